@@ -17,10 +17,14 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <unistd.h>
+#ifdef HAVE_LIBPTHREAD
+#include <pthread.h>
+#endif
 
 #include "sockaddr.h"
 #include "misc.h"
 #include "nfslib.h"
+#include "xmalloc.h"
 #include "exportfs.h"
 #include "export.h"
 #include "v4root.h"
@@ -36,11 +40,45 @@ enum auth_error
 };
 
 static void		auth_fixpath(char *path);
-static nfs_export my_exp;
-static nfs_client my_client;
+/* What auth_authenticate() returns, one per thread serving requests */
+static __thread nfs_export my_exp;
+static __thread nfs_client my_client;
 
 extern int use_ipaddr;
 
+#ifdef HAVE_LIBPTHREAD
+/*
+ * Protects the export and client tables when upcalls are handled by
+ * a pool of threads.  Readers are the upcall handlers; the only
+ * writer is auth_reload().  Prefer the writer so that a reload is
+ * not held off indefinitely by a steady stream of upcalls.
+ */
+#ifdef PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP
+static pthread_rwlock_t export_lock =
+	PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP;
+#else
+static pthread_rwlock_t export_lock = PTHREAD_RWLOCK_INITIALIZER;
+#endif
+
+void export_read_lock(void)
+{
+	pthread_rwlock_rdlock(&export_lock);
+}
+
+void export_read_unlock(void)
+{
+	pthread_rwlock_unlock(&export_lock);
+}
+
+#define export_write_lock()	pthread_rwlock_wrlock(&export_lock)
+#define export_write_unlock()	pthread_rwlock_unlock(&export_lock)
+#else
+void export_read_lock(void) { }
+void export_read_unlock(void) { }
+#define export_write_lock()	do { } while (0)
+#define export_write_unlock()	do { } while (0)
+#endif
+
 /*
 void
 auth_init(void)
@@ -81,50 +119,282 @@ check_useipaddr(void)
 		cache_flush();
 }
 
+static unsigned int	counter;
+
+/*
+ * Returns a value that changes each time the export table is rebuilt,
+ * without checking etab itself.
+ */
+unsigned int
+auth_generation(void)
+{
+	return counter;
+}
+
+/*
+ * etab as last read, kept open so that its inode number can't be
+ * reused by the file that replaces it.
+ */
+static ino_t		etab_inode;
+static int		etab_fd = -1;
+
+static void
+auth_etab_adopt(int fd, ino_t ino)
+{
+	if (etab_fd != -1)
+		close(etab_fd);
+	etab_fd = fd;
+	etab_inode = ino;
+}
+
+/* Rebuild what depends on the export table; the caller holds it locked */
+static void
+auth_rebuild(void)
+{
+	check_useipaddr();
+	v4root_set();
+	export_purge_stale(1);
+	client_freeunused();
+	client_subnet_index();
+	hostcache_netgroups_update();
+	cache_export_replies();
+	export_hash_stats();
+	++counter;
+}
+
 unsigned int
 auth_reload()
 {
 	struct stat		stb;
-	static ino_t		last_inode;
-	static int		last_fd = -1;
-	static unsigned int	counter;
-	int			fd;
+	struct exportent	*list;
+	unsigned long long	start;
+	int			fd, n;
 
 	if ((fd = open(etab.statefn, O_RDONLY)) < 0) {
 		xlog(L_FATAL, "couldn't open %s", etab.statefn);
 	} else if (fstat(fd, &stb) < 0) {
 		xlog(L_FATAL, "couldn't stat %s", etab.statefn);
 		close(fd);
-	} else if (last_fd != -1 && stb.st_ino == last_inode) {
+	} else if (etab_fd != -1 && stb.st_ino == etab_inode &&
+		   !xtab_export_journal_changed()) {
 		/* We opened the etab file before, and its inode
-		 * number hasn't changed since then.
+		 * number hasn't changed since then, and nothing
+		 * was appended to its journal either.
 		 */
 		close(fd);
+		hostcache_netgroups_refresh();
 		return counter;
 	} else {
 		/* Need to process entries from the etab file.  Close
-		 * the file descriptor from the previous open (last_fd),
-		 * and keep the current file descriptor open to prevent
-		 * the file system reusing the current inode number
-		 * (last_inode).
+		 * the file descriptor from the previous open, and keep
+		 * the current file descriptor open to prevent the file
+		 * system reusing the current inode number.
 		 */
-		if (last_fd != -1)
-			close(last_fd);
-		last_fd = fd;
-		last_inode = stb.st_ino;
+		auth_etab_adopt(fd, stb.st_ino);
 	}
 
-	export_freeall();
+	/* Read etab before taking the table from the other threads */
+	start = cache_stats_clock();
+	n = xtab_export_fetch(&list);
+	export_write_lock();
 	memset(&my_client, 0, sizeof(my_client));
-	xtab_export_read();
-	check_useipaddr();
-	v4root_set();
-
-	++counter;
+	if (n < 0)
+		xlog(L_ERROR, "couldn't read %s", etab.statefn);
+	else {
+		if (counter == 0)
+			export_freeall();
+		xtab_export_apply(list, n);
+	}
+	auth_rebuild();
+	export_write_unlock();
+	xtab_snapshot_free(list, n > 0 ? n : 0);
+	cache_stats_add(CSTAT_RELOAD, start);
+	hostcache_netgroups_refresh();
 
 	return counter;
 }
 
+/* Free what parseopts() allocated for an entry made by mkexportent() */
+static void
+auth_parsed_release(struct exportent *eep)
+{
+	xfree(eep->e_squids);
+	xfree(eep->e_sqgids);
+	xfree(eep->e_mountpoint);
+	xfree(eep->e_fslocdata);
+	xfree(eep->e_uuid);
+	eep->e_squids = eep->e_sqgids = NULL;
+	eep->e_nsquids = eep->e_nsqgids = 0;
+	eep->e_mountpoint = eep->e_fslocdata = eep->e_uuid = NULL;
+}
+
+/* Flush the kernel's cache entries for @path as exported to @client */
+static void
+auth_flush_export(char *client, char *path, int clients_changed)
+{
+	char	*clients[2] = { client, client };
+	char	*paths[2] = { path, NULL };
+	char	buf[PATH_MAX];
+	int	count = 1;
+
+	if (realpath(path, buf) && strcmp(buf, path)) {
+		paths[1] = buf;
+		count++;
+	}
+	cache_flush_paths(clients, paths, count, clients_changed);
+}
+
+/*
+ * Set @hname:@path to @eep, or remove it if @eep is NULL.  See
+ * auth_export_change().
+ */
+static int
+auth_export_apply(char *hname, char *path, struct exportent *eep)
+{
+	struct exportent	xe;
+	nfs_export		*exp, *target = NULL;
+	nfs_client		*clp;
+	char			*client = NULL;
+	int			i, remaining = 0, new_client = 0, err = 0;
+
+	auth_reload();
+
+	export_write_lock();
+	clp = client_lookup(hname, 0);
+	if (!clp) {
+		err = -EINVAL;
+		goto out_unlock;
+	}
+	new_client = clp->m_count == 0;
+	for (exp = export_find_path(clp->m_type, path, NULL); exp;
+	     exp = export_find_path(clp->m_type, path, exp))
+		if (exp->m_client == clp)
+			break;
+	if (!eep && (!exp || !exp->m_xtabent)) {
+		err = -ENOENT;
+		goto out_unlock;
+	}
+
+	memset(&my_client, 0, sizeof(my_client));
+	export_mark_stale();
+	if (eep) {
+		/* written to etab with the client's own name */
+		xe = *eep;
+		xe.e_hostname = clp->m_hostname;
+		if (exp)
+			export_update(exp, &xe);
+		else
+			exp = export_create_client(&xe, clp);
+		exp->m_xtabent = 1;
+		exp->m_mayexport = 1;
+	} else
+		exp->m_xtabent = 0;
+	target = exp;
+
+	/* keep the rest of etab, as xtab_export_update() would */
+	v4root_needed = 1;
+	for (i = 0; i < MCL_MAXTYPES; i++)
+		for (exp = exportlist[i].p_head; exp; exp = exp->m_next) {
+			if (!exp->m_xtabent)
+				continue;
+			if (exp->m_fsidforced) {
+				exp->m_export.e_flags &= ~NFSEXP_FSID;
+				exp->m_fsidforced = 0;
+			}
+			exp->m_stale = 0;
+			if ((exp->m_export.e_flags & NFSEXP_FSID) &&
+			    exp->m_export.e_fsid == 0)
+				v4root_needed = 0;
+			if (exp->m_client == clp)
+				remaining++;
+		}
+	client = xstrdup(clp->m_hostname);
+	xlog(D_GENERAL, "%s export %s:%s", eep ? "setting" : "removing",
+	     client, path);
+	export_purge_stale(0);
+	auth_rebuild();
+
+out_unlock:
+	export_write_unlock();
+	if (target) {
+		auth_flush_export(client, path, new_client || !remaining);
+		free(client);
+	}
+	return err;
+}
+
+/**
+ * auth_export_change - add, change or remove one export in place
+ * @hname: client, as it would be given to exportfs(8)
+ * @path: exported path
+ * @options: the export's options, or NULL to remove the export
+ *
+ * The in-core export table is changed as a reload of etab with only
+ * this export changed would change it, and only the kernel's cache
+ * entries for this export are flushed.  etab itself is not touched:
+ * until auth_export_write() is called, a change to it made by
+ * exportfs(8) undoes this one.
+ *
+ * Returns 0, -ENOENT if there is no such export to remove, -EINVAL
+ * if the client or the options can't be parsed.
+ */
+int
+auth_export_change(char *hname, char *path, char *options)
+{
+	struct exportent	*eep = NULL;
+	int			err;
+
+	if (options) {
+		eep = mkexportent(hname, path, options);
+		if (!eep)
+			return -EINVAL;
+	}
+	err = auth_export_apply(hname, path, eep);
+	if (eep)
+		auth_parsed_release(eep);
+	return err;
+}
+
+/**
+ * auth_export_set - add or change one export in place
+ * @eep: the export, as read from an exports file
+ *
+ * As auth_export_change(), for an entry that is already parsed.
+ */
+int
+auth_export_set(struct exportent *eep)
+{
+	return auth_export_apply(eep->e_hostname, eep->e_path, eep);
+}
+
+/**
+ * auth_export_write - write the in-core export table to etab
+ *
+ * For making the changes of auth_export_change() last.  The etab
+ * written is taken as already read, so it isn't loaded again.
+ *
+ * Returns 0, or -EAGAIN if etab was changed since it was last read,
+ * in which case nothing is written: call auth_reload(), redo the
+ * changes, and try again.  Returns -EIO if etab couldn't be written.
+ */
+int
+auth_export_write(void)
+{
+	struct stat	stb;
+	int		fd = -1, err;
+
+	export_read_lock();
+	err = xtab_export_write_if(etab_inode, &fd);
+	export_read_unlock();
+	if (err < 0)
+		return err;
+	if (fd >= 0 && fstat(fd, &stb) == 0)
+		auth_etab_adopt(fd, stb.st_ino);
+	else if (fd >= 0)
+		close(fd);
+	return 0;
+}
+
 static char *get_client_ipaddr_name(const struct sockaddr *caller)
 {
 	char buf[INET6_ADDRSTRLEN + 1];
@@ -190,9 +460,8 @@ auth_authenticate_newcache(const struct sockaddr *caller,
 
 	exp = NULL;
 	for (i = 0; !exp && i < MCL_MAXTYPES; i++)
-		for (exp = exportlist[i].p_head; exp; exp = exp->m_next) {
-			if (strcmp(path, exp->m_export.e_path))
-				continue;
+		for (exp = export_find_path(i, path, NULL); exp;
+		     exp = export_find_path(i, path, exp)) {
 			if (!client_matches(exp, my_client.m_hostname, ai))
 				continue;
 			if (exp->m_export.e_flags & NFSEXP_V4ROOT)
@@ -236,6 +505,7 @@ auth_authenticate(const char *what, const struct sockaddr *caller,
 	char		epath[MAXPATHLEN+1];
 	char		*p = NULL;
 	char		buf[INET6_ADDRSTRLEN];
+	struct host_addr ha;
 	struct addrinfo *ai = NULL;
 	enum auth_error	error = bad_path;
 
@@ -249,9 +519,11 @@ auth_authenticate(const char *what, const struct sockaddr *caller,
 	epath[sizeof (epath) - 1] = '\0';
 	auth_fixpath(epath); /* strip duplicate '/' etc */
 
-	ai = client_resolve(caller);
+	/* As client_resolve() would, but without allocating */
+	ai = host_addrinfo_buf(caller, &ha);
 	if (ai == NULL)
 		return exp;
+	nfs_set_port(ai->ai_addr, 0);
 
 	/* Try the longest matching exported pathname. */
 	while (1) {
@@ -301,7 +573,6 @@ auth_authenticate(const char *what, const struct sockaddr *caller,
 		     what, buf, nfs_get_port(caller), path, epath, error);
 	}
 
-	nfs_freeaddrinfo(ai);
 	return exp;
 }
 
@@ -3,7 +3,7 @@
  * Handle communication with knfsd internal cache
  *
  * We open /proc/net/rpc/{auth.unix.ip,nfsd.export,nfsd.fh}/channel
- * and listen for requests (using my_svc_run)
+ * and listen for requests (using an epoll event loop, see xepoll.c)
  * 
  */
 
@@ -13,7 +13,6 @@
 
 #include <sys/sysmacros.h>
 #include <sys/types.h>
-#include <sys/select.h>
 #include <sys/stat.h>
 #include <sys/vfs.h>
 #include <time.h>
@@ -23,9 +22,9 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <ctype.h>
-#include <pwd.h>
-#include <grp.h>
-#include <mntent.h>
+#ifdef HAVE_LIBPTHREAD
+#include <pthread.h>
+#endif
 #include "misc.h"
 #include "nfsd_path.h"
 #include "nfslib.h"
@@ -33,6 +32,9 @@
 #include "export.h"
 #include "pseudoflavors.h"
 #include "xcommon.h"
+#include "xepoll.h"
+#include "workqueue.h"
+#include "nfstrace.h"
 
 #ifdef HAVE_JUNCTION_SUPPORT
 #include "fsloc.h"
@@ -59,6 +61,13 @@ static int is_mountpoint(const char *path)
 	return check_is_mountpoint(path, nfsd_path_lstat);
 }
 
+/*
+ * The kernel resolves the pathnames in nfsd.export and nfsd.fh
+ * downcalls, and prints those in nfsd.export upcalls, relative to the
+ * root of the thread doing the I/O, so with a rootdir that I/O has to
+ * be done by a chrooted worker.  Everything else on the channels
+ * carries no pathnames and uses read() and write() directly.
+ */
 static ssize_t cache_read(int fd, char *buf, size_t len)
 {
 	return nfsd_path_read(fd, buf, len);
@@ -66,7 +75,155 @@ static ssize_t cache_read(int fd, char *buf, size_t len)
 
 static ssize_t cache_write(int fd, const char *buf, size_t len)
 {
-	return nfsd_path_write(fd, buf, len);
+	ssize_t ret = nfsd_path_write(fd, buf, len);
+
+	nfstrace_downcall();
+	return ret;
+}
+
+static ssize_t cache_read_plain(int fd, char *buf, size_t len)
+{
+	return read(fd, buf, len);
+}
+
+/*
+ * When upcalls are handed to a pool of worker threads, the event
+ * loop reloads the export table before queueing work, and the
+ * handlers run with the table read-locked instead of reloading it
+ * themselves.
+ */
+static struct xthread_workqueue *cache_wq;
+
+#ifdef HAVE_LIBPTHREAD
+#ifdef USE_BLKID
+static pthread_mutex_t blkid_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+#ifdef HAVE_JUNCTION_SUPPORT
+static pthread_mutex_t junction_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+#define cache_lock(l)		pthread_mutex_lock(l)
+#define cache_unlock(l)		pthread_mutex_unlock(l)
+#else
+#define cache_lock(l)		do { } while (0)
+#define cache_unlock(l)		do { } while (0)
+#endif
+
+static void cache_reload(void)
+{
+	if (!cache_wq)
+		auth_reload();
+}
+
+/*
+ * Refresh-ahead: the auth.unix.ip and nfsd.export entries written in
+ * answer to upcalls are remembered, and written again shortly before
+ * they expire, so that busy clients don't wait for an upcall every
+ * TTL.  The kernel doesn't say whether an entry is still used, and
+ * one that is kept fresh is never asked for again, so an entry is
+ * refreshed at most cache_refresh_ahead times after its last upcall.
+ * TTLs are then cut by up to a tenth at random, so that entries
+ * written together don't expire together either.
+ */
+int cache_refresh_ahead;
+
+#define REFRESH_HASH_SIZE	4096
+#define REFRESH_MAX		65536
+/* Seconds between looks for entries about to expire */
+#define REFRESH_TICK		5
+
+enum refresh_type {
+	REFRESH_AUTH_UNIX_IP,
+	REFRESH_NFSD_EXPORT,
+};
+
+struct refresh_ent {
+	struct refresh_ent *	re_next;
+	time_t			re_due;		/* when to write it again */
+	unsigned int		re_ttl;
+	unsigned int		re_left;	/* refreshes before it lapses */
+	enum refresh_type	re_type;
+	size_t			re_len;
+	char			re_key[];	/* address, or domain\0path */
+};
+
+static struct refresh_ent *refresh_table[REFRESH_HASH_SIZE];
+static unsigned int refresh_count;
+#ifdef HAVE_LIBPTHREAD
+static pthread_mutex_t refresh_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/* Started by cache_register_events(), see below */
+static void cache_refresh_register(void);
+
+/* The TTL to give an entry instead of @ttl */
+static unsigned int cache_ttl(unsigned int ttl)
+{
+	if (cache_refresh_ahead <= 0 || ttl < 10)
+		return ttl;
+	return ttl - random() % (ttl / 10 + 1);
+}
+
+/*
+ * When to refresh an entry written now with cache_ttl(@ttl), or 0 if
+ * it expires too soon to bother.
+ */
+static time_t refresh_due(time_t now, unsigned int ttl)
+{
+	unsigned int early = ttl / 10 + ttl / 20 + 2 * REFRESH_TICK;
+
+	return early < ttl ? now + ttl - early : 0;
+}
+
+/* Remember an entry written in answer to an upcall */
+static void cache_refresh_note(enum refresh_type type, const char *key,
+			       const char *path, unsigned int ttl)
+{
+	size_t klen, len;
+	struct refresh_ent *re;
+	unsigned int h = type;
+	const char *p;
+	time_t now, due;
+
+	if (cache_refresh_ahead <= 0)
+		return;
+	now = time(0);
+	due = refresh_due(now, ttl);
+	if (!due)
+		return;
+
+	klen = strlen(key) + 1;
+	len = klen + (path ? strlen(path) + 1 : 0);
+	for (p = key; *p; p++)
+		h = h * 31 + (unsigned char)*p;
+	for (p = path; p && *p; p++)
+		h = h * 31 + (unsigned char)*p;
+	h %= REFRESH_HASH_SIZE;
+
+	cache_lock(&refresh_lock);
+	for (re = refresh_table[h]; re; re = re->re_next)
+		if (re->re_type == type && re->re_len == len &&
+		    memcmp(re->re_key, key, klen) == 0 &&
+		    (!path || strcmp(re->re_key + klen, path) == 0))
+			break;
+	if (!re && refresh_count < REFRESH_MAX) {
+		re = malloc(sizeof(*re) + len);
+		if (re) {
+			re->re_type = type;
+			re->re_len = len;
+			memcpy(re->re_key, key, klen);
+			if (path)
+				strcpy(re->re_key + klen, path);
+			re->re_next = refresh_table[h];
+			refresh_table[h] = re;
+			refresh_count++;
+		}
+	}
+	if (re) {
+		re->re_due = due;
+		re->re_ttl = ttl;
+		re->re_left = cache_refresh_ahead;
+	}
+	cache_unlock(&refresh_lock);
 }
 
 static bool path_lookup_error(int err)
@@ -90,11 +247,141 @@ static bool path_lookup_error(int err)
  *
  */
 
-#define INITIAL_MANAGED_GROUPS 100
-
 extern int use_ipaddr;
 
-static void auth_unix_ip(int f)
+/*
+ * Find the client name for @sap.  Returns an allocated string, which
+ * is empty for the default client, or NULL if no client matched.
+ */
+static char *auth_unix_ip_client(const struct sockaddr *sap)
+{
+	struct host_addr ha;
+	struct addrinfo *ai;
+
+	ai = host_addrinfo_buf(sap, &ha);
+	if (ai == NULL)
+		return NULL;
+	return client_compose(ai);
+}
+
+/*
+ * Write the auth.unix.ip entry mapping @ipaddr to @client, or a
+ * negative entry if @client is NULL.  Returns zero on success.
+ */
+static int auth_unix_ip_dump(int f, char *ipaddr, char *client)
+{
+	char buf[RPC_CHAN_BUF_SIZE], *bp;
+	char dom[INET6_ADDRSTRLEN + 2];
+	int blen;
+
+	bp = buf; blen = sizeof(buf);
+	qword_add(&bp, &blen, "nfsd");
+	qword_add(&bp, &blen, ipaddr);
+	qword_adduint(&bp, &blen, time(0) + cache_ttl(default_ttl));
+	if (use_ipaddr && client) {
+		snprintf(dom, sizeof(dom), "$%s", ipaddr);
+		qword_add(&bp, &blen, dom);
+	} else if (client)
+		qword_add(&bp, &blen, *client?client:"DEFAULT");
+	qword_addeol(&bp, &blen);
+	if (blen <= 0 || write(f, buf, bp - buf) != bp - buf)
+		return -1;
+	nfstrace_downcall();
+	return 0;
+}
+
+/* Match @sap against the client list and answer the upcall for it */
+static void auth_unix_ip_answer(int f, char *ipaddr, const struct sockaddr *sap)
+{
+	char *client;
+
+	/* addr is a valid address, find the domain name... */
+	client = auth_unix_ip_client(sap);
+	if (!client) {
+		xlog(D_AUTH, "failed authentication for IP %s", ipaddr);
+		cache_stats_miss(CSTAT_AUTH_UNIX_IP);
+	}
+	else if	(!use_ipaddr)
+		xlog(D_AUTH, "successful authentication for IP %s as %s",
+		     ipaddr, *client ? client : "DEFAULT");
+	else
+		xlog(D_AUTH, "successful authentication for IP %s",
+			     ipaddr);
+
+	if (auth_unix_ip_dump(f, ipaddr, client) < 0)
+		xlog(L_ERROR, "auth_unix_ip: error writing reply");
+	else if (client)
+		cache_refresh_note(REFRESH_AUTH_UNIX_IP, ipaddr, NULL,
+				   default_ttl);
+
+	xlog(D_CALL, "auth_unix_ip: client %p '%s'", client, client?client: "DEFAULT");
+
+	free(client);
+}
+
+/*
+ * When upcalls are handled inline, an address whose names aren't
+ * cached is handed to a small pool of resolver threads, so that the
+ * event loop can serve other upcalls while the name service answers.
+ * The kernel keeps the request pending until the reply is written.
+ */
+#define CACHE_RESOLVER_THREADS	4
+
+struct auth_unix_ip_req {
+	int			ar_fd;
+	char			ar_ipaddr[INET6_ADDRSTRLEN + 1];
+};
+
+/* Set by cache_handle_upcall(), which must answer every upcall itself */
+static int cache_replaying;
+
+#ifdef HAVE_LIBPTHREAD
+static struct xthread_workqueue *resolver_wq;
+
+static void auth_unix_ip_run(void *data)
+{
+	struct auth_unix_ip_req *req = data;
+	struct host_addr ha;
+	struct addrinfo *tmp;
+
+	tmp = host_pton_buf(req->ar_ipaddr, &ha);
+	if (tmp != NULL) {
+		export_read_lock();
+		auth_unix_ip_answer(req->ar_fd, req->ar_ipaddr, tmp->ai_addr);
+		export_read_unlock();
+	}
+	free(req);
+}
+
+static int auth_unix_ip_park(int f, char *ipaddr)
+{
+	struct auth_unix_ip_req *req;
+
+	if (!resolver_wq) {
+		resolver_wq = xthread_workqueue_alloc_pool(CACHE_RESOLVER_THREADS);
+		if (!resolver_wq)
+			return -1;
+	}
+	req = malloc(sizeof(*req));
+	if (req == NULL)
+		return -1;
+	req->ar_fd = f;
+	strcpy(req->ar_ipaddr, ipaddr);
+	if (xthread_work_queue(resolver_wq, auth_unix_ip_run, req) < 0) {
+		free(req);
+		return -1;
+	}
+	xlog(D_CALL, "auth_unix_ip: waiting for name service for %s", ipaddr);
+	return 0;
+}
+#else
+static int auth_unix_ip_park(int UNUSED(f), char *UNUSED(ipaddr))
+{
+	return -1;
+}
+#endif
+
+static void auth_unix_ip(int f, char *inbuf, int UNUSED(inlen))
 {
 	/* requests are
 	 *  class IP-ADDR
@@ -105,19 +392,13 @@ static void auth_unix_ip(int f)
 	 */
 	char class[20];
 	char ipaddr[INET6_ADDRSTRLEN + 1];
-	char *client = NULL;
-	struct addrinfo *ai = NULL;
-	struct addrinfo *tmp = NULL;
-	char buf[RPC_CHAN_BUF_SIZE], *bp;
-	int blen;
-
-	blen = read(f, buf, sizeof(buf));
-	if (blen <= 0 || buf[blen-1] != '\n') return;
-	buf[blen-1] = 0;
+	struct host_addr ha;
+	struct addrinfo *tmp;
+	char *bp;
 
-	xlog(D_CALL, "auth_unix_ip: inbuf '%s'", buf);
+	xlog(D_CALL, "auth_unix_ip: inbuf '%s'", inbuf);
 
-	bp = buf;
+	bp = inbuf;
 
 	if (qword_get(&bp, class, 20) <= 0 ||
 	    strcmp(class, "nfsd") != 0)
@@ -126,49 +407,19 @@ static void auth_unix_ip(int f)
 	if (qword_get(&bp, ipaddr, sizeof(ipaddr) - 1) <= 0)
 		return;
 
-	tmp = host_pton(ipaddr);
+	tmp = host_pton_buf(ipaddr, &ha);
 	if (tmp == NULL)
 		return;
 
-	auth_reload();
-
-	/* addr is a valid address, find the domain name... */
-	ai = client_resolve(tmp->ai_addr);
-	if (ai) {
-		client = client_compose(ai);
-		nfs_freeaddrinfo(ai);
-	}
-	if (!client)
-		xlog(D_AUTH, "failed authentication for IP %s", ipaddr);
-	else if	(!use_ipaddr)
-		xlog(D_AUTH, "successful authentication for IP %s as %s",
-		     ipaddr, *client ? client : "DEFAULT");
-	else
-		xlog(D_AUTH, "successful authentication for IP %s",
-			     ipaddr);
-
-	bp = buf; blen = sizeof(buf);
-	qword_add(&bp, &blen, "nfsd");
-	qword_add(&bp, &blen, ipaddr);
-	qword_adduint(&bp, &blen, time(0) + default_ttl);
-	if (use_ipaddr && client) {
-		memmove(ipaddr + 1, ipaddr, strlen(ipaddr) + 1);
-		ipaddr[0] = '$';
-		qword_add(&bp, &blen, ipaddr);
-	} else if (client)
-		qword_add(&bp, &blen, *client?client:"DEFAULT");
-	qword_addeol(&bp, &blen);
-	if (blen <= 0 || write(f, buf, bp - buf) != bp - buf)
-		xlog(L_ERROR, "auth_unix_ip: error writing reply");
-
-	xlog(D_CALL, "auth_unix_ip: client %p '%s'", client, client?client: "DEFAULT");
-
-	free(client);
-	nfs_freeaddrinfo(tmp);
+	cache_reload();
 
+	if (cache_wq || cache_replaying ||
+	    !client_needs_lookup(tmp->ai_addr) ||
+	    auth_unix_ip_park(f, ipaddr) < 0)
+		auth_unix_ip_answer(f, ipaddr, tmp->ai_addr);
 }
 
-static void auth_unix_gid(int f)
+static void auth_unix_gid(int f, char *inbuf, int UNUSED(inlen))
 {
 	/* Request are
 	 *  uid
@@ -176,55 +427,30 @@ static void auth_unix_gid(int f)
 	 *  uid expiry count list of group ids
 	 */
 	uid_t uid;
-	struct passwd *pw;
-	static gid_t *groups = NULL;
-	static int groups_len = 0;
-	gid_t *more_groups;
+	gid_t *groups;
 	int ngroups;
-	int rv, i;
+	int i;
 	char buf[RPC_CHAN_BUF_SIZE], *bp;
 	int blen;
 
-	if (groups_len == 0) {
-		groups = malloc(sizeof(gid_t) * INITIAL_MANAGED_GROUPS);
-		if (!groups)
-			return;
-
-		groups_len = INITIAL_MANAGED_GROUPS;
-	}
-
-	ngroups = groups_len;
-
-	blen = read(f, buf, sizeof(buf));
-	if (blen <= 0 || buf[blen-1] != '\n') return;
-	buf[blen-1] = 0;
-
-	bp = buf;
+	bp = inbuf;
 	if (qword_get_uint(&bp, &uid) != 0)
 		return;
 
-	pw = getpwuid(uid);
-	if (!pw)
-		rv = -1;
-	else {
-		rv = getgrouplist(pw->pw_name, pw->pw_gid, groups, &ngroups);
-		if (rv == -1 && ngroups >= groups_len) {
-			more_groups = realloc(groups, sizeof(gid_t)*ngroups);
-			if (!more_groups)
-				rv = -1;
-			else {
-				groups = more_groups;
-				groups_len = ngroups;
-				rv = getgrouplist(pw->pw_name, pw->pw_gid,
-						  groups, &ngroups);
-			}
-		}
+	ngroups = gidcache_get(uid, &groups);
+	if (ngroups == -ENOMEM) {
+		/* no reply, so that the kernel asks again */
+		xlog(L_ERROR, "auth_unix_gid: out of memory looking up uid %u",
+		     uid);
+		return;
 	}
+	if (ngroups < 0)
+		cache_stats_miss(CSTAT_AUTH_UNIX_GID);
 
 	bp = buf; blen = sizeof(buf);
 	qword_adduint(&bp, &blen, uid);
 	qword_adduint(&bp, &blen, time(0) + default_ttl);
-	if (rv >= 0) {
+	if (ngroups >= 0) {
 		qword_adduint(&bp, &blen, ngroups);
 		for (i=0; i<ngroups; i++)
 			qword_adduint(&bp, &blen, groups[i]);
@@ -233,10 +459,12 @@ static void auth_unix_gid(int f)
 	qword_addeol(&bp, &blen);
 	if (blen <= 0 || write(f, buf, bp - buf) != bp - buf)
 		xlog(L_ERROR, "auth_unix_gid: error writing reply");
+	nfstrace_downcall();
+	free(groups);
 }
 
 #ifdef USE_BLKID
-static const char *get_uuid_blkdev(char *path)
+static const char *get_uuid_blkdev_locked(char *path)
 {
 	/* We set *safe if we know that we need the
 	 * fsid from statfs too.
@@ -276,8 +504,29 @@ static const char *get_uuid_blkdev(char *path)
 	blkid_tag_iterate_end(iter);
 	return uuid;
 }
+
+/*
+ * libblkid is not thread safe, and the returned value points into
+ * its cache, so copy it out before dropping the lock.
+ */
+static const char *get_uuid_blkdev(char *path, char *uuid, size_t len)
+{
+	unsigned long long start = cache_stats_clock();
+	const char *val;
+
+	cache_lock(&blkid_lock);
+	val = get_uuid_blkdev_locked(path);
+	if (val) {
+		strncpy(uuid, val, len - 1);
+		uuid[len - 1] = '\0';
+		val = uuid;
+	}
+	cache_unlock(&blkid_lock);
+	cache_stats_add(CSTAT_BLKID, start);
+	return val;
+}
 #else
-#define get_uuid_blkdev(path) (NULL)
+#define get_uuid_blkdev(path, uuid, len) ((void)(uuid), (const char *)NULL)
 #endif
 
 static int get_uuid(const char *val, size_t uuidlen, char *u)
@@ -331,19 +580,8 @@ static const unsigned long nonblkid_filesystems[] = {
     0        /* last */
 };
 
-static int uuid_by_path(char *path, int type, size_t uuidlen, char *uuid)
+static int uuid_val_by_path(char *path, char *val, size_t len)
 {
-	/* get a uuid for the filesystem found at 'path'.
-	 * There are several possible ways of generating the
-	 * uuids (types).
-	 * Type 0 is used for new filehandles, while other types
-	 * may be used to interpret old filehandle - to ensure smooth
-	 * forward migration.
-	 * We return 1 if a uuid was found (and it might be worth 
-	 * trying the next type) or 0 if no more uuid types can be
-	 * extracted.
-	 */
-
 	/* Possible sources of uuid are
 	 * - blkid uuid
 	 * - statfs64 uuid
@@ -359,106 +597,497 @@ static int uuid_by_path(char *path, int type, size_t uuidlen, char *uuid)
 	 * We rely on get_uuid_blkdev *knowing* which is which and not returning
 	 * a uuid for filesystems where the statfs64 uuid is better.
 	 *
+	 * Only the preferred value is returned: it is the type 0 uuid,
+	 * and older filehandle types have never been derived from the
+	 * other source.
 	 */
 	struct statfs64 st;
-	char fsid_val[17];
-	const char *blkid_val = NULL;
-	const char *val;
-	int rc;
+	const unsigned long *bad;
 
-	rc = nfsd_path_statfs64(path, &st);
+	if (nfsd_path_statfs64(path, &st) != 0)
+		return 0;
 
-	if (type == 0 && rc == 0) {
-		const unsigned long *bad;
-		for (bad = nonblkid_filesystems; *bad; bad++) {
-			if (*bad == (unsigned long)st.f_type)
-				break;
-		}
-		if (*bad == 0)
-			blkid_val = get_uuid_blkdev(path);
+	for (bad = nonblkid_filesystems; *bad; bad++) {
+		if (*bad == (unsigned long)st.f_type)
+			break;
 	}
+	if (*bad == 0 && get_uuid_blkdev(path, val, len))
+		return 1;
 
-	if (rc == 0 &&
-	    (st.f_fsid.__val[0] || st.f_fsid.__val[1]))
-		snprintf(fsid_val, 17, "%08x%08x",
+	if (st.f_fsid.__val[0] || st.f_fsid.__val[1]) {
+		snprintf(val, len, "%08x%08x",
 			 st.f_fsid.__val[0], st.f_fsid.__val[1]);
-	else
-		fsid_val[0] = 0;
-
-	if (blkid_val && (type--) == 0)
-		val = blkid_val;
-	else if (fsid_val[0] && (type--) == 0)
-		val = fsid_val;
-	else
-		return 0;
-
-	get_uuid(val, uuidlen, uuid);
-	return 1;
+		return 1;
+	}
+	return 0;
 }
 
-/* Iterate through /etc/mtab, finding mountpoints
- * at or below a given path
+/*
+ * Working out a uuid costs a statfs64() and, for block devices, a trip
+ * through libblkid, and an nfsd.fh upcall may need one for every
+ * export.  So remember the value found for each path, along with the
+ * device and mount ID it came from.  A cached value is revalidated
+ * with a stat(), and when the mount table has changed since it was
+ * last checked, by looking up the mount ID for its device again: only
+ * paths whose filesystem was actually replaced are recomputed.
  */
-static char *next_mnt(void **v, char *p)
+#define UUID_VAL_MAX		64
+#define UUID_CACHE_INIT		256
+
+struct uuid_cache_ent {
+	struct uuid_cache_ent *	uc_next;
+	unsigned int		uc_hash;
+	dev_t			uc_dev;
+	int			uc_mnt_id;
+	unsigned long		uc_mnt_gen;
+	/* to check a value saved by another process */
+	int			uc_saved;
+	ino_t			uc_ino;
+	unsigned long		uc_type;
+	unsigned int		uc_fsid[2];
+	char			uc_val[UUID_VAL_MAX];	/* "" if none */
+	char			uc_path[];
+};
+
+static struct uuid_cache_ent **	uuid_cache;
+static unsigned int		uuid_cache_mask;
+static unsigned int		uuid_cache_count;
+#ifdef HAVE_LIBPTHREAD
+static pthread_mutex_t		uuid_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static unsigned int uuid_path_hash(const char *path)
 {
-	FILE *f;
-	struct mntent *me;
-	size_t l = strlen(p);
+	unsigned int h = 2166136261u;
 
-	if (*v == NULL) {
-		f = setmntent("/etc/mtab", "r");
-		*v = f;
-	} else
-		f = *v;
-	while ((me = getmntent(f)) != NULL && l > 1) {
-		char *mnt_dir = nfsd_path_strip_root(me->mnt_dir);
+	while (*path)
+		h = (h ^ (unsigned char)*path++) * 16777619u;
+	return h;
+}
 
-		if (!mnt_dir)
-			continue;
+static int uuid_mnt_id(const struct mnttab *mt, dev_t dev)
+{
+	const struct mnttab_entry *me;
 
-		if (strncmp(mnt_dir, p, l) == 0 && mnt_dir[l] == '/')
-			return mnt_dir;
-	}
-	endmntent(f);
-	*v = NULL;
-	return NULL;
+	if (mt == NULL)
+		return -1;
+	me = mnttab_lookup_dev(mt, dev);
+	return me ? me->me_id : -1;
 }
 
-/* same_path() check is two paths refer to the same directory.
- * We don't rely on 'strcmp()' as some filesystems support case-insensitive
- * names and we might have two different names for the one directory.
- * Theoretically the lengths of the names could be different, but the
- * number of components must be the same.
- * So if the paths have the same number of components (but aren't identical)
- * we ask the kernel if they are the same thing.
- * By preference we use name_to_handle_at(), as the mntid it returns
- * will distinguish between bind-mount points.  If that isn't available
- * we fall back on lstat, which is usually good enough.
- */
-static inline int count_slashes(char *p)
+static void uuid_cache_grow(void)
 {
-	int cnt = 0;
-	while (*p)
-		if (*p++ == '/')
-			cnt++;
-	return cnt;
+	struct uuid_cache_ent **new, *ent, *next;
+	unsigned int size, i;
+
+	size = uuid_cache ? (uuid_cache_mask + 1) * 2 : UUID_CACHE_INIT;
+	new = calloc(size, sizeof(*new));
+	if (new == NULL)
+		return;
+	for (i = 0; uuid_cache && i <= uuid_cache_mask; i++)
+		for (ent = uuid_cache[i]; ent; ent = next) {
+			next = ent->uc_next;
+			ent->uc_next = new[ent->uc_hash & (size - 1)];
+			new[ent->uc_hash & (size - 1)] = ent;
+		}
+	free(uuid_cache);
+	uuid_cache = new;
+	uuid_cache_mask = size - 1;
 }
 
-#if defined(HAVE_STRUCT_FILE_HANDLE)
-static int check_same_path_by_handle(const char *child, const char *parent)
+static struct uuid_cache_ent *uuid_cache_find(const char *path,
+					      unsigned int hash)
 {
-	struct {
-		struct file_handle fh;
-		unsigned char handle[128];
-	} fchild, fparent;
-	int mnt_child, mnt_parent;
+	struct uuid_cache_ent *ent;
 
-	fchild.fh.handle_bytes = 128;
-	fparent.fh.handle_bytes = 128;
+	if (uuid_cache == NULL)
+		return NULL;
+	for (ent = uuid_cache[hash & uuid_cache_mask]; ent; ent = ent->uc_next)
+		if (ent->uc_hash == hash && strcmp(ent->uc_path, path) == 0)
+			return ent;
+	return NULL;
+}
 
-	/* This process should have the CAP_DAC_READ_SEARCH capability */
-	if (nfsd_name_to_handle_at(AT_FDCWD, child, &fchild.fh, &mnt_child, 0) < 0)
-		return -1;
+/* Find or add the entry for @path.  Called with uuid_cache_lock held. */
+static struct uuid_cache_ent *uuid_cache_add(const char *path,
+					     unsigned int hash)
+{
+	struct uuid_cache_ent *ent;
+
+	ent = uuid_cache_find(path, hash);
+	if (ent)
+		return ent;
+	if (uuid_cache == NULL || uuid_cache_count > 2 * uuid_cache_mask)
+		uuid_cache_grow();
+	ent = uuid_cache ? calloc(1, sizeof(*ent) + strlen(path) + 1) : NULL;
+	if (ent) {
+		strcpy(ent->uc_path, path);
+		ent->uc_hash = hash;
+		ent->uc_next = uuid_cache[hash & uuid_cache_mask];
+		uuid_cache[hash & uuid_cache_mask] = ent;
+		uuid_cache_count++;
+	}
+	return ent;
+}
+
+/*
+ * The values found are also saved in "uuid.cache" in the state
+ * directory, so that a daemon that restarts, or a new worker process,
+ * doesn't have to probe every exported filesystem again.  The file is
+ * only trusted in the boot that wrote it, and a saved value only for a
+ * path with the same device and inode number, on a filesystem whose
+ * type and statfs fsid are unchanged, which a statfs64() checks
+ * without going near libblkid.  Each process loads the file once and
+ * appends the values it finds; the file is rewritten when it is loaded
+ * holding more stale lines than live ones.
+ */
+int cache_uuid_persist = 1;
+
+#define UUID_SAVED_FILE		"uuid.cache"
+#define UUID_BOOT_ID		"/proc/sys/kernel/random/boot_id"
+
+static int	uuid_saved_loaded;
+static int	uuid_saved_fd = -1;
+
+static int uuid_boot_id(char *buf, size_t len)
+{
+	ssize_t n;
+	int fd;
+
+	fd = open(UUID_BOOT_ID, O_RDONLY);
+	if (fd < 0)
+		return 0;
+	n = read(fd, buf, len - 1);
+	close(fd);
+	if (n <= 0)
+		return 0;
+	buf[n] = '\0';
+	buf[strcspn(buf, "\n")] = '\0';
+	return buf[0] != '\0';
+}
+
+/* Format @ent as a line of the file.  Returns its length, or -1. */
+static int uuid_saved_format(char *buf, int len,
+			     const struct uuid_cache_ent *ent)
+{
+	char *bp = buf;
+	int n;
+
+	n = snprintf(bp, len, "%llx %llx %lx %x %x %s ",
+		     (unsigned long long)ent->uc_dev,
+		     (unsigned long long)ent->uc_ino, ent->uc_type,
+		     ent->uc_fsid[0], ent->uc_fsid[1],
+		     ent->uc_val[0] ? ent->uc_val : "-");
+	if (n >= len)
+		return -1;
+	bp += n;
+	len -= n;
+	qword_add(&bp, &len, (char *)ent->uc_path);
+	qword_addeol(&bp, &len);
+	return len > 0 ? bp - buf : -1;
+}
+
+/* Parse a line of the file into the cache.  Returns 0 if it is bad. */
+static int uuid_saved_parse(char *line)
+{
+	struct uuid_cache_ent *ent;
+	unsigned long long dev, ino;
+	unsigned long type;
+	unsigned int fsid0, fsid1;
+	char val[UUID_VAL_MAX], *bp, *path;
+	int n = 0;
+
+	if (sscanf(line, "%llx %llx %lx %x %x %63s %n", &dev, &ino, &type,
+		   &fsid0, &fsid1, val, &n) != 6 || n == 0)
+		return 0;
+	bp = line + n;
+	if (qword_get_inplace(&bp, &path) <= 0 || path[0] != '/')
+		return 0;
+	ent = uuid_cache_add(path, uuid_path_hash(path));
+	if (ent == NULL)
+		return 0;
+	ent->uc_saved = 1;
+	ent->uc_dev = dev;
+	ent->uc_ino = ino;
+	ent->uc_type = type;
+	ent->uc_fsid[0] = fsid0;
+	ent->uc_fsid[1] = fsid1;
+	ent->uc_mnt_gen = 0;
+	strcpy(ent->uc_val, strcmp(val, "-") ? val : "");
+	return 1;
+}
+
+/* Write the file afresh from the cache */
+static void uuid_saved_rewrite(const char *fname, const char *boot)
+{
+	struct uuid_cache_ent *ent;
+	char buf[UUID_VAL_MAX + 2 * PATH_MAX + 128], *tmp;
+	unsigned int i;
+	FILE *fp;
+	int n;
+
+	if (asprintf(&tmp, "%s.tmp", fname) < 0)
+		return;
+	fp = fopen(tmp, "w");
+	if (fp == NULL) {
+		xlog(L_WARNING, "can't create %s: %m", tmp);
+		free(tmp);
+		return;
+	}
+	fprintf(fp, "boot %s\n", boot);
+	for (i = 0; uuid_cache && i <= uuid_cache_mask; i++)
+		for (ent = uuid_cache[i]; ent; ent = ent->uc_next) {
+			n = uuid_saved_format(buf, sizeof(buf), ent);
+			if (n > 0)
+				fwrite(buf, 1, n, fp);
+		}
+	if (fclose(fp) != 0 || rename(tmp, fname) < 0) {
+		xlog(L_WARNING, "can't write %s: %m", fname);
+		unlink(tmp);
+	}
+	free(tmp);
+}
+
+/*
+ * Load the values saved by earlier processes, once, and open the file
+ * for saving more.  Called with uuid_cache_lock held.
+ */
+static void uuid_saved_load(void)
+{
+	char boot[64], line[UUID_VAL_MAX + 4 * PATH_MAX + 128], *fname;
+	unsigned int lines = 0;
+	int current = 0;
+	FILE *fp;
+
+	if (uuid_saved_loaded)
+		return;
+	uuid_saved_loaded = 1;
+	if (!cache_uuid_persist || !uuid_boot_id(boot, sizeof(boot)))
+		return;
+	fname = state_make_pathname(UUID_SAVED_FILE);
+	if (fname == NULL)
+		return;
+
+	fp = fopen(fname, "r");
+	if (fp) {
+		if (fgets(line, sizeof(line), fp) &&
+		    strncmp(line, "boot ", 5) == 0) {
+			line[strcspn(line, "\n")] = '\0';
+			current = strcmp(line + 5, boot) == 0;
+		}
+		while (current && fgets(line, sizeof(line), fp))
+			if (strchr(line, '\n') && uuid_saved_parse(line))
+				lines++;
+		fclose(fp);
+	}
+	if (!current || lines > 2 * uuid_cache_count + 64)
+		uuid_saved_rewrite(fname, boot);
+	xlog(D_GENERAL, "%u saved uuids loaded from %s",
+	     uuid_cache_count, fname);
+
+	uuid_saved_fd = open(fname, O_WRONLY|O_APPEND|O_CLOEXEC);
+	free(fname);
+}
+
+/* Append @ent to the file.  Called with uuid_cache_lock held. */
+static void uuid_saved_append(const struct uuid_cache_ent *ent)
+{
+	char buf[UUID_VAL_MAX + 2 * PATH_MAX + 128];
+	int n;
+
+	if (uuid_saved_fd < 0)
+		return;
+	n = uuid_saved_format(buf, sizeof(buf), ent);
+	if (n > 0 && write(uuid_saved_fd, buf, n) != n)
+		xlog(L_WARNING, "can't save the uuid of %s: %m",
+		     ent->uc_path);
+}
+
+/* Whether a saved value still describes the filesystem at @path */
+static int uuid_saved_valid(const struct uuid_cache_ent *ent, char *path,
+			    const struct stat *stb)
+{
+	struct statfs64 st;
+
+	if (ent->uc_ino != stb->st_ino ||
+	    nfsd_path_statfs64(path, &st) != 0)
+		return 0;
+	return ent->uc_type == (unsigned long)st.f_type &&
+	       ent->uc_fsid[0] == (unsigned int)st.f_fsid.__val[0] &&
+	       ent->uc_fsid[1] == (unsigned int)st.f_fsid.__val[1];
+}
+
+/*
+ * Copy the uuid string for @path into @val.  Returns 1 if there is
+ * one, 0 if the filesystem doesn't provide a uuid or can't be reached.
+ */
+static int uuid_cache_lookup(char *path, char *val)
+{
+	struct uuid_cache_ent *ent;
+	struct mnttab *mt;
+	struct stat stb;
+	struct statfs64 sfs;
+	unsigned int hash = uuid_path_hash(path);
+	unsigned long gen;
+	int mnt_id, found;
+
+	if (nfsd_path_stat(path, &stb) != 0)
+		return 0;
+
+	mt = mnttab_get();
+	gen = mnttab_generation();
+
+	cache_lock(&uuid_cache_lock);
+	uuid_saved_load();
+	ent = uuid_cache_find(path, hash);
+	if (ent && ent->uc_dev == stb.st_dev && ent->uc_saved) {
+		/* from the file: check it once, then treat it as our own */
+		if (uuid_saved_valid(ent, path, &stb)) {
+			ent->uc_saved = 0;
+			ent->uc_mnt_id = uuid_mnt_id(mt, stb.st_dev);
+			ent->uc_mnt_gen = gen;
+		}
+	}
+	if (ent && ent->uc_dev == stb.st_dev && !ent->uc_saved) {
+		if (ent->uc_mnt_gen != gen &&
+		    ent->uc_mnt_id == uuid_mnt_id(mt, stb.st_dev))
+			ent->uc_mnt_gen = gen;
+		if (ent->uc_mnt_gen == gen) {
+			strcpy(val, ent->uc_val);
+			cache_unlock(&uuid_cache_lock);
+			mnttab_put(mt);
+			return val[0] != '\0';
+		}
+	}
+	cache_unlock(&uuid_cache_lock);
+
+	/* Miss or stale: blkid may be slow, so don't hold the lock */
+	mnt_id = uuid_mnt_id(mt, stb.st_dev);
+	mnttab_put(mt);
+	found = uuid_val_by_path(path, val, UUID_VAL_MAX);
+	if (!found)
+		val[0] = '\0';
+	if (nfsd_path_statfs64(path, &sfs) != 0)
+		memset(&sfs, 0, sizeof(sfs));
+
+	cache_lock(&uuid_cache_lock);
+	ent = uuid_cache_add(path, hash);
+	if (ent) {
+		ent->uc_dev = stb.st_dev;
+		ent->uc_mnt_id = mnt_id;
+		ent->uc_mnt_gen = gen;
+		ent->uc_saved = 0;
+		ent->uc_ino = stb.st_ino;
+		ent->uc_type = sfs.f_type;
+		ent->uc_fsid[0] = sfs.f_fsid.__val[0];
+		ent->uc_fsid[1] = sfs.f_fsid.__val[1];
+		strcpy(ent->uc_val, val);
+		if (sfs.f_type)
+			uuid_saved_append(ent);
+	}
+	cache_unlock(&uuid_cache_lock);
+	return found;
+}
+
+static int uuid_by_path(char *path, int type, size_t uuidlen, char *uuid)
+{
+	/* get a uuid for the filesystem found at 'path'.
+	 * There are several possible ways of generating the
+	 * uuids (types).
+	 * Type 0 is used for new filehandles, while other types
+	 * may be used to interpret old filehandle - to ensure smooth
+	 * forward migration.
+	 * We return 1 if a uuid was found (and it might be worth 
+	 * trying the next type) or 0 if no more uuid types can be
+	 * extracted.
+	 */
+	char val[UUID_VAL_MAX];
+
+	if (type != 0 || !uuid_cache_lookup(path, val))
+		return 0;
+
+	get_uuid(val, uuidlen, uuid);
+	return 1;
+}
+
+/* Iterate through the mount table, finding mountpoints
+ * below a given path
+ */
+struct mnt_iter {
+	struct mnttab	*mi_tab;
+	size_t		mi_pos;
+};
+
+static void end_mnt(void **v)
+{
+	struct mnt_iter *it = *v;
+
+	if (it) {
+		mnttab_put(it->mi_tab);
+		free(it);
+	}
+	*v = NULL;
+}
+
+static char *next_mnt(void **v, char *p)
+{
+	struct mnt_iter *it = *v;
+	const struct mnttab_entry *me;
+
+	if (it == NULL) {
+		if (strlen(p) <= 1)
+			return NULL;
+		it = malloc(sizeof(*it));
+		if (it == NULL)
+			return NULL;
+		it->mi_tab = mnttab_get();
+		it->mi_pos = MNTTAB_START;
+		*v = it;
+	}
+	if (it->mi_tab) {
+		me = mnttab_next_below(it->mi_tab, p, &it->mi_pos);
+		if (me)
+			return me->me_dir;
+	}
+	end_mnt(v);
+	return NULL;
+}
+
+/* same_path() check is two paths refer to the same directory.
+ * We don't rely on 'strcmp()' as some filesystems support case-insensitive
+ * names and we might have two different names for the one directory.
+ * Theoretically the lengths of the names could be different, but the
+ * number of components must be the same.
+ * So if the paths have the same number of components (but aren't identical)
+ * we ask the kernel if they are the same thing.
+ * By preference we use name_to_handle_at(), as the mntid it returns
+ * will distinguish between bind-mount points.  If that isn't available
+ * we fall back on lstat, which is usually good enough.
+ */
+static inline int count_slashes(char *p)
+{
+	int cnt = 0;
+	while (*p)
+		if (*p++ == '/')
+			cnt++;
+	return cnt;
+}
+
+#if defined(HAVE_STRUCT_FILE_HANDLE)
+static int check_same_path_by_handle(const char *child, const char *parent)
+{
+	struct {
+		struct file_handle fh;
+		unsigned char handle[128];
+	} fchild, fparent;
+	int mnt_child, mnt_parent;
+
+	fchild.fh.handle_bytes = 128;
+	fparent.fh.handle_bytes = 128;
+
+	/* This process should have the CAP_DAC_READ_SEARCH capability */
+	if (nfsd_name_to_handle_at(AT_FDCWD, child, &fchild.fh, &mnt_child, 0) < 0)
+		return -1;
 	if (nfsd_name_to_handle_at(AT_FDCWD, parent, &fparent.fh, &mnt_parent, 0) < 0) {
 		/* If the child resolved, but the parent did not, they differ */
 		if (path_lookup_error(errno))
@@ -504,9 +1133,208 @@ static int check_same_path_by_inode(const char *child, const char *parent)
 	return 1;
 }
 
-static int same_path(char *child, char *parent, int len)
+/*
+ * What same_path() compares, looked up once: for the path of an
+ * upcall and its prefixes in a struct path_memo that lasts for the
+ * lookup, and for export paths in a cache kept until the exports or
+ * the mount table change, or PATH_ID_TTL seconds have passed.
+ */
+#define PATH_ID_UNKNOWN		0
+#define PATH_ID_OK		1
+#define PATH_ID_FAILED		2
+
+struct path_id {
+	int			pi_fh_err;	/* errno from name_to_handle_at */
+	int			pi_stat;	/* PATH_ID_* */
+	int			pi_mnt;
+	dev_t			pi_dev;
+	ino_t			pi_ino;
+#if defined(HAVE_STRUCT_FILE_HANDLE)
+	struct {
+		struct file_handle fh;
+		unsigned char handle[128];
+	} pi_fh;
+#endif
+};
+
+#define PATH_MEMO_MAX		8
+
+struct path_memo {
+	unsigned int		pm_exp_gen;
+	unsigned long		pm_mnt_gen;
+	int			pm_count;
+	size_t			pm_len[PATH_MEMO_MAX];
+	struct path_id		pm_id[PATH_MEMO_MAX];
+};
+
+#define PATH_ID_HASH		1024
+#define PATH_ID_TTL		60
+
+struct path_id_ent {
+	struct path_id_ent *	pe_next;
+	struct path_id		pe_id;
+	char			pe_path[];
+};
+
+static struct path_id_ent *	path_ids[PATH_ID_HASH];
+static unsigned int		path_ids_exp_gen;
+static unsigned long		path_ids_mnt_gen;
+static time_t			path_ids_time;
+#ifdef HAVE_LIBPTHREAD
+static pthread_mutex_t		path_ids_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static void path_id_stat(const char *path, struct path_id *id)
+{
+	struct stat stb;
+
+	if (nfsd_path_lstat(path, &stb) != 0) {
+		id->pi_stat = PATH_ID_FAILED;
+		return;
+	}
+	id->pi_dev = stb.st_dev;
+	id->pi_ino = stb.st_ino;
+	id->pi_stat = PATH_ID_OK;
+}
+
+/* A child's lstat() is left until path_id_same() needs it */
+static void path_id_fill(const char *path, struct path_id *id, int parent)
+{
+#if defined(HAVE_STRUCT_FILE_HANDLE)
+	id->pi_fh.fh.handle_bytes = 128;
+	/* This process should have the CAP_DAC_READ_SEARCH capability */
+	if (nfsd_name_to_handle_at(AT_FDCWD, path, &id->pi_fh.fh,
+				   &id->pi_mnt, 0) < 0)
+		id->pi_fh_err = errno ? errno : EINVAL;
+	else
+		id->pi_fh_err = 0;
+#else
+	id->pi_fh_err = ENOSYS;
+#endif
+	id->pi_stat = PATH_ID_UNKNOWN;
+	if (parent || id->pi_fh_err)
+		path_id_stat(path, id);
+}
+
+/* As check_same_path_by_handle() then check_same_path_by_inode() */
+static int path_id_same(const char *child, struct path_id *c,
+			const struct path_id *p)
+{
+	if (c->pi_fh_err == 0) {
+#if defined(HAVE_STRUCT_FILE_HANDLE)
+		if (p->pi_fh_err == 0)
+			return c->pi_mnt == p->pi_mnt &&
+			       c->pi_fh.fh.handle_bytes ==
+					p->pi_fh.fh.handle_bytes &&
+			       c->pi_fh.fh.handle_type ==
+					p->pi_fh.fh.handle_type &&
+			       memcmp(c->pi_fh.handle, p->pi_fh.handle,
+				      c->pi_fh.fh.handle_bytes) == 0;
+#endif
+		/* If the child resolved, but the parent did not, they differ */
+		if (path_lookup_error(p->pi_fh_err))
+			return 0;
+	}
+
+	if (c->pi_stat == PATH_ID_UNKNOWN)
+		path_id_stat(child, c);
+	return c->pi_stat == PATH_ID_OK && p->pi_stat == PATH_ID_OK &&
+	       c->pi_dev == p->pi_dev && c->pi_ino == p->pi_ino;
+}
+
+static void path_memo_init(struct path_memo *pm)
+{
+	/* Notice any mount table change before checking generations */
+	mnttab_put(mnttab_get());
+	pm->pm_exp_gen = auth_generation();
+	pm->pm_mnt_gen = mnttab_generation();
+	pm->pm_count = 0;
+}
+
+static int path_ids_current(const struct path_memo *pm)
 {
-	static char p[PATH_MAX];
+	return path_ids_exp_gen == pm->pm_exp_gen &&
+	       path_ids_mnt_gen == pm->pm_mnt_gen &&
+	       time(NULL) - path_ids_time < PATH_ID_TTL;
+}
+
+static void path_ids_flush(void)
+{
+	struct path_id_ent *pe;
+	int i;
+
+	for (i = 0; i < PATH_ID_HASH; i++)
+		while ((pe = path_ids[i]) != NULL) {
+			path_ids[i] = pe->pe_next;
+			free(pe);
+		}
+}
+
+static void export_path_id(const struct path_memo *pm, const char *path,
+			   struct path_id *id)
+{
+	unsigned int h = uuid_path_hash(path) % PATH_ID_HASH;
+	struct path_id_ent *pe;
+
+	cache_lock(&path_ids_lock);
+	if (!path_ids_current(pm)) {
+		path_ids_flush();
+		path_ids_exp_gen = pm->pm_exp_gen;
+		path_ids_mnt_gen = pm->pm_mnt_gen;
+		path_ids_time = time(NULL);
+	}
+	for (pe = path_ids[h]; pe; pe = pe->pe_next)
+		if (strcmp(pe->pe_path, path) == 0) {
+			*id = pe->pe_id;
+			cache_unlock(&path_ids_lock);
+			return;
+		}
+	cache_unlock(&path_ids_lock);
+
+	path_id_fill(path, id, 1);
+	pe = malloc(sizeof(*pe) + strlen(path) + 1);
+	if (pe == NULL)
+		return;
+	pe->pe_id = *id;
+	strcpy(pe->pe_path, path);
+	cache_lock(&path_ids_lock);
+	if (path_ids_current(pm)) {
+		pe->pe_next = path_ids[h];
+		path_ids[h] = pe;
+		pe = NULL;
+	}
+	cache_unlock(&path_ids_lock);
+	free(pe);
+}
+
+/* same_path() of the first @len bytes of the memo's path, @child */
+static int path_memo_same(struct path_memo *pm, const char *child,
+			  size_t len, const char *parent)
+{
+	struct path_id cid, pid, *c = NULL;
+	int i;
+
+	for (i = 0; i < pm->pm_count; i++)
+		if (pm->pm_len[i] == len) {
+			c = &pm->pm_id[i];
+			break;
+		}
+	if (c == NULL) {
+		c = &cid;
+		if (pm->pm_count < PATH_MEMO_MAX) {
+			pm->pm_len[pm->pm_count] = len;
+			c = &pm->pm_id[pm->pm_count++];
+		}
+		path_id_fill(child, c, 0);
+	}
+	export_path_id(pm, parent, &pid);
+	return path_id_same(child, c, &pid);
+}
+
+static int same_path(char *child, char *parent, int len,
+		     struct path_memo *pm)
+{
+	char p[PATH_MAX];
 	int err;
 
 	if (len <= 0)
@@ -520,6 +1348,9 @@ static int same_path(char *child, char *parent, int len)
 	if (count_slashes(p) != count_slashes(parent))
 		return 0;
 
+	if (pm)
+		return path_memo_same(pm, p, len, parent);
+
 	/* Try to use filehandle approach before falling back to stat() */
 	err = check_same_path_by_handle(p, parent);
 	if (err != -1)
@@ -527,7 +1358,7 @@ static int same_path(char *child, char *parent, int len)
 	return check_same_path_by_inode(p, parent);
 }
 
-static int is_subdirectory(char *child, char *parent)
+static int is_subdirectory(char *child, char *parent, struct path_memo *pm)
 {
 	/* Check is child is strictly a subdirectory of
 	 * parent or a more distant descendant.
@@ -537,24 +1368,25 @@ static int is_subdirectory(char *child, char *parent)
 	if (strcmp(parent, "/") == 0 && child[1] != 0)
 		return 1;
 
-	return (same_path(child, parent, l) && child[l] == '/');
+	return (same_path(child, parent, l, pm) && child[l] == '/');
 }
 
-static int path_matches(nfs_export *exp, char *path)
+static int path_matches(nfs_export *exp, char *path, struct path_memo *pm)
 {
 	/* Does the path match the export?  I.e. is it an
 	 * exact match, or does the export have CROSSMOUNT, and path
 	 * is a descendant?
 	 */
-	return same_path(path, exp->m_export.e_path, 0)
+	return same_path(path, exp->m_export.e_path, 0, pm)
 		|| ((exp->m_export.e_flags & NFSEXP_CROSSMOUNT)
-		    && is_subdirectory(path, exp->m_export.e_path));
+		    && is_subdirectory(path, exp->m_export.e_path, pm));
 }
 
 static int
-export_matches(nfs_export *exp, char *dom, char *path, struct addrinfo *ai)
+export_matches(nfs_export *exp, char *dom, char *path, struct addrinfo *ai,
+	       struct path_memo *pm)
 {
-	return path_matches(exp, path) && client_matches(exp, dom, ai);
+	return path_matches(exp, path, pm) && client_matches(exp, dom, ai);
 }
 
 /* True iff e1 is a child of e2 (or descendant) and e2 has crossmnt set: */
@@ -563,7 +1395,7 @@ static bool subexport(struct exportent *e1, struct exportent *e2)
 	char *p1 = e1->e_path, *p2 = e2->e_path;
 
 	return e2->e_flags & NFSEXP_CROSSMOUNT
-		&& is_subdirectory(p1, p2);
+		&& is_subdirectory(p1, p2, NULL);
 }
 
 struct parsed_fsid {
@@ -661,27 +1493,247 @@ static int parse_fsid(int fsidtype, int fsidlen, char *fsid,
 	return 0;
 }
 
-static int match_fsid(struct parsed_fsid *parsed, nfs_export *exp, char *path)
+/*
+ * Index from uuid to the exported paths (including the submounts of
+ * crossmnt exports) that carry it, so that nfsd_fh() only has to call
+ * match_fsid() on paths that can possibly match a uuid filehandle.
+ * It is built on first use and rebuilt whenever the export table or
+ * the mount table changes.  Paths without a known uuid are kept on a
+ * separate list and always tried, so match_fsid() still gets to
+ * report errors on them.
+ */
+struct fsid_index_ent {
+	struct fsid_index_ent *	fe_next;
+	unsigned int		fe_hash;
+	size_t			fe_uuidlen;	/* 0 if unknown */
+	char			fe_uuid[16];
+	char			fe_path[];
+};
+
+struct fsid_index {
+	int			fi_refcount;
+	unsigned int		fi_exp_gen;
+	unsigned long		fi_mnt_gen;
+	unsigned int		fi_mask;
+	struct fsid_index_ent **	fi_table;
+	struct fsid_index_ent *	fi_unknown;
+};
+
+static struct fsid_index *	fsid_index;
+#ifdef HAVE_LIBPTHREAD
+static pthread_mutex_t		fsid_index_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static unsigned int fsid_uuid_hash(const char *uuid, size_t uuidlen)
 {
-	struct stat stb;
-	int type;
+	unsigned int h = 2166136261u ^ uuidlen;
+	size_t i;
+
+	for (i = 0; i < uuidlen; i++)
+		h = (h ^ (unsigned char)uuid[i]) * 16777619u;
+	return h;
+}
+
+static int fsid_index_add(struct fsid_index_ent **list, const char *path,
+			  const char *uuid, size_t uuidlen)
+{
+	struct fsid_index_ent *fe;
+
+	fe = malloc(sizeof(*fe) + strlen(path) + 1);
+	if (fe == NULL)
+		return -1;
+	strcpy(fe->fe_path, path);
+	fe->fe_uuidlen = uuidlen;
+	if (uuidlen)
+		memcpy(fe->fe_uuid, uuid, uuidlen);
+	fe->fe_hash = fsid_uuid_hash(uuid, uuidlen);
+	fe->fe_next = *list;
+	*list = fe;
+	return 0;
+}
+
+static int fsid_index_add_path(struct fsid_index *idx,
+			       struct fsid_index_ent **list, unsigned int *cnt,
+			       nfs_export *exp, char *path)
+{
+	static const size_t uuidlens[] = { 4, 8, 16 };
+	char val[UUID_VAL_MAX];
+	const char *v;
 	char u[16];
+	size_t i;
 
-	if (nfsd_path_stat(path, &stb) != 0)
-		goto path_error;
-	if (!S_ISDIR(stb.st_mode) && !S_ISREG(stb.st_mode))
-		goto nomatch;
+	if (exp->m_export.e_uuid)
+		v = exp->m_export.e_uuid;
+	else if (uuid_cache_lookup(path, val))
+		v = val;
+	else
+		return fsid_index_add(&idx->fi_unknown, path, NULL, 0);
 
-	switch (parsed->fsidtype) {
-	case FSID_DEV:
-	case FSID_MAJOR_MINOR:
-	case FSID_ENCODE_DEV:
-		if (stb.st_ino != parsed->inode)
-			goto nomatch;
-		if (parsed->major != major(stb.st_dev) ||
-		    parsed->minor != minor(stb.st_dev))
-			goto nomatch;
-		goto match;
+	for (i = 0; i < sizeof(uuidlens) / sizeof(uuidlens[0]); i++) {
+		get_uuid(v, uuidlens[i], u);
+		if (fsid_index_add(list, path, u, uuidlens[i]) < 0)
+			return -1;
+		(*cnt)++;
+	}
+	return 0;
+}
+
+static void fsid_index_free(struct fsid_index *idx)
+{
+	struct fsid_index_ent *fe, *next;
+	unsigned int i;
+
+	for (i = 0; idx->fi_table && i <= idx->fi_mask; i++)
+		for (fe = idx->fi_table[i]; fe; fe = next) {
+			next = fe->fe_next;
+			free(fe);
+		}
+	for (fe = idx->fi_unknown; fe; fe = next) {
+		next = fe->fe_next;
+		free(fe);
+	}
+	free(idx->fi_table);
+	free(idx);
+}
+
+static struct fsid_index *fsid_index_build(unsigned int exp_gen,
+					   unsigned long mnt_gen)
+{
+	struct fsid_index *idx;
+	struct fsid_index_ent *list = NULL, *fe;
+	unsigned int cnt = 0, size;
+	nfs_export *exp;
+	void *mnt;
+	char *path;
+	int i;
+
+	idx = calloc(1, sizeof(*idx));
+	if (idx == NULL)
+		return NULL;
+	idx->fi_refcount = 1;
+	idx->fi_exp_gen = exp_gen;
+	idx->fi_mnt_gen = mnt_gen;
+
+	for (i = 0; i < MCL_MAXTYPES; i++) {
+		for (exp = exportlist[i].p_head; exp; exp = exp->m_next) {
+			if (fsid_index_add_path(idx, &list, &cnt, exp,
+						exp->m_export.e_path) < 0)
+				goto out_free;
+			if (!(exp->m_export.e_flags & NFSEXP_CROSSMOUNT))
+				continue;
+			mnt = NULL;
+			while ((path = next_mnt(&mnt, exp->m_export.e_path)))
+				if (fsid_index_add_path(idx, &list, &cnt,
+							exp, path) < 0) {
+					end_mnt(&mnt);
+					goto out_free;
+				}
+		}
+	}
+
+	for (size = 16; size < cnt; size <<= 1)
+		;
+	idx->fi_table = calloc(size, sizeof(*idx->fi_table));
+	if (idx->fi_table == NULL)
+		goto out_free;
+	idx->fi_mask = size - 1;
+	while ((fe = list) != NULL) {
+		list = fe->fe_next;
+		fe->fe_next = idx->fi_table[fe->fe_hash & idx->fi_mask];
+		idx->fi_table[fe->fe_hash & idx->fi_mask] = fe;
+	}
+	xlog(D_GENERAL, "fsid index: %u uuid entries", cnt);
+	return idx;
+
+out_free:
+	while ((fe = list) != NULL) {
+		list = fe->fe_next;
+		free(fe);
+	}
+	fsid_index_free(idx);
+	return NULL;
+}
+
+/* Callers must hold the export table (read) lock */
+static struct fsid_index *fsid_index_get(void)
+{
+	struct fsid_index *idx;
+	unsigned int exp_gen;
+	unsigned long mnt_gen;
+
+	/* Notice any mount table change before checking generations */
+	mnttab_put(mnttab_get());
+	exp_gen = auth_generation();
+	mnt_gen = mnttab_generation();
+
+	cache_lock(&fsid_index_lock);
+	idx = fsid_index;
+	if (idx == NULL || idx->fi_exp_gen != exp_gen ||
+	    idx->fi_mnt_gen != mnt_gen) {
+		fsid_index = fsid_index_build(exp_gen, mnt_gen);
+		if (idx && --idx->fi_refcount == 0)
+			fsid_index_free(idx);
+		idx = fsid_index;
+	}
+	if (idx)
+		idx->fi_refcount++;
+	cache_unlock(&fsid_index_lock);
+	return idx;
+}
+
+static void fsid_index_put(struct fsid_index *idx)
+{
+	if (idx == NULL)
+		return;
+	cache_lock(&fsid_index_lock);
+	if (--idx->fi_refcount == 0)
+		fsid_index_free(idx);
+	cache_unlock(&fsid_index_lock);
+}
+
+/*
+ * Returns 0 only if @path certainly doesn't carry the uuid in @parsed.
+ */
+static int fsid_index_match(struct fsid_index *idx,
+			    struct parsed_fsid *parsed, const char *path)
+{
+	struct fsid_index_ent *fe;
+	unsigned int hash;
+
+	hash = fsid_uuid_hash(parsed->fhuuid, parsed->uuidlen);
+	for (fe = idx->fi_table[hash & idx->fi_mask]; fe; fe = fe->fe_next)
+		if (fe->fe_hash == hash &&
+		    fe->fe_uuidlen == parsed->uuidlen &&
+		    memcmp(fe->fe_uuid, parsed->fhuuid, parsed->uuidlen) == 0 &&
+		    strcmp(fe->fe_path, path) == 0)
+			return 1;
+	for (fe = idx->fi_unknown; fe; fe = fe->fe_next)
+		if (strcmp(fe->fe_path, path) == 0)
+			return 1;
+	return 0;
+}
+
+static int match_fsid(struct parsed_fsid *parsed, nfs_export *exp, char *path)
+{
+	struct stat stb;
+	int type;
+	char u[16];
+
+	if (nfsd_path_stat(path, &stb) != 0)
+		goto path_error;
+	if (!S_ISDIR(stb.st_mode) && !S_ISREG(stb.st_mode))
+		goto nomatch;
+
+	switch (parsed->fsidtype) {
+	case FSID_DEV:
+	case FSID_MAJOR_MINOR:
+	case FSID_ENCODE_DEV:
+		if (stb.st_ino != parsed->inode)
+			goto nomatch;
+		if (parsed->major != major(stb.st_dev) ||
+		    parsed->minor != minor(stb.st_dev))
+			goto nomatch;
+		goto match;
 	case FSID_NUM:
 		if (((exp->m_export.e_flags & NFSEXP_FSID) == 0 ||
 		     exp->m_export.e_fsid != parsed->fsidnum))
@@ -723,22 +1775,15 @@ path_error:
 	return -1;
 }
 
-static struct addrinfo *lookup_client_addr(char *dom)
+/* The result lives in @ha, and is not to be freed */
+static struct addrinfo *lookup_client_addr(char *dom, struct host_addr *ha)
 {
-	struct addrinfo *ret;
-	struct addrinfo *tmp;
-
 	dom++; /* skip initial "$" */
 
-	tmp = host_pton(dom);
-	if (tmp == NULL)
-		return NULL;
-	ret = client_resolve(tmp->ai_addr);
-	nfs_freeaddrinfo(tmp);
-	return ret;
+	return host_pton_buf(dom, ha);
 }
 
-static void nfsd_fh(int f)
+static void nfsd_fh(int f, char *inbuf, int UNUSED(inlen))
 {
 	/* request are:
 	 *  domain fsidtype fsid
@@ -751,26 +1796,23 @@ static void nfsd_fh(int f)
 	char fsid[32];
 	struct parsed_fsid parsed;
 	struct exportent *found = NULL;
+	struct host_addr ha;
 	struct addrinfo *ai = NULL;
 	char *found_path = NULL;
 	nfs_export *exp;
+	nfs_export *prev = NULL;
+	void *mnt = NULL;
+	struct fsid_index *idx = NULL;
 	int i;
 	int dev_missing = 0;
 	char buf[RPC_CHAN_BUF_SIZE], *bp;
 	int blen;
 
-	blen = cache_read(f, buf, sizeof(buf));
-	if (blen <= 0 || buf[blen-1] != '\n') return;
-	buf[blen-1] = 0;
-
-	xlog(D_CALL, "nfsd_fh: inbuf '%s'", buf);
+	xlog(D_CALL, "nfsd_fh: inbuf '%s'", inbuf);
 
-	bp = buf;
+	bp = inbuf;
 
-	dom = malloc(blen);
-	if (dom == NULL)
-		return;
-	if (qword_get(&bp, dom, blen) <= 0)
+	if (qword_get_inplace(&bp, &dom) <= 0)
 		goto out;
 	if (qword_get_int(&bp, &fsidtype) != 0)
 		goto out;
@@ -781,10 +1823,13 @@ static void nfsd_fh(int f)
 	if (parse_fsid(fsidtype, fsidlen, fsid, &parsed))
 		goto out;
 
-	auth_reload();
+	cache_reload();
+
+	if (parsed.uuidlen)
+		idx = fsid_index_get();
 
 	if (is_ipaddr_client(dom)) {
-		ai = lookup_client_addr(dom);
+		ai = lookup_client_addr(dom, &ha);
 		if (!ai)
 			goto out;
 	}
@@ -796,9 +1841,6 @@ static void nfsd_fh(int f)
 			char *path;
 
 			if (exp->m_export.e_flags & NFSEXP_CROSSMOUNT) {
-				static nfs_export *prev = NULL;
-				static void *mnt = NULL;
-				
 				if (prev == exp) {
 					/* try a submount */
 					path = next_mnt(&mnt, exp->m_export.e_path);
@@ -828,6 +1870,9 @@ static void nfsd_fh(int f)
 					   exp->m_export.e_path))
 				dev_missing ++;
 
+			if (idx && !fsid_index_match(idx, &parsed, path))
+				continue;
+
 			switch(match_fsid(&parsed, exp, path)) {
 			case 0:
 				continue;
@@ -898,38 +1943,53 @@ static void nfsd_fh(int f)
 	qword_addeol(&bp, &blen);
 	if (blen <= 0 || cache_write(f, buf, bp - buf) != bp - buf)
 		xlog(L_ERROR, "nfsd_fh: error writing reply");
-	if (!found)
+	if (!found) {
 		xlog(D_AUTH, "denied access to %s", *dom == '$' ? dom+1 : dom);
+		cache_stats_miss(CSTAT_NFSD_FH);
+	}
 out:
+	end_mnt(&mnt);
+	fsid_index_put(idx);
 	if (found_path)
 		free(found_path);
-	nfs_freeaddrinfo(ai);
-	free(dom);
 	xlog(D_CALL, "nfsd_fh: found %p path %s", found, found ? found->e_path : NULL);
 }
 
 #ifdef HAVE_JUNCTION_SUPPORT
-static void write_fsloc(char **bp, int *blen, struct exportent *ep)
+/*
+ * Exports in the table carry their locations parsed; the others, such
+ * as those made for junctions, take them from replicas_get() here.
+ * They are ordered for @domain by replicas_order().
+ */
+static void write_fsloc(char **bp, int *blen, struct exportent *ep,
+			const char *domain)
 {
-	struct servers *servers;
+	struct servers *servers = ep->e_fslocs;
+	int order[FSLOC_MAX_LIST];
 
 	if (ep->e_fslocmethod == FSLOC_NONE)
 		return;
 
-	servers = replicas_lookup(ep->e_fslocmethod, ep->e_fslocdata);
+	if (servers == NULL)
+		servers = replicas_get(ep->e_fslocmethod, ep->e_fslocdata);
 	if (!servers)
 		return;
+	replicas_order(servers, domain, order);
+	if (servers->h_num > 0 && order[0] != 0)
+		xlog(D_CALL, "fs locations of %s for %s start at %s",
+		     ep->e_path, domain, servers->h_mp[order[0]]->h_host);
 	qword_add(bp, blen, "fsloc");
 	qword_addint(bp, blen, servers->h_num);
 	if (servers->h_num >= 0) {
 		int i;
 		for (i=0; i<servers->h_num; i++) {
-			qword_add(bp, blen, servers->h_mp[i]->h_host);
-			qword_add(bp, blen, servers->h_mp[i]->h_path);
+			qword_add(bp, blen, servers->h_mp[order[i]]->h_host);
+			qword_add(bp, blen, servers->h_mp[order[i]]->h_path);
 		}
 	}
 	qword_addint(bp, blen, servers->h_referral);
-	release_replicas(servers);
+	if (servers != ep->e_fslocs)
+		replicas_put(servers);
 }
 #endif
 static void write_secinfo(char **bp, int *blen, struct exportent *ep, int flag_mask)
@@ -952,8 +2012,85 @@ static void write_secinfo(char **bp, int *blen, struct exportent *ep, int flag_m
 
 }
 
+/*
+ * Write the options of an nfsd.export reply for @exp: everything
+ * after the expiry time, except a uuid that has to be read from the
+ * filesystem.  @different_fs is set when a submount of @exp is being
+ * exported.  @domain is the client it is for, or NULL if the reply
+ * is for any client.
+ */
+static void write_export_opts(char **bp, int *blen, struct exportent *exp,
+#ifdef HAVE_JUNCTION_SUPPORT
+			      int different_fs, const char *domain)
+#else
+			      int different_fs, const char *UNUSED(domain))
+#endif
+{
+	int flag_mask = different_fs ? ~NFSEXP_FSID : ~0;
+
+	qword_addint(bp, blen, exp->e_flags & flag_mask);
+	qword_addint(bp, blen, exp->e_anonuid);
+	qword_addint(bp, blen, exp->e_anongid);
+	qword_addint(bp, blen, exp->e_fsid);
+
+#ifdef HAVE_JUNCTION_SUPPORT
+	write_fsloc(bp, blen, exp, domain);
+#endif
+	write_secinfo(bp, blen, exp, flag_mask);
+	if (exp->e_uuid && !different_fs) {
+		char u[16];
+		get_uuid(exp->e_uuid, 16, u);
+		qword_add(bp, blen, "uuid");
+		qword_addhex(bp, blen, u, 16);
+	}
+}
+
+/**
+ * cache_export_replies - format the nfsd.export reply options of exports
+ *
+ * The options don't change until the export does, so format them
+ * once for every export, and let dump_to_cache() copy them.  Called
+ * with the export table write-locked, after it has been reloaded.
+ */
+void cache_export_replies(void)
+{
+	char buf[RPC_CHAN_BUF_SIZE], *bp;
+	nfs_export *exp;
+	int i, blen;
+
+	for (i = 0; i < MCL_MAXTYPES; i++)
+		for (exp = exportlist[i].p_head; exp; exp = exp->m_next) {
+			free(exp->m_reply);
+			exp->m_reply = NULL;
+			/* a stub is asked for its locations every time */
+			if (exp->m_export.e_fslocmethod == FSLOC_STUB)
+				continue;
+#ifdef HAVE_JUNCTION_SUPPORT
+			/* and they may be ordered for each client */
+			if (exp->m_export.e_fslocmethod != FSLOC_NONE &&
+			    fsloc_order != FSLOC_ORDER_CONFIG)
+				continue;
+#endif
+
+			bp = buf; blen = sizeof(buf);
+			write_export_opts(&bp, &blen, &exp->m_export, 0, NULL);
+			if (blen <= 0)
+				continue;
+			exp->m_reply = malloc(sizeof(*exp->m_reply) + (bp - buf));
+			if (exp->m_reply == NULL)
+				continue;
+			exp->m_reply->r_len = bp - buf;
+			memcpy(exp->m_reply->r_text, buf, bp - buf);
+		}
+}
+
+/*
+ * Write an nfsd.export reply to @f.  If @reply is not NULL, it holds
+ * the options of @exp, formatted by cache_export_replies().
+ */
 static int dump_to_cache(int f, char *buf, int blen, char *domain,
-			 char *path, struct exportent *exp, int ttl)
+			 char *path, struct exportent *exp,
+			 const struct export_reply *reply, int ttl)
 {
 	char *bp = buf;
 	time_t now = time(0);
@@ -967,30 +2104,22 @@ static int dump_to_cache(int f, char *buf, int blen, char *domain,
 	qword_add(&bp, &blen, path);
 	if (exp) {
 		int different_fs = strcmp(path, exp->e_path) != 0;
-		int flag_mask = different_fs ? ~NFSEXP_FSID : ~0;
 
-		qword_adduint(&bp, &blen, now + exp->e_ttl);
-		qword_addint(&bp, &blen, exp->e_flags & flag_mask);
-		qword_addint(&bp, &blen, exp->e_anonuid);
-		qword_addint(&bp, &blen, exp->e_anongid);
-		qword_addint(&bp, &blen, exp->e_fsid);
-
-#ifdef HAVE_JUNCTION_SUPPORT
-		write_fsloc(&bp, &blen, exp);
-#endif
-		write_secinfo(&bp, &blen, exp, flag_mask);
+		qword_adduint(&bp, &blen, now + cache_ttl(exp->e_ttl));
+		if (reply && !different_fs && blen > reply->r_len) {
+			memcpy(bp, reply->r_text, reply->r_len);
+			bp += reply->r_len;
+			blen -= reply->r_len;
+		} else
+			write_export_opts(&bp, &blen, exp, different_fs,
+					  domain);
 		if (exp->e_uuid == NULL || different_fs) {
 			char u[16];
-			if ((exp->e_flags & flag_mask & NFSEXP_FSID) == 0 &&
+			if (((exp->e_flags & NFSEXP_FSID) == 0 || different_fs) &&
 			    uuid_by_path(path, 0, 16, u)) {
 				qword_add(&bp, &blen, "uuid");
 				qword_addhex(&bp, &blen, u, 16);
 			}
-		} else {
-			char u[16];
-			get_uuid(exp->e_uuid, 16, u);
-			qword_add(&bp, &blen, "uuid");
-			qword_addhex(&bp, &blen, u, 16);
 		}
 		xlog(D_AUTH, "granted access to %s for %s",
 		     path, *domain == '$' ? domain+1 : domain);
@@ -1015,51 +2144,103 @@ static int dump_to_cache(int f, char *buf, int blen, char *domain,
 	return 0;
 }
 
+/*
+ * Decide whether @exp, which matches the request, should replace the
+ * best match found so far.
+ */
+static void lookup_export_choose(nfs_export **found, int *found_type,
+				 nfs_export *exp, int i, char *path)
+{
+	if (!*found) {
+		*found = exp;
+		*found_type = i;
+		return;
+	}
+	/* Always prefer non-V4ROOT exports */
+	if (exp->m_export.e_flags & NFSEXP_V4ROOT)
+		return;
+	if ((*found)->m_export.e_flags & NFSEXP_V4ROOT) {
+		*found = exp;
+		*found_type = i;
+		return;
+	}
+
+	/* If one is a CROSSMOUNT, then prefer the longest path */
+	if ((((*found)->m_export.e_flags & NFSEXP_CROSSMOUNT) ||
+	     (exp->m_export.e_flags & NFSEXP_CROSSMOUNT)) &&
+	    strlen((*found)->m_export.e_path) !=
+	    strlen(exp->m_export.e_path)) {
+
+		if (strlen(exp->m_export.e_path) >
+		    strlen((*found)->m_export.e_path)) {
+			*found = exp;
+			*found_type = i;
+		}
+
+	} else if (*found_type == i && (*found)->m_warned == 0) {
+		xlog(L_WARNING, "%s exported to both %s and %s, "
+		     "arbitrarily choosing options from first",
+		     path, (*found)->m_client->m_hostname,
+		     exp->m_client->m_hostname);
+		(*found)->m_warned = 1;
+	}
+}
+
 static nfs_export *
 lookup_export(char *dom, char *path, struct addrinfo *ai)
 {
 	nfs_export *exp;
 	nfs_export *found = NULL;
 	int found_type = 0;
+	struct path_memo pm;
+	char prefix[PATH_MAX];
+	size_t len, plen = strlen(path);
 	int i;
 
-	for (i=0 ; i < MCL_MAXTYPES; i++) {
-		for (exp = exportlist[i].p_head; exp; exp = exp->m_next) {
-			if (!export_matches(exp, dom, path, ai))
-				continue;
-			if (!found) {
-				found = exp;
-				found_type = i;
-				continue;
-			}
-			/* Always prefer non-V4ROOT exports */
-			if (exp->m_export.e_flags & NFSEXP_V4ROOT)
-				continue;
-			if (found->m_export.e_flags & NFSEXP_V4ROOT) {
-				found = exp;
-				found_type = i;
-				continue;
+	/*
+	 * Only an export of @path itself, or a crossmnt export of one
+	 * of its ancestors, can match.  Look those up by name in the
+	 * export hash, from the root down.
+	 */
+	if (path[0] == '/' && plen < sizeof(prefix)) {
+		for (i = 0; i < MCL_MAXTYPES; i++) {
+			len = 1;
+			for (;;) {
+				memcpy(prefix, path, len);
+				prefix[len] = '\0';
+				for (exp = export_find_path(i, prefix, NULL); exp;
+				     exp = export_find_path(i, prefix, exp)) {
+					if (len < plen &&
+					    !(exp->m_export.e_flags & NFSEXP_CROSSMOUNT))
+						continue;
+					if (!export_matches(exp, dom, path, ai,
+							    NULL))
+						continue;
+					lookup_export_choose(&found, &found_type,
+							     exp, i, path);
+				}
+				if (len >= plen)
+					break;
+				while (++len < plen && path[len] != '/')
+					;
 			}
+		}
+		if (found)
+			return found;
+	}
 
-			/* If one is a CROSSMOUNT, then prefer the longest path */
-			if (((found->m_export.e_flags & NFSEXP_CROSSMOUNT) ||
-			     (exp->m_export.e_flags & NFSEXP_CROSSMOUNT)) &&
-			    strlen(found->m_export.e_path) !=
-			    strlen(exp->m_export.e_path)) {
-
-				if (strlen(exp->m_export.e_path) >
-				    strlen(found->m_export.e_path)) {
-					found = exp;
-					found_type = i;
-				}
+	/*
+	 * Nothing matched by name, but @path might still name an export
+	 * by another spelling (e.g. on a case-insensitive filesystem),
+	 * which only same_path() can tell.  Look up what it compares
+	 * once, not for every export.
+	 */
+	path_memo_init(&pm);
+	for (i=0 ; i < MCL_MAXTYPES; i++) {
+		for (exp = exportlist[i].p_head; exp; exp = exp->m_next) {
+			if (!export_matches(exp, dom, path, ai, &pm))
 				continue;
-
-			} else if (found_type == i && found->m_warned == 0) {
-				xlog(L_WARNING, "%s exported to both %s and %s, "
-				     "arbitrarily choosing options from first",
-				     path, found->m_client->m_hostname, exp->m_client->m_hostname);
-				found->m_warned = 1;
-			}
+			lookup_export_choose(&found, &found_type, exp, i, path);
 		}
 	}
 	return found;
@@ -1250,23 +2431,15 @@ static struct exportent *create_junction_exportent(struct exportent *parent,
 		goto out_nomem;
 
 	dupexportent(eep, parent);
-	strcpy(eep->e_path, junction);
-	eep->e_hostname = strdup(parent->e_hostname);
-	if (eep->e_hostname == NULL) {
-		free(eep);
-		goto out_nomem;
-	}
-	free(eep->e_uuid);
+	strpool_put(eep->e_path);
+	eep->e_path = strpool_get(junction);
+	eep->e_hostname = strpool_get(parent->e_hostname);
+	strpool_put(eep->e_uuid);
 	eep->e_uuid = NULL;
 	eep->e_ttl = (unsigned int)ttl;
 
-	free(eep->e_fslocdata);
-	eep->e_fslocdata = strdup(fslocdata);
-	if (eep->e_fslocdata == NULL) {
-		free(eep->e_hostname);
-		free(eep);
-		goto out_nomem;
-	}
+	strpool_put(eep->e_fslocdata);
+	eep->e_fslocdata = strpool_get(fslocdata);
 	eep->e_fslocmethod = FSLOC_REFER;
 	return eep;
 
@@ -1314,101 +2487,506 @@ nfs_get_basic_junction(const char *junct_path, struct nfs_fsloc_set **locset)
 	return 0;
 }
 
-static struct exportent *lookup_junction(char *dom, const char *pathname,
-		struct addrinfo *ai)
+static void nfs_free_basic_junction(struct nfs_fsloc_set *locset)
 {
-	struct exportent *parent, *exp = NULL;
-	struct nfs_fsloc_set *locations;
+	if (locset == NULL)
+		return;
+	nfs_free_locations(locset->ns_list);
+	free(locset);
+}
+
+/*
+ * Deciding whether a directory is a junction means opening it,
+ * reading its trusted.junction.nfs xattr and parsing the XML in it,
+ * and a namespace full of referrals does that on every nfsd.export
+ * miss.  So keep the parsed locations of each directory, and the
+ * finding that a directory is not a junction, keyed by its device
+ * and inode.  Setting the xattr or the sticky bit changes the ctime,
+ * so an entry whose ctime no longer matches is parsed again.  Errors
+ * are not remembered, and the whole cache is dropped when it holds
+ * JUNCTION_CACHE_MAX directories.
+ *
+ * Only used under junction_lock.
+ */
+#define JUNCTION_CACHE_INIT	256
+#define JUNCTION_CACHE_MAX	65536
+
+struct junction_cache_ent {
+	struct junction_cache_ent *	jc_next;
+	dev_t				jc_dev;
+	ino_t				jc_ino;
+	struct timespec			jc_ctime;
+	struct nfs_fsloc_set *		jc_locations;	/* NULL if none */
+};
+
+static struct junction_cache_ent **	junction_cache;
+static unsigned int			junction_cache_mask;
+static unsigned int			junction_cache_count;
+
+static unsigned int junction_cache_hash(dev_t dev, ino_t ino)
+{
+	unsigned long long h = (unsigned long long)ino * 0x9e3779b97f4a7c15ULL;
+
+	h ^= (unsigned long long)dev * 0xc2b2ae3d27d4eb4fULL;
+	return (unsigned int)(h ^ (h >> 32));
+}
+
+static void junction_cache_flush(void)
+{
+	struct junction_cache_ent *ent, *next;
+	unsigned int i;
+
+	for (i = 0; junction_cache && i <= junction_cache_mask; i++) {
+		for (ent = junction_cache[i]; ent; ent = next) {
+			next = ent->jc_next;
+			nfs_free_basic_junction(ent->jc_locations);
+			free(ent);
+		}
+		junction_cache[i] = NULL;
+	}
+	junction_cache_count = 0;
+}
+
+static void junction_cache_grow(void)
+{
+	struct junction_cache_ent **new, *ent, *next;
+	unsigned int size, i, h;
+
+	size = junction_cache ? (junction_cache_mask + 1) * 2 :
+				JUNCTION_CACHE_INIT;
+	new = calloc(size, sizeof(*new));
+	if (new == NULL)
+		return;
+	for (i = 0; junction_cache && i <= junction_cache_mask; i++)
+		for (ent = junction_cache[i]; ent; ent = next) {
+			next = ent->jc_next;
+			h = junction_cache_hash(ent->jc_dev, ent->jc_ino);
+			ent->jc_next = new[h & (size - 1)];
+			new[h & (size - 1)] = ent;
+		}
+	free(junction_cache);
+	junction_cache = new;
+	junction_cache_mask = size - 1;
+}
+
+/*
+ * Find the locations of the junction at "pathname", whose attributes
+ * are "stb".  Returns NULL if it is not a junction, or can't be read.
+ * The locations belong to the cache.
+ */
+static struct nfs_fsloc_set *junction_cache_lookup(const char *pathname,
+		const struct stat *stb)
+{
+	struct nfs_fsloc_set *locations = NULL;
+	struct junction_cache_ent *ent;
+	unsigned int hash;
+	FedFsStatus retval;
 	int status;
 
-	xmlInitParser();
+	hash = junction_cache_hash(stb->st_dev, stb->st_ino);
+	for (ent = junction_cache ? junction_cache[hash & junction_cache_mask] :
+			NULL; ent; ent = ent->jc_next)
+		if (ent->jc_dev == stb->st_dev && ent->jc_ino == stb->st_ino)
+			break;
+	if (ent && ent->jc_ctime.tv_sec == stb->st_ctim.tv_sec &&
+	    ent->jc_ctime.tv_nsec == stb->st_ctim.tv_nsec) {
+		xlog(D_CALL, "%s: %s %s", __func__, pathname,
+			ent->jc_locations ? "is a cached junction" :
+			"is not a junction (cached)");
+		return ent->jc_locations;
+	}
+
+	if (ent == NULL) {
+		if (junction_cache_count >= JUNCTION_CACHE_MAX)
+			junction_cache_flush();
+		if (junction_cache == NULL ||
+		    junction_cache_count > 2 * junction_cache_mask)
+			junction_cache_grow();
+		if (junction_cache == NULL)
+			return NULL;
+		ent = calloc(1, sizeof(*ent));
+		if (ent == NULL)
+			return NULL;
+		ent->jc_dev = stb->st_dev;
+		ent->jc_ino = stb->st_ino;
+		ent->jc_next = junction_cache[hash & junction_cache_mask];
+		junction_cache[hash & junction_cache_mask] = ent;
+		junction_cache_count++;
+	}
+	nfs_free_basic_junction(ent->jc_locations);
+	ent->jc_locations = NULL;
+	ent->jc_ctime.tv_sec = ent->jc_ctime.tv_nsec = -1;
 
-	if (nfs_is_junction(pathname)) {
+	xmlInitParser();
+	retval = nfs_is_junction(pathname);
+	if (retval == FEDFS_OK) {
+		status = nfs_get_basic_junction(pathname, &locations);
+		if (status) {
+			xlog(L_WARNING, "Dangling junction %s: %s",
+				pathname, strerror(status));
+			retval = FEDFS_ERR_SVRFAULT;
+		}
+	} else
 		xlog(D_GENERAL, "%s: %s is not a junction",
 			__func__, pathname);
-		goto out;
+	xmlCleanupParser();
+
+	/* Errors are tried again next time */
+	if (retval != FEDFS_OK && retval != FEDFS_ERR_NOTJUNCT)
+		return NULL;
+	ent->jc_locations = locations;
+	ent->jc_ctime = stb->st_ctim;
+	return locations;
+}
+
+static struct exportent *lookup_junction(char *dom, const char *pathname,
+		struct addrinfo *ai)
+{
+	struct nfs_fsloc_set *locations;
+	struct exportent *parent;
+	struct stat stb;
+
+	if (stat(pathname, &stb) < 0) {
+		xlog(D_GENERAL, "%s: %s: %m", __func__, pathname);
+		return NULL;
 	}
-	status = nfs_get_basic_junction(pathname, &locations);
-	if (status) {
-		xlog(L_WARNING, "Dangling junction %s: %s",
-			pathname, strerror(status));
-		goto out;
+	if (!S_ISDIR(stb.st_mode)) {
+		xlog(D_GENERAL, "%s: %s is not a junction",
+			__func__, pathname);
+		return NULL;
 	}
+	locations = junction_cache_lookup(pathname, &stb);
+	if (locations == NULL)
+		return NULL;
 
 	parent = lookup_parent_export(dom, pathname, ai);
 	if (parent == NULL)
-		goto free_locations;
-
-	exp = locations_to_export(locations, pathname, parent);
-
-free_locations:
-	nfs_free_locations(locations->ns_list);
-	free(locations);
+		return NULL;
 
-out:
-	xmlCleanupParser();
-	return exp;
+	locations->ns_current = locations->ns_list;
+	return locations_to_export(locations, pathname, parent);
 }
 
-static void lookup_nonexport(int f, char *buf, int buflen, char *dom, char *path,
+/* Returns 1 if a junction was found at @path, else 0 */
+static int lookup_nonexport(int f, char *buf, int buflen, char *dom, char *path,
 		struct addrinfo *ai)
 {
 	struct exportent *eep;
 
+	/* libxml2 parser setup/teardown, the fslocdata buffer and the
+	 * junction cache are not safe to use from several threads at once. */
+	cache_lock(&junction_lock);
 	eep = lookup_junction(dom, path, ai);
-	dump_to_cache(f, buf, buflen, dom, path, eep, 0);
+	cache_unlock(&junction_lock);
+	dump_to_cache(f, buf, buflen, dom, path, eep, NULL, 0);
 	if (eep == NULL)
-		return;
+		return 0;
 	exportent_release(eep);
 	free(eep);
+	return 1;
 }
 
-#else	/* !HAVE_JUNCTION_SUPPORT */
+/*
+ * Junctions found below the exports by cache_prewarm_junctions(),
+ * sorted, so that cache_prewarm() can push those below each export
+ * it pushes.
+ */
+struct prewarm_junctions {
+	char **			pj_paths;
+	unsigned int		pj_count, pj_size;
+#ifdef HAVE_LIBPTHREAD
+	pthread_mutex_t		pj_lock;
+#endif
+};
 
-static void lookup_nonexport(int f, char *buf, int buflen, char *dom, char *path,
-		struct addrinfo *UNUSED(ai))
+static struct prewarm_junctions prewarm_junctions;
+
+static void prewarm_junction_found(const char *pathname, void *arg)
 {
-	dump_to_cache(f, buf, buflen, dom, path, NULL, 0);
+	struct prewarm_junctions *pj = arg;
+	char **new, *path;
+
+	path = strdup(pathname);
+	if (path == NULL)
+		return;
+	cache_lock(&pj->pj_lock);
+	if (pj->pj_count == pj->pj_size) {
+		new = realloc(pj->pj_paths, (pj->pj_size ? pj->pj_size * 2 :
+					     256) * sizeof(*new));
+		if (new == NULL) {
+			cache_unlock(&pj->pj_lock);
+			free(path);
+			return;
+		}
+		pj->pj_paths = new;
+		pj->pj_size = pj->pj_size ? pj->pj_size * 2 : 256;
+	}
+	pj->pj_paths[pj->pj_count++] = path;
+	cache_unlock(&pj->pj_lock);
 }
 
-#endif	/* !HAVE_JUNCTION_SUPPORT */
+static int prewarm_junction_cmp(const void *a, const void *b)
+{
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
 
-static void nfsd_export(int f)
+static void prewarm_junctions_free(void)
 {
-	/* requests are:
-	 *  domain path
-	 * determine export options and return:
-	 *  domain path expiry flags anonuid anongid fsid
-	 */
+	unsigned int i;
 
-	char *dom, *path;
-	nfs_export *found = NULL;
-	struct addrinfo *ai = NULL;
-	char buf[RPC_CHAN_BUF_SIZE], *bp;
-	int blen;
+	for (i = 0; i < prewarm_junctions.pj_count; i++)
+		free(prewarm_junctions.pj_paths[i]);
+	free(prewarm_junctions.pj_paths);
+	prewarm_junctions.pj_paths = NULL;
+	prewarm_junctions.pj_count = prewarm_junctions.pj_size = 0;
+}
 
-	blen = cache_read(f, buf, sizeof(buf));
-	if (blen <= 0 || buf[blen-1] != '\n') return;
-	buf[blen-1] = 0;
+/**
+ * cache_prewarm_junctions - find the junctions below every export
+ * @nthreads: number of threads to walk each export with
+ *
+ * Fills the junction cache, so that the first lookup of each junction
+ * doesn't have to read and parse it, and remembers the junctions for
+ * cache_prewarm(), which then pushes them for each client it pushes
+ * the exports above them for.  Meant to be called once at startup,
+ * before cache_prewarm().  Returns the number of junctions found.
+ */
+int cache_prewarm_junctions(int nthreads)
+{
+	struct prewarm_junctions *pj = &prewarm_junctions;
+	time_t start = time(NULL);
+	unsigned int i, j, nroots = 0;
+	struct stat stb;
+	nfs_export *exp;
+	char *last = NULL;
 
-	xlog(D_CALL, "nfsd_export: inbuf '%s'", buf);
+	prewarm_junctions_free();
+#ifdef HAVE_LIBPTHREAD
+	pthread_mutex_init(&pj->pj_lock, NULL);
+#endif
 
-	bp = buf;
-	dom = malloc(blen);
-	path = malloc(blen);
+	auth_reload();
+	export_read_lock();
+	for (i = 0; i < MCL_MAXTYPES; i++)
+		for (exp = exportlist[i].p_head; exp; exp = exp->m_next) {
+			if (exp->m_export.e_flags & NFSEXP_V4ROOT)
+				continue;
+			if (last && strcmp(last, exp->m_export.e_path) == 0)
+				continue;
+			last = exp->m_export.e_path;
+			junction_scan(last, nthreads, prewarm_junction_found, pj);
+			nroots++;
+		}
+	export_read_unlock();
+#ifdef HAVE_LIBPTHREAD
+	pthread_mutex_destroy(&pj->pj_lock);
+#endif
+
+	if (pj->pj_count)
+		qsort(pj->pj_paths, pj->pj_count, sizeof(*pj->pj_paths),
+		      prewarm_junction_cmp);
+
+	/* Drop duplicates, and junctions whose locations can't be read */
+	cache_lock(&junction_lock);
+	for (i = j = 0; i < pj->pj_count; i++) {
+		char *path = pj->pj_paths[i];
+
+		if ((j > 0 && strcmp(pj->pj_paths[j - 1], path) == 0) ||
+		    stat(path, &stb) < 0 ||
+		    junction_cache_lookup(path, &stb) == NULL) {
+			free(path);
+			continue;
+		}
+		pj->pj_paths[j++] = path;
+	}
+	cache_unlock(&junction_lock);
+	pj->pj_count = j;
+
+	xlog(L_NOTICE, "pre-warm: found %u junctions below %u exports in "
+	     "%ld seconds", pj->pj_count, nroots, (long)(time(NULL) - start));
+	return pj->pj_count;
+}
+
+#else	/* !HAVE_JUNCTION_SUPPORT */
 
-	if (!dom || !path)
+static int lookup_nonexport(int f, char *buf, int buflen, char *dom, char *path,
+		struct addrinfo *UNUSED(ai))
+{
+	dump_to_cache(f, buf, buflen, dom, path, NULL, NULL, 0);
+	return 0;
+}
+
+int cache_prewarm_junctions(int UNUSED(nthreads))
+{
+	xlog(L_WARNING, "pre-warm: junction support is not compiled in");
+	return 0;
+}
+
+#endif	/* !HAVE_JUNCTION_SUPPORT */
+
+/*
+ * Paths that neither an export nor a junction was found for, per
+ * domain, so that clients probing for them (or asking again after a
+ * cache flush) don't cost a full lookup each time.  Entries go when
+ * the export table changes, and after NEG_TTL seconds, since
+ * junctions come and go without that.
+ */
+#define NEG_HASH_SIZE		1024
+#define NEG_MAX			8192
+#define NEG_TTL			15
+
+struct neg_ent {
+	struct neg_ent *	ne_next;
+	time_t			ne_expiry;
+	size_t			ne_dlen;
+	char			ne_key[];	/* domain\0path */
+};
+
+static struct neg_ent *neg_table[NEG_HASH_SIZE];
+static unsigned int neg_count;
+static unsigned int neg_gen;
+#ifdef HAVE_LIBPTHREAD
+static pthread_mutex_t neg_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static unsigned int neg_hash(const char *dom, const char *path)
+{
+	unsigned int h = 0;
+
+	while (*dom)
+		h = h * 31 + (unsigned char)*dom++;
+	while (*path)
+		h = h * 31 + (unsigned char)*path++;
+	return h % NEG_HASH_SIZE;
+}
+
+/* Drop expired entries, or all of them if @all; call with neg_lock */
+static void neg_prune(time_t now, int all)
+{
+	struct neg_ent *ne, **nep;
+	int i;
+
+	for (i = 0; i < NEG_HASH_SIZE; i++)
+		for (nep = &neg_table[i]; (ne = *nep) != NULL;) {
+			if (!all && ne->ne_expiry > now) {
+				nep = &ne->ne_next;
+				continue;
+			}
+			*nep = ne->ne_next;
+			free(ne);
+			neg_count--;
+		}
+}
+
+/* Call with neg_lock */
+static void neg_check_gen(void)
+{
+	unsigned int gen = auth_generation();
+
+	if (neg_gen == gen)
+		return;
+	neg_prune(0, 1);
+	neg_gen = gen;
+}
+
+static struct neg_ent **neg_find(unsigned int h, const char *dom,
+				 const char *path)
+{
+	size_t dlen = strlen(dom);
+	struct neg_ent *ne, **nep;
+
+	for (nep = &neg_table[h]; (ne = *nep) != NULL; nep = &ne->ne_next)
+		if (ne->ne_dlen == dlen && memcmp(ne->ne_key, dom, dlen) == 0 &&
+		    strcmp(ne->ne_key + dlen + 1, path) == 0)
+			break;
+	return nep;
+}
+
+/* Returns 1 if @path is known to be neither exported nor a junction */
+static int neg_lookup(const char *dom, const char *path)
+{
+	unsigned int h = neg_hash(dom, path);
+	struct neg_ent *ne, **nep;
+	int found = 0;
+
+	cache_lock(&neg_lock);
+	neg_check_gen();
+	nep = neg_find(h, dom, path);
+	if ((ne = *nep) != NULL) {
+		if (ne->ne_expiry > time(0))
+			found = 1;
+		else {
+			*nep = ne->ne_next;
+			free(ne);
+			neg_count--;
+		}
+	}
+	cache_unlock(&neg_lock);
+	return found;
+}
+
+static void neg_add(const char *dom, const char *path)
+{
+	unsigned int h = neg_hash(dom, path);
+	size_t dlen = strlen(dom);
+	time_t now = time(0);
+	struct neg_ent *ne;
+
+	cache_lock(&neg_lock);
+	neg_check_gen();
+	if (*neg_find(h, dom, path) != NULL)
+		goto out;
+	if (neg_count >= NEG_MAX) {
+		neg_prune(now, 0);
+		if (neg_count >= NEG_MAX)
+			goto out;
+	}
+	ne = malloc(sizeof(*ne) + dlen + strlen(path) + 2);
+	if (ne == NULL)
 		goto out;
+	ne->ne_expiry = now + NEG_TTL;
+	ne->ne_dlen = dlen;
+	memcpy(ne->ne_key, dom, dlen + 1);
+	strcpy(ne->ne_key + dlen + 1, path);
+	ne->ne_next = neg_table[h];
+	neg_table[h] = ne;
+	neg_count++;
+out:
+	cache_unlock(&neg_lock);
+}
+
+static void nfsd_export(int f, char *inbuf, int UNUSED(inlen))
+{
+	/* requests are:
+	 *  domain path
+	 * determine export options and return:
+	 *  domain path expiry flags anonuid anongid fsid
+	 */
+
+	char *dom, *path = NULL;
+	nfs_export *found = NULL;
+	struct host_addr ha;
+	struct addrinfo *ai = NULL;
+	char buf[RPC_CHAN_BUF_SIZE], *bp;
+
+	xlog(D_CALL, "nfsd_export: inbuf '%s'", inbuf);
 
-	if (qword_get(&bp, dom, blen) <= 0)
+	bp = inbuf;
+	if (qword_get_inplace(&bp, &dom) <= 0)
 		goto out;
-	if (qword_get(&bp, path, blen) <= 0)
+	if (qword_get_inplace(&bp, &path) <= 0)
 		goto out;
 
-	auth_reload();
+	cache_reload();
+
+	if (neg_lookup(dom, path)) {
+		cache_stats_miss(CSTAT_NFSD_EXPORT);
+		dump_to_cache(f, buf, sizeof(buf), dom, path, NULL, NULL, 0);
+		goto out;
+	}
 
 	if (is_ipaddr_client(dom)) {
-		ai = lookup_client_addr(dom);
+		ai = lookup_client_addr(dom, &ha);
 		if (!ai)
 			goto out;
 	}
@@ -1436,39 +3014,121 @@ static void nfsd_export(int f)
 			     "Cannot export path '%s': not a mountpoint",
 			     path);
 			dump_to_cache(f, buf, sizeof(buf), dom, path,
-				      NULL, 60);
+				      NULL, NULL, 60);
 		} else if (dump_to_cache(f, buf, sizeof(buf), dom, path,
-					 &found->m_export, 0) < 0) {
+					 &found->m_export, found->m_reply,
+					 0) < 0) {
 			xlog(L_WARNING,
 			     "Cannot export %s, possibly unsupported filesystem"
 			     " or fsid= required", path);
-			dump_to_cache(f, buf, sizeof(buf), dom, path, NULL, 0);
-		}
-	} else
-		lookup_nonexport(f, buf, sizeof(buf), dom, path, ai);
+			dump_to_cache(f, buf, sizeof(buf), dom, path, NULL,
+				      NULL, 0);
+		} else
+			cache_refresh_note(REFRESH_NFSD_EXPORT, dom, path,
+					   found->m_export.e_ttl);
+	} else {
+		cache_stats_miss(CSTAT_NFSD_EXPORT);
+		if (!lookup_nonexport(f, buf, sizeof(buf), dom, path, ai))
+			neg_add(dom, path);
+	}
 
  out:
 	xlog(D_CALL, "nfsd_export: found %p path %s", found, path ? path : NULL);
-	if (dom) free(dom);
-	if (path) free(path);
-	nfs_freeaddrinfo(ai);
 }
 
 
-struct {
+/*
+ * Upper bound on the number of upcalls drained from one channel per
+ * wakeup, so that a busy channel cannot starve the others.
+ */
+#define CACHE_BATCH_MAX 64
+
+struct cache_channel {
 	char *cache_name;
-	void (*cache_handle)(int f);
+	void (*cache_handle)(int f, char *inbuf, int inlen);
+	ssize_t (*cache_read)(int f, char *buf, size_t len);
 	int f;
+	enum cache_stat_id stat;
 } cachelist[] = {
-	{ "auth.unix.ip", auth_unix_ip, -1 },
-	{ "auth.unix.gid", auth_unix_gid, -1 },
-	{ "nfsd.export", nfsd_export, -1 },
-	{ "nfsd.fh", nfsd_fh, -1 },
-	{ NULL, NULL, -1 }
+	{ "auth.unix.ip", auth_unix_ip, cache_read_plain, -1, CSTAT_AUTH_UNIX_IP },
+	{ "auth.unix.gid", auth_unix_gid, cache_read_plain, -1, CSTAT_AUTH_UNIX_GID },
+	{ "nfsd.export", nfsd_export, cache_read, -1, CSTAT_NFSD_EXPORT },
+	{ "nfsd.fh", nfsd_fh, cache_read_plain, -1, CSTAT_NFSD_FH },
+	{ NULL, NULL, NULL, -1, CSTAT_MAX }
+};
+
+/* An upcall waiting for a worker thread */
+struct cache_req {
+	struct cache_req	*cr_next;
+	struct cache_channel	*cr_channel;
+	unsigned long long	cr_start;	/* when it was read */
+	int			cr_len;
+	struct nfstrace		cr_trace;
+	char			cr_buf[RPC_CHAN_BUF_SIZE];
 };
 
+/*
+ * Finished requests are kept for reuse, up to one batch of them, so
+ * that a busy server doesn't allocate a buffer for every upcall.
+ */
+static struct cache_req *cache_req_pool;
+static unsigned int cache_req_npool;
+#ifdef HAVE_LIBPTHREAD
+static pthread_mutex_t cache_req_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static struct cache_req *cache_req_get(void)
+{
+	struct cache_req *req;
+
+	cache_lock(&cache_req_lock);
+	req = cache_req_pool;
+	if (req) {
+		cache_req_pool = req->cr_next;
+		cache_req_npool--;
+	}
+	cache_unlock(&cache_req_lock);
+	if (req == NULL)
+		req = malloc(sizeof(*req));
+	return req;
+}
+
+static void cache_req_put(struct cache_req *req)
+{
+	cache_lock(&cache_req_lock);
+	if (cache_req_npool < CACHE_BATCH_MAX) {
+		req->cr_next = cache_req_pool;
+		cache_req_pool = req;
+		cache_req_npool++;
+		req = NULL;
+	}
+	cache_unlock(&cache_req_lock);
+	free(req);
+}
+
 extern int manage_gids;
 
+/*
+ * When a trace file is configured, every upcall read is appended to
+ * it as "timestamp channel request", the timestamp being monotonic
+ * microseconds.  tests/upcall_replay replays such a trace.
+ */
+char *cache_trace_file;
+static FILE *cache_trace_fp;
+
+static void cache_trace_open(void)
+{
+	if (!cache_trace_file || cache_trace_fp)
+		return;
+	cache_trace_fp = fopen(cache_trace_file, "a");
+	if (cache_trace_fp == NULL) {
+		xlog(L_WARNING, "Unable to open trace file %s: %m",
+		     cache_trace_file);
+		return;
+	}
+	setvbuf(cache_trace_fp, NULL, _IOLBF, 0);
+}
+
 /**
  * cache_open - prepare communications channels with kernel RPC caches
  *
@@ -1484,36 +3144,220 @@ void cache_open(void)
 		sprintf(path, "/proc/net/rpc/%s/channel", cachelist[i].cache_name);
 		cachelist[i].f = open(path, O_RDWR);
 	}
+	cache_trace_open();
 }
 
 /**
- * cache_set_fds - prepare cache file descriptors for one iteration of the service loop
- * @fdset: pointer to fd_set to prepare
+ * cache_handle_upcall - answer one upcall without a cache channel
+ * @name: name of the cache the upcall is for, e.g. "nfsd.fh"
+ * @f: descriptor to write the reply to
+ * @buf: the request, without its newline; it is modified
+ * @len: length of @buf, including the terminating NUL
+ *
+ * For replaying traces of upcalls.  The upcall is answered before
+ * this returns, even where the daemon would have waited for the name
+ * service in another thread.  Returns the upcall's cache_stat_id, or
+ * -1 if @name isn't a cache channel.
  */
-void cache_set_fds(fd_set *fdset)
+int cache_handle_upcall(const char *name, int f, char *buf, int len)
 {
 	int i;
-	for (i=0; cachelist[i].cache_name; i++) {
-		if (cachelist[i].f >= 0)
-			FD_SET(cachelist[i].f, fdset);
+
+	for (i = 0; cachelist[i].cache_name; i++)
+		if (strcmp(cachelist[i].cache_name, name) == 0)
+			break;
+	if (cachelist[i].cache_name == NULL)
+		return -1;
+
+	cache_replaying = 1;
+	cachelist[i].cache_handle(f, buf, len);
+	return cachelist[i].stat;
+}
+
+/**
+ * cache_start_workers - hand upcalls to a pool of threads
+ * @nthreads: number of worker threads
+ *
+ * Call before cache_process_loop().  All workers share one export
+ * table, which is reloaded by the event loop rather than by each
+ * worker.  Returns zero on success, or -1 if the pool could not be
+ * started, in which case upcalls are handled inline.
+ */
+int cache_start_workers(int nthreads)
+{
+#ifdef HAVE_LIBPTHREAD
+	cache_wq = xthread_workqueue_alloc_pool(nthreads);
+	if (cache_wq)
+		return 0;
+	xlog(L_ERROR, "Unable to start %d upcall worker threads", nthreads);
+#else
+	xlog(L_ERROR, "Threaded upcall processing is not supported");
+#endif
+	return -1;
+}
+
+static void cache_req_run(void *data)
+{
+	struct cache_req *req = data;
+	struct cache_channel *ch = req->cr_channel;
+
+	nfstrace_enter(&req->cr_trace);
+	export_read_lock();
+	ch->cache_handle(ch->f, req->cr_buf, req->cr_len);
+	export_read_unlock();
+	cache_stats_add(ch->stat, req->cr_start);
+	nfstrace_done();
+	cache_req_put(req);
+}
+
+/*
+ * auth.unix.gid upcalls don't look at the export table, and each can
+ * wait a long time for NSS, so they get a pool of their own whether
+ * or not the other upcalls are threaded.  gidcache_get() makes
+ * concurrent upcalls for one uid share a single lookup.
+ */
+#define CACHE_GID_THREADS	8
+
+#ifdef HAVE_LIBPTHREAD
+static struct xthread_workqueue *cache_gid_wq;
+
+static struct xthread_workqueue *cache_gid_workqueue(void)
+{
+	static int failed;
+
+	if (!cache_gid_wq && !failed) {
+		cache_gid_wq = xthread_workqueue_alloc_pool(CACHE_GID_THREADS);
+		if (!cache_gid_wq) {
+			xlog(L_WARNING, "Unable to start auth.unix.gid "
+			     "threads, handling upcalls inline");
+			failed = 1;
+		}
+	}
+	return cache_gid_wq;
+}
+#else
+#define cache_gid_workqueue()	NULL
+#endif
+
+static void cache_gid_req_run(void *data)
+{
+	struct cache_req *req = data;
+	struct cache_channel *ch = req->cr_channel;
+
+	nfstrace_enter(&req->cr_trace);
+	ch->cache_handle(ch->f, req->cr_buf, req->cr_len);
+	cache_stats_add(ch->stat, req->cr_start);
+	nfstrace_done();
+	cache_req_put(req);
+}
+
+/*
+ * Read one upcall from @ch into @buf, and start @trace for it.
+ * Returns the length of the request including its terminating NUL,
+ * zero if the channel is empty, or -1 if the request was malformed or
+ * the read failed.
+ */
+static int cache_read_req(struct cache_channel *ch, char *buf, size_t len,
+			  struct nfstrace *trace)
+{
+	int blen;
+
+	blen = ch->cache_read(ch->f, buf, len);
+	if (blen <= 0)
+		return blen;
+	if (buf[blen-1] != '\n')
+		return -1;
+	buf[blen-1] = 0;
+	if (cache_trace_fp)
+		fprintf(cache_trace_fp, "%llu %s %s\n", cache_stats_clock(),
+			ch->cache_name, buf);
+	nfstrace_read(trace, ch->cache_name, buf);
+	return blen;
+}
+
+/*
+ * A read from a cache channel returns zero once no more requests are
+ * queued for this reader, so keep handling upcalls until the channel
+ * is empty instead of going back to epoll_wait() for every one.
+ */
+static void cache_channel_event(int UNUSED(fd), void *data)
+{
+	struct cache_channel *ch = data;
+	struct xthread_workqueue *wq = cache_wq;
+	void (*run)(void *) = cache_req_run;
+	char buf[RPC_CHAN_BUF_SIZE];
+	struct cache_req *req;
+	struct nfstrace trace;
+	unsigned long long start;
+	int i, blen;
+
+	if (ch->cache_handle == auth_unix_gid) {
+		wq = cache_gid_workqueue();
+		run = cache_gid_req_run;
+	}
+
+	if (!wq) {
+		for (i = 0; i < CACHE_BATCH_MAX; i++) {
+			start = cache_stats_clock();
+			blen = cache_read_req(ch, buf, sizeof(buf), &trace);
+			if (blen == 0)
+				break;
+			if (blen > 0) {
+				nfstrace_enter(&trace);
+				ch->cache_handle(ch->f, buf, blen);
+				cache_stats_add(ch->stat, start);
+				nfstrace_done();
+			}
+		}
+		return;
+	}
+
+	if (wq == cache_wq)
+		auth_reload();
+	for (i = 0; i < CACHE_BATCH_MAX; i++) {
+		req = cache_req_get();
+		if (req == NULL) {
+			xlog(L_ERROR, "%s: no memory for upcall", __func__);
+			break;
+		}
+		req->cr_start = cache_stats_clock();
+		blen = cache_read_req(ch, req->cr_buf, sizeof(req->cr_buf),
+				      &req->cr_trace);
+		if (blen <= 0) {
+			cache_req_put(req);
+			if (blen == 0)
+				break;
+			continue;
+		}
+		req->cr_channel = ch;
+		req->cr_len = blen;
+		/* The queue is full: handle this one here */
+		if (xthread_work_queue(wq, run, req) < 0)
+			run(req);
 	}
 }
 
 /**
- * cache_process_req - process any active cache file descriptors during service loop iteration
- * @fdset: pointer to fd_set to examine for activity
+ * cache_register_events - add open cache channels to the event loop
+ *
+ * Also starts writing the statistics file, if one is configured, and
+ * refreshing entries ahead of their expiry, if that is enabled.
+ * Returns the number of channels registered.
  */
-int cache_process_req(fd_set *readfds) 
+int cache_register_events(void)
 {
 	int i;
 	int cnt = 0;
+
+	cache_stats_register();
+	cache_refresh_register();
+
 	for (i=0; cachelist[i].cache_name; i++) {
-		if (cachelist[i].f >= 0 &&
-		    FD_ISSET(cachelist[i].f, readfds)) {
+		if (cachelist[i].f < 0)
+			continue;
+		if (xepoll_add(cachelist[i].f, cache_channel_event,
+			       &cachelist[i]) == 0)
 			cnt++;
-			cachelist[i].cache_handle(cachelist[i].f);
-			FD_CLR(cachelist[i].f, readfds);
-		}
 	}
 	return cnt;
 }
@@ -1523,31 +3367,19 @@ int cache_process_req(fd_set *readfds)
  */
 void cache_process_loop(void)
 {
-	fd_set	readfds;
-	int	selret;
+	if (xepoll_init() < 0)
+		return;
 
-	FD_ZERO(&readfds);
+	cache_register_events();
+	v4clients_register_events();
 
 	for (;;) {
-
-		cache_set_fds(&readfds);
-		v4clients_set_fds(&readfds);
-
-		selret = select(FD_SETSIZE, &readfds,
-				(void *) 0, (void *) 0, (struct timeval *) 0);
-
-
-		switch (selret) {
-		case -1:
-			if (errno == EINTR || errno == ECONNREFUSED
-			 || errno == ENETUNREACH || errno == EHOSTUNREACH)
+		if (xepoll_wait(-1) < 0) {
+			if (errno == ECONNREFUSED || errno == ENETUNREACH ||
+			    errno == EHOSTUNREACH)
 				continue;
-			xlog(L_ERROR, "my_svc_run() - select: %m");
+			xlog(L_ERROR, "cache_process_loop() - epoll_wait: %m");
 			return;
-
-		default:
-			cache_process_req(&readfds);
-			v4clients_process(&readfds);
 		}
 	}
 }
@@ -1559,61 +3391,176 @@ void cache_process_loop(void)
  * % echo $domain $path $[now+DEFAULT_TTL] $options $anonuid $anongid $fsid > /proc/net/rpc/nfsd.export/channel
  */
 
-static int cache_export_ent(char *buf, int buflen, char *domain, struct exportent *exp, char *path)
+/*
+ * Downcalls that aren't replies to an upcall (cache_export() and the
+ * like) are written to a descriptor that stays open, rather than
+ * opening and closing the channel around each entry.  The channel
+ * opened by cache_open() is used when there is one.
+ *
+ * Entries can't be combined any further than that: the kernel parses
+ * exactly one entry per write() and silently ignores anything after
+ * the first newline.
+ */
+static int cache_downcall_fds[] = { -1, -1, -1, -1, -1 };
+#ifdef HAVE_LIBPTHREAD
+static pthread_mutex_t cache_downcall_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static int cache_downcall_fd(const char *cache)
 {
+	char path[100];
+	int i, f;
+
+	for (i = 0; cachelist[i].cache_name; i++)
+		if (strcmp(cachelist[i].cache_name, cache) == 0)
+			break;
+	if (!cachelist[i].cache_name)
+		return -1;
+	if (cachelist[i].f >= 0)
+		return cachelist[i].f;
+
+	cache_lock(&cache_downcall_lock);
+	f = cache_downcall_fds[i];
+	if (f < 0) {
+		sprintf(path, "/proc/net/rpc/%s/channel", cache);
+		f = open(path, O_WRONLY | O_CLOEXEC);
+		cache_downcall_fds[i] = f;
+	}
+	cache_unlock(&cache_downcall_lock);
+	return f;
+}
+
+/*
+ * Filesystems whose subvolumes have a device number of their own
+ * without being mounted, so the mount table can't show where they are.
+ */
+static int mnt_has_subvols(const struct mnttab_entry *me)
+{
+	return strcmp(me->me_type, "btrfs") == 0 ||
+	       strcmp(me->me_type, "bcachefs") == 0;
+}
+
+/* The mount seen at @dir, or NULL if @dir isn't a mount point */
+static const struct mnttab_entry *mnt_visible(const struct mnttab *mt,
+					      const char *dir)
+{
+	const struct mnttab_entry *me, *top = NULL;
+	size_t pos = MNTTAB_START;
+
+	while ((me = mnttab_next_path(mt, dir, &pos)) != NULL)
+		top = me;
+	return top;
+}
+
+/* Export each filesystem met along @path from @l, where @dev starts */
+static void crossmnt_walk_stat(int f, char *buf, int buflen, char *domain,
+			       struct exportent *exp, char *path, size_t l,
+			       dev_t dev)
+{
+	struct stat stb;
+
+	while(path[l] == '/') {
+		char c;
+		/* errors for submount should fail whole filesystem */
+		int err2;
+
+		l++;
+		while (path[l] != '/' && path[l])
+			l++;
+		c = path[l];
+		path[l] = 0;
+		err2 = nfsd_path_lstat(path, &stb);
+		path[l] = c;
+		if (err2 < 0)
+			break;
+		if (stb.st_dev == dev)
+			continue;
+		dev = stb.st_dev;
+		path[l] = 0;
+		dump_to_cache(f, buf, buflen, domain, path, exp, NULL, 0);
+		path[l] = c;
+	}
+}
+
+/*
+ * As crossmnt_walk_stat() from the export point, but finding the
+ * filesystems in the mount table instead of with a stat() of every
+ * component.  Where a filesystem with subvolumes is met, the rest of
+ * the walk is left to crossmnt_walk_stat().
+ */
+static void crossmnt_walk(int f, char *buf, int buflen, char *domain,
+			  struct exportent *exp, char *path)
+{
+	const struct mnttab_entry *top, *me;
+	size_t l, elen = strlen(exp->e_path);
+	struct mnttab *mt;
+	struct stat stb;
+	char c;
+	int err, done;
+
+	mt = mnttab_get();
+	top = mt ? mnt_visible(mt, "/") : NULL;
+	l = 0;
+	while (top && !mnt_has_subvols(top) && path[l] == '/') {
+		do
+			l++;
+		while (path[l] != '/' && path[l]);
+		c = path[l];
+		path[l] = 0;
+		me = mnt_visible(mt, path);
+		if (me && l > elen && me->me_dev != top->me_dev)
+			dump_to_cache(f, buf, buflen, domain, path, exp,
+				      NULL, 0);
+		path[l] = c;
+		if (me)
+			top = me;
+	}
+	done = top && !mnt_has_subvols(top);
+	mnttab_put(mt);
+	if (done)
+		return;
+
+	if (l < elen)
+		l = elen;
+	c = path[l];
+	path[l] = 0;
+	if (l == elen)
+		err = nfsd_path_stat(path, &stb);
+	else
+		err = nfsd_path_lstat(path, &stb);
+	path[l] = c;
+	if (err == 0)
+		crossmnt_walk_stat(f, buf, buflen, domain, exp, path, l,
+				   stb.st_dev);
+}
+
+static int cache_export_ent(char *buf, int buflen, char *domain, nfs_export *ne, char *path)
+{
+	struct exportent *exp = &ne->m_export;
 	int f, err;
 
-	f = open("/proc/net/rpc/nfsd.export/channel", O_WRONLY);
+	f = cache_downcall_fd("nfsd.export");
 	if (f < 0) return -1;
 
-	err = dump_to_cache(f, buf, buflen, domain, exp->e_path, exp, 0);
+	err = dump_to_cache(f, buf, buflen, domain, exp->e_path, exp,
+			    ne->m_reply, 0);
 	if (err) {
 		xlog(L_WARNING,
 		     "Cannot export %s, possibly unsupported filesystem or"
 		     " fsid= required", exp->e_path);
 	}
 
-	while (err == 0 && (exp->e_flags & NFSEXP_CROSSMOUNT) && path) {
-		/* really an 'if', but we can break out of
-		 * a 'while' more easily */
-		/* Look along 'path' for other filesystems
-		 * and export them with the same options
-		 */
-		struct stat stb;
+	/* Look along 'path' for other filesystems and export them
+	 * with the same options
+	 */
+	if (err == 0 && (exp->e_flags & NFSEXP_CROSSMOUNT) && path) {
 		size_t l = strlen(exp->e_path);
-		dev_t dev;
 
-		if (strlen(path) <= l || path[l] != '/' ||
-		    strncmp(exp->e_path, path, l) != 0)
-			break;
-		if (nfsd_path_stat(exp->e_path, &stb) != 0)
-			break;
-		dev = stb.st_dev;
-		while(path[l] == '/') {
-			char c;
-			/* errors for submount should fail whole filesystem */
-			int err2;
-
-			l++;
-			while (path[l] != '/' && path[l])
-				l++;
-			c = path[l];
-			path[l] = 0;
-			err2 = nfsd_path_lstat(path, &stb);
-			path[l] = c;
-			if (err2 < 0)
-				break;
-			if (stb.st_dev == dev)
-				continue;
-			dev = stb.st_dev;
-			path[l] = 0;
-			dump_to_cache(f, buf, buflen, domain, path, exp, 0);
-			path[l] = c;
-		}
-		break;
+		if (strlen(path) > l && path[l] == '/' &&
+		    strncmp(exp->e_path, path, l) == 0)
+			crossmnt_walk(f, buf, buflen, domain, exp, path);
 	}
 
-	close(f);
 	return err;
 }
 
@@ -1628,7 +3575,7 @@ int cache_export(nfs_export *exp, char *path)
 	char buf[RPC_CHAN_BUF_SIZE], *bp;
 	int blen, f;
 
-	f = open("/proc/net/rpc/auth.unix.ip/channel", O_WRONLY);
+	f = cache_downcall_fd("auth.unix.ip");
 	if (f < 0)
 		return -1;
 
@@ -1638,11 +3585,439 @@ int cache_export(nfs_export *exp, char *path)
 	qword_adduint(&bp, &blen, time(0) + exp->m_export.e_ttl);
 	qword_add(&bp, &blen, exp->m_client->m_hostname);
 	qword_addeol(&bp, &blen);
-	if (blen <= 0 || cache_write(f, buf, bp - buf) != bp - buf) blen = -1;
-	close(f);
+	if (blen <= 0 || write(f, buf, bp - buf) != bp - buf) blen = -1;
 	if (blen < 0) return -1;
 
-	return cache_export_ent(buf, sizeof(buf), exp->m_client->m_hostname, &exp->m_export, path);
+	return cache_export_ent(buf, sizeof(buf), exp->m_client->m_hostname, exp, path);
+}
+
+/*
+ * Write @re's entry again, with what it maps to now.  Returns the TTL
+ * it was given, or -1 if it should be left to lapse.
+ */
+static int cache_refresh_push(struct refresh_ent *re)
+{
+	char buf[RPC_CHAN_BUF_SIZE];
+	struct host_addr ha;
+	struct addrinfo *ai = NULL;
+	nfs_export *exp;
+	char *client, *dom, *path, *mp;
+	int f, err;
+
+	if (re->re_type == REFRESH_AUTH_UNIX_IP) {
+		ai = host_pton_buf(re->re_key, &ha);
+		/* don't wait for the name service here; an upcall will */
+		if (ai == NULL || client_needs_lookup(ai->ai_addr))
+			return -1;
+		client = auth_unix_ip_client(ai->ai_addr);
+		if (client == NULL)
+			return -1;
+		f = cache_downcall_fd("auth.unix.ip");
+		err = f < 0 ? -1 : auth_unix_ip_dump(f, re->re_key, client);
+		free(client);
+		return err < 0 ? -1 : default_ttl;
+	}
+
+	dom = re->re_key;
+	path = dom + strlen(dom) + 1;
+	if (is_ipaddr_client(dom)) {
+		ai = lookup_client_addr(dom, &ha);
+		if (ai == NULL)
+			return -1;
+	}
+	exp = lookup_export(dom, path, ai);
+	if (exp == NULL)
+		return -1;
+	mp = exp->m_export.e_mountpoint;
+	if (mp && !*mp)
+		mp = exp->m_export.e_path;
+	if (mp && !is_mountpoint(mp))
+		return -1;
+	f = cache_downcall_fd("nfsd.export");
+	if (f < 0 || dump_to_cache(f, buf, sizeof(buf), dom, path,
+				   &exp->m_export, exp->m_reply, 0) < 0)
+		return -1;
+	return exp->m_export.e_ttl;
+}
+
+static void cache_refresh_event(int UNUSED(fd), void *UNUSED(data))
+{
+	struct refresh_ent *re, **pp;
+	unsigned int pushed = 0, dropped = 0;
+	time_t now = time(0);
+	int i, ttl;
+
+	if (!refresh_count)
+		return;
+	cache_reload();
+	/* the order upcall handlers take these locks in */
+	export_read_lock();
+	cache_lock(&refresh_lock);
+	for (i = 0; i < REFRESH_HASH_SIZE; i++)
+		for (pp = &refresh_table[i]; (re = *pp) != NULL;) {
+			if (re->re_due > now) {
+				pp = &re->re_next;
+				continue;
+			}
+			ttl = re->re_left ? cache_refresh_push(re) : -1;
+			if (ttl > 0 && (re->re_due = refresh_due(now, ttl))) {
+				re->re_ttl = ttl;
+				re->re_left--;
+				pushed++;
+				pp = &re->re_next;
+				continue;
+			}
+			*pp = re->re_next;
+			free(re);
+			refresh_count--;
+			dropped++;
+		}
+	cache_unlock(&refresh_lock);
+	export_read_unlock();
+	if (pushed || dropped)
+		xlog(D_CALL, "refresh-ahead: %u entries written again, "
+		     "%u left to lapse", pushed, dropped);
+}
+
+static void cache_refresh_register(void)
+{
+	if (cache_refresh_ahead <= 0)
+		return;
+	srandom(time(0) ^ getpid());
+	if (xepoll_add_timer(REFRESH_TICK * 1000, cache_refresh_event,
+			     NULL) < 0)
+		xlog(L_WARNING, "Unable to start refresh-ahead timer: %m");
+}
+
+/*
+ * Pre-warming: push auth.unix.ip and nfsd.export entries for the
+ * clients recorded in rmtab before nfsd starts taking requests, so
+ * that the first requests after a restart don't all wait for upcalls.
+ */
+
+/* Seconds between progress reports */
+#define PREWARM_REPORT_INTERVAL	5
+
+struct prewarm_ent {
+	char *			pw_client;
+	char *			pw_path;
+};
+
+struct prewarm_state {
+	struct prewarm_ent *	ps_ents;
+	unsigned int		ps_count;
+	unsigned int		ps_next;	/* first unclaimed entry */
+	unsigned int		ps_done;
+	unsigned int		ps_clients;
+	unsigned int		ps_pushed;
+	time_t			ps_report;
+#ifdef HAVE_LIBPTHREAD
+	pthread_mutex_t		ps_lock;
+#endif
+};
+
+static int prewarm_cmp(const void *a, const void *b)
+{
+	const struct prewarm_ent *pa = a, *pb = b;
+
+	return strcmp(pa->pw_client, pb->pw_client);
+}
+
+static void prewarm_free(struct prewarm_ent *ents, unsigned int count)
+{
+	unsigned int i;
+
+	for (i = 0; i < count; i++) {
+		free(ents[i].pw_client);
+		free(ents[i].pw_path);
+	}
+	free(ents);
+}
+
+/*
+ * Read @fname into an array sorted by client, so that each client's
+ * entries can be handled together.  Returns the number of entries.
+ */
+static int prewarm_read_rmtab(const char *fname, struct prewarm_ent **entsp)
+{
+	struct prewarm_ent *ents = NULL, *new;
+	struct rmtabent *rep;
+	unsigned int count = 0, size = 0;
+	FILE *fp;
+
+	fp = fsetrmtabent((char *)fname, "r");
+	if (fp == NULL)
+		return -1;
+	while ((rep = fgetrmtabent(fp, 1, NULL)) != NULL) {
+		if (count == size) {
+			size = size ? size * 2 : 64;
+			new = realloc(ents, size * sizeof(*ents));
+			if (new == NULL)
+				break;
+			ents = new;
+		}
+		ents[count].pw_client = strdup(rep->r_client);
+		ents[count].pw_path = strdup(rep->r_path);
+		if (!ents[count].pw_client || !ents[count].pw_path) {
+			free(ents[count].pw_client);
+			free(ents[count].pw_path);
+			break;
+		}
+		count++;
+	}
+	fendrmtabent(fp);
+
+	if (count)
+		qsort(ents, count, sizeof(*ents), prewarm_cmp);
+	*entsp = ents;
+	return count;
+}
+
+#ifdef HAVE_JUNCTION_SUPPORT
+/*
+ * Push nfsd.export entries for @dom for the junctions below @exp.
+ * Returns the number pushed.
+ */
+static int prewarm_junctions_push(char *dom, nfs_export *exp,
+				  struct addrinfo *ai)
+{
+	struct prewarm_junctions *pj = &prewarm_junctions;
+	char buf[RPC_CHAN_BUF_SIZE];
+	const char *root = exp->m_export.e_path;
+	size_t len = strlen(root);
+	unsigned int lo = 0, hi = pj->pj_count;
+	struct exportent *eep;
+	int f, pushed = 0;
+	char *path;
+
+	if (pj->pj_count == 0)
+		return 0;
+	f = cache_downcall_fd("nfsd.export");
+	if (f < 0)
+		return 0;
+
+	while (lo < hi) {
+		unsigned int mid = lo + (hi - lo) / 2;
+
+		if (strcmp(pj->pj_paths[mid], root) <= 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	for (; lo < pj->pj_count; lo++) {
+		path = pj->pj_paths[lo];
+		if (strncmp(path, root, len) != 0)
+			break;
+		if (len > 1 && path[len] != '/')
+			continue;
+		if (lookup_export(dom, path, ai) != NULL)
+			continue;
+
+		cache_lock(&junction_lock);
+		eep = lookup_junction(dom, path, ai);
+		cache_unlock(&junction_lock);
+		if (eep == NULL)
+			continue;
+		if (dump_to_cache(f, buf, sizeof(buf), dom, path, eep,
+				  NULL, 0) == 0)
+			pushed++;
+		exportent_release(eep);
+		free(eep);
+	}
+	return pushed;
+}
+#endif
+
+/*
+ * Push entries for one address of a client.  Returns the number of
+ * exports written to the kernel.
+ */
+static int prewarm_addr(const struct sockaddr *sap, struct prewarm_ent *ents,
+			unsigned int count)
+{
+	char ipaddr[INET6_ADDRSTRLEN];
+	char ipdom[INET6_ADDRSTRLEN + 2];
+	char buf[RPC_CHAN_BUF_SIZE];
+	struct host_addr ha;
+	struct addrinfo *ai = NULL;
+	nfs_export *exp;
+	char *client, *dom, *mp;
+	unsigned int i;
+	int f, pushed = 0;
+
+	if (host_ntop(sap, ipaddr, sizeof(ipaddr)) == NULL)
+		return 0;
+	client = auth_unix_ip_client(sap);
+	if (client == NULL) {
+		xlog(D_AUTH, "pre-warm: no client matches %s", ipaddr);
+		return 0;
+	}
+
+	if (!*client) {
+		free(client);
+		client = strdup("DEFAULT");
+		if (client == NULL)
+			return 0;
+	}
+
+	f = cache_downcall_fd("auth.unix.ip");
+	if (f < 0 || auth_unix_ip_dump(f, ipaddr, client) < 0)
+		goto out;
+
+	dom = client;
+	if (use_ipaddr) {
+		snprintf(ipdom, sizeof(ipdom), "$%s", ipaddr);
+		dom = ipdom;
+		ai = lookup_client_addr(dom, &ha);
+		if (ai == NULL)
+			goto out;
+	}
+
+	for (i = 0; i < count; i++) {
+		exp = lookup_export(dom, ents[i].pw_path, ai);
+		if (exp == NULL)
+			continue;
+		mp = exp->m_export.e_mountpoint;
+		if (mp && !*mp)
+			mp = exp->m_export.e_path;
+		if (mp && !is_mountpoint(mp))
+			continue;
+		if (cache_export_ent(buf, sizeof(buf), dom, exp,
+				     ents[i].pw_path) == 0)
+			pushed++;
+#ifdef HAVE_JUNCTION_SUPPORT
+		pushed += prewarm_junctions_push(dom, exp, ai);
+#endif
+	}
+out:
+	free(client);
+	return pushed;
+}
+
+/* Push entries for @count rmtab entries that share a client name */
+static int prewarm_client(struct prewarm_ent *ents, unsigned int count)
+{
+	struct addrinfo *ai, *a;
+	int pushed = 0;
+
+	ai = host_pton(ents[0].pw_client);
+	if (ai == NULL)
+		ai = host_addrinfo(ents[0].pw_client);
+	if (ai == NULL) {
+		xlog(D_GENERAL, "pre-warm: can't resolve %s",
+		     ents[0].pw_client);
+		return 0;
+	}
+	for (a = ai; a; a = a->ai_next)
+		pushed += prewarm_addr(a->ai_addr, ents, count);
+	nfs_freeaddrinfo(ai);
+	return pushed;
+}
+
+static void *prewarm_worker(void *data)
+{
+	struct prewarm_state *ps = data;
+	unsigned int start, end;
+	time_t now;
+	int pushed;
+
+	for (;;) {
+		cache_lock(&ps->ps_lock);
+		start = end = ps->ps_next;
+		if (start < ps->ps_count) {
+			while (++end < ps->ps_count &&
+			       !strcmp(ps->ps_ents[end].pw_client,
+				       ps->ps_ents[start].pw_client))
+				;
+			ps->ps_next = end;
+		}
+		cache_unlock(&ps->ps_lock);
+		if (start == end)
+			break;
+
+		export_read_lock();
+		pushed = prewarm_client(&ps->ps_ents[start], end - start);
+		export_read_unlock();
+
+		cache_lock(&ps->ps_lock);
+		ps->ps_done += end - start;
+		ps->ps_clients++;
+		ps->ps_pushed += pushed;
+		now = time(NULL);
+		if (now >= ps->ps_report + PREWARM_REPORT_INTERVAL &&
+		    ps->ps_done < ps->ps_count) {
+			xlog(L_NOTICE, "pre-warm: %u of %u rmtab entries done",
+			     ps->ps_done, ps->ps_count);
+			ps->ps_report = now;
+		}
+		cache_unlock(&ps->ps_lock);
+	}
+	return NULL;
+}
+
+/**
+ * cache_prewarm - push cache entries for previously connected clients
+ * @fname: rmtab file listing the clients and the paths they mounted
+ * @nthreads: number of threads to use
+ *
+ * Meant to be called once at startup, before upcall workers are
+ * started.  Progress is logged every few seconds.  Returns the number
+ * of export entries written to the kernel, or -1 if the kernel's
+ * caches are not available.
+ */
+int cache_prewarm(const char *fname, int nthreads)
+{
+	struct prewarm_state ps;
+	time_t start = time(NULL);
+	int count;
+#ifdef HAVE_LIBPTHREAD
+	pthread_t *threads;
+	int i, started = 0;
+#endif
+
+	if (cache_downcall_fd("auth.unix.ip") < 0 ||
+	    cache_downcall_fd("nfsd.export") < 0) {
+		xlog(L_WARNING, "pre-warm: kernel export caches unavailable");
+		return -1;
+	}
+
+	memset(&ps, 0, sizeof(ps));
+	count = prewarm_read_rmtab(fname, &ps.ps_ents);
+	if (count <= 0)
+		return 0;
+	ps.ps_count = count;
+	ps.ps_report = start;
+
+	auth_reload();
+	xlog(L_NOTICE, "pre-warm: pushing exports for %u rmtab entries",
+	     ps.ps_count);
+
+#ifdef HAVE_LIBPTHREAD
+	pthread_mutex_init(&ps.ps_lock, NULL);
+	threads = nthreads > 1 ? calloc(nthreads - 1, sizeof(*threads)) : NULL;
+	for (i = 0; threads && i < nthreads - 1; i++) {
+		if (pthread_create(&threads[i], NULL, prewarm_worker, &ps) != 0)
+			break;
+		started++;
+	}
+	prewarm_worker(&ps);
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+	pthread_mutex_destroy(&ps.ps_lock);
+#else
+	(void)nthreads;
+	prewarm_worker(&ps);
+#endif
+
+	xlog(L_NOTICE, "pre-warm: pushed %u exports for %u clients in %ld "
+	     "seconds", ps.ps_pushed, ps.ps_clients,
+	     (long)(time(NULL) - start));
+	prewarm_free(ps.ps_ents, ps.ps_count);
+#ifdef HAVE_JUNCTION_SUPPORT
+	prewarm_junctions_free();
+#endif
+	return ps.ps_pushed;
 }
 
 /**
@@ -1661,7 +4036,7 @@ int cache_export(nfs_export *exp, char *path)
 struct nfs_fh_len *
 cache_get_filehandle(nfs_export *exp, int len, char *p)
 {
-	static struct nfs_fh_len fh;
+	static __thread struct nfs_fh_len fh;
 	char buf[RPC_CHAN_BUF_SIZE], *bp;
 	int blen, f;
 
@@ -1681,7 +4056,7 @@ cache_get_filehandle(nfs_export *exp, int len, char *p)
 		return NULL;
 	}
 	bp = buf;
-	blen = cache_read(f, buf, sizeof(buf));
+	blen = cache_read_plain(f, buf, sizeof(buf));
 	close(f);
 
 	if (blen <= 0 || buf[blen-1] != '\n')
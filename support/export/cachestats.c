@@ -0,0 +1,222 @@
+/*
+ * support/export/cachestats.c
+ *
+ * Statistics about upcalls on the kernel's cache channels.
+ *
+ * Each entry counts calls, the calls answered negatively, and their
+ * latency in a histogram of power-of-two buckets.  The cache channel
+ * handlers in cache.c update one entry per channel, and the lookups
+ * that upcalls can wait for time themselves.  Counters are updated
+ * with relaxed atomic operations, so they are cheap enough to keep
+ * all the time; a reader of the statistics file sees each counter
+ * exact, but not all of them from the same instant.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <limits.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "nfslib.h"
+#include "exportfs.h"
+#include "export.h"
+#include "xepoll.h"
+#include "xlog.h"
+#include "nfsmetrics.h"
+#include "nfstrace.h"
+
+#define CACHE_STAT_BUCKETS	24	/* < 1us ... < 2^22us, and the rest */
+
+struct cache_stat {
+	const char *		cs_name;
+	unsigned long		cs_calls;
+	unsigned long		cs_misses;
+	unsigned long		cs_usecs;
+	unsigned long		cs_max;
+	unsigned long		cs_hist[CACHE_STAT_BUCKETS];
+	struct nfsmetric *	cs_metric;
+	struct nfsmetric *	cs_miss_metric;
+};
+
+static struct cache_stat cache_stats[CSTAT_MAX] = {
+	[CSTAT_AUTH_UNIX_IP]	= { .cs_name = "auth.unix.ip" },
+	[CSTAT_AUTH_UNIX_GID]	= { .cs_name = "auth.unix.gid" },
+	[CSTAT_NFSD_EXPORT]	= { .cs_name = "nfsd.export" },
+	[CSTAT_NFSD_FH]		= { .cs_name = "nfsd.fh" },
+	[CSTAT_DNS]		= { .cs_name = "dns" },
+	[CSTAT_NSS]		= { .cs_name = "nss" },
+	[CSTAT_BLKID]		= { .cs_name = "blkid" },
+	[CSTAT_RELOAD]		= { .cs_name = "reload" },
+	[CSTAT_MOUNT]		= { .cs_name = "mount" },
+};
+
+#define cache_stat_inc(p, n)	__atomic_fetch_add((p), (n), __ATOMIC_RELAXED)
+
+char *cache_stats_file;
+int cache_stats_interval = CACHE_STATS_INTERVAL;
+static int cache_stats_id = -1;
+
+/* Returns a monotonic time stamp, in microseconds, for cache_stats_add() */
+unsigned long long cache_stats_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/* Count one call of @id that started at @start */
+void cache_stats_add(enum cache_stat_id id, unsigned long long start)
+{
+	struct cache_stat *cs = &cache_stats[id];
+	unsigned long usecs = cache_stats_clock() - start;
+	unsigned long max;
+	int bucket;
+
+	bucket = usecs ? 64 - __builtin_clzll(usecs) : 0;
+	if (bucket >= CACHE_STAT_BUCKETS)
+		bucket = CACHE_STAT_BUCKETS - 1;
+
+	cache_stat_inc(&cs->cs_calls, 1);
+	cache_stat_inc(&cs->cs_usecs, usecs);
+	cache_stat_inc(&cs->cs_hist[bucket], 1);
+	max = __atomic_load_n(&cs->cs_max, __ATOMIC_RELAXED);
+	while (usecs > max &&
+	       !__atomic_compare_exchange_n(&cs->cs_max, &max, usecs, 1,
+					    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+	nfsmetric_observe(cs->cs_metric, usecs);
+
+	/* Waits on outside services also count against the upcall */
+	switch (id) {
+	case CSTAT_DNS:
+		nfstrace_dep(NFSTRACE_DNS, usecs);
+		break;
+	case CSTAT_NSS:
+		nfstrace_dep(NFSTRACE_NSS, usecs);
+		break;
+	case CSTAT_BLKID:
+		nfstrace_dep(NFSTRACE_BLKID, usecs);
+		break;
+	default:
+		break;
+	}
+}
+
+/* Count a call of @id that found nothing: no client or export matched */
+void cache_stats_miss(enum cache_stat_id id)
+{
+	cache_stat_inc(&cache_stats[id].cs_misses, 1);
+	nfsmetric_add(cache_stats[id].cs_miss_metric, 1);
+}
+
+/* Make the statistics available through nfsmetrics(8) as well */
+static void cache_stats_metrics(void)
+{
+	char name[64], help[128];
+	struct cache_stat *cs;
+	char *p;
+	int i;
+
+	for (i = 0; i < CSTAT_MAX; i++) {
+		cs = &cache_stats[i];
+		snprintf(name, sizeof(name), "cache_%s", cs->cs_name);
+		for (p = name; *p; p++)
+			if (*p == '.')
+				*p = '_';
+		snprintf(help, sizeof(help), "Time taken by %s calls, in us",
+			 cs->cs_name);
+		cs->cs_metric = nfsmetric_histogram(name, help);
+		strcat(name, "_misses");
+		snprintf(help, sizeof(help),
+			 "%s calls that matched no client or export",
+			 cs->cs_name);
+		cs->cs_miss_metric = nfsmetric_counter(name, help);
+	}
+}
+
+/**
+ * cache_stats_worker - give this process its own statistics file
+ * @id: worker number
+ *
+ * Called in each worker process of a daemon that forked several, so
+ * that they don't overwrite each other's statistics: worker @id
+ * writes to the file name with ".@id" appended.
+ */
+void cache_stats_worker(int id)
+{
+	cache_stats_id = id;
+}
+
+static void cache_stats_write(void)
+{
+	char path[PATH_MAX], tmp[PATH_MAX + 4];
+	struct cache_stat *cs;
+	FILE *fp;
+	int i, j;
+
+	if (cache_stats_id < 0)
+		snprintf(path, sizeof(path), "%s", cache_stats_file);
+	else
+		snprintf(path, sizeof(path), "%s.%d", cache_stats_file,
+			 cache_stats_id);
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+	fp = fopen(tmp, "w");
+	if (fp == NULL) {
+		xlog(L_WARNING, "Unable to write %s: %m", tmp);
+		return;
+	}
+	fprintf(fp, "# name calls misses total_us max_us, then the number\n"
+		    "# of calls that took less than 1, 2, 4 ... %u us, and longer\n",
+		1U << (CACHE_STAT_BUCKETS - 2));
+	for (i = 0; i < CSTAT_MAX; i++) {
+		cs = &cache_stats[i];
+		fprintf(fp, "%s %lu %lu %lu %lu", cs->cs_name,
+			__atomic_load_n(&cs->cs_calls, __ATOMIC_RELAXED),
+			__atomic_load_n(&cs->cs_misses, __ATOMIC_RELAXED),
+			__atomic_load_n(&cs->cs_usecs, __ATOMIC_RELAXED),
+			__atomic_load_n(&cs->cs_max, __ATOMIC_RELAXED));
+		for (j = 0; j < CACHE_STAT_BUCKETS; j++)
+			fprintf(fp, " %lu", __atomic_load_n(&cs->cs_hist[j],
+							    __ATOMIC_RELAXED));
+		fputc('\n', fp);
+	}
+	if (fclose(fp) != 0 || rename(tmp, path) != 0) {
+		xlog(L_WARNING, "Unable to write %s: %m", path);
+		unlink(tmp);
+	}
+}
+
+static void cache_stats_event(int UNUSED(fd), void *UNUSED(data))
+{
+	cache_stats_write();
+}
+
+/*
+ * Write the statistics file now and every cache_stats_interval
+ * seconds after, if one is configured.
+ */
+int cache_stats_register(void)
+{
+	cache_stats_metrics();
+	if (cache_stats_file == NULL || *cache_stats_file == '\0')
+		return 0;
+	if (cache_stats_interval < 1)
+		cache_stats_interval = 1;
+
+	if (xepoll_add_timer(cache_stats_interval * 1000,
+			     cache_stats_event, NULL) < 0) {
+		xlog(L_WARNING, "Unable to start statistics timer: %m");
+		return -1;
+	}
+	cache_stats_write();
+	return 0;
+}
@@ -18,23 +18,28 @@
 #include <ctype.h>
 #include <netdb.h>
 #include <errno.h>
+#include <time.h>
+#ifdef HAVE_LIBPTHREAD
+#include <pthread.h>
+#endif
 
 #include "sockaddr.h"
 #include "misc.h"
 #include "nfslib.h"
 #include "exportfs.h"
-
-/* netgroup stuff never seems to be defined in any header file. Linux is
- * not alone in this.
- */
-#if !defined(__GLIBC__) || __GLIBC__ < 2
-extern int	innetgr(char *netgr, char *host, char *, char *);
-#endif
+#include "workqueue.h"
+#include "xmalloc.h"
+#include "xlog.h"
 
 static char	*add_name(char *old, const char *add);
 
 nfs_client	*clientlist[MCL_MAXTYPES] = { NULL, };
 
+/* Bumped whenever the MCL_SUBNETWORK list changes */
+static unsigned int	subnet_gen;
+/* Bumped whenever any client list changes */
+static unsigned int	client_gen;
+
 
 static void
 init_addrlist(nfs_client *clp, const struct addrinfo *ai)
@@ -55,6 +60,9 @@ init_addrlist(nfs_client *clp, const struct addrinfo *ai)
 static void
 client_free(nfs_client *clp)
 {
+	client_gen++;
+	if (clp->m_type == MCL_SUBNETWORK)
+		subnet_gen++;
 	free(clp->m_hostname);
 	free(clp);
 }
@@ -255,6 +263,106 @@ client_add(nfs_client *clp)
 		cpp = &((*cpp)->m_next);
 	clp->m_next = NULL;
 	*cpp = clp;
+	client_gen++;
+	if (clp->m_type == MCL_SUBNETWORK)
+		subnet_gen++;
+}
+
+/*
+ * FQDN client names resolved by client_prefetch(), sorted by name, for
+ * client_lookup() to use until client_prefetch_done().
+ */
+struct client_prefetched {
+	char *			cp_name;
+	struct addrinfo *	cp_ai;		/* NULL if it didn't resolve */
+};
+
+static struct client_prefetched	*prefetched;
+static int			nprefetched;
+
+/* Threads client_prefetch() resolves names on */
+int client_prefetch_threads = CLIENT_PREFETCH_THREADS;
+
+static int client_prefetched_cmp(const void *a, const void *b)
+{
+	const struct client_prefetched *pa = a, *pb = b;
+
+	return strcmp(pa->cp_name, pb->cp_name);
+}
+
+static void client_prefetch_one(void *data, int i)
+{
+	struct client_prefetched *cp = (struct client_prefetched *)data + i;
+
+	cp->cp_ai = host_addrinfo(cp->cp_name);
+}
+
+/**
+ * client_prefetch - resolve many FQDN client names at once
+ * @names: client names as they appear in the exports
+ * @n: number of names
+ *
+ * The distinct FQDN names among @names are looked up on
+ * client_prefetch_threads threads, so that client_lookup() of each
+ * name doesn't wait for the name service in turn.  The results are
+ * used until client_prefetch_done() is called.
+ */
+void
+client_prefetch(char **names, int n)
+{
+	int i, j;
+
+	client_prefetch_done();
+	prefetched = xmalloc((n ? n : 1) * sizeof(*prefetched));
+	for (i = 0; i < n; i++) {
+		if (client_gettype(names[i]) != MCL_FQDN)
+			continue;
+		prefetched[nprefetched].cp_name = names[i];
+		prefetched[nprefetched].cp_ai = NULL;
+		nprefetched++;
+	}
+	qsort(prefetched, nprefetched, sizeof(*prefetched),
+	      client_prefetched_cmp);
+	for (i = j = 0; i < nprefetched; i++)
+		if (j == 0 || strcmp(prefetched[j - 1].cp_name,
+				     prefetched[i].cp_name) != 0)
+			prefetched[j++] = prefetched[i];
+	nprefetched = j;
+	for (i = 0; i < nprefetched; i++)
+		prefetched[i].cp_name = xstrdup(prefetched[i].cp_name);
+
+	xthread_work_run_each(client_prefetch_threads, client_prefetch_one,
+			      prefetched, nprefetched);
+	xlog(D_GENERAL, "Resolved %d client names on %d threads",
+	     nprefetched, client_prefetch_threads);
+}
+
+/**
+ * client_prefetch_done - forget the names resolved by client_prefetch()
+ */
+void
+client_prefetch_done(void)
+{
+	int i;
+
+	for (i = 0; i < nprefetched; i++) {
+		free(prefetched[i].cp_name);
+		nfs_freeaddrinfo(prefetched[i].cp_ai);
+	}
+	free(prefetched);
+	prefetched = NULL;
+	nprefetched = 0;
+}
+
+static struct client_prefetched *
+client_prefetched_find(char *hname)
+{
+	struct client_prefetched key = { .cp_name = hname };
+
+	if (nprefetched == 0)
+		return NULL;
+	return bsearch(&key, prefetched, nprefetched, sizeof(*prefetched),
+		       client_prefetched_cmp);
 }
 
 /**
@@ -271,11 +379,14 @@ client_lookup(char *hname, int canonical)
 	nfs_client	*clp = NULL;
 	int		htype;
 	struct addrinfo	*ai = NULL;
+	struct client_prefetched *cp = NULL;
 
 	htype = client_gettype(hname);
 
 	if (htype == MCL_FQDN && !canonical) {
-		ai = host_addrinfo(hname);
+		/* a prefetched result stays owned by the prefetch table */
+		cp = client_prefetched_find(hname);
+		ai = cp ? cp->cp_ai : host_addrinfo(hname);
 		if (!ai) {
 			xlog(L_WARNING, "Failed to resolve %s", hname);
 			goto out;
@@ -309,7 +420,8 @@ client_lookup(char *hname, int canonical)
 		init_addrlist(clp, ai);
 
 out:
-	nfs_freeaddrinfo(ai);
+	if (cp == NULL)
+		nfs_freeaddrinfo(ai);
 	return clp;
 }
 
@@ -373,6 +485,294 @@ client_freeall(void)
 	}
 }
 
+/**
+ * client_freeunused - deallocate nfs_client records no export refers to
+ *
+ */
+void
+client_freeunused(void)
+{
+	nfs_client	*clp, **cpp;
+	int		i;
+
+	for (i = 0; i < MCL_MAXTYPES; i++) {
+		cpp = clientlist + i;
+		while ((clp = *cpp) != NULL) {
+			if (clp->m_count > 0) {
+				cpp = &clp->m_next;
+				continue;
+			}
+			*cpp = clp->m_next;
+			client_free(clp);
+		}
+	}
+}
+
+/*
+ * Subnetwork clients are also indexed in a path-compressed binary
+ * trie (one per address family) keyed by network prefix, so that
+ * client_compose() finds every subnet containing an address in one
+ * walk from the root instead of checking each subnet client in turn.
+ * Clients whose netmask isn't a prefix stay on a short list that is
+ * still scanned.  The index is rebuilt by client_subnet_index() when
+ * the export table is loaded; until then the plain scan is used.
+ */
+struct subnet_node {
+	struct subnet_node *	sn_child[2];
+	unsigned char		sn_key[16];	/* masked to sn_plen bits */
+	unsigned int		sn_plen;
+	nfs_client **		sn_clients;	/* exactly this prefix */
+	unsigned int		sn_nclients;
+};
+
+static struct subnet_index {
+	struct subnet_node *	si_root[2];	/* IPv4, IPv6 */
+	nfs_client **		si_other;	/* non-prefix netmasks */
+	unsigned int		si_nother;
+	unsigned int		si_nodes;
+	unsigned int		si_gen;
+	int			si_valid;
+} subnet_index;
+
+/* Address bytes and length in bits of @sap, or 0 if not indexable */
+static unsigned int
+subnet_key(const struct sockaddr *sap, const unsigned char **key, int *fam)
+{
+	switch (sap->sa_family) {
+	case AF_INET:
+		*key = (const unsigned char *)
+			&((const struct sockaddr_in *)sap)->sin_addr;
+		*fam = 0;
+		return 32;
+#ifdef IPV6_SUPPORTED
+	case AF_INET6:
+		*key = ((const struct sockaddr_in6 *)sap)->sin6_addr.s6_addr;
+		*fam = 1;
+		return 128;
+#endif
+	}
+	return 0;
+}
+
+static inline int
+subnet_bit(const unsigned char *key, unsigned int i)
+{
+	return (key[i >> 3] >> (7 - (i & 7))) & 1;
+}
+
+/* Number of leading bits, up to @max, that @a and @b have in common */
+static unsigned int
+subnet_common(const unsigned char *a, const unsigned char *b,
+	      unsigned int max)
+{
+	unsigned int i = 0;
+
+	while (i + 8 <= max && a[i >> 3] == b[i >> 3])
+		i += 8;
+	while (i < max && subnet_bit(a, i) == subnet_bit(b, i))
+		i++;
+	return i;
+}
+
+static struct subnet_node *
+subnet_node_new(const unsigned char *key, unsigned int plen,
+		unsigned int bits)
+{
+	struct subnet_node *sn;
+	unsigned int i;
+
+	sn = calloc(1, sizeof(*sn));
+	if (sn == NULL)
+		return NULL;
+	memcpy(sn->sn_key, key, bits >> 3);
+	for (i = plen; i < bits; i++)
+		sn->sn_key[i >> 3] &= ~(1 << (7 - (i & 7)));
+	sn->sn_plen = plen;
+	subnet_index.si_nodes++;
+	return sn;
+}
+
+static int
+subnet_node_add_client(struct subnet_node *sn, nfs_client *clp)
+{
+	nfs_client **new;
+
+	new = realloc(sn->sn_clients, (sn->sn_nclients + 1) * sizeof(*new));
+	if (new == NULL)
+		return -1;
+	new[sn->sn_nclients++] = clp;
+	sn->sn_clients = new;
+	return 0;
+}
+
+static int
+subnet_insert(struct subnet_node **np, const unsigned char *key,
+	      unsigned int plen, unsigned int bits, nfs_client *clp)
+{
+	struct subnet_node *sn, *new, *glue;
+	unsigned int common;
+
+	while ((sn = *np) != NULL) {
+		common = subnet_common(sn->sn_key, key,
+				       plen < sn->sn_plen ? plen : sn->sn_plen);
+		if (common == sn->sn_plen) {
+			if (sn->sn_plen == plen)
+				return subnet_node_add_client(sn, clp);
+			np = &sn->sn_child[subnet_bit(key, sn->sn_plen)];
+			continue;
+		}
+
+		/* @key diverges from this node's prefix, or is a
+		 * shorter prefix of it */
+		new = subnet_node_new(key, plen, bits);
+		if (new == NULL || subnet_node_add_client(new, clp) < 0)
+			goto out_nomem;
+		if (common == plen) {
+			new->sn_child[subnet_bit(sn->sn_key, plen)] = sn;
+			*np = new;
+			return 0;
+		}
+		glue = subnet_node_new(key, common, bits);
+		if (glue == NULL)
+			goto out_nomem;
+		glue->sn_child[subnet_bit(key, common)] = new;
+		glue->sn_child[subnet_bit(sn->sn_key, common)] = sn;
+		*np = glue;
+		return 0;
+	}
+
+	new = subnet_node_new(key, plen, bits);
+	if (new == NULL || subnet_node_add_client(new, clp) < 0)
+		goto out_nomem;
+	*np = new;
+	return 0;
+
+out_nomem:
+	if (new) {
+		free(new->sn_clients);
+		free(new);
+	}
+	return -1;
+}
+
+static void
+subnet_free(struct subnet_node *sn)
+{
+	if (sn == NULL)
+		return;
+	subnet_free(sn->sn_child[0]);
+	subnet_free(sn->sn_child[1]);
+	free(sn->sn_clients);
+	free(sn);
+}
+
+/* Length of the prefix described by @mask, or -1 if it isn't one */
+static int
+subnet_prefixlen(const unsigned char *mask, unsigned int bits)
+{
+	unsigned int plen = 0, i;
+
+	while (plen < bits && subnet_bit(mask, plen))
+		plen++;
+	for (i = plen; i < bits; i++)
+		if (subnet_bit(mask, i))
+			return -1;
+	return plen;
+}
+
+static int
+subnet_index_add(nfs_client *clp)
+{
+	struct subnet_index *si = &subnet_index;
+	const unsigned char *key, *mask;
+	unsigned int bits;
+	nfs_client **new;
+	int fam, plen;
+
+	bits = subnet_key(get_addrlist(clp, 0), &key, &fam);
+	if (bits == 0)
+		return 0;
+	plen = -1;
+	if (subnet_key(get_addrlist(clp, 1), &mask, &fam) == bits)
+		plen = subnet_prefixlen(mask, bits);
+	if (plen >= 0)
+		return subnet_insert(&si->si_root[fam], key, plen, bits, clp);
+
+	new = realloc(si->si_other, (si->si_nother + 1) * sizeof(*new));
+	if (new == NULL)
+		return -1;
+	new[si->si_nother++] = clp;
+	si->si_other = new;
+	return 0;
+}
+
+/**
+ * client_subnet_index - index the current subnetwork clients
+ *
+ * Call after the client list has been built or changed.
+ */
+void
+client_subnet_index(void)
+{
+	struct subnet_index *si = &subnet_index;
+	unsigned int nclients = 0;
+	nfs_client *clp;
+
+	subnet_free(si->si_root[0]);
+	subnet_free(si->si_root[1]);
+	free(si->si_other);
+	memset(si, 0, sizeof(*si));
+
+	for (clp = clientlist[MCL_SUBNETWORK]; clp; clp = clp->m_next) {
+		if (subnet_index_add(clp) < 0) {
+			xlog(L_WARNING, "%s: no memory, subnets will be "
+			     "scanned", __func__);
+			return;
+		}
+		nclients++;
+	}
+	si->si_gen = subnet_gen;
+	si->si_valid = 1;
+	xlog(D_GENERAL, "subnet index: %u clients, %u nodes, %u unindexed",
+	     nclients, si->si_nodes, si->si_nother);
+}
+
+/*
+ * Add the names of all subnetwork clients matching @ai to *@name.
+ * Returns -1 if the index can't be used, in which case the caller
+ * checks each client instead.
+ */
+static int
+client_subnet_compose(const struct addrinfo *ai, char **name)
+{
+	struct subnet_index *si = &subnet_index;
+	const unsigned char *key;
+	struct subnet_node *sn;
+	unsigned int bits, i;
+	int fam;
+
+	/* Each client must be added only once */
+	if (!si->si_valid || si->si_gen != subnet_gen || ai->ai_next)
+		return -1;
+
+	bits = subnet_key(ai->ai_addr, &key, &fam);
+	if (bits == 0)
+		return 0;
+	for (sn = si->si_root[fam]; sn; ) {
+		if (subnet_common(sn->sn_key, key, sn->sn_plen) < sn->sn_plen)
+			break;
+		for (i = 0; i < sn->sn_nclients; i++)
+			*name = add_name(*name, sn->sn_clients[i]->m_hostname);
+		if (sn->sn_plen == bits)
+			break;
+		sn = sn->sn_child[subnet_bit(key, sn->sn_plen)];
+	}
+	for (i = 0; i < si->si_nother; i++)
+		if (client_check(si->si_other[i], ai))
+			*name = add_name(*name, si->si_other[i]->m_hostname);
+	return 0;
+}
+
 /**
  * client_resolve - look up an IP address
  * @sap: pointer to socket address to resolve
@@ -383,14 +783,187 @@ client_freeall(void)
 struct addrinfo *
 client_resolve(const struct sockaddr *sap)
 {
-	struct addrinfo *ai = NULL;
+	/* Wildcard and netgroup clients look up the name of the
+	 * address themselves, through the host cache, when they are
+	 * checked.  Whether or not the name maps back to the address,
+	 * the result here is the same numeric addrinfo. */
+	return host_numeric_addrinfo(sap);
+}
 
-	if (clientlist[MCL_WILDCARD] || clientlist[MCL_NETGROUP])
-		ai = host_reliable_addrinfo(sap);
-	if (ai == NULL)
-		ai = host_numeric_addrinfo(sap);
+/**
+ * client_needs_lookup - check whether matching an address may block
+ * @sap: address that is about to be passed to client_compose()
+ *
+ * Returns 1 if the client list has wildcard or netgroup entries and
+ * the names of @sap are not in the host cache, so that matching it
+ * will have to wait for the name service.
+ */
+int
+client_needs_lookup(const struct sockaddr *sap)
+{
+	if (!clientlist[MCL_WILDCARD] && !clientlist[MCL_NETGROUP])
+		return 0;
+	return !hostcache_cached(sap);
+}
+
+/*
+ * What client_compose() made of each recent address, so that the
+ * auth.unix.ip upcalls a client sends each time its entry expires
+ * cost a hash lookup instead of a match against every client.  An
+ * answer lasts until a client list changes, or, while there are
+ * wildcard or netgroup clients whose matching used the name service,
+ * as long as the host cache would keep the names it was made from.
+ */
+#define COMPOSE_BUCKETS		1024
+#define COMPOSE_MAX		8192
+
+struct compose_ent {
+	struct compose_ent *	ce_next;
+	unsigned int		ce_gen;
+	time_t			ce_expiry;	/* 0 for none */
+	struct sockaddr_storage	ce_addr;
+	char *			ce_name;	/* NULL if nothing matched */
+};
+
+static struct compose_ent *	compose_table[COMPOSE_BUCKETS];
+static unsigned int		compose_count;
+#ifdef HAVE_LIBPTHREAD
+static pthread_mutex_t		compose_lock = PTHREAD_MUTEX_INITIALIZER;
+#define client_lock(l)		pthread_mutex_lock(l)
+#define client_unlock(l)	pthread_mutex_unlock(l)
+#else
+#define client_lock(l)		do { } while (0)
+#define client_unlock(l)	do { } while (0)
+#endif
+
+static unsigned int
+compose_hash(const struct sockaddr *sap)
+{
+	const unsigned char *p;
+	unsigned int h = 2166136261u;
+	size_t len;
 
-	return ai;
+	switch (sap->sa_family) {
+	case AF_INET:
+		p = (const unsigned char *)
+			&((const struct sockaddr_in *)sap)->sin_addr;
+		len = sizeof(struct in_addr);
+		break;
+	case AF_INET6:
+		p = ((const struct sockaddr_in6 *)sap)->sin6_addr.s6_addr;
+		len = sizeof(struct in6_addr);
+		break;
+	default:
+		return 0;
+	}
+	while (len--)
+		h = (h ^ *p++) * 16777619u;
+	return h % COMPOSE_BUCKETS;
+}
+
+static void
+compose_ent_free(struct compose_ent *ce)
+{
+	free(ce->ce_name);
+	free(ce);
+}
+
+/* Drop stale answers, or all of them if @all; call with compose_lock */
+static void
+compose_prune(time_t now, int all)
+{
+	struct compose_ent *ce, **cep;
+	int i;
+
+	for (i = 0; i < COMPOSE_BUCKETS; i++)
+		for (cep = &compose_table[i]; (ce = *cep) != NULL;) {
+			if (!all && ce->ce_gen == client_gen &&
+			    (!ce->ce_expiry || ce->ce_expiry > now)) {
+				cep = &ce->ce_next;
+				continue;
+			}
+			*cep = ce->ce_next;
+			compose_ent_free(ce);
+			compose_count--;
+		}
+}
+
+/* Returns 1 and sets @name to a copy of the answer if there is one */
+static int
+compose_get(const struct sockaddr *sap, char **name)
+{
+	struct compose_ent *ce;
+	int found = 0;
+
+	client_lock(&compose_lock);
+	for (ce = compose_table[compose_hash(sap)]; ce; ce = ce->ce_next) {
+		if (!nfs_compare_sockaddr((struct sockaddr *)&ce->ce_addr, sap))
+			continue;
+		if (ce->ce_gen != client_gen ||
+		    (ce->ce_expiry && ce->ce_expiry <= time(NULL)))
+			break;
+		*name = NULL;
+		if (ce->ce_name) {
+			*name = strdup(ce->ce_name);
+			if (*name == NULL)
+				break;
+		}
+		found = 1;
+		break;
+	}
+	client_unlock(&compose_lock);
+	return found;
+}
+
+static void
+compose_put(const struct sockaddr *sap, const char *name)
+{
+	unsigned int h = compose_hash(sap);
+	struct compose_ent *ce, **cep;
+	time_t now = time(NULL), expiry = 0;
+	socklen_t len;
+
+	len = nfs_sockaddr_length(sap);
+	if (len == 0)
+		return;
+	if (clientlist[MCL_WILDCARD] || clientlist[MCL_NETGROUP]) {
+		int ttl = name ? hostcache_ttl : hostcache_neg_ttl;
+
+		if (hostcache_ttl <= 0 || ttl <= 0)
+			return;
+		expiry = now + ttl;
+	}
+
+	ce = calloc(1, sizeof(*ce));
+	if (ce == NULL)
+		return;
+	if (name && (ce->ce_name = strdup(name)) == NULL) {
+		free(ce);
+		return;
+	}
+	memcpy(&ce->ce_addr, sap, len);
+	ce->ce_gen = client_gen;
+	ce->ce_expiry = expiry;
+
+	client_lock(&compose_lock);
+	for (cep = &compose_table[h]; *cep; cep = &(*cep)->ce_next)
+		if (nfs_compare_sockaddr((struct sockaddr *)&(*cep)->ce_addr,
+					 sap)) {
+			struct compose_ent *old = *cep;
+
+			*cep = old->ce_next;
+			compose_ent_free(old);
+			compose_count--;
+			break;
+		}
+	if (compose_count >= COMPOSE_MAX)
+		compose_prune(now, 0);
+	if (compose_count >= COMPOSE_MAX)
+		compose_prune(now, 1);
+	ce->ce_next = compose_table[h];
+	compose_table[h] = ce;
+	compose_count++;
+	client_unlock(&compose_lock);
 }
 
 /**
@@ -409,16 +982,27 @@ char *
 client_compose(const struct addrinfo *ai)
 {
 	char *name = NULL;
-	int i;
+	int i, memo;
+
+	/* Only the answer for a single address is remembered */
+	memo = ai->ai_next == NULL;
+	if (memo && compose_get(ai->ai_addr, &name))
+		return name;
 
 	for (i = 0 ; i < MCL_MAXTYPES; i++) {
 		nfs_client	*clp;
+
+		if (i == MCL_SUBNETWORK &&
+		    client_subnet_compose(ai, &name) == 0)
+			continue;
 		for (clp = clientlist[i]; clp ; clp = clp->m_next) {
 			if (!client_check(clp, ai))
 				continue;
 			name = add_name(name, clp->m_hostname);
 		}
 	}
+	if (memo)
+		compose_put(ai->ai_addr, name);
 	return name;
 }
 
@@ -608,35 +1192,23 @@ check_subnetwork(const nfs_client *clp, const struct addrinfo *ai)
 static int
 check_wildcard(const nfs_client *clp, const struct addrinfo *ai)
 {
-	char *hname, *cname = clp->m_hostname;
-	struct hostent *hp;
-	char **ap;
+	char *names, *p, *cname = clp->m_hostname;
 	int match;
 
 	match = 0;
 
-	hname = host_canonname(ai->ai_addr);
-	if (hname == NULL)
-		goto out;
-
-	if (wildmat(hname, cname)) {
-		match = 1;
-		goto out;
-	}
-
-	/* See if hname aliases listed in /etc/hosts or nis[+]
-	 * match the requested wildcard */
-	hp = gethostbyname(hname);
-	if (hp != NULL) {
-		for (ap = hp->h_aliases; *ap; ap++)
-			if (wildmat(*ap, cname)) {
-				match = 1;
-				goto out;
-			}
-	}
+	/* The canonical name comes first, followed by the aliases
+	 * listed in /etc/hosts or nis[+] */
+	names = hostcache_names(ai->ai_addr);
+	if (names == NULL)
+		return 0;
+	for (p = names; *p; p += strlen(p) + 1)
+		if (wildmat(p, cname)) {
+			match = 1;
+			break;
+		}
 
-out:
-	free(hname);
+	free(names);
 	return match;
 }
 
@@ -651,46 +1223,37 @@ check_netgroup(const nfs_client *clp, const struct addrinfo *ai)
 {
 	const char *netgroup = clp->m_hostname + 1;
 	struct addrinfo *tmp = NULL;
-	struct hostent *hp;
-	char *dot, *hname, *ip;
-	int i, match;
+	char ip[INET6_ADDRSTRLEN];
+	char *names, *cname = NULL, *hname, *dot, *p;
+	int match;
 
 	match = 0;
 
-	hname = host_canonname(ai->ai_addr);
-	if (hname == NULL)
-		goto out;
-
-	/* First, try to match the hostname without
-	 * splitting off the domain */
-	if (innetgr(netgroup, hname, NULL, NULL)) {
-		match = 1;
-		goto out;
-	}
+	names = hostcache_names(ai->ai_addr);
+	if (names == NULL)
+		return 0;
 
-	/* See if hname aliases listed in /etc/hosts or nis[+]
-	 * match the requested netgroup */
-	hp = gethostbyname(hname);
-	if (hp != NULL) {
-		for (i = 0; hp->h_aliases[i]; i++)
-			if (innetgr(netgroup, hp->h_aliases[i], NULL, NULL)) {
-				match = 1;
-				goto out;
-			}
-	}
+	/* First, try to match the hostname without splitting off
+	 * the domain, then its aliases listed in /etc/hosts or
+	 * nis[+] */
+	for (p = names; *p; p += strlen(p) + 1)
+		if (hostcache_innetgr(netgroup, p)) {
+			match = 1;
+			goto out;
+		}
+	hname = names;
 
 	/* If hname happens to be an IP address, convert it
 	 * to a the canonical DNS name bound to this address. */
 	tmp = host_pton(hname);
 	if (tmp != NULL) {
-		char *cname = host_canonname(tmp->ai_addr);
+		cname = hostcache_names(tmp->ai_addr);
 		nfs_freeaddrinfo(tmp);
 
 		/* The resulting FQDN may be in our netgroup. */
 		if (cname != NULL) {
-			free(hname);
 			hname = cname;
-			if (innetgr(netgroup, hname, NULL, NULL)) {
+			if (hostcache_innetgr(netgroup, hname)) {
 				match = 1;
 				goto out;
 			}
@@ -698,16 +1261,11 @@ check_netgroup(const nfs_client *clp, const struct addrinfo *ai)
 	}
 
 	/* check whether the IP itself is in the netgroup */
-	ip = calloc(INET6_ADDRSTRLEN, 1);
-	if (inet_ntop(ai->ai_family, &(((struct sockaddr_in *)ai->ai_addr)->sin_addr), ip, INET6_ADDRSTRLEN) == ip) {
-		if (innetgr(netgroup, ip, NULL, NULL)) {
-			free(hname);
-			hname = ip;
-			match = 1;
-			goto out;
-		}
+	if (host_ntop(ai->ai_addr, ip, sizeof(ip)) != NULL &&
+	    hostcache_innetgr(netgroup, ip)) {
+		match = 1;
+		goto out;
 	}
-	free(ip);
 
 	/* Okay, strip off the domain (if we have one) */
 	dot = strchr(hname, '.');
@@ -715,10 +1273,11 @@ check_netgroup(const nfs_client *clp, const struct addrinfo *ai)
 		goto out;
 
 	*dot = '\0';
-	match = innetgr(netgroup, hname, NULL, NULL);
+	match = hostcache_innetgr(netgroup, hname);
 
 out:
-	free(hname);
+	free(cname);
+	free(names);
 	return match;
 }
 #else	/* !HAVE_INNETGR */
@@ -0,0 +1,401 @@
+/*
+ * support/export/etabjournal.c
+ *
+ * Journal of changes to etab.
+ *
+ * Rewriting etab costs as much for one changed export as for all of
+ * them, and gives it a new inode, which every reader takes as a reason
+ * to load it again.  With etab-journal set, exportfs instead appends
+ * the exports it has added, changed or removed to "etab.journal" next
+ * to etab, and only rewrites etab, and removes the journal, when the
+ * journal gets long or exportfs has not read etab first (-r).
+ *
+ * Each record is one line: '+' followed by the entry as etab has it,
+ * or '-' followed by the entry that was removed.  A later record for
+ * the same client and path replaces an earlier one, and either hides
+ * the one in etab, so etab plus the journal is the export table.
+ *
+ * Readers don't lock etab, so the records of one exportfs run end with
+ * a line holding just '.', and records after the last such line, from
+ * a write in progress or cut short by a crash, are ignored.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "nfslib.h"
+#include "exportfs.h"
+#include "xmalloc.h"
+#include "xlog.h"
+
+#define ETAB_JOURNAL_MAX	1024	/* records before rewriting etab */
+#define ETAB_INDEX_INIT		256	/* initial buckets, a power of 2 */
+
+struct etab_ient {
+	struct etab_ient *	i_next;		/* in its bucket */
+	struct etab_ient *	i_order;	/* in the order added */
+	unsigned int		i_hash;
+	int			i_removed;
+	int			i_seen;
+	struct exportent	i_ent;
+};
+
+/* Entries by client and path, each kept once */
+struct etab_index {
+	struct etab_ient **	x_table;
+	unsigned int		x_size, x_count;
+	struct etab_ient *	x_head;
+	struct etab_ient **	x_tail;
+	struct etab_ient *	x_iter;
+};
+
+static char *
+etab_journal_name(const char *etab)
+{
+	char *name = xmalloc(strlen(etab) + sizeof(".journal"));
+
+	strcpy(name, etab);
+	strcat(name, ".journal");
+	return name;
+}
+
+static unsigned int
+etab_index_hash(const char *host, const char *path)
+{
+	unsigned int h = 2166136261u;
+	const unsigned char *p;
+
+	for (p = (const unsigned char *)host; *p; p++)
+		h = (h ^ *p) * 16777619u;
+	h = (h ^ ':') * 16777619u;
+	for (p = (const unsigned char *)path; *p; p++)
+		h = (h ^ *p) * 16777619u;
+	return h;
+}
+
+struct etab_index *
+etab_index_new(void)
+{
+	struct etab_index *idx = xmalloc(sizeof(*idx));
+
+	memset(idx, 0, sizeof(*idx));
+	idx->x_size = ETAB_INDEX_INIT;
+	idx->x_table = xmalloc(idx->x_size * sizeof(*idx->x_table));
+	memset(idx->x_table, 0, idx->x_size * sizeof(*idx->x_table));
+	idx->x_tail = &idx->x_head;
+	return idx;
+}
+
+void
+etab_index_free(struct etab_index *idx)
+{
+	struct etab_ient *ie, *next;
+
+	if (idx == NULL)
+		return;
+	for (ie = idx->x_head; ie; ie = next) {
+		next = ie->i_order;
+		exportent_release(&ie->i_ent);
+		free(ie);
+	}
+	free(idx->x_table);
+	free(idx);
+}
+
+static struct etab_ient *
+etab_index_lookup(struct etab_index *idx, const char *host, const char *path)
+{
+	unsigned int hash = etab_index_hash(host, path);
+	struct etab_ient *ie;
+
+	for (ie = idx->x_table[hash & (idx->x_size - 1)]; ie; ie = ie->i_next)
+		if (ie->i_hash == hash &&
+		    strcmp(ie->i_ent.e_hostname, host) == 0 &&
+		    strcmp(ie->i_ent.e_path, path) == 0)
+			return ie;
+	return NULL;
+}
+
+static void
+etab_index_grow(struct etab_index *idx)
+{
+	unsigned int size = idx->x_size * 2;
+	struct etab_ient **table, *ie;
+
+	table = xmalloc(size * sizeof(*table));
+	memset(table, 0, size * sizeof(*table));
+	for (ie = idx->x_head; ie; ie = ie->i_order) {
+		ie->i_next = table[ie->i_hash & (size - 1)];
+		table[ie->i_hash & (size - 1)] = ie;
+	}
+	free(idx->x_table);
+	idx->x_table = table;
+	idx->x_size = size;
+}
+
+/* Add a copy of @xp, or of its removal, replacing any earlier entry */
+void
+etab_index_add(struct etab_index *idx, struct exportent *xp, int removed)
+{
+	struct etab_ient *ie;
+
+	ie = etab_index_lookup(idx, xp->e_hostname, xp->e_path);
+	if (ie) {
+		exportent_release(&ie->i_ent);
+	} else {
+		if (2 * (idx->x_count + 1) > idx->x_size)
+			etab_index_grow(idx);
+		ie = xmalloc(sizeof(*ie));
+		ie->i_hash = etab_index_hash(xp->e_hostname, xp->e_path);
+		ie->i_next = idx->x_table[ie->i_hash & (idx->x_size - 1)];
+		idx->x_table[ie->i_hash & (idx->x_size - 1)] = ie;
+		ie->i_order = NULL;
+		*idx->x_tail = ie;
+		idx->x_tail = &ie->i_order;
+		idx->x_count++;
+	}
+	dupexportent(&ie->i_ent, xp);
+	ie->i_ent.e_hostname = strpool_get(xp->e_hostname);
+	ie->i_removed = removed;
+	ie->i_seen = 0;
+}
+
+/* Whether the index has an entry, or a removal, for @xp's client and path */
+int
+etab_index_covers(struct etab_index *idx, const struct exportent *xp)
+{
+	return etab_index_lookup(idx, xp->e_hostname, xp->e_path) != NULL;
+}
+
+/*
+ * Return the entries that are not removed, in the order they were
+ * first added, then NULL.  They belong to the index.
+ */
+struct exportent *
+etab_index_next(struct etab_index *idx)
+{
+	struct etab_ient *ie;
+
+	ie = idx->x_iter ? idx->x_iter->i_order : idx->x_head;
+	while (ie && ie->i_removed)
+		ie = ie->i_order;
+	if (ie == NULL)
+		return NULL;
+	idx->x_iter = ie;
+	return &ie->i_ent;
+}
+
+/* The journal's identity, all zero when there is none */
+void
+etab_journal_stat(const char *etab, struct stat *stb)
+{
+	char *name = etab_journal_name(etab);
+
+	if (stat(name, stb) < 0)
+		memset(stb, 0, sizeof(*stb));
+	free(name);
+}
+
+/* Whether @a and @b describe the same file, unchanged */
+int
+etab_same_file(const struct stat *a, const struct stat *b)
+{
+	return a->st_dev == b->st_dev && a->st_ino == b->st_ino &&
+	       a->st_size == b->st_size &&
+	       a->st_mtim.tv_sec == b->st_mtim.tv_sec &&
+	       a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+/*
+ * Read the complete batches of records in the journal of @etab into
+ * an index, and note in *@js which file it was and how much of it was
+ * read.  Returns NULL if there is no journal.
+ */
+struct etab_index *
+etab_journal_read(const char *etab, struct etab_journal_state *js)
+{
+	struct etab_index *idx = NULL;
+	struct exportent *xp;
+	char *name, *buf = NULL, *line, *eol, *end;
+	size_t len = 0, size = 0, n;
+	FILE *fp;
+
+	memset(js, 0, sizeof(*js));
+	name = etab_journal_name(etab);
+	fp = fopen(name, "r");
+	if (fp == NULL) {
+		if (errno != ENOENT)
+			xlog(L_ERROR, "can't open %s: %m", name);
+		free(name);
+		return NULL;
+	}
+	if (fstat(fileno(fp), &js->js_stb) < 0)
+		memset(&js->js_stb, 0, sizeof(js->js_stb));
+	for (;;) {
+		if (len == size) {
+			size = size ? size * 2 : 8192;
+			buf = xrealloc(buf, size);
+		}
+		n = fread(buf + len, 1, size - len, fp);
+		if (n == 0)
+			break;
+		len += n;
+	}
+	fclose(fp);
+
+	/* find the end of the last complete batch */
+	for (end = buf + len; end > buf; end--)
+		if (end - buf >= 2 && end[-1] == '\n' && end[-2] == '.' &&
+		    (end - buf == 2 || end[-3] == '\n'))
+			break;
+	js->js_committed = end - buf;
+
+	idx = etab_index_new();
+	for (line = buf; line < end; line = eol + 1) {
+		eol = memchr(line, '\n', end - line);
+		if (*line == '.')
+			continue;
+		js->js_records++;
+		if (*line != '+' && *line != '-') {
+			xlog(L_ERROR, "%s: bad record ignored", name);
+			continue;
+		}
+		setexportent_buf(name, line + 1, eol - line);
+		xp = getexportent(0, 0);
+		if (xp) {
+			etab_index_add(idx, xp, *line == '-');
+			free(xp->e_hostname);
+			xp->e_hostname = NULL;
+			free(xp->e_uuid);
+			xp->e_uuid = NULL;
+		}
+		endexportent();
+	}
+	free(buf);
+	free(name);
+	return idx;
+}
+
+static void
+etab_journal_record(FILE *fp, int op, struct exportent *xp)
+{
+	fputc(op, fp);
+	fputexportent(fp, xp);
+}
+
+/*
+ * Append to the journal of @etab, which the caller has locked for
+ * writing, what has changed in the export table since etab was read
+ * into @loaded, as one batch.  @js describes the journal as it was
+ * read.
+ *
+ * Returns the number of records appended, or -1 if etab must be
+ * rewritten instead: the journal has changed since, would grow too
+ * long, or couldn't be written.
+ */
+int
+etab_journal_write(const char *etab, struct etab_index *loaded,
+		   const struct etab_journal_state *js)
+{
+	struct etab_ient *ie;
+	struct exportent xe;
+	struct stat now;
+	nfs_export *exp;
+	char *name, *buf = NULL;
+	size_t len = 0;
+	ssize_t n;
+	FILE *fp;
+	int i, count = 0, fd, ret = -1;
+
+	fp = open_memstream(&buf, &len);
+	if (fp == NULL)
+		return -1;
+	for (ie = loaded->x_head; ie; ie = ie->i_order)
+		ie->i_seen = 0;
+	for (i = 0; i < MCL_MAXTYPES; i++) {
+		for (exp = exportlist[i].p_head; exp; exp = exp->m_next) {
+			if (!exp->m_xtabent)
+				continue;
+			xe = exp->m_export;
+			xe.e_hostname = exp->m_client->m_hostname;
+			ie = etab_index_lookup(loaded, xe.e_hostname,
+					       xe.e_path);
+			if (ie && !ie->i_removed) {
+				ie->i_seen = 1;
+				if (cmpexportent(&ie->i_ent, &xe) == 0)
+					continue;
+			}
+			etab_journal_record(fp, '+', &xe);
+			count++;
+		}
+	}
+	for (ie = loaded->x_head; ie; ie = ie->i_order) {
+		if (ie->i_seen || ie->i_removed)
+			continue;
+		etab_journal_record(fp, '-', &ie->i_ent);
+		count++;
+	}
+	if (count)
+		fputs(".\n", fp);
+	if (fclose(fp) != 0) {
+		free(buf);
+		return -1;
+	}
+	if (count == 0) {
+		free(buf);
+		return 0;
+	}
+	/* a batch left incomplete would swallow the start of this one */
+	if (js->js_records + count > ETAB_JOURNAL_MAX ||
+	    js->js_committed != js->js_stb.st_size) {
+		free(buf);
+		return -1;
+	}
+
+	name = etab_journal_name(etab);
+	fd = open(name, O_WRONLY|O_APPEND|O_CREAT|O_CLOEXEC, 0644);
+	if (fd < 0) {
+		xlog(L_ERROR, "can't open %s: %m", name);
+		goto out;
+	}
+	if (fstat(fd, &now) < 0 ||
+	    now.st_size != js->js_stb.st_size ||
+	    (js->js_stb.st_ino && (now.st_ino != js->js_stb.st_ino ||
+				   now.st_dev != js->js_stb.st_dev)))
+		goto out_close;
+	n = write(fd, buf, len);
+	if (n != (ssize_t)len) {
+		xlog(L_ERROR, "can't append to %s: %m", name);
+		if (n > 0 && ftruncate(fd, js->js_stb.st_size) < 0)
+			xlog(L_ERROR, "can't truncate %s: %m", name);
+		goto out_close;
+	}
+	xlog(D_GENERAL, "appended %d records to %s", count, name);
+	ret = count;
+out_close:
+	close(fd);
+out:
+	free(name);
+	free(buf);
+	return ret;
+}
+
+void
+etab_journal_remove(const char *etab)
+{
+	char *name = etab_journal_name(etab);
+
+	if (unlink(name) < 0 && errno != ENOENT)
+		xlog(L_WARNING, "can't remove %s: %m", name);
+	free(name);
+}
@@ -0,0 +1,608 @@
+/*
+ * support/export/etabsnap.c
+ *
+ * Binary snapshot of etab.
+ *
+ * Each daemon parses etab when it starts and whenever it reloads, and
+ * mountd does so in each of its worker processes.  With etab-snapshot
+ * set, exportfs writes the entries it has just written to etab, already
+ * parsed, to a second file next to it, which readers map instead of
+ * parsing etab again.  etab remains the source of truth: the snapshot
+ * records the etab file it was made from, and one that doesn't match
+ * the current etab, or that doesn't look right, is ignored.
+ *
+ * The same format serves as exportfs's cache of parsed exports.d
+ * files, see export_d_read().
+ *
+ * The snapshot is only read on the host that wrote it, so it is in the
+ * host's byte order.  It is a header, an array of fixed size entries,
+ * a table of squash ids and a table of NUL-terminated strings, which
+ * the entries refer to by offset.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "nfslib.h"
+#include "exportfs.h"
+#include "pseudoflavors.h"
+#include "xmalloc.h"
+#include "xlog.h"
+
+#define ETAB_SNAP_MAGIC		0x4e534e50	/* "NSNP" */
+#define ETAB_SNAP_VERSION	2
+#define ETAB_SNAP_NOSTR		UINT32_MAX	/* a NULL string */
+
+struct etab_snap_hdr {
+	uint32_t	h_magic;
+	uint32_t	h_version;
+	uint32_t	h_entsize;	/* sizeof(struct etab_snap_ent) */
+	uint32_t	h_count;	/* entries */
+	uint32_t	h_nids;		/* squash ids */
+	uint32_t	h_strlen;	/* bytes of strings */
+	/* what parsing depended on */
+	uint32_t	h_ttl;		/* default_ttl */
+	uint32_t	h_features;	/* kernel's export features */
+	uint32_t	h_secinfo_flags;
+	uint32_t	h_pad;
+	/* the file the snapshot was made from */
+	uint64_t	h_dev;
+	uint64_t	h_ino;
+	uint64_t	h_size;
+	int64_t		h_mtime;
+	int64_t		h_mtime_nsec;
+};
+
+struct etab_snap_ent {
+	uint32_t	s_hostname;	/* string offsets */
+	uint32_t	s_path;
+	uint32_t	s_mountpoint;
+	uint32_t	s_fslocdata;
+	uint32_t	s_uuid;
+	int32_t		s_flags;
+	int32_t		s_anonuid;
+	int32_t		s_anongid;
+	uint32_t	s_fsid;
+	int32_t		s_fslocmethod;
+	uint32_t	s_ttl;
+	uint32_t	s_rsize;
+	uint32_t	s_wsize;
+	uint32_t	s_readahead;
+	uint32_t	s_squids;	/* index of first id */
+	uint32_t	s_nsquids;
+	uint32_t	s_sqgids;
+	uint32_t	s_nsqgids;
+	uint32_t	s_nsec;
+	struct {
+		int32_t	flav;		/* index in flav_map */
+		int32_t	flags;
+	}		s_sec[SECFLAVOR_COUNT];
+};
+
+struct etab_snap {
+	void *				es_map;
+	size_t				es_len;
+	const struct etab_snap_ent *	es_ents;
+	const int32_t *			es_ids;
+	const char *			es_strs;
+	uint32_t			es_count;
+	uint32_t			es_next;
+	struct exportent		es_ee;
+};
+
+static char *
+etab_snap_name(const char *etab, const char *suffix)
+{
+	char *name = xmalloc(strlen(etab) + strlen(suffix) + 1);
+
+	strcpy(name, etab);
+	strcat(name, suffix);
+	return name;
+}
+
+static void
+etab_snap_stamp(struct etab_snap_hdr *hdr, const struct stat *st)
+{
+	struct export_features *ef = get_export_features();
+
+	hdr->h_ttl = default_ttl;
+	hdr->h_features = ef->flags;
+	hdr->h_secinfo_flags = ef->secinfo_flags;
+	hdr->h_dev = st->st_dev;
+	hdr->h_ino = st->st_ino;
+	hdr->h_size = st->st_size;
+	hdr->h_mtime = st->st_mtim.tv_sec;
+	hdr->h_mtime_nsec = st->st_mtim.tv_nsec;
+}
+
+static int
+etab_snap_current(const struct etab_snap_hdr *hdr, const struct stat *st)
+{
+	struct etab_snap_hdr now;
+
+	etab_snap_stamp(&now, st);
+	return hdr->h_magic == ETAB_SNAP_MAGIC &&
+	       hdr->h_version == ETAB_SNAP_VERSION &&
+	       hdr->h_entsize == sizeof(struct etab_snap_ent) &&
+	       hdr->h_ttl == now.h_ttl && hdr->h_features == now.h_features &&
+	       hdr->h_secinfo_flags == now.h_secinfo_flags &&
+	       hdr->h_dev == now.h_dev && hdr->h_ino == now.h_ino &&
+	       hdr->h_size == now.h_size && hdr->h_mtime == now.h_mtime &&
+	       hdr->h_mtime_nsec == now.h_mtime_nsec;
+}
+
+/* Strings being gathered for a snapshot, each stored once */
+struct snap_strtab {
+	char *		st_buf;
+	uint32_t	st_len, st_size;
+	uint32_t *	st_hash;	/* offsets + 1, 0 if empty */
+	uint32_t	st_hsize, st_count;
+};
+
+/* FNV-1a */
+static uint32_t
+snap_strhash(const char *s)
+{
+	uint32_t h = 2166136261u;
+
+	for (; *s; s++)
+		h = (h ^ (unsigned char)*s) * 16777619u;
+	return h;
+}
+
+static void
+snap_strtab_grow(struct snap_strtab *st)
+{
+	uint32_t size = st->st_hsize ? st->st_hsize * 2 : 1024;
+	uint32_t *hash, i, j;
+
+	hash = xmalloc(size * sizeof(*hash));
+	memset(hash, 0, size * sizeof(*hash));
+	for (i = 0; i < st->st_hsize; i++) {
+		if (!st->st_hash[i])
+			continue;
+		j = snap_strhash(st->st_buf + st->st_hash[i] - 1);
+		while (hash[j & (size - 1)])
+			j++;
+		hash[j & (size - 1)] = st->st_hash[i];
+	}
+	free(st->st_hash);
+	st->st_hash = hash;
+	st->st_hsize = size;
+}
+
+static uint32_t
+snap_strtab_add(struct snap_strtab *st, const char *s)
+{
+	uint32_t i, len;
+
+	if (s == NULL)
+		return ETAB_SNAP_NOSTR;
+	if (2 * (st->st_count + 1) > st->st_hsize)
+		snap_strtab_grow(st);
+	for (i = snap_strhash(s); st->st_hash[i & (st->st_hsize - 1)]; i++)
+		if (!strcmp(st->st_buf + st->st_hash[i & (st->st_hsize - 1)] - 1,
+			    s))
+			return st->st_hash[i & (st->st_hsize - 1)] - 1;
+
+	len = strlen(s) + 1;
+	if (st->st_len + len > st->st_size) {
+		st->st_size = (st->st_len + len) * 2;
+		st->st_buf = xrealloc(st->st_buf, st->st_size);
+	}
+	memcpy(st->st_buf + st->st_len, s, len);
+	st->st_hash[i & (st->st_hsize - 1)] = st->st_len + 1;
+	st->st_count++;
+	st->st_len += len;
+	return st->st_len - len;
+}
+
+static int
+snap_write_all(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+	ssize_t n;
+
+	while (len) {
+		n = write(fd, p, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* A snapshot being put together */
+struct snap_builder {
+	struct snap_strtab	b_strs;
+	struct etab_snap_ent *	b_ents;
+	uint32_t		b_count, b_size;
+	int32_t *		b_ids;
+	uint32_t		b_nids;
+};
+
+static void
+snap_add(struct snap_builder *b, const struct exportent *xp)
+{
+	const struct sec_entry *p;
+	struct etab_snap_ent *se;
+	uint32_t i;
+
+	if (b->b_count == b->b_size) {
+		b->b_size = b->b_size ? b->b_size * 2 : 64;
+		b->b_ents = xrealloc(b->b_ents, b->b_size * sizeof(*b->b_ents));
+	}
+	se = &b->b_ents[b->b_count++];
+	memset(se, 0, sizeof(*se));
+	se->s_hostname = snap_strtab_add(&b->b_strs, xp->e_hostname);
+	se->s_path = snap_strtab_add(&b->b_strs, xp->e_path);
+	se->s_mountpoint = snap_strtab_add(&b->b_strs, xp->e_mountpoint);
+	se->s_fslocdata = snap_strtab_add(&b->b_strs, xp->e_fslocdata);
+	se->s_uuid = snap_strtab_add(&b->b_strs, xp->e_uuid);
+	se->s_flags = xp->e_flags;
+	se->s_anonuid = xp->e_anonuid;
+	se->s_anongid = xp->e_anongid;
+	se->s_fsid = xp->e_fsid;
+	se->s_fslocmethod = xp->e_fslocmethod;
+	se->s_ttl = xp->e_ttl;
+	se->s_rsize = xp->e_rsize;
+	se->s_wsize = xp->e_wsize;
+	se->s_readahead = xp->e_readahead;
+	b->b_ids = xrealloc(b->b_ids, (b->b_nids + xp->e_nsquids +
+				       xp->e_nsqgids + 1) * sizeof(*b->b_ids));
+	se->s_squids = b->b_nids;
+	se->s_nsquids = xp->e_nsquids;
+	for (i = 0; i < (uint32_t)xp->e_nsquids; i++)
+		b->b_ids[b->b_nids++] = xp->e_squids[i];
+	se->s_sqgids = b->b_nids;
+	se->s_nsqgids = xp->e_nsqgids;
+	for (i = 0; i < (uint32_t)xp->e_nsqgids; i++)
+		b->b_ids[b->b_nids++] = xp->e_sqgids[i];
+	for (p = xp->e_secinfo; p->flav &&
+	     se->s_nsec < SECFLAVOR_COUNT; p++, se->s_nsec++) {
+		se->s_sec[se->s_nsec].flav = p->flav - flav_map;
+		se->s_sec[se->s_nsec].flags = p->flags;
+	}
+}
+
+/* Write @b to @snap, as made from the file @st is the status of */
+static int
+snap_save(struct snap_builder *b, const char *snap, const struct stat *st)
+{
+	struct etab_snap_hdr hdr;
+	char *tmp;
+	int fd, ret = -1;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.h_magic = ETAB_SNAP_MAGIC;
+	hdr.h_version = ETAB_SNAP_VERSION;
+	hdr.h_entsize = sizeof(struct etab_snap_ent);
+	hdr.h_count = b->b_count;
+	hdr.h_nids = b->b_nids;
+	hdr.h_strlen = b->b_strs.st_len;
+	etab_snap_stamp(&hdr, st);
+
+	tmp = etab_snap_name(snap, ".tmp");
+	fd = open(tmp, O_CREAT|O_TRUNC|O_WRONLY, 0644);
+	if (fd < 0) {
+		xlog(L_ERROR, "can't create %s: %m", tmp);
+		goto out;
+	}
+	if (snap_write_all(fd, &hdr, sizeof(hdr)) < 0 ||
+	    snap_write_all(fd, b->b_ents, b->b_count * sizeof(*b->b_ents)) < 0 ||
+	    snap_write_all(fd, b->b_ids, b->b_nids * sizeof(*b->b_ids)) < 0 ||
+	    snap_write_all(fd, b->b_strs.st_buf, b->b_strs.st_len) < 0) {
+		xlog(L_ERROR, "can't write %s: %m", tmp);
+		close(fd);
+		unlink(tmp);
+		goto out;
+	}
+	close(fd);
+	if (rename(tmp, snap) < 0) {
+		xlog(L_ERROR, "can't rename %s to %s: %m", tmp, snap);
+		unlink(tmp);
+		goto out;
+	}
+	xlog(D_GENERAL, "wrote %u entries to %s", b->b_count, snap);
+	ret = 0;
+out:
+	free(tmp);
+	return ret;
+}
+
+static void
+snap_builder_free(struct snap_builder *b)
+{
+	free(b->b_ents);
+	free(b->b_ids);
+	free(b->b_strs.st_buf);
+	free(b->b_strs.st_hash);
+}
+
+/**
+ * etab_snap_save - write a snapshot of parsed entries
+ * @snap: path of the snapshot
+ * @src: status of the file the entries were parsed from
+ * @ents: the entries
+ * @n: number of entries in @ents
+ *
+ * Returns 0 on success, or -1 if the snapshot couldn't be written.
+ */
+int
+etab_snap_save(const char *snap, const struct stat *src,
+	       const struct exportent *ents, int n)
+{
+	struct snap_builder b;
+	int i, ret;
+
+	memset(&b, 0, sizeof(b));
+	for (i = 0; i < n; i++)
+		snap_add(&b, &ents[i]);
+	ret = snap_save(&b, snap, src);
+	snap_builder_free(&b);
+	return ret;
+}
+
+/**
+ * etab_snap_write - bring the snapshot of an etab file up to date
+ * @etab: path of the etab file, which the caller has locked
+ *
+ * The entries are read back from @etab, so that the snapshot holds
+ * exactly what parsing it would give.  Nothing is written if the
+ * snapshot is already up to date.
+ *
+ * Returns 0 on success, or -1 if the snapshot couldn't be written, in
+ * which case readers go on parsing etab.
+ */
+int
+etab_snap_write(const char *etab)
+{
+	struct snap_builder b;
+	struct etab_snap_hdr hdr;
+	struct exportent *xp;
+	struct stat st;
+	char *snap;
+	int fd, ret = -1;
+
+	if (stat(etab, &st) < 0)
+		return -1;
+	snap = etab_snap_name(etab, ".snap");
+
+	fd = open(snap, O_RDONLY);
+	if (fd >= 0) {
+		if (read(fd, &hdr, sizeof(hdr)) == sizeof(hdr) &&
+		    etab_snap_current(&hdr, &st))
+			ret = 0;
+		close(fd);
+		if (ret == 0)
+			goto out;
+	}
+
+	memset(&b, 0, sizeof(b));
+	setexportent((char *)etab, "r");
+	while ((xp = getexportent(0, 0)) != NULL) {
+		snap_add(&b, xp);
+		free(xp->e_hostname);
+		xp->e_hostname = NULL;
+		free(xp->e_uuid);
+		xp->e_uuid = NULL;
+	}
+	endexportent();
+	ret = snap_save(&b, snap, &st);
+	snap_builder_free(&b);
+out:
+	free(snap);
+	return ret;
+}
+
+/**
+ * etab_snap_remove - remove the snapshot of an etab file
+ * @etab: path of the etab file
+ */
+void
+etab_snap_remove(const char *etab)
+{
+	char *snap = etab_snap_name(etab, ".snap");
+
+	if (unlink(snap) < 0 && errno != ENOENT)
+		xlog(L_WARNING, "can't remove %s: %m", snap);
+	free(snap);
+}
+
+static int
+etab_snap_str_ok(uint32_t len, uint32_t off)
+{
+	return off == ETAB_SNAP_NOSTR || off < len;
+}
+
+/* Check that every offset and index in the snapshot is in range */
+static int
+etab_snap_check(const struct etab_snap *es, const struct etab_snap_hdr *hdr)
+{
+	const struct etab_snap_ent *se;
+	uint32_t i, j;
+
+	if (hdr->h_strlen && es->es_strs[hdr->h_strlen - 1] != '\0')
+		return 0;
+	for (i = 0; i < hdr->h_count; i++) {
+		se = &es->es_ents[i];
+		if (se->s_hostname == ETAB_SNAP_NOSTR ||
+		    se->s_path == ETAB_SNAP_NOSTR ||
+		    !etab_snap_str_ok(hdr->h_strlen, se->s_hostname) ||
+		    !etab_snap_str_ok(hdr->h_strlen, se->s_path) ||
+		    !etab_snap_str_ok(hdr->h_strlen, se->s_mountpoint) ||
+		    !etab_snap_str_ok(hdr->h_strlen, se->s_fslocdata) ||
+		    !etab_snap_str_ok(hdr->h_strlen, se->s_uuid))
+			return 0;
+		if (se->s_squids > hdr->h_nids ||
+		    se->s_nsquids > hdr->h_nids - se->s_squids ||
+		    se->s_sqgids > hdr->h_nids ||
+		    se->s_nsqgids > hdr->h_nids - se->s_sqgids)
+			return 0;
+		if (se->s_nsec > SECFLAVOR_COUNT)
+			return 0;
+		for (j = 0; j < se->s_nsec; j++)
+			if (se->s_sec[j].flav < 0 ||
+			    se->s_sec[j].flav >= flav_map_size)
+				return 0;
+	}
+	return 1;
+}
+
+/**
+ * etab_snap_load - map a snapshot
+ * @snap: path of the snapshot
+ * @src: status of the file the snapshot should have been made from
+ *
+ * Returns a handle to read the entries with etab_snap_next(), or NULL
+ * if @snap is missing, bad, or wasn't made from that file as it is.
+ */
+struct etab_snap *
+etab_snap_load(const char *snap, const struct stat *src)
+{
+	const struct etab_snap_hdr *hdr;
+	struct etab_snap *es;
+	struct stat sst;
+	size_t need;
+	void *map;
+	int fd;
+
+	fd = open(snap, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &sst) < 0 || (size_t)sst.st_size < sizeof(*hdr)) {
+		close(fd);
+		return NULL;
+	}
+	map = mmap(NULL, sst.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return NULL;
+
+	hdr = map;
+	es = xmalloc(sizeof(*es));
+	memset(es, 0, sizeof(*es));
+	es->es_map = map;
+	es->es_len = sst.st_size;
+	if (!etab_snap_current(hdr, src))
+		goto stale;
+	need = sizeof(*hdr) + (size_t)hdr->h_count * sizeof(*es->es_ents) +
+	       (size_t)hdr->h_nids * sizeof(*es->es_ids) + hdr->h_strlen;
+	if (need != es->es_len)
+		goto bad;
+	es->es_ents = (const struct etab_snap_ent *)(hdr + 1);
+	es->es_ids = (const int32_t *)(es->es_ents + hdr->h_count);
+	es->es_strs = (const char *)(es->es_ids + hdr->h_nids);
+	es->es_count = hdr->h_count;
+	if (!etab_snap_check(es, hdr))
+		goto bad;
+	return es;
+
+bad:
+	xlog(L_WARNING, "ignoring bad snapshot %s", snap);
+stale:
+	etab_snap_close(es);
+	return NULL;
+}
+
+/**
+ * etab_snap_open - map the snapshot of an etab file
+ * @etab: path of the etab file, which the caller has locked
+ *
+ * Returns a handle to read the entries with etab_snap_next(), or NULL
+ * if there is no snapshot matching the current @etab.
+ */
+struct etab_snap *
+etab_snap_open(const char *etab)
+{
+	struct etab_snap *es;
+	struct stat st;
+	char *snap;
+
+	if (stat(etab, &st) < 0)
+		return NULL;
+	snap = etab_snap_name(etab, ".snap");
+	es = etab_snap_load(snap, &st);
+	free(snap);
+	return es;
+}
+
+static char *
+etab_snap_str(const struct etab_snap *es, uint32_t off)
+{
+	return off == ETAB_SNAP_NOSTR ? NULL : (char *)es->es_strs + off;
+}
+
+/**
+ * etab_snap_next - return the next entry of a snapshot
+ * @es: handle from etab_snap_open()
+ *
+ * Returns the entry as getexportent() would, or NULL after the last.
+ * The entry's strings and ids are in the snapshot and must not be
+ * changed or freed; they go away with etab_snap_close().
+ */
+struct exportent *
+etab_snap_next(struct etab_snap *es)
+{
+	const struct etab_snap_ent *se;
+	struct exportent *ee = &es->es_ee;
+	uint32_t i;
+
+	if (es->es_next >= es->es_count)
+		return NULL;
+	se = &es->es_ents[es->es_next++];
+
+	memset(ee, 0, sizeof(*ee));
+	ee->e_hostname = etab_snap_str(es, se->s_hostname);
+	ee->e_path = etab_snap_str(es, se->s_path);
+	ee->e_mountpoint = etab_snap_str(es, se->s_mountpoint);
+	ee->e_fslocdata = etab_snap_str(es, se->s_fslocdata);
+	ee->e_uuid = etab_snap_str(es, se->s_uuid);
+	ee->e_flags = se->s_flags;
+	ee->e_anonuid = se->s_anonuid;
+	ee->e_anongid = se->s_anongid;
+	ee->e_fsid = se->s_fsid;
+	ee->e_fslocmethod = se->s_fslocmethod;
+	ee->e_ttl = se->s_ttl;
+	ee->e_rsize = se->s_rsize;
+	ee->e_wsize = se->s_wsize;
+	ee->e_readahead = se->s_readahead;
+	ee->e_nsquids = se->s_nsquids;
+	if (se->s_nsquids)
+		ee->e_squids = (int *)&es->es_ids[se->s_squids];
+	ee->e_nsqgids = se->s_nsqgids;
+	if (se->s_nsqgids)
+		ee->e_sqgids = (int *)&es->es_ids[se->s_sqgids];
+	for (i = 0; i < se->s_nsec; i++) {
+		ee->e_secinfo[i].flav = &flav_map[se->s_sec[i].flav];
+		ee->e_secinfo[i].flags = se->s_sec[i].flags;
+	}
+	return ee;
+}
+
+/**
+ * etab_snap_close - unmap a snapshot
+ * @es: handle from etab_snap_open()
+ */
+void
+etab_snap_close(struct etab_snap *es)
+{
+	munmap(es->es_map, es->es_len);
+	free(es);
+}
@@ -20,20 +20,23 @@
 #include <stdlib.h>
 #include <dirent.h>
 #include <errno.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <pthread.h>
 #include "xmalloc.h"
 #include "nfslib.h"
 #include "exportfs.h"
+#include "fsloc.h"
 #include "nfsd_path.h"
 #include "xlog.h"
 
-exp_hash_table exportlist[MCL_MAXTYPES] = {{NULL, {{NULL,NULL}, }}, }; 
-static int export_hash(char *);
+exp_hash_table exportlist[MCL_MAXTYPES];
+static unsigned int export_hash(const exp_hash_table *, const char *);
+static unsigned int export_strhash(const char *str);
 
 static void	export_init(nfs_export *exp, nfs_client *clp,
 					struct exportent *nep);
 static void	export_add(nfs_export *exp);
-static int	export_check(const nfs_export *exp, const struct addrinfo *ai,
-				const char *path);
 
 /* Return a real path for the export. */
 static void
@@ -68,10 +71,12 @@ exportent_release(struct exportent *eep)
 {
 	xfree(eep->e_squids);
 	xfree(eep->e_sqgids);
-	free(eep->e_mountpoint);
-	free(eep->e_fslocdata);
-	free(eep->e_uuid);
-	xfree(eep->e_hostname);
+	strpool_put(eep->e_path);
+	strpool_put(eep->e_mountpoint);
+	strpool_put(eep->e_fslocdata);
+	replicas_put(eep->e_fslocs);
+	strpool_put(eep->e_uuid);
+	strpool_put(eep->e_hostname);
 	xfree(eep->e_realpath);
 }
 
@@ -79,6 +84,7 @@ static void
 export_free(nfs_export *exp)
 {
 	exportent_release(&exp->m_export);
+	free(exp->m_reply);
 	xfree(exp);
 }
 
@@ -98,6 +104,215 @@ static void warn_duplicated_exports(nfs_export *exp, struct exportent *eep)
 	}
 }
 
+/*
+ * The exports read so far, by client and path, so that telling whether
+ * an entry duplicates one already read takes a single lookup.
+ */
+struct export_set_ent {
+	struct export_set_ent *	s_next;
+	nfs_export *		s_exp;
+};
+
+struct export_set {
+	struct export_set_ent **s_table;
+	unsigned int		s_size, s_count;
+};
+
+static unsigned int
+export_set_hash(const nfs_client *clp, const char *path)
+{
+	return export_strhash(path) ^
+	       (unsigned int)((uintptr_t)clp >> 4) * 2654435761u;
+}
+
+static void
+export_set_grow(struct export_set *set)
+{
+	unsigned int size = set->s_size ? set->s_size * 2 : 1024;
+	struct export_set_ent **table, *se, *next;
+	unsigned int i, h;
+
+	table = xmalloc(size * sizeof(*table));
+	memset(table, 0, size * sizeof(*table));
+	for (i = 0; i < set->s_size; i++)
+		for (se = set->s_table[i]; se; se = next) {
+			next = se->s_next;
+			h = export_set_hash(se->s_exp->m_client,
+					    se->s_exp->m_export.e_path);
+			se->s_next = table[h & (size - 1)];
+			table[h & (size - 1)] = se;
+		}
+	free(set->s_table);
+	set->s_table = table;
+	set->s_size = size;
+}
+
+static void
+export_set_add(struct export_set *set, nfs_export *exp)
+{
+	struct export_set_ent *se;
+	unsigned int h;
+
+	if (set->s_count >= set->s_size)
+		export_set_grow(set);
+	h = export_set_hash(exp->m_client, exp->m_export.e_path);
+	se = xmalloc(sizeof(*se));
+	se->s_exp = exp;
+	se->s_next = set->s_table[h & (set->s_size - 1)];
+	set->s_table[h & (set->s_size - 1)] = se;
+	set->s_count++;
+}
+
+static nfs_export *
+export_set_find(struct export_set *set, nfs_client *clp, const char *path)
+{
+	struct export_set_ent *se;
+	unsigned int h = export_set_hash(clp, path);
+
+	for (se = set->s_table[h & (set->s_size - 1)]; se; se = se->s_next)
+		if (se->s_exp->m_client == clp &&
+		    strcmp(se->s_exp->m_export.e_path, path) == 0)
+			return se->s_exp;
+	return NULL;
+}
+
+/* Start a set with the exports already in the export table */
+static void
+export_set_init(struct export_set *set)
+{
+	nfs_export *exp;
+	int i;
+
+	memset(set, 0, sizeof(*set));
+	export_set_grow(set);
+	for (i = 0; i < MCL_MAXTYPES; i++)
+		for (exp = exportlist[i].p_head; exp; exp = exp->m_next)
+			export_set_add(set, exp);
+}
+
+static void
+export_set_free(struct export_set *set)
+{
+	struct export_set_ent *se, *next;
+	unsigned int i;
+
+	for (i = 0; i < set->s_size; i++)
+		for (se = set->s_table[i]; se; se = next) {
+			next = se->s_next;
+			free(se);
+		}
+	free(set->s_table);
+}
+
+/*
+ * Read the entries of @fname into @list.  With @cachefn, entries are
+ * taken from that cache when it was made from @fname as it is now, and
+ * the cache is written after parsing a file that gave no errors.
+ */
+static int
+export_read_entries(char *fname, const char *cachefn,
+		    struct exportent **list)
+{
+	struct exportent	*eep, *ents = NULL;
+	struct etab_snap	*es = NULL;
+	int			n = 0, size = 0, errors;
+	struct stat		st;
+
+	if (cachefn && stat(fname, &st) < 0)
+		cachefn = NULL;
+	if (cachefn)
+		es = etab_snap_load(cachefn, &st);
+	if (es) {
+		while ((eep = etab_snap_next(es)) != NULL) {
+			if (n == size) {
+				size = size ? size * 2 : 64;
+				ents = xrealloc(ents, size * sizeof(*ents));
+			}
+			dupexportent(&ents[n], eep);
+			ents[n].e_hostname = strpool_get(eep->e_hostname);
+			n++;
+		}
+		etab_snap_close(es);
+		xlog(D_GENERAL, "%s unchanged, %d entries from %s", fname, n,
+		     cachefn);
+		*list = ents;
+		return n;
+	}
+
+	errors = export_errno;
+	export_errno = 0;
+	setexportent(fname, "r");
+	while ((eep = getexportent(0,1)) != NULL) {
+		if (n == size) {
+			size = size ? size * 2 : 64;
+			ents = xrealloc(ents, size * sizeof(*ents));
+		}
+		dupexportent(&ents[n], eep);
+		ents[n].e_hostname = strpool_get(eep->e_hostname);
+		n++;
+	}
+	endexportent();
+	if (cachefn && !export_errno)
+		etab_snap_save(cachefn, &st, ents, n);
+	export_errno |= errors;
+
+	*list = ents;
+	return n;
+}
+
+static int
+export_read_file(char *fname, int ignore_hosts, const char *cachefn,
+		 struct export_set *set)
+{
+	struct exportent	*eep, *ents;
+	nfs_export		*exp;
+	nfs_client		*clp;
+	char			**names;
+	int			i, n;
+
+	int volumes = 0;
+
+	/*
+	 * Read the whole file first, so that the client names in it
+	 * can be resolved together rather than one after another.
+	 */
+	n = export_read_entries(fname, cachefn, &ents);
+
+	if (!ignore_hosts && n > 1) {
+		names = xmalloc(n * sizeof(*names));
+		for (i = 0; i < n; i++)
+			names[i] = ents[i].e_hostname;
+		client_prefetch(names, n);
+		free(names);
+	}
+
+	for (i = 0; i < n; i++) {
+		eep = &ents[i];
+		clp = client_lookup(eep->e_hostname, ignore_hosts);
+		exp = clp ? export_set_find(set, clp, eep->e_path) : NULL;
+		if (exp) {
+			warn_duplicated_exports(exp, eep);
+			continue;
+		}
+		if (clp && !ignore_hosts)
+			exp = export_create_client(eep, clp);
+		else
+			exp = export_create(eep, 0);
+		if (exp) {
+			/* possible complaints already logged */
+			export_set_add(set, exp);
+			volumes++;
+		}
+	}
+	client_prefetch_done();
+
+	for (i = 0; i < n; i++)
+		exportent_release(&ents[i]);
+	free(ents);
+
+	return volumes;
+}
+
 /**
  * export_read - read entries from /etc/exports
  * @fname: name of file to read from
@@ -111,25 +326,79 @@ static void warn_duplicated_exports(nfs_export *exp, struct exportent *eep)
 int
 export_read(char *fname, int ignore_hosts)
 {
-	struct exportent	*eep;
-	nfs_export		*exp;
+	struct export_set	set;
+	int			volumes;
 
-	int volumes = 0;
+	export_set_init(&set);
+	volumes = export_read_file(fname, ignore_hosts, NULL, &set);
+	export_set_free(&set);
+	return volumes;
+}
 
-	setexportent(fname, "r");
-	while ((eep = getexportent(0,1)) != NULL) {
-		exp = export_lookup(eep->e_hostname, eep->e_path, ignore_hosts);
-		if (!exp) {
-			if (export_create(eep, 0))
-				/* possible complaints already logged */
-				volumes++;
-		}
-		else
-			warn_duplicated_exports(exp, eep);
+/**
+ * export_read_list - parse an exports file without exporting anything
+ * @fname: name of file to read from
+ * @list: set to the entries read, one per client and path
+ *
+ * Returns the number of entries.  Free them with xtab_snapshot_free().
+ */
+int
+export_read_list(char *fname, struct exportent **list)
+{
+	return export_read_entries(fname, NULL, list);
+}
+
+/* Cache parsed exports.d files, see export_d_read() */
+int export_parse_cache;
+
+/*
+ * Where parsed exports.d files are cached, or NULL if they aren't.
+ * The directory is created if need be.
+ */
+static char *
+export_cache_dir(void)
+{
+	char *dir;
+
+	if (!export_parse_cache || !etab.statefn)
+		return NULL;
+	dir = state_make_pathname("exports.d.cache");
+	if (dir && mkdir(dir, 0700) < 0 && errno != EEXIST) {
+		xlog(L_WARNING, "can't create %s: %m", dir);
+		free(dir);
+		dir = NULL;
 	}
-	endexportent();
+	return dir;
+}
 
-	return volumes;
+/* Remove the cached files whose exports.d file is gone */
+static void
+export_cache_prune(const char *dir, struct dirent **namelist, int n)
+{
+	char fname[PATH_MAX + 1];
+	struct dirent *d;
+	size_t len;
+	DIR *dp;
+	int i;
+
+	dp = opendir(dir);
+	if (dp == NULL)
+		return;
+	while ((d = readdir(dp)) != NULL) {
+		len = strlen(d->d_name);
+		if (len <= 5 || strcmp(d->d_name + len - 5, ".snap"))
+			continue;
+		for (i = 0; i < n; i++)
+			if (strlen(namelist[i]->d_name) == len - 5 &&
+			    !strncmp(namelist[i]->d_name, d->d_name, len - 5))
+				break;
+		if (i < n)
+			continue;
+		if (snprintf(fname, sizeof(fname), "%s/%s", dir,
+			     d->d_name) < (int)sizeof(fname))
+			unlink(fname);
+	}
+	closedir(dp);
 }
 
 /**
@@ -140,12 +409,19 @@ export_read(char *fname, int ignore_hosts)
  * Returns number of read entries.
  * Based on mnt_table_parse_dir() in
  *  util-linux-ng/shlibs/mount/src/tab_parse.c
+ *
+ * With export_parse_cache set, each file parsed without errors is
+ * cached in the state directory, and read from there while the file's
+ * inode, size and mtime stay the same, so that changing one file
+ * doesn't mean parsing all the others again.
  */
 int
 export_d_read(const char *dname, int ignore_hosts)
 {
 	int n = 0, i;
 	struct dirent **namelist = NULL;
+	struct export_set set;
+	char *cachedir;
 	int volumes = 0;
 
 
@@ -158,10 +434,13 @@ export_d_read(const char *dname, int ignore_hosts)
 	} else if (n == 0)
 		return volumes;
 
+	cachedir = export_cache_dir();
+	export_set_init(&set);
 	for (i = 0; i < n; i++) {
 		struct dirent *d = namelist[i];
 		size_t namesz;
 		char fname[PATH_MAX + 1];
+		char cachefn[PATH_MAX + 1];
 		int fname_len;
 
 
@@ -186,9 +465,20 @@ export_d_read(const char *dname, int ignore_hosts)
 			continue;
 		}
 
-		volumes += export_read(fname, ignore_hosts);
+		if (cachedir && snprintf(cachefn, sizeof(cachefn), "%s/%s.snap",
+					 cachedir, d->d_name) < (int)sizeof(cachefn))
+			volumes += export_read_file(fname, ignore_hosts,
+						    cachefn, &set);
+		else
+			volumes += export_read_file(fname, ignore_hosts,
+						    NULL, &set);
 	}
+	export_set_free(&set);
 
+	if (cachedir) {
+		export_cache_prune(cachedir, namelist, n);
+		free(cachedir);
+	}
 	for (i = 0; i < n; i++)
 		free(namelist[i]);
 	free(namelist);
@@ -208,12 +498,26 @@ nfs_export *
 export_create(struct exportent *xep, int canonical)
 {
 	nfs_client	*clp;
-	nfs_export	*exp;
 
 	if (!(clp = client_lookup(xep->e_hostname, canonical))) {
 		/* bad export entry; complaint already logged */
 		return NULL;
 	}
+	return export_create_client(xep, clp);
+}
+
+/**
+ * export_create_client - create an export for a client already looked up
+ * @xep: export details, which are copied
+ * @clp: the client of @xep->e_hostname
+ *
+ * Spares the caller another client_lookup() when it has @clp at hand.
+ */
+nfs_export *
+export_create_client(struct exportent *xep, nfs_client *clp)
+{
+	nfs_export	*exp;
+
 	exp = (nfs_export *) xmalloc(sizeof(*exp));
 	export_init(exp, clp, xep);
 	export_add(exp);
@@ -227,14 +531,18 @@ export_init(nfs_export *exp, nfs_client *clp, struct exportent *nep)
 	struct exportent	*e = &exp->m_export;
 
 	dupexportent(e, nep);
-	if (nep->e_hostname)
-		e->e_hostname = xstrdup(nep->e_hostname);
+	e->e_hostname = strpool_get(nep->e_hostname);
+	e->e_fslocs = replicas_get(e->e_fslocmethod, e->e_fslocdata);
 
+	exp->m_reply = NULL;
 	exp->m_exported = 0;
 	exp->m_xtabent = 0;
 	exp->m_mayexport = 0;
 	exp->m_changed = 0;
 	exp->m_warned = 0;
+	exp->m_stale = 0;
+	exp->m_fsidforced = 0;
+	exp->m_pseudo = 0;
 	exp->m_client = clp;
 	clp->m_count++;
 }
@@ -252,9 +560,11 @@ export_dup(nfs_export *exp, const struct addrinfo *ai)
 
 	new = (nfs_export *) xmalloc(sizeof(*new));
 	memcpy(new, exp, sizeof(*new));
+	new->m_reply = NULL;
 	dupexportent(&new->m_export, &exp->m_export);
-	if (exp->m_export.e_hostname)
-		new->m_export.e_hostname = xstrdup(exp->m_export.e_hostname);
+	new->m_export.e_hostname = strpool_get(exp->m_export.e_hostname);
+	new->m_export.e_fslocs = replicas_get(exp->m_export.e_fslocmethod,
+					      exp->m_export.e_fslocdata);
 	clp = client_dup(exp->m_client, ai);
 	if (clp == NULL) {
 		export_free(new);
@@ -267,24 +577,24 @@ export_dup(nfs_export *exp, const struct addrinfo *ai)
 	new->m_xtabent = 0;
 	new->m_changed = 0;
 	new->m_warned = 0;
+	new->m_stale = 0;
+	new->m_pseudo = 0;
 	export_add(new);
 
 	return new;
 }
 
+/* Initial number of hash buckets per client type */
+#define EXP_HASH_INIT	256
+
 static void
-export_add(nfs_export *exp)
+export_hash_insert(exp_hash_table *p_tbl, nfs_export *exp)
 {
-	exp_hash_table *p_tbl;
 	exp_hash_entry *p_hen;
 	nfs_export *p_next;
 
-	int type = exp->m_client->m_type;
-	int pos;
-
-	pos = export_hash(exp->m_export.e_path);
-	p_tbl = &(exportlist[type]); /* pointer to hash table */
-	p_hen = &(p_tbl->entries[pos]); /* pointer to hash table entry */
+	/* pointer to hash table entry */
+	p_hen = &(p_tbl->entries[export_hash(p_tbl, exp->m_export.e_path)]);
 
 	if (!(p_hen->p_first)) { /* hash table entry is empty */ 
  		p_hen->p_first = exp;
@@ -300,6 +610,44 @@ export_add(nfs_export *exp)
 	}
 }
 
+/*
+ * Double the number of buckets and re-insert every export.  Exports
+ * of the same path always share a bucket, so their relative order on
+ * the list is preserved.
+ */
+static void
+export_hash_grow(exp_hash_table *p_tbl)
+{
+	unsigned int size = p_tbl->size ? p_tbl->size * 2 : EXP_HASH_INIT;
+	nfs_export *exp, *nxt;
+
+	exp = p_tbl->p_head;
+	xfree(p_tbl->entries);
+	p_tbl->entries = (exp_hash_entry *) xmalloc(size * sizeof(exp_hash_entry));
+	memset(p_tbl->entries, 0, size * sizeof(exp_hash_entry));
+	p_tbl->size = size;
+	p_tbl->p_head = NULL;
+
+	for (; exp; exp = nxt) {
+		nxt = exp->m_next;
+		export_hash_insert(p_tbl, exp);
+	}
+}
+
+static void
+export_add(nfs_export *exp)
+{
+	exp_hash_table *p_tbl;
+
+	int type = exp->m_client->m_type;
+
+	p_tbl = &(exportlist[type]); /* pointer to hash table */
+	if (p_tbl->count >= p_tbl->size)
+		export_hash_grow(p_tbl);
+	export_hash_insert(p_tbl, exp);
+	p_tbl->count++;
+}
+
 /**
  * export_find - find or create a suitable nfs_export for @ai and @path
  * @ai: pointer to addrinfo for client
@@ -315,8 +663,9 @@ export_find(const struct addrinfo *ai, const char *path)
 	int		i;
 
 	for (i = 0; i < MCL_MAXTYPES; i++) {
-		for (exp = exportlist[i].p_head; exp; exp = exp->m_next) {
-			if (!export_check(exp, ai, path))
+		for (exp = export_find_path(i, path, NULL); exp;
+		     exp = export_find_path(i, path, exp)) {
+			if (!client_check(exp->m_client, ai))
 				continue;
 			if (exp->m_client->m_type == MCL_FQDN)
 				return exp;
@@ -327,6 +676,36 @@ export_find(const struct addrinfo *ai, const char *path)
 	return NULL;
 }
 
+/**
+ * export_find_path - iterate over the exports of one client type for @path
+ * @type: client type (MCL_*) whose exports to search
+ * @path: '\0'-terminated ASCII string containing export path to look for
+ * @prev: NULL to start, otherwise the value returned by the previous call
+ *
+ * Only the hash chain for @path is searched, and matches are returned
+ * in the order they appear on exportlist[@type].  Returns NULL when
+ * there are no more matches.
+ */
+nfs_export *
+export_find_path(int type, const char *path, nfs_export *prev)
+{
+	exp_hash_entry	*p_hen;
+	nfs_export	*exp, *end;
+
+	if (!exportlist[type].entries)
+		return NULL;
+	p_hen = &exportlist[type].entries[export_hash(&exportlist[type], path)];
+	if (!p_hen->p_first)
+		return NULL;
+	end = p_hen->p_last->m_next;
+	for (exp = prev ? prev->m_next : p_hen->p_first;
+	     exp && exp != end; exp = exp->m_next) {
+		if (strcmp(exp->m_export.e_path, path) == 0)
+			return exp;
+	}
+	return NULL;
+}
+
 /**
  * export_lookup - search hash table for export entry
  * @hname: '\0'-terminated ASCII string containing client hostname to look for
@@ -341,32 +720,205 @@ export_lookup(char *hname, char *path, int canonical)
 {
 	nfs_client *clp;
 	nfs_export *exp;
-	exp_hash_entry *p_hen;
-
-	int pos;
 
 	clp = client_lookup(hname, canonical);
 	if(clp == NULL)
 		return NULL;
 
-	pos = export_hash(path);
-	p_hen = &(exportlist[clp->m_type].entries[pos]); 
-	for(exp = p_hen->p_first; exp && (exp != p_hen->p_last->m_next); 
-  			exp = exp->m_next) {
-		if (exp->m_client == clp && !strcmp(exp->m_export.e_path, path)) {
-  			return exp;
+	for (exp = export_find_path(clp->m_type, path, NULL); exp;
+	     exp = export_find_path(clp->m_type, path, exp)) {
+		if (exp->m_client == clp)
+			return exp;
+	}
+	return NULL;
+}
+
+/**
+ * export_mark_stale - flag every export for removal
+ *
+ * The first step of an incremental reload: exports that are found in
+ * the new etab (or are still needed as pseudo exports) have the flag
+ * cleared again, and export_purge_stale() frees the rest.
+ */
+void
+export_mark_stale(void)
+{
+	nfs_export	*exp;
+	int		i;
+
+	for (i = 0; i < MCL_MAXTYPES; i++)
+		for (exp = exportlist[i].p_head; exp; exp = exp->m_next) {
+			exp->m_stale = 1;
+			exp->m_changed = 0;
+		}
+}
+
+/**
+ * export_lookup_entry - find the stale export an etab entry replaces
+ * @xep: entry read from etab
+ *
+ * Matches on the path and on e_hostname exactly as it was written to
+ * etab, so unlike export_lookup() this never needs to resolve the
+ * client.  Only etab and pseudo exports that haven't already been
+ * claimed during this reload are considered.
+ *
+ * Returns the matching export, or NULL.
+ */
+nfs_export *
+export_lookup_entry(const struct exportent *xep)
+{
+	nfs_export	*exp;
+	int		i;
+
+	if (xep->e_hostname == NULL)
+		return NULL;
+	for (i = 0; i < MCL_MAXTYPES; i++) {
+		for (exp = export_find_path(i, xep->e_path, NULL); exp;
+		     exp = export_find_path(i, xep->e_path, exp)) {
+			if (!exp->m_stale || exp->m_export.e_hostname == NULL)
+				continue;
+			if (!exp->m_xtabent &&
+			    !(exp->m_export.e_flags & NFSEXP_V4ROOT))
+				continue;
+			if (strcmp(exp->m_export.e_hostname,
+				   xep->e_hostname) == 0)
+				return exp;
 		}
 	}
 	return NULL;
 }
 
+/**
+ * export_update - replace the options of an existing export
+ * @exp: export to update
+ * @xep: entry carrying the new options
+ *
+ * The client and path of @exp are unchanged.
+ */
+void
+export_update(nfs_export *exp, struct exportent *xep)
+{
+	struct exportent	*e = &exp->m_export;
+
+	exportent_release(e);
+	dupexportent(e, xep);
+	e->e_hostname = strpool_get(xep->e_hostname);
+	e->e_fslocs = replicas_get(e->e_fslocmethod, e->e_fslocdata);
+	free(exp->m_reply);
+	exp->m_reply = NULL;
+
+	exp->m_changed = 1;
+	exp->m_warned = 0;
+	exp->m_fsidforced = 0;
+}
+
+/*
+ * Append @exp to the end of its bucket's run of exports.  Used while
+ * rebuilding a list in its existing order.
+ */
+static void
+export_hash_append(exp_hash_table *p_tbl, nfs_export *exp,
+		   nfs_export **tail)
+{
+	exp_hash_entry *p_hen;
+
+	p_hen = &(p_tbl->entries[export_hash(p_tbl, exp->m_export.e_path)]);
+
+	if (!(p_hen->p_first)) {
+		p_hen->p_first = exp;
+		exp->m_next = NULL;
+		if (*tail)
+			(*tail)->m_next = exp;
+		else
+			p_tbl->p_head = exp;
+		*tail = exp;
+	} else {
+		exp->m_next = p_hen->p_last->m_next;
+		p_hen->p_last->m_next = exp;
+		if (*tail == p_hen->p_last)
+			*tail = exp;
+	}
+	p_hen->p_last = exp;
+	p_tbl->count++;
+}
+
+/*
+ * An export_dup() copy survives a reload if the etab export it was
+ * made from is still there with the same options.
+ */
 static int
-export_check(const nfs_export *exp, const struct addrinfo *ai, const char *path)
+export_dup_parent_kept(const nfs_export *dup)
 {
-	if (strcmp(path, exp->m_export.e_path))
-		return 0;
+	nfs_export	*exp;
+	int		i;
 
-	return client_check(exp->m_client, ai);
+	for (i = 0; i < MCL_MAXTYPES; i++) {
+		for (exp = export_find_path(i, dup->m_export.e_path, NULL); exp;
+		     exp = export_find_path(i, dup->m_export.e_path, exp)) {
+			if (exp->m_xtabent && !exp->m_stale && !exp->m_changed &&
+			    exp->m_export.e_hostname && dup->m_export.e_hostname &&
+			    strcmp(exp->m_export.e_hostname,
+				   dup->m_export.e_hostname) == 0)
+				return 1;
+		}
+	}
+	return 0;
+}
+
+/**
+ * export_purge_stale - free exports still flagged by export_mark_stale()
+ * @v4root: if set, purge only pseudo exports, otherwise only others
+ *
+ * export_dup() copies of etab exports that were kept unchanged are
+ * kept too.  The remaining exports keep their order.  Returns the
+ * number of exports removed.
+ */
+unsigned int
+export_purge_stale(int v4root)
+{
+	exp_hash_table	*p_tbl;
+	nfs_export	*exp, *nxt, *tail;
+	unsigned int	removed = 0;
+	int		i;
+
+	if (!v4root)
+		for (i = 0; i < MCL_MAXTYPES; i++)
+			for (exp = exportlist[i].p_head; exp; exp = exp->m_next)
+				if (exp->m_stale && !exp->m_xtabent &&
+				    !(exp->m_export.e_flags & NFSEXP_V4ROOT) &&
+				    export_dup_parent_kept(exp))
+					exp->m_stale = 0;
+
+	for (i = 0; i < MCL_MAXTYPES; i++) {
+		p_tbl = &exportlist[i];
+		for (exp = p_tbl->p_head; exp; exp = exp->m_next)
+			if (exp->m_stale &&
+			    !(exp->m_export.e_flags & NFSEXP_V4ROOT) == !v4root)
+				break;
+		if (!exp)
+			continue;
+
+		exp = p_tbl->p_head;
+		memset(p_tbl->entries, 0, p_tbl->size * sizeof(exp_hash_entry));
+		p_tbl->p_head = NULL;
+		p_tbl->count = 0;
+		tail = NULL;
+		for (; exp; exp = nxt) {
+			nxt = exp->m_next;
+			if (exp->m_stale &&
+			    !(exp->m_export.e_flags & NFSEXP_V4ROOT) == !v4root) {
+				xlog(D_GENERAL, "removing export %s:%s",
+				     exp->m_export.e_hostname,
+				     exp->m_export.e_path);
+				client_release(exp->m_client);
+				export_free(exp);
+				removed++;
+				continue;
+			}
+			export_hash_append(p_tbl, exp, &tail);
+		}
+	}
+	return removed;
 }
 
 /**
@@ -377,7 +929,7 @@ void
 export_freeall(void)
 {
 	nfs_export	*exp, *nxt;
-	int		i, j;
+	int		i;
 
 	for (i = 0; i < MCL_MAXTYPES; i++) {
 		for (exp = exportlist[i].p_head; exp; exp = nxt) {
@@ -385,42 +937,156 @@ export_freeall(void)
 			client_release(exp->m_client);
 			export_free(exp);
 		}
-		for (j = 0; j < HASH_TABLE_SIZE; j++) {
-			exportlist[i].entries[j].p_first = NULL;
-			exportlist[i].entries[j].p_last = NULL;
-		}
+		xfree(exportlist[i].entries);
+		exportlist[i].entries = NULL;
+		exportlist[i].size = 0;
+		exportlist[i].count = 0;
 		exportlist[i].p_head = NULL;
 	}
 	client_freeall();
 }
 
 /*
- * Compute and returns integer from string. 
- * Note: Its understood the smae integers can be same for 
- *       different strings, but it should not matter.
+ * Hash function
+ *
+ * FNV-1a over the path followed by a final avalanche, so that paths
+ * differing only in their last few characters (/export/home/u0001,
+ * /export/home/u0002, ...) still spread over the whole table.  The
+ * seed is fixed so that the order of the export list, which follows
+ * the buckets, is the same from one run to the next.
+ */
+#define EXP_HASH_SEED	0x9e3779b9u
+
+static unsigned int
+export_strhash(const char *str)
+{
+	unsigned int h = 2166136261u ^ EXP_HASH_SEED;
+
+	while (*str)
+		h = (h ^ (unsigned char)*str++) * 16777619u;
+
+	h ^= h >> 16;
+	h *= 0x85ebca6bu;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35u;
+	h ^= h >> 16;
+	return h;
+}
+
+static unsigned int
+export_hash(const exp_hash_table *p_tbl, const char *str)
+{
+	return export_strhash(str) & (p_tbl->size - 1);
+}
+
+#define EXP_HASH_HIST	8
+
+/* Log the memory the in-core exports take, including shared strings */
+static void
+export_mem_stats(void)
+{
+	unsigned long count = 0, bytes = 0;
+	unsigned long strings, strbytes, refs;
+	const struct exportent *e;
+	nfs_export *exp;
+	int i;
+
+	for (i = 0; i < MCL_MAXTYPES; i++)
+		for (exp = exportlist[i].p_head; exp; exp = exp->m_next) {
+			e = &exp->m_export;
+			count++;
+			bytes += sizeof(*exp);
+			bytes += (e->e_nsquids + e->e_nsqgids) * sizeof(int);
+			if (e->e_realpath)
+				bytes += strlen(e->e_realpath) + 1;
+			if (exp->m_reply)
+				bytes += sizeof(*exp->m_reply) +
+					 exp->m_reply->r_len;
+		}
+	if (!count)
+		return;
+	strpool_stats(&strings, &strbytes, &refs);
+	xlog(D_GENERAL, "export memory: %lu exports in %lu bytes, %lu shared "
+	     "strings with %lu references in %lu bytes, %lu bytes per export",
+	     count, bytes, strings, refs, strbytes,
+	     (bytes + strbytes) / count);
+}
+
+/**
+ * export_hash_stats - log the distribution of the export hash tables
+ *
+ * For each client type with exports, logs how many buckets hold
+ * 0, 1, ... EXP_HASH_HIST or more exports.  Several exports of one
+ * path (to different clients) necessarily share a bucket.  Also logs
+ * the memory the exports take.
  */
-static unsigned int 
-strtoint(char *str)
+void
+export_hash_stats(void)
 {
-	int i = 0;
-	unsigned int n = 0;
+	unsigned int hist[EXP_HASH_HIST + 1];
+	char buf[EXP_HASH_HIST * 16], *bp;
+	unsigned int i, j, n, longest;
+	exp_hash_entry *p_hen;
+	nfs_export *exp, *end;
+
+	if (!xlog_enabled(D_GENERAL))
+		return;
 
-	while ( str[i] != '\0') {
-		n+=((int)str[i])*i;
-		i++;
+	for (i = 0; i < MCL_MAXTYPES; i++) {
+		if (!exportlist[i].count)
+			continue;
+		memset(hist, 0, sizeof(hist));
+		longest = 0;
+		for (j = 0; j < exportlist[i].size; j++) {
+			p_hen = &exportlist[i].entries[j];
+			n = 0;
+			if (p_hen->p_first) {
+				end = p_hen->p_last->m_next;
+				for (exp = p_hen->p_first; exp != end;
+				     exp = exp->m_next)
+					n++;
+			}
+			if (n > longest)
+				longest = n;
+			hist[n < EXP_HASH_HIST ? n : EXP_HASH_HIST]++;
+		}
+		bp = buf;
+		for (j = 0; j <= EXP_HASH_HIST; j++)
+			bp += sprintf(bp, " %u%s:%u", j,
+				      j == EXP_HASH_HIST ? "+" : "", hist[j]);
+		xlog(D_GENERAL, "export hash type %u: %u exports, %u buckets, "
+		     "longest %u, exports per bucket%s",
+		     i, exportlist[i].count, exportlist[i].size, longest, buf);
 	}
-	return n;
+	export_mem_stats();
 }
 
 /*
- * Hash function
+ * The export channel is opened the first time an export is tested and
+ * then kept, so that testing a large table costs a write for each test
+ * rather than an open, a write and a close.  Every write is a request
+ * of its own to the kernel, so the threads that test exports at once
+ * can share the descriptor.
  */
-static int 
-export_hash(char *str)
+static int export_test_fd = -1;
+static pthread_mutex_t export_test_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int export_test_channel(void)
 {
-	unsigned int num = strtoint(str);
+	int fd = __atomic_load_n(&export_test_fd, __ATOMIC_ACQUIRE);
 
-	return num % HASH_TABLE_SIZE;
+	if (fd >= 0)
+		return fd;
+	pthread_mutex_lock(&export_test_lock);
+	fd = export_test_fd;
+	if (fd < 0) {
+		fd = open("/proc/net/rpc/nfsd.export/channel",
+			  O_WRONLY | O_CLOEXEC);
+		if (fd >= 0)
+			__atomic_store_n(&export_test_fd, fd, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&export_test_lock);
+	return fd;
 }
 
 int export_test(struct exportent *eep, int with_fsid)
@@ -428,7 +1094,7 @@ int export_test(struct exportent *eep, int with_fsid)
 	char *path = eep->e_path;
 	int flags = eep->e_flags | (with_fsid ? NFSEXP_FSID : 0);
 	/* beside max path, buf size should take protocol str into account */
-	char buf[NFS_MAXPATHLEN+1+64] = { 0 };
+	char buf[NFS_MAXPATHLEN+1+64];
 	char *bp = buf;
 	int len = sizeof(buf);
 	int fd, n;
@@ -439,12 +1105,13 @@ int export_test(struct exportent *eep, int with_fsid)
 	qword_add(&bp, &len, path);
 	if (len < 1)
 		return 0;
-	snprintf(bp, len, " 3 %d 65534 65534 0\n", flags);
-	fd = open("/proc/net/rpc/nfsd.export/channel", O_WRONLY);
+	n = snprintf(bp, len, " 3 %d 65534 65534 0\n", flags);
+	if (n >= len)
+		return 0;
+	fd = export_test_channel();
 	if (fd < 0)
 		return 0;
-	n = nfsd_path_write(fd, buf, strlen(buf));
-	close(fd);
+	n = nfsd_path_write(fd, buf, bp - buf + n);
 	if (n < 0)
 		return 0;
 	return 1;
@@ -11,24 +11,47 @@
 
 #include "nfslib.h"
 #include "exportfs.h"
+#include "mnttab.h"
 
 unsigned int	auth_reload(void);
+unsigned int	auth_generation(void);
+int		auth_export_change(char *hname, char *path, char *options);
+int		auth_export_set(struct exportent *eep);
+int		auth_export_write(void);
+void		export_read_lock(void);
+void		export_read_unlock(void);
 nfs_export *	auth_authenticate(const char *what,
 					const struct sockaddr *caller,
 					const char *path);
 
+extern char *	cache_trace_file;
+extern int	cache_refresh_ahead;
+extern int	cache_uuid_persist;
 void		cache_open(void);
-void		cache_set_fds(fd_set *fdset);
-int		cache_process_req(fd_set *readfds);
+int		cache_handle_upcall(const char *name, int f, char *buf,
+				    int len);
+int		cache_start_workers(int nthreads);
+int		cache_register_events(void);
 void		cache_process_loop(void);
 
+extern int	v4clients_log;
 void		v4clients_init(void);
-void		v4clients_set_fds(fd_set *fdset);
-int		v4clients_process(fd_set *fdset);
+int		v4clients_register_events(void);
 
 struct nfs_fh_len *
 		cache_get_filehandle(nfs_export *exp, int len, char *p);
 int		cache_export(nfs_export *exp, char *path);
+void		cache_export_replies(void);
+int		cache_prewarm(const char *fname, int nthreads);
+int		cache_prewarm_junctions(int nthreads);
+
+/* Default interval, in seconds, between writes of the statistics file */
+#define CACHE_STATS_INTERVAL	60
+
+extern char *	cache_stats_file;
+extern int	cache_stats_interval;
+void		cache_stats_worker(int id);
+int		cache_stats_register(void);
 
 bool ipaddr_client_matches(nfs_export *exp, struct addrinfo *ai);
 bool namelist_client_matches(nfs_export *exp, char *dom);
@@ -28,9 +28,17 @@
  * SUCH DAMAGES.
  */
 
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
+#include <time.h>
+#include <pthread.h>
 
 #include "fsloc.h"
 #include "exportfs.h"
@@ -201,3 +209,415 @@ void release_replicas(struct servers *server)
 	}
 	free(server);
 }
+
+/*
+ * The fs locations of every export in the table, parsed once for each
+ * method and string, and shared by all the exports, including the dups
+ * made for each client name, that carry them.
+ */
+struct fsloc_ent {
+	struct fsloc_ent	*f_next;
+	unsigned int		f_refs;
+	uint32_t		f_hash;
+	int			f_method;
+	struct servers		f_servers;
+	char			f_data[];
+};
+
+#define FSLOC_HASH	256	/* buckets, a power of 2 */
+
+static struct fsloc_ent *fsloc_table[FSLOC_HASH];
+static pthread_mutex_t fsloc_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint32_t fsloc_hash(int method, const char *data)
+{
+	const unsigned char *p = (const unsigned char *)data;
+	uint32_t h = 2166136261u;
+
+	h = (h ^ (unsigned int)method) * 16777619u;
+	for (; *p; p++)
+		h = (h ^ *p) * 16777619u;
+	return h;
+}
+
+/**
+ * replicas_get - take a reference to the parsed form of fs locations
+ * @method: FSLOC_* method of @data
+ * @data: the refer= or replicas= option string
+ *
+ * Returns the parsed locations, which must not be modified and are
+ * given back with replicas_put(), or NULL if @data could not be
+ * parsed.  Only the first caller for each @method and @data parses it.
+ */
+struct servers *replicas_get(int method, const char *data)
+{
+	struct fsloc_ent *fe, **bucket;
+	struct servers *sp;
+	uint32_t hash;
+	size_t len;
+
+	if (method == FSLOC_NONE || data == NULL)
+		return NULL;
+	hash = fsloc_hash(method, data);
+	bucket = &fsloc_table[hash & (FSLOC_HASH - 1)];
+
+	pthread_mutex_lock(&fsloc_lock);
+	for (fe = *bucket; fe; fe = fe->f_next)
+		if (fe->f_hash == hash && fe->f_method == method &&
+		    strcmp(fe->f_data, data) == 0) {
+			fe->f_refs++;
+			pthread_mutex_unlock(&fsloc_lock);
+			return &fe->f_servers;
+		}
+	pthread_mutex_unlock(&fsloc_lock);
+
+	/* parse it unlocked; another caller may race to add the same */
+	sp = replicas_lookup(method, (char *)data);
+	if (sp == NULL)
+		return NULL;
+	len = strlen(data);
+	fe = malloc(sizeof(*fe) + len + 1);
+	if (fe == NULL) {
+		release_replicas(sp);
+		return NULL;
+	}
+	fe->f_refs = 1;
+	fe->f_hash = hash;
+	fe->f_method = method;
+	fe->f_servers = *sp;
+	free(sp);
+	memcpy(fe->f_data, data, len + 1);
+
+	pthread_mutex_lock(&fsloc_lock);
+	fe->f_next = *bucket;
+	*bucket = fe;
+	pthread_mutex_unlock(&fsloc_lock);
+	return &fe->f_servers;
+}
+
+/**
+ * replicas_put - drop a reference taken with replicas_get()
+ * @server: parsed locations, or NULL
+ *
+ * They are freed when their last reference is dropped.
+ */
+void replicas_put(struct servers *server)
+{
+	struct fsloc_ent *fe, **fep;
+	int i;
+
+	if (server == NULL)
+		return;
+	fe = (struct fsloc_ent *)((char *)server -
+				  offsetof(struct fsloc_ent, f_servers));
+
+	pthread_mutex_lock(&fsloc_lock);
+	if (--fe->f_refs > 0) {
+		pthread_mutex_unlock(&fsloc_lock);
+		return;
+	}
+	for (fep = &fsloc_table[fe->f_hash & (FSLOC_HASH - 1)];
+	     *fep != fe; fep = &(*fep)->f_next)
+		;
+	*fep = fe->f_next;
+	pthread_mutex_unlock(&fsloc_lock);
+
+	for (i = 0; i < server->h_num; i++) {
+		free(server->h_mp[i]->h_host);
+		free(server->h_mp[i]->h_path);
+		free(server->h_mp[i]);
+	}
+	free(fe);
+}
+
+/*
+ * Ordering the locations for each client.  With "hash", each place in
+ * the list is drawn in turn from the locations not yet placed, with
+ * odds in proportion to their weights, by a hash of the client's
+ * domain; so every client is always sent the same order, and clients
+ * spread over the servers by weight.  With "subnet", the locations
+ * whose hosts share the longest address prefix with the client are
+ * drawn from first.
+ */
+int fsloc_order = FSLOC_ORDER_CONFIG;
+char *fsloc_weights;
+
+static const char *fsloc_order_names[] = {
+	[FSLOC_ORDER_CONFIG]	= "config",
+	[FSLOC_ORDER_HASH]	= "hash",
+	[FSLOC_ORDER_SUBNET]	= "subnet",
+};
+
+/* seconds between looks at whether fsloc_weights has changed */
+#define FSLOC_WEIGHTS_CHECK	5
+#define FSLOC_WEIGHT_DEFAULT	1
+#define FSLOC_WEIGHT_MAX	1000000
+
+struct fsloc_weight {
+	char *		w_host;
+	unsigned int	w_weight;
+};
+
+static struct fsloc_weight *weights;
+static int nweights;
+static time_t weights_checked;
+static struct timespec weights_mtime;
+static pthread_mutex_t weights_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * fsloc_order_set - choose how fs locations are ordered for clients
+ * @name: "config", "hash" or "subnet"
+ *
+ * Returns 0, or -1 if @name is none of them.
+ */
+int fsloc_order_set(const char *name)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof(fsloc_order_names) / sizeof(char *); i++)
+		if (strcmp(name, fsloc_order_names[i]) == 0) {
+			fsloc_order = i;
+			return 0;
+		}
+	return -1;
+}
+
+static void weights_free(void)
+{
+	int i;
+
+	for (i = 0; i < nweights; i++)
+		free(weights[i].w_host);
+	free(weights);
+	weights = NULL;
+	nweights = 0;
+}
+
+/*
+ * Read fsloc_weights again if it has changed.  It has a line for each
+ * server, "host weight", and '#' starts a comment.  Called with
+ * weights_lock held.
+ */
+static void weights_load(void)
+{
+	struct fsloc_weight *new;
+	char line[512], host[256];
+	unsigned int weight;
+	time_t now = time(NULL);
+	struct stat stb;
+	int lineno = 0;
+	FILE *fp;
+	char *cp;
+
+	if (fsloc_weights == NULL || now - weights_checked < FSLOC_WEIGHTS_CHECK)
+		return;
+	weights_checked = now;
+	if (stat(fsloc_weights, &stb) < 0) {
+		if (weights_mtime.tv_sec)
+			xlog(L_WARNING, "%s: %m; fs locations are not weighted",
+			     fsloc_weights);
+		weights_free();
+		weights_mtime.tv_sec = 0;
+		return;
+	}
+	if (stb.st_mtim.tv_sec == weights_mtime.tv_sec &&
+	    stb.st_mtim.tv_nsec == weights_mtime.tv_nsec)
+		return;
+	fp = fopen(fsloc_weights, "r");
+	if (fp == NULL) {
+		xlog(L_WARNING, "%s: %m", fsloc_weights);
+		return;
+	}
+	weights_free();
+	weights_mtime = stb.st_mtim;
+	while (fgets(line, sizeof(line), fp)) {
+		lineno++;
+		if ((cp = strchr(line, '#')) != NULL)
+			*cp = '\0';
+		if (sscanf(line, "%255s %u", host, &weight) != 2) {
+			if (sscanf(line, "%255s", host) == 1)
+				xlog(L_WARNING, "%s: %d: bad weight",
+				     fsloc_weights, lineno);
+			continue;
+		}
+		new = realloc(weights, (nweights + 1) * sizeof(*weights));
+		if (new == NULL)
+			break;
+		weights = new;
+		weights[nweights].w_host = strdup(host);
+		if (weights[nweights].w_host == NULL)
+			break;
+		if (weight > FSLOC_WEIGHT_MAX)
+			weight = FSLOC_WEIGHT_MAX;
+		weights[nweights++].w_weight = weight;
+	}
+	fclose(fp);
+	xlog(D_GENERAL, "%s: weights of %d servers", fsloc_weights, nweights);
+}
+
+/*
+ * Copy the next of the ':' separated @hosts of a location to @buf,
+ * without the brackets of an IPv6 address.  Returns where the one after
+ * starts, or NULL if there are none left.
+ */
+static const char *next_host(const char *hosts, char *buf, size_t len)
+{
+	const char *end;
+	size_t n;
+
+	if (*hosts == '\0')
+		return NULL;
+	if (*hosts == '[') {
+		hosts++;
+		end = strchr(hosts, ']');
+		if (end == NULL)
+			end = hosts + strlen(hosts);
+		n = end - hosts;
+		if (*end)
+			end++;
+	} else {
+		end = strchrnul(hosts, ':');
+		n = end - hosts;
+	}
+	if (n >= len)
+		n = len - 1;
+	memcpy(buf, hosts, n);
+	buf[n] = '\0';
+	return *end == ':' ? end + 1 : end;
+}
+
+/* The weight of the best host of a location.  Called with weights_lock */
+static unsigned int location_weight(const char *hosts)
+{
+	unsigned int weight, best = 0;
+	char host[256];
+	int i;
+
+	if (nweights == 0)
+		return FSLOC_WEIGHT_DEFAULT;
+	while ((hosts = next_host(hosts, host, sizeof(host))) != NULL) {
+		weight = FSLOC_WEIGHT_DEFAULT;
+		for (i = 0; i < nweights; i++)
+			if (strcmp(weights[i].w_host, host) == 0) {
+				weight = weights[i].w_weight;
+				break;
+			}
+		if (weight > best)
+			best = weight;
+	}
+	return best;
+}
+
+/*
+ * Parse the address at the start of @str, up to a '/' or ',', as an
+ * IPv6 address, mapping an IPv4 one.  Returns 1 if it is one.
+ */
+static int parse_addr(const char *str, struct in6_addr *addr)
+{
+	char buf[INET6_ADDRSTRLEN];
+	struct in_addr in;
+	size_t n;
+
+	n = strcspn(str, "/,");
+	if (n >= sizeof(buf))
+		return 0;
+	memcpy(buf, str, n);
+	buf[n] = '\0';
+	if (inet_pton(AF_INET6, buf, addr) == 1)
+		return 1;
+	if (inet_pton(AF_INET, buf, &in) != 1)
+		return 0;
+	memset(addr, 0, sizeof(*addr));
+	addr->s6_addr[10] = 0xff;
+	addr->s6_addr[11] = 0xff;
+	memcpy(&addr->s6_addr[12], &in, sizeof(in));
+	return 1;
+}
+
+/*
+ * The longest prefix the addresses of a location share with @client.
+ * Hosts given by name are taken to be farthest: they would have to be
+ * looked up while the kernel waits.
+ */
+static int location_prefix(const char *hosts, const struct in6_addr *client)
+{
+	struct in6_addr addr;
+	char host[256];
+	int i, bits, best = -1;
+
+	while ((hosts = next_host(hosts, host, sizeof(host))) != NULL) {
+		if (!parse_addr(host, &addr))
+			continue;
+		for (i = 0; i < 16 && addr.s6_addr[i] == client->s6_addr[i]; i++)
+			;
+		bits = i * 8;
+		if (i < 16)
+			bits += __builtin_clz((unsigned int)
+				(addr.s6_addr[i] ^ client->s6_addr[i]) << 24);
+		if (bits > best)
+			best = bits;
+	}
+	return best;
+}
+
+/**
+ * replicas_order - the order to send fs locations to a client in
+ * @sp: the locations
+ * @domain: the client's name in the export cache, or NULL
+ * @order: filled with the indexes of @sp's locations, in order
+ *
+ * The client's address is taken from @domain when it is one, as with
+ * "cache-use-ipaddr", or an IP subnet from exports(5); otherwise
+ * "subnet" orders as "hash" does.  Locations of weight 0 come last.
+ */
+void replicas_order(const struct servers *sp, const char *domain, int *order)
+{
+	unsigned int weight[FSLOC_MAX_LIST], total, pick;
+	int prefix[FSLOC_MAX_LIST], i, j, best, n = sp->h_num;
+	struct in6_addr client;
+	int have_addr;
+
+	for (i = 0; i < n; i++)
+		order[i] = i;
+	if (fsloc_order == FSLOC_ORDER_CONFIG || domain == NULL || n < 2)
+		return;
+	if (*domain == '$')
+		domain++;
+	have_addr = fsloc_order == FSLOC_ORDER_SUBNET &&
+		    parse_addr(domain, &client);
+
+	pthread_mutex_lock(&weights_lock);
+	weights_load();
+	for (i = 0; i < n; i++) {
+		weight[i] = location_weight(sp->h_mp[i]->h_host);
+		prefix[i] = have_addr ?
+			location_prefix(sp->h_mp[i]->h_host, &client) : 0;
+		/* below even those by name */
+		if (weight[i] == 0)
+			prefix[i] = -2;
+	}
+	pthread_mutex_unlock(&weights_lock);
+
+	/* order[i..] are those left, in the order they were given */
+	for (i = 0; i < n - 1; i++) {
+		best = -1;
+		total = 0;
+		for (j = i; j < n; j++)
+			if (prefix[order[j]] > best) {
+				best = prefix[order[j]];
+				total = weight[order[j]];
+			} else if (prefix[order[j]] == best)
+				total += weight[order[j]];
+		pick = total ? fsloc_hash(i, domain) % total : 0;
+		for (j = i; j < n; j++) {
+			if (prefix[order[j]] != best)
+				continue;
+			if (pick < weight[order[j]] || total == 0)
+				break;
+			pick -= weight[order[j]];
+		}
+		best = order[j];
+		memmove(&order[i + 1], &order[i], (j - i) * sizeof(*order));
+		order[i] = best;
+	}
+}
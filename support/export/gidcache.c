@@ -0,0 +1,425 @@
+/*
+ * support/export/gidcache.c
+ *
+ * Cache of uid to group list mappings for --manage-gids.
+ *
+ * Looking up a user's groups can take a long time when NSS is backed
+ * by a directory service, and after the kernel's auth.unix.gid cache
+ * is flushed every active uid is asked for at once.  Results are kept
+ * here for gidcache_ttl seconds, and unknown uids for
+ * gidcache_neg_ttl seconds.  Where threads are available, uids that
+ * were asked for recently are looked up again before their entries
+ * expire, so that busy users never wait for NSS, and concurrent
+ * requests for the same uid share one lookup.
+ *
+ * The cache is per process: it is shared by all upcall workers when
+ * they are threads (--threaded), but each forked worker has its own.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <sys/types.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pwd.h>
+#include <grp.h>
+#ifdef HAVE_LIBPTHREAD
+#include <pthread.h>
+#endif
+
+#include "nfslib.h"
+#include "exportfs.h"
+#include "xlog.h"
+
+int		gidcache_ttl = GIDCACHE_TTL;
+int		gidcache_neg_ttl = GIDCACHE_NEG_TTL;
+
+#define GIDCACHE_BUCKETS	1024
+/* Upper bound on the number of cached uids */
+#define GIDCACHE_MAX		65536
+#define GIDCACHE_INITIAL_GROUPS	100
+
+struct gidcache_ent {
+	struct gidcache_ent *	ge_next;
+	uid_t			ge_uid;
+	time_t			ge_expiry;
+	time_t			ge_used;	/* last lookup */
+	int			ge_ngroups;	/* -1 if no such user */
+	gid_t			ge_groups[];
+};
+
+static struct gidcache_ent *	gidcache_table[GIDCACHE_BUCKETS];
+static unsigned int		gidcache_count;
+
+#ifdef HAVE_LIBPTHREAD
+/*
+ * A lookup in progress.  Concurrent requests for the same uid wait
+ * for it instead of each calling NSS.
+ */
+struct gidcache_flight {
+	struct gidcache_flight *gf_next;
+	uid_t			gf_uid;
+	int			gf_done;
+	int			gf_refs;
+	struct gidcache_ent *	gf_ent;		/* result, NULL if none */
+	pthread_cond_t		gf_cond;
+};
+
+static struct gidcache_flight *	gidcache_flights;
+static pthread_mutex_t		gidcache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int			gidcache_prefetching;
+#define gidcache_lock()		pthread_mutex_lock(&gidcache_mutex)
+#define gidcache_unlock()	pthread_mutex_unlock(&gidcache_mutex)
+#else
+#define gidcache_lock()		do { } while (0)
+#define gidcache_unlock()	do { } while (0)
+#endif
+
+/*
+ * Look up the groups of @uid in NSS.  Returns a new, unhashed entry,
+ * or NULL if memory ran out.
+ */
+static struct gidcache_ent *gidcache_resolve(uid_t uid)
+{
+	struct gidcache_ent *ge;
+	struct passwd pwbuf, *pw;
+	char pwstr[1024];
+	gid_t *groups, *more_groups;
+	int ngroups = GIDCACHE_INITIAL_GROUPS;
+	unsigned long long start;
+	int rv = -1;
+
+	groups = malloc(sizeof(gid_t) * ngroups);
+	if (!groups)
+		return NULL;
+
+	start = cache_stats_clock();
+
+	if (getpwuid_r(uid, &pwbuf, pwstr, sizeof(pwstr), &pw) != 0)
+		pw = NULL;
+	if (pw) {
+		int len = ngroups;
+
+		rv = getgrouplist(pw->pw_name, pw->pw_gid, groups, &ngroups);
+		if (rv == -1 && ngroups >= len) {
+			more_groups = realloc(groups, sizeof(gid_t)*ngroups);
+			if (!more_groups) {
+				free(groups);
+				return NULL;
+			}
+			groups = more_groups;
+			rv = getgrouplist(pw->pw_name, pw->pw_gid,
+					  groups, &ngroups);
+		}
+	}
+	if (rv < 0)
+		ngroups = 0;
+	cache_stats_add(CSTAT_NSS, start);
+
+	ge = malloc(sizeof(*ge) + sizeof(gid_t) * ngroups);
+	if (ge) {
+		ge->ge_uid = uid;
+		ge->ge_used = 0;
+		ge->ge_ngroups = rv < 0 ? -1 : ngroups;
+		memcpy(ge->ge_groups, groups, sizeof(gid_t) * ngroups);
+		ge->ge_expiry = time(NULL) +
+			(rv < 0 ? gidcache_neg_ttl : gidcache_ttl);
+	}
+	free(groups);
+	return ge;
+}
+
+/* Drop expired entries, or everything if @all is set */
+static void gidcache_prune(time_t now, int all)
+{
+	struct gidcache_ent **gp, *ge;
+	int i;
+
+	for (i = 0; i < GIDCACHE_BUCKETS; i++) {
+		gp = &gidcache_table[i];
+		while ((ge = *gp) != NULL) {
+			if (all || ge->ge_expiry <= now) {
+				*gp = ge->ge_next;
+				free(ge);
+				gidcache_count--;
+				continue;
+			}
+			gp = &ge->ge_next;
+		}
+	}
+}
+
+/* Add @ge, replacing any entry for the same uid.  Call locked. */
+static void gidcache_insert(struct gidcache_ent *ge)
+{
+	struct gidcache_ent **gp, *old;
+
+	gp = &gidcache_table[ge->ge_uid % GIDCACHE_BUCKETS];
+	while ((old = *gp) != NULL) {
+		if (old->ge_uid == ge->ge_uid) {
+			*gp = old->ge_next;
+			if (old->ge_used > ge->ge_used)
+				ge->ge_used = old->ge_used;
+			free(old);
+			gidcache_count--;
+			continue;
+		}
+		gp = &old->ge_next;
+	}
+	if (gidcache_count >= GIDCACHE_MAX) {
+		gidcache_prune(time(NULL), 0);
+		if (gidcache_count >= GIDCACHE_MAX)
+			gidcache_prune(0, 1);
+	}
+	gp = &gidcache_table[ge->ge_uid % GIDCACHE_BUCKETS];
+	ge->ge_next = *gp;
+	*gp = ge;
+	gidcache_count++;
+}
+
+static struct gidcache_ent *gidcache_find(uid_t uid, time_t now)
+{
+	struct gidcache_ent *ge;
+
+	for (ge = gidcache_table[uid % GIDCACHE_BUCKETS]; ge; ge = ge->ge_next)
+		if (ge->ge_uid == uid && ge->ge_expiry > now)
+			return ge;
+	return NULL;
+}
+
+/* Copy the groups in @ge to *@groupsp, returning the count */
+static int gidcache_copy(const struct gidcache_ent *ge, gid_t **groupsp)
+{
+	*groupsp = NULL;
+	if (ge->ge_ngroups <= 0)
+		return ge->ge_ngroups;
+	*groupsp = malloc(sizeof(gid_t) * ge->ge_ngroups);
+	if (*groupsp == NULL)
+		return -ENOMEM;
+	memcpy(*groupsp, ge->ge_groups, sizeof(gid_t) * ge->ge_ngroups);
+	return ge->ge_ngroups;
+}
+
+#ifdef HAVE_LIBPTHREAD
+/* Seconds between prefetch passes */
+static unsigned int gidcache_prefetch_interval(void)
+{
+	return gidcache_ttl > 4 ? gidcache_ttl / 4 : 1;
+}
+
+/*
+ * Every pass looks up again the uids that were asked for since the
+ * previous pass and would expire before the next one, all at once
+ * rather than each on its first upcall after expiry.
+ */
+static void *gidcache_prefetch_thread(void *UNUSED(data))
+{
+	unsigned int interval = gidcache_prefetch_interval();
+	time_t last = time(NULL), now;
+	unsigned int i, n, size = 0;
+	struct gidcache_ent *ge;
+	uid_t *uids = NULL, *new;
+
+	for (;;) {
+		sleep(interval);
+		now = time(NULL);
+
+		n = 0;
+		gidcache_lock();
+		gidcache_prune(now, 0);
+		for (i = 0; i < GIDCACHE_BUCKETS; i++)
+			for (ge = gidcache_table[i]; ge; ge = ge->ge_next) {
+				if (ge->ge_used < last ||
+				    ge->ge_expiry > now + 2 * interval)
+					continue;
+				if (n == size) {
+					size = size ? size * 2 : 64;
+					new = realloc(uids, size * sizeof(*uids));
+					if (new == NULL)
+						break;
+					uids = new;
+				}
+				uids[n++] = ge->ge_uid;
+			}
+		gidcache_unlock();
+		last = now;
+
+		for (i = 0; i < n; i++) {
+			ge = gidcache_resolve(uids[i]);
+			if (ge == NULL)
+				continue;
+			gidcache_lock();
+			gidcache_insert(ge);
+			gidcache_unlock();
+		}
+		if (n)
+			xlog(D_GENERAL, "gid cache: prefetched %u uids", n);
+	}
+	return NULL;
+}
+
+static void gidcache_start_prefetch(void)
+{
+	pthread_t thread;
+
+	/* Called with the lock held */
+	if (gidcache_prefetching)
+		return;
+	gidcache_prefetching = 1;
+	if (pthread_create(&thread, NULL, gidcache_prefetch_thread,
+			   NULL) != 0) {
+		xlog(L_WARNING, "gid cache: unable to start prefetch thread");
+		return;
+	}
+	pthread_detach(thread);
+}
+#else
+#define gidcache_start_prefetch()	do { } while (0)
+#endif
+
+#ifdef HAVE_LIBPTHREAD
+static struct gidcache_ent *gidcache_dup(const struct gidcache_ent *ge)
+{
+	size_t len;
+	struct gidcache_ent *new;
+
+	len = sizeof(*ge) + sizeof(gid_t) *
+		(ge->ge_ngroups > 0 ? ge->ge_ngroups : 0);
+	new = malloc(len);
+	if (new)
+		memcpy(new, ge, len);
+	return new;
+}
+
+static void gidcache_flight_put(struct gidcache_flight *gf)
+{
+	struct gidcache_flight **fp;
+
+	/* Called with the lock held */
+	if (--gf->gf_refs > 0)
+		return;
+	for (fp = &gidcache_flights; *fp; fp = &(*fp)->gf_next)
+		if (*fp == gf) {
+			*fp = gf->gf_next;
+			break;
+		}
+	pthread_cond_destroy(&gf->gf_cond);
+	free(gf->gf_ent);
+	free(gf);
+}
+
+/*
+ * Wait for a lookup of @uid that another thread has started.  Returns
+ * the group count, or -2 if there was none to wait for.  Called with
+ * the lock held.
+ */
+static int gidcache_flight_wait(uid_t uid, gid_t **groupsp)
+{
+	struct gidcache_flight *gf;
+	int ngroups = -ENOMEM;
+
+	for (gf = gidcache_flights; gf; gf = gf->gf_next)
+		if (gf->gf_uid == uid)
+			break;
+	if (gf == NULL)
+		return -2;
+	gf->gf_refs++;
+	while (!gf->gf_done)
+		pthread_cond_wait(&gf->gf_cond, &gidcache_mutex);
+	if (gf->gf_ent)
+		ngroups = gidcache_copy(gf->gf_ent, groupsp);
+	gidcache_flight_put(gf);
+	return ngroups;
+}
+
+static struct gidcache_flight *gidcache_flight_start(uid_t uid)
+{
+	struct gidcache_flight *gf;
+
+	/* Called with the lock held */
+	gf = calloc(1, sizeof(*gf));
+	if (gf == NULL)
+		return NULL;
+	gf->gf_uid = uid;
+	gf->gf_refs = 1;
+	pthread_cond_init(&gf->gf_cond, NULL);
+	gf->gf_next = gidcache_flights;
+	gidcache_flights = gf;
+	return gf;
+}
+
+static void gidcache_flight_done(struct gidcache_flight *gf,
+				 const struct gidcache_ent *ge)
+{
+	/* Called with the lock held */
+	if (gf == NULL)
+		return;
+	gf->gf_ent = ge ? gidcache_dup(ge) : NULL;
+	gf->gf_done = 1;
+	pthread_cond_broadcast(&gf->gf_cond);
+	gidcache_flight_put(gf);
+}
+#else
+struct gidcache_flight;
+#define gidcache_flight_wait(uid, groupsp)	(-2)
+#define gidcache_flight_start(uid)		NULL
+#define gidcache_flight_done(gf, ge)		((void)(gf))
+#endif
+
+/**
+ * gidcache_get - look up the group list of a user
+ * @uid: user to look up
+ * @groupsp: OUT: allocated array of group ids, or NULL
+ *
+ * Returns the number of groups in *@groupsp, which the caller must
+ * free with free(3), -1 if @uid is unknown, or -ENOMEM if memory ran
+ * out, in which case nothing is known about @uid.
+ */
+int
+gidcache_get(uid_t uid, gid_t **groupsp)
+{
+	struct gidcache_flight *gf;
+	struct gidcache_ent *ge;
+	time_t now = time(NULL);
+	int ngroups;
+
+	*groupsp = NULL;
+	gidcache_lock();
+	if (gidcache_ttl > 0) {
+		ge = gidcache_find(uid, now);
+		if (ge) {
+			ge->ge_used = now;
+			ngroups = gidcache_copy(ge, groupsp);
+			gidcache_unlock();
+			return ngroups;
+		}
+	}
+	ngroups = gidcache_flight_wait(uid, groupsp);
+	if (ngroups != -2) {
+		gidcache_unlock();
+		return ngroups;
+	}
+	gf = gidcache_flight_start(uid);
+	gidcache_unlock();
+
+	/* Don't hold the lock across NSS calls */
+	ge = gidcache_resolve(uid);
+	ngroups = ge ? gidcache_copy(ge, groupsp) : -ENOMEM;
+
+	gidcache_lock();
+	gidcache_flight_done(gf, ge);
+	if (ge && gidcache_ttl > 0) {
+		ge->ge_used = now;
+		gidcache_insert(ge);
+		gidcache_start_prefetch();
+		ge = NULL;
+	}
+	gidcache_unlock();
+	free(ge);
+	return ngroups;
+}
@@ -0,0 +1,978 @@
+/*
+ * support/export/hostcache.c
+ *
+ * Cache of name service results used when matching clients.
+ *
+ * Matching an address against wildcard and netgroup clients needs
+ * its canonical name, the aliases of that name, and innetgr(3) calls
+ * for each candidate name.  Each of these can go to DNS or NIS, and the same
+ * questions are asked again for every client entry and every upcall,
+ * so answers are kept here for hostcache_ttl seconds.  Failed lookups
+ * are kept for hostcache_neg_ttl seconds so that an unresolvable
+ * address doesn't cost a full resolver timeout every time.
+ *
+ * Daemons that fork workers also share answers between them, see
+ * hostcache_share().
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <netinet/in.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <netdb.h>
+#include <errno.h>
+#include <time.h>
+#ifdef HAVE_LIBPTHREAD
+#include <pthread.h>
+#endif
+
+#include "sockaddr.h"
+#include "exportfs.h"
+#include "xlog.h"
+
+/* netgroup stuff never seems to be defined in any header file. Linux is
+ * not alone in this.
+ */
+#if !defined(__GLIBC__) || __GLIBC__ < 2
+extern int	innetgr(char *netgr, char *host, char *, char *);
+#endif
+
+int		hostcache_ttl = HOSTCACHE_TTL;
+int		hostcache_neg_ttl = HOSTCACHE_NEG_TTL;
+
+#define HOSTCACHE_BUCKETS	1024
+/* Upper bound on the entries in each table */
+#define HOSTCACHE_MAX		8192
+
+struct hostcache_ent {
+	struct hostcache_ent *	he_next;
+	unsigned int		he_hash;
+	time_t			he_expiry;
+	struct sockaddr_storage	he_addr;
+	/* Canonical name followed by its aliases, each NUL terminated,
+	 * with an empty string at the end.  NULL if the address has no
+	 * name. */
+	char *			he_names;
+	size_t			he_nameslen;
+};
+
+struct netgr_ent {
+	struct netgr_ent *	ne_next;
+	unsigned int		ne_hash;
+	time_t			ne_expiry;
+	int			ne_member;
+	char			ne_key[];	/* netgroup NUL host NUL */
+};
+
+static struct hostcache_ent *	host_table[HOSTCACHE_BUCKETS];
+static unsigned int		host_count;
+static struct netgr_ent *	netgr_table[HOSTCACHE_BUCKETS];
+static unsigned int		netgr_count;
+
+#ifdef HAVE_LIBPTHREAD
+static pthread_mutex_t		host_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t		netgr_lock = PTHREAD_MUTEX_INITIALIZER;
+/* innetgr(3) is not thread safe */
+static pthread_mutex_t		innetgr_lock = PTHREAD_MUTEX_INITIALIZER;
+#define hostcache_lock(l)	pthread_mutex_lock(l)
+#define hostcache_unlock(l)	pthread_mutex_unlock(l)
+#else
+#define hostcache_lock(l)	do { } while (0)
+#define hostcache_unlock(l)	do { } while (0)
+#endif
+
+static unsigned int hostcache_hash(const void *data, size_t len,
+				   unsigned int hash)
+{
+	const unsigned char *p = data;
+
+	while (len--)
+		hash = (hash ^ *p++) * 16777619;
+	return hash;
+}
+
+static unsigned int hostcache_addr_hash(const struct sockaddr *sap)
+{
+	const struct sockaddr_in *sin = (const struct sockaddr_in *)sap;
+	const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *)sap;
+
+	switch (sap->sa_family) {
+	case AF_INET:
+		return hostcache_hash(&sin->sin_addr, sizeof(sin->sin_addr),
+				      2166136261u);
+	case AF_INET6:
+		return hostcache_hash(&sin6->sin6_addr,
+				      sizeof(sin6->sin6_addr), 2166136261u);
+	}
+	return 0;
+}
+
+/*
+ * A daemon that forks workers calls hostcache_share() before it forks,
+ * and the workers then keep the answers they get in a table in memory
+ * they all share as well as in their own, so that a name looked up by
+ * one worker isn't looked up again by each of the others.
+ *
+ * The table is a fixed array of fixed size slots.  Each slot has a
+ * sequence count that a writer makes odd while it writes the slot, and
+ * readers take a copy of the slot, which they discard if the count was
+ * odd or changed meanwhile, so reads never wait or take a lock.  A
+ * writer that finds a slot being written leaves it be, and an answer
+ * that doesn't fit in a slot is only kept by the worker that got it.
+ */
+#define HOSTSHM_SLOTS		8192		/* a power of 2 */
+#define HOSTSHM_PROBE		8		/* slots an answer may go in */
+#define HOSTSHM_SLOT_SIZE	512
+
+struct hostshm_slot {
+	uint32_t		hs_seq;		/* odd while written */
+	uint32_t		hs_hash;
+	int64_t			hs_expiry;
+	uint16_t		hs_keylen;
+	uint16_t		hs_vallen;
+	int32_t			hs_member;	/* for innetgr(3) answers */
+	char			hs_data[HOSTSHM_SLOT_SIZE - 24];	/* key, value */
+};
+
+static struct hostshm_slot *	hostshm;
+
+/**
+ * hostcache_share - share cached answers with forked workers
+ *
+ * Called before forking worker processes.  Returns zero, or -1 if the
+ * table can't be set up, in which case each worker keeps its own.
+ */
+int
+hostcache_share(void)
+{
+	void *p;
+
+	if (hostshm != NULL || hostcache_ttl <= 0)
+		return 0;
+	p = mmap(NULL, HOSTSHM_SLOTS * sizeof(*hostshm),
+		 PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED) {
+		xlog(L_WARNING, "Unable to share the name service cache: %m");
+		return -1;
+	}
+	hostshm = p;
+	return 0;
+}
+
+/* Copy the current slot for @key into @out.  Returns 1 if there is one */
+static int hostshm_get(unsigned int hash, const char *key, size_t keylen,
+		       time_t now, struct hostshm_slot *out)
+{
+	struct hostshm_slot *hs;
+	unsigned int i;
+	uint32_t seq;
+
+	if (hostshm == NULL)
+		return 0;
+	for (i = 0; i < HOSTSHM_PROBE; i++) {
+		hs = &hostshm[(hash + i) & (HOSTSHM_SLOTS - 1)];
+		seq = __atomic_load_n(&hs->hs_seq, __ATOMIC_ACQUIRE);
+		if ((seq & 1) ||
+		    __atomic_load_n(&hs->hs_hash, __ATOMIC_RELAXED) != hash)
+			continue;
+		memcpy(out, hs, sizeof(*out));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&hs->hs_seq, __ATOMIC_RELAXED) != seq)
+			continue;
+		if (out->hs_keylen == keylen && out->hs_expiry > now &&
+		    keylen + out->hs_vallen <= sizeof(out->hs_data) &&
+		    memcmp(out->hs_data, key, keylen) == 0)
+			return 1;
+	}
+	return 0;
+}
+
+/* Publish an answer for @key, in the slot it had or the oldest one */
+static void hostshm_put(unsigned int hash, const char *key, size_t keylen,
+			const char *val, size_t vallen, int member,
+			time_t expiry)
+{
+	struct hostshm_slot *hs, *victim = NULL;
+	int64_t oldest = INT64_MAX, exp;
+	unsigned int i;
+	uint32_t seq;
+
+	if (hostshm == NULL || keylen + vallen > sizeof(hs->hs_data))
+		return;
+	for (i = 0; i < HOSTSHM_PROBE; i++) {
+		hs = &hostshm[(hash + i) & (HOSTSHM_SLOTS - 1)];
+		if (__atomic_load_n(&hs->hs_hash, __ATOMIC_RELAXED) == hash) {
+			victim = hs;
+			break;
+		}
+		exp = __atomic_load_n(&hs->hs_expiry, __ATOMIC_RELAXED);
+		if (exp < oldest) {
+			oldest = exp;
+			victim = hs;
+		}
+	}
+
+	hs = victim;
+	seq = __atomic_load_n(&hs->hs_seq, __ATOMIC_RELAXED);
+	if ((seq & 1) ||
+	    !__atomic_compare_exchange_n(&hs->hs_seq, &seq, seq + 1, 0,
+					 __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return;
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&hs->hs_hash, hash, __ATOMIC_RELAXED);
+	__atomic_store_n(&hs->hs_expiry, (int64_t)expiry, __ATOMIC_RELAXED);
+	hs->hs_keylen = keylen;
+	hs->hs_vallen = vallen;
+	hs->hs_member = member;
+	memcpy(hs->hs_data, key, keylen);
+	if (vallen)
+		memcpy(hs->hs_data + keylen, val, vallen);
+	__atomic_store_n(&hs->hs_seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/* The key an address's names are shared under: its family and bytes */
+static size_t hostshm_addr_key(const struct sockaddr *sap, char *key)
+{
+	const struct sockaddr_in *sin = (const struct sockaddr_in *)sap;
+	const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *)sap;
+
+	key[0] = 'A';
+	key[1] = sap->sa_family;
+	switch (sap->sa_family) {
+	case AF_INET:
+		memcpy(key + 2, &sin->sin_addr, sizeof(sin->sin_addr));
+		return 2 + sizeof(sin->sin_addr);
+	case AF_INET6:
+		memcpy(key + 2, &sin6->sin6_addr, sizeof(sin6->sin6_addr));
+		return 2 + sizeof(sin6->sin6_addr);
+	}
+	return 0;
+}
+
+/*
+ * Look up the aliases of @hname and append them to the name list
+ * in @buf, which holds @len bytes so far.  Returns the new length.
+ */
+static size_t hostcache_add_aliases(const char *hname, char **buf, size_t len)
+{
+	struct hostent he, *hp = NULL;
+	size_t tmplen = 8192, l;
+	char *tmp = NULL, *new, **ap;
+	int err, herr;
+
+	for (;;) {
+		new = realloc(tmp, tmplen);
+		if (new == NULL)
+			goto out;
+		tmp = new;
+		err = gethostbyname_r(hname, &he, tmp, tmplen, &hp, &herr);
+		if (err != ERANGE)
+			break;
+		tmplen *= 2;
+	}
+	if (err || hp == NULL)
+		goto out;
+
+	for (ap = hp->h_aliases; *ap; ap++) {
+		l = strlen(*ap) + 1;
+		new = realloc(*buf, len + l + 1);
+		if (new == NULL)
+			break;
+		*buf = new;
+		memcpy(*buf + len - 1, *ap, l);
+		len += l;
+		(*buf)[len - 1] = '\0';
+	}
+out:
+	free(tmp);
+	return len;
+}
+
+/* Resolve @sap into a new, unhashed entry */
+static struct hostcache_ent *hostcache_resolve(const struct sockaddr *sap)
+{
+	struct hostcache_ent *he;
+	socklen_t salen = nfs_sockaddr_length(sap);
+	unsigned long long start;
+	char *hname;
+	size_t len;
+
+	if (salen == 0)
+		return NULL;
+	he = calloc(1, sizeof(*he));
+	if (he == NULL)
+		return NULL;
+	memcpy(&he->he_addr, sap, salen);
+
+	start = cache_stats_clock();
+
+	hname = host_canonname(sap);
+	if (hname != NULL) {
+		len = strlen(hname) + 2;
+		he->he_names = malloc(len);
+		if (he->he_names != NULL) {
+			memcpy(he->he_names, hname, len - 1);
+			he->he_names[len - 1] = '\0';
+			len = hostcache_add_aliases(hname, &he->he_names, len);
+			he->he_nameslen = len;
+		}
+		free(hname);
+	}
+	cache_stats_add(CSTAT_DNS, start);
+	he->he_expiry = time(NULL) +
+		(he->he_names ? hostcache_ttl : hostcache_neg_ttl);
+	return he;
+}
+
+static void hostcache_ent_free(struct hostcache_ent *he)
+{
+	free(he->he_names);
+	free(he);
+}
+
+/* Drop expired entries, or everything if @all is set */
+static void hostcache_prune(time_t now, int all)
+{
+	struct hostcache_ent **hp, *he;
+	int i;
+
+	for (i = 0; i < HOSTCACHE_BUCKETS; i++) {
+		hp = &host_table[i];
+		while ((he = *hp) != NULL) {
+			if (all || he->he_expiry <= now) {
+				*hp = he->he_next;
+				hostcache_ent_free(he);
+				host_count--;
+				continue;
+			}
+			hp = &he->he_next;
+		}
+	}
+}
+
+/* Find a current entry for @sap.  Call with host_lock held. */
+static struct hostcache_ent *hostcache_find(const struct sockaddr *sap,
+					    unsigned int hash, time_t now)
+{
+	struct hostcache_ent *he;
+
+	for (he = host_table[hash % HOSTCACHE_BUCKETS]; he; he = he->he_next)
+		if (he->he_hash == hash && he->he_expiry > now &&
+		    nfs_compare_sockaddr((struct sockaddr *)&he->he_addr, sap))
+			return he;
+	return NULL;
+}
+
+/* Add @he, replacing any entry for the same address */
+static void hostcache_insert(struct hostcache_ent *he)
+{
+	struct hostcache_ent **hp, *old;
+	struct sockaddr *sap = (struct sockaddr *)&he->he_addr;
+
+	hp = &host_table[he->he_hash % HOSTCACHE_BUCKETS];
+	while ((old = *hp) != NULL) {
+		if (old->he_hash == he->he_hash &&
+		    nfs_compare_sockaddr((struct sockaddr *)&old->he_addr, sap)) {
+			*hp = old->he_next;
+			hostcache_ent_free(old);
+			host_count--;
+			continue;
+		}
+		hp = &old->he_next;
+	}
+	if (host_count >= HOSTCACHE_MAX) {
+		hostcache_prune(time(NULL), 0);
+		if (host_count >= HOSTCACHE_MAX)
+			hostcache_prune(0, 1);
+	}
+	hp = &host_table[he->he_hash % HOSTCACHE_BUCKETS];
+	he->he_next = *hp;
+	*hp = he;
+	host_count++;
+}
+
+/* Make a new, unhashed entry for @sap from a shared answer */
+static struct hostcache_ent *hostcache_from_shared(const struct sockaddr *sap,
+						   unsigned int hash,
+						   const struct hostshm_slot *hs)
+{
+	struct hostcache_ent *he;
+
+	he = calloc(1, sizeof(*he));
+	if (he == NULL)
+		return NULL;
+	memcpy(&he->he_addr, sap, nfs_sockaddr_length(sap));
+	he->he_hash = hash;
+	he->he_expiry = hs->hs_expiry;
+	if (hs->hs_vallen) {
+		he->he_names = malloc(hs->hs_vallen);
+		if (he->he_names == NULL) {
+			free(he);
+			return NULL;
+		}
+		memcpy(he->he_names, hs->hs_data + hs->hs_keylen,
+		       hs->hs_vallen);
+		he->he_nameslen = hs->hs_vallen;
+	}
+	return he;
+}
+
+static char *hostcache_copy_names(const struct hostcache_ent *he)
+{
+	char *names;
+
+	if (he->he_names == NULL)
+		return NULL;
+	names = malloc(he->he_nameslen);
+	if (names)
+		memcpy(names, he->he_names, he->he_nameslen);
+	return names;
+}
+
+/**
+ * hostcache_names - look up the names of an address
+ * @sap: address to look up
+ *
+ * Returns the canonical name of @sap followed by the aliases of that
+ * name, as consecutive NUL-terminated strings ending with an empty
+ * string, or NULL if @sap has no name.  Caller must free the result
+ * with free(3).
+ */
+char *
+hostcache_names(const struct sockaddr *sap)
+{
+	struct hostcache_ent *he;
+	unsigned int hash = hostcache_addr_hash(sap);
+	char key[2 + sizeof(struct in6_addr)];
+	size_t keylen = hostshm_addr_key(sap, key);
+	struct hostshm_slot hs;
+	char *names;
+
+	if (hostcache_ttl > 0) {
+		hostcache_lock(&host_lock);
+		he = hostcache_find(sap, hash, time(NULL));
+		if (he) {
+			names = hostcache_copy_names(he);
+			hostcache_unlock(&host_lock);
+			return names;
+		}
+		hostcache_unlock(&host_lock);
+
+		/* Another worker may have looked it up already */
+		if (keylen && hostshm_get(hash, key, keylen, time(NULL), &hs)) {
+			he = hostcache_from_shared(sap, hash, &hs);
+			if (he) {
+				names = hostcache_copy_names(he);
+				hostcache_lock(&host_lock);
+				hostcache_insert(he);
+				hostcache_unlock(&host_lock);
+				return names;
+			}
+		}
+	}
+
+	/* Don't hold the lock across name service calls */
+	he = hostcache_resolve(sap);
+	if (he == NULL)
+		return NULL;
+	he->he_hash = hash;
+	names = hostcache_copy_names(he);
+
+	if (hostcache_ttl > 0) {
+		if (keylen)
+			hostshm_put(hash, key, keylen, he->he_names,
+				    he->he_names ? he->he_nameslen : 0, 0,
+				    he->he_expiry);
+		hostcache_lock(&host_lock);
+		hostcache_insert(he);
+		hostcache_unlock(&host_lock);
+	} else
+		hostcache_ent_free(he);
+	return names;
+}
+
+/**
+ * hostcache_cached - check whether an address can be matched quickly
+ * @sap: address to check
+ *
+ * Returns 1 if the names of @sap are cached, so that matching it
+ * against clients won't need to wait for the name service.
+ */
+int
+hostcache_cached(const struct sockaddr *sap)
+{
+	unsigned int hash = hostcache_addr_hash(sap);
+	char key[2 + sizeof(struct in6_addr)];
+	struct hostshm_slot hs;
+	size_t keylen;
+	int ret;
+
+	if (hostcache_ttl <= 0)
+		return 0;
+	hostcache_lock(&host_lock);
+	ret = hostcache_find(sap, hash, time(NULL)) != NULL;
+	hostcache_unlock(&host_lock);
+	if (!ret) {
+		keylen = hostshm_addr_key(sap, key);
+		ret = keylen && hostshm_get(hash, key, keylen, time(NULL), &hs);
+	}
+	return ret;
+}
+
+#ifdef HAVE_INNETGR
+static void netgr_prune(time_t now, int all)
+{
+	struct netgr_ent **np, *ne;
+	int i;
+
+	for (i = 0; i < HOSTCACHE_BUCKETS; i++) {
+		np = &netgr_table[i];
+		while ((ne = *np) != NULL) {
+			if (all || ne->ne_expiry <= now) {
+				*np = ne->ne_next;
+				free(ne);
+				netgr_count--;
+				continue;
+			}
+			np = &ne->ne_next;
+		}
+	}
+}
+
+/*
+ * With netgroup_expand set, each netgroup used in the export table
+ * is enumerated with getnetgrent(3) and its hosts are kept in a hash
+ * set, which hostcache_innetgr() probes instead of calling innetgr(3).
+ * Sets are rebuilt every netgroup_refresh seconds.  A netgroup that
+ * can't be enumerated falls back to innetgr(3).
+ */
+int		netgroup_expand;
+int		netgroup_refresh = NETGROUP_REFRESH;
+
+struct netgr_set {
+	struct netgr_set *	ns_next;
+	time_t			ns_loaded;	/* zero if never built */
+	int			ns_valid;
+	int			ns_any;		/* has a wildcard host */
+	int			ns_used;
+	unsigned int *		ns_slots;	/* offset + 1 into ns_names */
+	unsigned int		ns_size;	/* power of 2 */
+	unsigned int		ns_count;
+	char *			ns_names;
+	size_t			ns_nameslen;
+	char			ns_name[];
+};
+
+static struct netgr_set *	netgr_sets;
+static time_t			netgr_next_refresh;
+static int			netgr_refreshing;
+#ifdef HAVE_LIBPTHREAD
+static pthread_mutex_t		netgr_set_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static unsigned int netgr_host_hash(const char *host)
+{
+	unsigned int hash = 2166136261u;
+
+	while (*host)
+		hash = (hash ^ tolower((unsigned char)*host++)) * 16777619;
+	return hash;
+}
+
+static unsigned int *netgr_set_slot(unsigned int *slots, unsigned int size,
+				    const char *names, const char *host)
+{
+	unsigned int i = netgr_host_hash(host) & (size - 1);
+
+	/* Host names compare without regard to case, as in innetgr(3) */
+	while (slots[i] && strcasecmp(names + slots[i] - 1, host) != 0)
+		i = (i + 1) & (size - 1);
+	return &slots[i];
+}
+
+static int netgr_set_grow(struct netgr_set *ns)
+{
+	unsigned int size = ns->ns_size ? ns->ns_size * 2 : 64;
+	unsigned int *slots, i;
+
+	slots = calloc(size, sizeof(*slots));
+	if (slots == NULL)
+		return -1;
+	for (i = 0; i < ns->ns_size; i++)
+		if (ns->ns_slots[i])
+			*netgr_set_slot(slots, size, ns->ns_names,
+					ns->ns_names + ns->ns_slots[i] - 1) =
+				ns->ns_slots[i];
+	free(ns->ns_slots);
+	ns->ns_slots = slots;
+	ns->ns_size = size;
+	return 0;
+}
+
+static int netgr_set_add(struct netgr_set *ns, const char *host)
+{
+	size_t len = strlen(host) + 1;
+	unsigned int *slot;
+	char *names;
+
+	if (ns->ns_count * 2 >= ns->ns_size && netgr_set_grow(ns) < 0)
+		return -1;
+	slot = netgr_set_slot(ns->ns_slots, ns->ns_size, ns->ns_names, host);
+	if (*slot)
+		return 0;
+	names = realloc(ns->ns_names, ns->ns_nameslen + len);
+	if (names == NULL)
+		return -1;
+	ns->ns_names = names;
+	memcpy(names + ns->ns_nameslen, host, len);
+	*slot = ns->ns_nameslen + 1;
+	ns->ns_nameslen += len;
+	ns->ns_count++;
+	return 0;
+}
+
+static void netgr_set_clear(struct netgr_set *ns)
+{
+	free(ns->ns_slots);
+	free(ns->ns_names);
+	ns->ns_slots = NULL;
+	ns->ns_names = NULL;
+	ns->ns_size = ns->ns_count = 0;
+	ns->ns_nameslen = 0;
+	ns->ns_any = ns->ns_valid = 0;
+}
+
+static size_t netgr_set_bytes(const struct netgr_set *ns)
+{
+	return sizeof(*ns) + strlen(ns->ns_name) + 1 +
+		ns->ns_size * sizeof(*ns->ns_slots) + ns->ns_nameslen;
+}
+
+/* Enumerate @name into @ns.  Returns zero on success. */
+static int netgr_set_build(struct netgr_set *ns, const char *name)
+{
+	char *host, *user, *domain;
+	int ret = 0;
+
+	hostcache_lock(&innetgr_lock);
+	if (!setnetgrent(name)) {
+		hostcache_unlock(&innetgr_lock);
+		return -1;
+	}
+	while (getnetgrent(&host, &user, &domain)) {
+		if (host == NULL) {
+			ns->ns_any = 1;
+			continue;
+		}
+		if (netgr_set_add(ns, host) < 0) {
+			ret = -1;
+			break;
+		}
+	}
+	endnetgrent();
+	hostcache_unlock(&innetgr_lock);
+	ns->ns_valid = ret == 0;
+	return ret;
+}
+
+/*
+ * Returns 1 or 0 if @netgroup has been expanded, or -1 if the caller
+ * has to fall back to innetgr(3).
+ */
+static int netgr_set_probe(const char *netgroup, const char *host)
+{
+	struct netgr_set *ns;
+	int ret = -1;
+
+	hostcache_lock(&netgr_set_lock);
+	for (ns = netgr_sets; ns; ns = ns->ns_next) {
+		if (strcmp(ns->ns_name, netgroup) != 0)
+			continue;
+		if (!ns->ns_valid)
+			break;
+		ret = ns->ns_any ||
+			*netgr_set_slot(ns->ns_slots, ns->ns_size,
+					ns->ns_names, host) != 0;
+		break;
+	}
+	hostcache_unlock(&netgr_set_lock);
+	return ret;
+}
+
+/**
+ * hostcache_netgroups_update - track the netgroups in the client list
+ *
+ * Called with the export table write locked after it is reloaded.
+ * Sets are added for new netgroups and dropped for netgroups no
+ * longer in use; hostcache_netgroups_refresh() fills them in.
+ */
+void
+hostcache_netgroups_update(void)
+{
+	struct netgr_set *ns, **np;
+	nfs_client *clp;
+
+	if (!netgroup_expand)
+		return;
+
+	hostcache_lock(&netgr_set_lock);
+	for (ns = netgr_sets; ns; ns = ns->ns_next)
+		ns->ns_used = 0;
+	for (clp = clientlist[MCL_NETGROUP]; clp; clp = clp->m_next) {
+		const char *name = clp->m_hostname + 1;
+
+		for (ns = netgr_sets; ns; ns = ns->ns_next)
+			if (strcmp(ns->ns_name, name) == 0)
+				break;
+		if (ns == NULL) {
+			ns = calloc(1, sizeof(*ns) + strlen(name) + 1);
+			if (ns == NULL)
+				continue;
+			strcpy(ns->ns_name, name);
+			ns->ns_next = netgr_sets;
+			netgr_sets = ns;
+			netgr_next_refresh = 0;
+		}
+		ns->ns_used = 1;
+	}
+	np = &netgr_sets;
+	while ((ns = *np) != NULL) {
+		if (!ns->ns_used) {
+			*np = ns->ns_next;
+			netgr_set_clear(ns);
+			free(ns);
+			continue;
+		}
+		np = &ns->ns_next;
+	}
+	hostcache_unlock(&netgr_set_lock);
+}
+
+/* Rebuild every set that is due, logging what each one costs */
+static void netgr_sets_refresh(void)
+{
+	struct netgr_set *ns, tmp;
+	char name[NI_MAXHOST];
+	unsigned int nsets = 0;
+	size_t total = 0;
+	time_t now;
+
+	for (;;) {
+		now = time(NULL);
+		hostcache_lock(&netgr_set_lock);
+		for (ns = netgr_sets; ns; ns = ns->ns_next)
+			if (!ns->ns_loaded ||
+			    now - ns->ns_loaded >= netgroup_refresh)
+				break;
+		if (ns == NULL) {
+			hostcache_unlock(&netgr_set_lock);
+			break;
+		}
+		/* Don't try again until the next refresh, even if this
+		 * attempt fails */
+		ns->ns_loaded = now;
+		strncpy(name, ns->ns_name, sizeof(name) - 1);
+		name[sizeof(name) - 1] = '\0';
+		hostcache_unlock(&netgr_set_lock);
+
+		memset(&tmp, 0, sizeof(tmp));
+		if (netgr_set_build(&tmp, name) < 0) {
+			xlog(D_GENERAL, "netgroup %s: can't enumerate, "
+			     "using innetgr(3)", name);
+			netgr_set_clear(&tmp);
+			continue;
+		}
+
+		hostcache_lock(&netgr_set_lock);
+		for (ns = netgr_sets; ns; ns = ns->ns_next)
+			if (strcmp(ns->ns_name, name) == 0)
+				break;
+		if (ns) {
+			netgr_set_clear(ns);
+			ns->ns_slots = tmp.ns_slots;
+			ns->ns_size = tmp.ns_size;
+			ns->ns_count = tmp.ns_count;
+			ns->ns_names = tmp.ns_names;
+			ns->ns_nameslen = tmp.ns_nameslen;
+			ns->ns_any = tmp.ns_any;
+			ns->ns_valid = 1;
+			xlog(D_GENERAL, "netgroup %s: %u hosts%s, %zu bytes",
+			     name, ns->ns_count,
+			     ns->ns_any ? " and a wildcard" : "",
+			     netgr_set_bytes(ns));
+			nsets++;
+			total += netgr_set_bytes(ns);
+		} else
+			netgr_set_clear(&tmp);
+		hostcache_unlock(&netgr_set_lock);
+	}
+	if (nsets)
+		xlog(D_GENERAL, "expanded %u netgroups, %zu bytes", nsets, total);
+
+	hostcache_lock(&netgr_set_lock);
+	netgr_next_refresh = now + netgroup_refresh;
+	for (ns = netgr_sets; ns; ns = ns->ns_next)
+		if (ns->ns_loaded + netgroup_refresh < netgr_next_refresh)
+			netgr_next_refresh = ns->ns_loaded + netgroup_refresh;
+	netgr_refreshing = 0;
+	hostcache_unlock(&netgr_set_lock);
+}
+
+#ifdef HAVE_LIBPTHREAD
+static void *netgr_sets_refresh_thread(void *UNUSED(data))
+{
+	netgr_sets_refresh();
+	return NULL;
+}
+#endif
+
+/**
+ * hostcache_netgroups_refresh - rebuild netgroup sets that are due
+ *
+ * Called after each auth_reload().  The first expansion is done
+ * inline, so that daemons which fork workers do so with the sets
+ * already built.  Enumerating large netgroups can take a while, so
+ * later refreshes are done in the background when threads are
+ * available; probes fall back to innetgr(3) until a set is built.
+ */
+void
+hostcache_netgroups_refresh(void)
+{
+	static int started;
+#ifdef HAVE_LIBPTHREAD
+	pthread_t thread;
+#endif
+	int due;
+
+	if (!netgroup_expand)
+		return;
+
+	hostcache_lock(&netgr_set_lock);
+	due = !netgr_refreshing && time(NULL) >= netgr_next_refresh;
+	if (due)
+		netgr_refreshing = 1;
+	hostcache_unlock(&netgr_set_lock);
+	if (!due)
+		return;
+
+#ifdef HAVE_LIBPTHREAD
+	if (started && pthread_create(&thread, NULL, netgr_sets_refresh_thread,
+				      NULL) == 0) {
+		pthread_detach(thread);
+		return;
+	}
+#endif
+	started = 1;
+	netgr_sets_refresh();
+}
+
+/**
+ * hostcache_innetgr - check whether a host is in a netgroup
+ * @netgroup: name of netgroup, without the leading '@'
+ * @host: host name or address to look for
+ *
+ * A cached version of innetgr(3).  Returns 1 if @host is a member
+ * of @netgroup, otherwise zero.
+ */
+int
+hostcache_innetgr(const char *netgroup, const char *host)
+{
+	size_t glen = strlen(netgroup) + 1, hlen = strlen(host) + 1;
+	struct netgr_ent *ne, **np;
+	struct hostshm_slot hs;
+	unsigned long long start;
+	char key[sizeof(hs.hs_data)];
+	size_t keylen = 0;
+	unsigned int hash;
+	time_t now = time(NULL), expiry;
+	int member;
+
+	if (netgroup_expand) {
+		member = netgr_set_probe(netgroup, host);
+		if (member >= 0)
+			return member;
+	}
+
+	hash = hostcache_hash(netgroup, glen, 2166136261u);
+	hash = hostcache_hash(host, hlen, hash);
+
+	if (hostcache_ttl > 0) {
+		hostcache_lock(&netgr_lock);
+		for (ne = netgr_table[hash % HOSTCACHE_BUCKETS]; ne;
+		     ne = ne->ne_next) {
+			if (ne->ne_hash != hash || ne->ne_expiry <= now ||
+			    strcmp(ne->ne_key, netgroup) != 0 ||
+			    strcmp(ne->ne_key + glen, host) != 0)
+				continue;
+			member = ne->ne_member;
+			hostcache_unlock(&netgr_lock);
+			return member;
+		}
+		hostcache_unlock(&netgr_lock);
+
+		if (1 + glen + hlen <= sizeof(key)) {
+			key[0] = 'N';
+			memcpy(key + 1, netgroup, glen);
+			memcpy(key + 1 + glen, host, hlen);
+			keylen = 1 + glen + hlen;
+		}
+	}
+
+	if (keylen && hostshm_get(hash, key, keylen, now, &hs)) {
+		member = hs.hs_member;
+		expiry = hs.hs_expiry;
+	} else {
+		start = cache_stats_clock();
+		hostcache_lock(&innetgr_lock);
+		member = innetgr(netgroup, host, NULL, NULL);
+		hostcache_unlock(&innetgr_lock);
+		cache_stats_add(CSTAT_NSS, start);
+		expiry = now + (member ? hostcache_ttl : hostcache_neg_ttl);
+		if (keylen)
+			hostshm_put(hash, key, keylen, NULL, 0, member, expiry);
+	}
+
+	if (hostcache_ttl <= 0)
+		return member;
+	ne = malloc(sizeof(*ne) + glen + hlen);
+	if (ne == NULL)
+		return member;
+	ne->ne_hash = hash;
+	ne->ne_member = member;
+	ne->ne_expiry = expiry;
+	memcpy(ne->ne_key, netgroup, glen);
+	memcpy(ne->ne_key + glen, host, hlen);
+
+	hostcache_lock(&netgr_lock);
+	if (netgr_count >= HOSTCACHE_MAX) {
+		netgr_prune(now, 0);
+		if (netgr_count >= HOSTCACHE_MAX)
+			netgr_prune(0, 1);
+	}
+	np = &netgr_table[hash % HOSTCACHE_BUCKETS];
+	ne->ne_next = *np;
+	*np = ne;
+	netgr_count++;
+	hostcache_unlock(&netgr_lock);
+	return member;
+}
+#else	/* !HAVE_INNETGR */
+void
+hostcache_netgroups_update(void)
+{
+}
+
+void
+hostcache_netgroups_refresh(void)
+{
+}
+#endif	/* !HAVE_INNETGR */
@@ -24,6 +24,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <arpa/inet.h>
+#include <net/if.h>
 #include <netdb.h>
 #include <errno.h>
 
@@ -37,11 +38,16 @@
  * @buflen: size of @buf in bytes
  *
  * Returns a pointer to a @buf.
+ *
+ * Addresses without a scope are formatted with inet_ntop(3), which
+ * is all that getnameinfo(3) would do for them.
  */
 #ifdef HAVE_GETNAMEINFO
 char *
 host_ntop(const struct sockaddr *sap, char *buf, const size_t buflen)
 {
+	const struct sockaddr_in *sin = (const struct sockaddr_in *)(char *)sap;
+	const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *)(char *)sap;
 	socklen_t salen = nfs_sockaddr_length(sap);
 	int error;
 
@@ -52,6 +58,13 @@ host_ntop(const struct sockaddr *sap, char *buf, const size_t buflen)
 		return buf;
 	}
 
+	if (sap->sa_family == AF_INET &&
+	    inet_ntop(AF_INET, &sin->sin_addr, buf, buflen) != NULL)
+		return buf;
+	if (sap->sa_family == AF_INET6 && sin6->sin6_scope_id == 0 &&
+	    inet_ntop(AF_INET6, &sin6->sin6_addr, buf, buflen) != NULL)
+		return buf;
+
 	error = getnameinfo(sap, salen, buf, (socklen_t)buflen,
 						NULL, 0, NI_NUMERICHOST);
 	if (error != 0) {
@@ -149,6 +162,99 @@ host_pton(const char *paddr)
 	return NULL;
 }
 
+#ifdef IPV6_SUPPORTED
+/*
+ * Parse a scoped IPv6 address, "addr%scope", where scope is an
+ * interface name or index, as getaddrinfo(3) would.
+ */
+static int
+host_pton_scoped(const char *paddr, struct sockaddr_in6 *sin6)
+{
+	char addr[INET6_ADDRSTRLEN];
+	const char *scope = strchr(paddr, '%');
+	unsigned long index;
+	char *end;
+
+	if (scope == NULL || scope == paddr || scope[1] == '\0' ||
+	    (size_t)(scope - paddr) >= sizeof(addr))
+		return 0;
+	memcpy(addr, paddr, scope - paddr);
+	addr[scope - paddr] = '\0';
+	if (inet_pton(AF_INET6, addr, &sin6->sin6_addr) != 1)
+		return 0;
+
+	scope++;
+	index = if_nametoindex(scope);
+	if (index == 0) {
+		errno = 0;
+		index = strtoul(scope, &end, 10);
+		if (*end != '\0' || errno != 0 || index > UINT32_MAX)
+			return 0;
+	}
+	sin6->sin6_scope_id = (uint32_t)index;
+	return 1;
+}
+#endif
+
+/**
+ * host_pton_buf - fill in an addrinfo for a presentation address
+ * @paddr: pointer to a '\0'-terminated ASCII string containing an
+ *		IP presentation address
+ * @ha: caller-supplied storage for the result
+ *
+ * Like host_pton(), but nothing is allocated and there is no list:
+ * the result describes the one address in @paddr, which may be a
+ * scoped IPv6 address.  Returns a pointer to the addrinfo in @ha, or
+ * NULL if @paddr is not a numeric address.  The result must not be
+ * passed to freeaddrinfo(3).
+ */
+struct addrinfo *
+host_pton_buf(const char *paddr, struct host_addr *ha)
+{
+	struct sockaddr_in *sin = (struct sockaddr_in *)&ha->ha_ss;
+	struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&ha->ha_ss;
+
+	memset(ha, 0, sizeof(*ha));
+	if (inet_pton(AF_INET, paddr, &sin->sin_addr) == 1)
+		sin->sin_family = AF_INET;
+#ifdef IPV6_SUPPORTED
+	else if (inet_pton(AF_INET6, paddr, &sin6->sin6_addr) == 1 ||
+		 host_pton_scoped(paddr, sin6))
+		sin6->sin6_family = AF_INET6;
+#endif
+	else
+		return NULL;
+	return host_addrinfo_buf((struct sockaddr *)&ha->ha_ss, ha);
+}
+
+/**
+ * host_addrinfo_buf - fill in an addrinfo for a socket address
+ * @sap: pointer to socket address
+ * @ha: caller-supplied storage for the result
+ *
+ * Like host_numeric_addrinfo(), but nothing is allocated.  @sap may
+ * point to @ha's own address storage.  Returns a pointer to the
+ * addrinfo in @ha, or NULL if @sap's family is not supported.  The
+ * result must not be passed to freeaddrinfo(3).
+ */
+struct addrinfo *
+host_addrinfo_buf(const struct sockaddr *sap, struct host_addr *ha)
+{
+	socklen_t salen = nfs_sockaddr_length(sap);
+
+	if (salen == 0)
+		return NULL;
+	if (sap != (struct sockaddr *)&ha->ha_ss)
+		memcpy(&ha->ha_ss, sap, salen);
+	memset(&ha->ha_ai, 0, sizeof(ha->ha_ai));
+	ha->ha_ai.ai_family = sap->sa_family;
+	ha->ha_ai.ai_socktype = SOCK_DGRAM;
+	ha->ha_ai.ai_protocol = (int)IPPROTO_UDP;
+	ha->ha_ai.ai_addrlen = salen;
+	ha->ha_ai.ai_addr = (struct sockaddr *)&ha->ha_ss;
+	return &ha->ha_ai;
+}
+
 /**
  * host_addrinfo - return addrinfo for a given hostname
  * @hostname: pointer to a '\0'-terminated ASCII string containing a hostname
@@ -0,0 +1,627 @@
+/*
+ * support/export/mnttab.c
+ *
+ * In-memory copy of the mount table.
+ *
+ * Filehandle lookups for crossmnt exports need every mount point
+ * below an export, and used to re-read the whole of /etc/mtab for
+ * each one.  Instead, keep a parsed copy of /proc/self/mountinfo,
+ * sorted by mount point so that the mounts under a directory form one
+ * contiguous range, along with a hash of the mounts by device number.
+ * The kernel flags /proc/self/mountinfo with POLLPRI whenever the
+ * mount table changes, so a zero-timeout poll() tells us when the
+ * copy has gone stale.
+ *
+ * mount.nfs uses the same table, with a hash of the mounts by source
+ * as well, so that an umount on a host with many thousands of mounts
+ * neither parses the whole of /proc/mounts twice nor scans it per
+ * lookup.
+ *
+ * Callers take a reference on the current table with mnttab_get()
+ * and drop it with mnttab_put(); a table replaced while in use is
+ * freed once the last reference goes away.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <sys/types.h>
+#include <sys/sysmacros.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#ifdef HAVE_LIBPTHREAD
+#include <pthread.h>
+#endif
+
+#include "nfsd_path.h"
+#include "export.h"
+
+#define MOUNTINFO	"/proc/self/mountinfo"
+
+struct mnttab {
+	int			mt_refcount;
+	size_t			mt_count;
+	struct mnttab_entry	*mt_entries;	/* sorted by me_dir */
+	size_t			mt_hashmask;
+	struct mnttab_entry	**mt_devhash;
+	struct mnttab_entry	**mt_srchash;
+};
+
+static struct mnttab	*mnttab_current;
+static int		mnttab_fd = -1;
+static int		mnttab_no_rootdir;
+static unsigned long	mnttab_hits;
+static unsigned long	mnttab_parses;
+
+#ifdef HAVE_LIBPTHREAD
+static pthread_mutex_t	mnttab_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define mnttab_lock()	pthread_mutex_lock(&mnttab_mutex)
+#define mnttab_unlock()	pthread_mutex_unlock(&mnttab_mutex)
+#else
+#define mnttab_lock()	do { } while (0)
+#define mnttab_unlock()	do { } while (0)
+#endif
+
+static void
+mnttab_free(struct mnttab *mt)
+{
+	size_t i;
+
+	for (i = 0; i < mt->mt_count; i++) {
+		free(mt->mt_entries[i].me_dir);
+		free(mt->mt_entries[i].me_type);
+		free(mt->mt_entries[i].me_source);
+		free(mt->mt_entries[i].me_opts);
+	}
+	free(mt->mt_entries);
+	free(mt->mt_devhash);
+	free(mt->mt_srchash);
+	free(mt);
+}
+
+static size_t
+mnttab_devhash(dev_t dev, size_t mask)
+{
+	unsigned long long v = dev;
+
+	v ^= v >> 33;
+	v *= 0xff51afd7ed558ccdULL;
+	v ^= v >> 33;
+	return (size_t)v & mask;
+}
+
+static size_t
+mnttab_srchash(const char *source, size_t mask)
+{
+	unsigned long long v = 0xcbf29ce484222325ULL;
+
+	while (*source)
+		v = (v ^ (unsigned char)*source++) * 0x100000001b3ULL;
+	return (size_t)v & mask;
+}
+
+/* Undo the octal escaping the kernel applies to white space and '\' */
+static void
+mnttab_unescape(char *s)
+{
+	char *d = s;
+
+	while (*s) {
+		if (s[0] == '\\' &&
+		    s[1] >= '0' && s[1] <= '3' &&
+		    s[2] >= '0' && s[2] <= '7' &&
+		    s[3] >= '0' && s[3] <= '7') {
+			*d++ = ((s[1] - '0') << 6) | ((s[2] - '0') << 3) |
+				(s[3] - '0');
+			s += 4;
+		} else
+			*d++ = *s++;
+	}
+	*d = '\0';
+}
+
+/*
+ * Join the per-mount and per-superblock options the way /proc/mounts
+ * shows them; both lists start with "rw" or "ro".
+ */
+static char *
+mnttab_join_opts(const char *mntopts, const char *sbopts)
+{
+	const char *comma;
+	char *opts;
+
+	if (sbopts == NULL)
+		return strdup(mntopts);
+	comma = strchr(sbopts, ',');
+	if (strncmp(sbopts, "rw", 2) == 0 || strncmp(sbopts, "ro", 2) == 0) {
+		if (comma == NULL)
+			return strdup(mntopts);
+		sbopts = comma + 1;
+	}
+	opts = malloc(strlen(mntopts) + strlen(sbopts) + 2);
+	if (opts)
+		sprintf(opts, "%s,%s", mntopts, sbopts);
+	return opts;
+}
+
+/*
+ * Parse one line of mountinfo:
+ *   id parent major:minor root mountpoint options [optional...] -
+ *	type source super-options
+ */
+static int
+mnttab_parse_line(char *line, const char *root, struct mnttab_entry *me)
+{
+	char *field[6], *type, *source, *dir, *p;
+	unsigned int maj, min;
+	int i;
+
+	p = line;
+	for (i = 0; i < 6; i++) {
+		field[i] = strsep(&p, " ");
+		if (field[i] == NULL)
+			return -1;
+	}
+	if (sscanf(field[0], "%d", &me->me_id) != 1 ||
+	    sscanf(field[2], "%u:%u", &maj, &min) != 2)
+		return -1;
+
+	/* Skip the per-mount options and any optional fields */
+	while ((type = strsep(&p, " ")) != NULL)
+		if (strcmp(type, "-") == 0)
+			break;
+	type = strsep(&p, " ");
+	if (type == NULL)
+		return -1;
+	source = strsep(&p, " ");
+	if (source == NULL)
+		return -1;
+	mnttab_unescape(source);
+
+	mnttab_unescape(field[4]);
+	dir = field[4];
+	if (root) {
+		/* Same as nfsd_path_strip_root(), minus the realpath() */
+		size_t len = strlen(root);
+
+		if (strncmp(dir, root, len) != 0)
+			return -1;
+		dir += len;
+	}
+
+	me->me_dir = strdup(dir);
+	me->me_type = strdup(type);
+	me->me_source = strdup(source);
+	me->me_opts = mnttab_join_opts(field[5], strsep(&p, " "));
+	if (me->me_dir == NULL || me->me_type == NULL ||
+	    me->me_source == NULL || me->me_opts == NULL) {
+		free(me->me_dir);
+		free(me->me_type);
+		free(me->me_source);
+		free(me->me_opts);
+		return -1;
+	}
+	me->me_dev = makedev(maj, min);
+	me->me_devnext = NULL;
+	me->me_srcnext = NULL;
+	return 0;
+}
+
+static char *
+mnttab_slurp(int fd)
+{
+	size_t size = 16384, len = 0;
+	char *buf, *new;
+	ssize_t n;
+
+	if (lseek(fd, 0, SEEK_SET) < 0)
+		return NULL;
+	buf = malloc(size);
+	if (buf == NULL)
+		return NULL;
+	for (;;) {
+		if (len + 1 >= size) {
+			size *= 2;
+			new = realloc(buf, size);
+			if (new == NULL) {
+				free(buf);
+				return NULL;
+			}
+			buf = new;
+		}
+		n = read(fd, buf + len, size - len - 1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			free(buf);
+			return NULL;
+		}
+		if (n == 0)
+			break;
+		len += n;
+	}
+	buf[len] = '\0';
+	return buf;
+}
+
+static int
+mnttab_entry_cmp(const void *a, const void *b)
+{
+	const struct mnttab_entry *ea = a, *eb = b;
+
+	return strcmp(ea->me_dir, eb->me_dir);
+}
+
+/* Stacked mounts on one directory stay in mount order */
+static int
+mnttab_entry_sort_cmp(const void *a, const void *b)
+{
+	const struct mnttab_entry *ea = a, *eb = b;
+	int rc = strcmp(ea->me_dir, eb->me_dir);
+
+	if (rc)
+		return rc;
+	return ea->me_seq < eb->me_seq ? -1 : ea->me_seq > eb->me_seq;
+}
+
+static int
+mnttab_seq_cmp(const void *a, const void *b)
+{
+	const struct mnttab_entry *ea = *(struct mnttab_entry * const *)a;
+	const struct mnttab_entry *eb = *(struct mnttab_entry * const *)b;
+
+	return ea->me_seq < eb->me_seq ? -1 : ea->me_seq > eb->me_seq;
+}
+
+static struct mnttab *
+mnttab_parse(int fd)
+{
+	struct mnttab *mt;
+	struct mnttab_entry **order = NULL;
+	char *buf, *line, *next;
+	const char *root;
+	char rootbuf[PATH_MAX];
+	size_t lines = 0, size, i;
+
+	root = mnttab_no_rootdir ? NULL : nfsd_path_nfsd_rootdir();
+	if (root && !realpath(root, rootbuf)) {
+		xlog(D_GENERAL, "%s: failed to resolve path %s: %m",
+			__func__, root);
+		root = NULL;
+	} else if (root)
+		root = rootbuf;
+
+	buf = mnttab_slurp(fd);
+	if (buf == NULL)
+		return NULL;
+	for (line = buf; *line; line++)
+		if (*line == '\n')
+			lines++;
+
+	mt = calloc(1, sizeof(*mt));
+	if (mt == NULL)
+		goto out_nomem;
+	mt->mt_refcount = 1;
+	mt->mt_entries = calloc(lines + 1, sizeof(*mt->mt_entries));
+	if (mt->mt_entries == NULL)
+		goto out_nomem;
+
+	for (line = buf; line && *line; line = next) {
+		next = strchr(line, '\n');
+		if (next)
+			*next++ = '\0';
+		if (mnttab_parse_line(line, root,
+				      &mt->mt_entries[mt->mt_count]) == 0) {
+			mt->mt_entries[mt->mt_count].me_seq = mt->mt_count;
+			mt->mt_count++;
+		}
+	}
+	free(buf);
+	buf = NULL;
+
+	qsort(mt->mt_entries, mt->mt_count, sizeof(*mt->mt_entries),
+	      mnttab_entry_sort_cmp);
+
+	for (size = 16; size < mt->mt_count * 2; size <<= 1)
+		;
+	mt->mt_hashmask = size - 1;
+	mt->mt_devhash = calloc(size, sizeof(*mt->mt_devhash));
+	if (mt->mt_devhash == NULL)
+		goto out_nomem;
+	/* Walk backwards so each chain is in mount point order */
+	for (i = mt->mt_count; i-- > 0; ) {
+		struct mnttab_entry *me = &mt->mt_entries[i];
+		size_t h = mnttab_devhash(me->me_dev, mt->mt_hashmask);
+
+		me->me_devnext = mt->mt_devhash[h];
+		mt->mt_devhash[h] = me;
+	}
+
+	/* ...and each source chain in mount order */
+	mt->mt_srchash = calloc(size, sizeof(*mt->mt_srchash));
+	order = malloc((mt->mt_count + 1) * sizeof(*order));
+	if (mt->mt_srchash == NULL || order == NULL)
+		goto out_nomem;
+	for (i = 0; i < mt->mt_count; i++)
+		order[i] = &mt->mt_entries[i];
+	qsort(order, mt->mt_count, sizeof(*order), mnttab_seq_cmp);
+	for (i = mt->mt_count; i-- > 0; ) {
+		struct mnttab_entry *me = order[i];
+		size_t h = mnttab_srchash(me->me_source, mt->mt_hashmask);
+
+		me->me_srcnext = mt->mt_srchash[h];
+		mt->mt_srchash[h] = me;
+	}
+	free(order);
+	return mt;
+
+out_nomem:
+	xlog(L_ERROR, "%s: no memory for mount table", __func__);
+	free(order);
+	free(buf);
+	if (mt)
+		mnttab_free(mt);
+	return NULL;
+}
+
+static int
+mnttab_changed(void)
+{
+	struct pollfd pfd;
+
+	if (mnttab_fd < 0) {
+		mnttab_fd = open(MOUNTINFO, O_RDONLY | O_CLOEXEC);
+		if (mnttab_fd < 0)
+			xlog(L_ERROR, "%s: unable to open %s: %m",
+				__func__, MOUNTINFO);
+		return 1;
+	}
+	pfd.fd = mnttab_fd;
+	pfd.events = POLLPRI;
+	pfd.revents = 0;
+	if (poll(&pfd, 1, 0) < 0)
+		return 1;
+	return (pfd.revents & (POLLPRI | POLLERR)) != 0;
+}
+
+/**
+ * mnttab_ignore_rootdir - report mount points as the caller sees them
+ *
+ * By default mount points are reported relative to nfsd's rootdir,
+ * as export paths are; mount.nfs wants them as they are.
+ */
+void
+mnttab_ignore_rootdir(void)
+{
+	mnttab_lock();
+	mnttab_no_rootdir = 1;
+	mnttab_unlock();
+}
+
+/**
+ * mnttab_get - take a reference on an up to date copy of the mount table
+ *
+ * Returns NULL if the mount table could not be read.
+ */
+struct mnttab *
+mnttab_get(void)
+{
+	struct mnttab *mt;
+
+	mnttab_lock();
+	if (mnttab_changed() || mnttab_current == NULL) {
+		if (mnttab_fd >= 0 && (mt = mnttab_parse(mnttab_fd)) != NULL) {
+			if (mnttab_current && --mnttab_current->mt_refcount == 0)
+				mnttab_free(mnttab_current);
+			mnttab_current = mt;
+			xlog(D_GENERAL, "mount table reloaded: %zu mounts, "
+			     "%lu lookups served from cache so far",
+			     mt->mt_count, mnttab_hits);
+			mnttab_parses++;
+		}
+	} else
+		mnttab_hits++;
+	mt = mnttab_current;
+	if (mt)
+		mt->mt_refcount++;
+	mnttab_unlock();
+	return mt;
+}
+
+/**
+ * mnttab_put - release a reference taken by mnttab_get()
+ * @mt: mount table, may be NULL
+ */
+void
+mnttab_put(struct mnttab *mt)
+{
+	if (mt == NULL)
+		return;
+	mnttab_lock();
+	if (--mt->mt_refcount == 0)
+		mnttab_free(mt);
+	mnttab_unlock();
+}
+
+/*
+ * Compare @dir against the string "@path/".  Only the sign matters;
+ * zero means @dir lies at or below "@path/".
+ */
+static int
+mnttab_below_cmp(const char *dir, const char *path, size_t len)
+{
+	int rc = strncmp(dir, path, len);
+
+	if (rc)
+		return rc;
+	return (unsigned char)dir[len] - (unsigned char)'/';
+}
+
+/**
+ * mnttab_next_below - iterate over mount points strictly below @path
+ * @mt: mount table from mnttab_get()
+ * @path: NUL-terminated directory name
+ * @pos: iteration cursor; set to MNTTAB_START before the first call
+ *
+ * Returns the next mount entry, or NULL when there are no more.
+ */
+const struct mnttab_entry *
+mnttab_next_below(const struct mnttab *mt, const char *path, size_t *pos)
+{
+	size_t len = strlen(path);
+	const struct mnttab_entry *me;
+
+	if (*pos == MNTTAB_START) {
+		size_t lo = 0, hi = mt->mt_count;
+
+		while (lo < hi) {
+			size_t mid = lo + (hi - lo) / 2;
+
+			if (mnttab_below_cmp(mt->mt_entries[mid].me_dir,
+					     path, len) < 0)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		*pos = lo;
+	}
+	if (*pos >= mt->mt_count)
+		return NULL;
+	me = &mt->mt_entries[*pos];
+	if (strncmp(me->me_dir, path, len) != 0 || me->me_dir[len] != '/')
+		return NULL;
+	(*pos)++;
+	return me;
+}
+
+/**
+ * mnttab_next_path - iterate over the mounts stacked on @path
+ * @mt: mount table from mnttab_get()
+ * @path: NUL-terminated directory name
+ * @pos: iteration cursor; set to MNTTAB_START before the first call
+ *
+ * The mounts are returned in the order they were made, so the last
+ * one returned is the one that is visible.
+ *
+ * Returns the next mount entry, or NULL when there are no more.
+ */
+const struct mnttab_entry *
+mnttab_next_path(const struct mnttab *mt, const char *path, size_t *pos)
+{
+	const struct mnttab_entry *me;
+
+	if (*pos == MNTTAB_START) {
+		size_t lo = 0, hi = mt->mt_count;
+
+		while (lo < hi) {
+			size_t mid = lo + (hi - lo) / 2;
+
+			if (strcmp(mt->mt_entries[mid].me_dir, path) < 0)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		*pos = lo;
+	}
+	if (*pos >= mt->mt_count)
+		return NULL;
+	me = &mt->mt_entries[*pos];
+	if (strcmp(me->me_dir, path) != 0)
+		return NULL;
+	(*pos)++;
+	return me;
+}
+
+/**
+ * mnttab_lookup_path - find the mount at exactly @path
+ * @mt: mount table from mnttab_get()
+ * @path: NUL-terminated directory name
+ *
+ * Returns NULL if @path is not a mount point.  If several mounts are
+ * stacked on @path, any one of them may be returned.
+ */
+const struct mnttab_entry *
+mnttab_lookup_path(const struct mnttab *mt, const char *path)
+{
+	struct mnttab_entry key = { .me_dir = (char *)path };
+
+	return bsearch(&key, mt->mt_entries, mt->mt_count,
+		       sizeof(*mt->mt_entries), mnttab_entry_cmp);
+}
+
+/**
+ * mnttab_lookup_dev - find the mounts of device @dev
+ * @mt: mount table from mnttab_get()
+ * @dev: device number
+ *
+ * Returns the first matching entry; follow me_devnext (checking
+ * me_dev) for further mounts of the same device.
+ */
+const struct mnttab_entry *
+mnttab_lookup_dev(const struct mnttab *mt, dev_t dev)
+{
+	const struct mnttab_entry *me;
+
+	me = mt->mt_devhash[mnttab_devhash(dev, mt->mt_hashmask)];
+	while (me && me->me_dev != dev)
+		me = me->me_devnext;
+	return me;
+}
+
+/**
+ * mnttab_lookup_source - find the mounts of @source
+ * @mt: mount table from mnttab_get()
+ * @source: what was mounted, such as "server:/export"
+ *
+ * Returns the first matching entry in mount order; follow me_srcnext
+ * (checking me_source) for later mounts of the same source.
+ */
+const struct mnttab_entry *
+mnttab_lookup_source(const struct mnttab *mt, const char *source)
+{
+	const struct mnttab_entry *me;
+
+	me = mt->mt_srchash[mnttab_srchash(source, mt->mt_hashmask)];
+	while (me && strcmp(me->me_source, source) != 0)
+		me = me->me_srcnext;
+	return me;
+}
+
+/**
+ * mnttab_generation - identify the current copy of the mount table
+ *
+ * The value changes each time the mount table is re-read, so callers
+ * can cheaply tell whether data derived from it may be stale.  It
+ * does not check for changes itself; mnttab_get() does that.
+ */
+unsigned long
+mnttab_generation(void)
+{
+	unsigned long gen;
+
+	mnttab_lock();
+	gen = mnttab_parses;
+	mnttab_unlock();
+	return gen;
+}
+
+/**
+ * mnttab_stats - report mount table cache effectiveness
+ * @hits: set to the number of lookups that did not need a re-parse
+ * @parses: set to the number of times the mount table was parsed
+ */
+void
+mnttab_stats(unsigned long *hits, unsigned long *parses)
+{
+	mnttab_lock();
+	*hits = mnttab_hits;
+	*parses = mnttab_parses;
+	mnttab_unlock();
+}
@@ -3,22 +3,29 @@
  *
  * Montior clients appearing in, and disappearing from, /proc/fs/nfsd/clients
  * and log relevant information.
+ *
+ * The events that arrive together are handled together: a client's
+ * info file is read once they all have been seen, and only if the
+ * client is still there, so that a client which comes and goes, or
+ * whose info changes several times, in the meantime costs no reads.
  */
 
 #include <unistd.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <sys/inotify.h>
 #include <sys/stat.h>
+#include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include "export.h"
+#include "xepoll.h"
+#include "nfsdclients.h"
 
-/* search.h declares 'struct entry' and nfs_prot.h
- * does too.  Easiest fix is to trick search.h into
- * calling its struct "struct Entry".
- */
-#define entry Entry
-#include <search.h>
-#undef entry
+#define CLIENTS_DIR	NFSD_CLIENTS_DIR
+
+/* Whether clients are watched and logged at all */
+int v4clients_log = 1;
 
 static int clients_fd = -1;
 
@@ -26,7 +33,9 @@ void v4clients_init(void)
 {
 	struct stat sb;
 
-	if (!stat("/proc/fs/nfsd/clients", &sb) == 0 ||
+	if (!v4clients_log)
+		return;
+	if (!stat(CLIENTS_DIR, &sb) == 0 ||
 	    !S_ISDIR(sb.st_mode))
 		return;
 	if (clients_fd >= 0)
@@ -37,7 +46,7 @@ void v4clients_init(void)
 			 strerror(errno));
 		return;
 	}
-	if (inotify_add_watch(clients_fd, "/proc/fs/nfsd/clients",
+	if (inotify_add_watch(clients_fd, CLIENTS_DIR,
 			      IN_CREATE | IN_DELETE) < 0) {
 		xlog_err("Unable to watch /proc/fs/nfsd/clients: %s\n",
 			 strerror(errno));
@@ -47,34 +56,110 @@ void v4clients_init(void)
 	}
 }
 
-void v4clients_set_fds(fd_set *fdset)
-{
-	if (clients_fd >= 0)
-		FD_SET(clients_fd, fdset);
-}
-
-static void *tree_root;
 static int have_unconfirmed;
 
 struct ent {
+	struct ent *hnext;		/* by num */
+	struct ent *wnext;		/* by wid, while watched */
+	struct ent *pnext;		/* while pending */
 	unsigned long num;
 	char *clientid;
 	char *addr;
 	int vers;
 	int unconfirmed;
 	int wid;
+	int pending;			/* info to be read */
+	unsigned int seen;		/* last rescan that found it */
 };
 
-static int ent_cmp(const void *av, const void *bv)
+#define ENT_HASH_INIT	256		/* initial buckets, a power of 2 */
+#define WID_HASH	256		/* buckets, a power of 2 */
+
+static struct ent **ent_table;
+static unsigned int ent_size, ent_count;
+static struct ent *wid_table[WID_HASH];
+static struct ent *pending;
+
+static unsigned int ent_hash(unsigned long num)
+{
+	return (uint32_t)(num * 2654435761u);
+}
+
+static void ent_grow(void)
 {
-	const struct ent *a = av;
-	const struct ent *b = bv;
+	unsigned int size = ent_size ? ent_size * 2 : ENT_HASH_INIT;
+	struct ent **table, *ent, *next;
+	unsigned int i;
 
-	if (a->num < b->num)
-		return -1;
-	if (a->num > b->num)
-		return 1;
-	return 0;
+	table = calloc(size, sizeof(*table));
+	if (!table)
+		return;
+	for (i = 0; i < ent_size; i++)
+		for (ent = ent_table[i]; ent; ent = next) {
+			next = ent->hnext;
+			ent->hnext = table[ent_hash(ent->num) & (size - 1)];
+			table[ent_hash(ent->num) & (size - 1)] = ent;
+		}
+	free(ent_table);
+	ent_table = table;
+	ent_size = size;
+}
+
+static struct ent **find_num(unsigned long num)
+{
+	struct ent **ep;
+
+	if (!ent_table)
+		return NULL;
+	ep = &ent_table[ent_hash(num) & (ent_size - 1)];
+	while (*ep && (*ep)->num != num)
+		ep = &(*ep)->hnext;
+	return ep;
+}
+
+static struct ent *find_wid(int wid)
+{
+	struct ent *ent;
+
+	for (ent = wid_table[wid & (WID_HASH - 1)]; ent; ent = ent->wnext)
+		if (ent->wid == wid)
+			return ent;
+	return NULL;
+}
+
+static void watch(struct ent *ent, const char *path)
+{
+	struct ent **head;
+
+	ent->wid = inotify_add_watch(clients_fd, path, IN_MODIFY);
+	if (ent->wid < 0)
+		return;
+	head = &wid_table[ent->wid & (WID_HASH - 1)];
+	ent->wnext = *head;
+	*head = ent;
+}
+
+static void unwatch(struct ent *ent)
+{
+	struct ent **ep;
+
+	if (ent->wid < 0)
+		return;
+	inotify_rm_watch(clients_fd, ent->wid);
+	ep = &wid_table[ent->wid & (WID_HASH - 1)];
+	while (*ep != ent)
+		ep = &(*ep)->wnext;
+	*ep = ent->wnext;
+	ent->wid = -1;
+}
+
+static void set_pending(struct ent *ent)
+{
+	if (ent->pending)
+		return;
+	ent->pending = 1;
+	ent->pnext = pending;
+	pending = ent;
 }
 
 static void free_ent(struct ent *ent)
@@ -84,140 +169,175 @@ static void free_ent(struct ent *ent)
 	free(ent);
 }
 
-static char *dup_line(char *line)
-{
-	char *ret;
-	char *e = strchr(line, '\n');
-	if (!e)
-		e = line + strlen(line);
-	ret = malloc(e - line + 1);
-	if (ret) {
-		memcpy(ret, line, e - line);
-		ret[e-line] = 0;
-	}
-	return ret;
-}
-
 static void read_info(struct ent *key)
 {
-	char buf[2048];
-	char *path;
+	char path[sizeof(CLIENTS_DIR) + 32];
 	int was_unconfirmed = key->unconfirmed;
-	FILE *f;
-
-	if (asprintf(&path, "/proc/fs/nfsd/clients/%lu/info", key->num) < 0)
-		return;
+	struct nfsd_client_info info;
 
-	f = fopen(path, "r");
-	if (!f) {
-		free(path);
+	snprintf(path, sizeof(path), CLIENTS_DIR "/%lu/info", key->num);
+	if (nfsd_client_read_info(AT_FDCWD, path, &info) < 0)
 		return;
-	}
 	if (key->wid < 0)
-		key->wid = inotify_add_watch(clients_fd, path, IN_MODIFY);
+		watch(key, path);
 
-	while (fgets(buf, sizeof(buf), f)) {
-		if (strncmp(buf, "clientid: ", 10) == 0) {
-			free(key->clientid);
-			key->clientid = dup_line(buf+10);
-		}
-		if (strncmp(buf, "address: ", 9) == 0) {
-			free(key->addr);
-			key->addr = dup_line(buf+9);
-		}
-		if (strncmp(buf, "minor version: ", 15) == 0)
-			key->vers = atoi(buf+15);
-		if (strncmp(buf, "status: ", 8) == 0 &&
-		    strstr(buf, " unconfirmed") != NULL) {
-			key->unconfirmed = 1;
-			have_unconfirmed = 1;
-		}
-		if (strncmp(buf, "status: ", 8) == 0 &&
-		    strstr(buf, " confirmed") != NULL)
-			key->unconfirmed = 0;
+	if (info.ci_clientid) {
+		free(key->clientid);
+		key->clientid = info.ci_clientid;
+		info.ci_clientid = NULL;
+	}
+	if (info.ci_address) {
+		free(key->addr);
+		key->addr = info.ci_address;
+		info.ci_address = NULL;
 	}
-	fclose(f);
-	free(path);
+	if (info.ci_minorversion >= 0)
+		key->vers = info.ci_minorversion;
+	if (info.ci_status == NFSD_CLIENT_UNCONFIRMED) {
+		key->unconfirmed = 1;
+		have_unconfirmed = 1;
+	} else if (info.ci_status == NFSD_CLIENT_CONFIRMED)
+		key->unconfirmed = 0;
+	nfsd_client_free_info(&info);
 
 	if (was_unconfirmed && !key->unconfirmed)
 		xlog(L_NOTICE, "v4.%d client attached: %s from %s",
 		     key->vers, key->clientid ?: "-none-",
 		     key->addr ?: "-none-");
-	if (!key->unconfirmed && key->wid >= 0) {
-		inotify_rm_watch(clients_fd, key->wid);
-		key->wid = -1;
-	}
+	if (!key->unconfirmed)
+		unwatch(key);
 }
 
-static void add_id(int id)
+static struct ent *add_id(unsigned long id)
 {
-	struct ent **ent;
+	struct ent **ep;
 	struct ent *key;
 
+	if (ent_count >= ent_size)
+		ent_grow();
+	ep = find_num(id);
+	if (!ep)
+		return NULL;
+	if (*ep)
+		/* Already existed */
+		return *ep;
+
 	key = calloc(1, sizeof(*key));
-	if (!key) {
-		return;
-	}
+	if (!key)
+		return NULL;
 	key->num = id;
 	key->wid = -1;
+	*ep = key;
+	ent_count++;
+	set_pending(key);
+	return key;
+}
 
-	ent = tsearch(key, &tree_root, ent_cmp);
+static void del_ent(struct ent **ep)
+{
+	struct ent *ent = *ep, **pp;
 
-	if (!ent || *ent != key)
-		/* Already existed, or insertion failed */
-		free_ent(key);
-	else
-		read_info(key);
+	*ep = ent->hnext;
+	ent_count--;
+	if (ent->pending) {
+		pp = &pending;
+		while (*pp != ent)
+			pp = &(*pp)->pnext;
+		*pp = ent->pnext;
+	}
+	/* a client whose info was never read has nothing to report */
+	if (!ent->unconfirmed && ent->clientid)
+		xlog(L_NOTICE, "v4.%d client detached: %s from %s",
+		     ent->vers, ent->clientid, ent->addr ?: "-none-");
+	unwatch(ent);
+	free_ent(ent);
 }
 
 static void del_id(unsigned long id)
 {
-	struct ent key = {.num = id};
-	struct ent **e, *ent;
+	struct ent **ep = find_num(id);
 
-	e = tfind(&key, &tree_root, ent_cmp);
-	if (!e || !*e)
-		return;
-	ent = *e;
-	tdelete(ent, &tree_root, ent_cmp);
-	if (!ent->unconfirmed)
-		xlog(L_NOTICE, "v4.%d client detached: %s from %s",
-		     ent->vers, ent->clientid, ent->addr);
-	if (ent->wid >= 0)
-		inotify_rm_watch(clients_fd, ent->wid);
-	free_ent(ent);
+	if (ep && *ep)
+		del_ent(ep);
+}
+
+static void check_wid(int wid)
+{
+	struct ent *ent = find_wid(wid);
+
+	if (ent && ent->unconfirmed)
+		set_pending(ent);
 }
 
-static void check_id(unsigned long id)
+/*
+ * Events were lost: bring the table up to date with what is in
+ * CLIENTS_DIR now.
+ */
+static void rescan(void)
 {
-	struct ent key = {.num = id};
-	struct ent **e, *ent;
+	static unsigned int generation;
+	struct dirent *d;
+	struct ent *ent, **ep;
+	unsigned int i;
+	DIR *dir;
+	long id;
 
-	e = tfind(&key, &tree_root, ent_cmp);
-	if (!e || !*e)
+	dir = opendir(CLIENTS_DIR);
+	if (!dir)
 		return;
-	ent = *e;
-	if (ent->unconfirmed)
-		read_info(ent);
+	generation++;
+	while ((d = readdir(dir)) != NULL) {
+		id = atol(d->d_name);
+		if (id <= 0)
+			continue;
+		ent = add_id(id);
+		if (ent)
+			ent->seen = generation;
+	}
+	closedir(dir);
+
+	for (i = 0; i < ent_size; i++) {
+		ep = &ent_table[i];
+		while ((ent = *ep) != NULL) {
+			if (ent->seen != generation) {
+				del_ent(ep);
+				continue;
+			}
+			if (ent->unconfirmed)
+				set_pending(ent);
+			ep = &ent->hnext;
+		}
+	}
+	xlog(D_GENERAL, "v4clients: events lost, %u clients found",
+	     ent_count);
 }
 
-int v4clients_process(fd_set *fdset)
+static void v4clients_process(int fd, void *UNUSED(data))
 {
 	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
 	const struct inotify_event *ev;
+	struct ent *ent;
+	int overflow = 0;
 	ssize_t len;
 	char *ptr;
 
-	if (clients_fd < 0 ||
-	    !FD_ISSET(clients_fd, fdset))
-		return 0;
-
-	while ((len = read(clients_fd, buf, sizeof(buf))) > 0) {
+	while ((len = read(fd, buf, sizeof(buf))) > 0) {
 		for (ptr = buf; ptr < buf + len;
 		     ptr += sizeof(struct inotify_event) + ev->len) {
 			int id;
 			ev = (const struct inotify_event *)ptr;
 
+			if (ev->mask & IN_Q_OVERFLOW) {
+				overflow = 1;
+				continue;
+			}
+			/* the info files are watched themselves, and
+			 * their events carry no name
+			 */
+			if (ev->mask & IN_MODIFY) {
+				check_wid(ev->wd);
+				continue;
+			}
 			id = atoi(ev->name);
 			if (id <= 0)
 				continue;
@@ -225,9 +345,26 @@ int v4clients_process(fd_set *fdset)
 				add_id(id);
 			if (ev->mask & IN_DELETE)
 				del_id(id);
-			if (ev->mask & IN_MODIFY)
-				check_id(id);
 		}
 	}
-	return 1;
+
+	if (overflow)
+		rescan();
+	while ((ent = pending) != NULL) {
+		pending = ent->pnext;
+		ent->pending = 0;
+		read_info(ent);
+	}
+}
+
+/**
+ * v4clients_register_events - add the clients watcher to the event loop
+ *
+ * Returns 1 if the watcher was registered, otherwise zero.
+ */
+int v4clients_register_events(void)
+{
+	if (clients_fd < 0)
+		return 0;
+	return xepoll_add(clients_fd, v4clients_process, NULL) == 0;
 }
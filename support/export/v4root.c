@@ -75,19 +75,19 @@ set_pseudofs_security(struct exportent *pseudo)
 }
 
 /*
- * Create a pseudo export
+ * Create a pseudo export of @path to @clp, the client of @hostname
  */
 static struct exportent *
-v4root_create(char *path, nfs_export *export)
+v4root_create(char *path, char *hostname, nfs_client *clp)
 {
 	nfs_export *exp;
 	struct exportent eep;
-	struct exportent *curexp = &export->m_export;
 
-	dupexportent(&eep, &pseudo_root.m_export);
+	/* export_create_client() copies what it keeps */
+	eep = pseudo_root.m_export;
 	eep.e_ttl = default_ttl;
-	eep.e_hostname = curexp->e_hostname;
-	strncpy(eep.e_path, path, sizeof(eep.e_path)-1);
+	eep.e_hostname = hostname;
+	eep.e_path = path;
 	if (strcmp(path, "/") != 0)
 		eep.e_flags &= ~NFSEXP_FSID;
 
@@ -111,9 +111,10 @@ v4root_create(char *path, nfs_export *export)
 		eep.e_uuid = uuid_s;
 	}
 	set_pseudofs_security(&eep);
-	exp = export_create(&eep, 0);
+	exp = export_create_client(&eep, clp);
 	if (exp == NULL)
 		return NULL;
+	exp->m_pseudo = 1;
 	xlog(D_CALL, "v4root_create: path '%s' flags 0x%x",
 		exp->m_export.e_path, exp->m_export.e_flags);
 	return &exp->m_export;
@@ -141,16 +142,29 @@ v4root_support(void)
 	return 0;
 }
 
+/* The export of @path to @clp itself, if there is one */
+static nfs_export *
+pseudofs_lookup(nfs_client *clp, const char *path)
+{
+	nfs_export *exp;
+
+	for (exp = export_find_path(clp->m_type, path, NULL); exp;
+	     exp = export_find_path(clp->m_type, path, exp))
+		if (exp->m_client == clp)
+			return exp;
+	return NULL;
+}
+
 static int
-pseudofs_update(char *hostname, char *path, nfs_export *source)
+pseudofs_update(char *hostname, nfs_client *clp, char *path)
 {
 	nfs_export *exp;
 
-	exp = export_lookup(hostname, path, 0);
+	exp = pseudofs_lookup(clp, path);
 	if (exp && !(exp->m_export.e_flags & NFSEXP_V4ROOT))
 		return 0;
 	if (!exp) {
-		if (v4root_create(path, source) == NULL) {
+		if (v4root_create(path, hostname, clp) == NULL) {
 			xlog(L_WARNING, "v4root_set: Unable to create "
 					"pseudo export for '%s'", path);
 			return -ENOMEM;
@@ -159,48 +173,137 @@ pseudofs_update(char *hostname, char *path, nfs_export *source)
 	}
 	/* Update an existing V4ROOT export: */
 	set_pseudofs_security(&exp->m_export);
+	exp->m_stale = 0;
 	return 0;
 }
 
-static int v4root_add_parents(nfs_export *exp)
+/*
+ * Add the parents of @path that the previous path of the same client,
+ * @prev, does not share.  As the paths are sorted, any parent that an
+ * earlier path had is also a parent of @prev, so with this each
+ * directory is only looked at once for each client.
+ */
+static int
+v4root_add_parents(char *hostname, nfs_client *clp, const char *path,
+		const char *prev)
 {
-	char *hostname = exp->m_export.e_hostname;
-	char *path;
-	char *ptr;
+	size_t len = strlen(path), i = 0;
+	char *buf;
 	int ret = 0;
 
-	path = strdup(exp->m_export.e_path);
-	if (!path) {
+	/* Skip the parents in common: those before the first difference */
+	if (prev)
+		while (path[i] && path[i] == prev[i])
+			i++;
+
+	buf = malloc(len + 1);
+	if (!buf) {
 		xlog(L_WARNING, "v4root_add_parents: Unable to create "
-				"pseudo export for '%s'", exp->m_export.e_path);
+				"pseudo export for '%s'", path);
 		return -ENOMEM;
 	}
-	for (ptr = path; ptr; ptr = strchr(ptr, '/')) {
-		char saved;
-
-		saved = *ptr;
-		*ptr = '\0';
-		ret = pseudofs_update(hostname, *path ? path : "/", exp);
+	memcpy(buf, path, len + 1);
+	for (; i < len; i++) {
+		if (buf[i] != '/')
+			continue;
+		buf[i] = '\0';
+		ret = pseudofs_update(hostname, clp, i ? buf : "/");
+		buf[i] = '/';
 		if (ret)
 			break;
-		*ptr = saved;
-		ptr++;
 	}
-	free(path);
+	free(buf);
 	return ret;
 }
 
+static int
+v4root_cmp(const void *a, const void *b)
+{
+	const struct exportent *ea = &(*(nfs_export * const *)a)->m_export;
+	const struct exportent *eb = &(*(nfs_export * const *)b)->m_export;
+	int c = 0;
+
+	/* e_hostname comes from the string pool, so is most often shared */
+	if (ea->e_hostname != eb->e_hostname)
+		c = strcmp(ea->e_hostname, eb->e_hostname);
+	return c ? c : strcmp(ea->e_path, eb->e_path);
+}
+
+/*
+ * What the pseudo exports depend on: the client and path of every
+ * etab export.  It is added up over the exports so that it does not
+ * depend on the order they are in, and can be worked out without
+ * sorting them.
+ */
+struct v4root_sig {
+	unsigned int		count;
+	unsigned long long	sum, xor;
+};
+
+static void
+v4root_sig_add(struct v4root_sig *sig, const struct exportent *e)
+{
+	unsigned long long h = 14695981039346656037ULL;
+	const char *c;
+
+	for (c = e->e_hostname; *c; c++)
+		h = (h ^ (unsigned char)*c) * 1099511628211ULL;
+	h = (h ^ 0xff) * 1099511628211ULL;
+	for (c = e->e_path; *c; c++)
+		h = (h ^ (unsigned char)*c) * 1099511628211ULL;
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+
+	sig->count++;
+	sig->sum += h;
+	sig->xor ^= h * 0xc4ceb9fe1a85ec53ULL;
+}
+
+/* The pseudo exports made from the last set of exports, and how many */
+static struct v4root_sig v4root_last;
+static unsigned int v4root_npseudo;
+
+/*
+ * If the etab exports are the clients and paths that the pseudo exports
+ * were last made from, and those (@npseudo of them) are all still
+ * there, keep them as they are.  Returns 1 if so.
+ */
+static int
+v4root_unchanged(const struct v4root_sig *sig, unsigned int npseudo)
+{
+	nfs_export *exp;
+	int i;
+
+	if (sig->count != v4root_last.count || sig->sum != v4root_last.sum ||
+	    sig->xor != v4root_last.xor || npseudo != v4root_npseudo)
+		return 0;
+
+	for (i = 0; i < MCL_MAXTYPES; i++)
+		for (exp = exportlist[i].p_head; exp; exp = exp->m_next)
+			if (exp->m_pseudo)
+				exp->m_stale = 0;
+	return 1;
+}
+
 /*
  * Create pseudo exports by running through the real export
  * looking at the components of the path that make up the export.
  * Those path components, if not exported, will become pseudo
  * exports allowing them to be found when the kernel does an upcall
  * looking for components of the v4 mount.
+ *
+ * The exports are sorted by client and path first, so that each
+ * client is looked up, and each directory looked at, only once.
  */
 void
 v4root_set()
 {
-	nfs_export	*exp;
+	struct v4root_sig sig = { 0, 0, 0 };
+	nfs_export	*exp, **exps;
+	nfs_client	*clp = NULL;
+	unsigned int	n = 0, npseudo = 0, j;
+	const char	*prev = NULL;
 	int	i;
 
 	if (!v4root_needed)
@@ -208,13 +311,25 @@ v4root_set()
 	if (!v4root_support())
 		return;
 
+	for (i = 0; i < MCL_MAXTYPES; i++)
+		n += exportlist[i].count;
+	exps = malloc((n ? n : 1) * sizeof(*exps));
+	if (!exps) {
+		xlog(L_WARNING, "v4root_set: Unable to create pseudo exports");
+		return;
+	}
+
+	n = 0;
 	for (i = 0; i < MCL_MAXTYPES; i++) {
 		for (exp = exportlist[i].p_head; exp; exp = exp->m_next) {
-			if (exp->m_export.e_flags & NFSEXP_V4ROOT)
-				/*
-				 * We just added this one, so its
-				 * parents are already dealt with!
-				 */
+			/*
+			 * Pseudo exports have their parents already,
+			 * and the copies export_find() makes have the
+			 * client and path of their etab export.
+			 */
+			npseudo += exp->m_pseudo;
+			if (exp->m_export.e_flags & NFSEXP_V4ROOT ||
+			    !exp->m_xtabent)
 				continue;
 
 			if (strcmp(exp->m_export.e_path, "/") == 0 &&
@@ -222,10 +337,43 @@ v4root_set()
 				/* Force '/' to be exported as fsid == 0*/
 				exp->m_export.e_flags |= NFSEXP_FSID;
 				exp->m_export.e_fsid = 0;
+				exp->m_fsidforced = 1;
 			}
 
-			v4root_add_parents(exp);
-			/* XXX: error handling! */
+			if (exp->m_export.e_hostname == NULL)
+				continue;
+			exps[n++] = exp;
+			v4root_sig_add(&sig, &exp->m_export);
+		}
+	}
+	if (v4root_unchanged(&sig, npseudo)) {
+		xlog(D_GENERAL, "v4root_set: exports unchanged, keeping "
+				"%u pseudo exports", v4root_npseudo);
+		free(exps);
+		return;
+	}
+
+	qsort(exps, n, sizeof(*exps), v4root_cmp);
+	for (j = 0; j < n; j++) {
+		struct exportent *e = &exps[j]->m_export;
+
+		if (j == 0 || strcmp(e->e_hostname,
+				     exps[j - 1]->m_export.e_hostname)) {
+			clp = client_lookup(e->e_hostname, 0);
+			prev = NULL;
 		}
+		if (clp == NULL)
+			continue;
+		if (v4root_add_parents(e->e_hostname, clp, e->e_path, prev) == 0)
+			prev = e->e_path;
+		/* XXX: error handling! */
 	}
+	free(exps);
+
+	v4root_last = sig;
+	v4root_npseudo = 0;
+	for (i = 0; i < MCL_MAXTYPES; i++)
+		for (exp = exportlist[i].p_head; exp; exp = exp->m_next)
+			if (exp->m_pseudo && !exp->m_stale)
+				v4root_npseudo++;
 }
@@ -22,6 +22,7 @@
 #include "nfslib.h"
 #include "exportfs.h"
 #include "xio.h"
+#include "xmalloc.h"
 #include "xlog.h"
 #include "v4root.h"
 #include "misc.h"
@@ -30,104 +31,446 @@ static char state_base_dirname[PATH_MAX] = NFS_STATEDIR;
 struct state_paths etab;
 
 int v4root_needed;
+/* Keep a binary snapshot of etab for readers, see etabsnap.c */
+int xtab_write_snapshot;
 static void cond_rename(char *newfile, char *oldfile);
 
-static int
-xtab_read(char *xtab, char *lockfn, int is_export)
+/*
+ * etab is read from its binary snapshot when there is one that is up
+ * to date, and parsed otherwise.  Entries from the snapshot point into
+ * it, so only those from parsing are freed by xtab_put().
+ *
+ * Entries in etab's journal replace those in etab for the same client
+ * and path, and come after them.  They belong to the journal's index.
+ */
+static struct etab_snap *xtab_snap;
+static struct etab_index *xtab_jnl;
+static int xtab_base_done, xtab_from_jnl;
+
+/* Keep changes to etab in a journal next to it, see etabjournal.c */
+int xtab_write_journal;
+/*
+ * etab and its journal as last loaded into the export table, and what
+ * xtab_export_read() found there, for the journal to record changes to.
+ */
+static struct stat xtab_etab_stb;
+static struct etab_journal_state xtab_jnl_state;
+static struct etab_index *xtab_loaded;
+
+/* Unlocked reads of etab that find it replaced before falling back to locking */
+#define XTAB_FETCH_TRIES	3
+
+/*
+ * Open etab, or another file of exports, for xtab_next().  @loading
+ * is set when the entries are for the export table.
+ */
+static void
+xtab_open(char *xtab, int is_export, int loading)
+{
+	struct etab_journal_state js;
+
+	xtab_snap = NULL;
+	xtab_jnl = NULL;
+	xtab_base_done = xtab_from_jnl = 0;
+	if (is_export == 1) {
+		/* before etab, as reading the journal uses the parser */
+		xtab_jnl = etab_journal_read(xtab, &js);
+		if (loading)
+			xtab_jnl_state = js;
+		xtab_snap = etab_snap_open(xtab);
+	}
+	if (!xtab_snap)
+		setexportent(xtab, "r");
+}
+
+static void
+xtab_put(struct exportent *xp)
+{
+	if (xtab_snap || xtab_from_jnl)
+		return;
+	free(xp->e_hostname);
+	xp->e_hostname = NULL;
+	free(xp->e_uuid);
+	xp->e_uuid = NULL;
+}
+
+static struct exportent *
+xtab_next(int is_export)
 {
-    /* is_export == 0  => reading /proc/fs/nfs/exports - we know these things are exported to kernel
-     * is_export == 1  => reading /var/lib/nfs/etab - these things are allowed to be exported
-     */
 	struct exportent	*xp;
+
+	while (!xtab_base_done) {
+		if (xtab_snap)
+			xp = etab_snap_next(xtab_snap);
+		else
+			xp = getexportent(is_export==0, 0);
+		if (xp == NULL)
+			xtab_base_done = 1;
+		else if (xtab_jnl && etab_index_covers(xtab_jnl, xp))
+			xtab_put(xp);
+		else
+			return xp;
+	}
+	if (!xtab_jnl)
+		return NULL;
+	xtab_from_jnl = 1;
+	return etab_index_next(xtab_jnl);
+}
+
+static void
+xtab_close(void)
+{
+	if (xtab_snap) {
+		etab_snap_close(xtab_snap);
+		xtab_snap = NULL;
+	} else
+		endexportent();
+	etab_index_free(xtab_jnl);
+	xtab_jnl = NULL;
+}
+
+/* Write the export table to the file opened with setexportent() */
+static void
+xtab_write_entries(int is_export)
+{
+	struct exportent	xe;
 	nfs_export		*exp;
-	int			lockid;
+	int			i;
+
+	for (i = 0; i < MCL_MAXTYPES; i++) {
+		for (exp = exportlist[i].p_head; exp; exp = exp->m_next) {
+			if (is_export && !exp->m_xtabent)
+				continue;
+			if (!is_export && ! exp->m_exported)
+				continue;
+
+			/* write out the export entry using the FQDN */
+			xe = exp->m_export;
+			xe.e_hostname = exp->m_client->m_hostname;
+			putexportent(&xe);
+		}
+	}
+}
+
+/*
+ * Read all the entries in @fname, and those in its journal if it is
+ * etab (@is_export is 1)
+ */
+static int
+xtab_read_entries(char *fname, int is_export, int loading,
+		  struct exportent **list)
+{
+	struct exportent	*xp, *ents = NULL;
+	int			n = 0, size = 0;
+
+	xtab_open(fname, is_export, loading);
+	while ((xp = xtab_next(1)) != NULL) {
+		if (n == size) {
+			size = size ? size * 2 : 64;
+			ents = xrealloc(ents, size * sizeof(*ents));
+		}
+		dupexportent(&ents[n], xp);
+		ents[n].e_hostname = strpool_get(xp->e_hostname);
+		n++;
+		xtab_put(xp);
+	}
+	xtab_close();
+
+	*list = ents;
+	return n;
+}
+
+/*
+ * Read etab and its journal without locking etab, so that a reader is
+ * never held up by exportfs: etab is only ever replaced by rename()
+ * and the journal only appended to in whole batches, so what is read
+ * is one complete version of the export table, unless etab was
+ * replaced meanwhile, when it is read again.  Only a reader that keeps
+ * losing that race takes the lock.  @loading is set when the entries
+ * are for the export table.
+ *
+ * Returns the number of entries, or -1 if etab couldn't be locked.
+ */
+static int
+xtab_fetch(struct exportent **list, int loading)
+{
+	struct stat		before, after;
+	int			tries, lockid = -1, n;
+
+	for (tries = 0; ; tries++) {
+		if (tries == XTAB_FETCH_TRIES &&
+		    (lockid = xflock(etab.lockfn, "r")) < 0) {
+			*list = NULL;
+			return -1;
+		}
+		if (stat(etab.statefn, &before) < 0)
+			memset(&before, 0, sizeof(before));
+		n = xtab_read_entries(etab.statefn, 1, loading, list);
+		if (stat(etab.statefn, &after) < 0)
+			memset(&after, 0, sizeof(after));
+		if (lockid >= 0 || etab_same_file(&before, &after))
+			break;
+		xlog(D_GENERAL, "%s was replaced while reading it",
+		     etab.statefn);
+		xtab_snapshot_free(*list, n);
+	}
+	if (lockid >= 0)
+		xfunlock(lockid);
+	if (loading)
+		xtab_etab_stb = before;
+	return n;
+}
+
+/*
+ * Add the exports in etab to the export table.  Exports already in
+ * the table are left as they are.
+ */
+int
+xtab_export_read(void)
+{
+	struct exportent	*list, *xp;
+	nfs_export		*exp;
+	int			i, n;
 
-	if ((lockid = xflock(lockfn, "r")) < 0)
+	if ((n = xtab_fetch(&list, 1)) < 0)
 		return 0;
-	setexportent(xtab, "r");
-	if (is_export == 1)
-		v4root_needed = 1;
-	while ((xp = getexportent(is_export==0, 0)) != NULL) {
-		if (!(exp = export_lookup(xp->e_hostname, xp->e_path, is_export != 1)) &&
-		    !(exp = export_create(xp, is_export!=1))) {
-                        if(xp->e_hostname) {
-                            free(xp->e_hostname);
-                            xp->e_hostname=NULL;
-                        }
-                        if(xp->e_uuid) {
-                            free(xp->e_uuid);
-                            xp->e_uuid=NULL;
-                        }
+	v4root_needed = 1;
+	etab_index_free(xtab_loaded);
+	xtab_loaded = xtab_write_journal ? etab_index_new() : NULL;
+	for (i = 0; i < n; i++) {
+		xp = &list[i];
+		if (xtab_loaded)
+			etab_index_add(xtab_loaded, xp, 0);
+		if (!(exp = export_lookup(xp->e_hostname, xp->e_path, 0)) &&
+		    !(exp = export_create(xp, 0)))
 			continue;
+		exp->m_xtabent = 1;
+		exp->m_mayexport = 1;
+		if ((xp->e_flags & NFSEXP_FSID) && xp->e_fsid == 0)
+			v4root_needed = 0;
+	}
+	xtab_snapshot_free(list, n);
+
+	return 0;
+}
+
+/**
+ * xtab_export_fetch - read etab for xtab_export_apply()
+ * @list: set to the entries; free them with xtab_snapshot_free()
+ *
+ * Doesn't need the export table, which the caller need not lock yet,
+ * nor etab's lock.  Returns the number of entries, or -1.
+ */
+int
+xtab_export_fetch(struct exportent **list)
+{
+	return xtab_fetch(list, 1);
+}
+
+/*
+ * Bring the in-core export table up to date with @list, the @n
+ * entries of etab from xtab_export_fetch(), without throwing it away:
+ * entries whose client, path and options are unchanged are kept as
+ * they are, changed ones are updated in place, and only new clients
+ * need to be looked up.  Exports that are no longer listed are
+ * removed, except pseudo exports, which are left for v4root_set() to
+ * reclaim (see export_purge_stale()).
+ *
+ * Returns the number of exports added, changed or removed.
+ */
+int
+xtab_export_apply(struct exportent *list, int n)
+{
+	struct exportent	*xp;
+	nfs_export		*exp;
+	int			i, changes = 0;
+
+	export_mark_stale();
+	v4root_needed = 1;
+	for (i = 0; i < n; i++) {
+		xp = &list[i];
+		exp = export_lookup_entry(xp);
+		if (exp && exp->m_fsidforced) {
+			/* let v4root_set() decide again */
+			exp->m_export.e_flags &= ~NFSEXP_FSID;
+			exp->m_fsidforced = 0;
 		}
-		switch (is_export) {
-		case 0:
-			exp->m_exported = 1;
-			break;
-		case 1:
+		if (exp && cmpexportent(&exp->m_export, xp) != 0) {
+			xlog(D_GENERAL, "updating export %s:%s",
+			     xp->e_hostname, xp->e_path);
+			export_update(exp, xp);
+			changes++;
+		} else if (!exp) {
+			exp = export_create(xp, 0);
+			if (exp)
+				changes++;
+		}
+		if (exp) {
+			exp->m_stale = 0;
 			exp->m_xtabent = 1;
 			exp->m_mayexport = 1;
 			if ((xp->e_flags & NFSEXP_FSID) && xp->e_fsid == 0)
 				v4root_needed = 0;
-			break;
-		}  
-                if(xp->e_hostname) {
-                    free(xp->e_hostname);
-                    xp->e_hostname=NULL;
-                }
-                if(xp->e_uuid) {
-                    free(xp->e_uuid);
-                    xp->e_uuid=NULL;
-                }
-
+		}
 	}
+
+	changes += export_purge_stale(0);
+	return changes;
+}
+
+/*
+ * xtab_export_fetch() and xtab_export_apply() in one.  Returns the
+ * number of exports added, changed or removed, or -1 if etab couldn't
+ * be read.
+ */
+int
+xtab_export_update(void)
+{
+	struct exportent	*list;
+	int			n, changes;
+
+	if ((n = xtab_export_fetch(&list)) < 0)
+		return -1;
+	changes = xtab_export_apply(list, n);
+	xtab_snapshot_free(list, n);
+	return changes;
+}
+
+/*
+ * Read the entries currently in etab without touching the in-core
+ * export table.  Free the result with xtab_snapshot_free().
+ *
+ * Returns the number of entries, or -1 if etab couldn't be locked.
+ */
+int
+xtab_export_snapshot(struct exportent **list)
+{
+	return xtab_fetch(list, 0);
+}
+
+/*
+ * Read back the entries xtab_export_write() would write, without
+ * changing etab: the export table is written to etab's temporary file
+ * and read from there, so that the result compares with that of
+ * xtab_export_snapshot() exactly as etab would after the write.  Free
+ * the result with xtab_snapshot_free().
+ *
+ * Returns the number of entries, or -1 if etab couldn't be locked.
+ */
+int
+xtab_export_preview(struct exportent **list)
+{
+	int			lockid, n;
+
+	*list = NULL;
+	if ((lockid = xflock(etab.lockfn, "w")) < 0)
+		return -1;
+	setexportent(etab.tmpfn, "w");
+	xtab_write_entries(1);
 	endexportent();
+	n = xtab_read_entries(etab.tmpfn, 2, 0, list);
+	unlink(etab.tmpfn);
 	xfunlock(lockid);
+	return n;
+}
 
-	return 0;
+void
+xtab_snapshot_free(struct exportent *list, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		exportent_release(&list[i]);
+	free(list);
 }
 
-int
-xtab_export_read(void)
+/* Whether etab is still the file last loaded into the export table */
+static int
+xtab_etab_unchanged(char *xtab)
+{
+	struct stat		stb;
+
+	return stat(xtab, &stb) == 0 &&
+	       stb.st_dev == xtab_etab_stb.st_dev &&
+	       stb.st_ino == xtab_etab_stb.st_ino &&
+	       stb.st_size == xtab_etab_stb.st_size &&
+	       stb.st_mtim.tv_sec == xtab_etab_stb.st_mtim.tv_sec &&
+	       stb.st_mtim.tv_nsec == xtab_etab_stb.st_mtim.tv_nsec;
+}
+
+/*
+ * Append the changes to the export table since xtab_export_read() to
+ * etab's journal.  Called with etab locked for writing.  Returns zero
+ * if etab must be rewritten instead.
+ */
+static int
+xtab_write_journaled(char *xtab)
+{
+	int			n;
+
+	if (!xtab_write_journal || !xtab_loaded ||
+	    !xtab_etab_unchanged(xtab))
+		return 0;
+	n = etab_journal_write(xtab, xtab_loaded, &xtab_jnl_state);
+	if (n < 0)
+		return 0;
+	xtab_jnl_state.js_records += n;
+	etab_journal_stat(xtab, &xtab_jnl_state.js_stb);
+	xtab_jnl_state.js_committed = xtab_jnl_state.js_stb.st_size;
+	/* the table is now what etab and the journal say */
+	etab_index_free(xtab_loaded);
+	xtab_loaded = NULL;
+	return 1;
+}
+
+/*
+ * Write the export table to etab in full, and remove its journal,
+ * which etab now includes.  Called with etab locked for writing.
+ */
+static void
+xtab_write_full(char *xtab, char *xtabtmp)
 {
-	return xtab_read(etab.statefn, etab.lockfn, 1);
+	setexportent(xtabtmp, "w");
+	xtab_write_entries(1);
+	endexportent();
+
+	cond_rename(xtabtmp, xtab);
+	etab_journal_remove(xtab);
+	if (xtab_write_snapshot)
+		etab_snap_write(xtab);
+	else
+		etab_snap_remove(xtab);
+
+	etab_index_free(xtab_loaded);
+	xtab_loaded = NULL;
+	if (stat(xtab, &xtab_etab_stb) < 0)
+		memset(&xtab_etab_stb, 0, sizeof(xtab_etab_stb));
+	memset(&xtab_jnl_state, 0, sizeof(xtab_jnl_state));
 }
 
 /*
  * mountd now keeps an open fd for the etab at all times to make sure that the
  * inode number changes when the xtab_export_write is done. If you change the
  * routine below such that the files are edited in place, then you'll need to
- * fix the auth_reload logic as well...
+ * fix the auth_reload logic as well...  Appending to the journal leaves etab
+ * alone, so mountd also checks the journal, see xtab_export_journal_changed().
  */
 static int
 xtab_write(char *xtab, char *xtabtmp, char *lockfn, int is_export)
 {
-	struct exportent	xe;
-	nfs_export		*exp;
-	int			lockid, i;
+	int			lockid;
 
 	if ((lockid = xflock(lockfn, "w")) < 0) {
 		xlog(L_ERROR, "can't lock %s for writing", xtab);
 		return 0;
 	}
-	setexportent(xtabtmp, "w");
-
-	for (i = 0; i < MCL_MAXTYPES; i++) {
-		for (exp = exportlist[i].p_head; exp; exp = exp->m_next) {
-			if (is_export && !exp->m_xtabent)
-				continue;
-			if (!is_export && ! exp->m_exported)
-				continue;
-
-			/* write out the export entry using the FQDN */
-			xe = exp->m_export;
-			xe.e_hostname = exp->m_client->m_hostname;
-			putexportent(&xe);
-		}
-	}
-	endexportent();
-
-	cond_rename(xtabtmp, xtab);
+	if (!is_export) {
+		setexportent(xtabtmp, "w");
+		xtab_write_entries(is_export);
+		endexportent();
+		cond_rename(xtabtmp, xtab);
+	} else if (!xtab_write_journaled(xtab))
+		xtab_write_full(xtab, xtabtmp);
 
 	xfunlock(lockid);
 
@@ -140,6 +483,51 @@ xtab_export_write()
 	return xtab_write(etab.statefn, etab.tmpfn, etab.lockfn, 1);
 }
 
+/*
+ * Whether etab's journal has changed since the export table was last
+ * loaded from etab, or written to it.
+ */
+int
+xtab_export_journal_changed(void)
+{
+	struct stat		stb;
+
+	etab_journal_stat(etab.statefn, &stb);
+	return !etab_same_file(&stb, &xtab_jnl_state.js_stb);
+}
+
+/*
+ * Write etab in full as xtab_export_write() does, but only if it is
+ * still the file with inode number @ino and its journal hasn't changed
+ * either, and leave it open in *@fdp so that the caller knows what it
+ * wrote.
+ *
+ * Returns 0, -EAGAIN if etab was replaced since, or -EIO if it
+ * couldn't be locked.
+ */
+int
+xtab_export_write_if(ino_t ino, int *fdp)
+{
+	struct stat		stb;
+	int			lockid;
+
+	*fdp = -1;
+	if ((lockid = xflock(etab.lockfn, "w")) < 0) {
+		xlog(L_ERROR, "can't lock %s for writing", etab.statefn);
+		return -EIO;
+	}
+	if (stat(etab.statefn, &stb) < 0 || stb.st_ino != ino ||
+	    xtab_export_journal_changed()) {
+		xfunlock(lockid);
+		return -EAGAIN;
+	}
+	xtab_write_full(etab.statefn, etab.tmpfn);
+	*fdp = open(etab.statefn, O_RDONLY);
+
+	xfunlock(lockid);
+	return 0;
+}
+
 /*
  * rename newfile onto oldfile unless
  * they are identical
@@ -189,7 +577,7 @@ static void cond_rename(char *newfile, char *oldfile)
  * containing an appropriate pathname, or NULL if an error
  * occurs.  Caller must free the returned result with free(3).
  */
-static char *
+char *
 state_make_pathname(const char *tabname)
 {
 	return generic_make_pathname(state_base_dirname, tabname);
@@ -23,7 +23,7 @@
 #define _NFSD_CLD_H
 
 /* latest upcall version available */
-#define CLD_UPCALL_VERSION 2
+#define CLD_UPCALL_VERSION 3
 
 /* defined by RFC3530 */
 #define NFS4_OPAQUE_LIMIT 1024
@@ -84,6 +84,28 @@ struct cld_msg_v2 {
 	} __attribute__((packed)) cm_u;
 } __attribute__((packed));
 
+/*
+ * Version 3 messages have the version 2 layout, but a Cld_GraceStart
+ * upcall is answered with records packed into fewer downcalls.  Each
+ * record in cr_data is a cld_name and a cld_princhash, each cut off
+ * after its cn_id or cp_data.
+ */
+#define CLD_RECLIST_SIZE	8192
+
+struct cld_reclist {
+	uint16_t	cr_count;		/* records in cr_data */
+	uint16_t	cr_len;			/* bytes used in cr_data */
+	unsigned char	cr_data[CLD_RECLIST_SIZE];
+} __attribute__((packed));
+
+struct cld_msg_reclist {
+	uint8_t		cm_vers;		/* upcall version */
+	uint8_t		cm_cmd;			/* upcall command */
+	int16_t		cm_status;		/* return code */
+	uint32_t	cm_xid;			/* transaction id */
+	struct cld_reclist cm_reclist;
+} __attribute__((packed));
+
 struct cld_msg_hdr {
 	uint8_t		cm_vers;		/* upcall version */
 	uint8_t		cm_cmd;			/* upcall command */
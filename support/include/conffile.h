@@ -49,6 +49,13 @@ struct conf_list {
 	TAILQ_HEAD(conf_list_fields_head, conf_list_node) fields;
 };
 
+struct conf_key;
+
+/* Where "nfsconf --snapshot" saves the parsed configuration */
+#ifndef NFS_CONFSNAPSHOT
+#define NFS_CONFSNAPSHOT	NFS_STATEDIR "/nfs.conf.snapshot"
+#endif
+
 extern int      conf_begin(void);
 extern int      conf_decode_base64(uint8_t *, uint32_t *, const unsigned char *);
 extern int      conf_end(int, int);
@@ -63,12 +70,17 @@ extern char    *conf_get_str_with_def(const char *, const char *, char *);
 extern char    *conf_get_section(const char *, const char *, const char *);
 extern char    *conf_get_entry(const char *, const char *, const char *);
 extern int      conf_init_file(const char *);
+extern struct conf_key *conf_key_get(const char *, const char *, const char *);
+extern char    *conf_key_str(struct conf_key *);
+extern int      conf_key_num(struct conf_key *, int);
+extern _Bool    conf_key_bool(struct conf_key *, _Bool);
 extern void     conf_cleanup(void);
 extern int      conf_match_num(const char *, const char *, int);
 extern int      conf_remove(int, const char *, const char *);
 extern int      conf_remove_section(int, const char *);
 extern void     conf_report(FILE *);
 extern int      conf_write(const char *, const char *, const char *, const char *, const char *);
+extern int      conf_snapshot_write(const char *, const char *);
 
 extern const char *modified_by;
 
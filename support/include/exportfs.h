@@ -11,6 +11,7 @@
 
 #include <netdb.h>
 #include <string.h>
+#include <sys/stat.h>
 
 #include "sockaddr.h"
 #include "nfslib.h"
@@ -92,20 +93,28 @@ set_addrlist(nfs_client *clp, const int i, const struct sockaddr *sap)
 	}
 }
 
+/* The part of an nfsd.export reply that depends only on the export */
+struct export_reply {
+	int			r_len;
+	char			r_text[];
+};
+
 typedef struct mexport {
 	struct mexport *	m_next;
 	struct mclient *	m_client;
 	struct exportent	m_export;
+	struct export_reply *	m_reply;	/* set by cache_export_replies() */
 	int			m_exported;	/* known to knfsd. */
 	unsigned int		m_xtabent  : 1,	/* xtab entry exists */
 				m_mayexport: 1,	/* derived from xtabbed */
 				m_changed  : 1, /* options (may) have changed */
-				m_warned   : 1; /* warned about multiple exports
+				m_warned   : 1, /* warned about multiple exports
 						 * matching one client */
+				m_stale    : 1, /* gone from etab (reload) */
+				m_fsidforced: 1, /* fsid=0 set by v4root_set */
+				m_pseudo   : 1; /* made by v4root_set */
 } nfs_export;
 
-#define HASH_TABLE_SIZE 1021
-
 extern int default_ttl;
 
 typedef struct _exp_hash_entry {
@@ -113,9 +122,15 @@ typedef struct _exp_hash_entry {
   	nfs_export * p_last;
 } exp_hash_entry;
 
+/*
+ * Exports sharing a hash bucket are kept together on the p_head list;
+ * the table doubles in size as exports are added.
+ */
 typedef struct _exp_hash_table {
 	nfs_export * p_head;
-	exp_hash_entry entries[HASH_TABLE_SIZE];
+	exp_hash_entry * entries;
+	unsigned int size;		/* number of entries, a power of 2 */
+	unsigned int count;		/* number of exports */
 } exp_hash_table;
 
 extern exp_hash_table exportlist[MCL_MAXTYPES];
@@ -130,31 +145,115 @@ int				client_check(const nfs_client *clp,
 						const struct addrinfo *ai);
 void				client_release(nfs_client *);
 void				client_freeall(void);
+void				client_freeunused(void);
+void				client_subnet_index(void);
 char *				client_compose(const struct addrinfo *ai);
 struct addrinfo *		client_resolve(const struct sockaddr *sap);
+int				client_needs_lookup(const struct sockaddr *sap);
 int 				client_member(const char *client,
 						const char *name);
 
+/* Default number of threads exportfs resolves client names on */
+#define CLIENT_PREFETCH_THREADS	8
+
+extern int			client_prefetch_threads;
+void				client_prefetch(char **names, int n);
+void				client_prefetch_done(void);
+
 int				export_read(char *fname, int ignore_hosts);
 int				export_d_read(const char *dname, int ignore_hosts);
+int				export_read_list(char *fname, struct exportent **list);
 void				export_reset(nfs_export *);
 nfs_export *			export_lookup(char *hname, char *path, int caconical);
+nfs_export *			export_find_path(int type, const char *path,
+					nfs_export *prev);
 nfs_export *			export_find(const struct addrinfo *ai,
 						const char *path);
 nfs_export *			export_create(struct exportent *, int canonical);
+nfs_export *			export_create_client(struct exportent *,
+						nfs_client *);
 void				exportent_release(struct exportent *);
 void				export_freeall(void);
+void				export_hash_stats(void);
+void				export_mark_stale(void);
+unsigned int			export_purge_stale(int v4root);
+nfs_export *			export_lookup_entry(const struct exportent *xep);
+void				export_update(nfs_export *exp,
+						struct exportent *xep);
+
+extern int			export_parse_cache;
 
 extern struct state_paths etab;
 int				xtab_export_read(void);
+int				xtab_export_update(void);
+int				xtab_export_fetch(struct exportent **list);
+int				xtab_export_apply(struct exportent *list, int n);
+int				xtab_export_snapshot(struct exportent **list);
+int				xtab_export_preview(struct exportent **list);
+void				xtab_snapshot_free(struct exportent *list, int n);
 int				xtab_export_write(void);
+int				xtab_export_write_if(ino_t ino, int *fdp);
+int				xtab_export_journal_changed(void);
+
+/* Binary snapshot of etab, see etabsnap.c */
+struct etab_snap;
+struct stat;
+extern int			xtab_write_snapshot;
+int				etab_snap_write(const char *etab);
+int				etab_snap_save(const char *snap,
+						const struct stat *src,
+						const struct exportent *ents,
+						int n);
+struct etab_snap *		etab_snap_load(const char *snap,
+						const struct stat *src);
+void				etab_snap_remove(const char *etab);
+struct etab_snap *		etab_snap_open(const char *etab);
+struct exportent *		etab_snap_next(struct etab_snap *es);
+void				etab_snap_close(struct etab_snap *es);
+
+/* Journal of changes to etab, see etabjournal.c */
+struct etab_index;
+struct etab_journal_state {
+	struct stat		js_stb;		/* all zero if none */
+	unsigned int		js_records;
+	off_t			js_committed;	/* bytes of complete batches */
+};
+extern int			xtab_write_journal;
+struct etab_index *		etab_index_new(void);
+void				etab_index_free(struct etab_index *idx);
+void				etab_index_add(struct etab_index *idx,
+						struct exportent *xp,
+						int removed);
+int				etab_index_covers(struct etab_index *idx,
+						const struct exportent *xp);
+struct exportent *		etab_index_next(struct etab_index *idx);
+void				etab_journal_stat(const char *etab,
+						struct stat *stb);
+int				etab_same_file(const struct stat *a,
+						   const struct stat *b);
+struct etab_index *		etab_journal_read(const char *etab,
+						struct etab_journal_state *js);
+int				etab_journal_write(const char *etab,
+						struct etab_index *loaded,
+					const struct etab_journal_state *js);
+void				etab_journal_remove(const char *etab);
 
 int				secinfo_addflavor(struct flav_info *, struct exportent *);
 
+/* One numeric address, in storage supplied by the caller */
+struct host_addr {
+	struct addrinfo		ha_ai;
+	struct sockaddr_storage	ha_ss;
+};
+
 char *				host_ntop(const struct sockaddr *sap,
 						char *buf, const size_t buflen);
 __attribute__((__malloc__))
 struct addrinfo *		host_pton(const char *paddr);
+struct addrinfo *		host_pton_buf(const char *paddr,
+						struct host_addr *ha);
+struct addrinfo *		host_addrinfo_buf(const struct sockaddr *sap,
+						struct host_addr *ha);
 __attribute__((__malloc__))
 struct addrinfo *		host_addrinfo(const char *hostname);
 __attribute__((__malloc__))
@@ -164,6 +263,58 @@ struct addrinfo *		host_reliable_addrinfo(const struct sockaddr *sap);
 __attribute__((__malloc__))
 struct addrinfo *		host_numeric_addrinfo(const struct sockaddr *sap);
 
+/* Default lifetimes, in seconds, of cached name service results */
+#define HOSTCACHE_TTL		300
+#define HOSTCACHE_NEG_TTL	30
+
+extern int			hostcache_ttl;
+extern int			hostcache_neg_ttl;
+__attribute__((__malloc__))
+char *				hostcache_names(const struct sockaddr *sap);
+int				hostcache_cached(const struct sockaddr *sap);
+int				hostcache_share(void);
+int				hostcache_innetgr(const char *netgroup,
+						const char *host);
+
+/* Default interval, in seconds, between netgroup expansions */
+#define NETGROUP_REFRESH	600
+
+extern int			netgroup_expand;
+extern int			netgroup_refresh;
+void				hostcache_netgroups_update(void);
+void				hostcache_netgroups_refresh(void);
+
+/* Default lifetimes, in seconds, of cached group lists */
+#define GIDCACHE_TTL		300
+#define GIDCACHE_NEG_TTL	30
+
+extern int			gidcache_ttl;
+extern int			gidcache_neg_ttl;
+int				gidcache_get(uid_t uid, gid_t **groupsp);
+
+/*
+ * Upcall statistics, kept by cachestats.c.  The first entries count the
+ * upcalls on each cache channel, the others time the lookups that
+ * upcalls can wait for, and the MOUNT requests rpc.mountd serves.
+ */
+enum cache_stat_id {
+	CSTAT_AUTH_UNIX_IP,
+	CSTAT_AUTH_UNIX_GID,
+	CSTAT_NFSD_EXPORT,
+	CSTAT_NFSD_FH,
+	CSTAT_DNS,
+	CSTAT_NSS,
+	CSTAT_BLKID,
+	CSTAT_RELOAD,
+	CSTAT_MOUNT,
+	CSTAT_MAX
+};
+
+unsigned long long		cache_stats_clock(void);
+void				cache_stats_add(enum cache_stat_id id,
+						unsigned long long start);
+void				cache_stats_miss(enum cache_stat_id id);
+
 struct nfskey *			key_lookup(char *hname);
 
 struct export_features {
@@ -46,5 +46,19 @@ struct servers {
 
 struct servers *replicas_lookup(int method, char *data);
 void release_replicas(struct servers *server);
+struct servers *replicas_get(int method, const char *data);
+void replicas_put(struct servers *server);
+
+/* How the locations of an export are ordered for each client */
+enum {
+	FSLOC_ORDER_CONFIG,	/* as given in exports(5) */
+	FSLOC_ORDER_HASH,	/* shuffled by client, by weight */
+	FSLOC_ORDER_SUBNET,	/* nearest first, then as for hash */
+};
+
+extern int	fsloc_order;
+extern char *	fsloc_weights;
+int fsloc_order_set(const char *name);
+void replicas_order(const struct servers *sp, const char *domain, int *order);
 
 #endif /* FSLOC_H */
@@ -141,12 +141,25 @@ FedFsStatus	 nfs_get_locations(const char *pathname,
 				struct nfs_fsloc **locations);
 FedFsStatus	 nfs_is_prejunction(const char *pathname);
 FedFsStatus	 nfs_is_junction(const char *pathname);
+FedFsStatus	 nfs_update_junction(const char *pathname);
+
+
+/**
+ ** Junction discovery
+ **/
+
+typedef void	(*junction_scan_fn)(const char *pathname, void *arg);
+
+FedFsStatus	 junction_scan(const char *pathname, unsigned int nthreads,
+				junction_scan_fn fn, void *arg);
 
 
 /**
  ** Flush kernel NFS server's export cache
  **/
 FedFsStatus	 junction_flush_exports_cache(void);
+FedFsStatus	 junction_flush_exports_cache_paths(const char * const *pathnames,
+				unsigned int count);
 
 /**
  ** Pathname conversion helpers
@@ -0,0 +1,47 @@
+/*
+ * support/include/mnttab.h
+ *
+ * In-memory copy of the mount table, shared by mountd's export
+ * cache and by mount.nfs.
+ */
+
+#ifndef MNTTAB_H
+#define MNTTAB_H
+
+#include <sys/types.h>
+
+struct mnttab;
+struct mnttab_entry {
+	int			me_id;		/* mount ID */
+	size_t			me_seq;		/* position in mountinfo */
+	char *			me_dir;
+	char *			me_type;
+	char *			me_source;
+	char *			me_opts;	/* as in /proc/mounts */
+	dev_t			me_dev;
+	struct mnttab_entry *	me_devnext;	/* same hash bucket */
+	struct mnttab_entry *	me_srcnext;	/* same hash bucket */
+};
+
+#define MNTTAB_START	((size_t)-1)
+
+void		mnttab_ignore_rootdir(void);
+struct mnttab *	mnttab_get(void);
+void		mnttab_put(struct mnttab *mt);
+const struct mnttab_entry *
+		mnttab_next_below(const struct mnttab *mt, const char *path,
+					size_t *pos);
+const struct mnttab_entry *
+		mnttab_next_path(const struct mnttab *mt, const char *path,
+					size_t *pos);
+const struct mnttab_entry *
+		mnttab_lookup_path(const struct mnttab *mt, const char *path);
+const struct mnttab_entry *
+		mnttab_lookup_dev(const struct mnttab *mt, dev_t dev);
+const struct mnttab_entry *
+		mnttab_lookup_source(const struct mnttab *mt,
+					const char *source);
+unsigned long	mnttab_generation(void);
+void		mnttab_stats(unsigned long *hits, unsigned long *parses);
+
+#endif	/* MNTTAB_H */
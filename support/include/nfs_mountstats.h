@@ -0,0 +1,100 @@
+/*
+ * nfs_mountstats.h -- parse /proc/self/mountstats
+ *
+ * Shared by nfsstat, which reads the per-op statistics of each mount,
+ * and by the snapshots that nfsstat writes for mountstats and
+ * nfsiostat, which need all of a mount's statistics.
+ */
+
+#ifndef _NFS_MOUNTSTATS_H
+#define _NFS_MOUNTSTATS_H
+
+#include <stdio.h>
+
+#define MOUNTSTATSFILE	"/proc/self/mountstats"
+
+/* The fields of a per-op line, in order */
+#define MS_OPS		0	/* operations */
+#define MS_TRANS	1	/* transmissions */
+#define MS_TIMEOUTS	2	/* major timeouts */
+#define MS_SENT		3	/* bytes sent */
+#define MS_RECV		4	/* bytes received */
+#define MS_QUEUE	5	/* milliseconds queued */
+#define MS_RTT		6	/* milliseconds on the wire */
+#define MS_EXEC		7	/* milliseconds in all */
+#define MS_ERRORS	8	/* only in newer kernels */
+#define MS_NFIELDS	9
+
+/* The fields kept from the "xprt:" lines of a mount, summed */
+#define MS_XSENDS	0	/* RPC requests sent */
+#define MS_XRECVS	1	/* RPC replies received */
+#define MS_XBADXIDS	2	/* replies that matched no request */
+#define MS_XINFLIGHT	3	/* requests in flight, summed at each send */
+#define MS_XBACKLOG	4	/* requests waiting for a slot, likewise */
+#define MS_XNFIELDS	5
+
+/* ms_parse() flags */
+#define MS_PARSE_ALL	0x0001	/* every line and op, not only used ops */
+
+struct ms_op {
+	const char *		name;
+	unsigned int		n;		/* fields on the line */
+	unsigned long long	v[MS_NFIELDS];
+};
+
+/* A run of the numbers on one line, in ms_sample.vals */
+struct ms_vals {
+	size_t			first;
+	unsigned int		n;
+};
+
+struct ms_mount {
+	const char *		dev;
+	const char *		dir;
+	const char *		fstype;
+	const char *		statvers;
+	const char *		addr;		/* not with MS_PARSE_ALL */
+	const char *		proto;
+	unsigned long long	port;
+	unsigned long long	x[MS_XNFIELDS];
+	size_t			firstop;
+	unsigned int		nops;
+	unsigned int		hash;
+	int			hnext;
+
+	/* Only with MS_PARSE_ALL; "" or empty when missing */
+	const char *		opts;
+	const char *		caps;
+	const char *		nfsv4;
+	const char *		sec;
+	const char *		rpcvers;	/* "1.1" */
+	const char *		progvers;	/* "100003/4" */
+	unsigned long long	age;
+	struct ms_vals		events, bytes;
+	struct ms_vals		xprt;		/* of the last "xprt:" line */
+};
+
+struct ms_sample {
+	char *			buf;
+	size_t			buflen, len;
+	struct ms_mount *	mounts;
+	unsigned int		nmounts, maxmounts;
+	struct ms_op *		ops;
+	size_t			nops, maxops;
+	unsigned long long *	vals;
+	size_t			nvals, maxvals;
+	int *			buckets;
+	unsigned int		nbuckets;
+};
+
+int	ms_read(int fd, struct ms_sample *s);
+int	ms_parse(struct ms_sample *s, int flags);
+void	ms_free(struct ms_sample *s);
+const struct ms_mount *
+	ms_find_mount(const struct ms_sample *s, const struct ms_mount *m);
+const struct ms_op *
+	ms_find_op(const struct ms_sample *s, const struct ms_mount *m,
+			const char *name);
+int	ms_write_snapshot(FILE *f, const struct ms_sample *s);
+
+#endif	/* _NFS_MOUNTSTATS_H */
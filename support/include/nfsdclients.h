@@ -0,0 +1,58 @@
+/*
+ * nfsdclients.h -- read the files knfsd keeps for each NFSv4 client
+ *
+ * /proc/fs/nfsd/clients has a directory for each client, holding an
+ * "info" file of "key: value" lines and a "states" file listing the
+ * opens, locks, delegations and layouts the client holds, one per
+ * line, as
+ *
+ *	- 0x...: { type: open, access: rw, deny: --, superblock: "fd:10:13649", ... }
+ */
+
+#ifndef NFSDCLIENTS_H
+#define NFSDCLIENTS_H
+
+#define NFSD_CLIENTS_DIR	"/proc/fs/nfsd/clients"
+
+enum nfsd_client_status {
+	NFSD_CLIENT_UNKNOWN,
+	NFSD_CLIENT_CONFIRMED,
+	NFSD_CLIENT_UNCONFIRMED,
+};
+
+/*
+ * Values are as they appear in the file, quotes included; a field
+ * that is missing is NULL, or -1 for the minor version.
+ */
+struct nfsd_client_info {
+	char *			ci_clientid;
+	char *			ci_address;
+	char *			ci_name;
+	int			ci_minorversion;
+	enum nfsd_client_status	ci_status;
+};
+
+/*
+ * Quoted values are unquoted.  Each field is only valid during the
+ * call it is passed to, and is NULL if the line has no such field.
+ */
+struct nfsd_client_state {
+	const char *		cs_id;
+	const char *		cs_type;
+	const char *		cs_access;
+	const char *		cs_deny;
+	const char *		cs_superblock;
+	const char *		cs_owner;
+	const char *		cs_filename;
+};
+
+typedef void (*nfsd_client_state_fn)(const struct nfsd_client_state *,
+				     void *);
+
+int	nfsd_client_read_info(int dirfd, const char *pathname,
+			      struct nfsd_client_info *info);
+void	nfsd_client_free_info(struct nfsd_client_info *info);
+int	nfsd_client_read_states(int dirfd, const char *pathname,
+				nfsd_client_state_fn fn, void *arg);
+
+#endif /* NFSDCLIENTS_H */
@@ -0,0 +1,37 @@
+/*
+ * nfsgrace.h -- progress of the clients reclaiming through a grace period
+ *
+ * A daemon that knows which clients held state before a restart, and
+ * sees them reclaim it, tracks them here.  The progress is logged when
+ * the grace period ends, and published as a timeline in
+ * NFSMETRICS_DIR/<service>.grace, where the daemons that share a grace
+ * period can hand it to each other.  Once every expected client has
+ * reclaimed, the daemon may end the kernel's grace period early.
+ */
+
+#ifndef _NFSGRACE_H
+#define _NFSGRACE_H
+
+#include <stddef.h>
+#include "nfsmetrics.h"
+
+#define NFSGRACE_SUFFIX		".grace"
+
+int		nfsgrace_open(const char *service, const char *endfile);
+void		nfsgrace_close(void);
+
+void		nfsgrace_start(void);
+int		nfsgrace_adopt(void);
+void		nfsgrace_expect(const void *id, size_t len);
+int		nfsgrace_reclaim(const void *id, size_t len);
+void		nfsgrace_publish(void);
+void		nfsgrace_end(void);
+
+int		nfsgrace_active(void);
+int		nfsgrace_complete(void);
+unsigned long	nfsgrace_elapsed(void);
+
+int		nfsgrace_lift(void);
+int		nfsgrace_over(void);
+
+#endif	/* _NFSGRACE_H */
@@ -19,6 +19,7 @@
 #include <netdb.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <paths.h>
 #include <rpcsvc/nfs_prot.h>
 #include <nfs/nfs.h>
@@ -57,19 +58,35 @@ struct state_paths {
 /* Maximum number of security flavors on an export: */
 #define SECFLAVOR_COUNT 8
 
+/*
+ * Bounds of the rsize=, wsize= (bytes) and readahead= (KiB) export
+ * options.  They are only hints for clients: neither the MOUNT reply
+ * nor the kernel's export table has room for them.
+ */
+#define EXPORT_IOSIZE_MIN	4096
+#define EXPORT_IOSIZE_MAX	(1024 * 1024)
+#define EXPORT_READAHEAD_MAX	(1024 * 1024)
+
 struct sec_entry {
 	struct flav_info *flav;
 	int flags;
 };
 
+struct servers;
+
 /*
  * Data related to a single exports entry as returned by getexportent.
+ * The path, mountpoint, fs locations and uuid of an entry made by
+ * dupexportent() are shared with other entries through strpool_get().
+ * e_fslocs is e_fslocdata parsed, for entries in the export table;
+ * dupexportent() leaves it NULL.  e_rsize, e_wsize and e_readahead
+ * are zero unless the I/O hints were given.
  * FIXME: export options should probably be parsed at a later time to
  * allow overrides when using exportfs.
  */
 struct exportent {
 	char *		e_hostname;
-	char		e_path[NFS_MAXPATHLEN+1];
+	char *		e_path;
 	int		e_flags;
 	int		e_anonuid;
 	int		e_anongid;
@@ -81,9 +98,13 @@ struct exportent {
 	char *		e_mountpoint;
 	int             e_fslocmethod;
 	char *          e_fslocdata;
+	struct servers *e_fslocs;
 	char *		e_uuid;
 	struct sec_entry e_secinfo[SECFLAVOR_COUNT+1];
 	unsigned int	e_ttl;
+	unsigned int	e_rsize;
+	unsigned int	e_wsize;
+	unsigned int	e_readahead;
 	char *		e_realpath;
 };
 
@@ -97,15 +118,28 @@ struct rmtabent {
  * configuration file parsing
  */
 void			setexportent(char *fname, char *type);
+void			setexportent_buf(const char *name,
+					const char *buf, size_t len);
 struct exportent *	getexportent(int,int);
+int			getexportpath(char *path, int len,
+					int *mountpoint);
 void 			secinfo_show(FILE *fp, struct exportent *ep);
 void			putexportent(struct exportent *xep);
+void			fputexportent(FILE *fp, struct exportent *xep);
 void			endexportent(void);
 struct exportent *	mkexportent(char *hname, char *path, char *opts);
 void			dupexportent(struct exportent *dst,
 					struct exportent *src);
+int			cmpexportent(const struct exportent *a,
+					const struct exportent *b);
 int			updateexportent(struct exportent *eep, char *options);
 
+char *			strpool_get(const char *s);
+void			strpool_put(const char *s);
+void			strpool_stats(unsigned long *count,
+					unsigned long *bytes,
+					unsigned long *refs);
+
 extern struct state_paths rmtab;
 int			setrmtabent(char *type);
 struct rmtabent *	getrmtabent(int log, long *pos);
@@ -119,6 +153,7 @@ void			fendrmtabent(FILE *fp);
 void			frewindrmtabent(FILE *fp);
 
 _Bool state_setup_basedir(const char *, const char *);
+char *state_make_pathname(const char *);
 int setup_state_path_names(const char *, const char *, const char *, const char *, struct state_paths *);
 void free_state_path_names(struct state_paths *);
 
@@ -132,12 +167,17 @@ void daemon_ready(void);
 int			wildmat(char *text, char *pattern);
 
 int qword_get(char **bpp, char *dest, int bufsize);
+int qword_get_inplace(char **bpp, char **wordp);
 int qword_get_int(char **bpp, int *anint);
 void cache_flush(void);
+void cache_flush_paths(char **clients, char **paths, int count,
+			int clients_changed);
+int cache_count_paths(char **clients, char **paths, int count);
 void qword_add(char **bpp, int *lp, char *str);
 void qword_addhex(char **bpp, int *lp, char *buf, int blen);
 void qword_addint(char **bpp, int *lp, int n);
 void qword_adduint(char **bpp, int *lp, unsigned int n);
+void qword_adduint64(char **bpp, int *lp, uint64_t n);
 void qword_addeol(char **bpp, int *lp);
 int qword_get_uint(char **bpp, unsigned int *anint);
 
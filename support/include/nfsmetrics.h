@@ -0,0 +1,35 @@
+/*
+ * nfsmetrics.h -- counters and histograms shared by the daemons
+ *
+ * A daemon registers its metrics by name, updates them from any
+ * thread, and if "metrics" is set in nfs.conf serves them on a unix
+ * socket in NFSMETRICS_DIR, where nfsmetrics(8) reads them.
+ */
+
+#ifndef _NFSMETRICS_H
+#define _NFSMETRICS_H
+
+#include <stdio.h>
+
+#define NFSMETRICS_DIR		"/run/nfs-utils"
+#define NFSMETRICS_SUFFIX	".metrics"
+
+/* Histogram buckets: < 1us, < 2us, < 4us ... < 2^22us, and the rest */
+#define NFSMETRIC_BUCKETS	24
+
+struct nfsmetric;
+
+struct nfsmetric *	nfsmetric_counter(const char *name, const char *help);
+struct nfsmetric *	nfsmetric_histogram(const char *name, const char *help);
+void			nfsmetric_add(struct nfsmetric *m, unsigned long n);
+void			nfsmetric_observe(struct nfsmetric *m,
+					  unsigned long usecs);
+unsigned long long	nfsmetric_clock(void);
+void			nfsmetric_since(struct nfsmetric *m,
+					unsigned long long start);
+
+void			nfsmetrics_write(FILE *fp);
+int			nfsmetrics_start(const char *service);
+void			nfsmetrics_worker(int id);
+
+#endif	/* _NFSMETRICS_H */
@@ -127,6 +127,14 @@ extern unsigned short	nfs_getport(const struct sockaddr *,
 				const socklen_t, const rpcprog_t,
 				const rpcvers_t, const unsigned short);
 
+/*
+ * The same, with a caller-chosen timeout
+ */
+extern unsigned short	nfs_getport_timed(const struct sockaddr *,
+				const socklen_t, const rpcprog_t,
+				const rpcvers_t, const unsigned short,
+				const struct timeval *);
+
 /*
  * Generic function that maps an RPC service tuple to an IP port
  * number of the service on the local host
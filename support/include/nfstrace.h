@@ -0,0 +1,65 @@
+/*
+ * nfstrace.h -- per-upcall latency records kept by the daemons
+ *
+ * If "upcall-trace" is set in nfs.conf, a daemon records for each
+ * upcall when it was read, when a worker started on it, how long it
+ * waited on each outside service, when the downcall was written and
+ * when it was done.  The records are kept in a ring, written to a
+ * file on SIGUSR2, and streamed to readers of a unix socket in
+ * NFSMETRICS_DIR, where nfsupcalltrace(8) reads them.
+ */
+
+#ifndef _NFSTRACE_H
+#define _NFSTRACE_H
+
+#include "nfsmetrics.h"
+
+#define NFSTRACE_SUFFIX		".upcalls"
+#define NFSTRACE_DUMP_SUFFIX	".trace"
+#define NFSTRACE_KEYLEN		96
+
+/* The outside services an upcall can wait on */
+enum nfstrace_dep {
+	NFSTRACE_DNS,
+	NFSTRACE_NSS,
+	NFSTRACE_LDAP,
+	NFSTRACE_KDC,
+	NFSTRACE_BLKID,
+	NFSTRACE_SERVER,	/* gssd's RPCs to the NFS server */
+	NFSTRACE_DEPS
+};
+
+/* One upcall; times are nfsmetric_clock() values, zero if not reached */
+struct nfstrace {
+	const char *		tr_channel;
+	unsigned long long	tr_read;
+	unsigned long long	tr_dispatch;
+	unsigned long long	tr_downcall;
+	unsigned long long	tr_done;
+	unsigned long		tr_dep[NFSTRACE_DEPS];	/* microseconds */
+	int			tr_tid;
+	char			tr_key[NFSTRACE_KEYLEN];
+};
+
+extern int		nfstrace_active;
+
+static inline int
+nfstrace_enabled(void)
+{
+	return __atomic_load_n(&nfstrace_active, __ATOMIC_RELAXED);
+}
+
+int			nfstrace_start(const char *service);
+void			nfstrace_worker(int id);
+void			nfstrace_dump(void);
+
+void			nfstrace_read(struct nfstrace *tr, const char *channel,
+				      const char *key);
+void			nfstrace_enter(struct nfstrace *tr);
+void			nfstrace_leave(void);
+void			nfstrace_dep(enum nfstrace_dep dep,
+				     unsigned long usecs);
+void			nfstrace_downcall(void);
+void			nfstrace_done(void);
+
+#endif	/* _NFSTRACE_H */
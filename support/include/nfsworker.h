@@ -0,0 +1,19 @@
+/*
+ * nfsworker.h -- placing a daemon's workers on CPUs, and counting
+ * how busy each one is
+ *
+ * A daemon reads its "cpu-affinity" setting once with nfsworker_init().
+ * Each worker process or thread calls nfsworker_start() as it starts,
+ * and reports the time it spends on requests with nfsworker_busy().
+ */
+
+#ifndef _NFSWORKER_H
+#define _NFSWORKER_H
+
+int			nfsworker_init(const char *service);
+int			nfsworker_start(int id);
+unsigned long long	nfsworker_clock(void);
+void			nfsworker_busy(unsigned long long start,
+				       unsigned int items);
+
+#endif	/* _NFSWORKER_H */
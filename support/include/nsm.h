@@ -66,6 +66,31 @@ extern void	nsm_delete_notified_host(const char *hostname,
 extern size_t	nsm_priv_to_hex(const char *priv, char *buf,
 				const size_t buflen);
 
+extern void	nsm_commit_hold(void);
+extern _Bool	nsm_commit_pending(void);
+extern _Bool	nsm_commit(void);
+
+extern _Bool	nsm_log_enabled(void);
+extern _Bool	nsm_log_convert(void);
+extern _Bool	nsm_log_revert(void);
+extern _Bool	nsm_log_compact(void);
+
+/* Room for any presentation address, IPv6 scope included */
+#define NSM_ADDRSTRLEN	(64u)
+
+extern _Bool	nsm_set_monitored_addr(const char *hostname,
+			const char *addr);
+extern _Bool	nsm_set_notified_addr(const char *hostname,
+			const char *addr);
+extern _Bool	nsm_get_notified_addr(const char *hostname, char *buf,
+			const size_t buflen);
+extern _Bool	nsm_remember_port(const char *hostname,
+			const uint16_t port);
+extern uint16_t	nsm_recall_port(const char *hostname);
+extern _Bool	nsm_set_monitored_port(const char *hostname,
+			const uint16_t port);
+extern uint16_t	nsm_get_notified_port(const char *hostname);
+
 /* rpc.c */
 
 #define NSM_MAXMSGSIZE	(2048u)
@@ -85,6 +110,10 @@ extern uint32_t nsm_xmit_notify(const int sock, const struct sockaddr *sap,
 extern uint32_t nsm_xmit_nlmcall(const int sock, const struct sockaddr *sap,
 			const socklen_t salen, const struct mon *m,
 			const int state);
+extern void	nsm_xmit_hold(const int sock);
+extern unsigned int
+		nsm_xmit_flush(void);
+extern void	nsm_xmit_reuse_xid(const uint32_t xid);
 extern uint32_t nsm_parse_reply(XDR *xdrs);
 extern unsigned long
 		nsm_recv_getport(XDR *xdrs);
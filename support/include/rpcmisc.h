@@ -20,6 +20,8 @@
 
 typedef bool_t	(*rpcsvc_fn_t)(struct svc_req *, void *argp, void *resp);
 
+struct nfsmetric;
+
 struct rpc_dentry {
 	const char	*name;
 	rpcsvc_fn_t	func;
@@ -27,6 +29,7 @@ struct rpc_dentry {
 	size_t		xdr_arg_size;
 	xdrproc_t	xdr_res_fn;		/* result XDR */
 	size_t		xdr_res_size;
+	struct nfsmetric *metric;		/* see rpc_dispatch_metrics() */
 };
 
 struct rpc_dtable {
@@ -39,6 +42,7 @@ struct rpc_dtable {
 		(rpcsvc_fn_t)func##_##vers##_svc, \
 		(xdrproc_t)xdr_##arg_type, sizeof(arg_type), \
 		(xdrproc_t)xdr_##res_type, sizeof(res_type), \
+		NULL, \
 	}
 
 void		nfs_svc_unregister(const rpcprog_t program,
@@ -47,12 +51,22 @@ unsigned int	nfs_svc_create(char *name, const rpcprog_t program,
 				const rpcvers_t version,
 				void (*dispatch)(struct svc_req *, SVCXPRT *),
 				const uint16_t port);
+/* Seconds an RPC connection may stay idle, by default */
+#define NFS_SVC_IDLE_TIMEOUT	360
+
+int		nfs_svc_epoll_init(int maxconns, int idle);
+void		nfs_svc_epoll_sync(void);
+typedef int	(*nfs_svc_queue_t)(void (*fn)(void *), void *data);
+int		nfs_svc_epoll_offload(nfs_svc_queue_t queue);
 void		rpc_init(char *name, int prog, int vers,
 				void (*dispatch)(struct svc_req *, SVCXPRT *),
 				int defport);
 void		rpc_dispatch(struct svc_req *rq, SVCXPRT *xprt,
 				struct rpc_dtable *dtable, int nvers,
 				void *argp, void *resp);
+void		rpc_dispatch_metrics(struct rpc_dtable *dtable, int nvers);
+struct nfsmetric *
+		rpc_proc_metric(const char *name, int vers);
 int		getservport(u_long number, const char *proto);
 
 extern int	_rpcpmstart;
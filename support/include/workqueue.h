@@ -7,10 +7,20 @@
 struct xthread_workqueue;
 
 struct xthread_workqueue *xthread_workqueue_alloc(void);
+struct xthread_workqueue *xthread_workqueue_alloc_pool(int nthreads);
 void xthread_workqueue_shutdown(struct xthread_workqueue *wq);
 
 void xthread_work_run_sync(struct xthread_workqueue *wq,
 		void (*fn)(void *), void *data);
+int xthread_work_queue(struct xthread_workqueue *wq,
+		void (*fn)(void *), void *data);
+void xthread_work_run_batch(struct xthread_workqueue *wq,
+		void (*fn)(void *), void **data, int n);
+int xthread_work_queue_batch(struct xthread_workqueue *wq,
+		void (*fn)(void *), void **data, int n);
+
+void xthread_work_run_each(int nthreads, void (*fn)(void *, int),
+		void *data, int n);
 
 void xthread_workqueue_chroot(struct xthread_workqueue *wq,
 		const char *path);
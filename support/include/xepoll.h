@@ -0,0 +1,26 @@
+/*
+ * support/include/xepoll.h
+ *
+ * Minimal epoll based event loop shared by the nfs-utils daemons.
+ */
+
+#ifndef XEPOLL_H
+#define XEPOLL_H
+
+/*
+ * Callback invoked when @fd becomes readable.  @data is the
+ * opaque pointer handed to xepoll_add().
+ */
+typedef void (*xepoll_handler_t)(int fd, void *data);
+
+int		xepoll_init(void);
+int		xepoll_add(int fd, xepoll_handler_t handler, void *data);
+void		xepoll_del(int fd);
+int		xepoll_registered(int fd);
+xepoll_handler_t xepoll_handler(int fd, void **data);
+int		xepoll_wait(int timeout);
+int		xepoll_ready(void);
+int		xepoll_add_timer(unsigned int msecs,
+				xepoll_handler_t handler, void *data);
+
+#endif /* XEPOLL_H */
@@ -9,11 +9,15 @@
 #include <stdio.h>
 
 typedef struct XFILE {
-	FILE		*x_fp;
+	FILE		*x_fp;		/* NULL when reading */
 	int		x_line;
+	char		*x_buf;		/* the file, when reading */
+	size_t		x_len, x_pos;
+	int		x_back;		/* pushed back char, or EOF */
 } XFILE;
 
 XFILE	*xfopen(char *fname, char *type);
+XFILE	*xfopenbuf(const char *buf, size_t len);
 int	xflock(char *fname, char *type);
 void	xfunlock(int lockid);
 void	xfclose(XFILE *xfp);
@@ -39,6 +39,11 @@ struct xlog_debugfac {
 	int		df_fac;
 };
 
+/* Debug facilities compiled in; see --disable-verbose-debug */
+#ifndef XLOG_DEBUG_LEVELS
+#define XLOG_DEBUG_LEVELS	D_ALL
+#endif
+
 #ifdef HAVE_FUNC_ATTRIBUTE_FORMAT
 #define XLOG_FORMAT(_x) __attribute__((__format__ _x))
 #else
@@ -46,17 +51,35 @@ struct xlog_debugfac {
 #endif
 
 extern int export_errno;
+extern int xlog_debug_mask;		/* debug facilities being logged */
 void			xlog_open(char *progname);
 void			xlog_stderr(int on);
 void			xlog_syslog(int on);
 void			xlog_config(int fac, int on);
 void			xlog_sconfig(char *, int on);
 void			xlog_set_debug(char *);
-int			xlog_enabled(int fac);
+void			xlog_async(int on);
+void			xlog_set_async(char *);
 void			xlog(int fac, const char *fmt, ...) XLOG_FORMAT((printf, 2, 3));
 void			xlog_warn(const char *fmt, ...) XLOG_FORMAT((printf, 1, 2));
 void			xlog_err(const char *fmt, ...) XLOG_FORMAT((printf, 1, 2));
 void			xlog_errno(int err, const char *fmt, ...) XLOG_FORMAT((printf, 2, 3));
 void			xlog_backend(int fac, const char *fmt, va_list args) XLOG_FORMAT((printf, 2, 0));
 
+/* Cheap enough to guard building the arguments of a debug message */
+#define xlog_enabled(fac) \
+	(((fac) & XLOG_DEBUG_LEVELS) && (xlog_debug_mask & (fac)))
+
+/*
+ * Don't evaluate the arguments of a debug message that will not be
+ * logged, but still set export_errno as xlog() would.
+ */
+#define xlog(fac, ...) do { \
+	int _xlog_fac = (fac); \
+	if ((_xlog_fac & L_ALL) || xlog_enabled(_xlog_fac)) \
+		(xlog)(_xlog_fac, __VA_ARGS__); \
+	else if (_xlog_fac & D_GENERAL) \
+		export_errno = 1; \
+} while (0)
+
 #endif /* XLOG_H */
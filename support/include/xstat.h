@@ -8,4 +8,5 @@ struct stat;
 
 int xlstat(const char *pathname, struct stat *statbuf);
 int xstat(const char *pathname, struct stat *statbuf);
+int xfstat(int fd, struct stat *statbuf);
 #endif
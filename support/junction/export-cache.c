@@ -32,10 +32,12 @@
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <time.h>
 
 
 #include "junction.h"
+#include "nfslib.h"
 #include "xlog.h"
 
 /**
@@ -116,3 +118,67 @@ junction_flush_exports_cache(void)
 	}
 	return FEDFS_OK;
 }
+
+/**
+ * Invalidate the kernel NFSD's cache entries for some junctions
+ *
+ * @param pathnames array of NUL-terminated C strings containing POSIX pathnames of junctions
+ * @param count count of elements in "pathnames"
+ * @return a FedFsStatus code
+ *
+ * Only the nfsd.export and nfsd.fh entries for each junction, and for
+ * the paths below it, are invalidated, so that the next access to a
+ * junction finds its new locations without every other path on the
+ * server having to be looked up again.  Falls back to flushing the
+ * whole of the caches when the entries can't be found.
+ */
+FedFsStatus
+junction_flush_exports_cache_paths(const char * const *pathnames,
+		unsigned int count)
+{
+	char **paths, **clients;
+	FedFsStatus retval;
+	unsigned int i, n;
+
+	if (count == 0)
+		return FEDFS_OK;
+	if (access("/proc/net/rpc/nfsd.export/channel", W_OK) != 0) {
+		xlog(D_GENERAL, "%s: Failed to access nfsd.export: %m",
+			__func__);
+		return FEDFS_ERR_NO_CACHE_UPDATE;
+	}
+
+	paths = calloc(count, sizeof(*paths));
+	clients = calloc(count, sizeof(*clients));
+	if (paths == NULL || clients == NULL) {
+		free(paths);
+		free(clients);
+		return junction_flush_exports_cache();
+	}
+
+	/* The caches know each path by its canonical name */
+	retval = FEDFS_OK;
+	for (i = n = 0; i < count; i++) {
+		paths[n] = realpath(pathnames[i], NULL);
+		if (paths[n] == NULL) {
+			xlog(D_GENERAL, "%s: Failed to resolve %s: %m",
+				__func__, pathnames[i]);
+			retval = FEDFS_ERR_SVRFAULT;
+			break;
+		}
+		n++;
+	}
+
+	if (retval == FEDFS_OK) {
+		xlog(D_CALL, "%s: Invalidating NFSD cache entries for "
+			"%u junction(s)...", __func__, n);
+		cache_flush_paths(clients, paths, n, 0);
+	} else
+		retval = junction_flush_exports_cache();
+
+	for (i = 0; i < n; i++)
+		free(paths[i]);
+	free(paths);
+	free(clients);
+	return retval;
+}
@@ -43,6 +43,12 @@
  */
 #define JUNCTION_XATTR_NAME_NFS		"trusted.junction.nfs"
 
+/**
+ * Name of extended attribute containing a binary copy of the NFS
+ * locations in JUNCTION_XATTR_NAME_NFS
+ */
+#define JUNCTION_XATTR_NAME_NFSBIN	"trusted.junction.nfsbin"
+
 
 /**
  ** Names of XML elements and attributes that represent junction data
@@ -66,6 +66,23 @@
  * junctions, their mode bits are saved in an extended attribute called
  * "trusted.junction.mode".  When the junction data is removed, the
  * directory's mode bits are restored from this information.
+ *
+ * A copy of the locations is also kept in a fixed binary form, in an
+ * extended attribute called "trusted.junction.nfsbin", so that reading
+ * a junction needs neither a DOM parse nor an XPath evaluation.  The
+ * XML stays authoritative: the binary copy records the length and hash
+ * of the XML it was made from, and is ignored if they don't match, for
+ * instance after a tool that doesn't know about it rewrote the XML.
+ * All its integers are big-endian:
+ *
+ *   header:	"NFSJ", u8 version, u8 zero, u16 number of locations,
+ *		u32 XML length, u64 FNV-1a hash of the XML
+ *   location:	u16 port, u8 flags, u8 zero, s32 currency, s32 validfor,
+ *		u8 simul, handle, fileid, writever, change, readdir,
+ *		readrank, writerank, readorder, writeorder,
+ *		u16 length and bytes of the hostname,
+ *		u16 number of path components, and for each,
+ *		u16 length and bytes of the component
  */
 
 #include <sys/types.h>
@@ -234,6 +251,47 @@
 #define NFS_XML_LOCATION_XPATH		(const xmlChar *)	\
 						"/junction/fileset/location"
 
+/**
+ * Leading bytes of binary NFS junction data
+ */
+#define NFS_BIN_MAGIC			"NFSJ"
+
+/**
+ * Version of the binary NFS junction data layout
+ */
+#define NFS_BIN_VERSION			1
+
+/**
+ * Size of the header of binary NFS junction data
+ */
+#define NFS_BIN_HDRLEN			20
+
+/**
+ * Bits in the flags byte of a binary NFS location
+ */
+#define NFS_BIN_VARSUB			0x01
+#define NFS_BIN_WRITABLE		0x02
+#define NFS_BIN_GOING			0x04
+#define NFS_BIN_SPLIT			0x08
+#define NFS_BIN_RDMA			0x10
+
+/**
+ * A growing buffer of binary NFS junction data
+ */
+struct nfs_bin_buf {
+	unsigned char		*data;
+	size_t			 len, size;
+	_Bool			 failed;
+};
+
+/**
+ * A read position in binary NFS junction data
+ */
+struct nfs_bin_cursor {
+	const unsigned char	*p, *end;
+	_Bool			 failed;
+};
+
 
 /**
  * Remove all NFS-related xattrs from a directory
@@ -254,11 +312,32 @@ nfs_remove_locations(const char *pathname)
 		return retval;
 
 	retval = junction_remove_xattr(fd, pathname, JUNCTION_XATTR_NAME_NFS);
+	if (junction_is_xattr_present(fd, pathname,
+				JUNCTION_XATTR_NAME_NFSBIN) == FEDFS_OK)
+		(void)junction_remove_xattr(fd, pathname,
+				JUNCTION_XATTR_NAME_NFSBIN);
 
 	(void)close(fd);
 	return retval;
 }
 
+/**
+ * Hash the junction XML that binary NFS junction data was made from
+ *
+ * @param xml buffer containing junction XML
+ * @param len size of "xml"
+ * @return FNV-1a hash of "xml"
+ */
+static uint64_t
+nfs_bin_hash(const unsigned char *xml, size_t len)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+
+	while (len--)
+		h = (h ^ *xml++) * 0x100000001b3ULL;
+	return h;
+}
+
 /**
  * Add a "host" child to a "location" element
  *
@@ -715,6 +794,207 @@ nfs_write_junction(const char *pathname, xmlDocPtr doc,
 	return junction_xml_write(pathname, JUNCTION_XATTR_NAME_NFS, doc);
 }
 
+/**
+ * Append bytes to binary NFS junction data
+ *
+ * @param b buffer to append to
+ * @param data bytes to append
+ * @param len size of "data"
+ */
+static void
+nfs_bin_put(struct nfs_bin_buf *b, const void *data, size_t len)
+{
+	unsigned char *new;
+	size_t size;
+
+	if (b->failed)
+		return;
+	if (b->len + len > b->size) {
+		size = b->size ? b->size : 256;
+		while (size < b->len + len)
+			size *= 2;
+		new = realloc(b->data, size);
+		if (new == NULL) {
+			b->failed = true;
+			return;
+		}
+		b->data = new;
+		b->size = size;
+	}
+	memcpy(b->data + b->len, data, len);
+	b->len += len;
+}
+
+/**
+ * Append a big-endian integer to binary NFS junction data
+ *
+ * @param b buffer to append to
+ * @param value integer to append
+ * @param len size of the integer, in bytes
+ */
+static void
+nfs_bin_put_int(struct nfs_bin_buf *b, uint64_t value, unsigned int len)
+{
+	unsigned char bytes[8];
+	unsigned int i;
+
+	for (i = 0; i < len; i++)
+		bytes[i] = (unsigned char)(value >> (8 * (len - 1 - i)));
+	nfs_bin_put(b, bytes, len);
+}
+
+/**
+ * Append a counted string to binary NFS junction data
+ *
+ * @param b buffer to append to
+ * @param string NUL-terminated C string to append
+ */
+static void
+nfs_bin_put_string(struct nfs_bin_buf *b, const char *string)
+{
+	size_t len = strlen(string);
+
+	if (len > UINT16_MAX) {
+		b->failed = true;
+		return;
+	}
+	nfs_bin_put_int(b, len, 2);
+	nfs_bin_put(b, string, len);
+}
+
+/**
+ * Encode a list of NFS locations as binary NFS junction data
+ *
+ * @param fslocs list of NFS locations to encode
+ * @param xml buffer containing the junction XML made from "fslocs"
+ * @param xmllen size of "xml"
+ * @param b OUT: buffer to fill in
+ * @return true if "fslocs" could be encoded
+ *
+ * Caller must free b->data with free(3).
+ */
+static _Bool
+nfs_bin_encode(struct nfs_fsloc *fslocs, const unsigned char *xml,
+		size_t xmllen, struct nfs_bin_buf *b)
+{
+	struct nfs_fsloc *fsloc;
+	unsigned int count, i;
+	unsigned char flags;
+
+	for (count = 0, fsloc = fslocs; fsloc != NULL; fsloc = fsloc->nfl_next)
+		count++;
+	if (count > UINT16_MAX || xmllen > UINT32_MAX)
+		return false;
+
+	nfs_bin_put(b, NFS_BIN_MAGIC, 4);
+	nfs_bin_put_int(b, NFS_BIN_VERSION, 1);
+	nfs_bin_put_int(b, 0, 1);
+	nfs_bin_put_int(b, count, 2);
+	nfs_bin_put_int(b, xmllen, 4);
+	nfs_bin_put_int(b, nfs_bin_hash(xml, xmllen), 8);
+
+	for (fsloc = fslocs; fsloc != NULL; fsloc = fsloc->nfl_next) {
+		flags = 0;
+		if (fsloc->nfl_flags.nfl_varsub)
+			flags |= NFS_BIN_VARSUB;
+		if (fsloc->nfl_genflags.nfl_writable)
+			flags |= NFS_BIN_WRITABLE;
+		if (fsloc->nfl_genflags.nfl_going)
+			flags |= NFS_BIN_GOING;
+		if (fsloc->nfl_genflags.nfl_split)
+			flags |= NFS_BIN_SPLIT;
+		if (fsloc->nfl_transflags.nfl_rdma)
+			flags |= NFS_BIN_RDMA;
+
+		nfs_bin_put_int(b, fsloc->nfl_hostport, 2);
+		nfs_bin_put_int(b, flags, 1);
+		nfs_bin_put_int(b, 0, 1);
+		nfs_bin_put_int(b, (uint32_t)fsloc->nfl_currency, 4);
+		nfs_bin_put_int(b, (uint32_t)fsloc->nfl_validfor, 4);
+		nfs_bin_put_int(b, fsloc->nfl_info.nfl_simul, 1);
+		nfs_bin_put_int(b, fsloc->nfl_info.nfl_handle, 1);
+		nfs_bin_put_int(b, fsloc->nfl_info.nfl_fileid, 1);
+		nfs_bin_put_int(b, fsloc->nfl_info.nfl_writever, 1);
+		nfs_bin_put_int(b, fsloc->nfl_info.nfl_change, 1);
+		nfs_bin_put_int(b, fsloc->nfl_info.nfl_readdir, 1);
+		nfs_bin_put_int(b, fsloc->nfl_info.nfl_readrank, 1);
+		nfs_bin_put_int(b, fsloc->nfl_info.nfl_writerank, 1);
+		nfs_bin_put_int(b, fsloc->nfl_info.nfl_readorder, 1);
+		nfs_bin_put_int(b, fsloc->nfl_info.nfl_writeorder, 1);
+		nfs_bin_put_string(b, fsloc->nfl_hostname);
+
+		for (i = 0; fsloc->nfl_rootpath[i] != NULL; i++);
+		if (i > UINT16_MAX)
+			return false;
+		nfs_bin_put_int(b, i, 2);
+		for (i = 0; fsloc->nfl_rootpath[i] != NULL; i++)
+			nfs_bin_put_string(b, fsloc->nfl_rootpath[i]);
+	}
+	return !b->failed;
+}
+
+static FedFsStatus nfs_parse_xml(const char *pathname, xmlDocPtr doc,
+		struct nfs_fsloc **fslocs);
+
+/**
+ * Store a binary copy of the NFS locations in a junction object
+ *
+ * @param pathname NUL-terminated C string containing pathname of a junction
+ * @return a FedFsStatus code
+ *
+ * The copy is made from the junction XML as it was stored, so that it
+ * yields exactly what parsing the XML would.
+ *
+ * @note Access to trusted attributes requires CAP_SYS_ADMIN.
+ */
+static FedFsStatus
+nfs_store_binary_locations(const char *pathname)
+{
+	struct nfs_bin_buf b = { NULL, 0, 0, false };
+	struct nfs_fsloc *fslocs = NULL;
+	FedFsStatus retval;
+	xmlDocPtr doc;
+	size_t xmllen;
+	void *xml;
+	int fd;
+
+	retval = junction_open_path(pathname, &fd);
+	if (retval != FEDFS_OK)
+		return retval;
+
+	retval = junction_get_xattr(fd, pathname, JUNCTION_XATTR_NAME_NFS,
+					&xml, &xmllen);
+	if (retval != FEDFS_OK)
+		goto out_close;
+
+	retval = FEDFS_ERR_SVRFAULT;
+	doc = xmlParseMemory(xml, (int)xmllen);
+	if (doc == NULL)
+		goto out_free;
+	retval = nfs_parse_xml(pathname, doc, &fslocs);
+	xmlFreeDoc(doc);
+	if (retval != FEDFS_OK)
+		goto out_free;
+
+	if (nfs_bin_encode(fslocs, xml, xmllen, &b))
+		retval = junction_set_xattr(fd, pathname,
+					JUNCTION_XATTR_NAME_NFSBIN,
+					b.data, b.len);
+	else {
+		xlog(D_GENERAL, "%s: Failed to encode locations of %s",
+			__func__, pathname);
+		retval = FEDFS_ERR_SVRFAULT;
+	}
+
+	free(b.data);
+	nfs_free_locations(fslocs);
+out_free:
+	free(xml);
+out_close:
+	(void)close(fd);
+	return retval;
+}
+
 /**
  * Store NFS locations information into a junction object
  *
@@ -740,7 +1020,14 @@ nfs_store_locations(const char *pathname, struct nfs_fsloc *fslocs)
 	retval = nfs_write_junction(pathname, doc, fslocs);
 
 	xmlFreeDoc(doc);
-	return retval;
+	if (retval != FEDFS_OK)
+		return retval;
+
+	/* Readers fall back to the XML without the binary copy */
+	if (nfs_store_binary_locations(pathname) != FEDFS_OK)
+		xlog(D_GENERAL, "%s: No binary locations stored for %s",
+			__func__, pathname);
+	return FEDFS_OK;
 }
 
 /**
@@ -1396,6 +1683,214 @@ nfs_parse_xml(const char *pathname, xmlDocPtr doc, struct nfs_fsloc **fslocs)
 	return retval;
 }
 
+/**
+ * Take bytes from binary NFS junction data
+ *
+ * @param c read position
+ * @param len number of bytes to take
+ * @return pointer to the bytes, or NULL if there are not enough
+ */
+static const unsigned char *
+nfs_bin_get(struct nfs_bin_cursor *c, size_t len)
+{
+	const unsigned char *p = c->p;
+
+	if (c->failed || (size_t)(c->end - c->p) < len) {
+		c->failed = true;
+		return NULL;
+	}
+	c->p += len;
+	return p;
+}
+
+/**
+ * Take a big-endian integer from binary NFS junction data
+ *
+ * @param c read position
+ * @param len size of the integer, in bytes
+ * @return the integer, or zero if there are not enough bytes
+ */
+static uint64_t
+nfs_bin_get_int(struct nfs_bin_cursor *c, unsigned int len)
+{
+	const unsigned char *p = nfs_bin_get(c, len);
+	uint64_t value = 0;
+	unsigned int i;
+
+	if (p == NULL)
+		return 0;
+	for (i = 0; i < len; i++)
+		value = (value << 8) | p[i];
+	return value;
+}
+
+/**
+ * Take a counted string from binary NFS junction data
+ *
+ * @param c read position
+ * @return a freshly allocated NUL-terminated C string, or NULL
+ *
+ * Caller must free the returned string with free(3).
+ */
+static char *
+nfs_bin_get_string(struct nfs_bin_cursor *c)
+{
+	size_t len = (size_t)nfs_bin_get_int(c, 2);
+	const unsigned char *p = nfs_bin_get(c, len);
+	char *string;
+
+	if (p == NULL || memchr(p, '\0', len) != NULL) {
+		c->failed = true;
+		return NULL;
+	}
+	string = strndup((const char *)p, len);
+	if (string == NULL)
+		c->failed = true;
+	return string;
+}
+
+/**
+ * Decode one binary NFS location
+ *
+ * @param c read position
+ * @return a freshly allocated NFS location, or NULL
+ *
+ * Caller must free the returned location with nfs_free_location().
+ */
+static struct nfs_fsloc *
+nfs_bin_decode_location(struct nfs_bin_cursor *c)
+{
+	struct nfs_fsloc *fsloc;
+	unsigned int flags, count, i;
+
+	fsloc = nfs_new_location();
+	if (fsloc == NULL)
+		return NULL;
+
+	fsloc->nfl_hostport = (uint16_t)nfs_bin_get_int(c, 2);
+	flags = (unsigned int)nfs_bin_get_int(c, 1);
+	(void)nfs_bin_get_int(c, 1);
+	fsloc->nfl_currency = (int32_t)(uint32_t)nfs_bin_get_int(c, 4);
+	fsloc->nfl_validfor = (int32_t)(uint32_t)nfs_bin_get_int(c, 4);
+	fsloc->nfl_info.nfl_simul = (uint8_t)nfs_bin_get_int(c, 1);
+	fsloc->nfl_info.nfl_handle = (uint8_t)nfs_bin_get_int(c, 1);
+	fsloc->nfl_info.nfl_fileid = (uint8_t)nfs_bin_get_int(c, 1);
+	fsloc->nfl_info.nfl_writever = (uint8_t)nfs_bin_get_int(c, 1);
+	fsloc->nfl_info.nfl_change = (uint8_t)nfs_bin_get_int(c, 1);
+	fsloc->nfl_info.nfl_readdir = (uint8_t)nfs_bin_get_int(c, 1);
+	fsloc->nfl_info.nfl_readrank = (uint8_t)nfs_bin_get_int(c, 1);
+	fsloc->nfl_info.nfl_writerank = (uint8_t)nfs_bin_get_int(c, 1);
+	fsloc->nfl_info.nfl_readorder = (uint8_t)nfs_bin_get_int(c, 1);
+	fsloc->nfl_info.nfl_writeorder = (uint8_t)nfs_bin_get_int(c, 1);
+	fsloc->nfl_flags.nfl_varsub = (flags & NFS_BIN_VARSUB) != 0;
+	fsloc->nfl_genflags.nfl_writable = (flags & NFS_BIN_WRITABLE) != 0;
+	fsloc->nfl_genflags.nfl_going = (flags & NFS_BIN_GOING) != 0;
+	fsloc->nfl_genflags.nfl_split = (flags & NFS_BIN_SPLIT) != 0;
+	fsloc->nfl_transflags.nfl_rdma = (flags & NFS_BIN_RDMA) != 0;
+
+	fsloc->nfl_hostname = nfs_bin_get_string(c);
+	count = (unsigned int)nfs_bin_get_int(c, 2);
+	if (c->failed)
+		goto out_free;
+	fsloc->nfl_rootpath = calloc(count + 1, sizeof(char *));
+	if (fsloc->nfl_rootpath == NULL)
+		goto out_free;
+	for (i = 0; i < count; i++) {
+		fsloc->nfl_rootpath[i] = nfs_bin_get_string(c);
+		if (fsloc->nfl_rootpath[i] == NULL)
+			goto out_free;
+	}
+	return fsloc;
+
+out_free:
+	nfs_free_location(fsloc);
+	return NULL;
+}
+
+/**
+ * Retrieve list of NFS locations from the binary copy in an NFS junction
+ *
+ * @param pathname NUL-terminated C string containing pathname of a junction
+ * @param fslocs OUT: pointer to a list of NFS locations
+ * @return a FedFsStatus code
+ *
+ * Returns FEDFS_ERR_NOTJUNCT if there is no usable binary copy, in
+ * which case the junction XML has to be parsed.  If
+ * nfs_get_binary_locations() returns FEDFS_OK, caller must free the
+ * returned list of locations with nfs_free_locations().
+ */
+static FedFsStatus
+nfs_get_binary_locations(const char *pathname, struct nfs_fsloc **fslocs)
+{
+	struct nfs_fsloc *result = NULL, **next = &result;
+	struct nfs_bin_cursor c;
+	size_t binlen, xmllen;
+	unsigned int count;
+	FedFsStatus retval;
+	void *bin, *xml;
+	int fd;
+
+	retval = junction_open_path(pathname, &fd);
+	if (retval != FEDFS_OK)
+		return retval;
+
+	retval = junction_get_xattr(fd, pathname, JUNCTION_XATTR_NAME_NFSBIN,
+					&bin, &binlen);
+	if (retval != FEDFS_OK) {
+		(void)close(fd);
+		return FEDFS_ERR_NOTJUNCT;
+	}
+	retval = junction_get_xattr(fd, pathname, JUNCTION_XATTR_NAME_NFS,
+					&xml, &xmllen);
+	(void)close(fd);
+	if (retval != FEDFS_OK) {
+		free(bin);
+		return retval;
+	}
+
+	retval = FEDFS_ERR_NOTJUNCT;
+	c.p = bin;
+	c.end = c.p + binlen;
+	c.failed = false;
+	if (binlen < NFS_BIN_HDRLEN ||
+	    memcmp(nfs_bin_get(&c, 4), NFS_BIN_MAGIC, 4) != 0 ||
+	    nfs_bin_get_int(&c, 1) != NFS_BIN_VERSION) {
+		xlog(D_GENERAL, "%s: Unrecognized binary locations in %s",
+			__func__, pathname);
+		goto out;
+	}
+	(void)nfs_bin_get_int(&c, 1);
+	count = (unsigned int)nfs_bin_get_int(&c, 2);
+	if (nfs_bin_get_int(&c, 4) != xmllen ||
+	    nfs_bin_get_int(&c, 8) != nfs_bin_hash(xml, xmllen)) {
+		xlog(D_GENERAL, "%s: Binary locations in %s don't match "
+			"its XML", __func__, pathname);
+		goto out;
+	}
+
+	for (; count != 0; count--) {
+		*next = nfs_bin_decode_location(&c);
+		if (*next == NULL)
+			break;
+		next = &(*next)->nfl_next;
+	}
+	if (count != 0 || c.p != c.end || result == NULL) {
+		xlog(D_GENERAL, "%s: Bad binary locations in %s",
+			__func__, pathname);
+		nfs_free_locations(result);
+		goto out;
+	}
+
+	xlog(D_CALL, "%s: read binary locations from %s",
+		__func__, pathname);
+	*fslocs = result;
+	retval = FEDFS_OK;
+out:
+	free(xml);
+	free(bin);
+	return retval;
+}
+
 /**
  * Retrieve list of NFS locations from an NFS junction
  *
@@ -1415,6 +1910,10 @@ nfs_get_locations(const char *pathname, struct nfs_fsloc **fslocs)
 	if (fslocs == NULL)
 		return FEDFS_ERR_INVAL;
 
+	retval = nfs_get_binary_locations(pathname, fslocs);
+	if (retval != FEDFS_ERR_NOTJUNCT)
+		return retval;
+
 	retval = junction_xml_parse(pathname, JUNCTION_XATTR_NAME_NFS, &doc);
 	if (retval != FEDFS_OK)
 		return retval;
@@ -1496,25 +1995,19 @@ out_exist:
  *	Other:			Some error occurred, "pathname" not
  *				investigated
  *
- * NB: This is an expensive test.  However, it is only done if the object
- * actually has a junction extended attribute, meaning it should be done
- * rarely.  If this is really a problem, we can make the XML test cheaper.
+ * NB: Without a binary copy of the locations, this is an expensive test.
+ * However, it is only done if the object actually has a junction extended
+ * attribute, meaning it should be done rarely.
  */
 static FedFsStatus
 nfs_is_junction_xml(const char *pathname)
 {
 	struct nfs_fsloc *fslocs = NULL;
 	FedFsStatus retval;
-	xmlDocPtr doc;
-
-	retval = junction_xml_parse(pathname, JUNCTION_XATTR_NAME_NFS, &doc);
-	if (retval != FEDFS_OK)
-		return retval;
-
-	retval = nfs_parse_xml(pathname, doc, &fslocs);
-	nfs_free_locations(fslocs);
 
-	xmlFreeDoc(doc);
+	retval = nfs_get_locations(pathname, &fslocs);
+	if (retval == FEDFS_OK)
+		nfs_free_locations(fslocs);
 	return retval;
 }
 
@@ -1562,3 +2055,42 @@ out_close:
 	(void)close(fd);
 	return retval;
 }
+
+/**
+ * Give an NFS junction an up to date binary copy of its locations
+ *
+ * @param pathname NUL-terminated C string containing pathname of a directory
+ * @return a FedFsStatus code
+ *
+ * Return values:
+ *	FEDFS_OK:		the binary copy was written
+ *	FEDFS_ERR_EXIST:	the binary copy was already up to date
+ *	FEDFS_ERR_NOTJUNCT:	"pathname" refers to an object that is
+ *				not a junction
+ *	Other:			Some error occurred
+ *
+ * Used to bring junctions made by older tools, or whose XML was
+ * edited, up to date without changing their locations.
+ *
+ * @note Access to trusted attributes requires CAP_SYS_ADMIN.
+ */
+FedFsStatus
+nfs_update_junction(const char *pathname)
+{
+	struct nfs_fsloc *fslocs;
+	FedFsStatus retval;
+
+	retval = nfs_get_binary_locations(pathname, &fslocs);
+	if (retval == FEDFS_OK) {
+		nfs_free_locations(fslocs);
+		return FEDFS_ERR_EXIST;
+	}
+	if (retval != FEDFS_ERR_NOTJUNCT)
+		return retval;
+
+	retval = nfs_is_junction(pathname);
+	if (retval != FEDFS_OK)
+		return retval;
+
+	return nfs_store_binary_locations(pathname);
+}
@@ -0,0 +1,344 @@
+/**
+ * @file support/junction/scan.c
+ * @brief Find every junction below a directory
+ */
+
+/*
+ * This file is part of nfs-utils.
+ *
+ * nfs-utils is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2.0 as
+ * published by the Free Software Foundation.
+ *
+ * nfs-utils is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License version 2.0 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2.0 along with nfs-utils.  If not, see:
+ *
+ *	http://www.gnu.org/licenses/old-licenses/gpl-2.0.txt
+ */
+
+/*
+ * The tree is walked breadth-first by a few threads sharing a queue of
+ * directories still to read.  Each directory is opened once, and its
+ * entries are examined with fstatat(2) relative to it.  Only a
+ * directory with the sticky bit set and no execute bits can be a
+ * junction, so the junction xattr is looked for on those alone.  A
+ * junction's own contents are not walked, nor are other file systems
+ * mounted below the starting directory.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#ifdef HAVE_LIBPTHREAD
+#include <pthread.h>
+#endif
+
+#include "junction.h"
+#include "junction-internal.h"
+#include "xlog.h"
+
+/**
+ * Upper limit on the number of threads walking a tree
+ */
+#define JUNCTION_SCAN_MAXTHREADS	64
+
+/**
+ * A directory waiting to be read
+ */
+struct junction_scan_dir {
+	struct junction_scan_dir	*sd_next;
+	char				 sd_path[];
+};
+
+/**
+ * State shared by the threads walking one tree
+ */
+struct junction_scan {
+	struct junction_scan_dir	*sc_queue;
+	unsigned int			 sc_busy;
+	dev_t				 sc_dev;
+	junction_scan_fn		 sc_fn;
+	void				*sc_arg;
+	unsigned long			 sc_dirs, sc_junctions;
+#ifdef HAVE_LIBPTHREAD
+	pthread_mutex_t			 sc_lock;
+	pthread_cond_t			 sc_cond;
+#endif
+};
+
+#ifdef HAVE_LIBPTHREAD
+#define scan_lock(sc)		pthread_mutex_lock(&(sc)->sc_lock)
+#define scan_unlock(sc)		pthread_mutex_unlock(&(sc)->sc_lock)
+#define scan_wait(sc)		pthread_cond_wait(&(sc)->sc_cond, &(sc)->sc_lock)
+#define scan_wake(sc)		pthread_cond_broadcast(&(sc)->sc_cond)
+#else
+#define scan_lock(sc)		do { } while (0)
+#define scan_unlock(sc)		do { } while (0)
+#define scan_wait(sc)		do { } while (0)
+#define scan_wake(sc)		do { } while (0)
+#endif
+
+/**
+ * Predicate: could a directory with these attributes be a junction?
+ *
+ * @param stb attributes of a directory
+ * @return true if the sticky bit is set and no execute bit is
+ *
+ * The same test as junction_is_sticky_bit_set(), without the fstat(2).
+ */
+static _Bool
+junction_scan_maybe_junction(const struct stat *stb)
+{
+	return (stb->st_mode & S_ISVTX) &&
+		!(stb->st_mode & (S_IXUSR|S_IXGRP|S_IXOTH));
+}
+
+/**
+ * Queue a directory to be read
+ *
+ * @param sc scan state
+ * @param parent NUL-terminated C string containing pathname of parent, or NULL
+ * @param name NUL-terminated C string containing name of directory
+ */
+static void
+junction_scan_push(struct junction_scan *sc, const char *parent,
+		const char *name)
+{
+	struct junction_scan_dir *dir;
+	size_t plen = parent ? strlen(parent) : 0;
+
+	dir = malloc(sizeof(*dir) + plen + strlen(name) + 2);
+	if (dir == NULL) {
+		xlog(L_ERROR, "%s: No memory to scan %s/%s",
+			__func__, parent ? parent : "", name);
+		return;
+	}
+	if (parent == NULL)
+		strcpy(dir->sd_path, name);
+	else if (plen > 0 && parent[plen - 1] == '/')
+		sprintf(dir->sd_path, "%s%s", parent, name);
+	else
+		sprintf(dir->sd_path, "%s/%s", parent, name);
+
+	scan_lock(sc);
+	dir->sd_next = sc->sc_queue;
+	sc->sc_queue = dir;
+	scan_wake(sc);
+	scan_unlock(sc);
+}
+
+/**
+ * Report a junction to the caller
+ *
+ * @param sc scan state
+ * @param pathname NUL-terminated C string containing pathname of a junction
+ */
+static void
+junction_scan_found(struct junction_scan *sc, const char *pathname)
+{
+	xlog(D_CALL, "%s: found junction %s", __func__, pathname);
+	sc->sc_fn(pathname, sc->sc_arg);
+
+	scan_lock(sc);
+	sc->sc_junctions++;
+	scan_unlock(sc);
+}
+
+/**
+ * Read one directory, queueing its subdirectories and reporting junctions
+ *
+ * @param sc scan state
+ * @param path NUL-terminated C string containing pathname of a directory
+ */
+static void
+junction_scan_dir(struct junction_scan *sc, const char *path)
+{
+	char child[PATH_MAX];
+	struct dirent *de;
+	struct stat stb;
+	int dfd, fd;
+	DIR *dir;
+
+	dfd = open(path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	if (dfd == -1) {
+		xlog(D_GENERAL, "%s: Failed to open %s: %m", __func__, path);
+		return;
+	}
+	dir = fdopendir(dfd);
+	if (dir == NULL) {
+		xlog(D_GENERAL, "%s: Failed to read %s: %m", __func__, path);
+		(void)close(dfd);
+		return;
+	}
+
+	while ((de = readdir(dir)) != NULL) {
+		if (de->d_type != DT_DIR && de->d_type != DT_UNKNOWN)
+			continue;
+		if (strcmp(de->d_name, ".") == 0 ||
+		    strcmp(de->d_name, "..") == 0)
+			continue;
+		if (fstatat(dfd, de->d_name, &stb, AT_SYMLINK_NOFOLLOW) == -1)
+			continue;
+		if (!S_ISDIR(stb.st_mode) || stb.st_dev != sc->sc_dev)
+			continue;
+
+		if (!junction_scan_maybe_junction(&stb)) {
+			junction_scan_push(sc, path, de->d_name);
+			continue;
+		}
+
+		if ((size_t)snprintf(child, sizeof(child), "%s%s%s", path,
+				path[strlen(path) - 1] == '/' ? "" : "/",
+				de->d_name) >= sizeof(child))
+			continue;
+		fd = openat(dfd, de->d_name,
+				O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+		if (fd == -1)
+			continue;
+		if (junction_is_xattr_present(fd, child,
+					JUNCTION_XATTR_NAME_NFS) == FEDFS_OK)
+			junction_scan_found(sc, child);
+		else
+			junction_scan_push(sc, path, de->d_name);
+		(void)close(fd);
+	}
+	(void)closedir(dir);
+}
+
+/**
+ * Read queued directories until the whole tree has been read
+ *
+ * @param data scan state
+ * @return NULL
+ */
+static void *
+junction_scan_worker(void *data)
+{
+	struct junction_scan *sc = data;
+	struct junction_scan_dir *dir;
+
+	scan_lock(sc);
+	for (;;) {
+		while (sc->sc_queue == NULL && sc->sc_busy != 0)
+			scan_wait(sc);
+		dir = sc->sc_queue;
+		if (dir == NULL)
+			break;
+		sc->sc_queue = dir->sd_next;
+		sc->sc_busy++;
+		scan_unlock(sc);
+
+		junction_scan_dir(sc, dir->sd_path);
+		free(dir);
+
+		scan_lock(sc);
+		sc->sc_busy--;
+		sc->sc_dirs++;
+		if (sc->sc_busy == 0 && sc->sc_queue == NULL)
+			scan_wake(sc);
+	}
+	scan_unlock(sc);
+	return NULL;
+}
+
+/**
+ * Find every NFS junction below a directory
+ *
+ * @param pathname NUL-terminated C string containing pathname of a directory
+ * @param nthreads number of threads to walk the tree with
+ * @param fn function called with the pathname of each junction found
+ * @param arg passed to "fn"
+ * @return a FedFsStatus code
+ *
+ * "fn" may be called from several threads at once, and in no
+ * particular order.  A junction is recognized by its mode bits and the
+ * presence of its junction xattr; its contents are not checked.  If
+ * "pathname" is itself a junction, only "pathname" is reported.
+ * Directories that cannot be read are skipped.
+ */
+FedFsStatus
+junction_scan(const char *pathname, unsigned int nthreads,
+		junction_scan_fn fn, void *arg)
+{
+	struct junction_scan sc;
+	struct stat stb;
+	FedFsStatus retval;
+	int fd;
+#ifdef HAVE_LIBPTHREAD
+	pthread_t threads[JUNCTION_SCAN_MAXTHREADS];
+	unsigned int i, started = 0;
+#endif
+
+	if (pathname == NULL || fn == NULL)
+		return FEDFS_ERR_INVAL;
+
+	retval = junction_open_path(pathname, &fd);
+	if (retval != FEDFS_OK)
+		return retval;
+	if (fstat(fd, &stb) == -1) {
+		xlog(D_GENERAL, "%s: Failed to stat %s: %m",
+			__func__, pathname);
+		(void)close(fd);
+		return FEDFS_ERR_ACCESS;
+	}
+
+	memset(&sc, 0, sizeof(sc));
+	sc.sc_dev = stb.st_dev;
+	sc.sc_fn = fn;
+	sc.sc_arg = arg;
+
+	if (junction_scan_maybe_junction(&stb) &&
+	    junction_is_xattr_present(fd, pathname,
+				JUNCTION_XATTR_NAME_NFS) == FEDFS_OK) {
+		(void)close(fd);
+		fn(pathname, arg);
+		return FEDFS_OK;
+	}
+	(void)close(fd);
+
+#ifdef HAVE_LIBPTHREAD
+	pthread_mutex_init(&sc.sc_lock, NULL);
+	pthread_cond_init(&sc.sc_cond, NULL);
+#endif
+	junction_scan_push(&sc, NULL, pathname);
+
+#ifdef HAVE_LIBPTHREAD
+	if (nthreads > JUNCTION_SCAN_MAXTHREADS)
+		nthreads = JUNCTION_SCAN_MAXTHREADS;
+	for (i = 1; i < nthreads; i++) {
+		if (pthread_create(&threads[started], NULL,
+				junction_scan_worker, &sc) != 0)
+			break;
+		started++;
+	}
+	junction_scan_worker(&sc);
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+	pthread_cond_destroy(&sc.sc_cond);
+	pthread_mutex_destroy(&sc.sc_lock);
+#else
+	(void)nthreads;
+	junction_scan_worker(&sc);
+#endif
+
+	xlog(D_GENERAL, "%s: %lu junction(s) in %lu directories below %s",
+		__func__, sc.sc_junctions, sc.sc_dirs, pathname);
+	return FEDFS_OK;
+}
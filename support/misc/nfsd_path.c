@@ -8,8 +8,14 @@
 #include <sys/vfs.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <sys/syscall.h>
+#ifdef HAVE_LINUX_OPENAT2_H
+#include <linux/openat2.h>
+#endif
 
 #include "conffile.h"
 #include "xmalloc.h"
@@ -21,6 +27,22 @@
 
 static struct xthread_workqueue *nfsd_wq;
 
+#if defined(HAVE_LINUX_OPENAT2_H) && defined(SYS_openat2)
+#define NFSD_PATH_OPENAT2
+#endif
+
+/*
+ * With openat2(RESOLVE_IN_ROOT), a path is resolved below the rootdir
+ * in the calling thread, just as a chrooted worker would resolve it,
+ * and the operation is then done on the file descriptor.  The workers
+ * are still needed for reading and writing the kernel's cache channels,
+ * which show pathnames relative to the reader's root, and they take
+ * the path operations as well on kernels without openat2.
+ */
+static int nfsd_rootfd = -1;
+static char nfsd_rootpath[PATH_MAX];	/* rootdir, resolved */
+static size_t nfsd_rootlen;
+
 static int
 nfsd_path_isslash(const char *path)
 {
@@ -103,6 +125,101 @@ nfsd_path_prepend_dir(const char *dir, const char *pathname)
 	return ret;
 }
 
+/*
+ * Each worker is chrooted, so path operations from several threads
+ * need not wait for one another.
+ */
+#define NFSD_PATH_THREADS	4
+
+static void
+nfsd_path_close(int fd)
+{
+	int err = errno;
+
+	close(fd);
+	errno = err;
+}
+
+#ifdef NFSD_PATH_OPENAT2
+static int
+nfsd_openat2(int dirfd, const char *pathname, int flags)
+{
+	struct open_how how = {
+		.flags = flags | O_PATH | O_CLOEXEC,
+		.resolve = RESOLVE_IN_ROOT,
+	};
+
+	return syscall(SYS_openat2, dirfd, pathname, &how, sizeof(how));
+}
+
+static void
+nfsd_setup_rootfd(const char *rootdir)
+{
+	char proc[64];
+	ssize_t len;
+	int fd, tfd;
+
+	fd = open(rootdir, O_PATH | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0)
+		return;
+	snprintf(proc, sizeof(proc), "/proc/self/fd/%d", fd);
+	len = readlink(proc, nfsd_rootpath, sizeof(nfsd_rootpath) - 1);
+	if (len <= 0)
+		goto out_close;
+	nfsd_rootpath[len] = '\0';
+	while (len > 0 && nfsd_rootpath[len - 1] == '/')
+		len--;
+	nfsd_rootlen = len;
+
+	/* Check that this kernel has openat2 before relying on it */
+	tfd = nfsd_openat2(fd, "/", O_DIRECTORY);
+	if (tfd < 0) {
+		xlog(D_GENERAL, "%s: openat2 unavailable, using worker threads: %m",
+			__func__);
+		goto out_close;
+	}
+	close(tfd);
+	nfsd_rootfd = fd;
+	return;
+out_close:
+	close(fd);
+}
+#else
+static int
+nfsd_openat2(int UNUSED(dirfd), const char *UNUSED(pathname),
+		int UNUSED(flags))
+{
+	errno = ENOSYS;
+	return -1;
+}
+
+static void
+nfsd_setup_rootfd(const char *UNUSED(rootdir))
+{
+}
+#endif
+
+/*
+ * Open @pathname below the rootdir, for use with fstat() and friends.
+ * Returns -1 with errno set to ENOSYS if the caller should hand the
+ * operation to a worker instead.
+ */
+static int
+nfsd_path_open(const char *pathname, int flags)
+{
+	int fd;
+
+	if (nfsd_rootfd < 0 || pathname[0] != '/') {
+		errno = ENOSYS;
+		return -1;
+	}
+	fd = nfsd_openat2(nfsd_rootfd, pathname, flags);
+	/* openat2 asks for a retry if ".." raced with a rename */
+	if (fd < 0 && errno == EAGAIN)
+		errno = ENOSYS;
+	return fd;
+}
+
 static void
 nfsd_setup_workqueue(void)
 {
@@ -111,10 +228,11 @@ nfsd_setup_workqueue(void)
 	if (!rootdir)
 		return;
 
-	nfsd_wq = xthread_workqueue_alloc();
+	nfsd_wq = xthread_workqueue_alloc_pool(NFSD_PATH_THREADS);
 	if (!nfsd_wq)
 		return;
 	xthread_workqueue_chroot(nfsd_wq, rootdir);
+	nfsd_setup_rootfd(rootdir);
 }
 
 void
@@ -168,11 +286,28 @@ nfsd_run_stat(struct xthread_workqueue *wq,
 	return data.ret;
 }
 
+static int
+nfsd_open_stat(const char *pathname, struct stat *statbuf, int flags)
+{
+	int fd, ret;
+
+	fd = nfsd_path_open(pathname, flags);
+	if (fd < 0)
+		return -1;
+	ret = xfstat(fd, statbuf);
+	nfsd_path_close(fd);
+	return ret;
+}
+
 int
 nfsd_path_stat(const char *pathname, struct stat *statbuf)
 {
 	if (!nfsd_wq)
 		return xstat(pathname, statbuf);
+	if (nfsd_open_stat(pathname, statbuf, 0) == 0)
+		return 0;
+	if (errno != ENOSYS)
+		return -1;
 	return nfsd_run_stat(nfsd_wq, nfsd_statfunc, pathname, statbuf);
 }
 
@@ -181,6 +316,10 @@ nfsd_path_lstat(const char *pathname, struct stat *statbuf)
 {
 	if (!nfsd_wq)
 		return xlstat(pathname, statbuf);
+	if (nfsd_open_stat(pathname, statbuf, O_NOFOLLOW) == 0)
+		return 0;
+	if (errno != ENOSYS)
+		return -1;
 	return nfsd_run_stat(nfsd_wq, nfsd_lstatfunc, pathname, statbuf);
 }
 
@@ -221,8 +360,18 @@ nfsd_run_statfs64(struct xthread_workqueue *wq,
 int
 nfsd_path_statfs64(const char *pathname, struct statfs64 *statbuf)
 {
+	int fd, ret;
+
 	if (!nfsd_wq)
 		return statfs64(pathname, statbuf);
+	fd = nfsd_path_open(pathname, 0);
+	if (fd >= 0) {
+		ret = fstatfs64(fd, statbuf);
+		nfsd_path_close(fd);
+		return ret;
+	}
+	if (errno != ENOSYS)
+		return -1;
 	return nfsd_run_statfs64(nfsd_wq, pathname, statbuf);
 }
 
@@ -242,6 +391,39 @@ nfsd_realpathfunc(void *data)
 		d->err = errno;
 }
 
+/*
+ * The kernel's name for an open file is a host path; the name the
+ * chrooted workers would see is what follows the rootdir.
+ */
+static char *
+nfsd_open_realpath(const char *path, char *resolved_path)
+{
+	char proc[64], buf[PATH_MAX];
+	const char *name;
+	ssize_t len;
+	int fd;
+
+	fd = nfsd_path_open(path, 0);
+	if (fd < 0)
+		return NULL;
+	snprintf(proc, sizeof(proc), "/proc/self/fd/%d", fd);
+	len = readlink(proc, buf, sizeof(buf) - 1);
+	nfsd_path_close(fd);
+	if (len < 0 || (size_t)len < nfsd_rootlen ||
+	    strncmp(buf, nfsd_rootpath, nfsd_rootlen) != 0 ||
+	    (buf[nfsd_rootlen] != '/' && (size_t)len != nfsd_rootlen)) {
+		errno = ENOSYS;
+		return NULL;
+	}
+	buf[len] = '\0';
+	name = buf + nfsd_rootlen;
+	if (*name == '\0')
+		name = "/";
+	if (!resolved_path)
+		return strdup(name);
+	return strcpy(resolved_path, name);
+}
+
 char *
 nfsd_realpath(const char *path, char *resolved_path)
 {
@@ -250,10 +432,14 @@ nfsd_realpath(const char *path, char *resolved_path)
 		resolved_path,
 		0
 	};
+	char *ret;
 
 	if (!nfsd_wq)
 		return realpath(path, resolved_path);
 
+	ret = nfsd_open_realpath(path, resolved_path);
+	if (ret || errno != ENOSYS)
+		return ret;
 	xthread_work_run_sync(nfsd_wq, nfsd_realpathfunc, &data);
 	if (!data.resolved)
 		errno = data.err;
@@ -391,9 +577,20 @@ int
 nfsd_name_to_handle_at(int fd, const char *path, struct file_handle *fh,
 		int *mount_id, int flags)
 {
+	int pfd, ret;
+
 	if (!nfsd_wq)
 		return name_to_handle_at(fd, path, fh, mount_id, flags);
 
+	pfd = nfsd_path_open(path, (flags & AT_SYMLINK_FOLLOW) ? 0 : O_NOFOLLOW);
+	if (pfd >= 0) {
+		ret = name_to_handle_at(pfd, "", fh, mount_id,
+				flags | AT_EMPTY_PATH);
+		nfsd_path_close(pfd);
+		return ret;
+	}
+	if (errno != ENOSYS)
+		return -1;
 	return nfsd_run_name_to_handle_at(nfsd_wq, fd, path, fh,
 			mount_id, flags);
 }
@@ -2,119 +2,248 @@
 #include <unistd.h>
 
 #include "config.h"
+#include "nfsworker.h"
 #include "workqueue.h"
 #include "xlog.h"
 
 #if defined(HAVE_SCHED_H) && defined(HAVE_LIBPTHREAD) && defined(HAVE_UNSHARE)
 #include <sched.h>
 #include <pthread.h>
+#include <semaphore.h>
+
+/*
+ * Work is passed to the workers through a bounded ring of slots, each
+ * with a sequence number saying whose turn it is: a producer may fill
+ * slot (pos % size) once its sequence is pos, and a consumer may empty
+ * it once its sequence is pos + 1.  Positions are claimed with a
+ * compare-and-swap, so neither side takes a lock.
+ *
+ * Workers with nothing to do sleep on a semaphore.  A worker counts
+ * itself in "sleepers" before looking at the ring one last time, and a
+ * producer that finds a sleeper counted takes it off the count and
+ * posts the semaphore once, so a wakeup is never lost and an idle pool
+ * costs a submitter no system call at all.
+ *
+ * A caller waiting for its work waits on a semaphore of its own, which
+ * the worker posts when the last piece of the work is done.
+ */
+
+/*
+ * Daemons that place their workers on CPUs link in nfsworker.c;
+ * other programs using a queue don't, and their workers run anywhere.
+ */
+#pragma weak nfsworker_start
+#pragma weak nfsworker_clock
+#pragma weak nfsworker_busy
+
+#define XWORK_RING_SIZE		1024	/* a power of two */
+
+struct xthread_done {
+	int pending;
+	sem_t sem;
+};
 
-struct xwork_struct {
-	struct xwork_struct *next;
+struct xwork_slot {
+	unsigned long seq;
 	void (*fn)(void *);
 	void *data;
+	struct xthread_done *done;
 };
 
-struct xwork_queue {
-	struct xwork_struct *head;
-	struct xwork_struct **tail;
-
-	unsigned char shutdown : 1;
+struct xthread_workqueue {
+	struct xwork_slot ring[XWORK_RING_SIZE];
+	unsigned long head;	/* next slot to fill */
+	unsigned long tail;	/* next slot to empty */
+
+	sem_t wake;
+	int sleepers;
+	int shutdown;
+	int nthreads;
 };
 
-static void xwork_queue_init(struct xwork_queue *queue)
+static void xthread_workqueue_init(struct xthread_workqueue *wq)
 {
-	queue->head = NULL;
-	queue->tail = &queue->head;
-	queue->shutdown = 0;
+	unsigned long i;
+
+	for (i = 0; i < XWORK_RING_SIZE; i++)
+		wq->ring[i].seq = i;
+	wq->head = wq->tail = 0;
+	sem_init(&wq->wake, 0, 0);
+	wq->sleepers = 0;
+	wq->shutdown = 0;
+	wq->nthreads = 0;
 }
 
-static void xwork_enqueue(struct xwork_queue *queue,
-		struct xwork_struct *entry)
+static void xthread_workqueue_fini(struct xthread_workqueue *wq)
 {
-	entry->next = NULL;
-	*queue->tail = entry;
-	queue->tail = &entry->next;
+	sem_destroy(&wq->wake);
 }
 
-static struct xwork_struct *xwork_dequeue(struct xwork_queue *queue)
+static int xwork_enqueue(struct xthread_workqueue *wq,
+		void (*fn)(void *), void *data, struct xthread_done *done)
 {
-	struct xwork_struct *entry = NULL;
-	if (queue->head) {
-		entry = queue->head;
-		queue->head = entry->next;
-		if (!queue->head)
-			queue->tail = &queue->head;
+	unsigned long pos, seq;
+	struct xwork_slot *slot;
+	long dif;
+
+	pos = __atomic_load_n(&wq->head, __ATOMIC_RELAXED);
+	for (;;) {
+		slot = &wq->ring[pos & (XWORK_RING_SIZE - 1)];
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		dif = (long)(seq - pos);
+		if (dif == 0) {
+			if (__atomic_compare_exchange_n(&wq->head, &pos,
+					pos + 1, 1, __ATOMIC_RELAXED,
+					__ATOMIC_RELAXED))
+				break;
+		} else if (dif < 0)
+			return -1;	/* full */
+		else
+			pos = __atomic_load_n(&wq->head, __ATOMIC_RELAXED);
 	}
-	return entry;
+	slot->fn = fn;
+	slot->data = data;
+	slot->done = done;
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+	return 0;
 }
 
-struct xthread_work {
-	struct xwork_struct work;
+static int xwork_dequeue(struct xthread_workqueue *wq,
+		struct xwork_slot *work)
+{
+	unsigned long pos, seq;
+	struct xwork_slot *slot;
+	long dif;
 
-	pthread_cond_t cond;
-};
+	pos = __atomic_load_n(&wq->tail, __ATOMIC_RELAXED);
+	for (;;) {
+		slot = &wq->ring[pos & (XWORK_RING_SIZE - 1)];
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		dif = (long)(seq - (pos + 1));
+		if (dif == 0) {
+			if (__atomic_compare_exchange_n(&wq->tail, &pos,
+					pos + 1, 1, __ATOMIC_RELAXED,
+					__ATOMIC_RELAXED))
+				break;
+		} else if (dif < 0)
+			return 0;	/* empty */
+		else
+			pos = __atomic_load_n(&wq->tail, __ATOMIC_RELAXED);
+	}
+	*work = *slot;
+	__atomic_store_n(&slot->seq, pos + XWORK_RING_SIZE, __ATOMIC_RELEASE);
+	return 1;
+}
 
-struct xthread_workqueue {
-	struct xwork_queue queue;
+/* Take one sleeper off the count; returns 0 if there was none */
+static int xthread_take_sleeper(struct xthread_workqueue *wq)
+{
+	int n = __atomic_load_n(&wq->sleepers, __ATOMIC_SEQ_CST);
 
-	pthread_mutex_t mutex;
-	pthread_cond_t cond;
-};
+	while (n > 0)
+		if (__atomic_compare_exchange_n(&wq->sleepers, &n, n - 1, 1,
+				__ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+			return 1;
+	return 0;
+}
 
-static void xthread_workqueue_init(struct xthread_workqueue *wq)
+static void xthread_wake(struct xthread_workqueue *wq, int n)
 {
-	xwork_queue_init(&wq->queue);
-	pthread_mutex_init(&wq->mutex, NULL);
-	pthread_cond_init(&wq->cond, NULL);
+	while (n-- > 0 && xthread_take_sleeper(wq))
+		sem_post(&wq->wake);
 }
 
-static void xthread_workqueue_fini(struct xthread_workqueue *wq)
+/*
+ * Queue @n pieces of work, waiting for room if the ring is full.
+ * Unless @wait is set, gives up at the first one that does not fit.
+ */
+static int xthread_submit(struct xthread_workqueue *wq,
+		void (*fn)(void *), void **data, int n,
+		struct xthread_done *done, int wait)
 {
-	pthread_cond_destroy(&wq->cond);
-	pthread_mutex_destroy(&wq->mutex);
+	int i;
+
+	for (i = 0; i < n; i++) {
+		while (xwork_enqueue(wq, fn, data[i], done) < 0) {
+			if (!wait)
+				goto out;
+			xthread_wake(wq, i);
+			sched_yield();
+		}
+	}
+out:
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	xthread_wake(wq, i);
+	return i;
 }
 
-static int xthread_work_enqueue(struct xthread_workqueue *wq,
-		struct xthread_work *work)
+static void xthread_done_init(struct xthread_done *done, int n)
 {
-	xwork_enqueue(&wq->queue, &work->work);
-	pthread_cond_signal(&wq->cond);
-	return 0;
+	done->pending = n;
+	sem_init(&done->sem, 0, 0);
 }
 
-static struct xthread_work *xthread_work_dequeue(struct xthread_workqueue *wq)
+static void xthread_done_wait(struct xthread_done *done)
 {
-	return (struct xthread_work *)xwork_dequeue(&wq->queue);
+	while (sem_wait(&done->sem) != 0)
+		;
+	sem_destroy(&done->sem);
+}
+
+static void xthread_work_complete(struct xwork_slot *work)
+{
+	if (work->done &&
+	    __atomic_sub_fetch(&work->done->pending, 1, __ATOMIC_ACQ_REL) == 0)
+		sem_post(&work->done->sem);
+}
+
+static void xthread_work_do(struct xwork_slot *work)
+{
+	unsigned long long start = nfsworker_clock ? nfsworker_clock() : 0;
+
+	work->fn(work->data);
+	if (nfsworker_busy)
+		nfsworker_busy(start, 1);
+	xthread_work_complete(work);
 }
 
 static void xthread_workqueue_do_work(struct xthread_workqueue *wq)
 {
-	struct xthread_work *work;
+	struct xwork_slot work;
 
-	pthread_mutex_lock(&wq->mutex);
-	/* Signal the caller that we're up and running */
-	pthread_cond_signal(&wq->cond);
+	if (nfsworker_start)
+		nfsworker_start(-1);
 	for (;;) {
-		work = xthread_work_dequeue(wq);
-		if (work) {
-			work->work.fn(work->work.data);
-			pthread_cond_signal(&work->cond);
+		if (xwork_dequeue(wq, &work)) {
+			xthread_work_do(&work);
+			continue;
+		}
+		if (__atomic_load_n(&wq->shutdown, __ATOMIC_ACQUIRE))
+			break;
+		__atomic_add_fetch(&wq->sleepers, 1, __ATOMIC_SEQ_CST);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (xwork_dequeue(wq, &work)) {
+			/* A producer may already have taken us off the count */
+			if (!xthread_take_sleeper(wq))
+				while (sem_wait(&wq->wake) != 0)
+					;
+			xthread_work_do(&work);
 			continue;
 		}
-		if (wq->queue.shutdown)
+		if (__atomic_load_n(&wq->shutdown, __ATOMIC_ACQUIRE))
 			break;
-		pthread_cond_wait(&wq->cond, &wq->mutex);
+		while (sem_wait(&wq->wake) != 0)
+			;
 	}
-	pthread_mutex_unlock(&wq->mutex);
 }
 
 void xthread_workqueue_shutdown(struct xthread_workqueue *wq)
 {
-	pthread_mutex_lock(&wq->mutex);
-	wq->queue.shutdown = 1;
-	pthread_cond_signal(&wq->cond);
-	pthread_mutex_unlock(&wq->mutex);
+	int i, n = __atomic_load_n(&wq->nthreads, __ATOMIC_ACQUIRE);
+
+	__atomic_store_n(&wq->shutdown, 1, __ATOMIC_RELEASE);
+	for (i = 0; i < n; i++)
+		sem_post(&wq->wake);
 }
 
 static void xthread_workqueue_free(struct xthread_workqueue *wq)
@@ -125,7 +254,11 @@ static void xthread_workqueue_free(struct xthread_workqueue *wq)
 
 static void xthread_workqueue_cleanup(void *data)
 {
-	xthread_workqueue_free(data);
+	struct xthread_workqueue *wq = data;
+
+	/* The last worker to exit releases the queue */
+	if (__atomic_sub_fetch(&wq->nthreads, 1, __ATOMIC_ACQ_REL) == 0)
+		xthread_workqueue_free(wq);
 }
 
 static void *xthread_workqueue_worker(void *data)
@@ -136,65 +269,213 @@ static void *xthread_workqueue_worker(void *data)
 	return NULL;
 }
 
-struct xthread_workqueue *xthread_workqueue_alloc(void)
+/**
+ * xthread_workqueue_alloc_pool - start a work queue served by @nthreads
+ * @nthreads: number of worker threads, at least one
+ *
+ * Returns NULL if the queue could not be set up.  If only some of
+ * the threads could be started, the queue runs with those.
+ */
+struct xthread_workqueue *xthread_workqueue_alloc_pool(int nthreads)
 {
 	struct xthread_workqueue *ret;
 	pthread_t thread;
+	int i;
+
+	if (nthreads < 1)
+		nthreads = 1;
 
 	ret = malloc(sizeof(*ret));
-	if (ret) {
-		xthread_workqueue_init(ret);
+	if (!ret)
+		return NULL;
+	xthread_workqueue_init(ret);
 
-		pthread_mutex_lock(&ret->mutex);
+	/* Count every worker up front, so none can free the queue early */
+	ret->nthreads = nthreads;
+	for (i = 0; i < nthreads; i++) {
 		if (pthread_create(&thread, NULL,
 					xthread_workqueue_worker,
-					ret) == 0) {
-			/* Wait for thread to start */
-			pthread_cond_wait(&ret->cond, &ret->mutex);
-			pthread_mutex_unlock(&ret->mutex);
-			return ret;
-		}
-		pthread_mutex_unlock(&ret->mutex);
+					ret) != 0)
+			break;
+		pthread_detach(thread);
+	}
+	if (i == 0) {
 		xthread_workqueue_free(ret);
-		ret = NULL;
+		return NULL;
 	}
-	return NULL;
+	if (i < nthreads) {
+		xlog(L_WARNING, "Started only %d of %d worker threads",
+			i, nthreads);
+		__atomic_sub_fetch(&ret->nthreads, nthreads - i,
+				__ATOMIC_ACQ_REL);
+	}
+	return ret;
+}
+
+struct xthread_workqueue *xthread_workqueue_alloc(void)
+{
+	return xthread_workqueue_alloc_pool(1);
 }
 
+/**
+ * xthread_work_run_sync - run @fn(@data) on a worker and wait for it
+ * @wq: target work queue
+ * @fn: function to run
+ * @data: argument for @fn
+ */
 void xthread_work_run_sync(struct xthread_workqueue *wq,
 		void (*fn)(void *), void *data)
 {
-	struct xthread_work work = {
-		{
-			NULL,
-			fn,
-			data
-		},
-		PTHREAD_COND_INITIALIZER,
-	};
-	pthread_mutex_lock(&wq->mutex);
-	xthread_work_enqueue(wq, &work);
-	pthread_cond_wait(&work.cond, &wq->mutex);
-	pthread_mutex_unlock(&wq->mutex);
-	pthread_cond_destroy(&work.cond);
+	xthread_work_run_batch(wq, fn, &data, 1);
 }
 
-static void xthread_workqueue_do_chroot(void *data)
+/**
+ * xthread_work_run_batch - run @fn(@data[i]) for each i below @n and wait
+ * @wq: target work queue
+ * @fn: function to run
+ * @data: arguments for @fn
+ * @n: number of calls
+ *
+ * The calls are shared among the workers and made in no particular
+ * order.  This returns when all of them have returned.
+ */
+void xthread_work_run_batch(struct xthread_workqueue *wq,
+		void (*fn)(void *), void **data, int n)
 {
-	const char *path = data;
+	struct xthread_done done;
 
-	if (unshare(CLONE_FS) != 0) {
-		xlog_err("unshare() failed: %m");
+	if (n <= 0)
 		return;
+	xthread_done_init(&done, n);
+	xthread_submit(wq, fn, data, n, &done, 1);
+	xthread_done_wait(&done);
+}
+
+/**
+ * xthread_work_queue - run @fn(@data) asynchronously on a worker
+ * @wq: target work queue
+ * @fn: function to run
+ * @data: argument for @fn; ownership passes to @fn
+ *
+ * Returns zero if the work was queued, otherwise -1.
+ */
+int xthread_work_queue(struct xthread_workqueue *wq,
+		void (*fn)(void *), void *data)
+{
+	return xthread_submit(wq, fn, &data, 1, NULL, 0) == 1 ? 0 : -1;
+}
+
+/**
+ * xthread_work_queue_batch - run @fn(@data[i]) asynchronously for each i
+ * @wq: target work queue
+ * @fn: function to run
+ * @data: arguments for @fn; ownership of each passes to @fn
+ * @n: number of calls
+ *
+ * Returns the number of calls queued, which is less than @n only if
+ * the queue filled up; the rest of @data still belongs to the caller.
+ */
+int xthread_work_queue_batch(struct xthread_workqueue *wq,
+		void (*fn)(void *), void **data, int n)
+{
+	if (n <= 0)
+		return 0;
+	return xthread_submit(wq, fn, data, n, NULL, 0);
+}
+
+struct xthread_each {
+	void (*fn)(void *, int);
+	void *data;
+	int n;
+	int next;
+};
+
+static void *xthread_each_worker(void *arg)
+{
+	struct xthread_each *each = arg;
+	int i;
+
+	while ((i = __atomic_fetch_add(&each->next, 1, __ATOMIC_RELAXED)) <
+			each->n)
+		each->fn(each->data, i);
+	return NULL;
+}
+
+/**
+ * xthread_work_run_each - run @fn(@data, i) for each i below @n
+ * @nthreads: number of threads to share the calls, the caller's included
+ * @fn: function to run
+ * @data: first argument for @fn
+ * @n: number of calls
+ *
+ * The calls are made in no particular order, and this returns when all
+ * of them have returned.  With fewer than 2 threads, or if no thread
+ * can be started, the caller makes the calls in turn.
+ */
+void xthread_work_run_each(int nthreads, void (*fn)(void *, int),
+		void *data, int n)
+{
+	struct xthread_each each = { fn, data, n, 0 };
+	pthread_t *threads = NULL;
+	int i, started = 0;
+
+	if (nthreads > n)
+		nthreads = n;
+	if (nthreads > 1)
+		threads = calloc(nthreads - 1, sizeof(*threads));
+	if (threads) {
+		for (; started < nthreads - 1; started++)
+			if (pthread_create(&threads[started], NULL,
+					xthread_each_worker, &each) != 0)
+				break;
 	}
-	if (chroot(path) != 0)
-		xlog_err("chroot(%s) failed: %m", path);
+	xthread_each_worker(&each);
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+}
+
+struct xthread_chroot {
+	const char *path;
+	pthread_barrier_t barrier;
+};
+
+static void xthread_workqueue_do_chroot(void *data)
+{
+	struct xthread_chroot *ch = data;
+
+	if (unshare(CLONE_FS) != 0)
+		xlog_err("unshare() failed: %m");
+	else if (chroot(ch->path) != 0)
+		xlog_err("chroot(%s) failed: %m", ch->path);
+	/* Hold this worker until every other one has its own call */
+	pthread_barrier_wait(&ch->barrier);
 }
 
+/**
+ * xthread_workqueue_chroot - change the root directory of every worker
+ * @wq: target work queue
+ * @path: new root directory
+ */
 void xthread_workqueue_chroot(struct xthread_workqueue *wq,
 		const char *path)
 {
-	xthread_work_run_sync(wq, xthread_workqueue_do_chroot, (void *)path);
+	int i, n = __atomic_load_n(&wq->nthreads, __ATOMIC_ACQUIRE);
+	struct xthread_chroot ch;
+	void **data;
+
+	ch.path = path;
+	data = calloc(n, sizeof(*data));
+	if (!data || pthread_barrier_init(&ch.barrier, NULL, n) != 0) {
+		xlog_err("Unable to chroot worker threads");
+		free(data);
+		return;
+	}
+	for (i = 0; i < n; i++)
+		data[i] = &ch;
+	xthread_work_run_batch(wq, xthread_workqueue_do_chroot, data, n);
+	pthread_barrier_destroy(&ch.barrier);
+	free(data);
 }
 
 #else
@@ -209,6 +490,11 @@ struct xthread_workqueue *xthread_workqueue_alloc(void)
 	return &ret;
 }
 
+struct xthread_workqueue *xthread_workqueue_alloc_pool(int nthreads)
+{
+	return &ret;
+}
+
 void xthread_workqueue_shutdown(struct xthread_workqueue *wq)
 {
 }
@@ -219,6 +505,38 @@ void xthread_work_run_sync(struct xthread_workqueue *wq,
 	fn(data);
 }
 
+int xthread_work_queue(struct xthread_workqueue *wq,
+		void (*fn)(void *), void *data)
+{
+	fn(data);
+	return 0;
+}
+
+void xthread_work_run_batch(struct xthread_workqueue *wq,
+		void (*fn)(void *), void **data, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		fn(data[i]);
+}
+
+int xthread_work_queue_batch(struct xthread_workqueue *wq,
+		void (*fn)(void *), void **data, int n)
+{
+	xthread_work_run_batch(wq, fn, data, n);
+	return n > 0 ? n : 0;
+}
+
+void xthread_work_run_each(int nthreads, void (*fn)(void *, int),
+		void *data, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		fn(data, i);
+}
+
 void xthread_workqueue_chroot(struct xthread_workqueue *wq,
 		const char *path)
 {
@@ -100,6 +100,17 @@ int xstat(const char *pathname, struct stat *statbuf)
 	return fstatat(AT_FDCWD, pathname, statbuf, AT_NO_AUTOMOUNT);
 }
 
+int xfstat(int fd, struct stat *statbuf)
+{
+	if (statx_stat_nosync(fd, "", statbuf, AT_EMPTY_PATH |
+				AT_NO_AUTOMOUNT) == 0)
+		return 0;
+	else if (errno != ENOSYS)
+		return -1;
+	errno = 0;
+	return fstatat(fd, "", statbuf, AT_EMPTY_PATH | AT_NO_AUTOMOUNT);
+}
+
 #else
 
 int xlstat(const char *pathname, struct stat *statbuf)
@@ -111,4 +122,9 @@ int xstat(const char *pathname, struct stat *statbuf)
 {
 	return stat(pathname, statbuf);
 }
+
+int xfstat(int fd, struct stat *statbuf)
+{
+	return fstat(fd, statbuf);
+}
 #endif
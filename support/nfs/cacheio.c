@@ -21,6 +21,7 @@
 
 #include <nfslib.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdio_ext.h>
 #include <string.h>
@@ -31,68 +32,109 @@
 #include <fcntl.h>
 #include <time.h>
 #include <errno.h>
+#include "misc.h"
+#include "xlog.h"
+
+/*
+ * qword_plain() finds the first character that qword_add() must
+ * quote a word at a time: a byte of (w ^ c) is zero exactly where w
+ * holds c, and QWORD_HASZERO() is nonzero if w has any zero byte.
+ */
+#define QWORD_ONES		((uint64_t)0x0101010101010101ULL)
+#define QWORD_HASZERO(w)	(((w) - QWORD_ONES) & ~(w) & (QWORD_ONES << 7))
+#define QWORD_HASBYTE(w, c)	QWORD_HASZERO((w) ^ (QWORD_ONES * (c)))
+
+static inline int qword_special(char c)
+{
+	return c == ' ' || c == '\t' || c == '\n' || c == '\\';
+}
+
+/* Return the length of the leading run of @s[0..@n) that needs no quoting */
+static size_t qword_plain(const char *s, size_t n)
+{
+	size_t i;
+	uint64_t w;
+
+	for (i = 0; i + sizeof(w) <= n; i += sizeof(w)) {
+		memcpy(&w, s + i, sizeof(w));
+		if (QWORD_HASBYTE(w, ' ') | QWORD_HASBYTE(w, '\t') |
+		    QWORD_HASBYTE(w, '\n') | QWORD_HASBYTE(w, '\\'))
+			break;
+	}
+	while (i < n && !qword_special(s[i]))
+		i++;
+	return i;
+}
 
 void qword_add(char **bpp, int *lp, char *str)
 {
 	char *bp = *bpp;
 	int len = *lp;
+	size_t n, run;
 	char c;
 
 	if (len < 0) return;
 
-	while ((c=*str++) && len > 0)
-		switch(c) {
-		case ' ':
-		case '\t':
-		case '\n':
-		case '\\':
-			if (len >= 4) {
-				*bp++ = '\\';
-				*bp++ = '0' + ((c & 0300)>>6);
-				*bp++ = '0' + ((c & 0070)>>3);
-				*bp++ = '0' + ((c & 0007)>>0);
-			}
-			len -= 4;
+	n = strlen(str);
+	while (n) {
+		run = qword_plain(str, n);
+		if (run > (size_t)len)
+			goto overflow;
+		memcpy(bp, str, run);
+		bp += run;
+		len -= run;
+		str += run;
+		n -= run;
+		if (!n)
 			break;
-		default:
-			*bp++ = c;
-			len--;
-		}
-	if (c || len <1) len = -1;
-	else {
-		*bp++ = ' ';
-		len--;
+
+		if (len < 4)
+			goto overflow;
+		c = *str++;
+		n--;
+		*bp++ = '\\';
+		*bp++ = '0' + ((c & 0300)>>6);
+		*bp++ = '0' + ((c & 0070)>>3);
+		*bp++ = '0' + ((c & 0007)>>0);
+		len -= 4;
 	}
+	if (len < 1)
+		goto overflow;
+	*bp++ = ' ';
+	len--;
 	*bpp = bp;
 	*lp = len;
+	return;
+
+overflow:
+	*bpp = bp;
+	*lp = -1;
 }
 
+static const char qword_hexdigit[] = "0123456789abcdef";
+
 void qword_addhex(char **bpp, int *lp, char *buf, int blen)
 {
+	const unsigned char *src = (const unsigned char *)buf;
 	char *bp = *bpp;
 	int len = *lp;
 
 	if (len < 0) return;
 
-	if (len > 2) {
-		*bp++ = '\\';
-		*bp++ = 'x';
-		len -= 2;
-		while (blen && len >= 2) {
-			unsigned char c = *buf++;
-			*bp++ = '0' + ((c&0xf0)>>4) + (c>=0xa0)*('a'-'9'-1);
-			*bp++ = '0' + (c&0x0f) + ((c&0x0f)>=0x0a)*('a'-'9'-1);
-			len -= 2;
-			blen--;
-		}
+	/* "\x", two digits for each byte, and the separator */
+	if (blen < 0 || len < 3 || (len - 3) / 2 < blen) {
+		*lp = -1;
+		return;
 	}
-	if (blen || len<1) len = -1;
-	else {
-		*bp++ = ' ';
-		len--;
+	*bp++ = '\\';
+	*bp++ = 'x';
+	for (; blen > 0; blen--, src++) {
+		*bp++ = qword_hexdigit[*src >> 4];
+		*bp++ = qword_hexdigit[*src & 0x0f];
 	}
+	*bp++ = ' ';
+	*lp = len - (bp - *bpp);
 	*bpp = bp;
-	*lp = len;
 }
 
 void qword_addint(char **bpp, int *lp, int n)
@@ -117,6 +159,29 @@ void qword_adduint(char **bpp, int *lp, unsigned int n)
 	*lp -= len;
 }
 
+/* Like qword_adduint(), for wider values; marks overflow as qword_add() does */
+void qword_adduint64(char **bpp, int *lp, uint64_t n)
+{
+	char digits[20], *dp = digits + sizeof(digits);
+	int len;
+
+	if (*lp < 0)
+		return;
+	do {
+		*--dp = '0' + n % 10;
+		n /= 10;
+	} while (n);
+	len = digits + sizeof(digits) - dp;
+	if (len + 1 > *lp) {
+		*lp = -1;
+		return;
+	}
+	memcpy(*bpp, dp, len);
+	(*bpp)[len] = ' ';
+	*bpp += len + 1;
+	*lp -= len + 1;
+}
+
 void qword_addeol(char **bpp, int *lp)
 {
 	if (*lp <= 0)
@@ -126,7 +191,20 @@ void qword_addeol(char **bpp, int *lp)
 	(*lp)--;
 }
 
+/* Value of each hex digit plus one, zero for anything else */
+static const unsigned char qword_hexval[256] = {
+	['0'] = 1, ['1'] = 2, ['2'] = 3, ['3'] = 4, ['4'] = 5,
+	['5'] = 6, ['6'] = 7, ['7'] = 8, ['8'] = 9, ['9'] = 10,
+	['A'] = 11, ['B'] = 12, ['C'] = 13, ['D'] = 14, ['E'] = 15, ['F'] = 16,
+	['a'] = 11, ['b'] = 12, ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16,
+};
+
 #define isodigit(c) (isdigit(c) && c <= '7')
+
+/*
+ * @dest may point into the buffer being parsed, at or before *@bpp:
+ * a decoded word is never longer than its encoding.
+ */
 int qword_get(char **bpp, char *dest, int bufsize)
 {
 	/* return bytes copied, or -1 on error */
@@ -137,21 +215,33 @@ int qword_get(char **bpp, char *dest, int bufsize)
 
 	if (bp[0] == '\\' && bp[1] == 'x') {
 		/* HEX STRING */
-		bp += 2;
-		while (isxdigit(bp[0]) && isxdigit(bp[1]) && len < bufsize) {
-			int byte = isdigit(*bp) ? *bp-'0' : toupper(*bp)-'A'+10;
-			bp++;
-			byte <<= 4;
-			byte |= isdigit(*bp) ? *bp-'0' : toupper(*bp)-'A'+10;
-			*dest++ = byte;
-			bp++;
-			len++;
+		const unsigned char *src = (const unsigned char *)bp + 2;
+		unsigned int hi, lo;
+
+		for (; len < bufsize; len++, src += 2) {
+			hi = qword_hexval[src[0]];
+			if (!hi)
+				break;
+			lo = qword_hexval[src[1]];
+			if (!lo)
+				break;
+			*dest++ = ((hi - 1) << 4) | (lo - 1);
 		}
+		bp = (char *)src;
 	} else {
 		/* text with \nnn octal quoting */
-		while (*bp != ' ' && *bp != '\n' && *bp && len < bufsize-1) {
-			if (*bp == '\\' &&
-			    isodigit(bp[1]) && (bp[1] <= '3') &&
+		while (len < bufsize-1) {
+			size_t run = strcspn(bp, " \n\\");
+
+			if (run > (size_t)(bufsize - 1 - len))
+				run = bufsize - 1 - len;
+			memmove(dest, bp, run);
+			dest += run;
+			bp += run;
+			len += run;
+			if (*bp != '\\' || len >= bufsize-1)
+				break;
+			if (isodigit(bp[1]) && (bp[1] <= '3') &&
 			    isodigit(bp[2]) &&
 			    isodigit(bp[3])) {
 				int byte = (*++bp -'0');
@@ -159,11 +249,9 @@ int qword_get(char **bpp, char *dest, int bufsize)
 				byte = (byte << 3) | (*bp++ - '0');
 				byte = (byte << 3) | (*bp++ - '0');
 				*dest++ = byte;
-				len++;
-			} else {
+			} else
 				*dest++ = *bp++;
-				len++;
-			}
+			len++;
 		}
 	}
 
@@ -175,6 +263,22 @@ int qword_get(char **bpp, char *dest, int bufsize)
 	return len;
 }
 
+/**
+ * qword_get_inplace - decode the next word of a request over itself
+ * @bpp: IN/OUT: parse position in a writable request buffer
+ * @wordp: OUT: set to the decoded word
+ *
+ * Like qword_get(), but the word is left in the request buffer, so
+ * the caller needs no buffer of its own.  Returns the length of the
+ * word, or -1 on error.
+ */
+int qword_get_inplace(char **bpp, char **wordp)
+{
+	while (**bpp == ' ') (*bpp)++;
+	*wordp = *bpp;
+	return qword_get(bpp, *wordp, INT_MAX);
+}
+
 int qword_get_int(char **bpp, int *anint)
 {
 	char buf[50];
@@ -203,6 +307,23 @@ int qword_get_uint(char **bpp, unsigned int *anint)
 	return 0;
 }
 
+static void
+cache_flush_file(const char *cache, const char *stime)
+{
+	char path[200];
+	int fd;
+
+	sprintf(path, "/proc/net/rpc/%s/flush", cache);
+	fd = open(path, O_RDWR);
+	if (fd >= 0) {
+		if (write(fd, stime, strlen(stime)) != (ssize_t)strlen(stime)) {
+			xlog_warn("Writing to '%s' failed: errno %d (%s)",
+			path, errno, strerror(errno));
+		}
+		close(fd);
+	}
+}
+
 /* flush the kNFSd caches.
  * Set the flush time to the mtime of the etab state file or
  * if force, to now.
@@ -215,7 +336,6 @@ cache_flush(void)
 {
 	int c;
 	char stime[32];
-	char path[200];
 	time_t now;
 	/* Note: the order of these caches is important.
 	 * They need to be flushed in dependancy order. So
@@ -238,16 +358,313 @@ cache_flush(void)
 	 * the best we can do.
 	 */
 	sprintf(stime, "%" PRId64 "\n", (int64_t)now+1);
-	for (c=0; cachelist[c]; c++) {
-		int fd;
-		sprintf(path, "/proc/net/rpc/%s/flush", cachelist[c]);
-		fd = open(path, O_RDWR);
-		if (fd >= 0) {
-			if (write(fd, stime, strlen(stime)) != (ssize_t)strlen(stime)) {
-				xlog_warn("Writing to '%s' failed: errno %d (%s)",
-				path, errno, strerror(errno));
+	for (c=0; cachelist[c]; c++)
+		cache_flush_file(cachelist[c], stime);
+}
+
+/*
+ * Selective invalidation.
+ *
+ * Rather than expiring every entry, read the entries the kernel holds
+ * from each cache's "content" file and write back an already expired
+ * entry for just those that refer to a changed export.  The kernel
+ * drops an expired entry on its next lookup and makes a fresh upcall,
+ * so only clients using the changed exports see any upcalls.
+ */
+
+/* More changes than this and a full flush is cheaper */
+#define CACHE_FLUSH_MAX		256
+
+/* Expiry time written for entries being invalidated: long past */
+#define CACHE_EXPIRED		1
+
+struct cache_flush_req {
+	char **		cf_clients;
+	char **		cf_paths;
+	int		cf_count;
+	int		cf_dryrun;	/* only count the affected entries */
+};
+
+/* Is @name one of the comma separated client names in @domain? */
+static int
+cache_domain_has(const char *domain, const char *name)
+{
+	size_t len = strlen(name);
+	const char *p = domain;
+
+	for (;;) {
+		if (strncmp(p, name, len) == 0 && (p[len] == ',' || p[len] == '\0'))
+			return 1;
+		p = strchr(p, ',');
+		if (p == NULL)
+			return 0;
+		p++;
+	}
+}
+
+static int
+cache_path_covers(const char *export, const char *path)
+{
+	size_t len = strlen(export);
+
+	if (strcmp(export, "/") == 0)
+		return 1;
+	return strncmp(path, export, len) == 0 &&
+		(path[len] == '\0' || path[len] == '/');
+}
+
+/*
+ * Might the entry for @domain and @path depend on one of the changed
+ * exports?  Domains of the form "$address" (see use_ipaddr) don't name
+ * clients, so only the path can be checked for those.
+ */
+static int
+cache_entry_affected(const struct cache_flush_req *req, const char *domain,
+		     const char *path)
+{
+	int i;
+
+	for (i = 0; i < req->cf_count; i++) {
+		if (!cache_path_covers(req->cf_paths[i], path))
+			continue;
+		if (req->cf_clients[i] == NULL || domain[0] == '$' ||
+		    cache_domain_has(domain, req->cf_clients[i]))
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * Parse one line of nfsd.fh/content,
+ *	domain fsidtype 0xFSID [path]
+ * and if it needs invalidating, format a downcall for it in @buf.
+ * Negative entries don't say which path they were for, so they are
+ * always invalidated: one may be hiding a newly added export.
+ */
+static int
+cache_fh_invalidate(const struct cache_flush_req *req, char *line,
+		    char *buf, int blen)
+{
+	char domain[NFSCLNT_IDMAX+1], hex[80], path[NFS_MAXPATHLEN+1];
+	char fsid[32], *bp = buf, *cp = line;
+	unsigned int i, nwords;
+	int fsidtype, len;
+	uint32_t word;
+
+	if (qword_get(&cp, domain, sizeof(domain)) <= 0 ||
+	    qword_get_int(&cp, &fsidtype) != 0 ||
+	    qword_get(&cp, hex, sizeof(hex)) <= 0)
+		return 0;
+	if (strncmp(hex, "0x", 2) != 0)
+		return 0;
+	len = strlen(hex + 2);
+	if (len % 8 != 0 || len / 2 > (int)sizeof(fsid))
+		return 0;
+	nwords = len / 8;
+	for (i = 0; i < nwords; i++) {
+		char w[9];
+
+		memcpy(w, hex + 2 + i * 8, 8);
+		w[8] = '\0';
+		word = strtoul(w, NULL, 16);
+		memcpy(fsid + i * 4, &word, 4);
+	}
+	len = qword_get(&cp, path, sizeof(path));
+	if (len > 0 && !cache_entry_affected(req, domain, path))
+		return 0;
+
+	qword_add(&bp, &blen, domain);
+	qword_addint(&bp, &blen, fsidtype);
+	qword_addhex(&bp, &blen, fsid, nwords * 4);
+	qword_addint(&bp, &blen, CACHE_EXPIRED);
+	qword_addeol(&bp, &blen);
+	if (blen <= 0)
+		return 0;
+	return bp - buf;
+}
+
+/*
+ * Parse one line of nfsd.export/content,
+ *	path<TAB>domain(options)
+ * and if it needs invalidating, format a downcall for it in @buf.
+ */
+static int
+cache_export_invalidate(const struct cache_flush_req *req, char *line,
+			char *buf, int blen)
+{
+	char domain[NFSCLNT_IDMAX+1], path[NFS_MAXPATHLEN+1];
+	char *bp = buf, *cp, *tab, *paren;
+
+	tab = strchr(line, '\t');
+	if (tab == NULL)
+		return 0;
+	*tab = ' ';
+	paren = strchr(tab, '(');
+	if (paren)
+		*paren = ' ';
+	cp = line;
+	if (qword_get(&cp, path, sizeof(path)) <= 0 ||
+	    qword_get(&cp, domain, sizeof(domain)) <= 0)
+		return 0;
+	if (!cache_entry_affected(req, domain, path))
+		return 0;
+
+	qword_add(&bp, &blen, domain);
+	qword_add(&bp, &blen, path);
+	qword_addint(&bp, &blen, CACHE_EXPIRED);
+	qword_addeol(&bp, &blen);
+	if (blen <= 0)
+		return 0;
+	return bp - buf;
+}
+
+/*
+ * Invalidate the affected entries of one cache.  All downcalls are
+ * formatted before any is written, so that the content being read
+ * doesn't change underneath us.  Returns the number of entries
+ * invalidated, or just counted for a dry run, or -1 if the cache
+ * couldn't be read or written.
+ */
+static int
+cache_invalidate(const char *cache, const struct cache_flush_req *req,
+		 int (*invalidate)(const struct cache_flush_req *, char *,
+				   char *, int))
+{
+	char path[200], line[RPC_CHAN_BUF_SIZE], buf[RPC_CHAN_BUF_SIZE];
+	char *out = NULL, *new;
+	size_t outlen = 0, outsize = 0, pos;
+	int fd, len, ret = 0, count = 0;
+	FILE *fp;
+
+	sprintf(path, "/proc/net/rpc/%s/content", cache);
+	fp = fopen(path, "r");
+	if (fp == NULL)
+		return -1;
+	while (fgets(line, sizeof(line), fp)) {
+		/* Comments, and entries that are already invalid */
+		if (line[0] == '#')
+			continue;
+		len = invalidate(req, line, buf, sizeof(buf));
+		if (len <= 0)
+			continue;
+		count++;
+		if (req->cf_dryrun)
+			continue;
+		if (outlen + len > outsize) {
+			outsize = outsize ? outsize * 2 : 4096;
+			while (outlen + len > outsize)
+				outsize *= 2;
+			new = realloc(out, outsize);
+			if (new == NULL) {
+				ret = -1;
+				break;
 			}
-			close(fd);
+			out = new;
+		}
+		memcpy(out + outlen, buf, len);
+		outlen += len;
+	}
+	fclose(fp);
+	if (ret < 0 || outlen == 0)
+		goto out;
+
+	sprintf(path, "/proc/net/rpc/%s/channel", cache);
+	fd = open(path, O_WRONLY);
+	if (fd < 0) {
+		ret = -1;
+		goto out;
+	}
+	/* One downcall per write() */
+	for (pos = 0; pos < outlen; pos += len) {
+		len = strchr(out + pos, '\n') - (out + pos) + 1;
+		if (write(fd, out + pos, len) != len) {
+			xlog(D_GENERAL, "%s: invalidating in %s: %m",
+			     __func__, cache);
+			ret = -1;
 		}
 	}
+	close(fd);
+out:
+	free(out);
+	return ret < 0 ? ret : count;
+}
+
+/**
+ * cache_flush_paths - invalidate the kernel's cache entries for some exports
+ * @clients: client names (as used in cache domains), NULL entries match any
+ * @paths: export paths, each paired with the client at the same index
+ * @count: number of changed exports
+ * @clients_changed: set if the list of client names has changed
+ *
+ * The nfsd.fh and nfsd.export entries for the given exports, and for
+ * paths below them (which may have been reached through crossmnt),
+ * are invalidated.  auth.unix.ip is flushed only if @clients_changed,
+ * since otherwise every address still maps to the same domain.
+ *
+ * Falls back to cache_flush() if there are too many changes, or if
+ * the kernel doesn't let us read or write the caches selectively.
+ */
+void
+cache_flush_paths(char **clients, char **paths, int count,
+		  int clients_changed)
+{
+	struct cache_flush_req req = {
+		.cf_clients	= clients,
+		.cf_paths	= paths,
+		.cf_count	= count,
+	};
+	char stime[32];
+
+	if (count > CACHE_FLUSH_MAX)
+		goto full;
+
+	if (clients_changed) {
+		sprintf(stime, "%" PRId64 "\n", (int64_t)time(0) + 1);
+		cache_flush_file("auth.unix.ip", stime);
+	}
+	if (count == 0)
+		return;
+
+	/* nfsd.fh entries refer to nfsd.export ones, so go first */
+	if (cache_invalidate("nfsd.fh", &req, cache_fh_invalidate) < 0 ||
+	    cache_invalidate("nfsd.export", &req, cache_export_invalidate) < 0)
+		goto full;
+	return;
+
+full:
+	xlog(D_GENERAL, "%s: flushing all caches", __func__);
+	cache_flush();
+}
+
+/**
+ * cache_count_paths - count what cache_flush_paths() would invalidate
+ * @clients: as for cache_flush_paths()
+ * @paths: as for cache_flush_paths()
+ * @count: number of changed exports
+ *
+ * Returns the number of nfsd.fh and nfsd.export entries that would be
+ * invalidated for the given exports, without changing any, or -1 if
+ * cache_flush_paths() would flush all the caches instead.
+ */
+int
+cache_count_paths(char **clients, char **paths, int count)
+{
+	struct cache_flush_req req = {
+		.cf_clients	= clients,
+		.cf_paths	= paths,
+		.cf_count	= count,
+		.cf_dryrun	= 1,
+	};
+	int nfh, nexport;
+
+	if (count > CACHE_FLUSH_MAX)
+		return -1;
+	if (count == 0)
+		return 0;
+	nfh = cache_invalidate("nfsd.fh", &req, cache_fh_invalidate);
+	nexport = cache_invalidate("nfsd.export", &req,
+				   cache_export_invalidate);
+	if (nfh < 0 || nexport < 0)
+		return -1;
+	return nfh + nexport;
 }
@@ -68,6 +68,7 @@ static int conf_set(int , const char *, const char *, const char *,
 	const char *, int , int );
 static void conf_parse(int trans, char *buf,
 	char **section, char **subsection, const char *filename);
+static void conf_note_source(const char *path);
 
 struct conf_trans {
 	TAILQ_ENTRY (conf_trans) link;
@@ -109,27 +110,153 @@ static const uint8_t asc2bin[] =
 
 struct conf_binding {
   LIST_ENTRY (conf_binding) link;
+  struct conf_binding *hnext;
+  uint32_t hash;
   char *section;
   char *arg;
   char *tag;
   char *value;
   int is_default;
+  int mapped;		/* strings and binding belong to a snapshot */
 };
 
-LIST_HEAD (conf_bindings, conf_binding) conf_bindings[256];
+/*
+ * Bindings are kept on one list, newest first, for the walks that go
+ * by section alone, and hashed on section, argument and tag for the
+ * lookups.  Names match without regard to case, so the hash folds
+ * case as well.  A hash chain keeps its bindings newest first too, so
+ * that of two bindings for the same name the one found is the newer,
+ * as it is on the list.
+ */
+LIST_HEAD (conf_bindings, conf_binding) conf_bindings;
+
+#define CONF_HASH_INIT	256		/* initial buckets, a power of 2 */
+
+static struct conf_binding **conf_table;
+static unsigned int conf_table_size, conf_count;
+
+/* Bumped whenever a binding is added or removed, see conf_key_str() */
+static unsigned int conf_generation = 1;
 
 const char *modified_by = NULL;
 
-static __inline__ uint8_t
-conf_hash(const char *s)
+static __inline__ uint32_t
+conf_hash_str(uint32_t hash, const char *s)
+{
+	for (; *s; s++)
+		hash = (hash ^ (unsigned char)tolower(*s)) * 16777619u;
+	return hash;
+}
+
+/* FNV-1a, with a separator that tells a missing ARG from an empty one */
+static uint32_t
+conf_hash(const char *section, const char *arg, const char *tag)
 {
-	uint8_t hash = 0;
+	uint32_t hash = 2166136261u;
+
+	hash = conf_hash_str(hash, section);
+	hash = (hash ^ (arg ? 1 : 2)) * 16777619u;
+	if (arg)
+		hash = conf_hash_str(hash, arg);
+	hash = (hash ^ 1) * 16777619u;
+	return conf_hash_str(hash, tag);
+}
 
-	while (*s) {
-		hash = ((hash << 1) | (hash >> 7)) ^ tolower (*s);
-		s++;
+static int
+conf_binding_match(const struct conf_binding *cb, const char *section,
+	const char *arg, const char *tag)
+{
+	if (strcasecmp(section, cb->section) != 0)
+		return 0;
+	if (arg && (cb->arg == NULL || strcasecmp(arg, cb->arg) != 0))
+		return 0;
+	if (!arg && cb->arg)
+		return 0;
+	return strcasecmp(tag, cb->tag) == 0;
+}
+
+static struct conf_binding *
+conf_lookup(uint32_t hash, const char *section, const char *arg,
+	const char *tag)
+{
+	struct conf_binding *cb;
+
+	if (!conf_table)
+		return NULL;
+	cb = conf_table[hash & (conf_table_size - 1)];
+	for (; cb; cb = cb->hnext)
+		if (cb->hash == hash && conf_binding_match(cb, section, arg, tag))
+			return cb;
+	return NULL;
+}
+
+/*
+ * Double the table.  The bindings of a chain are split over two new
+ * chains in the order they were in, so each chain stays newest first.
+ */
+static int
+conf_table_grow(void)
+{
+	unsigned int size = conf_table_size ? conf_table_size * 2 : CONF_HASH_INIT;
+	struct conf_binding **table, *cb, *next, **lo, **hi;
+	unsigned int i;
+
+	table = calloc(size, sizeof *table);
+	if (!table) {
+		xlog_warn("conf_set: calloc (%u, %lu) failed", size,
+			(unsigned long)sizeof *table);
+		return -1;
 	}
-	return hash;
+	for (i = 0; i < conf_table_size; i++) {
+		lo = &table[i];
+		hi = &table[i + conf_table_size];
+		for (cb = conf_table[i]; cb; cb = next) {
+			next = cb->hnext;
+			cb->hnext = NULL;
+			if (cb->hash & conf_table_size) {
+				*hi = cb;
+				hi = &cb->hnext;
+			} else {
+				*lo = cb;
+				lo = &cb->hnext;
+			}
+		}
+	}
+	free(conf_table);
+	conf_table = table;
+	conf_table_size = size;
+	return 0;
+}
+
+static int
+conf_link(struct conf_binding *cb)
+{
+	struct conf_binding **head;
+
+	if (conf_count >= conf_table_size && conf_table_grow() < 0 &&
+	    !conf_table)
+		return -1;
+	head = &conf_table[cb->hash & (conf_table_size - 1)];
+	cb->hnext = *head;
+	*head = cb;
+	LIST_INSERT_HEAD(&conf_bindings, cb, link);
+	conf_count++;
+	conf_generation++;
+	return 0;
+}
+
+static void
+conf_unlink(struct conf_binding *cb)
+{
+	struct conf_binding **cbp;
+
+	cbp = &conf_table[cb->hash & (conf_table_size - 1)];
+	while (*cbp != cb)
+		cbp = &(*cbp)->hnext;
+	*cbp = cb->hnext;
+	LIST_REMOVE(cb, link);
+	conf_count--;
+	conf_generation++;
 }
 
 /*
@@ -137,7 +264,7 @@ conf_hash(const char *s)
  */
 static void free_confbind(struct conf_binding *cb)
 {
-	if (!cb)
+	if (!cb || cb->mapped)
 		return;
 	if (cb->section)
 		free(cb->section);
@@ -173,12 +300,34 @@ conf_remove_now(const char *section, const char *tag)
 {
 	struct conf_binding *cb, *next;
 
-	cb = LIST_FIRST(&conf_bindings[conf_hash (section)]);
+	cb = LIST_FIRST(&conf_bindings);
 	for (; cb; cb = next) {
 		next = LIST_NEXT(cb, link);
 		if (strcasecmp(cb->section, section) == 0
 				&& strcasecmp(cb->tag, tag) == 0) {
-			LIST_REMOVE(cb, link);
+			conf_unlink(cb);
+			xlog(LOG_INFO,"[%s]:%s->%s removed", section, tag, cb->value);
+			free_confbind(cb);
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* As conf_remove_now(), but only for the key in subsection 'arg' */
+static int
+conf_remove_arg_now(const char *section, const char *arg, const char *tag)
+{
+	struct conf_binding *cb, *next;
+
+	cb = LIST_FIRST(&conf_bindings);
+	for (; cb; cb = next) {
+		next = LIST_NEXT(cb, link);
+		if (strcasecmp(cb->section, section) == 0
+				&& strcasecmp(cb->tag, tag) == 0
+				&& (arg ? cb->arg && strcasecmp(cb->arg, arg) == 0
+					: !cb->arg)) {
+			conf_unlink(cb);
 			xlog(LOG_INFO,"[%s]:%s->%s removed", section, tag, cb->value);
 			free_confbind(cb);
 			return 0;
@@ -193,12 +342,12 @@ conf_remove_section_now(const char *section)
   struct conf_binding *cb, *next;
   int unseen = 1;
 
-	cb = LIST_FIRST(&conf_bindings[conf_hash (section)]);
+	cb = LIST_FIRST(&conf_bindings);
 	for (; cb; cb = next) {
 		next = LIST_NEXT(cb, link);
 		if (strcasecmp(cb->section, section) == 0) {
 			unseen = 0;
-			LIST_REMOVE(cb, link);
+			conf_unlink(cb);
 			xlog(LOG_INFO, "[%s]:%s->%s removed", section, cb->tag, cb->value);
 			free_confbind(cb);
 			}
@@ -217,7 +366,7 @@ conf_set_now(const char *section, const char *arg, const char *tag,
 	struct conf_binding *node = 0;
 
 	if (override)
-		conf_remove_now(section, tag);
+		conf_remove_arg_now(section, arg, tag);
 	else if (conf_get_section(section, arg, tag)) {
 		if (!is_default) {
 			xlog(LOG_INFO, "conf_set: duplicate tag [%s]:%s, ignoring...",
@@ -236,7 +385,11 @@ conf_set_now(const char *section, const char *arg, const char *tag,
 	node->tag = strdup(tag);
 	node->value = strdup(value);
 	node->is_default = is_default;
-	LIST_INSERT_HEAD(&conf_bindings[conf_hash (section)], node, link);
+	node->hash = conf_hash(section, arg, tag);
+	if (conf_link(node) < 0) {
+		free_confbind(node);
+		return 1;
+	}
 	return 0;
 }
 
@@ -533,6 +686,7 @@ conf_readfile(const char *path)
 		xlog(L_ERROR, "conf_readfile: no path given");
 		return NULL;
 	}
+	conf_note_source(path);
 
 	if ((stat (path, &sb) == 0) || (errno != ENOENT)) {
 		char *new_conf_addr = NULL;
@@ -588,18 +742,15 @@ conf_readfile(const char *path)
 /* remove and free up any existing config state */
 static void conf_free_bindings(void)
 {
-	unsigned int i;
-	for (i = 0; i < sizeof conf_bindings / sizeof conf_bindings[0]; i++) {
-		struct conf_binding *cb, *next;
+	struct conf_binding *cb, *next;
 
-		cb = LIST_FIRST(&conf_bindings[i]);
-		for (; cb; cb = next) {
-			next = LIST_NEXT(cb, link);
-			LIST_REMOVE(cb, link);
-			free_confbind(cb);
-		}
-		LIST_INIT(&conf_bindings[i]);
+	cb = LIST_FIRST(&conf_bindings);
+	for (; cb; cb = next) {
+		next = LIST_NEXT(cb, link);
+		conf_unlink(cb);
+		free_confbind(cb);
 	}
+	LIST_INIT(&conf_bindings);
 }
 
 static int
@@ -672,6 +823,7 @@ conf_init_dir(const char *conf_file)
 		return;	
 	}
 	sprintf(dname, "%s.d", conf_file);
+	conf_note_source(dname);
 
 	n = scandir(dname, &namelist, NULL, versionsort);
 	if (n < 0) {
@@ -750,20 +902,420 @@ conf_init_dir(const char *conf_file)
 	return;
 }
 
+/*
+ * Snapshots.
+ *
+ * Every daemon and helper parses the configuration file, its includes
+ * and the .d directory when it starts, and short-lived helpers run by
+ * udev, request-key or the kernel pay for that every time.
+ * "nfsconf --snapshot" saves the parsed bindings in NFS_CONFSNAPSHOT,
+ * together with the identity of every file and directory the parse
+ * looked at, and of those it looked for and did not find.  When
+ * conf_init_file() is asked for the same configuration file and none
+ * of those has changed, it maps the snapshot and links the bindings
+ * in place; otherwise it parses the files as before.
+ */
+
+#define CONF_SNAP_MAGIC		"NFSCONFS"
+#define CONF_SNAP_VERSION	1
+#define CONF_SNAP_NONE		UINT32_MAX	/* offset of a missing string */
+
+struct conf_snap_header {
+	char		magic[8];
+	uint32_t	version;
+	uint32_t	status;		/* what conf_init_file() returned */
+	uint32_t	nsources;
+	uint32_t	nbindings;
+	uint32_t	strsize;	/* bytes of strings after the bindings */
+	uint32_t	conf_file;
+};
+
+struct conf_snap_source {
+	uint64_t	dev;
+	uint64_t	ino;
+	int64_t		size;
+	int64_t		mtime_sec;
+	int64_t		mtime_nsec;
+	uint32_t	path;
+	uint32_t	present;
+};
+
+struct conf_snap_binding {
+	uint32_t	section;
+	uint32_t	arg;
+	uint32_t	tag;
+	uint32_t	value;
+	uint32_t	is_default;
+};
+
+/* A file or directory looked at by the last parse */
+struct conf_source {
+	struct conf_source *next;
+	char *path;
+	int present;
+	struct stat st;
+};
+
+static struct conf_source *conf_sources, **conf_sources_tail = &conf_sources;
+static int conf_sources_lost;	/* one could not be recorded */
+static int conf_snap_skip;	/* parse even if a snapshot is current */
+
+/* Mapped snapshots; callers may hold values from them until cleanup */
+struct conf_snap {
+	struct conf_snap *next;
+	void *map;
+	size_t len;
+	struct conf_binding *bindings;
+};
+
+static struct conf_snap *conf_snaps;
+
+static void
+conf_note_source(const char *path)
+{
+	struct conf_source *src;
+
+	src = calloc(1, sizeof *src);
+	if (src)
+		src->path = strdup(path);
+	if (!src || !src->path) {
+		free(src);
+		conf_sources_lost = 1;
+		return;
+	}
+	src->present = stat(path, &src->st) == 0;
+	*conf_sources_tail = src;
+	conf_sources_tail = &src->next;
+}
+
+static void
+conf_free_sources(void)
+{
+	struct conf_source *src, *next;
+
+	for (src = conf_sources; src; src = next) {
+		next = src->next;
+		free(src->path);
+		free(src);
+	}
+	conf_sources = NULL;
+	conf_sources_tail = &conf_sources;
+	conf_sources_lost = 0;
+}
+
+static void
+conf_free_snaps(void)
+{
+	struct conf_snap *snap, *next;
+
+	for (snap = conf_snaps; snap; snap = next) {
+		next = snap->next;
+		munmap(snap->map, snap->len);
+		free(snap->bindings);
+		free(snap);
+	}
+	conf_snaps = NULL;
+}
+
+static int
+conf_snap_source_current(const struct conf_snap_source *ss, const char *path)
+{
+	struct stat st;
+	int present = stat(path, &st) == 0;
+
+	if (present != (int)ss->present)
+		return 0;
+	if (!present)
+		return 1;
+	return ss->dev == (uint64_t)st.st_dev && ss->ino == (uint64_t)st.st_ino &&
+		ss->size == (int64_t)st.st_size &&
+		ss->mtime_sec == (int64_t)st.st_mtim.tv_sec &&
+		ss->mtime_nsec == (int64_t)st.st_mtim.tv_nsec;
+}
+
+/*
+ * Link the bindings of a current snapshot made from CONF_FILE, and set
+ * STATUS to what parsing it returned.  Returns 0, or -1 if there is no
+ * such snapshot and the files must be parsed.
+ */
+static int
+conf_snapshot_load(const char *conf_file, int *status)
+{
+	const struct conf_snap_header *hdr;
+	const struct conf_snap_source *ss;
+	const struct conf_snap_binding *sb;
+	struct conf_binding *bindings = NULL, *cb;
+	struct conf_snap *snap = NULL;
+	char *strings;
+	struct stat st;
+	size_t len;
+	uint32_t i;
+	void *map;
+	int fd;
+
+	if (conf_snap_skip)
+		return -1;
+	fd = open(NFS_CONFSNAPSHOT, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &st) || st.st_size < (off_t)sizeof(*hdr)) {
+		close(fd);
+		return -1;
+	}
+	len = st.st_size;
+	map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return -1;
+
+	hdr = map;
+	if (memcmp(hdr->magic, CONF_SNAP_MAGIC, sizeof(hdr->magic)) != 0 ||
+	    hdr->version != CONF_SNAP_VERSION || hdr->strsize == 0 ||
+	    len != sizeof(*hdr) + (size_t)hdr->nsources * sizeof(*ss) +
+		   (size_t)hdr->nbindings * sizeof(*sb) + hdr->strsize)
+		goto out_stale;
+	ss = (const struct conf_snap_source *)(hdr + 1);
+	sb = (const struct conf_snap_binding *)(ss + hdr->nsources);
+	strings = (char *)(sb + hdr->nbindings);
+
+	/* every string ends inside the table once its last byte is a NUL */
+	if (strings[hdr->strsize - 1] != '\0' || hdr->conf_file >= hdr->strsize ||
+	    strcmp(strings + hdr->conf_file, conf_file) != 0)
+		goto out_stale;
+	for (i = 0; i < hdr->nsources; i++)
+		if (ss[i].path >= hdr->strsize ||
+		    !conf_snap_source_current(&ss[i], strings + ss[i].path))
+			goto out_stale;
+	for (i = 0; i < hdr->nbindings; i++)
+		if (sb[i].section >= hdr->strsize || sb[i].tag >= hdr->strsize ||
+		    sb[i].value >= hdr->strsize ||
+		    (sb[i].arg != CONF_SNAP_NONE && sb[i].arg >= hdr->strsize))
+			goto out_stale;
+
+	snap = calloc(1, sizeof *snap);
+	bindings = calloc(hdr->nbindings ? hdr->nbindings : 1, sizeof *bindings);
+	if (!snap || !bindings) {
+		xlog_warn("conf_init_file: no memory for the snapshot");
+		free(snap);
+		free(bindings);
+		munmap(map, len);
+		return -1;
+	}
+
+	/* linked last first, so that the list comes out as it was saved */
+	for (i = hdr->nbindings; i-- > 0; ) {
+		cb = &bindings[i];
+		cb->section = strings + sb[i].section;
+		if (sb[i].arg != CONF_SNAP_NONE)
+			cb->arg = strings + sb[i].arg;
+		cb->tag = strings + sb[i].tag;
+		cb->value = strings + sb[i].value;
+		cb->is_default = sb[i].is_default;
+		cb->mapped = 1;
+		cb->hash = conf_hash(cb->section, cb->arg, cb->tag);
+		conf_link(cb);
+	}
+
+	snap->map = map;
+	snap->len = len;
+	snap->bindings = bindings;
+	snap->next = conf_snaps;
+	conf_snaps = snap;
+	*status = hdr->status;
+	xlog(D_GENERAL, "conf_init_file: %u bindings from " NFS_CONFSNAPSHOT,
+		hdr->nbindings);
+	return 0;
+
+out_stale:
+	xlog(D_GENERAL, "conf_init_file: " NFS_CONFSNAPSHOT " is not current");
+	munmap(map, len);
+	return -1;
+}
+
+struct conf_strtab {
+	char *buf;
+	size_t len;
+	size_t size;
+	int failed;
+};
+
+static uint32_t
+conf_strtab_add(struct conf_strtab *tab, const char *s)
+{
+	size_t n = strlen(s) + 1, size;
+	uint32_t off = tab->len;
+	char *buf;
+
+	if (tab->failed)
+		return 0;
+	if (tab->len + n > tab->size) {
+		size = tab->size ? tab->size * 2 : 4096;
+		while (size < tab->len + n)
+			size *= 2;
+		buf = realloc(tab->buf, size);
+		if (!buf || size > CONF_SNAP_NONE) {
+			free(buf);
+			tab->buf = NULL;
+			tab->failed = 1;
+			return 0;
+		}
+		tab->buf = buf;
+		tab->size = size;
+	}
+	memcpy(tab->buf + tab->len, s, n);
+	tab->len += n;
+	return off;
+}
+
+/*
+ * Parse CONF_FILE, which must be an absolute path, and save the result
+ * as a snapshot in SNAPFILE, or NFS_CONFSNAPSHOT if that is NULL.  The
+ * file is replaced by a rename, so that readers see the old snapshot
+ * or the new one.  Returns 0, or -1 with errno set.
+ */
+int
+conf_snapshot_write(const char *conf_file, const char *snapfile)
+{
+	struct conf_snap_header hdr = { .version = CONF_SNAP_VERSION };
+	struct conf_snap_binding *sb = NULL;
+	struct conf_snap_source *ss = NULL;
+	struct conf_strtab tab = { .buf = NULL };
+	struct conf_binding *cb;
+	struct conf_source *src;
+	char *tmpfile = NULL;
+	FILE *f = NULL;
+	uint32_t i;
+	int fd, err = 0;
+
+	if (conf_file == NULL)
+		conf_file = NFS_CONFFILE;
+	if (snapfile == NULL)
+		snapfile = NFS_CONFSNAPSHOT;
+	if (*conf_file != '/') {
+		xlog_warn("conf_snapshot_write: %s is not an absolute path",
+			conf_file);
+		errno = EINVAL;
+		return -1;
+	}
+
+	conf_snap_skip = 1;
+	hdr.status = conf_init_file(conf_file);
+	conf_snap_skip = 0;
+	if (conf_sources_lost) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	memcpy(hdr.magic, CONF_SNAP_MAGIC, sizeof(hdr.magic));
+	for (src = conf_sources; src; src = src->next)
+		hdr.nsources++;
+	LIST_FOREACH(cb, &conf_bindings, link)
+		hdr.nbindings++;
+	ss = calloc(hdr.nsources ? hdr.nsources : 1, sizeof *ss);
+	sb = calloc(hdr.nbindings ? hdr.nbindings : 1, sizeof *sb);
+	if (!ss || !sb)
+		goto out_nomem;
+
+	hdr.conf_file = conf_strtab_add(&tab, conf_file);
+	for (src = conf_sources, i = 0; src; src = src->next, i++) {
+		ss[i].path = conf_strtab_add(&tab, src->path);
+		ss[i].present = src->present;
+		if (!src->present)
+			continue;
+		ss[i].dev = src->st.st_dev;
+		ss[i].ino = src->st.st_ino;
+		ss[i].size = src->st.st_size;
+		ss[i].mtime_sec = src->st.st_mtim.tv_sec;
+		ss[i].mtime_nsec = src->st.st_mtim.tv_nsec;
+	}
+	i = 0;
+	LIST_FOREACH(cb, &conf_bindings, link) {
+		sb[i].section = conf_strtab_add(&tab, cb->section);
+		sb[i].arg = cb->arg ? conf_strtab_add(&tab, cb->arg) :
+			CONF_SNAP_NONE;
+		sb[i].tag = conf_strtab_add(&tab, cb->tag);
+		sb[i].value = conf_strtab_add(&tab, cb->value);
+		sb[i].is_default = cb->is_default;
+		i++;
+	}
+	if (tab.failed)
+		goto out_nomem;
+	hdr.strsize = tab.len;
+
+	tmpfile = malloc(strlen(snapfile) + 8);
+	if (!tmpfile)
+		goto out_nomem;
+	sprintf(tmpfile, "%s.XXXXXX", snapfile);
+	fd = mkstemp(tmpfile);
+	if (fd < 0) {
+		err = errno;
+		xlog_warn("conf_snapshot_write: unable to create %s: %s",
+			tmpfile, strerror(err));
+		goto out;
+	}
+	if (fchmod(fd, 0644) || !(f = fdopen(fd, "w"))) {
+		err = errno;
+		close(fd);
+		goto out_unlink;
+	}
+	if (fwrite(&hdr, sizeof(hdr), 1, f) != 1 ||
+	    fwrite(ss, sizeof(*ss), hdr.nsources, f) != hdr.nsources ||
+	    fwrite(sb, sizeof(*sb), hdr.nbindings, f) != hdr.nbindings ||
+	    fwrite(tab.buf, 1, tab.len, f) != tab.len ||
+	    fflush(f) || fsync(fileno(f))) {
+		err = errno;
+		fclose(f);
+		goto out_unlink;
+	}
+	if (fclose(f)) {
+		err = errno;
+		goto out_unlink;
+	}
+	if (rename(tmpfile, snapfile)) {
+		err = errno;
+		goto out_unlink;
+	}
+	xlog(D_GENERAL, "conf_snapshot_write: %u files, %u bindings in %s",
+		hdr.nsources, hdr.nbindings, snapfile);
+	goto out;
+
+out_unlink:
+	xlog_warn("conf_snapshot_write: unable to write %s: %s",
+		snapfile, strerror(err));
+	unlink(tmpfile);
+	goto out;
+out_nomem:
+	xlog_warn("conf_snapshot_write: no memory");
+	err = ENOMEM;
+out:
+	free(tmpfile);
+	free(tab.buf);
+	free(sb);
+	free(ss);
+	errno = err;
+	return err ? -1 : 0;
+}
+
 int
 conf_init_file(const char *conf_file)
 {
-	unsigned int i;
 	int ret;
 
-	for (i = 0; i < sizeof conf_bindings / sizeof conf_bindings[0]; i++)
-		LIST_INIT (&conf_bindings[i]);
+	LIST_INIT (&conf_bindings);
+	if (conf_table)
+		memset(conf_table, 0, conf_table_size * sizeof *conf_table);
+	conf_count = 0;
+	conf_generation++;
 
 	TAILQ_INIT (&conf_trans_queue);
 
 	if (conf_file == NULL) 
 		conf_file=NFS_CONFFILE;
 
+	conf_free_sources();
+	if (conf_snapshot_load(conf_file, &ret) == 0)
+		return ret;
+
 	/*
 	 * First parse the give config file 
 	 * then parse the config.conf.d directory 
@@ -790,6 +1342,8 @@ void
 conf_cleanup(void)
 {
 	conf_free_bindings();
+	conf_free_snaps();
+	conf_free_sources();
 
 	struct conf_trans *node, *next;
 	for (node = TAILQ_FIRST(&conf_trans_queue); node; node = next) {
@@ -815,18 +1369,9 @@ conf_get_num(const char *section, const char *tag, int def)
 	return def;
 }
 
-/*
- * Return the Boolean value denoted by TAG in section SECTION, or DEF
- * if that tags does not exist.
- * FALSE is returned for case-insensitive comparisons with 0, f, false, n, no, off
- * TRUE is returned for 1, t, true, y, yes, on
- * A failure to match one of these results in DEF
- */
-_Bool
-conf_get_bool(const char *section, const char *tag, _Bool def)
+static _Bool
+conf_parse_bool(const char *value, _Bool def)
 {
-	char *value = conf_get_str(section, tag);
-
 	if (!value)
 		return def;
 	if (strcasecmp(value, "1") == 0 ||
@@ -847,6 +1392,19 @@ conf_get_bool(const char *section, const char *tag, _Bool def)
 	return def;
 }
 
+/*
+ * Return the Boolean value denoted by TAG in section SECTION, or DEF
+ * if that tags does not exist.
+ * FALSE is returned for case-insensitive comparisons with 0, f, false, n, no, off
+ * TRUE is returned for 1, t, true, y, yes, on
+ * A failure to match one of these results in DEF
+ */
+_Bool
+conf_get_bool(const char *section, const char *tag, _Bool def)
+{
+	return conf_parse_bool(conf_get_str(section, tag), def);
+}
+
 /* Validate X according to the range denoted by TAG in section SECTION.  */
 int
 conf_match_num(const char *section, const char *tag, int x)
@@ -891,6 +1449,29 @@ conf_get_str_with_def(const char *section, const char *tag, char *def)
 	return result;
 }
 
+/*
+ * The value of CB, with $name expanded from the environment, or else
+ * from the [environment] section
+ */
+static char *
+conf_expand(struct conf_binding *cb, const char *arg)
+{
+	const char *tag;
+	char *env;
+
+	while (cb->value[0] == '$') {
+		env = getenv(cb->value + 1);
+		if (env && *env)
+			return env;
+		tag = cb->value + 1;
+		cb = conf_lookup(conf_hash("environment", arg, tag),
+				"environment", arg, tag);
+		if (!cb)
+			return 0;
+	}
+	return cb->value;
+}
+
 /*
  * Retrieve an entry without interpreting its contents
  */
@@ -899,19 +1480,8 @@ conf_get_entry(const char *section, const char *arg, const char *tag)
 {
 	struct conf_binding *cb;
 
-	cb = LIST_FIRST (&conf_bindings[conf_hash (section)]);
-	for (; cb; cb = LIST_NEXT (cb, link)) {
-		if (strcasecmp(section, cb->section) != 0)
-			continue;
-		if (arg && (cb->arg == NULL || strcasecmp(arg, cb->arg) != 0))
-			continue;
-		if (!arg && cb->arg)
-			continue;
-		if (strcasecmp(tag, cb->tag) != 0)
-			continue;
-		return cb->value;
-	}
-	return 0;
+	cb = conf_lookup(conf_hash(section, arg, tag), section, arg, tag);
+	return cb ? cb->value : 0;
 }
 
 /*
@@ -921,31 +1491,99 @@ char *
 conf_get_section(const char *section, const char *arg, const char *tag)
 {
 	struct conf_binding *cb;
-retry:
-	cb = LIST_FIRST (&conf_bindings[conf_hash (section)]);
-	for (; cb; cb = LIST_NEXT (cb, link)) {
-		if (strcasecmp(section, cb->section) != 0)
-			continue;
-		if (arg && (cb->arg == NULL || strcasecmp(arg, cb->arg) != 0))
-			continue;
-		if (!arg && cb->arg)
-			continue;
-		if (strcasecmp(tag, cb->tag) != 0)
+
+	cb = conf_lookup(conf_hash(section, arg, tag), section, arg, tag);
+	return cb ? conf_expand(cb, arg) : 0;
+}
+
+/*
+ * Keys for callers that read the same value over and over: the names
+ * are looked up once, and then again only when bindings have been
+ * added or removed since.  Keys are shared between callers asking for
+ * the same names, and live as long as the program does.
+ */
+struct conf_key {
+	struct conf_key *next;
+	uint32_t hash;
+	char *section;
+	char *arg;
+	char *tag;
+	unsigned int generation;
+	struct conf_binding *cb;
+};
+
+static struct conf_key *conf_keys;
+
+/*
+ * Return the key for TAG in SECTION, with argument ARG if that is not
+ * NULL, or NULL if there is no memory for it.  The readers take a NULL
+ * key as one that is not set.
+ */
+struct conf_key *
+conf_key_get(const char *section, const char *arg, const char *tag)
+{
+	uint32_t hash = conf_hash(section, arg, tag);
+	struct conf_key *key;
+
+	for (key = conf_keys; key; key = key->next) {
+		if (key->hash != hash || strcasecmp(key->section, section) != 0 ||
+		    strcasecmp(key->tag, tag) != 0)
 			continue;
-		if (cb->value[0] == '$') {
-			/* expand $name from [environment] section,
-			 * or from environment
-			 */
-			char *env = getenv(cb->value+1);
-			if (env && *env)
-				return env;
-			section = "environment";
-			tag = cb->value + 1;
-			goto retry;
-		}
-		return cb->value;
+		if (arg ? key->arg && strcasecmp(key->arg, arg) == 0 : !key->arg)
+			return key;
 	}
-	return 0;
+
+	key = calloc(1, sizeof *key);
+	if (!key)
+		goto mem_err;
+	key->hash = hash;
+	key->section = strdup(section);
+	key->tag = strdup(tag);
+	if (!key->section || !key->tag)
+		goto mem_err;
+	if (arg && !(key->arg = strdup(arg)))
+		goto mem_err;
+	key->next = conf_keys;
+	conf_keys = key;
+	return key;
+
+mem_err:
+	xlog_warn("conf_key_get: no memory for [%s]:%s", section, tag);
+	if (key) {
+		free(key->section);
+		free(key->tag);
+		free(key);
+	}
+	return NULL;
+}
+
+/* Return the string value of KEY, as conf_get_section() would */
+char *
+conf_key_str(struct conf_key *key)
+{
+	if (!key)
+		return 0;
+	if (key->generation != conf_generation) {
+		key->cb = conf_lookup(key->hash, key->section, key->arg, key->tag);
+		key->generation = conf_generation;
+	}
+	return key->cb ? conf_expand(key->cb, key->arg) : 0;
+}
+
+/* Return the numeric value of KEY, or DEF if it is not set */
+int
+conf_key_num(struct conf_key *key, int def)
+{
+	char *value = conf_key_str(key);
+
+	return value ? atoi(value) : def;
+}
+
+/* Return the Boolean value of KEY, as conf_get_bool() would */
+_Bool
+conf_key_bool(struct conf_key *key, _Bool def)
+{
+	return conf_parse_bool(conf_key_str(key), def);
 }
 
 /*
@@ -1018,7 +1656,7 @@ conf_get_tag_list(const char *section, const char *arg)
 		goto cleanup;
 	TAILQ_INIT(&list->fields);
 	list->cnt = 0;
-	cb = LIST_FIRST(&conf_bindings[conf_hash (section)]);
+	cb = LIST_FIRST(&conf_bindings);
 	for (; cb; cb = LIST_NEXT(cb, link)) {
 		if (strcasecmp (section, cb->section) == 0) {
 			if (arg != NULL && strcasecmp(arg, cb->arg) != 0)
@@ -1468,26 +2106,23 @@ void
 conf_report(FILE *outfile)
 {
 	struct conf_binding *cb = NULL;
-	unsigned int i;
 	struct dumper *dumper = NULL, *dnode = NULL;
 
 	xlog(LOG_INFO, "conf_report: dumping running configuration");
 
 	/* build a linked list of all the config nodes */
-	for (i = 0; i < sizeof conf_bindings / sizeof conf_bindings[0]; i++) {
-		for (cb = LIST_FIRST(&conf_bindings[i]); cb; cb = LIST_NEXT(cb, link)) {
-			struct dumper *newnode = calloc(1, sizeof (struct dumper));
-			if (!newnode)
-				goto mem_fail;
-
-			newnode->next = dumper;
-			dumper = newnode;
-
-			newnode->section = cb->section;
-			newnode->arg = cb->arg;
-			newnode->tag = cb->tag;
-			newnode->value = cb->value;
-		}
+	for (cb = LIST_FIRST(&conf_bindings); cb; cb = LIST_NEXT(cb, link)) {
+		struct dumper *newnode = calloc(1, sizeof (struct dumper));
+		if (!newnode)
+			goto mem_fail;
+
+		newnode->next = dumper;
+		dumper = newnode;
+
+		newnode->section = cb->section;
+		newnode->arg = cb->arg;
+		newnode->tag = cb->tag;
+		newnode->value = cb->value;
 	}
 
 	/* sort the list then print it */
@@ -61,6 +61,8 @@ static int	getpath(char *path, int len);
 static int	parseopts(char *cp, struct exportent *ep, int warn, int *had_subtree_opt_ptr);
 static int	parsesquash(char *list, int **idp, int *lenp, char **ep);
 static int	parsenum(char **cpp);
+static int	parsesize(const char *str, unsigned int *valp,
+				unsigned int min, unsigned int max);
 static void	freesquash(void);
 static void	syntaxerr(char *msg);
 static struct flav_info *find_flavor(char *name);
@@ -79,6 +81,20 @@ setexportent(char *fname, char *type)
 	first = 1;
 }
 
+/*
+ * Parse entries from @len bytes of @buf instead of a file; @name is
+ * used in error messages.
+ */
+void
+setexportent_buf(const char *name, const char *buf, size_t len)
+{
+	if (efp)
+		endexportent();
+	efp = xfopenbuf(buf, len);
+	efname = strdup(name);
+	first = 1;
+}
+
 static void init_exportent (struct exportent *ee, int fromkernel)
 {
 	ee->e_flags = EXPORT_DEFAULT_FLAGS;
@@ -98,17 +114,22 @@ static void init_exportent (struct exportent *ee, int fromkernel)
 	ee->e_mountpoint = NULL;
 	ee->e_fslocmethod = FSLOC_NONE;
 	ee->e_fslocdata = NULL;
+	ee->e_fslocs = NULL;
 	ee->e_secinfo[0].flav = NULL;
 	ee->e_nsquids = 0;
 	ee->e_nsqgids = 0;
 	ee->e_uuid = NULL;
 	ee->e_ttl = default_ttl;
+	ee->e_rsize = 0;
+	ee->e_wsize = 0;
+	ee->e_readahead = 0;
 }
 
 struct exportent *
 getexportent(int fromkernel, int fromexports)
 {
 	static struct exportent	ee, def_ee;
+	static char	ee_path[NFS_MAXPATHLEN+1], def_path[NFS_MAXPATHLEN+1];
 	char		exp[512], *hostname;
 	char		rpath[MAXPATHLEN+1];
 	char		*opt, *sp;
@@ -124,8 +145,9 @@ getexportent(int fromkernel, int fromexports)
 		has_default_subtree_opts = 0;
 	
 		init_exportent(&def_ee, fromkernel);
+		def_ee.e_path = def_path;
 
-		ok = getpath(def_ee.e_path, sizeof(def_ee.e_path));
+		ok = getpath(def_path, sizeof(def_path));
 		if (ok <= 0)
 			return NULL;
 
@@ -159,6 +181,8 @@ getexportent(int fromkernel, int fromexports)
 	xfree(ee.e_hostname);
 	xfree(ee.e_realpath);
 	ee = def_ee;
+	ee.e_path = ee_path;
+	strcpy(ee_path, def_path);
 
 	/* Check for default client */
 	if (ok == 0)
@@ -199,13 +223,72 @@ getexportent(int fromkernel, int fromexports)
 	/* resolve symlinks */
 	if (realpath(ee.e_path, rpath) != NULL) {
 		rpath[sizeof (rpath) - 1] = '\0';
-		strncpy(ee.e_path, rpath, sizeof (ee.e_path) - 1);
-		ee.e_path[sizeof (ee.e_path) - 1] = '\0';
+		strncpy(ee_path, rpath, sizeof (ee_path) - 1);
+		ee_path[sizeof (ee_path) - 1] = '\0';
 	}
 
 	return &ee;
 }
 
+/* Does the option list @opts include "mountpoint"? */
+static int
+hasmountpoint(const char *opts)
+{
+	size_t len;
+
+	for (; *opts; opts += len + (opts[len] == ',')) {
+		len = strcspn(opts, ",");
+		if ((len == 10 && strncmp(opts, "mountpoint", 10) == 0) ||
+		    (len == 2 && strncmp(opts, "mp", 2) == 0) ||
+		    strncmp(opts, "mountpoint=", 11) == 0 ||
+		    strncmp(opts, "mp=", 3) == 0)
+			return 1;
+	}
+	return 0;
+}
+
+/**
+ * getexportpath - read the next path from the exports file, skipping
+ *	its clients
+ * @path: where to put the path, resolved as getexportent() would
+ * @len: size of @path
+ * @mountpoint: set if the path's first client, or its default options,
+ *	have the "mountpoint" option
+ *
+ * For a caller that only wants the exported paths, and should not pay
+ * for parsing every client's options.  Returns 1, or 0 at the end of
+ * the file or at a syntax error.
+ */
+int
+getexportpath(char *path, int len, int *mountpoint)
+{
+	char	exp[512], rpath[MAXPATHLEN+1], *opt, *sp;
+	int	ok, clients = 0;
+
+	if (!efp || getpath(path, len) <= 0)
+		return 0;
+
+	*mountpoint = 0;
+	while ((ok = getexport(exp, sizeof(exp))) > 0) {
+		if (exp[0] == '-' && clients == 0)
+			opt = exp + 1;
+		else if (clients++ == 0 && (opt = strchr(exp, '(')) != NULL)
+			*opt++ = '\0';
+		else
+			continue;
+		if ((sp = strchr(opt, ')')) != NULL)
+			*sp = '\0';
+		if (hasmountpoint(opt))
+			*mountpoint = 1;
+	}
+	if (ok < 0)
+		return 0;
+
+	if (realpath(path, rpath) != NULL && (int)strlen(rpath) < len)
+		strcpy(path, rpath);
+	return 1;
+}
+
 static const struct secinfo_flag_displaymap {
 	unsigned int flag;
 	const char *set;
@@ -263,13 +346,17 @@ fprintpath(FILE *fp, const char *path)
 void
 putexportent(struct exportent *ep)
 {
-	FILE	*fp;
-	int	*id, i;
-
 	if (!efp)
 		return;
+	fputexportent(efp->x_fp, ep);
+}
+
+/* Write @ep to @fp as one etab line */
+void
+fputexportent(FILE *fp, struct exportent *ep)
+{
+	int	*id, i;
 
-	fp = efp->x_fp;
 	fprintpath(fp, ep->e_path);
 	fprintf(fp, "\t%s(", ep->e_hostname);
 	fprintf(fp, "%s,", (ep->e_flags & NFSEXP_READONLY)? "ro" : "rw");
@@ -305,6 +392,12 @@ putexportent(struct exportent *ep)
 	if (ep->e_mountpoint)
 		fprintf(fp, "mountpoint%s%s,",
 			ep->e_mountpoint[0]?"=":"", ep->e_mountpoint);
+	if (ep->e_rsize)
+		fprintf(fp, "rsize=%u,", ep->e_rsize);
+	if (ep->e_wsize)
+		fprintf(fp, "wsize=%u,", ep->e_wsize);
+	if (ep->e_readahead)
+		fprintf(fp, "readahead=%u,", ep->e_readahead);
 	switch (ep->e_fslocmethod) {
 	case FSLOC_NONE:
 		break;
@@ -374,34 +467,81 @@ dupexportent(struct exportent *dst, struct exportent *src)
 		dst->e_sqgids = (int *) xmalloc(n * sizeof(int));
 		memcpy(dst->e_sqgids, src->e_sqgids, n * sizeof(int));
 	}
-	if (src->e_mountpoint)
-		dst->e_mountpoint = strdup(src->e_mountpoint);
-	if (src->e_fslocdata)
-		dst->e_fslocdata = strdup(src->e_fslocdata);
-	if (src->e_uuid)
-		dst->e_uuid = strdup(src->e_uuid);
+	dst->e_path = strpool_get(src->e_path);
+	dst->e_mountpoint = strpool_get(src->e_mountpoint);
+	dst->e_fslocdata = strpool_get(src->e_fslocdata);
+	dst->e_fslocs = NULL;
+	dst->e_uuid = strpool_get(src->e_uuid);
 	dst->e_hostname = NULL;
 	dst->e_realpath = NULL;
 }
 
+static int
+cmpstr(const char *a, const char *b)
+{
+	if (a == NULL || b == NULL)
+		return a != b;
+	return strcmp(a, b);
+}
+
+/*
+ * Compare the export options of two entries, ignoring the client and
+ * path.  Returns zero if they are the same.
+ */
+int
+cmpexportent(const struct exportent *a, const struct exportent *b)
+{
+	const struct sec_entry *p1, *p2;
+
+	if (a->e_flags != b->e_flags ||
+	    a->e_anonuid != b->e_anonuid ||
+	    a->e_anongid != b->e_anongid ||
+	    a->e_fsid != b->e_fsid ||
+	    a->e_fslocmethod != b->e_fslocmethod ||
+	    a->e_ttl != b->e_ttl ||
+	    a->e_rsize != b->e_rsize ||
+	    a->e_wsize != b->e_wsize ||
+	    a->e_readahead != b->e_readahead ||
+	    a->e_nsquids != b->e_nsquids ||
+	    a->e_nsqgids != b->e_nsqgids)
+		return 1;
+	if (a->e_nsquids &&
+	    memcmp(a->e_squids, b->e_squids, a->e_nsquids * sizeof(int)))
+		return 1;
+	if (a->e_nsqgids &&
+	    memcmp(a->e_sqgids, b->e_sqgids, a->e_nsqgids * sizeof(int)))
+		return 1;
+	if (cmpstr(a->e_mountpoint, b->e_mountpoint) ||
+	    cmpstr(a->e_fslocdata, b->e_fslocdata) ||
+	    cmpstr(a->e_uuid, b->e_uuid))
+		return 1;
+	for (p1 = a->e_secinfo, p2 = b->e_secinfo; p1->flav || p2->flav;
+	     p1++, p2++)
+		if (p1->flav != p2->flav || p1->flags != p2->flags)
+			return 1;
+	return 0;
+}
+
 struct exportent *
 mkexportent(char *hname, char *path, char *options)
 {
 	static struct exportent	ee;
+	static char		ee_path[NFS_MAXPATHLEN+1];
 
 	init_exportent(&ee, 0);
+	ee.e_path = ee_path;
 
 	xfree(ee.e_hostname);
 	ee.e_hostname = xstrdup(hname);
 	xfree(ee.e_realpath);
 	ee.e_realpath = NULL;
 
-	if (strlen(path) >= sizeof(ee.e_path)) {
+	if (strlen(path) >= sizeof(ee_path)) {
 		xlog(L_ERROR, "path name %s too long", path);
 		return NULL;
 	}
-	strncpy(ee.e_path, path, sizeof (ee.e_path));
-	ee.e_path[sizeof (ee.e_path) - 1] = '\0';
+	strncpy(ee_path, path, sizeof (ee_path));
+	ee_path[sizeof (ee_path) - 1] = '\0';
 	if (parseopts(options, &ee, 0, NULL) < 0)
 		return NULL;
 	return &ee;
@@ -684,6 +824,27 @@ bad_option:
 		} else if (strncmp(opt, "replicas=", 9) == 0) {
 			ep->e_fslocmethod = FSLOC_REPLICA;
 			ep->e_fslocdata = strdup(opt+9);
+		} else if (strncmp(opt, "rsize=", 6) == 0) {
+			if (parsesize(opt+6, &ep->e_rsize, EXPORT_IOSIZE_MIN,
+				      EXPORT_IOSIZE_MAX) < 0) {
+				xlog(L_ERROR, "%s: %d: bad rsize \"%s\"\n",
+				     flname, flline, opt);
+				goto bad_option;
+			}
+		} else if (strncmp(opt, "wsize=", 6) == 0) {
+			if (parsesize(opt+6, &ep->e_wsize, EXPORT_IOSIZE_MIN,
+				      EXPORT_IOSIZE_MAX) < 0) {
+				xlog(L_ERROR, "%s: %d: bad wsize \"%s\"\n",
+				     flname, flline, opt);
+				goto bad_option;
+			}
+		} else if (strncmp(opt, "readahead=", 10) == 0) {
+			if (parsesize(opt+10, &ep->e_readahead, 0,
+				      EXPORT_READAHEAD_MAX) < 0) {
+				xlog(L_ERROR, "%s: %d: bad readahead \"%s\"\n",
+				     flname, flline, opt);
+				goto bad_option;
+			}
 		} else if (strncmp(opt, "sec=", 4) == 0) {
 			active = parse_flavors(opt+4, ep);
 			if (!active)
@@ -719,6 +880,27 @@ out:
 	return 1;
 }
 
+/*
+ * Parse the value of an I/O hint, which must lie in [min, max].  Zero
+ * is taken as well, and removes the hint.
+ */
+static int
+parsesize(const char *str, unsigned int *valp, unsigned int min,
+	  unsigned int max)
+{
+	unsigned long val;
+	char *end;
+
+	if (!isdigit((unsigned char)*str))
+		return -1;
+	errno = 0;
+	val = strtoul(str, &end, 10);
+	if (errno || *end != '\0' || (val && (val < min || val > max)))
+		return -1;
+	*valp = val;
+	return 0;
+}
+
 static int
 parsesquash(char *list, int **idp, int *lenp, char **ep)
 {
@@ -31,6 +31,8 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <pthread.h>
+#include <time.h>
 
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -716,6 +718,250 @@ static unsigned short nfs_gp_getport(CLIENT *client,
 	return 0;
 }
 
+/*
+ * A mount may ask a server's rpcbind for the same service several
+ * times, and ask about several services in turn.  Answers are kept
+ * for NFS_GP_CACHE_TTL seconds, and so is the rpcbind client used to
+ * get them, so that the next query for that server and transport
+ * goes over the same socket rather than a new connection.  A client
+ * in use by one thread is not shared; another thread querying the
+ * same server meanwhile gets a fresh one.
+ */
+#define NFS_GP_CACHE_TTL	(30)	/* seconds */
+#define NFS_GP_CACHE_PORTS	(32)
+#define NFS_GP_CACHE_CLIENTS	(4)
+
+struct nfs_gp_port {
+	union nfs_sockaddr	address;	/* port is zero */
+	rpcprog_t		program;
+	rpcvers_t		version;
+	unsigned short		protocol;
+	unsigned short		port;
+	time_t			expires;
+};
+
+struct nfs_gp_client {
+	union nfs_sockaddr	address;	/* port is zero */
+	unsigned short		transport;
+	CLIENT			*client;
+	struct timeval		timeout;
+	int			busy;
+	time_t			expires;
+};
+
+static pthread_mutex_t nfs_gp_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct nfs_gp_port nfs_gp_ports[NFS_GP_CACHE_PORTS];
+static unsigned int nfs_gp_next_port;
+static struct nfs_gp_client nfs_gp_clients[NFS_GP_CACHE_CLIENTS];
+
+static time_t nfs_gp_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+static void nfs_gp_cache_key(union nfs_sockaddr *key,
+			     const struct sockaddr *sap, const socklen_t salen)
+{
+	memset(key, 0, sizeof(*key));
+	if ((size_t)salen <= sizeof(*key))
+		memcpy(key, sap, (size_t)salen);
+	nfs_set_port(&key->sa, 0);
+}
+
+static unsigned short nfs_gp_cache_lookup(const struct sockaddr *sap,
+					  const socklen_t salen,
+					  const rpcprog_t program,
+					  const rpcvers_t version,
+					  const unsigned short protocol)
+{
+	union nfs_sockaddr key;
+	unsigned short port = 0;
+	time_t now = nfs_gp_now();
+	unsigned int i;
+
+	nfs_gp_cache_key(&key, sap, salen);
+	pthread_mutex_lock(&nfs_gp_cache_lock);
+	for (i = 0; i < NFS_GP_CACHE_PORTS; i++) {
+		struct nfs_gp_port *p = &nfs_gp_ports[i];
+
+		if (p->port != 0 && p->expires > now &&
+		    p->program == program && p->version == version &&
+		    p->protocol == protocol &&
+		    nfs_compare_sockaddr(&p->address.sa, &key.sa)) {
+			port = p->port;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&nfs_gp_cache_lock);
+	return port;
+}
+
+static void nfs_gp_cache_store(const struct sockaddr *sap,
+			       const socklen_t salen,
+			       const rpcprog_t program,
+			       const rpcvers_t version,
+			       const unsigned short protocol,
+			       const unsigned short port)
+{
+	struct nfs_gp_port *p;
+
+	pthread_mutex_lock(&nfs_gp_cache_lock);
+	p = &nfs_gp_ports[nfs_gp_next_port++ % NFS_GP_CACHE_PORTS];
+	nfs_gp_cache_key(&p->address, sap, salen);
+	p->program = program;
+	p->version = version;
+	p->protocol = protocol;
+	p->port = port;
+	p->expires = nfs_gp_now() + NFS_GP_CACHE_TTL;
+	pthread_mutex_unlock(&nfs_gp_cache_lock);
+}
+
+/*
+ * Take a kept rpcbind client for @sap and @transport, or create one.
+ * Clients kept past NFS_GP_CACHE_TTL are destroyed on the way.
+ *
+ * Returns the client, and sets @slot to its kept entry or to NULL if
+ * it is a fresh one; pass both to nfs_gp_put_rpcbclient() afterwards.
+ */
+static CLIENT *nfs_gp_take_rpcbclient(const struct sockaddr *sap,
+				      const socklen_t salen,
+				      const unsigned short transport,
+				      struct timeval *timeout,
+				      struct nfs_gp_client **slot)
+{
+	union nfs_sockaddr key, address;
+	time_t now = nfs_gp_now();
+	CLIENT *stale[NFS_GP_CACHE_CLIENTS], *client = NULL;
+	unsigned int i, nstale = 0;
+
+	nfs_gp_cache_key(&key, sap, salen);
+	*slot = NULL;
+	pthread_mutex_lock(&nfs_gp_cache_lock);
+	for (i = 0; i < NFS_GP_CACHE_CLIENTS; i++) {
+		struct nfs_gp_client *c = &nfs_gp_clients[i];
+
+		if (c->client == NULL || c->busy)
+			continue;
+		if (c->expires <= now) {
+			stale[nstale++] = c->client;
+			c->client = NULL;
+			continue;
+		}
+		if (client == NULL && c->transport == transport &&
+		    nfs_compare_sockaddr(&c->address.sa, &key.sa)) {
+			c->busy = 1;
+			client = c->client;
+			*timeout = c->timeout;
+			*slot = c;
+		}
+	}
+	pthread_mutex_unlock(&nfs_gp_cache_lock);
+
+	for (i = 0; i < nstale; i++)
+		CLNT_DESTROY(stale[i]);
+	if (client != NULL)
+		return client;
+
+	memcpy(&address, &key, sizeof(address));
+	return nfs_gp_get_rpcbclient(&address.sa, salen, transport,
+					default_rpcb_version, timeout);
+}
+
+/*
+ * Keep @client for the next query if @keep is set and there is room,
+ * otherwise destroy it.
+ */
+static void nfs_gp_put_rpcbclient(CLIENT *client, struct nfs_gp_client *slot,
+				  const struct sockaddr *sap,
+				  const socklen_t salen,
+				  const unsigned short transport,
+				  const struct timeval *timeout, int keep)
+{
+	unsigned int i;
+
+	pthread_mutex_lock(&nfs_gp_cache_lock);
+	if (slot != NULL) {
+		slot->busy = 0;
+		if (!keep)
+			slot->client = NULL;
+		else
+			client = NULL;
+	} else if (keep) {
+		for (i = 0; i < NFS_GP_CACHE_CLIENTS; i++) {
+			slot = &nfs_gp_clients[i];
+			if (slot->client != NULL)
+				continue;
+			nfs_gp_cache_key(&slot->address, sap, salen);
+			slot->transport = transport;
+			slot->client = client;
+			slot->timeout = *timeout;
+			slot->busy = 0;
+			slot->expires = nfs_gp_now() + NFS_GP_CACHE_TTL;
+			client = NULL;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&nfs_gp_cache_lock);
+
+	if (client != NULL)
+		CLNT_DESTROY(client);
+}
+
+/*
+ * Ask the rpcbind service at @sap, over @transport, for the port of
+ * [@program, @version, @protocol], using the cache and kept clients.
+ * A kept client whose connection has gone away is replaced once.
+ *
+ * Returns the port, or zero with rpc_createerr set.  @timeout is set
+ * to the timeout the query used.
+ */
+static unsigned short nfs_gp_cached_getport(const struct sockaddr *sap,
+					    const socklen_t salen,
+					    const rpcprog_t program,
+					    const rpcvers_t version,
+					    const unsigned short protocol,
+					    struct timeval *timeout)
+{
+	union nfs_sockaddr address;
+	struct sockaddr *saddr = &address.sa;
+	struct nfs_gp_client *slot;
+	unsigned short port;
+	CLIENT *client;
+	int retry;
+
+	nfs_clear_rpc_createerr();
+	port = nfs_gp_cache_lookup(sap, salen, program, version, protocol);
+	if (port != 0)
+		return port;
+
+	memcpy(saddr, sap, (size_t)salen);
+	nfs_set_port(saddr, ntohs(nfs_gp_get_rpcb_port(protocol)));
+	for (retry = 0; retry < 2; retry++) {
+		client = nfs_gp_take_rpcbclient(sap, salen, protocol,
+						timeout, &slot);
+		if (client == NULL)
+			return 0;
+		port = nfs_gp_getport(client, saddr, program, version,
+					protocol, *timeout);
+		nfs_gp_put_rpcbclient(client, slot, sap, salen, protocol,
+				timeout, port != 0 ||
+				rpc_createerr.cf_stat == RPC_PROGNOTREGISTERED);
+		if (port != 0 || slot == NULL ||
+		    (rpc_createerr.cf_stat != RPC_CANTSEND &&
+		     rpc_createerr.cf_stat != RPC_CANTRECV))
+			break;
+		nfs_clear_rpc_createerr();
+	}
+
+	if (port != 0)
+		nfs_gp_cache_store(sap, salen, program, version,
+					protocol, port);
+	return port;
+}
+
 /**
  * nfs_rpc_ping - Determine if RPC service is responding to requests
  * @sap: pointer to address of server to query (port is already filled in)
@@ -801,24 +1047,36 @@ unsigned short nfs_getport(const struct sockaddr *sap,
 			   const rpcvers_t version,
 			   const unsigned short protocol)
 {
-	union nfs_sockaddr address;
-	struct sockaddr *saddr = &address.sa;
 	struct timeval timeout = { -1, 0 };
-	unsigned short port = 0;
-	CLIENT *client;
 
-	nfs_clear_rpc_createerr();
+	return nfs_gp_cached_getport(sap, salen, program, version,
+					protocol, &timeout);
+}
 
-	memcpy(saddr, sap, (size_t)salen);
-	client = nfs_gp_get_rpcbclient(saddr, salen, protocol,
-						default_rpcb_version, &timeout);
-	if (client != NULL) {
-		port = nfs_gp_getport(client, saddr, program,
-					version, protocol, timeout);
-		CLNT_DESTROY(client);
-	}
+/**
+ * nfs_getport_timed - query server's rpcbind, waiting at most @timeout
+ * @sap: pointer to address of server to query
+ * @salen: length of server's address
+ * @program: requested RPC program number
+ * @version: requested RPC version number
+ * @protocol: IPPROTO_ value of requested transport protocol
+ * @timeout: pointer to request timeout
+ *
+ * The same as nfs_getport(), but each request to the server's rpcbind
+ * daemon, and connecting to it, is given @timeout rather than the
+ * default quick timeout.
+ */
+unsigned short nfs_getport_timed(const struct sockaddr *sap,
+				 const socklen_t salen,
+				 const rpcprog_t program,
+				 const rpcvers_t version,
+				 const unsigned short protocol,
+				 const struct timeval *timeout)
+{
+	struct timeval tout = *timeout;
 
-	return port;
+	return nfs_gp_cached_getport(sap, salen, program, version,
+					protocol, &tout);
 }
 
 /**
@@ -844,21 +1102,12 @@ int nfs_getport_ping(struct sockaddr *sap, const socklen_t salen,
 		     const unsigned short protocol)
 {
 	struct timeval timeout = { -1, 0 };
-	unsigned short port = 0;
+	unsigned short port;
 	CLIENT *client;
 	int result = 0;
-	
-	nfs_clear_rpc_createerr();
-
-	client = nfs_gp_get_rpcbclient(sap, salen, protocol,
-						default_rpcb_version, &timeout);
-	if (client != NULL) {
-		port = nfs_gp_getport(client, sap, program,
-					version, protocol, timeout);
-		CLNT_DESTROY(client);
-		client = NULL;
-	}
 
+	port = nfs_gp_cached_getport(sap, salen, program, version,
+					protocol, &timeout);
 	if (port != 0) {
 		union nfs_sockaddr address;
 		struct sockaddr *saddr = &address.sa;
@@ -0,0 +1,671 @@
+/*
+ * support/nfs/nfs_mountstats.c
+ *
+ * Parse /proc/self/mountstats, and write what was parsed as a
+ * binary snapshot that scripts can load without parsing text.
+ *
+ * The file is parsed in place with one pass over it, so that it
+ * stays quick with thousands of mounts: names point into the buffer
+ * the file was read into, and numbers are kept in a few arrays
+ * rather than one allocation for each mount.  Unless MS_PARSE_ALL is
+ * given, only the ops that have been used are kept.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+#include "nfs_mountstats.h"
+
+/* The snapshot starts with these, then a u32 version and mount count */
+#define MS_SNAPSHOT_MAGIC	"NFSMSNAP"
+#define MS_SNAPSHOT_VERSION	1
+
+static unsigned int
+ms_hash(const char *dev, const char *dir)
+{
+	unsigned int h = 2166136261u;
+
+	while (*dev)
+		h = (h ^ (unsigned char)*dev++) * 16777619u;
+	h = (h ^ ' ') * 16777619u;
+	while (*dir)
+		h = (h ^ (unsigned char)*dir++) * 16777619u;
+	return h;
+}
+
+/**
+ * ms_read - read all of a mountstats file
+ * @fd: open on the file; read from the start each time
+ * @s: sample to read into, reusing its buffer
+ *
+ * Returns 0 on success, 1 otherwise with errno set.
+ */
+int
+ms_read(int fd, struct ms_sample *s)
+{
+	size_t got = 0;
+	ssize_t len;
+
+	for (;;) {
+		if (got + 1 >= s->buflen) {
+			size_t newlen = s->buflen ? s->buflen * 2 : 65536;
+			char *newbuf = realloc(s->buf, newlen);
+
+			if (newbuf == NULL)
+				return 1;
+			s->buf = newbuf;
+			s->buflen = newlen;
+		}
+		len = pread(fd, s->buf + got, s->buflen - got - 1, got);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			return 1;
+		}
+		if (len == 0)
+			break;
+		got += len;
+	}
+	s->buf[got] = '\0';
+	s->len = got;
+	return 0;
+}
+
+static char *
+ms_token(char **p)
+{
+	char *tok = *p, *end;
+
+	while (*tok == ' ' || *tok == '\t')
+		tok++;
+	if (*tok == '\0')
+		return NULL;
+	end = tok + strcspn(tok, " \t");
+	if (*end) {
+		*end = '\0';
+		*p = end + 1;
+	} else
+		*p = end;
+	return tok;
+}
+
+/* The rest of a line, without the blanks around it */
+static const char *
+ms_rest(char *p)
+{
+	char *end;
+
+	while (*p == ' ' || *p == '\t')
+		p++;
+	end = p + strlen(p);
+	while (end > p && (end[-1] == ' ' || end[-1] == '\t'))
+		*--end = '\0';
+	return p;
+}
+
+/*
+ * "device DEV mounted on DIR with fstype TYPE statvers=1.1"
+ *
+ * Returns the index of the new mount, or -1 if this is not an NFS
+ * mount with statistics.
+ */
+static int
+ms_parse_device(struct ms_sample *s, char *p)
+{
+	char *dev, *dir, *type, *vers;
+	struct ms_mount *m;
+
+	if (!(dev = ms_token(&p)) || !ms_token(&p) || !ms_token(&p) ||
+	    !(dir = ms_token(&p)) || !ms_token(&p) || !ms_token(&p) ||
+	    !(type = ms_token(&p)) || !(vers = ms_token(&p)))
+		return -1;
+	if (strncmp(type, "nfs", 3) || !strcmp(type, "nfsd") ||
+	    strncmp(vers, "statvers=", 9))
+		return -1;
+
+	if (s->nmounts == s->maxmounts) {
+		unsigned int newmax = s->maxmounts ? s->maxmounts * 2 : 64;
+		struct ms_mount *new = realloc(s->mounts,
+						newmax * sizeof(*new));
+
+		if (new == NULL)
+			return -1;
+		s->mounts = new;
+		s->maxmounts = newmax;
+	}
+	m = &s->mounts[s->nmounts];
+	memset(m, 0, sizeof(*m));
+	m->dev = dev;
+	m->dir = dir;
+	m->fstype = type;
+	m->statvers = vers;
+	m->addr = m->proto = "";
+	m->opts = m->caps = m->nfsv4 = m->sec = "";
+	m->rpcvers = m->progvers = "";
+	m->firstop = s->nops;
+	m->hash = ms_hash(dev, dir);
+	return s->nmounts++;
+}
+
+/* strtoull() is most of the time spent parsing; the kernel prints plain decimal */
+static int
+ms_number(char **p, unsigned long long *val)
+{
+	char *c = *p;
+	unsigned long long v = 0;
+
+	while (*c == ' ' || *c == '\t')
+		c++;
+	if (*c < '0' || *c > '9')
+		return 0;
+	do
+		v = v * 10 + (unsigned long long)(*c++ - '0');
+	while (*c >= '0' && *c <= '9');
+	*val = v;
+	*p = c;
+	return 1;
+}
+
+/* Keep all the numbers at 'p' in s->vals; returns 0, or 1 if out of memory */
+static int
+ms_parse_vals(struct ms_sample *s, char *p, struct ms_vals *vals)
+{
+	unsigned long long v;
+
+	vals->first = s->nvals;
+	vals->n = 0;
+	while (ms_number(&p, &v)) {
+		if (s->nvals == s->maxvals) {
+			size_t newmax = s->maxvals ? s->maxvals * 2 : 4096;
+			unsigned long long *new;
+
+			new = realloc(s->vals, newmax * sizeof(*new));
+			if (new == NULL)
+				return 1;
+			s->vals = new;
+			s->maxvals = newmax;
+		}
+		s->vals[s->nvals++] = v;
+		vals->n++;
+	}
+	return 0;
+}
+
+/*
+ * "READ: 1 1 0 128 4224 0 1 1 0", with 'p' past the indent
+ *
+ * Returns 0 if this is an op line, 1 otherwise.  Unless all ops are
+ * wanted, those never used are given up on after the first number.
+ */
+static int
+ms_parse_op(struct ms_sample *s, struct ms_mount *m, char *p, int flags)
+{
+	char *colon = p, *end;
+	unsigned long long v[MS_NFIELDS] = { 0 };
+	struct ms_op *op;
+	int i;
+
+	while (*colon != ':' && *colon != '\n' && *colon != '\0')
+		colon++;
+	if (*colon != ':' || colon == p)
+		return 1;
+	*colon = '\0';
+	end = colon + 1;
+	if (!ms_number(&end, &v[0]))
+		return 1;
+	if (v[MS_OPS] == 0 && !(flags & MS_PARSE_ALL))
+		return 0;
+	for (i = 1; i < MS_NFIELDS; i++)
+		if (!ms_number(&end, &v[i]))
+			break;
+
+	if (s->nops == s->maxops) {
+		size_t newmax = s->maxops ? s->maxops * 2 : 1024;
+		struct ms_op *new = realloc(s->ops, newmax * sizeof(*new));
+
+		if (new == NULL)
+			return 0;
+		s->ops = new;
+		s->maxops = newmax;
+	}
+	op = &s->ops[s->nops++];
+	op->name = p;
+	op->n = i;
+	memcpy(op->v, v, sizeof(v));
+	m->nops++;
+	return 0;
+}
+
+/*
+ * "opts:\trw,vers=4.2,...,addr=192.0.2.1,..." with 'p' past the
+ * "opts:", and the end of the line made the end of the string.
+ * Only with MS_PARSE_ALL is the line kept, whole.
+ */
+static void
+ms_parse_opts(struct ms_mount *m, char *p, int flags)
+{
+	char *addr = strstr(p, ",addr="), *end;
+
+	if (flags & MS_PARSE_ALL) {
+		m->opts = ms_rest(p);
+		return;
+	}
+	if (addr == NULL)
+		return;
+	addr += 6;
+	end = addr + strcspn(addr, ",");
+	*end = '\0';
+	m->addr = addr;
+}
+
+/*
+ * "xprt:\ttcp 875 1 1 0 0 100 100 0 100 0 2 0 0" with 'p' past the
+ * "xprt:".  With nconnect there is a line for each connection, and
+ * their counters are added up.
+ */
+static void
+ms_parse_xprt(struct ms_sample *s, struct ms_mount *m, char *p, int flags)
+{
+	unsigned long long v[10] = { 0 };
+	const char *proto;
+	char *q;
+	int i, n, udp;
+
+	while (*p == ' ' || *p == '\t')
+		p++;
+	proto = p;
+	while (*p != ' ' && *p != '\t' && *p != '\n' && *p != '\0')
+		p++;
+	if (p == proto || (*p != ' ' && *p != '\t'))
+		return;
+	*p++ = '\0';
+	if (flags & MS_PARSE_ALL)
+		ms_parse_vals(s, p, &m->xprt);
+	for (q = p, n = 0; n < 10; n++)
+		if (!ms_number(&q, &v[n]))
+			break;
+
+	/* UDP has no connect_count, connect_time or idle_time */
+	udp = !strcmp(proto, "udp");
+	if (n < (udp ? 7 : 10))
+		return;
+	i = udp ? 2 : 5;
+	if (!m->proto[0]) {
+		m->proto = proto;
+		m->port = v[0];
+	}
+	m->x[MS_XSENDS] += v[i];
+	m->x[MS_XRECVS] += v[i + 1];
+	m->x[MS_XBADXIDS] += v[i + 2];
+	m->x[MS_XINFLIGHT] += v[i + 3];
+	m->x[MS_XBACKLOG] += v[i + 4];
+}
+
+/* "RPC iostats version: 1.1  p/v: 100003/4 (nfs)", past the "RPC" */
+static void
+ms_parse_rpc(struct ms_mount *m, char *p)
+{
+	char *vers, *tag;
+
+	if (!ms_token(&p) || !ms_token(&p) || !(vers = ms_token(&p)))
+		return;
+	m->rpcvers = vers;
+	if ((tag = ms_token(&p)) && !strcmp(tag, "p/v:") &&
+	    (vers = ms_token(&p)))
+		m->progvers = vers;
+}
+
+/* The lines before the per-op ones, which only MS_PARSE_ALL wants */
+static void
+ms_parse_line(struct ms_sample *s, struct ms_mount *m, char *p)
+{
+	char *v = p + 4;
+
+	if (!strncmp(p, "age:", 4))
+		ms_number(&v, &m->age);
+	else if (!strncmp(p, "caps:", 5))
+		m->caps = ms_rest(p + 5);
+	else if (!strncmp(p, "nfsv4:", 6))
+		m->nfsv4 = ms_rest(p + 6);
+	else if (!strncmp(p, "sec:", 4))
+		m->sec = ms_rest(p + 4);
+	else if (!strncmp(p, "events:", 7))
+		ms_parse_vals(s, p + 7, &m->events);
+	else if (!strncmp(p, "bytes:", 6))
+		ms_parse_vals(s, p + 6, &m->bytes);
+	else if (!strncmp(p, "RPC ", 4))
+		ms_parse_rpc(m, p + 4);
+}
+
+static int
+ms_hash_mounts(struct ms_sample *s)
+{
+	unsigned int i, n = 64;
+
+	while (n < s->nmounts * 2)
+		n <<= 1;
+	if (n != s->nbuckets) {
+		int *new = realloc(s->buckets, n * sizeof(*new));
+
+		if (new == NULL)
+			return 1;
+		s->buckets = new;
+		s->nbuckets = n;
+	}
+	for (i = 0; i < n; i++)
+		s->buckets[i] = -1;
+	for (i = 0; i < s->nmounts; i++) {
+		unsigned int b = s->mounts[i].hash & (n - 1);
+
+		s->mounts[i].hnext = s->buckets[b];
+		s->buckets[b] = i;
+	}
+	return 0;
+}
+
+/**
+ * ms_parse - parse what ms_read() read
+ * @s: sample to parse, in place
+ * @flags: MS_PARSE_ALL to keep every line of each mount
+ *
+ * Only NFS mounts are kept.  Returns 0 on success, 1 otherwise.
+ */
+int
+ms_parse(struct ms_sample *s, int flags)
+{
+	char *p, *next, *end = s->buf + s->len;
+	int cur = -1, inops = 0;
+
+	s->nmounts = 0;
+	s->nops = 0;
+	s->nvals = 0;
+	for (p = s->buf; p < end; p = next) {
+		/*
+		 * Find the end of the line before working on it, as
+		 * working on it may write NULs into it.
+		 */
+		next = memchr(p, '\n', end - p);
+		next = next ? next + 1 : end;
+
+		if (*p == 'd' && !strncmp(p, "device ", 7)) {
+			next[-1] = '\0';
+			cur = ms_parse_device(s, p + 7);
+			inops = 0;
+			continue;
+		}
+		if (cur < 0)
+			continue;
+		while (*p == ' ' || *p == '\t')
+			p++;
+		if (!inops) {
+			if (!strncmp(p, "per-op statistics\n", 18)) {
+				inops = 1;
+				continue;
+			}
+			if (next[-1] == '\n' &&
+			    ((flags & MS_PARSE_ALL) || !strncmp(p, "opts:", 5)))
+				next[-1] = '\0';
+			if (!strncmp(p, "opts:", 5))
+				ms_parse_opts(&s->mounts[cur], p + 5, flags);
+			else if (!strncmp(p, "xprt:", 5))
+				ms_parse_xprt(s, &s->mounts[cur], p + 5, flags);
+			else if (flags & MS_PARSE_ALL)
+				ms_parse_line(s, &s->mounts[cur], p);
+			continue;
+		}
+		if (ms_parse_op(s, &s->mounts[cur], p, flags))
+			inops = 0;
+	}
+	return ms_hash_mounts(s);
+}
+
+/**
+ * ms_free - release what a sample holds
+ * @s: sample to release; it can be read into again
+ */
+void
+ms_free(struct ms_sample *s)
+{
+	free(s->buf);
+	free(s->mounts);
+	free(s->ops);
+	free(s->vals);
+	free(s->buckets);
+	memset(s, 0, sizeof(*s));
+}
+
+/**
+ * ms_find_mount - find a mount of one sample in another
+ * @s: sample to look in
+ * @m: mount of another sample
+ *
+ * Returns the mount of @s with the same device and directory, or NULL.
+ */
+const struct ms_mount *
+ms_find_mount(const struct ms_sample *s, const struct ms_mount *m)
+{
+	int i;
+
+	if (s->nbuckets == 0)
+		return NULL;
+	for (i = s->buckets[m->hash & (s->nbuckets - 1)]; i >= 0;
+	     i = s->mounts[i].hnext) {
+		const struct ms_mount *om = &s->mounts[i];
+
+		if (om->hash == m->hash && !strcmp(om->dir, m->dir) &&
+		    !strcmp(om->dev, m->dev))
+			return om;
+	}
+	return NULL;
+}
+
+/**
+ * ms_find_op - find an op of a mount by name
+ * @s: sample that @m is in
+ * @m: mount to look in
+ * @name: op such as "READ"
+ *
+ * Returns the op, or NULL if the mount has none by that name.
+ */
+const struct ms_op *
+ms_find_op(const struct ms_sample *s, const struct ms_mount *m,
+		const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < m->nops; i++)
+		if (!strcmp(s->ops[m->firstop + i].name, name))
+			return &s->ops[m->firstop + i];
+	return NULL;
+}
+
+/* A u16 length, then the bytes */
+static void
+ms_put_str(FILE *f, const char *str)
+{
+	size_t len = strlen(str);
+	uint16_t n = len > UINT16_MAX ? UINT16_MAX : len;
+
+	fwrite(&n, sizeof(n), 1, f);
+	fwrite(str, 1, n, f);
+}
+
+/*
+ * A u8 count and a u8 width, then the values: none if they are all
+ * zero, as is most of every mount's ops, else u32s if they fit.
+ */
+static void
+ms_put_vals(FILE *f, const unsigned long long *vals, unsigned int count)
+{
+	uint8_t hdr[2] = { count > UINT8_MAX ? UINT8_MAX : count, 0 };
+	unsigned int i;
+
+	for (i = 0; i < hdr[0]; i++) {
+		if (vals[i] > UINT32_MAX) {
+			hdr[1] = sizeof(uint64_t);
+			break;
+		}
+		if (vals[i])
+			hdr[1] = sizeof(uint32_t);
+	}
+	fwrite(hdr, sizeof(hdr), 1, f);
+	for (i = 0; hdr[1] && i < hdr[0]; i++) {
+		uint64_t v64 = vals[i];
+		uint32_t v32 = vals[i];
+
+		if (hdr[1] == sizeof(v64))
+			fwrite(&v64, sizeof(v64), 1, f);
+		else
+			fwrite(&v32, sizeof(v32), 1, f);
+	}
+}
+
+/*
+ * The numbers of all the ops of a mount, as one block so that they
+ * can be loaded at once: a u8 count of numbers for each op and a u8
+ * width as for ms_put_vals(), then the numbers of each op in turn.  An op
+ * with fewer numbers than the others has zeros added.
+ */
+static void
+ms_put_ops(FILE *f, const struct ms_op *ops, unsigned int nops)
+{
+	uint8_t hdr[2] = { 0, 0 };
+	unsigned int i, k;
+
+	for (i = 0; i < nops; i++) {
+		if (ops[i].n > hdr[0])
+			hdr[0] = ops[i].n;
+		for (k = 0; k < ops[i].n; k++) {
+			if (ops[i].v[k] > UINT32_MAX)
+				hdr[1] = sizeof(uint64_t);
+			else if (ops[i].v[k] && !hdr[1])
+				hdr[1] = sizeof(uint32_t);
+		}
+	}
+	fwrite(hdr, sizeof(hdr), 1, f);
+	for (i = 0; hdr[1] && i < nops; i++)
+		for (k = 0; k < hdr[0]; k++) {
+			uint64_t v64 = k < ops[i].n ? ops[i].v[k] : 0;
+			uint32_t v32 = v64;
+
+			if (hdr[1] == sizeof(v64))
+				fwrite(&v64, sizeof(v64), 1, f);
+			else
+				fwrite(&v32, sizeof(v32), 1, f);
+		}
+}
+
+/*
+ * Every mount has much the same ops in the same order, so the
+ * snapshot stores their names once; returns the index of the op name.
+ */
+static int
+ms_op_name(const char **names, unsigned int *nnames, unsigned int hint,
+		const char *name)
+{
+	unsigned int i;
+
+	if (hint < *nnames && !strcmp(names[hint], name))
+		return hint;
+	for (i = 0; i < *nnames; i++)
+		if (!strcmp(names[i], name))
+			return i;
+	if (*nnames == UINT16_MAX)
+		return -1;
+	names[(*nnames)++] = name;
+	return i;
+}
+
+/**
+ * ms_write_snapshot - write a sample parsed with MS_PARSE_ALL
+ * @f: where to write it
+ * @s: the sample
+ *
+ * The snapshot is in host byte order: the magic, a u32 version, a
+ * u32 count of op names and the names, then a u32 mount count.
+ * Each mount has these strings: dev, dir, fstype, statvers, opts,
+ * caps, nfsv4, sec, RPC iostats version, program/version and xprt
+ * protocol; a u64 age; the events, bytes and last xprt numbers; a
+ * u32 op count, a u16 name index for each op, and their numbers.
+ *
+ * Returns 0 on success, or -1 with errno set.
+ */
+int
+ms_write_snapshot(FILE *f, const struct ms_sample *s)
+{
+	uint32_t hdr[2] = { MS_SNAPSHOT_VERSION, 0 };
+	unsigned int i, j, nnames = 0;
+	const char **names;
+	uint16_t *index;
+
+	names = malloc(UINT16_MAX * sizeof(*names));
+	index = malloc((s->nops ? s->nops : 1) * sizeof(*index));
+	if (names == NULL || index == NULL) {
+		free(names);
+		free(index);
+		errno = ENOMEM;
+		return -1;
+	}
+	for (i = 0; i < s->nmounts; i++) {
+		const struct ms_mount *m = &s->mounts[i];
+
+		for (j = 0; j < m->nops; j++) {
+			size_t k = m->firstop + j;
+			int n = ms_op_name(names, &nnames, j, s->ops[k].name);
+
+			if (n < 0) {
+				free(names);
+				free(index);
+				errno = E2BIG;
+				return -1;
+			}
+			index[k] = n;
+		}
+	}
+
+	fwrite(MS_SNAPSHOT_MAGIC, 1, 8, f);
+	hdr[1] = nnames;
+	fwrite(hdr, sizeof(hdr), 1, f);
+	for (i = 0; i < nnames; i++)
+		ms_put_str(f, names[i]);
+	hdr[0] = s->nmounts;
+	fwrite(hdr, sizeof(hdr[0]), 1, f);
+
+	for (i = 0; i < s->nmounts; i++) {
+		const struct ms_mount *m = &s->mounts[i];
+		uint64_t age = m->age;
+		uint32_t nops = m->nops;
+
+		ms_put_str(f, m->dev);
+		ms_put_str(f, m->dir);
+		ms_put_str(f, m->fstype);
+		ms_put_str(f, m->statvers);
+		ms_put_str(f, m->opts);
+		ms_put_str(f, m->caps);
+		ms_put_str(f, m->nfsv4);
+		ms_put_str(f, m->sec);
+		ms_put_str(f, m->rpcvers);
+		ms_put_str(f, m->progvers);
+		ms_put_str(f, m->proto);
+		fwrite(&age, sizeof(age), 1, f);
+		ms_put_vals(f, s->vals + m->events.first, m->events.n);
+		ms_put_vals(f, s->vals + m->bytes.first, m->bytes.n);
+		ms_put_vals(f, s->vals + m->xprt.first, m->xprt.n);
+		fwrite(&nops, sizeof(nops), 1, f);
+		fwrite(&index[m->firstop], sizeof(uint16_t), m->nops, f);
+		ms_put_ops(f, &s->ops[m->firstop], m->nops);
+	}
+	free(names);
+	free(index);
+	if (fflush(f) != 0 || ferror(f))
+		return -1;
+	return 0;
+}
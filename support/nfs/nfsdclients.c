@@ -0,0 +1,238 @@
+/*
+ * support/nfs/nfsdclients.c
+ *
+ * Parse the info and states files in each /proc/fs/nfsd/clients
+ * directory.  Both are read relative to a directory fd, so that a
+ * caller going through many clients resolves each path only once.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "nfsdclients.h"
+
+static char *dup_value(const char *val)
+{
+	size_t len = strcspn(val, "\n");
+
+	while (len > 0 && isspace((unsigned char)val[len - 1]))
+		len--;
+	return strndup(val, len);
+}
+
+/*
+ * Read a client's info file.  Returns 0, or -1 with errno set if it
+ * cannot be read.  Lines past the first 4k are ignored.
+ */
+int nfsd_client_read_info(int dirfd, const char *pathname,
+			  struct nfsd_client_info *info)
+{
+	char buf[4096];
+	char *line, *next;
+	ssize_t len = 0, n;
+	int fd;
+
+	memset(info, 0, sizeof(*info));
+	info->ci_minorversion = -1;
+
+	fd = openat(dirfd, pathname, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	while (len < (ssize_t)sizeof(buf) - 1 &&
+	       (n = read(fd, buf + len, sizeof(buf) - 1 - len)) > 0)
+		len += n;
+	close(fd);
+	buf[len] = '\0';
+
+	for (line = buf; *line; line = next) {
+		next = strchr(line, '\n');
+		next = next ? next + 1 : line + strlen(line);
+		if (strncmp(line, "clientid: ", 10) == 0) {
+			free(info->ci_clientid);
+			info->ci_clientid = dup_value(line + 10);
+		} else if (strncmp(line, "address: ", 9) == 0) {
+			free(info->ci_address);
+			info->ci_address = dup_value(line + 9);
+		} else if (strncmp(line, "name: ", 6) == 0) {
+			free(info->ci_name);
+			info->ci_name = dup_value(line + 6);
+		} else if (strncmp(line, "minor version: ", 15) == 0)
+			info->ci_minorversion = atoi(line + 15);
+		else if (strncmp(line, "status: ", 8) == 0) {
+			/* buf holds the whole file, so don't search past the line */
+			if (strncmp(line + 8, "unconfirmed", 11) == 0)
+				info->ci_status = NFSD_CLIENT_UNCONFIRMED;
+			else if (strncmp(line + 8, "confirmed", 9) == 0)
+				info->ci_status = NFSD_CLIENT_CONFIRMED;
+		}
+	}
+	return 0;
+}
+
+void nfsd_client_free_info(struct nfsd_client_info *info)
+{
+	free(info->ci_clientid);
+	free(info->ci_address);
+	free(info->ci_name);
+	memset(info, 0, sizeof(*info));
+	info->ci_minorversion = -1;
+}
+
+static int hexval(int c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	c = tolower(c);
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	return -1;
+}
+
+/*
+ * Unquote, in place, the string starting at the quote *pp points to,
+ * leaving *pp just past the closing quote.
+ */
+static char *unquote(char **pp)
+{
+	char *p = *pp + 1, *val = p, *out = p;
+	int c, i, d;
+
+	while (*p && *p != '"' && *p != '\n') {
+		if (*p != '\\' || !p[1]) {
+			*out++ = *p++;
+			continue;
+		}
+		p++;
+		switch (*p) {
+		case 'x':
+			for (c = 0, i = 0, p++;
+			     i < 2 && (d = hexval(*p)) >= 0; i++, p++)
+				c = c * 16 + d;
+			*out++ = c;
+			continue;
+		case '0': case '1': case '2': case '3':
+		case '4': case '5': case '6': case '7':
+			for (c = 0, i = 0; i < 3 && *p >= '0' && *p <= '7';
+			     i++, p++)
+				c = c * 8 + *p - '0';
+			*out++ = c;
+			continue;
+		case 'n':
+			c = '\n';
+			break;
+		case 't':
+			c = '\t';
+			break;
+		case 'r':
+			c = '\r';
+			break;
+		default:
+			c = *p;
+		}
+		*out++ = c;
+		p++;
+	}
+	if (*p == '"')
+		p++;
+	*out = '\0';
+	*pp = p;
+	return val;
+}
+
+static int parse_state(char *line, struct nfsd_client_state *st)
+{
+	char *p, *key, *val, *end;
+	char c;
+
+	memset(st, 0, sizeof(*st));
+	if (strncmp(line, "- ", 2) != 0)
+		return -1;
+	p = strchr(line, '{');
+	if (!p)
+		return -1;
+	for (end = p; end > line + 2 && (end[-1] == ' ' || end[-1] == ':');)
+		end--;
+	*end = '\0';
+	st->cs_id = line + 2;
+
+	p++;
+	for (;;) {
+		p += strspn(p, " \t");
+		key = p;
+		p += strcspn(p, ":,}\n");
+		if (*p != ':')
+			break;
+		*p++ = '\0';
+		p += strspn(p, " \t");
+		if (*p == '"') {
+			val = unquote(&p);
+			p += strspn(p, " \t");
+			end = NULL;
+		} else {
+			val = p;
+			p += strcspn(p, ",}\n");
+			for (end = p; end > val && end[-1] == ' '; end--)
+				;
+		}
+		c = *p;
+		if (c)
+			p++;
+		if (end)
+			*end = '\0';
+
+		if (strcmp(key, "type") == 0)
+			st->cs_type = val;
+		else if (strcmp(key, "access") == 0)
+			st->cs_access = val;
+		else if (strcmp(key, "deny") == 0)
+			st->cs_deny = val;
+		else if (strcmp(key, "superblock") == 0)
+			st->cs_superblock = val;
+		else if (strcmp(key, "owner") == 0)
+			st->cs_owner = val;
+		else if (strcmp(key, "filename") == 0)
+			st->cs_filename = val;
+		if (c != ',')
+			break;
+	}
+	return 0;
+}
+
+/*
+ * Call fn for each state in a client's states file, in the order
+ * they are listed.  Returns 0, or -1 with errno set if it cannot be
+ * read.  Lines that are not states are skipped.
+ */
+int nfsd_client_read_states(int dirfd, const char *pathname,
+			    nfsd_client_state_fn fn, void *arg)
+{
+	struct nfsd_client_state st;
+	char *line = NULL;
+	size_t size = 0;
+	FILE *fp;
+	int fd;
+
+	fd = openat(dirfd, pathname, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	fp = fdopen(fd, "r");
+	if (!fp) {
+		close(fd);
+		return -1;
+	}
+	while (getline(&line, &size, fp) > 0)
+		if (parse_state(line, &st) == 0)
+			fn(&st, arg);
+	free(line);
+	fclose(fp);
+	return 0;
+}
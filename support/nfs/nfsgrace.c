@@ -0,0 +1,659 @@
+/*
+ * support/nfs/nfsgrace.c
+ *
+ * Progress of the clients reclaiming their state through a grace period.
+ *
+ * At the start of a grace period the daemon names each client it
+ * expects back with nfsgrace_expect(), and as they return, it calls
+ * nfsgrace_reclaim().  Each client is kept in a hash table by its
+ * opaque identity, so that one that reclaims twice counts once.  When
+ * the grace period is over, nfsgrace_end() logs how long it lasted and
+ * which clients never came back.
+ *
+ * Along the way the progress is written to NFSMETRICS_DIR/<service>.grace:
+ *
+ *	# nfsgrace <service> <pid> start=<unix time>
+ *	state grace|over
+ *	lifted 0|1
+ *	expected <clients>
+ *	reclaimed <clients>
+ *	unexpected <clients that reclaimed but were not expected>
+ *	elapsed_ms <ms>
+ *	event <ms> start|adopt|progress|complete|lift|end <reclaimed>
+ *	...
+ *	waiting <client>
+ *	...
+ *
+ * with a "progress" event as each tenth of the expected clients is
+ * reached.  Clients are written as printable text, other bytes as \xNN.
+ * A daemon that shares the grace period, as rpc.statd does with the
+ * list sm-notify publishes, takes it over with nfsgrace_adopt().
+ *
+ * The file is opened once, by nfsgrace_open(), so that a daemon can
+ * keep writing it after it drops its privileges.  The kernel's file
+ * for ending the grace period is opened then too, for the same reason.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "nfsgrace.h"
+#include "xlog.h"
+
+#define NFSGRACE_HASH_INIT	256
+#define NFSGRACE_EVENTS		32
+#define NFSGRACE_LOG_WAITING	8
+#define NFSGRACE_MAX_FILE	(64 << 20)
+
+struct nfsgrace_client {
+	struct nfsgrace_client	*gc_next;
+	uint32_t		gc_hash;
+	unsigned int		gc_len;
+	int			gc_reclaimed;
+	unsigned char		gc_id[];
+};
+
+struct nfsgrace_event {
+	unsigned long		ge_ms;
+	const char		*ge_what;
+	unsigned int		ge_reclaimed;
+};
+
+static const char *nfsgrace_whats[] = {
+	"start", "adopt", "progress", "complete", "lift", "end",
+};
+
+static char			grace_service[32];
+static char			grace_endfile[PATH_MAX];
+static int			grace_fd = -1, grace_endfd = -1;
+static struct timespec		grace_mtime;	/* of our last write */
+
+static int			grace_active, grace_lifted;
+static time_t			grace_start_real;
+static unsigned long long	grace_start, grace_end, grace_published;
+static unsigned int		grace_expected, grace_reclaimed;
+static unsigned int		grace_unexpected, grace_tenth;
+
+static struct nfsgrace_client	**grace_table;
+static unsigned int		grace_size, grace_count;
+
+static struct nfsgrace_event	grace_events[NFSGRACE_EVENTS];
+static unsigned int		grace_nevents;
+
+/* FNV-1a */
+static uint32_t
+nfsgrace_hash(const unsigned char *id, size_t len)
+{
+	uint32_t hash = 2166136261u;
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		hash = (hash ^ id[i]) * 16777619u;
+	return hash;
+}
+
+static struct nfsgrace_client *
+nfsgrace_find(const unsigned char *id, size_t len)
+{
+	uint32_t hash = nfsgrace_hash(id, len);
+	struct nfsgrace_client *gc;
+
+	if (grace_size == 0)
+		return NULL;
+	gc = grace_table[hash & (grace_size - 1)];
+	for (; gc; gc = gc->gc_next)
+		if (gc->gc_hash == hash && gc->gc_len == len &&
+		    memcmp(gc->gc_id, id, len) == 0)
+			return gc;
+	return NULL;
+}
+
+static int
+nfsgrace_grow(void)
+{
+	unsigned int size = grace_size ? grace_size * 2 : NFSGRACE_HASH_INIT;
+	struct nfsgrace_client **table, *gc, *next;
+	unsigned int i;
+
+	table = calloc(size, sizeof(*table));
+	if (table == NULL)
+		return -1;
+	for (i = 0; i < grace_size; i++)
+		for (gc = grace_table[i]; gc; gc = next) {
+			next = gc->gc_next;
+			gc->gc_next = table[gc->gc_hash & (size - 1)];
+			table[gc->gc_hash & (size - 1)] = gc;
+		}
+	free(grace_table);
+	grace_table = table;
+	grace_size = size;
+	return 0;
+}
+
+static void
+nfsgrace_forget(void)
+{
+	struct nfsgrace_client *gc, *next;
+	unsigned int i;
+
+	for (i = 0; i < grace_size; i++)
+		for (gc = grace_table[i]; gc; gc = next) {
+			next = gc->gc_next;
+			free(gc);
+		}
+	free(grace_table);
+	grace_table = NULL;
+	grace_size = grace_count = 0;
+}
+
+static void
+nfsgrace_event(const char *what)
+{
+	if (grace_nevents == NFSGRACE_EVENTS)
+		return;
+	grace_events[grace_nevents].ge_ms = nfsgrace_elapsed();
+	grace_events[grace_nevents].ge_what = what;
+	grace_events[grace_nevents].ge_reclaimed = grace_reclaimed;
+	grace_nevents++;
+}
+
+static void
+nfsgrace_reset(void)
+{
+	nfsgrace_forget();
+	grace_active = 1;
+	grace_lifted = 0;
+	grace_start_real = time(NULL);
+	grace_start = nfsmetric_clock();
+	grace_end = grace_published = 0;
+	grace_expected = grace_reclaimed = 0;
+	grace_unexpected = grace_tenth = 0;
+	grace_nevents = 0;
+}
+
+/* Write @id as printable text, other bytes as \xNN */
+static void
+nfsgrace_print_id(FILE *fp, const unsigned char *id, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		if (id[i] > ' ' && id[i] < 0x7f && id[i] != '\\')
+			fputc(id[i], fp);
+		else
+			fprintf(fp, "\\x%02x", id[i]);
+	}
+}
+
+/* Undo nfsgrace_print_id() in place; returns the length */
+static size_t
+nfsgrace_parse_id(char *s)
+{
+	unsigned char *out = (unsigned char *)s;
+	unsigned int c;
+	size_t len = 0;
+
+	while (*s) {
+		if (s[0] == '\\' && s[1] == 'x' &&
+		    sscanf(s + 2, "%2x", &c) == 1) {
+			out[len++] = c;
+			s += 4;
+		} else
+			out[len++] = *s++;
+	}
+	return len;
+}
+
+static const char *
+nfsgrace_what(const char *what)
+{
+	unsigned int i;
+
+	for (i = 0; i < sizeof(nfsgrace_whats) / sizeof(nfsgrace_whats[0]); i++)
+		if (strcmp(what, nfsgrace_whats[i]) == 0)
+			return nfsgrace_whats[i];
+	return NULL;
+}
+
+/**
+ * nfsgrace_open - say where to publish the progress of grace periods
+ * @service: name of the file in NFSMETRICS_DIR
+ * @endfile: the kernel's file for ending its grace period
+ *
+ * Call it while the daemon can still open both files.  Returns zero,
+ * or -1 if the progress cannot be published; it is tracked and logged
+ * all the same.
+ */
+int
+nfsgrace_open(const char *service, const char *endfile)
+{
+	char path[PATH_MAX];
+
+	nfsgrace_close();
+	strncpy(grace_service, service, sizeof(grace_service) - 1);
+	strncpy(grace_endfile, endfile, sizeof(grace_endfile) - 1);
+
+	grace_endfd = open(endfile, O_RDWR | O_CLOEXEC);
+	if (grace_endfd < 0 && errno != ENOENT)
+		xlog(L_WARNING, "Unable to open %s: %m", endfile);
+
+	if (mkdir(NFSMETRICS_DIR, 0755) < 0 && errno != EEXIST) {
+		xlog(L_WARNING, "Unable to create %s: %m", NFSMETRICS_DIR);
+		return -1;
+	}
+	if ((size_t)snprintf(path, sizeof(path), "%s/%s%s", NFSMETRICS_DIR,
+			service, NFSGRACE_SUFFIX) >= sizeof(path))
+		return -1;
+	grace_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (grace_fd < 0) {
+		xlog(L_WARNING, "Unable to open %s: %m", path);
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * nfsgrace_close - stop publishing, and forget the grace period
+ *
+ * The file is left as it is, for a daemon that takes the grace period
+ * over, or for the administrator.
+ */
+void
+nfsgrace_close(void)
+{
+	if (grace_fd >= 0)
+		close(grace_fd);
+	if (grace_endfd >= 0)
+		close(grace_endfd);
+	grace_fd = grace_endfd = -1;
+	grace_active = 0;
+	nfsgrace_forget();
+}
+
+/**
+ * nfsgrace_start - a grace period has started
+ *
+ * Forgets any earlier one.  Name the clients expected to reclaim with
+ * nfsgrace_expect(), then call nfsgrace_publish().
+ */
+void
+nfsgrace_start(void)
+{
+	nfsgrace_reset();
+	nfsgrace_event("start");
+}
+
+/**
+ * nfsgrace_expect - a client is expected to reclaim its state
+ * @id: the client's identity, as it will be given to nfsgrace_reclaim()
+ * @len: its length in bytes
+ */
+void
+nfsgrace_expect(const void *id, size_t len)
+{
+	struct nfsgrace_client *gc, **head;
+
+	if (!grace_active || nfsgrace_find(id, len))
+		return;
+	if (grace_count >= grace_size && nfsgrace_grow() < 0)
+		return;
+	gc = malloc(sizeof(*gc) + len);
+	if (gc == NULL)
+		return;
+	gc->gc_hash = nfsgrace_hash(id, len);
+	gc->gc_len = len;
+	gc->gc_reclaimed = 0;
+	memcpy(gc->gc_id, id, len);
+
+	head = &grace_table[gc->gc_hash & (grace_size - 1)];
+	gc->gc_next = *head;
+	*head = gc;
+	grace_count++;
+	grace_expected++;
+}
+
+/**
+ * nfsgrace_reclaim - a client has reclaimed its state
+ * @id: the client's identity
+ * @len: its length in bytes
+ *
+ * Returns 1 if it is an expected client that had not yet reclaimed,
+ * otherwise zero.  The progress is published as each tenth of the
+ * expected clients is reached, and otherwise at most once a second.
+ */
+int
+nfsgrace_reclaim(const void *id, size_t len)
+{
+	struct nfsgrace_client *gc;
+	unsigned int events = grace_nevents;
+
+	if (!grace_active)
+		return 0;
+	gc = nfsgrace_find(id, len);
+	if (gc == NULL) {
+		grace_unexpected++;
+		return 0;
+	}
+	if (gc->gc_reclaimed)
+		return 0;
+	gc->gc_reclaimed = 1;
+	grace_reclaimed++;
+
+	if (grace_reclaimed == grace_expected)
+		nfsgrace_event("complete");
+	else if (grace_reclaimed * 10ULL >= (grace_tenth + 1ULL) * grace_expected) {
+		grace_tenth = grace_reclaimed * 10ULL / grace_expected;
+		nfsgrace_event("progress");
+	}
+	if (grace_nevents != events ||
+	    nfsmetric_clock() - grace_published >= 1000000)
+		nfsgrace_publish();
+	return 1;
+}
+
+/**
+ * nfsgrace_adopt - take over a grace period another daemon published
+ *
+ * Loads the clients still waiting from the file, if another process has
+ * written it since we last looked and says it is in a grace period we
+ * have not seen.  Returns 1 if a grace period was taken over, otherwise
+ * zero.  Cheap enough to call as each client reclaims.
+ */
+int
+nfsgrace_adopt(void)
+{
+	char service[32], what[16], *buf, *line, *next;
+	unsigned long long now, ms;
+	unsigned int expected = 0, waiting = 0, reclaimed;
+	long long start;
+	struct stat st;
+	ssize_t n;
+	size_t len;
+	int pid, grace = 0;
+
+	if (grace_fd < 0 || fstat(grace_fd, &st) < 0)
+		return 0;
+	if (st.st_mtim.tv_sec == grace_mtime.tv_sec &&
+	    st.st_mtim.tv_nsec == grace_mtime.tv_nsec)
+		return 0;
+	grace_mtime = st.st_mtim;
+	if (st.st_size == 0 || st.st_size > NFSGRACE_MAX_FILE)
+		return 0;
+
+	buf = malloc(st.st_size + 1);
+	if (buf == NULL)
+		return 0;
+	n = pread(grace_fd, buf, st.st_size, 0);
+	if (n <= 0)
+		goto out;
+	buf[n] = '\0';
+
+	if (sscanf(buf, "# nfsgrace %31s %d start=%lld", service, &pid,
+			&start) != 3 || pid == getpid() ||
+	    (grace_active && start == (long long)grace_start_real))
+		goto out;
+	for (line = buf; line; line = next) {
+		next = strchr(line, '\n');
+		if (next)
+			*next++ = '\0';
+		if (strcmp(line, "state grace") == 0)
+			grace = 1;
+		else if (sscanf(line, "expected %u", &expected) == 1)
+			continue;
+	}
+	if (!grace)
+		goto out;
+
+	nfsgrace_reset();
+	grace_start_real = start;
+	now = time(NULL);
+	if (now > (unsigned long long)start &&
+	    (now - start) * 1000000ULL < grace_start)
+		grace_start -= (now - start) * 1000000ULL;
+
+	for (line = buf; line < buf + n; line += strlen(line) + 1) {
+		if (sscanf(line, "event %llu %15s %u", &ms, what,
+				&reclaimed) == 3 &&
+		    nfsgrace_what(what) && grace_nevents < NFSGRACE_EVENTS) {
+			grace_events[grace_nevents].ge_ms = ms;
+			grace_events[grace_nevents].ge_what = nfsgrace_what(what);
+			grace_events[grace_nevents].ge_reclaimed = reclaimed;
+			grace_nevents++;
+		} else if (strncmp(line, "waiting ", 8) == 0) {
+			len = nfsgrace_parse_id(line + 8);
+			nfsgrace_expect(line + 8, len);
+			waiting++;
+		}
+	}
+	/* Those that reclaimed before are no longer listed */
+	if (expected > grace_expected) {
+		grace_reclaimed = expected - grace_expected;
+		grace_expected = expected;
+	}
+	if (grace_expected)
+		grace_tenth = grace_reclaimed * 10ULL / grace_expected;
+	nfsgrace_event("adopt");
+	xlog(D_GENERAL, "Took over the %s grace period of process %d: "
+		"%u of %u clients waiting", grace_service, pid, waiting,
+		grace_expected);
+	nfsgrace_publish();
+	free(buf);
+	return 1;
+out:
+	free(buf);
+	return 0;
+}
+
+/**
+ * nfsgrace_publish - write the progress of the grace period
+ */
+void
+nfsgrace_publish(void)
+{
+	struct nfsgrace_client *gc;
+	struct stat st;
+	unsigned int i;
+	size_t len = 0;
+	char *buf = NULL;
+	FILE *fp;
+
+	if (grace_fd < 0)
+		return;
+	fp = open_memstream(&buf, &len);
+	if (fp == NULL)
+		return;
+	fprintf(fp, "# nfsgrace %s %d start=%lld\n", grace_service,
+		(int)getpid(), (long long)grace_start_real);
+	fprintf(fp, "state %s\n", grace_active ? "grace" : "over");
+	fprintf(fp, "lifted %d\n", grace_lifted);
+	fprintf(fp, "expected %u\n", grace_expected);
+	fprintf(fp, "reclaimed %u\n", grace_reclaimed);
+	fprintf(fp, "unexpected %u\n", grace_unexpected);
+	fprintf(fp, "elapsed_ms %lu\n", nfsgrace_elapsed());
+	for (i = 0; i < grace_nevents; i++)
+		fprintf(fp, "event %lu %s %u\n", grace_events[i].ge_ms,
+			grace_events[i].ge_what, grace_events[i].ge_reclaimed);
+	for (i = 0; i < grace_size; i++)
+		for (gc = grace_table[i]; gc; gc = gc->gc_next) {
+			if (gc->gc_reclaimed)
+				continue;
+			fputs("waiting ", fp);
+			nfsgrace_print_id(fp, gc->gc_id, gc->gc_len);
+			fputc('\n', fp);
+		}
+	if (fclose(fp) != 0) {
+		free(buf);
+		return;
+	}
+
+	/* Readers may see a mix of old and new for a moment, never an empty file */
+	if (pwrite(grace_fd, buf, len, 0) != (ssize_t)len ||
+	    ftruncate(grace_fd, len) < 0)
+		xlog(L_WARNING, "Unable to write %s grace period progress: %m",
+			grace_service);
+	free(buf);
+	grace_published = nfsmetric_clock();
+	if (fstat(grace_fd, &st) == 0)
+		grace_mtime = st.st_mtim;
+}
+
+/**
+ * nfsgrace_end - the grace period is over
+ *
+ * Logs how long it lasted, how many of the expected clients reclaimed,
+ * and some of those that did not.
+ */
+void
+nfsgrace_end(void)
+{
+	struct nfsgrace_client *gc;
+	unsigned long ms;
+	unsigned int i, logged = 0;
+	char *label;
+	size_t len;
+	FILE *fp;
+
+	if (!grace_active)
+		return;
+	nfsgrace_event("end");
+	grace_end = nfsmetric_clock();
+	grace_active = 0;
+
+	ms = nfsgrace_elapsed();
+	xlog(L_NOTICE, "%s grace period over after %lu.%03lu seconds%s: "
+		"%u of %u clients reclaimed", grace_service, ms / 1000,
+		ms % 1000, grace_lifted ? ", ended early" : "",
+		grace_reclaimed, grace_expected);
+
+	for (i = 0; i < grace_size; i++)
+		for (gc = grace_table[i]; gc; gc = gc->gc_next) {
+			if (gc->gc_reclaimed ||
+			    logged++ >= NFSGRACE_LOG_WAITING)
+				continue;
+			label = NULL;
+			fp = open_memstream(&label, &len);
+			if (fp == NULL)
+				continue;
+			nfsgrace_print_id(fp, gc->gc_id, gc->gc_len);
+			if (fclose(fp) == 0)
+				xlog(L_NOTICE, "%s grace period: %s did not reclaim",
+					grace_service, label);
+			free(label);
+		}
+	if (logged > NFSGRACE_LOG_WAITING)
+		xlog(L_NOTICE, "%s grace period: and %u more did not reclaim",
+			grace_service, logged - NFSGRACE_LOG_WAITING);
+
+	nfsgrace_publish();
+}
+
+/* Is a grace period being tracked? */
+int
+nfsgrace_active(void)
+{
+	return grace_active;
+}
+
+/* Has every expected client of the grace period reclaimed? */
+int
+nfsgrace_complete(void)
+{
+	return grace_active && grace_expected != 0 &&
+		grace_reclaimed == grace_expected;
+}
+
+/* Milliseconds since the grace period started, or that it lasted */
+unsigned long
+nfsgrace_elapsed(void)
+{
+	unsigned long long end = grace_end ? grace_end : nfsmetric_clock();
+
+	if (grace_start == 0 || end < grace_start)
+		return 0;
+	return (end - grace_start) / 1000;
+}
+
+/*
+ * Open the kernel's file afresh where we can: nfsd's files take only
+ * one write each time they are opened.  A daemon that has dropped its
+ * privileges uses the one nfsgrace_open() kept.
+ */
+static int
+nfsgrace_endfile(int flags)
+{
+	int fd;
+
+	fd = open(grace_endfile, flags | O_CLOEXEC);
+	if (fd >= 0)
+		return fd;
+	if (errno == ENOENT)
+		return -1;
+	if (grace_endfd >= 0)
+		return dup(grace_endfd);
+	xlog(L_WARNING, "Unable to open %s: %m", grace_endfile);
+	return -1;
+}
+
+/**
+ * nfsgrace_lift - tell the kernel its grace period can end now
+ *
+ * Returns zero if it was told, or -1 if it could not be, for instance
+ * because it has no such file.
+ */
+int
+nfsgrace_lift(void)
+{
+	int fd, ret = 0;
+
+	if (grace_endfile[0] == '\0')
+		return -1;
+	fd = nfsgrace_endfile(O_WRONLY);
+	if (fd < 0)
+		return -1;
+	if (pwrite(fd, "Y", 1, 0) != 1) {
+		xlog(L_WARNING, "Unable to write to %s: %m", grace_endfile);
+		ret = -1;
+	}
+	close(fd);
+	if (ret == 0 && grace_active) {
+		grace_lifted = 1;
+		nfsgrace_event("lift");
+		nfsgrace_publish();
+	}
+	return ret;
+}
+
+/**
+ * nfsgrace_over - ask the kernel whether its grace period is over
+ *
+ * Returns 1 if it is, zero if not, or -1 if the kernel cannot say.
+ */
+int
+nfsgrace_over(void)
+{
+	char c;
+	int fd, ret = -1;
+
+	if (grace_endfile[0] == '\0')
+		return -1;
+	fd = nfsgrace_endfile(O_RDONLY);
+	if (fd < 0)
+		return -1;
+	if (pread(fd, &c, 1, 0) == 1)
+		ret = c == 'Y';
+	close(fd);
+	return ret;
+}
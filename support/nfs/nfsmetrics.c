@@ -0,0 +1,452 @@
+/*
+ * support/nfs/nfsmetrics.c
+ *
+ * Counters and latency histograms for the daemons.
+ *
+ * A metric is registered once by name and then updated from any
+ * thread with relaxed atomic adds.  Each metric keeps one copy of its
+ * values per shard, a cache line or more apart, and each thread
+ * updates the shard it was given the first time it counted anything,
+ * so threads of a busy daemon do not bounce a counter between CPUs.
+ * The shards are summed only when the metrics are read.
+ *
+ * If "metrics" is set in nfs.conf, a thread answers each connection to
+ * NFSMETRICS_DIR/<service>.metrics with a dump of every metric, in the
+ * line format documented in nfsmetrics(8), and closes it.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef HAVE_LIBPTHREAD
+#include <pthread.h>
+#endif
+
+#include "nfslib.h"
+#include "conffile.h"
+#include "nfsmetrics.h"
+#include "xlog.h"
+
+#define NFSMETRIC_SHARDS	16
+#define NFSMETRIC_LINE		64	/* bytes in a cache line */
+
+enum nfsmetric_kind {
+	NFSMETRIC_COUNTER,
+	NFSMETRIC_HISTOGRAM,
+};
+
+/*
+ * A counter shard is one value; a histogram shard is the number of
+ * observations, their sum, then the buckets.
+ */
+#define NFSM_COUNT	0
+#define NFSM_SUM	1
+#define NFSM_BUCKET	2
+
+struct nfsmetric {
+	struct nfsmetric *	m_next;
+	char *			m_name;
+	char *			m_help;
+	enum nfsmetric_kind	m_kind;
+	unsigned int		m_stride;	/* values per shard */
+	unsigned long *		m_values;
+};
+
+static struct nfsmetric *nfsmetrics;	/* newest first */
+static unsigned int nfsmetric_next_shard;
+static __thread unsigned int nfsmetric_shard = UINT_MAX;
+
+static unsigned long *
+nfsmetric_values(struct nfsmetric *m)
+{
+	unsigned int shard = nfsmetric_shard;
+
+	if (shard == UINT_MAX) {
+		shard = __atomic_fetch_add(&nfsmetric_next_shard, 1,
+				__ATOMIC_RELAXED) % NFSMETRIC_SHARDS;
+		nfsmetric_shard = shard;
+	}
+	return &m->m_values[shard * m->m_stride];
+}
+
+static struct nfsmetric *
+nfsmetric_find(const char *name)
+{
+	struct nfsmetric *m;
+
+	for (m = __atomic_load_n(&nfsmetrics, __ATOMIC_ACQUIRE); m;
+	     m = m->m_next)
+		if (strcmp(m->m_name, name) == 0)
+			return m;
+	return NULL;
+}
+
+static struct nfsmetric *
+nfsmetric_register(const char *name, const char *help,
+		enum nfsmetric_kind kind, unsigned int nvalues)
+{
+	struct nfsmetric *m;
+	size_t per_line = NFSMETRIC_LINE / sizeof(unsigned long);
+	void *values;
+
+	m = nfsmetric_find(name);
+	if (m != NULL)
+		return m->m_kind == kind ? m : NULL;
+
+	m = calloc(1, sizeof(*m));
+	if (m == NULL)
+		goto out_nomem;
+	m->m_kind = kind;
+	m->m_stride = (nvalues + per_line - 1) / per_line * per_line;
+	if (posix_memalign(&values, NFSMETRIC_LINE, NFSMETRIC_SHARDS *
+			m->m_stride * sizeof(unsigned long)) != 0)
+		goto out_free;
+	memset(values, 0, NFSMETRIC_SHARDS * m->m_stride *
+			sizeof(unsigned long));
+	m->m_values = values;
+	m->m_name = strdup(name);
+	m->m_help = strdup(help ? help : "");
+	if (m->m_name == NULL || m->m_help == NULL)
+		goto out_free;
+
+	m->m_next = __atomic_load_n(&nfsmetrics, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&nfsmetrics, &m->m_next, m, 1,
+			__ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		;
+	return m;
+
+out_free:
+	free(m->m_name);
+	free(m->m_help);
+	free(m->m_values);
+	free(m);
+out_nomem:
+	xlog(L_WARNING, "%s: no memory for metric %s", __func__, name);
+	return NULL;
+}
+
+/**
+ * nfsmetric_counter - find or register a counter
+ * @name: metric name
+ * @help: one line describing it
+ *
+ * Returns NULL if it could not be registered; updating a NULL metric
+ * does nothing.
+ */
+struct nfsmetric *
+nfsmetric_counter(const char *name, const char *help)
+{
+	return nfsmetric_register(name, help, NFSMETRIC_COUNTER, 1);
+}
+
+/**
+ * nfsmetric_histogram - find or register a latency histogram
+ * @name: metric name
+ * @help: one line describing it
+ *
+ * Observations are in microseconds.
+ */
+struct nfsmetric *
+nfsmetric_histogram(const char *name, const char *help)
+{
+	return nfsmetric_register(name, help, NFSMETRIC_HISTOGRAM,
+			NFSM_BUCKET + NFSMETRIC_BUCKETS);
+}
+
+void
+nfsmetric_add(struct nfsmetric *m, unsigned long n)
+{
+	if (m == NULL)
+		return;
+	__atomic_fetch_add(&nfsmetric_values(m)[NFSM_COUNT], n,
+			__ATOMIC_RELAXED);
+}
+
+void
+nfsmetric_observe(struct nfsmetric *m, unsigned long usecs)
+{
+	unsigned long *v;
+	int bucket;
+
+	if (m == NULL)
+		return;
+	bucket = usecs ? 64 - __builtin_clzll(usecs) : 0;
+	if (bucket >= NFSMETRIC_BUCKETS)
+		bucket = NFSMETRIC_BUCKETS - 1;
+	v = nfsmetric_values(m);
+	__atomic_fetch_add(&v[NFSM_COUNT], 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&v[NFSM_SUM], usecs, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&v[NFSM_BUCKET + bucket], 1, __ATOMIC_RELAXED);
+}
+
+/* Returns a monotonic time stamp, in microseconds, for nfsmetric_since() */
+unsigned long long
+nfsmetric_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/* Observe the time since @start, a value from nfsmetric_clock() */
+void
+nfsmetric_since(struct nfsmetric *m, unsigned long long start)
+{
+	if (m == NULL)
+		return;
+	nfsmetric_observe(m, nfsmetric_clock() - start);
+}
+
+static unsigned long
+nfsmetric_sum(const struct nfsmetric *m, unsigned int i)
+{
+	unsigned long sum = 0;
+	unsigned int shard;
+
+	for (shard = 0; shard < NFSMETRIC_SHARDS; shard++)
+		sum += __atomic_load_n(&m->m_values[shard * m->m_stride + i],
+				__ATOMIC_RELAXED);
+	return sum;
+}
+
+static void
+nfsmetric_write(FILE *fp, const struct nfsmetric *m)
+{
+	unsigned int i;
+
+	/* Oldest first, in the order the daemon registered them */
+	if (m->m_next)
+		nfsmetric_write(fp, m->m_next);
+
+	if (*m->m_help)
+		fprintf(fp, "# HELP %s %s\n", m->m_name, m->m_help);
+	switch (m->m_kind) {
+	case NFSMETRIC_COUNTER:
+		fprintf(fp, "counter %s %lu\n", m->m_name,
+			nfsmetric_sum(m, NFSM_COUNT));
+		break;
+	case NFSMETRIC_HISTOGRAM:
+		fprintf(fp, "histogram %s %lu %lu", m->m_name,
+			nfsmetric_sum(m, NFSM_COUNT),
+			nfsmetric_sum(m, NFSM_SUM));
+		for (i = 0; i < NFSMETRIC_BUCKETS; i++)
+			fprintf(fp, " %lu", nfsmetric_sum(m, NFSM_BUCKET + i));
+		fputc('\n', fp);
+		break;
+	}
+}
+
+static char nfsmetrics_service[64];
+static time_t nfsmetrics_started;
+
+/**
+ * nfsmetrics_write - dump every metric
+ * @fp: where to write them
+ *
+ * Each counter is exact, but they are not all read at the same instant.
+ */
+void
+nfsmetrics_write(FILE *fp)
+{
+	struct nfsmetric *m = __atomic_load_n(&nfsmetrics, __ATOMIC_ACQUIRE);
+
+	fprintf(fp, "# nfsmetrics %s %d %ld\n", nfsmetrics_service,
+		(int)getpid(), (long)(time(NULL) - nfsmetrics_started));
+	if (m)
+		nfsmetric_write(fp, m);
+}
+
+#ifdef HAVE_LIBPTHREAD
+/*
+ * Programs not linked with libpthread see a null pthread_create, and
+ * cannot serve their metrics.
+ */
+#pragma weak pthread_create
+#pragma weak pthread_detach
+
+static int nfsmetrics_fd = -1;
+static char nfsmetrics_path[PATH_MAX];
+static pid_t nfsmetrics_pid;
+
+static void
+nfsmetrics_reply(int fd)
+{
+	struct timeval tv = { 1, 0 };
+	char *buf = NULL;
+	size_t len = 0, off;
+	ssize_t n;
+	FILE *fp;
+
+	fp = open_memstream(&buf, &len);
+	if (fp == NULL)
+		return;
+	nfsmetrics_write(fp);
+	if (fclose(fp) != 0) {
+		free(buf);
+		return;
+	}
+	/* A reader that stops reading must not hold up the daemon */
+	(void)setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	for (off = 0; off < len; off += n) {
+		n = send(fd, buf + off, len - off, MSG_NOSIGNAL);
+		if (n <= 0)
+			break;
+	}
+	free(buf);
+}
+
+static void *
+nfsmetrics_thread(void *arg)
+{
+	int lfd = (int)(long)arg;
+	int fd;
+
+	for (;;) {
+		fd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED ||
+			    errno == EMFILE || errno == ENFILE)
+				continue;
+			xlog(L_WARNING, "%s: accept failed: %m", __func__);
+			break;
+		}
+		nfsmetrics_reply(fd);
+		close(fd);
+	}
+	return NULL;
+}
+
+static void
+nfsmetrics_unlink(void)
+{
+	if (nfsmetrics_pid == getpid())
+		unlink(nfsmetrics_path);
+}
+
+static int
+nfsmetrics_listen(const char *name)
+{
+	struct sockaddr_un sun;
+	pthread_t thread;
+	int fd;
+
+	if (mkdir(NFSMETRICS_DIR, 0755) < 0 && errno != EEXIST) {
+		xlog(L_WARNING, "Unable to create %s: %m", NFSMETRICS_DIR);
+		return -1;
+	}
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	if ((size_t)snprintf(sun.sun_path, sizeof(sun.sun_path), "%s/%s%s",
+			NFSMETRICS_DIR, name, NFSMETRICS_SUFFIX) >=
+			sizeof(sun.sun_path)) {
+		xlog(L_WARNING, "Metrics socket name too long for %s", name);
+		return -1;
+	}
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		xlog(L_WARNING, "Unable to create metrics socket: %m");
+		return -1;
+	}
+	/* A socket left by an earlier instance would make bind() fail */
+	(void)unlink(sun.sun_path);
+	if (bind(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0 ||
+	    listen(fd, 8) < 0) {
+		xlog(L_WARNING, "Unable to listen on %s: %m", sun.sun_path);
+		close(fd);
+		return -1;
+	}
+	if (pthread_create(&thread, NULL, nfsmetrics_thread,
+			(void *)(long)fd) != 0) {
+		xlog(L_WARNING, "Unable to start metrics thread");
+		close(fd);
+		unlink(sun.sun_path);
+		return -1;
+	}
+	pthread_detach(thread);
+
+	if (nfsmetrics_pid == 0)
+		atexit(nfsmetrics_unlink);
+	strcpy(nfsmetrics_path, sun.sun_path);
+	nfsmetrics_pid = getpid();
+	nfsmetrics_fd = fd;
+	xlog(D_GENERAL, "Serving metrics on %s", sun.sun_path);
+	return 0;
+}
+
+/**
+ * nfsmetrics_start - serve this daemon's metrics if nfs.conf says so
+ * @service: nfs.conf section, also the name of the socket
+ *
+ * Looks for "metrics" in [@service], then in [general].  Call it once
+ * the daemon has forked into the background.  Returns zero if the
+ * metrics are being served or were not asked for, otherwise -1.
+ */
+int
+nfsmetrics_start(const char *service)
+{
+	nfsmetrics_started = time(NULL);
+	strncpy(nfsmetrics_service, service, sizeof(nfsmetrics_service) - 1);
+	if (!conf_get_bool(service, "metrics",
+			conf_get_bool("general", "metrics", false)))
+		return 0;
+	if (!pthread_create) {
+		xlog(L_WARNING, "%s cannot serve metrics", service);
+		return -1;
+	}
+	return nfsmetrics_listen(service);
+}
+
+/**
+ * nfsmetrics_worker - serve the metrics of a forked worker process
+ * @id: worker number
+ *
+ * The worker's metrics are served on a socket of its own, named with
+ * ".@id" appended to the service name.
+ */
+void
+nfsmetrics_worker(int id)
+{
+	char name[sizeof(nfsmetrics_service) + 16];
+
+	if (nfsmetrics_fd < 0)
+		return;
+	/* The parent's thread didn't come along, only its socket */
+	close(nfsmetrics_fd);
+	nfsmetrics_fd = -1;
+	snprintf(name, sizeof(name), "%s.%d", nfsmetrics_service, id);
+	strcpy(nfsmetrics_service, name);
+	nfsmetrics_listen(name);
+}
+#else
+int
+nfsmetrics_start(const char *service)
+{
+	nfsmetrics_started = time(NULL);
+	strncpy(nfsmetrics_service, service, sizeof(nfsmetrics_service) - 1);
+	if (!conf_get_bool(service, "metrics",
+			conf_get_bool("general", "metrics", false)))
+		return 0;
+	xlog(L_WARNING, "%s cannot serve metrics", service);
+	return -1;
+}
+
+void
+nfsmetrics_worker(int UNUSED(id))
+{
+}
+#endif /* HAVE_LIBPTHREAD */
@@ -0,0 +1,672 @@
+/*
+ * support/nfs/nfstrace.c
+ *
+ * Per-upcall latency records for the daemons.
+ *
+ * A daemon fills in a struct nfstrace as an upcall goes through it:
+ * nfstrace_read() when the request is read from the kernel,
+ * nfstrace_enter() when a thread starts on it, nfstrace_dep() for each
+ * wait on DNS, NSS, LDAP, a KDC or blkid, nfstrace_downcall() when the
+ * reply is written, and nfstrace_done() at the end.  nfstrace_dep()
+ * and nfstrace_downcall() apply to the record the calling thread
+ * entered, so code deep in the libraries need not be handed it.
+ *
+ * Finished records go into a ring of the size given by "upcall-trace"
+ * in nfs.conf.  Each slot has a sequence number that is zero while a
+ * thread is writing it, so the ring can be read without locks, from a
+ * signal handler too: SIGUSR2 writes it to NFSMETRICS_DIR/<service>.trace.
+ * A thread serves NFSMETRICS_DIR/<service>.upcalls, sending the ring to
+ * each reader that connects and then every record as it is finished.
+ * A reader that does not keep up loses records rather than holding up
+ * the daemon; upcall_trace_dropped counts them.
+ *
+ * Times are CLOCK_MONOTONIC microseconds, as used by ftrace with
+ * trace_clock=mono, so that the records can be matched with the
+ * sunrpc cache tracepoints.  The line format is in nfsupcalltrace(8).
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef HAVE_LIBPTHREAD
+#include <pthread.h>
+#endif
+
+#include "nfslib.h"
+#include "conffile.h"
+#include "nfstrace.h"
+#include "xlog.h"
+
+#define NFSTRACE_MAX_RECORDS	(1 << 20)
+#define NFSTRACE_LINE		512
+#define NFSTRACE_READERS	4
+
+struct nfstrace_slot {
+	unsigned long		ts_seq;		/* record number, 0 if busy */
+	struct nfstrace		ts_rec;
+};
+
+int nfstrace_active;
+
+static struct nfstrace_slot *nfstrace_ring;
+static unsigned long nfstrace_mask;
+static unsigned long nfstrace_head;	/* records started */
+static struct nfsmetric *nfstrace_dropped;
+
+static char nfstrace_service[64];
+static char nfstrace_dump_path[PATH_MAX];
+
+static __thread struct nfstrace *nfstrace_current;
+static __thread int nfstrace_tid;
+
+static const char *nfstrace_dep_names[NFSTRACE_DEPS] = {
+	[NFSTRACE_DNS]		= "dns",
+	[NFSTRACE_NSS]		= "nss",
+	[NFSTRACE_LDAP]		= "ldap",
+	[NFSTRACE_KDC]		= "kdc",
+	[NFSTRACE_BLKID]	= "blkid",
+	[NFSTRACE_SERVER]	= "server",
+};
+
+/*
+ * The formatting below is done by hand so that nfstrace_dump() can
+ * use it from a signal handler.
+ */
+static char *
+nfstrace_put_str(char *p, char *end, const char *s)
+{
+	while (*s && p < end)
+		*p++ = *s++;
+	return p;
+}
+
+static char *
+nfstrace_put_num(char *p, char *end, unsigned long long n)
+{
+	char digits[24];
+	int i = 0;
+
+	do {
+		digits[i++] = '0' + n % 10;
+		n /= 10;
+	} while (n);
+	while (i && p < end)
+		*p++ = digits[--i];
+	return p;
+}
+
+static size_t
+nfstrace_format(char *buf, size_t len, unsigned long seq,
+		const struct nfstrace *tr)
+{
+	char *p = buf, *end = buf + len - 1;
+	int i;
+
+	p = nfstrace_put_str(p, end, "upcall ");
+	p = nfstrace_put_num(p, end, seq);
+	p = nfstrace_put_str(p, end, " ");
+	p = nfstrace_put_num(p, end, tr->tr_tid);
+	p = nfstrace_put_str(p, end, " ");
+	p = nfstrace_put_str(p, end, tr->tr_channel);
+	p = nfstrace_put_str(p, end, " ");
+	p = nfstrace_put_num(p, end, tr->tr_read);
+	p = nfstrace_put_str(p, end, " ");
+	p = nfstrace_put_num(p, end, tr->tr_dispatch);
+	p = nfstrace_put_str(p, end, " ");
+	p = nfstrace_put_num(p, end, tr->tr_downcall);
+	p = nfstrace_put_str(p, end, " ");
+	p = nfstrace_put_num(p, end, tr->tr_done);
+	for (i = 0; i < NFSTRACE_DEPS; i++) {
+		p = nfstrace_put_str(p, end, " ");
+		p = nfstrace_put_num(p, end, tr->tr_dep[i]);
+	}
+	p = nfstrace_put_str(p, end, " ");
+	p = nfstrace_put_str(p, end, tr->tr_key);
+	*p++ = '\n';
+	return p - buf;
+}
+
+static size_t
+nfstrace_header(char *buf, size_t len)
+{
+	char *p = buf, *end = buf + len;
+	int i;
+
+	p = nfstrace_put_str(p, end, "# nfstrace ");
+	p = nfstrace_put_str(p, end, nfstrace_service);
+	p = nfstrace_put_str(p, end, " ");
+	p = nfstrace_put_num(p, end, getpid());
+	p = nfstrace_put_str(p, end, " clock=monotonic\n"
+		"# upcall seq tid channel read dispatch downcall done");
+	for (i = 0; i < NFSTRACE_DEPS; i++) {
+		p = nfstrace_put_str(p, end, " ");
+		p = nfstrace_put_str(p, end, nfstrace_dep_names[i]);
+	}
+	p = nfstrace_put_str(p, end, " key\n");
+	return p - buf;
+}
+
+/*
+ * Copy out record @seq if it is still in the ring and not being
+ * rewritten.  Returns 1 if it was.
+ */
+static int
+nfstrace_fetch(unsigned long seq, struct nfstrace *tr)
+{
+	struct nfstrace_slot *slot = &nfstrace_ring[(seq - 1) & nfstrace_mask];
+
+	if (__atomic_load_n(&slot->ts_seq, __ATOMIC_ACQUIRE) != seq)
+		return 0;
+	memcpy(tr, &slot->ts_rec, sizeof(*tr));
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&slot->ts_seq, __ATOMIC_RELAXED) == seq;
+}
+
+static unsigned long
+nfstrace_store(const struct nfstrace *tr)
+{
+	unsigned long seq;
+	struct nfstrace_slot *slot;
+
+	seq = __atomic_add_fetch(&nfstrace_head, 1, __ATOMIC_RELAXED);
+	slot = &nfstrace_ring[(seq - 1) & nfstrace_mask];
+	__atomic_store_n(&slot->ts_seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy(&slot->ts_rec, tr, sizeof(*tr));
+	__atomic_store_n(&slot->ts_seq, seq, __ATOMIC_RELEASE);
+	return seq;
+}
+
+/* The oldest record that may still be in the ring */
+static unsigned long
+nfstrace_tail(unsigned long head)
+{
+	return head > nfstrace_mask ? head - nfstrace_mask : 1;
+}
+
+static void
+nfstrace_write_all(int fd, const char *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len) {
+		n = write(fd, buf, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return;
+		buf += n;
+		len -= n;
+	}
+}
+
+/**
+ * nfstrace_dump - write the ring to NFSMETRICS_DIR/<service>.trace
+ *
+ * Safe to call from a signal handler.  Records finished while the
+ * dump is written may or may not be in it.
+ */
+void
+nfstrace_dump(void)
+{
+	char buf[16 * NFSTRACE_LINE];
+	unsigned long seq, head;
+	struct nfstrace tr;
+	size_t len;
+	int fd, saved_errno = errno;
+
+	if (!nfstrace_enabled())
+		return;
+	fd = open(nfstrace_dump_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+		  0600);
+	if (fd < 0)
+		goto out;
+	len = nfstrace_header(buf, sizeof(buf));
+	head = __atomic_load_n(&nfstrace_head, __ATOMIC_ACQUIRE);
+	for (seq = nfstrace_tail(head); seq <= head; seq++) {
+		if (!nfstrace_fetch(seq, &tr))
+			continue;
+		if (len + NFSTRACE_LINE > sizeof(buf)) {
+			nfstrace_write_all(fd, buf, len);
+			len = 0;
+		}
+		len += nfstrace_format(buf + len, NFSTRACE_LINE, seq, &tr);
+	}
+	nfstrace_write_all(fd, buf, len);
+	close(fd);
+out:
+	errno = saved_errno;
+}
+
+static void
+nfstrace_sigusr2(int UNUSED(sig))
+{
+	nfstrace_dump();
+}
+
+#ifdef HAVE_LIBPTHREAD
+/*
+ * Programs not linked with libpthread see a null pthread_create, and
+ * cannot stream their records.
+ */
+#pragma weak pthread_create
+#pragma weak pthread_detach
+
+static pthread_mutex_t nfstrace_readers_lock = PTHREAD_MUTEX_INITIALIZER;
+static int nfstrace_readers[NFSTRACE_READERS] = { -1, -1, -1, -1 };
+static int nfstrace_nreaders;
+static int nfstrace_fd = -1;
+static char nfstrace_path[PATH_MAX];
+static pid_t nfstrace_pid;
+
+/* Returns 0 if @fd took the whole line, -1 if it has to go */
+static int
+nfstrace_send(int fd, const char *buf, size_t len)
+{
+	ssize_t n;
+
+	n = send(fd, buf, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+	if (n == (ssize_t)len)
+		return 0;
+	if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+		nfsmetric_add(nfstrace_dropped, 1);
+		return 0;
+	}
+	/* A line cut short would garble the rest of the stream */
+	return -1;
+}
+
+static void
+nfstrace_stream(unsigned long seq, const struct nfstrace *tr)
+{
+	char buf[NFSTRACE_LINE];
+	size_t len;
+	int i;
+
+	if (!__atomic_load_n(&nfstrace_nreaders, __ATOMIC_RELAXED))
+		return;
+	len = nfstrace_format(buf, sizeof(buf), seq, tr);
+	pthread_mutex_lock(&nfstrace_readers_lock);
+	for (i = 0; i < NFSTRACE_READERS; i++) {
+		if (nfstrace_readers[i] < 0)
+			continue;
+		if (nfstrace_send(nfstrace_readers[i], buf, len) < 0) {
+			close(nfstrace_readers[i]);
+			nfstrace_readers[i] = -1;
+			__atomic_sub_fetch(&nfstrace_nreaders, 1,
+					__ATOMIC_RELAXED);
+		}
+	}
+	pthread_mutex_unlock(&nfstrace_readers_lock);
+}
+
+/* Send records @from to the current head; returns where it stopped */
+static unsigned long
+nfstrace_history(int fd, unsigned long from)
+{
+	char buf[16 * NFSTRACE_LINE];
+	unsigned long seq, head;
+	struct nfstrace tr;
+	size_t len = 0;
+
+	head = __atomic_load_n(&nfstrace_head, __ATOMIC_ACQUIRE);
+	if (from < nfstrace_tail(head))
+		from = nfstrace_tail(head);
+	for (seq = from; seq <= head; seq++) {
+		if (!nfstrace_fetch(seq, &tr))
+			continue;
+		if (len + NFSTRACE_LINE > sizeof(buf)) {
+			if (send(fd, buf, len, MSG_NOSIGNAL) != (ssize_t)len)
+				return 0;
+			len = 0;
+		}
+		len += nfstrace_format(buf + len, NFSTRACE_LINE, seq, &tr);
+	}
+	if (len && send(fd, buf, len, MSG_NOSIGNAL) != (ssize_t)len)
+		return 0;
+	return head + 1;
+}
+
+static void
+nfstrace_add_reader(int fd)
+{
+	struct timeval tv = { 1, 0 };
+	char buf[NFSTRACE_LINE];
+	unsigned long next;
+	size_t len;
+	int i;
+
+	/* A reader that stops reading must not hold up the daemon */
+	(void)setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	len = nfstrace_header(buf, sizeof(buf));
+	if (send(fd, buf, len, MSG_NOSIGNAL) != (ssize_t)len)
+		goto out_close;
+
+	/*
+	 * Most of the history goes out without the lock held; the few
+	 * records finished meanwhile are sent once the workers can no
+	 * longer miss this reader, and some may be sent twice.
+	 */
+	next = nfstrace_history(fd, 1);
+	if (next == 0)
+		goto out_close;
+	pthread_mutex_lock(&nfstrace_readers_lock);
+	for (i = 0; i < NFSTRACE_READERS; i++)
+		if (nfstrace_readers[i] < 0)
+			break;
+	if (i == NFSTRACE_READERS || nfstrace_history(fd, next) == 0) {
+		pthread_mutex_unlock(&nfstrace_readers_lock);
+		goto out_close;
+	}
+	nfstrace_readers[i] = fd;
+	__atomic_add_fetch(&nfstrace_nreaders, 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&nfstrace_readers_lock);
+	return;
+
+out_close:
+	close(fd);
+}
+
+static void *
+nfstrace_thread(void *arg)
+{
+	int lfd = (int)(long)arg;
+	int fd;
+
+	for (;;) {
+		fd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED ||
+			    errno == EMFILE || errno == ENFILE)
+				continue;
+			xlog(L_WARNING, "%s: accept failed: %m", __func__);
+			break;
+		}
+		nfstrace_add_reader(fd);
+	}
+	return NULL;
+}
+
+static void
+nfstrace_unlink(void)
+{
+	if (nfstrace_pid == getpid())
+		unlink(nfstrace_path);
+}
+
+static int
+nfstrace_listen(const char *name)
+{
+	struct sockaddr_un sun;
+	pthread_t thread;
+	int fd;
+
+	if (!pthread_create) {
+		xlog(L_WARNING, "%s cannot stream upcall records", name);
+		return -1;
+	}
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	if ((size_t)snprintf(sun.sun_path, sizeof(sun.sun_path), "%s/%s%s",
+			NFSMETRICS_DIR, name, NFSTRACE_SUFFIX) >=
+			sizeof(sun.sun_path)) {
+		xlog(L_WARNING, "Trace socket name too long for %s", name);
+		return -1;
+	}
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		xlog(L_WARNING, "Unable to create trace socket: %m");
+		return -1;
+	}
+	(void)unlink(sun.sun_path);
+	if (bind(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0 ||
+	    listen(fd, 8) < 0) {
+		xlog(L_WARNING, "Unable to listen on %s: %m", sun.sun_path);
+		close(fd);
+		return -1;
+	}
+	if (pthread_create(&thread, NULL, nfstrace_thread,
+			(void *)(long)fd) != 0) {
+		xlog(L_WARNING, "Unable to start trace thread");
+		close(fd);
+		unlink(sun.sun_path);
+		return -1;
+	}
+	pthread_detach(thread);
+
+	if (nfstrace_pid == 0)
+		atexit(nfstrace_unlink);
+	strcpy(nfstrace_path, sun.sun_path);
+	nfstrace_pid = getpid();
+	nfstrace_fd = fd;
+	xlog(D_GENERAL, "Streaming upcall records on %s", sun.sun_path);
+	return 0;
+}
+
+/* After fork(): the parent's thread and readers stay with the parent */
+static void
+nfstrace_forget(void)
+{
+	int i;
+
+	if (nfstrace_fd >= 0)
+		close(nfstrace_fd);
+	nfstrace_fd = -1;
+	for (i = 0; i < NFSTRACE_READERS; i++) {
+		if (nfstrace_readers[i] >= 0)
+			close(nfstrace_readers[i]);
+		nfstrace_readers[i] = -1;
+	}
+	nfstrace_nreaders = 0;
+}
+#else
+static void
+nfstrace_stream(unsigned long UNUSED(seq), const struct nfstrace *UNUSED(tr))
+{
+}
+
+static int
+nfstrace_listen(const char *name)
+{
+	xlog(L_WARNING, "%s cannot stream upcall records", name);
+	return -1;
+}
+
+static void
+nfstrace_forget(void)
+{
+}
+#endif /* HAVE_LIBPTHREAD */
+
+static void
+nfstrace_name(const char *name)
+{
+	strlcpy(nfstrace_service, name, sizeof(nfstrace_service));
+	snprintf(nfstrace_dump_path, sizeof(nfstrace_dump_path), "%s/%s%s",
+		 NFSMETRICS_DIR, nfstrace_service, NFSTRACE_DUMP_SUFFIX);
+}
+
+/**
+ * nfstrace_start - start recording upcalls if nfs.conf says so
+ * @service: nfs.conf section, also the name of the socket and dump
+ *
+ * Looks for "upcall-trace", the number of records to keep, in
+ * [@service], then in [general].  Call it once the daemon has forked
+ * into the background.  SIGUSR2 then dumps the records instead of
+ * turning off debug logging; a daemon that handles SIGUSR2 itself
+ * should install its handler afterwards and call nfstrace_dump() from
+ * it.  Returns zero if the records are kept or were not asked for,
+ * otherwise -1.
+ */
+int
+nfstrace_start(const char *service)
+{
+	struct sigaction sa;
+	unsigned long size;
+	int records;
+
+	records = conf_get_num(service, "upcall-trace",
+			conf_get_num("general", "upcall-trace", 0));
+	if (records <= 0)
+		return 0;
+	if (records > NFSTRACE_MAX_RECORDS)
+		records = NFSTRACE_MAX_RECORDS;
+	for (size = 1; size < (unsigned long)records; size <<= 1)
+		;
+	nfstrace_ring = calloc(size, sizeof(*nfstrace_ring));
+	if (nfstrace_ring == NULL) {
+		xlog(L_WARNING, "Unable to keep %lu upcall records", size);
+		return -1;
+	}
+	nfstrace_mask = size - 1;
+	nfstrace_dropped = nfsmetric_counter("upcall_trace_dropped",
+			"Upcall records not streamed to a slow reader");
+	nfstrace_name(service);
+
+	if (mkdir(NFSMETRICS_DIR, 0755) < 0 && errno != EEXIST)
+		xlog(L_WARNING, "Unable to create %s: %m", NFSMETRICS_DIR);
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = nfstrace_sigusr2;
+	sa.sa_flags = SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGUSR2, &sa, NULL);
+
+	__atomic_store_n(&nfstrace_active, 1, __ATOMIC_RELEASE);
+	xlog(L_NOTICE, "Keeping the last %lu upcall records", size);
+	return nfstrace_listen(service);
+}
+
+/**
+ * nfstrace_worker - start afresh in a forked worker process
+ * @id: worker number
+ *
+ * The worker's records are dumped and streamed under a name of their
+ * own, with ".@id" appended to the service name.
+ */
+void
+nfstrace_worker(int id)
+{
+	char name[sizeof(nfstrace_service) + 16];
+	unsigned long i;
+
+	if (!nfstrace_enabled())
+		return;
+	nfstrace_forget();
+	for (i = 0; i <= nfstrace_mask; i++)
+		nfstrace_ring[i].ts_seq = 0;
+	nfstrace_head = 0;
+	snprintf(name, sizeof(name), "%s.%d", nfstrace_service, id);
+	nfstrace_name(name);
+	nfstrace_listen(name);
+}
+
+/**
+ * nfstrace_read - start a record for an upcall just read
+ * @tr: record to fill in
+ * @channel: name of the cache or pipe the upcall came from
+ * @key: the upcall, or enough of it to tell upcalls apart
+ *
+ * The record is left empty, and the calls below ignore it, unless
+ * tracing is on.
+ */
+void
+nfstrace_read(struct nfstrace *tr, const char *channel, const char *key)
+{
+	size_t i;
+
+	memset(tr, 0, offsetof(struct nfstrace, tr_key));
+	tr->tr_key[0] = '\0';
+	if (!nfstrace_enabled())
+		return;
+	tr->tr_read = nfsmetric_clock();
+	tr->tr_channel = channel;
+
+	/* One line, without the newline the kernel ends upcalls with */
+	for (i = 0; key[i] && i < sizeof(tr->tr_key) - 1; i++)
+		tr->tr_key[i] = (unsigned char)key[i] < ' ' ? ' ' : key[i];
+	while (i && tr->tr_key[i - 1] == ' ')
+		i--;
+	tr->tr_key[i] = '\0';
+}
+
+/**
+ * nfstrace_enter - make @tr the calling thread's current record
+ * @tr: record started by nfstrace_read()
+ *
+ * The first call marks when a thread started working on the upcall.
+ */
+void
+nfstrace_enter(struct nfstrace *tr)
+{
+	if (tr->tr_read == 0)
+		return;
+	if (nfstrace_tid == 0)
+		nfstrace_tid = syscall(SYS_gettid);
+	if (tr->tr_dispatch == 0)
+		tr->tr_dispatch = nfsmetric_clock();
+	tr->tr_tid = nfstrace_tid;
+	nfstrace_current = tr;
+}
+
+/* The calling thread is done with its record, but the upcall is not */
+void
+nfstrace_leave(void)
+{
+	nfstrace_current = NULL;
+}
+
+/**
+ * nfstrace_dep - charge time spent waiting on an outside service
+ * @dep: which service
+ * @usecs: how long
+ */
+void
+nfstrace_dep(enum nfstrace_dep dep, unsigned long usecs)
+{
+	struct nfstrace *tr = nfstrace_current;
+
+	if (tr)
+		tr->tr_dep[dep] += usecs;
+}
+
+/* Mark the first reply written for the current record */
+void
+nfstrace_downcall(void)
+{
+	struct nfstrace *tr = nfstrace_current;
+
+	if (tr && tr->tr_downcall == 0)
+		tr->tr_downcall = nfsmetric_clock();
+}
+
+/* Finish the current record and put it in the ring */
+void
+nfstrace_done(void)
+{
+	struct nfstrace *tr = nfstrace_current;
+	unsigned long seq;
+
+	if (tr == NULL)
+		return;
+	nfstrace_current = NULL;
+	tr->tr_done = nfsmetric_clock();
+	seq = nfstrace_store(tr);
+	nfstrace_stream(seq, tr);
+}
@@ -0,0 +1,270 @@
+/*
+ * support/nfs/nfsworker.c
+ *
+ * Placing a daemon's workers on CPUs.
+ *
+ * "cpu-affinity" in a daemon's nfs.conf section, or in [general], says
+ * where its worker processes and threads run:
+ *
+ *	node	worker N runs on the CPUs of the Nth NUMA node, round robin
+ *	cpu	worker N runs on the Nth CPU the daemon may use, round robin
+ *	<list>	every worker runs on the listed CPUs, such as "0-7,16-23"
+ *
+ * Workers are numbered in the order they start, across all of a
+ * daemon's pools, unless the daemon numbers them itself.  A NUMA node
+ * or list is first narrowed to the CPUs the daemon was started with.
+ *
+ * Each worker also counts the requests it handled and the time it
+ * spent on them, as worker<N>_requests and worker<N>_busy_usecs in the
+ * daemon's metrics, so placement and load can be checked.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <sched.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "conffile.h"
+#include "nfsmetrics.h"
+#include "nfsworker.h"
+#include "xlog.h"
+
+#define SYSFS_NODES		"/sys/devices/system/node"
+
+enum nfsworker_mode {
+	NFSWORKER_ANY,
+	NFSWORKER_NODE,
+	NFSWORKER_CPU,
+	NFSWORKER_LIST,
+};
+
+static enum nfsworker_mode	nfsworker_mode;
+static cpu_set_t		nfsworker_allowed;
+static cpu_set_t *		nfsworker_nodes;	/* nonempty ones only */
+static int			nfsworker_nnodes;
+static int			nfsworker_next;
+
+static __thread int		nfsworker_id = -1;
+static __thread struct nfsmetric *nfsworker_usecs, *nfsworker_requests;
+
+/*
+ * Parse a list like "0-3,8,10-11" as the kernel writes them.
+ * Returns zero, or -1 if @list isn't one.
+ */
+static int
+nfsworker_parse(const char *list, cpu_set_t *set)
+{
+	const char *p;
+	char *end;
+
+	CPU_ZERO(set);
+	for (p = list; *p >= '0' && *p <= '9'; p = end + 1) {
+		long first = strtol(p, &end, 10), last = first;
+
+		if (*end == '-')
+			last = strtol(end + 1, &end, 10);
+		if (last < first)
+			return -1;
+		for (; first <= last && first < CPU_SETSIZE; first++)
+			CPU_SET(first, set);
+		if (*end != ',')
+			break;
+	}
+	if (p == list || (*end != '\0' && *end != '\n'))
+		return -1;
+	return 0;
+}
+
+static int
+nfsworker_read(const char *path, cpu_set_t *set)
+{
+	char list[4096];
+	ssize_t n;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	n = read(fd, list, sizeof(list) - 1);
+	close(fd);
+	if (n <= 0)
+		return -1;
+	list[n] = '\0';
+	return nfsworker_parse(list, set);
+}
+
+/* Find the CPUs of each online node that the daemon may use */
+static int
+nfsworker_load_nodes(void)
+{
+	char path[sizeof(SYSFS_NODES) + 32];
+	cpu_set_t online, cpus;
+	int node;
+
+	if (nfsworker_read(SYSFS_NODES "/online", &online) < 0)
+		return -1;
+	nfsworker_nodes = calloc(CPU_COUNT(&online), sizeof(cpu_set_t));
+	if (nfsworker_nodes == NULL)
+		return -1;
+	for (node = 0; node < CPU_SETSIZE; node++) {
+		if (!CPU_ISSET(node, &online))
+			continue;
+		snprintf(path, sizeof(path), SYSFS_NODES "/node%d/cpulist",
+			 node);
+		if (nfsworker_read(path, &cpus) < 0)
+			continue;
+		CPU_AND(&cpus, &cpus, &nfsworker_allowed);
+		if (CPU_COUNT(&cpus) == 0)
+			continue;
+		xlog(D_GENERAL, "NUMA node %d has %d CPUs for workers",
+		     node, CPU_COUNT(&cpus));
+		nfsworker_nodes[nfsworker_nnodes++] = cpus;
+	}
+	return nfsworker_nnodes ? 0 : -1;
+}
+
+/**
+ * nfsworker_init - read where this daemon's workers should run
+ * @service: nfs.conf section to look in before [general]
+ *
+ * Call once, before any worker starts.  Returns zero, or -1 if the
+ * setting can't be followed, in which case workers run anywhere.
+ */
+int
+nfsworker_init(const char *service)
+{
+	const char *s;
+
+	s = conf_get_str(service, "cpu-affinity");
+	if (s == NULL)
+		s = conf_get_str("general", "cpu-affinity");
+	if (s == NULL || strcmp(s, "none") == 0)
+		return 0;
+
+	if (sched_getaffinity(0, sizeof(nfsworker_allowed),
+			      &nfsworker_allowed) < 0) {
+		xlog(L_WARNING, "Unable to get the CPUs for workers: %m");
+		return -1;
+	}
+
+	if (strcmp(s, "node") == 0) {
+		if (nfsworker_load_nodes() < 0) {
+			xlog(L_WARNING, "cpu-affinity=node: unable to find "
+			     "the CPUs of each NUMA node");
+			return -1;
+		}
+		nfsworker_mode = NFSWORKER_NODE;
+	} else if (strcmp(s, "cpu") == 0) {
+		nfsworker_mode = NFSWORKER_CPU;
+	} else {
+		cpu_set_t set;
+
+		if (nfsworker_parse(s, &set) < 0) {
+			xlog(L_WARNING, "cpu-affinity: \"%s\" is not node, "
+			     "cpu, or a list of CPUs", s);
+			return -1;
+		}
+		CPU_AND(&nfsworker_allowed, &nfsworker_allowed, &set);
+		if (CPU_COUNT(&nfsworker_allowed) == 0) {
+			xlog(L_WARNING, "cpu-affinity: none of %s can be "
+			     "used", s);
+			return -1;
+		}
+		nfsworker_mode = NFSWORKER_LIST;
+	}
+	return 0;
+}
+
+/* Restrict the calling thread to the CPUs of worker @id */
+static void
+nfsworker_place(int id)
+{
+	cpu_set_t set;
+	int cpu, n;
+
+	switch (nfsworker_mode) {
+	case NFSWORKER_ANY:
+		return;
+	case NFSWORKER_NODE:
+		set = nfsworker_nodes[id % nfsworker_nnodes];
+		break;
+	case NFSWORKER_CPU:
+		n = id % CPU_COUNT(&nfsworker_allowed);
+		for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+			if (CPU_ISSET(cpu, &nfsworker_allowed) && n-- == 0)
+				break;
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		break;
+	case NFSWORKER_LIST:
+		set = nfsworker_allowed;
+		break;
+	}
+	if (sched_setaffinity(0, sizeof(set), &set) < 0)
+		xlog(L_WARNING, "Unable to place worker %d: %m", id);
+	else
+		xlog(D_GENERAL, "Worker %d placed on %d CPUs", id,
+		     CPU_COUNT(&set));
+}
+
+/**
+ * nfsworker_start - place the calling thread and count its work
+ * @id: worker number, or -1 for the next one
+ *
+ * Called by each worker process or thread as it starts; a thread
+ * already started keeps its number.  Returns the worker number.
+ */
+int
+nfsworker_start(int id)
+{
+	char name[64], help[64];
+
+	if (nfsworker_id >= 0)
+		return nfsworker_id;
+	if (id < 0)
+		id = __atomic_fetch_add(&nfsworker_next, 1, __ATOMIC_RELAXED);
+	nfsworker_id = id;
+	nfsworker_place(id);
+
+	snprintf(name, sizeof(name), "worker%d_requests", id);
+	snprintf(help, sizeof(help), "Requests handled by worker %d", id);
+	nfsworker_requests = nfsmetric_counter(name, help);
+	snprintf(name, sizeof(name), "worker%d_busy_usecs", id);
+	snprintf(help, sizeof(help), "Microseconds worker %d was busy", id);
+	nfsworker_usecs = nfsmetric_counter(name, help);
+	return id;
+}
+
+/**
+ * nfsworker_clock - note when the calling worker starts on requests
+ *
+ * Returns a time stamp for nfsworker_busy(), or zero if the calling
+ * thread isn't a worker.
+ */
+unsigned long long
+nfsworker_clock(void)
+{
+	if (nfsworker_id < 0)
+		return 0;
+	return nfsmetric_clock();
+}
+
+/**
+ * nfsworker_busy - count requests the calling worker has handled
+ * @start: what nfsworker_clock() returned before them
+ * @items: how many there were
+ */
+void
+nfsworker_busy(unsigned long long start, unsigned int items)
+{
+	if (start == 0 || items == 0)
+		return;
+	nfsmetric_add(nfsworker_usecs, nfsmetric_clock() - start);
+	nfsmetric_add(nfsworker_requests, items);
+}
@@ -17,9 +17,56 @@
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <string.h>
+#include <ctype.h>
 #include "rpcmisc.h"
+#include "nfsmetrics.h"
 #include "xlog.h"
 
+/**
+ * rpc_proc_metric - find or register the latency histogram of a procedure
+ * @name: procedure name, as in a dispatch or rpcgen procedure table
+ * @vers: program version
+ *
+ * The metric is named rpc_<name>_v<vers>, in lower case.  Returns
+ * NULL if it could not be registered.
+ */
+struct nfsmetric *
+rpc_proc_metric(const char *name, int vers)
+{
+	char mname[64], help[128];
+	char *p;
+
+	snprintf(mname, sizeof(mname), "rpc_%s_v%d", name, vers);
+	for (p = mname; *p; p++)
+		*p = isalnum((unsigned char)*p) ? tolower((unsigned char)*p)
+						: '_';
+	snprintf(help, sizeof(help), "Time taken by version %d %s calls, in us",
+		 vers, name);
+	return nfsmetric_histogram(mname, help);
+}
+
+/**
+ * rpc_dispatch_metrics - time each procedure served by rpc_dispatch()
+ * @dtable: per-version dispatch tables
+ * @nvers: number of versions
+ *
+ * Call once, before the tables are used.
+ */
+void
+rpc_dispatch_metrics(struct rpc_dtable *dtable, int nvers)
+{
+	struct rpc_dentry *dent;
+	rpcproc_t proc;
+	int vers;
+
+	for (vers = 1; vers <= nvers; vers++, dtable++)
+		for (proc = 0; proc < dtable->nproc; proc++) {
+			dent = &dtable->entries[proc];
+			if (dent->func)
+				dent->metric = rpc_proc_metric(dent->name, vers);
+		}
+}
+
 void
 rpc_dispatch(struct svc_req *rqstp, SVCXPRT *transp,
 			struct rpc_dtable *dtable, int nvers,
@@ -27,6 +74,7 @@ rpc_dispatch(struct svc_req *rqstp, SVCXPRT *transp,
 {
 	struct rpc_dentry	*dent;
 	int rq_vers = (int)rqstp->rq_vers;
+	unsigned long long	start = 0;
 
 	if (rq_vers < 1 || rq_vers > nvers) {
 		svcerr_progvers(transp, 1, nvers);
@@ -50,12 +98,14 @@ rpc_dispatch(struct svc_req *rqstp, SVCXPRT *transp,
 		return;
 	}
 
+	if (dent->metric)
+		start = nfsmetric_clock();
 	memset(argp, 0, dent->xdr_arg_size);
 	memset(resp, 0, dent->xdr_res_size);
 
 	if (!svc_getargs(transp, dent->xdr_arg_fn, argp)) {
 		svcerr_decode(transp);
-		return;
+		goto out;
 	}
 
 	if ((dent->func)(rqstp, argp, resp) && resp != 0) {
@@ -66,4 +116,7 @@ rpc_dispatch(struct svc_req *rqstp, SVCXPRT *transp,
 		xlog(L_ERROR, "failed to free RPC arguments");
 		exit (2);
 	}
+out:
+	if (dent->metric)
+		nfsmetric_since(dent->metric, start);
 }
@@ -0,0 +1,166 @@
+/*
+ * support/nfs/strpool.c
+ *
+ * Reference counted pool of shared strings.
+ *
+ * Export entries for one path to many clients, and the entries
+ * copied from those when etab is re-read, carry the same path, uuid,
+ * mountpoint and fs locations strings.  dupexportent() takes these
+ * from the pool, so that each distinct string is stored once however
+ * many entries refer to it.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_LIBPTHREAD
+#include <pthread.h>
+#endif
+
+#include "nfslib.h"
+#include "xcommon.h"
+
+struct strpool_ent {
+	struct strpool_ent *	s_next;
+	unsigned int		s_refs;
+	uint32_t		s_hash;
+	char			s_str[];
+};
+
+#define STRPOOL_INIT	1024	/* initial hash buckets, a power of 2 */
+
+static struct strpool_ent **strpool_table;
+static unsigned int strpool_size;	/* buckets */
+static unsigned long strpool_count;	/* distinct strings */
+static unsigned long strpool_bytes;	/* memory they take */
+static unsigned long strpool_refs;	/* references to them */
+
+#ifdef HAVE_LIBPTHREAD
+static pthread_mutex_t	strpool_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define strpool_lock()		pthread_mutex_lock(&strpool_mutex)
+#define strpool_unlock()	pthread_mutex_unlock(&strpool_mutex)
+#else
+#define strpool_lock()		do { } while (0)
+#define strpool_unlock()	do { } while (0)
+#endif
+
+/* FNV-1a */
+static uint32_t strpool_hash(const char *s, size_t *lenp)
+{
+	const unsigned char *p = (const unsigned char *)s;
+	uint32_t h = 2166136261u;
+
+	for (; *p; p++)
+		h = (h ^ *p) * 16777619u;
+	*lenp = p - (const unsigned char *)s;
+	return h;
+}
+
+static void strpool_grow(void)
+{
+	unsigned int size = strpool_size ? strpool_size * 2 : STRPOOL_INIT;
+	struct strpool_ent **table, *se, *next;
+	unsigned int i;
+
+	table = xmalloc(size * sizeof(*table));
+	memset(table, 0, size * sizeof(*table));
+	for (i = 0; i < strpool_size; i++)
+		for (se = strpool_table[i]; se; se = next) {
+			next = se->s_next;
+			se->s_next = table[se->s_hash & (size - 1)];
+			table[se->s_hash & (size - 1)] = se;
+		}
+	free(strpool_table);
+	strpool_table = table;
+	strpool_size = size;
+}
+
+/**
+ * strpool_get - take a reference to the pooled copy of a string
+ * @s: NUL-terminated string, or NULL
+ *
+ * Returns the pooled copy, which must not be modified and is given
+ * back with strpool_put(), or NULL if @s is NULL.  Like xstrdup(),
+ * exits if memory runs out.
+ */
+char *strpool_get(const char *s)
+{
+	struct strpool_ent *se, **bucket;
+	uint32_t hash;
+	size_t len;
+
+	if (s == NULL)
+		return NULL;
+	hash = strpool_hash(s, &len);
+
+	strpool_lock();
+	if (strpool_count >= strpool_size)
+		strpool_grow();
+	bucket = &strpool_table[hash & (strpool_size - 1)];
+	for (se = *bucket; se; se = se->s_next)
+		if (se->s_hash == hash && strcmp(se->s_str, s) == 0)
+			break;
+	if (se == NULL) {
+		se = xmalloc(sizeof(*se) + len + 1);
+		memcpy(se->s_str, s, len + 1);
+		se->s_hash = hash;
+		se->s_refs = 0;
+		se->s_next = *bucket;
+		*bucket = se;
+		strpool_count++;
+		strpool_bytes += sizeof(*se) + len + 1;
+	}
+	se->s_refs++;
+	strpool_refs++;
+	strpool_unlock();
+	return se->s_str;
+}
+
+/**
+ * strpool_put - drop a reference taken with strpool_get()
+ * @s: pooled string, or NULL
+ *
+ * The string is freed when its last reference is dropped.
+ */
+void strpool_put(const char *s)
+{
+	struct strpool_ent *se, **sep;
+
+	if (s == NULL)
+		return;
+	se = (struct strpool_ent *)(s - offsetof(struct strpool_ent, s_str));
+
+	strpool_lock();
+	strpool_refs--;
+	if (--se->s_refs == 0) {
+		for (sep = &strpool_table[se->s_hash & (strpool_size - 1)];
+		     *sep != se; sep = &(*sep)->s_next)
+			;
+		*sep = se->s_next;
+		strpool_count--;
+		strpool_bytes -= sizeof(*se) + strlen(se->s_str) + 1;
+		free(se);
+	}
+	strpool_unlock();
+}
+
+/**
+ * strpool_stats - report the size of the string pool
+ * @count: filled in with the number of distinct strings
+ * @bytes: filled in with the memory they and the table take
+ * @refs: filled in with the number of references to them
+ */
+void strpool_stats(unsigned long *count, unsigned long *bytes,
+		   unsigned long *refs)
+{
+	strpool_lock();
+	*count = strpool_count;
+	*bytes = strpool_bytes + strpool_size * sizeof(*strpool_table);
+	*refs = strpool_refs;
+	strpool_unlock();
+}
@@ -28,7 +28,13 @@
 #include <signal.h>
 #include <unistd.h>
 #include <errno.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <poll.h>
+#include <time.h>
 #include <netdb.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
 #include "nfslib.h"
 
 #include <netinet/in.h>
@@ -46,6 +52,8 @@
 #include "sockaddr.h"
 #include "rpcmisc.h"
 #include "xlog.h"
+#include "xepoll.h"
+#include "nfsmetrics.h"
 
 #ifdef HAVE_LIBTIRPC
 
@@ -523,3 +531,433 @@ nfs_svc_unregister(const rpcprog_t program, const rpcvers_t version)
 }
 
 #endif	/* !HAVE_LIBTIRPC */
+
+/*
+ * The RPC transports are followed through svc_pollfd, which, unlike
+ * svc_fdset, is not limited to FD_SETSIZE descriptors.  The library
+ * only changes it while a request is being handled, so after each
+ * request the slot of the transport that was served is checked, and
+ * the whole array only after a new connection has been accepted.
+ *
+ * The library keeps a connection until its peer closes it.  To bound
+ * them, a connection that has carried no request for the idle timeout
+ * is shut down, and while the maximum number of connections is open
+ * the listeners are not watched, leaving new connections in the
+ * kernel's accept backlog.  A connection that is shut down reads as
+ * closed, so the library still destroys its transport itself.
+ */
+
+enum svc_epoll_kind {
+	SVC_EPOLL_DGRAM,
+	SVC_EPOLL_LISTEN,
+	SVC_EPOLL_CONN,
+};
+
+struct svc_epoll_slot {
+	int			fd;	/* svc_pollfd[].fd as last seen */
+	enum svc_epoll_kind	kind;
+	time_t			last;	/* of the last request */
+	_Bool			busy;	/* being served by another thread */
+};
+
+/*
+ * Requests can be served by other threads, see nfs_svc_epoll_offload().
+ * A transport isn't watched while one of its requests is served, so
+ * only one thread at a time reads from it.  The thread then hands its
+ * slot back to the event loop, which watches the transport again, or
+ * notices that the library has destroyed it meanwhile.
+ */
+struct svc_epoll_work {
+	struct svc_epoll_work *	next;
+	int			slot;
+	int			fd;
+	enum svc_epoll_kind	kind;
+};
+
+static nfs_svc_queue_t		svc_epoll_queue;
+static int			svc_epoll_donefd = -1;
+static struct svc_epoll_work *	svc_epoll_done;
+static pthread_mutex_t		svc_epoll_done_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct svc_epoll_slot *	svc_epoll_slots;
+static int			svc_epoll_size;
+static unsigned int		svc_epoll_conns, svc_epoll_maxconns;
+static unsigned int		svc_epoll_idle;
+static _Bool			svc_epoll_paused;
+
+static struct nfsmetric *svc_epoll_accepted, *svc_epoll_closed;
+static struct nfsmetric *svc_epoll_reaped, *svc_epoll_throttled;
+static struct nfsmetric *svc_epoll_dgram_wakeups, *svc_epoll_dgrams;
+
+/*
+ * The library reads one datagram each time it is called, so a burst of
+ * UDP requests would otherwise cost an epoll wakeup per request.  The
+ * requests already queued on a datagram transport are served together,
+ * up to this many, before the event loop moves on.  The average batch
+ * is rpc_udp_requests / rpc_udp_wakeups.
+ */
+#define SVC_EPOLL_DGRAM_BATCH	32
+
+static void	svc_epoll_event(int fd, void *data);
+static void	svc_epoll_listen_event(int fd, void *data);
+
+static time_t
+svc_epoll_now(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+	return now.tv_sec;
+}
+
+/*
+ * Start or stop watching the listeners, as the number of connections
+ * crosses the maximum.
+ */
+static void
+svc_epoll_throttle(void)
+{
+	_Bool full = svc_epoll_maxconns != 0 &&
+			svc_epoll_conns >= svc_epoll_maxconns;
+	int slot, fd;
+
+	if (full == svc_epoll_paused)
+		return;
+	svc_epoll_paused = full;
+	if (full) {
+		xlog(D_GENERAL, "%u connections open, not accepting more",
+			svc_epoll_conns);
+		nfsmetric_add(svc_epoll_throttled, 1);
+	}
+
+	for (slot = 0; slot < svc_epoll_size; slot++) {
+		fd = svc_epoll_slots[slot].fd;
+		if (fd < 0 || svc_epoll_slots[slot].kind != SVC_EPOLL_LISTEN)
+			continue;
+		if (full)
+			xepoll_del(fd);
+		else
+			(void)xepoll_add(fd, svc_epoll_listen_event,
+					 (void *)(intptr_t)slot);
+	}
+}
+
+/*
+ * Stop watching the transport last seen in svc_pollfd[@slot], unless
+ * its descriptor has since been taken over by another slot.
+ */
+static void
+svc_epoll_forget(int slot)
+{
+	int fd = svc_epoll_slots[slot].fd;
+	xepoll_handler_t handler;
+	void *data;
+
+	svc_epoll_slots[slot].fd = -1;
+	if (svc_epoll_slots[slot].kind == SVC_EPOLL_CONN) {
+		svc_epoll_conns--;
+		nfsmetric_add(svc_epoll_closed, 1);
+	}
+
+	handler = xepoll_handler(fd, &data);
+	if (handler != svc_epoll_event && handler != svc_epoll_listen_event)
+		return;
+	if (data != (void *)(intptr_t)slot)
+		return;
+	xepoll_del(fd);
+}
+
+static void
+svc_epoll_watch(int slot, int fd)
+{
+	struct svc_epoll_slot *sp = &svc_epoll_slots[slot];
+	xepoll_handler_t handler = svc_epoll_event;
+	int type = SOCK_DGRAM, listening = 0;
+	socklen_t len;
+
+	len = sizeof(type);
+	(void)getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &len);
+	len = sizeof(listening);
+	(void)getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &len);
+
+	/* Serving a listener can add transports; nothing else can */
+	if (listening) {
+		sp->kind = SVC_EPOLL_LISTEN;
+		handler = svc_epoll_listen_event;
+	} else if (type == SOCK_STREAM)
+		sp->kind = SVC_EPOLL_CONN;
+	else
+		sp->kind = SVC_EPOLL_DGRAM;
+
+	if (sp->kind != SVC_EPOLL_LISTEN || !svc_epoll_paused)
+		if (xepoll_add(fd, handler, (void *)(intptr_t)slot) < 0)
+			return;
+	sp->fd = fd;
+	sp->last = svc_epoll_now();
+	if (sp->kind == SVC_EPOLL_CONN) {
+		svc_epoll_conns++;
+		nfsmetric_add(svc_epoll_accepted, 1);
+	}
+}
+
+/**
+ * nfs_svc_epoll_sync - bring the watched RPC transports up to date
+ *
+ * Compares svc_pollfd with what was last seen, and watches or stops
+ * watching transports to match.  Called by the event loop itself as
+ * needed; a daemon only calls it after it creates or destroys
+ * transports outside the loop.
+ */
+void
+nfs_svc_epoll_sync(void)
+{
+	int slot, fd;
+
+	if (svc_max_pollfd > svc_epoll_size) {
+		struct svc_epoll_slot *new;
+
+		new = realloc(svc_epoll_slots, svc_max_pollfd * sizeof(*new));
+		if (new == NULL) {
+			xlog(L_ERROR, "%s: no memory to watch RPC transports",
+				__func__);
+			return;
+		}
+		for (slot = svc_epoll_size; slot < svc_max_pollfd; slot++) {
+			new[slot].fd = -1;
+			new[slot].busy = false;
+		}
+		svc_epoll_slots = new;
+		svc_epoll_size = svc_max_pollfd;
+	}
+
+	for (slot = 0; slot < svc_epoll_size; slot++) {
+		fd = slot < svc_max_pollfd ? svc_pollfd[slot].fd : -1;
+		if (fd == svc_epoll_slots[slot].fd || svc_epoll_slots[slot].busy)
+			continue;
+		if (svc_epoll_slots[slot].fd >= 0)
+			svc_epoll_forget(slot);
+		if (fd >= 0)
+			svc_epoll_watch(slot, fd);
+	}
+	svc_epoll_throttle();
+}
+
+/*
+ * Serve the request waiting on @fd, and on a datagram transport those
+ * queued behind it.  Only the thread serving a transport reads from
+ * it, so a datagram seen here is still there for the library.
+ */
+static void
+svc_epoll_getreq(int fd, enum svc_epoll_kind kind)
+{
+	unsigned int count = 1;
+	char byte;
+
+	svc_getreq_common(fd);
+	if (kind != SVC_EPOLL_DGRAM)
+		return;
+
+	/* Datagram transports live as long as the daemon */
+	while (count < SVC_EPOLL_DGRAM_BATCH &&
+	       recv(fd, &byte, sizeof(byte), MSG_PEEK | MSG_DONTWAIT) >= 0) {
+		svc_getreq_common(fd);
+		count++;
+	}
+	nfsmetric_add(svc_epoll_dgram_wakeups, 1);
+	nfsmetric_add(svc_epoll_dgrams, count);
+}
+
+/* Serve a request in another thread, and hand the slot back */
+static void
+svc_epoll_serve(void *data)
+{
+	struct svc_epoll_work *w = data;
+	uint64_t one = 1;
+
+	svc_epoll_getreq(w->fd, w->kind);
+
+	pthread_mutex_lock(&svc_epoll_done_lock);
+	w->next = svc_epoll_done;
+	svc_epoll_done = w;
+	pthread_mutex_unlock(&svc_epoll_done_lock);
+	if (write(svc_epoll_donefd, &one, sizeof(one)) < 0)
+		xlog(L_ERROR, "%s: can't wake the event loop: %m", __func__);
+}
+
+static void
+svc_epoll_done_event(int fd, void *UNUSED(data))
+{
+	struct svc_epoll_work *w, *next;
+	_Bool gone = false;
+	uint64_t count;
+
+	if (read(fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+		return;
+	pthread_mutex_lock(&svc_epoll_done_lock);
+	w = svc_epoll_done;
+	svc_epoll_done = NULL;
+	pthread_mutex_unlock(&svc_epoll_done_lock);
+
+	for (; w; w = next) {
+		next = w->next;
+		svc_epoll_slots[w->slot].busy = false;
+		if (w->slot < svc_max_pollfd &&
+		    svc_pollfd[w->slot].fd == w->fd) {
+			if (xepoll_add(w->fd, svc_epoll_event,
+				       (void *)(intptr_t)w->slot) < 0)
+				xlog(L_ERROR, "%s: can't watch transport: %m",
+				     __func__);
+		} else {
+			svc_epoll_forget(w->slot);
+			gone = true;
+		}
+		free(w);
+	}
+	/* a new transport may have taken a slot that was busy */
+	if (gone)
+		nfs_svc_epoll_sync();
+}
+
+/* Returns true if the request on @fd was queued for another thread */
+static _Bool
+svc_epoll_offload(int slot, int fd)
+{
+	struct svc_epoll_work *w;
+
+	if (!svc_epoll_queue || svc_epoll_slots[slot].kind == SVC_EPOLL_LISTEN)
+		return false;
+	w = malloc(sizeof(*w));
+	if (w == NULL)
+		return false;
+	w->slot = slot;
+	w->fd = fd;
+	w->kind = svc_epoll_slots[slot].kind;
+	xepoll_del(fd);
+	svc_epoll_slots[slot].busy = true;
+	if (svc_epoll_queue(svc_epoll_serve, w) == 0)
+		return true;
+	svc_epoll_slots[slot].busy = false;
+	(void)xepoll_add(fd, svc_epoll_event, (void *)(intptr_t)slot);
+	free(w);
+	return false;
+}
+
+static void
+svc_epoll_event(int fd, void *data)
+{
+	int slot = (intptr_t)data;
+
+	svc_epoll_slots[slot].last = svc_epoll_now();
+	if (svc_epoll_offload(slot, fd))
+		return;
+	svc_epoll_getreq(fd, svc_epoll_slots[slot].kind);
+
+	/* The transport is unregistered before it is closed */
+	if (slot >= svc_max_pollfd || svc_pollfd[slot].fd != fd) {
+		svc_epoll_forget(slot);
+		svc_epoll_throttle();
+	}
+}
+
+static void
+svc_epoll_listen_event(int fd, void *UNUSED(data))
+{
+	svc_getreq_common(fd);
+	nfs_svc_epoll_sync();
+}
+
+/*
+ * Shut down the connections that have been idle for too long.
+ */
+static void
+svc_epoll_reap(int UNUSED(fd), void *UNUSED(data))
+{
+	time_t now = svc_epoll_now();
+	struct svc_epoll_slot *sp;
+	int slot;
+
+	for (slot = 0; slot < svc_epoll_size; slot++) {
+		sp = &svc_epoll_slots[slot];
+		if (sp->fd < 0 || sp->kind != SVC_EPOLL_CONN)
+			continue;
+		if (now - sp->last < (time_t)svc_epoll_idle)
+			continue;
+		xlog(D_CALL, "Closing RPC connection idle for %lds",
+			(long)(now - sp->last));
+		if (shutdown(sp->fd, SHUT_RDWR) == 0)
+			nfsmetric_add(svc_epoll_reaped, 1);
+		/* Don't shut it down again before the library notices */
+		sp->last = now;
+	}
+}
+
+/**
+ * nfs_svc_epoll_offload - serve RPC requests in other threads
+ * @queue: runs fn(data) in another thread, returning 0, or -1 if it
+ *	can't, in which case the request is served in the event loop
+ *
+ * Call after nfs_svc_epoll_init().  Requests on different transports
+ * may then be served at once, so the daemon's dispatch routines must
+ * be thread safe.  New connections are still accepted by the event
+ * loop.  Returns zero on success, or -1 with errno set.
+ */
+int
+nfs_svc_epoll_offload(nfs_svc_queue_t queue)
+{
+	if (svc_epoll_donefd < 0) {
+		svc_epoll_donefd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+		if (svc_epoll_donefd < 0)
+			return -1;
+		if (xepoll_add(svc_epoll_donefd, svc_epoll_done_event,
+			       NULL) < 0) {
+			close(svc_epoll_donefd);
+			svc_epoll_donefd = -1;
+			return -1;
+		}
+	}
+	svc_epoll_queue = queue;
+	return 0;
+}
+
+/**
+ * nfs_svc_epoll_init - serve RPC requests from the event loop
+ * @maxconns: most connections to keep open at once, or zero for no limit
+ * @idle: seconds a connection may stay idle, or zero to keep it
+ *
+ * Watches every RPC transport the daemon has created, and from then
+ * on follows transports as connections come and go.  Returns zero on
+ * success, or -1 with errno set.
+ */
+int
+nfs_svc_epoll_init(int maxconns, int idle)
+{
+	static _Bool registered;
+
+	if (xepoll_init() < 0)
+		return -1;
+
+	if (!registered) {
+		registered = true;
+		svc_epoll_accepted = nfsmetric_counter("rpc_connections_accepted",
+				"RPC connections accepted");
+		svc_epoll_closed = nfsmetric_counter("rpc_connections_closed",
+				"RPC connections closed");
+		svc_epoll_reaped = nfsmetric_counter("rpc_connections_reaped",
+				"Idle RPC connections shut down");
+		svc_epoll_throttled = nfsmetric_counter("rpc_accept_throttled",
+				"Times accepting stopped at the connection limit");
+		svc_epoll_dgram_wakeups = nfsmetric_counter("rpc_udp_wakeups",
+				"Times UDP requests were found waiting");
+		svc_epoll_dgrams = nfsmetric_counter("rpc_udp_requests",
+				"UDP requests served");
+
+		svc_epoll_idle = idle > 0 ? idle : 0;
+		if (svc_epoll_idle != 0 &&
+		    xepoll_add_timer(idle < 8 ? 1000 : svc_epoll_idle * 125,
+				     svc_epoll_reap, NULL) < 0)
+			xlog(L_WARNING, "Unable to start idle connection timer: %m");
+	}
+	svc_epoll_maxconns = maxconns > 0 ? maxconns : 0;
+	nfs_svc_epoll_sync();
+	return 0;
+}
@@ -0,0 +1,283 @@
+/*
+ * support/nfs/xepoll.c
+ *
+ * Minimal epoll based event loop.
+ *
+ * Descriptors are registered once with xepoll_add() and stay in the
+ * kernel's interest list until xepoll_del() is called, so a wakeup
+ * only costs work proportional to the number of descriptors that are
+ * actually ready.  Handlers are kept in a table indexed by descriptor,
+ * which lets a handler safely remove other descriptors (or itself)
+ * while a batch of events is being dispatched.
+ *
+ * The RPC transports of a daemon are added by nfs_svc_epoll_init(),
+ * in svc_create.c.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+
+#include "nfsworker.h"
+#include "xepoll.h"
+#include "xlog.h"
+
+/* Number of ready descriptors fetched per epoll_wait() */
+#define XEPOLL_MAX_EVENTS	64
+
+struct xepoll_entry {
+	xepoll_handler_t	handler;
+	void *			data;
+};
+
+static int			xepoll_fd = -1;
+static struct xepoll_entry *	xepoll_table;
+static int			xepoll_table_size;
+
+struct xepoll_timer {
+	xepoll_handler_t	handler;
+	void *			data;
+};
+
+/**
+ * xepoll_init - create the epoll instance
+ *
+ * Returns zero on success, or -1 with errno set.  Calling it again
+ * once the instance exists is harmless.
+ */
+int
+xepoll_init(void)
+{
+	if (xepoll_fd >= 0)
+		return 0;
+	xepoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (xepoll_fd < 0) {
+		xlog(L_ERROR, "%s: epoll_create1: %m", __func__);
+		return -1;
+	}
+	return 0;
+}
+
+static int
+xepoll_grow(int fd)
+{
+	struct xepoll_entry *new;
+	int size = xepoll_table_size ? xepoll_table_size : 64;
+
+	while (size <= fd)
+		size *= 2;
+	new = realloc(xepoll_table, size * sizeof(*new));
+	if (new == NULL)
+		return -1;
+	memset(new + xepoll_table_size, 0,
+	       (size - xepoll_table_size) * sizeof(*new));
+	xepoll_table = new;
+	xepoll_table_size = size;
+	return 0;
+}
+
+/**
+ * xepoll_add - watch @fd for readability
+ * @fd: descriptor to watch
+ * @handler: called each time @fd is readable
+ * @data: opaque argument passed to @handler
+ *
+ * Returns zero on success, or -1 with errno set.
+ */
+int
+xepoll_add(int fd, xepoll_handler_t handler, void *data)
+{
+	struct epoll_event ev;
+
+	if (fd < 0 || handler == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (xepoll_init() < 0)
+		return -1;
+	if (fd >= xepoll_table_size && xepoll_grow(fd) < 0)
+		return -1;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = fd;
+	/* A descriptor closed without xepoll_del() has left the kernel's
+	 * interest list, and must be added again if its number is reused */
+	if ((!xepoll_table[fd].handler ||
+	     epoll_ctl(xepoll_fd, EPOLL_CTL_MOD, fd, &ev) < 0) &&
+	    epoll_ctl(xepoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		xlog(L_ERROR, "%s: epoll_ctl(%d): %m", __func__, fd);
+		return -1;
+	}
+	xepoll_table[fd].handler = handler;
+	xepoll_table[fd].data = data;
+	return 0;
+}
+
+/**
+ * xepoll_del - stop watching @fd
+ * @fd: descriptor previously passed to xepoll_add()
+ *
+ * Must be called before @fd is closed if it might be reused while
+ * events for it are still being dispatched.
+ */
+void
+xepoll_del(int fd)
+{
+	if (!xepoll_registered(fd))
+		return;
+	/* The descriptor may already be closed, which removes it from
+	 * the interest list anyway, so ignore errors here. */
+	epoll_ctl(xepoll_fd, EPOLL_CTL_DEL, fd, NULL);
+	xepoll_table[fd].handler = NULL;
+	xepoll_table[fd].data = NULL;
+}
+
+/**
+ * xepoll_registered - check whether @fd is being watched
+ * @fd: descriptor to check
+ */
+int
+xepoll_registered(int fd)
+{
+	return fd >= 0 && fd < xepoll_table_size &&
+		xepoll_table[fd].handler != NULL;
+}
+
+/**
+ * xepoll_handler - look up the handler watching @fd
+ * @fd: descriptor to look up
+ * @data: OUT: opaque argument passed to the handler, if not NULL
+ *
+ * Returns NULL if @fd is not being watched.
+ */
+xepoll_handler_t
+xepoll_handler(int fd, void **data)
+{
+	if (!xepoll_registered(fd))
+		return NULL;
+	if (data != NULL)
+		*data = xepoll_table[fd].data;
+	return xepoll_table[fd].handler;
+}
+
+/**
+ * xepoll_wait - wait for events and dispatch them
+ * @timeout: in milliseconds, or -1 to wait indefinitely
+ *
+ * Returns the number of handlers invoked, zero on timeout or signal,
+ * or -1 with errno set on failure.
+ */
+int
+xepoll_wait(int timeout)
+{
+	struct epoll_event events[XEPOLL_MAX_EVENTS];
+	unsigned long long start;
+	int i, n, cnt = 0;
+
+	if (xepoll_init() < 0)
+		return -1;
+
+	n = epoll_wait(xepoll_fd, events, XEPOLL_MAX_EVENTS, timeout);
+	if (n < 0) {
+		if (errno == EINTR)
+			return 0;
+		return -1;
+	}
+
+	start = nfsworker_clock();
+	for (i = 0; i < n; i++) {
+		int fd = events[i].data.fd;
+
+		/* An earlier handler in this batch may have dropped it */
+		if (!xepoll_registered(fd))
+			continue;
+		xepoll_table[fd].handler(fd, xepoll_table[fd].data);
+		cnt++;
+	}
+	nfsworker_busy(start, cnt);
+	return cnt;
+}
+
+/**
+ * xepoll_ready - check whether any watched descriptor is ready
+ *
+ * Returns 1 if xepoll_wait() would dispatch an event without waiting,
+ * otherwise zero.  Nothing is dispatched.
+ */
+int
+xepoll_ready(void)
+{
+	struct pollfd pfd;
+
+	if (xepoll_fd < 0)
+		return 0;
+	pfd.fd = xepoll_fd;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	return poll(&pfd, 1, 0) > 0;
+}
+
+static void
+xepoll_timer_event(int fd, void *data)
+{
+	struct xepoll_timer *timer = data;
+	uint64_t expirations;
+
+	if (read(fd, &expirations, sizeof(expirations)) < 0)
+		return;
+	timer->handler(fd, timer->data);
+}
+
+/**
+ * xepoll_add_timer - call a handler periodically
+ * @msecs: interval between calls, in milliseconds
+ * @handler: called each time the interval has passed
+ * @data: opaque argument passed to @handler
+ *
+ * Expirations missed while the daemon was busy are folded into a
+ * single call.  Returns the timer's descriptor, or -1 with errno set.
+ */
+int
+xepoll_add_timer(unsigned int msecs, xepoll_handler_t handler, void *data)
+{
+	struct itimerspec its;
+	struct xepoll_timer *timer;
+	int fd;
+
+	if (msecs == 0 || handler == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	timer = malloc(sizeof(*timer));
+	if (timer == NULL)
+		return -1;
+	timer->handler = handler;
+	timer->data = data;
+
+	fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (fd < 0)
+		goto out_free;
+	its.it_interval.tv_sec = msecs / 1000;
+	its.it_interval.tv_nsec = (msecs % 1000) * 1000000;
+	its.it_value = its.it_interval;
+	if (timerfd_settime(fd, 0, &its, NULL) < 0 ||
+	    xepoll_add(fd, xepoll_timer_event, timer) < 0) {
+		close(fd);
+		goto out_free;
+	}
+	return fd;
+
+out_free:
+	free(timer);
+	return -1;
+}
@@ -22,6 +22,29 @@
 #include "xlog.h"
 #include "xio.h"
 
+/*
+ * A file opened for reading is read into memory in one go, and parsed
+ * from there, so that getting each character costs no more than an
+ * index into the buffer.
+ */
+static int
+xreadall(XFILE *xfp, FILE *fp)
+{
+	size_t	size = 0, n;
+
+	for (;;) {
+		if (xfp->x_len == size) {
+			size = size ? size * 2 : 8192;
+			xfp->x_buf = xrealloc(xfp->x_buf, size);
+		}
+		n = fread(xfp->x_buf + xfp->x_len, 1, size - xfp->x_len, fp);
+		if (n == 0)
+			break;
+		xfp->x_len += n;
+	}
+	return ferror(fp) ? -1 : 0;
+}
+
 XFILE *
 xfopen(char *fname, char *type)
 {
@@ -31,19 +54,80 @@ xfopen(char *fname, char *type)
 	if (!(fp = fopen(fname, type)))
 		return NULL;
 	xfp = (XFILE *) xmalloc(sizeof(*xfp));
+	memset(xfp, 0, sizeof(*xfp));
 	xfp->x_fp = fp;
 	xfp->x_line = 1;
+	xfp->x_back = EOF;
 
+	if (strcmp(type, "r") == 0) {
+		if (xreadall(xfp, fp) < 0) {
+			fclose(fp);
+			xfree(xfp->x_buf);
+			xfree(xfp);
+			return NULL;
+		}
+		fclose(fp);
+		xfp->x_fp = NULL;
+	}
+	return xfp;
+}
+
+/* Parse @len bytes of @buf as if they were read from a file */
+XFILE *
+xfopenbuf(const char *buf, size_t len)
+{
+	XFILE	*xfp;
+
+	xfp = (XFILE *) xmalloc(sizeof(*xfp));
+	memset(xfp, 0, sizeof(*xfp));
+	xfp->x_line = 1;
+	xfp->x_back = EOF;
+	xfp->x_buf = xmalloc(len ? len : 1);
+	memcpy(xfp->x_buf, buf, len);
+	xfp->x_len = len;
 	return xfp;
 }
 
 void
 xfclose(XFILE *xfp)
 {
-	fclose(xfp->x_fp);
+	if (xfp->x_fp)
+		fclose(xfp->x_fp);
+	xfree(xfp->x_buf);
 	xfree(xfp);
 }
 
+/* Like getc() and ungetc(), for a file opened for reading */
+static inline int
+xrawgetc(XFILE *xfp)
+{
+	int	c = xfp->x_back;
+
+	if (c != EOF) {
+		xfp->x_back = EOF;
+		return c;
+	}
+	if (xfp->x_pos >= xfp->x_len)
+		return EOF;
+	return (unsigned char)xfp->x_buf[xfp->x_pos++];
+}
+
+static inline int
+xpeekc(XFILE *xfp)
+{
+	if (xfp->x_back != EOF)
+		return xfp->x_back;
+	if (xfp->x_pos >= xfp->x_len)
+		return EOF;
+	return (unsigned char)xfp->x_buf[xfp->x_pos];
+}
+
+static inline void
+xrawungetc(int c, XFILE *xfp)
+{
+	xfp->x_back = c;
+}
+
 int
 xflock(char *fname, char *type)
 {
@@ -78,6 +162,49 @@ xfunlock(int fd)
 }
 
 #define isoctal(x) (isdigit(x) && ((x)<'8'))
+
+/*
+ * If the backslash just read starts an escape of three octal digits
+ * for a value below 256, take the escape and put the value in @c.
+ */
+static inline int
+xgetoctal(XFILE *xfp, int *c)
+{
+	const char	*p = xfp->x_buf + xfp->x_pos;
+	int		val;
+
+	if (xfp->x_back != EOF || xfp->x_len - xfp->x_pos < 3 ||
+	    !isoctal(p[0]) || !isoctal(p[1]) || !isoctal(p[2]))
+		return 0;
+	val = (p[0] - '0') << 6 | (p[1] - '0') << 3 | (p[2] - '0');
+	if (val >= 256)
+		return 0;
+	xfp->x_pos += 3;
+	*c = val;
+	return 1;
+}
+
+static inline int
+xnextc(XFILE *xfp)
+{
+	int	c = xrawgetc(xfp);
+
+	if (c == EOF)
+		return c;
+	if (c == '\\') {
+		if (xpeekc(xfp) != '\n')
+			return '\\';
+		xrawgetc(xfp);
+		xfp->x_line++;
+		while ((c = xrawgetc(xfp)) == ' ' || c == '\t');
+		xrawungetc(c, xfp);
+		return ' ';
+	}
+	if (c == '\n')
+		xfp->x_line++;
+	return c;
+}
+
 int
 xgettok(XFILE *xfp, char sepa, char *tok, int len)
 {
@@ -85,23 +212,15 @@ xgettok(XFILE *xfp, char sepa, char *tok, int len)
 	int	c = 0;
 	int 	quoted=0;
 
-	while (i < len && (c = xgetc(xfp)) != EOF &&
+	while (i < len && (c = xnextc(xfp)) != EOF &&
 	       (quoted || (c != sepa && !isspace(c)))) {
 		if (c == '"') {
 			quoted = !quoted;
 			continue;
 		}
+		if (c == '\\')
+			xgetoctal(xfp, &c);
 		tok[i++] = c;
-		if (i >= 4 &&
-		    tok[i-4] == '\\' &&
-		    isoctal(tok[i-3]) &&
-		    isoctal(tok[i-2]) &&
-		    isoctal(tok[i-1]) &&
-		    ((tok[i]=0),
-		     (c = strtol(tok+i-3,NULL, 8)) < 256)) {
-			i -= 4;
-			tok[i++] = c;
-		}
 	}	
 	if (c == '\n')
 		xungetc(c, xfp);
@@ -116,23 +235,7 @@ xgettok(XFILE *xfp, char sepa, char *tok, int len)
 int
 xgetc(XFILE *xfp)
 {
-	int	c = getc(xfp->x_fp);
-
-	if (c == EOF)
-		return c;
-	if (c == '\\') {
-		if ((c = getc(xfp->x_fp)) != '\n') {
-			ungetc(c, xfp->x_fp);
-			return '\\';
-		}
-		xfp->x_line++;
-		while ((c = getc(xfp->x_fp)) == ' ' || c == '\t');
-		ungetc(c, xfp->x_fp);
-		return ' ';
-	}
-	if (c == '\n')
-		xfp->x_line++;
-	return c;
+	return xnextc(xfp);
 }
 
 void
@@ -141,7 +244,7 @@ xungetc(int c, XFILE *xfp)
 	if (c == EOF)
 		return;
 
-	ungetc(c, xfp->x_fp);
+	xrawungetc(c, xfp);
 	if (c == '\n')
 		xfp->x_line--;
 }
@@ -151,7 +254,7 @@ xskip(XFILE *xfp, char *str)
 {
 	int	c;
 
-	while ((c = xgetc(xfp)) != EOF) {
+	while ((c = xnextc(xfp)) != EOF) {
 		if (c == '#')
 			c = xskipcomment(xfp);
 		if (strchr(str, c) == NULL)
@@ -165,6 +268,6 @@ xskipcomment(XFILE *xfp)
 {
 	int	c;
 
-	while ((c = getc(xfp->x_fp)) != EOF && c != '\n');
+	while ((c = xrawgetc(xfp)) != EOF && c != '\n');
 	return c;
 }
@@ -28,6 +28,10 @@
 #include <stdarg.h>
 #include <syslog.h>
 #include <errno.h>
+#ifdef HAVE_LIBPTHREAD
+#include <pthread.h>
+#include <semaphore.h>
+#endif
 #include "nfslib.h"
 #include "conffile.h"
 
@@ -43,6 +47,7 @@ static char log_name[256];		/* name of this program		*/
 static int  log_pid = -1;		/* PID of this program		*/
 
 int export_errno = 0;
+int xlog_debug_mask = 0;
 
 static void	xlog_toggle(int sig);
 static struct xlog_debugfac	debugnames[] = {
@@ -54,6 +59,12 @@ static struct xlog_debugfac	debugnames[] = {
 	{ NULL,		0, },
 };
 
+static void
+xlog_update_mask(void)
+{
+	xlog_debug_mask = logging ? logmask : 0;
+}
+
 void
 xlog_open(char *progname)
 {
@@ -88,10 +99,12 @@ xlog_toggle(int sig)
 		if ((logmask & D_ALL) && !logging) {
 			xlog(D_GENERAL, "turned on logging");
 			logging = 1;
+			xlog_update_mask();
 			return;
 		}
 		tmp = ~logmask;
 		logmask |= ((logmask & D_ALL) << 1) | D_GENERAL;
+		xlog_update_mask();
 		for (i = -1, tmp &= logmask; tmp; tmp >>= 1, i++)
 			if (tmp & 1)
 				xlog(D_GENERAL,
@@ -99,6 +112,7 @@ xlog_toggle(int sig)
 	} else {
 		xlog(D_GENERAL, "turned off logging");
 		logging = 0;
+		xlog_update_mask();
 	}
 	signal(sig, xlog_toggle);
 }
@@ -112,6 +126,7 @@ xlog_config(int fac, int on)
 		logmask &= ~fac;
 	if (on)
 		logging = 1;
+	xlog_update_mask();
 }
 
 void
@@ -134,6 +149,7 @@ xlog_set_debug(char *service)
 	struct conf_list *kinds;
 	struct conf_list_node *n;
 
+	xlog_set_async(service);
 	kinds = conf_get_list(service, "debug");
 	if (!kinds || !kinds->cnt) {
 		free(kinds);
@@ -145,12 +161,316 @@ xlog_set_debug(char *service)
 	conf_free_list(kinds);
 }
 
-int
-xlog_enabled(int fac)
+
+#ifdef HAVE_LIBPTHREAD
+/*
+ * In asynchronous mode, a message is formatted straight into a slot
+ * of a ring and a single thread writes it out, so logging never waits
+ * for stderr or syslog.  Slots are claimed with a compare-and-swap on
+ * a sequence number, as in support/misc/workqueue.c.  A message that
+ * finds the ring full is counted and dropped, and the drain thread
+ * reports the count.  Each message site, known by its format string,
+ * may log XLOG_RATE_BURST messages every XLOG_RATE_INTERVAL seconds;
+ * the rest are counted and reported when the next interval starts.
+ *
+ * Programs not linked with libpthread see null thread functions and
+ * keep logging synchronously.
+ */
+#pragma weak pthread_create
+#pragma weak pthread_detach
+#pragma weak sem_init
+#pragma weak sem_post
+#pragma weak sem_wait
+
+#define XLOG_RING		256	/* a power of two */
+#define XLOG_MSG_MAX		512
+#define XLOG_RATE_SITES		256
+#define XLOG_RATE_BURST		100
+#define XLOG_RATE_INTERVAL	5
+
+struct xlog_slot {
+	unsigned long	seq;
+	int		kind;
+	char		text[XLOG_MSG_MAX];
+};
+
+struct xlog_rate {
+	const char *	fmt;
+	time_t		start;
+	unsigned int	count;
+	unsigned int	suppressed;
+};
+
+static struct xlog_slot *xlog_ring;
+static unsigned long xlog_head, xlog_tail;
+static unsigned long xlog_dropped;
+static struct xlog_rate xlog_rates[XLOG_RATE_SITES];
+static int xlog_async_on;
+static pid_t xlog_async_pid;	/* process the drain thread runs in */
+static int xlog_sleeping;
+static sem_t xlog_wake;
+
+static void	xlog_emit(int kind, const char *msg);
+
+static struct xlog_slot *
+xlog_claim(void)
+{
+	unsigned long pos, seq;
+	struct xlog_slot *slot;
+	long dif;
+
+	pos = __atomic_load_n(&xlog_head, __ATOMIC_RELAXED);
+	for (;;) {
+		slot = &xlog_ring[pos & (XLOG_RING - 1)];
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		dif = (long)(seq - pos);
+		if (dif == 0) {
+			if (__atomic_compare_exchange_n(&xlog_head, &pos,
+					pos + 1, 1, __ATOMIC_RELAXED,
+					__ATOMIC_RELAXED))
+				return slot;
+		} else if (dif < 0)
+			return NULL;
+		else
+			pos = __atomic_load_n(&xlog_head, __ATOMIC_RELAXED);
+	}
+}
+
+static void
+xlog_publish(struct xlog_slot *slot)
+{
+	__atomic_store_n(&slot->seq, (slot->seq + 1), __ATOMIC_RELEASE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_exchange_n(&xlog_sleeping, 0, __ATOMIC_SEQ_CST))
+		sem_post(&xlog_wake);
+}
+
+/* Only the drain thread takes slots off the ring */
+static struct xlog_slot *
+xlog_next(void)
+{
+	struct xlog_slot *slot = &xlog_ring[xlog_tail & (XLOG_RING - 1)];
+
+	if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != xlog_tail + 1)
+		return NULL;
+	return slot;
+}
+
+static void
+xlog_release(struct xlog_slot *slot)
+{
+	__atomic_store_n(&slot->seq, xlog_tail + XLOG_RING, __ATOMIC_RELEASE);
+	xlog_tail++;
+}
+
+static void
+xlog_drain(void)
+{
+	struct xlog_slot *slot;
+	unsigned long dropped;
+	char msg[64];
+
+	while ((slot = xlog_next()) != NULL) {
+		xlog_emit(slot->kind, slot->text);
+		xlog_release(slot);
+	}
+	dropped = __atomic_exchange_n(&xlog_dropped, 0, __ATOMIC_RELAXED);
+	if (dropped) {
+		snprintf(msg, sizeof(msg), "%lu log messages dropped", dropped);
+		xlog_emit(L_WARNING, msg);
+	}
+}
+
+static void *
+xlog_drain_thread(void *UNUSED(arg))
+{
+	for (;;) {
+		xlog_drain();
+		__atomic_store_n(&xlog_sleeping, 1, __ATOMIC_SEQ_CST);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (xlog_next() != NULL) {
+			/* A producer may already have taken the flag down */
+			if (!__atomic_exchange_n(&xlog_sleeping, 0,
+					__ATOMIC_SEQ_CST))
+				while (sem_wait(&xlog_wake) != 0)
+					;
+			continue;
+		}
+		while (sem_wait(&xlog_wake) != 0)
+			;
+	}
+	return NULL;
+}
+
+/*
+ * Start the drain thread the first time it is needed in this process,
+ * so that a daemon that forks after enabling asynchronous logging gets
+ * a thread in the child.
+ */
+static int
+xlog_async_ready(void)
 {
-	return (logging && (fac & logmask));
+	pthread_t thread;
+	pid_t pid, cur;
+
+	if (!xlog_async_on)
+		return 0;
+	pid = getpid();
+	cur = __atomic_load_n(&xlog_async_pid, __ATOMIC_ACQUIRE);
+	if (cur == pid)
+		return 1;
+	/* -pid: being started, or could not be, in this process */
+	if (cur == -pid || !__atomic_compare_exchange_n(&xlog_async_pid,
+			&cur, -pid, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		return 0;
+	/* Anything left over belonged to the parent's thread */
+	xlog_drain();
+	xlog_sleeping = 0;
+	if (sem_init(&xlog_wake, 0, 0) != 0 ||
+	    pthread_create(&thread, NULL, xlog_drain_thread, NULL) != 0)
+		return 0;
+	pthread_detach(thread);
+	__atomic_store_n(&xlog_async_pid, pid, __ATOMIC_RELEASE);
+	return 1;
 }
 
+static void
+xlog_async_flush(void)
+{
+	int i;
+
+	if (!xlog_async_on || xlog_async_pid != getpid())
+		return;
+	/* Give the drain thread a moment to write out what is queued */
+	for (i = 0; i < 100; i++) {
+		if (__atomic_load_n(&xlog_head, __ATOMIC_ACQUIRE) ==
+		    __atomic_load_n(&xlog_tail, __ATOMIC_ACQUIRE))
+			break;
+		usleep(1000);
+	}
+}
+
+/* Returns 0 if this message must be suppressed */
+static int
+xlog_rate_check(int kind, const char *fmt)
+{
+	struct xlog_rate *r;
+	struct xlog_slot *slot;
+	unsigned int suppressed;
+	time_t now;
+
+	r = &xlog_rates[((unsigned long)fmt >> 3) % XLOG_RATE_SITES];
+	now = time(NULL);
+	if (r->fmt != fmt || now - r->start >= XLOG_RATE_INTERVAL) {
+		suppressed = r->fmt == fmt ? r->suppressed : 0;
+		r->fmt = fmt;
+		r->start = now;
+		r->count = 0;
+		r->suppressed = 0;
+		if (suppressed && (slot = xlog_claim()) != NULL) {
+			slot->kind = kind;
+			snprintf(slot->text, sizeof(slot->text),
+				"%u messages suppressed like \"%s\"",
+				suppressed, fmt);
+			xlog_publish(slot);
+		}
+	}
+	if (__atomic_fetch_add(&r->count, 1, __ATOMIC_RELAXED) <
+			XLOG_RATE_BURST)
+		return 1;
+	__atomic_add_fetch(&r->suppressed, 1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+static int
+xlog_async_backend(int kind, const char *fmt, va_list args)
+{
+	struct xlog_slot *slot;
+	va_list args2;
+
+	if (kind == L_FATAL || !xlog_async_ready())
+		return 0;
+	if (!xlog_rate_check(kind, fmt))
+		return 1;
+	slot = xlog_claim();
+	if (slot == NULL) {
+		__atomic_add_fetch(&xlog_dropped, 1, __ATOMIC_RELAXED);
+		return 1;
+	}
+	slot->kind = kind;
+	va_copy(args2, args);
+	vsnprintf(slot->text, sizeof(slot->text), fmt, args2);
+	va_end(args2);
+	xlog_publish(slot);
+	return 1;
+}
+
+void
+xlog_async(int on)
+{
+	unsigned long i;
+
+	if (!on || xlog_async_on || !pthread_create)
+		return;
+	xlog_ring = calloc(XLOG_RING, sizeof(*xlog_ring));
+	if (xlog_ring == NULL)
+		return;
+	for (i = 0; i < XLOG_RING; i++)
+		xlog_ring[i].seq = i;
+	atexit(xlog_async_flush);
+	xlog_async_on = 1;
+}
+
+static int
+xlog_priority(int kind)
+{
+	switch (kind) {
+	case L_FATAL:
+	case L_ERROR:
+		return LOG_ERR;
+	case L_WARNING:
+		return LOG_WARNING;
+	case L_NOTICE:
+		return LOG_NOTICE;
+	}
+	return log_stderr ? -1 : LOG_INFO;
+}
+
+static void
+xlog_emit(int kind, const char *msg)
+{
+	int prio = xlog_priority(kind);
+
+	if (log_stderr)
+		fprintf(stderr, "%s: %s\n", log_name, msg);
+	if (log_syslog && prio >= 0)
+		syslog(prio, "%s", msg);
+}
+#else
+static int
+xlog_async_backend(int UNUSED(kind), const char *UNUSED(fmt),
+		va_list UNUSED(args))
+{
+	return 0;
+}
+
+static void
+xlog_async_flush(void)
+{
+}
+
+void
+xlog_async(int UNUSED(on))
+{
+}
+#endif /* HAVE_LIBPTHREAD */
+
+void
+xlog_set_async(char *service)
+{
+	xlog_async(conf_get_bool(service, "log-async",
+			conf_get_bool("general", "log-async", false)));
+}
 
 /* Write something to the system logfile and/or stderr */
 void
@@ -159,6 +479,11 @@ xlog_backend(int kind, const char *fmt, va_list args)
 	if (!(kind & (L_ALL)) && !(logging && (kind & logmask)))
 		return;
 
+	if (xlog_async_backend(kind, fmt, args))
+		return;
+	if (kind == L_FATAL)
+		xlog_async_flush();
+
 	if (log_stderr) {
 		va_list		args2;
 #ifdef VERBOSE_PRINTF
@@ -206,7 +531,7 @@ xlog_backend(int kind, const char *fmt, va_list args)
 }
 
 void
-xlog(int kind, const char* fmt, ...)
+(xlog)(int kind, const char* fmt, ...)
 {
 	va_list args;
 
@@ -0,0 +1,414 @@
+/*
+ *  idmap_cache.c
+ *
+ *  A cache of the results of the translation methods, kept by
+ *  libnfsidmap in front of all of them, so that every program using
+ *  the library is spared repeated lookups in NSS, LDAP and the rest.
+ *
+ *  Lookups that succeed are kept for Cache-TTL seconds, and those that
+ *  no method could answer (-ENOENT) for Cache-Negative-TTL seconds;
+ *  other errors are never kept, as they may be transient.  At most
+ *  Cache-Size results are kept, the least recently used being dropped
+ *  first.  A Cache-Size of 0, the default, disables the cache.
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "nfsidmap.h"
+#include "nfsidmap_private.h"
+#include "nfsidmap_plugin.h"
+
+#pragma GCC visibility push(hidden)
+
+struct idmap_cache_ent {
+	struct idmap_cache_ent		*next;		/* hash chain */
+	TAILQ_ENTRY(idmap_cache_ent)	lru;
+	uint32_t			hash;
+	int				kind;
+	uint32_t			id;		/* key, for ids */
+	char				*str;		/* key: name or principal */
+	char				*str2;		/* key: domain or secname */
+	int				ret;
+	time_t				expires;
+	/* the result, as far as the kind has one */
+	char				*name;
+	uint32_t			uid, gid;
+	int				ngroups;
+	gid_t				*groups;
+};
+
+static TAILQ_HEAD(idmap_cache_lru, idmap_cache_ent) cache_lru =
+	TAILQ_HEAD_INITIALIZER(cache_lru);
+static struct idmap_cache_ent **cache_table;
+static unsigned int cache_hash_size, cache_count, cache_max;
+static int cache_ttl, cache_neg_ttl;
+static struct nfs4_cache_stats cache_stats;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static time_t cache_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+static uint32_t cache_hash(int kind, uint32_t id, const char *str,
+			   const char *str2)
+{
+	uint32_t h = 2166136261u;
+
+	h = (h ^ (uint32_t)kind) * 16777619u;
+	h = (h ^ id) * 16777619u;
+	for (; str && *str; str++)
+		h = (h ^ (unsigned char)*str) * 16777619u;
+	h = (h ^ 0xff) * 16777619u;
+	for (; str2 && *str2; str2++)
+		h = (h ^ (unsigned char)*str2) * 16777619u;
+	return h;
+}
+
+static int same_str(const char *a, const char *b)
+{
+	return strcmp(a ? a : "", b ? b : "") == 0;
+}
+
+static void cache_free_ent(struct idmap_cache_ent *ent)
+{
+	free(ent->str);
+	free(ent->str2);
+	free(ent->name);
+	free(ent->groups);
+	free(ent);
+}
+
+/* Called with the cache_lock held */
+static void cache_unlink(struct idmap_cache_ent *ent)
+{
+	struct idmap_cache_ent **ep;
+
+	ep = &cache_table[ent->hash & (cache_hash_size - 1)];
+	while (*ep != ent)
+		ep = &(*ep)->next;
+	*ep = ent->next;
+	TAILQ_REMOVE(&cache_lru, ent, lru);
+	cache_count--;
+}
+
+/*
+ * Find the entry for a key, counting a hit or miss.  Called with the
+ * cache_lock held; an entry found stays valid until it is dropped.
+ */
+static struct idmap_cache_ent *cache_find(int kind, uint32_t id,
+					  const char *str, const char *str2)
+{
+	uint32_t hash = cache_hash(kind, id, str, str2);
+	struct idmap_cache_ent *ent;
+
+	if (cache_max == 0)
+		return NULL;
+	for (ent = cache_table[hash & (cache_hash_size - 1)]; ent;
+	     ent = ent->next)
+		if (ent->hash == hash && ent->kind == kind && ent->id == id &&
+		    same_str(ent->str, str) && same_str(ent->str2, str2))
+			break;
+	if (ent && ent->expires <= cache_now()) {
+		cache_unlink(ent);
+		cache_free_ent(ent);
+		cache_stats.expired++;
+		ent = NULL;
+	}
+	if (ent == NULL) {
+		cache_stats.misses++;
+		return NULL;
+	}
+	TAILQ_REMOVE(&cache_lru, ent, lru);
+	TAILQ_INSERT_HEAD(&cache_lru, ent, lru);
+	if (ent->ret == 0)
+		cache_stats.hits++;
+	else
+		cache_stats.negative_hits++;
+	return ent;
+}
+
+/*
+ * Make a new entry for a key, with result RET, for the caller to fill
+ * in.  Called with the cache_lock held; returns NULL if RET isn't one
+ * that is kept.
+ */
+static struct idmap_cache_ent *cache_add(int kind, uint32_t id,
+					 const char *str, const char *str2,
+					 int ret)
+{
+	uint32_t hash = cache_hash(kind, id, str, str2);
+	struct idmap_cache_ent *ent, **head;
+
+	if (cache_max == 0 || (ret != 0 && ret != -ENOENT))
+		return NULL;
+	if (ret == -ENOENT && cache_neg_ttl <= 0)
+		return NULL;
+
+	head = &cache_table[hash & (cache_hash_size - 1)];
+	for (ent = *head; ent; ent = ent->next)
+		if (ent->hash == hash && ent->kind == kind && ent->id == id &&
+		    same_str(ent->str, str) && same_str(ent->str2, str2)) {
+			/* another thread looked it up meanwhile */
+			cache_unlink(ent);
+			cache_free_ent(ent);
+			break;
+		}
+	while (cache_count >= cache_max) {
+		ent = TAILQ_LAST(&cache_lru, idmap_cache_lru);
+		cache_unlink(ent);
+		cache_free_ent(ent);
+		cache_stats.evicted++;
+	}
+
+	ent = calloc(1, sizeof(*ent));
+	if (ent == NULL)
+		return NULL;
+	if ((str && (ent->str = strdup(str)) == NULL) ||
+	    (str2 && (ent->str2 = strdup(str2)) == NULL)) {
+		cache_free_ent(ent);
+		return NULL;
+	}
+	ent->hash = hash;
+	ent->kind = kind;
+	ent->id = id;
+	ent->ret = ret;
+	ent->expires = cache_now() + (ret == 0 ? cache_ttl : cache_neg_ttl);
+	ent->next = *head;
+	*head = ent;
+	TAILQ_INSERT_HEAD(&cache_lru, ent, lru);
+	cache_count++;
+	return ent;
+}
+
+/* Drop an entry cache_add() made that couldn't be filled in */
+static void cache_drop(struct idmap_cache_ent *ent)
+{
+	cache_unlink(ent);
+	cache_free_ent(ent);
+}
+
+/**
+ * idmap_cache_init - set the cache up as configured
+ * @size: the most results to keep; 0 disables the cache
+ * @ttl: seconds to keep a mapping for
+ * @neg_ttl: seconds to keep a failed lookup for
+ */
+void idmap_cache_init(int size, int ttl, int neg_ttl)
+{
+	unsigned int buckets = 64;
+
+	idmap_cache_flush();
+	pthread_mutex_lock(&cache_lock);
+	if (size <= 0 || ttl <= 0) {
+		cache_max = 0;
+		goto out;
+	}
+	while (buckets < (unsigned int)size / 2 && buckets < (1U << 20))
+		buckets <<= 1;
+	free(cache_table);
+	cache_table = calloc(buckets, sizeof(*cache_table));
+	if (cache_table == NULL) {
+		IDMAP_LOG(0, ("libnfsidmap: no memory for the mapping cache"));
+		cache_max = 0;
+		goto out;
+	}
+	cache_hash_size = buckets;
+	cache_max = size;
+	cache_ttl = ttl;
+	cache_neg_ttl = neg_ttl;
+	IDMAP_LOG(1, ("libnfsidmap: caching %d mappings for %d seconds, "
+		      "failed lookups for %d", size, ttl, neg_ttl));
+out:
+	pthread_mutex_unlock(&cache_lock);
+}
+
+/**
+ * idmap_cache_flush - forget all the cached results
+ */
+void idmap_cache_flush(void)
+{
+	struct idmap_cache_ent *ent;
+
+	pthread_mutex_lock(&cache_lock);
+	while ((ent = TAILQ_FIRST(&cache_lru)) != NULL) {
+		cache_unlink(ent);
+		cache_free_ent(ent);
+	}
+	pthread_mutex_unlock(&cache_lock);
+}
+
+/*
+ * The idmap_cache_get_* functions return 1, and the translation
+ * methods' return value in @ret, if the result of a lookup is cached,
+ * and 0 if it should be looked up and passed to idmap_cache_put_*.
+ */
+
+int idmap_cache_get_name(int kind, uint32_t id, const char *domain,
+			 char *name, size_t len, int *ret)
+{
+	struct idmap_cache_ent *ent;
+	int found = 0;
+
+	pthread_mutex_lock(&cache_lock);
+	ent = cache_find(kind, id, NULL, domain);
+	if (ent) {
+		found = 1;
+		*ret = ent->ret;
+		if (ent->ret == 0) {
+			if (strlen(ent->name) + 1 > len)
+				*ret = -ERANGE;
+			else
+				strcpy(name, ent->name);
+		}
+	}
+	pthread_mutex_unlock(&cache_lock);
+	return found;
+}
+
+void idmap_cache_put_name(int kind, uint32_t id, const char *domain,
+			  const char *name, int ret)
+{
+	struct idmap_cache_ent *ent;
+
+	pthread_mutex_lock(&cache_lock);
+	ent = cache_add(kind, id, NULL, domain, ret);
+	if (ent && ret == 0 && (ent->name = strdup(name)) == NULL)
+		cache_drop(ent);
+	pthread_mutex_unlock(&cache_lock);
+}
+
+int idmap_cache_get_id(int kind, const char *name, uint32_t *id, int *ret)
+{
+	struct idmap_cache_ent *ent;
+	int found = 0;
+
+	pthread_mutex_lock(&cache_lock);
+	ent = cache_find(kind, 0, name, NULL);
+	if (ent) {
+		found = 1;
+		*ret = ent->ret;
+		if (ent->ret == 0)
+			*id = ent->uid;
+	}
+	pthread_mutex_unlock(&cache_lock);
+	return found;
+}
+
+void idmap_cache_put_id(int kind, const char *name, uint32_t id, int ret)
+{
+	struct idmap_cache_ent *ent;
+
+	pthread_mutex_lock(&cache_lock);
+	ent = cache_add(kind, 0, name, NULL, ret);
+	if (ent)
+		ent->uid = id;
+	pthread_mutex_unlock(&cache_lock);
+}
+
+int idmap_cache_get_ids(const char *secname, const char *princ,
+			uid_t *uid, gid_t *gid, int *ret)
+{
+	struct idmap_cache_ent *ent;
+	int found = 0;
+
+	pthread_mutex_lock(&cache_lock);
+	ent = cache_find(IDMAP_CACHE_PRINC_TO_IDS, 0, princ, secname);
+	if (ent) {
+		found = 1;
+		*ret = ent->ret;
+		if (ent->ret == 0) {
+			*uid = ent->uid;
+			*gid = ent->gid;
+		}
+	}
+	pthread_mutex_unlock(&cache_lock);
+	return found;
+}
+
+void idmap_cache_put_ids(const char *secname, const char *princ,
+			 uid_t uid, gid_t gid, int ret)
+{
+	struct idmap_cache_ent *ent;
+
+	pthread_mutex_lock(&cache_lock);
+	ent = cache_add(IDMAP_CACHE_PRINC_TO_IDS, 0, princ, secname, ret);
+	if (ent) {
+		ent->uid = uid;
+		ent->gid = gid;
+	}
+	pthread_mutex_unlock(&cache_lock);
+}
+
+/*
+ * As getgrouplist(3) does, a list that doesn't fit in @ngroups is
+ * cut short and -ERANGE returned, with its length in @ngroups.
+ */
+int idmap_cache_get_groups(const char *secname, const char *princ,
+			   gid_t *groups, int *ngroups, int *ret)
+{
+	struct idmap_cache_ent *ent;
+	int found = 0;
+
+	pthread_mutex_lock(&cache_lock);
+	ent = cache_find(IDMAP_CACHE_PRINC_TO_GROUPS, 0, princ, secname);
+	if (ent) {
+		found = 1;
+		*ret = ent->ret;
+		if (ent->ret == 0) {
+			if (ent->ngroups > *ngroups)
+				*ret = -ERANGE;
+			else
+				*ngroups = ent->ngroups;
+			memcpy(groups, ent->groups, *ngroups * sizeof(*groups));
+			*ngroups = ent->ngroups;
+		}
+	}
+	pthread_mutex_unlock(&cache_lock);
+	return found;
+}
+
+void idmap_cache_put_groups(const char *secname, const char *princ,
+			    const gid_t *groups, int ngroups, int ret)
+{
+	struct idmap_cache_ent *ent;
+
+	pthread_mutex_lock(&cache_lock);
+	ent = cache_add(IDMAP_CACHE_PRINC_TO_GROUPS, 0, princ, secname, ret);
+	if (ent && ret == 0) {
+		ent->groups = malloc((ngroups ? ngroups : 1) * sizeof(*groups));
+		if (ent->groups == NULL)
+			cache_drop(ent);
+		else {
+			memcpy(ent->groups, groups, ngroups * sizeof(*groups));
+			ent->ngroups = ngroups;
+		}
+	}
+	pthread_mutex_unlock(&cache_lock);
+}
+
+#pragma GCC visibility pop
+
+/**
+ * nfs4_get_cache_stats - report how well the mapping cache does
+ * @stats: filled in with the counts since the cache was set up
+ */
+void nfs4_get_cache_stats(struct nfs4_cache_stats *stats)
+{
+	pthread_mutex_lock(&cache_lock);
+	*stats = cache_stats;
+	stats->entries = cache_count;
+	pthread_mutex_unlock(&cache_lock);
+}
@@ -39,6 +39,8 @@
 #include "config.h"
 
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <stdint.h>
 #include <errno.h>
 #include <unistd.h>
 #include <stdlib.h>
@@ -56,6 +58,8 @@
 #include <resolv.h>
 #include <arpa/nameser.h>
 #include <arpa/nameser_compat.h>
+#include <pthread.h>
+#include <time.h>
 
 #include "nfsidmap.h"
 #include "nfsidmap_private.h"
@@ -66,8 +70,13 @@
 
 void nfs4_cleanup_name_mapping(void);
 static char *default_domain;
+static int domain_cache_ttl;
+static int mapping_initialized;
+static struct conf_list *nfs4_methods, *gss_methods;
 static struct mapping_plugin **nfs4_plugins = NULL;
 static struct mapping_plugin **gss_plugins = NULL;
+static int nfs4_plugins_failed, gss_plugins_failed;
+static pthread_mutex_t mapping_lock = PTHREAD_MUTEX_INITIALIZER;
 uid_t nobody_uid = (uid_t)-1;
 gid_t nobody_gid = (gid_t)-1;
 
@@ -93,6 +102,8 @@ gid_t nobody_gid = (gid_t)-1;
 #define NS_MAXMSG 65535
 #endif
 
+#define DOMAIN_CACHE_FILE NFS_STATEDIR "/nfsidmap.domain"
+
 /* Default logging fuction */
 static void default_logger(const char *fmt, ...)
 {
@@ -212,6 +223,65 @@ freemem:
 	return (status);
 }
 
+/*
+ * The domain found in DNS is kept for Domain-Cache-TTL seconds in a
+ * file, which later processes on the same host read instead of asking
+ * again.  Only a file that just root can have written is trusted.
+ */
+static char *domain_cache_read(const char *hname)
+{
+	char buf[64 + NS_MAXDNAME + 2], *sp, *nl;
+	struct stat st;
+	time_t now;
+	FILE *fp;
+
+	if (domain_cache_ttl <= 0)
+		return NULL;
+	fp = fopen(DOMAIN_CACHE_FILE, "re");
+	if (fp == NULL)
+		return NULL;
+	now = time(NULL);
+	if (fstat(fileno(fp), &st) < 0 || st.st_uid != 0 ||
+	    (st.st_mode & (S_IWGRP | S_IWOTH)) ||
+	    st.st_mtime > now || st.st_mtime + domain_cache_ttl <= now ||
+	    fgets(buf, sizeof(buf), fp) == NULL) {
+		fclose(fp);
+		return NULL;
+	}
+	fclose(fp);
+
+	nl = strchr(buf, '\n');
+	sp = strchr(buf, ' ');
+	if (nl == NULL || sp == NULL || sp + 1 >= nl)
+		return NULL;
+	*nl = '\0';
+	*sp++ = '\0';
+	if (strcmp(buf, hname) != 0)
+		return NULL;
+	IDMAP_LOG(2, ("libnfsidmap: using domain %s from %s",
+		  sp, DOMAIN_CACHE_FILE));
+	return strdup(sp);
+}
+
+static void domain_cache_write(const char *hname, const char *domain)
+{
+	char tmpname[] = DOMAIN_CACHE_FILE ".XXXXXX";
+	int fd, ok;
+
+	if (domain_cache_ttl <= 0 || geteuid() != 0)
+		return;
+	fd = mkstemp(tmpname);
+	if (fd < 0)
+		return;
+	ok = fchmod(fd, 0644) == 0 &&
+		dprintf(fd, "%s %s\n", hname, domain) > 0;
+	if (close(fd) < 0 || !ok || rename(tmpname, DOMAIN_CACHE_FILE) < 0) {
+		IDMAP_LOG(1, ("libnfsidmap: unable to write %s",
+			  DOMAIN_CACHE_FILE));
+		unlink(tmpname);
+	}
+}
+
 static int domain_from_dns(char **domain)
 {
 	struct hostent *he;
@@ -219,6 +289,9 @@ static int domain_from_dns(char **domain)
 
 	if (gethostname(hname, sizeof(hname)) == -1)
 		return -1;
+	*domain = domain_cache_read(hname);
+	if (*domain)
+		return 0;
 	if ((he = gethostbyname(hname)) == NULL)
 		return -1;
 	if ((c = strchr(he->h_name, '.')) == NULL || *++c == '\0')
@@ -229,6 +302,9 @@ static int domain_from_dns(char **domain)
 	 */
 	if (dns_txt_query(c, domain) < 0)
 		*domain = strdup(c);
+	if (*domain == NULL)
+		return -1;
+	domain_cache_write(hname, *domain);
 
 	return 0;
 }
@@ -290,6 +366,8 @@ static int load_translation_plugin(char *method, struct mapping_plugin *plgn)
 	}
 	plgn->dl_handle = dl;
 	plgn->trans = trans;
+	plgn->grouplist_batch = (libnfsidmap_grouplist_batch_t)
+			dlsym(dl, PLUGIN_GROUPLIST_BATCH_FUNC);
 	IDMAP_LOG(1, ("libnfsidmap: loaded plugin %s for method %s",
 		  plgname, method));
 
@@ -340,19 +418,83 @@ out:
 	return ret;
 }
 
+/*
+ * The domain, unless idmapd.conf names one, is looked up only once it
+ * is first needed.
+ */
 static char *get_default_domain(void)
 {
-	int ret;
+	char *domain;
 
-	if (default_domain)
-		return default_domain;
-	ret = domain_from_dns(&default_domain);
-	if (ret) {
-		IDMAP_LOG(0, ("Unable to determine a default nfsv4 domain; "
-			" consider specifying one in idmapd.conf"));
-		default_domain = "";
+	domain = __atomic_load_n(&default_domain, __ATOMIC_ACQUIRE);
+	if (domain)
+		return domain;
+
+	pthread_mutex_lock(&mapping_lock);
+	if (default_domain == NULL) {
+		if (domain_from_dns(&domain)) {
+			IDMAP_LOG(1, ("libnfsidmap: Unable to determine "
+				  "the NFSv4 domain; Using '%s' as the NFSv4 domain "
+				  "which means UIDs will be mapped to the 'Nobody-User' "
+				  "user defined in %s",
+				  IDMAPD_DEFAULT_DOMAIN, PATH_IDMAPDCONF));
+			domain = IDMAPD_DEFAULT_DOMAIN;
+		}
+		IDMAP_LOG(1, ("libnfsidmap: using (default) domain: %s",
+			  domain));
+		__atomic_store_n(&default_domain, domain, __ATOMIC_RELEASE);
+	}
+	domain = default_domain;
+	pthread_mutex_unlock(&mapping_lock);
+	return domain;
+}
+
+/*
+ * Return the plugins for the GSS methods if @prefer_gss and there are
+ * any, otherwise those for the methods, loading them when they are
+ * first needed.  Returns NULL if they couldn't be loaded.
+ */
+static struct mapping_plugin **get_plugins(int prefer_gss)
+{
+	struct mapping_plugin ***plgnsp = &nfs4_plugins;
+	struct conf_list *methods = nfs4_methods;
+	int *failed = &nfs4_plugins_failed;
+	const char *what = "Method";
+	struct mapping_plugin **plgns;
+
+	if (prefer_gss && gss_methods) {
+		plgnsp = &gss_plugins;
+		methods = gss_methods;
+		failed = &gss_plugins_failed;
+		what = "GSS-Methods";
+	}
+	plgns = __atomic_load_n(plgnsp, __ATOMIC_ACQUIRE);
+	if (plgns)
+		return plgns;
+
+	pthread_mutex_lock(&mapping_lock);
+	if (*plgnsp == NULL && !*failed) {
+		struct conf_list list;
+		struct conf_list_node node;
+
+		if (methods)
+			IDMAP_LOG(1, ("libnfsidmap: processing '%s' list",
+				  what));
+		else {
+			TAILQ_INIT(&list.fields);
+			list.cnt = 1;
+			node.field = "nsswitch";
+			TAILQ_INSERT_TAIL (&list.fields, &node, link);
+			methods = &list;
+		}
+		if (load_plugins(methods, &plgns) == 0)
+			__atomic_store_n(plgnsp, plgns, __ATOMIC_RELEASE);
+		else
+			*failed = 1;
 	}
-	return default_domain;
+	plgns = *plgnsp;
+	pthread_mutex_unlock(&mapping_lock);
+	return plgns;
 }
 
 void nfs4_cleanup_name_mapping(void)
@@ -362,6 +504,15 @@ void nfs4_cleanup_name_mapping(void)
 	if (gss_plugins)
 		unload_plugins(gss_plugins);
 	nfs4_plugins = gss_plugins = NULL;
+	nfs4_plugins_failed = gss_plugins_failed = 0;
+	if (nfs4_methods)
+		conf_free_list(nfs4_methods);
+	if (gss_methods)
+		conf_free_list(gss_methods);
+	nfs4_methods = gss_methods = NULL;
+	/* a configured domain points into the configuration */
+	default_domain = NULL;
+	mapping_initialized = 0;
 }
 
 #pragma GCC visibility pop
@@ -370,42 +521,37 @@ const char * nfsidmap_conf_path = PATH_IDMAPDCONF;
 
 int nfs4_init_name_mapping(char *conffile)
 {
-	int ret = -ENOENT;
-	int dflt = 0;
-	struct conf_list *nfs4_methods, *gss_methods;
 	char *nobody_user, *nobody_group;
 
 	/* XXX: need to be able to reload configurations... */
-	if (nfs4_plugins) /* already succesfully initialized */
+	if (mapping_initialized) /* already succesfully initialized */
 		return 0;
 	if (conffile)
 		nfsidmap_conf_path = conffile;
 	conf_init_file(nfsidmap_conf_path);
 
+	/*
+	 * The domain and local realms are found, and the translation
+	 * plugins loaded, only when first needed, unless they are to be
+	 * logged now.
+	 */
+	domain_cache_ttl = conf_get_num("General", "Domain-Cache-TTL", 0);
 	default_domain = conf_get_str("General", "Domain");
-	if (default_domain == NULL) {
-		dflt = 1;
-		ret = domain_from_dns(&default_domain);
-		if (ret) {
-			IDMAP_LOG(1, ("libnfsidmap: Unable to determine "
-				  "the NFSv4 domain; Using '%s' as the NFSv4 domain "
-				  "which means UIDs will be mapped to the 'Nobody-User' "
-				  "user defined in %s", 
-				  IDMAPD_DEFAULT_DOMAIN, PATH_IDMAPDCONF));
-			default_domain = IDMAPD_DEFAULT_DOMAIN;
-		}
-	}
-	IDMAP_LOG(1, ("libnfsidmap: using%s domain: %s",
-		(dflt ? " (default)" : ""), default_domain));
-
-	struct conf_list *local_realms = get_local_realms();
-	if (local_realms == NULL) return -ENOMEM;
+	if (default_domain)
+		IDMAP_LOG(1, ("libnfsidmap: using domain: %s",
+			  default_domain));
 
 	if (idmap_verbosity >= 1) {
+		struct conf_list *local_realms;
 		struct conf_list_node *r;
 		char *buf = NULL;
 		int siz=0;
 
+		get_default_domain();
+		local_realms = get_local_realms();
+		if (local_realms == NULL)
+			return -ENOMEM;
+
 		if (local_realms) {
 			TAILQ_FOREACH(r, &local_realms->fields, link) {
 				siz += (strlen(r->field)+4);
@@ -424,31 +570,7 @@ int nfs4_init_name_mapping(char *conffile)
 	}
 
 	nfs4_methods = conf_get_list("Translation", "Method");
-	if (nfs4_methods) {
-		IDMAP_LOG(1, ("libnfsidmap: processing 'Method' list"));
-		if (load_plugins(nfs4_methods, &nfs4_plugins) == -1) {
-			conf_free_list(nfs4_methods);
-			return -ENOENT;
-		}
-	} else {
-		struct conf_list list;
-		struct conf_list_node node;
-
-		TAILQ_INIT(&list.fields);
-		list.cnt = 1;
-		node.field = "nsswitch";
-		TAILQ_INSERT_TAIL (&list.fields, &node, link);
-
-		if (load_plugins(&list, &nfs4_plugins) == -1)
-			return -ENOENT;
-	}
-
 	gss_methods = conf_get_list("Translation", "GSS-Methods");
-	if (gss_methods) {
-		IDMAP_LOG(1, ("libnfsidmap: processing 'GSS-Methods' list"));
-		if (load_plugins(gss_methods, &gss_plugins) == -1)
-			goto out;
-	}
 
 	nobody_user = conf_get_str("Mapping", "Nobody-User");
 	if (nobody_user) {
@@ -492,34 +614,27 @@ int nfs4_init_name_mapping(char *conffile)
 					nobody_group, strerror(errno)));
 	}
 
-	ret = 0;
-out:
-	if (ret) {
-		if (nfs4_plugins)
-			unload_plugins(nfs4_plugins);
-		if (gss_plugins) {
-			unload_plugins(gss_plugins);
-		}
-		nfs4_plugins = gss_plugins = NULL;
-	}
+	idmap_cache_init(conf_get_num("Translation", "Cache-Size", 0),
+			 conf_get_num("Translation", "Cache-TTL", 300),
+			 conf_get_num("Translation", "Cache-Negative-TTL", 30));
 
-	if (gss_methods)
-		conf_free_list(gss_methods);
-
-	if (nfs4_methods)
-		conf_free_list(nfs4_methods);
-
-	return ret ? -ENOENT: 0;
+	mapping_initialized = 1;
+	return 0;
 }
 
 void nfs4_term_name_mapping(void)
 {
-	if (nfs4_plugins)
-		unload_plugins(nfs4_plugins);
-	if (gss_plugins)
-		unload_plugins(gss_plugins);
+	struct nfs4_cache_stats stats;
 
-	nfs4_plugins = gss_plugins = NULL;
+	nfs4_get_cache_stats(&stats);
+	if (stats.hits + stats.negative_hits + stats.misses)
+		IDMAP_LOG(1, ("libnfsidmap: mapping cache: %lu hits, "
+			      "%lu negative hits, %lu misses, %lu expired, "
+			      "%lu evicted", stats.hits, stats.negative_hits,
+			      stats.misses, stats.expired, stats.evicted));
+	idmap_cache_init(0, 0, 0);
+
+	nfs4_cleanup_name_mapping();
 
 	free_local_realms();
 	conf_cleanup();
@@ -554,10 +669,9 @@ nfs4_get_default_domain(char *UNUSED(server), char *domain, size_t len)
 		if (ret)						\
 			return ret;					\
 									\
-		if ((prefer_gss) && gss_plugins)			\
-			plgns = gss_plugins;				\
-		else							\
-			plgns = nfs4_plugins;				\
+		plgns = get_plugins(prefer_gss);			\
+		if (plgns == NULL)					\
+			return -ENOENT;					\
 									\
 		for (i = 0; plgns[i] != NULL; i++) {			\
 			if (plgns[i]->trans->funcname == NULL)		\
@@ -582,16 +696,68 @@ nfs4_get_default_domain(char *UNUSED(server), char *domain, size_t len)
 		return ret;						\
 	} while (0)
 
-int nfs4_uid_to_name(uid_t uid, char *domain, char *name, size_t len)
+static int run_uid_to_name(uid_t uid, char *domain, char *name, size_t len)
 {
 	RUN_TRANSLATIONS(uid_to_name, 0, uid, domain, name, len);
 }
 
-int nfs4_gid_to_name(gid_t gid, char *domain, char *name, size_t len)
+static int run_gid_to_name(gid_t gid, char *domain, char *name, size_t len)
 {
 	RUN_TRANSLATIONS(gid_to_name, 0, gid, domain, name, len);
 }
 
+static int run_name_to_uid(char *name, uid_t *uid)
+{
+	RUN_TRANSLATIONS(name_to_uid, 0, name, uid);
+}
+
+static int run_name_to_gid(char *name, gid_t *gid)
+{
+	RUN_TRANSLATIONS(name_to_gid, 0, name, gid);
+}
+
+static int run_princ_to_ids(char *secname, char *princ, uid_t *uid,
+			    gid_t *gid, extra_mapping_params **ex)
+{
+	RUN_TRANSLATIONS(princ_to_ids, 1, secname, princ, uid, gid, ex);
+}
+
+static int run_princ_to_grouplist(char *secname, char *princ, gid_t *groups,
+				  int *ngroups, extra_mapping_params **ex)
+{
+	RUN_TRANSLATIONS(gss_princ_to_grouplist, 1, secname, princ,
+			 groups, ngroups, ex);
+}
+
+/*
+ * The public lookups below answer from the mapping cache when they
+ * can (see idmap_cache.c), and run the translation methods otherwise.
+ */
+
+int nfs4_uid_to_name(uid_t uid, char *domain, char *name, size_t len)
+{
+	int ret;
+
+	if (idmap_cache_get_name(IDMAP_CACHE_UID_TO_NAME, uid, domain,
+				 name, len, &ret))
+		return ret;
+	ret = run_uid_to_name(uid, domain, name, len);
+	idmap_cache_put_name(IDMAP_CACHE_UID_TO_NAME, uid, domain, name, ret);
+	return ret;
+}
+
+int nfs4_gid_to_name(gid_t gid, char *domain, char *name, size_t len)
+{
+	int ret;
+
+	if (idmap_cache_get_name(IDMAP_CACHE_GID_TO_NAME, gid, domain,
+				 name, len, &ret))
+		return ret;
+	ret = run_gid_to_name(gid, domain, name, len);
+	idmap_cache_put_name(IDMAP_CACHE_GID_TO_NAME, gid, domain, name, ret);
+	return ret;
+}
+
 int nfs4_uid_to_owner(uid_t uid, char *domain, char *name, size_t len)
 {
 	if (nfs4_uid_to_name(uid, domain, name, len))
@@ -608,12 +774,32 @@ int nfs4_gid_to_group_owner(gid_t gid, char *domain, char *name, size_t len)
 
 int nfs4_name_to_uid(char *name, uid_t *uid)
 {
-	RUN_TRANSLATIONS(name_to_uid, 0, name, uid);
+	uint32_t id;
+	int ret;
+
+	if (idmap_cache_get_id(IDMAP_CACHE_NAME_TO_UID, name, &id, &ret)) {
+		if (ret == 0)
+			*uid = id;
+		return ret;
+	}
+	ret = run_name_to_uid(name, uid);
+	idmap_cache_put_id(IDMAP_CACHE_NAME_TO_UID, name, ret ? 0 : *uid, ret);
+	return ret;
 }
 
 int nfs4_name_to_gid(char *name, gid_t *gid)
 {
-	RUN_TRANSLATIONS(name_to_gid, 0, name, gid);
+	uint32_t id;
+	int ret;
+
+	if (idmap_cache_get_id(IDMAP_CACHE_NAME_TO_GID, name, &id, &ret)) {
+		if (ret == 0)
+			*gid = id;
+		return ret;
+	}
+	ret = run_name_to_gid(name, gid);
+	idmap_cache_put_id(IDMAP_CACHE_NAME_TO_GID, name, ret ? 0 : *gid, ret);
+	return ret;
 }
 
 static int set_id_to_nobody(uid_t *id, uid_t is_uid)
@@ -670,27 +856,133 @@ int nfs4_group_owner_to_gid(char *name, gid_t *gid)
 
 int nfs4_gss_princ_to_ids(char *secname, char *princ, uid_t *uid, gid_t *gid)
 {
-	RUN_TRANSLATIONS(princ_to_ids, 1, secname, princ, uid, gid, NULL);
+	return nfs4_gss_princ_to_ids_ex(secname, princ, uid, gid, NULL);
 }
 
 int nfs4_gss_princ_to_grouplist(char *secname, char *princ,
 				gid_t *groups, int *ngroups)
 {
-	RUN_TRANSLATIONS(gss_princ_to_grouplist, 1, secname, princ,
-			 groups, ngroups, NULL);
+	return nfs4_gss_princ_to_grouplist_ex(secname, princ, groups,
+					      ngroups, NULL);
 }
 
+/* Mappings that depend on extra parameters are not cached */
 int nfs4_gss_princ_to_ids_ex(char *secname, char *princ, uid_t *uid,
 			     gid_t *gid, extra_mapping_params **ex)
 {
-	RUN_TRANSLATIONS(princ_to_ids, 1, secname, princ, uid, gid, ex);
+	int ret;
+
+	if (ex)
+		return run_princ_to_ids(secname, princ, uid, gid, ex);
+	if (idmap_cache_get_ids(secname, princ, uid, gid, &ret))
+		return ret;
+	ret = run_princ_to_ids(secname, princ, uid, gid, NULL);
+	if (ret == 0)
+		idmap_cache_put_ids(secname, princ, *uid, *gid, ret);
+	else
+		idmap_cache_put_ids(secname, princ, 0, 0, ret);
+	return ret;
 }
 
 int nfs4_gss_princ_to_grouplist_ex(char *secname, char *princ, gid_t *groups,
 				   int *ngroups, extra_mapping_params **ex)
 {
-	RUN_TRANSLATIONS(gss_princ_to_grouplist, 1, secname, princ,
-			 groups, ngroups, ex);
+	int ret;
+
+	if (ex)
+		return run_princ_to_grouplist(secname, princ, groups,
+					      ngroups, ex);
+	if (idmap_cache_get_groups(secname, princ, groups, ngroups, &ret))
+		return ret;
+	ret = run_princ_to_grouplist(secname, princ, groups, ngroups, NULL);
+	idmap_cache_put_groups(secname, princ, groups, *ngroups, ret);
+	return ret;
+}
+
+/**
+ * nfs4_gss_princ_to_grouplist_batch - find the groups of many principals
+ * @secname: the security mechanism of all the principals
+ * @reqs: a principal, and where to put its groups, for each lookup
+ * @nreqs: the number of lookups
+ *
+ * Each of @reqs gets the status nfs4_gss_princ_to_grouplist() would
+ * return for it.  Plugins that can resolve many principals at once are
+ * passed them together; the others are asked about them one by one.
+ *
+ * Returns 0, or an error if no lookups could be made.
+ */
+int nfs4_gss_princ_to_grouplist_batch(char *secname,
+				      struct nfs4_grouplist_req *reqs,
+				      int nreqs)
+{
+	struct nfs4_grouplist_req **pending;
+	struct mapping_plugin **plgns;
+	int i, j, n, npending, *sizes;
+	struct trans_func *trans;
+
+	i = nfs4_init_name_mapping(NULL);
+	if (i)
+		return i;
+	plgns = get_plugins(1);
+	if (plgns == NULL)
+		return -ENOENT;
+	if (nreqs <= 0)
+		return 0;
+
+	pending = calloc(nreqs, sizeof(*pending));
+	sizes = calloc(nreqs, sizeof(*sizes));
+	if (pending == NULL || sizes == NULL) {
+		free(pending);
+		free(sizes);
+		return -ENOMEM;
+	}
+
+	/* sizes[i] is -1 for the lookups answered from the cache */
+	for (i = npending = 0; i < nreqs; i++) {
+		sizes[i] = -1;
+		if (idmap_cache_get_groups(secname, reqs[i].princ,
+					   reqs[i].groups, &reqs[i].ngroups,
+					   &reqs[i].status))
+			continue;
+		sizes[i] = reqs[i].ngroups;
+		reqs[i].status = -ENOENT;
+		pending[npending++] = &reqs[i];
+	}
+
+	for (i = 0; plgns[i] != NULL && npending; i++) {
+		trans = plgns[i]->trans;
+		if (plgns[i]->grouplist_batch) {
+			IDMAP_LOG(4, ("%s: calling %s batch for %d principals",
+				  __func__, trans->name, npending));
+			plgns[i]->grouplist_batch(secname, pending, npending);
+		} else if (trans->gss_princ_to_grouplist) {
+			for (j = 0; j < npending; j++)
+				pending[j]->status =
+					trans->gss_princ_to_grouplist(secname,
+						pending[j]->princ,
+						pending[j]->groups,
+						&pending[j]->ngroups, NULL);
+		} else
+			continue;
+
+		/* as RUN_TRANSLATIONS does, only -ENOENT tries the next */
+		for (j = n = 0; j < npending; j++) {
+			if (pending[j]->status != -ENOENT)
+				continue;
+			pending[j]->ngroups = sizes[pending[j] - reqs];
+			pending[n++] = pending[j];
+		}
+		npending = n;
+	}
+
+	for (i = 0; i < nreqs; i++)
+		if (sizes[i] >= 0)
+			idmap_cache_put_groups(secname, reqs[i].princ,
+					       reqs[i].groups, reqs[i].ngroups,
+					       reqs[i].status);
+	free(pending);
+	free(sizes);
+	return 0;
 }
 
 void nfs4_set_debug(int dbg_level, void (*logger)(const char *, ...))
@@ -65,4 +65,26 @@ int nfs4_gss_princ_to_ids(char *secname, char *princ, uid_t *uid, gid_t *gid);
 int nfs4_gss_princ_to_grouplist(char *secname, char *princ, gid_t *groups, int *ngroups);
 int nfs4_gss_princ_to_ids_ex(char *secname, char *princ, uid_t *uid, gid_t *gid, extra_mapping_params **ex);
 int nfs4_gss_princ_to_grouplist_ex(char *secname, char *princ, gid_t *groups, int *ngroups, extra_mapping_params **ex);
+
+/* One principal of a nfs4_gss_princ_to_grouplist_batch() */
+struct nfs4_grouplist_req {
+	char *princ;
+	gid_t *groups;		/* filled in with the groups */
+	int ngroups;		/* size of groups; set to the number found */
+	int status;		/* set as nfs4_gss_princ_to_grouplist() returns */
+};
+int nfs4_gss_princ_to_grouplist_batch(char *secname,
+				      struct nfs4_grouplist_req *reqs,
+				      int nreqs);
 void nfs4_set_debug(int dbg_level, nfs4_idmap_log_function_t dbg_logfunc);
+
+/* Counts kept by the mapping cache, see Cache-Size in idmapd.conf(5) */
+struct nfs4_cache_stats {
+	unsigned long hits;		/* mappings found cached */
+	unsigned long negative_hits;	/* failed lookups found cached */
+	unsigned long misses;		/* lookups passed to the methods */
+	unsigned long expired;		/* cached results found too old */
+	unsigned long evicted;		/* dropped to make room */
+	unsigned long entries;		/* results cached now */
+};
+void nfs4_get_cache_stats(struct nfs4_cache_stats *stats);
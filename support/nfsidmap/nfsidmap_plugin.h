@@ -49,6 +49,19 @@ struct trans_func {
 		int *ngroups, extra_mapping_params **ex);
 };
 
+/*
+ * A plugin may also define this, to resolve the group lists of many
+ * principals at once.  It is passed those the plugins before it
+ * couldn't, each with status -ENOENT, and sets the status of each as
+ * gss_princ_to_grouplist() would return it, leaving -ENOENT for the
+ * next plugin to try.
+ */
+#define PLUGIN_GROUPLIST_BATCH_FUNC "libnfsidmap_plugin_grouplist_batch"
+typedef void (*libnfsidmap_grouplist_batch_t)(char *secname,
+		struct nfs4_grouplist_req **reqs, int nreqs);
+void libnfsidmap_plugin_grouplist_batch(char *secname,
+		struct nfs4_grouplist_req **reqs, int nreqs);
+
 extern int idmap_verbosity;
 extern nfs4_idmap_log_function_t idmap_log_func;
 struct trans_func *libnfsidmap_plugin_init(void);
@@ -34,6 +34,9 @@
  *  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <sys/types.h>
+#include <stdint.h>
+
 #include "conffile.h"
 
 struct conf_list *get_local_realms(void);
@@ -51,4 +54,32 @@ typedef struct trans_func * (*libnfsidmap_plugin_init_t)(void);
 struct mapping_plugin {
 	void *dl_handle;
 	struct trans_func *trans;
+	void (*grouplist_batch)(char *secname,		/* optional */
+			struct nfs4_grouplist_req **reqs, int nreqs);
+};
+
+enum {
+	IDMAP_CACHE_UID_TO_NAME = 1,
+	IDMAP_CACHE_GID_TO_NAME,
+	IDMAP_CACHE_NAME_TO_UID,
+	IDMAP_CACHE_NAME_TO_GID,
+	IDMAP_CACHE_PRINC_TO_IDS,
+	IDMAP_CACHE_PRINC_TO_GROUPS,
 };
+
+void idmap_cache_init(int size, int ttl, int neg_ttl);
+void idmap_cache_flush(void);
+int idmap_cache_get_name(int kind, uint32_t id, const char *domain,
+			 char *name, size_t len, int *ret);
+void idmap_cache_put_name(int kind, uint32_t id, const char *domain,
+			  const char *name, int ret);
+int idmap_cache_get_id(int kind, const char *name, uint32_t *id, int *ret);
+void idmap_cache_put_id(int kind, const char *name, uint32_t id, int ret);
+int idmap_cache_get_ids(const char *secname, const char *princ,
+			uid_t *uid, gid_t *gid, int *ret);
+void idmap_cache_put_ids(const char *secname, const char *princ,
+			 uid_t uid, gid_t gid, int ret);
+int idmap_cache_get_groups(const char *secname, const char *princ,
+			   gid_t *groups, int *ngroups, int *ret);
+void idmap_cache_put_groups(const char *secname, const char *princ,
+			    const gid_t *groups, int ngroups, int ret);
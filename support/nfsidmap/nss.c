@@ -47,6 +47,7 @@
 #include <grp.h>
 #include <limits.h>
 #include <ctype.h>
+#include <pthread.h>
 #include "nfsidmap.h"
 #include "nfsidmap_plugin.h"
 #include "nfsidmap_private.h"
@@ -458,6 +459,56 @@ out:
 	return ret;
 }
 
+/*
+ * Each lookup of a batch can wait on a directory service, so several
+ * are made at once, by up to NSS_BATCH_THREADS threads taking the
+ * next lookup in turn.
+ */
+#define NSS_BATCH_THREADS	8
+
+struct nss_batch {
+	char *secname;
+	struct nfs4_grouplist_req **reqs;
+	int nreqs;
+	int next;
+};
+
+static void *nss_batch_worker(void *arg)
+{
+	struct nss_batch *b = arg;
+	struct nfs4_grouplist_req *req;
+	int i;
+
+	while ((i = __atomic_fetch_add(&b->next, 1, __ATOMIC_RELAXED)) <
+	       b->nreqs) {
+		req = b->reqs[i];
+		req->status = nss_gss_princ_to_grouplist(b->secname, req->princ,
+				req->groups, &req->ngroups, NULL);
+	}
+	return NULL;
+}
+
+void libnfsidmap_plugin_grouplist_batch(char *secname,
+		struct nfs4_grouplist_req **reqs, int nreqs)
+{
+	struct nss_batch b = {
+		.secname	= secname,
+		.reqs		= reqs,
+		.nreqs		= nreqs,
+	};
+	pthread_t threads[NSS_BATCH_THREADS];
+	int i, nthreads;
+
+	nthreads = nreqs < NSS_BATCH_THREADS ? nreqs : NSS_BATCH_THREADS;
+	for (i = 1; i < nthreads; i++)
+		if (pthread_create(&threads[i], NULL, nss_batch_worker, &b))
+			break;
+	nthreads = i;
+	nss_batch_worker(&b);
+	for (i = 1; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+}
+
 static int nss_plugin_init(void)
 {
 	if (nfsidmap_conf_path)
@@ -37,6 +37,7 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include <sys/types.h>
 #include <pwd.h>
 #include <grp.h>
@@ -86,68 +87,268 @@ static char *get_default_domain(void)
 }
 
 /*
- * Regexp Translation Methods
- *
+ * Buffer sizes for the getpw*_r() and getgr*_r() calls.  They start
+ * from the sysconf() hints and grow to fit the largest entry seen, so
+ * only the first lookup of an unusually large entry has to retry.
  */
+#define NSS_BUFLEN_DEFAULT	16384
 
-static struct passwd *regex_getpwnam(const char *name, const char *UNUSED(domain),
-				      int *err_p)
+static size_t pw_buflen, gr_buflen;
+
+static size_t nss_buflen(size_t *cur, int sc_name)
 {
-	struct passwd *pw;
+	size_t len = __atomic_load_n(cur, __ATOMIC_RELAXED);
+	long hint;
+
+	if (len == 0) {
+		hint = sysconf(sc_name);
+		len = hint > 0 ? (size_t)hint : NSS_BUFLEN_DEFAULT;
+		__atomic_store_n(cur, len, __ATOMIC_RELAXED);
+	}
+	return len;
+}
+
+static void nss_buflen_grow(size_t *cur, size_t len)
+{
+	size_t old = __atomic_load_n(cur, __ATOMIC_RELAXED);
+
+	while (old < len &&
+	       !__atomic_compare_exchange_n(cur, &old, len, 1,
+					    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+/* The passwd entry for @name, or for @uid if @name is NULL; free() it */
+static struct passwd *regex_nss_getpw(const char *name, uid_t uid, int *err_p)
+{
+	struct passwd *pw = NULL;
 	struct pwbuf *buf;
-	size_t buflen = sysconf(_SC_GETPW_R_SIZE_MAX);
-	char *localname;
-	size_t namelen;
+	size_t buflen = nss_buflen(&pw_buflen, _SC_GETPW_R_SIZE_MAX);
 	int err;
-	int status;
-	int index;
-	regmatch_t matches[MAX_MATCHES];
 
-	buf = malloc(sizeof(*buf) + buflen);
-	if (!buf) {
-		err = ENOMEM;
-		goto err;
+	for (;;) {
+		buf = malloc(sizeof(*buf) + buflen);
+		if (!buf) {
+			*err_p = ENOMEM;
+			return NULL;
+		}
+		do {
+			if (name)
+				err = getpwnam_r(name, &buf->pwbuf, buf->buf,
+						 buflen, &pw);
+			else
+				err = getpwuid_r(uid, &buf->pwbuf, buf->buf,
+						 buflen, &pw);
+		} while (err == EINTR);
+		if (err != ERANGE)
+			break;
+		free(buf);
+		buflen *= 2;
+		nss_buflen_grow(&pw_buflen, buflen);
 	}
 
-	status = regexec(&user_re, name, MAX_MATCHES, matches, 0);
-	if (status) {
-		IDMAP_LOG(4, ("regexp_getpwnam: user '%s' did not match regex", name));
-		err = ENOENT;
-		goto err_free_buf;
+	if (!pw) {
+		free(buf);
+		*err_p = err ? err : ENOENT;
+		return NULL;
 	}
+	*err_p = 0;
+	return pw;
+}
 
-	for (index = 1; index < MAX_MATCHES ; index++)
-	{
-		if (matches[index].rm_so >= 0)
+/* The group entry for @name, or for @gid if @name is NULL; free() it */
+static struct group *regex_nss_getgr(const char *name, gid_t gid, int *err_p)
+{
+	struct group *gr = NULL;
+	struct grbuf *buf;
+	size_t buflen = nss_buflen(&gr_buflen, _SC_GETGR_R_SIZE_MAX);
+	int err;
+
+	for (;;) {
+		buf = malloc(sizeof(*buf) + buflen);
+		if (!buf) {
+			*err_p = ENOMEM;
+			return NULL;
+		}
+		do {
+			if (name)
+				err = getgrnam_r(name, &buf->grbuf, buf->buf,
+						 buflen, &gr);
+			else
+				err = getgrgid_r(gid, &buf->grbuf, buf->buf,
+						 buflen, &gr);
+		} while (err == EINTR);
+		if (err != ERANGE)
 			break;
+		free(buf);
+		buflen *= 2;
+		nss_buflen_grow(&gr_buflen, buflen);
 	}
 
-	if (index == MAX_MATCHES) {
-		IDMAP_LOG(4, ("regexp_getpwnam: user '%s' did not match regex", name));
-		err = ENOENT;
-		goto err_free_buf;
+	if (!gr) {
+		free(buf);
+		*err_p = err ? err : ENOENT;
+		return NULL;
 	}
+	*err_p = 0;
+	return gr;
+}
 
-	namelen = matches[index].rm_eo - matches[index].rm_so;
-	localname= malloc(namelen + 1);
-	if (!localname)
-	{
-		err = ENOMEM;
-		goto err_free_buf;
+/*
+ * Most User-Regex and Group-Regex settings just strip a fixed prefix or
+ * suffix, as in "^(.*)@EXAMPLE\.COM$".  Such a pattern is recognised
+ * when the plugin is initialised and then matched by comparing the
+ * affixes, without calling regexec().  The capture may be ".*", ".+",
+ * "[^c]*" or "[^c]+" for a single character c that has no case.
+ */
+struct regex_affix {
+	int active;
+	char prefix[256];
+	size_t prefix_len;
+	char suffix[256];
+	size_t suffix_len;
+	int nonempty;		/* the capture may not be empty */
+	int exclude;		/* a character the capture may not contain */
+};
+
+static struct regex_affix user_affix, group_affix;
+
+/* Copy the ERE literal at *@re, up to @stop, to @out */
+static int regex_parse_literal(const char **re, char stop, char *out,
+			       size_t size, size_t *len)
+{
+	const char *p = *re;
+	size_t n = 0;
+
+	for (; *p != stop; p++) {
+		if (*p == '\0' || strchr(".[]()*+?{}|^$", *p))
+			return -1;
+		if (*p == '\\') {
+			p++;
+			if (*p == '\0' || isalnum((unsigned char)*p))
+				return -1;
+		}
+		if (n + 1 >= size)
+			return -1;
+		out[n++] = *p;
+	}
+	out[n] = '\0';
+	*len = n;
+	*re = p;
+	return 0;
+}
+
+static void regex_parse_affix(const char *re, struct regex_affix *a)
+{
+	memset(a, 0, sizeof(*a));
+
+	if (*re++ != '^')
+		return;
+	if (regex_parse_literal(&re, '(', a->prefix, sizeof(a->prefix),
+				&a->prefix_len))
+		return;
+	re++;
+	if (re[0] == '.') {
+		re++;
+	} else if (re[0] == '[' && re[1] == '^' && re[2] != '\0' &&
+		   re[3] == ']' && !isalpha((unsigned char)re[2]) &&
+		   !strchr("]\\-[", re[2])) {
+		a->exclude = re[2];
+		re += 4;
+	} else
+		return;
+	if (*re == '+')
+		a->nonempty = 1;
+	else if (*re != '*')
+		return;
+	if (*++re != ')')
+		return;
+	re++;
+	if (regex_parse_literal(&re, '$', a->suffix, sizeof(a->suffix),
+				&a->suffix_len))
+		return;
+	if (re[1] != '\0')
+		return;
+	a->active = 1;
+}
+
+/*
+ * Match @name against @re, and return a copy of the first matched
+ * subexpression, the local name, or NULL with *err_p set.
+ */
+static char *regex_match(regex_t *re, struct regex_affix *a,
+			 const char *name, int *err_p)
+{
+	regmatch_t matches[MAX_MATCHES];
+	const char *start;
+	char *localname;
+	size_t namelen;
+	int index;
+
+	if (a->active) {
+		namelen = strlen(name);
+		if (namelen < a->prefix_len + a->suffix_len ||
+		    strncasecmp(name, a->prefix, a->prefix_len) ||
+		    strncasecmp(name + namelen - a->suffix_len, a->suffix,
+				a->suffix_len))
+			goto nomatch;
+		start = name + a->prefix_len;
+		namelen -= a->prefix_len + a->suffix_len;
+		if ((a->nonempty && namelen == 0) ||
+		    (a->exclude && memchr(start, a->exclude, namelen)))
+			goto nomatch;
+	} else {
+		if (regexec(re, name, MAX_MATCHES, matches, 0))
+			goto nomatch;
+
+		for (index = 1; index < MAX_MATCHES ; index++)
+		{
+			if (matches[index].rm_so >= 0)
+				break;
+		}
+
+		if (index == MAX_MATCHES)
+			goto nomatch;
+
+		start = name + matches[index].rm_so;
+		namelen = matches[index].rm_eo - matches[index].rm_so;
 	}
-	strncpy(localname, name+matches[index].rm_so, namelen);
+
+	localname = malloc(namelen + 1);
+	if (!localname) {
+		*err_p = ENOMEM;
+		return NULL;
+	}
+	memcpy(localname, start, namelen);
 	localname[namelen] = '\0';
+	return localname;
+
+nomatch:
+	*err_p = ENOENT;
+	return NULL;
+}
 
-again:
-	err = getpwnam_r(localname, &buf->pwbuf, buf->buf, buflen, &pw);
+/*
+ * Regexp Translation Methods
+ *
+ */
 
-	if (err == EINTR)
-		goto again;
+static struct passwd *regex_getpwnam(const char *name, const char *UNUSED(domain),
+				      int *err_p)
+{
+	struct passwd *pw;
+	char *localname;
+	int err;
 
-	if (!pw) {
-		if (err == 0)
-			err = ENOENT;
+	localname = regex_match(&user_re, &user_affix, name, &err);
+	if (!localname) {
+		if (err == ENOENT)
+			IDMAP_LOG(4, ("regexp_getpwnam: user '%s' did not match regex", name));
+		goto err;
+	}
 
+	pw = regex_nss_getpw(localname, 0, &err);
+	if (!pw) {
 		IDMAP_LOG(4, ("regex_getpwnam: local user '%s' for '%s' not found",
 		  localname, name));
 
@@ -163,8 +364,6 @@ again:
 
 err_free_name:
 	free(localname);
-err_free_buf:
-	free(buf);
 err:
 	*err_p = err;
 	return NULL;
@@ -174,51 +373,17 @@ static struct group *regex_getgrnam(const char *name, const char *UNUSED(domain)
 				      int *err_p)
 {
 	struct group *gr;
-	struct grbuf *buf;
-	size_t buflen = sysconf(_SC_GETGR_R_SIZE_MAX);
 	char *localgroup;
 	char *groupname;
-	size_t namelen;
 	int err = 0;
-	int index;
-	int status;
-	regmatch_t matches[MAX_MATCHES];
 
-	buf = malloc(sizeof(*buf) + buflen);
-	if (!buf) {
-		err = ENOMEM;
+	localgroup = regex_match(&group_re, &group_affix, name, &err);
+	if (!localgroup) {
+		if (err == ENOENT)
+			IDMAP_LOG(4, ("regexp_getgrnam: group '%s' did not match regex", name));
 		goto err;
 	}
 
-	status = regexec(&group_re, name, MAX_MATCHES, matches, 0);
-	if (status) {
-		IDMAP_LOG(4, ("regexp_getgrnam: group '%s' did not match regex", name));
-		err = ENOENT;
-		goto err_free_buf;
-	}
-
-	for (index = 1; index < MAX_MATCHES ; index++)
-	{
-		if (matches[index].rm_so >= 0)
-			break;
-	}
-
-	if (index == MAX_MATCHES) {
-		IDMAP_LOG(4, ("regexp_getgrnam: group '%s' did not match regex", name));
-		err = ENOENT;
-		goto err_free_buf;
-	}
-
-	namelen = matches[index].rm_eo - matches[index].rm_so;
-	localgroup = malloc(namelen + 1);
-	if (!localgroup)
-	{
-		err = ENOMEM;
-		goto err_free_buf;
-	}
-	strncpy(localgroup, name+matches[index].rm_so, namelen);
-	localgroup[namelen] = '\0';
-
 	IDMAP_LOG(4, ("regexp_getgrnam: group '%s' after match of regex", localgroup));
 
         groupname = localgroup;
@@ -241,16 +406,8 @@ static struct group *regex_getgrnam(const char *name, const char *UNUSED(domain)
 
 	IDMAP_LOG(4, ("regexp_getgrnam: will use '%s'", groupname));
 
-again:
-	err = getgrnam_r(groupname, &buf->grbuf, buf->buf, buflen, &gr);
-
-	if (err == EINTR)
-		goto again;
-
+	gr = regex_nss_getgr(groupname, 0, &err);
 	if (!gr) {
-		if (err == 0)
-			err = ENOENT;
-
 		IDMAP_LOG(4, ("regex_getgrnam: local group '%s' for '%s' not found", groupname, name));
 
 		goto err_free_name;
@@ -265,8 +422,6 @@ again:
 
 err_free_name:
 	free(localgroup);
-err_free_buf:
-	free(buf);
 err:
 	*err_p = err;
 	return NULL;
@@ -363,55 +518,29 @@ static int write_name(char *dest, char *localname, const char* name_prefix, cons
 
 static int regex_uid_to_name(uid_t uid, char *domain, char *name, size_t len)
 {
-	struct passwd *pw = NULL;
-	struct passwd pwbuf;
-	char *buf;
-	size_t buflen = sysconf(_SC_GETPW_R_SIZE_MAX);
-	int err = -ENOMEM;
-
-	buf = malloc(buflen);
-	if (!buf)
-		goto out;
+	struct passwd *pw;
+	int err;
+
 	if (domain == NULL)
 		domain = get_default_domain();
-	err = -getpwuid_r(uid, &pwbuf, buf, buflen, &pw);
-	if (pw == NULL)
-		err = -ENOENT;
-	if (err)
-		goto out_buf;
+	pw = regex_nss_getpw(NULL, uid, &err);
+	if (!pw)
+		return -err;
 	err = write_name(name, pw->pw_name, &empty, user_prefix, user_suffix, len);
-out_buf:
-	free(buf);
-out:
+	free(pw);
 	return err;
 }
 
 static int regex_gid_to_name(gid_t gid, char *UNUSED(domain), char *name, size_t len)
 {
-	struct group *gr = NULL;
-	struct group grbuf;
-	char *buf;
+	struct group *gr;
     const char *name_prefix;
-	size_t buflen = sysconf(_SC_GETGR_R_SIZE_MAX);
 	int err;
     char * groupname = NULL;
 
-	do {
-		err = -ENOMEM;
-		buf = malloc(buflen);
-		if (!buf)
-			goto out;
-		err = -getgrgid_r(gid, &grbuf, buf, buflen, &gr);
-		if (gr == NULL && !err)
-			err = -ENOENT;
-		if (err == -ERANGE) {
-			buflen *= 2;
-			free(buf);
-		}
-	} while (err == -ERANGE);
-
-	if (err)
-		goto out_buf;
+	gr = regex_nss_getgr(NULL, gid, &err);
+	if (!gr)
+		return -err;
 
 	groupname = gr->gr_name;
     	name_prefix = group_name_prefix;
@@ -434,9 +563,7 @@ static int regex_gid_to_name(gid_t gid, char *UNUSED(domain), char *name, size_t
       
 	err = write_name(name, groupname, name_prefix, group_prefix, group_suffix, len);
 
-out_buf:
-	free(buf);
-out:
+	free(gr);
 	return err;
 }
 
@@ -458,6 +585,7 @@ static int regex_init(void) {
 		warnx("regex_init: compiling regex for user mapping failed with status %u", status);
 		goto error1;
 	}
+	regex_parse_affix(string, &user_affix);
 
 	string = CONFIG_GET_STRING("Regex", "Group-Regex");
 	if (!string)
@@ -472,6 +600,7 @@ static int regex_init(void) {
 		warnx("regex_init: compiling regex for group mapping failed with status %u", status);
 		goto error2;
     }
+	regex_parse_affix(string, &group_affix);
 
 	group_name_prefix = CONFIG_GET_STRING("Regex", "Group-Name-Prefix");
     if (!group_name_prefix)
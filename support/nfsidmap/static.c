@@ -34,7 +34,9 @@
 
 #include <unistd.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
+#include <ctype.h>
 #include <sys/types.h>
 #include <pwd.h>
 #include <grp.h>
@@ -63,34 +65,60 @@ struct grbuf {
 	char buf[1];
 };
 
-struct uid_mapping {
-	LIST_ENTRY (uid_mapping) link;
+/*
+ * A principal named in [Static], with the account and group its local
+ * name resolved to when the tables were built.  Each mapping is chained
+ * in three hash tables: by principal, by uid and by gid.
+ */
+struct static_mapping {
+	struct static_mapping *name_next;
+	struct static_mapping *uid_next;
+	struct static_mapping *gid_next;
+	char *principal;
+	char *localname;
+	int has_user;
 	uid_t uid;
-	char * principal;
-	char * localname;
+	gid_t pw_gid;		/* primary group of the account */
+	int has_group;
+	gid_t gid;
 };
 
-struct gid_mapping {
-	LIST_ENTRY (gid_mapping) link;
-	gid_t gid;
-	char * principal;
-	char * localgroup;
+struct static_table {
+	struct static_mapping **buckets;
+	unsigned int mask;	/* buckets - 1, a power of 2 less one */
 };
 
-static __inline__ u_int8_t uid_hash (uid_t uid)
+static struct static_table name_mappings, uid_mappings, gid_mappings;
+
+/* Principals are compared without case, as [Static] tags are */
+static unsigned int name_hash(const char *name)
 {
-	return uid % 256;
+	uint32_t hash = 2166136261u;
+
+	while (*name) {
+		hash ^= (unsigned char)tolower((unsigned char)*name++);
+		hash *= 16777619u;
+	}
+	return hash;
 }
 
-static __inline__ u_int8_t gid_hash (gid_t gid)
+static unsigned int id_hash(uint32_t id)
 {
-	return gid % 256;
+	return (id * 2654435761u) ^ (id >> 16);
 }
 
-//Hash tables of uid and guids to principals mappings.
-//We reuse some queue/hash functions from cfg.c.
-LIST_HEAD (uid_mappings, uid_mapping) uid_mappings[256];
-LIST_HEAD (gid_mappings, gid_mapping) gid_mappings[256];
+static struct static_mapping *static_find(const char *name)
+{
+	struct static_mapping *sm;
+
+	if (name_mappings.buckets == NULL)
+		return NULL;
+	for (sm = name_mappings.buckets[name_hash(name) & name_mappings.mask];
+	     sm; sm = sm->name_next)
+		if (strcasecmp(sm->principal, name) == 0)
+			return sm;
+	return NULL;
+}
 
 static struct passwd *static_getpwnam(const char *name,
 				      const char *UNUSED(domain),
@@ -198,6 +226,7 @@ static int static_gss_princ_to_ids(char *secname, char *princ,
 				   uid_t *uid, uid_t *gid,
 				   extra_mapping_params **UNUSED(ex))
 {
+	struct static_mapping *sm;
 	struct passwd *pw;
 	int err;
 
@@ -205,6 +234,13 @@ static int static_gss_princ_to_ids(char *secname, char *princ,
 	if (strcmp(secname, "krb5") != 0 && strcmp(secname, "spkm3") != 0)
 		return -EINVAL;
 
+	sm = static_find(princ);
+	if (sm && sm->has_user) {
+		*uid = sm->uid;
+		*gid = sm->pw_gid;
+		return 0;
+	}
+
 	pw = static_getpwnam(princ, NULL, &err);
 
 	if (pw) {
@@ -220,6 +256,7 @@ static int static_gss_princ_to_grouplist(char *secname, char *princ,
 					 gid_t *groups, int *ngroups,
 					 extra_mapping_params **UNUSED(ex))
 {
+	struct static_mapping *sm;
 	struct passwd *pw;
 	int err;
 
@@ -227,6 +264,13 @@ static int static_gss_princ_to_grouplist(char *secname, char *princ,
 	if (strcmp(secname, "krb5") != 0 && strcmp(secname, "spkm3") != 0)
 		return -EINVAL;
 
+	sm = static_find(princ);
+	if (sm && sm->has_user) {
+		if (getgrouplist(sm->localname, sm->pw_gid, groups, ngroups) < 0)
+			return -ERANGE;
+		return 0;
+	}
+
 	pw = static_getpwnam(princ, NULL, &err);
 
 	if (pw) {
@@ -240,9 +284,16 @@ static int static_gss_princ_to_grouplist(char *secname, char *princ,
 
 static int static_name_to_uid(char *name, uid_t *uid)
 {
+	struct static_mapping *sm;
 	struct passwd *pw;
 	int err;
 
+	sm = static_find(name);
+	if (sm && sm->has_user) {
+		*uid = sm->uid;
+		return 0;
+	}
+
 	pw = static_getpwnam(name, NULL, &err);
 
 	if (pw) {
@@ -255,9 +306,16 @@ static int static_name_to_uid(char *name, uid_t *uid)
 
 static int static_name_to_gid(char *name, gid_t *gid)
 {
+	struct static_mapping *sm;
 	struct group *gr;
 	int err;
 
+	sm = static_find(name);
+	if (sm && sm->has_group) {
+		*gid = sm->gid;
+		return 0;
+	}
+
 	gr = static_getgrnam(name, NULL, &err);
 
 	if (gr) {
@@ -268,14 +326,18 @@ static int static_name_to_gid(char *name, gid_t *gid)
 	return -err;
 }
 
-static int static_uid_to_name(uid_t uid, char *UNUSED(domain), char *name, size_t UNUSED(len))
+static int static_uid_to_name(uid_t uid, char *UNUSED(domain), char *name, size_t len)
 {
-	struct uid_mapping * um;
+	struct static_mapping *sm;
 
-	for (um = LIST_FIRST (&uid_mappings[uid_hash (uid)]); um;
-		um = LIST_NEXT (um, link)) {
-		if (um->uid == uid) {
-			strcpy(name, um->principal);
+	if (uid_mappings.buckets == NULL)
+		return -ENOENT;
+	for (sm = uid_mappings.buckets[id_hash(uid) & uid_mappings.mask]; sm;
+	     sm = sm->uid_next) {
+		if (sm->uid == uid) {
+			if (strlen(sm->principal) >= len)
+				return -ERANGE;
+			strcpy(name, sm->principal);
 			return 0;
 		}
 	}
@@ -283,14 +345,18 @@ static int static_uid_to_name(uid_t uid, char *UNUSED(domain), char *name, size_
 	return -ENOENT;
 }
 
-static int static_gid_to_name(gid_t gid, char *UNUSED(domain), char *name, size_t UNUSED(len))
+static int static_gid_to_name(gid_t gid, char *UNUSED(domain), char *name, size_t len)
 {
-	struct gid_mapping * gm;
+	struct static_mapping *sm;
 
-	for (gm = LIST_FIRST (&gid_mappings[gid_hash (gid)]); gm;
-		gm = LIST_NEXT (gm, link)) {
-		if (gm->gid == gid) {
-			strcpy(name, gm->principal);
+	if (gid_mappings.buckets == NULL)
+		return -ENOENT;
+	for (sm = gid_mappings.buckets[id_hash(gid) & gid_mappings.mask]; sm;
+	     sm = sm->gid_next) {
+		if (sm->gid == gid) {
+			if (strlen(sm->principal) >= len)
+				return -ERANGE;
+			strcpy(name, sm->principal);
 			return 0;
 		}
 	}
@@ -298,24 +364,56 @@ static int static_gid_to_name(gid_t gid, char *UNUSED(domain), char *name, size_
 	return -ENOENT;
 }
 
+static void static_free_tables(void)
+{
+	struct static_mapping *sm, *next;
+	unsigned int i;
+
+	if (name_mappings.buckets) {
+		for (i = 0; i <= name_mappings.mask; i++) {
+			for (sm = name_mappings.buckets[i]; sm; sm = next) {
+				next = sm->name_next;
+				free(sm->principal);
+				free(sm);
+			}
+		}
+	}
+	free(name_mappings.buckets);
+	free(uid_mappings.buckets);
+	free(gid_mappings.buckets);
+	memset(&name_mappings, 0, sizeof(name_mappings));
+	memset(&uid_mappings, 0, sizeof(uid_mappings));
+	memset(&gid_mappings, 0, sizeof(gid_mappings));
+}
+
+static int static_alloc_table(struct static_table *t, unsigned int nbuckets)
+{
+	t->buckets = calloc(nbuckets, sizeof(*t->buckets));
+	if (!t->buckets) {
+		warnx("static_init: calloc (%u, %lu) failed", nbuckets,
+			(unsigned long)sizeof(*t->buckets));
+		return -ENOMEM;
+	}
+	t->mask = nbuckets - 1;
+	return 0;
+}
+
 /*
- * We buffer all UID's for which static mappings is defined in advance, so the
- * uid_to_name functions will be fast enough.
+ * We resolve all principals for which static mappings are defined in
+ * advance, into tables with about one bucket per mapping, so that
+ * lookups in either direction are fast however many there are.
  */
 
 static int static_init(void) {	
 	int err;
 	struct conf_list * princ_list = NULL;
-	struct conf_list_node * cln, *next;
-	struct uid_mapping * unode;
-	struct gid_mapping * gnode;
+	struct conf_list_node * cln;
+	struct static_mapping * sm;
 	struct passwd * pw = NULL;
 	struct group * gr = NULL;
-	unsigned int i;
+	unsigned int nbuckets, h;
 
-	//init hash_table first
-	for (i = 0; i < sizeof uid_mappings / sizeof uid_mappings[0]; i++)
-		LIST_INIT (&uid_mappings[i]);
+	static_free_tables();
 
 	if (nfsidmap_conf_path)
 		conf_init_file(nfsidmap_conf_path);
@@ -327,82 +425,76 @@ static int static_init(void) {
 		return -ENOENT;
 	}
 
+	for (nbuckets = 16; nbuckets < (unsigned int)princ_list->cnt &&
+	     nbuckets < (1U << 30); nbuckets <<= 1)
+		;
+	if (static_alloc_table(&name_mappings, nbuckets) ||
+	    static_alloc_table(&uid_mappings, nbuckets) ||
+	    static_alloc_table(&gid_mappings, nbuckets)) {
+		static_free_tables();
+		conf_free_list(princ_list);
+		return -ENOMEM;
+	}
+
 	/* As we can not distinguish between mappings for users and groups, we try to
 	 * resolve all mappings for both cases.
 	 */
-
-	//resolve uid of localname account for all such principals and cache it
-	for (cln = TAILQ_FIRST (&princ_list->fields); cln; cln = next) 
-	{ 
-		next = TAILQ_NEXT (cln, link); 
-
-		pw = static_getpwnam(cln->field, NULL, &err);
-		if (!pw) {
+	TAILQ_FOREACH(cln, &princ_list->fields, link) {
+		if (static_find(cln->field))
 			continue;
-		}
-		
-		unode = calloc (1, sizeof *unode);
-		if (!unode)
+
+		sm = calloc (1, sizeof *sm);
+		if (sm)
+			sm->principal = strdup(cln->field);
+		if (!sm || !sm->principal)
 		{
 			warnx("static_init: calloc (1, %lu) failed",
-				(unsigned long)sizeof *unode);
-			free(pw);
+				(unsigned long)sizeof *sm);
+			free(sm);
+			static_free_tables();
 			conf_free_list(princ_list);
 			return -ENOMEM;
 		}
-		unode->uid = pw->pw_uid;
-		unode->principal = strdup(cln->field);
 
-		unode->localname = conf_get_str("Static", cln->field);
-		if (!unode->localname) {
-			free(pw);
-			free(unode->principal);
-			free(unode);
+		sm->localname = conf_get_str("Static", cln->field);
+		if (!sm->localname) {
+			free(sm->principal);
+			free(sm);
+			static_free_tables();
 			conf_free_list(princ_list);
 			return -ENOENT;
 		}
 
-		free(pw);
+		h = name_hash(sm->principal) & name_mappings.mask;
+		sm->name_next = name_mappings.buckets[h];
+		name_mappings.buckets[h] = sm;
 
-		LIST_INSERT_HEAD (&uid_mappings[uid_hash(unode->uid)], unode, link);
-	}
+		//resolve uid of localname account for all such principals and cache it
+		pw = static_getpwnam(cln->field, NULL, &err);
+		if (pw) {
+			sm->has_user = 1;
+			sm->uid = pw->pw_uid;
+			sm->pw_gid = pw->pw_gid;
+			free(pw);
 
-	//resolve gid of localgroup accounts and cache it
-	for (cln = TAILQ_FIRST (&princ_list->fields); cln; cln = next) 
-	{ 
-		next = TAILQ_NEXT (cln, link); 
+			h = id_hash(sm->uid) & uid_mappings.mask;
+			sm->uid_next = uid_mappings.buckets[h];
+			uid_mappings.buckets[h] = sm;
+		}
 
+		//resolve gid of localgroup accounts and cache it
 		gr = static_getgrnam(cln->field, NULL, &err);
-		if (!gr) {
-			continue;
-		}
-		
-		gnode = calloc (1, sizeof *gnode);
-		if (!gnode)
-		{
-			warnx("static_init: calloc (1, %lu) failed",
-				(unsigned long)sizeof *gnode);
+		if (gr) {
+			sm->has_group = 1;
+			sm->gid = gr->gr_gid;
 			free(gr);
-			conf_free_list(princ_list);
-			return -ENOMEM;
-		}
-		gnode->gid = gr->gr_gid;
-		gnode->principal = strdup(cln->field);
 
-		gnode->localgroup = conf_get_str("Static", cln->field);
-		if (!gnode->localgroup) {
-			free(gr);
-			free(gnode->principal);
-			free(gnode);
-			conf_free_list(princ_list);
-			return -ENOENT;
+			h = id_hash(sm->gid) & gid_mappings.mask;
+			sm->gid_next = gid_mappings.buckets[h];
+			gid_mappings.buckets[h] = sm;
 		}
-
-		free(gr);
-
-		LIST_INSERT_HEAD (&gid_mappings[gid_hash(gnode->gid)], gnode, link);
 	}
-	
+
 	conf_free_list(princ_list);
 	return 0;
 }
@@ -44,6 +44,9 @@
 #include <limits.h>
 #include <pwd.h>
 #include <err.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
 #ifdef HAVE_GSSAPI_GSSAPI_KRB5_H
 #include <gssapi/gssapi_krb5.h>
 #endif /* HAVE_GSSAPI_GSSAPI_KRB5_H */
@@ -75,6 +78,9 @@
 #define DEFAULT_UMICH_ATTR_MEMBEROF		"memberof"
 
 #define DEFAULT_UMICH_SEARCH_TIMEOUT		4
+#define DEFAULT_UMICH_POOL_SIZE			4
+#define DEFAULT_UMICH_IDLE_TIMEOUT		300
+#define DEFAULT_UMICH_RETRY_MAX			60
 
 /* config section */
 #define LDAP_SECTION "UMICH_SCHEMA"
@@ -100,8 +106,16 @@ struct ldap_map_names{
 	char *NFSv4_grouplist_filter; /* Filter for grouplist lookups */
 };
 
+struct umich_ldap_server {
+	char *name;		/* server name/address */
+	int failures;		/* connects failed in a row */
+	time_t retry_at;	/* not to be tried again before */
+};
+
 struct umich_ldap_info {
-	char *server;		/* server name/address */
+	char *server;		/* first server name/address */
+	struct umich_ldap_server *servers;
+	int nservers;
 	int  port;		/* server port */
 	char *base;		/* base DN */
 	char *people_tree;	/* base DN to start searches for people */
@@ -123,6 +137,18 @@ struct umich_ldap_info {
 	char *sasl_secprops;	/* Cyrus SASL security properties. */
 	int sasl_canonicalize;	/* canonicalize LDAP server host name */
 	char *sasl_krb5_ccname;	/* krb5 ticket cache */
+	int pool_size;		/* idle connections kept for reuse */
+	int idle_timeout;	/* seconds an idle connection is kept */
+	int retry_max;		/* longest wait before retrying a server */
+};
+
+/* A bound connection, lent to one lookup at a time */
+struct umich_ldap_conn {
+	LDAP *ld;
+	int server;		/* index in linfo->servers */
+	int reused;		/* taken from the pool */
+	int sizelimit;
+	time_t idle_since;
 };
 
 /* GLOBAL data */
@@ -148,8 +174,16 @@ static struct umich_ldap_info ldap_info = {
 	.sasl_secprops = NULL,
 	.sasl_canonicalize = -1, /* leave to the LDAP lib */
 	.sasl_krb5_ccname = NULL,
+	.pool_size = DEFAULT_UMICH_POOL_SIZE,
+	.idle_timeout = DEFAULT_UMICH_IDLE_TIMEOUT,
+	.retry_max = DEFAULT_UMICH_RETRY_MAX,
 };
 
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct umich_ldap_conn *pool_idle;
+static int pool_nidle;
+static unsigned int pool_next;	/* server for the next new connection */
+
 static struct ldap_map_names ldap_map = {
 	.NFSv4_person_objcls = NULL,
 	.NFSv4_nfsname_attr = NULL,
@@ -281,10 +315,10 @@ static int sasl_interact_cb(__attribute__((unused)) LDAP * ld,
 
 static int
 ldap_init_and_bind(LDAP **pld,
-		   int *sizelimit,
+		   const char *server,
 		   struct umich_ldap_info *linfo)
 {
-	LDAP *ld;
+	LDAP *ld = NULL;
 	int lerr;
 	int err = -1;
 	int current_version, new_version;
@@ -295,12 +329,8 @@ ldap_init_and_bind(LDAP **pld,
 
 	snprintf(server_url, sizeof(server_url), "%s://%s:%d",
 		 (linfo->use_ssl) ? "ldaps" : "ldap",
-		 linfo->server, linfo->port);
+		 server, linfo->port);
 
-	/*
-	 * XXX We really, REALLY only want to initialize once, not for
-	 * each request.  Figure out how to do that!
-	 */
 	if ((lerr = ldap_initialize(&ld, server_url)) != LDAP_SUCCESS) {
 		IDMAP_LOG(0, ("ldap_init_and_bind: ldap_initialize() failed "
 			  "to [%s]: %s (%d)", server_url,
@@ -343,11 +373,6 @@ ldap_init_and_bind(LDAP **pld,
 	ldap_memfree (apiinfo.ldapai_extensions);
 	ldap_memfree(apiinfo.ldapai_vendor_name);
 
-	/* Set sizelimit option if requested */
-	if (sizelimit) {
-		ldap_set_option(ld, LDAP_OPT_SIZELIMIT, (void *)sizelimit);
-	}
-
 	lerr = ldap_set_option(ld, LDAP_OPT_REFERRALS,
 			linfo->follow_referrals ? (void *)LDAP_OPT_ON :
 						  (void *)LDAP_OPT_OFF);
@@ -513,13 +538,188 @@ retry_bind:
 	*pld = ld;
 	err = 0;
 out:
+	if (err && ld)
+		ldap_unbind(ld);
 	return err;
 }
 
+/*
+ * Connections are kept bound in a pool once their lookup is done, and
+ * reused by later lookups while the server keeps them open.  New ones
+ * go to the configured servers in turn; a server that cannot be reached
+ * is skipped for a second, then twice as long after each further
+ * failure, up to LDAP_retry_max seconds.
+ */
+static int
+umich_ldap_conn_lost(int lerr)
+{
+	return lerr == LDAP_SERVER_DOWN || lerr == LDAP_CONNECT_ERROR ||
+	       lerr == LDAP_TIMEOUT || lerr == LDAP_UNAVAILABLE ||
+	       lerr == LDAP_BUSY;
+}
+
+/* An idle connection that is readable has been closed by the server */
+static int
+umich_ldap_conn_ok(LDAP *ld)
+{
+	struct pollfd pfd = { .events = POLLIN };
+
+	if (ldap_get_option(ld, LDAP_OPT_DESC, &pfd.fd) != LDAP_OPT_SUCCESS ||
+	    pfd.fd < 0)
+		return 0;
+	return poll(&pfd, 1, 0) == 0;
+}
+
+static void
+umich_ldap_pool_drain(void)
+{
+	struct umich_ldap_conn conn;
+
+	pthread_mutex_lock(&pool_lock);
+	while (pool_nidle > 0) {
+		conn = pool_idle[--pool_nidle];
+		pthread_mutex_unlock(&pool_lock);
+		ldap_unbind(conn.ld);
+		pthread_mutex_lock(&pool_lock);
+	}
+	pthread_mutex_unlock(&pool_lock);
+}
+
+static int
+umich_ldap_get(struct umich_ldap_conn *conn, int sizelimit,
+	       struct umich_ldap_info *linfo)
+{
+	struct umich_ldap_server *srv;
+	time_t now = time(NULL);
+	unsigned int start;
+	int i, n, skip, delay;
+
+	for (;;) {
+		pthread_mutex_lock(&pool_lock);
+		if (pool_nidle == 0) {
+			pthread_mutex_unlock(&pool_lock);
+			break;
+		}
+		*conn = pool_idle[--pool_nidle];
+		pthread_mutex_unlock(&pool_lock);
+
+		if ((linfo->idle_timeout <= 0 ||
+		     now - conn->idle_since < linfo->idle_timeout) &&
+		    umich_ldap_conn_ok(conn->ld)) {
+			conn->reused = 1;
+			goto found;
+		}
+		IDMAP_LOG(3, ("umich_ldap_get: dropping idle connection "
+			  "to %s", linfo->servers[conn->server].name));
+		ldap_unbind(conn->ld);
+	}
+
+	pthread_mutex_lock(&pool_lock);
+	start = pool_next++;
+	pthread_mutex_unlock(&pool_lock);
+
+	for (i = 0; i < linfo->nservers; i++) {
+		n = (start + i) % linfo->nservers;
+		srv = &linfo->servers[n];
+
+		pthread_mutex_lock(&pool_lock);
+		skip = srv->retry_at > now;
+		pthread_mutex_unlock(&pool_lock);
+		if (skip)
+			continue;
+
+		if (ldap_init_and_bind(&conn->ld, srv->name, linfo) == 0) {
+			pthread_mutex_lock(&pool_lock);
+			srv->failures = 0;
+			srv->retry_at = 0;
+			pthread_mutex_unlock(&pool_lock);
+			conn->server = n;
+			conn->reused = 0;
+			goto found;
+		}
+
+		if (linfo->retry_max <= 0)
+			continue;
+		pthread_mutex_lock(&pool_lock);
+		if (srv->failures < 16)
+			srv->failures++;
+		delay = 1 << (srv->failures - 1);
+		if (delay > linfo->retry_max)
+			delay = linfo->retry_max;
+		srv->retry_at = time(NULL) + delay;
+		pthread_mutex_unlock(&pool_lock);
+		IDMAP_LOG(1, ("umich_ldap_get: not trying %s again for %d "
+			  "seconds", srv->name, delay));
+	}
+	conn->ld = NULL;
+	return -1;
+
+found:
+	conn->sizelimit = sizelimit;
+	ldap_set_option(conn->ld, LDAP_OPT_SIZELIMIT, &conn->sizelimit);
+	return 0;
+}
+
+/* Give @conn back to the pool, unless it failed or the pool is full */
+static void
+umich_ldap_put(struct umich_ldap_conn *conn, struct umich_ldap_info *linfo)
+{
+	int lerr = LDAP_SUCCESS;
+
+	if (conn->ld == NULL)
+		return;
+
+	ldap_get_option(conn->ld, LDAP_OPT_RESULT_CODE, &lerr);
+	if (!umich_ldap_conn_lost(lerr)) {
+		pthread_mutex_lock(&pool_lock);
+		if (pool_nidle < linfo->pool_size) {
+			conn->idle_since = time(NULL);
+			pool_idle[pool_nidle++] = *conn;
+			conn->ld = NULL;
+		}
+		pthread_mutex_unlock(&pool_lock);
+	}
+	if (conn->ld)
+		ldap_unbind(conn->ld);
+	conn->ld = NULL;
+}
+
+/*
+ * ldap_search_st() on @conn.  A connection from the pool that turns out
+ * to be dead is replaced, and the search tried again once, so that a
+ * server closing idle connections does not fail lookups.
+ */
+static int
+umich_ldap_search(struct umich_ldap_conn *conn, char *base, char *filter,
+		  char **attrs, struct timeval *timeout, LDAPMessage **result,
+		  struct umich_ldap_info *linfo)
+{
+	int err;
+
+	*result = NULL;
+	err = ldap_search_st(conn->ld, base, LDAP_SCOPE_SUBTREE, filter,
+			     attrs, 0, timeout, result);
+	if (err == LDAP_SUCCESS || !conn->reused || !umich_ldap_conn_lost(err))
+		return err;
+
+	IDMAP_LOG(2, ("umich_ldap_search: connection to %s lost: %s (%d)",
+		  linfo->servers[conn->server].name,
+		  ldap_err2string(err), err));
+	if (*result)
+		ldap_msgfree(*result);
+	*result = NULL;
+	ldap_unbind(conn->ld);
+	if (umich_ldap_get(conn, conn->sizelimit, linfo))
+		return err;
+	return ldap_search_st(conn->ld, base, LDAP_SCOPE_SUBTREE, filter,
+			      attrs, 0, timeout, result);
+}
+
 static int
 umich_name_to_ids(char *name, int idtype, uid_t *uid, gid_t *gid,
 		  char *attrtype, struct umich_ldap_info *linfo)
 {
+	struct umich_ldap_conn conn = { .ld = NULL };
 	LDAP *ld = NULL;
 	struct timeval timeout = {
 		.tv_sec = linfo->ldap_timeout,
@@ -571,16 +771,16 @@ umich_name_to_ids(char *name, int idtype, uid_t *uid, gid_t *gid,
 		goto out;
 	}
 
-	if (ldap_init_and_bind(&ld, &sizelimit, linfo))
+	if (umich_ldap_get(&conn, sizelimit, linfo))
 		goto out;
 
 	attrs[0] = ldap_map.NFSv4_uid_attr;
 	attrs[1] = ldap_map.NFSv4_gid_attr;
 	attrs[2] = NULL;
 
-	err = ldap_search_st(ld, base, LDAP_SCOPE_SUBTREE,
-			 filter, (char **)attrs,
-			 0, &timeout, &result);
+	err = umich_ldap_search(&conn, base, filter, (char **)attrs,
+				&timeout, &result, linfo);
+	ld = conn.ld;
 	if (err) {
 		char *errmsg;
 
@@ -674,7 +874,7 @@ out_memfree:
 out_unbind:
 	if (result)
 		ldap_msgfree(result);
-	ldap_unbind(ld);
+	umich_ldap_put(&conn, linfo);
 out:
 	return err;
 }
@@ -683,6 +883,7 @@ static int
 umich_id_to_name(uid_t id, int idtype, char **name, size_t len,
 		 struct umich_ldap_info *linfo)
 {
+	struct umich_ldap_conn conn = { .ld = NULL };
 	LDAP *ld = NULL;
 	struct timeval timeout = {
 		.tv_sec = linfo->ldap_timeout,
@@ -733,7 +934,7 @@ umich_id_to_name(uid_t id, int idtype, char **name, size_t len,
 		goto out;
 	}
 
-	if (ldap_init_and_bind(&ld, &sizelimit, linfo))
+	if (umich_ldap_get(&conn, sizelimit, linfo))
 		goto out;
 
 	if (idtype == IDTYPE_USER)
@@ -742,9 +943,9 @@ umich_id_to_name(uid_t id, int idtype, char **name, size_t len,
 		attrs[0] = ldap_map.NFSv4_group_nfsname_attr;
 	attrs[1] = NULL;
 
-	err = ldap_search_st(ld, base, LDAP_SCOPE_SUBTREE,
-			 filter, (char **)attrs,
-			 0, &timeout, &result);
+	err = umich_ldap_search(&conn, base, filter, (char **)attrs,
+				&timeout, &result, linfo);
+	ld = conn.ld;
 	if (err) {
 		char * errmsg;
 
@@ -812,94 +1013,30 @@ out_memfree:
 out_unbind:
 	if (result)
 		ldap_msgfree(result);
-	ldap_unbind(ld);
+	umich_ldap_put(&conn, linfo);
 out:
 	return err;
 }
 
+/*
+ * Find the groups of the account @acctname, the account of @principal,
+ * searching on the connection @ld
+ */
 static int
-umich_gss_princ_to_grouplist(char *principal, gid_t *groups, int *ngroups,
-			     struct umich_ldap_info *linfo)
+umich_acct_to_grouplist(LDAP *ld, char *principal, char *acctname,
+			gid_t *groups, int *ngroups,
+			struct umich_ldap_info *linfo)
 {
-	LDAP *ld = NULL;
 	struct timeval timeout = {
 		.tv_sec = linfo->ldap_timeout,
 	};
 	LDAPMessage *result, *entry;
 	char **names, filter[LDAP_FILT_MAXSIZ];
 	char *attrs[2];
-	int count = 0, err = -ENOMEM, lerr, f_len;
+	int count = 0, err = -EINVAL, lerr, f_len;
         int i, num_gids;
 	gid_t *curr_group = groups;
 
-	err = -EINVAL;
-	if (linfo == NULL || linfo->server == NULL ||
-		linfo->people_tree == NULL || linfo->group_tree == NULL)
-		goto out;
-
-
-	if (ldap_init_and_bind(&ld, NULL, linfo))
-		goto out;
-
-	/*
-	 * First we need to map the gss principal name to a uid (name) string
-	 */
-	err = -EINVAL;
-	if ((f_len = snprintf(filter, LDAP_FILT_MAXSIZ,
-			     "(&(objectClass=%s)(%s=%s))",
-			     ldap_map.NFSv4_person_objcls,
-			     ldap_map.GSS_principal_attr, principal))
-			== LDAP_FILT_MAXSIZ) {
-		IDMAP_LOG(0, ("ERROR: umich_gss_princ_to_grouplist: "
-			  "filter too long!"));
-		goto out;
-	}
-
-	attrs[0] = ldap_map.NFSv4_acctname_attr;
-	attrs[1] = NULL;
-
-	err = ldap_search_st(ld, linfo->people_tree, LDAP_SCOPE_SUBTREE,
-			 filter, attrs, 0, &timeout, &result);
-	if (err) {
-		char *errmsg;
-
-		IDMAP_LOG(2, ("umich_gss_princ_to_grouplist: ldap_search_st "
-			  "for tree '%s, filter '%s': %s (%d)",
-			  linfo->people_tree, filter,
-			  ldap_err2string(err), err));
-		if ((ldap_get_option(ld, LDAP_OPT_ERROR_STRING, &errmsg) == LDAP_SUCCESS)
-				&& (errmsg != NULL) && (*errmsg != '\0')) {
-			IDMAP_LOG(2, ("umich_gss_princ_to_grouplist: "
-				   "Additional info: %s", errmsg));
-			ldap_memfree(errmsg);
-		}
-		err = -ENOENT;
-		goto out_unbind;
-	}
-
-	err = -ENOENT;
-	count = ldap_count_entries(ld, result);
-	if (count != 1) {
-		IDMAP_LOG(2, ("umich_gss_princ_to_grouplist: "
-                                "ldap account lookup of gssauthname %s returned %d accounts",
-                                principal,count));
-		goto out_unbind;
-	}
-
-	if (!(entry = ldap_first_entry(ld, result))) {
-		lerr = ldap_result2error(ld, result, 0);
-		IDMAP_LOG(2, ("umich_gss_princ_to_grouplist: ldap_first_entry: "
-			  "%s (%d)", ldap_err2string(lerr), lerr));
-		goto out_unbind;
-	}
-
-	if ((names = ldap_get_values(ld, result, attrs[0])) == NULL) {
-		lerr = ldap_result2error(ld, result, 0);
-		IDMAP_LOG(2, ("umich_gss_princ_to_grouplist: ldap_get_values: "
-			  "%s (%d)", ldap_err2string(lerr), lerr));
-		goto out_unbind;
-	}
-
         if (ldap_info.memberof_for_groups) {
 
             /*
@@ -909,15 +1046,12 @@ umich_gss_princ_to_grouplist(char *principal, gid_t *groups, int *ngroups,
                         "(&(objectClass=%s)(%s=%s))",
                         ldap_map.NFSv4_person_objcls,
                         ldap_map.NFSv4_acctname_attr,
-                        names[0])) == LDAP_FILT_MAXSIZ ) {
+                        acctname)) == LDAP_FILT_MAXSIZ ) {
                 IDMAP_LOG(2, ("ERROR: umich_gss_princ_to_grouplist: "
                           "filter too long!"));
-                ldap_value_free(names);
-                goto out_unbind;
+                goto out;
             }
 
-            ldap_value_free(names);
-
             attrs[0] = ldap_map.NFSv4_member_of_attr;
             attrs[1] = NULL;
 
@@ -938,7 +1072,7 @@ umich_gss_princ_to_grouplist(char *principal, gid_t *groups, int *ngroups,
                         ldap_memfree(errmsg);
                 }
                 err = -ENOENT;
-                goto out_unbind;
+                goto out;
             }
 	    err = -ENOENT;
 
@@ -948,21 +1082,21 @@ umich_gss_princ_to_grouplist(char *principal, gid_t *groups, int *ngroups,
                 IDMAP_LOG(2, ("umich_gss_princ_to_grouplist: "
                     "ldap group member lookup of gssauthname %s returned %d multiple entries",
                          principal,count));
-                goto out_unbind;
+                goto out;
             }
 
             if (!(entry = ldap_first_entry(ld, result))) {
                 lerr = ldap_result2error(ld, result, 0);
                 IDMAP_LOG(2, ("umich_gss_princ_to_grouplist: ldap_first_entry: "
                           "%s (%d)", ldap_err2string(lerr), lerr));
-                goto out_unbind;
+                goto out;
             }
 
             if ((names = ldap_get_values(ld, result, attrs[0])) == NULL) {
                 lerr = ldap_result2error(ld, result, 0);
                 IDMAP_LOG(2, ("umich_gss_princ_to_grouplist: ldap_get_values: "
                           "%s (%d)", ldap_err2string(lerr), lerr));
-                goto out_unbind;
+                goto out;
             }
 
 	    /*  Count the groups first before doing a lookup of the group.
@@ -976,7 +1110,7 @@ umich_gss_princ_to_grouplist(char *principal, gid_t *groups, int *ngroups,
 			  "number of groups %d, exceeds requested number %d",
 			  principal, i, *ngroups));
 		*ngroups = i;
-		goto out_unbind;
+		goto out;
             }
 
             /* Loop through the groupnames (names) and get the group gid */
@@ -1008,7 +1142,7 @@ umich_gss_princ_to_grouplist(char *principal, gid_t *groups, int *ngroups,
                 		IDMAP_LOG(2, ("ERROR: umich_gss_princ_to_grouplist: "
                           		"filter too long!"));
                 		ldap_value_free(names);
-                		goto out_unbind;
+                		goto out;
         	}
 		attrs[0] = ldap_map.NFSv4_gid_attr;
         	attrs[1] = NULL;
@@ -1040,7 +1174,7 @@ umich_gss_princ_to_grouplist(char *principal, gid_t *groups, int *ngroups,
 				"Group %s has %d gids defined - aborting", names[i], count));
 			ldap_value_free(names);
 			err = -ENOENT;
-			goto out_unbind;
+			goto out;
 		}
 
                 vals = ldap_get_values(ld, result, ldap_map.NFSv4_gid_attr);
@@ -1081,7 +1215,7 @@ umich_gss_princ_to_grouplist(char *principal, gid_t *groups, int *ngroups,
                         "(&(objectClass=%s)(%s=%s)%s)",
                         ldap_map.NFSv4_group_objcls,
                         ldap_map.NFSv4_member_attr,
-                        names[0],
+                        acctname,
 			ldap_map.NFSv4_grouplist_filter);
 
             else
@@ -1089,17 +1223,14 @@ umich_gss_princ_to_grouplist(char *principal, gid_t *groups, int *ngroups,
                         "(&(objectClass=%s)(%s=%s))",
                         ldap_map.NFSv4_group_objcls,
                         ldap_map.NFSv4_member_attr,
-                        names[0]);
+                        acctname);
 
             if ( f_len == LDAP_FILT_MAXSIZ ) {
 		IDMAP_LOG(0, ("ERROR: umich_gss_princ_to_grouplist: "
 			  "filter too long!"));
-		ldap_value_free(names);
-		goto out_unbind;
+		goto out;
 	    }
 
-	    ldap_value_free(names);
-
 	    attrs[0] = ldap_map.NFSv4_gid_attr;
 	    attrs[1] = NULL;
 
@@ -1120,7 +1251,7 @@ umich_gss_princ_to_grouplist(char *principal, gid_t *groups, int *ngroups,
 			ldap_memfree(errmsg);
 		}
 		err = -ENOENT;
-		goto out_unbind;
+		goto out;
 	    }
 
 	    /*
@@ -1133,17 +1264,17 @@ umich_gss_princ_to_grouplist(char *principal, gid_t *groups, int *ngroups,
 
 	    if (count < 0) {
 		err = count;
-		goto out_unbind;
+		goto out;
 	    }
 	    if (count == 0) {
 		*ngroups = 0;
 		err = 0;
-		goto out_unbind;
+		goto out;
 	    }
 	    if (count > *ngroups) {
 		*ngroups = count;
 		err = -EINVAL;
-		goto out_unbind;
+		goto out;
 	    }
 	    *ngroups = count;
 
@@ -1165,7 +1296,7 @@ umich_gss_princ_to_grouplist(char *principal, gid_t *groups, int *ngroups,
 		if ((valcount = ldap_count_values(vals)) != 1) {
 			IDMAP_LOG(0, ("DB problem getting gidNumber of "
 				  "posixGroup! (count was %d)", valcount));
-			goto out_unbind;
+			goto out;
 		}
 		tmp_g = strtoul(vals[0], (char **)NULL, 10);
 		tmp_gid = tmp_g;
@@ -1175,7 +1306,7 @@ umich_gss_princ_to_grouplist(char *principal, gid_t *groups, int *ngroups,
 				  "gidNumber too long converting '%s'",
 				  vals[0]));
 			ldap_value_free(vals);
-			goto out_unbind;
+			goto out;
 		}
 		*curr_group++ = tmp_gid;
 		ldap_value_free(vals);
@@ -1183,8 +1314,99 @@ umich_gss_princ_to_grouplist(char *principal, gid_t *groups, int *ngroups,
 	    err = 0;
 	}
 
+out:
+	return err;
+}
+
+static int
+umich_gss_princ_to_grouplist(char *principal, gid_t *groups, int *ngroups,
+			     struct umich_ldap_info *linfo)
+{
+	struct umich_ldap_conn conn = { .ld = NULL };
+	LDAP *ld = NULL;
+	struct timeval timeout = {
+		.tv_sec = linfo->ldap_timeout,
+	};
+	LDAPMessage *result = NULL, *entry;
+	char **names, filter[LDAP_FILT_MAXSIZ];
+	char *attrs[2];
+	int count = 0, err = -ENOMEM, lerr, f_len;
+
+	err = -EINVAL;
+	if (linfo == NULL || linfo->server == NULL ||
+		linfo->people_tree == NULL || linfo->group_tree == NULL)
+		goto out;
+
+	/*
+	 * First we need to map the gss principal name to a uid (name) string
+	 */
+	if ((f_len = snprintf(filter, LDAP_FILT_MAXSIZ,
+			     "(&(objectClass=%s)(%s=%s))",
+			     ldap_map.NFSv4_person_objcls,
+			     ldap_map.GSS_principal_attr, principal))
+			== LDAP_FILT_MAXSIZ) {
+		IDMAP_LOG(0, ("ERROR: umich_gss_princ_to_grouplist: "
+			  "filter too long!"));
+		goto out;
+	}
+
+	if (umich_ldap_get(&conn, 0, linfo))
+		goto out;
+
+	attrs[0] = ldap_map.NFSv4_acctname_attr;
+	attrs[1] = NULL;
+
+	err = umich_ldap_search(&conn, linfo->people_tree, filter, attrs,
+				&timeout, &result, linfo);
+	ld = conn.ld;
+	if (err) {
+		char *errmsg;
+
+		IDMAP_LOG(2, ("umich_gss_princ_to_grouplist: ldap_search_st "
+			  "for tree '%s, filter '%s': %s (%d)",
+			  linfo->people_tree, filter,
+			  ldap_err2string(err), err));
+		if ((ldap_get_option(ld, LDAP_OPT_ERROR_STRING, &errmsg) == LDAP_SUCCESS)
+				&& (errmsg != NULL) && (*errmsg != '\0')) {
+			IDMAP_LOG(2, ("umich_gss_princ_to_grouplist: "
+				   "Additional info: %s", errmsg));
+			ldap_memfree(errmsg);
+		}
+		err = -ENOENT;
+		goto out_unbind;
+	}
+
+	err = -ENOENT;
+	count = ldap_count_entries(ld, result);
+	if (count != 1) {
+		IDMAP_LOG(2, ("umich_gss_princ_to_grouplist: "
+                                "ldap account lookup of gssauthname %s returned %d accounts",
+                                principal,count));
+		goto out_unbind;
+	}
+
+	if (!(entry = ldap_first_entry(ld, result))) {
+		lerr = ldap_result2error(ld, result, 0);
+		IDMAP_LOG(2, ("umich_gss_princ_to_grouplist: ldap_first_entry: "
+			  "%s (%d)", ldap_err2string(lerr), lerr));
+		goto out_unbind;
+	}
+
+	if ((names = ldap_get_values(ld, result, attrs[0])) == NULL) {
+		lerr = ldap_result2error(ld, result, 0);
+		IDMAP_LOG(2, ("umich_gss_princ_to_grouplist: ldap_get_values: "
+			  "%s (%d)", ldap_err2string(lerr), lerr));
+		goto out_unbind;
+	}
+
+	err = umich_acct_to_grouplist(ld, principal, names[0], groups, ngroups,
+				      linfo);
+	ldap_value_free(names);
+
 out_unbind:
-	ldap_unbind(ld);
+	if (result)
+		ldap_msgfree(result);
+	umich_ldap_put(&conn, linfo);
 out:
 	return err;
 }
@@ -1266,6 +1488,128 @@ umichldap_gss_princ_to_grouplist(char *secname, char *principal,
 					    &ldap_info);
 }
 
+/*
+ * Resolve many principals on one connection: their accounts are found
+ * with as few searches as the filter length allows, and then the
+ * groups of each account as above.
+ */
+void
+libnfsidmap_plugin_grouplist_batch(char *secname,
+		struct nfs4_grouplist_req **reqs, int nreqs)
+{
+	struct umich_ldap_info *linfo = &ldap_info;
+	struct timeval timeout = {
+		.tv_sec = linfo->ldap_timeout,
+	};
+	char filter[LDAP_FILT_MAXSIZ], *attrs[3], **princs, **names;
+	int first, last, i, j, len, f_len, err, *matches;
+	struct umich_ldap_conn conn = { .ld = NULL };
+	LDAPMessage *result, *entry;
+	LDAP *ld;
+	char **accts;
+
+	if ((strcmp(secname, "krb5") != 0) && (strcmp(secname, "spkm3") != 0)) {
+		IDMAP_LOG(0, ("ERROR: libnfsidmap_plugin_grouplist_batch: "
+			  "invalid secname '%s'", secname));
+		for (i = 0; i < nreqs; i++)
+			reqs[i]->status = -EINVAL;
+		return;
+	}
+
+	accts = calloc(nreqs, sizeof(*accts));
+	matches = calloc(nreqs, sizeof(*matches));
+	if (accts == NULL || matches == NULL || linfo->server == NULL ||
+	    linfo->people_tree == NULL || linfo->group_tree == NULL ||
+	    umich_ldap_get(&conn, 0, linfo)) {
+		for (i = 0; i < nreqs; i++)
+			reqs[i]->status = -EINVAL;
+		goto out;
+	}
+
+	attrs[0] = ldap_map.GSS_principal_attr;
+	attrs[1] = ldap_map.NFSv4_acctname_attr;
+	attrs[2] = NULL;
+
+	for (first = 0; first < nreqs; first = last) {
+		/* as many principals as fit in one filter */
+		f_len = snprintf(filter, LDAP_FILT_MAXSIZ, "(&(objectClass=%s)(|",
+				 ldap_map.NFSv4_person_objcls);
+		for (last = first; last < nreqs; last++) {
+			len = snprintf(filter + f_len, LDAP_FILT_MAXSIZ - f_len,
+				       "(%s=%s)", ldap_map.GSS_principal_attr,
+				       reqs[last]->princ);
+			if (f_len + len + 2 >= LDAP_FILT_MAXSIZ)
+				break;
+			f_len += len;
+		}
+		if (last == first) {
+			IDMAP_LOG(0, ("ERROR: libnfsidmap_plugin_grouplist_batch: "
+				  "filter too long!"));
+			reqs[last++]->status = -EINVAL;
+			continue;
+		}
+		strcpy(filter + f_len, "))");
+
+		err = umich_ldap_search(&conn, linfo->people_tree, filter,
+					attrs, &timeout, &result, linfo);
+		ld = conn.ld;
+		if (err) {
+			IDMAP_LOG(2, ("libnfsidmap_plugin_grouplist_batch: "
+				  "ldap_search_st for tree '%s, filter '%s': "
+				  "%s (%d)", linfo->people_tree, filter,
+				  ldap_err2string(err), err));
+			if (result)
+				ldap_msgfree(result);
+			if (ld == NULL)
+				break;
+			continue;
+		}
+
+		for (entry = ldap_first_entry(ld, result); entry != NULL;
+		     entry = ldap_next_entry(ld, entry)) {
+			princs = ldap_get_values(ld, entry, attrs[0]);
+			names = ldap_get_values(ld, entry, attrs[1]);
+			for (i = first; princs && names && i < last; i++) {
+				for (j = 0; princs[j] != NULL; j++)
+					if (strcasecmp(princs[j],
+						       reqs[i]->princ) == 0)
+						break;
+				if (princs[j] == NULL)
+					continue;
+				if (matches[i]++ == 0)
+					accts[i] = strdup(names[0]);
+			}
+			if (princs)
+				ldap_value_free(princs);
+			if (names)
+				ldap_value_free(names);
+		}
+		ldap_msgfree(result);
+
+		for (i = first; i < last; i++) {
+			if (matches[i] != 1 || accts[i] == NULL) {
+				IDMAP_LOG(2, ("libnfsidmap_plugin_grouplist_batch: "
+					  "ldap account lookup of gssauthname "
+					  "%s returned %d accounts",
+					  reqs[i]->princ, matches[i]));
+				continue;
+			}
+			reqs[i]->status = umich_acct_to_grouplist(ld,
+					reqs[i]->princ, accts[i],
+					reqs[i]->groups, &reqs[i]->ngroups,
+					linfo);
+		}
+	}
+
+out:
+	umich_ldap_put(&conn, linfo);
+	if (accts)
+		for (i = 0; i < nreqs; i++)
+			free(accts[i]);
+	free(accts);
+	free(matches);
+}
+
 /*
  * TLS connections require that the hostname we specify matches
  * the hostname in the certificate that the server uses.
@@ -1319,12 +1663,59 @@ out_err:
 	return return_name;
 }
 
+/*
+ * LDAP_server may list several servers, separated by commas or blanks.
+ */
+static int
+umichldap_parse_servers(const char *list, int canonicalize)
+{
+	struct umich_ldap_server *servers = NULL, *new;
+	char *copy, *tok, *save, *canon_name;
+	int n = 0;
+
+	copy = strdup(list);
+	if (copy == NULL)
+		return -1;
+	for (tok = strtok_r(copy, ", \t", &save); tok != NULL;
+	     tok = strtok_r(NULL, ", \t", &save)) {
+		new = realloc(servers, (n + 1) * sizeof(*servers));
+		if (new == NULL) {
+			free(servers);
+			free(copy);
+			return -1;
+		}
+		servers = new;
+		servers[n].name = tok;
+		servers[n].failures = 0;
+		servers[n].retry_at = 0;
+		if (canonicalize) {
+			canon_name = get_canonical_hostname(tok);
+			if (canon_name == NULL)
+				IDMAP_LOG(0, ("umichldap_init: Warning! Unable "
+					  "to canonicalize server name '%s' as "
+					  "requested.", tok));
+			else
+				servers[n].name = canon_name;
+		}
+		n++;
+	}
+	if (n == 0) {
+		free(copy);
+		return -1;
+	}
+	ldap_info.servers = servers;
+	ldap_info.nservers = n;
+	ldap_info.server = servers[0].name;
+	return 0;
+}
+
 static int
 umichldap_init(void)
 {
 	char *tssl, *canonicalize, *memberof, *cert_req, *follow_referrals;
 	char missing_msg[128] = "";
-	char *server_in, *canon_name;
+	char *server_in;
+	int i;
 
 	if (nfsidmap_conf_path)
 		conf_init_file(nfsidmap_conf_path);
@@ -1411,19 +1802,15 @@ umichldap_init(void)
 		goto fail;
 	}
 
-	ldap_info.server = server_in;
 	canonicalize = conf_get_str_with_def(LDAP_SECTION,
 					     "LDAP_canonicalize_name", "yes");
-	if ((strcasecmp(canonicalize, "true") == 0) ||
-	    (strcasecmp(canonicalize, "on") == 0) ||
-	    (strcasecmp(canonicalize, "yes") == 0)) {
-		canon_name = get_canonical_hostname(server_in);
-		if (canon_name == NULL)
-			IDMAP_LOG(0, ("umichldap_init: Warning! Unable to "
-				  "canonicalize server name '%s' as requested.",
-				  server_in));
-		else
-			ldap_info.server = canon_name;
+	if (umichldap_parse_servers(server_in,
+			(strcasecmp(canonicalize, "true") == 0) ||
+			(strcasecmp(canonicalize, "on") == 0) ||
+			(strcasecmp(canonicalize, "yes") == 0))) {
+		IDMAP_LOG(0, ("umichldap_init: Invalid value(%s) for "
+			  "LDAP_server.", server_in));
+		goto fail;
 	}
 
 	/* get the ldap mapping attributes/objectclasses (all have defaults) */
@@ -1475,6 +1862,24 @@ umichldap_init(void)
 		conf_get_num(LDAP_SECTION, "LDAP_timeout_seconds",
                                       DEFAULT_UMICH_SEARCH_TIMEOUT);
 
+	ldap_info.pool_size = conf_get_num(LDAP_SECTION, "LDAP_pool_size",
+					   DEFAULT_UMICH_POOL_SIZE);
+	ldap_info.idle_timeout = conf_get_num(LDAP_SECTION, "LDAP_idle_timeout",
+					      DEFAULT_UMICH_IDLE_TIMEOUT);
+	ldap_info.retry_max = conf_get_num(LDAP_SECTION, "LDAP_retry_max",
+					   DEFAULT_UMICH_RETRY_MAX);
+
+	umich_ldap_pool_drain();
+	free(pool_idle);
+	pool_idle = NULL;
+	if (ldap_info.pool_size < 0)
+		ldap_info.pool_size = 0;
+	if (ldap_info.pool_size > 0) {
+		pool_idle = calloc(ldap_info.pool_size, sizeof(*pool_idle));
+		if (pool_idle == NULL)
+			ldap_info.pool_size = 0;
+	}
+
 
  	/*
 	 * Some LDAP servers do a better job with indexing where searching
@@ -1520,9 +1925,13 @@ umichldap_init(void)
 	/* print out some good debugging info */
 	IDMAP_LOG(1, ("umichldap_init: canonicalize_name: %s",
 		  canonicalize));
-	IDMAP_LOG(1, ("umichldap_init: server  : %s (from config value '%s')",
-		  ldap_info.server, server_in));
+	for (i = 0; i < ldap_info.nservers; i++)
+		IDMAP_LOG(1, ("umichldap_init: server  : %s (from config "
+			  "value '%s')", ldap_info.servers[i].name, server_in));
 	IDMAP_LOG(1, ("umichldap_init: port    : %d", ldap_info.port));
+	IDMAP_LOG(1, ("umichldap_init: pool_size : %d, idle_timeout : %d, "
+		  "retry_max : %d", ldap_info.pool_size,
+		  ldap_info.idle_timeout, ldap_info.retry_max));
 	IDMAP_LOG(1, ("umichldap_init: people  : %s", ldap_info.people_tree));
 	IDMAP_LOG(1, ("umichldap_init: groups  : %s", ldap_info.group_tree));
 
@@ -1595,6 +2004,17 @@ fail:
   	return -1;
 }
 
+/*
+ * Called by dlclose(). See dlopen(3) man page
+ */
+__attribute__((destructor))
+static void umichldap_term(void)
+{
+	umich_ldap_pool_drain();
+	free(pool_idle);
+	pool_idle = NULL;
+}
+
 
 /* The external interface */
 
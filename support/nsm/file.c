@@ -60,6 +60,37 @@
  * in any way except that they must fit into 1024 bytes.  Our
  * implementation requires that these strings not contain
  * white space or '\0'.
+ *
+ * The last network address known for the monitored host, if any, is
+ * kept as a presentation address in the file's NSM_ADDR_XATTR extended
+ * attribute, so sm-notify can send its first SM_NOTIFY without waiting
+ * for DNS, and the port its statd was last found on, in decimal, in
+ * NSM_PORT_XATTR, so that SM_NOTIFY need not wait for rpcbind either.
+ * These are hints only: where the file system does not support user
+ * extended attributes, the host is simply looked up.
+ *
+ * sm-notify usually learns a peer's statd port before the peer is
+ * monitored again, so until statd creates the peer's new record, the
+ * port is kept in a file named NSM_PORT_NOTE followed by the hostname,
+ * under NSM_MONITOR_DIR.  Notes left over when the system reboots are
+ * removed.
+ *
+ * Where many peers are monitored, the records may instead be kept in
+ * a database log: one file, NSM_MONITOR_LOG or NSM_NOTIFY_LOG, under
+ * the state directory for each of the two directories, used once
+ * NSM_MONITOR_LOG exists.  Every change is appended as one line:
+ *
+ *	+ <hostname> <timestamp> <record>
+ *	- <hostname> <mon_name> <my_name>
+ *	= <hostname> <hint> <value>
+ *
+ * A new record, laid out as a line of a host's file, replaces any of
+ * the host's records with the same mon_name and my_name, and carries
+ * the time the host's file would have been modified.  <hint> is the
+ * name of one of the extended attributes above.  The log is replayed
+ * into memory when it is loaded, after any records still kept a file
+ * per host in the directory, and it is rewritten with only the live
+ * records, and those files removed, once enough of it is dead.
  */
 
 #ifdef HAVE_CONFIG_H
@@ -72,10 +103,12 @@
 #endif
 #include <sys/prctl.h>
 #include <sys/stat.h>
+#include <sys/xattr.h>
 
 #include <ctype.h>
 #include <string.h>
 #include <stdint.h>
+#include <time.h>
 #ifndef S_SPLINT_S
 #include <unistd.h>
 #endif
@@ -101,6 +134,64 @@ static char nsm_base_dirname[PATH_MAX] = NSM_DEFAULT_STATEDIR;
 #define NSM_NOTIFY_DIR	"sm.bak"
 #define NSM_STATE_FILE	"state"
 
+#define NSM_ADDR_XATTR	"user.nsm.addr"
+#define NSM_PORT_XATTR	"user.nsm.port"
+
+#define NSM_PORT_NOTE	".port."
+
+static const char *nsm_xattrs[] = { NSM_ADDR_XATTR, NSM_PORT_XATTR };
+#define NSM_NXATTRS	(sizeof(nsm_xattrs) / sizeof(nsm_xattrs[0]))
+
+#define NSM_MONITOR_LOG	"sm.log"
+#define NSM_NOTIFY_LOG	"sm.bak.log"
+#define NSM_LOG_SLACK	1024	/* dead lines kept before compacting */
+
+/* "+ <hostname> <timestamp> <record>", the longest line in a log */
+#define LOGLINELEN	(2 + SM_MAXSTRLEN + 22 + LINELEN + 2 * SM_MAXSTRLEN + 3)
+
+struct nsm_log_rec {
+	struct nsm_log_rec *	lr_next;
+	char			lr_line[];	/* as in a host's file */
+};
+
+struct nsm_log_host {
+	struct nsm_log_host *	lh_next;	/* in its hash chain */
+	struct nsm_log_rec *	lh_recs;
+	time_t			lh_time;
+	char *			lh_hints[NSM_NXATTRS];
+	char			lh_name[];
+};
+
+struct nsm_log {
+	const char *		nl_name;
+	const char *		nl_dir;		/* that the log stands in for */
+	struct nsm_log_host **	nl_table;
+	size_t			nl_size;	/* a power of two, or 0 */
+	size_t			nl_hosts;
+	unsigned long		nl_lines;	/* in the file */
+	unsigned long		nl_live;	/* that compaction would keep */
+	unsigned int		nl_absorbed;	/* host files read in */
+	int			nl_fd;		/* for appending */
+	_Bool			nl_loaded;
+};
+
+static struct nsm_log nsm_monitor_log = {
+	.nl_name		= NSM_MONITOR_LOG,
+	.nl_dir			= NSM_MONITOR_DIR,
+	.nl_fd			= -1,
+};
+
+static struct nsm_log nsm_notify_log = {
+	.nl_name		= NSM_NOTIFY_LOG,
+	.nl_dir			= NSM_NOTIFY_DIR,
+	.nl_fd			= -1,
+};
+
+static int nsm_log_state = -1;
+
+static unsigned int nsm_log_retire(void);
+static _Bool nsm_log_insert(const char *hostname, const char *record);
+
 
 static _Bool
 error_check(const int len, const size_t buflen)
@@ -262,6 +353,107 @@ out:
 	return result;
 }
 
+/*
+ * Group commit.  After nsm_commit_hold(), new monitor records are not
+ * written synchronously one by one.  The caller makes them durable,
+ * with the records renamed and removed since, in one go by calling
+ * nsm_commit() before it answers the requests that changed them.
+ */
+static _Bool nsm_group_commit;
+static _Bool nsm_uncommitted;
+
+/* open(2) flags for creating a monitor record */
+static int
+nsm_record_flags(void)
+{
+#ifdef HAVE_SYNCFS
+	if (nsm_group_commit)
+		return 0;
+#endif
+	return O_SYNC;
+}
+
+static void
+nsm_record_changed(void)
+{
+	if (nsm_group_commit)
+		nsm_uncommitted = true;
+}
+
+/**
+ * nsm_commit_hold - start committing record changes in groups
+ *
+ */
+void
+nsm_commit_hold(void)
+{
+	nsm_group_commit = true;
+}
+
+/**
+ * nsm_commit_pending - check for record changes not yet committed
+ *
+ * Returns true if records have changed since the last nsm_commit().
+ */
+_Bool
+nsm_commit_pending(void)
+{
+	return nsm_uncommitted;
+}
+
+/**
+ * nsm_commit - make record changes durable
+ *
+ * Returns true if the records changed since the last call are now
+ * on stable storage, otherwise false.
+ */
+_Bool
+nsm_commit(void)
+{
+	_Bool result = false;
+	char *path;
+	int fd;
+
+	if (!nsm_uncommitted)
+		return true;
+	nsm_uncommitted = false;
+
+	if (nsm_log_enabled()) {
+		fd = nsm_monitor_log.nl_fd;
+		if (fd != -1 && fdatasync(fd) == -1) {
+			xlog(L_ERROR, "Failed to commit: syncing "
+				NSM_MONITOR_LOG ": %m");
+			return false;
+		}
+		return true;
+	}
+
+	path = nsm_make_pathname(NSM_MONITOR_DIR);
+	if (path == NULL) {
+		xlog(L_ERROR, "Failed to commit: path too long");
+		return false;
+	}
+
+	fd = open(path, O_RDONLY | O_DIRECTORY);
+	if (fd == -1) {
+		xlog(L_ERROR, "Failed to commit: opening %s: %m", path);
+		goto out;
+	}
+#ifdef HAVE_SYNCFS
+	if (syncfs(fd) == -1)
+#else
+	if (fsync(fd) == -1)
+#endif
+		xlog(L_ERROR, "Failed to commit: syncing %s: %m", path);
+	else
+		result = true;
+	(void)close(fd);
+
+out:
+	free(path);
+	return result;
+}
+
 /**
  * nsm_setup_pathnames - set up pathname
  * @progname: C string containing name of program, for error messages
@@ -276,6 +468,7 @@ out:
 _Bool
 nsm_setup_pathnames(const char *progname, const char *parentdir)
 {
+	nsm_log_state = -1;
 	return generic_setup_basedir(progname, parentdir, nsm_base_dirname,
 				     PATH_MAX);
 }
@@ -293,6 +486,27 @@ nsm_is_default_parentdir(void)
 	return strcmp(nsm_base_dirname, NSM_DEFAULT_STATEDIR) == 0;
 }
 
+/**
+ * nsm_log_enabled - check if records are kept in the database log
+ *
+ * Returns true if NSM_MONITOR_LOG exists under the state directory,
+ * otherwise false.
+ */
+_Bool
+nsm_log_enabled(void)
+{
+	struct stat stb;
+	char *path;
+
+	if (nsm_log_state == -1) {
+		path = nsm_make_pathname(NSM_MONITOR_LOG);
+		nsm_log_state = path != NULL && lstat(path, &stb) == 0 &&
+					S_ISREG(stb.st_mode);
+		free(path);
+	}
+	return nsm_log_state;
+}
+
 /*
  * Clear all capabilities but CAP_NET_BIND_SERVICE.  This permits
  * callers to acquire privileged source ports, but all other root
@@ -556,6 +770,9 @@ nsm_retire_monitored_hosts(void)
 	char *path;
 	DIR *dir;
 
+	if (nsm_log_enabled())
+		count = nsm_log_retire();
+
 	path = nsm_make_pathname(NSM_MONITOR_DIR);
 	if (path == NULL) {
 		xlog(L_ERROR, "Failed to allocate path for " NSM_MONITOR_DIR);
@@ -573,6 +790,15 @@ nsm_retire_monitored_hosts(void)
 		char *src, *dst;
 		struct stat stb;
 
+		if (strncmp(de->d_name, NSM_PORT_NOTE,
+			    strlen(NSM_PORT_NOTE)) == 0) {
+			src = nsm_make_record_pathname(NSM_MONITOR_DIR,
+							de->d_name);
+			if (src != NULL)
+				(void)unlink(src);
+			free(src);
+			continue;
+		}
 		if (de->d_name[0] == '.')
 			continue;
 
@@ -766,11 +992,17 @@ nsm_insert_monitored_host(const char *hostname, const struct sockaddr *sap,
 		goto out;
 	}
 
+	if (nsm_log_enabled()) {
+		result = nsm_log_insert(hostname, buf);
+		goto out;
+	}
+
 	/*
 	 * If exclusive create fails, we're adding a new line to an
 	 * existing file.
 	 */
-	fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_SYNC, S_IRUSR | S_IWUSR);
+	fd = open(path, O_WRONLY | O_CREAT | O_EXCL | nsm_record_flags(),
+			S_IRUSR | S_IWUSR);
 	if (fd == -1) {
 		if (errno != EEXIST) {
 			xlog(L_ERROR, "Failed to insert: creating %s: %m", path);
@@ -778,6 +1010,8 @@ nsm_insert_monitored_host(const char *hostname, const struct sockaddr *sap,
 		}
 
 		result = nsm_append_monitored_host(path, buf);
+		if (result)
+			nsm_record_changed();
 		goto out;
 	}
 	result = true;
@@ -794,6 +1028,8 @@ nsm_insert_monitored_host(const char *hostname, const struct sockaddr *sap,
 		(void)unlink(path);
 		result = false;
 	}
+	if (result)
+		nsm_record_changed();
 
 out:
 	free(path);
@@ -861,135 +1097,1036 @@ nsm_read_line(const char *hostname, const time_t timestamp, char *line,
 	return func(hostname, (struct sockaddr *)(char *)&sin, &m, timestamp);
 }
 
+static size_t
+nsm_log_hash(const char *hostname, const size_t size)
+{
+	uint32_t hash = 2166136261u;
+
+	for (; *hostname != '\0'; hostname++) {
+		hash ^= (unsigned char)*hostname;
+		hash *= 16777619u;
+	}
+	return hash & (size - 1);
+}
+
 /*
- * Given a filename, reads data from a file under "directory"
- * and invokes @func so caller can populate their in-core
- * database with this data.
+ * Returns @hostname's entry in @log, creating it if @create is set,
+ * or NULL.
  */
-static unsigned int
-nsm_load_host(const char *directory, const char *filename, nsm_populate_t func)
+static struct nsm_log_host *
+nsm_log_find(struct nsm_log *log, const char *hostname, const _Bool create)
 {
-	char buf[LINELEN + 1 + SM_MAXSTRLEN + 2];
-	unsigned int result = 0;
-	struct stat stb;
-	char *path;
-	FILE *f;
-
-	path = nsm_make_record_pathname(directory, filename);
-	if (path == NULL)
-		goto out_err;
+	struct nsm_log_host *lh, **table;
+	size_t i, len, size;
+
+	if (log->nl_size != 0)
+		for (lh = log->nl_table[nsm_log_hash(hostname, log->nl_size)];
+		     lh != NULL; lh = lh->lh_next)
+			if (strcmp(lh->lh_name, hostname) == 0)
+				return lh;
+	if (!create)
+		return NULL;
 
-	if (lstat(path, &stb) == -1) {
-		xlog(L_ERROR, "Failed to stat %s: %m", path);
-		goto out_freepath;
-	}
-	if (!S_ISREG(stb.st_mode)) {
-		xlog(D_GENERAL, "Skipping non-regular file %s",
-				path);
-		goto out_freepath;
+	if (log->nl_hosts >= log->nl_size) {
+		size = log->nl_size != 0 ? log->nl_size * 2 : 256;
+		table = calloc(size, sizeof(*table));
+		if (table == NULL) {
+			xlog(L_ERROR, "Failed to grow %s: no memory",
+					log->nl_name);
+			return NULL;
+		}
+		for (i = 0; i < log->nl_size; i++)
+			while ((lh = log->nl_table[i]) != NULL) {
+				log->nl_table[i] = lh->lh_next;
+				len = nsm_log_hash(lh->lh_name, size);
+				lh->lh_next = table[len];
+				table[len] = lh;
+			}
+		free(log->nl_table);
+		log->nl_table = table;
+		log->nl_size = size;
 	}
 
-	f = fopen(path, "r");
-	if (f == NULL) {
-		xlog(L_ERROR, "Failed to open %s: %m", path);
-		goto out_freepath;
+	len = strlen(hostname) + 1;
+	lh = calloc(1, sizeof(*lh) + len);
+	if (lh == NULL) {
+		xlog(L_ERROR, "Failed to add %s to %s: no memory",
+				hostname, log->nl_name);
+		return NULL;
 	}
+	memcpy(lh->lh_name, hostname, len);
+	i = nsm_log_hash(hostname, log->nl_size);
+	lh->lh_next = log->nl_table[i];
+	log->nl_table[i] = lh;
+	log->nl_hosts++;
+	return lh;
+}
 
-	while (fgets(buf, (int)sizeof(buf), f) != NULL) {
-		buf[sizeof(buf) - 1] = '\0';
-		result += nsm_read_line(filename, stb.st_mtime, buf, func);
+static void
+nsm_log_drop(struct nsm_log *log, struct nsm_log_host *lh)
+{
+	struct nsm_log_host **p;
+	struct nsm_log_rec *lr;
+	unsigned int i;
+
+	for (p = &log->nl_table[nsm_log_hash(lh->lh_name, log->nl_size)];
+	     *p != lh; p = &(*p)->lh_next)
+		;
+	*p = lh->lh_next;
+	log->nl_hosts--;
+
+	while ((lr = lh->lh_recs) != NULL) {
+		lh->lh_recs = lr->lr_next;
+		free(lr);
+		log->nl_live--;
 	}
-	if (result == 0)
-		xlog(L_ERROR, "Failed to read monitor data from %s", path);
+	for (i = 0; i < NSM_NXATTRS; i++)
+		if (lh->lh_hints[i] != NULL) {
+			free(lh->lh_hints[i]);
+			log->nl_live--;
+		}
+	free(lh);
+}
 
-	(void)fclose(f);
+static void
+nsm_log_clear(struct nsm_log *log)
+{
+	size_t i;
+
+	for (i = 0; i < log->nl_size; i++)
+		while (log->nl_table[i] != NULL)
+			nsm_log_drop(log, log->nl_table[i]);
+	free(log->nl_table);
+	log->nl_table = NULL;
+	log->nl_size = 0;
+	log->nl_lines = 0;
+	log->nl_live = 0;
+	log->nl_absorbed = 0;
+	log->nl_loaded = false;
+}
 
-out_freepath:
-	free(path);
-out_err:
-	return result;
+/*
+ * Records are kept as nsm_create_monitor_record() lays them out, so
+ * their mon_name and my_name always start at the same offset.
+ */
+static const char *
+nsm_log_names(const char *record)
+{
+	return record + LINELEN;
 }
 
-static unsigned int
-nsm_load_dir(const char *directory, nsm_populate_t func)
+static _Bool
+nsm_log_apply_insert(struct nsm_log *log, const char *hostname,
+		const time_t timestamp, const char *record)
 {
-	unsigned int count = 0;
-	struct dirent *de;
-	char *path;
-	DIR *dir;
+	struct nsm_log_rec *lr, **p;
+	struct nsm_log_host *lh;
+	size_t len;
 
-	path = nsm_make_pathname(directory);
-	if (path == NULL) {
-		xlog(L_ERROR, "Failed to allocate path for directory %s",
-				directory);
-		return 0;
-	}
+	lh = nsm_log_find(log, hostname, true);
+	if (lh == NULL)
+		return false;
 
-	dir = opendir(path);
-	free(path);
-	if (dir == NULL) {
-		xlog(L_ERROR, "Failed to open directory %s: %m",
-				directory);
-		return 0;
+	for (p = &lh->lh_recs; (lr = *p) != NULL; p = &lr->lr_next)
+		if (strcmp(nsm_log_names(lr->lr_line),
+			   nsm_log_names(record)) == 0) {
+			*p = lr->lr_next;
+			free(lr);
+			log->nl_live--;
+			break;
+		}
+	while (*p != NULL)
+		p = &(*p)->lr_next;
+
+	len = strlen(record) + 1;
+	lr = malloc(sizeof(*lr) + len);
+	if (lr == NULL) {
+		xlog(L_ERROR, "Failed to add record for %s to %s: no memory",
+				hostname, log->nl_name);
+		if (lh->lh_recs == NULL)
+			nsm_log_drop(log, lh);
+		return false;
 	}
+	memcpy(lr->lr_line, record, len);
+	lr->lr_next = NULL;
+	*p = lr;
+	lh->lh_time = timestamp;
+	log->nl_live++;
+	return true;
+}
 
-	while ((de = readdir(dir)) != NULL) {
-		if (de->d_name[0] == '.')
-			continue;
+/* @names is "<mon_name> <my_name>\n" */
+static _Bool
+nsm_log_apply_delete(struct nsm_log *log, const char *hostname,
+		const char *names)
+{
+	struct nsm_log_rec *lr, **p;
+	struct nsm_log_host *lh;
 
-		count += nsm_load_host(directory, de->d_name, func);
-	}
+	lh = nsm_log_find(log, hostname, false);
+	if (lh == NULL)
+		return false;
 
-	(void)closedir(dir);
-	return count;
+	for (p = &lh->lh_recs; (lr = *p) != NULL; p = &lr->lr_next)
+		if (strcmp(nsm_log_names(lr->lr_line), names) == 0)
+			break;
+	if (lr == NULL)
+		return false;
+
+	*p = lr->lr_next;
+	free(lr);
+	log->nl_live--;
+	if (lh->lh_recs == NULL)
+		nsm_log_drop(log, lh);
+	return true;
 }
 
-/**
- * nsm_load_monitor_list - load list of hosts to monitor
- * @func: callback function to create entry for one host
- *
- * Returns the count of hosts that were found in the directory.
+static int
+nsm_log_hint_index(const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < NSM_NXATTRS; i++)
+		if (strcmp(nsm_xattrs[i], name) == 0)
+			return (int)i;
+	return -1;
+}
+
+/* A hint is kept only while its host has records */
+static _Bool
+nsm_log_apply_hint(struct nsm_log *log, const char *hostname,
+		const char *name, const char *value)
+{
+	struct nsm_log_host *lh;
+	char *copy;
+	int i;
+
+	i = nsm_log_hint_index(name);
+	lh = nsm_log_find(log, hostname, false);
+	if (i == -1 || lh == NULL)
+		return false;
+
+	copy = strdup(value);
+	if (copy == NULL)
+		return false;
+	if (lh->lh_hints[i] == NULL)
+		log->nl_live++;
+	free(lh->lh_hints[i]);
+	lh->lh_hints[i] = copy;
+	return true;
+}
+
+/*
+ * Lay out @line, a record read from a file, in @buf as
+ * nsm_create_monitor_record() does.  Returns the length of the
+ * result, or zero if @line does not hold a valid record.
  */
-unsigned int
-nsm_load_monitor_list(nsm_populate_t func)
+static size_t
+nsm_log_record(char *buf, const size_t buflen, const char *line)
 {
-	return nsm_load_dir(NSM_MONITOR_DIR, func);
+	char copy[LINELEN + 1 + SM_MAXSTRLEN + 2];
+	struct sockaddr_in sin = {
+		.sin_family		= AF_INET,
+	};
+	struct mon m;
+
+	if (strlen(line) >= sizeof(copy))
+		return 0;
+	strcpy(copy, line);
+	if (!nsm_parse_line(copy, &sin, &m) ||
+	    *m.mon_id.mon_name == '\0' || *m.mon_id.my_id.my_name == '\0')
+		return 0;
+	return nsm_create_monitor_record(buf, buflen,
+					(struct sockaddr *)(char *)&sin, &m);
 }
 
-/**
- * nsm_load_notify_list - load list of hosts to notify
- * @func: callback function to create entry for one host
- *
- * Returns the count of hosts that were found in the directory.
+/*
+ * Apply one '\n'-terminated line of @log.  Returns false if it is
+ * not valid.
  */
-unsigned int
-nsm_load_notify_list(nsm_populate_t func)
+static _Bool
+nsm_log_replay(struct nsm_log *log, char *line)
 {
-	return nsm_load_dir(NSM_NOTIFY_DIR, func);
+	char record[LINELEN + 1 + SM_MAXSTRLEN + 2];
+	char *hostname, *field, *end;
+	long long timestamp;
+	size_t len = strlen(line);
+
+	if (len < 4 || line[len - 1] != '\n' || line[1] != ' ')
+		return false;
+
+	hostname = line + 2;
+	field = strchr(hostname, ' ');
+	if (field == NULL || field == hostname)
+		return false;
+	*field++ = '\0';
+
+	switch (line[0]) {
+	case '+':
+		timestamp = strtoll(field, &end, 10);
+		if (end == field || *end != ' ')
+			return false;
+		if (nsm_log_record(record, sizeof(record), end + 1) == 0)
+			return false;
+		return nsm_log_apply_insert(log, hostname,
+					(time_t)timestamp, record);
+	case '-':
+		(void)nsm_log_apply_delete(log, hostname, field);
+		return true;
+	case '=':
+		end = strchr(field, ' ');
+		if (end == NULL)
+			return false;
+		*end++ = '\0';
+		line[len - 1] = '\0';
+		(void)nsm_log_apply_hint(log, hostname, field, end);
+		return true;
+	}
+	return false;
 }
 
+/*
+ * Read the records of @log's directory that are kept a file per host.
+ */
 static void
-nsm_delete_host(const char *directory, const char *hostname,
-		const char *mon_name, const char *my_name, const int chatty)
+nsm_log_absorb(struct nsm_log *log)
 {
-	char line[LINELEN + 1 + SM_MAXSTRLEN + 2];
-	char *outbuf = NULL;
+	char buf[LINELEN + 1 + SM_MAXSTRLEN + 2];
+	char record[LINELEN + 1 + SM_MAXSTRLEN + 2];
+	char value[NSM_ADDRSTRLEN];
+	struct dirent *de;
 	struct stat stb;
-	char *path, *next;
-	size_t remaining;
+	unsigned int i;
+	char *path;
+	ssize_t len;
+	DIR *dir;
 	FILE *f;
 
-	path = nsm_make_record_pathname(directory, hostname);
-	if (path == NULL) {
-		xlog(L_ERROR, "Bad filename, not deleting");
+	path = nsm_make_pathname(log->nl_dir);
+	if (path == NULL)
+		return;
+	dir = opendir(path);
+	free(path);
+	if (dir == NULL)
 		return;
-	}
 
-	if (stat(path, &stb) == -1) {
-		if (chatty)
-			xlog(L_ERROR, "Failed to delete: "
-				"could not stat original file %s: %m", path);
-		goto out;
+	while ((de = readdir(dir)) != NULL) {
+		if (de->d_name[0] == '.')
+			continue;
+		path = nsm_make_record_pathname(log->nl_dir, de->d_name);
+		if (path == NULL)
+			continue;
+		if (lstat(path, &stb) == -1 || !S_ISREG(stb.st_mode)) {
+			free(path);
+			continue;
+		}
+		f = fopen(path, "r");
+		if (f == NULL) {
+			xlog(L_ERROR, "Failed to open %s: %m", path);
+			free(path);
+			continue;
+		}
+		while (fgets(buf, (int)sizeof(buf), f) != NULL)
+			if (nsm_log_record(record, sizeof(record), buf) != 0)
+				(void)nsm_log_apply_insert(log, de->d_name,
+						stb.st_mtime, record);
+		(void)fclose(f);
+
+		for (i = 0; i < NSM_NXATTRS; i++) {
+			len = getxattr(path, nsm_xattrs[i], value,
+					sizeof(value) - 1);
+			if (len <= 0)
+				continue;
+			value[len] = '\0';
+			(void)nsm_log_apply_hint(log, de->d_name,
+					nsm_xattrs[i], value);
+		}
+		log->nl_absorbed++;
+		free(path);
+	}
+	(void)closedir(dir);
+}
+
+/*
+ * Replay @log into memory, after the records kept a file per host.
+ */
+static void
+nsm_log_read(struct nsm_log *log)
+{
+	unsigned long bad = 0;
+	size_t size = 0;
+	char *line = NULL;
+	char *path;
+	FILE *f;
+
+	nsm_log_clear(log);
+	log->nl_loaded = true;
+	nsm_log_absorb(log);
+
+	path = nsm_make_pathname(log->nl_name);
+	if (path == NULL)
+		return;
+	f = fopen(path, "r");
+	if (f == NULL) {
+		if (errno != ENOENT)
+			xlog(L_ERROR, "Failed to open %s: %m", path);
+		free(path);
+		return;
+	}
+	while (getline(&line, &size, f) != -1) {
+		log->nl_lines++;
+		if (!nsm_log_replay(log, line))
+			bad++;
+	}
+	if (bad != 0)
+		xlog_warn("Skipped %lu bad lines in %s", bad, path);
+	(void)fclose(f);
+	free(line);
+	free(path);
+}
+
+static void
+nsm_log_sync_basedir(void)
+{
+	int fd;
+
+	fd = open(nsm_base_dirname, O_RDONLY | O_DIRECTORY);
+	if (fd == -1)
+		return;
+	if (fsync(fd) == -1)
+		xlog(L_ERROR, "Failed to sync %s: %m", nsm_base_dirname);
+	(void)close(fd);
+}
+
+/*
+ * Remove the files per host in @log's directory, once their records
+ * are in the log.
+ */
+static void
+nsm_log_drop_files(struct nsm_log *log)
+{
+	struct dirent *de;
+	struct stat stb;
+	char *path;
+	DIR *dir;
+
+	if (log->nl_absorbed == 0)
+		return;
+	log->nl_absorbed = 0;
+
+	path = nsm_make_pathname(log->nl_dir);
+	if (path == NULL)
+		return;
+	dir = opendir(path);
+	free(path);
+	if (dir == NULL)
+		return;
+
+	while ((de = readdir(dir)) != NULL) {
+		if (de->d_name[0] == '.')
+			continue;
+		path = nsm_make_record_pathname(log->nl_dir, de->d_name);
+		if (path == NULL)
+			continue;
+		if (lstat(path, &stb) == 0 && S_ISREG(stb.st_mode) &&
+		    unlink(path) == -1)
+			xlog(L_ERROR, "Failed to unlink %s: %m", path);
+		free(path);
+	}
+	(void)closedir(dir);
+}
+
+/*
+ * Replace @log's file with one holding only its live records.  If
+ * @drop_files is set, the files per host it has absorbed are removed.
+ *
+ * Returns true if successful, otherwise false.
+ */
+static _Bool
+nsm_log_rewrite(struct nsm_log *log, const _Bool drop_files)
+{
+	struct nsm_log_host *lh;
+	struct nsm_log_rec *lr;
+	char *path, *temp = NULL;
+	_Bool result = false;
+	unsigned int j;
+	FILE *f;
+	size_t i;
+	int fd;
+
+	path = nsm_make_pathname(log->nl_name);
+	if (path == NULL)
+		return false;
+	temp = nsm_make_temp_pathname(path);
+	if (temp == NULL) {
+		xlog(L_ERROR, "Failed to create new path for %s", path);
+		goto out;
+	}
+
+	fd = open(temp, O_CREAT | O_TRUNC | O_WRONLY, S_IRUSR | S_IWUSR);
+	if (fd == -1) {
+		xlog(L_ERROR, "Failed to create %s: %m", temp);
+		goto out;
+	}
+	f = fdopen(fd, "w");
+	if (f == NULL) {
+		xlog(L_ERROR, "Failed to open %s: %m", temp);
+		(void)close(fd);
+		(void)unlink(temp);
+		goto out;
+	}
+
+	for (i = 0; i < log->nl_size; i++)
+		for (lh = log->nl_table[i]; lh != NULL; lh = lh->lh_next) {
+			for (lr = lh->lh_recs; lr != NULL; lr = lr->lr_next)
+				(void)fprintf(f, "+ %s %lld %s", lh->lh_name,
+					(long long)lh->lh_time, lr->lr_line);
+			for (j = 0; j < NSM_NXATTRS; j++)
+				if (lh->lh_hints[j] != NULL)
+					(void)fprintf(f, "= %s %s %s\n",
+						lh->lh_name, nsm_xattrs[j],
+						lh->lh_hints[j]);
+		}
+
+	if (fflush(f) == EOF || ferror(f) || fsync(fd) == -1) {
+		xlog(L_ERROR, "Failed to write %s: %m", temp);
+		(void)fclose(f);
+		(void)unlink(temp);
+		goto out;
+	}
+	if (fclose(f) == EOF) {
+		xlog(L_ERROR, "Failed to close %s: %m", temp);
+		(void)unlink(temp);
+		goto out;
+	}
+	if (rename(temp, path) == -1) {
+		xlog(L_ERROR, "Failed to rename %s -> %s: %m", temp, path);
+		(void)unlink(temp);
+		goto out;
+	}
+	nsm_log_sync_basedir();
+
+	/* appends go to the new file from now on */
+	if (log->nl_fd != -1) {
+		(void)close(log->nl_fd);
+		log->nl_fd = -1;
+	}
+	log->nl_lines = log->nl_live;
+	if (drop_files)
+		nsm_log_drop_files(log);
+	xlog(D_GENERAL, "Rewrote %s with %zu hosts", log->nl_name,
+			log->nl_hosts);
+	result = true;
+
+out:
+	free(temp);
+	free(path);
+	return result;
+}
+
+/*
+ * Append @len bytes of @buf, one or more whole lines, to @log's file,
+ * and make them durable if @sync is set.
+ *
+ * Returns true if successful, otherwise false.
+ */
+static _Bool
+nsm_log_append(struct nsm_log *log, const char *buf, const size_t len,
+		const _Bool sync)
+{
+	struct stat stb;
+	ssize_t result;
+	char *path;
+	char c;
+
+	if (log->nl_fd == -1) {
+		path = nsm_make_pathname(log->nl_name);
+		if (path == NULL)
+			return false;
+		log->nl_fd = open(path, O_RDWR | O_APPEND | O_CREAT,
+					S_IRUSR | S_IWUSR);
+		if (log->nl_fd == -1) {
+			xlog(L_ERROR, "Failed to open %s: %m", path);
+			free(path);
+			return false;
+		}
+		free(path);
+
+		/* finish a line cut short by a crash, so ours is whole */
+		if (fstat(log->nl_fd, &stb) == 0 && stb.st_size > 0 &&
+		    pread(log->nl_fd, &c, 1, stb.st_size - 1) == 1 &&
+		    c != '\n' && write(log->nl_fd, "\n", 1) != 1)
+			xlog(L_ERROR, "Failed to repair %s: %m", log->nl_name);
+	}
+
+	result = write(log->nl_fd, buf, len);
+	if (exact_error_check(result, len)) {
+		xlog(L_ERROR, "Failed to append to %s: %m", log->nl_name);
+		return false;
+	}
+	if (sync && fdatasync(log->nl_fd) == -1) {
+		xlog(L_ERROR, "Failed to sync %s: %m", log->nl_name);
+		return false;
+	}
+	log->nl_lines++;
+	return true;
+}
+
+static struct nsm_log *
+nsm_log_of(const char *directory)
+{
+	if (strcmp(directory, NSM_MONITOR_DIR) == 0)
+		return &nsm_monitor_log;
+	return &nsm_notify_log;
+}
+
+static _Bool
+nsm_log_insert(const char *hostname, const char *record)
+{
+	struct nsm_log *log = &nsm_monitor_log;
+	char buf[LOGLINELEN];
+	time_t now = time(NULL);
+	int len;
+
+	len = snprintf(buf, sizeof(buf), "+ %s %lld %s",
+			hostname, (long long)now, record);
+	if (error_check(len, sizeof(buf))) {
+		xlog(L_ERROR, "Failed to insert: record too long");
+		return false;
+	}
+	if (!nsm_log_append(log, buf, (size_t)len, !nsm_group_commit))
+		return false;
+	if (log->nl_loaded)
+		(void)nsm_log_apply_insert(log, hostname, now, record);
+	nsm_record_changed();
+	return true;
+}
+
+static void
+nsm_log_delete(struct nsm_log *log, const char *hostname,
+		const char *mon_name, const char *my_name, const int chatty)
+{
+	char buf[LOGLINELEN];
+	struct nsm_log_host *lh;
+	struct nsm_log_rec *lr;
+	const char *names;
+	int len;
+
+	len = snprintf(buf, sizeof(buf), "- %s %s %s\n",
+			hostname, mon_name, my_name);
+	if (error_check(len, sizeof(buf))) {
+		xlog(L_ERROR, "Failed to delete: record too long");
+		return;
+	}
+	names = buf + 3 + strlen(hostname);
+
+	if (log->nl_loaded) {
+		lh = nsm_log_find(log, hostname, false);
+		for (lr = lh != NULL ? lh->lh_recs : NULL; lr != NULL;
+		     lr = lr->lr_next)
+			if (strcmp(nsm_log_names(lr->lr_line), names) == 0)
+				break;
+		if (lr == NULL) {
+			if (chatty)
+				xlog(L_ERROR, "Failed to delete: "
+					"no record for %s in %s",
+					hostname, log->nl_name);
+			return;
+		}
+	}
+
+	if (!nsm_log_append(log, buf, (size_t)len, false))
+		return;
+	if (log->nl_loaded)
+		(void)nsm_log_apply_delete(log, hostname, names);
+	nsm_record_changed();
+}
+
+static _Bool
+nsm_log_set_hint(struct nsm_log *log, const char *hostname,
+		const char *name, const char *value)
+{
+	char buf[LOGLINELEN];
+	int len;
+
+	if (!log->nl_loaded)
+		nsm_log_read(log);
+	if (nsm_log_find(log, hostname, false) == NULL) {
+		xlog(D_GENERAL, "Failed to record %s of %s: no record",
+				name, hostname);
+		return false;
+	}
+
+	len = snprintf(buf, sizeof(buf), "= %s %s %s\n",
+			hostname, name, value);
+	if (error_check(len, sizeof(buf)) ||
+	    !nsm_log_append(log, buf, (size_t)len, false))
+		return false;
+	return nsm_log_apply_hint(log, hostname, name, value);
+}
+
+static _Bool
+nsm_log_get_hint(struct nsm_log *log, const char *hostname,
+		const char *name, char *buf, const size_t buflen)
+{
+	struct nsm_log_host *lh;
+	int i;
+
+	if (!log->nl_loaded)
+		nsm_log_read(log);
+	lh = nsm_log_find(log, hostname, false);
+	i = nsm_log_hint_index(name);
+	if (lh == NULL || i == -1 || lh->lh_hints[i] == NULL ||
+	    strlen(lh->lh_hints[i]) >= buflen)
+		return false;
+	strcpy(buf, lh->lh_hints[i]);
+	return true;
+}
+
+/*
+ * Call @func for each live record of @log, and compact it if that
+ * is due.  Returns the count of in-core records created.
+ */
+static unsigned int
+nsm_log_load(struct nsm_log *log, nsm_populate_t func)
+{
+	char buf[LINELEN + 1 + SM_MAXSTRLEN + 2];
+	struct nsm_log_host *lh;
+	struct nsm_log_rec *lr;
+	unsigned int count = 0;
+	size_t i;
+
+	nsm_log_read(log);
+	for (i = 0; i < log->nl_size; i++)
+		for (lh = log->nl_table[i]; lh != NULL; lh = lh->lh_next)
+			for (lr = lh->lh_recs; lr != NULL; lr = lr->lr_next) {
+				strcpy(buf, lr->lr_line);
+				count += nsm_read_line(lh->lh_name,
+						lh->lh_time, buf, func);
+			}
+
+	if (log->nl_absorbed != 0 ||
+	    log->nl_lines > 2 * log->nl_live + NSM_LOG_SLACK)
+		(void)nsm_log_rewrite(log, true);
+	return count;
+}
+
+/*
+ * Move the live records of NSM_MONITOR_LOG to NSM_NOTIFY_LOG.  Should
+ * the system go down half way, records left in both are merged again
+ * next time.  Returns the count of hosts that were moved.
+ */
+static unsigned int
+nsm_log_retire(void)
+{
+	struct nsm_log *from = &nsm_monitor_log, *to = &nsm_notify_log;
+	unsigned int count = 0, absorbed, j;
+	struct nsm_log_host *lh;
+	struct nsm_log_rec *lr;
+	size_t i;
+
+	nsm_log_read(to);
+	nsm_log_read(from);
+
+	for (i = 0; i < from->nl_size; i++)
+		for (lh = from->nl_table[i]; lh != NULL; lh = lh->lh_next) {
+			for (lr = lh->lh_recs; lr != NULL; lr = lr->lr_next)
+				(void)nsm_log_apply_insert(to, lh->lh_name,
+						lh->lh_time, lr->lr_line);
+			for (j = 0; j < NSM_NXATTRS; j++)
+				if (lh->lh_hints[j] != NULL)
+					(void)nsm_log_apply_hint(to,
+						lh->lh_name, nsm_xattrs[j],
+						lh->lh_hints[j]);
+			xlog(D_GENERAL, "Retired record for mon_name %s",
+					lh->lh_name);
+			count++;
+		}
+
+	if (!nsm_log_rewrite(to, true))
+		return 0;
+	absorbed = from->nl_absorbed;
+	nsm_log_clear(from);
+	from->nl_loaded = true;
+	from->nl_absorbed = absorbed;
+	(void)nsm_log_rewrite(from, true);
+	return count;
+}
+
+/*
+ * Write @lh's records to a file of its own under @log's directory.
+ */
+static _Bool
+nsm_log_write_host(struct nsm_log *log, struct nsm_log_host *lh)
+{
+	struct timespec times[2] = {
+		{ .tv_sec = lh->lh_time },
+		{ .tv_sec = lh->lh_time },
+	};
+	struct nsm_log_rec *lr;
+	_Bool result = false;
+	size_t len = 0;
+	unsigned int i;
+	char *path, *buf;
+
+	path = nsm_make_record_pathname(log->nl_dir, lh->lh_name);
+	if (path == NULL)
+		return false;
+
+	for (lr = lh->lh_recs; lr != NULL; lr = lr->lr_next)
+		len += strlen(lr->lr_line);
+	buf = malloc(len + 1);
+	if (buf == NULL) {
+		xlog(L_ERROR, "Failed to write %s: no memory", path);
+		goto out;
+	}
+	len = 0;
+	for (lr = lh->lh_recs; lr != NULL; lr = lr->lr_next) {
+		strcpy(buf + len, lr->lr_line);
+		len += strlen(lr->lr_line);
+	}
+
+	if (nsm_atomic_write(path, buf, len)) {
+		for (i = 0; i < NSM_NXATTRS; i++)
+			if (lh->lh_hints[i] != NULL)
+				(void)setxattr(path, nsm_xattrs[i],
+					lh->lh_hints[i],
+					strlen(lh->lh_hints[i]), 0);
+		(void)utimensat(AT_FDCWD, path, times, 0);
+		result = true;
+	}
+	free(buf);
+
+out:
+	free(path);
+	return result;
+}
+
+/**
+ * nsm_log_convert - move records kept a file per host into the database log
+ *
+ * Neither statd nor sm-notify may be running.
+ *
+ * Returns true if successful, otherwise false.
+ */
+_Bool
+nsm_log_convert(void)
+{
+	nsm_log_read(&nsm_notify_log);
+	nsm_log_read(&nsm_monitor_log);
+
+	/* the files go only once both logs are complete */
+	if (!nsm_log_rewrite(&nsm_notify_log, false) ||
+	    !nsm_log_rewrite(&nsm_monitor_log, false))
+		return false;
+	nsm_log_state = 1;
+	nsm_log_drop_files(&nsm_notify_log);
+	nsm_log_drop_files(&nsm_monitor_log);
+	return true;
+}
+
+/**
+ * nsm_log_revert - move the records in the database log to a file per host
+ *
+ * Neither statd nor sm-notify may be running.
+ *
+ * Returns true if successful, otherwise false.
+ */
+_Bool
+nsm_log_revert(void)
+{
+	struct nsm_log *logs[] = { &nsm_notify_log, &nsm_monitor_log };
+	struct nsm_log_host *lh;
+	unsigned int j;
+	char *path;
+	size_t i;
+
+	for (j = 0; j < 2; j++) {
+		nsm_log_read(logs[j]);
+		for (i = 0; i < logs[j]->nl_size; i++)
+			for (lh = logs[j]->nl_table[i]; lh != NULL;
+			     lh = lh->lh_next)
+				if (!nsm_log_write_host(logs[j], lh))
+					return false;
+	}
+
+	/* NSM_MONITOR_LOG goes first: the files are in use without it */
+	for (j = 2; j-- > 0; ) {
+		path = nsm_make_pathname(logs[j]->nl_name);
+		if (path == NULL)
+			return false;
+		if (unlink(path) == -1 && errno != ENOENT) {
+			xlog(L_ERROR, "Failed to unlink %s: %m", path);
+			free(path);
+			return false;
+		}
+		free(path);
+		nsm_log_clear(logs[j]);
+	}
+	nsm_log_sync_basedir();
+	nsm_log_state = 0;
+	return true;
+}
+
+/**
+ * nsm_log_compact - rewrite the database log with only its live records
+ *
+ * Neither statd nor sm-notify may be running.
+ *
+ * Returns true if successful, otherwise false.
+ */
+_Bool
+nsm_log_compact(void)
+{
+	if (!nsm_log_enabled()) {
+		xlog(L_ERROR, "No " NSM_MONITOR_LOG " in %s", nsm_base_dirname);
+		return false;
+	}
+	nsm_log_read(&nsm_notify_log);
+	nsm_log_read(&nsm_monitor_log);
+	return nsm_log_rewrite(&nsm_notify_log, true) &&
+		nsm_log_rewrite(&nsm_monitor_log, true);
+}
+
+/*
+ * Given a filename, reads data from a file under "directory"
+ * and invokes @func so caller can populate their in-core
+ * database with this data.
+ */
+static unsigned int
+nsm_load_host(const char *directory, const char *filename, nsm_populate_t func)
+{
+	char buf[LINELEN + 1 + SM_MAXSTRLEN + 2];
+	unsigned int result = 0;
+	struct stat stb;
+	char *path;
+	FILE *f;
+
+	path = nsm_make_record_pathname(directory, filename);
+	if (path == NULL)
+		goto out_err;
+
+	if (lstat(path, &stb) == -1) {
+		xlog(L_ERROR, "Failed to stat %s: %m", path);
+		goto out_freepath;
+	}
+	if (!S_ISREG(stb.st_mode)) {
+		xlog(D_GENERAL, "Skipping non-regular file %s",
+				path);
+		goto out_freepath;
+	}
+
+	f = fopen(path, "r");
+	if (f == NULL) {
+		xlog(L_ERROR, "Failed to open %s: %m", path);
+		goto out_freepath;
+	}
+
+	while (fgets(buf, (int)sizeof(buf), f) != NULL) {
+		buf[sizeof(buf) - 1] = '\0';
+		result += nsm_read_line(filename, stb.st_mtime, buf, func);
+	}
+	if (result == 0)
+		xlog(L_ERROR, "Failed to read monitor data from %s", path);
+
+	(void)fclose(f);
+
+out_freepath:
+	free(path);
+out_err:
+	return result;
+}
+
+static unsigned int
+nsm_load_dir(const char *directory, nsm_populate_t func)
+{
+	unsigned int count = 0;
+	struct dirent *de;
+	char *path;
+	DIR *dir;
+
+	path = nsm_make_pathname(directory);
+	if (path == NULL) {
+		xlog(L_ERROR, "Failed to allocate path for directory %s",
+				directory);
+		return 0;
+	}
+
+	dir = opendir(path);
+	free(path);
+	if (dir == NULL) {
+		xlog(L_ERROR, "Failed to open directory %s: %m",
+				directory);
+		return 0;
+	}
+
+	while ((de = readdir(dir)) != NULL) {
+		if (de->d_name[0] == '.')
+			continue;
+
+		count += nsm_load_host(directory, de->d_name, func);
+	}
+
+	(void)closedir(dir);
+	return count;
+}
+
+/**
+ * nsm_load_monitor_list - load list of hosts to monitor
+ * @func: callback function to create entry for one host
+ *
+ * Returns the count of hosts that were found in the directory.
+ */
+unsigned int
+nsm_load_monitor_list(nsm_populate_t func)
+{
+	if (nsm_log_enabled())
+		return nsm_log_load(&nsm_monitor_log, func);
+	return nsm_load_dir(NSM_MONITOR_DIR, func);
+}
+
+/**
+ * nsm_load_notify_list - load list of hosts to notify
+ * @func: callback function to create entry for one host
+ *
+ * Returns the count of hosts that were found in the directory.
+ */
+unsigned int
+nsm_load_notify_list(nsm_populate_t func)
+{
+	if (nsm_log_enabled())
+		return nsm_log_load(&nsm_notify_log, func);
+	return nsm_load_dir(NSM_NOTIFY_DIR, func);
+}
+
+static void
+nsm_delete_host(const char *directory, const char *hostname,
+		const char *mon_name, const char *my_name, const int chatty)
+{
+	char line[LINELEN + 1 + SM_MAXSTRLEN + 2];
+	char *outbuf = NULL;
+	struct stat stb;
+	char *path, *next;
+	size_t remaining;
+	FILE *f;
+
+	path = nsm_make_record_pathname(directory, hostname);
+	if (path == NULL) {
+		xlog(L_ERROR, "Bad filename, not deleting");
+		return;
+	}
+
+	if (nsm_log_enabled()) {
+		nsm_log_delete(nsm_log_of(directory), hostname,
+				mon_name, my_name, chatty);
+		goto out;
+	}
+
+	if (stat(path, &stb) == -1) {
+		if (chatty)
+			xlog(L_ERROR, "Failed to delete: "
+				"could not stat original file %s: %m", path);
+		goto out;
 	}
 	remaining = (size_t)stb.st_size + 1;
 
@@ -1048,13 +2185,30 @@ nsm_delete_host(const char *directory, const char *hostname,
 	 * Otherwise, atomically update the contents of the file.
 	 */
 	if (next != outbuf) {
+		char value[NSM_NXATTRS][NSM_ADDRSTRLEN];
+		ssize_t len[NSM_NXATTRS];
+		unsigned int i;
+
+		/* the new file keeps the hints of the old one */
+		for (i = 0; i < NSM_NXATTRS; i++)
+			len[i] = getxattr(path, nsm_xattrs[i], value[i],
+					  sizeof(value[i]));
 		if (!nsm_atomic_write(path, outbuf, strlen(outbuf)))
 			xlog(L_ERROR, "Failed to delete: "
 				"could not write new file %s: %m", path);
+		else {
+			for (i = 0; i < NSM_NXATTRS; i++)
+				if (len[i] > 0)
+					(void)setxattr(path, nsm_xattrs[i],
+						value[i], (size_t)len[i], 0);
+			nsm_record_changed();
+		}
 	} else {
 		if (unlink(path) == -1)
 			xlog(L_ERROR, "Failed to delete: "
 				"could not unlink file %s: %m", path);
+		else
+			nsm_record_changed();
 	}
 
 out:
@@ -1090,3 +2244,228 @@ nsm_delete_notified_host(const char *hostname, const char *mon_name,
 {
 	nsm_delete_host(NSM_NOTIFY_DIR, hostname, mon_name, my_name, 1);
 }
+
+static _Bool
+nsm_set_hint(const char *directory, const char *hostname,
+		const char *name, const char *value)
+{
+	_Bool result = false;
+	char *path;
+
+	path = nsm_make_record_pathname(directory, hostname);
+	if (path == NULL)
+		return false;
+
+	if (nsm_log_enabled()) {
+		result = nsm_log_set_hint(nsm_log_of(directory), hostname,
+					  name, value);
+		goto out;
+	}
+
+	if (setxattr(path, name, value, strlen(value), 0) == -1)
+		xlog(D_GENERAL, "Failed to record %s of %s: %m",
+				name, hostname);
+	else
+		result = true;
+
+out:
+	free(path);
+	return result;
+}
+
+static _Bool
+nsm_get_hint(const char *directory, const char *hostname,
+		const char *name, char *buf, const size_t buflen)
+{
+	ssize_t len = -1;
+	char *path;
+
+	path = nsm_make_record_pathname(directory, hostname);
+	if (path != NULL && nsm_log_enabled()) {
+		free(path);
+		return nsm_log_get_hint(nsm_log_of(directory), hostname,
+					name, buf, buflen);
+	}
+	if (path != NULL && buflen > 1)
+		len = getxattr(path, name, buf, buflen - 1);
+	free(path);
+	if (len <= 0)
+		return false;
+	buf[len] = '\0';
+	return true;
+}
+
+static uint16_t
+nsm_get_port(const char *directory, const char *hostname)
+{
+	char buf[8], *end;
+	unsigned long port;
+
+	if (!nsm_get_hint(directory, hostname, NSM_PORT_XATTR,
+			  buf, sizeof(buf)))
+		return 0;
+	port = strtoul(buf, &end, 10);
+	if (*end != '\0' || port > UINT16_MAX)
+		return 0;
+	return (uint16_t)port;
+}
+
+static _Bool
+nsm_set_port(const char *directory, const char *hostname,
+		const uint16_t port)
+{
+	char buf[8];
+
+	(void)snprintf(buf, sizeof(buf), "%u", port);
+	return nsm_set_hint(directory, hostname, NSM_PORT_XATTR, buf);
+}
+
+/**
+ * nsm_set_monitored_addr - record the last known address of a monitored host
+ * @hostname: '\0'-terminated C string containing hostname of record
+ * @addr: '\0'-terminated C string containing a presentation address
+ *
+ * Returns true if successful, otherwise false if some error occurs.
+ */
+_Bool
+nsm_set_monitored_addr(const char *hostname, const char *addr)
+{
+	return nsm_set_hint(NSM_MONITOR_DIR, hostname, NSM_ADDR_XATTR, addr);
+}
+
+/**
+ * nsm_set_notified_addr - record the last known address of a host to notify
+ * @hostname: '\0'-terminated C string containing hostname of record
+ * @addr: '\0'-terminated C string containing a presentation address
+ *
+ * Returns true if successful, otherwise false if some error occurs.
+ */
+_Bool
+nsm_set_notified_addr(const char *hostname, const char *addr)
+{
+	return nsm_set_hint(NSM_NOTIFY_DIR, hostname, NSM_ADDR_XATTR, addr);
+}
+
+/**
+ * nsm_get_notified_addr - retrieve the last known address of a host to notify
+ * @hostname: '\0'-terminated C string containing hostname of record
+ * @buf: buffer to fill in with a '\0'-terminated presentation address
+ * @buflen: size of @buf
+ *
+ * Returns true if an address was recorded for @hostname, otherwise false.
+ */
+_Bool
+nsm_get_notified_addr(const char *hostname, char *buf, const size_t buflen)
+{
+	return nsm_get_hint(NSM_NOTIFY_DIR, hostname, NSM_ADDR_XATTR,
+			    buf, buflen);
+}
+
+static char *
+nsm_make_note_pathname(const char *hostname)
+{
+	char name[sizeof(NSM_PORT_NOTE) + SM_MAXSTRLEN];
+
+	if (snprintf(name, sizeof(name), NSM_PORT_NOTE "%s", hostname) >=
+							(int)sizeof(name))
+		return NULL;
+	return nsm_make_record_pathname(NSM_MONITOR_DIR, name);
+}
+
+/**
+ * nsm_remember_port - record the statd port of a host for its next reboot
+ * @hostname: '\0'-terminated C string containing hostname of record
+ * @port: port number, in host byte order
+ *
+ * The port is recorded on @hostname's monitor record, or if there is
+ * none yet, noted for nsm_recall_port() to find when statd creates it.
+ *
+ * Returns true if successful, otherwise false if some error occurs.
+ */
+_Bool
+nsm_remember_port(const char *hostname, const uint16_t port)
+{
+	_Bool result;
+	char buf[8];
+	char *path;
+
+	if (nsm_set_port(NSM_MONITOR_DIR, hostname, port))
+		return true;
+
+	path = nsm_make_note_pathname(hostname);
+	if (path == NULL)
+		return false;
+	(void)snprintf(buf, sizeof(buf), "%u", port);
+	result = nsm_atomic_write(path, buf, strlen(buf));
+	free(path);
+	return result;
+}
+
+/**
+ * nsm_recall_port - retrieve the statd port recorded for a monitored host
+ * @hostname: '\0'-terminated C string containing hostname of record
+ *
+ * A port only noted by nsm_remember_port() is forgotten once it has
+ * been retrieved; the caller records it on the new monitor record
+ * with nsm_set_monitored_port().
+ *
+ * Returns the port recorded for @hostname, or zero.
+ */
+uint16_t
+nsm_recall_port(const char *hostname)
+{
+	char buf[8], *end;
+	unsigned long port;
+	ssize_t len;
+	char *path;
+	int fd;
+
+	port = nsm_get_port(NSM_MONITOR_DIR, hostname);
+	if (port != 0)
+		return (uint16_t)port;
+
+	path = nsm_make_note_pathname(hostname);
+	if (path == NULL)
+		return 0;
+	fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		free(path);
+		return 0;
+	}
+	len = read(fd, buf, sizeof(buf) - 1);
+	(void)close(fd);
+	(void)unlink(path);
+	free(path);
+	if (len <= 0)
+		return 0;
+	buf[len] = '\0';
+	port = strtoul(buf, &end, 10);
+	if (*end != '\0' || port > UINT16_MAX)
+		return 0;
+	return (uint16_t)port;
+}
+
+/**
+ * nsm_set_monitored_port - record the statd port of a monitored host
+ * @hostname: '\0'-terminated C string containing hostname of record
+ * @port: port number, in host byte order
+ *
+ * Returns true if successful, otherwise false if some error occurs.
+ */
+_Bool
+nsm_set_monitored_port(const char *hostname, const uint16_t port)
+{
+	return nsm_set_port(NSM_MONITOR_DIR, hostname, port);
+}
+
+/**
+ * nsm_get_notified_port - retrieve the statd port of a host to notify
+ * @hostname: '\0'-terminated C string containing hostname of record
+ *
+ * Returns the port last recorded for @hostname, or zero.
+ */
+uint16_t
+nsm_get_notified_port(const char *hostname)
+{
+	return nsm_get_port(NSM_NOTIFY_DIR, hostname);
+}
@@ -37,6 +37,7 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 
 #include <stdint.h>
 #include <time.h>
@@ -45,6 +46,7 @@
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <errno.h>
 
 #include <netinet/in.h>
 #include <net/if.h>
@@ -68,12 +70,21 @@
 /*
  * Returns a fresh XID appropriate for RPC over UDP -- never zero.
  */
+static uint32_t nsm_xid_again = 0;
+
 static uint32_t
 nsm_next_xid(void)
 {
 	static uint32_t nsm_xid = 0;
 	struct timeval now;
 
+	if (nsm_xid_again != 0) {
+		uint32_t xid = nsm_xid_again;
+
+		nsm_xid_again = 0;
+		return xid;
+	}
+
 	if (nsm_xid == 0) {
 		(void)gettimeofday(&now, NULL);
 		nsm_xid = (uint32_t)getpid() ^
@@ -134,6 +145,155 @@ nsm_init_xdrmem(char *msgbuf, const unsigned int msgbuflen,
  * Returns true if all the bytes were sent successfully; otherwise
  * false if any error occurred.
  */
+/*
+ * While calls on a socket are held, nsm_rpc_sendto() copies them here,
+ * and nsm_xmit_flush() posts them together, with one sendmmsg(2) where
+ * it is available.
+ */
+#define NSM_XMIT_BATCH	64
+#define NSM_XMIT_SOCKS	16
+
+static struct {
+	unsigned int		nsocks;
+	int			socks[NSM_XMIT_SOCKS];
+	unsigned int		count;
+	int			sock[NSM_XMIT_BATCH];
+	struct iovec		iov[NSM_XMIT_BATCH];
+	struct sockaddr_storage	addr[NSM_XMIT_BATCH];
+	socklen_t		addrlen[NSM_XMIT_BATCH];
+	char			buf[NSM_XMIT_BATCH][NSM_MAXMSGSIZE];
+} nsm_held;
+
+/**
+ * nsm_xmit_hold - start holding calls posted on a socket
+ * @sock: datagram socket descriptor
+ *
+ * Until nsm_xmit_flush() is called, the nsm_xmit_* functions queue
+ * calls on @sock instead of sending them, except that a full queue is
+ * flushed.  Their XIDs are returned as usual.  Calls on several
+ * sockets may be held at once.
+ */
+void
+nsm_xmit_hold(const int sock)
+{
+	unsigned int i;
+
+	for (i = 0; i < nsm_held.nsocks; i++)
+		if (nsm_held.socks[i] == sock)
+			return;
+	if (nsm_held.nsocks < NSM_XMIT_SOCKS)
+		nsm_held.socks[nsm_held.nsocks++] = sock;
+}
+
+static _Bool
+nsm_xmit_held(const int sock)
+{
+	unsigned int i;
+
+	for (i = 0; i < nsm_held.nsocks; i++)
+		if (nsm_held.socks[i] == sock)
+			return true;
+	return false;
+}
+
+/*
+ * Send the calls queued so far, each run of calls on one socket
+ * with one sendmmsg(2) where it is available.
+ */
+static unsigned int
+nsm_xmit_post(void)
+{
+	unsigned int i, sent = 0;
+#ifdef HAVE_SENDMMSG
+	struct mmsghdr msgs[NSM_XMIT_BATCH];
+	unsigned int end;
+	int n;
+
+	memset(msgs, 0, sizeof(msgs[0]) * nsm_held.count);
+	for (i = 0; i < nsm_held.count; i++) {
+		msgs[i].msg_hdr.msg_name = &nsm_held.addr[i];
+		msgs[i].msg_hdr.msg_namelen = nsm_held.addrlen[i];
+		msgs[i].msg_hdr.msg_iov = &nsm_held.iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+	for (i = 0; i < nsm_held.count; i = end) {
+		for (end = i + 1; end < nsm_held.count &&
+		     nsm_held.sock[end] == nsm_held.sock[i]; end++)
+			;
+		while (i < end) {
+			n = sendmmsg(nsm_held.sock[i], msgs + i, end - i, 0);
+			if (n < 0) {
+				if (errno == EINTR)
+					continue;
+				/* skip the call that failed, and go on */
+				xlog(L_ERROR, "%s: sendmmsg failed: %m",
+					__func__);
+				i++;
+				continue;
+			}
+			i += (unsigned int)n;
+			sent += (unsigned int)n;
+		}
+	}
+#else	/* !HAVE_SENDMMSG */
+	for (i = 0; i < nsm_held.count; i++) {
+		if (sendto(nsm_held.sock[i], nsm_held.iov[i].iov_base,
+			   nsm_held.iov[i].iov_len, 0,
+			   (struct sockaddr *)&nsm_held.addr[i],
+			   nsm_held.addrlen[i]) < 0)
+			xlog(L_ERROR, "%s: sendto failed: %m", __func__);
+		else
+			sent++;
+	}
+#endif	/* !HAVE_SENDMMSG */
+	nsm_held.count = 0;
+	return sent;
+}
+
+/**
+ * nsm_xmit_flush - send the calls held by nsm_xmit_hold()
+ *
+ * Calls are posted but not sent any more, and the calls that were held
+ * are sent.  Returns the number of calls sent; any that could not be
+ * sent are logged and dropped, as if they were lost on the network.
+ */
+unsigned int
+nsm_xmit_flush(void)
+{
+	nsm_held.nsocks = 0;
+	return nsm_xmit_post();
+}
+
+/**
+ * nsm_xmit_reuse_xid - post the next call with the XID of an earlier one
+ * @xid: XID to use, or zero for a fresh one as usual
+ *
+ * A call posted to several addresses of one peer can then be matched
+ * by a single XID to whichever address answers first.
+ */
+void
+nsm_xmit_reuse_xid(const uint32_t xid)
+{
+	nsm_xid_again = xid;
+}
+
+static void
+nsm_rpc_hold(const int sock, const struct sockaddr *sap,
+		const socklen_t salen, const void *buf, const size_t buflen)
+{
+	const unsigned int i = nsm_held.count;
+
+	memcpy(nsm_held.buf[i], buf, buflen);
+	nsm_held.sock[i] = sock;
+	nsm_held.iov[i].iov_base = nsm_held.buf[i];
+	nsm_held.iov[i].iov_len = buflen;
+	memcpy(&nsm_held.addr[i], sap, salen);
+	nsm_held.addrlen[i] = salen;
+
+	if (++nsm_held.count == NSM_XMIT_BATCH)
+		(void)nsm_xmit_post();
+}
+
 static _Bool
 nsm_rpc_sendto(const int sock, const struct sockaddr *sap,
 			const socklen_t salen, XDR *xdrs, void *buf)
@@ -141,6 +301,12 @@ nsm_rpc_sendto(const int sock, const struct sockaddr *sap,
 	const size_t buflen = (size_t)xdr_getpos(xdrs);
 	ssize_t err;
 
+	if (nsm_xmit_held(sock) && buflen <= NSM_MAXMSGSIZE &&
+	    salen <= sizeof(struct sockaddr_storage)) {
+		nsm_rpc_hold(sock, sap, salen, buf, buflen);
+		return true;
+	}
+
 	err = sendto(sock, buf, buflen, 0, sap, salen);
 	if ((err < 0) || ((size_t)err != buflen)) {
 		xlog(L_ERROR, "%s: sendto failed: %m", __func__);
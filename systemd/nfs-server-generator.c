@@ -26,69 +26,235 @@
 #include <stdio.h>
 #include <mntent.h>
 #include <alloca.h>
+#include <dirent.h>
+#include <limits.h>
 
 #include "misc.h"
 #include "nfslib.h"
 #include "exportfs.h"
 #include "systemd.h"
 
-/* A simple "set of strings" to remove duplicates
- * found in /etc/exports
+/*
+ * A set of strings: the paths found in the exports files, to remove
+ * duplicates, and the mount points in /etc/fstab marked noauto.
+ * Hosts can have tens of thousands of each.
  */
-struct list {
-	struct list *next;
-	char *name;
+struct pathset_ent {
+	struct pathset_ent *next;
+	char name[];
+};
+
+struct pathset {
+	struct pathset_ent **table;
+	unsigned int size;	/* a power of two */
+	unsigned int count;
 };
-static int is_unique(struct list **lp, char *path)
+
+/* FNV-1a over the first @len bytes of @s */
+static unsigned int pathset_hash(const char *s, size_t len)
 {
-	struct list *l = *lp;
+	unsigned int h = 2166136261u;
+
+	while (len--)
+		h = (h ^ (unsigned char)*s++) * 16777619u;
+	return h;
+}
+
+static struct pathset_ent **pathset_find(struct pathset *set,
+					 const char *name, size_t len)
+{
+	struct pathset_ent **pp;
+
+	if (!set->size)
+		return NULL;
+	pp = &set->table[pathset_hash(name, len) & (set->size - 1)];
+	for (; *pp; pp = &(*pp)->next)
+		if (strncmp((*pp)->name, name, len) == 0 &&
+		    (*pp)->name[len] == '\0')
+			break;
+	return pp;
+}
 
-	while (l) {
-		if (strcmp(l->name, path) == 0)
-			return 0;
-		l = l->next;
+static void pathset_grow(struct pathset *set)
+{
+	unsigned int size = set->size ? set->size * 2 : 256;
+	struct pathset_ent **table, *e, *next;
+	unsigned int i, h;
+
+	table = calloc(size, sizeof(*table));
+	if (table == NULL)
+		return;
+	for (i = 0; i < set->size; i++)
+		for (e = set->table[i]; e; e = next) {
+			next = e->next;
+			h = pathset_hash(e->name, strlen(e->name));
+			e->next = table[h & (size - 1)];
+			table[h & (size - 1)] = e;
+		}
+	free(set->table);
+	set->table = table;
+	set->size = size;
+}
+
+/*
+ * Returns the copy of @name that was added, or NULL if it was already
+ * there or there is no memory for it.
+ */
+static const char *pathset_add(struct pathset *set, const char *name)
+{
+	size_t len = strlen(name);
+	struct pathset_ent **pp, *e;
+
+	pp = pathset_find(set, name, len);
+	if (pp && *pp)
+		return NULL;
+	if (set->count >= set->size) {
+		pathset_grow(set);
+		pp = pathset_find(set, name, len);
+		if (pp == NULL)
+			return NULL;
 	}
-	l = malloc(sizeof(*l));
-	if (l == NULL)
-		return 0;
-	l->name = path;
-	l->next = *lp;
-	*lp = l;
-	return 1;
+	e = malloc(sizeof(*e) + len + 1);
+	if (e == NULL)
+		return NULL;
+	memcpy(e->name, name, len + 1);
+	e->next = NULL;
+	*pp = e;
+	set->count++;
+	return e->name;
 }
 
-static int has_noauto_flag(char *path)
+static int pathset_has(struct pathset *set, const char *name, size_t len)
+{
+	struct pathset_ent **pp = pathset_find(set, name, len);
+
+	return pp && *pp;
+}
+
+static struct pathset noauto;	/* mount points in fstab marked noauto */
+static char **nfs_mounts;	/* of type nfs or nfs4, escaped as units */
+static int nfs_mount_count;
+
+/*
+ * Read /etc/fstab once, for both the noauto mount points and the NFS
+ * mounts.  Returns zero, or -1 if it can't be read.
+ */
+static int read_fstab(void)
 {
 	FILE		*fstab;
 	struct mntent	*mnt;
+	char		*spath, **new;
 
 	fstab = setmntent("/etc/fstab", "r");
 	if (!fstab)
-		return 0;
+		return -1;
 
 	while ((mnt = getmntent(fstab)) != NULL) {
-		int l = strlen(mnt->mnt_dir);
-		if (strncmp(mnt->mnt_dir, path, l) != 0)
+		if (hasmntopt(mnt, "noauto"))
+			pathset_add(&noauto, mnt->mnt_dir);
+
+		if (strcmp(mnt->mnt_type, "nfs") != 0 &&
+		    strcmp(mnt->mnt_type, "nfs4") != 0)
 			continue;
-		if (path[l] && path[l] != '/')
+
+		spath = systemd_escape(mnt->mnt_dir, ".mount");
+		if (!spath) {
+			fprintf(stderr, 
+				"nfs-server-generator: convert path failed: %s\n",
+				mnt->mnt_dir);
 			continue;
-		if (hasmntopt(mnt, "noauto"))
-			break;
+		}
+		new = realloc(nfs_mounts, (nfs_mount_count + 1) * sizeof(*new));
+		if (!new) {
+			free(spath);
+			continue;
+		}
+		nfs_mounts = new;
+		nfs_mounts[nfs_mount_count++] = spath;
 	}
 	fclose(fstab);
-	return mnt != NULL;
+	return 0;
+}
+
+/* Is @path, or a directory above it, a noauto mount point? */
+static int has_noauto_flag(const char *path)
+{
+	size_t l;
+
+	if (!noauto.count)
+		return 0;
+	for (l = 0; path[l]; l++)
+		if (path[l] == '/' && pathset_has(&noauto, path, l))
+			return 1;
+	return pathset_has(&noauto, path, l);
+}
+
+static struct pathset exported;
+static const char **requires;	/* exported paths to be mounted first */
+static int require_count;
+
+/*
+ * Note each new path exported by @fname that must be mounted before
+ * nfs-server starts.  Only the paths are read; the clients and their
+ * options are not parsed.  Returns the number of paths exported.
+ */
+static int scan_exports(char *fname)
+{
+	char		path[NFS_MAXPATHLEN+1];
+	const char	*name, **new;
+	int		mountpoint, count = 0;
+
+	setexportent(fname, "r");
+	while (getexportpath(path, sizeof(path), &mountpoint)) {
+		count++;
+		name = pathset_add(&exported, path);
+		if (!name || mountpoint || has_noauto_flag(name))
+			continue;
+		new = realloc(requires, (require_count + 1) * sizeof(*new));
+		if (!new)
+			continue;
+		requires = new;
+		requires[require_count++] = name;
+	}
+	endexportent();
+	return count;
+}
+
+/* The same files as export_d_read() reads, in the same order */
+static int scan_exports_d(const char *dname)
+{
+	struct dirent	**namelist = NULL;
+	char		fname[PATH_MAX + 1];
+	size_t		namesz, extsz = strlen(_EXT_EXPORT);
+	int		n, i, count = 0;
+
+	n = scandir(dname, &namelist, NULL, versionsort);
+	if (n < 0)
+		return 0;
+	for (i = 0; i < n; i++) {
+		struct dirent *d = namelist[i];
+
+		namesz = strlen(d->d_name);
+		if ((d->d_type == DT_UNKNOWN || d->d_type == DT_REG ||
+		     d->d_type == DT_LNK) && *d->d_name != '.' &&
+		    namesz > extsz &&
+		    strcmp(d->d_name + namesz - extsz, _EXT_EXPORT) == 0 &&
+		    snprintf(fname, sizeof(fname), "%s/%s", dname,
+			     d->d_name) < (int)sizeof(fname))
+			count += scan_exports(fname);
+		free(d);
+	}
+	free(namelist);
+	return count;
 }
 
 int main(int argc, char *argv[])
 {
-	char		*path, *spath;
+	char		*path;
 	char		dirbase[] = "/nfs-server.service.d";
 	char		filebase[] = "/order-with-mounts.conf";
-	nfs_export	*exp;
-	int		i;
-	struct list	*list = NULL;
-	FILE		*f, *fstab;
-	struct mntent	*mnt;
+	int		i, fstab_ok;
+	FILE		*f;
 
 	/* Avoid using any external services */
 	xlog_syslog(0);
@@ -102,8 +268,9 @@ int main(int argc, char *argv[])
 	path = alloca(strlen(argv[1]) + sizeof(dirbase) + sizeof(filebase));
 	if (!path)
 		exit(2);
-	if (export_read(_PATH_EXPORTS, 1) +
-	    export_d_read(_PATH_EXPORTS_D, 1) == 0)
+	fstab_ok = read_fstab() == 0;
+	if (scan_exports(_PATH_EXPORTS) +
+	    scan_exports_d(_PATH_EXPORTS_D) == 0)
 		/* Nothing is exported, so nothing to do */
 		exit(0);
 
@@ -115,43 +282,19 @@ int main(int argc, char *argv[])
 		exit(1);
 	fprintf(f, "# Automatically generated by nfs-server-generator\n\n[Unit]\n");
 
-	for (i = 0; i < MCL_MAXTYPES; i++) {
-		for (exp = exportlist[i].p_head; exp; exp = exp->m_next) {
-			if (!is_unique(&list, exp->m_export.e_path))
-				continue;
-			if (exp->m_export.e_mountpoint)
-				continue;
-			if (has_noauto_flag(exp->m_export.e_path))
-				continue;
-			if (strchr(exp->m_export.e_path, ' '))
-				fprintf(f, "RequiresMountsFor=\"%s\"\n",
-					exp->m_export.e_path);
-			else
-				fprintf(f, "RequiresMountsFor=%s\n",
-					exp->m_export.e_path);
-		}
+	for (i = 0; i < require_count; i++) {
+		if (strchr(requires[i], ' '))
+			fprintf(f, "RequiresMountsFor=\"%s\"\n", requires[i]);
+		else
+			fprintf(f, "RequiresMountsFor=%s\n", requires[i]);
 	}
 
-	fstab = setmntent("/etc/fstab", "r");
-	if (!fstab)
+	if (!fstab_ok)
 		exit(1);
 
-	while ((mnt = getmntent(fstab)) != NULL) {
-		if (strcmp(mnt->mnt_type, "nfs") != 0 &&
-		    strcmp(mnt->mnt_type, "nfs4") != 0)
-			continue;
+	for (i = 0; i < nfs_mount_count; i++)
+		fprintf(f, "Before=%s\n", nfs_mounts[i]);
 
-		spath = systemd_escape(mnt->mnt_dir, ".mount");
-		if (!spath) {
-			fprintf(stderr, 
-				"nfs-server-generator: convert path failed: %s\n",
-				mnt->mnt_dir);
-			continue;
-		}
-		fprintf(f, "Before=%s\n", spath);
-	}
-
-	fclose(fstab);
 	fclose(f);
 
 	exit(0);
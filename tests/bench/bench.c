@@ -0,0 +1,151 @@
+/*
+ * bench.c -- the harness shared by the microbenchmarks, see bench.h
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bench.h"
+
+volatile unsigned long bench_sink;
+
+static const char *bench_program;
+static char **bench_names;
+static int bench_nnames;
+static unsigned long long bench_min_nsec = 100000000ULL;
+static int bench_failures;
+
+static unsigned long long
+bench_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static unsigned long long
+bench_time(bench_fn fn, void *arg, unsigned long n)
+{
+	unsigned long long start = bench_clock();
+
+	fn(arg, n);
+	return bench_clock() - start;
+}
+
+/**
+ * bench_init - read the options common to every benchmark program
+ * @program: name printed with each result
+ * @argc: from main()
+ * @argv: from main()
+ */
+void
+bench_init(const char *program, int argc, char **argv)
+{
+	int opt;
+
+	bench_program = program;
+	while ((opt = getopt(argc, argv, "t:")) != -1) {
+		switch (opt) {
+		case 't':
+			bench_min_nsec = strtoull(optarg, NULL, 10) * 1000000ULL;
+			if (bench_min_nsec == 0)
+				bench_min_nsec = 1000000ULL;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-t msecs] [benchmark...]\n",
+				argv[0]);
+			exit(2);
+		}
+	}
+	bench_names = argv + optind;
+	bench_nnames = argc - optind;
+}
+
+static int
+bench_wanted(const char *name)
+{
+	int i;
+
+	if (bench_nnames == 0)
+		return 1;
+	for (i = 0; i < bench_nnames; i++)
+		if (strcmp(bench_names[i], name) == 0)
+			return 1;
+	return 0;
+}
+
+/**
+ * bench_run - time a benchmark and print its result
+ * @name: name of the benchmark within the program
+ * @fn: does the operation @n times
+ * @arg: passed to @fn
+ */
+void
+bench_run(const char *name, bench_fn fn, void *arg)
+{
+	unsigned long long t, best;
+	unsigned long n = 1;
+	int i;
+
+	if (!bench_wanted(name))
+		return;
+
+	/* The first call may set things up, so it doesn't count */
+	fn(arg, 1);
+	while ((t = bench_time(fn, arg, n)) < bench_min_nsec) {
+		if (t < bench_min_nsec / 16)
+			n *= 16;
+		else
+			n = n * bench_min_nsec / (t ? t : 1) + 1;
+	}
+
+	best = t;
+	for (i = 0; i < BENCH_RUNS; i++) {
+		t = bench_time(fn, arg, n);
+		if (t < best)
+			best = t;
+	}
+	printf("bench %s.%s %lu %.1f\n", bench_program, name, n,
+	       (double)best / n);
+	fflush(stdout);
+}
+
+/**
+ * bench_fail - report that a benchmark got a wrong answer
+ * @fmt: printf format of the message
+ *
+ * The program then exits with status 1 from bench_done().
+ */
+void
+bench_fail(const char *fmt, ...)
+{
+	va_list ap;
+
+	fprintf(stderr, "%s: ", bench_program);
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fputc('\n', stderr);
+	bench_failures++;
+}
+
+/* Returns the exit status of the program */
+int
+bench_done(void)
+{
+	return bench_failures != 0;
+}
@@ -0,0 +1,42 @@
+/*
+ * bench.h -- a small harness for the microbenchmarks in tests/bench
+ *
+ * A benchmark is a function that does its operation @n times.  After
+ * one call that isn't timed, the harness calls it with a growing @n
+ * until one call takes at least the minimum time, then calls it
+ * BENCH_RUNS more times with that @n and keeps the fastest, which is
+ * less disturbed by other work on the machine than the mean.  Each
+ * result is one line on stdout:
+ *
+ *	bench <program>.<name> <ops> <ns/op>
+ *
+ * so that runs can be compared with a script.  Anything else a
+ * program prints starts with '#'.
+ *
+ * Every program takes the same options: -t for the minimum time of a
+ * call in milliseconds, 100 by default, and any other arguments name
+ * the benchmarks to run, all of them if none are given.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ */
+
+#ifndef _BENCH_H
+#define _BENCH_H
+
+#define BENCH_RUNS	5
+
+typedef void (*bench_fn)(void *arg, unsigned long n);
+
+/* Results are stored here so that the compiler can't drop the work */
+extern volatile unsigned long bench_sink;
+
+void	bench_init(const char *program, int argc, char **argv);
+void	bench_run(const char *name, bench_fn fn, void *arg);
+void	bench_fail(const char *fmt, ...)
+		__attribute__((format(printf, 1, 2)));
+int	bench_done(void);
+
+#endif	/* _BENCH_H */
@@ -0,0 +1,144 @@
+/*
+ * bench_conf.c -- nfs.conf lookups in conffile.c
+ *
+ * Writes a configuration with NSECTIONS sections of NTAGS tags each,
+ * some of the sections with arguments, loads it, and looks values up
+ * the ways the daemons do.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "nfslib.h"
+#include "conffile.h"
+#include "xlog.h"
+#include "bench.h"
+
+#define NSECTIONS	64
+#define NTAGS		32
+
+static char conf_path[] = "/tmp/bench_conf.XXXXXX";
+
+static void
+write_conf(void)
+{
+	FILE *fp;
+	int fd, s, t;
+
+	fd = mkstemp(conf_path);
+	if (fd < 0 || (fp = fdopen(fd, "w")) == NULL) {
+		perror(conf_path);
+		exit(1);
+	}
+	for (s = 0; s < NSECTIONS; s++) {
+		if (s % 4 == 3)
+			fprintf(fp, "[section%d \"arg%d\"]\n", s - 3, s);
+		else
+			fprintf(fp, "[section%d]\n", s);
+		for (t = 0; t < NTAGS; t++)
+			fprintf(fp, "tag-%d = value %d.%d\n", t, s, t);
+		fputc('\n', fp);
+	}
+	fclose(fp);
+}
+
+static void
+bench_load(void *UNUSED(arg), unsigned long n)
+{
+	while (n--) {
+		conf_cleanup();
+		conf_init_file(conf_path);
+	}
+}
+
+static void
+bench_get_str(void *arg, unsigned long n)
+{
+	const char *section = arg;
+	unsigned long found = 0;
+
+	while (n--)
+		found += conf_get_str(section, "tag-17") != NULL;
+	bench_sink = found;
+}
+
+static void
+bench_get_section(void *UNUSED(arg), unsigned long n)
+{
+	unsigned long found = 0;
+
+	while (n--)
+		found += conf_get_section("section4", "arg7", "tag-17") != NULL;
+	bench_sink = found;
+}
+
+static void
+bench_get_num(void *UNUSED(arg), unsigned long n)
+{
+	unsigned long total = 0;
+
+	while (n--)
+		total += conf_get_num("section21", "threads", 8);
+	bench_sink = total;
+}
+
+static void
+bench_key_str(void *arg, unsigned long n)
+{
+	struct conf_key *key = arg;
+	unsigned long found = 0;
+
+	while (n--)
+		found += conf_key_str(key) != NULL;
+	bench_sink = found;
+}
+
+static void
+check(void)
+{
+	char *value;
+
+	value = conf_get_str("section21", "tag-17");
+	if (value == NULL || strcmp(value, "value 21.17") != 0)
+		bench_fail("[section21] tag-17 is %s", value ? value : "unset");
+	value = conf_get_section("section4", "arg7", "tag-3");
+	if (value == NULL || strcmp(value, "value 7.3") != 0)
+		bench_fail("[section4 \"arg7\"] tag-3 is %s",
+			   value ? value : "unset");
+	if (conf_get_str("nosuch", "tag-17") != NULL)
+		bench_fail("[nosuch] tag-17 is set");
+}
+
+int
+main(int argc, char **argv)
+{
+	bench_init("conf", argc, argv);
+	xlog_open(argv[0]);
+	xlog_stderr(1);
+	write_conf();
+
+	bench_run("load", bench_load, NULL);
+	conf_init_file(conf_path);
+	check();
+
+	bench_run("get_str", bench_get_str, "section21");
+	bench_run("get_str_missing", bench_get_str, "nosuch");
+	bench_run("get_section_arg", bench_get_section, NULL);
+	bench_run("get_num_default", bench_get_num, NULL);
+	bench_run("key_str", bench_key_str,
+		  conf_key_get("section21", NULL, "tag-17"));
+
+	unlink(conf_path);
+	return bench_done();
+}
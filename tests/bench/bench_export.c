@@ -0,0 +1,231 @@
+/*
+ * bench_export.c -- export and client matching in libexport, and the
+ * export option parser in exports.c
+ *
+ * Builds a table of NPATHS exported paths, each exported to NHOSTS
+ * hosts given by address and to a /16 subnetwork, plus one path
+ * exported to everyone, then looks exports up for client addresses
+ * the way mountd does.  No name service is used.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "exportfs.h"
+#include "xlog.h"
+#include "bench.h"
+
+#define NPATHS		256
+#define NHOSTS		4
+
+#define SIMPLE_OPTS	"rw,sync,no_subtree_check"
+#define FULL_OPTS	"rw,sync,no_subtree_check,no_root_squash,fsid=17," \
+			"anonuid=1000,anongid=1000,sec=krb5p:krb5i:sys," \
+			"refer=/export/vol17@nfs1.example.com+nfs2.example.com"
+
+struct lookup {
+	const char		*path;
+	struct addrinfo		*ai;
+	nfs_client		*clp;
+};
+
+static void
+add_export(char *hname, char *path)
+{
+	struct exportent *eep;
+
+	eep = mkexportent(hname, path, SIMPLE_OPTS);
+	if (eep == NULL || export_create(eep, 0) == NULL) {
+		fprintf(stderr, "unable to export %s to %s\n", path, hname);
+		exit(1);
+	}
+}
+
+static void
+build_table(void)
+{
+	char path[64], hname[64];
+	int i, h;
+
+	for (i = 0; i < NPATHS; i++) {
+		snprintf(path, sizeof(path), "/export/vol%d", i);
+		for (h = 1; h <= NHOSTS; h++) {
+			snprintf(hname, sizeof(hname), "192.168.%d.%d", i, h);
+			add_export(hname, path);
+		}
+		snprintf(hname, sizeof(hname), "10.%d.0.0/16", i);
+		add_export(hname, path);
+	}
+	add_export("*", "/export/public");
+	client_subnet_index();
+}
+
+static struct lookup *
+lookup(const char *path, const char *addr)
+{
+	struct lookup *l;
+
+	/* The addrinfo mountd has for a caller whose name isn't known */
+	l = calloc(1, sizeof(*l));
+	if (l == NULL || (l->ai = host_pton(addr)) == NULL) {
+		fprintf(stderr, "bad address %s\n", addr);
+		exit(1);
+	}
+	l->ai->ai_canonname = strdup(addr);
+	l->path = path;
+	return l;
+}
+
+/* The client that @path is exported to for @hname */
+static struct lookup *
+lookup_client(const char *path, const char *addr, char *hname)
+{
+	struct lookup *l = lookup(path, addr);
+	nfs_export *exp;
+
+	exp = export_lookup(hname, (char *)path, 0);
+	if (exp == NULL) {
+		fprintf(stderr, "%s is not exported to %s\n", path, hname);
+		exit(1);
+	}
+	l->clp = exp->m_client;
+	return l;
+}
+
+static void
+bench_find(void *arg, unsigned long n)
+{
+	struct lookup *l = arg;
+	unsigned long found = 0;
+
+	while (n--)
+		found += export_find(l->ai, l->path) != NULL;
+	bench_sink = found;
+}
+
+static void
+bench_client_check(void *arg, unsigned long n)
+{
+	struct lookup *l = arg;
+	unsigned long found = 0;
+
+	while (n--)
+		found += client_check(l->clp, l->ai);
+	bench_sink = found;
+}
+
+static void
+bench_parse(void *arg, unsigned long n)
+{
+	char opts[512];
+	unsigned long parsed = 0;
+
+	while (n--) {
+		strcpy(opts, arg);
+		parsed += mkexportent("*", "/export/vol17", opts) != NULL;
+	}
+	bench_sink = parsed;
+}
+
+/* A whole exports file, one line per path */
+static void
+bench_getexportent(void *arg, unsigned long n)
+{
+	const char *buf = arg;
+	size_t len = strlen(buf);
+	unsigned long entries = 0;
+
+	while (n--) {
+		setexportent_buf("bench", buf, len);
+		while (getexportent(0, 0) != NULL)
+			entries++;
+		endexportent();
+	}
+	bench_sink = entries;
+}
+
+static char *
+exports_file(void)
+{
+	size_t size = NPATHS * 160;
+	char *buf, *p;
+	int i;
+
+	buf = p = malloc(size);
+	if (buf == NULL)
+		exit(1);
+	for (i = 0; i < NPATHS; i++)
+		p += snprintf(p, size - (p - buf), "/export/vol%d "
+			      "192.168.%d.0/24(" SIMPLE_OPTS ") "
+			      "*.example.com(ro,sec=krb5p)\n", i, i);
+	return buf;
+}
+
+static void
+check(struct lookup *host, struct lookup *subnet, struct lookup *stranger)
+{
+	struct exportent *eep;
+	nfs_export *exp;
+	char opts[] = FULL_OPTS;
+
+	exp = export_find(host->ai, host->path);
+	if (exp == NULL || exp->m_client->m_type != MCL_FQDN)
+		bench_fail("no host export of %s", host->path);
+	exp = export_find(subnet->ai, subnet->path);
+	if (exp == NULL || strcmp(exp->m_export.e_hostname, "10.200.0.0/16"))
+		bench_fail("no subnet export of %s", subnet->path);
+	if (export_find(stranger->ai, stranger->path) != NULL)
+		bench_fail("%s is exported to a stranger", stranger->path);
+	if (!client_check(host->clp, host->ai) ||
+	    !client_check(subnet->clp, subnet->ai) ||
+	    client_check(subnet->clp, stranger->ai))
+		bench_fail("client_check() got it wrong");
+
+	eep = mkexportent("*", "/export/vol17", opts);
+	if (eep == NULL || eep->e_fsid != 17 || eep->e_anonuid != 1000 ||
+	    eep->e_flags & NFSEXP_ROOTSQUASH)
+		bench_fail("%s parsed wrong", FULL_OPTS);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct lookup *host, *subnet, *stranger, *public, *unexported;
+
+	bench_init("export", argc, argv);
+	xlog_open(argv[0]);
+	xlog_stderr(1);
+	build_table();
+
+	host = lookup_client("/export/vol100", "192.168.100.3",
+			     "192.168.100.3");
+	subnet = lookup_client("/export/vol200", "10.200.7.9",
+			       "10.200.0.0/16");
+	stranger = lookup("/export/vol100", "172.16.1.1");
+	public = lookup("/export/public", "172.16.1.1");
+	unexported = lookup("/srv/nothere", "192.168.100.3");
+	check(host, subnet, stranger);
+
+	bench_run("find_host", bench_find, host);
+	/* Finds the copy export_find() made for the address above */
+	bench_run("find_subnet", bench_find, subnet);
+	bench_run("find_anonymous", bench_find, public);
+	bench_run("find_stranger", bench_find, stranger);
+	bench_run("find_unexported", bench_find, unexported);
+	bench_run("client_check_host", bench_client_check, host);
+	bench_run("client_check_subnet", bench_client_check, subnet);
+	bench_run("parseopts_simple", bench_parse, SIMPLE_OPTS);
+	bench_run("parseopts_full", bench_parse, FULL_OPTS);
+	bench_run("getexportent", bench_getexportent, exports_file());
+	return bench_done();
+}
@@ -0,0 +1,170 @@
+/*
+ * bench_nsm.c -- the monitor records in support/nsm/file.c
+ *
+ * Sets up a scratch statd directory holding NHOSTS monitor records,
+ * then times what statd does with them: SM_MON and SM_UNMON for one
+ * more host, committed in groups of COMMIT_GROUP as statd does under
+ * load, and loading the whole list at start-up.  The same is timed
+ * again once the records are converted to the database log.
+ *
+ * These touch the file system, so the results depend on where the
+ * scratch directory is, TMPDIR or /tmp.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <ftw.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+
+#include "nfslib.h"
+#include "nsm.h"
+#include "xlog.h"
+#include "bench.h"
+
+#define NHOSTS		512
+#define COMMIT_GROUP	32
+
+static char statedir[PATH_MAX];
+
+static void
+make_mon(struct mon *m, char *mon_name)
+{
+	memset(m, 0, sizeof(*m));
+	m->mon_id.mon_name = mon_name;
+	m->mon_id.my_id.my_name = "nfs.example.com";
+	m->mon_id.my_id.my_prog = 100021;
+	m->mon_id.my_id.my_vers = 4;
+	m->mon_id.my_id.my_proc = 16;
+	memset(m->priv, 0x5a, sizeof(m->priv));
+}
+
+static void
+make_statedir(void)
+{
+	const char *tmp = getenv("TMPDIR");
+	struct sockaddr_in sin = {
+		.sin_family	= AF_INET,
+	};
+	char name[64], path[PATH_MAX + 8];
+	struct mon m;
+	int i;
+
+	snprintf(statedir, sizeof(statedir), "%s/bench_nsm.XXXXXX",
+		 tmp ? tmp : "/tmp");
+	if (mkdtemp(statedir) == NULL) {
+		perror(statedir);
+		exit(1);
+	}
+	snprintf(path, sizeof(path), "%s/sm", statedir);
+	mkdir(path, 0700);
+	snprintf(path, sizeof(path), "%s/sm.bak", statedir);
+	mkdir(path, 0700);
+	if (!nsm_setup_pathnames("bench_nsm", statedir))
+		exit(1);
+
+	nsm_commit_hold();
+	for (i = 0; i < NHOSTS; i++) {
+		snprintf(name, sizeof(name), "client%d.example.com", i);
+		sin.sin_addr.s_addr = htonl(0x0a000000 + i);
+		make_mon(&m, name);
+		if (!nsm_insert_monitored_host(name,
+					(struct sockaddr *)&sin, &m)) {
+			fprintf(stderr, "unable to monitor %s\n", name);
+			exit(1);
+		}
+	}
+	nsm_commit();
+}
+
+static int
+remove_entry(const char *path, const struct stat *UNUSED(sb),
+	     int UNUSED(flag), struct FTW *UNUSED(ftw))
+{
+	return remove(path);
+}
+
+static unsigned int
+count_host(const char *UNUSED(hostname), const struct sockaddr *UNUSED(sap),
+	   const struct mon *m, const time_t UNUSED(timestamp))
+{
+	return m->mon_id.my_id.my_prog == 100021;
+}
+
+/* SM_MON then SM_UNMON of one host */
+static void
+bench_monitor(void *UNUSED(arg), unsigned long n)
+{
+	struct sockaddr_in sin = {
+		.sin_family	= AF_INET,
+	};
+	char name[] = "bench.example.com";
+	unsigned long i;
+	struct mon m;
+
+	sin.sin_addr.s_addr = htonl(0xc0a80001);
+	make_mon(&m, name);
+	for (i = 1; i <= n; i++) {
+		nsm_insert_monitored_host(name, (struct sockaddr *)&sin, &m);
+		nsm_delete_monitored_host(name, name, m.mon_id.my_id.my_name,
+					  0);
+		if (i % COMMIT_GROUP == 0)
+			nsm_commit();
+	}
+	nsm_commit();
+}
+
+static void
+bench_load(void *UNUSED(arg), unsigned long n)
+{
+	unsigned long total = 0;
+
+	while (n--)
+		total += nsm_load_monitor_list(count_host);
+	bench_sink = total;
+}
+
+static void
+check(const char *mode)
+{
+	unsigned int count = nsm_load_monitor_list(count_host);
+
+	if (count != NHOSTS)
+		bench_fail("%s: loaded %u of %d hosts", mode, count, NHOSTS);
+}
+
+int
+main(int argc, char **argv)
+{
+	bench_init("nsm", argc, argv);
+	xlog_open(argv[0]);
+	xlog_stderr(1);
+	make_statedir();
+
+	check("files");
+	bench_run("files_monitor", bench_monitor, NULL);
+	bench_run("files_load", bench_load, NULL);
+	check("files");
+
+	if (!nsm_log_convert())
+		bench_fail("unable to convert the records to the log");
+	check("log");
+	bench_run("log_monitor", bench_monitor, NULL);
+	bench_run("log_load", bench_load, NULL);
+	check("log");
+
+	nftw(statedir, remove_entry, 8, FTW_DEPTH | FTW_PHYS);
+	return bench_done();
+}
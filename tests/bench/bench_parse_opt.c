@@ -0,0 +1,160 @@
+/*
+ * bench_parse_opt.c -- the mount option helpers in parse_opt.c
+ *
+ * Works on an option string like the one mount.nfs builds for the
+ * kernel, doing what nfsmount_string() and its helpers do with it.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "nfslib.h"
+#include "parse_opt.h"
+#include "bench.h"
+
+#define OPTIONS		"rw,hard,vers=4.2,proto=tcp,port=0,timeo=600," \
+			"retrans=2,sec=sys,rsize=1048576,wsize=1048576," \
+			"nconnect=4,local_lock=none,clientaddr=192.168.1.10," \
+			"addr=192.168.1.1"
+
+static const char *vers_keys[] = { "nfsvers", "vers", "v2", "v3", NULL };
+
+static void
+bench_split(void *UNUSED(arg), unsigned long n)
+{
+	char opts[] = OPTIONS;
+
+	while (n--)
+		po_destroy(po_split(opts));
+}
+
+static void
+bench_join(void *arg, unsigned long n)
+{
+	struct mount_options *options = arg;
+	unsigned long len = 0;
+	char *str;
+
+	while (n--) {
+		str = NULL;
+		if (po_join(options, &str) == PO_SUCCEEDED)
+			len += strlen(str);
+		free(str);
+	}
+	bench_sink = len;
+}
+
+static void
+bench_get(void *arg, unsigned long n)
+{
+	struct mount_options *options = arg;
+	unsigned long found = 0;
+
+	while (n--)
+		found += po_get(options, "clientaddr") != NULL;
+	bench_sink = found;
+}
+
+static void
+bench_get_numeric(void *arg, unsigned long n)
+{
+	struct mount_options *options = arg;
+	unsigned long total = 0;
+	long value;
+
+	while (n--)
+		if (po_get_numeric(options, "wsize", &value) == PO_FOUND)
+			total += value;
+	bench_sink = total;
+}
+
+static void
+bench_contains_missing(void *arg, unsigned long n)
+{
+	struct mount_options *options = arg;
+	unsigned long found = 0;
+
+	while (n--)
+		found += po_contains(options, "mountport");
+	bench_sink = found;
+}
+
+static void
+bench_rightmost(void *arg, unsigned long n)
+{
+	struct mount_options *options = arg;
+	unsigned long total = 0;
+
+	while (n--)
+		total += po_rightmost(options, vers_keys);
+	bench_sink = total;
+}
+
+/* What mount.nfs does to the options when it falls back to vers=4.1 */
+static void
+bench_replace_vers(void *arg, unsigned long n)
+{
+	struct mount_options *options;
+
+	while (n--) {
+		options = po_dup(arg);
+		po_remove_all(options, "vers");
+		po_append(options, "vers=4.1");
+		po_destroy(options);
+	}
+}
+
+static void
+check(struct mount_options *options)
+{
+	char *str = NULL, *value;
+	long wsize;
+
+	if (po_join(options, &str) != PO_SUCCEEDED ||
+	    strcmp(str, OPTIONS) != 0)
+		bench_fail("options came back as %s", str ? str : "nothing");
+	free(str);
+	value = po_get(options, "clientaddr");
+	if (value == NULL || strcmp(value, "192.168.1.10") != 0)
+		bench_fail("clientaddr is %s", value ? value : "unset");
+	if (po_get_numeric(options, "wsize", &wsize) != PO_FOUND ||
+	    wsize != 1048576)
+		bench_fail("wsize is wrong");
+	if (po_contains(options, "mountport") != PO_NOT_FOUND)
+		bench_fail("mountport is set");
+	if (po_rightmost(options, vers_keys) != 1)
+		bench_fail("vers isn't the rightmost version option");
+}
+
+int
+main(int argc, char **argv)
+{
+	char opts[] = OPTIONS;
+	struct mount_options *options;
+
+	bench_init("parse_opt", argc, argv);
+	options = po_split(opts);
+	if (options == NULL)
+		return 1;
+	check(options);
+
+	bench_run("split", bench_split, NULL);
+	bench_run("join", bench_join, options);
+	bench_run("get", bench_get, options);
+	bench_run("get_numeric", bench_get_numeric, options);
+	bench_run("contains_missing", bench_contains_missing, options);
+	bench_run("rightmost", bench_rightmost, options);
+	bench_run("replace_vers", bench_replace_vers, options);
+	po_destroy(options);
+	return bench_done();
+}
@@ -0,0 +1,557 @@
+/*
+ * cld_bench.c -- measure nfsdcld through a simulated server reboot
+ *
+ * Runs nfsdcld against a scratch rpc_pipefs directory whose nfsd/cld
+ * pipe is the slave side of a pseudo-terminal, and plays the kernel's
+ * part of the upcall protocol on the master side.  The first boot
+ * starts a grace period, creates a record for each of @clients
+ * clients and ends the grace period.  nfsdcld is then restarted, and
+ * the second boot starts a grace period, receives the records, checks
+ * and creates every client again as they reclaim, and ends the grace
+ * period.  Up to -w upcalls are outstanding at once, as when nfsd's
+ * threads make them.
+ *
+ * For each phase the report gives calls a second, latency percentiles
+ * and the cache flushes completed by the disk holding the storage
+ * directory, as counted in /proc/diskstats; and the time from the
+ * second boot's Cld_GraceStart to the end of its grace period.  If
+ * nfsdcld is set up in nfs.conf to write a stats-file, give its name
+ * with -S to have the commits it counted reported too.
+ *
+ * usage: cld_bench [-n nfsdcld] [-s storagedir] [-S stats-file]
+ *		    [-v upcall-version] [-w window] clients
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/wait.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cld.h"
+#include "nfslib.h"
+
+#define CLD_BENCH_WINDOW	32	/* default upcalls outstanding */
+#define CLD_BENCH_MAXWINDOW	1024
+#define CLD_BENCH_GIVEUP	30.0	/* seconds without progress */
+#define CLD_BENCH_INBUF		(4 * sizeof(struct cld_msg_reclist))
+
+struct bench_phase {
+	const char	*name;
+	unsigned int	calls;
+	unsigned int	failed;
+	unsigned int	records;	/* sent with Cld_GraceStart */
+	double		elapsed;
+	long long	flushes;
+	double		*latency;	/* per call, in seconds */
+};
+
+static const char *nfsdcld = "/usr/sbin/nfsdcld";
+static char scratch[] = "/tmp/cld_bench.XXXXXX";
+static char pipefs[PATH_MAX / 2], storagedir[PATH_MAX];
+static unsigned int window = CLD_BENCH_WINDOW;
+static uint8_t upcall_version = 2;
+static pid_t daemon_pid = -1;
+static int master = -1, slave = -1;
+static uint32_t next_xid = 1;
+
+static unsigned char inbuf[CLD_BENCH_INBUF];
+static size_t inlen;
+
+static double
+bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Cache flushes completed by the disk holding the storage directory,
+ * or -1 if they are not counted.
+ */
+static long long
+bench_flushes(void)
+{
+	unsigned int major, minor, maj, min;
+	long long f[17], result = -1;
+	char line[512], name[64];
+	struct stat st;
+	FILE *fp;
+	int n;
+
+	if (stat(storagedir, &st) == -1)
+		return -1;
+	maj = major(st.st_dev);
+	min = minor(st.st_dev);
+
+	fp = fopen("/proc/diskstats", "r");
+	if (fp == NULL)
+		return -1;
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		n = sscanf(line, "%u %u %63s %lld %lld %lld %lld %lld %lld %lld"
+			   " %lld %lld %lld %lld %lld %lld %lld %lld %lld %lld",
+			   &major, &minor, name, &f[0], &f[1], &f[2], &f[3],
+			   &f[4], &f[5], &f[6], &f[7], &f[8], &f[9], &f[10],
+			   &f[11], &f[12], &f[13], &f[14], &f[15], &f[16]);
+		if (n < 19 || major != maj || minor != min)
+			continue;
+		result = f[15];
+		break;
+	}
+	(void)fclose(fp);
+	return result;
+}
+
+static void
+bench_client_name(unsigned int client, struct cld_name *name)
+{
+	int len;
+
+	len = snprintf((char *)name->cn_id, sizeof(name->cn_id),
+		       "cld_bench client %08u", client);
+	name->cn_len = (uint16_t)len;
+}
+
+/* Start nfsdcld, its log going to @log */
+static int
+bench_start(const char *log)
+{
+	int fd;
+
+	daemon_pid = fork();
+	if (daemon_pid == -1) {
+		perror("fork");
+		return -1;
+	}
+	if (daemon_pid == 0) {
+		fd = open(log, O_WRONLY | O_CREAT | O_APPEND, 0600);
+		if (fd != -1) {
+			(void)dup2(fd, STDERR_FILENO);
+			(void)close(fd);
+		}
+		execl(nfsdcld, nfsdcld, "-F", "-p", pipefs, "-s", storagedir,
+		      (char *)NULL);
+		perror(nfsdcld);
+		_exit(127);
+	}
+	return 0;
+}
+
+static int
+bench_stop(void)
+{
+	int status;
+
+	if (daemon_pid == -1)
+		return 0;
+	(void)kill(daemon_pid, SIGTERM);
+	if (waitpid(daemon_pid, &status, 0) == -1)
+		return -1;
+	daemon_pid = -1;
+	if (WIFEXITED(status) && WEXITSTATUS(status) == 127)
+		return -1;
+	return 0;
+}
+
+/*
+ * Set up the scratch pipefs directory, with a pseudo-terminal for the
+ * cld pipe.  The slave side stays open here, so that the pipe does not
+ * hang up while nfsdcld restarts.
+ */
+static int
+bench_setup_pipe(void)
+{
+	char path[PATH_MAX];
+	struct termios tio;
+	const char *pts;
+
+	master = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+	if (master == -1 || grantpt(master) == -1 || unlockpt(master) == -1) {
+		perror("posix_openpt");
+		return -1;
+	}
+	pts = ptsname(master);
+	if (pts == NULL) {
+		perror("ptsname");
+		return -1;
+	}
+	slave = open(pts, O_RDWR | O_NOCTTY | O_CLOEXEC);
+	if (slave == -1 || tcgetattr(slave, &tio) == -1) {
+		perror(pts);
+		return -1;
+	}
+	cfmakeraw(&tio);
+	if (tcsetattr(slave, TCSANOW, &tio) == -1) {
+		perror("tcsetattr");
+		return -1;
+	}
+	(void)fcntl(master, F_SETFL, fcntl(master, F_GETFL) | O_NONBLOCK);
+
+	snprintf(path, sizeof(path), "%s/nfsd", pipefs);
+	if (mkdir(pipefs, 0700) == -1 || mkdir(path, 0700) == -1) {
+		perror(path);
+		return -1;
+	}
+	snprintf(path, sizeof(path), "%s/nfsd/cld", pipefs);
+	if (symlink(pts, path) == -1) {
+		perror(path);
+		return -1;
+	}
+	return 0;
+}
+
+/* Returns the length of the downcall at the head of inbuf, or 0 */
+static size_t
+bench_downcall_len(void)
+{
+	struct cld_msg_hdr *hdr = (struct cld_msg_hdr *)inbuf;
+	struct cld_msg_reclist *rl = (struct cld_msg_reclist *)inbuf;
+	size_t len;
+
+	if (inlen < sizeof(*hdr))
+		return 0;
+	if (hdr->cm_vers >= 3 && hdr->cm_cmd == Cld_GraceStart &&
+	    hdr->cm_status == -EINPROGRESS) {
+		len = offsetof(struct cld_msg_reclist, cm_reclist.cr_data);
+		if (inlen < len)
+			return 0;
+		len += rl->cm_reclist.cr_len;
+	} else if (hdr->cm_vers == 1)
+		len = sizeof(struct cld_msg);
+	else
+		len = sizeof(struct cld_msg_v2);
+	return inlen < len ? 0 : len;
+}
+
+/*
+ * Make @n upcalls of @cmd, for clients 0 to @n - 1, with up to window
+ * of them outstanding, and time each from when it is written to its
+ * downcall.
+ */
+static int
+bench_calls(struct bench_phase *phase, uint8_t cmd, unsigned int n)
+{
+	struct cld_msg_v2 msg;
+	size_t msglen = 0, msgoff = 0, len;
+	unsigned int sent = 0, done = 0, i;
+	double *start, begin, progress, now;
+	uint32_t base = next_xid;
+	struct pollfd pfd;
+	ssize_t ret;
+
+	start = calloc(n, sizeof(*start));
+	phase->latency = calloc(n, sizeof(*phase->latency));
+	if (start == NULL || phase->latency == NULL) {
+		fprintf(stderr, "out of memory\n");
+		return -1;
+	}
+	next_xid += n;
+	phase->flushes = bench_flushes();
+	begin = progress = bench_now();
+
+	while (done < n) {
+		if (msglen == 0 && sent < n && sent - done < window) {
+			memset(&msg, 0, sizeof(msg));
+			msg.cm_vers = upcall_version;
+			msg.cm_cmd = cmd;
+			msg.cm_xid = base + sent;
+			if (cmd == Cld_GetVersion)
+				msg.cm_u.cm_version = upcall_version;
+			else if (cmd == Cld_Create || cmd == Cld_Check)
+				bench_client_name(sent,
+					&msg.cm_u.cm_clntinfo.cc_name);
+			msglen = upcall_version == 1 ?
+				sizeof(struct cld_msg) : sizeof(msg);
+			msgoff = 0;
+			start[sent++] = bench_now();
+		}
+
+		pfd.fd = master;
+		pfd.events = POLLIN | (msglen ? POLLOUT : 0);
+		if (poll(&pfd, 1, 1000) == -1 && errno != EINTR) {
+			perror("poll");
+			return -1;
+		}
+		now = bench_now();
+		if (now - progress > CLD_BENCH_GIVEUP) {
+			fprintf(stderr, "%s: no downcall for %.0f seconds, "
+				"%u of %u done\n", phase->name,
+				CLD_BENCH_GIVEUP, done, n);
+			return -1;
+		}
+
+		if (msglen && (pfd.revents & POLLOUT)) {
+			ret = write(master, (char *)&msg + msgoff,
+				    msglen - msgoff);
+			if (ret > 0) {
+				msgoff += (size_t)ret;
+				if (msgoff == msglen)
+					msglen = 0;
+			}
+		}
+		if (!(pfd.revents & POLLIN))
+			continue;
+		ret = read(master, inbuf + inlen, sizeof(inbuf) - inlen);
+		if (ret <= 0)
+			continue;
+		inlen += (size_t)ret;
+		progress = now;
+
+		while ((len = bench_downcall_len()) != 0) {
+			struct cld_msg_hdr *hdr = (struct cld_msg_hdr *)inbuf;
+			struct cld_msg_reclist *rl =
+				(struct cld_msg_reclist *)inbuf;
+
+			i = hdr->cm_xid - base;
+			if (hdr->cm_status == -EINPROGRESS) {
+				phase->records += hdr->cm_vers >= 3 ?
+					rl->cm_reclist.cr_count : 1;
+			} else if (i < sent && phase->latency[i] == 0) {
+				phase->latency[i] = now - start[i];
+				if (hdr->cm_status != 0)
+					phase->failed++;
+				done++;
+			}
+			memmove(inbuf, inbuf + len, inlen - len);
+			inlen -= len;
+		}
+	}
+
+	phase->calls = n;
+	phase->elapsed = bench_now() - begin;
+	if (phase->flushes != -1)
+		phase->flushes = bench_flushes() - phase->flushes;
+	free(start);
+	return 0;
+}
+
+static int
+bench_cmp(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void
+bench_report(struct bench_phase *phase)
+{
+	unsigned int n = phase->calls;
+	double *l = phase->latency;
+
+	printf("%-12s %u calls in %.3f s, %.0f calls/s",
+	       phase->name, n, phase->elapsed,
+	       phase->elapsed > 0 ? n / phase->elapsed : 0.0);
+	if (phase->flushes != -1)
+		printf(", %lld disk flushes", phase->flushes);
+	printf("\n");
+	if (n == 0)
+		return;
+
+	qsort(l, n, sizeof(*l), bench_cmp);
+	printf("%-12s latency ms: p50 %.3f  p90 %.3f  p99 %.3f  max %.3f\n",
+	       "", l[n / 2] * 1e3, l[n * 9 / 10] * 1e3,
+	       l[n * 99 / 100] * 1e3, l[n - 1] * 1e3);
+	if (phase->records)
+		printf("%-12s %u records sent\n", "", phase->records);
+	if (phase->failed)
+		printf("%-12s %u failed\n", "", phase->failed);
+	free(phase->latency);
+	phase->latency = NULL;
+}
+
+/* Report the commits in nfsdcld's statistics file, which it writes at exit */
+static void
+bench_report_stats(const char *stats)
+{
+	unsigned long calls, failed, usecs, max, a, b, c, d;
+	char line[1024];
+	FILE *fp;
+
+	fp = fopen(stats, "r");
+	if (fp == NULL) {
+		perror(stats);
+		return;
+	}
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if (sscanf(line, "commit %lu %lu %lu %lu",
+			   &calls, &failed, &usecs, &max) == 4 && calls)
+			printf("%-12s %lu commits, %lu failed, avg %.3f ms, "
+			       "max %.3f ms\n", "nfsdcld", calls, failed,
+			       usecs / 1e3 / calls, max / 1e3);
+		else if (sscanf(line, "groups %lu %lu %lu %lu",
+				&a, &b, &c, &d) == 4 && a)
+			printf("%-12s %.1f changes a commit, at most %lu; "
+			       "at most %lu upcalls queued\n", "",
+			       (double)b / a, c, d);
+	}
+	(void)fclose(fp);
+}
+
+static int
+bench_remove(const char *path, const struct stat *UNUSED(st),
+	     int UNUSED(type), struct FTW *UNUSED(ftw))
+{
+	(void)remove(path);
+	return 0;
+}
+
+static void
+usage(const char *progname)
+{
+	fprintf(stderr, "usage: %s [-n nfsdcld] [-s storagedir] "
+		"[-S stats-file] [-v upcall-version] [-w window] clients\n",
+		progname);
+	exit(1);
+}
+
+/*
+ * Boot nfsdcld and run a grace period, in which @clients clients
+ * reclaim if @reclaim.  Sets @grace to the time from Cld_GraceStart to
+ * the end of the grace period.
+ */
+static int
+bench_boot(struct bench_phase *phases, unsigned int clients, int reclaim,
+	   const char *log, double *grace)
+{
+	double start;
+
+	if (bench_start(log) == -1)
+		return -1;
+	if (bench_calls(&phases[0], Cld_GetVersion, 1) == -1)
+		return -1;
+	start = bench_now();
+	if (bench_calls(&phases[1], Cld_GraceStart, 1) == -1)
+		return -1;
+	if (reclaim && bench_calls(&phases[2], Cld_Check, clients) == -1)
+		return -1;
+	if (bench_calls(&phases[3], Cld_Create, clients) == -1)
+		return -1;
+	if (bench_calls(&phases[4], Cld_GraceDone, 1) == -1)
+		return -1;
+	*grace = bench_now() - start;
+	return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	struct bench_phase boot[5] = {
+		{ .name = "getversion" }, { .name = "gracestart" },
+		{ .name = "check" }, { .name = "create" },
+		{ .name = "gracedone" },
+	};
+	struct bench_phase reboot[5] = {
+		{ .name = "getversion" }, { .name = "gracestart" },
+		{ .name = "check" }, { .name = "create" },
+		{ .name = "gracedone" },
+	};
+	const char *stats = NULL;
+	char log[PATH_MAX];
+	unsigned int clients, i;
+	double grace;
+	int c, keep = 0, result = 1;
+
+	while ((c = getopt(argc, argv, "n:s:S:v:w:")) != -1) {
+		switch (c) {
+		case 'n':
+			nfsdcld = optarg;
+			break;
+		case 's':
+			snprintf(storagedir, sizeof(storagedir), "%s", optarg);
+			keep = 1;
+			break;
+		case 'S':
+			stats = optarg;
+			break;
+		case 'v':
+			upcall_version = (uint8_t)atoi(optarg);
+			break;
+		case 'w':
+			window = (unsigned int)atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1)
+		usage(argv[0]);
+	clients = (unsigned int)strtoul(argv[optind], NULL, 10);
+	if (clients == 0 || window == 0 || window > CLD_BENCH_MAXWINDOW ||
+	    upcall_version < 2 || upcall_version > CLD_UPCALL_VERSION)
+		usage(argv[0]);
+
+	if (mkdtemp(scratch) == NULL) {
+		perror("mkdtemp");
+		return 1;
+	}
+	snprintf(pipefs, sizeof(pipefs), "%s/pipefs", scratch);
+	snprintf(log, sizeof(log), "%s/nfsdcld.log", scratch);
+	if (!keep)
+		snprintf(storagedir, sizeof(storagedir), "%s/db", scratch);
+	if (bench_setup_pipe() == -1)
+		goto out;
+	signal(SIGPIPE, SIG_IGN);
+	setvbuf(stdout, NULL, _IOLBF, 0);
+
+	printf("%u clients, upcall version %u, window %u\n",
+	       clients, upcall_version, window);
+	if (bench_boot(boot, clients, 0, log, &grace) == -1)
+		goto out;
+	printf("first boot, grace period %.3f s:\n", grace);
+	for (i = 0; i < 5; i++)
+		if (i != 2)
+			bench_report(&boot[i]);
+	if (bench_stop() == -1)
+		goto out;
+	if (stats)
+		bench_report_stats(stats);
+
+	if (bench_boot(reboot, clients, 1, log, &grace) == -1)
+		goto out;
+	printf("after restart, grace period %.3f s:\n", grace);
+	for (i = 0; i < 5; i++)
+		bench_report(&reboot[i]);
+	if (reboot[1].records != clients)
+		printf("expected %u records, got %u\n", clients,
+		       reboot[1].records);
+	else if (reboot[2].failed == 0)
+		result = 0;
+	if (bench_stop() == -1)
+		result = 1;
+	if (stats)
+		bench_report_stats(stats);
+
+out:
+	if (result)
+		fprintf(stderr, "nfsdcld's log is in %s\n", log);
+	(void)bench_stop();
+	if (!result)
+		(void)nftw(scratch, bench_remove, 16, FTW_DEPTH | FTW_PHYS);
+	return result;
+}
@@ -0,0 +1,307 @@
+/*
+ * etab_update.c -- check that export changes made in place match a reload
+ *
+ * The export table is brought up to date with etab in place by
+ * xtab_export_update(), changed one export at a time by
+ * auth_export_change(), and changed from the exports files by
+ * exportd's watch code.  Starting from the same etab, and making the
+ * same change each way (one export added, one changed, one removed),
+ * each must leave the exports that throwing the table away and
+ * reading the new etab would.
+ *
+ * watch.c is built in here, with control_export() and
+ * control_unexport() applying the changes directly, so that its diff
+ * of an exports file can be run without inotify.
+ *
+ * usage: etab_update [directory]
+ *
+ * The etab and exports files are written to @directory, by default
+ * a new one under /tmp that is removed afterwards.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+
+#include "nfslib.h"
+#include "exportfs.h"
+#include "export.h"
+#include "xlog.h"
+
+int use_ipaddr = -1;
+int manage_gids = 1;
+
+#include "watch.c"
+
+int
+control_export(struct exportent *eep)
+{
+	return auth_export_set(eep);
+}
+
+int
+control_unexport(char *client, char *path)
+{
+	return auth_export_change(client, path, NULL);
+}
+
+int
+control_writer_start(void)
+{
+	return 0;
+}
+
+/* etab before and after the change */
+static const char etab1[] =
+	"/export/a\t*(ro,root_squash,no_subtree_check)\n"
+	"/export/b\t192.168.0.0/24(rw,no_root_squash,no_subtree_check)\n"
+	"/export/c\t*.example.com(ro,no_subtree_check)\n";
+static const char etab2[] =
+	"/export/a\t*(ro,root_squash,no_subtree_check)\n"
+	"/export/b\t192.168.0.0/24(ro,no_root_squash,no_subtree_check)\n"
+	"/export/d\t10.0.0.0/8(rw,sync,no_subtree_check)\n";
+
+static char dir[PATH_MAX];
+static int errors;
+
+static void
+fail(const char *what, const char *fmt, ...)
+{
+	va_list ap;
+
+	fprintf(stderr, "%s: ", what);
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fputc('\n', stderr);
+	errors++;
+}
+
+/* Replace @fname in @dir, so that it gets a new inode as exportfs's would */
+static void
+write_file(const char *fname, const char *text)
+{
+	char path[PATH_MAX], tmp[PATH_MAX];
+	FILE *fp;
+
+	if (snprintf(path, sizeof(path), "%s/%s", dir,
+		     fname) >= (int)sizeof(path) ||
+	    snprintf(tmp, sizeof(tmp), "%s.new", path) >= (int)sizeof(tmp)) {
+		fprintf(stderr, "%s: name too long\n", dir);
+		exit(1);
+	}
+	fp = fopen(tmp, "w");
+	if (fp == NULL || fputs(text, fp) == EOF || fclose(fp) == EOF ||
+	    rename(tmp, path) < 0) {
+		perror(path);
+		exit(1);
+	}
+}
+
+static int
+ent_cmp(const void *a, const void *b)
+{
+	const struct exportent *x = a, *y = b;
+	int c;
+
+	c = strcmp(x->e_path, y->e_path);
+	if (c == 0)
+		c = strcmp(x->e_hostname, y->e_hostname);
+	return c;
+}
+
+/* The etab exports in the table, as etab would list them, sorted */
+static int
+table_entries(struct exportent **list)
+{
+	int n;
+
+	n = xtab_export_preview(list);
+	if (n < 0) {
+		fprintf(stderr, "can't lock %s\n", etab.lockfn);
+		exit(1);
+	}
+	qsort(*list, n, sizeof(**list), ent_cmp);
+	return n;
+}
+
+/* The etab exports that reading etab afresh gives */
+static int
+reload_entries(struct exportent **list)
+{
+	export_freeall();
+	xtab_export_read();
+	return table_entries(list);
+}
+
+static void
+compare(const char *what, struct exportent *got, int ngot,
+	struct exportent *want, int nwant)
+{
+	int i;
+
+	if (ngot != nwant) {
+		fail(what, "%d exports, a reload gives %d", ngot, nwant);
+		return;
+	}
+	for (i = 0; i < ngot; i++) {
+		if (ent_cmp(&got[i], &want[i]) != 0)
+			fail(what, "%s:%s, a reload gives %s:%s",
+			     got[i].e_hostname, got[i].e_path,
+			     want[i].e_hostname, want[i].e_path);
+		else if (cmpexportent(&got[i], &want[i]) != 0)
+			fail(what, "%s:%s has other options than on a reload",
+			     got[i].e_hostname, got[i].e_path);
+	}
+}
+
+/* The etab export of @path, or NULL */
+static nfs_export *
+find_export(const char *path)
+{
+	nfs_export *exp;
+	int i;
+
+	for (i = 0; i < MCL_MAXTYPES; i++)
+		for (exp = exportlist[i].p_head; exp; exp = exp->m_next)
+			if (exp->m_xtabent &&
+			    strcmp(exp->m_export.e_path, path) == 0)
+				return exp;
+	return NULL;
+}
+
+/* Check the table against a reload of etab2, and free both */
+static void
+check_table(const char *what)
+{
+	struct exportent *got, *want;
+	int ngot, nwant;
+
+	ngot = table_entries(&got);
+	write_file("etab", etab2);
+	nwant = reload_entries(&want);
+	compare(what, got, ngot, want, nwant);
+	xtab_snapshot_free(got, ngot);
+	xtab_snapshot_free(want, nwant);
+}
+
+static void
+test_xtab_update(void)
+{
+	const char *what = "xtab_export_update";
+	nfs_export *kept;
+	int changes;
+
+	write_file("etab", etab1);
+	export_freeall();
+	xtab_export_read();
+	kept = find_export("/export/a");
+
+	write_file("etab", etab2);
+	changes = xtab_export_update();
+	if (changes != 3)
+		fail(what, "%d changes, expected 3", changes);
+	if (kept == NULL || find_export("/export/a") != kept)
+		fail(what, "unchanged export /export/a was replaced");
+	check_table(what);
+}
+
+static void
+test_auth_change(void)
+{
+	const char *what = "auth_export_change";
+	int err;
+
+	write_file("etab", etab1);
+	auth_reload();
+
+	err = auth_export_change("192.168.0.0/24", "/export/b",
+				 "ro,no_root_squash,no_subtree_check");
+	if (err)
+		fail(what, "changing /export/b: %s", strerror(-err));
+	err = auth_export_change("10.0.0.0/8", "/export/d",
+				 "rw,sync,no_subtree_check");
+	if (err)
+		fail(what, "adding /export/d: %s", strerror(-err));
+	err = auth_export_change("*.example.com", "/export/c", NULL);
+	if (err)
+		fail(what, "removing /export/c: %s", strerror(-err));
+	err = auth_export_change("*.example.com", "/export/c", NULL);
+	if (err != -ENOENT)
+		fail(what, "removing /export/c again gave %d", err);
+	check_table(what);
+}
+
+static void
+test_watch_update(void)
+{
+	const char *what = "watch_update";
+	struct watch_file *f;
+	char path[PATH_MAX];
+
+	write_file("etab", etab1);
+	auth_reload();
+
+	/* as watch_start() takes in the file */
+	write_file("exports", etab1);
+	snprintf(path, sizeof(path), "%s/exports", dir);
+	f = watch_file_get(path);
+	f->f_count = watch_read(f->f_name, &f->f_ents);
+
+	write_file("exports", etab2);
+	watch_update(f);
+	check_table(what);
+}
+
+int
+main(int argc, char **argv)
+{
+	char path[PATH_MAX];
+	int tmpdir = argc < 2;
+
+	xlog_open(argv[0]);
+	xlog_stderr(1);
+
+	if (tmpdir) {
+		strcpy(dir, "/tmp/etab_update.XXXXXX");
+		if (mkdtemp(dir) == NULL) {
+			perror("mkdtemp");
+			return 1;
+		}
+	} else
+		snprintf(dir, sizeof(dir), "%s", argv[1]);
+	snprintf(path, sizeof(path), "%s/etab", dir);
+	etab.statefn = strdup(path);
+	snprintf(path, sizeof(path), "%s/etab.tmp", dir);
+	etab.tmpfn = strdup(path);
+	snprintf(path, sizeof(path), "%s/etab.lock", dir);
+	etab.lockfn = strdup(path);
+
+	test_xtab_update();
+	test_auth_change();
+	test_watch_update();
+
+	if (tmpdir) {
+		unlink(etab.statefn);
+		unlink(etab.lockfn);
+		snprintf(path, sizeof(path), "%s/exports", dir);
+		unlink(path);
+		rmdir(dir);
+	}
+	if (errors)
+		printf("%d failures\n", errors);
+	return errors != 0;
+}
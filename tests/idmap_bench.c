@@ -0,0 +1,264 @@
+/*
+ * idmap_bench.c -- time rpc.idmapd's handling of nfsd upcalls
+ *
+ * Builds a set of nfsd idmap upcalls, "authname user|group name" and
+ * "authname user|group id" with some escaped names among them, and
+ * repeatedly decodes each one and encodes the reply the way nfsdcb()
+ * and nfsdreply() do: with a copy of the original getfield() and
+ * addfield(), which copy every field into buffers of their own, and
+ * with the cache channel codec working in the read buffer.  The two
+ * replies must agree.
+ *
+ * usage: idmap_bench [iterations]
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <time.h>
+
+#include "nfslib.h"
+
+#define IDMAP_MAXMSGSZ	256	/* IDMAP_NAMESZ + 128, as in nfs_idmap.h */
+#define NREQS		1024
+#define EXPIRY		1700000000
+
+static int ref_addfield(char **bpp, ssize_t *bsizp, char *fld)
+{
+	char ch, *bp = *bpp;
+	ssize_t bsiz = *bsizp;
+
+	while ((ch = *fld++) != '\0' && bsiz > 0) {
+		switch(ch) {
+		case ' ':
+		case '\t':
+		case '\n':
+		case '\\':
+			if (bsiz >= 4) {
+				bp += snprintf(bp, bsiz, "\\%03o", ch);
+				bsiz -= 4;
+			}
+			break;
+		default:
+			*bp++ = ch;
+			bsiz--;
+			break;
+		}
+	}
+
+	if (bsiz < 1 || ch != '\0')
+		return (-1);
+
+	*bp++ = ' ';
+	bsiz--;
+
+	*bpp = bp;
+	*bsizp = bsiz;
+
+	return (0);
+}
+
+static int ref_getfield(char **bpp, char *fld, size_t fldsz)
+{
+	char *bp;
+	unsigned int val;
+	int n;
+
+	while ((bp = strsep(bpp, " ")) != NULL && bp[0] == '\0')
+		;
+
+	if (bp == NULL || bp[0] == '\0' || bp[0] == '\n')
+		return (-1);
+
+	while (*bp != '\0' && fldsz > 1) {
+		if (*bp == '\\') {
+			if ((n = sscanf(bp, "\\%03o", &val)) != 1)
+				return (-1);
+			if (val > UCHAR_MAX)
+				return (-1);
+			*fld++ = val;
+			bp += 4;
+		} else {
+			*fld++ = *bp;
+			bp++;
+		}
+		fldsz--;
+	}
+
+	if (*bp != '\0')
+		return (-1);
+	*fld = '\0';
+
+	return (0);
+}
+
+/*
+ * Answer @req on the name-to-id channel if @nameid, else on the
+ * id-to-name one, mapping every name to id 1000 and every id to
+ * "nobody@example.com".  Returns the length of the reply in @out,
+ * or -1.
+ */
+static int
+ref_handle(int nameid, const char *req, char *out)
+{
+	char buf[IDMAP_MAXMSGSZ + 1], *bp = buf;
+	char authbuf[IDMAP_MAXMSGSZ], typebuf[IDMAP_MAXMSGSZ];
+	char name[IDMAP_MAXMSGSZ], buf1[IDMAP_MAXMSGSZ];
+	ssize_t bsiz = IDMAP_MAXMSGSZ + 1;
+	unsigned long id = 1000;
+
+	strcpy(buf, req);
+	if (ref_getfield(&bp, authbuf, sizeof(authbuf)) == -1 ||
+	    ref_getfield(&bp, typebuf, sizeof(typebuf)) == -1)
+		return -1;
+	if (nameid) {
+		if (ref_getfield(&bp, name, sizeof(name)) == -1)
+			return -1;
+	} else {
+		if (ref_getfield(&bp, buf1, sizeof(buf1)) == -1)
+			return -1;
+		id = strtoul(buf1, NULL, 10);
+		strcpy(name, "nobody@example.com");
+	}
+
+	bp = out;
+	ref_addfield(&bp, &bsiz, authbuf);
+	ref_addfield(&bp, &bsiz, strcmp(typebuf, "user") == 0 ?
+		     "user" : "group");
+	if (nameid) {
+		ref_addfield(&bp, &bsiz, name);
+		snprintf(buf1, sizeof(buf1), "%" PRId64, (int64_t)EXPIRY);
+		ref_addfield(&bp, &bsiz, buf1);
+		snprintf(buf1, sizeof(buf1), "%lu", id);
+		ref_addfield(&bp, &bsiz, buf1);
+	} else {
+		snprintf(buf1, sizeof(buf1), "%lu", id);
+		ref_addfield(&bp, &bsiz, buf1);
+		snprintf(buf1, sizeof(buf1), "%" PRId64, (int64_t)EXPIRY);
+		ref_addfield(&bp, &bsiz, buf1);
+		ref_addfield(&bp, &bsiz, name);
+	}
+	bp[-1] = '\n';
+	return bp - out;
+}
+
+static int
+new_handle(int nameid, const char *req, char *out)
+{
+	char buf[IDMAP_MAXMSGSZ + 1], *bp = buf;
+	char *authbuf, *typebuf, *field;
+	char name[IDMAP_MAXMSGSZ];
+	int blen = IDMAP_MAXMSGSZ + 1, flen;
+	unsigned long id = 1000;
+
+	strcpy(buf, req);
+	if (qword_get_inplace(&bp, &authbuf) <= 0 ||
+	    qword_get_inplace(&bp, &typebuf) <= 0)
+		return -1;
+	flen = qword_get_inplace(&bp, &field);
+	if (flen <= 0 || flen >= (int)sizeof(name))
+		return -1;
+	if (nameid)
+		memcpy(name, field, flen + 1);
+	else {
+		id = strtoul(field, NULL, 10);
+		strcpy(name, "nobody@example.com");
+	}
+
+	bp = out;
+	qword_add(&bp, &blen, authbuf);
+	qword_add(&bp, &blen, strcmp(typebuf, "user") == 0 ?
+		  "user" : "group");
+	if (nameid) {
+		qword_add(&bp, &blen, name);
+		qword_adduint64(&bp, &blen, EXPIRY);
+		qword_adduint64(&bp, &blen, id);
+	} else {
+		qword_adduint64(&bp, &blen, id);
+		qword_adduint64(&bp, &blen, EXPIRY);
+		qword_add(&bp, &blen, name);
+	}
+	if (blen < 0)
+		return -1;
+	bp[-1] = '\n';
+	return bp - out;
+}
+
+typedef int (*handler)(int nameid, const char *req, char *out);
+
+static double
+run(handler h, char **reqs, int iters)
+{
+	char out[IDMAP_MAXMSGSZ + 1];
+	struct timespec start, now;
+	int i, n;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (n = 0; n < iters; n++)
+		for (i = 0; i < NREQS; i++)
+			h(i & 1, reqs[i], out);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start.tv_sec) +
+		(now.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+int
+main(int argc, char **argv)
+{
+	int iters = argc > 1 ? atoi(argv[1]) : 2000;
+	char *reqs[NREQS], req[IDMAP_MAXMSGSZ + 1];
+	char a[IDMAP_MAXMSGSZ + 1], b[IDMAP_MAXMSGSZ + 1];
+	int i, alen, blen, errors = 0;
+	double tref, tnew;
+
+	/* Even requests go to the name-to-id channel, odd ones the other */
+	for (i = 0; i < NREQS; i++) {
+		const char *type = i & 2 ? "group" : "user";
+
+		if (i & 1)
+			snprintf(req, sizeof(req), "* %s %u",
+				 type, 1000 + i * 37);
+		else if (i % 16 == 0)
+			snprintf(req, sizeof(req),
+				 "* %s first\\040last%d@ad.example.com", type, i);
+		else
+			snprintf(req, sizeof(req), "* %s user%d@example.com",
+				 type, i);
+		reqs[i] = strdup(req);
+		if (reqs[i] == NULL)
+			return 1;
+	}
+
+	for (i = 0; i < NREQS; i++) {
+		alen = ref_handle(i & 1, reqs[i], a);
+		blen = new_handle(i & 1, reqs[i], b);
+		if (alen != blen || (alen > 0 && memcmp(a, b, alen) != 0)) {
+			fprintf(stderr, "mismatch on '%s'\n", reqs[i]);
+			errors++;
+		}
+	}
+
+	tref = run(ref_handle, reqs, iters);
+	tnew = run(new_handle, reqs, iters);
+
+	printf("%d upcalls, %d iterations\n", NREQS, iters);
+	printf("getfield: %.3f s (%.0f ns/upcall)\n",
+	       tref, tref * 1e9 / ((double)NREQS * iters));
+	printf("in place: %.3f s (%.0f ns/upcall)\n",
+	       tnew, tnew * 1e9 / ((double)NREQS * iters));
+	if (errors)
+		printf("%d mismatches\n", errors);
+	return errors != 0;
+}
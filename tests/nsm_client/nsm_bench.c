@@ -0,0 +1,656 @@
+/*
+ * nsm_bench.c -- measure statd and sm-notify with many simulated peers
+ *
+ * Sends SM_MON for @peers peers to the local statd over UDP, at up to
+ * @rate calls a second with NSM_BENCH_WINDOW of them outstanding, and
+ * times each call from its first transmission to its reply.  The
+ * peers are named by presentation addresses on the loopback network,
+ * 127.a.b.c, so that statd and sm-notify need no name service.
+ *
+ * With -s, the statd port of every peer is then recorded as that of a
+ * UDP responder stub in this program, and "sm-notify -f -n -d" is run
+ * against the same state directory (-P); the stub answers each
+ * SM_NOTIFY from the address it was sent to, and the time until every
+ * peer has been notified is reported.  Last, SM_UNMON is sent for
+ * every peer the same way as SM_MON was.
+ *
+ * For each phase the report gives calls a second, reply latency
+ * percentiles, and the cache flushes completed by the disk holding
+ * the state directory, as counted in /proc/diskstats, which is close
+ * to the number of fsyncs that reached it.
+ *
+ * usage: nsm_bench [-p statd-port] [-r rate] [-P state-dir]
+ *		    [-s sm-notify [-R notify-rate]] peers
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/wait.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <rpc/rpc.h>
+
+#include "nfsrpc.h"
+#include "nsm.h"
+#include "sm_inter.h"
+
+#define NSM_BENCH_WINDOW	64	/* calls outstanding at once */
+#define NSM_BENCH_RETRANS	1.0	/* seconds before a call is resent */
+#define NSM_BENCH_MAXPEERS	(253u << 16)
+#define NSM_BENCH_GIVEUP	30.0	/* seconds without progress */
+#define NSM_BENCH_EXITWAIT	5.0	/* seconds for sm-notify to finish */
+#define NSM_BENCH_RCVBUF	(8 << 20)	/* so a burst is not dropped */
+
+struct bench_call {
+	unsigned int	peer;
+	double		first;		/* sent first */
+	double		last;		/* sent last */
+};
+
+struct bench_phase {
+	const char	*name;
+	unsigned int	calls;
+	unsigned int	failed;
+	unsigned int	resent;
+	double		elapsed;
+	long long	flushes;
+	double		*latency;	/* per call, in seconds */
+};
+
+static const char *state_dir = "/var/lib/nfs";
+static char my_name[] = "nsm_bench";
+
+static double
+bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+bench_peer_name(unsigned int peer, char *buf, size_t len)
+{
+	snprintf(buf, len, "127.%u.%u.%u", ((peer >> 16) & 0xff) + 1,
+		 (peer >> 8) & 0xff, peer & 0xff);
+}
+
+/*
+ * Returns the index of the peer at @addr, or -1 if it is none of ours.
+ */
+static long
+bench_peer_index(const struct in_addr *addr, unsigned int peers)
+{
+	uint32_t a = ntohl(addr->s_addr);
+	unsigned long peer;
+
+	if ((a >> 24) != 127 || ((a >> 16) & 0xff) == 0)
+		return -1;
+	peer = (((a >> 16) & 0xff) - 1) << 16 | (a & 0xffff);
+	return peer < peers ? (long)peer : -1;
+}
+
+/*
+ * Cache flushes completed by the disk holding the state directory,
+ * or -1 if they are not counted.
+ */
+static long long
+bench_flushes(void)
+{
+	unsigned int major, minor, maj, min;
+	long long f[17], result = -1;
+	char line[512], name[64];
+	struct stat st;
+	FILE *fp;
+	int n;
+
+	if (stat(state_dir, &st) == -1)
+		return -1;
+	maj = major(st.st_dev);
+	min = minor(st.st_dev);
+
+	fp = fopen("/proc/diskstats", "r");
+	if (fp == NULL)
+		return -1;
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		n = sscanf(line, "%u %u %63s %lld %lld %lld %lld %lld %lld %lld"
+			   " %lld %lld %lld %lld %lld %lld %lld %lld %lld %lld",
+			   &major, &minor, name, &f[0], &f[1], &f[2], &f[3],
+			   &f[4], &f[5], &f[6], &f[7], &f[8], &f[9], &f[10],
+			   &f[11], &f[12], &f[13], &f[14], &f[15], &f[16]);
+		if (n < 19 || major != maj || minor != min)
+			continue;
+		result = f[15];
+		break;
+	}
+	(void)fclose(fp);
+	return result;
+}
+
+static size_t
+bench_encode_call(char *buf, size_t len, uint32_t xid, rpcproc_t proc,
+		unsigned int peer)
+{
+	char name[INET_ADDRSTRLEN];
+	struct rpc_msg msg;
+	size_t result = 0;
+	mon_id id;
+	mon mon;
+	XDR xdr;
+
+	bench_peer_name(peer, name, sizeof(name));
+	memset(&mon, 0, sizeof(mon));
+	mon.mon_id.mon_name = name;
+	mon.mon_id.my_id.my_name = my_name;
+	mon.mon_id.my_id.my_prog = 100021;
+	mon.mon_id.my_id.my_vers = 4;
+	mon.mon_id.my_id.my_proc = 16;
+	memcpy(mon.priv, &peer, sizeof(peer));
+	id = mon.mon_id;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.rm_xid = xid;
+	msg.rm_direction = CALL;
+	msg.rm_call.cb_rpcvers = RPC_MSG_VERSION;
+	msg.rm_call.cb_prog = SM_PROG;
+	msg.rm_call.cb_vers = SM_VERS;
+	msg.rm_call.cb_proc = proc;
+	msg.rm_call.cb_cred = _null_auth;
+	msg.rm_call.cb_verf = _null_auth;
+
+	xdrmem_create(&xdr, buf, (unsigned int)len, XDR_ENCODE);
+	if (xdr_callmsg(&xdr, &msg) &&
+	    (proc == SM_MON ? xdr_mon(&xdr, &mon) : xdr_mon_id(&xdr, &id)))
+		result = (size_t)xdr_getpos(&xdr);
+	xdr_destroy(&xdr);
+	return result;
+}
+
+/*
+ * Returns the XID of the reply in @buf, or zero if it is garbled.
+ * @ok is cleared if the call failed.
+ */
+static uint32_t
+bench_decode_reply(char *buf, size_t len, rpcproc_t proc, _Bool *ok)
+{
+	struct rpc_msg msg;
+	sm_stat_res res;
+	sm_stat stat;
+	uint32_t xid;
+	XDR xdr;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.acpted_rply.ar_verf = _null_auth;
+	if (proc == SM_MON) {
+		msg.acpted_rply.ar_results.where = (caddr_t)&res;
+		msg.acpted_rply.ar_results.proc = (xdrproc_t)xdr_sm_stat_res;
+	} else {
+		msg.acpted_rply.ar_results.where = (caddr_t)&stat;
+		msg.acpted_rply.ar_results.proc = (xdrproc_t)xdr_sm_stat;
+	}
+
+	xdrmem_create(&xdr, buf, (unsigned int)len, XDR_DECODE);
+	if (!xdr_replymsg(&xdr, &msg)) {
+		xdr_destroy(&xdr);
+		return 0;
+	}
+	xdr_destroy(&xdr);
+	xid = msg.rm_xid;
+
+	*ok = msg.rm_reply.rp_stat == MSG_ACCEPTED &&
+		msg.acpted_rply.ar_stat == SUCCESS &&
+		(proc != SM_MON || res.res_stat == stat_succ);
+	return xid;
+}
+
+/*
+ * Send @proc for every peer to statd at @sap, and wait for the replies.
+ */
+static int
+bench_calls(int sock, const struct sockaddr_in *sap, rpcproc_t proc,
+		unsigned int peers, unsigned int rate,
+		struct bench_phase *phase)
+{
+	struct bench_call window[NSM_BENCH_WINDOW];
+	unsigned int next = 0, done = 0, inflight = 0, i;
+	uint32_t xid_base = (uint32_t)random() << 8 & 0x7fffff00u;
+	char buf[NSM_MAXMSGSIZE];
+	double start, now, progress;
+	long long flushes;
+	struct pollfd pfd;
+	ssize_t n;
+	size_t len;
+
+	phase->calls = peers;
+	phase->failed = phase->resent = 0;
+	phase->latency = calloc(peers ? peers : 1, sizeof(double));
+	if (phase->latency == NULL)
+		return -1;
+
+	flushes = bench_flushes();
+	start = progress = bench_now();
+	while (done < peers) {
+		int timeout = -1;
+
+		now = bench_now();
+		if (now - progress > NSM_BENCH_GIVEUP) {
+			fprintf(stderr, "%s: statd stopped answering after "
+				"%u calls\n", phase->name, done);
+			return -1;
+		}
+		while (next < peers && inflight < NSM_BENCH_WINDOW &&
+		       (rate == 0 || next < rate * (now - start) + 1)) {
+			len = bench_encode_call(buf, sizeof(buf),
+					xid_base + next, proc, next);
+			if (len == 0 || sendto(sock, buf, len, 0,
+					(const struct sockaddr *)sap,
+					sizeof(*sap)) == -1) {
+				perror("sendto");
+				return -1;
+			}
+			window[inflight].peer = next;
+			window[inflight].first = now;
+			window[inflight].last = now;
+			inflight++;
+			next++;
+		}
+		if (next < peers && inflight < NSM_BENCH_WINDOW && rate)
+			timeout = (int)((next / (double)rate -
+					(now - start)) * 1000) + 1;
+
+		for (i = 0; i < inflight; i++) {
+			struct bench_call *call = &window[i];
+			int t;
+
+			if (now - call->last >= NSM_BENCH_RETRANS) {
+				len = bench_encode_call(buf, sizeof(buf),
+						xid_base + call->peer, proc,
+						call->peer);
+				(void)sendto(sock, buf, len, 0,
+						(const struct sockaddr *)sap,
+						sizeof(*sap));
+				call->last = now;
+				phase->resent++;
+			}
+			t = (int)((call->last + NSM_BENCH_RETRANS - now) *
+					1000) + 1;
+			if (timeout == -1 || t < timeout)
+				timeout = t;
+		}
+
+		pfd.fd = sock;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, timeout) <= 0)
+			continue;
+
+		while ((n = recv(sock, buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+			_Bool ok = false;
+			uint32_t xid;
+
+			xid = bench_decode_reply(buf, (size_t)n, proc, &ok);
+			for (i = 0; i < inflight; i++)
+				if (xid_base + window[i].peer == xid)
+					break;
+			if (i == inflight)
+				continue;
+
+			now = progress = bench_now();
+			phase->latency[done++] = now - window[i].first;
+			if (!ok)
+				phase->failed++;
+			window[i] = window[--inflight];
+		}
+	}
+	phase->elapsed = bench_now() - start;
+	phase->flushes = flushes;
+	if (flushes != -1)
+		phase->flushes = bench_flushes() - flushes;
+	return 0;
+}
+
+static int
+bench_cmp(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void
+bench_report(struct bench_phase *phase)
+{
+	unsigned int n = phase->calls;
+	double *l = phase->latency;
+
+	printf("%-9s %u calls in %.3f s, %.0f calls/s",
+	       phase->name, n, phase->elapsed,
+	       phase->elapsed > 0 ? n / phase->elapsed : 0.0);
+	if (phase->flushes != -1)
+		printf(", %lld disk flushes", phase->flushes);
+	printf("\n");
+	if (n == 0)
+		return;
+
+	qsort(l, n, sizeof(*l), bench_cmp);
+	printf("%-9s latency ms: p50 %.3f  p90 %.3f  p99 %.3f  max %.3f\n",
+	       "", l[n / 2] * 1e3, l[n * 9 / 10] * 1e3,
+	       l[n * 99 / 100] * 1e3, l[n - 1] * 1e3);
+	if (phase->failed || phase->resent)
+		printf("%-9s %u failed, %u resent\n",
+		       "", phase->failed, phase->resent);
+}
+
+/*
+ * Answer the SM_NOTIFY in @buf from the address it was sent to.
+ * Returns the index of the peer notified, or -1.
+ */
+static long
+bench_stub_reply(int sock, char *buf, size_t len, struct msghdr *mh,
+		unsigned int peers)
+{
+	char cred[2 * MAX_AUTH_BYTES];
+	struct in_pktinfo *pi = NULL;
+	struct cmsghdr *cm;
+	struct rpc_msg msg;
+	stat_chge chge;
+	long peer;
+	XDR xdr;
+
+	for (cm = CMSG_FIRSTHDR(mh); cm != NULL; cm = CMSG_NXTHDR(mh, cm))
+		if (cm->cmsg_level == IPPROTO_IP &&
+		    cm->cmsg_type == IP_PKTINFO)
+			pi = (struct in_pktinfo *)CMSG_DATA(cm);
+	if (pi == NULL)
+		return -1;
+	peer = bench_peer_index(&pi->ipi_addr, peers);
+	if (peer == -1)
+		return -1;
+
+	memset(&msg, 0, sizeof(msg));
+	memset(&chge, 0, sizeof(chge));
+	msg.rm_call.cb_cred.oa_base = cred;
+	msg.rm_call.cb_verf.oa_base = cred + MAX_AUTH_BYTES;
+	xdrmem_create(&xdr, buf, (unsigned int)len, XDR_DECODE);
+	if (!xdr_callmsg(&xdr, &msg) || msg.rm_call.cb_prog != SM_PROG ||
+	    msg.rm_call.cb_proc != SM_NOTIFY || !xdr_stat_chge(&xdr, &chge)) {
+		xdr_destroy(&xdr);
+		return -1;
+	}
+	xdr_destroy(&xdr);
+	xdr_free((xdrproc_t)xdr_stat_chge, (char *)&chge);
+
+	memset(&msg.rm_reply, 0, sizeof(msg.rm_reply));
+	msg.rm_direction = REPLY;
+	msg.rm_reply.rp_stat = MSG_ACCEPTED;
+	msg.acpted_rply.ar_verf = _null_auth;
+	msg.acpted_rply.ar_stat = SUCCESS;
+	msg.acpted_rply.ar_results.where = NULL;
+	msg.acpted_rply.ar_results.proc = (xdrproc_t)xdr_void;
+	xdrmem_create(&xdr, buf, NSM_MAXMSGSIZE, XDR_ENCODE);
+	if (!xdr_replymsg(&xdr, &msg)) {
+		xdr_destroy(&xdr);
+		return -1;
+	}
+	mh->msg_iov->iov_len = (size_t)xdr_getpos(&xdr);
+	xdr_destroy(&xdr);
+
+	pi->ipi_ifindex = 0;
+	pi->ipi_spec_dst = pi->ipi_addr;
+	(void)sendmsg(sock, mh, 0);
+	return peer;
+}
+
+/*
+ * Point every peer's recorded statd port at a stub, run sm-notify,
+ * and wait until the stub has heard from it about every peer.
+ */
+static int
+bench_notify(const char *sm_notify, const char *notify_rate,
+		unsigned int peers)
+{
+	char buf[NSM_MAXMSGSIZE], cbuf[CMSG_SPACE(sizeof(struct in_pktinfo))];
+	char name[INET_ADDRSTRLEN], dir[PATH_MAX];
+	unsigned int notified = 0, calls = 0, i;
+	struct sockaddr_in sin, from;
+	double start, first = 0, last;
+	unsigned char *seen;
+	struct msghdr mh;
+	struct iovec iov;
+	socklen_t len;
+	int sock, one = 1, rcvbuf = NSM_BENCH_RCVBUF, status;
+	pid_t pid;
+
+	sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	if (sock == -1) {
+		perror("socket");
+		return -1;
+	}
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_ANY);
+	len = sizeof(sin);
+	(void)setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+	if (setsockopt(sock, IPPROTO_IP, IP_PKTINFO, &one, sizeof(one)) ||
+	    bind(sock, (struct sockaddr *)&sin, sizeof(sin)) ||
+	    getsockname(sock, (struct sockaddr *)&sin, &len)) {
+		perror("stub socket");
+		(void)close(sock);
+		return -1;
+	}
+
+	for (i = 0; i < peers; i++) {
+		bench_peer_name(i, name, sizeof(name));
+		if (!nsm_set_monitored_port(name, ntohs(sin.sin_port))) {
+			fprintf(stderr, "failed to record a port for %s\n",
+				name);
+			(void)close(sock);
+			return -1;
+		}
+	}
+
+	seen = calloc(peers ? peers : 1, 1);
+	if (seen == NULL) {
+		(void)close(sock);
+		return -1;
+	}
+
+	snprintf(dir, sizeof(dir), "%s", state_dir);
+	start = bench_now();
+	pid = fork();
+	if (pid == 0) {
+		int fd = open("/dev/null", O_WRONLY);
+
+		if (fd != -1) {
+			(void)dup2(fd, STDERR_FILENO);
+			(void)dup2(fd, STDOUT_FILENO);
+		}
+		if (notify_rate != NULL)
+			execl(sm_notify, sm_notify, "-f", "-n", "-d",
+			      "-r", notify_rate, "-P", dir, (char *)NULL);
+		else
+			execl(sm_notify, sm_notify, "-f", "-n", "-d",
+			      "-P", dir, (char *)NULL);
+		_exit(127);
+	}
+	if (pid == -1) {
+		perror("fork");
+		free(seen);
+		(void)close(sock);
+		return -1;
+	}
+
+	/*
+	 * Go on answering until sm-notify is done: a host whose reply
+	 * was lost is sent its SM_NOTIFY again.
+	 */
+	last = start;
+	while (waitpid(pid, &status, WNOHANG) == 0) {
+		struct pollfd pfd = { .fd = sock, .events = POLLIN };
+		double now = bench_now();
+		long peer;
+		ssize_t n;
+
+		if (now - last > (notified < peers ?
+				  NSM_BENCH_GIVEUP : NSM_BENCH_EXITWAIT)) {
+			fprintf(stderr, "sm-notify is still running; "
+				"stopping it\n");
+			(void)kill(pid, SIGTERM);
+			(void)waitpid(pid, &status, 0);
+			break;
+		}
+		if (poll(&pfd, 1, 100) <= 0)
+			continue;
+
+		memset(&mh, 0, sizeof(mh));
+		iov.iov_base = buf;
+		iov.iov_len = sizeof(buf);
+		mh.msg_name = &from;
+		mh.msg_namelen = sizeof(from);
+		mh.msg_iov = &iov;
+		mh.msg_iovlen = 1;
+		mh.msg_control = cbuf;
+		mh.msg_controllen = sizeof(cbuf);
+		n = recvmsg(sock, &mh, MSG_DONTWAIT);
+		if (n <= 0)
+			continue;
+
+		calls++;
+		peer = bench_stub_reply(sock, buf, (size_t)n, &mh, peers);
+		if (peer == -1 || seen[peer])
+			continue;
+		last = bench_now();
+		if (notified == 0)
+			first = last;
+		seen[peer] = 1;
+		notified++;
+	}
+
+	printf("%-9s %u of %u peers in %.3f s (first after %.3f s), "
+	       "%u calls, %.0f peers/s\n", "notify", notified, peers,
+	       last - start, notified ? first - start : 0.0, calls,
+	       last > start ? notified / (last - start) : 0.0);
+
+	free(seen);
+	(void)close(sock);
+	return notified == peers ? 0 : -1;
+}
+
+static void
+usage(const char *progname)
+{
+	fprintf(stderr, "usage: %s [-p statd-port] [-r rate] "
+		"[-P state-dir] [-s sm-notify [-R notify-rate]] peers\n",
+		progname);
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct bench_phase mon = { .name = "SM_MON" };
+	struct bench_phase unmon = { .name = "SM_UNMON" };
+	const char *sm_notify = NULL, *notify_rate = NULL;
+	unsigned int peers, rate = 0;
+	unsigned short port = 0;
+	struct sockaddr_in sin;
+	int c, sock, rcvbuf = NSM_BENCH_RCVBUF, result = 0;
+
+	while ((c = getopt(argc, argv, "p:r:P:s:R:")) != -1) {
+		switch (c) {
+		case 'p':
+			port = (unsigned short)atoi(optarg);
+			break;
+		case 'r':
+			rate = (unsigned int)atoi(optarg);
+			break;
+		case 'P':
+			state_dir = optarg;
+			break;
+		case 's':
+			sm_notify = optarg;
+			break;
+		case 'R':
+			notify_rate = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1)
+		usage(argv[0]);
+	peers = (unsigned int)strtoul(argv[optind], NULL, 10);
+	if (peers == 0 || peers > NSM_BENCH_MAXPEERS)
+		usage(argv[0]);
+	if (sm_notify != NULL && !nsm_setup_pathnames(argv[0], state_dir))
+		return 1;
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (port == 0)
+		port = nfs_getport((struct sockaddr *)&sin, sizeof(sin),
+				   SM_PROG, SM_VERS, IPPROTO_UDP);
+	if (port == 0) {
+		fprintf(stderr, "statd is not registered\n");
+		return 1;
+	}
+	sin.sin_port = htons(port);
+
+	sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	if (sock == -1) {
+		perror("socket");
+		return 1;
+	}
+	(void)setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+	srandom((unsigned int)getpid() ^ (unsigned int)time(NULL));
+	setvbuf(stdout, NULL, _IOLBF, 0);
+
+	if (rate)
+		printf("%u peers, %u calls/s, window %u\n",
+		       peers, rate, NSM_BENCH_WINDOW);
+	else
+		printf("%u peers, window %u\n", peers, NSM_BENCH_WINDOW);
+	if (bench_calls(sock, &sin, SM_MON, peers, rate, &mon) == -1)
+		return 1;
+	bench_report(&mon);
+
+	if (sm_notify != NULL && bench_notify(sm_notify, notify_rate,
+					      peers) == -1)
+		result = 1;
+
+	if (bench_calls(sock, &sin, SM_UNMON, peers, rate, &unmon) == -1)
+		return 1;
+	bench_report(&unmon);
+
+	if (mon.failed || unmon.failed)
+		result = 1;
+	free(mon.latency);
+	free(unmon.latency);
+	(void)close(sock);
+	return result;
+}
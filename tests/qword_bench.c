@@ -0,0 +1,249 @@
+/*
+ * qword_bench.c -- time the cache channel codec against a trace
+ *
+ * Reads a trace of upcalls, one per line as "[timestamp] channel
+ * request" like upcall_replay, and repeatedly decodes every request
+ * with qword_get() and encodes the words again the way the replies
+ * do, with qword_add() and, for binary words, qword_addhex().  The same work is done with a copy
+ * of the original byte-at-a-time codec, and the two must agree.
+ *
+ * usage: qword_bench [trace [iterations]]
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+
+#include "nfslib.h"
+#include "misc.h"
+
+#define MAXREQS		4096
+
+static void ref_add(char **bpp, int *lp, char *str)
+{
+	char *bp = *bpp;
+	int len = *lp;
+	char c;
+
+	if (len < 0) return;
+
+	while ((c=*str++) && len > 0)
+		switch(c) {
+		case ' ':
+		case '\t':
+		case '\n':
+		case '\\':
+			if (len >= 4) {
+				*bp++ = '\\';
+				*bp++ = '0' + ((c & 0300)>>6);
+				*bp++ = '0' + ((c & 0070)>>3);
+				*bp++ = '0' + ((c & 0007)>>0);
+			}
+			len -= 4;
+			break;
+		default:
+			*bp++ = c;
+			len--;
+		}
+	if (c || len <1) len = -1;
+	else {
+		*bp++ = ' ';
+		len--;
+	}
+	*bpp = bp;
+	*lp = len;
+}
+
+static void ref_addhex(char **bpp, int *lp, char *buf, int blen)
+{
+	char *bp = *bpp;
+	int len = *lp;
+
+	if (len < 0) return;
+
+	if (len > 2) {
+		*bp++ = '\\';
+		*bp++ = 'x';
+		len -= 2;
+		while (blen && len >= 2) {
+			unsigned char c = *buf++;
+			*bp++ = '0' + ((c&0xf0)>>4) + (c>=0xa0)*('a'-'9'-1);
+			*bp++ = '0' + (c&0x0f) + ((c&0x0f)>=0x0a)*('a'-'9'-1);
+			len -= 2;
+			blen--;
+		}
+	}
+	if (blen || len<1) len = -1;
+	else {
+		*bp++ = ' ';
+		len--;
+	}
+	*bpp = bp;
+	*lp = len;
+}
+
+#define isodigit(c) (isdigit(c) && c <= '7')
+static int ref_get(char **bpp, char *dest, int bufsize)
+{
+	char *bp = *bpp;
+	int len = 0;
+
+	while (*bp == ' ') bp++;
+
+	if (bp[0] == '\\' && bp[1] == 'x') {
+		bp += 2;
+		while (isxdigit(bp[0]) && isxdigit(bp[1]) && len < bufsize) {
+			int byte = isdigit(*bp) ? *bp-'0' : toupper(*bp)-'A'+10;
+			bp++;
+			byte <<= 4;
+			byte |= isdigit(*bp) ? *bp-'0' : toupper(*bp)-'A'+10;
+			*dest++ = byte;
+			bp++;
+			len++;
+		}
+	} else {
+		while (*bp != ' ' && *bp != '\n' && *bp && len < bufsize-1) {
+			if (*bp == '\\' &&
+			    isodigit(bp[1]) && (bp[1] <= '3') &&
+			    isodigit(bp[2]) &&
+			    isodigit(bp[3])) {
+				int byte = (*++bp -'0');
+				bp++;
+				byte = (byte << 3) | (*bp++ - '0');
+				byte = (byte << 3) | (*bp++ - '0');
+				*dest++ = byte;
+				len++;
+			} else {
+				*dest++ = *bp++;
+				len++;
+			}
+		}
+	}
+
+	if (*bp != ' ' && *bp != '\n' && *bp != '\0')
+		return -1;
+	while (*bp == ' ') bp++;
+	*bpp = bp;
+	*dest = '\0';
+	return len;
+}
+
+struct codec {
+	int	(*get)(char **bpp, char *dest, int bufsize);
+	void	(*add)(char **bpp, int *lp, char *str);
+	void	(*addhex)(char **bpp, int *lp, char *buf, int blen);
+};
+
+static const struct codec ref_codec = { ref_get, ref_add, ref_addhex };
+static const struct codec new_codec = { qword_get, qword_add, qword_addhex };
+
+/*
+ * Decode @req and encode its words into @out, as a handler answering
+ * it would.  Returns the length of the reply, or -1.
+ */
+static int
+transcode(const struct codec *c, const char *req, char *out, int outlen)
+{
+	char in[RPC_CHAN_BUF_SIZE], word[RPC_CHAN_BUF_SIZE];
+	char *bp = in, *op = out;
+	int len, blen = outlen;
+
+	strcpy(in, req);
+	while (*bp) {
+		int hex = bp[0] == '\\' && bp[1] == 'x';
+
+		len = c->get(&bp, word, sizeof(word));
+		if (len < 0)
+			return -1;
+		if (hex)
+			c->addhex(&op, &blen, word, len);
+		else
+			c->add(&op, &blen, word);
+	}
+	qword_addeol(&op, &blen);
+	return blen <= 0 ? -1 : op - out;
+}
+
+static double
+run(const struct codec *c, char **reqs, int nreqs, int iters)
+{
+	char out[RPC_CHAN_BUF_SIZE];
+	struct timespec start, now;
+	int i, n;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (n = 0; n < iters; n++)
+		for (i = 0; i < nreqs; i++)
+			transcode(c, reqs[i], out, sizeof(out));
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start.tv_sec) +
+		(now.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *trace = argc > 1 ? argv[1] : "upcall-trace.txt";
+	int iters = argc > 2 ? atoi(argv[2]) : 2000;
+	char line[RPC_CHAN_BUF_SIZE], *reqs[MAXREQS], *sp;
+	char a[RPC_CHAN_BUF_SIZE], b[RPC_CHAN_BUF_SIZE];
+	int i, alen, blen, nreqs = 0, errors = 0;
+	double tref, tnew;
+	FILE *fp;
+
+	fp = fopen(trace, "r");
+	if (fp == NULL) {
+		perror(trace);
+		return 1;
+	}
+	while (nreqs < MAXREQS && fgets(line, sizeof(line), fp)) {
+		if (line[0] == '#')
+			continue;
+		line[strcspn(line, "\n")] = '\0';
+		/* skip any time stamp, then the channel name */
+		sp = line;
+		if (isdigit((unsigned char)*sp))
+			sp = strchr(sp, ' ');
+		if (sp)
+			sp = strchr(sp + 1, ' ');
+		if (sp == NULL)
+			continue;
+		reqs[nreqs] = strdup(sp + 1);
+		if (reqs[nreqs] == NULL)
+			return 1;
+		nreqs++;
+	}
+	fclose(fp);
+
+	for (i = 0; i < nreqs; i++) {
+		alen = transcode(&ref_codec, reqs[i], a, sizeof(a));
+		blen = transcode(&new_codec, reqs[i], b, sizeof(b));
+		if (alen != blen || (alen > 0 && memcmp(a, b, alen) != 0)) {
+			fprintf(stderr, "mismatch on '%s'\n", reqs[i]);
+			errors++;
+		}
+	}
+
+	tref = run(&ref_codec, reqs, nreqs, iters);
+	tnew = run(&new_codec, reqs, nreqs, iters);
+
+	printf("%d upcalls, %d iterations\n", nreqs, iters);
+	printf("bytewise: %.3f s (%.0f ns/upcall)\n",
+	       tref, tref * 1e9 / ((double)nreqs * iters));
+	printf("current:  %.3f s (%.0f ns/upcall)\n",
+	       tnew, tnew * 1e9 / ((double)nreqs * iters));
+	if (errors)
+		printf("%d mismatches\n", errors);
+	return errors != 0;
+}
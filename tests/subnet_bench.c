@@ -0,0 +1,156 @@
+/*
+ * subnet_bench.c -- compare indexed and linear subnet client matching
+ *
+ * Builds a client list of random IPv4 and IPv6 subnetworks, then
+ * matches random addresses against it with client_compose(), first
+ * by scanning every subnet client and then through the prefix index
+ * built by client_subnet_index().  The two must agree.
+ *
+ * usage: subnet_bench [subnets [lookups]]
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#include "exportfs.h"
+#include "xlog.h"
+
+/* Keep addresses in a few /8s so that subnets overlap */
+static void
+random_addr(unsigned char *addr, int len)
+{
+	int i;
+
+	for (i = 0; i < len; i++)
+		addr[i] = random();
+	addr[0] = 10 + (addr[0] & 3);
+}
+
+static void
+add_subnet(int v6)
+{
+	unsigned char addr[16];
+	char buf[INET6_ADDRSTRLEN + 24];
+	int plen;
+
+	random_addr(addr, v6 ? 16 : 4);
+	if (v6) {
+		inet_ntop(AF_INET6, addr, buf, INET6_ADDRSTRLEN);
+		plen = 8 + random() % 121;
+	} else {
+		inet_ntop(AF_INET, addr, buf, INET6_ADDRSTRLEN);
+		plen = 8 + random() % 25;
+	}
+	sprintf(buf + strlen(buf), "/%d", plen);
+	if (client_lookup(buf, 0) == NULL) {
+		fprintf(stderr, "client_lookup(%s) failed\n", buf);
+		exit(1);
+	}
+}
+
+static double
+elapsed(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) +
+		(now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* Match every address, returning the number that matched a subnet */
+static unsigned int
+run(struct addrinfo **ai, int n, char **names, double *secs)
+{
+	struct timespec start;
+	unsigned int matched = 0;
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < n; i++) {
+		names[i] = client_compose(ai[i]);
+		if (names[i])
+			matched++;
+	}
+	*secs = elapsed(&start);
+	return matched;
+}
+
+int
+main(int argc, char **argv)
+{
+	int nsubnets = argc > 1 ? atoi(argv[1]) : 500;
+	int nlookups = argc > 2 ? atoi(argv[2]) : 100000;
+	char buf[INET6_ADDRSTRLEN];
+	unsigned char addr[16];
+	struct addrinfo **ai;
+	char **linear, **indexed;
+	unsigned int matched;
+	double tlinear, tindexed;
+	int i, v6, errors = 0;
+
+	xlog_open(argv[0]);
+	xlog_stderr(1);
+	srandom(1);
+
+	/* Two non-prefix netmasks exercise the unindexed list */
+	if (!client_lookup("10.0.0.0/255.0.255.0", 0) ||
+	    !client_lookup("11.0.0.1/255.0.0.255", 0))
+		return 1;
+	for (i = 0; i < nsubnets; i++)
+		add_subnet(i % 4 == 3);
+
+	ai = calloc(nlookups, sizeof(*ai));
+	linear = calloc(nlookups, sizeof(*linear));
+	indexed = calloc(nlookups, sizeof(*indexed));
+	if (!ai || !linear || !indexed)
+		return 1;
+	for (i = 0; i < nlookups; i++) {
+		v6 = i % 4 == 3;
+		random_addr(addr, v6 ? 16 : 4);
+		inet_ntop(v6 ? AF_INET6 : AF_INET, addr, buf, sizeof(buf));
+		ai[i] = host_pton(buf);
+		if (ai[i] == NULL)
+			return 1;
+	}
+
+	matched = run(ai, nlookups, linear, &tlinear);
+	client_subnet_index();
+	run(ai, nlookups, indexed, &tindexed);
+
+	for (i = 0; i < nlookups; i++) {
+		if ((linear[i] == NULL) != (indexed[i] == NULL) ||
+		    (linear[i] && strcmp(linear[i], indexed[i]) != 0)) {
+			host_ntop(ai[i]->ai_addr, buf, sizeof(buf));
+			fprintf(stderr, "%s: scan '%s', index '%s'\n", buf,
+				linear[i] ? linear[i] : "",
+				indexed[i] ? indexed[i] : "");
+			errors++;
+		}
+		free(linear[i]);
+		free(indexed[i]);
+		nfs_freeaddrinfo(ai[i]);
+	}
+
+	printf("%d subnets, %d lookups, %u matched\n",
+	       nsubnets + 2, nlookups, matched);
+	printf("scan:  %.3f s (%.0f ns/lookup)\n",
+	       tlinear, tlinear * 1e9 / nlookups);
+	printf("index: %.3f s (%.0f ns/lookup)\n",
+	       tindexed, tindexed * 1e9 / nlookups);
+	if (errors)
+		printf("%d mismatches\n", errors);
+	return errors != 0;
+}
@@ -0,0 +1,36 @@
+#!/bin/bash
+#
+# bench_equivalence -- run the cache benchmarks briefly, so that their
+# checks that the fast paths match the reference ones gate "make check"
+#
+# This program is free software; you can redistribute it and/or
+# modify it under the terms of the GNU General Public License
+# as published by the Free Software Foundation; either version 2
+# of the License, or (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+
+. ./test-lib.sh
+
+# subnets and lookups; every lookup is checked against a linear scan
+./subnet_bench 50 2000
+if [ $? -ne 0 ]; then
+	echo "FAIL: subnet_bench lookups differ from the linear scan"
+	exit 1
+fi
+
+./qword_bench $srcdir/upcall-trace.txt 10
+if [ $? -ne 0 ]; then
+	echo "FAIL: qword_bench codec differs from the byte-at-a-time one"
+	exit 1
+fi
+
+./idmap_bench 10
+if [ $? -ne 0 ]; then
+	echo "FAIL: idmap_bench replies differ from getfield() and addfield()"
+	exit 1
+fi
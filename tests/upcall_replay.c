@@ -0,0 +1,471 @@
+/*
+ * upcall_replay.c -- replay cache channel upcalls against the handlers
+ *
+ * Feeds a trace of upcalls to the cache channel handlers in
+ * libexport, as mountd and exportd would answer them, and reports
+ * throughput and latency percentiles for each channel.  Replies go
+ * to /dev/null, or to a file with -o.
+ *
+ * A trace has one upcall per line, "[timestamp] channel request",
+ * the timestamp in microseconds.  The daemons write one when the
+ * trace-file option is set; tests/upcall-trace.txt is a small
+ * synthetic one.  Replay the trace against a copy of the server's
+ * etab with -e, the exported paths existing as they did there.
+ *
+ * With -g, an etab of that many exports of scratch directories to
+ * subnet, host and, with -n, netgroup clients is generated instead,
+ * along with -c upcalls for them when no trace is given.
+ *
+ * usage: upcall_replay [-e etab] [-g exports [-n netgroups] [-c upcalls]]
+ *			[-o replies] [-r repeat] [-t] [trace]
+ *
+ * -t keeps the recorded spacing of the upcalls instead of replaying
+ * them back to back.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "nfslib.h"
+#include "misc.h"
+#include "exportfs.h"
+#include "export.h"
+#include "xlog.h"
+
+int use_ipaddr = -1;
+int manage_gids = 1;
+
+struct upcall {
+	unsigned long long	u_time;		/* recorded, in microseconds */
+	char *			u_channel;
+	char *			u_req;
+};
+
+static struct upcall *upcalls;
+static int nupcalls, maxupcalls;
+
+/* Latencies of one channel, in nanoseconds */
+struct channel_stats {
+	unsigned long long *	c_ns;
+	int			c_count;
+	int			c_max;
+};
+
+static struct channel_stats stats[CSTAT_MAX];
+
+static unsigned long long
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void *
+xrealloc_or_die(void *p, size_t size)
+{
+	p = realloc(p, size);
+	if (p == NULL) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	return p;
+}
+
+static void
+add_upcall(unsigned long long time, const char *channel, const char *req)
+{
+	struct upcall *u;
+
+	if (nupcalls == maxupcalls) {
+		maxupcalls = maxupcalls ? maxupcalls * 2 : 1024;
+		upcalls = xrealloc_or_die(upcalls, maxupcalls * sizeof(*u));
+	}
+	u = &upcalls[nupcalls++];
+	u->u_time = time;
+	u->u_channel = strdup(channel);
+	u->u_req = strdup(req);
+	if (u->u_channel == NULL || u->u_req == NULL) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+}
+
+static int
+read_trace(const char *fname)
+{
+	char line[RPC_CHAN_BUF_SIZE + 64], *bp, *sp;
+	unsigned long long time;
+	FILE *fp;
+
+	fp = fopen(fname, "r");
+	if (fp == NULL) {
+		perror(fname);
+		return -1;
+	}
+	while (fgets(line, sizeof(line), fp)) {
+		if (line[0] == '#' || line[0] == '\n')
+			continue;
+		line[strcspn(line, "\n")] = '\0';
+		bp = line;
+		time = 0;
+		if (isdigit((unsigned char)*bp)) {
+			time = strtoull(bp, &bp, 10);
+			while (*bp == ' ')
+				bp++;
+		}
+		sp = strchr(bp, ' ');
+		if (sp == NULL)
+			continue;
+		*sp++ = '\0';
+		add_upcall(time, bp, sp);
+	}
+	fclose(fp);
+	return 0;
+}
+
+/*
+ * Synthetic exports: export i is of directory "e<i>" and goes to a
+ * /24 subnet, a single host, or a netgroup, in turn.
+ */
+static char syndir[] = "/tmp/upcall_replay.XXXXXX";
+static int nexports, nnetgroups;
+
+static void
+syn_client(int i, char *buf, size_t len)
+{
+	switch (i % 4) {
+	case 0:
+	case 1:
+		snprintf(buf, len, "10.%d.%d.0/24", (i >> 8) & 255, i & 255);
+		break;
+	case 3:
+		if (nnetgroups) {
+			snprintf(buf, len, "@ng%d", i % nnetgroups);
+			break;
+		}
+		/* fall through */
+	default:
+		snprintf(buf, len, "172.%d.%d.%d", 16 + ((i >> 16) & 15),
+			 (i >> 8) & 255, (i & 255) | 1);
+	}
+}
+
+/* An address in export @i's client, as a string */
+static void
+syn_addr(int i, char *buf, size_t len)
+{
+	switch (i % 4) {
+	case 0:
+	case 1:
+		snprintf(buf, len, "10.%d.%d.%ld", (i >> 8) & 255, i & 255,
+			 1 + random() % 254);
+		break;
+	case 3:
+		if (nnetgroups) {
+			snprintf(buf, len, "192.0.2.%ld", 1 + random() % 254);
+			break;
+		}
+		/* fall through */
+	default:
+		syn_client(i, buf, len);
+	}
+}
+
+static int
+syn_exports(void)
+{
+	char path[PATH_MAX], client[64];
+	FILE *fp;
+	int i;
+
+	if (mkdtemp(syndir) == NULL) {
+		perror(syndir);
+		return -1;
+	}
+	snprintf(path, sizeof(path), "%s/etab", syndir);
+	fp = fopen(path, "w");
+	if (fp == NULL) {
+		perror(path);
+		return -1;
+	}
+	for (i = 0; i < nexports; i++) {
+		syn_client(i, client, sizeof(client));
+		snprintf(path, sizeof(path), "%s/e%d", syndir, i);
+		if (mkdir(path, 0755) < 0) {
+			perror(path);
+			fclose(fp);
+			return -1;
+		}
+		fprintf(fp, "%s\t%s(rw,sync,no_subtree_check,fsid=%d)\n",
+			path, client, i + 1);
+	}
+	if (fclose(fp) != 0)
+		return -1;
+
+	snprintf(path, sizeof(path), "%s/etab", syndir);
+	etab.statefn = strdup(path);
+	snprintf(path, sizeof(path), "%s/etab.lock", syndir);
+	etab.lockfn = strdup(path);
+	return 0;
+}
+
+static void
+syn_cleanup(void)
+{
+	char path[PATH_MAX];
+	int i;
+
+	for (i = 0; i < nexports; i++) {
+		snprintf(path, sizeof(path), "%s/e%d", syndir, i);
+		rmdir(path);
+	}
+	snprintf(path, sizeof(path), "%s/etab", syndir);
+	unlink(path);
+	snprintf(path, sizeof(path), "%s/etab.lock", syndir);
+	unlink(path);
+	rmdir(syndir);
+}
+
+/*
+ * Generate @count upcalls for the synthetic exports.  The domain the
+ * kernel names in nfsd.export and nfsd.fh upcalls depends on whether
+ * auth_reload() chose to answer auth.unix.ip with addresses.
+ */
+static void
+syn_upcalls(int count)
+{
+	char req[RPC_CHAN_BUF_SIZE], addr[64], dom[72], *bp;
+	unsigned int j;
+	int i, e, fsid;
+
+	for (i = 0; i < count; i++) {
+		e = random() % nexports;
+		syn_addr(e, addr, sizeof(addr));
+		if (use_ipaddr > 0)
+			snprintf(dom, sizeof(dom), "$%s", addr);
+		else
+			syn_client(e, dom, sizeof(dom));
+
+		switch (i % 4) {
+		case 0:
+			snprintf(req, sizeof(req), "nfsd %s", addr);
+			add_upcall(0, "auth.unix.ip", req);
+			break;
+		case 1:
+			snprintf(req, sizeof(req), "%s %s/e%d", dom, syndir, e);
+			add_upcall(0, "nfsd.export", req);
+			break;
+		case 2:
+			fsid = e + 1;
+			bp = req + sprintf(req, "%s 1 \\x", dom);
+			for (j = 0; j < sizeof(fsid); j++)
+				bp += sprintf(bp, "%02x",
+					      ((unsigned char *)&fsid)[j]);
+			add_upcall(0, "nfsd.fh", req);
+			break;
+		case 3:
+			snprintf(req, sizeof(req), "%ld", 1000 + random() % 1000);
+			add_upcall(0, "auth.unix.gid", req);
+			break;
+		}
+	}
+}
+
+static void
+record(int id, unsigned long long ns)
+{
+	struct channel_stats *c = &stats[id];
+
+	if (c->c_count == c->c_max) {
+		c->c_max = c->c_max ? c->c_max * 2 : 1024;
+		c->c_ns = xrealloc_or_die(c->c_ns, c->c_max * sizeof(*c->c_ns));
+	}
+	c->c_ns[c->c_count++] = ns;
+}
+
+/* Replay every upcall once.  Returns the time taken, in nanoseconds */
+static unsigned long long
+replay(int f, int paced)
+{
+	char buf[RPC_CHAN_BUF_SIZE];
+	unsigned long long start, t, due;
+	struct timespec ts;
+	struct upcall *u;
+	int i, id;
+
+	start = now_ns();
+	for (i = 0; i < nupcalls; i++) {
+		u = &upcalls[i];
+		if (paced) {
+			due = start + (u->u_time - upcalls[0].u_time) * 1000;
+			ts.tv_sec = due / 1000000000ULL;
+			ts.tv_nsec = due % 1000000000ULL;
+			clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+					&ts, NULL);
+		}
+		strncpy(buf, u->u_req, sizeof(buf) - 1);
+		buf[sizeof(buf) - 1] = '\0';
+		t = now_ns();
+		id = cache_handle_upcall(u->u_channel, f, buf,
+					 strlen(buf) + 1);
+		if (id >= 0)
+			record(id, now_ns() - t);
+	}
+	return now_ns() - start;
+}
+
+static int
+cmp_ns(const void *a, const void *b)
+{
+	unsigned long long x = *(const unsigned long long *)a;
+	unsigned long long y = *(const unsigned long long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static double
+percentile(const struct channel_stats *c, double p)
+{
+	int i = (int)(p * (c->c_count - 1) + 0.5);
+
+	return c->c_ns[i] / 1000.0;
+}
+
+static const char *channel_names[CSTAT_MAX] = {
+	[CSTAT_AUTH_UNIX_IP]	= "auth.unix.ip",
+	[CSTAT_AUTH_UNIX_GID]	= "auth.unix.gid",
+	[CSTAT_NFSD_EXPORT]	= "nfsd.export",
+	[CSTAT_NFSD_FH]		= "nfsd.fh",
+};
+
+static void
+report(unsigned long long total_ns)
+{
+	struct channel_stats *c;
+	unsigned long long sum;
+	int id, i, count = 0;
+
+	printf("%-14s %8s %10s %9s %9s %9s %9s\n", "channel", "upcalls",
+	       "mean us", "p50 us", "p90 us", "p99 us", "max us");
+	for (id = 0; id < CSTAT_MAX; id++) {
+		c = &stats[id];
+		if (c->c_count == 0)
+			continue;
+		qsort(c->c_ns, c->c_count, sizeof(*c->c_ns), cmp_ns);
+		for (sum = 0, i = 0; i < c->c_count; i++)
+			sum += c->c_ns[i];
+		printf("%-14s %8d %10.1f %9.1f %9.1f %9.1f %9.1f\n",
+		       channel_names[id], c->c_count,
+		       sum / 1000.0 / c->c_count, percentile(c, 0.50),
+		       percentile(c, 0.90), percentile(c, 0.99),
+		       c->c_ns[c->c_count - 1] / 1000.0);
+		count += c->c_count;
+	}
+	printf("%d upcalls in %.3f s: %.0f upcalls/s\n", count,
+	       total_ns / 1e9, count / (total_ns / 1e9));
+}
+
+static void
+usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-e etab] [-g exports [-n netgroups] "
+		"[-c upcalls]] [-o replies] [-r repeat] [-t] [trace]\n", prog);
+	exit(2);
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *etabfn = NULL, *out = "/dev/null";
+	unsigned long long start, total = 0;
+	int count = 100000, repeat = 1, paced = 0;
+	int c, f, i;
+
+	while ((c = getopt(argc, argv, "c:e:g:n:o:r:t")) != EOF) {
+		switch (c) {
+		case 'c':
+			count = atoi(optarg);
+			break;
+		case 'e':
+			etabfn = optarg;
+			break;
+		case 'g':
+			nexports = atoi(optarg);
+			break;
+		case 'n':
+			nnetgroups = atoi(optarg);
+			break;
+		case 'o':
+			out = optarg;
+			break;
+		case 'r':
+			repeat = atoi(optarg);
+			break;
+		case 't':
+			paced = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if ((nexports <= 0 && optind >= argc) || (nexports && etabfn))
+		usage(argv[0]);
+
+	xlog_open(argv[0]);
+	xlog_stderr(1);
+	srandom(1);
+
+	if (optind < argc && read_trace(argv[optind]) < 0)
+		return 1;
+
+	if (nexports > 0) {
+		if (syn_exports() < 0)
+			return 1;
+	} else if (etabfn) {
+		etab.statefn = strdup(etabfn);
+		if (asprintf(&etab.lockfn, "%s.lock", etabfn) < 0)
+			return 1;
+	} else if (!setup_state_path_names(argv[0], ETAB, ETABTMP,
+					   ETABLCK, &etab))
+		return 1;
+
+	f = open(out, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (f < 0) {
+		perror(out);
+		return 1;
+	}
+
+	start = now_ns();
+	auth_reload();
+	printf("export table loaded in %.3f s\n", (now_ns() - start) / 1e9);
+
+	if (nexports > 0 && nupcalls == 0)
+		syn_upcalls(count);
+
+	for (i = 0; i < repeat; i++)
+		total += replay(f, paced);
+	report(total);
+
+	close(f);
+	if (nexports > 0)
+		syn_cleanup();
+	return 0;
+}
@@ -0,0 +1,539 @@
+/*
+ * lockbench - measure lock throughput and latency on a file system
+ *
+ * Several processes, each running several threads, lock and unlock
+ * byte ranges of a set of files for a while, and the number of lock
+ * and unlock calls made and their latencies are reported.  Run on an
+ * NFSv3 mount every lock and unlock is an NLM call to the server's
+ * lockd; on an NFSv4 mount it is a LOCK or LOCKU.
+ *
+ * With a rate given, calls are issued on a fixed schedule and each
+ * latency is measured from when its call was due, so that a stalled
+ * server shows up as latency rather than as fewer calls.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <sys/types.h>
+#include <sys/file.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define NSEC_PER_SEC	1000000000ULL
+
+/*
+ * Latencies, in nanoseconds, go in buckets 1/16th of a power of two
+ * wide, or about 6%.
+ */
+#define HIST_SUB	16
+#define HIST_BUCKETS	(64 * HIST_SUB)
+
+struct hist {
+	uint64_t		count, max;
+	uint64_t		buckets[HIST_BUCKETS];
+};
+
+struct result {
+	uint64_t		ops, conflicts, errors;
+	struct hist		lock, unlock;
+};
+
+enum lock_mode {
+	MODE_FCNTL,
+	MODE_OFD,
+	MODE_FLOCK,
+};
+
+static const char *mode_names[] = { "fcntl", "ofd", "flock" };
+
+static enum lock_mode mode = MODE_FCNTL;
+static unsigned int nprocs = 1, nthreads = 1, nfiles = 1, nranges = 1;
+static unsigned int write_pct = 100, hold_usecs;
+static unsigned int duration = 10;
+static uint64_t rate;
+static int nonblock, keep;
+static const char *dir;
+
+static uint64_t start_ns, deadline_ns;
+
+static uint64_t now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t ns)
+{
+	struct timespec ts;
+
+	ts.tv_sec = ns / NSEC_PER_SEC;
+	ts.tv_nsec = ns % NSEC_PER_SEC;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) ==
+	       EINTR)
+		;
+}
+
+static unsigned int hist_index(uint64_t v)
+{
+	unsigned int msb;
+
+	if (v < HIST_SUB)
+		return v;
+	msb = 63 - __builtin_clzll(v);
+	return (msb - 3) * HIST_SUB + ((v >> (msb - 4)) & (HIST_SUB - 1));
+}
+
+/* The largest value that goes in bucket i */
+static uint64_t hist_value(unsigned int i)
+{
+	unsigned int shift;
+
+	if (i < HIST_SUB)
+		return i;
+	shift = i / HIST_SUB - 1;
+	return ((uint64_t)(HIST_SUB + i % HIST_SUB + 1) << shift) - 1;
+}
+
+static void hist_add(struct hist *h, uint64_t v)
+{
+	h->count++;
+	h->buckets[hist_index(v)]++;
+	if (v > h->max)
+		h->max = v;
+}
+
+static void hist_merge(struct hist *to, const struct hist *from)
+{
+	unsigned int i;
+
+	to->count += from->count;
+	for (i = 0; i < HIST_BUCKETS; i++)
+		to->buckets[i] += from->buckets[i];
+	if (from->max > to->max)
+		to->max = from->max;
+}
+
+static uint64_t hist_percentile(const struct hist *h, double pct)
+{
+	uint64_t want, seen = 0;
+	unsigned int i;
+
+	want = (uint64_t)(h->count * pct / 100.0 + 0.5);
+	if (want == 0)
+		want = 1;
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		seen += h->buckets[i];
+		if (seen >= want)
+			return hist_value(i) < h->max ? hist_value(i) : h->max;
+	}
+	return h->max;
+}
+
+static void result_merge(struct result *to, const struct result *from)
+{
+	to->ops += from->ops;
+	to->conflicts += from->conflicts;
+	to->errors += from->errors;
+	hist_merge(&to->lock, &from->lock);
+	hist_merge(&to->unlock, &from->unlock);
+}
+
+static void file_name(char *buf, size_t size, unsigned int i)
+{
+	snprintf(buf, size, "%s/lockbench.%u", dir, i);
+}
+
+/*
+ * Returns 0, 1 if the lock is held by someone else and the call was
+ * not to wait, or -1 with errno set.
+ */
+static int do_lock(int fd, unsigned int range, int excl, int unlock)
+{
+	struct flock fl;
+	int cmd, op;
+
+	if (mode == MODE_FLOCK) {
+		op = unlock ? LOCK_UN : excl ? LOCK_EX : LOCK_SH;
+		if (nonblock && !unlock)
+			op |= LOCK_NB;
+		if (flock(fd, op) == 0)
+			return 0;
+		return errno == EWOULDBLOCK ? 1 : -1;
+	}
+
+	memset(&fl, 0, sizeof(fl));
+	fl.l_type = unlock ? F_UNLCK : excl ? F_WRLCK : F_RDLCK;
+	fl.l_whence = SEEK_SET;
+	fl.l_start = range;
+	fl.l_len = 1;
+#ifdef F_OFD_SETLK
+	if (mode == MODE_OFD)
+		cmd = nonblock || unlock ? F_OFD_SETLK : F_OFD_SETLKW;
+	else
+#endif
+		cmd = nonblock || unlock ? F_SETLK : F_SETLKW;
+	if (fcntl(fd, cmd, &fl) == 0)
+		return 0;
+	return errno == EAGAIN || errno == EACCES ? 1 : -1;
+}
+
+struct worker {
+	pthread_t		thread;
+	unsigned int		id;
+	struct result		result;
+};
+
+static void *worker_run(void *arg)
+{
+	struct worker *w = arg;
+	struct result *r = &w->result;
+	uint64_t next, interval = 0, t0, t1;
+	unsigned int seed = w->id * 2654435761u + getpid();
+	unsigned int i, f, range;
+	char path[PATH_MAX];
+	int *fds, excl, ret;
+
+	/* each thread has its own opens, so OFD and flock locks contend */
+	fds = calloc(nfiles, sizeof(*fds));
+	if (!fds) {
+		r->errors++;
+		return NULL;
+	}
+	for (i = 0; i < nfiles; i++)
+		fds[i] = -1;
+	for (i = 0; i < nfiles; i++) {
+		file_name(path, sizeof(path), i);
+		fds[i] = open(path, O_RDWR | O_CLOEXEC);
+		if (fds[i] < 0) {
+			fprintf(stderr, "lockbench: %s: %s\n", path,
+				strerror(errno));
+			r->errors++;
+			goto out;
+		}
+	}
+
+	if (rate)
+		interval = NSEC_PER_SEC * nprocs * nthreads / rate;
+	/* spread the workers over the first interval */
+	next = start_ns + interval * w->id / (nprocs * nthreads);
+	sleep_until(start_ns);
+	for (;;) {
+		if (rate) {
+			if (next >= deadline_ns)
+				break;
+			sleep_until(next);
+			t0 = next;
+			next += interval;
+		} else {
+			t0 = now();
+			if (t0 >= deadline_ns)
+				break;
+		}
+
+		f = rand_r(&seed) % nfiles;
+		range = rand_r(&seed) % nranges;
+		excl = (unsigned int)(rand_r(&seed) % 100) < write_pct;
+
+		ret = do_lock(fds[f], range, excl, 0);
+		t1 = now();
+		if (ret == 1) {
+			r->conflicts++;
+			continue;
+		}
+		if (ret < 0) {
+			fprintf(stderr, "lockbench: lock: %s\n",
+				strerror(errno));
+			r->errors++;
+			break;
+		}
+		hist_add(&r->lock, t1 - t0);
+
+		if (hold_usecs)
+			usleep(hold_usecs);
+
+		t0 = now();
+		ret = do_lock(fds[f], range, excl, 1);
+		t1 = now();
+		if (ret != 0) {
+			fprintf(stderr, "lockbench: unlock: %s\n",
+				strerror(errno));
+			r->errors++;
+			break;
+		}
+		hist_add(&r->unlock, t1 - t0);
+		r->ops++;
+	}
+
+out:
+	for (i = 0; i < nfiles; i++)
+		if (fds[i] >= 0)
+			close(fds[i]);
+	free(fds);
+	return NULL;
+}
+
+/* Run this process's threads, adding up their results in r */
+static void run_threads(unsigned int proc, struct result *r)
+{
+	struct worker *workers;
+	unsigned int i;
+
+	workers = calloc(nthreads, sizeof(*workers));
+	if (!workers) {
+		r->errors++;
+		return;
+	}
+	for (i = 0; i < nthreads; i++) {
+		workers[i].id = proc * nthreads + i;
+		if (i > 0 && pthread_create(&workers[i].thread, NULL,
+					    worker_run, &workers[i]) != 0) {
+			fprintf(stderr, "lockbench: cannot start a thread\n");
+			exit(1);
+		}
+	}
+	worker_run(&workers[0]);
+	for (i = 1; i < nthreads; i++)
+		pthread_join(workers[i].thread, NULL);
+	for (i = 0; i < nthreads; i++)
+		result_merge(r, &workers[i].result);
+	free(workers);
+}
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+	ssize_t n;
+
+	while (len) {
+		n = write(fd, p, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int read_all(int fd, void *buf, size_t len)
+{
+	char *p = buf;
+	ssize_t n;
+
+	while (len) {
+		n = read(fd, p, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* Fork the processes and gather what each reports on its pipe */
+static void run_procs(struct result *total)
+{
+	struct result *r;
+	unsigned int i;
+	int (*pipes)[2];
+	pid_t pid;
+
+	if (nprocs == 1) {
+		run_threads(0, total);
+		return;
+	}
+
+	r = malloc(sizeof(*r));
+	pipes = calloc(nprocs, sizeof(*pipes));
+	if (!r || !pipes) {
+		fprintf(stderr, "lockbench: %s\n", strerror(ENOMEM));
+		exit(1);
+	}
+	fflush(stdout);
+	for (i = 0; i < nprocs; i++) {
+		if (pipe(pipes[i]) < 0 || (pid = fork()) < 0) {
+			fprintf(stderr, "lockbench: cannot start a process: "
+				"%s\n", strerror(errno));
+			exit(1);
+		}
+		if (pid == 0) {
+			close(pipes[i][0]);
+			memset(r, 0, sizeof(*r));
+			run_threads(i, r);
+			_exit(write_all(pipes[i][1], r, sizeof(*r)) < 0);
+		}
+		close(pipes[i][1]);
+	}
+	for (i = 0; i < nprocs; i++) {
+		if (read_all(pipes[i][0], r, sizeof(*r)) == 0)
+			result_merge(total, r);
+		else
+			total->errors++;
+		close(pipes[i][0]);
+	}
+	while (wait(NULL) > 0 || errno == EINTR)
+		;
+	free(pipes);
+	free(r);
+}
+
+static void print_hist(const char *name, const struct hist *h)
+{
+	static const double pcts[] = { 50, 90, 99, 99.9 };
+	unsigned int i;
+
+	printf("%-10s", name);
+	if (!h->count) {
+		printf(" -\n");
+		return;
+	}
+	for (i = 0; i < sizeof(pcts) / sizeof(*pcts); i++)
+		printf(" p%g %.1fus", pcts[i],
+		       hist_percentile(h, pcts[i]) / 1000.0);
+	printf(" max %.1fus\n", h->max / 1000.0);
+}
+
+static void usage(const char *progname)
+{
+	fprintf(stderr, "Usage: %s [-m fcntl|ofd|flock] [-p procs] "
+			"[-t threads] [-f files] [-R ranges]\n"
+			"\t\t[-w write%%] [-H hold-usecs] [-r ops/sec] "
+			"[-d seconds] [-n] [-k] directory\n", progname);
+	exit(2);
+}
+
+static unsigned long get_num(const char *arg, const char *progname,
+			     unsigned long min, unsigned long max)
+{
+	unsigned long val;
+	char *end;
+
+	errno = 0;
+	val = strtoul(arg, &end, 10);
+	if (*arg == '\0' || *end != '\0' || errno || val < min || val > max)
+		usage(progname);
+	return val;
+}
+
+int main(int argc, char **argv)
+{
+	struct result total;
+	char path[PATH_MAX];
+	unsigned int i;
+	double secs;
+	int c, fd;
+
+	while ((c = getopt(argc, argv, "m:p:t:f:R:w:H:r:d:nkh")) != EOF) {
+		switch (c) {
+		case 'm':
+			for (i = 0; i < sizeof(mode_names) / sizeof(*mode_names);
+			     i++)
+				if (strcmp(optarg, mode_names[i]) == 0)
+					break;
+			if (i == sizeof(mode_names) / sizeof(*mode_names))
+				usage(argv[0]);
+			mode = i;
+			break;
+		case 'p':
+			nprocs = get_num(optarg, argv[0], 1, 4096);
+			break;
+		case 't':
+			nthreads = get_num(optarg, argv[0], 1, 4096);
+			break;
+		case 'f':
+			nfiles = get_num(optarg, argv[0], 1, 65536);
+			break;
+		case 'R':
+			nranges = get_num(optarg, argv[0], 1, INT_MAX);
+			break;
+		case 'w':
+			write_pct = get_num(optarg, argv[0], 0, 100);
+			break;
+		case 'H':
+			hold_usecs = get_num(optarg, argv[0], 0, 10000000);
+			break;
+		case 'r':
+			rate = get_num(optarg, argv[0], 1, 100000000);
+			break;
+		case 'd':
+			duration = get_num(optarg, argv[0], 1, 86400);
+			break;
+		case 'n':
+			nonblock = 1;
+			break;
+		case 'k':
+			keep = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1)
+		usage(argv[0]);
+	dir = argv[optind];
+#ifndef F_OFD_SETLK
+	if (mode == MODE_OFD) {
+		fprintf(stderr, "lockbench: OFD locks are not supported\n");
+		return 1;
+	}
+#endif
+	if (mode == MODE_FCNTL && nthreads > 1)
+		fprintf(stderr, "lockbench: the threads of a process share "
+			"its fcntl locks; use -p for them to contend\n");
+
+	for (i = 0; i < nfiles; i++) {
+		file_name(path, sizeof(path), i);
+		fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+		if (fd < 0) {
+			fprintf(stderr, "lockbench: %s: %s\n", path,
+				strerror(errno));
+			return 1;
+		}
+		close(fd);
+	}
+
+	printf("%s locks, %u process(es) x %u thread(s), %u file(s), "
+	       "%u range(s), %u%% exclusive, %us\n", mode_names[mode],
+	       nprocs, nthreads, nfiles, nranges, write_pct, duration);
+
+	/* give every process and thread time to open its files */
+	start_ns = now() + NSEC_PER_SEC / 2 + nprocs * nthreads * 100000ULL;
+	deadline_ns = start_ns + duration * NSEC_PER_SEC;
+	memset(&total, 0, sizeof(total));
+	run_procs(&total);
+	secs = (now() - start_ns) / (double)NSEC_PER_SEC;
+
+	printf("ops        %llu (%.1f/sec)\n", (unsigned long long)total.ops,
+	       total.ops / secs);
+	if (nonblock)
+		printf("conflicts  %llu\n",
+		       (unsigned long long)total.conflicts);
+	if (total.errors)
+		printf("errors     %llu\n", (unsigned long long)total.errors);
+	print_hist("lock", &total.lock);
+	print_hist("unlock", &total.unlock);
+
+	if (!keep)
+		for (i = 0; i < nfiles; i++) {
+			file_name(path, sizeof(path), i);
+			unlink(path);
+		}
+	return total.errors ? 1 : 0;
+}
@@ -24,7 +24,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
 MA 02110-1301 USA
 """
 
-import sys, os, time
+import sys, os, time, struct, subprocess
 from operator import itemgetter, add
 try:
     import argparse
@@ -317,10 +317,62 @@ class DeviceData:
             if len(self.__rpc_data[op]) < 9:
                 self.__rpc_data[op] += [0]
 
+    def __load_snapshot(self, mnt):
+        (export, mountpoint, fstype, statvers, opts, caps, nfsv4, sec,
+            rpcvers, progvers, protocol) = mnt.strings
+        self.__nfs_data['export'] = export
+        self.__nfs_data['mountpoint'] = mountpoint
+        self.__nfs_data['fstype'] = fstype
+        if fstype.find('nfs') != -1 and fstype != 'nfsd':
+            self.__nfs_data['statvers'] = statvers
+        self.__nfs_data['age'] = mnt.age
+        if opts:
+            self.__nfs_data['mountoptions'] = ''.join(opts.split()).split(',')
+        if caps:
+            self.__nfs_data['servercapabilities'] = ''.join(caps.split()).split(',')
+        if nfsv4:
+            self.__nfs_data['nfsv4flags'] = ''.join(nfsv4.split()).split(',')
+        if sec:
+            keys = ''.join(sec.split()).split(',')
+            self.__nfs_data['flavor'] = int(keys[0].split('=')[1])
+            self.__nfs_data['pseudoflavor'] = 0
+            if self.__nfs_data['flavor'] == 6:
+                self.__nfs_data['pseudoflavor'] = int(keys[1].split('=')[1])
+        if mnt.events:
+            for key in NfsEventCounters:
+                self.__nfs_data[key] = 0
+            self.__nfs_data.update(zip(NfsEventCounters, mnt.events))
+        self.__nfs_data.update(zip(NfsByteCounters, mnt.bytes))
+
+        if rpcvers:
+            self.__rpc_data['statsvers'] = float(rpcvers)
+            self.__rpc_data['programversion'] = progvers
+        if protocol:
+            self.__rpc_data['protocol'] = protocol
+            if protocol == 'udp':
+                self.__rpc_data.update(zip(XprtUdpCounters, mnt.xprt))
+            elif protocol == 'tcp':
+                self.__rpc_data.update(zip(XprtTcpCounters, mnt.xprt))
+            elif protocol == 'rdma':
+                self.__rpc_data.update(zip(XprtRdmaCounters, mnt.xprt))
+        if mnt.ops:
+            n = mnt.nfields
+            ends = range(n, n * len(mnt.ops) + 1, n)
+            if n < 9:
+                rows = [mnt.values[i - n:i] + [0] for i in ends]
+            else:
+                rows = [mnt.values[i - n:i] for i in ends]
+            self.__rpc_data['ops'] += mnt.ops
+            self.__rpc_data.update(zip(mnt.ops, rows))
+
     def parse_stats(self, lines):
-        """Turn a list of lines from a mount stat file into a 
-        dictionary full of stats, keyed by name
+        """Turn a list of lines from a mount stat file, or a
+        SnapshotMount, into a dictionary full of stats, keyed by name
         """
+        if isinstance(lines, SnapshotMount):
+            self.__load_snapshot(lines)
+            return
+
         found = False
         for line in lines:
             words = line.split()
@@ -805,6 +857,105 @@ def parse_stats_file(f):
 
     return ms_dict
 
+class SnapshotMount:
+    """The stats of one mount, as loaded from an nfsstat snapshot
+    """
+    __slots__ = ['strings', 'age', 'events', 'bytes', 'xprt', 'ops',
+        'nfields', 'values']
+
+Nfsstat_paths = os.environ.get('PATH', '').split(os.pathsep) + ['/usr/sbin', '/sbin']
+Nfsstat = None
+
+def read_snapshot(filename):
+    """have nfsstat parse a mountstats file and load the binary
+    snapshot it writes into a dictionary of SnapshotMounts, keyed
+    by mount point; only NFS mounts are in it.  return None if
+    nfsstat is missing or cannot write snapshots.
+    """
+    global Nfsstat
+    if Nfsstat is None:
+        Nfsstat = ''
+        for d in Nfsstat_paths:
+            if d and os.access(os.path.join(d, 'nfsstat'), os.X_OK):
+                Nfsstat = os.path.join(d, 'nfsstat')
+                break
+    if not Nfsstat:
+        return None
+    try:
+        p = subprocess.Popen([Nfsstat, '--snapshot=' + filename],
+            stdout=subprocess.PIPE, stderr=subprocess.DEVNULL)
+        buf = p.communicate()[0]
+    except OSError:
+        Nfsstat = ''
+        return None
+    if p.returncode != 0 or buf[:8] != b'NFSMSNAP':
+        if p.returncode != 2:
+            # an nfsstat without --snapshot, so stop asking
+            Nfsstat = ''
+        return None
+
+    formats = dict()
+    def vals(off, times=1):
+        count, width = buf[off], buf[off + 1]
+        off += 2
+        if width == 0:
+            return [0] * (count * times), off
+        fmt = formats.get((count * times, width))
+        if fmt is None:
+            fmt = struct.Struct('=%d%s' % (count * times, 'I' if width == 4 else 'Q'))
+            formats[(count * times, width)] = fmt
+        return list(fmt.unpack_from(buf, off)), off + fmt.size
+
+    def string(off):
+        n = u16.unpack_from(buf, off)[0]
+        return buf[off + 2:off + 2 + n].decode('utf-8', 'replace'), off + 2 + n
+
+    u16 = struct.Struct('=H')
+    u32 = struct.Struct('=I')
+    u64 = struct.Struct('=Q')
+    version, nnames = struct.unpack_from('=II', buf, 8)
+    if version != 1:
+        return None
+    off = 16
+    names = []
+    for i in range(nnames):
+        name, off = string(off)
+        names += [name]
+    nmounts = u32.unpack_from(buf, off)[0]
+    off += 4
+
+    ms_dict = dict()
+    for i in range(nmounts):
+        mnt = SnapshotMount()
+        mnt.strings = []
+        for j in range(11):
+            s, off = string(off)
+            mnt.strings += [s]
+        mnt.age = u64.unpack_from(buf, off)[0]
+        off += 8
+        mnt.events, off = vals(off)
+        mnt.bytes, off = vals(off)
+        mnt.xprt, off = vals(off)
+        nops = u32.unpack_from(buf, off)[0]
+        off += 4
+        mnt.ops = [names[k] for k in struct.unpack_from('=%dH' % nops, buf, off)]
+        off += 2 * nops
+        mnt.nfields = buf[off]
+        mnt.values, off = vals(off, nops)
+        ms_dict[mnt.strings[1]] = mnt
+
+    return ms_dict
+
+def read_stats_file(f):
+    """load a mountstats file with the help of nfsstat if possible,
+    as that is much quicker with many mounts, and parse it otherwise
+    """
+    if os.path.exists(f.name):
+        ms_dict = read_snapshot(f.name)
+        if ms_dict is not None:
+            return ms_dict
+    return parse_stats_file(f)
+
 def print_mountstats(stats, nfs_only, rpc_only, raw, xprt_only):
     if nfs_only:
        stats.display_stats_header()
@@ -831,7 +982,7 @@ def print_mountstats(stats, nfs_only, rpc_only, raw, xprt_only):
 def mountstats_command(args):
     """Mountstats command
     """
-    mountstats = parse_stats_file(args.infile)
+    mountstats = read_stats_file(args.infile)
     mountpoints = [os.path.normpath(mp) for mp in args.mountpoints]
 
     # make certain devices contains only NFS mount points
@@ -857,7 +1008,7 @@ def mountstats_command(args):
         return 1
 
     if args.since:
-        old_mountstats = parse_stats_file(args.since)
+        old_mountstats = read_stats_file(args.since)
 
     for mp in mountpoints:
         stats = DeviceData()
@@ -880,7 +1031,7 @@ def mountstats_command(args):
 def nfsstat_command(args):
     """nfsstat-like command for NFS mount points
     """
-    mountstats = parse_stats_file(args.infile)
+    mountstats = read_stats_file(args.infile)
     mountpoints = [os.path.normpath(mp) for mp in args.mountpoints]
     v3stats = DeviceData()
     v3stats.setup_accumulator(Nfsv3ops)
@@ -916,7 +1067,7 @@ def nfsstat_command(args):
         return 1
 
     if args.since:
-        old_mountstats = parse_stats_file(args.since)
+        old_mountstats = read_stats_file(args.since)
 
     for mp in mountpoints:
         stats = DeviceData()
@@ -968,11 +1119,11 @@ def print_iostat_summary(old, new, devices, time):
 def iostat_command(args):
     """iostat-like command for NFS mount points
     """
-    mountstats = parse_stats_file(args.infile)
+    mountstats = read_stats_file(args.infile)
     devices = [os.path.normpath(mp) for mp in args.mountpoints]
 
     if args.since:
-        old_mountstats = parse_stats_file(args.since)
+        old_mountstats = read_stats_file(args.since)
     else:
         old_mountstats = None
 
@@ -1011,7 +1162,7 @@ def iostat_command(args):
             old_mountstats = mountstats
             time.sleep(args.interval)
             sample_time = args.interval
-            mountstats = parse_stats_file(args.infile)
+            mountstats = read_stats_file(args.infile)
             count -= 1
     else: 
         while True:
@@ -1019,7 +1170,7 @@ def iostat_command(args):
             old_mountstats = mountstats
             time.sleep(args.interval)
             sample_time = args.interval
-            mountstats = parse_stats_file(args.infile)
+            mountstats = read_stats_file(args.infile)
 
     args.infile.close()
     if args.since:
@@ -23,7 +23,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
 MA 02110-1301 USA
 """
 
-import sys, os, time
+import sys, os, time, struct, subprocess
 from optparse import OptionParser, OptionGroup
 
 Iostats_version = '0.2'
@@ -72,6 +72,52 @@ NfsByteCounters = [
     'writepages'
 ]
 
+# The "xprt:" fields that DeviceData keeps, after the protocol
+XprtUdpCounters = [
+    'port',
+    'bind_count',
+    'rpcsends',
+    'rpcreceives',
+    'badxids',
+    'inflightsends',
+    'backlogutil'
+]
+
+XprtTcpCounters = [
+    'port',
+    'bind_count',
+    'connect_count',
+    'connect_time',
+    'idle_time',
+    'rpcsends',
+    'rpcreceives',
+    'badxids',
+    'inflightsends',
+    'backlogutil'
+]
+
+XprtRdmaCounters = [
+    'port',
+    'bind_count',
+    'connect_count',
+    'connect_time',
+    'idle_time',
+    'rpcsends',
+    'rpcreceives',
+    'badxids',
+    'backlogutil',
+    'read_chunks',
+    'write_chunks',
+    'reply_chunks',
+    'total_rdma_req',
+    'total_rdma_rep',
+    'pullup',
+    'fixup',
+    'hardway',
+    'failed_marshal',
+    'bad_reply'
+]
+
 class DeviceData:
     """DeviceData objects provide methods for parsing and displaying
     data for a single mount grabbed from /proc/self/mountstats
@@ -171,10 +217,60 @@ class DeviceData:
             self.__rpc_data['ops'] += [op]
             self.__rpc_data[op] = [int(word) for word in words[1:]]
 
+    def __load_snapshot(self, mnt):
+        (export, mountpoint, fstype, statvers, opts, caps, nfsv4, sec,
+            rpcvers, progvers, protocol) = mnt.strings
+        self.__nfs_data['export'] = export
+        self.__nfs_data['mountpoint'] = mountpoint
+        self.__nfs_data['fstype'] = fstype
+        if fstype == 'nfs':
+            self.__nfs_data['statvers'] = statvers
+        self.__nfs_data['age'] = mnt.age
+        if opts:
+            self.__nfs_data['mountoptions'] = ''.join(opts.split()).split(',')
+        if caps:
+            self.__nfs_data['servercapabilities'] = ''.join(caps.split()).split(',')
+        if nfsv4:
+            self.__nfs_data['nfsv4flags'] = ''.join(nfsv4.split()).split(',')
+        if sec:
+            keys = ''.join(sec.split()).split(',')
+            self.__nfs_data['flavor'] = int(keys[0].split('=')[1])
+            self.__nfs_data['pseudoflavor'] = 0
+            if self.__nfs_data['flavor'] == 6:
+                self.__nfs_data['pseudoflavor'] = int(keys[1].split('=')[1])
+        self.__nfs_data.update(zip(NfsEventCounters, mnt.events))
+        self.__nfs_data.update(zip(NfsByteCounters, mnt.bytes))
+
+        if rpcvers:
+            self.__rpc_data['statsvers'] = float(rpcvers)
+            self.__rpc_data['programversion'] = progvers
+        if protocol:
+            self.__rpc_data['protocol'] = protocol
+            xprt = list(mnt.xprt)
+            if protocol == 'udp':
+                self.__rpc_data.update(zip(XprtUdpCounters, xprt))
+            elif protocol in ('tcp', 'rdma'):
+                if xprt:
+                    # as the text parser keeps it
+                    xprt[0] = str(xprt[0])
+                if protocol == 'tcp':
+                    self.__rpc_data.update(zip(XprtTcpCounters, xprt))
+                else:
+                    self.__rpc_data.update(zip(XprtRdmaCounters, xprt))
+        if mnt.ops:
+            n = mnt.nfields
+            rows = [mnt.values[i - n:i] for i in range(n, n * len(mnt.ops) + 1, n)]
+            self.__rpc_data['ops'] += mnt.ops
+            self.__rpc_data.update(zip(mnt.ops, rows))
+
     def parse_stats(self, lines):
-        """Turn a list of lines from a mount stat file into a 
-        dictionary full of stats, keyed by name
+        """Turn a list of lines from a mount stat file, or a
+        SnapshotMount, into a dictionary full of stats, keyed by name
         """
+        if isinstance(lines, SnapshotMount):
+            self.__load_snapshot(lines)
+            return
+
         found = False
         for line in lines:
             words = line.split()
@@ -467,6 +563,104 @@ def parse_stats_file(filename):
 
     return ms_dict
 
+class SnapshotMount:
+    """The stats of one mount, as loaded from an nfsstat snapshot
+    """
+    __slots__ = ['strings', 'age', 'events', 'bytes', 'xprt', 'ops',
+        'nfields', 'values']
+
+Nfsstat_paths = os.environ.get('PATH', '').split(os.pathsep) + ['/usr/sbin', '/sbin']
+Nfsstat = None
+
+def read_snapshot(filename):
+    """have nfsstat parse a mountstats file and load the binary
+    snapshot it writes into a dictionary of SnapshotMounts, keyed
+    by mount point; only NFS mounts are in it.  return None if
+    nfsstat is missing or cannot write snapshots.
+    """
+    global Nfsstat
+    if Nfsstat is None:
+        Nfsstat = ''
+        for d in Nfsstat_paths:
+            if d and os.access(os.path.join(d, 'nfsstat'), os.X_OK):
+                Nfsstat = os.path.join(d, 'nfsstat')
+                break
+    if not Nfsstat:
+        return None
+    try:
+        p = subprocess.Popen([Nfsstat, '--snapshot=' + filename],
+            stdout=subprocess.PIPE, stderr=subprocess.DEVNULL)
+        buf = p.communicate()[0]
+    except OSError:
+        Nfsstat = ''
+        return None
+    if p.returncode != 0 or buf[:8] != b'NFSMSNAP':
+        if p.returncode != 2:
+            # an nfsstat without --snapshot, so stop asking
+            Nfsstat = ''
+        return None
+
+    formats = dict()
+    def vals(off, times=1):
+        count, width = buf[off], buf[off + 1]
+        off += 2
+        if width == 0:
+            return [0] * (count * times), off
+        fmt = formats.get((count * times, width))
+        if fmt is None:
+            fmt = struct.Struct('=%d%s' % (count * times, 'I' if width == 4 else 'Q'))
+            formats[(count * times, width)] = fmt
+        return list(fmt.unpack_from(buf, off)), off + fmt.size
+
+    def string(off):
+        n = u16.unpack_from(buf, off)[0]
+        return buf[off + 2:off + 2 + n].decode('utf-8', 'replace'), off + 2 + n
+
+    u16 = struct.Struct('=H')
+    u32 = struct.Struct('=I')
+    u64 = struct.Struct('=Q')
+    version, nnames = struct.unpack_from('=II', buf, 8)
+    if version != 1:
+        return None
+    off = 16
+    names = []
+    for i in range(nnames):
+        name, off = string(off)
+        names += [name]
+    nmounts = u32.unpack_from(buf, off)[0]
+    off += 4
+
+    ms_dict = dict()
+    for i in range(nmounts):
+        mnt = SnapshotMount()
+        mnt.strings = []
+        for j in range(11):
+            s, off = string(off)
+            mnt.strings += [s]
+        mnt.age = u64.unpack_from(buf, off)[0]
+        off += 8
+        mnt.events, off = vals(off)
+        mnt.bytes, off = vals(off)
+        mnt.xprt, off = vals(off)
+        nops = u32.unpack_from(buf, off)[0]
+        off += 4
+        mnt.ops = [names[k] for k in struct.unpack_from('=%dH' % nops, buf, off)]
+        off += 2 * nops
+        mnt.nfields = buf[off]
+        mnt.values, off = vals(off, nops)
+        ms_dict[mnt.strings[1]] = mnt
+
+    return ms_dict
+
+def read_stats_file(filename):
+    """load a mountstats file with the help of nfsstat if possible,
+    as that is much quicker with many mounts, and parse it otherwise
+    """
+    ms_dict = read_snapshot(filename)
+    if ms_dict is None:
+        ms_dict = parse_stats_file(filename)
+    return ms_dict
+
 def print_iostat_summary(old, new, devices, time, options):
     stats = {}
     diff_stats = {}
@@ -475,7 +669,7 @@ def print_iostat_summary(old, new, devices, time, options):
         # Trim device list to only include intersection of old and new data,
         # this addresses umounts due to autofs mountpoints
         for device in devices:
-            if "fstype autofs" not in str(old[device]):
+            if device in old and "fstype autofs" not in str(old[device]):
                 devicelist.append(device)
     else:
         devicelist = devices
@@ -517,6 +711,9 @@ def list_nfs_mounts(givenlist, mountstats):
     devicelist = []
     if len(givenlist) > 0:
         for device in givenlist:
+            # snapshots have only NFS mounts
+            if device not in mountstats:
+                continue
             stats = DeviceData()
             stats.parse_stats(mountstats[device])
             if stats.is_nfs_mountpoint():
@@ -532,7 +729,7 @@ def list_nfs_mounts(givenlist, mountstats):
 def iostat_command(name):
     """iostat-like command for NFS mount points
     """
-    mountstats = parse_stats_file('/proc/self/mountstats')
+    mountstats = read_stats_file('/proc/self/mountstats')
     devices = []
     origdevices = []
     interval_seen = False
@@ -594,7 +791,7 @@ client are listed.
         if arg == sys.argv[0]:
             continue
 
-        if arg in mountstats:
+        if arg in mountstats or os.path.ismount(arg):
             origdevices += [arg]
         elif not interval_seen:
             try:
@@ -639,7 +836,7 @@ client are listed.
             old_mountstats = mountstats
             time.sleep(interval)
             sample_time = interval
-            mountstats = parse_stats_file('/proc/self/mountstats')
+            mountstats = read_stats_file('/proc/self/mountstats')
             # automount mountpoints add and drop, if automount is involved
             # we need to recheck the devices list when reparsing
             devices = list_nfs_mounts(origdevices,mountstats)
@@ -653,7 +850,7 @@ client are listed.
             old_mountstats = mountstats
             time.sleep(interval)
             sample_time = interval
-            mountstats = parse_stats_file('/proc/self/mountstats')
+            mountstats = read_stats_file('/proc/self/mountstats')
             # automount mountpoints add and drop, if automount is involved
             # we need to recheck the devices list when reparsing
             devices = list_nfs_mounts(origdevices,mountstats)
@@ -15,7 +15,8 @@ typedef enum {
 	MODE_ISSET,
 	MODE_DUMP,
 	MODE_SET,
-	MODE_UNSET
+	MODE_UNSET,
+	MODE_SNAPSHOT
 } confmode_t;
 
 static void usage(const char *name)
@@ -39,6 +40,9 @@ static void usage(const char *name)
 	fprintf(stderr, "      Set and Write a config value\n");
 	fprintf(stderr, "  --unset [--arg subsection] {section} {tag}\n");
 	fprintf(stderr, "      Remove an existing config value\n");
+	fprintf(stderr, "  --snapshot [outputfile]\n");
+	fprintf(stderr, "      Save the parsed configuration for the daemons to load\n");
+	fprintf(stderr, "      (Default snapshot file: " NFS_CONFSNAPSHOT ")\n");
 }
 
 int main(int argc, char **argv)
@@ -67,10 +71,11 @@ int main(int argc, char **argv)
 			{"file",  required_argument, 0, 'f' },
 			{"verbose",	no_argument, 0, 'v' },
 			{"modified", required_argument, 0, 'm' },
+			{"snapshot", optional_argument, 0, 'S' },
 			{NULL,			  0, 0, 0 }
 		};
 
-		c = getopt_long(argc, argv, "gesua:id::f:vm:", long_options, &index);
+		c = getopt_long(argc, argv, "gesua:id::f:vm:S::", long_options, &index);
 		if (c == -1) break;
 
 		switch (c) {
@@ -110,6 +115,13 @@ int main(int argc, char **argv)
 				mode = MODE_DUMP;
 				dumpfile = optarg;
 				break;
+			case 'S':
+				if (optarg == NULL && argv[optind] != NULL
+				    && argv[optind][0] != '-')
+					optarg = argv[optind++];
+				mode = MODE_SNAPSHOT;
+				dumpfile = optarg;
+				break;
 			case 'm':
 				if (optarg == NULL || *optarg == 0)
 					modified_by = NULL;
@@ -135,7 +147,7 @@ int main(int argc, char **argv)
 		return 1;
 	}
 
-	if (mode != MODE_SET && mode != MODE_UNSET) {
+	if (mode != MODE_SET && mode != MODE_UNSET && mode != MODE_SNAPSHOT) {
 		if (conf_init_file(confpath)) {
 			/* config file was missing or had an error, warn about it */
 			if (verbose || mode != MODE_ISSET) {
@@ -242,6 +254,15 @@ int main(int argc, char **argv)
 				fprintf(stderr, "Error writing config\n");
 			ret = 1;
 		}
+	} else
+	if (mode == MODE_SNAPSHOT) {
+		if (conf_snapshot_write(confpath, dumpfile)) {
+			fprintf(stderr, "Error writing snapshot of %s: %s\n",
+				confpath, strerror(errno));
+			ret = 1;
+		} else if (verbose)
+			printf("Saved snapshot of %s to %s\n", confpath,
+				dumpfile ? dumpfile : NFS_CONFSNAPSHOT);
 	} else {
 		fprintf(stderr, "Mode not yet implemented.\n");
 		ret = 2;
@@ -0,0 +1,469 @@
+/*
+ * nfsdclnts - list the opens, locks, delegations and layouts that
+ * knfsd's NFSv4 clients hold
+ *
+ * Each client directory in /proc/fs/nfsd/clients is opened once, and
+ * its states and info files are read relative to it.  A few threads
+ * read clients in parallel; each client's lines are gathered in a
+ * buffer and written out in directory order as soon as the clients
+ * before it are done, or as each client is done with --stream.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef HAVE_LIBPTHREAD
+#include <pthread.h>
+#endif
+
+#include "nfsdclients.h"
+
+#define BBOLD		"\033[1;30;47m"	/* bold black text on white */
+#define ENDC		"\033[m"
+
+#define MAX_JOBS	64
+
+enum {
+	TYPE_ALL,
+	TYPE_OPEN,
+	TYPE_DELEG,
+	TYPE_LOCK,
+	TYPE_LAYOUT,
+};
+
+static const char *type_names[] = { "all", "open", "deleg", "lock", "layout" };
+
+struct client {
+	char *			name;	/* directory, or states file with -f */
+	char *			out;
+	size_t			len;
+	int			nstates;
+	int			done;
+};
+
+struct lister {
+	struct client *		clients;
+	unsigned int		nclients, size;
+	unsigned int		next;	/* to be read */
+	unsigned int		flushed;/* written out, in order */
+	int			dfd;	/* clients directory, or AT_FDCWD */
+	int			header;	/* written */
+#ifdef HAVE_LIBPTHREAD
+	pthread_mutex_t		lock;
+#endif
+};
+
+#ifdef HAVE_LIBPTHREAD
+#define lister_lock(l)		pthread_mutex_lock(&(l)->lock)
+#define lister_unlock(l)	pthread_mutex_unlock(&(l)->lock)
+#else
+#define lister_lock(l)		do { } while (0)
+#define lister_unlock(l)	do { } while (0)
+#endif
+
+/* What is being read for one client */
+struct reading {
+	FILE *			fp;
+	int			cfd;
+	const char *		info_path;
+	int			have_info;
+	struct nfsd_client_info	info;
+	int			nstates;
+};
+
+static int show_type = TYPE_ALL;
+static int show_hostname, show_clientinfo, quiet, verbose, stream;
+
+static int has_access(void)
+{
+	return show_type != TYPE_LOCK && show_type != TYPE_LAYOUT;
+}
+
+static int has_deny(void)
+{
+	return has_access() && show_type != TYPE_DELEG;
+}
+
+static void print_header(void)
+{
+	fputs(BBOLD, stdout);
+	printf("%-13s| %-7s| ", "Inode number", "Type");
+	if (has_access())
+		printf("%-7s| ", "Access");
+	if (has_deny())
+		printf("%-5s| ", "Deny");
+	printf("%-22s| ", show_hostname ? "Hostname" : "ip address");
+	if (show_clientinfo)
+		printf("%-20s| %-5s| ", "Client ID", "vers");
+	fputs("Filename" ENDC "\n", stdout);
+}
+
+/*
+ * The last word of the client's name, up to its first dot, and cut
+ * short so as to not spoil the columns.
+ */
+static void print_hostname(FILE *fp, const char *name)
+{
+	const char *p, *word = name;
+	size_t len;
+
+	for (p = name; *p; p++)
+		if ((p[0] == ' ' || p[0] == '\t') &&
+		    p[1] && p[1] != ' ' && p[1] != '\t')
+			word = p + 1;
+	len = strcspn(word, "\".");
+	if (len > 20)
+		fprintf(fp, "%.20s..| ", word);
+	else
+		fprintf(fp, "%-22.*s| ", (int)len, word);
+}
+
+static void print_state(const struct nfsd_client_state *st, void *arg)
+{
+	struct reading *r = arg;
+	const struct nfsd_client_info *info = &r->info;
+	const char *p, *type = st->cs_type ? st->cs_type : "";
+	size_t len = 0;
+
+	r->nstates++;
+	if (show_type != TYPE_ALL && strcmp(type, type_names[show_type]) != 0)
+		return;
+
+	if (!r->have_info) {
+		/* clients without states are common; only then is info read */
+		if (nfsd_client_read_info(r->cfd, r->info_path, &r->info) < 0 &&
+		    verbose)
+			fprintf(stderr, "nfsdclnts: %s: %s\n", r->info_path,
+				strerror(errno));
+		r->have_info = 1;
+	}
+
+	p = st->cs_superblock ? strrchr(st->cs_superblock, ':') : NULL;
+	fprintf(r->fp, "%-13s| %-7s| ", p ? p + 1 :
+		st->cs_superblock ? st->cs_superblock : "N/A", type);
+	if (has_access())
+		fprintf(r->fp, "%-7s| ", st->cs_access ? st->cs_access : "");
+	if (has_deny())
+		fprintf(r->fp, "%-5s| ", st->cs_deny ? st->cs_deny : "");
+
+	if (show_hostname && info->ci_name)
+		print_hostname(r->fp, info->ci_name);
+	else if (show_hostname || !info->ci_address)
+		fprintf(r->fp, "%-22s| ", "N/A");
+	else {
+		/* the address is quoted */
+		p = info->ci_address;
+		len = strlen(p);
+		if (len >= 2 && p[0] == '"' && p[len - 1] == '"') {
+			p++;
+			len -= 2;
+		}
+		fprintf(r->fp, "%-22.*s| ", (int)len, p);
+	}
+	if (show_clientinfo) {
+		fprintf(r->fp, "%-20s| ",
+			info->ci_clientid ? info->ci_clientid : "N/A");
+		if (info->ci_minorversion >= 0)
+			fprintf(r->fp, "4.%-3d| ", info->ci_minorversion);
+		else
+			fprintf(r->fp, "%-5s| ", "N/A");
+	}
+
+	/*
+	 * A file held open across a server reboot is shown as "/"; one
+	 * from a kernel too old to give file names has none.
+	 */
+	if (!st->cs_filename)
+		fputs("N/A\n", r->fp);
+	else if (strcmp(st->cs_filename, "/") == 0)
+		fputs("disconnected dentry\n", r->fp);
+	else {
+		p = strrchr(st->cs_filename, '/');
+		fprintf(r->fp, "%s\n", p ? p + 1 : st->cs_filename);
+	}
+}
+
+static void read_client(struct lister *l, struct client *c)
+{
+	struct reading r;
+	char *info_path = NULL;
+	const char *states = "states", *slash;
+
+	memset(&r, 0, sizeof(r));
+	r.info_path = "info";
+	r.cfd = -1;
+	c->nstates = -1;
+
+	if (l->dfd == AT_FDCWD) {
+		/* the info file is next to the states file given */
+		states = c->name;
+		slash = strrchr(c->name, '/');
+		if (slash && asprintf(&info_path, "%.*s/info",
+				      (int)(slash - c->name), c->name) < 0)
+			return;
+		if (info_path)
+			r.info_path = info_path;
+		r.cfd = AT_FDCWD;
+	} else {
+		r.cfd = openat(l->dfd, c->name,
+			       O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (r.cfd < 0) {
+			/* the client went away */
+			if (verbose)
+				fprintf(stderr, "nfsdclnts: %s/%s: %s\n",
+					NFSD_CLIENTS_DIR, c->name,
+					strerror(errno));
+			return;
+		}
+	}
+
+	r.fp = open_memstream(&c->out, &c->len);
+	if (r.fp) {
+		if (nfsd_client_read_states(r.cfd, states, print_state,
+					    &r) == 0)
+			c->nstates = r.nstates;
+		else if (verbose)
+			fprintf(stderr, "nfsdclnts: %s%s%s: %s\n",
+				l->dfd == AT_FDCWD ? "" : c->name,
+				l->dfd == AT_FDCWD ? "" : "/", states,
+				strerror(errno));
+		fclose(r.fp);
+	}
+
+	nfsd_client_free_info(&r.info);
+	if (r.cfd >= 0)
+		close(r.cfd);
+	free(info_path);
+}
+
+/* Called with the lister locked */
+static void write_client(struct lister *l, struct client *c)
+{
+	if (c->nstates > 0 && !l->header) {
+		l->header = 1;
+		if (!quiet)
+			print_header();
+	}
+	if (c->len)
+		fwrite(c->out, 1, c->len, stdout);
+	free(c->out);
+	c->out = NULL;
+}
+
+static void *lister_worker(void *arg)
+{
+	struct lister *l = arg;
+	struct client *c;
+
+	lister_lock(l);
+	while (l->next < l->nclients) {
+		c = &l->clients[l->next++];
+		lister_unlock(l);
+
+		read_client(l, c);
+
+		lister_lock(l);
+		c->done = 1;
+		if (stream)
+			write_client(l, c);
+		else
+			while (l->flushed < l->nclients &&
+			       l->clients[l->flushed].done)
+				write_client(l, &l->clients[l->flushed++]);
+	}
+	lister_unlock(l);
+	return NULL;
+}
+
+static void list_clients(struct lister *l, unsigned int jobs)
+{
+#ifdef HAVE_LIBPTHREAD
+	pthread_t threads[MAX_JOBS];
+	unsigned int i, started = 0;
+
+	pthread_mutex_init(&l->lock, NULL);
+	for (i = 1; i < jobs && i < l->nclients; i++) {
+		if (pthread_create(&threads[started], NULL,
+				   lister_worker, l) != 0)
+			break;
+		started++;
+	}
+	lister_worker(l);
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+	pthread_mutex_destroy(&l->lock);
+#else
+	(void)jobs;
+	lister_worker(l);
+#endif
+}
+
+static int add_client(struct lister *l, const char *name)
+{
+	struct client *new;
+	unsigned int size;
+
+	if (l->nclients == l->size) {
+		size = l->size ? l->size * 2 : 256;
+		new = realloc(l->clients, size * sizeof(*new));
+		if (!new)
+			return -1;
+		l->clients = new;
+		l->size = size;
+	}
+	memset(&l->clients[l->nclients], 0, sizeof(*new));
+	l->clients[l->nclients].name = strdup(name);
+	if (!l->clients[l->nclients].name)
+		return -1;
+	l->nclients++;
+	return 0;
+}
+
+static int read_clients_dir(struct lister *l)
+{
+	struct dirent *de;
+	DIR *dir;
+	int fd;
+
+	l->dfd = open(NFSD_CLIENTS_DIR, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (l->dfd < 0)
+		goto out_err;
+	fd = dup(l->dfd);
+	dir = fd < 0 ? NULL : fdopendir(fd);
+	if (!dir) {
+		if (fd >= 0)
+			close(fd);
+		goto out_err;
+	}
+	while ((de = readdir(dir)) != NULL) {
+		if (de->d_name[0] == '.')
+			continue;
+		if (add_client(l, de->d_name) < 0) {
+			closedir(dir);
+			errno = ENOMEM;
+			goto out_err;
+		}
+	}
+	closedir(dir);
+	return 0;
+
+out_err:
+	fprintf(stderr, "nfsdclnts: %s: %s\n", NFSD_CLIENTS_DIR,
+		strerror(errno));
+	return -1;
+}
+
+static void usage(const char *progname)
+{
+	fprintf(stderr, "Usage: %s [-t type] [--clientinfo] [--hostname] "
+			"[-q] [-v] [-j jobs] [--stream]\n"
+			"\t\t[-f states ...]\n", progname);
+	fprintf(stderr, "  type is one of open, deleg, lock, layout, "
+			"or all\n");
+	exit(2);
+}
+
+static const struct option longopts[] = {
+	{ "type", 1, NULL, 't' },
+	{ "clientinfo", 0, NULL, 'c' },
+	{ "hostname", 0, NULL, 'n' },
+	{ "quiet", 0, NULL, 'q' },
+	{ "verbose", 0, NULL, 'v' },
+	{ "file", 0, NULL, 'f' },
+	{ "jobs", 1, NULL, 'j' },
+	{ "stream", 0, NULL, 's' },
+	{ "help", 0, NULL, 'h' },
+	{ NULL, 0, NULL, 0 }
+};
+
+int main(int argc, char **argv)
+{
+	struct lister l;
+	unsigned int i;
+	long jobs;
+	char *end;
+	int c, files = 0;
+
+	jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	while ((c = getopt_long(argc, argv, "t:qvfj:sh", longopts,
+				NULL)) != -1) {
+		switch (c) {
+		case 't':
+			for (i = 0; i < sizeof(type_names) / sizeof(*type_names);
+			     i++)
+				if (strcmp(optarg, type_names[i]) == 0)
+					break;
+			if (i == sizeof(type_names) / sizeof(*type_names))
+				usage(argv[0]);
+			show_type = i;
+			break;
+		case 'c':
+			show_clientinfo = 1;
+			break;
+		case 'n':
+			show_hostname = 1;
+			break;
+		case 'q':
+			quiet = 1;
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		case 'f':
+			files = 1;
+			break;
+		case 'j':
+			jobs = strtol(optarg, &end, 10);
+			if (*optarg == '\0' || *end != '\0' || jobs < 1)
+				usage(argv[0]);
+			break;
+		case 's':
+			stream = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (jobs < 1)
+		jobs = 1;
+	if (jobs > MAX_JOBS)
+		jobs = MAX_JOBS;
+	if (files != (optind < argc))
+		usage(argv[0]);
+
+	memset(&l, 0, sizeof(l));
+	if (files) {
+		l.dfd = AT_FDCWD;
+		for (; optind < argc; optind++)
+			if (add_client(&l, argv[optind]) < 0) {
+				fprintf(stderr, "nfsdclnts: %s\n",
+					strerror(ENOMEM));
+				return 1;
+			}
+	} else {
+		if (read_clients_dir(&l) < 0)
+			return 1;
+		if (l.nclients == 0) {
+			fprintf(stderr, "Nothing to process\n");
+			return 1;
+		}
+	}
+
+	list_clients(&l, jobs);
+
+	for (i = 0; i < l.nclients; i++)
+		free(l.clients[i].name);
+	free(l.clients);
+	if (l.dfd >= 0)
+		close(l.dfd);
+	return fflush(stdout) == 0 ? 0 : 1;
+}
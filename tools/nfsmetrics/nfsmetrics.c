@@ -0,0 +1,424 @@
+/*
+ * nfsmetrics - read the metrics served by the nfs-utils daemons
+ *
+ * Each daemon started with "metrics" set in nfs.conf listens on a unix
+ * socket in NFSMETRICS_DIR, and writes out all of its metrics to
+ * anyone who connects.  This reads one or all of them and prints them
+ * for a person, or in the Prometheus text exposition format.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <dirent.h>
+#include <errno.h>
+#include <getopt.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "nfsmetrics.h"
+
+struct metric {
+	char *			name;
+	char *			help;
+	int			histogram;
+	unsigned long		count, sum;
+	unsigned long		buckets[NFSMETRIC_BUCKETS];
+};
+
+struct dump {
+	char			service[64];
+	long			pid, uptime;
+	struct metric *		metrics;
+	unsigned int		nmetrics;
+};
+
+static const char *metrics_dir = NFSMETRICS_DIR;
+
+static char *metrics_read(const char *path)
+{
+	struct sockaddr_un sun;
+	size_t len = 0, size = 8192;
+	char *buf, *new;
+	ssize_t n;
+	int fd;
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	if ((size_t)snprintf(sun.sun_path, sizeof(sun.sun_path), "%s",
+			path) >= sizeof(sun.sun_path)) {
+		fprintf(stderr, "nfsmetrics: %s: name too long\n", path);
+		return NULL;
+	}
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0 || connect(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0) {
+		fprintf(stderr, "nfsmetrics: %s: %s\n", path, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return NULL;
+	}
+
+	buf = malloc(size);
+	while (buf != NULL) {
+		if (len + 1 >= size) {
+			size *= 2;
+			new = realloc(buf, size);
+			if (new == NULL) {
+				free(buf);
+				buf = NULL;
+				break;
+			}
+			buf = new;
+		}
+		n = read(fd, buf + len, size - len - 1);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		len += n;
+	}
+	close(fd);
+	if (buf == NULL)
+		fprintf(stderr, "nfsmetrics: no memory\n");
+	else
+		buf[len] = '\0';
+	return buf;
+}
+
+static struct metric *metrics_add(struct dump *d, const char *name)
+{
+	struct metric *m;
+
+	m = realloc(d->metrics, (d->nmetrics + 1) * sizeof(*m));
+	if (m == NULL)
+		return NULL;
+	d->metrics = m;
+	m = &d->metrics[d->nmetrics++];
+	memset(m, 0, sizeof(*m));
+	m->name = strdup(name);
+	return m;
+}
+
+/* Parse @buf, the reply of one daemon, into @d; @buf is modified */
+static int metrics_parse(char *buf, struct dump *d)
+{
+	char *line, *next, *help = NULL, *p;
+	struct metric *m;
+	char name[256];
+	int i, n;
+
+	memset(d, 0, sizeof(*d));
+	for (line = buf; line && *line; line = next) {
+		next = strchr(line, '\n');
+		if (next)
+			*next++ = '\0';
+
+		if (sscanf(line, "# nfsmetrics %63s %ld %ld", d->service,
+				&d->pid, &d->uptime) == 3)
+			continue;
+		if (strncmp(line, "# HELP ", 7) == 0) {
+			help = line + 7;
+			continue;
+		}
+		if (sscanf(line, "counter %255s %n", name, &n) == 1) {
+			m = metrics_add(d, name);
+			if (m == NULL)
+				return -1;
+			m->count = strtoul(line + n, NULL, 10);
+		} else if (sscanf(line, "histogram %255s %n", name, &n) == 1) {
+			m = metrics_add(d, name);
+			if (m == NULL)
+				return -1;
+			m->histogram = 1;
+			p = line + n;
+			m->count = strtoul(p, &p, 10);
+			m->sum = strtoul(p, &p, 10);
+			for (i = 0; i < NFSMETRIC_BUCKETS; i++)
+				m->buckets[i] = strtoul(p, &p, 10);
+		} else
+			continue;
+
+		/* A HELP line belongs to the metric right after it */
+		if (help && (p = strchr(help, ' ')) != NULL &&
+		    (size_t)(p - help) == strlen(name) &&
+		    strncmp(help, name, p - help) == 0)
+			m->help = strdup(p + 1);
+		help = NULL;
+	}
+	return d->service[0] ? 0 : -1;
+}
+
+static void metrics_free(struct dump *d)
+{
+	unsigned int i;
+
+	for (i = 0; i < d->nmetrics; i++) {
+		free(d->metrics[i].name);
+		free(d->metrics[i].help);
+	}
+	free(d->metrics);
+}
+
+/* Upper bound, in us, of the bucket holding the @pct percentile */
+static unsigned long metrics_percentile(const struct metric *m, int pct)
+{
+	unsigned long want, seen = 0;
+	int i;
+
+	want = (m->count * pct + 99) / 100;
+	for (i = 0; i < NFSMETRIC_BUCKETS - 1; i++) {
+		seen += m->buckets[i];
+		if (seen >= want)
+			return 1UL << i;
+	}
+	return 0;	/* in the last, unbounded, bucket */
+}
+
+static void metrics_print_text(const struct dump *d)
+{
+	const struct metric *m;
+	unsigned long p50, p99;
+	unsigned int i;
+
+	printf("%s (pid %ld, up %lds)\n", d->service, d->pid, d->uptime);
+	for (i = 0; i < d->nmetrics; i++) {
+		m = &d->metrics[i];
+		if (!m->histogram) {
+			printf("  %-32s %lu\n", m->name, m->count);
+			continue;
+		}
+		if (m->count == 0) {
+			printf("  %-32s 0\n", m->name);
+			continue;
+		}
+		p50 = metrics_percentile(m, 50);
+		p99 = metrics_percentile(m, 99);
+		printf("  %-32s %lu, avg %luus", m->name, m->count,
+			m->sum / m->count);
+		if (p50)
+			printf(", p50 <%luus", p50);
+		if (p99)
+			printf(", p99 <%luus", p99);
+		else
+			printf(", p99 >=%luus", 1UL << (NFSMETRIC_BUCKETS - 2));
+		putchar('\n');
+	}
+}
+
+static void metrics_prom_name(const char *name)
+{
+	const char *p;
+
+	fputs("nfsutils_", stdout);
+	for (p = name; *p; p++)
+		putchar((*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z') ||
+			(*p >= '0' && *p <= '9') || *p == '_' ? *p : '_');
+}
+
+/*
+ * Prometheus wants every sample of one metric together, so walk the
+ * metrics of all the daemons by name, printing each name once.
+ */
+static void metrics_print_prom(const struct dump *dumps, unsigned int ndumps)
+{
+	const struct metric *m, *first;
+	unsigned int i, j, k, l;
+	unsigned long cum;
+	int b, seen;
+
+	for (i = 0; i < ndumps; i++)
+		for (j = 0; j < dumps[i].nmetrics; j++) {
+			first = &dumps[i].metrics[j];
+
+			/* Printed already, with an earlier daemon? */
+			for (seen = 0, k = 0; k < i && !seen; k++)
+				for (l = 0; l < dumps[k].nmetrics; l++)
+					if (strcmp(dumps[k].metrics[l].name,
+						   first->name) == 0)
+						seen = 1;
+			if (seen)
+				continue;
+
+			if (first->help) {
+				fputs("# HELP ", stdout);
+				metrics_prom_name(first->name);
+				printf(" %s\n", first->help);
+			}
+			fputs("# TYPE ", stdout);
+			metrics_prom_name(first->name);
+			printf(" %s\n", first->histogram ? "histogram" : "counter");
+
+			for (k = i; k < ndumps; k++)
+				for (l = 0; l < dumps[k].nmetrics; l++) {
+					m = &dumps[k].metrics[l];
+					if (strcmp(m->name, first->name) != 0 ||
+					    m->histogram != first->histogram)
+						continue;
+					if (!m->histogram) {
+						metrics_prom_name(m->name);
+						printf("{daemon=\"%s\"} %lu\n",
+							dumps[k].service, m->count);
+						continue;
+					}
+					for (cum = 0, b = 0; b < NFSMETRIC_BUCKETS - 1; b++) {
+						cum += m->buckets[b];
+						metrics_prom_name(m->name);
+						printf("_bucket{daemon=\"%s\",le=\"%g\"} %lu\n",
+							dumps[k].service,
+							(double)(1UL << b) / 1e6, cum);
+					}
+					metrics_prom_name(m->name);
+					printf("_bucket{daemon=\"%s\",le=\"+Inf\"} %lu\n",
+						dumps[k].service, m->count);
+					metrics_prom_name(m->name);
+					printf("_sum{daemon=\"%s\"} %g\n",
+						dumps[k].service, m->sum / 1e6);
+					metrics_prom_name(m->name);
+					printf("_count{daemon=\"%s\"} %lu\n",
+						dumps[k].service, m->count);
+				}
+		}
+}
+
+static int metrics_scrape(const char *path, struct dump **dumps,
+		unsigned int *ndumps)
+{
+	struct dump *new;
+	char *buf;
+
+	buf = metrics_read(path);
+	if (buf == NULL)
+		return -1;
+	new = realloc(*dumps, (*ndumps + 1) * sizeof(**dumps));
+	if (new == NULL) {
+		free(buf);
+		return -1;
+	}
+	*dumps = new;
+	if (metrics_parse(buf, &new[*ndumps]) < 0) {
+		fprintf(stderr, "nfsmetrics: %s: bad reply\n", path);
+		metrics_free(&new[*ndumps]);
+		free(buf);
+		return -1;
+	}
+	(*ndumps)++;
+	free(buf);
+	return 0;
+}
+
+static int metrics_cmp(const void *a, const void *b)
+{
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/* Scrape every socket in metrics_dir, in name order */
+static int metrics_scrape_all(struct dump **dumps, unsigned int *ndumps)
+{
+	size_t slen = strlen(NFSMETRICS_SUFFIX), len;
+	char **names = NULL, **new, path[PATH_MAX];
+	unsigned int i, n = 0;
+	struct dirent *de;
+	int ret = 0;
+	DIR *dir;
+
+	dir = opendir(metrics_dir);
+	if (dir == NULL) {
+		fprintf(stderr, "nfsmetrics: %s: %s\n", metrics_dir,
+			strerror(errno));
+		return -1;
+	}
+	while ((de = readdir(dir)) != NULL) {
+		len = strlen(de->d_name);
+		if (len <= slen ||
+		    strcmp(de->d_name + len - slen, NFSMETRICS_SUFFIX) != 0)
+			continue;
+		new = realloc(names, (n + 1) * sizeof(*names));
+		if (new == NULL)
+			break;
+		names = new;
+		names[n] = strdup(de->d_name);
+		if (names[n] != NULL)
+			n++;
+	}
+	closedir(dir);
+
+	qsort(names, n, sizeof(*names), metrics_cmp);
+	for (i = 0; i < n; i++) {
+		snprintf(path, sizeof(path), "%s/%s", metrics_dir, names[i]);
+		if (metrics_scrape(path, dumps, ndumps) < 0)
+			ret = -1;
+		free(names[i]);
+	}
+	free(names);
+	if (n == 0) {
+		fprintf(stderr, "nfsmetrics: no daemon is serving metrics in %s\n",
+			metrics_dir);
+		ret = -1;
+	}
+	return ret;
+}
+
+static void usage(const char *progname)
+{
+	fprintf(stderr, "Usage: %s [-p] [-d directory] [daemon ...]\n",
+		progname);
+	exit(2);
+}
+
+static const struct option longopts[] = {
+	{ "prometheus", 0, NULL, 'p' },
+	{ "directory", 1, NULL, 'd' },
+	{ "help", 0, NULL, 'h' },
+	{ NULL, 0, NULL, 0 }
+};
+
+int main(int argc, char **argv)
+{
+	struct dump *dumps = NULL;
+	unsigned int i, ndumps = 0;
+	char path[PATH_MAX];
+	int c, prom = 0, ret = 0;
+
+	while ((c = getopt_long(argc, argv, "pd:h", longopts, NULL)) != -1) {
+		switch (c) {
+		case 'p':
+			prom = 1;
+			break;
+		case 'd':
+			metrics_dir = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (optind == argc)
+		ret = metrics_scrape_all(&dumps, &ndumps);
+	for (; optind < argc; optind++) {
+		if (strchr(argv[optind], '/'))
+			snprintf(path, sizeof(path), "%s", argv[optind]);
+		else
+			snprintf(path, sizeof(path), "%s/%s%s", metrics_dir,
+				 argv[optind], NFSMETRICS_SUFFIX);
+		if (metrics_scrape(path, &dumps, &ndumps) < 0)
+			ret = -1;
+	}
+
+	if (prom)
+		metrics_print_prom(dumps, ndumps);
+	else
+		for (i = 0; i < ndumps; i++)
+			metrics_print_text(&dumps[i]);
+
+	for (i = 0; i < ndumps; i++)
+		metrics_free(&dumps[i]);
+	free(dumps);
+	return ret < 0 ? 1 : 0;
+}
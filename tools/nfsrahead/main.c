@@ -3,6 +3,11 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <netdb.h>
+#include <limits.h>
+#include <time.h>
 
 #include <libmount/libmount.h>
 #include <sys/sysmacros.h>
@@ -14,8 +19,19 @@
 #define MOUNTINFO_PATH "/proc/self/mountinfo"
 #endif
 
+#ifndef BDI_PATH
+#define BDI_PATH "/sys/class/bdi"
+#endif
+
+#ifndef MOUNTSTATS_PATH
+#define MOUNTSTATS_PATH "/proc/self/mountstats"
+#endif
+
 #define CONF_NAME "nfsrahead"
 #define NFS_DEFAULT_READAHEAD 128
+#define NFS_ADAPTIVE_MAX_READAHEAD 16384
+/* intervals with less read from the server than this say too little */
+#define NFS_ADAPTIVE_MIN_BYTES (4ULL << 20)
 
 /* Device information from the system */
 struct device_info {
@@ -23,6 +39,7 @@ struct device_info {
 	dev_t dev;
 	char *mountpoint;
 	char *fstype;
+	char *source;
 };
 
 /* Convert a string in the format n:m to a device number */
@@ -62,6 +79,7 @@ static void init_device_info(struct device_info *di, const char *device_number)
 	di->dev = 0;
 	di->mountpoint = NULL;
 	di->fstype = NULL;
+	di->source = NULL;
 }
 
 
@@ -69,6 +87,7 @@ static void free_device_info(struct device_info *di)
 {
 	sfree(di->mountpoint);
 	sfree(di->fstype);
+	sfree(di->source);
 	sfree(di->device_number);
 }
 
@@ -104,6 +123,9 @@ static int get_mountinfo(const char *device_number, struct device_info *device_i
 	target = (char *)mnt_fs_get_fstype(fs);
 	if (target)
 		device_info->fstype = strdup(target);
+	target = (char *)mnt_fs_get_source(fs);
+	if (target)
+		device_info->source = strdup(target);
 
 out_free_fs:
 	mnt_free_fs(fs);
@@ -115,40 +137,428 @@ out_free_device_info:
 	return ret;
 }
 
+/*
+ * The bdi can show up before the mount does, so give mountinfo a
+ * moment to catch up; each try parses all of it.  NFS always uses an
+ * anonymous device, so the bdis of disks are given up on at once.
+ */
 static int get_device_info(const char *device_number, struct device_info *device_info)
 {
+	struct timespec pause = { .tv_nsec = 20 * 1000 * 1000 };
 	int ret = ENOENT;
-	for (int retry_count = 0; retry_count < 10 && ret != 0; retry_count++)
+
+	if (strncmp(device_number, "0:", 2) != 0) {
+		init_device_info(device_info, device_number);
+		return ret;
+	}
+
+	for (int retry_count = 0; retry_count < 20; retry_count++) {
+		if (retry_count) {
+			free_device_info(device_info);
+			nanosleep(&pause, NULL);
+		}
 		ret = get_mountinfo(device_number, device_info, MOUNTINFO_PATH);
+		if (ret == 0)
+			break;
+	}
 
 	return ret;
 }
 
-static int conf_get_readahead(const char *kind) {
+/* Look up 'tag' for the export, then the server, then for every mount */
+static int conf_get_policy(const char *source, const char *tag)
+{
+	char server[NI_MAXHOST], *value, *p;
+	size_t len;
+
+	if (source) {
+		value = conf_get_section(CONF_NAME, source, tag);
+		if (value)
+			return atoi(value);
+
+		if (source[0] == '[' && (p = strchr(source, ']')) != NULL)
+			len = p - source + 1;
+		else
+			len = strcspn(source, ":");
+		if (len < sizeof(server) && source[len] == ':') {
+			memcpy(server, source, len);
+			server[len] = '\0';
+			value = conf_get_section(CONF_NAME, server, tag);
+			if (value)
+				return atoi(value);
+		}
+	}
+	return conf_get_num(CONF_NAME, tag, -1);
+}
+
+static int conf_get_readahead(const char *kind, const char *source) {
 	int readahead = 0;
 
-	if((readahead = conf_get_num(CONF_NAME, kind, -1)) == -1)
-		readahead = conf_get_num(CONF_NAME, "default", NFS_DEFAULT_READAHEAD);
-	
+	if ((readahead = conf_get_policy(source, kind)) == -1 &&
+	    (readahead = conf_get_policy(source, "default")) == -1)
+		readahead = NFS_DEFAULT_READAHEAD;
+
 	return readahead;
 }
 
+static int set_readahead(dev_t dev, int readahead)
+{
+	char path[64], value[16];
+	int fd, len, ret = 0;
+
+	snprintf(path, sizeof(path), BDI_PATH "/%u:%u/read_ahead_kb",
+		 major(dev), minor(dev));
+	fd = open(path, O_WRONLY);
+	if (fd < 0)
+		return errno;
+	len = snprintf(value, sizeof(value), "%d\n", readahead);
+	if (write(fd, value, len) != len)
+		ret = errno;
+	close(fd);
+	return ret;
+}
+
+/* What is known of each NFS mount while watching */
+struct ra_mount {
+	dev_t dev;
+	char *target;
+	int readahead;
+	int min, max;		/* bounds for adaptive readahead */
+	int sampled;
+	unsigned long long normal, direct, server;	/* bytes read */
+	unsigned long long reads, readbytes;		/* READ ops */
+};
+
+struct ra_mounts {
+	struct ra_mount *mounts;	/* sorted by dev */
+	size_t count;
+	struct ra_mount **bytarget;	/* sorted by target */
+};
+
+static int cmp_dev(const void *a, const void *b)
+{
+	dev_t da = ((const struct ra_mount *)a)->dev;
+	dev_t db = ((const struct ra_mount *)b)->dev;
+
+	return da < db ? -1 : da > db;
+}
+
+static int cmp_target(const void *a, const void *b)
+{
+	return strcmp((*(struct ra_mount * const *)a)->target,
+		      (*(struct ra_mount * const *)b)->target);
+}
+
+/*
+ * Set the readahead of each NFS mount in mountinfo that is not in
+ * 'rm', and then make 'rm' the mounts that are there now, so that
+ * each mount is only set once however often mountinfo changes.
+ */
+static int scan_mounts(struct ra_mounts *rm)
+{
+	struct libmnt_table *mnttbl;
+	struct libmnt_iter *iter;
+	struct libmnt_fs *fs;
+	struct ra_mount *now = NULL, **bytarget;
+	size_t nnow = 0, maxnow = 0, i;
+	int ret = 0;
+
+	mnttbl = mnt_new_table();
+	iter = mnt_new_iter(MNT_ITER_FORWARD);
+	if (!mnttbl || !iter) {
+		ret = ENOMEM;
+		goto out;
+	}
+	if ((ret = mnt_table_parse_file(mnttbl, MOUNTINFO_PATH)) < 0) {
+		xlog(L_ERROR, "Failed to parse %s", MOUNTINFO_PATH);
+		goto out;
+	}
+
+	while (mnt_table_next_fs(mnttbl, iter, &fs) == 0) {
+		const char *fstype = mnt_fs_get_fstype(fs);
+		const char *source = mnt_fs_get_source(fs);
+		struct ra_mount key, *old, *m;
+
+		if (!fstype || strncmp("nfs", fstype, 3) != 0 ||
+		    !strcmp(fstype, "nfsd"))
+			continue;
+
+		if (nnow == maxnow) {
+			size_t newmax = maxnow ? maxnow * 2 : 64;
+			struct ra_mount *new = realloc(now, newmax * sizeof(*new));
+
+			if (!new) {
+				ret = ENOMEM;
+				goto out;
+			}
+			now = new;
+			maxnow = newmax;
+		}
+
+		key.dev = mnt_fs_get_devno(fs);
+		old = bsearch(&key, rm->mounts, rm->count, sizeof(key), cmp_dev);
+		m = &now[nnow];
+		if (old && old->target) {
+			*m = *old;
+			old->target = NULL;
+			nnow++;
+			continue;
+		}
+
+		memset(m, 0, sizeof(*m));
+		m->dev = key.dev;
+		m->target = strdup(mnt_fs_get_target(fs));
+		if (!m->target) {
+			ret = ENOMEM;
+			goto out;
+		}
+		nnow++;
+		m->readahead = conf_get_readahead(fstype, source);
+		if ((m->min = conf_get_policy(source, "adaptive-min")) == -1)
+			m->min = NFS_DEFAULT_READAHEAD;
+		if ((m->max = conf_get_policy(source, "adaptive-max")) == -1)
+			m->max = NFS_ADAPTIVE_MAX_READAHEAD;
+
+		if (set_readahead(m->dev, m->readahead))
+			xlog(L_WARNING, "unable to set %s readahead: %m",
+			     m->target);
+		else
+			xlog(D_FAC7, "setting %s readahead to %d",
+			     m->target, m->readahead);
+	}
+
+	bytarget = realloc(rm->bytarget, (nnow ? nnow : 1) * sizeof(*bytarget));
+	if (!bytarget) {
+		ret = ENOMEM;
+		goto out;
+	}
+	qsort(now, nnow, sizeof(*now), cmp_dev);
+	for (i = 0; i < nnow; i++)
+		bytarget[i] = &now[i];
+	qsort(bytarget, nnow, sizeof(*bytarget), cmp_target);
+
+	for (i = 0; i < rm->count; i++)
+		sfree(rm->mounts[i].target);
+	free(rm->mounts);
+	rm->mounts = now;
+	rm->count = nnow;
+	rm->bytarget = bytarget;
+	now = NULL;
+	nnow = 0;
+out:
+	for (i = 0; i < nnow; i++)
+		sfree(now[i].target);
+	free(now);
+	mnt_free_iter(iter);
+	mnt_free_table(mnttbl);
+	return ret;
+}
+
+/* mountstats writes space, tab, newline and backslash as \ooo */
+static void unescape(char *s)
+{
+	char *d = s;
+
+	for (; *s; s++) {
+		if (s[0] == '\\' && s[1] >= '0' && s[1] <= '3' &&
+		    s[2] >= '0' && s[2] <= '7' && s[3] >= '0' && s[3] <= '7') {
+			*d++ = (s[1] - '0') << 6 | (s[2] - '0') << 3 | (s[3] - '0');
+			s += 3;
+		} else
+			*d++ = *s;
+	}
+	*d = '\0';
+}
+
+/*
+ * Streaming reads are READs as large as rsize where little of what was
+ * read ahead goes unused; random reads leave much of it unused.  So
+ * double the readahead of the first, and halve that of the second.
+ */
+static void adapt_readahead(struct ra_mount *m, unsigned long long rsize,
+			    unsigned long long normal, unsigned long long direct,
+			    unsigned long long server, unsigned long long reads,
+			    unsigned long long readbytes)
+{
+	unsigned long long dnormal, dserver, dreads, dbytes, used, unused;
+	int readahead = m->readahead;
+
+	if (!m->sampled || server < m->server || normal < m->normal ||
+	    direct < m->direct || reads < m->reads || readbytes < m->readbytes)
+		goto out;
+
+	dnormal = normal - m->normal;
+	dserver = server - m->server;
+	dreads = reads - m->reads;
+	dbytes = readbytes - m->readbytes;
+	if (dserver < NFS_ADAPTIVE_MIN_BYTES || dreads == 0)
+		goto out;
+
+	used = dnormal + (direct - m->direct);
+	unused = dserver > used ? dserver - used : 0;
+	if (unused * 4 > dserver)
+		readahead /= 2;
+	else if (unused * 20 < dserver && rsize && dbytes / dreads * 4 >= rsize * 3)
+		readahead *= 2;
+	if (readahead < m->min)
+		readahead = m->min;
+	if (readahead > m->max)
+		readahead = m->max;
+	if (readahead == m->readahead)
+		goto out;
+
+	if (set_readahead(m->dev, readahead))
+		xlog(L_WARNING, "unable to set %s readahead: %m", m->target);
+	else {
+		xlog(D_FAC7, "setting %s readahead to %d: %llu of %llu kB read "
+		     "unused, READs of %llu kB", m->target, readahead,
+		     unused >> 10, dserver >> 10, dbytes / dreads >> 10);
+		m->readahead = readahead;
+	}
+out:
+	m->normal = normal;
+	m->direct = direct;
+	m->server = server;
+	m->reads = reads;
+	m->readbytes = readbytes;
+	m->sampled = 1;
+}
+
+/*
+ * Work through mountstats a mount at a time; the counters of a mount
+ * are only used once the next one starts, or the file ends.
+ */
+static void sample_mounts(struct ra_mounts *rm)
+{
+	unsigned long long rsize = 0, v[8], reads = 0, readbytes = 0;
+	unsigned long long normal = 0, direct = 0, server = 0;
+	struct ra_mount *m = NULL, key, *keyp = &key, **found;
+	char line[4096], dir[PATH_MAX], type[32], *p;
+	FILE *f;
+	int last;
+
+	f = fopen(MOUNTSTATS_PATH, "r");
+	if (!f) {
+		xlog(L_WARNING, "unable to open %s: %m", MOUNTSTATS_PATH);
+		return;
+	}
+	do {
+		last = !fgets(line, sizeof(line), f);
+		if (!last && strncmp(line, "device ", 7) != 0) {
+			if (!m)
+				continue;
+			for (p = line; *p == ' ' || *p == '\t'; p++)
+				;
+			if (!strncmp(p, "opts:", 5) &&
+			    (p = strstr(p, ",rsize=")) != NULL)
+				rsize = strtoull(p + 7, NULL, 10);
+			else if (sscanf(p, "bytes: %llu %llu %llu %llu %llu",
+					&v[0], &v[1], &v[2], &v[3], &v[4]) == 5) {
+				normal = v[0];
+				direct = v[2];
+				server = v[4];
+			} else if (sscanf(p, "READ: %llu %llu %llu %llu %llu",
+					  &v[0], &v[1], &v[2], &v[3], &v[4]) == 5) {
+				reads = v[0];
+				readbytes = v[4];
+			}
+			continue;
+		}
+
+		if (m)
+			adapt_readahead(m, rsize, normal, direct, server,
+					reads, readbytes);
+		m = NULL;
+		rsize = normal = direct = server = reads = readbytes = 0;
+		if (last ||
+		    sscanf(line, "device %*s mounted on %4095s with fstype %31s",
+			   dir, type) != 2 || strncmp(type, "nfs", 3) != 0)
+			continue;
+		unescape(dir);
+		key.target = dir;
+		found = bsearch(&keyp, rm->bytarget, rm->count,
+				sizeof(*rm->bytarget), cmp_target);
+		if (found)
+			m = *found;
+	} while (!last);
+	fclose(f);
+}
+
+static long long now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * The kernel flags mountinfo with POLLPRI every time the mounts change.
+ * With adaptive readahead, the poll also times out every interval to
+ * look at how each mount is being read.
+ */
+static int watch_mounts(int interval)
+{
+	struct pollfd pfd = { .events = POLLPRI };
+	struct ra_mounts rm = { 0 };
+	long long next = now_ms() + interval * 1000LL;
+	size_t i;
+	int n;
+
+	pfd.fd = open(MOUNTINFO_PATH, O_RDONLY);
+	if (pfd.fd < 0)
+		xlog_err("unable to open %s: %m", MOUNTINFO_PATH);
+
+	scan_mounts(&rm);
+	for (;;) {
+		long long wait = -1;
+
+		if (interval) {
+			wait = next - now_ms();
+			if (wait <= 0) {
+				sample_mounts(&rm);
+				next += interval * 1000LL;
+				continue;
+			}
+		}
+		n = poll(&pfd, 1, (int)wait);
+		if (n < 0 && errno != EINTR)
+			break;
+		if (n > 0)
+			scan_mounts(&rm);
+	}
+	xlog(L_ERROR, "unable to watch %s: %m", MOUNTINFO_PATH);
+	for (i = 0; i < rm.count; i++)
+		sfree(rm.mounts[i].target);
+	free(rm.mounts);
+	free(rm.bytarget);
+	close(pfd.fd);
+	return 1;
+}
+
 int main(int argc, char **argv)
 {
-	int ret = 0, retry, opt;
+	int ret = 0, opt;
 	struct device_info device;
 	unsigned int readahead = 128, log_level, log_stderr = 0;
+	int all = 0, watch = 0;
 
 
 	log_level = D_ALL & ~D_GENERAL;
-	while((opt = getopt(argc, argv, "dF")) != -1) {
+	while((opt = getopt(argc, argv, "adFw")) != -1) {
 		switch (opt) {
+		case 'a':
+			all = 1;
+			break;
 		case 'd':
 			log_level = D_ALL;
 			break;
 		case 'F':
 			log_stderr = 1;
 			break;
+		case 'w':
+			watch = 1;
+			break;
 		}
 	}
 
@@ -159,15 +569,25 @@ int main(int argc, char **argv)
 	xlog_config(log_level, 1);
 	xlog_open(CONF_NAME);
 
+	if (watch)
+		return watch_mounts(conf_get_num(CONF_NAME, "adaptive-interval", 0));
+	if (all) {
+		struct ra_mounts rm = { 0 };
+		size_t i;
+
+		ret = scan_mounts(&rm);
+		for (i = 0; i < rm.count; i++)
+			sfree(rm.mounts[i].target);
+		free(rm.mounts);
+		free(rm.bytarget);
+		return ret;
+	}
+
 	// xlog_err causes the system to exit
 	if ((argc - optind) != 1)
 		xlog_err("expected the device number of a BDI; is udev ok?");
 
-	for (retry = 0; retry <= 10; retry++ )
-		if ((ret = get_device_info(argv[optind], &device)) == 0)
-			break;
-
-	if (ret != 0) {
+	if ((ret = get_device_info(argv[optind], &device)) != 0) {
 		xlog(D_GENERAL, "unable to find device %s\n", argv[optind]);
 		goto out;
 	}
@@ -180,7 +600,7 @@ int main(int argc, char **argv)
 		goto out;
 	}
 
-	readahead = conf_get_readahead(device.fstype);
+	readahead = conf_get_readahead(device.fstype, device.source);
 
 	xlog(D_FAC7, "setting %s readahead to %d\n", device.mountpoint, readahead);
 
@@ -0,0 +1,281 @@
+#!/usr/bin/python3
+#
+# nfsupcalltrace -- show where the time of each upcall to the NFS
+# daemons went, with the kernel's side of it from the sunrpc
+# tracepoints.
+#
+# This program is free software; you can redistribute it and/or
+# modify it under the terms of the GNU General Public License
+# as published by the Free Software Foundation; either version 2
+# of the License, or (at your option) any later version.
+import argparse
+import bisect
+import collections
+import os
+import pathlib
+import select
+import signal
+import socket
+import sys
+import time
+
+RUNDIR = "/run/nfs-utils"
+DEPS = [ "dns", "nss", "ldap", "kdc", "blkid", "server" ]
+EVENTS = [ "cache_entry_upcall", "cache_entry_update" ]
+STALE = 5000000
+
+Record = collections.namedtuple("Record", [ "daemon", "seq", "tid", "channel",
+        "read", "dispatch", "downcall", "done", "deps", "key" ])
+
+
+def parse_record(daemon, line):
+    """Parse one "upcall ..." line; times are in microseconds"""
+    n = 8 + len(DEPS)
+    fields = line.rstrip("\n").split(" ", n)
+    if len(fields) < n or fields[0] != "upcall":
+        return None
+    nums = [ int(f) for f in fields[1:3] + fields[4:n] ]
+    key = fields[n] if len(fields) > n else ""
+    return Record(daemon, nums[0], nums[1], fields[3], nums[2], nums[3],
+                  nums[4], nums[5], dict(zip(DEPS, nums[6:])), key)
+
+
+class Source:
+    """The records of one daemon, from its socket or a dump file"""
+    def __init__(self, daemon, sock=None, path=None):
+        self.daemon = daemon
+        self.sock = sock
+        self.path = path
+        self.buf = b""
+        self.seen = set()
+
+    def fileno(self):
+        return self.sock.fileno()
+
+    def lines(self, data):
+        self.buf += data
+        *lines, self.buf = self.buf.split(b"\n")
+        for line in lines:
+            line = line.decode(errors="replace")
+            if line.startswith("# nfstrace "):
+                self.daemon = line.split()[2]
+                continue
+            rec = parse_record(self.daemon, line)
+            # A record can be sent twice as a reader connects
+            if rec is None or rec.seq in self.seen:
+                continue
+            self.seen.add(rec.seq)
+            yield rec
+
+    def read_all(self):
+        with open(self.path, "rb") as f:
+            return list(self.lines(f.read() + b"\n"))
+
+
+def open_sockets(directory, daemons):
+    sources = []
+    if not daemons:
+        daemons = sorted(p.name[:-len(".upcalls")]
+                         for p in pathlib.Path(directory).glob("*.upcalls"))
+    for daemon in daemons:
+        path = daemon if "/" in daemon else f"{directory}/{daemon}.upcalls"
+        sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        try:
+            sock.connect(path)
+        except OSError as e:
+            print(f"{path}: {e.strerror}", file=sys.stderr)
+            continue
+        sources.append(Source(daemon, sock=sock))
+    return sources
+
+
+class Ftrace:
+    """The sunrpc cache tracepoints, in their own tracing instance"""
+    def __init__(self, tracefs):
+        self.dir = pathlib.Path(tracefs) / "instances" / "nfsupcalltrace"
+        self.dir.mkdir(exist_ok=True)
+        (self.dir / "trace_clock").write_text("mono")
+        for event in EVENTS:
+            (self.dir / "events" / "sunrpc" / event / "enable").write_text("1")
+        self.pipe = open(self.dir / "trace_pipe", "rb", buffering=0)
+        os.set_blocking(self.pipe.fileno(), False)
+        self.buf = b""
+
+    def fileno(self):
+        return self.pipe.fileno()
+
+    def read(self):
+        try:
+            data = self.pipe.read(65536) or b""
+        except BlockingIOError:
+            data = b""
+        self.buf += data
+        *lines, self.buf = self.buf.split(b"\n")
+        return [ e for e in map(parse_event, lines) if e ]
+
+    def close(self):
+        self.pipe.close()
+        for event in EVENTS:
+            (self.dir / "events" / "sunrpc" / event / "enable").write_text("0")
+        self.dir.rmdir()
+
+
+def parse_event(line):
+    """Returns (usecs, event, cache) for a sunrpc cache event line"""
+    if isinstance(line, bytes):
+        line = line.decode(errors="replace")
+    for event in EVENTS:
+        i = line.find(f" {event}: ")
+        if i < 0:
+            continue
+        ts = line[:i].rstrip(":").split()[-1].rstrip(":")
+        cache = line[i:].split("cache=", 1)[-1].split()[0]
+        try:
+            return (int(float(ts) * 1000000), event, cache)
+        except ValueError:
+            return None
+    return None
+
+
+def correlate(records, events):
+    """
+    Match each record, in the order they were read, with the oldest
+    upcall for its cache that the kernel made before the read and no
+    earlier record was matched with, and with the first update of the
+    cache after its reply was written.  Upcalls nobody read for
+    STALE microseconds are passed over.
+    """
+    by_cache = collections.defaultdict(lambda: ([], []))
+    for usecs, event, cache in sorted(events):
+        by_cache[cache][EVENTS.index(event)].append(usecs)
+    next_upcall = collections.defaultdict(int)
+    result = []
+    for rec in sorted(records, key=lambda r: r.read):
+        upcalls, updates = by_cache.get(rec.channel, ([], []))
+        i = next_upcall[rec.channel]
+        while i < len(upcalls) and upcalls[i] < rec.read - STALE:
+            i += 1
+        upcall = None
+        if i < len(upcalls) and upcalls[i] <= rec.read:
+            upcall = upcalls[i]
+            i += 1
+        next_upcall[rec.channel] = i
+        update = None
+        if rec.downcall:
+            j = bisect.bisect_left(updates, rec.downcall)
+            if j < len(updates):
+                update = updates[j]
+        result.append((rec, upcall, update))
+    return result
+
+
+def ms(usecs):
+    return "-" if usecs is None else f"{usecs / 1000:.3f}"
+
+
+def since(start, end):
+    return end - start if start and end else None
+
+
+def print_records(results, args):
+    print(f"{'daemon':12} {'channel':15} {'queued':>8} {'wait':>8} "
+          f"{'work':>8} {'deps':>8} {'apply':>8} {'total':>8}  key")
+    for rec, upcall, update in results:
+        deps = sum(rec.deps.values())
+        total = since(upcall or rec.read, update or rec.done)
+        if args.slower and (total or 0) < args.slower * 1000:
+            continue
+        print(f"{rec.daemon:12} {rec.channel:15} "
+              f"{ms(since(upcall, rec.read)):>8} "
+              f"{ms(since(rec.read, rec.dispatch)):>8} "
+              f"{ms(since(rec.dispatch, rec.downcall or rec.done)):>8} "
+              f"{ms(deps):>8} {ms(since(rec.downcall, update)):>8} "
+              f"{ms(total):>8}  {rec.key}")
+        if args.verbose and deps:
+            print(" " * 29 + ", ".join(f"{d} {ms(rec.deps[d])}"
+                                      for d in DEPS if rec.deps[d]))
+
+
+def follow(sources, ftrace, seconds):
+    records, events = [], []
+    stop = time.monotonic() + seconds if seconds else None
+    signal.signal(signal.SIGINT, signal.default_int_handler)
+    try:
+        while sources and (stop is None or time.monotonic() < stop):
+            wait = max(0, stop - time.monotonic()) if stop else None
+            readable, _, _ = select.select(sources + ([ftrace] if ftrace else []),
+                                           [], [], wait)
+            for src in readable:
+                if src is ftrace:
+                    events += ftrace.read()
+                    continue
+                data = src.sock.recv(65536)
+                if not data:
+                    sources.remove(src)
+                records += src.lines(data)
+    except KeyboardInterrupt:
+        pass
+    if ftrace:
+        # replies written just before the end are applied just after
+        time.sleep(0.1)
+        events += ftrace.read()
+    return records, events
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description="Show where the time of upcalls to the NFS daemons went")
+    parser.add_argument("daemon", nargs="*",
+                        help="daemon to follow, by default all that trace")
+    parser.add_argument("-d", "--directory", default=RUNDIR,
+                        help=f"where the daemons' sockets are, default {RUNDIR}")
+    parser.add_argument("-f", "--file", action="append", default=[],
+                        help="read records dumped on SIGUSR2 instead")
+    parser.add_argument("-k", "--kernel", action="store_true",
+                        help="match with the sunrpc cache tracepoints")
+    parser.add_argument("-e", "--events",
+                        help="read the tracepoints from a saved ftrace log")
+    parser.add_argument("-t", "--time", type=float, default=0,
+                        help="follow for this many seconds, not until ^C")
+    parser.add_argument("-s", "--slower", type=float, default=0,
+                        help="only show upcalls slower than this many ms")
+    parser.add_argument("-v", "--verbose", action="store_true",
+                        help="show the time of each dependency")
+    parser.add_argument("--tracefs", default="/sys/kernel/tracing")
+    args = parser.parse_args()
+
+    events = []
+    if args.events:
+        with open(args.events) as f:
+            events = [ e for e in map(parse_event, f) if e ]
+
+    if args.file:
+        records = []
+        for path in args.file:
+            records += Source(pathlib.Path(path).stem, path=path).read_all()
+    else:
+        sources = open_sockets(args.directory, args.daemon)
+        if not sources:
+            print("no daemon is tracing its upcalls; see upcall-trace in "
+                  "nfs.conf(5)", file=sys.stderr)
+            return 1
+        ftrace = None
+        if args.kernel:
+            try:
+                ftrace = Ftrace(args.tracefs)
+            except OSError as e:
+                print(f"{args.tracefs}: {e.strerror}", file=sys.stderr)
+                return 1
+        try:
+            records, more = follow(sources, ftrace, args.time)
+        finally:
+            if ftrace:
+                ftrace.close()
+        events += more
+
+    print_records(correlate(records, events), args)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
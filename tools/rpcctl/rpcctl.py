@@ -4,8 +4,12 @@ import collections
 import errno
 import os
 import pathlib
+import signal
 import socket
+import statistics
 import sys
+import syslog
+import time
 
 with open("/proc/mounts", 'r') as f:
     mount = [ line.split()[1] for line in f if "sysfs" in line ]
@@ -82,6 +86,9 @@ class Xprt:
             with open(self.path / "xprt_state") as f:
                 self.state = ','.join(f.readline().split()[1:])
 
+    def is_offline(self):
+        return "OFFLINE" in self.state.upper().split(",")
+
     def small_str(self):
         main = " [main]" if self.info.get("main_xprt") else ""
         return f"{self.name}: {self.type}, {self.dstaddr}{main}"
@@ -182,6 +189,30 @@ class XprtSwitch:
                           help="Name of a specific switch to show")
         show.set_defaults(func=XprtSwitch.show)
 
+        monitor = subparser.add_parser("monitor",
+                        help="Take slow xprts offline while they are slow")
+        monitor.add_argument("switch", metavar="SWITCH", nargs='?',
+                             help="Name of a specific xprt switch to watch")
+        monitor.add_argument("--interval", type=float, default=5,
+                             help="Seconds between samples (default 5)")
+        monitor.add_argument("--threshold", type=float, default=3,
+                             help="How many times the median score makes an xprt slow (default 3)")
+        monitor.add_argument("--min-latency", type=float, default=5,
+                             help="Scores below this many ms are never slow (default 5)")
+        monitor.add_argument("--samples", type=int, default=3,
+                             help="Slow samples in a row before acting (default 3)")
+        monitor.add_argument("--hold", type=float, default=60,
+                             help="Seconds an xprt stays offline (default 60)")
+        monitor.add_argument("--max-offline", type=float, default=0.25,
+                             help="Largest fraction of a switch's xprts to offline (default 0.25)")
+        monitor.add_argument("--min-active", type=int, default=2,
+                             help="Fewest xprts to leave active in a switch (default 2)")
+        monitor.add_argument("--count", type=int, default=0,
+                             help="Stop after this many samples")
+        monitor.add_argument("--dry-run", action="store_true",
+                             help="Log what would be done, but do nothing")
+        monitor.set_defaults(func=Monitor.run)
+
         set = subparser.add_parser("set", help="Change an xprt switch property")
         set.add_argument("switch", metavar="SWITCH", nargs=1,
                          help="Name of a specific xprt switch to modify")
@@ -209,6 +240,154 @@ class XprtSwitch:
         print(switch)
 
 
+def read_mountstats_xprts():
+    """Per-xprt counters from /proc/self/mountstats, by source port"""
+    res = {}
+    try:
+        with open("/proc/self/mountstats") as f:
+            for line in f:
+                words = line.split()
+                # tcp and rdma: port bind connect connect_time idle
+                #               sends recvs bad_xids req_u bklog_u ...
+                if len(words) < 11 or words[0] != "xprt:" or \
+                   words[1] not in ("tcp", "rdma"):
+                    continue
+                nums = [ int(w) for w in words[2:11] ]
+                res[nums[0]] = { "sends": nums[5], "recvs": nums[6],
+                                 "req_u": nums[8] }
+    except (OSError, ValueError):
+        pass
+    return res
+
+
+class Monitor:
+    """
+    Scores each xprt of a switch by its estimated request latency, and
+    takes an xprt offline for a while once it has scored much worse
+    than the switch's other xprts for several samples in a row.
+
+    The latency of an xprt is estimated by Little's law, from the
+    mountstats counters of the last interval: the average number of
+    requests in flight when one was sent, over the replies received per
+    second.  An xprt that got no reply while it had requests to answer
+    scores the whole interval.  One that mountstats doesn't show is
+    scored by the requests queued on it per slot, times the interval.
+    """
+    def __init__(self, args):
+        self.args = args
+        self.last = {}          # xprt name: (time, mountstats counters)
+        self.slow = collections.Counter()
+        self.offline = {}       # xprt name: (when to restore, switch name)
+        syslog.openlog("rpcctl", syslog.LOG_PID, syslog.LOG_DAEMON)
+
+    def log(self, msg):
+        print(time.strftime("%Y-%m-%d %H:%M:%S"), msg, flush=True)
+        syslog.syslog(syslog.LOG_NOTICE, msg)
+
+    def score(self, xprt, stats, now):
+        """Estimated latency in ms, or None if there is nothing to go on"""
+        cur = stats.get(xprt.info.get("src_port"))
+        prev = self.last.get(xprt.name)
+        self.last[xprt.name] = (now, cur)
+        queued = xprt.info["sending_q_len"] + xprt.info["pending_q_len"] + \
+                 xprt.info["backlog_q_len"]
+        if cur and prev and prev[1]:
+            sends = cur["sends"] - prev[1]["sends"]
+            recvs = cur["recvs"] - prev[1]["recvs"]
+            if sends > 0 and recvs > 0:
+                inflight = (cur["req_u"] - prev[1]["req_u"]) / sends
+                return 1000 * inflight / (recvs / (now - prev[0]))
+            if sends > 0 or queued > 0:
+                return 1000 * (now - prev[0])
+            return None
+        if cur or queued == 0:
+            return None
+        return 1000 * self.args.interval * queued / max(xprt.info["max_num_slots"], 1)
+
+    def set_state(self, xprt, state, why):
+        self.log(f"{xprt.name} ({xprt.dstaddr}): {state}, {why}" +
+                 (" [dry run]" if self.args.dry_run else ""))
+        if not self.args.dry_run:
+            xprt.set_state(state)
+
+    def restore(self, switch, now, all=False):
+        for xprt in switch.xprts:
+            until = self.offline.get(xprt.name)
+            if until is None or (not all and now < until[0]):
+                continue
+            del self.offline[xprt.name]
+            self.slow[xprt.name] = 0
+            self.last.pop(xprt.name, None)
+            try:
+                self.set_state(xprt, "online", "hold time over" if not all
+                               else "monitor stopped")
+            except OSError as e:
+                self.log(f"{xprt.name}: unable to set online: {e}")
+
+    def check(self, switch, stats, now):
+        self.restore(switch, now)
+        scores = {}
+        for xprt in switch.xprts:
+            if xprt.name in self.offline or xprt.is_offline():
+                continue
+            score = self.score(xprt, stats, now)
+            if score is not None:
+                scores[xprt.name] = score
+        if len(scores) < 2:
+            return
+        median = statistics.median(scores.values())
+        limit = max(median * self.args.threshold, self.args.min_latency)
+        active = sum(1 for x in switch.xprts if not x.is_offline() and
+                     x.name not in self.offline)
+        mine = sum(1 for x in switch.xprts if x.name in self.offline)
+        for xprt in sorted(switch.xprts, key=lambda x: -scores.get(x.name, 0)):
+            score = scores.get(xprt.name)
+            if score is None or score <= limit:
+                self.slow[xprt.name] = 0
+                continue
+            self.slow[xprt.name] += 1
+            if self.slow[xprt.name] < self.args.samples:
+                continue
+            why = f"{score:.1f}ms against a median of {median:.1f}ms"
+            if xprt.info.get("main_xprt"):
+                self.log(f"{xprt.name}: slow, {why}, but it is the main xprt")
+            elif active <= self.args.min_active:
+                self.log(f"{xprt.name}: slow, {why}, but only {active} xprts are active")
+            elif mine + 1 > self.args.max_offline * len(switch.xprts):
+                self.log(f"{xprt.name}: slow, {why}, but {mine} xprts are offline already")
+            else:
+                try:
+                    self.set_state(xprt, "offline", why)
+                except OSError as e:
+                    self.log(f"{xprt.name}: unable to set offline: {e}")
+                    continue
+                self.offline[xprt.name] = (now + self.args.hold, switch.name)
+                active -= 1
+                mine += 1
+            self.slow[xprt.name] = 0
+
+    def run(args):
+        monitor = Monitor(args)
+        monitor.log(f"monitoring {args.switch or 'all xprt switches'}, "
+                    f"threshold {args.threshold}x median, hold {args.hold}s")
+        signal.signal(signal.SIGTERM, signal.default_int_handler)
+        n = 0
+        try:
+            while args.count == 0 or n < args.count:
+                now = time.monotonic()
+                stats = read_mountstats_xprts()
+                for switch in XprtSwitch.get_by_name(args.switch):
+                    monitor.check(switch, stats, now)
+                n += 1
+                if args.count == 0 or n < args.count:
+                    time.sleep(args.interval)
+        except KeyboardInterrupt:
+            pass
+        finally:
+            for switch in XprtSwitch.get_by_name(args.switch):
+                monitor.restore(switch, time.monotonic(), all=True)
+
+
 class RpcClient:
     def __init__(self, path):
         self.path = path
@@ -26,7 +26,11 @@
 #include <malloc.h>
 #include <fcntl.h>
 #include <ctype.h>
+#include <errno.h>
 #include <libgen.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
 /* RPC debug flags
    #include <sunrpc/debug.h> */
 /* NFS debug flags
@@ -42,6 +46,8 @@ static unsigned int	find_flag(char **module, char *name);
 static unsigned int	get_flags(char *);
 static unsigned int	set_flags(char *, unsigned int value);
 static void		print_flags(FILE *, char *, unsigned int, int);
+static int		capture(char *, unsigned int, unsigned int,
+				unsigned long, unsigned long, char *);
 static char *		strtolower(char *str);
 static void		usage(int excode, char *module);
 
@@ -51,7 +57,10 @@ main(int argc, char **argv)
 	int		opt_s = 0,
 			opt_c = 0;
 	unsigned int	flags = 0, oflags;
+	unsigned long	opt_t = 0, opt_n = 0;
+	char *		opt_o = NULL;
 	char *		module = NULL;
+	char *		end;
 	int		c;
 
 	cdename = malloc(strlen(basename(argv[0])));
@@ -68,11 +77,27 @@ main(int argc, char **argv)
 	  module = "nfsd";
 	}
 
-	while ((c = getopt(argc, argv, "chm:sv")) != EOF) {
+	while ((c = getopt(argc, argv, "chm:n:o:st:v")) != EOF) {
 		switch (c) {
 		case 'c':
 			opt_c = 1;
 			break;
+		case 'n':
+		case 't':
+			errno = 0;
+			if (c == 'n')
+				opt_n = strtoul(optarg, &end, 10);
+			else
+				opt_t = strtoul(optarg, &end, 10);
+			if (errno || *end || end == optarg || *optarg == '-') {
+				fprintf(stderr, "%s: bad number for -%c: %s\n",
+					cdename, c, optarg);
+				usage(1, module);
+			}
+			break;
+		case 'o':
+			opt_o = optarg;
+			break;
 		case 'h':
 			usage(0, module); /* usage does not return */
 			break;
@@ -95,6 +120,18 @@ main(int argc, char **argv)
 		fprintf(stderr, "You can use at most one of -c and -s\n");
 		usage(1, module);
 	}
+	if (opt_c && (opt_t || opt_n || opt_o)) {
+		fprintf(stderr, "-t, -n and -o set flags, and cannot be used with -c\n");
+		usage(1, module);
+	}
+	if ((opt_t || opt_n) && argc == optind) {
+		fprintf(stderr, "-t and -n need the flags to set\n");
+		usage(1, module);
+	}
+	if (opt_o && !opt_t && !opt_n) {
+		fprintf(stderr, "-o needs -t or -n\n");
+		usage(1, module);
+	}
 
 	if (!module) {
 		fprintf(stderr, "%s: no module name specified.\n", cdename);
@@ -120,6 +157,8 @@ main(int argc, char **argv)
 
 	oflags = get_flags(module);
 
+	if (opt_t || opt_n)
+		return capture(module, oflags, flags, opt_t, opt_n, opt_o);
 	if (opt_c) {
 		oflags = set_flags(module, oflags & ~flags);
 	} else if (opt_s) {
@@ -292,6 +331,135 @@ set_flags(char *module, unsigned int value)
 	return value;
 }
 
+static volatile sig_atomic_t	capture_stop;
+
+static void
+capture_signal(int sig)
+{
+	capture_stop = sig;
+}
+
+static unsigned long long
+capture_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Set @flags for @module for at most @seconds, or until the kernel has
+ * logged @count messages, whichever comes first (zero means no limit),
+ * then put back @oflags.  Messages are counted, and copied to @outfile
+ * if it is given, from /dev/kmsg, so they include any the kernel logs
+ * for other reasons meanwhile.  Returns the exit status.
+ */
+static int
+capture(char *module, unsigned int oflags, unsigned int flags,
+	unsigned long seconds, unsigned long count, char *outfile)
+{
+	struct sigaction sa;
+	struct pollfd	pfd;
+	unsigned long long start, now, end = 0;
+	unsigned long	messages = 0, lost = 0, second = 0, this_second = 0,
+			peak = 0;
+	char		record[8192], *text;
+	FILE *		ofp = NULL;
+	ssize_t		len;
+	double		elapsed;
+	int		timeout;
+
+	pfd.fd = open("/dev/kmsg", O_RDONLY | O_NONBLOCK);
+	if (pfd.fd < 0) {
+		perror("/dev/kmsg");
+		return 1;
+	}
+	pfd.events = POLLIN;
+	/* Only messages logged from now on */
+	lseek(pfd.fd, 0, SEEK_END);
+	if (outfile) {
+		ofp = fopen(outfile, "w");
+		if (ofp == NULL) {
+			perror(outfile);
+			return 1;
+		}
+	}
+
+	/* Whatever happens, the flags must be put back */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = capture_signal;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGHUP, &sa, NULL);
+
+	set_flags(module, oflags | flags);
+	start = capture_clock();
+	if (seconds)
+		end = start + seconds * 1000ULL;
+	fprintf(stderr, "%s: capturing with these flags set:\n", cdename);
+	print_flags(stderr, module, oflags | flags, 0);
+
+	while (!capture_stop && (!count || messages < count)) {
+		now = capture_clock();
+		if (end && now >= end)
+			break;
+		timeout = 1000;
+		if (end && end - now < 1000)
+			timeout = end - now;
+		if (poll(&pfd, 1, timeout) < 0 && errno != EINTR)
+			break;
+
+		while (!count || messages < count) {
+			len = read(pfd.fd, record, sizeof(record) - 1);
+			if (len < 0) {
+				/* The kernel overwrote records we hadn't read */
+				if (errno == EPIPE) {
+					lost++;
+					continue;
+				}
+				break;
+			}
+			messages++;
+			this_second++;
+			if (ofp) {
+				record[len] = '\0';
+				text = strchr(record, ';');
+				fputs(text ? text + 1 : record, ofp);
+			}
+		}
+
+		now = capture_clock();
+		if ((now - start) / 1000 != second) {
+			if (verbose)
+				fprintf(stderr, "%s: %lus: %lu messages\n",
+					cdename, second + 1, this_second);
+			if (this_second > peak)
+				peak = this_second;
+			second = (now - start) / 1000;
+			this_second = 0;
+		}
+	}
+
+	set_flags(module, oflags);
+	elapsed = (capture_clock() - start) / 1000.0;
+	if (this_second > peak)
+		peak = this_second;
+	if (ofp)
+		fclose(ofp);
+	close(pfd.fd);
+
+	fprintf(stderr, "%s: restored the flags to:\n", cdename);
+	print_flags(stderr, module, oflags, 0);
+	fprintf(stdout, "%lu messages in %.1f seconds, %.1f per second, "
+		"peak %lu per second\n", messages, elapsed,
+		elapsed > 0 ? messages / elapsed : 0.0, peak);
+	if (lost)
+		fprintf(stdout, "%lu times the kernel log overflowed and "
+			"messages were lost\n", lost);
+	return 0;
+}
 
 static char *
 strtolower(char *str)
@@ -346,10 +514,14 @@ static void
 usage(int excode, char *module)
 {
         if (module)
-	  fprintf(stderr, "usage: %s [-v] [-h] [-s flags...|-c flags...]\n", cdename);
+	  fprintf(stderr, "usage: %s [-v] [-h] [-s flags...|-c flags...]\n"
+			  "       %s [-v] [-t secs] [-n msgs] [-o file] flags...\n",
+			  cdename, cdename);
 	else
-	  fprintf(stderr, "usage: %s [-v] [-h] [-m module] [-s flags...|-c flags...]\n", cdename);
-	fprintf(stderr, "       set or cancel debug flags.\n");
+	  fprintf(stderr, "usage: %s [-v] [-h] [-m module] [-s flags...|-c flags...]\n"
+			  "       %s [-v] [-m module] [-t secs] [-n msgs] [-o file] flags...\n",
+			  cdename, cdename);
+	fprintf(stderr, "       set or cancel debug flags, or set them for a while.\n");
 	if (verbose) {
 	  fprintf(stderr, "\nModule     Valid flags\n");
 	  print_flags(stderr, module, ~(unsigned int) 0, 1);
@@ -7,6 +7,7 @@ void printarglist(proc_list *proc, const char *result,
 /****** rpc_cout.c ******/
 
 void emit (definition *def);
+int has_view (const char *type);
 
 /****** rpc_hout.c ******/
 
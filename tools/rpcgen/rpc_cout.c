@@ -62,6 +62,8 @@ static void print_stat (int indent, const declaration * dec);
 static void print_header (const definition * def);
 static void print_trailer (void);
 static char *upcase (const char *str);
+static int emit_fast (const definition * def);
+static void emit_view (const definition * def);
 
 /*
  * Emit the C-routine for the given definition
@@ -109,6 +111,10 @@ emit (definition * def)
       break;
     }
   print_trailer ();
+
+  if (viewflag && (def->def_kind == DEF_STRUCT
+		   || def->def_kind == DEF_TYPEDEF) && has_view (def->def_name))
+    emit_view (def);
 }
 
 static int
@@ -611,6 +617,9 @@ emit_struct (definition * def)
   int can_inline;
 
 
+  if (fastflag && emit_fast (def))
+    return;
+
   if (inlineflag == 0)
     {
       /* No xdr_inlining at all */
@@ -687,6 +696,9 @@ emit_typedef (const definition * def)
   const char *amax = def->def.ty.array_max;
   relation rel = def->def.ty.rel;
 
+  if (fastflag && rel == REL_VECTOR && emit_fast (def))
+    return;
+
   print_ifstat (1, prefix, type, rel, amax, "objp", def->def_name);
 }
 
@@ -811,3 +823,536 @@ upcase (const char *str)
   *ptr = '\0';
   return hptr;
 }
+
+/*
+ * Fast XDR routines (-F).  A struct, or a typedef of a fixed-length
+ * array, whose encoded size does not depend on its contents is
+ * encoded and decoded with one XDR_INLINE for the whole object,
+ * nested structs and arrays included, then IXDR_ macros and memcpy.
+ * When the stream cannot give that much buffer, it falls back to the
+ * usual calls.  Such objects own no memory, so XDR_FREE does nothing.
+ */
+
+#define FAST_MAXDEPTH	16
+#define FAST_UNIT	4	/* BYTES_PER_XDR_UNIT */
+#define FAST_RNDUP(x)	(((x) + FAST_UNIT - 1) / FAST_UNIT * FAST_UNIT)
+
+struct fast_size
+{
+  long bytes;			/* constant part */
+  char *expr;			/* plus this, if not NULL */
+  int loops;			/* current array nesting */
+  int maxloops;			/* index variables needed */
+};
+
+static const char *
+fast_basic (const char *type)
+{
+  static const char *const names[][2] =
+  {
+    {"int", "LONG"},
+    {"u_int", "U_LONG"},
+    {"long", "LONG"},
+    {"u_long", "U_LONG"},
+    {"short", "SHORT"},
+    {"u_short", "U_SHORT"},
+    {"bool", "BOOL"},
+  };
+  unsigned int i;
+
+  for (i = 0; i < sizeof (names) / sizeof (names[0]); i++)
+    if (streq (type, names[i][0]))
+      return names[i][1];
+  return NULL;
+}
+
+static int
+isnumber (const char *str)
+{
+  if (*str == '\0')
+    return 0;
+  for (; *str != '\0'; str++)
+    if (!isdigit ((unsigned char) *str))
+      return 0;
+  return 1;
+}
+
+static void
+fast_add (struct fast_size *sz, const char *term)
+{
+  size_t len = sz->expr ? strlen (sz->expr) : 0;
+
+  sz->expr = realloc (sz->expr, len + strlen (term) + 4);
+  if (sz->expr == NULL)
+    {
+      f_print (stderr, "Fatal error : no memory \n");
+      crash ();
+    }
+  if (len)
+    s_print (sz->expr + len, " + %s", term);
+  else
+    strcpy (sz->expr, term);
+}
+
+/* The size, in C, of what fast_size describes */
+static char *
+fast_total (const struct fast_size *sz)
+{
+  char *str = alloc (sz->expr ? strlen (sz->expr) + 32 : 32);
+
+  if (str == NULL)
+    {
+      f_print (stderr, "Fatal error : no memory \n");
+      crash ();
+    }
+  if (sz->expr == NULL)
+    s_print (str, "%ld", sz->bytes);
+  else if (sz->bytes == 0)
+    strcpy (str, sz->expr);
+  else
+    s_print (str, "%ld + %s", sz->bytes, sz->expr);
+  return str;
+}
+
+static const definition *
+fast_find (const char *type)
+{
+  return (const definition *) FINDVAL (defined, type, findtype);
+}
+
+/*
+ * Add the encoded size of an object to sz.  Returns 0 if the size
+ * depends on the contents, or on a type that is not in this file.
+ */
+static int
+fast_sizeof (const char *type, relation rel, const char *amax,
+	     int depth, struct fast_size *sz)
+{
+  struct fast_size elem;
+  const definition *def;
+  decl_list *dl;
+  char *total, *term;
+  int ok;
+
+  if (depth > FAST_MAXDEPTH)
+    return 0;
+
+  if (rel == REL_VECTOR)
+    {
+      if (streq (type, "opaque"))
+	{
+	  if (isnumber (amax))
+	    sz->bytes += FAST_RNDUP (atol (amax));
+	  else
+	    {
+	      term = alloc (strlen (amax) + 16);
+	      s_print (term, "RNDUP (%s)", amax);
+	      fast_add (sz, term);
+	      free (term);
+	    }
+	  return 1;
+	}
+      if (streq (type, "string"))
+	return 0;
+      memset (&elem, 0, sizeof (elem));
+      elem.loops = sz->loops + 1;
+      elem.maxloops = elem.loops;
+      ok = fast_sizeof (type, REL_ALIAS, NULL, depth + 1, &elem);
+      if (ok)
+	{
+	  if (elem.maxloops > sz->maxloops)
+	    sz->maxloops = elem.maxloops;
+	  if (isnumber (amax) && elem.expr == NULL)
+	    sz->bytes += atol (amax) * elem.bytes;
+	  else
+	    {
+	      total = fast_total (&elem);
+	      term = alloc (strlen (amax) + strlen (total) + 8);
+	      s_print (term, "%s * (%s)", amax, total);
+	      fast_add (sz, term);
+	      free (term);
+	      free (total);
+	    }
+	}
+      free (elem.expr);
+      return ok;
+    }
+  if (rel != REL_ALIAS)
+    return 0;
+
+  if (fast_basic (type))
+    {
+      sz->bytes += FAST_UNIT;
+      return 1;
+    }
+  if ((def = fast_find (type)) == NULL)
+    return 0;
+  switch (def->def_kind)
+    {
+    case DEF_ENUM:
+      sz->bytes += FAST_UNIT;
+      return 1;
+    case DEF_STRUCT:
+      for (dl = def->def.st.decls; dl != NULL; dl = dl->next)
+	if (!fast_sizeof (dl->decl.type, dl->decl.rel,
+			  dl->decl.array_max, depth + 1, sz))
+	  return 0;
+      return 1;
+    case DEF_TYPEDEF:
+      return fast_sizeof (def->def.ty.old_type, def->def.ty.rel,
+			  def->def.ty.array_max, depth + 1, sz);
+    default:
+      return 0;
+    }
+}
+
+/* Encode (PUT) or decode (GET) lval, known to be of fixed size */
+static void
+fast_code (int indent, int flag, const char *lval, const char *type,
+	   relation rel, const char *amax, int loop)
+{
+  const definition *def;
+  const char *name;
+  decl_list *dl;
+  char *sub;
+
+  if (rel == REL_VECTOR && streq (type, "opaque"))
+    {
+      tabify (fout, indent);
+      if (flag == PUT)
+	{
+	  f_print (fout, "memcpy (buf, %s, %s);\n", lval, amax);
+	  if (!isnumber (amax) || atol (amax) % FAST_UNIT)
+	    {
+	      tabify (fout, indent);
+	      f_print (fout, "memset ((char *) buf + %s, 0, "
+		       "RNDUP (%s) - %s);\n", amax, amax, amax);
+	    }
+	}
+      else
+	f_print (fout, "memcpy (%s, buf, %s);\n", lval, amax);
+      tabify (fout, indent);
+      f_print (fout, "buf += RNDUP (%s) / BYTES_PER_XDR_UNIT;\n", amax);
+      return;
+    }
+  if (rel == REL_VECTOR)
+    {
+      tabify (fout, indent);
+      f_print (fout, "for (i%d = 0; i%d < %s; i%d++) {\n",
+	       loop, loop, amax, loop);
+      sub = alloc (strlen (lval) + 16);
+      s_print (sub, "%s[i%d]", lval, loop);
+      fast_code (indent + 1, flag, sub, type, REL_ALIAS, NULL, loop + 1);
+      free (sub);
+      tabify (fout, indent);
+      f_print (fout, "}\n");
+      return;
+    }
+
+  if ((name = fast_basic (type)) != NULL)
+    {
+      tabify (fout, indent);
+      if (flag == PUT)
+	f_print (fout, "IXDR_PUT_%s (buf, %s);\n", name, lval);
+      else
+	f_print (fout, "%s = IXDR_GET_%s (buf);\n", lval, name);
+      return;
+    }
+  def = fast_find (type);
+  switch (def->def_kind)
+    {
+    case DEF_ENUM:
+      tabify (fout, indent);
+      if (flag == PUT)
+	f_print (fout, "IXDR_PUT_ENUM (buf, %s);\n", lval);
+      else
+	f_print (fout, "%s = IXDR_GET_ENUM (buf, %s);\n", lval, type);
+      break;
+    case DEF_STRUCT:
+      for (dl = def->def.st.decls; dl != NULL; dl = dl->next)
+	{
+	  sub = alloc (strlen (lval) + strlen (dl->decl.name) + 2);
+	  s_print (sub, "%s.%s", lval, dl->decl.name);
+	  fast_code (indent, flag, sub, dl->decl.type, dl->decl.rel,
+		     dl->decl.array_max, loop);
+	  free (sub);
+	}
+      break;
+    case DEF_TYPEDEF:
+      fast_code (indent, flag, lval, def->def.ty.old_type, def->def.ty.rel,
+		 def->def.ty.array_max, loop);
+      break;
+    default:
+      /* can't happen, fast_sizeof() said it was fixed */
+      break;
+    }
+}
+
+/* Encode or decode every member of a fixed-size def */
+static void
+fast_members (int indent, int flag, const definition * def)
+{
+  decl_list *dl;
+  char *lval;
+
+  if (def->def_kind == DEF_TYPEDEF)
+    {
+      fast_code (indent, flag, "objp", def->def.ty.old_type,
+		 def->def.ty.rel, def->def.ty.array_max, 0);
+      return;
+    }
+  for (dl = def->def.st.decls; dl != NULL; dl = dl->next)
+    {
+      lval = alloc (strlen (dl->decl.name) + 8);
+      s_print (lval, "objp->%s", dl->decl.name);
+      fast_code (indent, flag, lval, dl->decl.type, dl->decl.rel,
+		 dl->decl.array_max, 0);
+      free (lval);
+    }
+}
+
+/*
+ * Emit the body of a fast routine for def, if its size is fixed.
+ * Returns 0, having emitted nothing, if it is not.
+ */
+static int
+emit_fast (const definition * def)
+{
+  struct fast_size sz;
+  decl_list *dl;
+  char *total;
+  int i, ok = 1;
+
+  memset (&sz, 0, sizeof (sz));
+  if (def->def_kind == DEF_TYPEDEF)
+    ok = fast_sizeof (def->def.ty.old_type, def->def.ty.rel,
+		      def->def.ty.array_max, 0, &sz);
+  else
+    for (dl = def->def.st.decls; ok && dl != NULL; dl = dl->next)
+      ok = fast_sizeof (dl->decl.type, dl->decl.rel,
+			dl->decl.array_max, 0, &sz);
+  if (!ok || (sz.bytes == 0 && sz.expr == NULL))
+    {
+      free (sz.expr);
+      return 0;
+    }
+
+  if (inlineflag == 0)
+    f_print (fout, "\tregister int32_t *buf;\n");
+  for (i = 0; i < sz.maxloops; i++)
+    f_print (fout, "\tu_int i%d;\n", i);
+  f_print (fout, "\n");
+
+  total = fast_total (&sz);
+  f_print (fout, "\tif (xdrs->x_op == XDR_FREE)\n");
+  f_print (fout, "\t\treturn TRUE;\n");
+  f_print (fout, "\tbuf = XDR_INLINE (xdrs, %s);\n", total);
+  f_print (fout, "\tif (buf != NULL) {\n");
+  f_print (fout, "\t\tif (xdrs->x_op == XDR_ENCODE) {\n");
+  fast_members (3, PUT, def);
+  f_print (fout, "\t\t} else {\n");
+  fast_members (3, GET, def);
+  f_print (fout, "\t\t}\n");
+  f_print (fout, "\t\treturn TRUE;\n");
+  f_print (fout, "\t}\n");
+  free (total);
+  free (sz.expr);
+
+  if (def->def_kind == DEF_TYPEDEF)
+    print_ifstat (1, def->def.ty.old_prefix, def->def.ty.old_type,
+		  def->def.ty.rel, def->def.ty.array_max, "objp",
+		  def->def_name);
+  else
+    for (dl = def->def.st.decls; dl != NULL; dl = dl->next)
+      print_stat (1, &dl->decl);
+  return 1;
+}
+
+/*
+ * Decoding views (-Z).  xdr_T_view () is xdr_T () for a struct or
+ * typedef whose only variable-length parts are bounded strings and
+ * opaques, but it decodes them into static buffers of the maximum
+ * size instead of allocating them, since xdr_string () and
+ * xdr_bytes () fill in a buffer that is already there.  What it
+ * decodes is good until it is called again, which suits servers that
+ * use their arguments only while handling the call.  Nothing needs
+ * to be freed, so XDR_FREE does nothing.
+ */
+
+#define VIEW_NONE	0	/* not a view type */
+#define VIEW_FIXED	1	/* fixed size, nothing to point at */
+#define VIEW_BUFFER	2	/* has strings or opaques */
+
+static int
+view_kind (const char *type, relation rel, const char *amax, int depth)
+{
+  struct fast_size sz;
+  const definition *def;
+  decl_list *dl;
+  int kind, k;
+
+  if (depth > FAST_MAXDEPTH)
+    return VIEW_NONE;
+
+  if (rel == REL_ARRAY)
+    {
+      if ((streq (type, "string") || streq (type, "opaque"))
+	  && !streq (amax, "~0"))
+	return VIEW_BUFFER;
+      return VIEW_NONE;
+    }
+
+  memset (&sz, 0, sizeof (sz));
+  k = fast_sizeof (type, rel, amax, depth, &sz);
+  free (sz.expr);
+  if (k)
+    return VIEW_FIXED;
+  if (rel != REL_ALIAS || (def = fast_find (type)) == NULL)
+    return VIEW_NONE;
+
+  switch (def->def_kind)
+    {
+    case DEF_STRUCT:
+      kind = VIEW_FIXED;
+      for (dl = def->def.st.decls; dl != NULL; dl = dl->next)
+	{
+	  k = view_kind (dl->decl.type, dl->decl.rel, dl->decl.array_max,
+			 depth + 1);
+	  if (k == VIEW_NONE)
+	    return VIEW_NONE;
+	  if (k > kind)
+	    kind = k;
+	}
+      return kind;
+    case DEF_TYPEDEF:
+      return view_kind (def->def.ty.old_type, def->def.ty.rel,
+			def->def.ty.array_max, depth + 1);
+    default:
+      return VIEW_NONE;
+    }
+}
+
+/* Has xdr_<type>_view () been generated? */
+int
+has_view (const char *type)
+{
+  const definition *def = fast_find (type);
+
+  if (def == NULL ||
+      (def->def_kind != DEF_STRUCT && def->def_kind != DEF_TYPEDEF))
+    return 0;
+  return view_kind (type, REL_ALIAS, NULL, 0) == VIEW_BUFFER;
+}
+
+/* Decode, or encode, one member whose kind is known */
+static void
+view_member (const char *prefix, const char *type, relation rel,
+	     const char *amax, const char *objname, const char *name)
+{
+  if (rel == REL_ALIAS && has_view (type))
+    {
+      f_print (fout, "\t if (!xdr_%s_view (xdrs, %s))\n", type, objname);
+      f_print (fout, "\t\t return FALSE;\n");
+    }
+  else
+    print_ifstat (1, prefix, type, rel, amax, objname, name);
+}
+
+/*
+ * Declare (decl) or point a member at (!decl) the buffer for each
+ * string or opaque that def itself holds.  Returns how many it has.
+ */
+static int
+view_buffers (const definition * def, int decl)
+{
+  const char *type, *amax, *name;
+  decl_list *dl;
+  int n = 0;
+
+  dl = def->def_kind == DEF_STRUCT ? def->def.st.decls : NULL;
+  for (;;)
+    {
+      if (def->def_kind == DEF_TYPEDEF)
+	{
+	  if (n > 0 || def->def.ty.rel != REL_ARRAY)
+	    break;
+	  type = def->def.ty.old_type;
+	  amax = def->def.ty.array_max;
+	  name = def->def_name;
+	}
+      else
+	{
+	  while (dl != NULL && dl->decl.rel != REL_ARRAY)
+	    dl = dl->next;
+	  if (dl == NULL)
+	    break;
+	  type = dl->decl.type;
+	  amax = dl->decl.array_max;
+	  name = dl->decl.name;
+	  dl = dl->next;
+	}
+      n++;
+
+      if (decl)
+	f_print (fout, "\tstatic %schar view_%s[%s%s];\n",
+		 mtflag ? "__thread " : "", name, amax,
+		 streq (type, "string") ? " + 1" : "");
+      else if (def->def_kind == DEF_TYPEDEF && streq (type, "string"))
+	f_print (fout, "\t\t*objp = view_%s;\n", name);
+      else if (def->def_kind == DEF_TYPEDEF)
+	f_print (fout, "\t\tobjp->%s_val = view_%s;\n", name, name);
+      else if (streq (type, "string"))
+	f_print (fout, "\t\tobjp->%s = view_%s;\n", name, name);
+      else
+	f_print (fout, "\t\tobjp->%s.%s_val = view_%s;\n", name, name,
+		 name);
+    }
+  return n;
+}
+
+static void
+emit_view (const definition * def)
+{
+  decl_list *dl;
+  int nbufs;
+
+  f_print (fout, "\nbool_t\n");
+  if (Cflag)
+    f_print (fout, "xdr_%s_view (XDR *xdrs, %s *objp)\n{\n",
+	     def->def_name, def->def_name);
+  else
+    {
+      f_print (fout, "xdr_%s_view (xdrs, objp)\n", def->def_name);
+      f_print (fout, "\tXDR *xdrs;\n");
+      f_print (fout, "\t%s *objp;\n{\n", def->def_name);
+    }
+  nbufs = view_buffers (def, 1);
+  if (nbufs > 0)
+    f_print (fout, "\n");
+  f_print (fout, "\tif (xdrs->x_op == XDR_FREE)\n");
+  f_print (fout, "\t\treturn TRUE;\n");
+  if (nbufs > 0)
+    {
+      f_print (fout, "\tif (xdrs->x_op == XDR_DECODE) {\n");
+      view_buffers (def, 0);
+      f_print (fout, "\t}\n");
+    }
+
+  if (def->def_kind == DEF_TYPEDEF)
+    view_member (def->def.ty.old_prefix, def->def.ty.old_type,
+		 def->def.ty.rel, def->def.ty.array_max, "objp",
+		 def->def_name);
+  else
+    for (dl = def->def.st.decls; dl != NULL; dl = dl->next)
+      {
+	char name[256];
+
+	if (isvectordef (dl->decl.type, dl->decl.rel))
+	  s_print (name, "objp->%s", dl->decl.name);
+	else
+	  s_print (name, "&objp->%s", dl->decl.name);
+	view_member (dl->decl.prefix, dl->decl.type, dl->decl.rel,
+		     dl->decl.array_max, name, dl->decl.name);
+      }
+  print_trailer ();
+}
@@ -141,13 +141,20 @@ void
 print_xdr_func_def (char *name, int pointerp, int i)
 {
   if (i == 2)
-    {
-      f_print (fout, "extern bool_t xdr_%s ();\n", name);
-      return;
-    }
+    f_print (fout, "extern bool_t xdr_%s ();\n", name);
   else
     f_print(fout, "extern  bool_t xdr_%s (XDR *, %s%s);\n", name,
 	    name, pointerp ? "*" : "");
+
+  if (!viewflag || !has_view (name))
+    return;
+  if (i == 2)
+    f_print (fout, "extern bool_t xdr_%s_view ();\n", name);
+  else
+    f_print (fout, "extern  bool_t xdr_%s_view (XDR *, %s *);\n", name,
+	     name);
+  /* so that callers can tell that it exists */
+  f_print (fout, "#define xdr_%s_view xdr_%s_view\n", name, name);
 }
 
 static void
@@ -302,6 +309,19 @@ pprogramdef (definition *def)
 	  f_print (fout, "extern %s_%s_nproc;\n",
 		   locase (def->def_name), vers->vers_num);
 	}
+      if (procflag)
+	{
+	  const char *pv = locase (def->def_name);
+
+	  f_print (fout, "extern const struct rpcgen_svc_proc %s_%s_procs[];\n",
+		   pv, vers->vers_num);
+	  f_print (fout, "extern const unsigned int %s_%s_nprocs;\n",
+		   pv, vers->vers_num);
+	  f_print (fout, "extern const struct rpcgen_svc_hooks *%s_%s_hooks;\n",
+		   pv, vers->vers_num);
+	  f_print (fout, "#define %s_%s_procs %s_%s_procs\n",
+		   pv, vers->vers_num, pv, vers->vers_num);
+	}
       pdefine (vers->vers_name, vers->vers_num);
 
       /*
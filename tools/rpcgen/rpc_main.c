@@ -168,6 +168,9 @@ int mtflag;			/* Support for MT */
 
 int inlineflag = INLINE;	/* length at which to start doing an inline. 3 = default
 				   if 0, no xdr_inline code */
+int fastflag;			/* fully inline fixed-size types */
+int viewflag;			/* generate xdr_*_view decoders */
+int procflag;			/* table-driven server stubs with hooks */
 
 int indefinitewait;		/* If started by port monitors, hang till it wants */
 int exitnow;			/* If started by port monitors, exit after the call */
@@ -492,6 +495,8 @@ c_output (const char *infile, const char *define, int extend,
     }
   else
     fprintf (fout, "#include <rpc/rpc.h>\n");
+  if (fastflag)
+    fprintf (fout, "#include <string.h>\n");
   tell = ftell (fout);
   while ((def = get_definition ()) != NULL)
     emit (def);
@@ -527,6 +532,24 @@ char rpcgen_table_dcl[] = "struct rpcgen_table {\n\
 	unsigned	len_res;\n\
 };\n";
 
+char rpcgen_svc_proc_dcl[] = "\n#ifndef RPCGEN_SVC_PROC\n\
+#define RPCGEN_SVC_PROC\n\
+struct rpcgen_svc_proc {\n\
+	const char	*name;\n\
+	char		*(*handler)(char *, struct svc_req *);\n\
+	xdrproc_t	xdr_arg;\n\
+	unsigned int	arg_size;\n\
+	xdrproc_t	xdr_res;\n\
+	unsigned int	res_size;\n\
+};\n\
+\n\
+struct rpcgen_svc_hooks {\n\
+	void	(*begin)(struct svc_req *, const struct rpcgen_svc_proc *,\n\
+			 unsigned long long *);\n\
+	void	(*end)(struct svc_req *, const struct rpcgen_svc_proc *,\n\
+		       unsigned long long);\n\
+};\n\
+#endif /* RPCGEN_SVC_PROC */\n";
 
 static char *
 generate_guard (const char *pathname)
@@ -598,6 +621,9 @@ h_output (const char *infile, const char *define, int extend,
       print_datadef (def);
     }
 
+  if (procflag)
+    fprintf (fout, "%s", rpcgen_svc_proc_dcl);
+
   /* print function declarations.
      Do this after data definitions because they might be used as
      arguments for functions */
@@ -1275,6 +1301,15 @@ parseargs (int argc, const char *argv[], struct commandline *cmd)
 		case 'M':
 		  mtflag = 1;
 		  break;
+		case 'F':
+		  fastflag = 1;
+		  break;
+		case 'Z':
+		  viewflag = 1;
+		  break;
+		case 'P':
+		  procflag = 1;
+		  break;
 		case 'i':
 		  if (++i == argc)
 		    {
@@ -1377,6 +1412,12 @@ parseargs (int argc, const char *argv[], struct commandline *cmd)
       return (0);
     }
 
+  if (procflag && (mtflag || !Cflag))
+    {
+      f_print (stderr, _("Procedure tables need ANSI C, and cannot be used with the MT flag!\n"));
+      return (0);
+    }
+
   /* check no conflicts with file generation flags */
   nflags = cmd->cflag + cmd->hflag + cmd->lflag + cmd->mflag +
     cmd->sflag + cmd->nflag + cmd->tflag + cmd->Ssflag + cmd->Scflag;
@@ -1407,7 +1448,7 @@ static void
 usage (FILE *stream, int status)
 {
   fprintf (stream, _("usage: %s infile\n"), cmdname);
-  fprintf (stream, _("\t%s [-abkCLNTM][-Dname[=value]] [-i size] \
+  fprintf (stream, _("\t%s [-abkCFLNPTMZ][-Dname[=value]] [-i size] \
 [-I [-K seconds]] [-Y path] infile\n"), cmdname);
   fprintf (stream, _("\t%s [-c | -h | -l | -m | -t | -Sc | -Ss | -Sm] \
 [-o outfile] [infile]\n"), cmdname);
@@ -1426,6 +1467,7 @@ options_usage (FILE *stream, int status)
   f_print (stream, _("-c\t\tgenerate XDR routines\n"));
   f_print (stream, _("-C\t\tANSI C mode\n"));
   f_print (stream, _("-Dname[=value]\tdefine a symbol (same as #define)\n"));
+  f_print (stream, _("-F\t\tfully inline XDR routines for fixed-size types\n"));
   f_print (stream, _("-h\t\tgenerate header file\n"));
   f_print (stream, _("-i size\t\tsize at which to start generating inline code\n"));
   f_print (stream, _("-I\t\tgenerate code for inetd support in server (for SunOS 4.1)\n"));
@@ -1437,6 +1479,7 @@ options_usage (FILE *stream, int status)
   f_print (stream, _("-n netid\tgenerate server code that supports named netid\n"));
   f_print (stream, _("-N\t\tsupports multiple arguments and call-by-value\n"));
   f_print (stream, _("-o outfile\tname of the output file\n"));
+  f_print (stream, _("-P\t\tgenerate procedure tables and hooks for server stubs\n"));
   f_print (stream, _("-s nettype\tgenerate server code that supports named nettype\n"));
   f_print (stream, _("-Sc\t\tgenerate sample client code that uses remote procedures\n"));
   f_print (stream, _("-Ss\t\tgenerate sample server code that defines remote procedures\n"));
@@ -1444,6 +1487,7 @@ options_usage (FILE *stream, int status)
   f_print (stream, _("-t\t\tgenerate RPC dispatch table\n"));
   f_print (stream, _("-T\t\tgenerate code to support RPC dispatch tables\n"));
   f_print (stream, _("-Y path\t\tdirectory name to find C preprocessor (cpp)\n"));
+  f_print (stream, _("-Z\t\tgenerate decoders that do not allocate strings or opaques\n"));
   f_print (stream, _("-5\t\tSysVr4 compatibility mode\n"));
   f_print (stream, _("--help\t\tgive this help list\n"));
   f_print (stream, _("--version\tprint program version\n"));
@@ -52,6 +52,13 @@ static void internal_proctype (const proc_list * plist);
 static void p_xdrfunc (const char *rname, const char *typename);
 static void write_real_program (const definition * def);
 static void write_program (const definition * def, const char *storage);
+static int need_null_entry (void);
+static void write_arg_union (const version_list * vp);
+static void write_proc_table (const definition * def,
+			      const version_list * vp);
+static void write_proc_program (const definition * def,
+				const version_list * vp,
+				const char *storage);
 static void printerr (const char *err, const char *transp);
 static void printif (const char *proc, const char *transp, const char *arg);
 static void write_inetmost (const char *infile);
@@ -313,6 +320,17 @@ write_programs (const char *storage)
 	}
     }
 
+  /* procedure tables answer NULLPROC themselves if it isn't defined */
+  if (procflag && need_null_entry ())
+    {
+      f_print (fout, "\nstatic char *\n");
+      f_print (fout, "_rpcgen_null (char *argp, struct svc_req *%s)\n",
+	       RQSTP);
+      f_print (fout, "{\n\tstatic char _null;\n\n");
+      f_print (fout, "\t(void) argp;\n\t(void) %s;\n", RQSTP);
+      f_print (fout, "\treturn (&_null);\n}\n");
+    }
+
   /* write out dispatcher for each program */
   for (l = defined; l != NULL; l = l->next)
     {
@@ -324,6 +342,200 @@ write_programs (const char *storage)
     }
 }
 
+static int
+need_null_entry (void)
+{
+  list *l;
+  definition *def;
+  version_list *vp;
+
+  for (l = defined; l != NULL; l = l->next)
+    {
+      def = (definition *) l->val;
+      if (def->def_kind != DEF_PROGRAM)
+	continue;
+      for (vp = def->def.pr.versions; vp != NULL; vp = vp->next)
+	if (!nullproc (vp->procs))
+	  return 1;
+    }
+  return 0;
+}
+
+static void
+write_arg_union (const version_list * vp)
+{
+  proc_list *proc;
+  int filled;
+
+  filled = 0;
+  f_print (fout, "\tunion {\n");
+  for (proc = vp->procs; proc != NULL; proc = proc->next)
+    {
+      if (proc->arg_num < 2)
+	{			/* single argument */
+	  if (streq (proc->args.decls->decl.type,
+		     "void"))
+	    {
+	      continue;
+	    }
+	  filled = 1;
+	  f_print (fout, "\t\t");
+	  ptype (proc->args.decls->decl.prefix,
+		 proc->args.decls->decl.type, 0);
+	  pvname (proc->proc_name, vp->vers_num);
+	  f_print (fout, "_arg;\n");
+
+	}
+      else
+	{
+	  filled = 1;
+	  f_print (fout, "\t\t%s", proc->args.argname);
+	  f_print (fout, " ");
+	  pvname (proc->proc_name, vp->vers_num);
+	  f_print (fout, "_arg;\n");
+	}
+    }
+  if (!filled)
+    {
+      f_print (fout, "\t\tint fill;\n");
+    }
+  f_print (fout, "\t} %s;\n", ARG);
+}
+
+/* One entry per procedure, indexed by procedure number */
+static void
+write_proc_table (const definition * def, const version_list * vp)
+{
+  proc_list *proc;
+  const char *type, *prefix;
+  char progvers[100];
+
+  s_print (progvers, "%s_%s", locase (def->def_name), vp->vers_num);
+  f_print (fout, "\nconst struct rpcgen_svc_proc %s_procs[] = {\n",
+	   progvers);
+  if (!nullproc (vp->procs))
+    f_print (fout, "\t[NULLPROC] = { \"NULLPROC\", _rpcgen_null,\n"
+	     "\t\t(xdrproc_t) xdr_void, 0, (xdrproc_t) xdr_void, 0 },\n");
+  for (proc = vp->procs; proc != NULL; proc = proc->next)
+    {
+      f_print (fout, "\t[%s] = { \"%s\",\n", proc->proc_name,
+	       proc->proc_name);
+      f_print (fout, "\t\t(char *(*)(char *, struct svc_req *)) ");
+      if (newstyle)
+	{			/* calls internal routine */
+	  f_print (fout, "_");
+	  pvname (proc->proc_name, vp->vers_num);
+	}
+      else
+	pvname_svc (proc->proc_name, vp->vers_num);
+      f_print (fout, ",\n");
+
+      if (proc->arg_num > 1)
+	{
+	  type = proc->args.argname;
+	  prefix = NULL;
+	}
+      else
+	{
+	  type = proc->args.decls->decl.type;
+	  prefix = proc->args.decls->decl.prefix;
+	}
+      if (proc->arg_num < 2 && viewflag && has_view (type))
+	f_print (fout, "\t\t(xdrproc_t) xdr_%s_view, ", stringfix (type));
+      else
+	f_print (fout, "\t\t(xdrproc_t) xdr_%s, ", stringfix (type));
+      if (streq (type, "void"))
+	f_print (fout, "0,\n");
+      else
+	{
+	  f_print (fout, "sizeof (");
+	  ptype (prefix, type, 0);
+	  f_print (fout, "),\n");
+	}
+
+      f_print (fout, "\t\t(xdrproc_t) xdr_%s, ", stringfix (proc->res_type));
+      if (streq (proc->res_type, "void"))
+	f_print (fout, "0 },\n");
+      else
+	{
+	  f_print (fout, "sizeof (");
+	  ptype (proc->res_prefix, proc->res_type, 0);
+	  f_print (fout, ") },\n");
+	}
+    }
+  f_print (fout, "};\n");
+  f_print (fout, "const unsigned int %s_nprocs =\n"
+	   "\tsizeof (%s_procs) / sizeof (%s_procs[0]);\n",
+	   progvers, progvers, progvers);
+  f_print (fout, "const struct rpcgen_svc_hooks *%s_hooks;\n", progvers);
+}
+
+/*
+ * With -P, a version's dispatcher looks the procedure up in its table
+ * instead of switching on it, and calls the hooks, if any are set,
+ * around each call.
+ */
+static void
+write_proc_program (const definition * def, const version_list * vp,
+		    const char *storage)
+{
+  char progvers[100];
+
+  s_print (progvers, "%s_%s", locase (def->def_name), vp->vers_num);
+  write_proc_table (def, vp);
+
+  f_print (fout, "\n");
+  if (storage != NULL)
+    f_print (fout, "%s ", storage);
+  f_print (fout, "void\n%s", progvers);
+  f_print (fout, "(struct svc_req *%s, register SVCXPRT *%s)\n",
+	   RQSTP, TRANSP);
+  f_print (fout, "{\n");
+  write_arg_union (vp);
+  f_print (fout, "\tconst struct rpcgen_svc_proc *proc;\n");
+  f_print (fout, "\tconst struct rpcgen_svc_hooks *hooks = %s_hooks;\n",
+	   progvers);
+  f_print (fout, "\tunsigned long long cookie = 0;\n");
+  f_print (fout, "\tchar *%s;\n\n", RESULT);
+
+  if (timerflag)
+    f_print (fout, "\t_rpcsvcstate = _SERVING;\n");
+
+  f_print (fout, "\tif (%s->rq_proc >= %s_nprocs ||\n", RQSTP, progvers);
+  f_print (fout, "\t    %s_procs[%s->rq_proc].handler == NULL) {\n",
+	   progvers, RQSTP);
+  printerr ("noproc", TRANSP);
+  print_return ("\t\t");
+  f_print (fout, "\t}\n");
+  f_print (fout, "\tproc = &%s_procs[%s->rq_proc];\n", progvers, RQSTP);
+  f_print (fout, "\tif (hooks != NULL && hooks->begin != NULL)\n");
+  f_print (fout, "\t\t(*hooks->begin)(%s, proc, &cookie);\n\n", RQSTP);
+
+  f_print (fout, "\tmemset ((char *)&%s, 0, sizeof (%s));\n", ARG, ARG);
+  f_print (fout, "\tif (!svc_getargs (%s, proc->xdr_arg, (caddr_t) &%s)) {\n",
+	   TRANSP, ARG);
+  printerr ("decode", TRANSP);
+  f_print (fout, "\t\tgoto done;\n");
+  f_print (fout, "\t}\n");
+  f_print (fout, "\t%s = (*proc->handler)((char *)&%s, %s);\n",
+	   RESULT, ARG, RQSTP);
+  f_print (fout, "\tif (%s != NULL && !svc_sendreply(%s, proc->xdr_res, %s)) {\n",
+	   RESULT, TRANSP, RESULT);
+  printerr ("systemerr", TRANSP);
+  f_print (fout, "\t}\n");
+  f_print (fout, "\tif (!svc_freeargs (%s, proc->xdr_arg, (caddr_t) &%s)) {\n",
+	   TRANSP, ARG);
+  sprintf (_errbuf, "unable to free arguments");
+  print_err_message ("\t\t");
+  f_print (fout, "\t\texit (1);\n");
+  f_print (fout, "\t}\n");
+  f_print (fout, "done:\n");
+  f_print (fout, "\tif (hooks != NULL && hooks->end != NULL)\n");
+  f_print (fout, "\t\t(*hooks->end)(%s, proc, cookie);\n", RQSTP);
+  print_return ("\t");
+  f_print (fout, "}\n");
+}
+
 /* write out definition of internal function (e.g. _printmsg_1(...))
    which calls server's defintion of actual function (e.g. printmsg_1(...)).
    Unpacks single user argument of printmsg_1 to call-by-value format
@@ -414,10 +626,14 @@ write_program (const definition * def, const char *storage)
 {
   version_list *vp;
   proc_list *proc;
-  int filled;
 
   for (vp = def->def.pr.versions; vp != NULL; vp = vp->next)
     {
+      if (procflag)
+	{
+	  write_proc_program (def, vp, storage);
+	  continue;
+	}
       f_print (fout, "\n");
       if (storage != NULL)
 	{
@@ -440,39 +656,7 @@ write_program (const definition * def, const char *storage)
 
       f_print (fout, "{\n");
 
-      filled = 0;
-      f_print (fout, "\tunion {\n");
-      for (proc = vp->procs; proc != NULL; proc = proc->next)
-	{
-	  if (proc->arg_num < 2)
-	    {			/* single argument */
-	      if (streq (proc->args.decls->decl.type,
-			 "void"))
-		{
-		  continue;
-		}
-	      filled = 1;
-	      f_print (fout, "\t\t");
-	      ptype (proc->args.decls->decl.prefix,
-		     proc->args.decls->decl.type, 0);
-	      pvname (proc->proc_name, vp->vers_num);
-	      f_print (fout, "_arg;\n");
-
-	    }
-	  else
-	    {
-	      filled = 1;
-	      f_print (fout, "\t\t%s", proc->args.argname);
-	      f_print (fout, " ");
-	      pvname (proc->proc_name, vp->vers_num);
-	      f_print (fout, "_arg;\n");
-	    }
-	}
-      if (!filled)
-	{
-	  f_print (fout, "\t\tint fill;\n");
-	}
-      f_print (fout, "\t} %s;\n", ARG);
+      write_arg_union (vp);
       if (mtflag)
 	{
 	  f_print(fout, "\tunion {\n");
@@ -537,7 +721,16 @@ write_program (const definition * def, const char *storage)
       for (proc = vp->procs; proc != NULL; proc = proc->next)
 	{
 	  f_print (fout, "\tcase %s:\n", proc->proc_name);
-	  if (proc->arg_num < 2)
+	  if (proc->arg_num < 2 && viewflag &&
+	      has_view (proc->args.decls->decl.type))
+	    {			/* decoded into static buffers */
+	      char *view = alloc (strlen (proc->args.decls->decl.type) + 6);
+
+	      s_print (view, "%s_view", proc->args.decls->decl.type);
+	      p_xdrfunc (ARG, view);
+	      free (view);
+	    }
+	  else if (proc->arg_num < 2)
 	    {			/* single argument */
 	      p_xdrfunc (ARG, proc->args.decls->decl.type);
 	    }
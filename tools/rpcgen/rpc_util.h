@@ -86,6 +86,9 @@ extern int Cflag;      /* C++ flag */
 extern int CCflag;     /* C++ flag */
 extern int tirpcflag;  /* flag for generating tirpc code */
 extern int inlineflag; /* if this is 0, then do not generate inline code */
+extern int fastflag;   /* fully inline fixed-size types */
+extern int viewflag;   /* generate xdr_*_view decoders */
+extern int procflag;   /* table-driven server stubs with hooks */
 extern int mtflag;
 
 /*
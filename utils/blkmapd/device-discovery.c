@@ -53,6 +53,7 @@
 #include <unistd.h>
 #include <libgen.h>
 #include <errno.h>
+#include <pthread.h>
 #include <libdevmapper.h>
 
 #include "device-discovery.h"
@@ -66,6 +67,9 @@
 #define RPCPIPE_DIR	NFS_STATEDIR "/rpc_pipefs"
 #define PID_FILE	"/run/blkmapd.pid"
 
+/* seconds /dev must be quiet before new devices are probed */
+#define BL_DEVICE_SETTLE	1
+
 #define CONF_SAVE(w, f) do {			\
 	char *p = f;				\
 	if (p != NULL)				\
@@ -78,6 +82,7 @@ static char rpcpipe_dir[PATH_MAX];
 
 struct bl_disk *visible_disk_list;
 int    bl_watch_fd, bl_pipe_fd, nfs_pipedir_wfd, rpc_pipedir_wfd;
+int    dev_wfd = -1, bl_devices_changed;
 int    pidfd = -1;
 
 
@@ -112,6 +117,31 @@ static int bl_update_path(enum bl_path_state_e state, struct bl_disk *disk)
 	return 1;
 }
 
+static void bl_free_serial(struct bl_serial *serial)
+{
+	if (serial) {
+		free(serial->data);
+		free(serial);
+	}
+}
+
+static struct bl_serial *bl_dup_serial(const struct bl_serial *serial)
+{
+	struct bl_serial *new;
+
+	new = malloc(sizeof(*new));
+	if (!new)
+		return NULL;
+	new->len = serial->len;
+	new->data = malloc(serial->len);
+	if (!new->data) {
+		free(new);
+		return NULL;
+	}
+	memcpy(new->data, serial->data, serial->len);
+	return new;
+}
+
 static void bl_release_disk(void)
 {
 	struct bl_disk *disk;
@@ -126,54 +156,231 @@ static void bl_release_disk(void)
 			free(path);
 			path = disk->paths;
 		}
-		if (disk->serial)
-			free(disk->serial);
+		bl_free_serial(disk->serial);
 		visible_disk_list = disk->next;
 		free(disk);
 	}
 }
 
-static void bl_add_disk(char *filepath)
+/*
+ * What was found out about one block device.  Probes are kept from one
+ * discovery to the next, keyed by device number and disk sequence
+ * number, so that the serial of a device is only read with SCSI
+ * inquiries when it first appears.  The kernel gives a new disk
+ * sequence number to each disk it sees, so a new disk that reuses the
+ * device number of an old one is probed again.
+ */
+struct bl_probe {
+	struct bl_probe *next;
+	char *path;
+	dev_t dev;
+	unsigned long long diskseq;	/* 0 if the kernel has none */
+	off_t size;
+	struct bl_serial *serial;	/* NULL until probed */
+	enum bl_path_state_e state;
+	unsigned int seen;		/* discovery that last listed it */
+	int todo;			/* BL_PROBE_* to do this discovery */
+};
+
+#define BL_PROBE_SERIAL		0x1
+#define BL_PROBE_STATE		0x2
+
+#define BL_DISCOVERY_THREADS	16
+#define BL_DISCOVERY_MAXTHREADS	64
+
+static struct bl_probe *bl_probes;
+static unsigned int bl_discovery;
+static int bl_discovery_threads = BL_DISCOVERY_THREADS;
+
+static void bl_free_probe(struct bl_probe *probe)
+{
+	bl_sig_forget(probe->dev);
+	free(probe->path);
+	bl_free_serial(probe->serial);
+	free(probe);
+}
+
+static unsigned long long bl_read_diskseq(const char *devname)
+{
+	char path[PATH_MAX], buf[32];
+	unsigned long long seq = 0;
+	ssize_t n;
+	int fd;
+
+	snprintf(path, sizeof(path), "/sys/block/%s/diskseq", devname);
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return 0;
+	n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (n > 0) {
+		buf[n] = '\0';
+		seq = strtoull(buf, NULL, 10);
+	}
+	return seq;
+}
+
+/*
+ * Find or make the probe for /dev/@devname, and decide what needs
+ * to be read from the device.
+ */
+static struct bl_probe *bl_get_probe(const char *devname, int refresh)
+{
+	char filepath[PATH_MAX];
+	unsigned long long diskseq;
+	struct bl_probe *probe, **pp;
+	struct stat sb;
+
+	snprintf(filepath, sizeof(filepath), "/dev/%s", devname);
+	if (stat(filepath, &sb) < 0 || !S_ISBLK(sb.st_mode))
+		return NULL;
+	diskseq = bl_read_diskseq(devname);
+
+	for (pp = &bl_probes; (probe = *pp) != NULL; pp = &probe->next)
+		if (probe->dev == sb.st_rdev)
+			break;
+	if (probe && (probe->diskseq != diskseq ||
+		      strcmp(probe->path, filepath) != 0)) {
+		*pp = probe->next;
+		bl_free_probe(probe);
+		probe = NULL;
+	}
+
+	if (!probe) {
+		probe = calloc(1, sizeof(*probe));
+		if (!probe)
+			goto out_nomem;
+		probe->path = strdup(filepath);
+		if (!probe->path) {
+			free(probe);
+			goto out_nomem;
+		}
+		probe->dev = sb.st_rdev;
+		probe->diskseq = diskseq;
+		probe->next = bl_probes;
+		bl_probes = probe;
+	}
+
+	if (probe->seen == bl_discovery)
+		return NULL;	/* listed twice */
+	probe->seen = bl_discovery;
+	probe->todo = 0;
+	if (!probe->serial)
+		probe->todo = BL_PROBE_SERIAL | BL_PROBE_STATE;
+	else if (refresh && !dm_is_dm_major(major(probe->dev)))
+		probe->todo = BL_PROBE_STATE;
+	return probe;
+
+ out_nomem:
+	BL_LOG_ERR("%s: Out of memory!\n", __func__);
+	return NULL;
+}
+
+/* Read what @probe needs from its device; may run in several threads */
+static void bl_probe_device(struct bl_probe *probe)
 {
-	struct bl_disk *disk = NULL;
-	int fd = 0;
 	struct stat sb;
 	off_t size = 0;
-	struct bl_serial *serial = NULL;
-	enum bl_path_state_e ap_state;
-	struct bl_disk_path *diskpath = NULL, *path = NULL;
-	dev_t dev;
+	int fd;
 
-	fd = open(filepath, O_RDONLY | O_LARGEFILE);
+	fd = open(probe->path, O_RDONLY | O_LARGEFILE);
 	if (fd < 0)
-		return;
-
-	if (fstat(fd, &sb)) {
+		goto out_fail;
+	if (fstat(fd, &sb) || sb.st_rdev != probe->dev) {
 		close(fd);
-		return;
+		goto out_fail;
 	}
 
 	if (!sb.st_size)
 		ioctl(fd, BLKGETSIZE, &size);
 	else
 		size = sb.st_size;
-
+	probe->size = size;
 	if (!size) {
 		close(fd);
-		return;
+		goto out_fail;
 	}
 
-	dev = sb.st_rdev;
-	serial = bldev_read_serial(fd, filepath);
-	if (!serial) {
-		BL_LOG_ERR("%s: no serial found for %s\n",
-				 __func__, filepath);
-		ap_state = BL_PATH_STATE_PASSIVE;
-	} else if (dm_is_dm_major(major(dev)))
-		ap_state = BL_PATH_STATE_PSEUDO;
+	if (probe->todo & BL_PROBE_SERIAL) {
+		probe->serial = bldev_read_serial(fd, probe->path);
+		if (!probe->serial)
+			BL_LOG_ERR("%s: no serial found for %s\n",
+				   __func__, probe->path);
+	}
+	if (!probe->serial)
+		probe->state = BL_PATH_STATE_PASSIVE;
+	else if (dm_is_dm_major(major(probe->dev)))
+		probe->state = BL_PATH_STATE_PSEUDO;
 	else
-		ap_state = bldev_read_ap_state(fd);
+		probe->state = bldev_read_ap_state(fd);
 	close(fd);
+	return;
+
+ out_fail:
+	/* Try again next time */
+	bl_free_serial(probe->serial);
+	probe->serial = NULL;
+	probe->size = 0;
+}
+
+struct bl_probe_work {
+	struct bl_probe **probes;
+	unsigned int count;
+	unsigned int next;
+	pthread_mutex_t lock;
+};
+
+static void *bl_probe_worker(void *data)
+{
+	struct bl_probe_work *work = data;
+	unsigned int i;
+
+	for (;;) {
+		pthread_mutex_lock(&work->lock);
+		i = work->next++;
+		pthread_mutex_unlock(&work->lock);
+		if (i >= work->count)
+			break;
+		bl_probe_device(work->probes[i]);
+	}
+	return NULL;
+}
+
+/* Probe @count devices, several at a time */
+static void bl_probe_devices(struct bl_probe **probes, unsigned int count)
+{
+	struct bl_probe_work work = {
+		.probes = probes,
+		.count = count,
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+	};
+	pthread_t threads[BL_DISCOVERY_MAXTHREADS];
+	int i, nthreads, started = 0;
+
+	nthreads = bl_discovery_threads;
+	if (nthreads > BL_DISCOVERY_MAXTHREADS)
+		nthreads = BL_DISCOVERY_MAXTHREADS;
+	if ((unsigned int)nthreads > count)
+		nthreads = count;
+	for (i = 1; i < nthreads; i++) {
+		if (pthread_create(&threads[started], NULL,
+				   bl_probe_worker, &work) != 0)
+			break;
+		started++;
+	}
+	bl_probe_worker(&work);
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+}
+
+static void bl_add_disk(struct bl_probe *probe)
+{
+	struct bl_disk *disk = NULL;
+	struct bl_serial *serial = probe->serial;
+	struct bl_disk_path *diskpath = NULL, *path = NULL;
+
+	if (!serial || !probe->size)
+		return;
 
 	for (disk = visible_disk_list; disk != NULL; disk = disk->next) {
 		/* Already scanned or a partition?
@@ -181,18 +388,13 @@ static void bl_add_disk(char *filepath)
 		 */
 		if ((serial->len == disk->serial->len) &&
 		    !memcmp(serial->data, disk->serial->data, serial->len)) {
-			diskpath = bl_get_path(filepath, disk->paths);
+			diskpath = bl_get_path(probe->path, disk->paths);
 			break;
 		}
 	}
 
-	if (disk && diskpath) {
-		if (serial) {
-			free(serial->data);
-			free(serial);
-		}
+	if (disk && diskpath)
 		return;
-	}
 
 	/* add path */
 	path = malloc(sizeof(struct bl_disk_path));
@@ -201,8 +403,8 @@ static void bl_add_disk(char *filepath)
 		goto out_err;
 	}
 	path->next = NULL;
-	path->state = ap_state;
-	path->full_path = strdup(filepath);
+	path->state = probe->state;
+	path->full_path = strdup(probe->path);
 	if (!path->full_path)
 		goto out_err;
 
@@ -212,10 +414,15 @@ static void bl_add_disk(char *filepath)
 			BL_LOG_ERR("%s: Out of memory!\n", __func__);
 			goto out_err;
 		}
+		disk->serial = bl_dup_serial(serial);
+		if (!disk->serial) {
+			BL_LOG_ERR("%s: Out of memory!\n", __func__);
+			free(disk);
+			goto out_err;
+		}
 		disk->next = visible_disk_list;
-		disk->dev = dev;
-		disk->size = size;
-		disk->serial = serial;
+		disk->dev = probe->dev;
+		disk->size = probe->size;
 		disk->valid_path = path;
 		disk->paths = path;
 		visible_disk_list = disk;
@@ -224,14 +431,10 @@ static void bl_add_disk(char *filepath)
 		disk->paths = path;
 		/* check whether we need to update disk info */
 		if (bl_update_path(path->state, disk)) {
-			disk->dev = dev;
-			disk->size = size;
+			disk->dev = probe->dev;
+			disk->size = probe->size;
 			disk->valid_path = path;
 		}
-		if (serial) {
-			free(serial->data);
-			free(serial);
-		}
 	}
 	return;
 
@@ -241,27 +444,30 @@ static void bl_add_disk(char *filepath)
 			free(path->full_path);
 		free(path);
 	}
-	if (serial) {
-		free(serial->data);
-		free(serial);
-	}
 	return;
 }
 
-int bl_discover_devices(void)
+/*
+ * Rebuild the list of visible disks.  Devices that appeared since the
+ * last discovery are probed, several at a time.  With @refresh, the
+ * path state of the others is read again too, since a multipath
+ * failover may have changed which path is active.
+ */
+int bl_discover_devices(int refresh)
 {
 	FILE *f;
 	int n;
 	char buf[PATH_MAX], devname[NAME_MAX], fulldevname[PATH_MAX];
-
-	/* release previous list */
-	bl_release_disk();
+	struct bl_probe **listed = NULL, **todo = NULL, **new;
+	struct bl_probe *probe, **pp;
+	unsigned int nlisted = 0, ntodo = 0, size = 0, i;
 
 	/* scan all block devices */
 	f = fopen("/proc/partitions", "r");
 	if (f == NULL)
 		return 0;
 
+	bl_discovery++;
 	while (1) {
 		if (fgets(buf, sizeof buf, f) == NULL)
 			break;
@@ -272,12 +478,52 @@ int bl_discover_devices(void)
 			 devname);
 		if (access(fulldevname, F_OK) < 0)
 			continue;
-		snprintf(fulldevname, sizeof fulldevname, "/dev/%s", devname);
-		bl_add_disk(fulldevname);
+		probe = bl_get_probe(devname, refresh);
+		if (!probe)
+			continue;
+		if (nlisted == size) {
+			size = size ? size * 2 : 64;
+			new = realloc(listed, size * sizeof(*listed));
+			if (!new) {
+				BL_LOG_ERR("%s: Out of memory!\n", __func__);
+				break;
+			}
+			listed = new;
+			new = realloc(todo, size * sizeof(*todo));
+			if (!new) {
+				BL_LOG_ERR("%s: Out of memory!\n", __func__);
+				break;
+			}
+			todo = new;
+		}
+		listed[nlisted++] = probe;
+		if (probe->todo)
+			todo[ntodo++] = probe;
 	}
 
 	fclose(f);
 
+	/* forget devices that went away */
+	for (pp = &bl_probes; (probe = *pp) != NULL; ) {
+		if (probe->seen != bl_discovery) {
+			*pp = probe->next;
+			bl_free_probe(probe);
+		} else
+			pp = &probe->next;
+	}
+
+	if (ntodo) {
+		BL_LOG_DEBUG("%s: probing %u of %u devices\n",
+			     __func__, ntodo, nlisted);
+		bl_probe_devices(todo, ntodo);
+	}
+
+	bl_release_disk();
+	for (i = 0; i < nlisted; i++)
+		bl_add_disk(listed[i]);
+
+	free(todo);
+	free(listed);
 	return 0;
 }
 
@@ -332,7 +578,7 @@ static int bl_disk_inquiry_process(int fd)
 		 * active and a standby LUN), this will re-order them in the
 		 * correct priority.
 		 */
-		bl_discover_devices();
+		bl_discover_devices(1);
 		if (!process_deviceinfo(buf, buflen, &major, &minor)) {
 			reply.status = BL_DEVICE_REQUEST_ERR;
 			break;
@@ -382,7 +628,10 @@ static void bl_rpcpipe_cb(void)
 	while (rc > curr_byte) {
 		event = (struct inotify_event *)&eventArr[curr_byte];
 		curr_byte += EVENT_SIZE + event->len;
-		if (event->wd == rpc_pipedir_wfd) {
+		if (event->wd == dev_wfd) {
+			/* picked up once /dev settles, see bl_event_helper */
+			bl_devices_changed = 1;
+		} else if (event->wd == rpc_pipedir_wfd) {
 			if (strncmp(event->name, "nfs", 3))
 				continue;
 			if (event->mask & IN_CREATE) {
@@ -424,6 +673,7 @@ static void bl_rpcpipe_cb(void)
 static int bl_event_helper(void)
 {
 	fd_set rset;
+	struct timeval tv;
 	int ret = 0, maxfd;
 
 	for (;;) {
@@ -432,7 +682,11 @@ static int bl_event_helper(void)
 		if (bl_pipe_fd > 0)
 			FD_SET(bl_pipe_fd, &rset);
 		maxfd = (bl_watch_fd>bl_pipe_fd)?bl_watch_fd:bl_pipe_fd;
-		switch (select(maxfd + 1, &rset, NULL, NULL, NULL)) {
+		/* wait for a burst of device changes to end */
+		tv.tv_sec = BL_DEVICE_SETTLE;
+		tv.tv_usec = 0;
+		switch (select(maxfd + 1, &rset, NULL, NULL,
+			       bl_devices_changed ? &tv : NULL)) {
 		case -1:
 			if (errno == EINTR)
 				continue;
@@ -441,7 +695,10 @@ static int bl_event_helper(void)
 				goto out;
 			}
 		case 0:
-			goto out;
+			/* only devices that appeared are probed */
+			bl_devices_changed = 0;
+			bl_discover_devices(0);
+			break;
 		default:
 			if (FD_ISSET(bl_watch_fd, &rset))
 				bl_rpcpipe_cb();
@@ -480,6 +737,10 @@ int main(int argc, char **argv)
 	CONF_SAVE(xrpcpipe_dir, conf_get_str("general", "pipefs-directory"));
 	if (xrpcpipe_dir != NULL)
 		strlcpy(rpcpipe_dir, xrpcpipe_dir, sizeof(rpcpipe_dir));
+	bl_discovery_threads = conf_get_num("blkmapd", "discovery-threads",
+					    BL_DISCOVERY_THREADS);
+	if (bl_discovery_threads < 1)
+		bl_discovery_threads = 1;
 
 	strncpy(nfspipe_dir, rpcpipe_dir, sizeof(nfspipe_dir));
 	strlcat(nfspipe_dir, "/nfs", sizeof(nfspipe_dir));
@@ -536,7 +797,7 @@ int main(int argc, char **argv)
 	signal(SIGHUP, SIG_IGN);
 
 	if (dflag) {
-		ret = bl_discover_devices();
+		ret = bl_discover_devices(1);
 		goto out;
 	}
 
@@ -548,6 +809,7 @@ int main(int argc, char **argv)
 	/* open pipe file */
 	bl_watch_dir(rpcpipe_dir, &rpc_pipedir_wfd);
 	bl_watch_dir(nfspipe_dir, &nfs_pipedir_wfd);
+	bl_watch_dir("/dev", &dev_wfd);
 
 	bl_pipe_fd = open(bl_pipe_file, O_RDWR);
 	if (bl_pipe_fd < 0)
@@ -555,7 +817,7 @@ int main(int argc, char **argv)
 
 	while (1) {
 		/* discover device when needed */
-		bl_discover_devices();
+		bl_discover_devices(0);
 
 		ret = bl_event_helper();
 		if (ret < 0) {
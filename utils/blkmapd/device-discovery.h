@@ -148,12 +148,13 @@ int dm_device_remove_all(uint64_t *dev);
 uint64_t process_deviceinfo(const char *dev_addr_buf,
 			    unsigned int dev_addr_len,
 			    uint32_t *major, uint32_t *minor);
+void bl_sig_forget(dev_t dev);
 
 extern ssize_t atomicio(ssize_t(*f) (int, void *, size_t),
 			int fd, void *_s, size_t n);
 extern struct bl_serial *bldev_read_serial(int fd, const char *filename);
 extern enum bl_path_state_e bldev_read_ap_state(int fd);
-extern int bl_discover_devices(void);
+extern int bl_discover_devices(int refresh);
 
 #define BL_LOG_INFO(fmt...)		syslog(LOG_INFO, fmt)
 #define BL_LOG_WARNING(fmt...)		syslog(LOG_WARNING, fmt)
@@ -96,42 +96,137 @@ static int decode_blk_signature(uint32_t **pp, uint32_t * end,
 }
 
 /*
- * Read signature from device and compare to sig_comp
- * return: 0=match, 1=no match, -1=error
+ * Signature bytes read from disks are kept, so that each (disk,
+ * offset, length) is read once however many volumes and requests ask
+ * about it.  Signatures that were matched are also indexed by a hash
+ * of all their components, so a request for a volume seen before maps
+ * straight to its disk.  Both are dropped for a device when discovery
+ * sees it go away or come back as a new disk; see bl_sig_forget().
  */
-static int
-read_cmp_blk_sig(struct bl_disk *disk, int fd, struct bl_sig_comp *comp)
+#define BL_SIG_HASHSIZE	256
+
+struct bl_sig_read {
+	struct bl_sig_read *next;
+	dev_t dev;
+	int64_t offset;			/* as sent, maybe from the end */
+	uint32_t length;
+	char data[];
+};
+
+struct bl_sig_map {
+	struct bl_sig_map *next;
+	uint64_t hash;
+	dev_t dev;
+};
+
+static struct bl_sig_read *bl_sig_reads[BL_SIG_HASHSIZE];
+static struct bl_sig_map *bl_sig_maps[BL_SIG_HASHSIZE];
+
+static unsigned int bl_sig_read_hash(dev_t dev, int64_t offset,
+				     uint32_t length)
+{
+	uint64_t h = (uint64_t)dev * 0x9e3779b97f4a7c15ULL;
+
+	h ^= (uint64_t)offset + ((uint64_t)length << 40);
+	h *= 0x9e3779b97f4a7c15ULL;
+	return (unsigned int)(h >> 32) % BL_SIG_HASHSIZE;
+}
+
+/* FNV-1a over every component of sig */
+static uint64_t bl_sig_hash(const struct bl_sig *sig)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+	const unsigned char *c;
+	int i;
+	uint32_t j;
+
+	for (i = 0; i < sig->si_num_comps; i++) {
+		const struct bl_sig_comp *comp = &sig->si_comps[i];
+		uint64_t off = (uint64_t)comp->bs_offset;
+
+		for (j = 0; j < 8; j++, off >>= 8)
+			h = (h ^ (off & 0xff)) * 0x100000001b3ULL;
+		c = (const unsigned char *)comp->bs_string;
+		for (j = 0; j < comp->bs_length; j++)
+			h = (h ^ c[j]) * 0x100000001b3ULL;
+		h = (h ^ 0xff) * 0x100000001b3ULL;
+	}
+	return h;
+}
+
+/* Forget what was read from device dev */
+void bl_sig_forget(dev_t dev)
+{
+	struct bl_sig_read *rd, **rp;
+	struct bl_sig_map *map, **mp;
+	int i;
+
+	for (i = 0; i < BL_SIG_HASHSIZE; i++) {
+		for (rp = &bl_sig_reads[i]; (rd = *rp) != NULL; ) {
+			if (rd->dev == dev) {
+				*rp = rd->next;
+				free(rd);
+			} else
+				rp = &rd->next;
+		}
+		for (mp = &bl_sig_maps[i]; (map = *mp) != NULL; ) {
+			if (map->dev == dev) {
+				*mp = map->next;
+				free(map);
+			} else
+				mp = &map->next;
+		}
+	}
+}
+
+/*
+ * Find the bytes of comp on disk, reading them if they are not known
+ * yet.  *fd is opened on first use.  Returns NULL on error.
+ */
+static const char *
+read_blk_sig(struct bl_disk *disk, int *fd, struct bl_sig_comp *comp)
 {
 	const char *dev_name = disk->valid_path->full_path;
-	int ret = -1;
 	ssize_t siglen = comp->bs_length;
 	int64_t bs_offset = comp->bs_offset;
-	char *sig = NULL;
+	struct bl_sig_read *rd, **head;
+
+	head = &bl_sig_reads[bl_sig_read_hash(disk->dev, comp->bs_offset,
+					      comp->bs_length)];
+	for (rd = *head; rd; rd = rd->next)
+		if (rd->dev == disk->dev && rd->offset == comp->bs_offset &&
+		    rd->length == comp->bs_length)
+			return rd->data;
+
+	if (*fd < 0) {
+		*fd = open(dev_name, O_RDONLY | O_LARGEFILE);
+		if (*fd < 0) {
+			BL_LOG_ERR("%s: %s could not be opened for read\n",
+				   __func__, dev_name);
+			return NULL;
+		}
+	}
 
-	sig = (char *)malloc(siglen);
-	if (!sig) {
+	rd = malloc(sizeof(*rd) + siglen);
+	if (!rd) {
 		BL_LOG_ERR("%s: Out of memory\n", __func__);
-		goto out;
+		return NULL;
 	}
 
 	if (bs_offset < 0)
 		bs_offset += (((int64_t) disk->size) << 9);
-	if (lseek64(fd, bs_offset, SEEK_SET) == -1) {
-		BL_LOG_ERR("File %s lseek error\n", dev_name);
-		goto out;
-	}
-
-	if (read(fd, sig, siglen) != siglen) {
+	if (pread64(*fd, rd->data, siglen, bs_offset) != siglen) {
 		BL_LOG_ERR("File %s read error\n", dev_name);
-		goto out;
+		free(rd);
+		return NULL;
 	}
 
-	ret = memcmp(sig, comp->bs_string, siglen);
-
- out:
-	if (sig)
-		free(sig);
-	return ret;
+	rd->dev = disk->dev;
+	rd->offset = comp->bs_offset;
+	rd->length = comp->bs_length;
+	rd->next = *head;
+	*head = rd;
+	return rd->data;
 }
 
 /*
@@ -140,20 +235,15 @@ read_cmp_blk_sig(struct bl_disk *disk, int fd, struct bl_sig_comp *comp)
  */
 static int verify_sig(struct bl_disk *disk, struct bl_sig *sig)
 {
-	const char *dev_name = disk->valid_path->full_path;
-	int fd, i, rv;
-
-	fd = open(dev_name, O_RDONLY | O_LARGEFILE);
-	if (fd < 0) {
-		BL_LOG_ERR("%s: %s could not be opened for read\n", __func__,
-			   dev_name);
-		return 0;
-	}
+	const char *data;
+	int fd = -1, i, rv;
 
 	rv = 1;
 
 	for (i = 0; i < sig->si_num_comps; i++) {
-		if (read_cmp_blk_sig(disk, fd, &sig->si_comps[i])) {
+		data = read_blk_sig(disk, &fd, &sig->si_comps[i]);
+		if (!data || memcmp(data, sig->si_comps[i].bs_string,
+				    sig->si_comps[i].bs_length)) {
 			rv = 0;
 			break;
 		}
@@ -164,30 +254,65 @@ static int verify_sig(struct bl_disk *disk, struct bl_sig *sig)
 	return rv;
 }
 
+static struct bl_disk *bl_find_disk(dev_t dev)
+{
+	struct bl_disk *disk;
+
+	for (disk = visible_disk_list; disk; disk = disk->next)
+		if (disk->dev == dev)
+			return disk;
+	return NULL;
+}
+
 /*
  * map_sig_to_device()
- * Given a signature, walk the list of visible disks searching for
- * a match. Returns True if mapping was done, False otherwise.
+ * Given a signature, look for a disk it matched before, else walk
+ * the list of visible disks searching for a match.  Returns True if
+ * mapping was done, False otherwise.
  *
  * While we're at it, fill in the vol->bv_size.
  */
 static int map_sig_to_device(struct bl_sig *sig, struct bl_volume *vol)
 {
 	int mapped = 0;
-	struct bl_disk *disk;
+	uint64_t hash = bl_sig_hash(sig);
+	struct bl_sig_map *map, **head;
+	struct bl_disk *disk = NULL;
+
+	head = &bl_sig_maps[hash % BL_SIG_HASHSIZE];
+	for (map = *head; map; map = map->next) {
+		if (map->hash != hash)
+			continue;
+		/* the bytes are known, so this does no I/O */
+		disk = bl_find_disk(map->dev);
+		if (disk && verify_sig(disk, sig)) {
+			mapped = 1;
+			break;
+		}
+	}
 
 	/* scan disk list to find out match device */
-	for (disk = visible_disk_list; disk; disk = disk->next) {
-		/* FIXME: should we use better algorithm for disk scan? */
-		mapped = verify_sig(disk, sig);
-		if (mapped) {
-			BL_LOG_INFO("%s: using device %s\n",
-					__func__, disk->valid_path->full_path);
-			vol->param.bv_dev = disk->dev;
-			vol->bv_size = disk->size;
-			break;
+	if (!mapped) {
+		for (disk = visible_disk_list; disk; disk = disk->next) {
+			mapped = verify_sig(disk, sig);
+			if (mapped)
+				break;
+		}
+		map = mapped ? malloc(sizeof(*map)) : NULL;
+		if (map) {
+			map->hash = hash;
+			map->dev = disk->dev;
+			map->next = *head;
+			*head = map;
 		}
 	}
+
+	if (mapped) {
+		BL_LOG_INFO("%s: using device %s\n",
+				__func__, disk->valid_path->full_path);
+		vol->param.bv_dev = disk->dev;
+		vol->bv_size = disk->size;
+	}
 	return mapped;
 }
 
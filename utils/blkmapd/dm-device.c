@@ -27,6 +27,7 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 #include <linux/kdev_t.h>
 
 #include <stdio.h>
@@ -326,8 +327,82 @@ static int bl_dm_create_tree(uint64_t dev)
 	return 1;
 }
 
+/*
+ * The devices made for each layout, by a description of its volumes,
+ * so that device info for a layout that already has them, as when
+ * several file systems are on the same volume, takes another reference
+ * to them rather than making new ones.  They are removed along with
+ * the last reference.
+ */
+struct bl_dm_layout {
+	char *key;
+	uint64_t dev;
+	unsigned int refs;
+	struct bl_dm_layout *next;
+};
+
+static struct bl_dm_layout *bl_layout_head;
+
+static char *bl_dm_layout_key(struct bl_volume *vols, int num_vols)
+{
+	size_t size = 64 * num_vols, len = 0;
+	char *key, *new;
+	int i, j, n;
+
+	key = malloc(size);
+	for (i = 0; key && i < num_vols; i++) {
+		for (j = -1; j < vols[i].bv_vol_n; j++) {
+			if (size - len < 64) {
+				size *= 2;
+				new = realloc(key, size);
+				if (!new) {
+					free(key);
+					return NULL;
+				}
+				key = new;
+			}
+			if (j < 0)
+				n = sprintf(key + len, "%u:%lld:%lld",
+					    vols[i].bv_type,
+					    (long long)vols[i].bv_size,
+					    (long long)vols[i].param.bv_offset);
+			else
+				n = sprintf(key + len, ",%ld",
+					    (long)(vols[i].bv_vols[j] - vols));
+			len += n;
+		}
+		key[len++] = ';';
+		key[len] = '\0';
+	}
+	return key;
+}
+
+static struct bl_dm_layout *bl_dm_layout_find_dev(uint64_t dev)
+{
+	struct bl_dm_layout *p;
+
+	for (p = bl_layout_head; p; p = p->next)
+		if (p->dev == dev)
+			break;
+	return p;
+}
+
+static void bl_dm_layout_del(struct bl_dm_layout *layout)
+{
+	struct bl_dm_layout **pp;
+
+	for (pp = &bl_layout_head; *pp; pp = &(*pp)->next)
+		if (*pp == layout) {
+			*pp = layout->next;
+			break;
+		}
+	free(layout->key);
+	free(layout);
+}
+
 int dm_device_remove_all(uint64_t *dev)
 {
+	struct bl_dm_layout *layout;
 	struct bl_dm_tree *p;
 	struct dm_tree_node *node;
 	const char *uuid;
@@ -338,6 +413,14 @@ int dm_device_remove_all(uint64_t *dev)
 	memcpy(&major, dev, sizeof(uint32_t));
 	memcpy(&minor, (void *)dev + sizeof(uint32_t), sizeof(uint32_t));
 	bl_dev = MKDEV(major, minor);
+
+	/* Other layouts may still be using the devices */
+	layout = bl_dm_layout_find_dev(bl_dev);
+	if (layout && --layout->refs > 0)
+		return 1;
+	if (layout)
+		bl_dm_layout_del(layout);
+
 	p = find_bl_dm_tree(bl_dev);
 	if (!p)
 		return ret;
@@ -366,160 +449,302 @@ static int dm_device_exists(char *dev_name)
 	return (access(fullname, F_OK) >= 0);
 }
 
-/* TODO: check the value for DM_DEV_NAME_LEN, DM_TYPE_LEN, DM_PARAMS_LEN */
-uint64_t dm_device_create(struct bl_volume *vols, int num_vols)
+/*
+ * Build the table of the device for volume @node, whose subvolumes
+ * already have devices.  Returns NULL if it can't be built.
+ */
+static struct bl_dm_table *bl_dm_build_table(struct bl_volume *node)
 {
-	uint64_t size, stripe_unit, dev = 0;
-	unsigned int count = dev_count;
-	int volnum, i, pos;
-	struct bl_volume *node;
+	uint64_t size, stripe_unit, dev;
+	int i, pos;
 	char *tmp;
 	struct bl_dm_table *table = NULL;
 	struct bl_dm_table *bl_table_head = NULL;
 	unsigned int len;
-	char *dev_name = NULL;
 
-	/* Create pseudo device here */
-	for (volnum = 0; volnum < num_vols; volnum++) {
-		node = &vols[volnum];
-		switch (node->bv_type) {
-		case BLOCK_VOLUME_SIMPLE:
-			/* Do not need to create device here */
-			dev = node->param.bv_dev;
-			goto continued;
-		case BLOCK_VOLUME_SLICE:
+	switch (node->bv_type) {
+	case BLOCK_VOLUME_SLICE:
+		table = bl_dm_table_alloc();
+		if (!table)
+			goto out;
+		table->offset = 0;
+		table->size = node->bv_size;
+		strcpy(table->target_type, "linear");
+		if (!TYPE_HAS_DEV(node->bv_vols[0]->bv_type)) {
+			free(table);
+			goto out;
+		}
+		dev = node->bv_vols[0]->param.bv_dev;
+		tmp = table->params;
+		BL_LOG_INFO("%s: major %llu minor %llu", __func__,
+				(long long unsigned)MAJOR(dev), 
+				(long long unsigned)MINOR(dev));
+		if (!dm_format_dev(tmp, DM_PARAMS_LEN,
+				   MAJOR(dev), MINOR(dev))) {
+			free(table);
+			goto out;
+		}
+		tmp += strlen(tmp);
+		sprintf(tmp, " %llu", 
+			(long long unsigned)node->param.bv_offset);
+		add_to_bl_dm_table(&bl_table_head, table);
+		break;
+	case BLOCK_VOLUME_STRIPE:
+		table = bl_dm_table_alloc();
+		if (!table)
+			goto out;
+		table->offset = 0;
+		/* Truncate size to a stripe unit boundary */
+		stripe_unit = node->param.bv_stripe_unit;
+		table->size =
+		    node->bv_size - (node->bv_size % stripe_unit);
+		strcpy(table->target_type, "striped");
+		sprintf(table->params, "%d %llu %n", node->bv_vol_n,
+			(long long unsigned) stripe_unit, &pos);
+		/* Copy subdev major:minor to params */
+		tmp = table->params + pos;
+		len = DM_PARAMS_LEN - pos;
+		for (i = 0; i < node->bv_vol_n; i++) {
+			if (!TYPE_HAS_DEV(node->bv_vols[i]->bv_type)) {
+				free(table);
+				goto out;
+			}
+			dev = node->bv_vols[i]->param.bv_dev;
+			if (!dm_format_dev(tmp, len, MAJOR(dev),
+					   MINOR(dev))) {
+				free(table);
+				goto out;
+			}
+			pos = strlen(tmp);
+			tmp += pos;
+			len -= pos;
+			sprintf(tmp, " %d ", 0);
+			tmp += 3;
+			len -= 3;
+		}
+		add_to_bl_dm_table(&bl_table_head, table);
+		break;
+	case BLOCK_VOLUME_CONCAT:
+		size = 0;
+		for (i = 0; i < node->bv_vol_n; i++) {
 			table = bl_dm_table_alloc();
 			if (!table)
 				goto out;
-			table->offset = 0;
-			table->size = node->bv_size;
-			strcpy(table->target_type, "linear");
-			if (!TYPE_HAS_DEV(node->bv_vols[0]->bv_type)) {
+			table->offset = size;
+			table->size = node->bv_vols[i]->bv_size;
+			if (!TYPE_HAS_DEV(node->bv_vols[i]->bv_type)) {
 				free(table);
 				goto out;
 			}
-			dev = node->bv_vols[0]->param.bv_dev;
+			strcpy(table->target_type, "linear");
 			tmp = table->params;
-			BL_LOG_INFO("%s: major %llu minor %llu", __func__,
-					(long long unsigned)MAJOR(dev), 
-					(long long unsigned)MINOR(dev));
+			dev = node->bv_vols[i]->param.bv_dev;
+			BL_LOG_INFO("%s: major %lu minor %lu", __func__,
+				(long unsigned int)MAJOR(dev), 
+				(long unsigned int)MINOR(dev));
 			if (!dm_format_dev(tmp, DM_PARAMS_LEN,
 					   MAJOR(dev), MINOR(dev))) {
 				free(table);
 				goto out;
 			}
 			tmp += strlen(tmp);
-			sprintf(tmp, " %llu", 
-				(long long unsigned)node->param.bv_offset);
+			sprintf(tmp, " %d", 0);
+			size += table->size;
 			add_to_bl_dm_table(&bl_table_head, table);
-			break;
-		case BLOCK_VOLUME_STRIPE:
-			table = bl_dm_table_alloc();
-			if (!table)
-				goto out;
-			table->offset = 0;
-			/* Truncate size to a stripe unit boundary */
-			stripe_unit = node->param.bv_stripe_unit;
-			table->size =
-			    node->bv_size - (node->bv_size % stripe_unit);
-			strcpy(table->target_type, "striped");
-			sprintf(table->params, "%d %llu %n", node->bv_vol_n,
-				(long long unsigned) stripe_unit, &pos);
-			/* Copy subdev major:minor to params */
-			tmp = table->params + pos;
-			len = DM_PARAMS_LEN - pos;
-			for (i = 0; i < node->bv_vol_n; i++) {
-				if (!TYPE_HAS_DEV(node->bv_vols[i]->bv_type)) {
-					free(table);
-					goto out;
-				}
-				dev = node->bv_vols[i]->param.bv_dev;
-				if (!dm_format_dev(tmp, len, MAJOR(dev),
-						   MINOR(dev))) {
-					free(table);
-					goto out;
+		}
+		break;
+	default:
+		goto out;
+	}		/* end of swtich */
+	return bl_table_head;
+
+ out:
+	bl_dm_table_free(bl_table_head);
+	return NULL;
+}
+
+/*
+ * Most members of a striped or concatenated volume don't depend on
+ * each other, and each device takes several ioctls, and a wait for
+ * udev, to create.  libdevmapper keeps global state, and isn't safe to
+ * call from several threads at once, so the devices that only depend
+ * on devices already made are created together by as many as
+ * BL_DM_MAXPROCS child processes, each of which sends back the device
+ * number of its device.
+ */
+#define BL_DM_MAXPROCS	16
+
+static void
+dm_devices_create_mapped(char (*names)[DM_DEV_NAME_LEN],
+			 struct bl_dm_table **tables, uint64_t *devs, int n)
+{
+	int fds[BL_DM_MAXPROCS], pipefd[2];
+	pid_t pids[BL_DM_MAXPROCS];
+	int i, j, batch;
+	uint64_t dev;
+
+	if (n == 1) {
+		devs[0] = dm_device_create_mapped(names[0], tables[0]);
+		return;
+	}
+
+	for (i = 0; i < n; i += batch) {
+		batch = n - i;
+		if (batch > BL_DM_MAXPROCS)
+			batch = BL_DM_MAXPROCS;
+		for (j = 0; j < batch; j++) {
+			pids[j] = -1;
+			fds[j] = -1;
+			if (pipe(pipefd) == 0) {
+				pids[j] = fork();
+				if (pids[j] == 0) {
+					close(pipefd[0]);
+					dev = dm_device_create_mapped(names[i + j],
+								tables[i + j]);
+					if (write(pipefd[1], &dev, sizeof(dev)) < 0)
+						_exit(1);
+					_exit(0);
 				}
-				pos = strlen(tmp);
-				tmp += pos;
-				len -= pos;
-				sprintf(tmp, " %d ", 0);
-				tmp += 3;
-				len -= 3;
+				close(pipefd[1]);
+				fds[j] = pipefd[0];
 			}
-			add_to_bl_dm_table(&bl_table_head, table);
-			break;
-		case BLOCK_VOLUME_CONCAT:
-			size = 0;
-			for (i = 0; i < node->bv_vol_n; i++) {
-				table = bl_dm_table_alloc();
-				if (!table)
-					goto out;
-				table->offset = size;
-				table->size = node->bv_vols[i]->bv_size;
-				if (!TYPE_HAS_DEV(node->bv_vols[i]->bv_type)) {
-					free(table);
-					goto out;
-				}
-				strcpy(table->target_type, "linear");
-				tmp = table->params;
-				dev = node->bv_vols[i]->param.bv_dev;
-				BL_LOG_INFO("%s: major %lu minor %lu", __func__,
-					(long unsigned int)MAJOR(dev), 
-					(long unsigned int)MINOR(dev));
-				if (!dm_format_dev(tmp, DM_PARAMS_LEN,
-						   MAJOR(dev), MINOR(dev))) {
-					free(table);
-					goto out;
-				}
-				tmp += strlen(tmp);
-				sprintf(tmp, " %d", 0);
-				size += table->size;
-				add_to_bl_dm_table(&bl_table_head, table);
+			if (pids[j] < 0) {
+				/* do it here, then */
+				if (fds[j] >= 0)
+					close(fds[j]);
+				fds[j] = -1;
+				devs[i + j] = dm_device_create_mapped(names[i + j],
+								tables[i + j]);
 			}
-			break;
-		default:
-			/* Delete previous temporary devices */
-			dm_devicelist_remove(count, dev_count);
-			goto out;
-		}		/* end of swtich */
-		/* Create dev_name here. Name of device is pnfs_vol_XXX */
-		if (dev_name)
-			free(dev_name);
-		dev_name = (char *)calloc(DM_DEV_NAME_LEN, sizeof(char));
-		if (!dev_name) {
-			BL_LOG_ERR("%s: Out of memory\n", __func__);
-			goto out;
 		}
-		do {
-			snprintf(dev_name, DM_DEV_NAME_LEN, dm_name,
-				 dev_count++);
-		} while (dm_device_exists(dev_name));
-
-		dev = dm_device_create_mapped(dev_name, bl_table_head);
-		BL_LOG_INFO("%s: %d %s %d:%d\n", __func__, volnum, dev_name,
-			    (int) MAJOR(dev), (int) MINOR(dev));
-		if (!dev) {
-			/* Delete previous temporary devices */
-			dm_devicelist_remove(count, dev_count);
-			goto out;
+		for (j = 0; j < batch; j++) {
+			if (pids[j] < 0)
+				continue;
+			if (atomicio(read, fds[j], &dev, sizeof(dev)) != sizeof(dev))
+				dev = 0;
+			devs[i + j] = dev;
+			close(fds[j]);
+			while (waitpid(pids[j], NULL, 0) < 0 && errno == EINTR)
+				;
 		}
-		node->param.bv_dev = dev;
-		/* TODO: extend use with PSEUDO later */
-		node->bv_type = BLOCK_VOLUME_PSEUDO;
-
- continued:
-		if (bl_table_head)
-			bl_dm_table_free(bl_table_head);
-		bl_table_head = NULL;
 	}
- out:
-	if (bl_table_head) {
-		bl_dm_table_free(bl_table_head);
-		bl_table_head = NULL;
+	dm_task_update_nodes();
+}
+
+/* TODO: check the value for DM_DEV_NAME_LEN, DM_TYPE_LEN, DM_PARAMS_LEN */
+uint64_t dm_device_create(struct bl_volume *vols, int num_vols)
+{
+	uint64_t dev = 0, *devs = NULL;
+	unsigned int count = dev_count;
+	int volnum, i, n, level, maxlevel = 0, *levels = NULL;
+	struct bl_volume *node, **nodes = NULL;
+	struct bl_dm_table **tables = NULL;
+	char (*names)[DM_DEV_NAME_LEN] = NULL;
+	struct bl_dm_layout *layout;
+	char *key;
+
+	key = bl_dm_layout_key(vols, num_vols);
+	if (key && vols[num_vols - 1].bv_type != BLOCK_VOLUME_SIMPLE) {
+		for (layout = bl_layout_head; layout; layout = layout->next)
+			if (strcmp(layout->key, key) == 0 &&
+			    find_bl_dm_tree(layout->dev))
+				break;
+		if (layout) {
+			BL_LOG_INFO("%s: reusing %d:%d\n", __func__,
+				    (int) MAJOR(layout->dev),
+				    (int) MINOR(layout->dev));
+			layout->refs++;
+			free(key);
+			return layout->dev;
+		}
 	}
+
+	/* Each volume can be created once those it is made of have been */
+	levels = calloc(num_vols, sizeof(*levels));
+	nodes = calloc(num_vols, sizeof(*nodes));
+	tables = calloc(num_vols, sizeof(*tables));
+	devs = calloc(num_vols, sizeof(*devs));
+	names = calloc(num_vols, sizeof(*names));
+	if (!levels || !nodes || !tables || !devs || !names) {
+		BL_LOG_ERR("%s: Out of memory\n", __func__);
+		goto out;
+	}
+	for (volnum = 0; volnum < num_vols; volnum++) {
+		node = &vols[volnum];
+		if (node->bv_type == BLOCK_VOLUME_SIMPLE)
+			continue;
+		for (i = 0; i < node->bv_vol_n; i++)
+			if (levels[node->bv_vols[i] - vols] >= levels[volnum])
+				levels[volnum] = levels[node->bv_vols[i] - vols] + 1;
+		if (levels[volnum] > maxlevel)
+			maxlevel = levels[volnum];
+	}
+
+	for (level = 1; level <= maxlevel; level++) {
+		n = 0;
+		for (volnum = 0; volnum < num_vols; volnum++) {
+			if (levels[volnum] != level)
+				continue;
+			node = &vols[volnum];
+			tables[n] = bl_dm_build_table(node);
+			if (!tables[n]) {
+				while (n > 0)
+					bl_dm_table_free(tables[--n]);
+				/* Delete previous temporary devices */
+				dm_devicelist_remove(count, dev_count + 1);
+				goto out;
+			}
+			/* Name of device is pnfs_vol_XXX */
+			do {
+				snprintf(names[n], DM_DEV_NAME_LEN, dm_name,
+					 dev_count++);
+			} while (dm_device_exists(names[n]));
+			nodes[n++] = node;
+		}
+
+		dm_devices_create_mapped(names, tables, devs, n);
+
+		for (i = 0; i < n; i++) {
+			BL_LOG_INFO("%s: %d %s %d:%d\n", __func__,
+				    (int)(nodes[i] - vols), names[i],
+				    (int) MAJOR(devs[i]), (int) MINOR(devs[i]));
+			bl_dm_table_free(tables[i]);
+			tables[i] = NULL;
+			if (!devs[i])
+				continue;
+			nodes[i]->param.bv_dev = devs[i];
+			/* TODO: extend use with PSEUDO later */
+			nodes[i]->bv_type = BLOCK_VOLUME_PSEUDO;
+		}
+		for (i = 0; i < n; i++)
+			if (!devs[i]) {
+				/* Delete the temporary devices, this level's too */
+				dm_devicelist_remove(count, dev_count + 1);
+				goto out;
+			}
+	}
+
+	dev = vols[num_vols - 1].param.bv_dev;
+	if (key && maxlevel > 0) {
+		layout = malloc(sizeof(*layout));
+		if (layout) {
+			layout->key = key;
+			key = NULL;
+			layout->dev = dev;
+			layout->refs = 1;
+			layout->next = bl_layout_head;
+			bl_layout_head = layout;
+		}
+	}
+
+ out:
 	if (dev)
 		bl_dm_create_tree(dev);
-	if (dev_name)
-		free(dev_name);
+	free(key);
+	free(levels);
+	free(nodes);
+	free(tables);
+	free(devs);
+	free(names);
 	return dev;
 }
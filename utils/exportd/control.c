@@ -0,0 +1,415 @@
+/*
+ * utils/exportd/control.c
+ *
+ * A unix socket through which single exports can be added, changed
+ * or removed without exportfs(8) rewriting etab and every daemon
+ * then reloading all of it.  Each request is one line:
+ *
+ *	export CLIENT:PATH [OPTIONS]
+ *	unexport CLIENT:PATH
+ *	sync
+ *
+ * and is answered by "ok" or "error MESSAGE".  A change takes effect
+ * as soon as it is answered; etab is brought up to date shortly
+ * after, or at once on "sync".  Changes found in the exports files by
+ * watch.c are made, and written, the same way.
+ */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "nfslib.h"
+#include "xmalloc.h"
+#include "xlog.h"
+#include "xepoll.h"
+#include "export.h"
+#include "exportd.h"
+
+/* How often changes not yet in etab are written, in milliseconds */
+#define CONTROL_WRITE_INTERVAL	500
+#define CONTROL_LINE_MAX	4096
+
+struct control_conn {
+	char			buf[CONTROL_LINE_MAX];
+	size_t			len;
+};
+
+/* A change made since etab was last written, kept for replaying */
+struct control_op {
+	struct control_op *	next;
+	char *			client;
+	char *			path;
+	char *			options;	/* NULL to unexport */
+	struct exportent *	ent;		/* instead of options */
+};
+
+static struct control_op *	control_ops;
+static unsigned int		control_gen;
+
+static void
+control_op_free(struct control_op *op)
+{
+	free(op->client);
+	free(op->path);
+	free(op->options);
+	if (op->ent) {
+		exportent_release(op->ent);
+		free(op->ent);
+	}
+	free(op);
+}
+
+static void
+control_ops_free(void)
+{
+	struct control_op *op;
+
+	while ((op = control_ops) != NULL) {
+		control_ops = op->next;
+		control_op_free(op);
+	}
+}
+
+/* Remember a change, replacing an earlier one to the same export */
+static void
+control_op_add(char *client, char *path, char *options,
+	       struct exportent *eep)
+{
+	struct control_op *op, **opp;
+
+	for (opp = &control_ops; (op = *opp) != NULL; opp = &op->next)
+		if (strcmp(op->client, client) == 0 &&
+		    strcmp(op->path, path) == 0) {
+			*opp = op->next;
+			control_op_free(op);
+			break;
+		}
+	op = xmalloc(sizeof(*op));
+	op->next = NULL;
+	op->client = xstrdup(client);
+	op->path = xstrdup(path);
+	op->options = options ? xstrdup(options) : NULL;
+	op->ent = NULL;
+	if (eep) {
+		op->ent = xmalloc(sizeof(*op->ent));
+		dupexportent(op->ent, eep);
+		op->ent->e_hostname = strpool_get(eep->e_hostname);
+	}
+	for (opp = &control_ops; *opp; opp = &(*opp)->next)
+		;
+	*opp = op;
+}
+
+/*
+ * etab was reloaded, so the changes not yet written to it are gone
+ * from the export table: make them again.
+ */
+static void
+control_replay(void)
+{
+	struct control_op *op, **opp;
+	int err;
+
+	for (opp = &control_ops; (op = *opp) != NULL;) {
+		if (op->ent)
+			err = auth_export_set(op->ent);
+		else
+			err = auth_export_change(op->client, op->path,
+						 op->options);
+		if (err < 0) {
+			xlog(L_WARNING, "dropping change to %s:%s: %s",
+			     op->client, op->path, strerror(-err));
+			*opp = op->next;
+			control_op_free(op);
+			continue;
+		}
+		opp = &op->next;
+	}
+	control_gen = auth_generation();
+}
+
+static void
+control_catch_up(void)
+{
+	if (control_ops && auth_reload() != control_gen)
+		control_replay();
+}
+
+static int
+control_write(void)
+{
+	int tries, err = 0;
+
+	for (tries = 0; control_ops && tries < 3; tries++) {
+		control_catch_up();
+		err = auth_export_write();
+		if (err == 0)
+			control_ops_free();
+		if (err != -EAGAIN)
+			break;
+	}
+	return err;
+}
+
+static void
+control_write_event(int UNUSED(fd), void *UNUSED(data))
+{
+	int err;
+
+	if (!control_ops)
+		return;
+	err = control_write();
+	if (err < 0)
+		xlog(L_WARNING, "couldn't write %s: %s", etab.statefn,
+		     strerror(-err));
+}
+
+/*
+ * Changes are kept until written, because a reload of etab before
+ * then undoes them.
+ */
+static int
+control_apply(char *client, char *path, char *options,
+	      struct exportent *eep)
+{
+	int err;
+
+	control_catch_up();
+	if (eep)
+		err = auth_export_set(eep);
+	else
+		err = auth_export_change(client, path, options);
+	if (err < 0)
+		return err;
+	control_op_add(client, path, options, eep);
+	control_gen = auth_generation();
+	return 0;
+}
+
+/**
+ * control_export - add or change one export, and etab after it
+ * @eep: the export, as read from an exports file
+ *
+ * Returns 0, or a negative errno as auth_export_change() does.
+ */
+int
+control_export(struct exportent *eep)
+{
+	return control_apply(eep->e_hostname, eep->e_path, NULL, eep);
+}
+
+/**
+ * control_unexport - remove one export, and from etab after it
+ * @client: client, as given in the exports file
+ * @path: exported path
+ *
+ * Returns 0, or a negative errno as auth_export_change() does.
+ */
+int
+control_unexport(char *client, char *path)
+{
+	return control_apply(client, path, NULL, NULL);
+}
+
+/**
+ * control_writer_start - write changes to etab in the background
+ *
+ * Returns 0, or -1 if changes can only be written on "sync".
+ */
+int
+control_writer_start(void)
+{
+	static int started;
+
+	if (started)
+		return 0;
+	if (xepoll_add_timer(CONTROL_WRITE_INTERVAL, control_write_event,
+			     NULL) < 0) {
+		xlog(L_WARNING, "can't start writing %s in the background: %m",
+		     etab.statefn);
+		return -1;
+	}
+	started = 1;
+	return 0;
+}
+
+/* Split "client:path", where an IPv6 client is in brackets */
+static int
+control_parse_export(char *arg, char **client, char **path)
+{
+	char *p;
+
+	if (*arg == '[') {
+		p = strstr(arg, "]:");
+		if (!p)
+			return -1;
+		*p++ = '\0';
+		arg++;
+	} else if ((p = strchr(arg, ':')) == NULL)
+		return -1;
+	*p++ = '\0';
+	if (*arg == '\0' || *p != '/')
+		return -1;
+	*client = arg;
+	*path = p;
+	return 0;
+}
+
+/* Carry out one request; returns NULL or an error message */
+static const char *
+control_request(char *line)
+{
+	char *cmd, *arg, *options, *client, *path, *save;
+	int err;
+
+	cmd = strtok_r(line, " \t", &save);
+	if (!cmd)
+		return "empty request";
+	if (strcmp(cmd, "sync") == 0) {
+		err = control_write();
+		return err < 0 ? strerror(-err) : NULL;
+	}
+	if (strcmp(cmd, "export") != 0 && strcmp(cmd, "unexport") != 0)
+		return "unknown request";
+
+	arg = strtok_r(NULL, " \t", &save);
+	options = strtok_r(NULL, " \t", &save);
+	if (!arg || control_parse_export(arg, &client, &path) < 0)
+		return "expected CLIENT:PATH";
+	if (strtok_r(NULL, " \t", &save) != NULL)
+		return "too many arguments";
+	if (cmd[0] == 'u') {
+		if (options)
+			return "too many arguments";
+	} else if (!options)
+		options = "";
+
+	err = control_apply(client, path, options, NULL);
+	if (err < 0)
+		return err == -EINVAL ? "bad client or options" :
+					strerror(-err);
+	return NULL;
+}
+
+static void
+control_reply(int fd, const char *msg)
+{
+	char buf[256];
+	int len;
+
+	if (msg)
+		len = snprintf(buf, sizeof(buf), "error %s\n", msg);
+	else
+		len = snprintf(buf, sizeof(buf), "ok\n");
+	if (send(fd, buf, len, MSG_NOSIGNAL | MSG_DONTWAIT) < 0)
+		xlog(D_GENERAL, "control: reply lost: %m");
+}
+
+static void
+control_close(int fd, struct control_conn *conn)
+{
+	xepoll_del(fd);
+	close(fd);
+	free(conn);
+}
+
+static void
+control_conn_event(int fd, void *data)
+{
+	struct control_conn *conn = data;
+	char *line, *end;
+	ssize_t n;
+
+	n = read(fd, conn->buf + conn->len, sizeof(conn->buf) - conn->len);
+	if (n <= 0) {
+		if (n < 0 && (errno == EINTR || errno == EAGAIN))
+			return;
+		control_close(fd, conn);
+		return;
+	}
+	conn->len += n;
+
+	line = conn->buf;
+	while ((end = memchr(line, '\n', conn->buf + conn->len - line))) {
+		*end = '\0';
+		if (end > line && end[-1] == '\r')
+			end[-1] = '\0';
+		control_reply(fd, control_request(line));
+		line = end + 1;
+	}
+	conn->len -= line - conn->buf;
+	memmove(conn->buf, line, conn->len);
+	if (conn->len == sizeof(conn->buf)) {
+		control_reply(fd, "request too long");
+		control_close(fd, conn);
+	}
+}
+
+static void
+control_accept_event(int fd, void *UNUSED(data))
+{
+	struct control_conn *conn;
+	int cfd;
+
+	cfd = accept4(fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+	if (cfd < 0)
+		return;
+	conn = calloc(1, sizeof(*conn));
+	if (!conn || xepoll_add(cfd, control_conn_event, conn) < 0) {
+		xlog(L_WARNING, "control: can't take connection: %m");
+		free(conn);
+		close(cfd);
+	}
+}
+
+/**
+ * control_start - listen for export changes on a unix socket
+ * @path: where to create the socket, which only root can use
+ *
+ * Returns 0, or -1 if the socket can't be set up.
+ */
+int
+control_start(const char *path)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	mode_t omask;
+	int fd;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		xlog(L_ERROR, "control socket path %s is too long", path);
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+	if (fd < 0)
+		goto out_err;
+	unlink(path);
+	omask = umask(0077);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		umask(omask);
+		goto out_close;
+	}
+	umask(omask);
+	if (listen(fd, 8) < 0 ||
+	    xepoll_add(fd, control_accept_event, NULL) < 0)
+		goto out_close;
+	control_writer_start();
+	xlog(L_NOTICE, "listening for export changes on %s", path);
+	return 0;
+
+out_close:
+	close(fd);
+out_err:
+	xlog(L_ERROR, "can't set up control socket %s: %m", path);
+	return -1;
+}
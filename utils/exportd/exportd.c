@@ -22,6 +22,11 @@
 #include "conffile.h"
 #include "exportfs.h"
 #include "export.h"
+#include "fsloc.h"
+#include "nfsmetrics.h"
+#include "nfstrace.h"
+#include "nfsworker.h"
+#include "exportd.h"
 
 extern void my_svc_run(void);
 
@@ -31,6 +36,19 @@ extern void my_svc_run(void);
 static int num_threads = 1;
 /* Arbitrary limit on number of threads */
 #define MAX_THREADS 64
+/* Serve upcalls from a thread pool sharing one export table,
+ * instead of forking num_threads worker processes */
+static int threaded = 0;
+/* Push cache entries for clients found in rmtab before
+ * reporting that we are ready, using prewarm_threads threads */
+static int prewarm = 0;
+static int prewarm_threads = 4;
+/* Also find the junctions below the exports, and push those */
+static int prewarm_junctions = 0;
+/* Unix socket taking changes to single exports, if any */
+static char *control_socket;
+/* Apply changes to the exports files without waiting for exportfs -r */
+static int watch_exports = 0;
 
 int manage_gids;
 int use_ipaddr = -1;
@@ -45,9 +63,13 @@ static struct option longopts[] =
 	{ "log-auth", 0, 0, 'l' },
 	{ "cache-use-ipaddr", 0, 0, 'i' },
 	{ "ttl", 0, 0, 'T' },
+	{ "threaded", 0, 0, 'm' },
+	{ "prewarm", 0, 0, 'w' },
+	{ "prewarm-threads", 1, 0, 'W' },
+	{ "prewarm-junctions", 0, 0, 'J' },
 	{ NULL, 0, 0, 0 }
 };
-static char shortopts[] = "d:fghs:t:liT:";
+static char shortopts[] = "d:fghs:t:liT:mwW:J";
 
 /*
  * Signal handlers.
@@ -97,6 +119,9 @@ fork_workers(void)
 
 	xlog(L_NOTICE, "mountd: starting %d threads\n", num_threads);
 
+	/* so that workers don't each ask the name service the same */
+	hostcache_share();
+
 	for (i = 0 ; i < num_threads ; i++) {
 		pid = fork();
 		if (pid < 0) {
@@ -118,6 +143,10 @@ fork_workers(void)
 			sigaction(SIGINT, &sa, NULL);
 			sigaction(SIGTERM, &sa, NULL);
 
+			cache_stats_worker(i);
+			nfsmetrics_worker(i);
+			nfstrace_worker(i);
+			nfsworker_start(i);
 			/* fall into my_svc_run in caller */
 			return;
 		}
@@ -134,7 +163,7 @@ fork_workers(void)
 static void 
 killer (int sig)
 {
-	if (num_threads > 1) {
+	if (num_threads > 1 && !threaded) {
 		/* play Kronos and eat our children */
 		kill(0, SIGTERM);
 		wait_for_workers();
@@ -179,7 +208,9 @@ usage(const char *prog, int n)
 		"Usage: %s [-f|--foreground] [-h|--help] [-d kind|--debug kind]\n"
 "	[-g|--manage-gids] [-l|--log-auth] [-i|--cache-use-ipaddr] [-T|--ttl ttl]\n"
 "	[-s|--state-directory-path path]\n"
-"	[-t num|--num-threads=num]\n", prog);
+"	[-t num|--num-threads=num] [-m|--threaded]\n"
+"	[-w|--prewarm] [-W num|--prewarm-threads=num] [-J|--prewarm-junctions]\n",
+		prog);
 	exit(n);
 }
 
@@ -195,6 +226,12 @@ read_exportd_conf(char *progname, char **argv)
 
 	manage_gids = conf_get_bool("exportd", "manage-gids", manage_gids);
 	num_threads = conf_get_num("exportd", "threads", num_threads);
+	threaded = conf_get_bool("exportd", "threaded", threaded);
+	prewarm = conf_get_bool("exportd", "prewarm", prewarm);
+	prewarm_threads = conf_get_num("exportd", "prewarm-threads",
+				       prewarm_threads);
+	prewarm_junctions = conf_get_bool("exportd", "prewarm-junctions",
+					  prewarm_junctions);
 	if (conf_get_bool("mountd", "cache-use-ipaddr", 0))
 		use_ipaddr = 2;
 
@@ -205,6 +242,32 @@ read_exportd_conf(char *progname, char **argv)
 	ttl = conf_get_num("mountd", "ttl", default_ttl);
 	if (ttl > 0)
 		default_ttl = ttl;
+	hostcache_ttl = conf_get_num("mountd", "name-cache-ttl", hostcache_ttl);
+	hostcache_neg_ttl = conf_get_num("mountd", "name-cache-negative-ttl",
+					 hostcache_neg_ttl);
+	netgroup_expand = conf_get_bool("mountd", "netgroup-expand",
+					netgroup_expand);
+	netgroup_refresh = conf_get_num("mountd", "netgroup-refresh",
+					netgroup_refresh);
+	gidcache_ttl = conf_get_num("mountd", "gid-cache-ttl", gidcache_ttl);
+	gidcache_neg_ttl = conf_get_num("mountd", "gid-cache-negative-ttl",
+					gidcache_neg_ttl);
+	cache_uuid_persist = conf_get_bool("mountd", "uuid-cache",
+					   cache_uuid_persist);
+	cache_stats_file = conf_get_str("exportd", "stats-file");
+	cache_stats_interval = conf_get_num("exportd", "stats-interval",
+					    cache_stats_interval);
+	cache_trace_file = conf_get_str("exportd", "trace-file");
+	cache_refresh_ahead = conf_get_num("exportd", "refresh-ahead",
+					   cache_refresh_ahead);
+	control_socket = conf_get_str("exportd", "control-socket");
+	watch_exports = conf_get_bool("exportd", "watch-exports",
+				      watch_exports);
+	v4clients_log = conf_get_bool("mountd", "log-v4clients", v4clients_log);
+	fsloc_weights = conf_get_str("mountd", "fsloc-weights");
+	s = conf_get_str("mountd", "fsloc-order");
+	if (s && fsloc_order_set(s) < 0)
+		xlog(L_ERROR, "unknown fsloc-order \"%s\"", s);
 }
 
 int
@@ -263,6 +326,18 @@ main(int argc, char **argv)
 		case 't':
 			num_threads = atoi (optarg);
 			break;
+		case 'm':
+			threaded = 1;
+			break;
+		case 'w':
+			prewarm = 1;
+			break;
+		case 'W':
+			prewarm_threads = atoi(optarg);
+			break;
+		case 'J':
+			prewarm_junctions = 1;
+			break;
 		case '?':
 		default:
 			usage(progname, 1);
@@ -272,24 +347,42 @@ main(int argc, char **argv)
 
 	if (!setup_state_path_names(progname, ETAB, ETABTMP, ETABLCK, &etab))
 		return 1;
+	if (prewarm &&
+	    !setup_state_path_names(progname, RMTAB, RMTABTMP, RMTABLCK, &rmtab))
+		return 1;
 
 	if (!foreground)
 		xlog_stderr(0);
 
 	daemon_init(foreground);
+	nfsmetrics_start(progname);
+	nfstrace_start(progname);
+	nfsworker_init(progname);
 
 	set_signals();
+
+	if (prewarm_threads < 1)
+		prewarm_threads = 1;
+	else if (prewarm_threads > MAX_THREADS)
+		prewarm_threads = MAX_THREADS;
+	if (prewarm_junctions)
+		cache_prewarm_junctions(prewarm_threads);
+	if (prewarm) {
+		cache_prewarm(rmtab.statefn, prewarm_threads);
+		free_state_path_names(&rmtab);
+	}
+
 	daemon_ready();
 
 	/* silently bounds check num_threads */
-	if (foreground)
+	if (foreground && !threaded)
 		num_threads = 1;
 	else if (num_threads < 1)
 		num_threads = 1;
 	else if (num_threads > MAX_THREADS)
 		num_threads = MAX_THREADS;
 
-	if (num_threads > 1)
+	if (num_threads > 1 && !threaded)
 		fork_workers();
 
 
@@ -297,6 +390,25 @@ main(int argc, char **argv)
 	cache_open();
 	v4clients_init();
 
+	if ((control_socket && *control_socket) || watch_exports) {
+		if (num_threads > 1 && !threaded)
+			xlog(L_WARNING, "control-socket and watch-exports are "
+			     "not used with worker processes; set threaded "
+			     "to use them");
+		else {
+			if (control_socket && *control_socket)
+				control_start(control_socket);
+			if (watch_exports)
+				watch_start();
+		}
+	}
+
+	if (num_threads > 1 && threaded) {
+		xlog(L_NOTICE, "exportd: starting %d worker threads\n",
+				num_threads);
+		cache_start_workers(num_threads);
+	}
+
 	/* Process incoming upcalls */
 	cache_process_loop();
 
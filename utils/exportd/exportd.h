@@ -0,0 +1,19 @@
+/*
+ * utils/exportd/exportd.h
+ *
+ * Declarations for exportd
+ */
+
+#ifndef EXPORTD_H
+#define EXPORTD_H
+
+struct exportent;
+
+int		control_start(const char *path);
+int		control_writer_start(void);
+int		control_export(struct exportent *eep);
+int		control_unexport(char *client, char *path);
+
+int		watch_start(void);
+
+#endif /* EXPORTD_H */
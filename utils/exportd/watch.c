@@ -0,0 +1,399 @@
+/*
+ * utils/exportd/watch.c
+ *
+ * Apply changes to /etc/exports and /etc/exports.d as they are made,
+ * rather than when "exportfs -r" is next run.  The entries of each
+ * file are kept as last read.  When inotify reports a change, and no
+ * other change follows for WATCH_DELAY, only the files that changed
+ * are read again, and only the exports whose entry changed are
+ * changed, through control.c.
+ */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <sys/types.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <dirent.h>
+#include <libgen.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "nfslib.h"
+#include "xmalloc.h"
+#include "xlog.h"
+#include "xepoll.h"
+#include "exportfs.h"
+#include "exportd.h"
+
+/* How long changes must stop for before they are applied, in ms */
+#define WATCH_DELAY	1000
+
+#define WATCH_MASK	(IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | \
+			 IN_CREATE | IN_DELETE)
+
+struct watch_file {
+	struct watch_file *	f_next;		/* in exportfs's order */
+	char *			f_name;
+	struct exportent *	f_ents;		/* sorted by path, client */
+	int			f_count;
+	int			f_dirty;
+};
+
+static struct watch_file *	watch_files;
+static int			watch_fd = -1;
+static int			watch_timer = -1;
+static int			watch_parent_wd = -1;
+static int			watch_dparent_wd = -1;
+static int			watch_d_wd = -1;
+
+static int
+watch_key_cmp(const void *a, const void *b)
+{
+	const struct exportent *x = a, *y = b;
+	int c;
+
+	c = strcmp(x->e_path, y->e_path);
+	if (c == 0)
+		c = strcasecmp(x->e_hostname, y->e_hostname);
+	return c;
+}
+
+/* As watch_key_cmp(), with earlier entries of a file first */
+static int
+watch_ent_cmp(const void *a, const void *b)
+{
+	const struct exportent *x = *(struct exportent * const *)a;
+	const struct exportent *y = *(struct exportent * const *)b;
+	int c;
+
+	c = watch_key_cmp(x, y);
+	if (c == 0)
+		c = (x > y) - (x < y);
+	return c;
+}
+
+/*
+ * Read @fname into a sorted list.  Of entries for the same client
+ * and path, the first is kept, as export_read() would.
+ */
+static int
+watch_read(char *fname, struct exportent **list)
+{
+	struct exportent *ents, *sorted, **ptrs;
+	struct stat st;
+	int n, i, j;
+
+	*list = NULL;
+	if (stat(fname, &st) < 0)
+		return 0;
+	n = export_read_list(fname, &ents);
+	if (n <= 0) {
+		free(ents);
+		return 0;
+	}
+
+	ptrs = xmalloc(n * sizeof(*ptrs));
+	for (i = 0; i < n; i++)
+		ptrs[i] = &ents[i];
+	qsort(ptrs, n, sizeof(*ptrs), watch_ent_cmp);
+	sorted = xmalloc(n * sizeof(*sorted));
+	for (i = j = 0; i < n; i++) {
+		if (j && watch_key_cmp(&sorted[j - 1], ptrs[i]) == 0) {
+			exportent_release(ptrs[i]);
+			continue;
+		}
+		sorted[j++] = *ptrs[i];
+	}
+	free(ptrs);
+	free(ents);
+	*list = sorted;
+	return j;
+}
+
+/* The file @name, added in the order exportfs reads files if need be */
+static struct watch_file *
+watch_file_get(const char *name)
+{
+	struct watch_file *f, **fp;
+
+	for (fp = &watch_files; (f = *fp) != NULL; fp = &f->f_next) {
+		if (strcmp(f->f_name, name) == 0)
+			return f;
+		/* _PATH_EXPORTS is first, then exports.d in versionsort order */
+		if (fp != &watch_files && strverscmp(f->f_name, name) > 0)
+			break;
+	}
+	f = xmalloc(sizeof(*f));
+	f->f_name = xstrdup(name);
+	f->f_ents = NULL;
+	f->f_count = 0;
+	f->f_dirty = 0;
+	f->f_next = *fp;
+	*fp = f;
+	return f;
+}
+
+/* The entry "exportfs -r" would use for @key's client and path */
+static struct exportent *
+watch_lookup(struct exportent *key)
+{
+	struct exportent *e;
+	struct watch_file *f;
+
+	for (f = watch_files; f; f = f->f_next) {
+		e = bsearch(key, f->f_ents, f->f_count, sizeof(*f->f_ents),
+			    watch_key_cmp);
+		if (e)
+			return e;
+	}
+	return NULL;
+}
+
+/* Read @f again, and change the exports whose entry changed */
+static void
+watch_update(struct watch_file *f)
+{
+	struct exportent *old = f->f_ents, *ents, **keys, **before, *after;
+	int nold = f->f_count, n, nkeys = 0, i, err;
+
+	n = watch_read(f->f_name, &ents);
+
+	/* only the exports that @f lists, or listed, can change */
+	keys = xmalloc((nold + n + 1) * sizeof(*keys));
+	before = xmalloc((nold + n + 1) * sizeof(*before));
+	for (i = 0; i < nold; i++)
+		keys[nkeys++] = &old[i];
+	for (i = 0; i < n; i++)
+		if (!bsearch(&ents[i], old, nold, sizeof(*old), watch_key_cmp))
+			keys[nkeys++] = &ents[i];
+	for (i = 0; i < nkeys; i++)
+		before[i] = watch_lookup(keys[i]);
+
+	f->f_ents = ents;
+	f->f_count = n;
+	for (i = 0; i < nkeys; i++) {
+		after = watch_lookup(keys[i]);
+		if (after == NULL && before[i] != NULL) {
+			err = control_unexport(keys[i]->e_hostname,
+					       keys[i]->e_path);
+			if (err == -ENOENT)
+				err = 0;
+		} else if (after != NULL && (before[i] == NULL ||
+			   cmpexportent(before[i], after) != 0))
+			err = control_export(after);
+		else
+			continue;
+		if (err < 0)
+			xlog(L_WARNING, "%s: can't %s %s:%s: %s", f->f_name,
+			     after ? "export" : "unexport",
+			     keys[i]->e_hostname, keys[i]->e_path,
+			     strerror(-err));
+	}
+	xlog(D_GENERAL, "%s: %d entries, was %d", f->f_name, n, nold);
+
+	xtab_snapshot_free(old, nold);
+	free(keys);
+	free(before);
+}
+
+static void
+watch_timer_event(int fd, void *UNUSED(data))
+{
+	struct watch_file *f;
+	uint64_t expirations;
+
+	if (read(fd, &expirations, sizeof(expirations)) < 0)
+		return;
+	for (f = watch_files; f; f = f->f_next)
+		if (f->f_dirty) {
+			f->f_dirty = 0;
+			watch_update(f);
+		}
+}
+
+static int
+watch_is_exports_d_file(const char *name)
+{
+	size_t len = strlen(name), ext = sizeof(_EXT_EXPORT) - 1;
+
+	return *name != '.' && len > ext &&
+	       strcmp(name + len - ext, _EXT_EXPORT) == 0;
+}
+
+static void
+watch_mark(const char *dir, const char *name)
+{
+	char fname[PATH_MAX + 1];
+
+	if (dir == NULL)
+		watch_file_get(name)->f_dirty = 1;
+	else if (snprintf(fname, sizeof(fname), "%s/%s", dir,
+			  name) < (int)sizeof(fname))
+		watch_file_get(fname)->f_dirty = 1;
+}
+
+/*
+ * Watch exports.d, if there is one, and take in the files it has.
+ * Those are applied if exports.d is new, and only read otherwise.
+ */
+static void
+watch_d_add(int apply)
+{
+	struct watch_file *f;
+	struct dirent *d;
+	DIR *dp;
+
+	if (watch_d_wd >= 0)
+		return;
+	watch_d_wd = inotify_add_watch(watch_fd, _PATH_EXPORTS_D,
+				       WATCH_MASK | IN_ONLYDIR);
+	if (watch_d_wd < 0) {
+		if (errno != ENOENT)
+			xlog(L_WARNING, "can't watch %s: %m", _PATH_EXPORTS_D);
+		return;
+	}
+	dp = opendir(_PATH_EXPORTS_D);
+	if (dp == NULL)
+		return;
+	while ((d = readdir(dp)) != NULL)
+		if (watch_is_exports_d_file(d->d_name))
+			watch_mark(_PATH_EXPORTS_D, d->d_name);
+	closedir(dp);
+
+	if (apply)
+		return;
+	for (f = watch_files; f; f = f->f_next)
+		if (f->f_dirty) {
+			f->f_dirty = 0;
+			f->f_count = watch_read(f->f_name, &f->f_ents);
+		}
+}
+
+static const char *
+watch_basename(const char *path)
+{
+	const char *p = strrchr(path, '/');
+
+	return p ? p + 1 : path;
+}
+
+static void
+watch_event(int fd, void *UNUSED(data))
+{
+	char buf[4096]
+		__attribute__((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *ev;
+	struct itimerspec its = { .it_value = {
+		.tv_sec = WATCH_DELAY / 1000,
+		.tv_nsec = (WATCH_DELAY % 1000) * 1000000,
+	} };
+	struct watch_file *f;
+	int changed = 0;
+	ssize_t len;
+	char *p;
+
+	while ((len = read(fd, buf, sizeof(buf))) > 0) {
+		for (p = buf; p < buf + len; p += sizeof(*ev) + ev->len) {
+			ev = (const struct inotify_event *)p;
+			if (ev->mask & IN_Q_OVERFLOW) {
+				/* lost track: read everything again */
+				for (f = watch_files; f; f = f->f_next)
+					f->f_dirty = 1;
+				changed = 1;
+			} else if (ev->wd == watch_d_wd &&
+				   (ev->mask & IN_IGNORED)) {
+				/* exports.d is gone, and its files with it */
+				watch_d_wd = -1;
+				for (f = watch_files->f_next; f; f = f->f_next)
+					f->f_dirty = 1;
+				changed = 1;
+			} else if (ev->len == 0)
+				continue;
+			else if (ev->wd == watch_d_wd) {
+				if (watch_is_exports_d_file(ev->name)) {
+					watch_mark(_PATH_EXPORTS_D, ev->name);
+					changed = 1;
+				}
+			} else if (ev->wd == watch_parent_wd &&
+				   !strcmp(ev->name,
+					   watch_basename(_PATH_EXPORTS))) {
+				watch_files->f_dirty = 1;
+				changed = 1;
+			} else if (ev->wd == watch_dparent_wd &&
+				   (ev->mask & (IN_CREATE | IN_MOVED_TO)) &&
+				   !strcmp(ev->name,
+					   watch_basename(_PATH_EXPORTS_D))) {
+				watch_d_add(1);
+				changed = 1;
+			}
+		}
+	}
+	if (changed && timerfd_settime(watch_timer, 0, &its, NULL) < 0)
+		xlog(L_WARNING, "can't schedule reading exports: %m");
+}
+
+/* inotify_add_watch() on the directory holding @path */
+static int
+watch_parent(const char *path)
+{
+	char *dir = xstrdup(path);
+	int wd;
+
+	wd = inotify_add_watch(watch_fd, dirname(dir), WATCH_MASK);
+	if (wd < 0)
+		xlog(L_WARNING, "can't watch %s: %m", dir);
+	free(dir);
+	return wd;
+}
+
+/**
+ * watch_start - apply changes to the exports files as they are made
+ *
+ * The files are taken to be as last exported; what they list when
+ * watching starts isn't exported until it is changed.  Returns 0, or
+ * -1 if they can't be watched.
+ */
+int
+watch_start(void)
+{
+	struct watch_file *f;
+
+	watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (watch_fd < 0)
+		goto out_err;
+	watch_timer = timerfd_create(CLOCK_MONOTONIC,
+				     TFD_NONBLOCK | TFD_CLOEXEC);
+	if (watch_timer < 0)
+		goto out_close;
+
+	watch_parent_wd = watch_parent(_PATH_EXPORTS);
+	watch_dparent_wd = watch_parent(_PATH_EXPORTS_D);
+	if (watch_parent_wd < 0 || watch_dparent_wd < 0)
+		goto out_close;
+	f = watch_file_get(_PATH_EXPORTS);
+	f->f_count = watch_read(f->f_name, &f->f_ents);
+	watch_d_add(0);
+
+	if (xepoll_add(watch_fd, watch_event, NULL) < 0 ||
+	    xepoll_add(watch_timer, watch_timer_event, NULL) < 0)
+		goto out_close;
+	control_writer_start();
+	xlog(L_NOTICE, "applying changes to %s and %s as they are made",
+	     _PATH_EXPORTS, _PATH_EXPORTS_D);
+	return 0;
+
+out_close:
+	xepoll_del(watch_fd);
+	close(watch_fd);
+	if (watch_timer >= 0)
+		close(watch_timer);
+out_err:
+	xlog(L_ERROR, "can't watch the exports files: %m");
+	return -1;
+}
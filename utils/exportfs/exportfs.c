@@ -36,22 +36,51 @@
 #include "nfsd_path.h"
 #include "nfslib.h"
 #include "exportfs.h"
+#include "xmalloc.h"
 #include "xlog.h"
 #include "conffile.h"
+#include "workqueue.h"
 
 static void	export_all(int verbose);
 static void	exportfs(char *arg, char *options, int verbose);
 static void	unexportfs(char *arg, int verbose);
 static void	dump(int verbose, int export_format);
+static void	dump_hints(const char *server);
 static void	usage(const char *progname, int n);
 static void	validate_export(nfs_export *exp);
+
+/* Result of checking whether an export can work */
+struct export_check {
+	nfs_export *	ec_exp;
+	enum {
+		EXPORT_OK,
+		EXPORT_NOSTAT,		/* stat failed with ec_errno */
+		EXPORT_NOTDIR,
+		EXPORT_UNSUPPORTED,
+		EXPORT_NEEDFSID,
+	}		ec_result;
+	int		ec_errno;
+};
+
+static int	can_test(void);
+static void	check_export_one(void *data, int i);
+static void	report_export(const struct export_check *ec);
 static int	matchhostname(const char *hostname1, const char *hostname2);
 static void grab_lockfile(void);
 static void release_lockfile(void);
+static void flush_changes(struct exportent *old, int nold, int verbose);
+static void preview_changes(void);
+static void dumpopts(struct exportent *ep);
 
 static const char *lockfile = EXP_LOCKFILE;
 static int _lockfd = -1;
 
+/* Only invalidate kernel cache entries for exports that changed */
+static bool selective_flush;
+
+/* Threads that check exports and resolve client names in parallel */
+static int num_threads = CLIENT_PREFETCH_THREADS;
+
 /*
  * If we aren't careful, changes made by exportfs can be lost
  * when multiple exports process run at once:
@@ -100,6 +129,14 @@ read_exportfs_conf(char **argv)
 	if (s && !state_setup_basedir(argv[0], s))
 		exit(1);
 
+	selective_flush = conf_get_bool("exportfs", "selective-flush", false);
+	num_threads = conf_get_num("exportfs", "threads", num_threads);
+	if (num_threads < 1)
+		num_threads = 1;
+	client_prefetch_threads = num_threads;
+	xtab_write_snapshot = conf_get_bool("exportfs", "etab-snapshot", false);
+	xtab_write_journal = conf_get_bool("exportfs", "etab-journal", false);
+	export_parse_cache = conf_get_bool("exportfs", "parse-cache", false);
 }
 int
 main(int argc, char **argv)
@@ -112,6 +149,8 @@ main(int argc, char **argv)
 	int	f_export_format = 0;
 	int	f_reexport = 0;
 	int	f_ignore = 0;
+	int	f_dryrun = 0;
+	char	*f_hints = NULL;
 	int	i, c;
 	int	force_flush = 0;
 
@@ -129,7 +168,7 @@ main(int argc, char **argv)
 
 	nfsd_path_init();
 
-	while ((c = getopt(argc, argv, "ad:fhio:ruvs")) != EOF) {
+	while ((c = getopt(argc, argv, "ad:fhH:ino:ruvs")) != EOF) {
 		switch(c) {
 		case 'a':
 			f_all = 1;
@@ -143,9 +182,15 @@ main(int argc, char **argv)
 		case 'h':
 			usage(progname, 0);
 			break;
+		case 'H':
+			f_hints = optarg;
+			break;
 		case 'i':
 			f_ignore = 1;
 			break;
+		case 'n':
+			f_dryrun = 1;
+			break;
 		case 'o':
 			options = optarg;
 			break;
@@ -180,10 +225,19 @@ main(int argc, char **argv)
 		xlog(L_ERROR, "-r and -u are incompatible");
 		return 1;
 	}
+	if (f_hints && (optind != argc || f_all || ! f_export)) {
+		xlog(L_ERROR, "-H cannot be used with other options");
+		return 1;
+	}
 
 	if (!setup_state_path_names(progname, ETAB, ETABTMP, ETABLCK, &etab))
 		return 1;
 
+	if (f_dryrun && optind == argc && ! f_all) {
+		xlog(L_ERROR, "-n needs -a, -r, -u or exports to change");
+		return 1;
+	}
+
 	if (optind == argc && ! f_all) {
 		if (force_flush) {
 			cache_flush();
@@ -191,7 +245,10 @@ main(int argc, char **argv)
 			return 0;
 		} else {
 			xtab_export_read();
-			dump(f_verbose, f_export_format);
+			if (f_hints)
+				dump_hints(f_hints);
+			else
+				dump(f_verbose, f_export_format);
 			free_state_path_names(&etab);
 			export_freeall();
 			return 0;
@@ -232,8 +289,20 @@ main(int argc, char **argv)
 			for (i = optind ; i < argc ; i++)
 				unexportfs(argv[i], f_verbose);
 	}
-	xtab_export_write();
-	cache_flush();
+	export_hash_stats();
+	if (f_dryrun)
+		preview_changes();
+	else if (selective_flush) {
+		struct exportent *old;
+		int nold = xtab_export_snapshot(&old);
+
+		xtab_export_write();
+		flush_changes(old, nold, f_verbose);
+		xtab_snapshot_free(old, nold);
+	} else {
+		xtab_export_write();
+		cache_flush();
+	}
 	free_state_path_names(&etab);
 	export_freeall();
 
@@ -247,9 +316,15 @@ main(int argc, char **argv)
 static void
 export_all(int verbose)
 {
+	struct export_check	*checks;
 	nfs_export	*exp;
-	int		i;
+	int		i, n = 0;
+
+	for (i = 0; i < MCL_MAXTYPES; i++)
+		n += exportlist[i].count;
+	checks = xmalloc((n ? n : 1) * sizeof(*checks));
 
+	n = 0;
 	for (i = 0; i < MCL_MAXTYPES; i++) {
 		for (exp = exportlist[i].p_head; exp; exp = exp->m_next) {
 			if (verbose)
@@ -260,9 +335,20 @@ export_all(int verbose)
 			exp->m_mayexport = 1;
 			exp->m_changed = 1;
 			exp->m_warned = 0;
-			validate_export(exp);
+			checks[n++].ec_exp = exp;
 		}
 	}
+
+	/*
+	 * Checking an export can wait on a slow file system, so the
+	 * checks are run in parallel and their results reported in
+	 * order afterwards.
+	 */
+	can_test();
+	xthread_work_run_each(num_threads, check_export_one, checks, n);
+	for (i = 0; i < n; i++)
+		report_export(&checks[i]);
+	free(checks);
 }
 
 
@@ -471,11 +557,17 @@ unexportfs(char *arg, int verbose)
 
 static int can_test(void)
 {
+	static int tested = -1;
 	char buf[1024] = { 0 };
 	int fd;
 	int n;
 	size_t bufsiz = sizeof(buf);
 
+	/* The answer doesn't change while exportfs runs */
+	if (tested >= 0)
+		return tested;
+	tested = 0;
+
 	fd = open("/proc/net/rpc/auth.unix.ip/channel", O_WRONLY);
 	if (fd < 0)
 		return 0;
@@ -500,29 +592,36 @@ static int can_test(void)
 	if (fd < 0)
 		return 0;
 	close(fd);
+	tested = 1;
 	return 1;
 }
 
+/*
+ * Check that the given export point is potentially exportable.
+ * We just give warnings here, don't cause anything to fail.
+ * If a path doesn't exist, or is not a dir or file, give an warning
+ * otherwise trial-export to '-test-client-' and check for failure.
+ *
+ * check_export() does the work and report_export() gives the warnings,
+ * so that many exports can be checked at once.
+ */
 static void
-validate_export(nfs_export *exp)
+check_export(struct export_check *ec)
 {
-	/* Check that the given export point is potentially exportable.
-	 * We just give warnings here, don't cause anything to fail.
-	 * If a path doesn't exist, or is not a dir or file, give an warning
-	 * otherwise trial-export to '-test-client-' and check for failure.
-	 */
+	nfs_export *exp = ec->ec_exp;
 	struct stat stb;
 	char *path = exportent_realpath(&exp->m_export);
 	struct statfs64 stf;
 	int fs_has_fsid = 0;
 
+	ec->ec_result = EXPORT_OK;
 	if (stat(path, &stb) < 0) {
-		xlog(L_ERROR, "Failed to stat %s: %m", path);
+		ec->ec_result = EXPORT_NOSTAT;
+		ec->ec_errno = errno;
 		return;
 	}
 	if (!S_ISDIR(stb.st_mode)) {
-		xlog(L_ERROR, "%s is not a directory. "
-			"Remote access will fail", path);
+		ec->ec_result = EXPORT_NOTDIR;
 		return;
 	}
 	if (!can_test())
@@ -534,20 +633,56 @@ validate_export(nfs_export *exp)
 
 	if ((exp->m_export.e_flags & NFSEXP_FSID) || exp->m_export.e_uuid ||
 	    fs_has_fsid) {
-		if ( !export_test(&exp->m_export, 1)) {
-			xlog(L_ERROR, "%s does not support NFS export", path);
-			return;
-		}
+		if ( !export_test(&exp->m_export, 1))
+			ec->ec_result = EXPORT_UNSUPPORTED;
 	} else if ( !export_test(&exp->m_export, 0)) {
 		if (export_test(&exp->m_export, 1))
-			xlog(L_ERROR, "%s requires fsid= for NFS export", path);
+			ec->ec_result = EXPORT_NEEDFSID;
 		else
-			xlog(L_ERROR, "%s does not support NFS export", path);
-		return;
+			ec->ec_result = EXPORT_UNSUPPORTED;
+	}
+}
 
+static void
+check_export_one(void *data, int i)
+{
+	check_export((struct export_check *)data + i);
+}
+
+static void
+report_export(const struct export_check *ec)
+{
+	char *path = exportent_realpath(&ec->ec_exp->m_export);
+
+	switch (ec->ec_result) {
+	case EXPORT_OK:
+		break;
+	case EXPORT_NOSTAT:
+		errno = ec->ec_errno;
+		xlog(L_ERROR, "Failed to stat %s: %m", path);
+		break;
+	case EXPORT_NOTDIR:
+		xlog(L_ERROR, "%s is not a directory. "
+			"Remote access will fail", path);
+		break;
+	case EXPORT_UNSUPPORTED:
+		xlog(L_ERROR, "%s does not support NFS export", path);
+		break;
+	case EXPORT_NEEDFSID:
+		xlog(L_ERROR, "%s requires fsid= for NFS export", path);
+		break;
 	}
 }
 
+static void
+validate_export(nfs_export *exp)
+{
+	struct export_check ec = { .ec_exp = exp };
+
+	check_export(&ec);
+	report_export(&ec);
+}
+
 static _Bool
 is_hostname(const char *sp)
 {
@@ -594,6 +729,228 @@ out:
 	return ai;
 }
 
+static int
+etab_cmp(const void *a, const void *b)
+{
+	const struct exportent *e1 = a, *e2 = b;
+	int rc = strcmp(e1->e_path, e2->e_path);
+
+	return rc ? rc : strcmp(e1->e_hostname, e2->e_hostname);
+}
+
+static int
+name_cmp(const void *a, const void *b)
+{
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/*
+ * Sort @ents, and collect the distinct client names in @names, which
+ * must have room for @n.  Returns how many there are.
+ */
+static int
+etab_sort(struct exportent *ents, int n, char **names)
+{
+	int i, cnt = 0;
+
+	qsort(ents, n, sizeof(*ents), etab_cmp);
+	for (i = 0; i < n; i++)
+		names[i] = ents[i].e_hostname;
+	qsort(names, n, sizeof(*names), name_cmp);
+	for (i = 0; i < n; i++)
+		if (cnt == 0 || strcmp(names[cnt - 1], names[i]))
+			names[cnt++] = names[i];
+	return cnt;
+}
+
+/* Changes between two versions of etab */
+struct etab_changes {
+	char **		ec_clients;	/* as cache_flush_paths() takes them */
+	char **		ec_paths;
+	int		ec_count;
+	int		ec_added, ec_removed, ec_changed;
+	int		ec_names_changed; /* the list of clients changed */
+};
+
+/*
+ * Note that @xp has been added, removed or changed.  The kernel
+ * reports paths with symlinks resolved, so record that form too.
+ */
+static void
+add_change(struct etab_changes *ec, struct exportent *xp)
+{
+	char buf[PATH_MAX];
+
+	ec->ec_clients[ec->ec_count] = xp->e_hostname;
+	ec->ec_paths[ec->ec_count] = xstrdup(xp->e_path);
+	ec->ec_count++;
+	if (realpath(xp->e_path, buf) && strcmp(buf, xp->e_path)) {
+		ec->ec_clients[ec->ec_count] = xp->e_hostname;
+		ec->ec_paths[ec->ec_count] = xstrdup(buf);
+		ec->ec_count++;
+	}
+}
+
+/* Print a change the way "exportfs -s" would show the export */
+static void
+print_change(char c, struct exportent *ep)
+{
+	char buf[NFS_MAXPATHLEN+1], *bp = buf;
+	int len = sizeof(buf) - 1;
+
+	qword_add(&bp, &len, ep->e_path);
+	*bp = '\0';
+	printf("%c %s%s", c, buf, ep->e_hostname);
+	dumpopts(ep);
+	printf("\n");
+}
+
+/*
+ * Compare etab as it was (@old) with what it is or would be (@new),
+ * and collect the exports that were added, removed or had their
+ * options changed.  With @report, each change is printed as well.
+ * Both lists are sorted.  Release the result with etab_changes_free().
+ */
+static void
+etab_diff(struct exportent *old, int nold, struct exportent *new, int nnew,
+	  struct etab_changes *ec, int report)
+{
+	char **oldnames, **newnames;
+	int nonames, nnnames, i, j;
+
+	memset(ec, 0, sizeof(*ec));
+	ec->ec_clients = xmalloc(2 * (nold + nnew + 1) * sizeof(char *));
+	ec->ec_paths = xmalloc(2 * (nold + nnew + 1) * sizeof(char *));
+	oldnames = xmalloc((nold + 1) * sizeof(char *));
+	newnames = xmalloc((nnew + 1) * sizeof(char *));
+	nonames = etab_sort(old, nold, oldnames);
+	nnnames = etab_sort(new, nnew, newnames);
+
+	for (i = j = 0; i < nold || j < nnew; ) {
+		int rc;
+
+		if (i == nold)
+			rc = 1;
+		else if (j == nnew)
+			rc = -1;
+		else
+			rc = etab_cmp(&old[i], &new[j]);
+		if (rc < 0) {
+			if (report)
+				print_change('-', &old[i]);
+			add_change(ec, &old[i++]);
+			ec->ec_removed++;
+		} else if (rc > 0) {
+			if (report)
+				print_change('+', &new[j]);
+			add_change(ec, &new[j++]);
+			ec->ec_added++;
+		} else {
+			if (cmpexportent(&old[i], &new[j])) {
+				if (report)
+					print_change('~', &new[j]);
+				add_change(ec, &new[j]);
+				ec->ec_changed++;
+			}
+			i++;
+			j++;
+		}
+	}
+
+	ec->ec_names_changed = nonames != nnnames;
+	for (i = 0; !ec->ec_names_changed && i < nonames; i++)
+		ec->ec_names_changed = strcmp(oldnames[i], newnames[i]) != 0;
+
+	free(oldnames);
+	free(newnames);
+}
+
+static void
+etab_changes_free(struct etab_changes *ec)
+{
+	int i;
+
+	for (i = 0; i < ec->ec_count; i++)
+		free(ec->ec_paths[i]);
+	free(ec->ec_clients);
+	free(ec->ec_paths);
+}
+
+/*
+ * Compare etab as it was before (@old) with what has just been
+ * written, and invalidate only the kernel cache entries for exports
+ * that were added, removed or had their options changed.
+ */
+static void
+flush_changes(struct exportent *old, int nold, int verbose)
+{
+	struct exportent *new;
+	struct etab_changes ec;
+	int nnew;
+
+	if (nold < 0 || nfsd_path_nfsd_rootdir()) {
+		cache_flush();
+		return;
+	}
+	nnew = xtab_export_snapshot(&new);
+	if (nnew < 0) {
+		cache_flush();
+		return;
+	}
+
+	etab_diff(old, nold, new, nnew, &ec, verbose);
+	xlog(D_GENERAL, "%d changed export paths%s", ec.ec_count,
+	     ec.ec_names_changed ? ", client list changed" : "");
+	cache_flush_paths(ec.ec_clients, ec.ec_paths, ec.ec_count,
+			  ec.ec_names_changed);
+
+	etab_changes_free(&ec);
+	xtab_snapshot_free(new, nnew);
+}
+
+/*
+ * Report what writing the export table would change, in etab and in
+ * the kernel's caches, without changing either.
+ */
+static void
+preview_changes(void)
+{
+	struct exportent *old, *new;
+	struct etab_changes ec;
+	int nold, nnew, n;
+
+	nold = xtab_export_snapshot(&old);
+	nnew = xtab_export_preview(&new);
+	if (nold < 0 || nnew < 0) {
+		xlog(L_ERROR, "can't lock %s", etab.lockfn);
+		xtab_snapshot_free(old, nold > 0 ? nold : 0);
+		xtab_snapshot_free(new, nnew > 0 ? nnew : 0);
+		export_errno = 1;
+		return;
+	}
+
+	etab_diff(old, nold, new, nnew, &ec, 1);
+	if (ec.ec_added + ec.ec_removed + ec.ec_changed == 0)
+		printf("%s would not change\n", etab.statefn);
+	else
+		printf("%d added, %d removed, %d changed\n",
+		       ec.ec_added, ec.ec_removed, ec.ec_changed);
+
+	if (!selective_flush || nfsd_path_nfsd_rootdir())
+		printf("All kernel export caches would be flushed\n");
+	else if ((n = cache_count_paths(ec.ec_clients, ec.ec_paths,
+					ec.ec_count)) < 0)
+		printf("All kernel export caches would be flushed\n");
+	else
+		printf("%d kernel export cache entries would be flushed%s\n",
+		       n, ec.ec_names_changed ?
+		       ", and the client address cache" : "");
+
+	etab_changes_free(&ec);
+	xtab_snapshot_free(old, nold);
+	xtab_snapshot_free(new, nnew);
+}
+
 static int
 matchhostname(const char *hostname1, const char *hostname2)
 {
@@ -650,6 +1007,76 @@ dumpopt(char c, char *fmt, ...)
 	return ',';
 }
 
+/* Print the options of @ep in parentheses, as exports(5) has them */
+static void
+dumpopts(struct exportent *ep)
+{
+	char		c;
+
+	c = '(';
+	if (ep->e_flags & NFSEXP_ASYNC)
+		c = dumpopt(c, "async");
+	else
+		c = dumpopt(c, "sync");
+	if (ep->e_flags & NFSEXP_GATHERED_WRITES)
+		c = dumpopt(c, "wdelay");
+	else
+		c = dumpopt(c, "no_wdelay");
+	if (ep->e_flags & NFSEXP_NOHIDE)
+		c = dumpopt(c, "nohide");
+	else
+		c = dumpopt(c, "hide");
+	if (ep->e_flags & NFSEXP_CROSSMOUNT)
+		c = dumpopt(c, "crossmnt");
+	if (ep->e_flags & NFSEXP_NOSUBTREECHECK)
+		c = dumpopt(c, "no_subtree_check");
+	if (ep->e_flags & NFSEXP_NOAUTHNLM)
+		c = dumpopt(c, "insecure_locks");
+	if (ep->e_flags & NFSEXP_NOREADDIRPLUS)
+		c = dumpopt(c, "nordirplus");
+	if (ep->e_flags & NFSEXP_SECURITY_LABEL)
+		c = dumpopt(c, "security_label");
+	if (ep->e_flags & NFSEXP_NOACL)
+		c = dumpopt(c, "no_acl");
+	if (ep->e_flags & NFSEXP_PNFS)
+		c = dumpopt(c, "pnfs");
+	if (ep->e_flags & NFSEXP_FSID)
+		c = dumpopt(c, "fsid=%d", ep->e_fsid);
+	if (ep->e_uuid)
+		c = dumpopt(c, "fsid=%s", ep->e_uuid);
+	if (ep->e_mountpoint)
+		c = dumpopt(c, "mountpoint%s%s",
+			    ep->e_mountpoint[0]?"=":"",
+			    ep->e_mountpoint);
+	if (ep->e_rsize)
+		c = dumpopt(c, "rsize=%u", ep->e_rsize);
+	if (ep->e_wsize)
+		c = dumpopt(c, "wsize=%u", ep->e_wsize);
+	if (ep->e_readahead)
+		c = dumpopt(c, "readahead=%u", ep->e_readahead);
+	if (ep->e_anonuid != 65534)
+		c = dumpopt(c, "anonuid=%d", ep->e_anonuid);
+	if (ep->e_anongid != 65534)
+		c = dumpopt(c, "anongid=%d", ep->e_anongid);
+	switch(ep->e_fslocmethod) {
+	case FSLOC_NONE:
+		break;
+	case FSLOC_REFER:
+		c = dumpopt(c, "refer=%s", ep->e_fslocdata);
+		break;
+	case FSLOC_REPLICA:
+		c = dumpopt(c, "replicas=%s", ep->e_fslocdata);
+		break;
+#ifdef DEBUG
+	case FSLOC_STUB:
+		c = dumpopt(c, "fsloc=stub");
+		break;
+#endif
+	}
+	secinfo_show(stdout, ep);
+	printf("%c", (c != '(')? ')' : ' ');
+}
+
 static void
 dump(int verbose, int export_format)
 {
@@ -660,7 +1087,7 @@ dump(int verbose, int export_format)
 	nfs_export	*exp;
 	struct exportent *ep;
 	int		htype;
-	char		*hname, c;
+	char		*hname;
 
 	for (htype = 0; htype < MCL_MAXTYPES; htype++) {
 		for (exp = exportlist[htype].p_head; exp; exp = exp->m_next) {
@@ -688,69 +1115,64 @@ dump(int verbose, int export_format)
 				printf("\n");
 				continue;
 			}
-			c = '(';
-			if (ep->e_flags & NFSEXP_ASYNC)
-				c = dumpopt(c, "async");
-			else
-				c = dumpopt(c, "sync");
-			if (ep->e_flags & NFSEXP_GATHERED_WRITES)
-				c = dumpopt(c, "wdelay");
-			else
-				c = dumpopt(c, "no_wdelay");
-			if (ep->e_flags & NFSEXP_NOHIDE)
-				c = dumpopt(c, "nohide");
-			else
-				c = dumpopt(c, "hide");
-			if (ep->e_flags & NFSEXP_CROSSMOUNT)
-				c = dumpopt(c, "crossmnt");
-			if (ep->e_flags & NFSEXP_NOSUBTREECHECK)
-				c = dumpopt(c, "no_subtree_check");
-			if (ep->e_flags & NFSEXP_NOAUTHNLM)
-				c = dumpopt(c, "insecure_locks");
-			if (ep->e_flags & NFSEXP_NOREADDIRPLUS)
-				c = dumpopt(c, "nordirplus");
-			if (ep->e_flags & NFSEXP_SECURITY_LABEL)
-				c = dumpopt(c, "security_label");
-			if (ep->e_flags & NFSEXP_NOACL)
-				c = dumpopt(c, "no_acl");
-			if (ep->e_flags & NFSEXP_PNFS)
-				c = dumpopt(c, "pnfs");
-			if (ep->e_flags & NFSEXP_FSID)
-				c = dumpopt(c, "fsid=%d", ep->e_fsid);
-			if (ep->e_uuid)
-				c = dumpopt(c, "fsid=%s", ep->e_uuid);
-			if (ep->e_mountpoint)
-				c = dumpopt(c, "mountpoint%s%s",
-					    ep->e_mountpoint[0]?"=":"",
-					    ep->e_mountpoint);
-			if (ep->e_anonuid != 65534)
-				c = dumpopt(c, "anonuid=%d", ep->e_anonuid);
-			if (ep->e_anongid != 65534)
-				c = dumpopt(c, "anongid=%d", ep->e_anongid);
-			switch(ep->e_fslocmethod) {
-			case FSLOC_NONE:
-				break;
-			case FSLOC_REFER:
-				c = dumpopt(c, "refer=%s", ep->e_fslocdata);
-				break;
-			case FSLOC_REPLICA:
-				c = dumpopt(c, "replicas=%s", ep->e_fslocdata);
-				break;
-#ifdef DEBUG
-			case FSLOC_STUB:
-				c = dumpopt(c, "fsloc=stub");
-				break;
-#endif
+			dumpopts(ep);
+			printf("\n");
+		}
+	}
+}
+
+/*
+ * Print the I/O hints of the exports for the clients of @server: the
+ * readahead as nfsrahead(5) sections of nfs.conf, and rsize and wsize
+ * as mount options in a comment.  Where the clients of a path are
+ * given different hints, those of the first are used.
+ */
+static void
+dump_hints(const char *server)
+{
+	char		**done = NULL;
+	int		ndone = 0, htype, i;
+	nfs_export	*exp;
+	struct exportent *ep;
+
+	for (htype = 0; htype < MCL_MAXTYPES; htype++) {
+		for (exp = exportlist[htype].p_head; exp; exp = exp->m_next) {
+			ep = &exp->m_export;
+			if (!exp->m_xtabent)
+				continue;
+			if (!ep->e_rsize && !ep->e_wsize && !ep->e_readahead)
+				continue;
+			for (i = 0; i < ndone; i++)
+				if (strcmp(done[i], ep->e_path) == 0)
+					break;
+			if (i < ndone)
+				continue;
+			done = xrealloc(done, (ndone + 1) * sizeof(*done));
+			done[ndone++] = ep->e_path;
+
+			printf("# %s:%s", server, ep->e_path);
+			if (ep->e_rsize || ep->e_wsize) {
+				printf(" -o ");
+				if (ep->e_rsize)
+					printf("rsize=%u%s", ep->e_rsize,
+					       ep->e_wsize ? "," : "");
+				if (ep->e_wsize)
+					printf("wsize=%u", ep->e_wsize);
 			}
-			secinfo_show(stdout, ep);
-			printf("%c\n", (c != '(')? ')' : ' ');
+			printf("\n");
+			if (ep->e_readahead)
+				printf("[nfsrahead \"%s:%s\"]\ndefault=%u\n",
+				       server, ep->e_path, ep->e_readahead);
+			printf("\n");
 		}
 	}
+	free(done);
 }
 
 static void
 usage(const char *progname, int n)
 {
-	fprintf(stderr, "usage: %s [-adfhioruvs] [host:/path]\n", progname);
+	fprintf(stderr, "usage: %s [-adfhinoruvs] [host:/path]\n", progname);
+	fprintf(stderr, "       %s -H server\n", progname);
 	exit(n);
 }
@@ -48,6 +48,7 @@
 #include "err_util.h"
 #include "gss_oids.h"
 #include "write_bytes.h"
+#include "krb5_util.h"
 
 int write_heimdal_keyblock(char **p, char *end, krb5_keyblock *key)
 {
@@ -72,7 +73,7 @@ int write_heimdal_enc_key(char **p, char *end, gss_ctx_id_t ctx)
 	char *skd, *dkd, *k5err = NULL;
 	int code = -1;
 
-	if ((ret = krb5_init_context(&context))) {
+	if ((ret = gssd_k5_get_context(&context))) {
 		k5err = gssd_k5_err_msg(NULL, ret);
 		printerr(0, "ERROR: initializing krb5_context: %s\n", k5err);
 		goto out_err;
@@ -117,7 +118,7 @@ int write_heimdal_enc_key(char **p, char *end, gss_ctx_id_t ctx)
     out_err_free_key:
 	krb5_free_keyblock(context, key);
     out_err_free_context:
-	krb5_free_context(context);
+	gssd_k5_put_context(context);
     out_err:
 	free(k5err);
 	printerr(2, "write_heimdal_enc_key: %s\n", code ? "FAILED" : "SUCCESS");
@@ -132,7 +133,7 @@ int write_heimdal_seq_key(char **p, char *end, gss_ctx_id_t ctx)
 	char *k5err = NULL;
 	int code = -1;
 
-	if ((ret = krb5_init_context(&context))) {
+	if ((ret = gssd_k5_get_context(&context))) {
 		k5err = gssd_k5_err_msg(NULL, ret);
 		printerr(0, "ERROR: initializing krb5_context: %s\n", k5err);
 		goto out_err;
@@ -162,7 +163,7 @@ int write_heimdal_seq_key(char **p, char *end, gss_ctx_id_t ctx)
     out_err_free_key:
 	krb5_free_keyblock(context, key);
     out_err_free_context:
-	krb5_free_context(context);
+	gssd_k5_put_context(context);
     out_err:
 	free(k5err);
 	printerr(2, "write_heimdal_seq_key: %s\n", code ? "FAILED" : "SUCCESS");
@@ -50,7 +50,7 @@ void initerr(char *progname, int set_verbosity, int set_fg)
 }
 
 
-void printerr(int priority, char *format, ...)
+void (printerr)(int priority, char *format, ...)
 {
 	va_list args;
 
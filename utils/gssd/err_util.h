@@ -34,6 +34,12 @@
 void initerr(char *progname, int verbosity, int fg);
 void printerr(int priority, char *format, ...);
 int get_verbosity(void);
+
+/* Don't evaluate the arguments of a message that will not be printed */
+#define printerr(priority, ...) do { \
+	if ((priority) <= get_verbosity()) \
+		(printerr)((priority), __VA_ARGS__); \
+} while (0)
 char * sec2time(int);
 
 #endif /* _ERR_UTIL_H_ */
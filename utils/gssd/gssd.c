@@ -64,6 +64,7 @@
 #include <fcntl.h>
 #include <dirent.h>
 #include <netdb.h>
+#include <stdint.h>
 #include <event2/event.h>
 
 #include "gssd.h"
@@ -72,6 +73,9 @@
 #include "krb5_util.h"
 #include "nfslib.h"
 #include "conffile.h"
+#include "xlog.h"
+#include "nfsmetrics.h"
+#include "nfsworker.h"
 
 static char *pipefs_path = GSSD_PIPEFS_DIR;
 static DIR *pipefs_dir;
@@ -82,9 +86,13 @@ struct event *inotify_ev;
 char *keytabfile = GSSD_DEFAULT_KEYTAB_FILE;
 char **ccachesearch;
 int  use_memcache = 0;
+/* With use_memcache, also write machine creds to files for others */
+int  machine_cred_file = 0;
 int  root_uses_machine_creds = 1;
 unsigned int  context_timeout = 0;
 unsigned int  rpc_timeout = 5;
+/* Seconds an idle connection to a server is kept for the next upcall */
+int connection_idle_timeout = 30;
 char *preferred_realm = NULL;
 char *ccachedir = NULL;
 /* set $HOME to "/" by default */
@@ -97,6 +105,12 @@ static bool signal_received = false;
 static struct event_base *evbase = NULL;
 
 int upcall_timeout = DEF_UPCALL_TIMEOUT;
+/* Worker threads that run upcalls; zero starts a thread for each */
+int upcall_threads = 0;
+int upcall_client_threads = 0;
+int upcall_topdir_threads = 0;
+/* Percent of their lifetime after which machine creds are renewed */
+int machine_cred_refresh = 0;
 static bool cancel_timed_out_upcalls = false;
 
 TAILQ_HEAD(topdir_list_head, topdir) topdir_list;
@@ -149,9 +163,136 @@ struct topdir {
  *      in a form the kernel code will understand.
  *      In addition, we make sure we are notified whenever anything is
  *      created or destroyed in {rpc_pipefs} or in any of the clntXX directories,
- *      and rescan the whole {rpc_pipefs} when this happens.
+ *      and add or remove just that client when this happens.  Should events
+ *      be lost, the topdirs are read again, and only the clients that came
+ *      or went in the meantime, or weren't complete yet, are looked at.
+ *
+ * The clients are also hashed by watch descriptor, to find the client
+ * an event is for, and by topdir and name.
  */
 
+#define CLNT_HASH_INIT	256		/* initial buckets, a power of 2 */
+
+static struct clnt_info **clnt_wd_table, **clnt_name_table;
+static unsigned int clnt_hash_size, clnt_count;
+
+static unsigned int
+gssd_wd_hash(int wd)
+{
+	return (uint32_t)((unsigned int)wd * 2654435761u);
+}
+
+static unsigned int
+gssd_name_hash(const struct topdir *tdi, const char *name)
+{
+	uint32_t h = 2166136261u ^ (uint32_t)(uintptr_t)tdi;
+
+	for (; *name; name++)
+		h = (h ^ (unsigned char)*name) * 16777619u;
+	return h;
+}
+
+static void
+gssd_clnt_grow(void)
+{
+	unsigned int size = clnt_hash_size ? clnt_hash_size * 2 : CLNT_HASH_INIT;
+	struct clnt_info **wd_table, **name_table, *clp, *next;
+	unsigned int i, b;
+
+	wd_table = calloc(size, sizeof(*wd_table));
+	name_table = calloc(size, sizeof(*name_table));
+	if (!wd_table || !name_table) {
+		free(wd_table);
+		free(name_table);
+		return;
+	}
+	for (i = 0; i < clnt_hash_size; i++) {
+		for (clp = clnt_wd_table[i]; clp; clp = next) {
+			next = clp->wd_next;
+			b = gssd_wd_hash(clp->wd) & (size - 1);
+			clp->wd_next = wd_table[b];
+			wd_table[b] = clp;
+		}
+		for (clp = clnt_name_table[i]; clp; clp = next) {
+			next = clp->name_next;
+			b = gssd_name_hash(clp->tdi, clp->name) & (size - 1);
+			clp->name_next = name_table[b];
+			name_table[b] = clp;
+		}
+	}
+	free(clnt_wd_table);
+	free(clnt_name_table);
+	clnt_wd_table = wd_table;
+	clnt_name_table = name_table;
+	clnt_hash_size = size;
+}
+
+/* Returns -1 if the tables couldn't be allocated */
+static int
+gssd_clnt_hash(struct clnt_info *clp)
+{
+	unsigned int b;
+
+	if (clnt_count >= clnt_hash_size)
+		gssd_clnt_grow();
+	if (!clnt_hash_size)
+		return -1;
+	b = gssd_wd_hash(clp->wd) & (clnt_hash_size - 1);
+	clp->wd_next = clnt_wd_table[b];
+	clnt_wd_table[b] = clp;
+	b = gssd_name_hash(clp->tdi, clp->name) & (clnt_hash_size - 1);
+	clp->name_next = clnt_name_table[b];
+	clnt_name_table[b] = clp;
+	clnt_count++;
+	return 0;
+}
+
+static void
+gssd_clnt_unhash(struct clnt_info *clp)
+{
+	struct clnt_info **cp;
+
+	cp = &clnt_wd_table[gssd_wd_hash(clp->wd) & (clnt_hash_size - 1)];
+	while (*cp != clp)
+		cp = &(*cp)->wd_next;
+	*cp = clp->wd_next;
+	cp = &clnt_name_table[gssd_name_hash(clp->tdi, clp->name) &
+			      (clnt_hash_size - 1)];
+	while (*cp != clp)
+		cp = &(*cp)->name_next;
+	*cp = clp->name_next;
+	clnt_count--;
+}
+
+static struct clnt_info *
+gssd_find_clnt_wd(int wd)
+{
+	struct clnt_info *clp;
+
+	if (!clnt_hash_size)
+		return NULL;
+	for (clp = clnt_wd_table[gssd_wd_hash(wd) & (clnt_hash_size - 1)];
+	     clp; clp = clp->wd_next)
+		if (clp->wd == wd)
+			return clp;
+	return NULL;
+}
+
+static struct clnt_info *
+gssd_find_clnt(struct topdir *tdi, const char *name)
+{
+	struct clnt_info *clp;
+
+	if (!clnt_hash_size)
+		return NULL;
+	for (clp = clnt_name_table[gssd_name_hash(tdi, name) &
+				   (clnt_hash_size - 1)];
+	     clp; clp = clp->name_next)
+		if (clp->tdi == tdi && !strcmp(clp->name, name))
+			return clp;
+	return NULL;
+}
+
 /*
  * convert a presentation address string to a sockaddr_storage struct. Returns
  * true on success or false on failure.
@@ -418,6 +559,7 @@ static void
 gssd_destroy_client(struct clnt_info *clp)
 {
 	printerr(4, "destroying client %s\n", clp->relpath);
+	gssd_clnt_unhash(clp);
 
 	if (clp->krb5_ev) {
 		event_del(clp->krb5_ev);
@@ -435,11 +577,11 @@ gssd_destroy_client(struct clnt_info *clp)
 	gssd_free_client(clp);
 }
 
-static void gssd_scan(void);
+static void gssd_scan(bool full);
 
-/* For each upcall read the upcall info into the buffer, then create a
- * thread in a detached state so that resources are released back into
- * the system without the need for a join.
+/* Read every upcall waiting on the pipe, then create a thread in a
+ * detached state for each, so that resources are released back into the
+ * system without the need for a join, or queue them all for the pool.
  */
 static void
 gssd_clnt_gssd_cb(int UNUSED(fd), short UNUSED(which), void *data)
@@ -484,7 +626,11 @@ scan_active_thread_list(void)
 	pthread_mutex_lock(&active_thread_list_lock);
 	clock_gettime(CLOCK_MONOTONIC, &now);
 	TAILQ_FOREACH(info, &active_thread_list, list) {
-		err = pthread_tryjoin_np(info->tid, &tret);
+		/* pooled upcalls are taken off the list by their worker */
+		if (info->flags & UPCALL_THREAD_POOLED)
+			err = EBUSY;
+		else
+			err = pthread_tryjoin_np(info->tid, &tret);
 		switch (err) {
 		case 0:
 			/*
@@ -509,8 +655,38 @@ scan_active_thread_list(void)
 			 * log an error (cancel_timed_out_upcalls=false).  In either case,
 			 * the error is logged only once.
 			 */
-			if (now.tv_sec >= info->timeout.tv_sec) {
+			if (now.tv_sec >= info->timeout.tv_sec &&
+			    (info->flags & UPCALL_THREAD_POOLED) &&
+			    !(info->flags & UPCALL_THREAD_RUNNING)) {
+				/*
+				 * A pooled upcall that is still waiting for a worker
+				 * has nothing to cancel: it is dropped from its queue,
+				 * or just logged, as a running one would be.
+				 */
+				if (!(info->flags & UPCALL_THREAD_WARNED))
+					gssd_stats_count(GCOUNT_TIMEOUT);
+				if (cancel_timed_out_upcalls) {
+					gssd_stats_count(GCOUNT_CANCEL);
+					printerr(0, "watchdog: upcall for uid %d timed out "
+							"waiting for a worker\n", info->uid);
+					upcall_pool_drop(info);
+					do_error_downcall(info->fd, info->uid, -ETIMEDOUT);
+					free_upcall_info(info->info);
+					saveprev = info->list.tqe_prev;
+					TAILQ_REMOVE(&active_thread_list, info, list);
+					free(info);
+					info = saveprev;
+				} else if (!(info->flags & UPCALL_THREAD_WARNED)) {
+					printerr(0, "watchdog: upcall for uid %d waiting for "
+							"a worker for %ld seconds\n", info->uid,
+							now.tv_sec - info->timeout.tv_sec + upcall_timeout);
+					info->flags |= UPCALL_THREAD_WARNED;
+				}
+			} else if (now.tv_sec >= info->timeout.tv_sec) {
+				if (!(info->flags & UPCALL_THREAD_WARNED))
+					gssd_stats_count(GCOUNT_TIMEOUT);
 				if (cancel_timed_out_upcalls && !(info->flags & UPCALL_THREAD_CANCELED)) {
+					gssd_stats_count(GCOUNT_CANCEL);
 					printerr(0, "watchdog: thread id 0x%lx timed out\n",
 							info->tid);
 					pthread_cancel(info->tid);
@@ -594,9 +770,9 @@ gssd_get_clnt(struct topdir *tdi, const char *name)
 {
 	struct clnt_info *clp;
 
-	TAILQ_FOREACH(clp, &tdi->clnt_list, list)
-		if (!strcmp(clp->name, name))
-			return clp;
+	clp = gssd_find_clnt(tdi, name);
+	if (clp)
+		return clp;
 
 	printerr(4, "creating client %s/%s\n", tdi->name, name);
 
@@ -621,10 +797,16 @@ gssd_get_clnt(struct topdir *tdi, const char *name)
 	}
 
 	clp->name = clp->relpath + strlen(tdi->name) + 1;
+	clp->tdi = tdi;
 	clp->krb5_fd = -1;
 	clp->gssd_fd = -1;
 	clp->refcount = 1;
 
+	if (gssd_clnt_hash(clp) < 0) {
+		printerr(0, "ERROR: can't hash client %s\n", clp->relpath);
+		inotify_rm_watch(inotify_fd, clp->wd);
+		goto out;
+	}
 	TAILQ_INSERT_HEAD(&tdi->clnt_list, clp, list);
 	return clp;
 
@@ -736,8 +918,22 @@ gssd_get_topdir(const char *name)
 	return tdi;
 }
 
+/*
+ * Whether there is nothing more to find out about a client: it has its
+ * pipe open, and its info read.
+ */
+static bool
+gssd_clnt_complete(struct clnt_info *clp)
+{
+	return (clp->gssd_fd >= 0 || clp->krb5_fd >= 0) && clp->prog != 0;
+}
+
+/*
+ * Bring the clients of a topdir up to date with what is in it.  With
+ * full unset, known clients that are complete aren't looked at again.
+ */
 static void
-gssd_scan_topdir(const char *name)
+gssd_scan_topdir(const char *name, bool full)
 {
 	struct topdir *tdi;
 	int dfd;
@@ -774,6 +970,11 @@ gssd_scan_topdir(const char *name)
 		if (strncmp(d->d_name, "clnt", strlen("clnt")))
 			continue;
 
+		clp = gssd_find_clnt(tdi, d->d_name);
+		if (clp && !full && gssd_clnt_complete(clp)) {
+			clp->scanned = true;
+			continue;
+		}
 		gssd_create_clnt(tdi, d->d_name);
 	}
 
@@ -794,11 +995,11 @@ gssd_scan_topdir(const char *name)
 }
 
 static void
-gssd_scan(void)
+gssd_scan(bool full)
 {
 	struct dirent *d;
 
-	printerr(4, "doing a full rescan\n");
+	printerr(4, "doing a %s rescan\n", full ? "full" : "quick");
 	rewinddir(pipefs_dir);
 
 	while ((d = readdir(pipefs_dir))) {
@@ -808,7 +1009,7 @@ gssd_scan(void)
 		if (d->d_name[0] == '.')
 			continue;
 
-		gssd_scan_topdir(d->d_name);
+		gssd_scan_topdir(d->d_name, full);
 	}
 
 	if (TAILQ_EMPTY(&topdir_list)) {
@@ -820,9 +1021,19 @@ gssd_scan(void)
 static void
 gssd_scan_cb(int UNUSED(fd), short UNUSED(which), void *UNUSED(data))
 {
-	gssd_scan();
+	gssd_scan(true);
+}
+
+static void
+gssd_report_cb(int UNUSED(fd), short UNUSED(which), void *UNUSED(data))
+{
+	upcall_report_counters();
 }
 
+/*
+ * Returns false if the topdir is gone, and the topdirs need reading
+ * again.
+ */
 static bool
 gssd_inotify_topdir(struct topdir *tdi, const struct inotify_event *ev)
 {
@@ -836,48 +1047,38 @@ gssd_inotify_topdir(struct topdir *tdi, const struct inotify_event *ev)
 	}
 
 	if (ev->len == 0)
-		return false;
-
-	if (ev->mask & IN_CREATE) {
-		if (!(ev->mask & IN_ISDIR))
-			return true;
-
-		if (strncmp(ev->name, "clnt", strlen("clnt")))
-			return true;
-
-		if (gssd_create_clnt(tdi, ev->name))
-			return false;
-
 		return true;
-	} 
 
-	return false;
+	if ((ev->mask & IN_CREATE) && (ev->mask & IN_ISDIR) &&
+	    !strncmp(ev->name, "clnt", strlen("clnt")))
+		/* if it's gone already, so be it */
+		gssd_create_clnt(tdi, ev->name);
+
+	return true;
 }
 
-static bool
-gssd_inotify_clnt(struct topdir *tdi, struct clnt_info *clp, const struct inotify_event *ev)
+static void
+gssd_inotify_clnt(struct clnt_info *clp, const struct inotify_event *ev)
 {
 	printerr(5, "inotify event for clntdir (%s) - "
 		 "ev->wd (%d) ev->name (%s) ev->mask (0x%08x)\n",
 		 clp->relpath, ev->wd, ev->len > 0 ? ev->name : "<?>", ev->mask);
 
 	if (ev->mask & IN_IGNORED) {
-		TAILQ_REMOVE(&tdi->clnt_list, clp, list);
+		TAILQ_REMOVE(&clp->tdi->clnt_list, clp, list);
 		gssd_destroy_client(clp);
-		return true;
+		return;
 	}
 
 	if (ev->len == 0)
-		return false;
+		return;
 
 	if (ev->mask & IN_CREATE) {
 		if (!strcmp(ev->name, "gssd") ||
 		    !strcmp(ev->name, "krb5") ||
 		    !strcmp(ev->name, "info"))
-			if (gssd_scan_clnt(clp))
-				return false;
-
-		return true;
+			/* if the client is going away, IN_IGNORED follows */
+			gssd_scan_clnt(clp);
 
 	} else if (ev->mask & IN_DELETE) {
 		if (!strcmp(ev->name, "gssd") && clp->gssd_fd >= 0) {
@@ -894,11 +1095,7 @@ gssd_inotify_clnt(struct topdir *tdi, struct clnt_info *clp, const struct inotif
 			clp->krb5_ev = NULL;
 			clp->krb5_fd = -1;
 		}
-
-		return true;
 	}
-
-	return false;
 }
 
 static void
@@ -931,34 +1128,30 @@ gssd_inotify_cb(int ifd, short UNUSED(which), void *UNUSED(data))
 				break;
 			}
 
-			TAILQ_FOREACH(tdi, &topdir_list, list) {
-				if (tdi->wd == ev->wd) {
-					if (!gssd_inotify_topdir(tdi, ev))
-						rescan = true;
-					goto found;
-				}
-
-				TAILQ_FOREACH(clp, &tdi->clnt_list, list) {
-					if (clp->wd == ev->wd) {
-						if (!gssd_inotify_clnt(tdi, clp, ev))
-							rescan = true;
-						goto found;
-					}
-				}
+			TAILQ_FOREACH(tdi, &topdir_list, list)
+				if (tdi->wd == ev->wd)
+					break;
+			if (tdi) {
+				if (!gssd_inotify_topdir(tdi, ev))
+					rescan = true;
+				continue;
 			}
 
-found:
-			if (!tdi) {
-				printerr(5, "inotify event for unknown wd!!! - "
-					 "ev->wd (%d) ev->name (%s) ev->mask (0x%08x)\n",
-					 ev->wd, ev->len > 0 ? ev->name : "<?>", ev->mask);
-				rescan = true;
+			clp = gssd_find_clnt_wd(ev->wd);
+			if (clp) {
+				gssd_inotify_clnt(clp, ev);
+				continue;
 			}
+
+			/* most likely, for a client already removed */
+			printerr(5, "inotify event for unknown wd!!! - "
+				 "ev->wd (%d) ev->name (%s) ev->mask (0x%08x)\n",
+				 ev->wd, ev->len > 0 ? ev->name : "<?>", ev->mask);
 		}
 	}
 
 	if (rescan)
-		gssd_scan();
+		gssd_scan(false);
 }
 
 static void
@@ -989,7 +1182,10 @@ read_gss_conf(void)
 	char *s;
 
 	conf_init_file(NFS_CONFFILE);
+	xlog_set_async("gssd");
 	use_memcache = conf_get_bool("gssd", "use-memcache", use_memcache);
+	machine_cred_file = conf_get_bool("gssd", "machine-cred-file",
+					  machine_cred_file);
 	root_uses_machine_creds = conf_get_bool("gssd", "use-machine-creds",
 						root_uses_machine_creds);
 	avoid_dns = conf_get_bool("gssd", "avoid-dns", avoid_dns);
@@ -999,9 +1195,19 @@ read_gss_conf(void)
 #endif
 	context_timeout = conf_get_num("gssd", "context-timeout", context_timeout);
 	rpc_timeout = conf_get_num("gssd", "rpc-timeout", rpc_timeout);
+	connection_idle_timeout = conf_get_num("gssd", "connection-idle-timeout",
+					       connection_idle_timeout);
 	upcall_timeout = conf_get_num("gssd", "upcall-timeout", upcall_timeout);
 	cancel_timed_out_upcalls = conf_get_bool("gssd", "cancel-timed-out-upcalls",
 						cancel_timed_out_upcalls);
+	upcall_threads = conf_get_num("gssd", "upcall-threads", upcall_threads);
+	upcall_client_threads = conf_get_num("gssd", "upcall-client-threads",
+					     upcall_client_threads);
+	upcall_topdir_threads = conf_get_num("gssd", "upcall-topdir-threads",
+					     upcall_topdir_threads);
+	machine_cred_refresh = conf_get_num("gssd", "machine-cred-refresh",
+					    machine_cred_refresh);
+	stats_interval = conf_get_num("gssd", "stats-interval", stats_interval);
 	s = conf_get_str("gssd", "pipefs-directory");
 	if (!s)
 		s = conf_get_str("general", "pipefs-directory");
@@ -1037,6 +1243,8 @@ main(int argc, char *argv[])
 	extern char *optarg;
 	char *progname;
 	struct event *sighup_ev;
+	struct event *sigusr1_ev;
+	struct event *stats_ev = NULL;
 
 	read_gss_conf();
 
@@ -1190,6 +1398,9 @@ main(int argc, char *argv[])
 #endif
 
 	daemon_init(fg);
+	nfsmetrics_start("gssd");
+	nfstrace_start("gssd");
+	nfsworker_init("gssd");
 
 	if (gssd_check_mechs() != 0)
 		errx(1, "Problem with gssapi library");
@@ -1226,6 +1437,23 @@ main(int argc, char *argv[])
 		exit(EXIT_FAILURE);
 	}
 	evsignal_add(sighup_ev, NULL);
+	sigusr1_ev = evsignal_new(evbase, SIGUSR1, gssd_report_cb, NULL);
+	if (!sigusr1_ev) {
+		printerr(0, "ERROR: failed to create SIGUSR1 event: %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	evsignal_add(sigusr1_ev, NULL);
+	if (stats_interval > 0) {
+		struct timeval tv = { .tv_sec = stats_interval };
+
+		stats_ev = event_new(evbase, -1, EV_PERSIST, gssd_report_cb, NULL);
+		if (!stats_ev) {
+			printerr(0, "ERROR: failed to create statistics timer: %s\n",
+				 strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		event_add(stats_ev, &tv);
+	}
 	inotify_ev = event_new(evbase, inotify_fd, EV_READ | EV_PERSIST,
 			       gssd_inotify_cb, NULL);
 	if (!inotify_ev) {
@@ -1241,9 +1469,15 @@ main(int argc, char *argv[])
 		printerr(0, "ERROR: failed to start watchdog thread: %d\n", rc);
 		exit(EXIT_FAILURE);
 	}
+	rc = gssd_start_machine_cred_refresher();
+	if (rc != 0) {
+		printerr(0, "ERROR: failed to start machine credentials "
+			 "refresher: %d\n", rc);
+		exit(EXIT_FAILURE);
+	}
 
 	TAILQ_INIT(&topdir_list);
-	gssd_scan();
+	gssd_scan(true);
 	daemon_ready();
 
 	rc = event_base_dispatch(evbase);
@@ -1265,6 +1499,9 @@ main(int argc, char *argv[])
 
 	event_free(inotify_ev);
 	event_free(sighup_ev);
+	event_free(sigusr1_ev);
+	if (stats_ev)
+		event_free(stats_ev);
 	event_base_free(evbase);
 
 	close(inotify_fd);
@@ -38,6 +38,8 @@
 #include <stdbool.h>
 #include <pthread.h>
 
+#include "nfstrace.h"
+
 #ifndef GSSD_PIPEFS_DIR
 #define GSSD_PIPEFS_DIR		NFS_STATEDIR "/rpc_pipefs"
 #endif
@@ -64,13 +66,22 @@ enum {AUTHTYPE_KRB5, AUTHTYPE_LIPKEY};
 extern char		       *keytabfile;
 extern char		      **ccachesearch;
 extern int			use_memcache;
+extern int			machine_cred_file;
 extern int			root_uses_machine_creds;
 extern unsigned int 		context_timeout;
 extern unsigned int rpc_timeout;
+extern int			connection_idle_timeout;
 extern char			*preferred_realm;
 
+struct topdir;
+struct upcall_queue;
+struct gssd_enctypes;
+
 struct clnt_info {
 	TAILQ_ENTRY(clnt_info)	list;
+	struct clnt_info	*wd_next;	/* hashed by wd */
+	struct clnt_info	*name_next;	/* hashed by topdir and name */
+	struct topdir		*tdi;
 	int			refcount;
 	int			wd;
 	bool			scanned;
@@ -86,6 +97,7 @@ struct clnt_info {
 	int			gssd_fd;
 	struct event		*gssd_ev;
 	struct			sockaddr_storage addr;
+	const struct gssd_enctypes *enctypes;	/* last sent in an upcall */
 };
 
 struct clnt_upcall_info {
@@ -95,24 +107,70 @@ struct clnt_upcall_info {
 	char			*srchost;
 	char			*target;
 	char			*service;
+	const struct gssd_enctypes *enctypes;	/* NULL if never sent */
+	int			stat;		/* its gssd_stat_id */
+	unsigned long long	start;		/* when it was read */
+	struct nfstrace		trace;
 };
 
 struct upcall_thread_info {
 	TAILQ_ENTRY(upcall_thread_info) list;
+	TAILQ_ENTRY(upcall_thread_info) queue;	/* per uid, until run */
+	struct upcall_queue	*uq;		/* that, then its client's */
 	pthread_t		tid;
 	struct timespec		timeout;
+	unsigned long long	queued;		/* pooled, when queued */
 	uid_t			uid;
 	int			fd;
 	unsigned short		flags;
 #define UPCALL_THREAD_CANCELED	0x0001
 #define UPCALL_THREAD_WARNED	0x0002
+#define UPCALL_THREAD_POOLED	0x0004	/* run by a worker, see upcall_threads */
+#define UPCALL_THREAD_RUNNING	0x0008	/* pooled, and taken by a worker */
+	void			(*func)(struct clnt_upcall_info *);
+	struct clnt_upcall_info	*info;
 };
 
+extern int			upcall_threads;
+extern int			upcall_client_threads;
+extern int			upcall_topdir_threads;
+extern int			machine_cred_refresh;
+
 void handle_krb5_upcall(struct clnt_info *clp);
 void handle_gssd_upcall(struct clnt_info *clp);
 void free_upcall_info(struct clnt_upcall_info *info);
 void gssd_free_client(struct clnt_info *clp);
 int do_error_downcall(int k5_fd, uid_t uid, int err);
+void upcall_pool_drop(struct upcall_thread_info *tinfo);
+void upcall_report_counters(void);
+
+/* gssd_stats.c */
+enum gssd_stat_id {
+	GSTAT_KRB5_UPCALL,	/* from the krb5 pipe, read to reply */
+	GSTAT_GSSD_UPCALL,	/* from the gssd pipe, read to reply */
+	GSTAT_QUEUE,		/* waiting for an upcall worker */
+	GSTAT_CONNECT,		/* connecting to the server */
+	GSTAT_KDC,		/* getting machine credentials */
+	GSTAT_NEGOTIATE,	/* creating the context with the server */
+	GSTAT_CCACHE,		/* searching for a user's credentials cache */
+	GSTAT_MAX
+};
+
+enum gssd_counter_id {
+	GCOUNT_USER,		/* upcalls with user credentials */
+	GCOUNT_MACHINE,		/* upcalls with machine credentials */
+	GCOUNT_TIMEOUT,		/* upcalls the watchdog found timed out */
+	GCOUNT_CANCEL,		/* of those, upcalls it canceled */
+	GCOUNT_CCACHE_HIT,	/* user ccaches found without a search */
+	GCOUNT_MAX
+};
+
+extern int			stats_interval;
+
+unsigned long long gssd_stats_clock(void);
+void gssd_stats_add(enum gssd_stat_id id, unsigned long long start, bool failed);
+void gssd_stats_count(enum gssd_counter_id id);
+void gssd_stats_report(void);
 
 
 #endif /* _RPC_GSSD_H_ */
@@ -56,6 +56,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <pwd.h>
 #include <grp.h>
 #include <string.h>
@@ -78,6 +79,7 @@
 #include "context.h"
 #include "nfsrpc.h"
 #include "nfslib.h"
+#include "nfsworker.h"
 #include "gss_names.h"
 
 extern pthread_mutex_t clp_lock;
@@ -85,10 +87,6 @@ extern pthread_mutex_t active_thread_list_lock;
 extern int upcall_timeout;
 extern TAILQ_HEAD(active_thread_list_head, upcall_thread_info) active_thread_list;
 
-/* Encryption types supported by the kernel rpcsec_gss code */
-int num_krb5_enctypes = 0;
-krb5_enctype *krb5_enctypes = NULL;
-
 /* Args for the cleanup_handler() */
 struct cleanup_args  {
 	OM_uint32 	*min_stat;
@@ -97,63 +95,67 @@ struct cleanup_args  {
 	struct authgss_private_data *pd;
 	AUTH		**auth;
 	CLIENT		**rpc_clnt;
+	struct clnt_info *clp;
 };
 
 /*
- * Parse the supported encryption type information
+ * Encryption types supported by the kernel rpcsec_gss code.  The
+ * kernel sends the same list with every upcall, so each distinct list
+ * is parsed only once, and kept for all the clients and upcalls that
+ * use it: only the main thread parses lists, and none is ever freed.
  */
-static int
-parse_enctypes(char *enctypes)
-{
-	int n = 0;
-	char *curr, *comma;
-	int i;
-	static char *cached_types;
-
-	if (cached_types && strcmp(cached_types, enctypes) == 0)
-		return 0;
-	free(cached_types);
-
-	if (krb5_enctypes != NULL) {
-		free(krb5_enctypes);
-		krb5_enctypes = NULL;
-		num_krb5_enctypes = 0;
-	}
+static struct gssd_enctypes *enctype_lists;
+/* The list last sent, for upcalls that don't say */
+static const struct gssd_enctypes *enctypes_last;
 
-	/* count the number of commas */
-	for (curr = enctypes; curr && *curr != '\0'; curr = ++comma) {
-		comma = strchr(curr, ',');
-		if (comma != NULL)
+/*
+ * Parse the supported encryption type information, or find it parsed
+ * already.  Returns NULL with errno set if it can't be parsed.
+ */
+static const struct gssd_enctypes *
+parse_enctypes(const char *enctypes)
+{
+	struct gssd_enctypes *list;
+	const char *curr;
+	int n, i;
+
+	for (list = enctype_lists; list; list = list->next)
+		if (strcmp(list->str, enctypes) == 0)
+			return list;
+
+	/* count the values, ignoring a trailing comma */
+	n = *enctypes != '\0';
+	for (curr = enctypes; *curr != '\0'; curr++)
+		if (*curr == ',' && curr[1] != '\0')
 			n++;
-		else
-			break;
-	}
-	/* If no more commas and we're not at the end, there's one more value */
-	if (*curr != '\0')
-		n++;
 
 	/* Empty string, return an error */
-	if (n == 0)
-		return ENOENT;
+	if (n == 0) {
+		errno = ENOENT;
+		return NULL;
+	}
 
-	/* Allocate space for enctypes array */
-	if ((krb5_enctypes = (int *) calloc(n, sizeof(int))) == NULL) {
-		return ENOMEM;
+	list = malloc(sizeof(*list) + n * sizeof(list->types[0]));
+	if (list == NULL)
+		return NULL;
+	list->str = strdup(enctypes);
+	if (list->str == NULL) {
+		free(list);
+		return NULL;
 	}
 
 	/* Now parse each value into the array */
-	for (curr = enctypes, i = 0; curr && *curr != '\0'; curr = ++comma) {
-		krb5_enctypes[i++] = atoi(curr);
-		comma = strchr(curr, ',');
-		if (comma == NULL)
+	for (curr = enctypes, i = 0; i < n; i++) {
+		list->types[i] = atoi(curr);
+		curr = strchr(curr, ',');
+		if (curr == NULL)
 			break;
+		curr++;
 	}
-
-	num_krb5_enctypes = n;
-	if ((cached_types = malloc(strlen(enctypes)+1)))
-		strcpy(cached_types, enctypes);
-
-	return 0;
+	list->count = n;
+	list->next = enctype_lists;
+	enctype_lists = list;
+	return list;
 }
 
 static void
@@ -190,6 +192,7 @@ do_downcall(int k5_fd, uid_t uid, struct authgss_private_data *pd,
 	if (write_buffer(&p, end, acceptor)) goto out_err;
 
 	if (write(k5_fd, buf, p - buf) < p - buf) goto out_err;
+	nfstrace_downcall();
 	free(buf);
 	return;
 out_err:
@@ -216,12 +219,283 @@ do_error_downcall(int k5_fd, uid_t uid, int err)
 	if (WRITE_BYTES(&p, end, err)) goto out_err;
 
 	if (write(k5_fd, buf, p - buf) < p - buf) goto out_err;
+	nfstrace_downcall();
 	return 0;
 out_err:
 	printerr(1, "Failed to write error downcall!\n");
 	return -1;
 }
 
+static int upcall_queued, upcall_queued_max;
+
+/**
+ * upcall_report_counters - log how many upcalls wait for a worker, and
+ * the statistics kept in gssd_stats.c
+ */
+void
+upcall_report_counters(void)
+{
+	int queued, queued_max;
+
+	pthread_mutex_lock(&active_thread_list_lock);
+	queued = upcall_queued;
+	queued_max = upcall_queued_max;
+	pthread_mutex_unlock(&active_thread_list_lock);
+	if (upcall_threads > 0)
+		printerr(0, "upcalls: %d waiting for a worker, at most %d\n",
+			 queued, queued_max);
+	gssd_stats_report();
+}
+
+/*
+ * Idle RPC clients, for creating contexts with a server over a
+ * connection the last upcall for it left open instead of a new one.
+ * Each is used by one upcall at a time, and closed once it has been
+ * idle for connection_idle_timeout seconds, or when the server has
+ * closed its end.
+ */
+struct rpc_conn {
+	struct rpc_conn		*next;
+	struct sockaddr_storage	addr;
+	socklen_t		salen;
+	int			protocol;
+	rpcprog_t		prog;
+	rpcvers_t		vers;
+	CLIENT			*clnt;
+	time_t			idle;		/* since when */
+};
+
+#define RPC_CONN_HASH	64		/* buckets, a power of 2 */
+#define RPC_CONN_MAX	512		/* idle clients kept */
+
+static struct rpc_conn *rpc_conn_table[RPC_CONN_HASH];
+static unsigned int rpc_conn_count;
+static time_t rpc_conn_swept;
+static pthread_mutex_t rpc_conn_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned int
+rpc_conn_hash(const struct sockaddr *sa, socklen_t salen, rpcprog_t prog,
+	      rpcvers_t vers)
+{
+	const unsigned char *p = (const unsigned char *)sa;
+	uint32_t h = 2166136261u;
+	socklen_t i;
+
+	for (i = 0; i < salen; i++)
+		h = (h ^ p[i]) * 16777619u;
+	h = (h ^ prog) * 16777619u;
+	h = (h ^ vers) * 16777619u;
+	return h & (RPC_CONN_HASH - 1);
+}
+
+/* Whether the connection is still as the last upcall left it */
+static bool
+rpc_conn_usable(CLIENT *clnt)
+{
+	struct pollfd pfd;
+	int fd;
+
+	if (!clnt_control(clnt, CLGET_FD, (char *)&fd))
+		return false;
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	/* an idle connection has nothing to read, not even an EOF */
+	return poll(&pfd, 1, 0) == 0;
+}
+
+/* Close the clients idle for too long.  Called with rpc_conn_lock held. */
+static void
+rpc_conn_sweep(time_t now)
+{
+	struct rpc_conn *rc, **rcp;
+	int i;
+
+	rpc_conn_swept = now;
+	for (i = 0; i < RPC_CONN_HASH; i++) {
+		rcp = &rpc_conn_table[i];
+		while ((rc = *rcp) != NULL) {
+			if (now - rc->idle < connection_idle_timeout) {
+				rcp = &rc->next;
+				continue;
+			}
+			*rcp = rc->next;
+			clnt_destroy(rc->clnt);
+			free(rc);
+			rpc_conn_count--;
+		}
+	}
+}
+
+/*
+ * Find an idle client for the given server and program, or create
+ * one as nfs_get_rpcclient() does.
+ */
+static CLIENT *
+rpc_conn_get(const struct sockaddr *sa, socklen_t salen, int protocol,
+	     rpcprog_t prog, rpcvers_t vers, struct timeval *timeout)
+{
+	struct rpc_conn *rc, **rcp;
+	CLIENT *clnt = NULL;
+
+	pthread_mutex_lock(&rpc_conn_lock);
+	rcp = &rpc_conn_table[rpc_conn_hash(sa, salen, prog, vers)];
+	while ((rc = *rcp) != NULL) {
+		if (rc->salen != salen || rc->protocol != protocol ||
+		    rc->prog != prog || rc->vers != vers ||
+		    memcmp(&rc->addr, sa, salen) != 0) {
+			rcp = &rc->next;
+			continue;
+		}
+		*rcp = rc->next;
+		rpc_conn_count--;
+		if (rpc_conn_usable(rc->clnt)) {
+			clnt = rc->clnt;
+			free(rc);
+			break;
+		}
+		clnt_destroy(rc->clnt);
+		free(rc);
+	}
+	pthread_mutex_unlock(&rpc_conn_lock);
+
+	if (clnt) {
+		printerr(3, "reusing connection for prog %lu vers %lu\n",
+			 (unsigned long)prog, (unsigned long)vers);
+		return clnt;
+	}
+	return nfs_get_rpcclient(sa, salen, protocol, prog, vers, timeout);
+}
+
+/*
+ * Keep a client that an upcall is done with for the next upcall for
+ * the same server, or destroy it.  Its GSS auth must have been
+ * destroyed already.
+ */
+static void
+rpc_conn_put(struct clnt_info *clp, CLIENT *clnt)
+{
+	const struct sockaddr *sa = (const struct sockaddr *)&clp->addr;
+	struct rpc_conn *rc, **rcp;
+	time_t now;
+
+	/* the gss auth has been destroyed */
+	clnt->cl_auth = authnone_create();
+	if (connection_idle_timeout <= 0)
+		goto out_destroy;
+	rc = calloc(1, sizeof(*rc));
+	if (rc == NULL)
+		goto out_destroy;
+	switch (sa->sa_family) {
+	case AF_INET:
+		rc->salen = sizeof(struct sockaddr_in);
+		break;
+#ifdef IPV6_SUPPORTED
+	case AF_INET6:
+		rc->salen = sizeof(struct sockaddr_in6);
+		break;
+#endif /* IPV6_SUPPORTED */
+	default:
+		free(rc);
+		goto out_destroy;
+	}
+	memcpy(&rc->addr, sa, rc->salen);
+	rc->protocol = strcmp(clp->protocol, "udp") == 0 ?
+					IPPROTO_UDP : IPPROTO_TCP;
+	rc->prog = clp->prog;
+	rc->vers = clp->vers;
+	rc->clnt = clnt;
+	now = time(NULL);
+	rc->idle = now;
+
+	pthread_mutex_lock(&rpc_conn_lock);
+	if (now - rpc_conn_swept >= connection_idle_timeout ||
+	    rpc_conn_count >= RPC_CONN_MAX)
+		rpc_conn_sweep(now);
+	if (rpc_conn_count >= RPC_CONN_MAX) {
+		pthread_mutex_unlock(&rpc_conn_lock);
+		free(rc);
+		goto out_destroy;
+	}
+	rcp = &rpc_conn_table[rpc_conn_hash(sa, rc->salen, rc->prog,
+					    rc->vers)];
+	rc->next = *rcp;
+	*rcp = rc;
+	rpc_conn_count++;
+	pthread_mutex_unlock(&rpc_conn_lock);
+	return;
+
+out_destroy:
+	clnt_destroy(clnt);
+}
+
+/*
+ * Ports found with rpcbind, so that upcalls for a server the kernel
+ * doesn't pass the port of don't each query rpcbind.  The cache is
+ * direct-mapped: a colliding server simply replaces the one before.
+ */
+struct port_cache_ent {
+	struct sockaddr_storage	addr;		/* port cleared */
+	socklen_t		salen;
+	rpcprog_t		prog;
+	rpcvers_t		vers;
+	unsigned short		protocol;
+	unsigned short		port;
+	time_t			expires;
+};
+
+#define PORT_CACHE_SIZE		64		/* a power of 2 */
+#define PORT_CACHE_TTL		300		/* seconds */
+
+static struct port_cache_ent port_cache[PORT_CACHE_SIZE];
+static pthread_mutex_t port_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct port_cache_ent *
+port_cache_slot(const struct sockaddr *sa, const socklen_t salen,
+		const rpcprog_t program, const rpcvers_t version)
+{
+	return &port_cache[rpc_conn_hash(sa, salen, program, version) &
+			   (PORT_CACHE_SIZE - 1)];
+}
+
+/* Called with the port in SA clear */
+static unsigned short
+port_cache_get(const struct sockaddr *sa, const socklen_t salen,
+	       const rpcprog_t program, const rpcvers_t version,
+	       const unsigned short protocol)
+{
+	struct port_cache_ent *pc = port_cache_slot(sa, salen, program, version);
+	unsigned short port = 0;
+
+	pthread_mutex_lock(&port_cache_lock);
+	if (pc->salen == salen && pc->prog == program &&
+	    pc->vers == version && pc->protocol == protocol &&
+	    pc->expires > time(NULL) && memcmp(&pc->addr, sa, salen) == 0)
+		port = pc->port;
+	pthread_mutex_unlock(&port_cache_lock);
+	return port;
+}
+
+static void
+port_cache_put(const struct sockaddr *sa, const socklen_t salen,
+	       const rpcprog_t program, const rpcvers_t version,
+	       const unsigned short protocol, unsigned short port)
+{
+	struct port_cache_ent *pc = port_cache_slot(sa, salen, program, version);
+
+	if (salen > sizeof(pc->addr))
+		return;
+	pthread_mutex_lock(&port_cache_lock);
+	memcpy(&pc->addr, sa, salen);
+	pc->salen = salen;
+	pc->prog = program;
+	pc->vers = version;
+	pc->protocol = protocol;
+	pc->port = port;
+	pc->expires = time(NULL) + PORT_CACHE_TTL;
+	pthread_mutex_unlock(&port_cache_lock);
+}
+
 /*
  * If the port isn't already set, do an rpcbind query to the remote server
  * using the program and version and get the port.
@@ -282,12 +556,16 @@ populate_port(struct sockaddr *sa, const socklen_t salen,
 		goto set_port;
 	}
 
+	port = port_cache_get(sa, salen, program, version, protocol);
+	if (port)
+		goto set_port;
 	port = nfs_getport(sa, salen, program, version, protocol);
 	if (!port) {
 		printerr(0, "ERROR: unable to obtain port for prog %ld "
 			    "vers %ld\n", program, version);
 		return 0;
 	}
+	port_cache_put(sa, salen, program, version, protocol, port);
 
 set_port:
 	printerr(2, "DEBUG: setting port to %hu for prog %lu vers %lu\n", port,
@@ -313,6 +591,7 @@ set_port:
  */
 static int
 create_auth_rpc_client(struct clnt_info *clp,
+		       const struct gssd_enctypes *enctypes,
 		       char *tgtname,
 		       CLIENT **clnt_return,
 		       AUTH **auth_return,
@@ -330,6 +609,7 @@ create_auth_rpc_client(struct clnt_info *clp,
 	struct timeval	timeout;
 	struct sockaddr		*addr = (struct sockaddr *) &clp->addr;
 	socklen_t		salen;
+	unsigned long long	start;
 	pthread_t tid = pthread_self();
 
 	sec.qop = GSS_C_QOP_DEFAULT;
@@ -353,7 +633,7 @@ create_auth_rpc_client(struct clnt_info *clp,
 		 * Do this before creating rpc connection since we won't need
 		 * rpc connection if it fails!
 		 */
-		if (limit_krb5_enctypes(&sec)) {
+		if (limit_krb5_enctypes(&sec, enctypes)) {
 			printerr(1, "WARNING: Failed while limiting krb5 "
 				    "encryption types for user with uid %d\n",
 				 uid);
@@ -393,8 +673,10 @@ create_auth_rpc_client(struct clnt_info *clp,
 	timeout.tv_sec = (long) rpc_timeout;
 	timeout.tv_usec = (long) 0;
 
-	rpc_clnt = nfs_get_rpcclient(addr, salen, protocol, clp->prog,
-				     clp->vers, &timeout);
+	start = gssd_stats_clock();
+	rpc_clnt = rpc_conn_get(addr, salen, protocol, clp->prog,
+				clp->vers, &timeout);
+	gssd_stats_add(GSTAT_CONNECT, start, rpc_clnt == NULL);
 	if (!rpc_clnt) {
 		snprintf(rpc_errmsg, sizeof(rpc_errmsg),
 			 "WARNING: can't create %s rpc_clnt to server %s for "
@@ -410,7 +692,9 @@ create_auth_rpc_client(struct clnt_info *clp,
 
 	printerr(3, "create_auth_rpc_client(0x%lx): creating context with server %s\n", 
 		tid, tgtname);
+	start = gssd_stats_clock();
 	auth = authgss_create_default(rpc_clnt, tgtname, &sec);
+	gssd_stats_add(GSTAT_NEGOTIATE, start, auth == NULL);
 	if (!auth) {
 		/* Our caller should print appropriate message */
 		printerr(2, "WARNING: Failed to create krb5 context for "
@@ -449,11 +733,20 @@ create_auth_rpc_client(struct clnt_info *clp,
  * renicing, but this is the best we can do. In the event that a child is
  * signalled before downcalling, the kernel will just eventually time out the
  * upcall attempt.
+ *
+ * A pooled worker runs one upcall after another, so it keeps its own uid
+ * and gid as the saved set-user-ID and set-group-ID, for
+ * restore_identity() to go back to.
  */
+static __thread bool upcall_worker;
+static __thread uid_t upcall_worker_uid;
+static __thread gid_t upcall_worker_gid;
+
 static int
 change_identity(uid_t uid)
 {
 	struct passwd	*pw;
+	uid_t		suid = upcall_worker ? (uid_t)-1 : uid;
 	int res;
 
 	/* drop list of supplimentary groups first */
@@ -485,9 +778,11 @@ change_identity(uid_t uid)
 	 * other threads. To bypass this, we have to call syscall() directly.
 	 */
 #ifdef __NR_setresgid32
-	res = syscall(SYS_setresgid32, pw->pw_gid, pw->pw_gid, pw->pw_gid);
+	res = syscall(SYS_setresgid32, pw->pw_gid, pw->pw_gid,
+		      upcall_worker ? (gid_t)-1 : pw->pw_gid);
 #else 
-	res = syscall(SYS_setresgid, pw->pw_gid, pw->pw_gid, pw->pw_gid);
+	res = syscall(SYS_setresgid, pw->pw_gid, pw->pw_gid,
+		      upcall_worker ? (gid_t)-1 : pw->pw_gid);
 #endif
 	if (res != 0) {
 		printerr(0, "WARNING: failed to set gid to %u!\n", pw->pw_gid);
@@ -495,9 +790,9 @@ change_identity(uid_t uid)
 	}
 
 #ifdef __NR_setresuid32
-	res = syscall(SYS_setresuid32, uid, uid, uid);
+	res = syscall(SYS_setresuid32, uid, uid, suid);
 #else 
-	res = syscall(SYS_setresuid, uid, uid, uid);
+	res = syscall(SYS_setresuid, uid, uid, suid);
 #endif
 	if (res != 0) {
 		printerr(0, "WARNING: Failed to setuid for user with uid %u\n", uid);
@@ -507,18 +802,53 @@ change_identity(uid_t uid)
 	return 0;
 }
 
+/*
+ * Switch a pooled worker back to its own identity after an upcall that
+ * may have changed it.  The supplementary groups change_identity()
+ * dropped stay dropped: root has no use for them.
+ */
+static int
+restore_identity(void)
+{
+	uid_t uid = upcall_worker_uid;
+	gid_t gid = upcall_worker_gid;
+	int res;
+
+#ifdef __NR_setresuid32
+	res = syscall(SYS_setresuid32, uid, uid, uid);
+#else
+	res = syscall(SYS_setresuid, uid, uid, uid);
+#endif
+	if (res == 0)
+#ifdef __NR_setresgid32
+		res = syscall(SYS_setresgid32, gid, gid, gid);
+#else
+		res = syscall(SYS_setresgid, gid, gid, gid);
+#endif
+	if (res != 0) {
+		res = errno;
+		printerr(0, "ERROR: upcall worker can't switch back to "
+			 "uid %u: %s\n", uid, strerror(res));
+	}
+	return res;
+}
+
 static AUTH *
-krb5_not_machine_creds(struct clnt_info *clp, uid_t uid, char *tgtname,
-			int *downcall_err, int *chg_err, CLIENT **rpc_clnt)
+krb5_not_machine_creds(struct clnt_info *clp,
+			const struct gssd_enctypes *enctypes, uid_t uid,
+			char *tgtname, int *downcall_err, int *chg_err,
+			CLIENT **rpc_clnt)
 {
 	AUTH		*auth = NULL;
 	gss_cred_id_t	gss_cred;
 	char		**dname;
 	int		err, resp = -1;
+	unsigned long long start;
 	pthread_t tid = pthread_self();
 
 	printerr(2, "krb5_not_machine_creds(0x%lx): uid %d tgtname %s\n", 
 		tid, uid, tgtname);
+	gssd_stats_count(GCOUNT_USER);
 
 	*chg_err = change_identity(uid);
 	if (*chg_err) {
@@ -532,7 +862,7 @@ krb5_not_machine_creds(struct clnt_info *clp, uid_t uid, char *tgtname,
 	 */
 	err = gssd_acquire_user_cred(&gss_cred);
 	if (err == 0)
-		resp = create_auth_rpc_client(clp, tgtname, rpc_clnt,
+		resp = create_auth_rpc_client(clp, enctypes, tgtname, rpc_clnt,
 						&auth, uid,
 						AUTHTYPE_KRB5, gss_cred);
 
@@ -540,12 +870,15 @@ krb5_not_machine_creds(struct clnt_info *clp, uid_t uid, char *tgtname,
 	 * method of trolling for credentials
 	 */
 	for (dname = ccachesearch; resp != 0 && *dname != NULL; dname++) {
+		start = gssd_stats_clock();
 		err = gssd_setup_krb5_user_gss_ccache(uid, clp->servername,
 						*dname);
+		gssd_stats_add(GSTAT_CCACHE, start, err != 0);
 		if (err == -EKEYEXPIRED)
 			*downcall_err = -EKEYEXPIRED;
 		else if (err == 0)
-			resp = create_auth_rpc_client(clp, tgtname, rpc_clnt,
+			resp = create_auth_rpc_client(clp, enctypes, tgtname,
+						rpc_clnt,
 						&auth, uid,AUTHTYPE_KRB5,
 						GSS_C_NO_CREDENTIAL);
 	}
@@ -555,7 +888,8 @@ out:
 }
 
 static AUTH *
-krb5_use_machine_creds(struct clnt_info *clp, uid_t uid,
+krb5_use_machine_creds(struct clnt_info *clp,
+		       const struct gssd_enctypes *enctypes, uid_t uid,
 		       char *srchost, char *tgtname, char *service,
 		       CLIENT **rpc_clnt)
 {
@@ -568,6 +902,7 @@ krb5_use_machine_creds(struct clnt_info *clp, uid_t uid,
 
 	printerr(2, "krb5_use_machine_creds(0x%lx): uid %d tgtname %s\n", 
 		tid, uid, tgtname);
+	gssd_stats_count(GCOUNT_MACHINE);
 
 	do {
 		gssd_refresh_krb5_machine_credential(clp->servername,
@@ -592,7 +927,8 @@ krb5_use_machine_creds(struct clnt_info *clp, uid_t uid,
 					 *ccname, error_message(min_stat));
 				continue;
 			}
-			if ((create_auth_rpc_client(clp, tgtname, rpc_clnt,
+			if ((create_auth_rpc_client(clp, enctypes, tgtname,
+						rpc_clnt,
 						&auth, uid,
 						AUTHTYPE_KRB5,
 						GSS_C_NO_CREDENTIAL)) == 0) {
@@ -649,7 +985,7 @@ cleanup_handler(void *arg)
 	if (*args->auth)
 		AUTH_DESTROY(*args->auth);
 	if (*args->rpc_clnt)
-		clnt_destroy(*args->rpc_clnt);
+		rpc_conn_put(args->clp, *args->rpc_clnt);
 }
 
 /*
@@ -680,7 +1016,7 @@ process_krb5_upcall(struct clnt_upcall_info *info)
 	gss_name_t		gacceptor = GSS_C_NO_NAME;
 	gss_OID			mech;
 	gss_buffer_desc		acceptor  = {0};
-	struct cleanup_args cleanup_args = {&min_stat, &acceptor, &token, &pd, &auth, &rpc_clnt};
+	struct cleanup_args cleanup_args = {&min_stat, &acceptor, &token, &pd, &auth, &rpc_clnt, clp};
 
 	token.length = 0;
 	token.value = NULL;
@@ -713,7 +1049,8 @@ process_krb5_upcall(struct clnt_upcall_info *info)
 	if (uid != 0 || (uid == 0 && root_uses_machine_creds == 0 &&
 				service == NULL)) {
 
-		auth = krb5_not_machine_creds(clp, uid, tgtname, &downcall_err,
+		auth = krb5_not_machine_creds(clp, info->enctypes, uid,
+						tgtname, &downcall_err,
 						&err, &rpc_clnt);
 		if (err)
 			goto out_return_error;
@@ -721,7 +1058,8 @@ process_krb5_upcall(struct clnt_upcall_info *info)
 	if (auth == NULL) {
 		if (uid == 0 && (root_uses_machine_creds == 1 ||
 				service != NULL)) {
-			auth =	krb5_use_machine_creds(clp, uid, srchost, tgtname,
+			auth =	krb5_use_machine_creds(clp, info->enctypes, uid,
+							srchost, tgtname,
 							service, &rpc_clnt);
 			if (auth == NULL)
 				goto out_return_error;
@@ -774,7 +1112,11 @@ process_krb5_upcall(struct clnt_upcall_info *info)
 	pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
 	pthread_testcancel();
 
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
 	do_downcall(fd, uid, &pd, &token, lifetime_rec, &acceptor);
+	gssd_stats_add(info->stat, info->start, false);
+	info->start = 0;
+	pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
 
 out:
 	pthread_cleanup_pop(1);
@@ -785,15 +1127,20 @@ out_return_error:
 	pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
 	pthread_testcancel();
 
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
 	do_error_downcall(fd, uid, downcall_err);
+	gssd_stats_add(info->stat, info->start, true);
+	info->start = 0;
+	pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
 	goto out;
 }
 
 static struct clnt_upcall_info *
-alloc_upcall_info(struct clnt_info *clp, uid_t uid, int fd, char *srchost,
-		  char *target, char *service)
+alloc_upcall_info(struct clnt_info *clp, int stat, uid_t uid, int fd,
+		  char *srchost, char *target, char *service)
 {
 	struct clnt_upcall_info *info;
+	char key[NFSTRACE_KEYLEN];
 
 	info = malloc(sizeof(struct clnt_upcall_info));
 	if (info == NULL)
@@ -804,8 +1151,18 @@ alloc_upcall_info(struct clnt_info *clp, uid_t uid, int fd, char *srchost,
 	clp->refcount++;
 	pthread_mutex_unlock(&clp_lock);
 	info->clp = clp;
+	info->enctypes = clp->enctypes ? clp->enctypes : enctypes_last;
+	info->stat = stat;
+	info->start = gssd_stats_clock();
 	info->uid = uid;
 	info->fd = fd;
+	if (nfstrace_enabled()) {
+		snprintf(key, sizeof(key), "uid %u %s %s", uid,
+			 clp->servername ? clp->servername : "-",
+			 service ? service : "-");
+		nfstrace_read(&info->trace, stat == GSTAT_KRB5_UPCALL ?
+			      "krb5" : "gssd", key);
+	}
 	if (srchost) {
 		info->srchost = strdup(srchost);
 		if (info->srchost == NULL)
@@ -839,6 +1196,10 @@ out_info:
 
 void free_upcall_info(struct clnt_upcall_info *info)
 {
+	if (info->start)
+		gssd_stats_add(info->stat, info->start, true);
+	nfstrace_enter(&info->trace);
+	nfstrace_done();
 	gssd_free_client(info->clp);
 	if (info->service)
 		free(info->service);
@@ -861,6 +1222,7 @@ static void
 gssd_work_thread_fn(struct clnt_upcall_info *info)
 {
 	pthread_cleanup_push(cleanup_clnt_upcall_info, info);
+	nfstrace_enter(&info->trace);
 	process_krb5_upcall(info);
 	pthread_cleanup_pop(1);
 }
@@ -877,6 +1239,388 @@ alloc_upcall_thread_info(void)
 	return info;
 }
 
+/*
+ * With upcall-threads set, upcalls are run by a pool of that many worker
+ * threads rather than by a thread each.  Upcalls waiting for a worker
+ * are queued by top directory, by RPC client within it, and by uid
+ * within that, and the workers take them round robin at each level: a
+ * top directory after another, a client after another within it, and
+ * a uid after another within the client.  So neither a mount with many
+ * upcalls nor a user with many can hold up the rest, however many
+ * upcalls they queue.  upcall-client-threads and upcall-topdir-threads
+ * limit the workers one client's or one top directory's upcalls can
+ * keep busy at once, so that some are left for the others even while
+ * a busy client's upcalls are slow to run.
+ *
+ * Queued and running upcalls are on the active_thread_list as before,
+ * and the queues are protected by the active_thread_list_lock too.
+ * The watchdog times out each upcall on its own: a queued one that
+ * times out is dropped from its queue, a running one is canceled by
+ * canceling its worker, which another worker then replaces.
+ */
+enum upcall_level {
+	UPCALL_TOPDIR,
+	UPCALL_CLIENT,
+	UPCALL_UID,
+};
+
+struct upcall_queue {
+	struct upcall_queue	*next;		/* hash chain */
+	struct upcall_queue	*parent;	/* NULL for a top directory */
+	TAILQ_ENTRY(upcall_queue) ready;	/* in its parent's children */
+	TAILQ_HEAD(upcall_queue_head, upcall_queue) children;	/* waiting */
+	TAILQ_HEAD(upcall_task_head, upcall_thread_info) tasks;	/* by uid */
+	enum upcall_level	level;
+	const void		*key;		/* topdir, or clnt_info */
+	uid_t			uid;
+	int			queued;		/* upcalls waiting in it */
+	int			running;	/* topdirs and clients */
+};
+
+#define UPCALL_QUEUE_HASH	256		/* buckets, a power of 2 */
+
+/* A queue is kept only while it has upcalls waiting or running */
+static struct upcall_queue *upcall_queues[UPCALL_QUEUE_HASH];
+static struct upcall_queue_head upcall_ready =
+	TAILQ_HEAD_INITIALIZER(upcall_ready);
+static pthread_cond_t upcall_more = PTHREAD_COND_INITIALIZER;
+static int upcall_workers;
+
+static inline unsigned int
+upcall_queue_hash(enum upcall_level level, const void *key, uid_t uid)
+{
+	uintptr_t h = (uintptr_t)key >> 4;
+
+	return (h ^ (h >> 8) ^ uid * 2654435761u ^ level) &
+		(UPCALL_QUEUE_HASH - 1);
+}
+
+/* Called with the active_thread_list_lock held */
+static struct upcall_queue *
+upcall_queue_get(struct upcall_queue *parent, enum upcall_level level,
+		 const void *key, uid_t uid)
+{
+	struct upcall_queue **uqp, *uq;
+
+	uqp = &upcall_queues[upcall_queue_hash(level, key, uid)];
+	for (uq = *uqp; uq; uq = uq->next)
+		if (uq->level == level && uq->key == key && uq->uid == uid)
+			return uq;
+	uq = calloc(1, sizeof(*uq));
+	if (!uq)
+		return NULL;
+	uq->parent = parent;
+	uq->level = level;
+	uq->key = key;
+	uq->uid = uid;
+	TAILQ_INIT(&uq->children);
+	TAILQ_INIT(&uq->tasks);
+	uq->next = *uqp;
+	*uqp = uq;
+	return uq;
+}
+
+/* Free UQ, and the parents it leaves idle, if it is idle.  Lock held */
+static void
+upcall_queue_put(struct upcall_queue *uq)
+{
+	struct upcall_queue **uqp, *parent;
+
+	for (; uq && !uq->queued && !uq->running; uq = parent) {
+		uqp = &upcall_queues[upcall_queue_hash(uq->level, uq->key,
+						       uq->uid)];
+		while (*uqp != uq)
+			uqp = &(*uqp)->next;
+		*uqp = uq->next;
+		parent = uq->parent;
+		free(uq);
+	}
+}
+
+static inline struct upcall_queue_head *
+upcall_queue_siblings(struct upcall_queue *uq)
+{
+	return uq->parent ? &uq->parent->children : &upcall_ready;
+}
+
+/* Queue TINFO for CLP.  Called with the active_thread_list_lock held */
+static int
+upcall_queue_add(struct upcall_thread_info *tinfo, struct clnt_info *clp)
+{
+	struct upcall_queue *tq, *cq, *uq;
+
+	tq = upcall_queue_get(NULL, UPCALL_TOPDIR, clp->tdi, 0);
+	cq = tq ? upcall_queue_get(tq, UPCALL_CLIENT, clp, 0) : NULL;
+	uq = cq ? upcall_queue_get(cq, UPCALL_UID, clp, tinfo->uid) : NULL;
+	if (!uq) {
+		upcall_queue_put(cq ? cq : tq);
+		return -ENOMEM;
+	}
+	TAILQ_INSERT_TAIL(&uq->tasks, tinfo, queue);
+	tinfo->uq = uq;
+	for (; uq; uq = uq->parent)
+		if (uq->queued++ == 0)
+			TAILQ_INSERT_TAIL(upcall_queue_siblings(uq), uq, ready);
+	if (++upcall_queued > upcall_queued_max)
+		upcall_queued_max = upcall_queued;
+	return 0;
+}
+
+/*
+ * Take TINFO off its queue, and move each queue above it to the back
+ * of its parent's, if it still has others waiting.  Called with the
+ * active_thread_list_lock held.
+ */
+static void
+upcall_queue_remove(struct upcall_thread_info *tinfo)
+{
+	struct upcall_queue *leaf = tinfo->uq, *uq;
+
+	TAILQ_REMOVE(&leaf->tasks, tinfo, queue);
+	for (uq = leaf; uq; uq = uq->parent) {
+		TAILQ_REMOVE(upcall_queue_siblings(uq), uq, ready);
+		if (--uq->queued)
+			TAILQ_INSERT_TAIL(upcall_queue_siblings(uq), uq,
+					  ready);
+	}
+	upcall_queued--;
+	tinfo->uq = NULL;
+}
+
+/*
+ * upcall_pool_drop - take an upcall that timed out off its queue
+ *
+ * Called by the watchdog, with the active_thread_list_lock held, for an
+ * upcall that no worker has taken yet.
+ */
+void
+upcall_pool_drop(struct upcall_thread_info *tinfo)
+{
+	struct upcall_queue *uq = tinfo->uq;
+
+	upcall_queue_remove(tinfo);
+	upcall_queue_put(uq);
+	gssd_stats_add(GSTAT_QUEUE, tinfo->queued, true);
+}
+
+static void *upcall_worker_fn(void *arg);
+
+/* Called with the active_thread_list_lock held */
+static void
+upcall_pool_fill(void)
+{
+	pthread_attr_t attr;
+	pthread_t th;
+	int ret;
+
+	if (upcall_workers >= upcall_threads)
+		return;
+	ret = pthread_attr_init(&attr);
+	if (ret != 0) {
+		printerr(0, "ERROR: failed to init pthread attr: ret %d: %s\n",
+			 ret, strerror(ret));
+		return;
+	}
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	while (upcall_workers < upcall_threads) {
+		ret = pthread_create(&th, &attr, upcall_worker_fn, NULL);
+		if (ret != 0) {
+			printerr(0, "ERROR: failed to start upcall worker: "
+				 "ret %d: %s\n", ret, strerror(ret));
+			break;
+		}
+		upcall_workers++;
+	}
+	pthread_attr_destroy(&attr);
+}
+
+/*
+ * Take the next upcall to run, from the first top directory and client
+ * not at their limits.  Called with the active_thread_list_lock held.
+ */
+static struct upcall_thread_info *
+upcall_pool_next(void)
+{
+	struct upcall_queue *tq, *cq, *uq;
+	struct upcall_thread_info *tinfo;
+
+	TAILQ_FOREACH(tq, &upcall_ready, ready) {
+		if (upcall_topdir_threads > 0 &&
+		    tq->running >= upcall_topdir_threads)
+			continue;
+		TAILQ_FOREACH(cq, &tq->children, ready)
+			if (upcall_client_threads <= 0 ||
+			    cq->running < upcall_client_threads)
+				goto found;
+	}
+	return NULL;
+found:
+	uq = TAILQ_FIRST(&cq->children);
+	tinfo = TAILQ_FIRST(&uq->tasks);
+	upcall_queue_remove(tinfo);
+	cq->running++;
+	tq->running++;
+	upcall_queue_put(uq);
+	tinfo->uq = cq;
+	gssd_stats_add(GSTAT_QUEUE, tinfo->queued, false);
+	tinfo->flags |= UPCALL_THREAD_RUNNING;
+	tinfo->tid = pthread_self();
+	return tinfo;
+}
+
+/* TINFO's upcall has finished.  Called with the active_thread_list_lock held */
+static void
+upcall_pool_done(struct upcall_thread_info *tinfo)
+{
+	struct upcall_queue *cq = tinfo->uq;
+
+	TAILQ_REMOVE(&active_thread_list, tinfo, list);
+	cq->running--;
+	cq->parent->running--;
+	upcall_queue_put(cq);
+	/* a worker held back by a limit may go on now */
+	if (upcall_queued)
+		pthread_cond_signal(&upcall_more);
+	free(tinfo);
+}
+
+/*
+ * The worker was canceled while running TINFO's upcall.  Its replacement
+ * starts with the identity it has, so it takes its own back first, and
+ * leaves the replacing to the next batch of upcalls if it can't.
+ */
+static void
+upcall_worker_canceled(void *arg)
+{
+	struct upcall_thread_info *tinfo = arg;
+	int err;
+
+	printerr(2, "watchdog: thread id 0x%lx cancelled successfully\n",
+		 tinfo->tid);
+	err = restore_identity();
+	pthread_mutex_lock(&active_thread_list_lock);
+	upcall_pool_done(tinfo);
+	upcall_workers--;
+	if (!err)
+		upcall_pool_fill();
+	pthread_mutex_unlock(&active_thread_list_lock);
+}
+
+/*
+ * Cancellation is only enabled while an upcall runs.  A cancel that
+ * comes too late to stop the upcall it was meant for is still pending
+ * when the upcall returns, so the worker leaves the pool rather than
+ * let the cancel stop the next upcall.  So does a worker that can't
+ * get its own identity back after an upcall run as a user.
+ */
+static void *
+upcall_worker_fn(void *UNUSED(arg))
+{
+	struct upcall_thread_info *tinfo;
+	unsigned long long start;
+	bool canceled;
+	int err;
+
+	nfsworker_start(-1);
+	upcall_worker = true;
+	upcall_worker_uid = geteuid();
+	upcall_worker_gid = getegid();
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+	pthread_mutex_lock(&active_thread_list_lock);
+	for (;;) {
+		while ((tinfo = upcall_pool_next()) == NULL)
+			pthread_cond_wait(&upcall_more, &active_thread_list_lock);
+		pthread_mutex_unlock(&active_thread_list_lock);
+
+		pthread_cleanup_push(upcall_worker_canceled, tinfo);
+		start = nfsworker_clock();
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+		tinfo->func(tinfo->info);
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+		pthread_cleanup_pop(0);
+		nfsworker_busy(start, 1);
+		err = restore_identity();
+
+		pthread_mutex_lock(&active_thread_list_lock);
+		canceled = tinfo->flags & UPCALL_THREAD_CANCELED;
+		upcall_pool_done(tinfo);
+		if (canceled || err) {
+			upcall_workers--;
+			if (!err)
+				upcall_pool_fill();
+			break;
+		}
+	}
+	pthread_mutex_unlock(&active_thread_list_lock);
+	return NULL;
+}
+
+/*
+ * Upcalls read from a pipe in one callback, to be queued for the workers
+ * together, under one taking of the active_thread_list_lock
+ */
+#define UPCALL_BATCH_MAX	32
+
+struct upcall_batch {
+	int			count;
+	struct clnt_upcall_info	*info[UPCALL_BATCH_MAX];
+};
+
+/* Queue the upcalls in BATCH for the pool, and answer those it can't take */
+static void
+queue_upcalls(struct upcall_batch *batch)
+{
+	struct upcall_thread_info *tinfo[UPCALL_BATCH_MAX];
+	struct clnt_upcall_info *info;
+	int i, queued = 0;
+
+	if (batch->count == 0)
+		return;
+	for (i = 0; i < batch->count; i++) {
+		tinfo[i] = alloc_upcall_thread_info();
+		if (!tinfo[i])
+			continue;
+		info = batch->info[i];
+		tinfo[i]->fd = info->fd;
+		tinfo[i]->uid = info->uid;
+		tinfo[i]->func = gssd_work_thread_fn;
+		tinfo[i]->info = info;
+		tinfo[i]->flags = UPCALL_THREAD_POOLED;
+	}
+
+	pthread_mutex_lock(&active_thread_list_lock);
+	upcall_pool_fill();
+	for (i = 0; i < batch->count; i++) {
+		if (!tinfo[i] || upcall_workers == 0 ||
+		    upcall_queue_add(tinfo[i], batch->info[i]->clp) < 0) {
+			free(tinfo[i]);
+			tinfo[i] = NULL;
+			continue;
+		}
+		tinfo[i]->queued = gssd_stats_clock();
+		clock_gettime(CLOCK_MONOTONIC, &tinfo[i]->timeout);
+		tinfo[i]->timeout.tv_sec += upcall_timeout;
+		TAILQ_INSERT_TAIL(&active_thread_list, tinfo[i], list);
+		queued++;
+	}
+	if (queued > 1)
+		pthread_cond_broadcast(&upcall_more);
+	else if (queued)
+		pthread_cond_signal(&upcall_more);
+	pthread_mutex_unlock(&active_thread_list_lock);
+
+	printerr(2, "queue_upcalls(0x%lx): queued %d of %d upcalls\n",
+		 pthread_self(), queued, batch->count);
+	for (i = 0; i < batch->count; i++) {
+		if (tinfo[i])
+			continue;
+		info = batch->info[i];
+		do_error_downcall(info->fd, info->uid, -EACCES);
+		free_upcall_info(info);
+	}
+	batch->count = 0;
+}
+
 static int
 start_upcall_thread(void (*func)(struct clnt_upcall_info *), struct clnt_upcall_info *info)
 {
@@ -920,39 +1664,100 @@ start_upcall_thread(void (*func)(struct clnt_upcall_info *), struct clnt_upcall_
 	return ret;
 }
 
-void
-handle_krb5_upcall(struct clnt_info *clp)
+/*
+ * Handle INFO's upcall.  With a pool of workers, it is added to BATCH, to be queued along with
+ * the other upcalls read in the same callback.  On error the caller
+ * answers for INFO itself.
+ */
+static int
+start_upcall(struct clnt_upcall_info *info, struct upcall_batch *batch)
+{
+	if (upcall_threads > 0) {
+		batch->info[batch->count++] = info;
+		if (batch->count == UPCALL_BATCH_MAX)
+			queue_upcalls(batch);
+		return 0;
+	}
+	return start_upcall_thread(gssd_work_thread_fn, info);
+}
+
+/*
+ * Upcalls read from one pipe before going back to the event loop.  The
+ * pipes are polled level-triggered, so the rest are read on the next
+ * pass, after the other pipes have had their turn.
+ */
+#define UPCALL_DRAIN_MAX	256
+
+/*
+ * Read the next message from FD, a non-blocking pipe, into BUF.
+ * Returns its length, 0 if there are no more, or -1 on error.
+ */
+static ssize_t
+read_upcall(int fd, void *buf, size_t size)
+{
+	ssize_t len;
+
+	do {
+		len = read(fd, buf, size);
+	} while (len < 0 && errno == EINTR);
+	if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		return 0;
+	if (len == 0)
+		errno = EPIPE;
+	return len > 0 ? len : -1;
+}
+
+static void
+handle_krb5_message(struct clnt_info *clp, uid_t uid,
+		    struct upcall_batch *batch)
 {
-	uid_t			uid;
 	struct clnt_upcall_info	*info;
 	int			err;
 
-	if (read(clp->krb5_fd, &uid, sizeof(uid)) < (ssize_t)sizeof(uid)) {
-		printerr(0, "WARNING: failed reading uid from krb5 "
-			    "upcall pipe: %s\n", strerror(errno));
-		return;
-	}
 	printerr(2, "\n%s: uid %d (%s)\n", __func__, uid, clp->relpath);
 
-	info = alloc_upcall_info(clp, uid, clp->krb5_fd, NULL, NULL, NULL);
+	info = alloc_upcall_info(clp, GSTAT_KRB5_UPCALL, uid, clp->krb5_fd,
+				 NULL, NULL, NULL);
 	if (info == NULL) {
 		printerr(0, "%s: failed to allocate clnt_upcall_info\n", __func__);
 		do_error_downcall(clp->krb5_fd, uid, -EACCES);
 		return;
 	}
-	err = start_upcall_thread(gssd_work_thread_fn, info);
+	err = start_upcall(info, batch);
 	if (err != 0) {
 		do_error_downcall(clp->krb5_fd, uid, -EACCES);
 		free_upcall_info(info);
 	}
 }
 
+/* Handle every upcall waiting on CLP's krb5 pipe */
 void
-handle_gssd_upcall(struct clnt_info *clp)
+handle_krb5_upcall(struct clnt_info *clp)
+{
+	struct upcall_batch	batch = { .count = 0 };
+	uid_t			uid;
+	ssize_t			len;
+	int			n;
+
+	for (n = 0; n < UPCALL_DRAIN_MAX; n++) {
+		len = read_upcall(clp->krb5_fd, &uid, sizeof(uid));
+		if (len == 0)
+			break;
+		if (len < (ssize_t)sizeof(uid)) {
+			printerr(0, "WARNING: failed reading uid from krb5 "
+				    "upcall pipe: %s\n", strerror(errno));
+			break;
+		}
+		handle_krb5_message(clp, uid, &batch);
+	}
+	queue_upcalls(&batch);
+}
+
+static void
+handle_gssd_message(struct clnt_info *clp, char *lbuf,
+		    struct upcall_batch *batch)
 {
 	uid_t			uid;
-	char			lbuf[RPC_CHAN_BUF_SIZE];
-	int			lbuflen = 0;
 	char			*p;
 	char			*mech = NULL;
 	char			*uidstr = NULL;
@@ -964,14 +1769,6 @@ handle_gssd_upcall(struct clnt_info *clp)
 	struct clnt_upcall_info	*info;
 	int			err;
 
-	lbuflen = read(clp->gssd_fd, lbuf, sizeof(lbuf));
-	if (lbuflen <= 0 || lbuf[lbuflen-1] != '\n') {
-		printerr(0, "WARNING: handle_gssd_upcall: "
-			    "failed reading request\n");
-		return;
-	}
-	lbuf[lbuflen-1] = 0;
-
 	printerr(2, "\n%s(0x%lx): '%s' (%s)\n", __func__, tid,
 		 lbuf, clp->relpath);
 
@@ -1010,10 +1807,16 @@ handle_gssd_upcall(struct clnt_info *clp)
 		return;
 	}
 
-	if (enctypes && parse_enctypes(enctypes) != 0) {
-		printerr(0, "WARNING: handle_gssd_upcall: "
-			 "parsing encryption types failed: errno %d\n", errno);
-		return;
+	if (enctypes && (!clp->enctypes ||
+			 strcmp(clp->enctypes->str, enctypes) != 0)) {
+		clp->enctypes = parse_enctypes(enctypes);
+		if (!clp->enctypes) {
+			printerr(0, "WARNING: handle_gssd_upcall: "
+				 "parsing encryption types failed: errno %d\n",
+				 errno);
+			return;
+		}
+		enctypes_last = clp->enctypes;
 	}
 
 	if (target && strlen(target) < 1) {
@@ -1039,13 +1842,14 @@ handle_gssd_upcall(struct clnt_info *clp)
 	}
 
 	if (strcmp(mech, "krb5") == 0 && clp->servername) {
-		info = alloc_upcall_info(clp, uid, clp->gssd_fd, srchost, target, service);
+		info = alloc_upcall_info(clp, GSTAT_GSSD_UPCALL, uid,
+					 clp->gssd_fd, srchost, target, service);
 		if (info == NULL) {
 			printerr(0, "%s: failed to allocate clnt_upcall_info\n", __func__);
 			do_error_downcall(clp->gssd_fd, uid, -EACCES);
 			return;
 		}
-		err = start_upcall_thread(gssd_work_thread_fn, info);
+		err = start_upcall(info, batch);
 		if (err != 0) {
 			do_error_downcall(clp->gssd_fd, uid, -EACCES);
 			free_upcall_info(info);
@@ -1057,3 +1861,27 @@ handle_gssd_upcall(struct clnt_info *clp)
 		do_error_downcall(clp->gssd_fd, uid, -EACCES);
 	}
 }
+
+/* Handle every upcall waiting on CLP's gssd pipe */
+void
+handle_gssd_upcall(struct clnt_info *clp)
+{
+	struct upcall_batch	batch = { .count = 0 };
+	char			lbuf[RPC_CHAN_BUF_SIZE];
+	ssize_t			lbuflen;
+	int			n;
+
+	for (n = 0; n < UPCALL_DRAIN_MAX; n++) {
+		lbuflen = read_upcall(clp->gssd_fd, lbuf, sizeof(lbuf));
+		if (lbuflen == 0)
+			break;
+		if (lbuflen < 0 || lbuf[lbuflen-1] != '\n') {
+			printerr(0, "WARNING: handle_gssd_upcall: "
+				    "failed reading request\n");
+			break;
+		}
+		lbuf[lbuflen-1] = 0;
+		handle_gssd_message(clp, lbuf, &batch);
+	}
+	queue_upcalls(&batch);
+}
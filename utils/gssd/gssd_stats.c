@@ -0,0 +1,170 @@
+/*
+ * utils/gssd/gssd_stats.c
+ *
+ * Statistics about the upcalls rpc.gssd handles, and about the work
+ * they wait for: a worker to run them, the connection to the server,
+ * the KDC, context negotiation and the credentials cache search.
+ *
+ * Each entry counts calls, the calls that failed, and their latency
+ * in a histogram of power-of-two buckets, from which percentiles are
+ * estimated when the statistics are logged.  Counters are updated with
+ * relaxed atomic operations, so upcall threads can keep them without
+ * taking a lock; the log shows each counter exact, but not all of them
+ * from the same instant.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "gssd.h"
+#include "err_util.h"
+
+#define GSSD_STAT_BUCKETS	24	/* < 1us ... < 2^22us, and the rest */
+
+struct gssd_stat {
+	const char *		gs_name;
+	unsigned long		gs_calls;
+	unsigned long		gs_failed;
+	unsigned long		gs_usecs;
+	unsigned long		gs_max;
+	unsigned long		gs_hist[GSSD_STAT_BUCKETS];
+};
+
+static struct gssd_stat gssd_stats[GSTAT_MAX] = {
+	[GSTAT_KRB5_UPCALL]	= { .gs_name = "krb5 upcall" },
+	[GSTAT_GSSD_UPCALL]	= { .gs_name = "gssd upcall" },
+	[GSTAT_QUEUE]		= { .gs_name = "queue wait" },
+	[GSTAT_CONNECT]		= { .gs_name = "connect" },
+	[GSTAT_KDC]		= { .gs_name = "kdc" },
+	[GSTAT_NEGOTIATE]	= { .gs_name = "negotiate" },
+	[GSTAT_CCACHE]		= { .gs_name = "ccache search" },
+};
+
+static unsigned long gssd_counters[GCOUNT_MAX];
+
+#define gssd_stat_inc(p, n)	__atomic_fetch_add((p), (n), __ATOMIC_RELAXED)
+#define gssd_stat_get(p)	__atomic_load_n((p), __ATOMIC_RELAXED)
+
+/* Seconds between statistics log lines; zero means only on SIGUSR1 */
+int stats_interval;
+
+/* Returns a monotonic time stamp, in microseconds, for gssd_stats_add() */
+unsigned long long
+gssd_stats_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/* Count one call of ID that started at START, and failed if FAILED */
+void
+gssd_stats_add(enum gssd_stat_id id, unsigned long long start, bool failed)
+{
+	struct gssd_stat *gs = &gssd_stats[id];
+	unsigned long usecs = gssd_stats_clock() - start;
+	unsigned long max;
+	int bucket;
+
+	bucket = usecs ? 64 - __builtin_clzll(usecs) : 0;
+	if (bucket >= GSSD_STAT_BUCKETS)
+		bucket = GSSD_STAT_BUCKETS - 1;
+
+	gssd_stat_inc(&gs->gs_calls, 1);
+	if (failed)
+		gssd_stat_inc(&gs->gs_failed, 1);
+	gssd_stat_inc(&gs->gs_usecs, usecs);
+	gssd_stat_inc(&gs->gs_hist[bucket], 1);
+	max = gssd_stat_get(&gs->gs_max);
+	while (usecs > max &&
+	       !__atomic_compare_exchange_n(&gs->gs_max, &max, usecs, 1,
+					    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+
+	/* Waits on the KDC and the server also count against the upcall */
+	switch (id) {
+	case GSTAT_KDC:
+		nfstrace_dep(NFSTRACE_KDC, usecs);
+		break;
+	case GSTAT_CONNECT:
+	case GSTAT_NEGOTIATE:
+		nfstrace_dep(NFSTRACE_SERVER, usecs);
+		break;
+	default:
+		break;
+	}
+}
+
+void
+gssd_stats_count(enum gssd_counter_id id)
+{
+	gssd_stat_inc(&gssd_counters[id], 1);
+}
+
+/*
+ * The latency under which a fraction PCT/100 of the calls in HIST
+ * completed, give or take a bucket: the upper bound of the bucket
+ * holding the call at that rank, but no more than MAX.
+ */
+static unsigned long
+gssd_stats_percentile(const unsigned long *hist, unsigned long calls,
+		      unsigned long max, unsigned int pct)
+{
+	unsigned long rank = (calls * pct + 99) / 100, seen = 0;
+	int i;
+
+	for (i = 0; i < GSSD_STAT_BUCKETS - 1; i++) {
+		seen += hist[i];
+		if (seen >= rank)
+			break;
+	}
+	if (i == GSSD_STAT_BUCKETS - 1 || (1UL << i) > max)
+		return max;
+	return 1UL << i;
+}
+
+/**
+ * gssd_stats_report - log the statistics
+ */
+void
+gssd_stats_report(void)
+{
+	unsigned long hist[GSSD_STAT_BUCKETS];
+	unsigned long calls, usecs, max;
+	struct gssd_stat *gs;
+	int i, j;
+
+	for (i = 0; i < GSTAT_MAX; i++) {
+		gs = &gssd_stats[i];
+		calls = gssd_stat_get(&gs->gs_calls);
+		if (calls == 0)
+			continue;
+		usecs = gssd_stat_get(&gs->gs_usecs);
+		max = gssd_stat_get(&gs->gs_max);
+		for (j = 0; j < GSSD_STAT_BUCKETS; j++)
+			hist[j] = gssd_stat_get(&gs->gs_hist[j]);
+		printerr(0, "%s: %lu calls, %lu failed, avg %luus, "
+			 "p50 %luus, p90 %luus, p99 %luus, max %luus\n",
+			 gs->gs_name, calls, gssd_stat_get(&gs->gs_failed),
+			 usecs / calls,
+			 gssd_stats_percentile(hist, calls, max, 50),
+			 gssd_stats_percentile(hist, calls, max, 90),
+			 gssd_stats_percentile(hist, calls, max, 99), max);
+	}
+	printerr(0, "upcalls: %lu for users, %lu with machine credentials; "
+		 "%lu timed out, %lu canceled by the watchdog\n",
+		 gssd_stat_get(&gssd_counters[GCOUNT_USER]),
+		 gssd_stat_get(&gssd_counters[GCOUNT_MACHINE]),
+		 gssd_stat_get(&gssd_counters[GCOUNT_TIMEOUT]),
+		 gssd_stat_get(&gssd_counters[GCOUNT_CANCEL]));
+	printerr(0, "credentials caches: %lu found without a search\n",
+		 gssd_stat_get(&gssd_counters[GCOUNT_CCACHE_HIT]));
+}
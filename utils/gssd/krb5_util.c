@@ -122,7 +122,9 @@
 #include <rpc/auth_gss.h>
 
 #include <sys/types.h>
+#include <sys/inotify.h>
 #include <fcntl.h>
+#include <stdint.h>
 
 #include "nfslib.h"
 #include "gssd.h"
@@ -145,6 +147,8 @@ struct gssd_k5_kt_princ {
 	// Modified during usage by gssd_get_single_krb5_cred()
 	char *ccname;
 	krb5_timestamp endtime;
+	// When the background refresher is to renew the credentials
+	time_t refresh;
 };
 
 
@@ -162,12 +166,13 @@ int limit_to_legacy_enctypes = 0;
 /*==========================*/
 
 static int select_krb5_ccache(const struct dirent *d);
-static int gssd_find_existing_krb5_ccache(uid_t uid, char *dirname,
-		const char **cctype, struct dirent **d);
+static int gssd_find_existing_krb5_ccache(uid_t uid, char *dirname, int indexed,
+		const char **cctype, struct dirent **d, struct stat *st,
+		time_t *endtime);
 static int gssd_get_single_krb5_cred(krb5_context context,
-		krb5_keytab kt, struct gssd_k5_kt_princ *ple);
+		krb5_keytab kt, struct gssd_k5_kt_princ *ple, int force);
 static int query_krb5_ccache(const char* cred_cache, char **ret_princname,
-		char **ret_realm);
+		char **ret_realm, time_t *ret_endtime);
 
 static void release_ple_locked(krb5_context context,
 			       struct gssd_k5_kt_princ *ple)
@@ -190,6 +195,236 @@ static void release_ple(krb5_context context, struct gssd_k5_kt_princ *ple)
 	pthread_mutex_unlock(&ple_lock);
 }
 
+/*
+ * Pool of krb5 contexts.  Setting one up parses the Kerberos
+ * configuration and loads plugins, which is far more work than most
+ * of the calls an upcall makes with it, so upcall threads borrow a
+ * context from here and hand it back when done.  Whether krb5.conf,
+ * or anything it includes, has changed is checked at most once a
+ * second; contexts made before a change are freed rather than reused.
+ */
+#define K5_POOL_MAX		16
+#define K5_CONFIG_DEPTH		4	/* levels of include followed */
+
+struct k5_pooled {
+	struct k5_pooled	*next;
+	krb5_context		context;
+	unsigned int		generation;	/* of the configuration */
+};
+
+static struct k5_pooled *k5_idle;		/* to be lent */
+static struct k5_pooled *k5_lent;
+static unsigned int k5_idle_count;
+static unsigned int k5_generation;
+static uint64_t k5_config_sig;
+static time_t k5_config_checked;
+static pthread_mutex_t k5_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void k5_sig_mix(uint64_t *sig, uint64_t val)
+{
+	*sig = (*sig ^ val) * 1099511628211ULL;
+}
+
+static void k5_stamp_path(const char *path, int depth, uint64_t *sig);
+
+static void k5_stamp_includes(const char *path, int depth, uint64_t *sig)
+{
+	char line[PATH_MAX + 16], *p, *end;
+	FILE *fp;
+
+	fp = fopen(path, "r");
+	if (fp == NULL)
+		return;
+	while (fgets(line, sizeof(line), fp)) {
+		p = line + strspn(line, " \t");
+		if (strncmp(p, "include", 7) != 0)
+			continue;
+		p += 7;
+		if (strncmp(p, "dir", 3) == 0)
+			p += 3;
+		if (*p != ' ' && *p != '\t')
+			continue;
+		p += strspn(p, " \t");
+		for (end = p + strlen(p); end > p && isspace((unsigned char)end[-1]);
+		     end--)
+			;
+		*end = '\0';
+		if (*p)
+			k5_stamp_path(p, depth + 1, sig);
+	}
+	fclose(fp);
+}
+
+/* Mix into *sig whatever would show that @path has changed */
+static void k5_stamp_path(const char *path, int depth, uint64_t *sig)
+{
+	char child[PATH_MAX];
+	struct dirent *d;
+	struct stat st;
+	DIR *dir;
+
+	if (stat(path, &st) != 0) {
+		k5_sig_mix(sig, errno);
+		return;
+	}
+	k5_sig_mix(sig, st.st_dev);
+	k5_sig_mix(sig, st.st_ino);
+	k5_sig_mix(sig, st.st_size);
+	k5_sig_mix(sig, st.st_mtim.tv_sec);
+	k5_sig_mix(sig, st.st_mtim.tv_nsec);
+	if (depth >= K5_CONFIG_DEPTH)
+		return;
+
+	if (!S_ISDIR(st.st_mode)) {
+		k5_stamp_includes(path, depth, sig);
+		return;
+	}
+	dir = opendir(path);
+	if (dir == NULL)
+		return;
+	while ((d = readdir(dir)) != NULL) {
+		if (d->d_name[0] == '.')
+			continue;
+		if ((size_t)snprintf(child, sizeof(child), "%s/%s", path,
+				     d->d_name) < sizeof(child))
+			k5_stamp_path(child, depth + 1, sig);
+	}
+	closedir(dir);
+}
+
+/* Called with k5_pool_lock held */
+static void k5_check_config(void)
+{
+	uint64_t sig = 14695981039346656037ULL;
+	const char *files;
+	char *copy, *file, *next;
+	time_t now = time(NULL);
+
+	if (k5_config_checked == now)
+		return;
+	k5_config_checked = now;
+
+	/* both MIT and Heimdal read the files named here instead */
+	files = getenv("KRB5_CONFIG");
+	copy = strdup(files ? files : "/etc/krb5.conf");
+	if (copy == NULL)
+		return;
+	for (file = copy; file; file = next) {
+		next = strchr(file, ':');
+		if (next)
+			*next++ = '\0';
+		if (*file)
+			k5_stamp_path(file, 0, &sig);
+	}
+	free(copy);
+
+	if (sig != k5_config_sig) {
+		if (k5_config_sig)
+			printerr(2, "Kerberos configuration changed\n");
+		k5_config_sig = sig;
+		k5_generation++;
+	}
+}
+
+static void k5_free_list(struct k5_pooled *list)
+{
+	struct k5_pooled *next;
+
+	for (; list; list = next) {
+		next = list->next;
+		krb5_free_context(list->context);
+		free(list);
+	}
+}
+
+/*
+ * Borrow a krb5 context, to be handed back with gssd_k5_put_context().
+ * Returns zero, or the error from krb5_init_context().
+ */
+krb5_error_code
+gssd_k5_get_context(krb5_context *context)
+{
+	struct k5_pooled *p, *stale = NULL;
+	unsigned int generation;
+	krb5_error_code code;
+
+	pthread_mutex_lock(&k5_pool_lock);
+	k5_check_config();
+	generation = k5_generation;
+	while ((p = k5_idle) != NULL) {
+		k5_idle = p->next;
+		k5_idle_count--;
+		if (p->generation == generation)
+			break;
+		p->next = stale;
+		stale = p;
+	}
+	if (p) {
+		p->next = k5_lent;
+		k5_lent = p;
+	}
+	pthread_mutex_unlock(&k5_pool_lock);
+	k5_free_list(stale);
+	if (p) {
+		*context = p->context;
+		return 0;
+	}
+
+	code = krb5_init_context(context);
+	if (code) {
+		*context = NULL;
+		return code;
+	}
+	/* without a record of it, the context is freed when handed back */
+	p = malloc(sizeof(*p));
+	if (p) {
+		p->context = *context;
+		p->generation = generation;
+		pthread_mutex_lock(&k5_pool_lock);
+		p->next = k5_lent;
+		k5_lent = p;
+		pthread_mutex_unlock(&k5_pool_lock);
+	}
+	return 0;
+}
+
+/*
+ * Hand back a context from gssd_k5_get_context().  The caller must
+ * have freed whatever it made with the context.
+ */
+void
+gssd_k5_put_context(krb5_context context)
+{
+	struct k5_pooled **pp, *p;
+
+	if (context == NULL)
+		return;
+
+	pthread_mutex_lock(&k5_pool_lock);
+	for (pp = &k5_lent; (p = *pp) != NULL; pp = &p->next)
+		if (p->context == context)
+			break;
+	if (p) {
+		*pp = p->next;
+		p->next = NULL;
+		k5_check_config();
+		if (p->generation == k5_generation &&
+		    k5_idle_count < K5_POOL_MAX) {
+			p->next = k5_idle;
+			k5_idle = p;
+			k5_idle_count++;
+			p = NULL;
+			context = NULL;
+		}
+	}
+	pthread_mutex_unlock(&k5_pool_lock);
+
+	if (p)
+		k5_free_list(p);
+	else if (context)
+		krb5_free_context(context);
+}
+
 
 /*
  * Called from the scandir function to weed out potential krb5
@@ -220,12 +455,310 @@ select_krb5_ccache(const struct dirent *d)
  * Returns 0 if a valid-looking entry is found.  "*cctype" is
  * set to the name of the cache type.  A pointer to the dirent
  * is planted in "*d".  Caller must free "*d" with free(3).
+ * The entry's stat is returned in "*st", and the end time of
+ * its TGT in "*endtime".
  *
  * Otherwise, a negative errno is returned.
  */
+/*
+ * Index of the credentials caches in the directories searched for
+ * them, by owner.  A directory such as /tmp, shared by all users, can
+ * hold a great many files, and scanning it and looking at each cache
+ * in it for every user upcall is slow.  Instead, the directory is
+ * scanned once and then watched with inotify, so that the candidates
+ * for a uid can be picked out of the index.  Pending events are read
+ * before each lookup, so the index is current whenever it is used.
+ *
+ * Directories whose names are made with %U are per user, and are not
+ * indexed: scanning them is cheap, and watching them all wouldn't be.
+ */
+struct ccache_ent {
+	struct ccache_ent	*nnext;		/* by name */
+	struct ccache_ent	*unext;		/* by uid */
+	uint32_t		nhash;
+	uid_t			uid;
+	char			name[];
+};
+
+struct ccache_dir {
+	struct ccache_dir	*next;
+	char			*path;
+	int			wd;
+	int			valid;		/* scanned, and watched since */
+	struct ccache_ent	**byname, **byuid;
+	unsigned int		size, count;
+};
+
+#define CCACHE_HASH_INIT	64		/* initial buckets, a power of 2 */
+
+static struct ccache_dir *ccache_dirs;
+static int ccache_ifd = -2;			/* -2 before the first try */
+static pthread_mutex_t ccache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* FNV-1a */
+static uint32_t
+ccache_hash(const char *s)
+{
+	uint32_t h = 2166136261u;
+
+	for (; *s; s++)
+		h = (h ^ (unsigned char)*s) * 16777619u;
+	return h;
+}
+
+static void
+ccache_dir_clear(struct ccache_dir *cd)
+{
+	struct ccache_ent *ce, *next;
+	unsigned int i;
+
+	for (i = 0; i < cd->size; i++)
+		for (ce = cd->byname[i]; ce; ce = next) {
+			next = ce->nnext;
+			free(ce);
+		}
+	free(cd->byname);
+	free(cd->byuid);
+	cd->byname = cd->byuid = NULL;
+	cd->size = cd->count = 0;
+	cd->valid = 0;
+}
+
+static int
+ccache_dir_grow(struct ccache_dir *cd)
+{
+	unsigned int size = cd->size ? cd->size * 2 : CCACHE_HASH_INIT;
+	struct ccache_ent **byname, **byuid, *ce, *next;
+	unsigned int i;
+
+	byname = calloc(size, sizeof(*byname));
+	byuid = calloc(size, sizeof(*byuid));
+	if (!byname || !byuid) {
+		free(byname);
+		free(byuid);
+		return -1;
+	}
+	for (i = 0; i < cd->size; i++)
+		for (ce = cd->byname[i]; ce; ce = next) {
+			next = ce->nnext;
+			ce->nnext = byname[ce->nhash & (size - 1)];
+			byname[ce->nhash & (size - 1)] = ce;
+			ce->unext = byuid[ce->uid & (size - 1)];
+			byuid[ce->uid & (size - 1)] = ce;
+		}
+	free(cd->byname);
+	free(cd->byuid);
+	cd->byname = byname;
+	cd->byuid = byuid;
+	cd->size = size;
+	return 0;
+}
+
+static void
+ccache_dir_remove(struct ccache_dir *cd, const char *name)
+{
+	uint32_t nhash = ccache_hash(name);
+	struct ccache_ent **cep, *ce;
+
+	if (!cd->size)
+		return;
+	for (cep = &cd->byname[nhash & (cd->size - 1)]; (ce = *cep) != NULL;
+	     cep = &ce->nnext)
+		if (ce->nhash == nhash && strcmp(ce->name, name) == 0)
+			break;
+	if (!ce)
+		return;
+	*cep = ce->nnext;
+	for (cep = &cd->byuid[ce->uid & (cd->size - 1)]; *cep != ce;
+	     cep = &(*cep)->unext)
+		;
+	*cep = ce->unext;
+	cd->count--;
+	free(ce);
+}
+
+/* Record NAME in CD if it is a candidate, as select_krb5_ccache() has it */
+static int
+ccache_dir_update(struct ccache_dir *cd, const char *name)
+{
+	char buf[PATH_MAX];
+	struct ccache_ent *ce;
+	struct stat st;
+	size_t len;
+
+	ccache_dir_remove(cd, name);
+	snprintf(buf, sizeof(buf), "%s/%s", cd->path, name);
+	if (lstat(buf, &st) != 0 ||
+	    (!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode)))
+		return 0;
+	if (cd->count >= cd->size && ccache_dir_grow(cd) < 0)
+		return -1;
+	len = strlen(name);
+	ce = malloc(sizeof(*ce) + len + 1);
+	if (!ce)
+		return -1;
+	memcpy(ce->name, name, len + 1);
+	ce->nhash = ccache_hash(name);
+	ce->uid = st.st_uid;
+	ce->nnext = cd->byname[ce->nhash & (cd->size - 1)];
+	cd->byname[ce->nhash & (cd->size - 1)] = ce;
+	ce->unext = cd->byuid[ce->uid & (cd->size - 1)];
+	cd->byuid[ce->uid & (cd->size - 1)] = ce;
+	cd->count++;
+	return 0;
+}
+
+static void
+ccache_dir_scan(struct ccache_dir *cd)
+{
+	struct dirent *d;
+	DIR *dir;
+
+	if (cd->wd < 0) {
+		cd->wd = inotify_add_watch(ccache_ifd, cd->path,
+					   IN_CREATE | IN_DELETE | IN_MOVED_FROM |
+					   IN_MOVED_TO | IN_ATTRIB | IN_ONLYDIR);
+		if (cd->wd < 0) {
+			printerr(2, "Not indexing credentials caches in '%s': "
+				 "%s\n", cd->path, strerror(errno));
+			return;
+		}
+	}
+	dir = opendir(cd->path);
+	if (!dir)
+		return;
+	while ((d = readdir(dir)) != NULL) {
+		if (!select_krb5_ccache(d))
+			continue;
+		if (ccache_dir_update(cd, d->d_name) < 0) {
+			closedir(dir);
+			ccache_dir_clear(cd);
+			return;
+		}
+	}
+	closedir(dir);
+	cd->valid = 1;
+	printerr(2, "indexed %u credentials caches in '%s'\n",
+		 cd->count, cd->path);
+}
+
+/* Called with ccache_lock held */
+static void
+ccache_read_events(void)
+{
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *ev;
+	struct ccache_dir *cd;
+	ssize_t len;
+	char *ptr;
+
+	while ((len = read(ccache_ifd, buf, sizeof(buf))) > 0) {
+		for (ptr = buf; ptr < buf + len;
+		     ptr += sizeof(struct inotify_event) + ev->len) {
+			ev = (const struct inotify_event *)ptr;
+			if (ev->mask & IN_Q_OVERFLOW) {
+				/* events were lost: start over */
+				for (cd = ccache_dirs; cd; cd = cd->next)
+					ccache_dir_clear(cd);
+				continue;
+			}
+			for (cd = ccache_dirs; cd; cd = cd->next)
+				if (cd->wd == ev->wd)
+					break;
+			if (!cd)
+				continue;
+			if (ev->mask & IN_IGNORED) {
+				/* the directory is gone */
+				ccache_dir_clear(cd);
+				cd->wd = -1;
+				continue;
+			}
+			if (!cd->valid || !ev->len ||
+			    !strstr(ev->name, GSSD_DEFAULT_CRED_PREFIX))
+				continue;
+			if (ev->mask & (IN_DELETE | IN_MOVED_FROM))
+				ccache_dir_remove(cd, ev->name);
+			else if (ccache_dir_update(cd, ev->name) < 0)
+				ccache_dir_clear(cd);
+		}
+	}
+}
+
+/*
+ * Look up the candidate caches owned by UID in DIRNAME in the index,
+ * in the form scandir() would return them.  Returns their number, or
+ * -1 if DIRNAME isn't indexed.
+ */
+static int
+ccache_index_lookup(uid_t uid, const char *dirname, struct dirent ***namelist)
+{
+	struct dirent **list = NULL, **nlist;
+	struct ccache_ent *ce;
+	struct ccache_dir *cd;
+	int n = 0;
+
+	pthread_mutex_lock(&ccache_lock);
+	if (ccache_ifd == -2) {
+		ccache_ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		if (ccache_ifd < 0)
+			printerr(1, "Not indexing credentials caches: %s\n",
+				 strerror(errno));
+	}
+	if (ccache_ifd < 0)
+		goto out_unindexed;
+	ccache_read_events();
+
+	for (cd = ccache_dirs; cd; cd = cd->next)
+		if (strcmp(cd->path, dirname) == 0)
+			break;
+	if (!cd) {
+		cd = calloc(1, sizeof(*cd));
+		if (!cd)
+			goto out_unindexed;
+		cd->path = strdup(dirname);
+		if (!cd->path) {
+			free(cd);
+			goto out_unindexed;
+		}
+		cd->wd = -1;
+		cd->next = ccache_dirs;
+		ccache_dirs = cd;
+	}
+	if (!cd->valid)
+		ccache_dir_scan(cd);
+	if (!cd->valid)
+		goto out_unindexed;
+
+	for (ce = cd->byuid[uid & (cd->size - 1)]; ce; ce = ce->unext) {
+		if (ce->uid != uid)
+			continue;
+		nlist = realloc(list, (n + 1) * sizeof(*list));
+		if (!nlist)
+			goto out_free;
+		list = nlist;
+		list[n] = calloc(1, sizeof(struct dirent));
+		if (!list[n])
+			goto out_free;
+		strncpy(list[n]->d_name, ce->name, sizeof(list[n]->d_name) - 1);
+		n++;
+	}
+	pthread_mutex_unlock(&ccache_lock);
+	*namelist = list;
+	return n;
+
+out_free:
+	while (n > 0)
+		free(list[--n]);
+	free(list);
+out_unindexed:
+	pthread_mutex_unlock(&ccache_lock);
+	return -1;
+}
+
 static int
-gssd_find_existing_krb5_ccache(uid_t uid, char *dirname,
-			       const char **cctype, struct dirent **d)
+gssd_find_existing_krb5_ccache(uid_t uid, char *dirname, int indexed,
+			       const char **cctype, struct dirent **d,
+			       struct stat *st, time_t *endtime)
 {
 	struct dirent **namelist;
 	int n;
@@ -237,12 +770,21 @@ gssd_find_existing_krb5_ccache(uid_t uid, char *dirname,
 	char buf[PATH_MAX+5+256+1];
 	char *princname = NULL;
 	char *realm = NULL;
+	const char *best_match_type = NULL;
+	time_t tgt_end, best_match_end = 0;
 	int score, best_match_score = 0, err = -EACCES;
 
 	memset(&best_match_stat, 0, sizeof(best_match_stat));
 	*cctype = NULL;
 	*d = NULL;
-	n = scandir(dirname, &namelist, select_krb5_ccache, 0);
+	n = indexed ? ccache_index_lookup(uid, dirname, &namelist) : -1;
+	if (n == 0) {
+		/* nothing in the index: check the directory itself */
+		free(namelist);
+		n = -1;
+	}
+	if (n < 0)
+		n = scandir(dirname, &namelist, select_krb5_ccache, 0);
 	if (n < 0) {
 		printerr(1, "Error doing scandir on directory '%s': %s\n",
 			dirname, strerror(errno));
@@ -290,7 +832,8 @@ gssd_find_existing_krb5_ccache(uid_t uid, char *dirname,
 			}
 			snprintf(buf, sizeof(buf), "%s:%s/%s", *cctype,
 				 dirname, namelist[i]->d_name);
-			if (!query_krb5_ccache(buf, &princname, &realm)) {
+			if (!query_krb5_ccache(buf, &princname, &realm,
+					       &tgt_end)) {
 				printerr(3, "CC '%s' is expired or corrupt\n",
 					 buf);
 				free(namelist[i]);
@@ -316,6 +859,8 @@ gssd_find_existing_krb5_ccache(uid_t uid, char *dirname,
 				best_match_dir = namelist[i];
 				best_match_stat = tmp_stat;
 				best_match_score = score;
+				best_match_type = *cctype;
+				best_match_end = tgt_end;
 				found++;
 			}
 			else {
@@ -335,6 +880,8 @@ gssd_find_existing_krb5_ccache(uid_t uid, char *dirname,
 					best_match_dir = namelist[i];
 					best_match_stat = tmp_stat;
 					best_match_score = score;
+					best_match_type = *cctype;
+					best_match_end = tgt_end;
 				}
 				else {
 					free(namelist[i]);
@@ -352,13 +899,25 @@ gssd_find_existing_krb5_ccache(uid_t uid, char *dirname,
 		free(namelist);
 	}
 	if (found) {
+		*cctype = best_match_type;
 		*d = best_match_dir;
+		*st = best_match_stat;
+		*endtime = best_match_end;
 		return 0;
 	}
 
 	return err;
 }
 
+/* The file machine credentials for ple are kept in, if not in memory */
+static void
+gssd_machine_cc_path(struct gssd_k5_kt_princ *ple, char *buf, size_t size)
+{
+	snprintf(buf, size, "%s/%s%s_%s",
+		ccachesearch[0], GSSD_DEFAULT_CRED_PREFIX,
+		GSSD_DEFAULT_MACHINE_CRED_SUFFIX, ple->realm);
+}
+
 /* check if the ticket cache exists, if not set nocache=1 so that new
  * tgt is gotten
  */
@@ -368,9 +927,7 @@ gssd_check_if_cc_exists(struct gssd_k5_kt_princ *ple)
 	int fd;
 	char cc_name[BUFSIZ];
 
-	snprintf(cc_name, sizeof(cc_name), "%s/%s%s_%s",
-		ccachesearch[0], GSSD_DEFAULT_CRED_PREFIX,
-		GSSD_DEFAULT_MACHINE_CRED_SUFFIX, ple->realm);
+	gssd_machine_cc_path(ple, cc_name, sizeof(cc_name));
 	fd = open(cc_name, O_RDONLY);
 	if (fd < 0)
 		return 1;
@@ -378,11 +935,65 @@ gssd_check_if_cc_exists(struct gssd_k5_kt_princ *ple)
 	return 0;
 }
 
+/*
+ * With machine credentials kept in memory, write a copy to the file
+ * they would otherwise be kept in, for programs other than rpc.gssd
+ * that look for them there.  The copy is written aside and renamed
+ * into place, so that it is never seen half written.
+ */
+static void
+gssd_write_machine_cc_file(krb5_context context,
+			   struct gssd_k5_kt_princ *ple, krb5_creds *creds)
+{
+	char path[BUFSIZ], tmp[BUFSIZ + 8], cc_name[BUFSIZ + 16];
+	krb5_ccache ccache;
+	char *k5err = NULL;
+	int code, fd;
+
+	gssd_machine_cc_path(ple, path, sizeof(path));
+	snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+	fd = mkstemp(tmp);
+	if (fd < 0) {
+		printerr(0, "WARNING: unable to create '%s': %s\n", tmp,
+			 strerror(errno));
+		return;
+	}
+	close(fd);
+
+	snprintf(cc_name, sizeof(cc_name), "FILE:%s", tmp);
+	if ((code = krb5_cc_resolve(context, cc_name, &ccache)))
+		goto out_err;
+	code = krb5_cc_initialize(context, ccache, ple->princ);
+	if (code == 0)
+		code = krb5_cc_store_cred(context, ccache, creds);
+	krb5_cc_close(context, ccache);
+	if (code)
+		goto out_err;
+
+	if (rename(tmp, path) != 0) {
+		printerr(0, "WARNING: unable to rename '%s' to '%s': %s\n",
+			 tmp, path, strerror(errno));
+		unlink(tmp);
+		return;
+	}
+	printerr(3, "%s: wrote copy of machine credentials to '%s'\n",
+		 __func__, path);
+	return;
+
+out_err:
+	k5err = gssd_k5_err_msg(context, code);
+	printerr(0, "WARNING: %s while writing machine credentials to '%s'\n",
+		 k5err, tmp);
+	free(k5err);
+	unlink(tmp);
+}
+
 /*
  * Obtain credentials via a key in the keytab given
  * a keytab handle and a gssd_k5_kt_princ structure.
  * Checks to see if current credentials are expired,
  * if not, uses the keytab to obtain new credentials.
+ * With force set, new credentials are obtained regardless.
  *
  * Returns:
  *	0 => success (or credentials have not expired)
@@ -391,7 +1002,8 @@ gssd_check_if_cc_exists(struct gssd_k5_kt_princ *ple)
 static int
 gssd_get_single_krb5_cred(krb5_context context,
 			  krb5_keytab kt,
-			  struct gssd_k5_kt_princ *ple)
+			  struct gssd_k5_kt_princ *ple,
+			  int force)
 {
 #ifdef HAVE_KRB5_GET_INIT_CREDS_OPT_SET_ADDRESSLESS
 	krb5_get_init_creds_opt *init_opts = NULL;
@@ -408,12 +1020,14 @@ gssd_get_single_krb5_cred(krb5_context context,
 	char *cache_type;
 	char *pname = NULL;
 	char *k5err = NULL;
-	int nocache = 0;
+	int nocache = force;
+	krb5_timestamp start;
+	unsigned long long kdc_start;
 	pthread_t tid = pthread_self();
 
 	memset(&my_creds, 0, sizeof(my_creds));
 
-	if (!use_memcache)
+	if (!use_memcache && !nocache)
 		nocache = gssd_check_if_cc_exists(ple);
 	/*
 	 * Workaround for clock skew among NFS server, NFS client and KDC
@@ -468,8 +1082,11 @@ gssd_get_single_krb5_cred(krb5_context context,
 	opts = &options;
 #endif
 
-	if ((code = krb5_get_init_creds_keytab(context, &my_creds, ple->princ,
-					       kt, 0, NULL, opts))) {
+	kdc_start = gssd_stats_clock();
+	code = krb5_get_init_creds_keytab(context, &my_creds, ple->princ,
+					  kt, 0, NULL, opts);
+	gssd_stats_add(GSTAT_KDC, kdc_start, code != 0);
+	if (code) {
 		k5err = gssd_k5_err_msg(context, code);
 		printerr(1, "WARNING: %s while getting initial ticket for "
 			 "principal '%s' using keytab '%s'\n", k5err,
@@ -491,6 +1108,12 @@ gssd_get_single_krb5_cred(krb5_context context,
 		ccachesearch[0], GSSD_DEFAULT_CRED_PREFIX,
 		GSSD_DEFAULT_MACHINE_CRED_SUFFIX, ple->realm);
 	ple->endtime = my_creds.times.endtime;
+	start = my_creds.times.starttime ? my_creds.times.starttime :
+					   my_creds.times.authtime;
+	ple->refresh = 0;
+	if (machine_cred_refresh > 0 && machine_cred_refresh < 100)
+		ple->refresh = start + (time_t)(ple->endtime - start) *
+					machine_cred_refresh / 100;
 	if (ple->ccname == NULL || strcmp(ple->ccname, cc_name) != 0) {
 		free(ple->ccname);
 		ple->ccname = strdup(cc_name);
@@ -522,6 +1145,9 @@ gssd_get_single_krb5_cred(krb5_context context,
 		goto out;
 	}
 
+	if (use_memcache && machine_cred_file)
+		gssd_write_machine_cc_file(context, ple, &my_creds);
+
 	code = 0;
 	printerr(2, "%s(0x%lx): principal '%s' ccache:'%s'\n", 
 		__func__, tid, pname, cc_name);
@@ -836,6 +1462,214 @@ gssd_search_krb5_keytab(krb5_context context, krb5_keytab kt,
 	return retval;
 }
 
+/*
+ * Cache of the principals find_keytab_entry() has picked, by the
+ * names it was given.  Picking one takes DNS lookups for the target
+ * and local hostnames and, often, several passes over the keytab; a
+ * cached choice takes a single lookup of that principal.  The cache is
+ * emptied whenever the keytab changes, and entries expire, since the
+ * DNS answers they were made from can change too.
+ */
+struct kt_choice {
+	struct kt_choice	*next;
+	uint32_t		hash;
+	time_t			expires;
+	krb5_principal		princ;
+	char			*hostname;	/* canonical target name */
+	char			key[];
+};
+
+#define KT_CHOICE_HASH		64		/* buckets, a power of 2 */
+#define KT_CHOICE_MAX		1024		/* entries */
+#define KT_CHOICE_TTL		600		/* seconds */
+
+static struct kt_choice *kt_choice_table[KT_CHOICE_HASH];
+static unsigned int kt_choice_count;
+static struct stat kt_choice_stat;		/* of the keytab cached for */
+static pthread_mutex_t kt_choice_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+kt_choice_free(krb5_context context, struct kt_choice *kc)
+{
+	krb5_free_principal(context, kc->princ);
+	free(kc->hostname);
+	free(kc);
+}
+
+static void
+kt_choice_flush(krb5_context context)
+{
+	struct kt_choice *kc, *next;
+	int i;
+
+	for (i = 0; i < KT_CHOICE_HASH; i++) {
+		for (kc = kt_choice_table[i]; kc; kc = next) {
+			next = kc->next;
+			kt_choice_free(context, kc);
+		}
+		kt_choice_table[i] = NULL;
+	}
+	kt_choice_count = 0;
+}
+
+/*
+ * Empty the cache if the keytab has changed since it was filled.
+ * Called with kt_choice_lock held.  Returns -1 if the keytab can't be
+ * checked, and nothing should be cached.
+ */
+static int
+kt_choice_check(krb5_context context)
+{
+	const char *path = keytabfile;
+	struct stat st;
+
+	if (strncmp(path, "FILE:", 5) == 0)
+		path += 5;
+	else if (strncmp(path, "WRFILE:", 7) == 0)
+		path += 7;
+	else if (strchr(path, ':') != NULL)
+		/* not a file */
+		return -1;
+	if (stat(path, &st) != 0) {
+		kt_choice_flush(context);
+		return -1;
+	}
+	if (st.st_ino != kt_choice_stat.st_ino ||
+	    st.st_dev != kt_choice_stat.st_dev ||
+	    st.st_size != kt_choice_stat.st_size ||
+	    st.st_mtim.tv_sec != kt_choice_stat.st_mtim.tv_sec ||
+	    st.st_mtim.tv_nsec != kt_choice_stat.st_mtim.tv_nsec) {
+		kt_choice_flush(context);
+		kt_choice_stat = st;
+	}
+	return 0;
+}
+
+static uint32_t
+kt_choice_hash(const char *key)
+{
+	uint32_t h = 2166136261u;
+
+	for (; *key; key++)
+		h = (h ^ (unsigned char)*key) * 16777619u;
+	return h;
+}
+
+/* Called with kt_choice_lock held */
+static struct kt_choice **
+kt_choice_find(const char *key, uint32_t hash)
+{
+	struct kt_choice **kcp;
+
+	for (kcp = &kt_choice_table[hash & (KT_CHOICE_HASH - 1)]; *kcp;
+	     kcp = &(*kcp)->next)
+		if ((*kcp)->hash == hash && strcmp((*kcp)->key, key) == 0)
+			break;
+	return kcp;
+}
+
+static void
+kt_choice_key(char *key, size_t size, const char *srchost,
+	      const char *tgtname, const char **svcnames)
+{
+	size_t len;
+	int j;
+
+	len = snprintf(key, size, "%s|%s|", srchost ? srchost : "", tgtname);
+	for (j = 0; svcnames[j] != NULL && len < size; j++)
+		len += snprintf(key + len, size - len, "%s,", svcnames[j]);
+}
+
+/*
+ * Look up the keytab entry cached for KEY.  Returns 0 and fills in KTE
+ * if there is one, or -1 otherwise.
+ */
+static int
+kt_choice_get(krb5_context context, krb5_keytab kt, const char *key,
+	      krb5_keytab_entry *kte)
+{
+	uint32_t hash = kt_choice_hash(key);
+	krb5_principal princ = NULL;
+	struct kt_choice *kc, **kcp;
+	char *k5err = NULL;
+	int code;
+
+	pthread_mutex_lock(&kt_choice_lock);
+	if (kt_choice_check(context) == 0) {
+		kcp = kt_choice_find(key, hash);
+		kc = *kcp;
+		if (kc && kc->expires <= time(NULL)) {
+			*kcp = kc->next;
+			kt_choice_free(context, kc);
+			kt_choice_count--;
+		} else if (kc) {
+			printerr(3, "using the keytab entry cached for %s\n",
+				 kc->hostname);
+			if (krb5_copy_principal(context, kc->princ, &princ))
+				princ = NULL;
+		}
+	}
+	pthread_mutex_unlock(&kt_choice_lock);
+	if (princ == NULL)
+		return -1;
+
+	code = krb5_kt_get_entry(context, kt, princ, 0, 0, kte);
+	krb5_free_principal(context, princ);
+	if (code) {
+		/* the keytab changed under us: look again */
+		k5err = gssd_k5_err_msg(context, code);
+		printerr(3, "%s while getting cached keytab entry\n", k5err);
+		free(k5err);
+		pthread_mutex_lock(&kt_choice_lock);
+		kcp = kt_choice_find(key, hash);
+		if ((kc = *kcp) != NULL) {
+			*kcp = kc->next;
+			kt_choice_free(context, kc);
+			kt_choice_count--;
+		}
+		pthread_mutex_unlock(&kt_choice_lock);
+		return -1;
+	}
+	return 0;
+}
+
+static void
+kt_choice_put(krb5_context context, const char *key, const char *hostname,
+	      krb5_principal princ)
+{
+	uint32_t hash = kt_choice_hash(key);
+	struct kt_choice *kc, **kcp;
+	size_t len = strlen(key);
+
+	pthread_mutex_lock(&kt_choice_lock);
+	if (kt_choice_check(context) != 0)
+		goto out;
+	kcp = kt_choice_find(key, hash);
+	if (*kcp != NULL)
+		goto out;
+	if (kt_choice_count >= KT_CHOICE_MAX)
+		kt_choice_flush(context);
+	kc = calloc(1, sizeof(*kc) + len + 1);
+	if (kc == NULL)
+		goto out;
+	memcpy(kc->key, key, len + 1);
+	kc->hostname = strdup(hostname);
+	if (kc->hostname == NULL ||
+	    krb5_copy_principal(context, princ, &kc->princ)) {
+		free(kc->hostname);
+		free(kc);
+		goto out;
+	}
+	kc->hash = hash;
+	kc->expires = time(NULL) + KT_CHOICE_TTL;
+	kcp = &kt_choice_table[hash & (KT_CHOICE_HASH - 1)];
+	kc->next = *kcp;
+	*kcp = kc;
+	kt_choice_count++;
+out:
+	pthread_mutex_unlock(&kt_choice_lock);
+}
+
 /*
  * Find a keytab entry to use for a given target realm.
  * Tries to find the most appropriate keytab to use given the
@@ -862,8 +1696,13 @@ find_keytab_entry(krb5_context context, krb5_keytab kt,
 	krb5_principal princ;
 	const char *notsetstr = "not set";
 	char *adhostoverride = NULL;
+	char key[3 * NI_MAXHOST];
+	int chosen = 0;
 	pthread_t tid = pthread_self();
 
+	kt_choice_key(key, sizeof(key), srchost, tgtname, svcnames);
+	if (kt_choice_get(context, kt, key, kte) == 0)
+		return 0;
 
 	/* Get full target hostname */
 	retval = get_full_hostname(tgtname, targethostname,
@@ -1019,6 +1858,7 @@ find_keytab_entry(krb5_context context, krb5_keytab kt,
 			} else {
 				printerr(2, "find_keytab_entry(0x%lx): Success getting keytab entry for '%s'\n",tid, spn);
 				retval = 0;
+				chosen = 1;
 				goto out;
 			}
 			retval = code;
@@ -1037,6 +1877,7 @@ find_keytab_entry(krb5_context context, krb5_keytab kt,
 				printerr(3, "Success getting keytab entry for "
 					 "%s/*@%s\n", svcnames[j], realm);
 				retval = 0;
+				chosen = 1;
 				goto out;
 			}
 		}
@@ -1046,6 +1887,8 @@ find_keytab_entry(krb5_context context, krb5_keytab kt,
 		}
 	}
 out:
+	if (chosen)
+		kt_choice_put(context, key, targethostname, kte->principal);
 	if (default_realm)
 		k5_free_default_realm(context, default_realm);
 	if (realmnames)
@@ -1063,7 +1906,7 @@ static inline int data_is_equal(krb5_data d1, krb5_data d2)
 
 static int
 check_for_tgt(krb5_context context, krb5_ccache ccache,
-	      krb5_principal principal)
+	      krb5_principal principal, time_t *endtime)
 {
 	krb5_error_code ret;
 	krb5_creds creds;
@@ -1084,8 +1927,10 @@ check_for_tgt(krb5_context context, krb5_ccache ccache,
 						"krbtgt", 6) == 0 &&
 				data_is_equal(creds.server->data[1],
 					      principal->realm) &&
-				creds.times.endtime > time(NULL))
+				creds.times.endtime > time(NULL)) {
+			*endtime = creds.times.endtime;
 			found = 1;
+		}
 		krb5_free_cred_contents(context, &creds);
 	}
 	krb5_cc_end_seq_get(context, ccache, &cur);
@@ -1095,7 +1940,7 @@ check_for_tgt(krb5_context context, krb5_ccache ccache,
 
 static int
 query_krb5_ccache(const char* cred_cache, char **ret_princname,
-		  char **ret_realm)
+		  char **ret_realm, time_t *ret_endtime)
 {
 	krb5_error_code ret;
 	krb5_context context;
@@ -1107,7 +1952,7 @@ query_krb5_ccache(const char* cred_cache, char **ret_princname,
 
 	*ret_princname = *ret_realm = NULL;
 
-	ret = krb5_init_context(&context);
+	ret = gssd_k5_get_context(&context);
 	if (ret) 
 		return 0;
 
@@ -1121,7 +1966,7 @@ query_krb5_ccache(const char* cred_cache, char **ret_princname,
 	if (ret) 
 		goto err_princ;
 
-	found = check_for_tgt(context, ccache, principal);
+	found = check_for_tgt(context, ccache, principal, ret_endtime);
 	if (found) {
 		ret = krb5_unparse_name(context, principal, &princstring);
 		if (ret == 0) {
@@ -1144,7 +1989,7 @@ err_princ:
 	krb5_cc_set_flags(context, ccache,  KRB5_TC_OPENCLOSE);
 	krb5_cc_close(context, ccache);
 err_cache:
-	krb5_free_context(context);
+	gssd_k5_put_context(context);
 	return (*ret_princname && *ret_realm);
 }
 
@@ -1155,7 +2000,7 @@ err_cache:
 static int
 gssd_refresh_krb5_machine_credential_internal(char *hostname,
 				     struct gssd_k5_kt_princ *ple,
-				     char *service, char *srchost)
+				     char *service, char *srchost, int force)
 {
 	krb5_error_code code = 0;
 	krb5_context context;
@@ -1176,7 +2021,7 @@ gssd_refresh_krb5_machine_credential_internal(char *hostname,
 		printerr(0, "ERROR: %s: Invalid args\n", __func__);
 		return EINVAL;
 	}
-	code = krb5_init_context(&context);
+	code = gssd_k5_get_context(&context);
 	if (code) {
 		k5err = gssd_k5_err_msg(NULL, code);
 		printerr(0, "ERROR: %s: %s while initializing krb5 context\n",
@@ -1221,18 +2066,142 @@ gssd_refresh_krb5_machine_credential_internal(char *hostname,
 			goto out_free_kt;
 		}
 	}
-	retval = gssd_get_single_krb5_cred(context, kt, ple);
+	retval = gssd_get_single_krb5_cred(context, kt, ple, force);
 out_free_kt:
 	krb5_kt_close(context, kt);
 out_free_context:
 	if (ple)
 		release_ple(context, ple);
-	krb5_free_context(context);
+	gssd_k5_put_context(context);
 out:
 	free(k5err);
 	return retval;
 }
 
+/*
+ * The credentials cache last chosen for each uid in each directory
+ * searched.  A user's upcalls tend to come in bursts, and each would
+ * otherwise search the directory and read every candidate cache again
+ * to come to the same answer.  The choice is kept as long as neither
+ * the cache nor the directory has changed since, by their ctime and
+ * mtime, and its TGT hasn't expired; a new cache in the directory, or
+ * a cache written or replaced, sends the next upcall to search again.
+ *
+ * Only FILE caches are remembered: a DIR collection can change under
+ * its directory without the directory itself showing it.
+ */
+struct uccache_ent {
+	struct uccache_ent	*next;
+	uid_t			uid;
+	dev_t			dev;
+	ino_t			ino;
+	struct timespec		ctime;		/* of the cache */
+	struct timespec		dir_mtime;
+	time_t			endtime;	/* of its TGT */
+	char			*dirname;
+	char			*ccname;	/* "FILE:dirname/name" */
+};
+
+#define UCCACHE_BUCKETS		256		/* a power of 2 */
+#define UCCACHE_MAX		4096
+
+static struct uccache_ent *uccache[UCCACHE_BUCKETS];
+static unsigned int uccache_count;
+static pthread_mutex_t uccache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline int
+timespec_equal(const struct timespec *a, const struct timespec *b)
+{
+	return a->tv_sec == b->tv_sec && a->tv_nsec == b->tv_nsec;
+}
+
+/*
+ * Copy the cache remembered for UID in DIRNAME into BUF, if it is
+ * still good.  Returns 1 if it is, otherwise 0, and forgets it.
+ */
+static int
+uccache_lookup(uid_t uid, const char *dirname, char *buf, size_t size)
+{
+	struct uccache_ent **ep, *e;
+	struct stat st, dst;
+	int ok;
+
+	pthread_mutex_lock(&uccache_lock);
+	for (ep = &uccache[uid & (UCCACHE_BUCKETS - 1)]; (e = *ep) != NULL;
+	     ep = &e->next)
+		if (e->uid == uid && strcmp(e->dirname, dirname) == 0)
+			break;
+	if (!e) {
+		pthread_mutex_unlock(&uccache_lock);
+		return 0;
+	}
+	ok = e->endtime > time(NULL) &&
+	     stat(dirname, &dst) == 0 &&
+	     timespec_equal(&dst.st_mtim, &e->dir_mtime) &&
+	     lstat(e->ccname + 5, &st) == 0 &&
+	     st.st_dev == e->dev && st.st_ino == e->ino &&
+	     st.st_uid == uid &&
+	     timespec_equal(&st.st_ctim, &e->ctime);
+	if (ok)
+		snprintf(buf, size, "%s", e->ccname);
+	else {
+		*ep = e->next;
+		uccache_count--;
+		free(e->dirname);
+		free(e->ccname);
+		free(e);
+	}
+	pthread_mutex_unlock(&uccache_lock);
+	return ok;
+}
+
+/*
+ * Remember CCNAME, found in DIRNAME, as the cache for UID.  ST is the
+ * cache's stat, and DIR_MTIME the directory's mtime from before the
+ * search, so that anything that changed during it is noticed.
+ */
+static void
+uccache_insert(uid_t uid, const char *dirname, const char *ccname,
+	       const struct stat *st, const struct timespec *dir_mtime,
+	       time_t endtime)
+{
+	struct uccache_ent **ep, *e;
+	char *name;
+
+	if (strncmp(ccname, "FILE:", 5) != 0)
+		return;
+	name = strdup(ccname);
+	if (!name)
+		return;
+	pthread_mutex_lock(&uccache_lock);
+	for (ep = &uccache[uid & (UCCACHE_BUCKETS - 1)]; (e = *ep) != NULL;
+	     ep = &e->next)
+		if (e->uid == uid && strcmp(e->dirname, dirname) == 0)
+			break;
+	if (!e) {
+		if (uccache_count >= UCCACHE_MAX ||
+		    (e = calloc(1, sizeof(*e))) == NULL ||
+		    (e->dirname = strdup(dirname)) == NULL) {
+			pthread_mutex_unlock(&uccache_lock);
+			free(e);
+			free(name);
+			return;
+		}
+		e->uid = uid;
+		e->next = *ep;
+		*ep = e;
+		uccache_count++;
+	}
+	free(e->ccname);
+	e->ccname = name;
+	e->dev = st->st_dev;
+	e->ino = st->st_ino;
+	e->ctime = st->st_ctim;
+	e->dir_mtime = *dir_mtime;
+	e->endtime = endtime;
+	pthread_mutex_unlock(&uccache_lock);
+}
+
 /*==========================*/
 /*===  External routines ===*/
 /*==========================*/
@@ -1251,6 +2220,8 @@ gssd_setup_krb5_user_gss_ccache(uid_t uid, char *servername, char *dirpattern)
 	char			buf[PATH_MAX+5+256+1], dirname[PATH_MAX];
 	const char		*cctype;
 	struct dirent		*d;
+	struct stat		st, dst;
+	time_t			endtime;
 	int			err, i, j;
 	u_int			maj_stat, min_stat;
 
@@ -1279,12 +2250,25 @@ gssd_setup_krb5_user_gss_ccache(uid_t uid, char *servername, char *dirpattern)
 	}
 	dirname[j] = '\0';
 
-	err = gssd_find_existing_krb5_ccache(uid, dirname, &cctype, &d);
+	if (uccache_lookup(uid, dirname, buf, sizeof(buf))) {
+		gssd_stats_count(GCOUNT_CCACHE_HIT);
+		goto found;
+	}
+
+	if (stat(dirname, &dst) != 0)
+		memset(&dst, 0, sizeof(dst));
+	err = gssd_find_existing_krb5_ccache(uid, dirname,
+					     strstr(dirpattern, "%U") == NULL,
+					     &cctype, &d, &st, &endtime);
 	if (err)
 		return err;
 
 	snprintf(buf, sizeof(buf), "%s:%s/%s", cctype, dirname, d->d_name);
 	free(d);
+	if (dst.st_mtim.tv_sec)
+		uccache_insert(uid, dirname, buf, &st, &dst.st_mtim, endtime);
+
+found:
 
 	printerr(2, "using %s as credentials cache for client with "
 		    "uid %u for server %s\n", buf, uid, servername);
@@ -1344,7 +2328,7 @@ gssd_get_krb5_machine_cred_list(char ***list)
 		pthread_mutex_unlock(&ple_lock);
 		/* Make sure cred is up-to-date before returning it */
 		retval = gssd_refresh_krb5_machine_credential_internal(NULL, ple,
-								       NULL, NULL);
+								       NULL, NULL, 0);
 		pthread_mutex_lock(&ple_lock);
 		if (gssd_k5_kt_princ_list == NULL) {
 			/* Looks like we did shutdown... abort */
@@ -1413,7 +2397,7 @@ gssd_destroy_krb5_principals(int destroy_machine_creds)
 	struct gssd_k5_kt_princ *ple;
 	char *k5err = NULL;
 
-	code = krb5_init_context(&context);
+	code = gssd_k5_get_context(&context);
 	if (code) {
 		k5err = gssd_k5_err_msg(NULL, code);
 		printerr(0, "ERROR: %s while initializing krb5\n", k5err);
@@ -1444,11 +2428,20 @@ gssd_destroy_krb5_principals(int destroy_machine_creds)
 				k5err = NULL;
 			}
 		}
+		if (destroy_machine_creds && use_memcache &&
+		    machine_cred_file && ple->realm) {
+			char path[BUFSIZ];
+
+			gssd_machine_cc_path(ple, path, sizeof(path));
+			if (unlink(path) != 0 && errno != ENOENT)
+				printerr(0, "WARNING: unable to remove '%s': "
+					    "%s\n", path, strerror(errno));
+		}
 
 		release_ple_locked(context, ple);
 	}
 	pthread_mutex_unlock(&ple_lock);
-	krb5_free_context(context);
+	gssd_k5_put_context(context);
 }
 
 /*
@@ -1459,7 +2452,88 @@ gssd_refresh_krb5_machine_credential(char *hostname,
 				     char *service, char *srchost)
 {
     return gssd_refresh_krb5_machine_credential_internal(hostname, NULL,
-							 service, srchost);
+							 service, srchost, 0);
+}
+
+/* Longest the refresher sleeps, so that it notices new principals */
+#define MACHINE_CRED_REFRESH_IDLE	60
+
+/*
+ * Renew the machine credentials in the principal list once
+ * machine_cred_refresh percent of their lifetime has gone by, so that
+ * upcalls find them current instead of waiting on the KDC themselves.
+ * Only principals that an upcall has obtained credentials for are
+ * renewed.
+ */
+static void *
+machine_cred_refresh_fn(void *UNUSED(arg))
+{
+	struct gssd_k5_kt_princ *ple;
+	time_t now, next;
+
+	for (;;) {
+		now = time(NULL);
+		next = now + MACHINE_CRED_REFRESH_IDLE;
+		pthread_mutex_lock(&ple_lock);
+		for (ple = gssd_k5_kt_princ_list; ple; ple = ple->next) {
+			if (!ple->ccname || !ple->refresh)
+				continue;
+			if (ple->refresh > now) {
+				if (ple->refresh < next)
+					next = ple->refresh;
+				continue;
+			}
+
+			/* see gssd_get_krb5_machine_cred_list() */
+			ple->refcount++;
+			pthread_mutex_unlock(&ple_lock);
+			printerr(2, "refreshing machine credentials in '%s'\n",
+				 ple->ccname);
+			if (gssd_refresh_krb5_machine_credential_internal(NULL,
+							ple, NULL, NULL, 1)) {
+				pthread_mutex_lock(&ple_lock);
+				if (gssd_k5_kt_princ_list == NULL)
+					break;
+				/* try again later; upcalls still can */
+				ple->refresh = now + MACHINE_CRED_REFRESH_IDLE;
+				continue;
+			}
+			pthread_mutex_lock(&ple_lock);
+			if (gssd_k5_kt_princ_list == NULL)
+				break;
+		}
+		pthread_mutex_unlock(&ple_lock);
+		if (ple)
+			/* shut down */
+			return NULL;
+		if (next > now)
+			sleep(next - now);
+	}
+}
+
+/*
+ * Start the thread that renews machine credentials ahead of their
+ * expiry, if machine_cred_refresh asks for one.
+ *
+ * Returns 0 on success, or an error code from pthread.
+ */
+int
+gssd_start_machine_cred_refresher(void)
+{
+	pthread_attr_t attr;
+	pthread_t th;
+	int ret;
+
+	if (machine_cred_refresh <= 0 || machine_cred_refresh >= 100)
+		return 0;
+	ret = pthread_attr_init(&attr);
+	if (ret != 0)
+		return ret;
+	ret = pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (ret == 0)
+		ret = pthread_create(&th, &attr, machine_cred_refresh_fn, NULL);
+	pthread_attr_destroy(&attr);
+	return ret;
 }
 
 /*
@@ -1498,12 +2572,12 @@ gssd_k5_get_default_realm(char **def_realm)
 {
 	krb5_context context;
 
-	if (krb5_init_context(&context))
+	if (gssd_k5_get_context(&context))
 		return;
 
 	krb5_get_default_realm(context, def_realm);
 
-	krb5_free_context(context);
+	gssd_k5_put_context(context);
 }
 
 static int
@@ -1555,8 +2629,7 @@ gssd_acquire_user_cred(gss_cred_id_t *gss_cred)
  * then calls gss_krb5_set_allowable_enctypes() to limit the encryption
  * types negotiated.
  *
- * XXX Should call some function to determine the enctypes supported
- * by the kernel. (Only need to do that once!)
+ * ENCTYPES are those the kernel supports, or NULL if it didn't say.
  *
  * Returns:
  *	0 => all went well
@@ -1564,15 +2637,15 @@ gssd_acquire_user_cred(gss_cred_id_t *gss_cred)
  */
 
 int
-limit_krb5_enctypes(struct rpc_gss_sec *sec)
+limit_krb5_enctypes(struct rpc_gss_sec *sec,
+		    const struct gssd_enctypes *enctypes)
 {
 	u_int maj_stat, min_stat;
-	krb5_enctype enctypes[] = { ENCTYPE_DES_CBC_CRC,
-				    ENCTYPE_DES_CBC_MD5,
-				    ENCTYPE_DES_CBC_MD4 };
-	int num_enctypes = sizeof(enctypes) / sizeof(enctypes[0]);
-	extern int num_krb5_enctypes;
-	extern krb5_enctype *krb5_enctypes;
+	krb5_enctype legacy_enctypes[] = { ENCTYPE_DES_CBC_CRC,
+					   ENCTYPE_DES_CBC_MD5,
+					   ENCTYPE_DES_CBC_MD4 };
+	int num_legacy_enctypes = sizeof(legacy_enctypes) /
+				  sizeof(legacy_enctypes[0]);
 	int err = -1;
 
 	if (sec->cred == GSS_C_NO_CREDENTIAL) {
@@ -1585,12 +2658,14 @@ limit_krb5_enctypes(struct rpc_gss_sec *sec)
 	 * If we failed for any reason to produce global
 	 * list of supported enctypes, use local default here.
 	 */
-	if (krb5_enctypes == NULL || limit_to_legacy_enctypes)
+	if (enctypes == NULL || limit_to_legacy_enctypes)
 		maj_stat = gss_set_allowable_enctypes(&min_stat, sec->cred,
-					&krb5oid, num_enctypes, enctypes);
+					&krb5oid, num_legacy_enctypes,
+					legacy_enctypes);
 	else
 		maj_stat = gss_set_allowable_enctypes(&min_stat, sec->cred,
-					&krb5oid, num_krb5_enctypes, krb5_enctypes);
+					&krb5oid, enctypes->count,
+					(krb5_enctype *)enctypes->types);
 
 	if (maj_stat != GSS_S_COMPLETE) {
 		pgsserr("gss_set_allowable_enctypes",
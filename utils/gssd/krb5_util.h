@@ -17,14 +17,30 @@ void gssd_free_krb5_machine_cred_list(char **list);
 void gssd_destroy_krb5_principals(int destroy_machine_creds);
 int  gssd_refresh_krb5_machine_credential(char *hostname,
 					  char *service, char *srchost);
+int  gssd_start_machine_cred_refresher(void);
 char *gssd_k5_err_msg(krb5_context context, krb5_error_code code);
+krb5_error_code gssd_k5_get_context(krb5_context *context);
+void gssd_k5_put_context(krb5_context context);
 void gssd_k5_get_default_realm(char **def_realm);
 
 int gssd_acquire_user_cred(gss_cred_id_t *gss_cred);
 
+/*
+ * A list of encryption types supported by the kernel, as parsed from
+ * the "enctypes=" of a gssd upcall.  Lists are never changed or freed
+ * once parsed, so upcall threads can use one without holding a lock.
+ */
+struct gssd_enctypes {
+	struct gssd_enctypes	*next;
+	char			*str;		/* as the kernel sent it */
+	int			count;
+	krb5_enctype		types[];
+};
+
 #ifdef HAVE_SET_ALLOWABLE_ENCTYPES
 extern int limit_to_legacy_enctypes;
-int limit_krb5_enctypes(struct rpc_gss_sec *sec);
+int limit_krb5_enctypes(struct rpc_gss_sec *sec,
+			const struct gssd_enctypes *enctypes);
 #endif
 
 /*
@@ -56,6 +56,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <signal.h>
+#include <pthread.h>
 #include <nfsidmap.h>
 #include <event2/event.h>
 
@@ -66,6 +67,7 @@
 #include "conffile.h"
 #include "misc.h"
 #include "svcgssd_krb5.h"
+#include "nfsmetrics.h"
 
 static bool signal_received = false;
 static struct event_base *evbase = NULL;
@@ -75,6 +77,84 @@ static struct event *wait_event = NULL;
 
 #define NULLRPC_FILE "/proc/net/rpc/auth.rpcsec.init/channel"
 
+/*
+ * With nullreq-threads set, null requests are read by the main loop
+ * and handled by that many worker threads, so that one waiting on the
+ * name service doesn't hold up all the others.
+ */
+static int nullreq_threads = 0;
+
+struct nullreq {
+	struct nullreq	*next;
+	char		buf[];
+};
+
+static struct nullreq *nullreq_head, **nullreq_tail = &nullreq_head;
+static pthread_mutex_t nullreq_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t nullreq_cond = PTHREAD_COND_INITIALIZER;
+
+static void *
+svcgssd_worker_fn(void *UNUSED(arg))
+{
+	struct nullreq *req;
+
+	for (;;) {
+		pthread_mutex_lock(&nullreq_lock);
+		while ((req = nullreq_head) == NULL)
+			pthread_cond_wait(&nullreq_cond, &nullreq_lock);
+		nullreq_head = req->next;
+		if (nullreq_head == NULL)
+			nullreq_tail = &nullreq_head;
+		pthread_mutex_unlock(&nullreq_lock);
+
+		handle_nullreq(req->buf);
+		free(req);
+	}
+	return NULL;
+}
+
+static void
+svcgssd_start_workers(void)
+{
+	pthread_attr_t attr;
+	pthread_t th;
+	int i, ret;
+
+	if (nullreq_threads <= 0)
+		return;
+	ret = pthread_attr_init(&attr);
+	if (ret == 0)
+		ret = pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	for (i = 0; ret == 0 && i < nullreq_threads; i++)
+		ret = pthread_create(&th, &attr, svcgssd_worker_fn, NULL);
+	pthread_attr_destroy(&attr);
+	if (ret != 0) {
+		printerr(0, "WARNING: started %d of %d worker threads: %s\n",
+			 i, nullreq_threads, strerror(ret));
+		if (i <= 1)
+			/* handle requests in the main loop */
+			i = 0;
+		nullreq_threads = i;
+	}
+}
+
+/* Hand the requests on LIST to the workers, all at once */
+static void
+svcgssd_queue_nullreqs(struct nullreq *list, struct nullreq **tail,
+		       int count)
+{
+	if (count == 0)
+		return;
+	pthread_mutex_lock(&nullreq_lock);
+	*nullreq_tail = list;
+	nullreq_tail = tail;
+	if (count > 1)
+		pthread_cond_broadcast(&nullreq_cond);
+	else
+		pthread_cond_signal(&nullreq_cond);
+	pthread_mutex_unlock(&nullreq_lock);
+}
+
 static void
 sig_die(int signal)
 {
@@ -104,22 +184,56 @@ usage(char *progname)
 	exit(1);
 }
 
+/* Requests read from the channel before going back to the event loop */
+#define NULLREQ_DRAIN_MAX	256
+
+/*
+ * Read every request waiting on the channel.  With workers, they are
+ * queued for them together; otherwise they are handled here, and the
+ * downcalls for them written together once all have been.
+ */
 static void
 svcgssd_nullrpc_cb(int fd, short UNUSED(which), void *UNUSED(data))
 {
 	char	lbuf[RPC_CHAN_BUF_SIZE];
 	int	lbuflen = 0;
+	struct nullreq *list = NULL, **tail = &list, *req;
+	int	n, queued = 0;
+
+	printerr(1, "reading null requests\n");
+
+	if (nullreq_threads == 0)
+		downcalls_held = true;
+	for (n = 0; n < NULLREQ_DRAIN_MAX; n++) {
+		lbuflen = read(fd, lbuf, sizeof(lbuf));
+		if (lbuflen < 0 && errno == EINTR)
+			continue;
+		if (n > 0 && (lbuflen == 0 ||
+			      (lbuflen < 0 && errno == EAGAIN)))
+			break;
+		if (lbuflen <= 0 || lbuf[lbuflen-1] != '\n') {
+			printerr(0, "WARNING: handle_nullreq: "
+				 "failed reading request\n");
+			break;
+		}
+		lbuf[lbuflen-1] = 0;
 
-	printerr(1, "reading null request\n");
-
-	lbuflen = read(fd, lbuf, sizeof(lbuf));
-	if (lbuflen <= 0 || lbuf[lbuflen-1] != '\n') {
-		printerr(0, "WARNING: handle_nullreq: failed reading request\n");
-		return;
+		req = nullreq_threads > 0 ?
+			malloc(sizeof(*req) + lbuflen) : NULL;
+		if (!req) {
+			handle_nullreq(lbuf);
+			continue;
+		}
+		memcpy(req->buf, lbuf, lbuflen);
+		req->next = NULL;
+		*tail = req;
+		tail = &req->next;
+		queued++;
 	}
-	lbuf[lbuflen-1] = 0;
-
-	handle_nullreq(lbuf);
+	svcgssd_queue_nullreqs(list, tail, queued);
+	downcalls_held = false;
+	downcall_flush();
+	printerr(2, "read %d null requests\n", n);
 }
 
 static void
@@ -139,7 +253,7 @@ svcgssd_nullrpc_close(void)
 static void
 svcgssd_nullrpc_open(void)
 {
-	nullrpc_fd = open(NULLRPC_FILE, O_RDWR);
+	nullrpc_fd = open(NULLRPC_FILE, O_RDWR | O_NONBLOCK);
 	if (nullrpc_fd < 0) {
 		printerr(0, "failed to open %s: %s\n",
 			 NULLRPC_FILE, strerror(errno));
@@ -210,9 +324,10 @@ main(int argc, char *argv[])
 	verbosity = conf_get_num("svcgssd", "Verbosity", verbosity);
 	rpc_verbosity = conf_get_num("svcgssd", "RPC-Verbosity", rpc_verbosity);
 	idmap_verbosity = conf_get_num("svcgssd", "IDMAP-Verbosity", idmap_verbosity);
-
-	/* We don't need the config anymore */
-	conf_cleanup();
+	nullreq_threads = conf_get_num("svcgssd", "nullreq-threads",
+				       nullreq_threads);
+	id_cache_timeout = conf_get_num("svcgssd", "id-cache-timeout",
+					id_cache_timeout);
 
 	while ((opt = getopt(argc, argv, "fivrnp:")) != -1) {
 		switch (opt) {
@@ -278,6 +393,10 @@ main(int argc, char *argv[])
 	}
 
 	daemon_init(fg);
+	nfsmetrics_start("svcgssd");
+
+	/* We don't need the config anymore */
+	conf_cleanup();
 
 	evbase = event_base_new();
 	if (!evbase) {
@@ -329,6 +448,7 @@ main(int argc, char *argv[])
 	daemon_ready();
 
 	nfs4_init_name_mapping(NULL); /* XXX: should only do this once */
+	svcgssd_start_workers();
 
 	rc = event_base_dispatch(evbase);
 	if (rc < 0)
@@ -31,11 +31,17 @@
 #ifndef _RPC_SVCGSSD_H_
 #define _RPC_SVCGSSD_H_
 
+#include <stdbool.h>
 #include <sys/types.h>
 #include <sys/queue.h>
 #include <gssapi/gssapi.h>
 
 void handle_nullreq(char *cp);
+void downcall_flush(void);
+
+extern bool downcalls_held;
+
+extern int id_cache_timeout;
 
 #define GSSD_SERVICE_NAME	"nfs"
 
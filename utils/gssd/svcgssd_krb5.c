@@ -39,6 +39,7 @@
 #include <stdio.h>
 #include <errno.h>
 #include <ctype.h>
+#include <pthread.h>
 #include <gssapi/gssapi.h>
 #include <krb5.h>
 
@@ -172,7 +173,8 @@ svcgssd_free_enctypes(void)
 /*
  * Get encryption types supported by the kernel, and then
  * call gss_krb5_set_allowable_enctypes() to limit the
- * encryption types negotiated.
+ * encryption types negotiated.  Null requests can be handled
+ * concurrently, so this is serialized.
  *
  * Returns:
  *	0 => all went well
@@ -196,8 +198,10 @@ svcgssd_limit_krb5_enctypes(void)
 		ENCTYPE_DES_CBC_CRC,
 		ENCTYPE_DES_CBC_MD5,
 		ENCTYPE_DES_CBC_MD4 };
+	static pthread_mutex_t enctypes_lock = PTHREAD_MUTEX_INITIALIZER;
 	krb5_enctype *default_enctypes, *enctypes;
 	int default_num_enctypes, num_enctypes;
+	int ret = 0;
 
 
 	if (linux_version_code() < MAKE_VERSION(2, 6, 35)) {
@@ -210,6 +214,7 @@ svcgssd_limit_krb5_enctypes(void)
 			sizeof(new_kernel_enctypes) / sizeof(new_kernel_enctypes[0]);
 	}
 
+	pthread_mutex_lock(&enctypes_lock);
 	get_kernel_supported_enctypes();
 
 	if (parsed_enctypes != NULL) {
@@ -230,8 +235,11 @@ svcgssd_limit_krb5_enctypes(void)
 		printerr(1, "WARNING: gss_set_allowable_enctypes failed\n");
 		pgsserr("svcgssd_limit_krb5_enctypes: gss_set_allowable_enctypes",
 			maj_stat, min_stat, &krb5oid);
-		return -1;
+		ret = -1;
 	}
-#endif
+	pthread_mutex_unlock(&enctypes_lock);
+	return ret;
+#else
 	return 0;
+#endif
 }
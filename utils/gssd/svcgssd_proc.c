@@ -48,6 +48,11 @@
 #include <string.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <sys/uio.h>
 #include <nfsidmap.h>
 #include <nfslib.h>
 #include <time.h>
@@ -74,26 +79,174 @@ struct svc_cred {
 	gid_t	cr_groups[NGROUPS];
 };
 
+/*
+ * Downcalls are queued, and written by whichever thread finds no other
+ * writing them: it takes all those queued so far, and writes those for
+ * each channel with one writev().  The kernel parses each iovec as an
+ * entry of its own.  Context entries are written first, as the kernel
+ * needs a context before the null reply that refers to it.  Each
+ * channel is opened once, and again only after an error.
+ *
+ * While downcalls_held is set, by the main loop handling a batch of
+ * requests itself, they are only queued, for downcall_flush().
+ */
+enum {
+	DOWNCALL_CONTEXT,
+	DOWNCALL_INIT,
+	DOWNCALL_MAX
+};
+
+#define DOWNCALL_IOV_MAX	64
+
+struct downcall {
+	struct downcall	*next;
+	size_t		len;
+	char		buf[];
+};
+
+static struct {
+	const char	*path;
+	int		fd;
+	struct downcall	*head, **tail;
+} downcall_chan[DOWNCALL_MAX] = {
+	[DOWNCALL_CONTEXT] = { SVCGSSD_CONTEXT_CHANNEL, -1, NULL,
+			       &downcall_chan[DOWNCALL_CONTEXT].head },
+	[DOWNCALL_INIT] = { SVCGSSD_INIT_CHANNEL, -1, NULL,
+			    &downcall_chan[DOWNCALL_INIT].head },
+};
+
+static pthread_mutex_t downcall_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool downcall_busy;
+bool downcalls_held;
+
+/* Write the downcalls in LIST to channel C, and free them */
+static void
+downcall_write(int c, struct downcall *list)
+{
+	struct iovec iov[DOWNCALL_IOV_MAX];
+	struct downcall *dc, *next;
+	ssize_t len;
+	int i, n;
+
+	while (list) {
+		n = 0;
+		for (dc = list; dc && n < DOWNCALL_IOV_MAX; dc = dc->next) {
+			iov[n].iov_base = dc->buf;
+			iov[n++].iov_len = dc->len;
+		}
+		if (downcall_chan[c].fd < 0) {
+			downcall_chan[c].fd = open(downcall_chan[c].path,
+						   O_WRONLY);
+			if (downcall_chan[c].fd < 0) {
+				printerr(0, "WARNING: unable to open downcall "
+					 "channel %s: %s\n",
+					 downcall_chan[c].path,
+					 strerror(errno));
+				for (; list; list = next) {
+					next = list->next;
+					free(list);
+				}
+				return;
+			}
+		}
+		len = writev(downcall_chan[c].fd, iov, n);
+
+		/* free those written, and the one that failed, if any */
+		for (i = 0; i < n; i++) {
+			next = list->next;
+			if (len >= 0 && (size_t)len >= list->len) {
+				len -= list->len;
+				free(list);
+				list = next;
+				continue;
+			}
+			printerr(0, "WARNING: error writing to downcall "
+				 "channel %s: %s\n", downcall_chan[c].path,
+				 len < 0 ? strerror(errno) : "short write");
+			if (len < 0 && errno != EINVAL) {
+				close(downcall_chan[c].fd);
+				downcall_chan[c].fd = -1;
+			}
+			free(list);
+			list = next;
+			break;
+		}
+	}
+}
+
+/* Write the downcalls queued, until none are left */
+static void
+downcall_flush_locked(void)
+{
+	struct downcall *list[DOWNCALL_MAX];
+	bool more;
+	int c;
+
+	downcall_busy = true;
+	do {
+		more = false;
+		for (c = 0; c < DOWNCALL_MAX; c++) {
+			list[c] = downcall_chan[c].head;
+			downcall_chan[c].head = NULL;
+			downcall_chan[c].tail = &downcall_chan[c].head;
+		}
+		pthread_mutex_unlock(&downcall_lock);
+		for (c = 0; c < DOWNCALL_MAX; c++) {
+			if (list[c])
+				more = true;
+			downcall_write(c, list[c]);
+		}
+		pthread_mutex_lock(&downcall_lock);
+	} while (more);
+	downcall_busy = false;
+}
+
+void
+downcall_flush(void)
+{
+	pthread_mutex_lock(&downcall_lock);
+	if (!downcall_busy)
+		downcall_flush_locked();
+	pthread_mutex_unlock(&downcall_lock);
+}
+
+static int
+downcall_queue(int c, const char *buf, size_t len)
+{
+	struct downcall *dc;
+
+	dc = malloc(sizeof(*dc) + len);
+	if (!dc) {
+		printerr(0, "WARNING: no memory for downcall to %s\n",
+			 downcall_chan[c].path);
+		return -1;
+	}
+	dc->next = NULL;
+	dc->len = len;
+	memcpy(dc->buf, buf, len);
+
+	pthread_mutex_lock(&downcall_lock);
+	*downcall_chan[c].tail = dc;
+	downcall_chan[c].tail = &dc->next;
+	if (!downcall_busy && !downcalls_held)
+		downcall_flush_locked();
+	pthread_mutex_unlock(&downcall_lock);
+	return 0;
+}
+
 static int
 do_svc_downcall(gss_buffer_desc *out_handle, struct svc_cred *cred,
 		gss_OID mech, gss_buffer_desc *context_token,
 		int32_t endtime, char *client_name)
 {
 	char buf[RPC_CHAN_BUF_SIZE], *bp;
-	int i, f, err, blen;
+	int i, blen;
 	char *fname = NULL;
 
 	printerr(1, "doing downcall\n");
 	if ((fname = mech2file(mech)) == NULL)
 		goto out_err;
 
-	f = open(SVCGSSD_CONTEXT_CHANNEL, O_WRONLY);
-	if (f < 0) {
-		printerr(0, "WARNING: unable to open downcall channel "
-			     "%s: %s\n",
-			     SVCGSSD_CONTEXT_CHANNEL, strerror(errno));
-		goto out_err;
-	}
 	bp = buf, blen = sizeof(buf);
 	qword_addhex(&bp, &blen, out_handle->value, out_handle->length);
 	/* XXX are types OK for the rest of this? */
@@ -117,14 +270,12 @@ do_svc_downcall(gss_buffer_desc *out_handle, struct svc_cred *cred,
 	if (client_name)
 		qword_add(&bp, &blen, client_name);
 	qword_addeol(&bp, &blen);
-	err = 0;
-	if (blen <= 0 || write(f, buf, bp - buf) != bp - buf) {
-		printerr(1, "WARNING: error writing to downcall channel "
-			 "%s: %s\n", SVCGSSD_CONTEXT_CHANNEL, strerror(errno));
-		err = -1;
+	if (blen <= 0) {
+		printerr(1, "WARNING: downcall to %s too long\n",
+			 SVCGSSD_CONTEXT_CHANNEL);
+		goto out_err;
 	}
-	close(f);
-	return err;
+	return downcall_queue(DOWNCALL_CONTEXT, buf, bp - buf);
 out_err:
 	printerr(1, "WARNING: downcall failed\n");
 	return -1;
@@ -145,8 +296,6 @@ send_response(gss_buffer_desc *in_handle, gss_buffer_desc *in_token,
 	char buf[2 * TOKEN_BUF_SIZE];
 	char *bp = buf;
 	int blen = sizeof(buf);
-	/* XXXARG: */
-	int g;
 
 	printerr(1, "sending null reply\n");
 
@@ -163,21 +312,9 @@ send_response(gss_buffer_desc *in_handle, gss_buffer_desc *in_token,
 		printerr(0, "WARNING: send_respsonse: message too long\n");
 		return -1;
 	}
-	g = open(SVCGSSD_INIT_CHANNEL, O_WRONLY);
-	if (g == -1) {
-		printerr(0, "WARNING: open %s failed: %s\n",
-				SVCGSSD_INIT_CHANNEL, strerror(errno));
-		return -1;
-	}
 	*bp = '\0';
 	printerr(3, "writing message: %s", buf);
-	if (write(g, buf, bp - buf) == -1) {
-		printerr(0, "WARNING: failed to write message\n");
-		close(g);
-		return -1;
-	}
-	close(g);
-	return 0;
+	return downcall_queue(DOWNCALL_INIT, buf, bp - buf);
 }
 
 #define rpc_auth_ok			0
@@ -189,19 +326,145 @@ send_response(gss_buffer_desc *in_handle, gss_buffer_desc *in_token,
 #define rpcsec_gsserr_credproblem	13
 #define rpcsec_gsserr_ctxproblem	14
 
+/*
+ * Cache of the credentials principals were mapped to, so that a burst of
+ * new contexts, such as when clients reconnect after a restart, doesn't
+ * take a name service lookup for each.  Principals that don't map are
+ * cached too.  Entries are kept for id_cache_timeout seconds; zero
+ * turns the cache off.
+ */
+int id_cache_timeout = 300;
+
+struct id_cache_ent {
+	struct id_cache_ent	*next;
+	uint32_t		hash;
+	time_t			expires;
+	struct svc_cred		cred;
+	char			name[];		/* secname, NUL, principal */
+};
+
+#define ID_CACHE_HASH		1024		/* buckets, a power of 2 */
+#define ID_CACHE_MAX		16384		/* entries */
+
+static struct id_cache_ent *id_cache_table[ID_CACHE_HASH];
+static unsigned int id_cache_count;
+static pthread_mutex_t id_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint32_t
+id_cache_hash(const char *secname, const char *sname)
+{
+	uint32_t h = 2166136261u;
+
+	for (; *secname; secname++)
+		h = (h ^ (unsigned char)*secname) * 16777619u;
+	h = (h ^ '/') * 16777619u;
+	for (; *sname; sname++)
+		h = (h ^ (unsigned char)*sname) * 16777619u;
+	return h;
+}
+
+static int
+id_cache_match(const struct id_cache_ent *ic, uint32_t hash,
+	       const char *secname, const char *sname)
+{
+	return ic->hash == hash && !strcmp(ic->name, secname) &&
+		!strcmp(ic->name + strlen(ic->name) + 1, sname);
+}
+
+/* Drop the expired entries.  Called with id_cache_lock held. */
+static void
+id_cache_expire(time_t now)
+{
+	struct id_cache_ent *ic, **icp;
+	int i;
+
+	for (i = 0; i < ID_CACHE_HASH; i++) {
+		icp = &id_cache_table[i];
+		while ((ic = *icp) != NULL) {
+			if (ic->expires > now) {
+				icp = &ic->next;
+				continue;
+			}
+			*icp = ic->next;
+			free(ic);
+			id_cache_count--;
+		}
+	}
+}
+
+/* Returns 0 and fills in CRED if SNAME is cached, or -1 otherwise */
+static int
+id_cache_get(const char *secname, const char *sname, struct svc_cred *cred)
+{
+	uint32_t hash = id_cache_hash(secname, sname);
+	struct id_cache_ent *ic;
+	int ret = -1;
+
+	if (id_cache_timeout <= 0)
+		return -1;
+	pthread_mutex_lock(&id_cache_lock);
+	for (ic = id_cache_table[hash & (ID_CACHE_HASH - 1)]; ic; ic = ic->next)
+		if (id_cache_match(ic, hash, secname, sname))
+			break;
+	if (ic && ic->expires > time(NULL)) {
+		*cred = ic->cred;
+		ret = 0;
+	}
+	pthread_mutex_unlock(&id_cache_lock);
+	return ret;
+}
+
+static void
+id_cache_put(const char *secname, const char *sname,
+	     const struct svc_cred *cred)
+{
+	uint32_t hash = id_cache_hash(secname, sname);
+	size_t slen = strlen(secname), nlen = strlen(sname);
+	struct id_cache_ent *ic, **icp;
+	time_t now = time(NULL);
+
+	if (id_cache_timeout <= 0)
+		return;
+	pthread_mutex_lock(&id_cache_lock);
+	icp = &id_cache_table[hash & (ID_CACHE_HASH - 1)];
+	for (ic = *icp; ic; ic = ic->next)
+		if (id_cache_match(ic, hash, secname, sname))
+			break;
+	if (!ic) {
+		if (id_cache_count >= ID_CACHE_MAX)
+			id_cache_expire(now);
+		if (id_cache_count >= ID_CACHE_MAX)
+			goto out;
+		ic = malloc(sizeof(*ic) + slen + nlen + 2);
+		if (!ic)
+			goto out;
+		memcpy(ic->name, secname, slen + 1);
+		memcpy(ic->name + slen + 1, sname, nlen + 1);
+		ic->hash = hash;
+		ic->next = *icp;
+		*icp = ic;
+		id_cache_count++;
+	}
+	ic->cred = *cred;
+	ic->expires = now + id_cache_timeout;
+out:
+	pthread_mutex_unlock(&id_cache_lock);
+}
+
 static void
 add_supplementary_groups(char *secname, char *name, struct svc_cred *cred)
 {
 	int ret;
-	static gid_t *groups = NULL;
+	gid_t *groups;
 
 	cred->cr_ngroups = NGROUPS;
 	ret = nfs4_gss_princ_to_grouplist(secname, name,
 			cred->cr_groups, &cred->cr_ngroups);
 	if (ret < 0) {
-		groups = realloc(groups, cred->cr_ngroups*sizeof(gid_t));
-		ret = nfs4_gss_princ_to_grouplist(secname, name,
-				groups, &cred->cr_ngroups);
+		/* requests can be handled concurrently: no static buffer */
+		groups = malloc(cred->cr_ngroups*sizeof(gid_t));
+		ret = groups ? nfs4_gss_princ_to_grouplist(secname, name,
+				groups, &cred->cr_ngroups) : -ENOMEM;
 		if (ret < 0)
 			cred->cr_ngroups = 0;
 		else {
@@ -210,6 +473,7 @@ add_supplementary_groups(char *secname, char *name, struct svc_cred *cred)
 			memcpy(cred->cr_groups, groups,
 					cred->cr_ngroups*sizeof(gid_t));
 		}
+		free(groups);
 	}
 }
 
@@ -248,6 +512,12 @@ get_ids(gss_name_t client_name, gss_OID mech, struct svc_cred *cred)
 		goto out_free;
 	}
 
+	if (id_cache_get(secname, sname, cred) == 0) {
+		printerr(2, "using cached ids for '%s'\n", sname);
+		res = 0;
+		goto out_free;
+	}
+
 	res = nfs4_gss_princ_to_ids(secname, sname, &uid, &gid);
 	if (res < 0) {
 		/*
@@ -262,6 +532,7 @@ get_ids(gss_name_t client_name, gss_OID mech, struct svc_cred *cred)
 			cred->cr_uid = -1;
 			cred->cr_gid = -1;
 			cred->cr_ngroups = 0;
+			id_cache_put(secname, sname, cred);
 			res = 0;
 			goto out_free;
 		}
@@ -272,6 +543,7 @@ get_ids(gss_name_t client_name, gss_OID mech, struct svc_cred *cred)
 	cred->cr_uid = uid;
 	cred->cr_gid = gid;
 	add_supplementary_groups(secname, sname, cred);
+	id_cache_put(secname, sname, cred);
 	res = 0;
 out_free:
 	free(sname);
@@ -322,6 +594,8 @@ handle_nullreq(char *cp) {
 	/* XXX initialize to a random integer to reduce chances of unnecessary
 	 * invalidation of existing ctx's on restarting svcgssd. */
 	static u_int32_t	handle_seq = 0;
+	static pthread_mutex_t	handle_seq_lock = PTHREAD_MUTEX_INITIALIZER;
+	u_int32_t		seq;
 	char			in_tok_buf[TOKEN_BUF_SIZE];
 	char			in_handle_buf[15];
 	char			out_handle_buf[15];
@@ -404,9 +678,11 @@ handle_nullreq(char *cp) {
 
 	/* Context complete. Pass handle_seq in out_handle to use
 	 * for context lookup in the kernel. */
-	handle_seq++;
-	out_handle.length = sizeof(handle_seq);
-	memcpy(out_handle.value, &handle_seq, sizeof(handle_seq));
+	pthread_mutex_lock(&handle_seq_lock);
+	seq = ++handle_seq;
+	pthread_mutex_unlock(&handle_seq_lock);
+	out_handle.length = sizeof(seq);
+	memcpy(out_handle.value, &seq, sizeof(seq));
 
 	/* kernel needs ctx to calculate verifier on null response, so
 	 * must give it context before doing null call: */
@@ -65,12 +65,15 @@
 #include <limits.h>
 #include <ctype.h>
 #include <libgen.h>
+#include <pthread.h>
 #include <nfsidmap.h>
 
 #include "xlog.h"
 #include "conffile.h"
 #include "queue.h"
 #include "nfslib.h"
+#include "nfsmetrics.h"
+#include "nfstrace.h"
 
 #ifndef PIPEFS_DIR
 #define PIPEFS_DIR  NFS_STATEDIR "/rpc_pipefs/"
@@ -115,7 +118,11 @@ struct idmap_client {
 	int                        ic_fd;
 	int                        ic_dirfd;
 	int                        ic_scanned;
+	int                        ic_pending;	/* lookups with workers */
+	int                        ic_dead;	/* to free once none are */
+	int                        ic_wd;	/* waiting for ic_path */
 	struct event              *ic_event;
+	struct idmap_client       *ic_hnext;	/* by ic_clid */
 	TAILQ_ENTRY(idmap_client)  ic_next;
 };
 static struct idmap_client nfsd_ic[2] = {
@@ -142,15 +149,22 @@ static struct idmap_client nfsd_ic[2] = {
 TAILQ_HEAD(idmap_clientq, idmap_client);
 
 static void dirscancb(int, short, void *);
+static void inotifycb(int, short, void *);
 static void clntscancb(int, short, void *);
 static void svrreopen(int, short, void *);
 static int  nfsopen(struct idmap_client *);
 static void nfscb(int, short, void *);
 static void nfsdcb(int, short, void *);
-static int  addfield(char **, ssize_t *, char *);
-static int  getfield(char **, char *, size_t);
 
 static void imconv(struct idmap_client *, struct idmap_msg *);
+static void nfsdreply(struct idmap_client *, char *, struct idmap_msg *, int);
+static void nfsreply(struct idmap_client *, struct idmap_msg *);
+static void queue_req(struct idmap_client *, int, char *, struct idmap_msg *,
+		      struct nfstrace *);
+static uint32_t lookup_hash(const struct idmap_msg *);
+static void start_workers(void);
+static void start_refresh(void);
+static void client_free(struct idmap_client *);
 static void idtonameres(struct idmap_msg *);
 static void nametoidres(struct idmap_msg *);
 
@@ -170,6 +184,75 @@ static gid_t nobodygid;
 static struct event_base *evbase = NULL;
 static bool signal_received = false;
 static int inotify_fd = -1;
+static int pipefs_wd = -1;
+
+/*
+ * The clients in pipefsdir, by the name of their directory, so that
+ * each directory created or deleted there is found without a search.
+ */
+#define CLIENT_HASH	1024		/* buckets, a power of 2 */
+
+static struct idmap_client *client_table[CLIENT_HASH];
+
+/*
+ * With worker_threads set, lookups are done by that many threads, so
+ * that one slow lookup doesn't hold up the others.  Upcalls are still
+ * read, and replies written, by the main loop only: each upcall is
+ * read once, and its reply is written when its lookup is done, in
+ * whatever order the lookups finish.  An upcall for the same lookup
+ * as one in progress waits for that one's result.
+ */
+struct idmap_req {
+	struct idmap_req          *next;	/* queued, done, or waiting */
+	struct idmap_req          *hnext;	/* in progress, by lookup */
+	struct idmap_req          *waiters;	/* on this one's result */
+	struct idmap_client       *ic;
+	int                        nfsd;	/* upcall from nfsd, or REQ_REFRESH */
+	struct idmap_msg           im;
+	char                       authbuf[IDMAP_MAXMSGSZ];
+	struct nfstrace            trace;
+};
+
+#define REQ_HASH	256		/* buckets, a power of 2 */
+
+#define REQ_REFRESH	2		/* nfsd value of a refresh-ahead */
+
+static int worker_threads = 0;
+static enum nfstrace_dep idmap_dep = NFSTRACE_NSS;	/* where lookups go */
+static pthread_mutex_t req_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t req_more = PTHREAD_COND_INITIALIZER;
+static struct idmap_req *req_todo, **req_todo_tail = &req_todo;
+static struct idmap_req *req_done;
+static struct idmap_req *req_table[REQ_HASH];
+static int req_wake[2] = { -1, -1 };
+static struct event *req_event;
+
+/*
+ * The entries written to nfsd's caches, so that those nfsd keeps
+ * asking for can be written again shortly before they expire, rather
+ * than nfsd having to wait for an upcall.  Each upcall after the first
+ * for an entry earns it hot_refresh refreshes, up to HOT_CREDIT_MAX;
+ * an entry that has spent them expires, and is dropped from here.
+ * They are only used by the main loop.
+ */
+struct idmap_hot {
+	struct idmap_hot          *hnext;
+	short                      which;	/* IC_IDNAME or IC_NAMEID */
+	short                      credit;	/* refreshes left */
+	time_t                     expiry;
+	struct idmap_msg           im;
+	char                       authbuf[32];
+};
+
+#define HOT_HASH	4096		/* buckets, a power of 2 */
+#define HOT_MAX		16384		/* entries followed */
+#define HOT_CREDIT_MAX	8
+
+static int hot_refresh = 2;
+static int hot_count;
+static time_t hot_interval;
+static struct idmap_hot *hot_table[HOT_HASH];
+static struct event *hot_event;
 
 static void
 sig_die(int signal)
@@ -237,6 +320,7 @@ main(int argc, char **argv)
 	int ret;
 	char *progname;
 	char *conf_path = NULL;
+	char *method;
 
 	nobodyuser = NFS4NOBODY_USER;
 	nobodygroup = NFS4NOBODY_GROUP;
@@ -276,6 +360,10 @@ main(int argc, char **argv)
 			verbose = conf_get_num("General", "Verbosity", 0);
 			cache_entry_expiration = conf_get_num("General",
 					"Cache-Expiration", DEFAULT_IDMAP_CACHE_EXPIRY);
+			worker_threads = conf_get_num("General",
+					"Worker-Threads", 0);
+			hot_refresh = conf_get_num("General",
+					"Cache-Refresh", hot_refresh);
 			CONF_SAVE(xpipefsdir, conf_get_str("General", "Pipefs-Directory"));
 			if (xpipefsdir != NULL)
 				strlcpy(pipefsdir, xpipefsdir, sizeof(pipefsdir));
@@ -298,6 +386,10 @@ main(int argc, char **argv)
 		verbose = conf_get_num("General", "Verbosity", 0);
 		cache_entry_expiration = conf_get_num("General",
 				"cache-expiration", DEFAULT_IDMAP_CACHE_EXPIRY);
+		worker_threads = conf_get_num("General",
+				"worker-threads", 0);
+		hot_refresh = conf_get_num("General",
+				"cache-refresh", hot_refresh);
 		CONF_SAVE(nobodyuser, conf_get_str("Mapping", "Nobody-User"));
 		CONF_SAVE(nobodygroup, conf_get_str("Mapping", "Nobody-Group"));
 		if (conf_get_bool("General", "server-only", false))
@@ -305,6 +397,7 @@ main(int argc, char **argv)
 		if (conf_get_bool("General", "client-only", false))
 			serverstart = 0;
 	}
+	xlog_set_async("idmapd");
 
 	while ((opt = getopt(argc, argv, GETOPTSTR)) != -1)
 		switch (opt) {
@@ -341,6 +434,11 @@ main(int argc, char **argv)
 	strncat(pipefsdir, "/nfs", sizeof(pipefsdir)-1);
 
 	daemon_init(fg);
+	nfsmetrics_start("idmapd");
+	nfstrace_start("idmapd");
+	method = conf_get_str("Translation", "Method");
+	if (method && strstr(method, "umich_ldap"))
+		idmap_dep = NFSTRACE_LDAP;
 
 	if ((pw = getpwnam(nobodyuser)) == NULL)
 		errx(1, "Could not find user \"%s\"", nobodyuser);
@@ -361,6 +459,8 @@ main(int argc, char **argv)
 	evbase = event_base_new();
 	if (evbase == NULL)
 		errx(1, "Failed to create event base.");
+	if (worker_threads > 0)
+		start_workers();
 
 	if (verbose > 1)
 		xlog_warn("Expiration time is %d seconds.",
@@ -371,6 +471,8 @@ main(int argc, char **argv)
 			ret = flush_nfsd_idmap_cache();
 			if (ret)
 				xlog_err("main: Failed to flush nfsd idmap cache\n: %s", strerror(errno));
+			if (hot_refresh > 0)
+				start_refresh();
 		}
 	}
 
@@ -410,6 +512,7 @@ main(int argc, char **argv)
 			wd = inotify_add_watch(inotify_fd, pipefsdir, IN_CREATE | IN_DELETE);
 			if (wd < 0)
 				xlog_err("Unable to inotify_add_watch(%s): %s\n", pipefsdir, strerror(errno));
+			pipefs_wd = wd;
 		}
 
 		TAILQ_INIT(&icq);
@@ -432,7 +535,7 @@ main(int argc, char **argv)
 		evsignal_add(svrdirev, NULL);
 		if ( wd >= 0) {
 			inotifyev = event_new(evbase, inotify_fd,
-					      EV_READ | EV_PERSIST, dirscancb, &icq);
+					      EV_READ | EV_PERSIST, inotifycb, &icq);
 			if (inotifyev == NULL)
 				errx(1, "Failed to create inotify read event.");
 			event_add(inotifyev, NULL);
@@ -464,6 +567,8 @@ main(int argc, char **argv)
 	if (inotify_fd != -1)
 		close(inotify_fd);
 
+	if (hot_event)
+		event_free(hot_event);
 	if (initialize)
 		event_free(initialize);
 	if (rootdirev)
@@ -477,9 +582,124 @@ main(int argc, char **argv)
 	return 0;
 }
 
+static unsigned int
+client_hash(const char *clid)
+{
+	uint32_t h = 2166136261u;
+
+	while (*clid)
+		h = (h ^ (unsigned char)*clid++) * 16777619u;
+	return h & (CLIENT_HASH - 1);
+}
+
+static struct idmap_client *
+client_find(const char *clid)
+{
+	struct idmap_client *ic;
+
+	for (ic = client_table[client_hash(clid)]; ic; ic = ic->ic_hnext)
+		if (strcmp(ic->ic_clid, clid) == 0)
+			break;
+	return ic;
+}
+
+static void
+client_unhash(struct idmap_client *ic)
+{
+	struct idmap_client **icp;
+
+	for (icp = &client_table[client_hash(ic->ic_clid)]; *icp;
+	     icp = &(*icp)->ic_hnext)
+		if (*icp == ic) {
+			*icp = ic->ic_hnext;
+			break;
+		}
+}
+
+/*
+ * Start on the client in directory NAME of pipefsdir.  It is kept even
+ * if its idmap pipe is not there yet, since nfsopen() watches for it.
+ */
+static struct idmap_client *
+client_add(struct idmap_clientq *icq, const char *name)
+{
+	struct idmap_client *ic;
+	char path[PATH_MAX+256]; /* + sizeof(d_name) */
+	unsigned int h;
+
+	if ((ic = calloc(1, sizeof(*ic))) == NULL)
+		return NULL;
+	strlcpy(ic->ic_clid, name + 4, sizeof(ic->ic_clid));
+	ic->ic_fd = -1;
+	ic->ic_wd = -1;
+	snprintf(path, sizeof(path), "%s/%s", pipefsdir, name);
+
+	if ((ic->ic_dirfd = open(path, O_RDONLY, 0)) == -1) {
+		if (verbose > 0)
+			xlog_warn("client_add: open(%s): %s", path, strerror(errno));
+		free(ic);
+		return NULL;
+	}
+
+	strlcat(path, "/idmap", sizeof(path));
+	strlcpy(ic->ic_path, path, sizeof(ic->ic_path));
+
+	if (nfsopen(ic) == -1 && ic->ic_wd < 0) {
+		close(ic->ic_dirfd);
+		free(ic);
+		return NULL;
+	}
+
+	if (verbose > 2)
+		xlog_warn("New client: %s", ic->ic_clid);
+
+	ic->ic_id = "Client";
+
+	TAILQ_INSERT_TAIL(icq, ic, ic_next);
+	h = client_hash(ic->ic_clid);
+	ic->ic_hnext = client_table[h];
+	client_table[h] = ic;
+	return ic;
+}
+
 static void
-flush_inotify(int fd)
+client_remove(struct idmap_clientq *icq, struct idmap_client *ic)
 {
+	if (ic->ic_event)
+		event_free(ic->ic_event);
+	if (ic->ic_fd != -1)
+		close(ic->ic_fd);
+	if (ic->ic_dirfd != -1)
+		close(ic->ic_dirfd);
+	TAILQ_REMOVE(icq, ic, ic_next);
+	client_unhash(ic);
+	if (verbose > 2) {
+		xlog_warn("Stale client: %s", ic->ic_clid);
+		xlog_warn("\t-> closed %s", ic->ic_path);
+	}
+	ic->ic_fd = -1;
+	client_free(ic);
+}
+
+static int
+is_client_dir(const char *name)
+{
+	return strncmp(name, "clnt", 4) == 0 && name[4] != '\0';
+}
+
+/*
+ * Each directory created in or deleted from pipefsdir adds or removes
+ * just its client.  Something created in a client's directory may be
+ * the idmap pipe it was waiting for.  Only when the kernel has dropped
+ * events is the whole of pipefsdir scanned again.
+ */
+static void
+inotifycb(int fd, short which, void *data)
+{
+	struct idmap_clientq *icq = data;
+	struct idmap_client *ic;
+	bool rescan = false;
+
 	while (true) {
 		char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
 		const struct inotify_event *ev;
@@ -500,102 +720,80 @@ flush_inotify(int fd)
 			if (verbose > 2)
 				xlog_warn("pipefs inotify: wd=%i, mask=0x%08x, len=%i, name=%s",
 				  ev->wd, ev->mask, ev->len, ev->len ? ev->name : "");
+
+			if (ev->mask & IN_Q_OVERFLOW) {
+				rescan = true;
+				continue;
+			}
+			if (ev->wd == pipefs_wd) {
+				if (!ev->len || !is_client_dir(ev->name))
+					continue;
+				ic = client_find(ev->name + 4);
+				if ((ev->mask & IN_CREATE) && ic == NULL)
+					client_add(icq, ev->name);
+				else if ((ev->mask & IN_DELETE) && ic != NULL)
+					client_remove(icq, ic);
+				continue;
+			}
+			if (!(ev->mask & IN_CREATE))
+				continue;
+			/* Few clients are ever left waiting */
+			TAILQ_FOREACH(ic, icq, ic_next)
+				if (ic->ic_fd == -1 && ic->ic_wd == ev->wd) {
+					ic->ic_wd = -1;
+					nfsopen(ic);
+					break;
+				}
 		}
 	}
+
+	if (rescan) {
+		xlog_warn("pipefs inotify: events lost, rescanning %s",
+			  pipefsdir);
+		dirscancb(-1, which, data);
+	}
 }
 
 static void
-dirscancb(int fd, short UNUSED(which), void *data)
+dirscancb(int UNUSED(fd), short UNUSED(which), void *data)
 {
-	int nent, i;
-	struct dirent **ents;
+	DIR *dir;
+	struct dirent *de;
 	struct idmap_client *ic, *nextic;
-	char path[PATH_MAX+256]; /* + sizeof(d_name) */
 	struct idmap_clientq *icq = data;
 
-	if (fd != -1)
-		flush_inotify(fd);
-
 	TAILQ_FOREACH(ic, icq, ic_next) {
 		ic->ic_scanned = 0;
 	}
 
-	nent = scandir(pipefsdir, &ents, NULL, alphasort);
-	if (nent == -1) {
-		xlog_warn("dirscancb: scandir(%s): %s", pipefsdir, strerror(errno));
+	dir = opendir(pipefsdir);
+	if (dir == NULL) {
+		xlog_warn("dirscancb: opendir(%s): %s", pipefsdir, strerror(errno));
 		return;
 	}
 
-	for (i = 0;  i < nent; i++) {
-		if (ents[i]->d_reclen > 4 &&
-		    strncmp(ents[i]->d_name, "clnt", 4) == 0) {
-			TAILQ_FOREACH(ic, icq, ic_next)
-			    if (strcmp(ents[i]->d_name + 4, ic->ic_clid) == 0)
-				    break;
-			if (ic != NULL)
-				goto next;
-
-			if ((ic = calloc(1, sizeof(*ic))) == NULL)
-				goto out;
-			strlcpy(ic->ic_clid, ents[i]->d_name + 4,
-			    sizeof(ic->ic_clid));
-			path[0] = '\0';
-			snprintf(path, sizeof(path), "%s/%s",
-			    pipefsdir, ents[i]->d_name);
-
-			if ((ic->ic_dirfd = open(path, O_RDONLY, 0)) == -1) {
-				if (verbose > 0)
-					xlog_warn("dirscancb: open(%s): %s", path, strerror(errno));
-				free(ic);
-				goto out;
-			}
-
-			strlcat(path, "/idmap", sizeof(path));
-			strlcpy(ic->ic_path, path, sizeof(ic->ic_path));
-
-			if (nfsopen(ic) == -1) {
-				close(ic->ic_dirfd);
-				free(ic);
-				goto out;
-			}
-
-			if (verbose > 2)
-				xlog_warn("New client: %s", ic->ic_clid);
-
-			ic->ic_id = "Client";
-
-			TAILQ_INSERT_TAIL(icq, ic, ic_next);
-
-		next:
-			ic->ic_scanned = 1;
+	while ((de = readdir(dir)) != NULL) {
+		if (!is_client_dir(de->d_name))
+			continue;
+		ic = client_find(de->d_name + 4);
+		if (ic == NULL)
+			ic = client_add(icq, de->d_name);
+		else if (ic->ic_fd == -1) {
+			ic->ic_wd = -1;
+			nfsopen(ic);
 		}
+		if (ic != NULL)
+			ic->ic_scanned = 1;
 	}
+	closedir(dir);
 
 	ic = TAILQ_FIRST(icq);
 	while(ic != NULL) {
 		nextic=TAILQ_NEXT(ic, ic_next);
-		if (!ic->ic_scanned) {
-			if (ic->ic_event)
-				event_free(ic->ic_event);
-			if (ic->ic_fd != -1)
-				close(ic->ic_fd);
-			if (ic->ic_dirfd != -1)
-				close(ic->ic_dirfd);
-			TAILQ_REMOVE(icq, ic, ic_next);
-			if (verbose > 2) {
-				xlog_warn("Stale client: %s", ic->ic_clid);
-				xlog_warn("\t-> closed %s", ic->ic_path);
-			}
-			free(ic);
-		}
+		if (!ic->ic_scanned)
+			client_remove(icq, ic);
 		ic = nextic;
 	}
-
-out:
-	for (i = 0;  i < nent; i++)
-		free(ents[i]);
-	free(ents);
-	return;
 }
 
 static void
@@ -610,27 +808,39 @@ clntscancb(int UNUSED(fd), short UNUSED(which), void *data)
 	struct idmap_clientq *icq = data;
 	struct idmap_client *ic, *ic_next;
 
+	/* This handler takes SIGUSR2 over from nfstrace_start() */
+	nfstrace_dump();
 	for (ic = TAILQ_FIRST(icq); ic != NULL; ic = ic_next) { 
 		ic_next = TAILQ_NEXT(ic, ic_next);
-		if (ic->ic_fd == -1 && nfsopen(ic) == -1) {
+		if (ic->ic_fd != -1)
+			continue;
+		ic->ic_wd = -1;
+		if (nfsopen(ic) == -1 && ic->ic_wd < 0) {
 			close(ic->ic_dirfd);
 			TAILQ_REMOVE(icq, ic, ic_next);
-			free(ic);
+			client_unhash(ic);
+			client_free(ic);
 		}
 	}
 }
 
+/*
+ * Upcalls and replies use the cache channel encoding, so the fields are
+ * decoded in place in the read buffer with qword_get_inplace(), which
+ * only has work to do for escaped characters, and replies are encoded
+ * straight into the write buffer.
+ */
 static void
 nfsdcb(int UNUSED(fd), short which, void *data)
 {
 	struct idmap_client *ic = data;
 	struct idmap_msg im;
-	u_char buf[IDMAP_MAXMSGSZ + 1];
+	struct nfstrace trace;
+	char buf[IDMAP_MAXMSGSZ + 1];
 	ssize_t len;
-	ssize_t bsiz;
-	char *bp, typebuf[IDMAP_MAXMSGSZ],
-		buf1[IDMAP_MAXMSGSZ], authbuf[IDMAP_MAXMSGSZ], *p;
+	char *bp, *typebuf, *authbuf, *field;
 	unsigned long tmp;
+	int flen;
 
 	if (which != EV_READ)
 		return;
@@ -649,16 +859,19 @@ nfsdcb(int UNUSED(fd), short which, void *data)
 
 	/* Get rid of newline and terminate buffer*/
 	buf[len - 1] = '\0';
-	bp = (char *)buf;
+	bp = buf;
+	nfstrace_read(&trace, ic->ic_which == IC_NAMEID ?
+		      "nfs4.nametoid" : "nfs4.idtoname", buf);
 
 	memset(&im, 0, sizeof(im));
 
 	/* Authentication name -- ignored for now*/
-	if (getfield(&bp, authbuf, sizeof(authbuf)) == -1) {
+	if (qword_get_inplace(&bp, &authbuf) <= 0 ||
+	    strlen(authbuf) >= IDMAP_MAXMSGSZ) {
 		xlog_warn("nfsdcb: bad authentication name in upcall\n");
 		return;
 	}
-	if (getfield(&bp, typebuf, sizeof(typebuf)) == -1) {
+	if (qword_get_inplace(&bp, &typebuf) <= 0) {
 		xlog_warn("nfsdcb: bad type in upcall\n");
 		return;
 	}
@@ -672,22 +885,25 @@ nfsdcb(int UNUSED(fd), short which, void *data)
 	switch (ic->ic_which) {
 	case IC_NAMEID:
 		im.im_conv = IDMAP_CONV_NAMETOID;
-		if (getfield(&bp, im.im_name, sizeof(im.im_name)) == -1) {
+		flen = qword_get_inplace(&bp, &field);
+		if (flen <= 0 || flen >= (int)sizeof(im.im_name)) {
 			xlog_warn("nfsdcb: bad name in upcall\n");
 			return;
 		}
+		memcpy(im.im_name, field, flen + 1);
 		break;
 	case IC_IDNAME:
 		im.im_conv = IDMAP_CONV_IDTONAME;
-		if (getfield(&bp, buf1, sizeof(buf1)) == -1) {
+		if (qword_get_inplace(&bp, &field) <= 0) {
 			xlog_warn("nfsdcb: bad id in upcall\n");
 			return;
 		}
-		tmp = strtoul(buf1, (char **)NULL, 10);
+		errno = 0;
+		tmp = strtoul(field, NULL, 10);
 		im.im_id = (u_int32_t)tmp;
 		if ((tmp == ULONG_MAX && errno == ERANGE)
 				|| (unsigned long)im.im_id != tmp) {
-			xlog_warn("nfsdcb: id '%s' too big!\n", buf1);
+			xlog_warn("nfsdcb: id '%s' too big!\n", field);
 			return;
 		}
 		break;
@@ -696,79 +912,205 @@ nfsdcb(int UNUSED(fd), short which, void *data)
 		return;
 	}
 
+	if (worker_threads > 0) {
+		queue_req(ic, 1, authbuf, &im, &trace);
+		return;
+	}
+	nfstrace_enter(&trace);
 	imconv(ic, &im);
+	nfsdreply(ic, authbuf, &im, 0);
+	nfstrace_done();
+}
 
-	buf[0] = '\0';
-	bp = (char *)buf;
-	bsiz = sizeof(buf);
+static int
+hot_same(const struct idmap_hot *h, int which, const struct idmap_msg *im)
+{
+	if (h->which != which || h->im.im_type != im->im_type)
+		return 0;
+	if (which == IC_NAMEID)
+		return strncmp(h->im.im_name, im->im_name, IDMAP_NAMESZ) == 0;
+	return h->im.im_id == im->im_id;
+}
+
+/* Note the reply for IM from nfsd cache IC, which expires at EXPIRY */
+static void
+hot_note(struct idmap_client *ic, const char *authbuf,
+	 const struct idmap_msg *im, time_t expiry, int refresh)
+{
+	struct idmap_hot *h, **head;
+
+	if (hot_refresh <= 0 || strlen(authbuf) >= sizeof(h->authbuf))
+		return;
+
+	head = &hot_table[lookup_hash(im) & (HOT_HASH - 1)];
+	for (h = *head; h; h = h->hnext)
+		if (hot_same(h, ic->ic_which, im))
+			break;
+	if (h == NULL) {
+		if (refresh || hot_count >= HOT_MAX)
+			return;
+		h = calloc(1, sizeof(*h));
+		if (h == NULL)
+			return;
+		h->which = ic->ic_which;
+		h->im = *im;
+		h->hnext = *head;
+		*head = h;
+		hot_count++;
+	} else if (!refresh) {
+		/* asked for again, after its last entry expired */
+		h->credit += hot_refresh;
+		if (h->credit > HOT_CREDIT_MAX)
+			h->credit = HOT_CREDIT_MAX;
+	}
+	strcpy(h->authbuf, authbuf);
+	h->expiry = expiry;
+}
+
+/*
+ * Look the entries due to expire before the next call up again, if
+ * they have refreshes left, and forget those that have expired.
+ */
+static void
+hotcb(int UNUSED(fd), short UNUSED(which), void *UNUSED(data))
+{
+	struct idmap_hot *h, **hp;
+	struct idmap_client *ic;
+	struct idmap_msg im;
+	time_t now = time(NULL);
+	int i, refreshed = 0;
+
+	for (i = 0; i < HOT_HASH; i++) {
+		hp = &hot_table[i];
+		while ((h = *hp) != NULL) {
+			if (h->expiry > now + 2 * hot_interval) {
+				hp = &h->hnext;
+				continue;
+			}
+			ic = &nfsd_ic[h->which];
+			if (h->credit > 0 && h->expiry > now && ic->ic_fd != -1) {
+				h->credit--;
+				im = h->im;
+				im.im_status = IDMAP_STATUS_SUCCESS;
+				if (worker_threads > 0)
+					queue_req(ic, REQ_REFRESH, h->authbuf, &im,
+						  NULL);
+				else {
+					imconv(ic, &im);
+					nfsdreply(ic, h->authbuf, &im, 1);
+				}
+				refreshed++;
+				hp = &h->hnext;
+				continue;
+			}
+			if (h->expiry > now) {
+				hp = &h->hnext;
+				continue;
+			}
+			*hp = h->hnext;
+			free(h);
+			hot_count--;
+		}
+	}
+	if (verbose > 2 && refreshed)
+		xlog_warn("hotcb: refreshed %d of %d nfsd cache entries",
+			  refreshed, hot_count);
+}
+
+static void
+start_refresh(void)
+{
+	struct timeval tv = { 0, 0 };
+
+	srandom(time(NULL) ^ getpid());
+	hot_interval = cache_entry_expiration / 20;
+	if (hot_interval < 1)
+		hot_interval = 1;
+	tv.tv_sec = hot_interval;
+	hot_event = event_new(evbase, -1, EV_PERSIST, hotcb, NULL);
+	if (hot_event == NULL) {
+		xlog_warn("start_refresh: Failed to create event; "
+			  "nfsd cache entries won't be refreshed");
+		hot_refresh = 0;
+		return;
+	}
+	event_add(hot_event, &tv);
+}
+
+/*
+ * Write the reply to an nfsd upcall, that came with AUTHBUF, or, with
+ * REFRESH, a new copy of an entry in nfsd's cache.  Expiries are spread
+ * over the last tenth of cache_entry_expiration, so that entries added
+ * together don't all expire, and come back as upcalls, together.
+ */
+static void
+nfsdreply(struct idmap_client *ic, char *authbuf, struct idmap_msg *im,
+	  int refresh)
+{
+	char buf[IDMAP_MAXMSGSZ + 1], *bp = buf;
+	int blen = sizeof(buf);
+	uint64_t expiry = (int64_t)time(NULL) + cache_entry_expiration -
+			  random() % (cache_entry_expiration / 10 + 1);
+
+	hot_note(ic, authbuf, im, expiry, refresh);
 
 	/* Authentication name */
-	addfield(&bp, &bsiz, authbuf);
+	qword_add(&bp, &blen, authbuf);
+	/* Type */
+	qword_add(&bp, &blen, im->im_type == IDMAP_TYPE_USER ?
+		  "user" : "group");
 
 	switch (ic->ic_which) {
 	case IC_NAMEID:
-		/* Type */
-		p = im.im_type == IDMAP_TYPE_USER ? "user" : "group";
-		addfield(&bp, &bsiz, p);
 		/* Name */
-		addfield(&bp, &bsiz, im.im_name);
+		qword_add(&bp, &blen, im->im_name);
 		/* expiry */
-		snprintf(buf1, sizeof(buf1), "%" PRId64,
-			 (int64_t)time(NULL) + cache_entry_expiration);
-		addfield(&bp, &bsiz, buf1);
+		qword_adduint64(&bp, &blen, expiry);
 		/* Note that we don't want to write the id if the mapping
 		 * failed; instead, by leaving it off, we write a negative
 		 * cache entry which will result in an error returned to
 		 * the client.  We don't want a chown or setacl referring
 		 * to an unknown user to result in giving permissions to
 		 * "nobody"! */
-		if (im.im_status == IDMAP_STATUS_SUCCESS) {
+		if (im->im_status == IDMAP_STATUS_SUCCESS)
 			/* ID */
-			snprintf(buf1, sizeof(buf1), "%u", im.im_id);
-			addfield(&bp, &bsiz, buf1);
-
-		}
-		//if (bsiz == sizeof(buf)) /* XXX */
-
-		bp[-1] = '\n';
-
+			qword_adduint64(&bp, &blen, im->im_id);
 		break;
 	case IC_IDNAME:
-		/* Type */
-		p = im.im_type == IDMAP_TYPE_USER ? "user" : "group";
-		addfield(&bp, &bsiz, p);
 		/* ID */
-		snprintf(buf1, sizeof(buf1), "%u", im.im_id);
-		addfield(&bp, &bsiz, buf1);
+		qword_adduint64(&bp, &blen, im->im_id);
 		/* expiry */
-		snprintf(buf1, sizeof(buf1), "%" PRId64,
-			 (int64_t)time(NULL) + cache_entry_expiration);
-		addfield(&bp, &bsiz, buf1);
+		qword_adduint64(&bp, &blen, expiry);
 		/* Note we're ignoring the status field in this case; we'll
 		 * just map to nobody instead. */
 		/* Name */
-		addfield(&bp, &bsiz, im.im_name);
-
-		bp[-1] = '\n';
-
+		qword_add(&bp, &blen, im->im_name);
 		break;
 	default:
 		xlog_warn("nfsdcb: Unknown which type %d", ic->ic_which);
 		return;
 	}
 
-	bsiz = sizeof(buf) - bsiz;
+	if (blen < 0) {
+		xlog_warn("nfsdreply: reply to %s too long", ic->ic_path);
+		return;
+	}
+	bp[-1] = '\n';
 
-	if (atomicio((void*)write, ic->ic_fd, buf, bsiz) != bsiz)
+	if (atomicio((void*)write, ic->ic_fd, buf, bp - buf) != bp - buf)
 		xlog_warn("nfsdcb: write(%s) failed: errno %d (%s)",
 			     ic->ic_path, errno, strerror(errno));
+	nfstrace_downcall();
 }
 
 static void
 imconv(struct idmap_client *ic, struct idmap_msg *im)
 {
+	unsigned long long start = 0;
 	u_int32_t len;
 
+	if (nfstrace_enabled())
+		start = nfsmetric_clock();
 	switch (im->im_conv) {
 	case IDMAP_CONV_IDTONAME:
 		idtonameres(im);
@@ -796,6 +1138,8 @@ imconv(struct idmap_client *ic, struct idmap_msg *im)
 		im->im_status |= IDMAP_STATUS_INVALIDMSG;
 		break;
 	}
+	if (start)
+		nfstrace_dep(idmap_dep, nfsmetric_clock() - start);
 }
 
 static void
@@ -813,19 +1157,243 @@ nfscb(int UNUSED(fd), short which, void *data)
 		return;
 	}
 
+	if (worker_threads > 0) {
+		queue_req(ic, 0, NULL, &im, NULL);
+		return;
+	}
 	imconv(ic, &im);
+	nfsreply(ic, &im);
+}
 
+/* Write the reply to an NFS client upcall */
+static void
+nfsreply(struct idmap_client *ic, struct idmap_msg *im)
+{
 	/* XXX: I don't like ignoring this error in the id->name case,
 	 * but we've never returned it, and I need to check that the client
 	 * can handle it gracefully before starting to return it now. */
 
-	if (im.im_status == IDMAP_STATUS_LOOKUPFAIL)
-		im.im_status = IDMAP_STATUS_SUCCESS;
+	if (im->im_status == IDMAP_STATUS_LOOKUPFAIL)
+		im->im_status = IDMAP_STATUS_SUCCESS;
 
-	if (atomicio((void*)write, ic->ic_fd, &im, sizeof(im)) != sizeof(im))
+	if (atomicio((void*)write, ic->ic_fd, im, sizeof(*im)) != sizeof(*im))
 		xlog_warn("nfscb: write(%s): %s", ic->ic_path, strerror(errno));
 }
 
+static uint32_t
+lookup_hash(const struct idmap_msg *im)
+{
+	uint32_t h = 2166136261u;
+	const char *p;
+
+	h = (h ^ im->im_conv) * 16777619u;
+	h = (h ^ im->im_type) * 16777619u;
+	if (im->im_conv == IDMAP_CONV_NAMETOID)
+		for (p = im->im_name; p < im->im_name + IDMAP_NAMESZ && *p; p++)
+			h = (h ^ (unsigned char)*p) * 16777619u;
+	else
+		h = (h ^ im->im_id) * 16777619u;
+	return h;
+}
+
+static unsigned int
+req_hash(const struct idmap_msg *im)
+{
+	return lookup_hash(im) & (REQ_HASH - 1);
+}
+
+static int
+same_lookup(const struct idmap_msg *a, const struct idmap_msg *b)
+{
+	if (a->im_conv != b->im_conv || a->im_type != b->im_type)
+		return 0;
+	if (a->im_conv == IDMAP_CONV_NAMETOID)
+		return strncmp(a->im_name, b->im_name, IDMAP_NAMESZ) == 0;
+	return a->im_id == b->im_id;
+}
+
+/*
+ * Hand the lookup for an upcall from IC to the workers.  TRACE, if
+ * not NULL, is the upcall's record, started by nfstrace_read().
+ */
+static void
+queue_req(struct idmap_client *ic, int nfsd, char *authbuf,
+	  struct idmap_msg *im, struct nfstrace *trace)
+{
+	struct idmap_req *req, **head, *r;
+
+	req = calloc(1, sizeof(*req));
+	if (req == NULL) {
+		/* do it here, then */
+		if (trace)
+			nfstrace_enter(trace);
+		imconv(ic, im);
+		if (nfsd)
+			nfsdreply(ic, authbuf, im, nfsd == REQ_REFRESH);
+		else
+			nfsreply(ic, im);
+		nfstrace_done();
+		return;
+	}
+	req->ic = ic;
+	req->nfsd = nfsd;
+	req->im = *im;
+	if (authbuf)
+		strlcpy(req->authbuf, authbuf, sizeof(req->authbuf));
+	if (trace)
+		req->trace = *trace;
+	ic->ic_pending++;
+
+	pthread_mutex_lock(&req_lock);
+	head = &req_table[req_hash(im)];
+	for (r = *head; r; r = r->hnext)
+		if (same_lookup(&r->im, im)) {
+			req->next = r->waiters;
+			r->waiters = req;
+			pthread_mutex_unlock(&req_lock);
+			return;
+		}
+	req->hnext = *head;
+	*head = req;
+	*req_todo_tail = req;
+	req_todo_tail = &req->next;
+	pthread_cond_signal(&req_more);
+	pthread_mutex_unlock(&req_lock);
+}
+
+static void *
+worker_fn(void *UNUSED(arg))
+{
+	struct idmap_req *req, **rp;
+	char c = 0;
+	int wake;
+
+	pthread_mutex_lock(&req_lock);
+	for (;;) {
+		while ((req = req_todo) == NULL)
+			pthread_cond_wait(&req_more, &req_lock);
+		req_todo = req->next;
+		if (req_todo == NULL)
+			req_todo_tail = &req_todo;
+		req->next = NULL;
+		pthread_mutex_unlock(&req_lock);
+
+		nfstrace_enter(&req->trace);
+		imconv(req->ic, &req->im);
+		nfstrace_leave();
+
+		pthread_mutex_lock(&req_lock);
+		rp = &req_table[req_hash(&req->im)];
+		while (*rp != req)
+			rp = &(*rp)->hnext;
+		*rp = req->hnext;
+		wake = req_done == NULL;
+		req->next = req_done;
+		req_done = req;
+		if (wake && write(req_wake[1], &c, 1) < 0 && errno != EAGAIN)
+			xlog_warn("worker: write: %s", strerror(errno));
+	}
+	return NULL;
+}
+
+static void
+req_reply(struct idmap_req *req)
+{
+	struct idmap_client *ic = req->ic;
+
+	nfstrace_enter(&req->trace);
+	if (!ic->ic_dead && ic->ic_fd != -1) {
+		if (req->nfsd)
+			nfsdreply(ic, req->authbuf, &req->im,
+				  req->nfsd == REQ_REFRESH);
+		else
+			nfsreply(ic, &req->im);
+	}
+	nfstrace_done();
+	if (--ic->ic_pending == 0 && ic->ic_dead)
+		free(ic);
+	free(req);
+}
+
+/* Write the replies for the lookups the workers have done */
+static void
+reqdonecb(int fd, short UNUSED(which), void *UNUSED(data))
+{
+	struct idmap_req *req, *next, *w, *wnext;
+	char buf[64];
+
+	while (read(fd, buf, sizeof(buf)) > 0)
+		;
+	pthread_mutex_lock(&req_lock);
+	req = req_done;
+	req_done = NULL;
+	pthread_mutex_unlock(&req_lock);
+
+	for (; req; req = next) {
+		next = req->next;
+		/* the lookup is the same, (only) the replies may differ */
+		for (w = req->waiters; w; w = wnext) {
+			wnext = w->next;
+			w->im = req->im;
+			req_reply(w);
+		}
+		req_reply(req);
+	}
+}
+
+static void
+start_workers(void)
+{
+	pthread_attr_t attr;
+	pthread_t th;
+	int i, ret, started = 0;
+
+	if (pipe2(req_wake, O_NONBLOCK | O_CLOEXEC) < 0) {
+		xlog_err("Unable to create worker pipe: %s", strerror(errno));
+		goto out_err;
+	}
+	req_event = event_new(evbase, req_wake[0], EV_READ | EV_PERSIST,
+			      reqdonecb, NULL);
+	if (req_event == NULL) {
+		xlog_err("Failed to create worker pipe event.");
+		close(req_wake[0]);
+		close(req_wake[1]);
+		goto out_err;
+	}
+	event_add(req_event, NULL);
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	for (i = 0; i < worker_threads; i++) {
+		ret = pthread_create(&th, &attr, worker_fn, NULL);
+		if (ret != 0) {
+			xlog_err("Unable to start worker thread: %s",
+				 strerror(ret));
+			break;
+		}
+		started++;
+	}
+	pthread_attr_destroy(&attr);
+	if (started > 0) {
+		worker_threads = started;
+		return;
+	}
+
+out_err:
+	/* look names up in the main loop, then */
+	worker_threads = 0;
+}
+
+/* Free IC, or, if lookups for it are being done, once they are */
+static void
+client_free(struct idmap_client *ic)
+{
+	if (ic->ic_pending > 0)
+		ic->ic_dead = 1;
+	else
+		free(ic);
+}
+
 static void
 nfsdclose_one(struct idmap_client *ic)
 {
@@ -927,7 +1495,7 @@ nfsopen(struct idmap_client *ic)
 			if (!slash)
 				return -1;
 			*slash = 0;
-			inotify_add_watch(inotify_fd, ic->ic_path, IN_CREATE | IN_ONLYDIR | IN_ONESHOT);
+			ic->ic_wd = inotify_add_watch(inotify_fd, ic->ic_path, IN_CREATE | IN_ONLYDIR | IN_ONESHOT);
 			*slash = '/';
 			if (verbose > 2)
 				xlog_warn("Path %s not available. waiting...", ic->ic_path);
@@ -1019,73 +1587,3 @@ nametoidres(struct idmap_msg *im)
 	}
 }
 
-static int
-addfield(char **bpp, ssize_t *bsizp, char *fld)
-{
-	char ch, *bp = *bpp;
-	ssize_t bsiz = *bsizp;
-
-	while ((ch = *fld++) != '\0' && bsiz > 0) {
-		switch(ch) {
-		case ' ':
-		case '\t':
-		case '\n':
-		case '\\':
-			if (bsiz >= 4) {
-				bp += snprintf(bp, bsiz, "\\%03o", ch);
-				bsiz -= 4;
-			}
-			break;
-		default:
-			*bp++ = ch;
-			bsiz--;
-			break;
-		}
-	}
-
-	if (bsiz < 1 || ch != '\0')
-		return (-1);
-
-	*bp++ = ' ';
-	bsiz--;
-
-	*bpp = bp;
-	*bsizp = bsiz;
-
-	return (0);
-}
-
-static int
-getfield(char **bpp, char *fld, size_t fldsz)
-{
-	char *bp;
-	unsigned int val; 
-	int n;
-
-	while ((bp = strsep(bpp, " ")) != NULL && bp[0] == '\0')
-		;
-
-	if (bp == NULL || bp[0] == '\0' || bp[0] == '\n')
-		return (-1);
-
-	while (*bp != '\0' && fldsz > 1) {
-		if (*bp == '\\') {
-			if ((n = sscanf(bp, "\\%03o", &val)) != 1)
-				return (-1);
-			if (val > UCHAR_MAX)
-				return (-1);
-			*fld++ = val;
-			bp += 4;
-		} else {
-			*fld++ = *bp;
-			bp++;
-		}
-		fldsz--;
-	}
-
-	if (*bp != '\0')
-		return (-1);
-	*fld = '\0';
-
-	return (0);
-}
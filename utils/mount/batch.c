@@ -0,0 +1,459 @@
+/*
+ * batch.c -- mount many NFS file systems from one mount.nfs
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 0211-1301 USA
+ *
+ */
+
+/*
+ * "mount.nfs -a" mounts the NFS entries of /etc/fstab itself, instead
+ * of "mount -a" running a mount.nfs for each of them.  nfsmount.conf
+ * and fstab are read once.  Each entry is still mounted by a child
+ * process of its own, running the same code as a single mount.nfs, so
+ * what is reported for each mount does not change.
+ *
+ * Up to NFS_BATCH_JOBS (or -j) entries are mounted at once.  The first
+ * entry for each server is mounted before the others for the same
+ * server start, so that they can use the version, ports and address
+ * it left in the server cache instead of negotiating them again.  An
+ * entry whose mount point lies under another entry's waits for that
+ * one too.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <mntent.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "xcommon.h"
+#include "nls.h"
+#include "error.h"
+#include "utils.h"
+#include "mnttab.h"
+#include "batch.h"
+
+#ifndef NFS_BATCH_JOBS
+#define NFS_BATCH_JOBS		(4)
+#endif
+
+#ifndef _PATH_FSTAB
+#define _PATH_FSTAB		"/etc/fstab"
+#endif
+
+extern char *progname;
+extern int verbose;
+
+enum {
+	NFS_BATCH_WAITING = 0,
+	NFS_BATCH_RUNNING,
+	NFS_BATCH_DONE,
+};
+
+struct nfs_batch_entry {
+	char		*spec,
+			*dir,
+			*opts,
+			*host;
+	unsigned int	leader;		/* first entry for this host */
+	int		state;
+	pid_t		pid;
+};
+
+static struct option batch_longopts[] = {
+  { "all", 0, 0, 'a' },
+  { "types", 1, 0, 't' },
+  { "test-opts", 1, 0, 'O' },
+  { "jobs", 1, 0, 'j' },
+  { "fake", 0, 0, 'f' },
+  { "no-mtab", 0, 0, 'n' },
+  { "read-only", 0, 0, 'r' },
+  { "ro", 0, 0, 'r' },
+  { "verbose", 0, 0, 'v' },
+  { "read-write", 0, 0, 'w' },
+  { "rw", 0, 0, 'w' },
+  { "sloppy", 0, 0, 's' },
+  { "options", 1, 0, 'o' },
+  { NULL, 0, 0, 0 }
+};
+
+/**
+ * nfs_batch_requested - was mount.nfs asked to mount all of fstab?
+ * @argc: count of command line arguments
+ * @argv: command line arguments
+ *
+ * Returns 1 if "-a" or "--all" is among the options, otherwise zero.
+ */
+int nfs_batch_requested(int argc, char **argv)
+{
+	int i;
+
+	for (i = 1; i < argc; i++) {
+		const char *p = argv[i];
+
+		if (strcmp(p, "--") == 0)
+			break;
+		if (strcmp(p, "--all") == 0)
+			return 1;
+		if (p[0] != '-' || p[1] == '-')
+			continue;
+		for (p++; *p != '\0'; p++) {
+			if (*p == 'a')
+				return 1;
+			if (strchr("otOj", *p) != NULL) {
+				if (p[1] == '\0')
+					i++;
+				break;
+			}
+		}
+	}
+	return 0;
+}
+
+/* Is there a "@name" or "@name=..." option in the list @opts? */
+static int nfs_batch_hasopt(const char *opts, const char *name, size_t len)
+{
+	const char *p = opts;
+
+	while (p != NULL && *p != '\0') {
+		if (strncmp(p, name, len) == 0 &&
+		    (p[len] == '\0' || p[len] == ',' || p[len] == '='))
+			return 1;
+		p = strchr(p, ',');
+		if (p != NULL)
+			p++;
+	}
+	return 0;
+}
+
+/*
+ * Does @opts pass the -O @filter?  Each option in the filter must be
+ * present, or absent if it is prefixed with "no".
+ */
+static int nfs_batch_match_opts(const char *opts, const char *filter)
+{
+	const char *p = filter, *end;
+	size_t len;
+	int neg;
+
+	while (p != NULL && *p != '\0') {
+		end = strchr(p, ',');
+		len = end ? (size_t)(end - p) : strlen(p);
+		neg = len > 2 && strncmp(p, "no", 2) == 0;
+		if (len && nfs_batch_hasopt(opts, neg ? p + 2 : p,
+					    neg ? len - 2 : len) == neg)
+			return 0;
+		p = end ? end + 1 : NULL;
+	}
+	return 1;
+}
+
+/* Is @type one of the comma-separated @types? */
+static int nfs_batch_match_type(const char *type, const char *types)
+{
+	return nfs_batch_hasopt(types, type, strlen(type));
+}
+
+/* The server part of "server:/path" or "[server]:/path" */
+static char *nfs_batch_host(const char *spec)
+{
+	const char *end;
+
+	if (spec[0] == '[') {
+		end = strchr(spec, ']');
+		if (end != NULL)
+			return strndup(spec + 1, end - spec - 1);
+	}
+	end = strchr(spec, ':');
+	if (end == NULL)
+		return xstrdup(spec);
+	return strndup(spec, end - spec);
+}
+
+static int nfs_batch_mounted(const char *spec, const char *dir)
+{
+	const struct mnttab_entry *me;
+	size_t pos = MNTTAB_START;
+	struct mnttab *mt;
+	int found = 0;
+
+	mnttab_ignore_rootdir();
+	mt = mnttab_get();
+	if (mt == NULL)
+		return 0;
+	while (!found && (me = mnttab_next_path(mt, dir, &pos)) != NULL)
+		found = strcmp(me->me_source, spec) == 0;
+	mnttab_put(mt);
+	return found;
+}
+
+/* Does the mount point @dir lie at or under @top? */
+static int nfs_batch_under(const char *dir, const char *top)
+{
+	size_t len = strlen(top);
+
+	if (strncmp(dir, top, len) != 0)
+		return 0;
+	return dir[len] == '\0' || dir[len] == '/' ||
+		(len > 0 && top[len - 1] == '/');
+}
+
+static int nfs_batch_ready(const struct nfs_batch_entry *entries,
+			   const unsigned int i)
+{
+	unsigned int j;
+
+	if (entries[entries[i].leader].state != NFS_BATCH_DONE &&
+	    entries[i].leader != i)
+		return 0;
+	for (j = 0; j < i; j++)
+		if (entries[j].state != NFS_BATCH_DONE &&
+		    nfs_batch_under(entries[i].dir, entries[j].dir))
+			return 0;
+	return 1;
+}
+
+/*
+ * Build the command line a single mount.nfs would get for @entry,
+ * with the options common to the batch in @common.
+ */
+static char **nfs_batch_argv(char **common, const int ncommon,
+			     const struct nfs_batch_entry *entry,
+			     const char *extra_opts, int *argc)
+{
+	char **argv = xmalloc((ncommon + 6) * sizeof(char *));
+	int n = 0, i;
+
+	argv[n++] = progname;
+	for (i = 0; i < ncommon; i++)
+		argv[n++] = common[i];
+	argv[n++] = entry->spec;
+	argv[n++] = entry->dir;
+	argv[n++] = "-o";
+	if (extra_opts != NULL)
+		argv[n++] = xstrconcat3(entry->opts, ",", (char *)extra_opts);
+	else
+		argv[n++] = entry->opts;
+	argv[n] = NULL;
+	*argc = n;
+	return argv;
+}
+
+static int nfs_batch_read(const char *types, const char *filter,
+			  struct nfs_batch_entry **entriesp)
+{
+	struct nfs_batch_entry *entries = NULL, *e;
+	unsigned int n = 0, i;
+	struct mntent *mnt;
+	FILE *fp;
+
+	fp = setmntent(_PATH_FSTAB, "r");
+	if (fp == NULL) {
+		nfs_error(_("%s: can't open %s: %s"),
+			progname, _PATH_FSTAB, strerror(errno));
+		return -1;
+	}
+	while ((mnt = getmntent(fp)) != NULL) {
+		if (!nfs_batch_match_type(mnt->mnt_type, types))
+			continue;
+		if (hasmntopt(mnt, "noauto") != NULL)
+			continue;
+		if (filter && !nfs_batch_match_opts(mnt->mnt_opts, filter))
+			continue;
+		if (nfs_batch_mounted(mnt->mnt_fsname, mnt->mnt_dir)) {
+			if (verbose)
+				printf(_("%s: %s is already mounted\n"),
+					progname, mnt->mnt_dir);
+			continue;
+		}
+
+		entries = xrealloc(entries, (n + 1) * sizeof(*entries));
+		e = &entries[n];
+		memset(e, 0, sizeof(*e));
+		e->spec = xstrdup(mnt->mnt_fsname);
+		e->dir = xstrdup(mnt->mnt_dir);
+		e->opts = xstrdup(mnt->mnt_opts);
+		e->host = nfs_batch_host(mnt->mnt_fsname);
+		e->leader = n;
+		for (i = 0; i < n; i++)
+			if (e->host && entries[i].host &&
+			    strcmp(entries[i].host, e->host) == 0) {
+				e->leader = i;
+				break;
+			}
+		n++;
+	}
+	endmntent(fp);
+
+	*entriesp = entries;
+	return n;
+}
+
+/**
+ * nfs_mount_batch - mount the NFS file systems listed in /etc/fstab
+ * @argc: count of command line arguments
+ * @argv: command line arguments
+ * @mount_one: runs a single mount.nfs command line
+ *
+ * Returns EX_SUCCESS if every selected entry was mounted, EX_SOMEOK
+ * if only some were, or another mount.nfs exit status.
+ */
+int nfs_mount_batch(int argc, char **argv, nfs_mount_one_t mount_one)
+{
+	const char *types = "nfs,nfs4", *filter = NULL;
+	char *extra_opts = NULL, *common[32], *end;
+	struct nfs_batch_entry *entries;
+	unsigned int i, done, running, ok;
+	int c, n, ncommon = 0, nargs, status;
+	long jobs = NFS_BATCH_JOBS;
+	char **args;
+	pid_t pid;
+
+	while ((c = getopt_long(argc, argv, "at:O:j:fnrvwso:",
+				batch_longopts, NULL)) != -1) {
+		switch (c) {
+		case 'a':
+			break;
+		case 't':
+			types = optarg;
+			break;
+		case 'O':
+			filter = optarg;
+			break;
+		case 'j':
+			jobs = strtol(optarg, &end, 10);
+			if (*end != '\0' || jobs < 1) {
+				nfs_error(_("%s: invalid number of jobs: %s"),
+					progname, optarg);
+				return EX_USAGE;
+			}
+			break;
+		case 'o':
+			if (extra_opts)
+				extra_opts = xstrconcat3(extra_opts, ",",
+							 optarg);
+			else
+				extra_opts = xstrdup(optarg);
+			break;
+		case 'v':
+			verbose++;
+			/* fall through */
+		case 'f':
+		case 'n':
+		case 'r':
+		case 'w':
+		case 's':
+			if (ncommon < (int)(sizeof(common) / sizeof(common[0])))
+				common[ncommon++] = c == 'f' ? "-f" :
+						    c == 'n' ? "-n" :
+						    c == 'r' ? "-r" :
+						    c == 'w' ? "-w" :
+						    c == 's' ? "-s" : "-v";
+			break;
+		default:
+			mount_usage();
+			return EX_USAGE;
+		}
+	}
+	if (optind != argc) {
+		mount_usage();
+		return EX_USAGE;
+	}
+	if (getuid() != 0) {
+		nfs_error(_("%s: only root can mount all file systems"),
+			progname);
+		return EX_USAGE;
+	}
+
+	n = nfs_batch_read(types, filter, &entries);
+	if (n < 0)
+		return EX_FILEIO;
+
+	done = running = ok = 0;
+	while (done < (unsigned int)n) {
+		for (i = 0; i < (unsigned int)n && running < (unsigned long)jobs;
+		     i++) {
+			if (entries[i].state != NFS_BATCH_WAITING ||
+			    !nfs_batch_ready(entries, i))
+				continue;
+			fflush(NULL);
+			pid = fork();
+			if (pid == 0) {
+				args = nfs_batch_argv(common, ncommon,
+						&entries[i], extra_opts,
+						&nargs);
+				/* start getopt_long() over */
+				optind = 0;
+				exit(mount_one(nargs, args));
+			}
+			if (pid == -1) {
+				nfs_error(_("%s: can't mount %s: %s"),
+					progname, entries[i].dir,
+					strerror(errno));
+				entries[i].state = NFS_BATCH_DONE;
+				done++;
+				continue;
+			}
+			entries[i].pid = pid;
+			entries[i].state = NFS_BATCH_RUNNING;
+			running++;
+		}
+		if (running == 0)
+			continue;
+
+		pid = wait(&status);
+		if (pid == -1) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		for (i = 0; i < (unsigned int)n; i++)
+			if (entries[i].state == NFS_BATCH_RUNNING &&
+			    entries[i].pid == pid)
+				break;
+		if (i == (unsigned int)n)
+			continue;
+		entries[i].state = NFS_BATCH_DONE;
+		running--;
+		done++;
+		if (WIFEXITED(status) && WEXITSTATUS(status) == EX_SUCCESS)
+			ok++;
+		else if (WIFSIGNALED(status))
+			nfs_error(_("%s: mount of %s killed by signal %d"),
+				progname, entries[i].dir, WTERMSIG(status));
+	}
+
+	for (i = 0; i < (unsigned int)n; i++) {
+		free(entries[i].spec);
+		free(entries[i].dir);
+		free(entries[i].opts);
+		free(entries[i].host);
+	}
+	free(entries);
+	free(extra_opts);
+
+	if (ok == (unsigned int)n)
+		return EX_SUCCESS;
+	return ok ? EX_SOMEOK : EX_FAIL;
+}
@@ -1,8 +1,5 @@
 /*
- * token.h -- tokenize strings, a la strtok(3)
- *
- * Copyright (C) 2007 Oracle.  All rights reserved.
- * Copyright (C) 2007 Chuck Lever <chuck.lever@oracle.com>
+ * batch.h -- mount many NFS file systems from one mount.nfs
  *
  * This program is free software; you can redistribute it and/or
  * modify it under the terms of the GNU General Public
@@ -21,14 +18,12 @@
  *
  */
 
-#ifndef _NFS_UTILS_MOUNT_TOKEN_H
-#define _NFS_UTILS_MOUNT_TOKEN_H
+#ifndef _NFS_UTILS_MOUNT_BATCH_H
+#define _NFS_UTILS_MOUNT_BATCH_H
 
-struct tokenizer_state;
+typedef int (*nfs_mount_one_t)(int argc, char **argv);
 
-char *next_token(struct tokenizer_state *);
-struct tokenizer_state *init_tokenizer(char *, char);
-int tokenizer_error(struct tokenizer_state *);
-void end_tokenizer(struct tokenizer_state *);
+int nfs_batch_requested(int argc, char **argv);
+int nfs_mount_batch(int argc, char **argv, nfs_mount_one_t mount_one);
 
-#endif	/* _NFS_UTILS_MOUNT_TOKEN_H */
+#endif	/* _NFS_UTILS_MOUNT_BATCH_H */
@@ -30,7 +30,10 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <stdio.h>
+#include <stdarg.h>
 #include <string.h>
+#include <strings.h>
+#include <time.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <syslog.h>
@@ -357,3 +360,130 @@ char *nfs_strerror(unsigned int stat)
 	sprintf(buf, _("unknown nfs status return value: %u"), stat);
 	return buf;
 }
+
+/*
+ * Timing reports: "mount.nfs -vv", or the "timing=" mount option,
+ * print one line for each step of a mount as it finishes, so that
+ * slow mounts can be taken apart.
+ */
+int nfs_timing_mode = NFS_TIMING_OFF;
+static long long nfs_timing_base;
+
+/**
+ * nfs_timing_now - read the clock timing reports use
+ *
+ * Returns microseconds since some arbitrary time.
+ */
+long long nfs_timing_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * nfs_timing_setup - start or stop timing reports
+ * @mode: NFS_TIMING_OFF, NFS_TIMING_TEXT or NFS_TIMING_JSON
+ *
+ * Reports give times since the first call.
+ */
+void nfs_timing_setup(const int mode)
+{
+	if (nfs_timing_base == 0)
+		nfs_timing_base = nfs_timing_now();
+	nfs_timing_mode = mode;
+}
+
+/**
+ * nfs_timing_parse - parse the value of the "timing=" mount option
+ * @value: "text", "json" or "off"
+ *
+ * Returns an NFS_TIMING_ mode, or -1 if @value is not recognized.
+ */
+int nfs_timing_parse(const char *value)
+{
+	if (strcasecmp(value, "text") == 0)
+		return NFS_TIMING_TEXT;
+	if (strcasecmp(value, "json") == 0)
+		return NFS_TIMING_JSON;
+	if (strcasecmp(value, "off") == 0)
+		return NFS_TIMING_OFF;
+	return -1;
+}
+
+static size_t nfs_timing_quote(char *buf, const size_t buflen, const char *s)
+{
+	size_t pos = 0;
+
+	for (; *s != '\0' && pos + 7 < buflen; s++) {
+		unsigned char c = (unsigned char)*s;
+
+		if (c == '"' || c == '\\') {
+			buf[pos++] = '\\';
+			buf[pos++] = c;
+		} else if (c < 0x20)
+			pos += snprintf(buf + pos, buflen - pos, "\\u%04x", c);
+		else
+			buf[pos++] = c;
+	}
+	buf[pos] = '\0';
+	return pos;
+}
+
+/**
+ * nfs_timing - report how long one step of a mount took
+ * @event: name of the step, such as "dns" or "mount"
+ * @elapsed: how long it took, in microseconds, or -1 if it has no length
+ * @result: NULL if it worked, otherwise why not
+ * @fmt: printf-style description of the step
+ *
+ * Text reports go to stdout with the other verbose messages.  JSON
+ * reports go to stderr, one object per line, so that they can be
+ * collected from many hosts and taken apart by machine.  Each report
+ * is written in one piece, so threads may call this.
+ */
+void nfs_timing(const char *event, const long long elapsed,
+		const char *result, const char *fmt, ...)
+{
+	char detail[512], quoted[1024], rquoted[256], line[2048];
+	long long at;
+	va_list args;
+
+	if (nfs_timing_mode == NFS_TIMING_OFF)
+		return;
+
+	at = nfs_timing_now() - nfs_timing_base;
+	va_start(args, fmt);
+	vsnprintf(detail, sizeof(detail), fmt, args);
+	va_end(args);
+
+	if (nfs_timing_mode == NFS_TIMING_JSON) {
+		nfs_timing_quote(quoted, sizeof(quoted), detail);
+		nfs_timing_quote(rquoted, sizeof(rquoted),
+				 result ? result : "ok");
+		snprintf(line, sizeof(line),
+			"{\"prog\":\"%s\",\"pid\":%d,\"at_us\":%lld,"
+			"\"event\":\"%s\",\"elapsed_us\":%lld,"
+			"\"result\":\"%s\",\"detail\":\"%s\"}\n",
+			progname, (int)getpid(), at, event, elapsed,
+			rquoted, quoted);
+		fputs(line, stderr);
+		return;
+	}
+
+	if (elapsed >= 0)
+		snprintf(line, sizeof(line),
+			_("%s: timing +%lld.%03lld ms: %s %s "
+			  "(%lld.%03lld ms): %s\n"),
+			progname, at / 1000, at % 1000, event, detail,
+			elapsed / 1000, elapsed % 1000,
+			result ? result : _("ok"));
+	else
+		snprintf(line, sizeof(line),
+			_("%s: timing +%lld.%03lld ms: %s %s: %s\n"),
+			progname, at / 1000, at % 1000, event, detail,
+			result ? result : _("ok"));
+	fputs(line, stdout);
+	fflush(stdout);
+}
@@ -32,4 +32,17 @@ void sys_mount_errors(char *, int, int, int);
 
 void umount_error(int, const char *);
 
+#define NFS_TIMING_OFF		(0)
+#define NFS_TIMING_TEXT		(1)
+#define NFS_TIMING_JSON		(2)
+
+extern int nfs_timing_mode;
+
+long long nfs_timing_now(void);
+void nfs_timing_setup(const int);
+int nfs_timing_parse(const char *);
+void nfs_timing(const char *, const long long, const char *,
+		const char *, ...)
+	__attribute__ ((format (printf, 4, 5)));
+
 #endif	/* _NFS_UTILS_MOUNT_ERROR_H */
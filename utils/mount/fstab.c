@@ -23,6 +23,7 @@
 #include "xcommon.h"
 #include "nfs_mntent.h"
 #include "nfs_paths.h"
+#include "mnttab.h"
 #include "nls.h"
 
 #define LOCK_TIMEOUT	10
@@ -246,6 +247,95 @@ read_fstab()
 	read_mntentchn(mfp, fnam, mc);
 }
 
+/*
+ * On hosts with many thousands of mounts, reading all of /proc/mounts
+ * into a chain for every lookup dominates the cost of an umount.
+ * Where the mount table is the kernel's, look mounts up in the shared
+ * index of /proc/self/mountinfo instead; it is only re-read when the
+ * kernel says the table has changed.  A lookup builds a chain of just
+ * the matching mounts, in mount order and ending at the first one's
+ * NULL prev, and returns its last member, so a following backward
+ * lookup only needs to step along it.
+ */
+static int
+mtab_is_procmounts(void)
+{
+	return mtab_is_a_symlink() || mtab_does_not_exist();
+}
+
+static int
+mnttab_usable(void)
+{
+	static int usable = -1;
+	struct mnttab *mt;
+
+	if (usable == -1) {
+		mnttab_ignore_rootdir();
+		mt = mnttab_get();
+		usable = mt != NULL;
+		mnttab_put(mt);
+	}
+	return usable;
+}
+
+static struct mntentchn *
+mnttab_chain_add(struct mntentchn *last, const struct mnttab_entry *me)
+{
+	struct mntentchn *mc;
+
+	if (streq(me->me_type, MNTTYPE_IGNORE))
+		return last;
+	mc = xmalloc(sizeof(*mc));
+	mc->m.mnt_fsname = xstrdup(me->me_source);
+	mc->m.mnt_dir = xstrdup(me->me_dir);
+	mc->m.mnt_type = xstrdup(me->me_type);
+	mc->m.mnt_opts = xstrdup(me->me_opts);
+	mc->m.mnt_freq = mc->m.mnt_passno = 0;
+	mc->prev = last;
+	mc->nxt = NULL;
+	if (last)
+		last->nxt = mc;
+	return mc;
+}
+
+static struct mntentchn *
+mnttab_dirbackward(const char *name, struct mntentchn *mcprev)
+{
+	const struct mnttab_entry *me;
+	struct mntentchn *mc = NULL;
+	struct mnttab *mt;
+	size_t pos = MNTTAB_START;
+
+	if (mcprev)
+		return mcprev->prev;
+	mt = mnttab_get();
+	if (mt == NULL)
+		return NULL;
+	while ((me = mnttab_next_path(mt, name, &pos)) != NULL)
+		mc = mnttab_chain_add(mc, me);
+	mnttab_put(mt);
+	return mc;
+}
+
+static struct mntentchn *
+mnttab_devbackward(const char *name, struct mntentchn *mcprev)
+{
+	const struct mnttab_entry *me;
+	struct mntentchn *mc = NULL;
+	struct mnttab *mt;
+
+	if (mcprev)
+		return mcprev->prev;
+	mt = mnttab_get();
+	if (mt == NULL)
+		return NULL;
+	for (me = mnttab_lookup_source(mt, name); me; me = me->me_srcnext)
+		if (streq(me->me_source, name))
+			mc = mnttab_chain_add(mc, me);
+	mnttab_put(mt);
+	return mc;
+}
+
 /*
  * Given the directory name NAME, and the place MCPREV we found it last time,
  * try to find more occurrences.
@@ -254,6 +344,9 @@ struct mntentchn *
 getmntdirbackward (const char *name, struct mntentchn *mcprev) {
 	struct mntentchn *mc, *mc0;
 
+	if (mtab_is_procmounts() && mnttab_usable())
+		return mnttab_dirbackward(name, mcprev);
+
 	mc0 = mtab_head();
 	if (!mcprev)
 		mcprev = mc0;
@@ -271,6 +364,9 @@ struct mntentchn *
 getprocmntdirbackward (const char *name, struct mntentchn *mcprev) {
 	struct mntentchn *mc, *mc0;
 
+	if (mnttab_usable())
+		return mnttab_dirbackward(name, mcprev);
+
 	mc0 = procmounts_head();
 	if (!mcprev)
 		mcprev = mc0;
@@ -288,6 +384,9 @@ struct mntentchn *
 getmntdevbackward (const char *name, struct mntentchn *mcprev) {
 	struct mntentchn *mc, *mc0;
 
+	if (mtab_is_procmounts() && mnttab_usable())
+		return mnttab_devbackward(name, mcprev);
+
 	mc0 = mtab_head();
 	if (!mcprev)
 		mcprev = mc0;
@@ -49,6 +49,7 @@
 #include "error.h"
 #include "stropts.h"
 #include "utils.h"
+#include "batch.h"
 
 char *progname;
 int nfs_mount_data_version;
@@ -379,22 +380,13 @@ static int try_mount(char *spec, char *mount_point, int flags,
 	return add_mtab(spec, mount_point, fs_type, flags, *extra_opts);
 }
 
-int main(int argc, char *argv[])
+static int mount_main(int argc, char *argv[])
 {
 	int c, flags = 0, mnt_err = 1, fake = 0;
 	char *spec = NULL, *mount_point = NULL, *fs_type = "nfs";
 	char *extra_opts = NULL, *mount_opts = NULL;
 	uid_t uid = getuid();
 
-	progname = basename(argv[0]);
-
-	nfs_mount_data_version = discover_nfs_mount_data_version(&string);
-
-	if(!strncmp(progname, "umount", strlen("umount")))
-		exit(nfsumount(argc, argv));
-
-	mount_config_init(progname);
-
 	while ((c = getopt_long(argc, argv, "rvVwfno:hs",
 				longopts, NULL)) != -1) {
 		switch (c) {
@@ -436,6 +428,7 @@ int main(int argc, char *argv[])
 		mount_usage();
 		exit(EX_USAGE);
 	}
+	nfs_timing_setup(verbose > 1 ? NFS_TIMING_TEXT : NFS_TIMING_OFF);
 
 	/*
 	 * Extra non-option words at the end are bogus...
@@ -556,3 +549,19 @@ out_usage:
 	free(mount_opts);
 	exit(EX_USAGE);
 }
+
+int main(int argc, char *argv[])
+{
+	progname = basename(argv[0]);
+
+	nfs_mount_data_version = discover_nfs_mount_data_version(&string);
+
+	if(!strncmp(progname, "umount", strlen("umount")))
+		exit(nfsumount(argc, argv));
+
+	mount_config_init(progname);
+
+	if (nfs_batch_requested(argc, argv))
+		exit(nfs_mount_batch(argc, argv, mount_main));
+	exit(mount_main(argc, argv));
+}
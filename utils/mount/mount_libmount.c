@@ -44,6 +44,7 @@
 
 #include "error.h"
 #include "utils.h"
+#include "batch.h"
 
 char *retrieve_mount_options(struct libmnt_fs *fs);
 
@@ -288,6 +289,7 @@ static int mount_main(struct libmnt_context *cxt, int argc, char **argv)
 	int rc, c;
 	struct libmnt_fs *fs;
 	char *spec = NULL, *mount_point = NULL, *opts = NULL;
+	int vcount = 0;
 
 	static const struct option longopts[] = {
 	  { "fake", 0, 0, 'f' },
@@ -304,11 +306,13 @@ static int mount_main(struct libmnt_context *cxt, int argc, char **argv)
 	  { NULL, 0, 0, 0 }
 	};
 
-	mount_config_init(progname);
 	mnt_context_init_helper(cxt, MNT_ACT_MOUNT, 0);
 
 	while ((c = getopt_long(argc, argv, "fhnrVvwo:s", longopts, NULL)) != -1) {
 
+		/* libmount only knows whether -v was given */
+		if (c == 'v')
+			vcount++;
 		rc = mnt_context_helper_setopt(cxt, c, optarg);
 		if (rc == 0)		/* valid option */
 			continue;
@@ -350,6 +354,7 @@ static int mount_main(struct libmnt_context *cxt, int argc, char **argv)
 	verbose = mnt_context_is_verbose(cxt);
 	sloppy = mnt_context_is_sloppy(cxt);
 	nomtab = mnt_context_is_nomtab(cxt);
+	nfs_timing_setup(vcount > 1 ? NFS_TIMING_TEXT : NFS_TIMING_OFF);
 
 	if (strcmp(progname, "mount.nfs4") == 0)
 		mnt_context_set_fstype(cxt, "nfs4");
@@ -434,6 +439,23 @@ err:
 	return EX_FAIL;
 }
 
+/* Mount one file system for nfs_mount_batch() */
+static int mount_one(int argc, char **argv)
+{
+	struct libmnt_context *cxt;
+	int rc;
+
+	cxt = mnt_new_context();
+	if (!cxt) {
+		nfs_error(_("Can't initilize libmount: %s"),
+					strerror(errno));
+		return EX_FAIL;
+	}
+	rc = mount_main(cxt, argc, argv);
+	mnt_free_context(cxt);
+	return rc;
+}
+
 int main(int argc, char *argv[])
 {
 	struct libmnt_context *cxt;
@@ -453,8 +475,13 @@ int main(int argc, char *argv[])
 
 	if(strncmp(progname, "umount", 6) == 0)
 		rc = umount_main(cxt, argc, argv);
-	else
-		rc = mount_main(cxt, argc, argv);
+	else {
+		mount_config_init(progname);
+		if (nfs_batch_requested(argc, argv))
+			rc = nfs_mount_batch(argc, argv, mount_one);
+		else
+			rc = mount_main(cxt, argc, argv);
+	}
 done:
 	mnt_free_context(cxt);
 	return rc;
@@ -34,11 +34,16 @@
 #include <netdb.h>
 #include <time.h>
 #include <grp.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/wait.h>
 #include <sys/stat.h>
+#include <sys/file.h>
 #if defined(__GLIBC__) && ((__GLIBC__ < 2) || (__GLIBC__ == 2 && __GLIBC_MINOR__ < 24))
 /* Cannot safely include linux/in6.h in old glibc, so hardcode the needed values */
 # define IPV6_PREFER_SRC_PUBLIC 2
@@ -62,14 +67,28 @@
 #include "nfsrpc.h"
 #include "parse_opt.h"
 #include "network.h"
+#include "error.h"
 #include "conffile.h"
 #include "nfslib.h"
+#include "umntqueue.h"
 
 #define PMAP_TIMEOUT	(10)
 #define CONNECT_TIMEOUT	(20)
 #define MOUNT_TIMEOUT	(30)
 #define STATD_TIMEOUT	(10)
 
+/*
+ * Held by the mount that is starting statd.  Mounts that find it held
+ * wait for it to be released, then use the outcome recorded in it.
+ */
+#define STATD_START_LOCK	"/run/mount.nfs.statd"
+
+#define RACE_MAX	(16)	/* addresses raced */
+#define RACE_DELAY	(250)	/* ms between connection attempts */
+
+#define PROBE_JOBS	(5)	/* NFS and MNT transports, and v4 */
+#define UMNT_BATCH	(64)	/* UMNT calls in flight at once */
+
 #define SAFE_SOCKADDR(x)	(struct sockaddr *)(char *)(x)
 
 extern int nfs_mount_data_version;
@@ -368,9 +387,9 @@ static int connect_to(int fd, struct sockaddr *addr,
 			socklen_t addrlen, int timeout)
 {
 	int ret, saved;
-	fd_set rset, wset;
-	struct timeval tv = {
-		.tv_sec = timeout,
+	struct pollfd pfd = {
+		.fd	= fd,
+		.events	= POLLOUT,
 	};
 
 	saved = fcntl(fd, F_GETFL, 0);
@@ -382,15 +401,15 @@ static int connect_to(int fd, struct sockaddr *addr,
 	if (ret == 0)
 		goto out;
 
-	FD_ZERO(&rset);
-	FD_SET(fd, &rset);
-	wset = rset;
-	ret = select(fd + 1, &rset, &wset, NULL, &tv);
+	do {
+		ret = poll(&pfd, 1, timeout * 1000);
+	} while (ret < 0 && errno == EINTR);
+	if (ret < 0)
+		return -1;
 	if (ret == 0) {
 		errno = ETIMEDOUT;
 		return -1;
-	}
-	if (FD_ISSET(fd, &rset) || FD_ISSET(fd, &wset)) {
+	} else {
 		int error;
 		socklen_t len = sizeof(error);
 		if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0)
@@ -399,14 +418,621 @@ static int connect_to(int fd, struct sockaddr *addr,
 			errno = error;
 			return -1;
 		}
-	} else
-		return -1;
+	}
 
 out:
 	fcntl(fd, F_SETFL, saved);
 	return 0;
 }
 
+static long long nfs_now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static long long nfs_now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * nfs_race_addresses - find which of a server's addresses answers first
+ * @ai: the server's addresses, in order of preference
+ * @port: TCP port to connect to
+ * @timeout: how long to wait for a connection, in milliseconds
+ *
+ * As RFC 8305 suggests, the addresses are tried with address families
+ * interleaved, starting with the family of the first.  A connection
+ * attempt starts every RACE_DELAY milliseconds, or as soon as the
+ * previous one fails, and earlier attempts stay open meanwhile.  A
+ * server whose IPv6 path is broken, say, costs RACE_DELAY instead of
+ * an RPC timeout per mount.
+ *
+ * Returns the first address to accept a connection, or NULL if none
+ * did in time.
+ */
+const struct addrinfo *nfs_race_addresses(const struct addrinfo *ai,
+					  const unsigned short port,
+					  const int timeout)
+{
+	const struct addrinfo *order[RACE_MAX], *winner = NULL, *p;
+	struct pollfd pfd[RACE_MAX];
+	unsigned int n, i, started, open;
+	long long start, next, now;
+	int ret, err, family;
+	socklen_t len;
+
+	/* Interleave the families, keeping the order within each */
+	n = 0;
+	family = ai->ai_family;
+	while (n < RACE_MAX) {
+		for (p = ai; p != NULL; p = p->ai_next) {
+			for (i = 0; i < n; i++)
+				if (order[i] == p)
+					break;
+			if (i == n && (p->ai_family == family ||
+				       (family == AF_UNSPEC)))
+				break;
+		}
+		if (p == NULL) {
+			if (family == AF_UNSPEC)
+				break;
+			family = AF_UNSPEC;
+			continue;
+		}
+		order[n++] = p;
+		family = p->ai_family == AF_INET ? AF_INET6 : AF_INET;
+	}
+
+	start = next = nfs_now_ms();
+	started = open = 0;
+	while (open > 0 || started < n) {
+		now = nfs_now_ms();
+		if (now - start >= timeout)
+			break;
+		if (started < n && (now >= next || open == 0)) {
+			union nfs_sockaddr address;
+			int fd;
+
+			p = order[started];
+			pfd[started].fd = -1;
+			pfd[started].events = POLLOUT;
+			pfd[started].revents = 0;
+			started++;
+			next = now + RACE_DELAY;
+			if (p->ai_addrlen > sizeof(address))
+				continue;
+			memcpy(&address, p->ai_addr, p->ai_addrlen);
+			nfs_set_port(&address.sa, port);
+			fd = socket(p->ai_family,
+				    SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+			if (fd == -1)
+				continue;
+			if (connect(fd, &address.sa, p->ai_addrlen) == 0) {
+				close(fd);
+				winner = p;
+				break;
+			}
+			if (errno != EINPROGRESS) {
+				close(fd);
+				continue;
+			}
+			pfd[started - 1].fd = fd;
+			open++;
+			continue;
+		}
+
+		ret = poll(pfd, started, (int)((started < n ? next :
+						start + timeout) - now));
+		if (ret <= 0)
+			continue;
+		for (i = 0; i < started && winner == NULL; i++) {
+			if (pfd[i].fd == -1 || pfd[i].revents == 0)
+				continue;
+			err = 0;
+			len = sizeof(err);
+			if (getsockopt(pfd[i].fd, SOL_SOCKET, SO_ERROR,
+					&err, &len) == 0 && err == 0) {
+				winner = order[i];
+				break;
+			}
+			close(pfd[i].fd);
+			pfd[i].fd = -1;
+			open--;
+			/* Start the next attempt now */
+			next = now;
+		}
+		if (winner != NULL)
+			break;
+	}
+
+	for (i = 0; i < started; i++)
+		if (pfd[i].fd != -1)
+			close(pfd[i].fd);
+	return winner;
+}
+
+/*
+ * RPC probes: each probe is one call on its own non-blocking socket,
+ * and a single poll loop drives all of them, so that a batch of
+ * probes costs the time of the slowest rather than of their sum.
+ */
+#define PROBE_RETRY	(1000)	/* ms between UDP retransmits */
+#define PROBE_BUFSIZE	(MNT_SENDBUFSIZE)
+#define PROBE_LASTFRAG	(0x80000000U)
+
+enum {
+	PROBE_CONNECTING,
+	PROBE_SENDING,
+	PROBE_WAITING,
+	PROBE_DONE,
+};
+
+struct nfs_rpc_call {
+	int		fd;
+	int		state;
+	uint32_t	xid;
+	long long	deadline;
+	long long	resend;
+	long long	sentat;		/* microseconds */
+	long long	doneat;		/* microseconds */
+	char		call[PROBE_BUFSIZE];
+	unsigned int	calllen;
+	unsigned int	sent;
+	char		reply[PROBE_BUFSIZE];
+	unsigned int	got;
+	char		marker[4];	/* TCP record marking */
+	unsigned int	markgot;
+	unsigned int	fraglen;
+	int		lastfrag;
+};
+
+#ifdef HAVE_LIBTIRPC
+static int nfs_probe_bindresvport(const int fd)
+{
+	return bindresvport_sa(fd, NULL);
+}
+#else	/* !HAVE_LIBTIRPC */
+static int nfs_probe_bindresvport(const int fd)
+{
+	return bindresvport(fd, NULL);
+}
+#endif	/* !HAVE_LIBTIRPC */
+
+static void nfs_rpc_call_done(struct nfs_rpc_probe *probe,
+			      struct nfs_rpc_call *call,
+			      const enum clnt_stat stat, const int err)
+{
+	if (stat != RPC_SUCCESS) {
+		memset(&probe->error, 0, sizeof(probe->error));
+		probe->error.re_status = stat;
+		probe->error.re_errno = err;
+	} else
+		probe->rtt = (unsigned long)(nfs_now_us() - call->sentat);
+	probe->stat = stat;
+	call->doneat = nfs_now_us();
+	call->state = PROBE_DONE;
+	if (call->fd != -1) {
+		close(call->fd);
+		call->fd = -1;
+	}
+}
+
+/*
+ * Connecting failed: report it as nfs_rpc_ping() would, so a refused
+ * or timed out TCP connection lets the caller try another transport.
+ */
+static void nfs_rpc_call_noconn(struct nfs_rpc_probe *probe,
+				struct nfs_rpc_call *call, const int err)
+{
+	enum clnt_stat stat = RPC_SYSTEMERROR;
+
+	if (err == ECONNREFUSED)
+		stat = RPC_CANTRECV;
+	else if (err == ETIMEDOUT)
+		stat = RPC_TIMEDOUT;
+	nfs_rpc_call_done(probe, call, stat, err);
+}
+
+static int nfs_rpc_call_encode(const struct nfs_rpc_probe *probe,
+			       struct nfs_rpc_call *call)
+{
+	unsigned int off = probe->prot == IPPROTO_TCP ? sizeof(uint32_t) : 0;
+	xdrproc_t xargs = probe->xargs ? probe->xargs : (xdrproc_t)xdr_void;
+	struct rpc_msg msg;
+	uint32_t marker;
+	XDR xdrs;
+	int ret;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.rm_xid = call->xid;
+	msg.rm_direction = CALL;
+	msg.rm_call.cb_rpcvers = RPC_MSG_VERSION;
+	msg.rm_call.cb_prog = probe->prog;
+	msg.rm_call.cb_vers = probe->vers;
+	msg.rm_call.cb_proc = probe->proc;
+	msg.rm_call.cb_cred = probe->auth ? probe->auth->ah_cred : _null_auth;
+	msg.rm_call.cb_verf = probe->auth ? probe->auth->ah_verf : _null_auth;
+
+	xdrmem_create(&xdrs, call->call + off, sizeof(call->call) - off,
+			XDR_ENCODE);
+	ret = xdr_callmsg(&xdrs, &msg) && xargs(&xdrs, probe->args);
+	call->calllen = off + xdr_getpos(&xdrs);
+	xdr_destroy(&xdrs);
+	if (!ret)
+		return 0;
+
+	if (off) {
+		marker = htonl(PROBE_LASTFRAG | (call->calllen - off));
+		memcpy(call->call, &marker, sizeof(marker));
+	}
+	return 1;
+}
+
+/*
+ * Returns 1 if the reply in @call answered it, and the probe is done;
+ * zero if it was for some other call, and has been discarded.
+ */
+static int nfs_rpc_call_decode(struct nfs_rpc_probe *probe,
+			       struct nfs_rpc_call *call)
+{
+	xdrproc_t xres = probe->xres ? probe->xres : (xdrproc_t)xdr_void;
+	struct rpc_msg reply;
+	struct rpc_err error;
+	uint32_t xid;
+	XDR xdrs;
+	int ret;
+
+	if (call->got < sizeof(xid))
+		goto discard;
+	memcpy(&xid, call->reply, sizeof(xid));
+	if (ntohl(xid) != call->xid)
+		goto discard;
+
+	memset(&reply, 0, sizeof(reply));
+	reply.acpted_rply.ar_verf = _null_auth;
+	reply.acpted_rply.ar_results.where = probe->res;
+	reply.acpted_rply.ar_results.proc = xres;
+
+	xdrmem_create(&xdrs, call->reply, call->got, XDR_DECODE);
+	ret = xdr_replymsg(&xdrs, &reply);
+	xdr_destroy(&xdrs);
+	if (reply.acpted_rply.ar_verf.oa_base != NULL) {
+		xdrs.x_op = XDR_FREE;
+		xdr_opaque_auth(&xdrs, &reply.acpted_rply.ar_verf);
+	}
+	if (!ret) {
+		nfs_rpc_call_done(probe, call, RPC_CANTDECODERES, 0);
+		return 1;
+	}
+
+	memset(&error, 0, sizeof(error));
+	_seterr_reply(&reply, &error);
+	nfs_rpc_call_done(probe, call, error.re_status, 0);
+	probe->error = error;
+	return 1;
+
+discard:
+	call->got = 0;
+	return 0;
+}
+
+static void nfs_rpc_call_send(struct nfs_rpc_probe *probe,
+			      struct nfs_rpc_call *call)
+{
+	ssize_t len;
+
+	if (probe->prot == IPPROTO_UDP) {
+		len = sendto(call->fd, call->call, call->calllen, 0,
+				probe->sap, probe->salen);
+		if (len == -1 && errno != EAGAIN && errno != EINTR) {
+			nfs_rpc_call_done(probe, call, RPC_CANTSEND, errno);
+			return;
+		}
+		call->state = PROBE_WAITING;
+		return;
+	}
+
+	len = send(call->fd, call->call + call->sent,
+			call->calllen - call->sent, MSG_NOSIGNAL);
+	if (len == -1) {
+		if (errno != EAGAIN && errno != EINTR)
+			nfs_rpc_call_done(probe, call, RPC_CANTSEND, errno);
+		return;
+	}
+	call->sent += len;
+	if (call->sent == call->calllen)
+		call->state = PROBE_WAITING;
+}
+
+static void nfs_rpc_call_connected(struct nfs_rpc_probe *probe,
+				   struct nfs_rpc_call *call)
+{
+	struct sockaddr dissolve = {
+		.sa_family	= AF_UNSPEC,
+	};
+
+	probe->caddrlen = sizeof(probe->caddr);
+	if (getsockname(call->fd, (struct sockaddr *)&probe->caddr,
+			&probe->caddrlen) == -1)
+		probe->caddrlen = 0;
+
+	/*
+	 * Some servers on multi-homed hosts reply from the wrong
+	 * address; a connected datagram socket would lose the reply.
+	 */
+	if (probe->prot == IPPROTO_UDP && (probe->flags & NFS_PROBE_ANYREPLY))
+		connect(call->fd, &dissolve, sizeof(dissolve));
+
+	call->sentat = nfs_now_us();
+	call->state = PROBE_SENDING;
+	nfs_rpc_call_send(probe, call);
+}
+
+static void nfs_rpc_call_recv(struct nfs_rpc_probe *probe,
+			      struct nfs_rpc_call *call)
+{
+	uint32_t marker;
+	ssize_t len;
+
+	if (probe->prot == IPPROTO_UDP) {
+		len = recv(call->fd, call->reply, sizeof(call->reply), 0);
+		if (len == -1) {
+			if (errno != EAGAIN && errno != EINTR)
+				nfs_rpc_call_done(probe, call,
+						RPC_CANTRECV, errno);
+			return;
+		}
+		call->got = len;
+		nfs_rpc_call_decode(probe, call);
+		return;
+	}
+
+	for (;;) {
+		if (call->markgot < sizeof(call->marker)) {
+			len = recv(call->fd, call->marker + call->markgot,
+					sizeof(call->marker) - call->markgot, 0);
+			if (len <= 0)
+				break;
+			call->markgot += len;
+			if (call->markgot < sizeof(call->marker))
+				continue;
+			memcpy(&marker, call->marker, sizeof(marker));
+			marker = ntohl(marker);
+			call->lastfrag = (marker & PROBE_LASTFRAG) != 0;
+			call->fraglen = marker & ~PROBE_LASTFRAG;
+			if (call->fraglen > sizeof(call->reply) - call->got) {
+				nfs_rpc_call_done(probe, call,
+						RPC_CANTDECODERES, EMSGSIZE);
+				return;
+			}
+		}
+		if (call->fraglen) {
+			len = recv(call->fd, call->reply + call->got,
+					call->fraglen, 0);
+			if (len <= 0)
+				break;
+			call->got += len;
+			call->fraglen -= len;
+			if (call->fraglen)
+				continue;
+		}
+		call->markgot = 0;
+		if (call->lastfrag && nfs_rpc_call_decode(probe, call))
+			return;
+	}
+
+	if (len == 0)
+		nfs_rpc_call_done(probe, call, RPC_CANTRECV, ECONNRESET);
+	else if (errno != EAGAIN && errno != EINTR)
+		nfs_rpc_call_done(probe, call, RPC_CANTRECV, errno);
+}
+
+static void nfs_rpc_call_start(struct nfs_rpc_probe *probe,
+			       struct nfs_rpc_call *call,
+			       const uint32_t xid, const long long now)
+{
+	int type = probe->prot == IPPROTO_UDP ? SOCK_DGRAM : SOCK_STREAM;
+
+	memset(call, 0, sizeof(*call));
+	call->fd = -1;
+	call->xid = xid;
+	call->deadline = now + probe->timeout;
+	call->resend = now + PROBE_RETRY;
+	probe->stat = RPC_SUCCESS;
+	probe->caddrlen = 0;
+	probe->rtt = 0;
+	memset(&probe->error, 0, sizeof(probe->error));
+
+	if (!nfs_rpc_call_encode(probe, call)) {
+		nfs_rpc_call_done(probe, call, RPC_CANTENCODEARGS, 0);
+		return;
+	}
+
+	call->fd = socket(probe->sap->sa_family,
+			  type | SOCK_NONBLOCK | SOCK_CLOEXEC, probe->prot);
+	if (call->fd == -1) {
+		nfs_rpc_call_done(probe, call, RPC_SYSTEMERROR, errno);
+		return;
+	}
+	if ((probe->flags & NFS_PROBE_RESVPORT) &&
+	    nfs_probe_bindresvport(call->fd) == -1) {
+		nfs_rpc_call_done(probe, call, RPC_SYSTEMERROR, errno);
+		return;
+	}
+
+	if (connect(call->fd, probe->sap, probe->salen) == -1) {
+		if (errno != EINPROGRESS)
+			nfs_rpc_call_noconn(probe, call, errno);
+		else
+			call->state = PROBE_CONNECTING;
+		return;
+	}
+	nfs_rpc_call_connected(probe, call);
+}
+
+static void nfs_rpc_call_event(struct nfs_rpc_probe *probe,
+			       struct nfs_rpc_call *call)
+{
+	socklen_t len;
+	int err;
+
+	switch (call->state) {
+	case PROBE_CONNECTING:
+		err = 0;
+		len = sizeof(err);
+		if (getsockopt(call->fd, SOL_SOCKET, SO_ERROR,
+				&err, &len) == -1)
+			err = errno;
+		if (err)
+			nfs_rpc_call_noconn(probe, call, err);
+		else
+			nfs_rpc_call_connected(probe, call);
+		break;
+	case PROBE_SENDING:
+		nfs_rpc_call_send(probe, call);
+		break;
+	case PROBE_WAITING:
+		nfs_rpc_call_recv(probe, call);
+		break;
+	}
+}
+
+static void nfs_rpc_probe_timing(const struct nfs_rpc_probe *probes,
+				 const struct nfs_rpc_call *calls,
+				 const unsigned int n, const long long start)
+{
+	char buf[NI_MAXHOST];
+	unsigned int i;
+
+	for (i = 0; i < n; i++) {
+		const struct nfs_rpc_probe *probe = &probes[i];
+
+		if (!nfs_present_sockaddr(probe->sap, probe->salen,
+					  buf, sizeof(buf)))
+			strcpy(buf, "?");
+		nfs_timing("rpc", calls[i].doneat - start,
+			   probe->stat == RPC_SUCCESS ? NULL :
+				clnt_sperrno(probe->stat),
+			   "%s prog %lu vers %lu proc %lu %s port %u", buf,
+			   (unsigned long)probe->prog,
+			   (unsigned long)probe->vers,
+			   (unsigned long)probe->proc,
+			   probe->prot == IPPROTO_UDP ? "udp" : "tcp",
+			   nfs_get_port(probe->sap));
+	}
+}
+
+/**
+ * nfs_rpc_probe_many - make several RPC calls at once
+ * @probes: array of calls to make
+ * @n: number of elements in @probes
+ *
+ * Each probe is sent on its own socket, using a privileged source
+ * port if it asks for one.  Replies that fail to arrive within the
+ * probe's timeout are reported as RPC_TIMEDOUT; UDP calls are
+ * retransmitted once a second until then.  Each probe's stat, error
+ * and caddr fields are filled in, whether or not the call succeeded,
+ * and rtt is filled in for those that did.
+ *
+ * Returns the number of probes that succeeded.
+ */
+unsigned int nfs_rpc_probe_many(struct nfs_rpc_probe *probes,
+				const unsigned int n)
+{
+	struct nfs_rpc_call *calls;
+	struct pollfd *pfd;
+	unsigned int i, pending, done = 0;
+	long long now, next, start;
+	uint32_t xid;
+	int ret;
+
+	calls = calloc(n, sizeof(*calls));
+	pfd = calloc(n, sizeof(*pfd));
+	if (calls == NULL || pfd == NULL) {
+		for (i = 0; i < n; i++) {
+			memset(&probes[i].error, 0, sizeof(probes[i].error));
+			probes[i].stat = RPC_SYSTEMERROR;
+			probes[i].error.re_status = RPC_SYSTEMERROR;
+			probes[i].error.re_errno = ENOMEM;
+			probes[i].caddrlen = 0;
+		}
+		goto out;
+	}
+
+	now = nfs_now_ms();
+	start = nfs_now_us();
+	xid = (uint32_t)getpid() ^ (uint32_t)now << 12;
+	for (i = 0; i < n; i++)
+		nfs_rpc_call_start(&probes[i], &calls[i], xid + i, now);
+
+	for (;;) {
+		next = now + PROBE_RETRY;
+		pending = 0;
+		for (i = 0; i < n; i++) {
+			struct nfs_rpc_call *call = &calls[i];
+
+			pfd[i].fd = -1;
+			pfd[i].revents = 0;
+			if (call->state == PROBE_DONE)
+				continue;
+			if (now >= call->deadline) {
+				nfs_rpc_call_done(&probes[i], call,
+						RPC_TIMEDOUT, ETIMEDOUT);
+				continue;
+			}
+			if (probes[i].prot == IPPROTO_UDP &&
+			    call->state == PROBE_WAITING &&
+			    now >= call->resend) {
+				call->resend = now + PROBE_RETRY;
+				nfs_rpc_call_send(&probes[i], call);
+				if (call->state == PROBE_DONE)
+					continue;
+			}
+			if (call->deadline < next)
+				next = call->deadline;
+			if (probes[i].prot == IPPROTO_UDP &&
+			    call->resend < next)
+				next = call->resend;
+			pfd[i].fd = call->fd;
+			pfd[i].events = call->state == PROBE_WAITING ?
+						POLLIN : POLLOUT;
+			pending++;
+		}
+		if (pending == 0)
+			break;
+
+		ret = poll(pfd, n, (int)(next - now));
+		if (ret == -1 && errno != EINTR) {
+			for (i = 0; i < n; i++)
+				if (calls[i].state != PROBE_DONE)
+					nfs_rpc_call_done(&probes[i], &calls[i],
+							RPC_SYSTEMERROR, errno);
+			break;
+		}
+		now = nfs_now_ms();
+		for (i = 0; ret > 0 && i < n; i++)
+			if (pfd[i].fd != -1 && pfd[i].revents)
+				nfs_rpc_call_event(&probes[i], &calls[i]);
+	}
+
+	for (i = 0; i < n; i++)
+		if (probes[i].stat == RPC_SUCCESS)
+			done++;
+	if (nfs_timing_mode)
+		nfs_rpc_probe_timing(probes, calls, n, start);
+out:
+	free(pfd);
+	free(calls);
+	return done;
+}
+
 /*
  * Create a socket that is locally bound to a reserved or non-reserved port.
  *
@@ -662,6 +1288,238 @@ static int nfs_probe_mntport(const struct sockaddr *sap, const socklen_t salen,
 					probe_mnt1_first, probe_udp_only);
 }
 
+/*
+ * One rpcbind query and RPC ping, run on its own thread so that the
+ * NFS and mountd services can be probed on every transport at once.
+ */
+struct nfs_probe_job {
+	union nfs_sockaddr	address;
+	socklen_t		salen;
+	rpcprog_t		prog;
+	rpcvers_t		vers;
+	unsigned short		prot;
+	unsigned short		port;	/* IN: required or fixed; OUT: found */
+	int			getport;
+	int			result;
+	enum clnt_stat		stat;	/* rpc_createerr, per-thread */
+	struct rpc_err		error;
+	pthread_t		thread;
+	int			started;
+};
+
+/*
+ * Look up the port of a job's service.  The pings that follow are
+ * made for all jobs at once by nfs_probe_job_ping().
+ */
+static void *nfs_probe_job_run(void *arg)
+{
+	struct nfs_probe_job *job = arg;
+	unsigned short p_port;
+	long long start;
+
+	if (verbose)
+		printf(_("%s: prog %lu, trying vers=%lu, prot=%u\n"),
+			progname, (unsigned long)job->prog,
+			(unsigned long)job->vers, job->prot);
+	start = nfs_timing_now();
+	p_port = nfs_getport(&job->address.sa, job->salen, job->prog,
+				job->vers, job->prot);
+	nfs_timing("rpcbind", nfs_timing_now() - start,
+		   p_port ? NULL : clnt_sperrno(rpc_createerr.cf_stat),
+		   "prog %lu vers %lu %s port %u", (unsigned long)job->prog,
+		   (unsigned long)job->vers,
+		   job->prot == IPPROTO_UDP ? "udp" : "tcp", p_port);
+	if (p_port && job->port && job->port != p_port) {
+		p_port = 0;
+		rpc_createerr.cf_stat = RPC_PROGNOTREGISTERED;
+	}
+	job->port = p_port;
+	job->stat = rpc_createerr.cf_stat;
+	job->error = rpc_createerr.cf_error;
+	return NULL;
+}
+
+/*
+ * Ping the service of each job whose port is known, all at once,
+ * with the timeouts nfs_rpc_ping() would use.
+ */
+static void nfs_probe_job_ping(struct nfs_probe_job *jobs,
+			       const unsigned int n)
+{
+	struct nfs_rpc_probe probes[PROBE_JOBS];
+	struct nfs_probe_job *owner[PROBE_JOBS];
+	struct sockaddr *saddr;
+	unsigned int i, count = 0;
+
+	memset(probes, 0, sizeof(probes));
+	for (i = 0; i < n; i++) {
+		jobs[i].result = 0;
+		if (!jobs[i].port)
+			continue;
+		saddr = &jobs[i].address.sa;
+		nfs_set_port(saddr, jobs[i].port);
+		nfs_pp_debug(saddr, jobs[i].salen, jobs[i].prog,
+				jobs[i].vers, jobs[i].prot, jobs[i].port);
+		probes[count].sap = saddr;
+		probes[count].salen = jobs[i].salen;
+		probes[count].prog = jobs[i].prog;
+		probes[count].vers = jobs[i].vers;
+		probes[count].proc = NULLPROC;
+		probes[count].prot = jobs[i].prot;
+		probes[count].timeout = jobs[i].prot == IPPROTO_UDP ?
+						3000 : 10000;
+		owner[count++] = &jobs[i];
+	}
+
+	nfs_rpc_probe_many(probes, count);
+
+	for (i = 0; i < count; i++) {
+		owner[i]->result = probes[i].stat == RPC_SUCCESS;
+		owner[i]->stat = probes[i].stat;
+		owner[i]->error = probes[i].error;
+	}
+}
+
+static struct nfs_probe_job *nfs_probe_job_add(struct nfs_probe_job *job,
+			const struct sockaddr *sap, const socklen_t salen,
+			const struct pmap *pmap, const unsigned int prot)
+{
+	memcpy(&job->address, sap, salen);
+	job->salen = salen;
+	job->prog = pmap->pm_prog;
+	job->vers = pmap->pm_vers;
+	job->prot = prot;
+	job->port = pmap->pm_port;
+	job->getport = 1;
+	return job + 1;
+}
+
+/*
+ * Pick the first job of @n, in order of preference, that found
+ * the service, and fill in @pmap from it.  As nfs_probe_port() would,
+ * give up at an error that trying another transport cannot cure.
+ *
+ * Returns 1 if a job found the service; otherwise zero, with
+ * rpc_createerr set from the last job considered.
+ */
+static int nfs_probe_job_pick(const struct nfs_probe_job *jobs,
+			      const unsigned int n, struct pmap *pmap)
+{
+	unsigned int i;
+
+	for (i = 0; i < n; i++) {
+		if (jobs[i].result) {
+			pmap->pm_prot = jobs[i].prot;
+			pmap->pm_port = jobs[i].port;
+			nfs_clear_rpc_createerr();
+			return 1;
+		}
+		rpc_createerr.cf_stat = jobs[i].stat;
+		rpc_createerr.cf_error = jobs[i].error;
+		if (rpc_createerr.cf_stat != RPC_PROGNOTREGISTERED &&
+		    rpc_createerr.cf_stat != RPC_TIMEDOUT &&
+		    rpc_createerr.cf_stat != RPC_CANTRECV &&
+		    rpc_createerr.cf_stat != RPC_PROGVERSMISMATCH)
+			break;
+		if (i + 1 < n)
+			nfs_pp_debug2("retrying");
+	}
+	nfs_pp_debug2("failed");
+	return 0;
+}
+
+/*
+ * Probe the NFS and mountd services on all candidate transports at
+ * once, rather than one after another, so that a slow or partly
+ * filtered server costs one timeout instead of several.  Only used
+ * when the NFS version is 3 or fixed by the mount options; the
+ * preference among transports is the same as the serial probes'.
+ *
+ * Returns 1 and fills in both @pmap structs if the requested service
+ * ports are unambiguous and pingable.  Otherwise zero is returned;
+ * rpccreateerr.cf_stat is set to reflect the nature of the error.
+ */
+static int nfs_probe_parallel(const struct sockaddr *mnt_saddr,
+			      const socklen_t mnt_salen,
+			      struct pmap *mnt_pmap,
+			      const struct sockaddr *nfs_saddr,
+			      const socklen_t nfs_salen,
+			      struct pmap *nfs_pmap,
+			      int checkv4)
+{
+	struct nfs_probe_job jobs[PROBE_JOBS], *nfs_jobs, *mnt_jobs, *v4_job, *job, *end;
+	const unsigned int *probe_proto, *p_prot;
+	unsigned int n_nfs, n_mnt;
+	int result = 0;
+
+	memset(jobs, 0, sizeof(jobs));
+	job = nfs_jobs = jobs;
+	if (!(nfs_pmap->pm_vers && nfs_pmap->pm_prot && nfs_pmap->pm_port)) {
+		probe_proto = nfs_default_proto();
+		if (nfs_pmap->pm_prot)
+			job = nfs_probe_job_add(job, nfs_saddr, nfs_salen,
+					nfs_pmap, nfs_pmap->pm_prot);
+		else
+			for (p_prot = probe_proto; *p_prot; p_prot++)
+				job = nfs_probe_job_add(job, nfs_saddr,
+					nfs_salen, nfs_pmap, *p_prot);
+	} else {
+		checkv4 = 0;
+		probe_proto = NULL;
+	}
+	n_nfs = job - nfs_jobs;
+
+	mnt_jobs = job;
+	if (!(mnt_pmap->pm_vers && mnt_pmap->pm_prot && mnt_pmap->pm_port)) {
+		if (mnt_pmap->pm_prot)
+			job = nfs_probe_job_add(job, mnt_saddr, mnt_salen,
+					mnt_pmap, mnt_pmap->pm_prot);
+		else
+			for (p_prot = probe_udp_first; *p_prot; p_prot++)
+				job = nfs_probe_job_add(job, mnt_saddr,
+					mnt_salen, mnt_pmap, *p_prot);
+	}
+	n_mnt = job - mnt_jobs;
+
+	v4_job = NULL;
+	if (checkv4 && probe_proto == probe_tcp_first) {
+		v4_job = job++;
+		memcpy(&v4_job->address, nfs_saddr, nfs_salen);
+		v4_job->salen = nfs_salen;
+		v4_job->prog = NFS_PROGRAM;
+		v4_job->vers = 4;
+		v4_job->prot = IPPROTO_TCP;
+		v4_job->port = NFS_PORT;
+	}
+
+	end = job;
+	for (job = jobs; job < end; job++)
+		if (job->getport)
+			job->started = pthread_create(&job->thread, NULL,
+					nfs_probe_job_run, job) == 0;
+	for (job = jobs; job < end; job++) {
+		if (job->started)
+			pthread_join(job->thread, NULL);
+		else if (job->getport)
+			nfs_probe_job_run(job);
+	}
+	nfs_probe_job_ping(jobs, end - jobs);
+
+	if (n_nfs && !nfs_probe_job_pick(nfs_jobs, n_nfs, nfs_pmap))
+		goto out;
+	if (v4_job && v4_job->result) {
+		rpc_createerr.cf_stat = RPC_FAILED;
+		rpc_createerr.cf_error.re_errno = EAGAIN;
+		goto out;
+	}
+	if (n_mnt && !nfs_probe_job_pick(mnt_jobs, n_mnt, mnt_pmap))
+		goto out;
+	nfs_clear_rpc_createerr();
+	result = 1;
+out:
+	return result;
+}
+
 /*
  * Probe a server's mountd service to determine which versions and
  * transport protocols are supported.  Invoked when the protocol
@@ -716,6 +1574,25 @@ int nfs_probe_bothports(const struct sockaddr *mnt_saddr,
 	else if (nfs_pmap->pm_vers && !mnt_pmap->pm_vers)
 		mnt_pmap->pm_vers = nfsvers_to_mnt(nfs_pmap->pm_vers);
 
+	if (nfs_mount_data_version >= 4) {
+		memcpy(&save_nfs, nfs_pmap, sizeof(save_nfs));
+		memcpy(&save_mnt, mnt_pmap, sizeof(save_mnt));
+		if (!nfs_pmap->pm_vers && !mnt_pmap->pm_vers) {
+			nfs_pmap->pm_vers = 3;
+			mnt_pmap->pm_vers = 3;
+		} else
+			checkv4 = 0;
+		if (nfs_pmap->pm_vers && mnt_pmap->pm_vers) {
+			if (nfs_probe_parallel(mnt_saddr, mnt_salen, mnt_pmap,
+					       nfs_saddr, nfs_salen,
+					       nfs_pmap, checkv4))
+				return 1;
+			memcpy(nfs_pmap, &save_nfs, sizeof(*nfs_pmap));
+			memcpy(mnt_pmap, &save_mnt, sizeof(*mnt_pmap));
+			return 0;
+		}
+	}
+
 	if (nfs_pmap->pm_vers)
 		return nfs_probe_version_fixed(mnt_saddr, mnt_salen, mnt_pmap,
 					       nfs_saddr, nfs_salen, nfs_pmap);
@@ -770,91 +1647,189 @@ int probe_bothports(clnt_addr_t *mnt_server, clnt_addr_t *nfs_server)
 					&nfs_server->pmap, 0);
 }
 
+#ifdef START_STATD
+/* Run START_STATD; returns 1 if statd then answers */
+static int statd_run_start(void)
+{
+	struct stat stb;
+	int cnt = STATD_TIMEOUT * 10;
+	int status = 0;
+	char * const envp[1] = { NULL };
+	const struct timespec ts = {
+		.tv_sec = 0,
+		.tv_nsec = 100000000,
+	};
+	pid_t pid;
+
+	if (stat(START_STATD, &stb) != 0 ||
+	    !S_ISREG(stb.st_mode) || !(stb.st_mode & S_IXUSR))
+		return 0;
+
+	pid = fork();
+	switch (pid) {
+	case 0: /* child */
+		setgroups(0, NULL);
+		if (setgid(0) < 0)
+			nfs_error(_("%s: setgid(0) failed: %s"),
+				progname, strerror(errno));
+		if (setuid(0) < 0)
+			nfs_error(_("%s: setuid(0) failed: %s"),
+				progname, strerror(errno));
+		execle(START_STATD, START_STATD, NULL, envp);
+		exit(1);
+	case -1: /* error */
+		nfs_error(_("%s: fork failed: %s"),
+				progname, strerror(errno));
+		break;
+	default: /* parent */
+		if (waitpid(pid, &status,0) == pid &&
+		    status == 0)
+			/* assume it worked */
+			return 1;
+		break;
+	}
+	while (1) {
+		if (nfs_probe_statd())
+			return 1;
+		if (! cnt--)
+			return 0;
+		nanosleep(&ts, NULL);
+	}
+}
+
+static void statd_lock_alarm(int UNUSED(sig))
+{
+}
+
+/*
+ * Wait for the mount starting statd to finish.  Returns 0 once it
+ * has, with the lock held, or -1 if it takes too long.
+ */
+static int statd_lock_wait(int fd)
+{
+	struct sigaction sa, osa;
+	int ret;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = statd_lock_alarm;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGALRM, &sa, &osa);
+	alarm(STATD_TIMEOUT * 2);
+	ret = flock(fd, LOCK_EX);
+	alarm(0);
+	sigaction(SIGALRM, &osa, NULL);
+	return ret;
+}
+
+/* Did the last attempt, recorded in @fd, fail only a moment ago? */
+static int statd_start_failed(int fd)
+{
+	char buf[64];
+	long long when;
+	int ok;
+	ssize_t len;
+
+	len = pread(fd, buf, sizeof(buf) - 1, 0);
+	if (len <= 0)
+		return 0;
+	buf[len] = '\0';
+	if (sscanf(buf, "%d %lld", &ok, &when) != 2)
+		return 0;
+	return !ok && when + STATD_TIMEOUT >= (long long)time(NULL);
+}
+
+static void statd_start_record(int fd, int ok)
+{
+	char buf[64];
+	int len;
+
+	len = snprintf(buf, sizeof(buf), "%d %lld\n", ok,
+		       (long long)time(NULL));
+	if (ftruncate(fd, 0) < 0 || pwrite(fd, buf, len, 0) != len)
+		return;
+}
+#endif
+
 /**
  * start_statd - attempt to start rpc.statd
  *
+ * Of several mounts that find statd isn't running at once, only one
+ * starts it; the others wait for it to finish, rather than each trying
+ * and polling statd themselves, and share its outcome.
+ *
  * Returns 1 if statd is running; otherwise zero.
  */
 int start_statd(void)
 {
 #ifdef START_STATD
-	struct stat stb;
+	int fd, ret;
 #endif
 
 	if (nfs_probe_statd())
 		return 1;
 
 #ifdef START_STATD
-	if (stat(START_STATD, &stb) == 0) {
-		if (S_ISREG(stb.st_mode) && (stb.st_mode & S_IXUSR)) {
-			int cnt = STATD_TIMEOUT * 10;
-			int status = 0;
-			char * const envp[1] = { NULL };
-			const struct timespec ts = {
-				.tv_sec = 0,
-				.tv_nsec = 100000000,
-			};
-			pid_t pid = fork();
-			switch (pid) {
-			case 0: /* child */
-				setgroups(0, NULL);
-				if (setgid(0) < 0)
-					nfs_error(_("%s: setgid(0) failed: %s"),
-						progname, strerror(errno));
-				if (setuid(0) < 0)
-					nfs_error(_("%s: setuid(0) failed: %s"),
-						progname, strerror(errno));
-				execle(START_STATD, START_STATD, NULL, envp);
-				exit(1);
-			case -1: /* error */
-				nfs_error(_("%s: fork failed: %s"),
-						progname, strerror(errno));
-				break;
-			default: /* parent */
-				if (waitpid(pid, &status,0) == pid &&
-				    status == 0)
-					/* assume it worked */
-					return 1;
-				break;
-			}
-			while (1) {
-				if (nfs_probe_statd())
-					return 1;
-				if (! cnt--)
-					return 0;
-				nanosleep(&ts, NULL);
-			}
+	fd = open(STATD_START_LOCK, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (fd < 0)
+		return statd_run_start();
+
+	if (flock(fd, LOCK_EX | LOCK_NB) < 0) {
+		if (errno != EWOULDBLOCK || statd_lock_wait(fd) < 0) {
+			close(fd);
+			return nfs_probe_statd();
 		}
+		/* another mount's attempt has just finished */
+		if (nfs_probe_statd()) {
+			close(fd);
+			return 1;
+		}
+		if (statd_start_failed(fd)) {
+			close(fd);
+			return 0;
+		}
+	} else if (nfs_probe_statd()) {
+		close(fd);
+		return 1;
 	}
-#endif
 
+	ret = statd_run_start();
+	statd_start_record(fd, ret);
+	close(fd);
+	return ret;
+#else
 	return 0;
+#endif
 }
 
 /**
- * nfs_advise_umount - ask the server to remove a share from it's rmtab
+ * nfs_advise_umount_many - ask the server to remove shares from it's rmtab
  * @sap: pointer to IP address of server to call
  * @salen: length of server address
  * @pmap: partially filled-in mountd RPC service tuple
- * @argp: directory path of share to "unmount"
+ * @dirs: directory paths of the shares to "unmount"
+ * @n: number of elements in @dirs
+ * @timeout: how long to wait for replies, in milliseconds
  *
- * Returns one if the unmount call succeeded; zero if the unmount
- * failed for any reason;  rpccreateerr.cf_stat is set to reflect
- * the nature of the error.
+ * The mountd port is found once, then the UMNT calls are made up to
+ * UMNT_BATCH at a time.  If none of a batch is answered, the server
+ * is taken to be unreachable and the rest are not sent.
  *
- * We use a fast timeout since this call is advisory only.
+ * Returns the number of unmount calls that succeeded;
+ * rpccreateerr.cf_stat is set to reflect the nature of the last error.
  */
-int nfs_advise_umount(const struct sockaddr *sap, const socklen_t salen,
-		      const struct pmap *pmap, const dirpath *argp)
+unsigned int nfs_advise_umount_many(const struct sockaddr *sap,
+				    const socklen_t salen,
+				    const struct pmap *pmap,
+				    const dirpath *dirs, const unsigned int n,
+				    const int timeout)
 {
 	union nfs_sockaddr address;
 	struct sockaddr *saddr = &address.sa;
 	struct pmap mnt_pmap = *pmap;
-	struct timeval timeout = {
-		.tv_sec		= MOUNT_TIMEOUT >> 3,
-	};
-	CLIENT *client;
-	enum clnt_stat res = 0;
+	struct nfs_rpc_probe *probes;
+	unsigned int i, first, count, done = 0, answered;
+	long long deadline;
+	AUTH *auth;
 
 	memcpy(saddr, sap, salen);
 	if (nfs_probe_mntport(saddr, salen, &mnt_pmap) == 0) {
@@ -865,43 +1840,83 @@ int nfs_advise_umount(const struct sockaddr *sap, const socklen_t salen,
 	}
 	nfs_set_port(saddr, mnt_pmap.pm_port);
 
-	client = nfs_get_priv_rpcclient(saddr, salen, mnt_pmap.pm_prot,
-					mnt_pmap.pm_prog, mnt_pmap.pm_vers,
-					&timeout);
-	if (client == NULL) {
+	auth = nfs_authsys_create();
+	if (auth == NULL) {
 		if (verbose)
-			nfs_error(_("%s: Failed to create RPC client%s"),
-				progname, clnt_spcreateerror(""));
+			nfs_error(_("%s: Failed to create RPC auth handle"),
+				progname);
 		return 0;
 	}
 
-	client->cl_auth = nfs_authsys_create();
-	if (client->cl_auth == NULL) {
-		if (verbose)
-			nfs_error(_("%s: Failed to create RPC auth handle"),
-				progname);
-		CLNT_DESTROY(client);
+	probes = calloc(n < UMNT_BATCH ? n : UMNT_BATCH, sizeof(*probes));
+	if (probes == NULL) {
+		auth_destroy(auth);
+		rpc_createerr.cf_stat = RPC_SYSTEMERROR;
+		rpc_createerr.cf_error.re_errno = ENOMEM;
 		return 0;
 	}
 
-	res = CLNT_CALL(client, MOUNTPROC_UMNT,
-			(xdrproc_t)xdr_dirpath, (caddr_t)argp,
-			(xdrproc_t)xdr_void, NULL,
-			timeout);
-	if (res != RPC_SUCCESS) {
-		rpc_createerr.cf_stat = res;
-		CLNT_GETERR(client, &rpc_createerr.cf_error);
-		if (verbose)
-			nfs_error(_("%s: UMNT call failed: %s"),
-				progname, clnt_sperrno(res));
+	deadline = nfs_now_ms() + timeout;
+	for (first = 0; first < n; first += count) {
+		count = n - first < UMNT_BATCH ? n - first : UMNT_BATCH;
+		for (i = 0; i < count; i++) {
+			probes[i].sap = saddr;
+			probes[i].salen = salen;
+			probes[i].prog = mnt_pmap.pm_prog;
+			probes[i].vers = mnt_pmap.pm_vers;
+			probes[i].proc = MOUNTPROC_UMNT;
+			probes[i].prot = mnt_pmap.pm_prot;
+			probes[i].flags = NFS_PROBE_RESVPORT;
+			probes[i].timeout = (int)(deadline - nfs_now_ms());
+			probes[i].auth = auth;
+			probes[i].xargs = (xdrproc_t)xdr_dirpath;
+			probes[i].args = (caddr_t)&dirs[first + i];
+		}
+
+		nfs_rpc_probe_many(probes, count);
 
+		answered = 0;
+		for (i = 0; i < count; i++) {
+			if (probes[i].stat == RPC_SUCCESS) {
+				done++;
+				answered++;
+				continue;
+			}
+			rpc_createerr.cf_stat = probes[i].stat;
+			rpc_createerr.cf_error = probes[i].error;
+			if (probes[i].stat != RPC_TIMEDOUT)
+				answered++;
+			if (verbose)
+				nfs_error(_("%s: UMNT call failed: %s"),
+					progname, clnt_sperrno(probes[i].stat));
+		}
+		if (answered == 0 || nfs_now_ms() >= deadline)
+			break;
 	}
-	auth_destroy(client->cl_auth);
-	CLNT_DESTROY(client);
 
-	if (res != RPC_SUCCESS)
-		return 0;
-	return 1;
+	free(probes);
+	auth_destroy(auth);
+	return done;
+}
+
+/**
+ * nfs_advise_umount - ask the server to remove a share from it's rmtab
+ * @sap: pointer to IP address of server to call
+ * @salen: length of server address
+ * @pmap: partially filled-in mountd RPC service tuple
+ * @argp: directory path of share to "unmount"
+ *
+ * Returns one if the unmount call succeeded; zero if the unmount
+ * failed for any reason;  rpccreateerr.cf_stat is set to reflect
+ * the nature of the error.
+ *
+ * We use a fast timeout since this call is advisory only.
+ */
+int nfs_advise_umount(const struct sockaddr *sap, const socklen_t salen,
+		      const struct pmap *pmap, const dirpath *argp)
+{
+	return nfs_advise_umount_many(sap, salen, pmap, argp, 1,
+				(MOUNT_TIMEOUT >> 3) * 1000) == 1;
 }
 
 /**
@@ -920,22 +1935,32 @@ int nfs_call_umount(clnt_addr_t *mnt_server, dirpath *argp)
 	struct sockaddr *sap = SAFE_SOCKADDR(&mnt_server->saddr);
 	socklen_t salen = sizeof(mnt_server->saddr);
 	struct pmap *pmap = &mnt_server->pmap;
-	CLIENT *clnt;
-	enum clnt_stat res = 0;
-	int msock;
+	struct nfs_rpc_probe probe = {
+		.sap		= sap,
+		.salen		= salen,
+		.proc		= MOUNTPROC_UMNT,
+		.flags		= NFS_PROBE_RESVPORT | NFS_PROBE_ANYREPLY,
+		.timeout	= (MOUNT_TIMEOUT + TIMEOUT.tv_sec) * 1000,
+		.xargs		= (xdrproc_t)xdr_dirpath,
+		.args		= (caddr_t)argp,
+	};
 
 	if (!nfs_probe_mntport(sap, salen, pmap))
 		return 0;
-	clnt = mnt_openclnt(mnt_server, &msock);
-	if (!clnt)
+	mnt_server->saddr.sin_port = htons((u_short)pmap->pm_port);
+	probe.prog = pmap->pm_prog;
+	probe.vers = pmap->pm_vers;
+	probe.prot = pmap->pm_prot;
+
+	probe.auth = nfs_authsys_create();
+	if (probe.auth == NULL)
 		return 0;
-	res = clnt_call(clnt, MOUNTPROC_UMNT,
-			(xdrproc_t)xdr_dirpath, (caddr_t)argp,
-			(xdrproc_t)xdr_void, NULL,
-			TIMEOUT);
-	mnt_closeclnt(clnt, msock);
+	nfs_rpc_probe_many(&probe, 1);
+	auth_destroy(probe.auth);
 
-	if (res == RPC_SUCCESS)
+	rpc_createerr.cf_stat = probe.stat;
+	rpc_createerr.cf_error = probe.error;
+	if (probe.stat == RPC_SUCCESS)
 		return 1;
 	return 0;
 }
@@ -1026,66 +2051,30 @@ int clnt_ping(struct sockaddr_in *saddr, const unsigned long prog,
 		const unsigned long vers, const unsigned int prot,
 		struct sockaddr_in *caddr)
 {
-	CLIENT *clnt = NULL;
-	int sock, status;
-	static char clnt_res;
-	struct sockaddr dissolve;
-
-	rpc_createerr.cf_stat = status = 0;
-	sock = get_socket(saddr, prot, CONNECT_TIMEOUT, FALSE, TRUE);
-	if (sock == RPC_ANYSOCK) {
-		if (rpc_createerr.cf_error.re_errno == ETIMEDOUT) {
-			/*
-			 * TCP timeout. Bubble up the error to see 
-			 * how it should be handled.
-			 */
-			rpc_createerr.cf_stat = RPC_TIMEDOUT;
-		}
-		return 0;
-	}
+	struct nfs_rpc_probe probe = {
+		.sap		= SAFE_SOCKADDR(saddr),
+		.salen		= sizeof(*saddr),
+		.prog		= prog,
+		.vers		= vers,
+		.proc		= NULLPROC,
+		.prot		= prot,
+		.flags		= NFS_PROBE_ANYREPLY,
+		.timeout	= (CONNECT_TIMEOUT + TIMEOUT.tv_sec) * 1000,
+	};
+
+	nfs_rpc_probe_many(&probe, 1);
 
 	if (caddr) {
 		/* Get the address of our end of this connection */
-		socklen_t len = sizeof(*caddr);
-		if (getsockname(sock, (struct sockaddr *) caddr, &len) != 0)
+		if (probe.caddrlen == sizeof(*caddr))
+			memcpy(caddr, &probe.caddr, sizeof(*caddr));
+		else
 			caddr->sin_family = 0;
 	}
 
-	switch(prot) {
-	case IPPROTO_UDP:
-		/* The socket is connected (so we could getsockname successfully),
-		 * but some servers on multi-homed hosts reply from
-		 * the wrong address, so if we stay connected, we lose the reply.
-		 */
-		dissolve.sa_family = AF_UNSPEC;
-		connect(sock, &dissolve, sizeof(dissolve));
-
-		clnt = clntudp_bufcreate(saddr, prog, vers,
-					 RETRY_TIMEOUT, &sock,
-					 RPCSMALLMSGSIZE, RPCSMALLMSGSIZE);
-		break;
-	case IPPROTO_TCP:
-		clnt = clnttcp_create(saddr, prog, vers, &sock,
-				      RPCSMALLMSGSIZE, RPCSMALLMSGSIZE);
-		break;
-	}
-	if (!clnt) {
-		close(sock);
-		return 0;
-	}
-	memset(&clnt_res, 0, sizeof(clnt_res));
-	status = clnt_call(clnt, NULLPROC,
-			 (xdrproc_t)xdr_void, (caddr_t)NULL,
-			 (xdrproc_t)xdr_void, (caddr_t)&clnt_res,
-			 TIMEOUT);
-	if (status) {
-		clnt_geterr(clnt, &rpc_createerr.cf_error);
-		rpc_createerr.cf_stat = status;
-	}
-	clnt_destroy(clnt);
-	close(sock);
-
-	if (status == RPC_SUCCESS)
+	rpc_createerr.cf_stat = probe.stat;
+	rpc_createerr.cf_error = probe.error;
+	if (probe.stat == RPC_SUCCESS)
 		return 1;
 	else
 		return 0;
@@ -1744,6 +2733,9 @@ int nfs_umount_do_umnt(struct mount_options *options,
 
 	if (!nfs_mount_proto_family(options, &family))
 		return 0;
+	if (nfs_umnt_queue(*hostname, family, &mnt_pmap, *dirname))
+		return EX_SUCCESS;
+
 	if (!nfs_lookup(*hostname, family, sap, &salen))
 		/* nfs_lookup reports any errors */
 		return EX_FAIL;
@@ -39,6 +39,36 @@ typedef struct {
 static const struct timeval TIMEOUT = { 20, 0 };
 static const struct timeval RETRY_TIMEOUT = { 3, 0 };
 
+/* One RPC call made by nfs_rpc_probe_many() */
+struct nfs_rpc_probe {
+	const struct sockaddr	*sap;		/* port filled in */
+	socklen_t		salen;
+	rpcprog_t		prog;
+	rpcvers_t		vers;
+	rpcproc_t		proc;
+	unsigned short		prot;
+	int			flags;
+	int			timeout;	/* milliseconds */
+	AUTH			*auth;		/* NULL means AUTH_NONE */
+	xdrproc_t		xargs;		/* NULL means no arguments */
+	caddr_t			args;
+	xdrproc_t		xres;		/* NULL means no results */
+	caddr_t			res;
+
+	struct sockaddr_storage	caddr;		/* OUT: our address */
+	socklen_t		caddrlen;
+	enum clnt_stat		stat;		/* OUT */
+	struct rpc_err		error;		/* OUT */
+	unsigned long		rtt;		/* OUT: microseconds from
+						   sending to the reply */
+};
+
+#define NFS_PROBE_RESVPORT	(1 << 0)	/* bind a privileged port */
+#define NFS_PROBE_ANYREPLY	(1 << 1)	/* UDP: reply may come from
+						   another address */
+
+unsigned int nfs_rpc_probe_many(struct nfs_rpc_probe *, const unsigned int);
+
 int probe_bothports(clnt_addr_t *, clnt_addr_t *);
 int nfs_probe_bothports(const struct sockaddr *, const socklen_t,
 			struct pmap *, const struct sockaddr *,
@@ -55,6 +85,8 @@ int clnt_ping(struct sockaddr_in *, const unsigned long,
 		const unsigned long, const unsigned int,
 		struct sockaddr_in *);
 int nfs_is_inaddr_any(struct sockaddr *);
+const struct addrinfo *nfs_race_addresses(const struct addrinfo *,
+					  const unsigned short, const int);
 int nfs_addr_matches_localips(struct sockaddr *);
 
 struct mount_options;
@@ -87,6 +119,9 @@ unsigned long nfsvers_to_mnt(const unsigned long);
 int nfs_call_umount(clnt_addr_t *, dirpath *);
 int nfs_advise_umount(const struct sockaddr *, const socklen_t,
 		      const struct pmap *, const dirpath *);
+unsigned int nfs_advise_umount_many(const struct sockaddr *, const socklen_t,
+				    const struct pmap *, const dirpath *,
+				    const unsigned int, const int);
 CLIENT *mnt_openclnt(clnt_addr_t *, int *);
 void mnt_closeclnt(CLIENT *, int);
 
@@ -27,9 +27,12 @@
  * the C string itself.  This is similar to the way Python handles
  * string manipulation.
  *
- * The current implementation uses a linked list as the data object
- * since lists are simple, and we don't need to worry about more
- * than ten or twenty options at a time.
+ * Options are kept in an array, in order, and the rightmost instance
+ * of each keyword is found through a hash index that is rebuilt only
+ * when options are inserted anywhere but the end, or removed.  Keywords
+ * and values live in shared, reference-counted chunks, so a whole
+ * options string is copied in one go, and a duplicate shares both the
+ * array and the strings until one of them is changed.
  *
  * Hopefully the interface is abstract enough that the underlying
  * data structure can be replaced if needed without changing the API.
@@ -48,173 +51,302 @@
 #include <errno.h>
 
 #include "parse_opt.h"
-#include "token.h"
 
 
+#define PO_CHUNK_SIZE	1024
+#define PO_MIN_BUCKETS	16
+
+struct po_chunk {
+	unsigned int refs;
+	size_t used, size;
+	char data[];
+};
+
 struct mount_option {
-	struct mount_option *next, *prev;
 	char *keyword;
 	char *value;
+	unsigned int hash;
+	int hprev;		/* next option to the left in its bucket */
+};
+
+/* The part of a group of options that duplicates share */
+struct po_set {
+	unsigned int refs;
+	struct mount_option *opts;
+	unsigned int count, size;
+	int *buckets;		/* rightmost option in each bucket */
+	unsigned int nbuckets;
+	int indexed;		/* buckets are up to date */
+	struct po_chunk **chunks;
+	unsigned int nchunks, chunks_size;
 };
 
 struct mount_options {
-	struct mount_option *head, *tail;
-	unsigned int count;
+	struct po_set *set;
 };
 
-static struct mount_option *option_create(char *str)
+static unsigned int keyword_hash(const char *keyword)
 {
-	struct mount_option *option;
-	char *opteq;
+	unsigned int hash = 2166136261u;
 
-	if (!str)
-		return NULL;
+	while (*keyword)
+		hash = (hash ^ (unsigned char)*keyword++) * 16777619u;
+	return hash;
+}
 
-	option = malloc(sizeof(*option));
-	if (!option)
-		return NULL;
-	
-	option->next = NULL;
-	option->prev = NULL;
+static void chunk_put(struct po_chunk *chunk)
+{
+	if (--chunk->refs == 0)
+		free(chunk);
+}
 
-	opteq = strchr(str, '=');
-	if (opteq) {
-		option->keyword = strndup(str, opteq - str);
-		if (!option->keyword)
-			goto fail;
-		option->value = strdup(opteq + 1);
-		if (!option->value) {
-			free(option->keyword);
-			goto fail;
-		}
-	} else {
-		option->keyword = strdup(str);
-		if (!option->keyword)
-			goto fail;
-		option->value = NULL;
+static int set_add_chunk(struct po_set *set, struct po_chunk *chunk)
+{
+	struct po_chunk **new;
+	unsigned int size;
+
+	if (set->nchunks == set->chunks_size) {
+		size = set->chunks_size ? set->chunks_size * 2 : 4;
+		new = realloc(set->chunks, size * sizeof(*new));
+		if (!new)
+			return 0;
+		set->chunks = new;
+		set->chunks_size = size;
 	}
-
-	return option;
-
-fail:
-	free(option);
-	return NULL;
+	chunk->refs++;
+	set->chunks[set->nchunks++] = chunk;
+	return 1;
 }
 
-static struct mount_option *option_dup(const struct mount_option *option)
+/*
+ * Copy @len bytes of @str, and a NUL, into the set's chunks.  Only a
+ * chunk no other set shares is written to, so that options added to
+ * a short-lived duplicate are freed along with it.
+ */
+static char *set_strndup(struct po_set *set, const char *str, size_t len)
 {
-	struct mount_option *new;
-
-	new = malloc(sizeof(*new));
-	if (!new)
-		return NULL;
-	
-	new->next = NULL;
-	new->prev = NULL;
+	struct po_chunk *chunk = NULL;
+	char *ret;
 
-	new->keyword = strdup(option->keyword);
-	if (!new->keyword)
-		goto fail;
+	if (set->nchunks) {
+		chunk = set->chunks[set->nchunks - 1];
+		if (chunk->refs != 1 || chunk->size - chunk->used < len + 1)
+			chunk = NULL;
+	}
+	if (!chunk) {
+		size_t size = len + 1 > PO_CHUNK_SIZE ? len + 1 : PO_CHUNK_SIZE;
 
-	new->value = NULL;
-	if (option->value) {
-		new->value = strdup(option->value);
-		if (!new->value) {
-			free(new->keyword);
-			goto fail;
+		chunk = malloc(sizeof(*chunk) + size);
+		if (!chunk)
+			return NULL;
+		chunk->refs = 0;
+		chunk->used = 0;
+		chunk->size = size;
+		if (!set_add_chunk(set, chunk)) {
+			free(chunk);
+			return NULL;
 		}
 	}
 
-	return new;
-
-fail:
-	free(new);
-	return NULL;
+	ret = chunk->data + chunk->used;
+	memcpy(ret, str, len);
+	ret[len] = '\0';
+	chunk->used += len + 1;
+	return ret;
 }
 
-static void option_destroy(struct mount_option *option)
+static struct po_set *set_create(void)
 {
-	free(option->keyword);
-	free(option->value);
-	free(option);
+	struct po_set *set;
+
+	set = calloc(1, sizeof(*set));
+	if (set)
+		set->refs = 1;
+	return set;
 }
 
-static void options_init(struct mount_options *options)
+static void set_put(struct po_set *set)
 {
-	options->head = options->tail = NULL;
-	options->count = 0;
+	unsigned int i;
+
+	if (!set || --set->refs > 0)
+		return;
+	for (i = 0; i < set->nchunks; i++)
+		chunk_put(set->chunks[i]);
+	free(set->chunks);
+	free(set->buckets);
+	free(set->opts);
+	free(set);
 }
 
-static struct mount_options *options_create(void)
+/* A private copy of @set, sharing its strings */
+static struct po_set *set_clone(struct po_set *set)
 {
-	struct mount_options *options;
+	struct po_set *new;
+	unsigned int i;
 
-	options = malloc(sizeof(*options));
-	if (options)
-		options_init(options);
+	new = set_create();
+	if (!new)
+		return NULL;
+	if (set->count) {
+		new->opts = malloc(set->count * sizeof(*new->opts));
+		if (!new->opts)
+			goto fail;
+		memcpy(new->opts, set->opts, set->count * sizeof(*new->opts));
+		new->count = new->size = set->count;
+	}
+	for (i = 0; i < set->nchunks; i++)
+		if (!set_add_chunk(new, set->chunks[i]))
+			goto fail;
+	return new;
 
-	return options;
+fail:
+	set_put(new);
+	return NULL;
 }
 
-static int options_empty(struct mount_options *options)
+static void set_index(struct po_set *set)
 {
-	return options->count == 0;
+	unsigned int i, n, b;
+
+	if (set->indexed)
+		return;
+	for (n = PO_MIN_BUCKETS; n < set->count * 2; n *= 2)
+		;
+	if (n != set->nbuckets) {
+		int *new = realloc(set->buckets, n * sizeof(*new));
+
+		/* without an index, lookups fall back to a scan */
+		if (!new)
+			return;
+		set->buckets = new;
+		set->nbuckets = n;
+	}
+	for (b = 0; b < n; b++)
+		set->buckets[b] = -1;
+	for (i = 0; i < set->count; i++) {
+		b = set->opts[i].hash & (n - 1);
+		set->opts[i].hprev = set->buckets[b];
+		set->buckets[b] = i;
+	}
+	set->indexed = 1;
 }
 
-static void options_tail_insert(struct mount_options *options,
-				struct mount_option *option)
+/* The index of the rightmost instance of @keyword, or -1 if none */
+static int set_find(struct po_set *set, const char *keyword)
 {
-	struct mount_option *prev = options->tail;
-
-	option->next = NULL;
-	option->prev = prev;
-
-	if (prev)
-		prev->next = option;
-	else
-		options->head = option;
-	options->tail = option;
+	unsigned int hash = keyword_hash(keyword);
+	int i;
 
-	options->count++;
+	set_index(set);
+	if (!set->indexed) {
+		for (i = set->count - 1; i >= 0; i--)
+			if (strcmp(set->opts[i].keyword, keyword) == 0)
+				return i;
+		return -1;
+	}
+	for (i = set->buckets[hash & (set->nbuckets - 1)]; i >= 0;
+	     i = set->opts[i].hprev)
+		if (set->opts[i].hash == hash &&
+		    strcmp(set->opts[i].keyword, keyword) == 0)
+			return i;
+	return -1;
 }
 
-static void options_head_insert(struct mount_options *options,
-				struct mount_option *option)
+/*
+ * Add the option in @str, which is already in the set's chunks, at
+ * position @pos.  @str is split at its first equals sign.
+ */
+static int set_insert(struct po_set *set, unsigned int pos, char *str)
 {
-	struct mount_option *ohead = options->head;
+	struct mount_option *option;
+	unsigned int b;
+	char *opteq;
 
-	option->prev = NULL;
-	option->next = ohead;
-	if (ohead)
-		ohead->prev = option;
-	else
-		options->tail = option;
-	options->head = option;
+	if (set->count == set->size) {
+		unsigned int size = set->size ? set->size * 2 : 16;
+		struct mount_option *new;
 
-	options->count++;
+		new = realloc(set->opts, size * sizeof(*new));
+		if (!new)
+			return 0;
+		set->opts = new;
+		set->size = size;
+	}
+
+	if (pos < set->count) {
+		memmove(&set->opts[pos + 1], &set->opts[pos],
+			(set->count - pos) * sizeof(*set->opts));
+		set->indexed = 0;
+	}
+	option = &set->opts[pos];
+	option->keyword = str;
+	option->value = NULL;
+	opteq = strchr(str, '=');
+	if (opteq) {
+		*opteq = '\0';
+		option->value = opteq + 1;
+	}
+	option->hash = keyword_hash(option->keyword);
+	set->count++;
+
+	if (set->indexed) {
+		if (set->count * 2 > set->nbuckets)
+			set->indexed = 0;
+		else {
+			b = option->hash & (set->nbuckets - 1);
+			option->hprev = set->buckets[b];
+			set->buckets[b] = pos;
+		}
+	}
+	return 1;
 }
 
-static void options_delete(struct mount_options *options,
-			   struct mount_option *option)
+static struct mount_options *options_create(struct po_set *set)
 {
-	struct mount_option *prev = option->prev;
-	struct mount_option *next = option->next;
+	struct mount_options *options;
 
-	if (!options_empty(options)) {
-		if (prev)
-			prev->next = option->next;
-		if (next)
-			next->prev = option->prev;
+	if (!set)
+		set = set_create();
+	if (!set)
+		return NULL;
+	options = malloc(sizeof(*options));
+	if (!options) {
+		set_put(set);
+		return NULL;
+	}
+	options->set = set;
+	return options;
+}
 
-		if (options->head == option)
-			options->head = option->next;
-		if (options->tail == option)
-			options->tail = prev;
+/* Make sure @options has a set of its own, before it is changed */
+static int options_own(struct mount_options *options)
+{
+	struct po_set *set = options->set;
+
+	if (set->refs == 1)
+		return 1;
+	set = set_clone(set);
+	if (!set)
+		return 0;
+	set_put(options->set);
+	options->set = set;
+	return 1;
+}
 
-		options->count--;
+static po_return_t options_add(struct mount_options *options, char *str,
+			       int head)
+{
+	struct po_set *set;
+	char *copy;
 
-		option_destroy(option);
-	}
+	if (!options || !str || !options_own(options))
+		return PO_FAILED;
+	set = options->set;
+	copy = set_strndup(set, str, strlen(str));
+	if (!copy || !set_insert(set, head ? 0 : set->count, copy))
+		return PO_FAILED;
+	return PO_SUCCEEDED;
 }
 
 
@@ -226,8 +358,7 @@ static void options_delete(struct mount_options *options,
 void po_destroy(struct mount_options *options)
 {
 	if (options) {
-		while (!options_empty(options))
-			options_delete(options, options->head);
+		set_put(options->set);
 		free(options);
 	}
 }
@@ -247,30 +378,46 @@ void po_destroy(struct mount_options *options)
 struct mount_options *po_split(char *str)
 {
 	struct mount_options *options;
-	struct tokenizer_state *tstate;
-	char *opt;
-
-	if (!str)
-		return options_create();
-
-	options = options_create();
-	if (options) {
-		tstate = init_tokenizer(str, ',');
-		for (opt = next_token(tstate); opt; opt = next_token(tstate)) {
-			struct mount_option *option = option_create(opt);
-			free(opt);
-			if (!option)
-				goto fail;
-			options_tail_insert(options, option);
+	struct po_set *set;
+	char *copy, *pos, *opt;
+	int quoted;
+
+	options = options_create(NULL);
+	if (!options || !str)
+		return options;
+
+	/*
+	 * Copy the whole string once and split it in place.  Delimiters
+	 * between double quotes don't count (needed for
+	 * 'context="sd,fslj"').
+	 */
+	set = options->set;
+	copy = set_strndup(set, str, strlen(str));
+	if (!copy)
+		goto fail;
+	for (pos = copy; *pos != '\0';) {
+		if (*pos == ',') {
+			pos++;
+			continue;
+		}
+		opt = pos;
+		for (quoted = 0; *pos != '\0'; pos++) {
+			if (*pos == '"')
+				quoted ^= 1;
+			if (!quoted && *pos == ',')
+				break;
 		}
-		if (tokenizer_error(tstate))
+		/* did the string terminate before the close quote? */
+		if (quoted)
+			goto fail;
+		if (*pos != '\0')
+			*pos++ = '\0';
+		if (!set_insert(set, set->count, opt))
 			goto fail;
-		end_tokenizer(tstate);
 	}
 	return options;
 
 fail:
-	end_tokenizer(tstate);
 	po_destroy(options);
 	return NULL;
 }
@@ -283,29 +430,14 @@ fail:
 struct mount_options *po_dup(struct mount_options *source)
 {
 	struct mount_options *target;
-	struct mount_option *current;
 
 	if (!source)
 		return NULL;
 
-	target = options_create();
-	if (options_empty(source) || target == NULL)
-		return target;
-
-	current = source->head;
-	while (target->count < source->count) {
-		struct mount_option *option;
-
-		option = option_dup(current);
-		if (!option) {
-			po_destroy(target);
-			return NULL;
-		}
-
-		options_tail_insert(target, option);
-		current = current->next;
-	}
-
+	/* the two share everything until one of them is changed */
+	target = options_create(source->set);
+	if (target)
+		source->set->refs++;
 	return target;
 }
 
@@ -318,16 +450,17 @@ struct mount_options *po_dup(struct mount_options *source)
  */
 void po_replace(struct mount_options *target, struct mount_options *source)
 {
-	if (target) {
-		while (!options_empty(target))
-			options_delete(target, target->head);
+	struct po_set *empty;
 
-		if (source) {
-			target->head = source->head;
-			target->tail = source->tail;
-			target->count = source->count;
-
-			options_init(source);
+	if (target) {
+		empty = set_create();
+		if (source && empty) {
+			set_put(target->set);
+			target->set = source->set;
+			source->set = empty;
+		} else if (empty) {
+			set_put(target->set);
+			target->set = empty;
 		}
 	}
 }
@@ -347,8 +480,11 @@ void po_replace(struct mount_options *target, struct mount_options *source)
  */
 po_return_t po_join(struct mount_options *options, char **str)
 {
-	size_t len = 0;
 	struct mount_option *option;
+	struct po_set *set;
+	size_t len = 0, n;
+	unsigned int i;
+	char *p;
 
 	if (!str || !options)
 		return PO_FAILED;
@@ -356,35 +492,36 @@ po_return_t po_join(struct mount_options *options, char **str)
 	free(*str);
 	*str = NULL;
 
-	if (options_empty(options)) {
-		*str = strdup("");
-		return *str ? PO_SUCCEEDED : PO_FAILED;
-	}
-
-	for (option = options->head; option; option = option->next) {
+	set = options->set;
+	for (i = 0; i < set->count; i++) {
+		option = &set->opts[i];
 		len += strlen(option->keyword);
 		if (option->value)
-			len +=strlen(option->value) + 1;  /* equals sign */
-		if (option->next)
-			len++;  /* comma */
+			len += strlen(option->value) + 1;  /* equals sign */
+		len++;  /* comma, or NULL on the end */
 	}
+	if (!len)
+		len++;
 
-	len++;	/* NULL on the end */
-
-	*str = malloc(len);
+	*str = p = malloc(len);
 	if (!*str)
 		return PO_FAILED;
-	*str[0] = '\0';
 
-	for (option = options->head; option; option = option->next) {
-		strcat(*str, option->keyword);
+	for (i = 0; i < set->count; i++) {
+		option = &set->opts[i];
+		if (i)
+			*p++ = ',';
+		n = strlen(option->keyword);
+		memcpy(p, option->keyword, n);
+		p += n;
 		if (option->value) {
-			strcat(*str, "=");
-			strcat(*str, option->value);
+			*p++ = '=';
+			n = strlen(option->value);
+			memcpy(p, option->value, n);
+			p += n;
 		}
-		if (option->next)
-			strcat(*str, ",");
 	}
+	*p = '\0';
 
 	return PO_SUCCEEDED;
 }
@@ -397,13 +534,7 @@ po_return_t po_join(struct mount_options *options, char **str)
  */
 po_return_t po_insert(struct mount_options *options, char *str)
 {
-	struct mount_option *option = option_create(str);
-
-	if (option) {
-		options_head_insert(options, option);
-		return PO_SUCCEEDED;
-	}
-	return PO_FAILED;
+	return options_add(options, str, 1);
 }
 
 /**
@@ -414,13 +545,7 @@ po_return_t po_insert(struct mount_options *options, char *str)
  */
 po_return_t po_append(struct mount_options *options, char *str)
 {
-	struct mount_option *option = option_create(str);
-
-	if (option) {
-		options_tail_insert(options, option);
-		return PO_SUCCEEDED;
-	}
-	return PO_FAILED;
+	return options_add(options, str, 0);
 }
 
 /**
@@ -431,13 +556,8 @@ po_return_t po_append(struct mount_options *options, char *str)
  */
 po_found_t po_contains(struct mount_options *options, char *keyword)
 {
-	struct mount_option *option;
-
-	if (options && keyword) {
-		for (option = options->head; option; option = option->next)
-			if (strcmp(option->keyword, keyword) == 0)
-				return PO_FOUND;
-	}
+	if (options && keyword && set_find(options->set, keyword) >= 0)
+		return PO_FOUND;
 
 	return PO_NOT_FOUND;
 }
@@ -454,16 +574,20 @@ po_found_t po_contains(struct mount_options *options, char *keyword)
 po_found_t po_contains_prefix(struct mount_options *options,
 			      const char *prefix, char **keyword, int n)
 {
-	struct mount_option *option;
+	struct po_set *set;
+	unsigned int i;
+	size_t len;
 
 	if (options && prefix) {
-		for (option = options->head; option; option = option->next)
-			if (strncmp(option->keyword, prefix, strlen(prefix)) == 0) {
+		set = options->set;
+		len = strlen(prefix);
+		for (i = 0; i < set->count; i++)
+			if (strncmp(set->opts[i].keyword, prefix, len) == 0) {
 				if (n > 0) {
 					n -= 1;
 				} else {
 					if (keyword)
-						*keyword = option->keyword;
+						*keyword = set->opts[i].keyword;
 					return PO_FOUND;
 				}
 			}
@@ -486,12 +610,12 @@ po_found_t po_contains_prefix(struct mount_options *options,
  */
 char *po_get(struct mount_options *options, char *keyword)
 {
-	struct mount_option *option;
+	int i;
 
 	if (options && keyword) {
-		for (option = options->tail; option; option = option->prev)
-			if (strcmp(option->keyword, keyword) == 0)
-				return option->value;
+		i = set_find(options->set, keyword);
+		if (i >= 0)
+			return options->set->opts[i].value;
 	}
 
 	return NULL;
@@ -570,18 +694,19 @@ po_found_t po_get_numeric(struct mount_options *options, char *keyword, long *va
  */
 int po_rightmost(struct mount_options *options, const char *keys[])
 {
-	struct mount_option *option;
-	int i;
+	int i, pos, best = -1, ret = -1;
 
 	if (options) {
-		for (option = options->tail; option; option = option->prev) {
-			for (i = 0; keys[i] != NULL; i++)
-				if (strcmp(option->keyword, keys[i]) == 0)
-					return i;
+		for (i = 0; keys[i] != NULL; i++) {
+			pos = set_find(options->set, keys[i]);
+			if (pos > best) {
+				best = pos;
+				ret = i;
+			}
 		}
 	}
 
-	return -1;
+	return ret;
 }
 
 /**
@@ -593,18 +718,20 @@ int po_rightmost(struct mount_options *options, const char *keys[])
  */
 po_found_t po_remove_all(struct mount_options *options, char *keyword)
 {
-	struct mount_option *option, *next;
-	int found = PO_NOT_FOUND;
+	struct po_set *set;
+	unsigned int i, j;
 
-	if (options && keyword) {
-		for (option = options->head; option; option = next) {
-			next = option->next;
-			if (strcmp(option->keyword, keyword) == 0) {
-				options_delete(options, option);
-				found = PO_FOUND;
-			}
-		}
-	}
+	if (!options || !keyword || set_find(options->set, keyword) < 0)
+		return PO_NOT_FOUND;
+	if (!options_own(options))
+		return PO_NOT_FOUND;
+
+	set = options->set;
+	for (i = j = 0; i < set->count; i++)
+		if (strcmp(set->opts[i].keyword, keyword) != 0)
+			set->opts[j++] = set->opts[i];
+	set->count = j;
+	set->indexed = 0;
 
-	return found;
+	return PO_FOUND;
 }
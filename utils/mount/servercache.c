@@ -0,0 +1,356 @@
+/*
+ * servercache.c -- remember what NFS servers negotiated to
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 0211-1301 USA
+ *
+ */
+
+/*
+ * When many file systems are mounted from one server at once, as
+ * autofs does at boot, each mount.nfs would otherwise repeat the same
+ * version negotiation and rpcbind queries.  The outcome for a server
+ * is kept in a small file named after its address, under
+ * NFS_SRVCACHE_DIR, for NFS_SRVCACHE_TTL seconds:
+ *
+ *   ADDRESS.vers	the NFS version and minor version that mounted,
+ *			where version 3 means NFSv4 could not be used
+ *   ADDRESS.ports	the NFS and MOUNT version, protocol and port
+ *			found by the last rpcbind probe
+ *   HOSTNAME.addr	which of a server's addresses answered first
+ *   ADDRESS.tune	the nconnect, rsize and wsize chosen by "autotune"
+ *
+ * A mount tries what is remembered first, and forgets it and
+ * negotiates as before if that fails.  Only root writes the cache, and
+ * files that anyone else could have written are ignored.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <rpc/rpc.h>
+
+#include "mount.h"
+#include "sockaddr.h"
+#include "mount_constants.h"
+#include "network.h"
+#include "servercache.h"
+
+#ifndef NFS_SRVCACHE_TOPDIR
+#define NFS_SRVCACHE_TOPDIR	"/run/nfs"
+#endif
+#define NFS_SRVCACHE_DIR	NFS_SRVCACHE_TOPDIR "/mount.nfs"
+#define NFS_SRVCACHE_TTL	(300)	/* seconds */
+
+static int nfs_srvcache_name(const char *name, const char *kind,
+			     char *buf, const size_t buflen)
+{
+	int len;
+
+	len = snprintf(buf, buflen, "%s/%s.%s", NFS_SRVCACHE_DIR,
+		       name, kind);
+	return len > 0 && (size_t)len < buflen;
+}
+
+static int nfs_srvcache_path(const struct sockaddr *sap, const char *kind,
+			     char *buf, const size_t buflen)
+{
+	char address[NI_MAXHOST];
+
+	if (getnameinfo(sap, nfs_sockaddr_length(sap), address,
+			sizeof(address), NULL, 0, NI_NUMERICHOST) != 0)
+		return 0;
+	return nfs_srvcache_name(address, kind, buf, buflen);
+}
+
+/* Host names become file names, so only plain ones are cached */
+static int nfs_srvcache_host_path(const char *hostname, char *buf,
+				  const size_t buflen)
+{
+	const char *p;
+
+	if (hostname[0] == '\0' || hostname[0] == '.')
+		return 0;
+	for (p = hostname; *p != '\0'; p++)
+		if (!isalnum((unsigned char)*p) && strchr(".-_", *p) == NULL)
+			return 0;
+	return nfs_srvcache_name(hostname, "addr", buf, buflen);
+}
+
+/*
+ * Read the one line of the cache file for @sap and @kind into @buf.
+ * Returns 1 if there is a fresh one, otherwise zero.
+ */
+static int nfs_srvcache_read_path(const char *path, char *buf,
+				  const size_t buflen)
+{
+	struct stat st;
+	time_t now;
+	ssize_t len;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd == -1)
+		return 0;
+	len = -1;
+	now = time(NULL);
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_uid == 0 &&
+	    !(st.st_mode & (S_IWGRP | S_IWOTH)) &&
+	    st.st_mtime <= now && now - st.st_mtime < NFS_SRVCACHE_TTL)
+		len = read(fd, buf, buflen - 1);
+	close(fd);
+	if (len <= 0)
+		return 0;
+	buf[len] = '\0';
+	return 1;
+}
+
+static int nfs_srvcache_read(const struct sockaddr *sap, const char *kind,
+			     char *buf, const size_t buflen)
+{
+	char path[PATH_MAX];
+
+	if (!nfs_srvcache_path(sap, kind, path, sizeof(path)))
+		return 0;
+	return nfs_srvcache_read_path(path, buf, buflen);
+}
+
+/* Replace the cache file at @path with @line */
+static void nfs_srvcache_write_path(const char *path, const char *line)
+{
+	char tmp[PATH_MAX + 8];
+	size_t len = strlen(line);
+	int fd;
+
+	if (geteuid() != 0)
+		return;
+	if ((mkdir(NFS_SRVCACHE_TOPDIR, 0755) == -1 && errno != EEXIST) ||
+	    (mkdir(NFS_SRVCACHE_DIR, 0700) == -1 && errno != EEXIST))
+		return;
+
+	snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+	fd = mkstemp(tmp);
+	if (fd == -1)
+		return;
+	if (write(fd, line, len) != (ssize_t)len || close(fd) == -1 ||
+	    rename(tmp, path) == -1)
+		unlink(tmp);
+}
+
+/* Replace the cache file for @sap and @kind with @line */
+static void nfs_srvcache_write(const struct sockaddr *sap, const char *kind,
+			       const char *line)
+{
+	char path[PATH_MAX];
+
+	if (nfs_srvcache_path(sap, kind, path, sizeof(path)))
+		nfs_srvcache_write_path(path, line);
+}
+
+/**
+ * nfs_srvcache_get_version - what NFS version did a server mount with?
+ * @sap: server's address
+ * @major: OUT: NFS version; 3 if NFSv4 could not be used
+ * @minor: OUT: NFSv4 minor version
+ *
+ * Returns 1 if it is remembered, otherwise zero.
+ */
+int nfs_srvcache_get_version(const struct sockaddr *sap, unsigned long *major,
+			     unsigned long *minor)
+{
+	char line[64];
+
+	if (!nfs_srvcache_read(sap, "vers", line, sizeof(line)))
+		return 0;
+	if (sscanf(line, "%lu %lu", major, minor) != 2)
+		return 0;
+	return *major == 3 || *major == 4;
+}
+
+/**
+ * nfs_srvcache_put_version - remember the NFS version a server mounted with
+ * @sap: server's address
+ * @major: NFS version; 3 if NFSv4 could not be used
+ * @minor: NFSv4 minor version
+ */
+void nfs_srvcache_put_version(const struct sockaddr *sap,
+			      const unsigned long major,
+			      const unsigned long minor)
+{
+	unsigned long omajor, ominor;
+	char line[64];
+
+	if (nfs_srvcache_get_version(sap, &omajor, &ominor) &&
+	    omajor == major && ominor == minor)
+		return;
+	snprintf(line, sizeof(line), "%lu %lu\n", major, minor);
+	nfs_srvcache_write(sap, "vers", line);
+}
+
+/**
+ * nfs_srvcache_get_ports - look up a server's remembered rpcbind probe
+ * @sap: server's address
+ * @nfs_pmap: OUT: NFS service version, protocol and port
+ * @mnt_pmap: OUT: MOUNT service version, protocol and port
+ *
+ * Returns 1 if it is remembered, otherwise zero.  The program numbers
+ * are left alone.
+ */
+int nfs_srvcache_get_ports(const struct sockaddr *sap, struct pmap *nfs_pmap,
+			   struct pmap *mnt_pmap)
+{
+	unsigned long v[6];
+	char line[128];
+
+	if (!nfs_srvcache_read(sap, "ports", line, sizeof(line)))
+		return 0;
+	if (sscanf(line, "%lu %lu %lu %lu %lu %lu", &v[0], &v[1], &v[2],
+		   &v[3], &v[4], &v[5]) != 6)
+		return 0;
+	if (v[2] == 0 || v[2] > 65535 || v[5] == 0 || v[5] > 65535)
+		return 0;
+	nfs_pmap->pm_vers = v[0];
+	nfs_pmap->pm_prot = v[1];
+	nfs_pmap->pm_port = v[2];
+	mnt_pmap->pm_vers = v[3];
+	mnt_pmap->pm_prot = v[4];
+	mnt_pmap->pm_port = v[5];
+	return 1;
+}
+
+/**
+ * nfs_srvcache_put_ports - remember the outcome of an rpcbind probe
+ * @sap: server's address
+ * @nfs_pmap: NFS service version, protocol and port
+ * @mnt_pmap: MOUNT service version, protocol and port
+ */
+void nfs_srvcache_put_ports(const struct sockaddr *sap,
+			    const struct pmap *nfs_pmap,
+			    const struct pmap *mnt_pmap)
+{
+	char line[128];
+
+	snprintf(line, sizeof(line), "%lu %lu %lu %lu %lu %lu\n",
+		 nfs_pmap->pm_vers, nfs_pmap->pm_prot, nfs_pmap->pm_port,
+		 mnt_pmap->pm_vers, mnt_pmap->pm_prot, mnt_pmap->pm_port);
+	nfs_srvcache_write(sap, "ports", line);
+}
+
+/**
+ * nfs_srvcache_get_tune - look up the transport settings chosen for a server
+ * @sap: server's address
+ * @nconnect: OUT: number of connections
+ * @rsize: OUT: read size, or zero to let the kernel negotiate it
+ * @wsize: OUT: write size, or zero to let the kernel negotiate it
+ *
+ * Returns 1 if they are remembered, otherwise zero.
+ */
+int nfs_srvcache_get_tune(const struct sockaddr *sap, unsigned long *nconnect,
+			  unsigned long *rsize, unsigned long *wsize)
+{
+	char line[96];
+
+	if (!nfs_srvcache_read(sap, "tune", line, sizeof(line)))
+		return 0;
+	if (sscanf(line, "%lu %lu %lu", nconnect, rsize, wsize) != 3)
+		return 0;
+	return *nconnect > 0;
+}
+
+/**
+ * nfs_srvcache_put_tune - remember the transport settings chosen for a server
+ * @sap: server's address
+ * @nconnect: number of connections
+ * @rsize: read size, or zero
+ * @wsize: write size, or zero
+ */
+void nfs_srvcache_put_tune(const struct sockaddr *sap,
+			   const unsigned long nconnect,
+			   const unsigned long rsize, const unsigned long wsize)
+{
+	char line[96];
+
+	snprintf(line, sizeof(line), "%lu %lu %lu\n", nconnect, rsize, wsize);
+	nfs_srvcache_write(sap, "tune", line);
+}
+
+/**
+ * nfs_srvcache_forget - drop what is remembered about a server
+ * @sap: server's address
+ * @kind: "vers", "ports" or "tune"
+ */
+void nfs_srvcache_forget(const struct sockaddr *sap, const char *kind)
+{
+	char path[PATH_MAX];
+
+	if (geteuid() == 0 && nfs_srvcache_path(sap, kind, path, sizeof(path)))
+		unlink(path);
+}
+
+/**
+ * nfs_srvcache_get_address - which of a server's addresses answered first?
+ * @hostname: server's host name
+ * @sap: OUT: the address
+ * @salen: IN: size of @sap; OUT: length of the address
+ *
+ * Returns 1 if it is remembered, otherwise zero.
+ */
+int nfs_srvcache_get_address(const char *hostname, struct sockaddr *sap,
+			     socklen_t *salen)
+{
+	char path[PATH_MAX], line[NI_MAXHOST + 2];
+
+	if (!nfs_srvcache_host_path(hostname, path, sizeof(path)))
+		return 0;
+	if (!nfs_srvcache_read_path(path, line, sizeof(line)))
+		return 0;
+	line[strcspn(line, "\n")] = '\0';
+	return nfs_string_to_sockaddr(line, sap, salen);
+}
+
+/**
+ * nfs_srvcache_put_address - remember which of a server's addresses answered
+ * @hostname: server's host name
+ * @sap: the address
+ */
+void nfs_srvcache_put_address(const char *hostname, const struct sockaddr *sap)
+{
+	char path[PATH_MAX], line[NI_MAXHOST + 2];
+	size_t len;
+
+	if (!nfs_srvcache_host_path(hostname, path, sizeof(path)))
+		return;
+	if (getnameinfo(sap, nfs_sockaddr_length(sap), line, NI_MAXHOST,
+			NULL, 0, NI_NUMERICHOST) != 0)
+		return;
+	len = strlen(line);
+	line[len] = '\n';
+	line[len + 1] = '\0';
+	nfs_srvcache_write_path(path, line);
+}
@@ -0,0 +1,43 @@
+/*
+ * servercache.h -- remember what NFS servers negotiated to
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 0211-1301 USA
+ *
+ */
+
+#ifndef _NFS_UTILS_MOUNT_SERVERCACHE_H
+#define _NFS_UTILS_MOUNT_SERVERCACHE_H
+
+#include <rpc/rpc.h>
+#include <rpc/pmap_prot.h>
+
+int nfs_srvcache_get_version(const struct sockaddr *, unsigned long *,
+			     unsigned long *);
+void nfs_srvcache_put_version(const struct sockaddr *, const unsigned long,
+			      const unsigned long);
+int nfs_srvcache_get_ports(const struct sockaddr *, struct pmap *,
+			   struct pmap *);
+void nfs_srvcache_put_ports(const struct sockaddr *, const struct pmap *,
+			    const struct pmap *);
+int nfs_srvcache_get_tune(const struct sockaddr *, unsigned long *,
+			  unsigned long *, unsigned long *);
+void nfs_srvcache_put_tune(const struct sockaddr *, const unsigned long,
+			   const unsigned long, const unsigned long);
+void nfs_srvcache_forget(const struct sockaddr *, const char *);
+int nfs_srvcache_get_address(const char *, struct sockaddr *, socklen_t *);
+void nfs_srvcache_put_address(const char *, const struct sockaddr *);
+
+#endif	/* _NFS_UTILS_MOUNT_SERVERCACHE_H */
@@ -50,6 +50,7 @@
 #include "parse_dev.h"
 #include "conffile.h"
 #include "misc.h"
+#include "servercache.h"
 
 #ifndef NFS_PROGRAM
 #define NFS_PROGRAM	(100003)
@@ -75,6 +76,17 @@
 #define NFS_DEF_BG_TIMEOUT_MINUTES	(10000u)
 #endif
 
+#ifndef NFS_RACE_TIMEOUT
+#define NFS_RACE_TIMEOUT	(5000)	/* ms */
+#endif
+
+#ifndef NFS_AUTOTUNE_TIMEOUT
+#define NFS_AUTOTUNE_TIMEOUT	(3000)	/* ms */
+#endif
+#define NFS_AUTOTUNE_PINGS	(5)
+#define NFS_AUTOTUNE_SECTION	"NFSMount_Autotune"
+#define NFS_MAX_NCONNECT	(16)	/* the kernel's limit */
+
 #ifndef NFS_DEFAULT_MAJOR
 #define NFS_DEFAULT_MAJOR	4
 #endif
@@ -101,9 +113,16 @@ struct nfsmount_info {
 	struct nfs_version	version;	/* NFS version */
 	int			flags,		/* MS_ flags */
 				fake,		/* actually do the mount? */
-				child;		/* forked bg child? */
+				child,		/* forked bg child? */
+				autotune,	/* choose nconnect etc.? */
+				tuned;		/* NFS_TUNED_ options added */
+	unsigned int		attempts;	/* for timing reports */
 };
 
+#define NFS_TUNED_NCONNECT	(1 << 0)
+#define NFS_TUNED_RSIZE		(1 << 1)
+#define NFS_TUNED_WSIZE		(1 << 2)
+
 
 static void nfs_default_version(struct nfsmount_info *mi)
 {
@@ -413,6 +432,30 @@ static int nfs_set_version(struct nfsmount_info *mi)
  *
  * Returns 1 if successful; otherwise zero.
  */
+static const char *nfs_autotune_opttbl[] = {
+	"noautotune",
+	"autotune",
+	NULL,
+};
+
+static int nfs_set_timing(struct mount_options *options)
+{
+	char *value = po_get(options, "timing");
+	int mode;
+
+	if (value == NULL)
+		return 1;
+	mode = nfs_timing_parse(value);
+	if (mode < 0) {
+		nfs_error(_("%s: invalid value for 'timing=' option"),
+			progname);
+		return 0;
+	}
+	nfs_timing_setup(mode);
+	po_remove_all(options, "timing");
+	return 1;
+}
+
 static int nfs_validate_options(struct nfsmount_info *mi)
 {
 	/* For remount, ignore mi->spec: the kernel will. */
@@ -431,6 +474,14 @@ static int nfs_validate_options(struct nfsmount_info *mi)
 	 */
 	po_remove_all(mi->options, "addr");
 
+	/* "autotune" and "timing" are for mount.nfs, not for the kernel */
+	if (!nfs_set_timing(mi->options))
+		return 0;
+
+	mi->autotune = po_rightmost(mi->options, nfs_autotune_opttbl) == 1;
+	po_remove_all(mi->options, "autotune");
+	po_remove_all(mi->options, "noautotune");
+
 	if (!nfs_set_version(mi))
 		return 0;
 
@@ -536,6 +587,231 @@ static int nfs_construct_new_options(struct mount_options *options,
 	return 1;
 }
 
+/*
+ * Fill in @nfs_pmap and @mnt_pmap from the ports remembered for the
+ * server at @sap, if they agree with every field the mount options
+ * set already.  Returns one if they were filled in, otherwise zero.
+ */
+static int nfs_cached_pmap(const struct sockaddr *sap,
+			   struct pmap *nfs_pmap, struct pmap *mnt_pmap)
+{
+	struct pmap nfs_cached = *nfs_pmap, mnt_cached = *mnt_pmap;
+
+	if (!nfs_srvcache_get_ports(sap, &nfs_cached, &mnt_cached))
+		return 0;
+	if ((nfs_pmap->pm_vers && nfs_pmap->pm_vers != nfs_cached.pm_vers) ||
+	    (nfs_pmap->pm_prot && nfs_pmap->pm_prot != nfs_cached.pm_prot) ||
+	    (nfs_pmap->pm_port && nfs_pmap->pm_port != nfs_cached.pm_port) ||
+	    (mnt_pmap->pm_vers && mnt_pmap->pm_vers != mnt_cached.pm_vers) ||
+	    (mnt_pmap->pm_prot && mnt_pmap->pm_prot != mnt_cached.pm_prot) ||
+	    (mnt_pmap->pm_port && mnt_pmap->pm_port != mnt_cached.pm_port))
+		return 0;
+	*nfs_pmap = nfs_cached;
+	*mnt_pmap = mnt_cached;
+	return 1;
+}
+
+/*
+ * The "autotune" policy, from the NFSMount_Autotune section of
+ * nfsmount.conf.  RTTs are in microseconds.
+ */
+struct nfs_autotune_policy {
+	unsigned long	min_nconnect,	/* on a LAN */
+			max_nconnect,
+			rtt_per_conn,	/* RTT worth one more connection */
+			wan_rtt,	/* RTT at which wan sizes apply */
+			wan_rsize,	/* zero lets the kernel choose */
+			wan_wsize;
+};
+
+static unsigned long nfs_autotune_get(const char *tag, const int dflt)
+{
+#ifdef MOUNT_CONFIG
+	int value = conf_get_num(NFS_AUTOTUNE_SECTION, tag, dflt);
+
+	return value < 0 ? (unsigned long)dflt : (unsigned long)value;
+#else
+	(void)tag;
+	return (unsigned long)dflt;
+#endif
+}
+
+static void nfs_autotune_read_policy(struct nfs_autotune_policy *policy)
+{
+	policy->min_nconnect = nfs_autotune_get("MinNconnect", 1);
+	policy->max_nconnect = nfs_autotune_get("MaxNconnect", 8);
+	policy->rtt_per_conn = nfs_autotune_get("RttPerConnection", 2000);
+	policy->wan_rtt = nfs_autotune_get("WanRtt", 10000);
+	policy->wan_rsize = nfs_autotune_get("WanRsize", 0);
+	policy->wan_wsize = nfs_autotune_get("WanWsize", 0);
+
+	if (policy->max_nconnect > NFS_MAX_NCONNECT)
+		policy->max_nconnect = NFS_MAX_NCONNECT;
+	if (policy->max_nconnect == 0)
+		policy->max_nconnect = 1;
+	if (policy->min_nconnect == 0)
+		policy->min_nconnect = 1;
+	if (policy->min_nconnect > policy->max_nconnect)
+		policy->min_nconnect = policy->max_nconnect;
+}
+
+/*
+ * Time a few NULL calls to the NFS service over TCP, each on its
+ * own connection, and take the fastest as the server's round trip.
+ *
+ * Returns 1 and fills in @rtt if any call was answered.
+ */
+static int nfs_autotune_rtt(struct nfsmount_info *mi, unsigned long *rtt)
+{
+	struct nfs_rpc_probe probes[NFS_AUTOTUNE_PINGS];
+	union nfs_sockaddr address;
+	struct sockaddr *sap = &address.sa;
+	socklen_t salen = mi->address->ai_addrlen;
+	long port;
+	int i, found = 0;
+
+	if (salen > sizeof(address))
+		return 0;
+	memcpy(sap, mi->address->ai_addr, salen);
+	if (po_get_numeric(mi->options, "port", &port) != PO_FOUND ||
+	    port <= 0 || port > 65535)
+		port = NFS_PORT;
+	nfs_set_port(sap, (uint16_t)port);
+
+	memset(probes, 0, sizeof(probes));
+	for (i = 0; i < NFS_AUTOTUNE_PINGS; i++) {
+		probes[i].sap = sap;
+		probes[i].salen = salen;
+		probes[i].prog = NFS_PROGRAM;
+		probes[i].vers = mi->version.major == 4 ? 4 : 3;
+		probes[i].proc = NFSPROC_NULL;
+		probes[i].prot = IPPROTO_TCP;
+		probes[i].timeout = NFS_AUTOTUNE_TIMEOUT;
+	}
+	if (nfs_rpc_probe_many(probes, NFS_AUTOTUNE_PINGS) == 0)
+		return 0;
+
+	for (i = 0; i < NFS_AUTOTUNE_PINGS; i++) {
+		if (probes[i].stat != RPC_SUCCESS)
+			continue;
+		if (!found || probes[i].rtt < *rtt)
+			*rtt = probes[i].rtt;
+		found = 1;
+	}
+	return found;
+}
+
+static void nfs_autotune_choose(const unsigned long rtt,
+				unsigned long *nconnect,
+				unsigned long *rsize, unsigned long *wsize)
+{
+	struct nfs_autotune_policy policy;
+
+	nfs_autotune_read_policy(&policy);
+
+	*nconnect = policy.min_nconnect;
+	if (policy.rtt_per_conn)
+		*nconnect += rtt / policy.rtt_per_conn;
+	if (*nconnect > policy.max_nconnect)
+		*nconnect = policy.max_nconnect;
+
+	*rsize = *wsize = 0;
+	if (rtt >= policy.wan_rtt) {
+		*rsize = policy.wan_rsize;
+		*wsize = policy.wan_wsize;
+	}
+}
+
+static int nfs_autotune_append(struct mount_options *options,
+			       const char *name, const unsigned long value)
+{
+	char buf[64];
+
+	if (po_contains(options, (char *)name) == PO_FOUND)
+		return 0;
+	snprintf(buf, sizeof(buf), "%s=%lu", name, value);
+	return po_append(options, buf) == PO_SUCCEEDED;
+}
+
+/*
+ * Choose nconnect, and rsize and wsize on slow links, for options
+ * the user left out.  The kernel cannot change these on remount, so
+ * the server is measured before mounting.  What is chosen is kept
+ * in the server cache, and later mounts use it without measuring.
+ */
+static void nfs_autotune(struct nfsmount_info *mi)
+{
+	unsigned long protocol = 0, rtt = 0, nconnect, rsize, wsize;
+	const struct sockaddr *sap = mi->address->ai_addr;
+
+	if (nfs_nfs_protocol(mi->options, &protocol) && protocol != 0 &&
+	    protocol != IPPROTO_TCP)
+		return;
+	if (po_contains(mi->options, "nconnect") == PO_FOUND &&
+	    po_contains(mi->options, "rsize") == PO_FOUND &&
+	    po_contains(mi->options, "wsize") == PO_FOUND)
+		return;
+
+	if (!nfs_srvcache_get_tune(sap, &nconnect, &rsize, &wsize)) {
+		if (!nfs_autotune_rtt(mi, &rtt))
+			return;
+		nfs_autotune_choose(rtt, &nconnect, &rsize, &wsize);
+		if (verbose)
+			printf(_("%s: round trip to %s takes %lu.%03lu ms\n"),
+				progname, mi->hostname,
+				rtt / 1000, rtt % 1000);
+		if (!mi->fake)
+			nfs_srvcache_put_tune(sap, nconnect, rsize, wsize);
+	}
+
+	/* nconnect=1 is the default, and older kernels reject it */
+	if (nconnect > 1 &&
+	    nfs_autotune_append(mi->options, "nconnect", nconnect))
+		mi->tuned |= NFS_TUNED_NCONNECT;
+	if (rsize && nfs_autotune_append(mi->options, "rsize", rsize))
+		mi->tuned |= NFS_TUNED_RSIZE;
+	if (wsize && nfs_autotune_append(mi->options, "wsize", wsize))
+		mi->tuned |= NFS_TUNED_WSIZE;
+}
+
+static void nfs_autotune_remove(const int tuned, struct mount_options *options)
+{
+	if (tuned & NFS_TUNED_NCONNECT)
+		po_remove_all(options, "nconnect");
+	if (tuned & NFS_TUNED_RSIZE)
+		po_remove_all(options, "rsize");
+	if (tuned & NFS_TUNED_WSIZE)
+		po_remove_all(options, "wsize");
+}
+
+/*
+ * Drop the options nfs_autotune() added from @opts, mi->options, and
+ * the string recorded in /etc/mtab.
+ */
+static void nfs_autotune_undo(struct nfsmount_info *mi,
+			      struct mount_options *opts)
+{
+	struct mount_options *extra;
+	char *str = NULL;
+
+	nfs_autotune_remove(mi->tuned, opts);
+	if (opts != mi->options)
+		nfs_autotune_remove(mi->tuned, mi->options);
+
+	extra = po_split(*mi->extra_opts);
+	if (extra != NULL) {
+		nfs_autotune_remove(mi->tuned, extra);
+		if (po_join(extra, &str) == PO_SUCCEEDED) {
+			free(*mi->extra_opts);
+			*mi->extra_opts = str;
+		}
+		po_destroy(extra);
+	}
+
+	nfs_srvcache_forget(mi->address->ai_addr, "tune");
+	mi->tuned = 0;
+}
+
 /*
  * Reconstruct the mount option string based on a portmapper probe
  * of the server.  Returns one if the server's portmapper returned
@@ -546,11 +822,17 @@ static int nfs_construct_new_options(struct mount_options *options,
  * portmap probe.  Mount options that nfs_rewrite_pmap_mount_options()
  * doesn't recognize are left alone.
  *
+ * If @cached is set on entry, the ports remembered for this server
+ * are used instead of a probe when they fit the requested options,
+ * and the outcome of a probe is remembered.  On return, @cached is
+ * set only if remembered ports were used.
+ *
  * Returns TRUE if rewriting was successful; otherwise
  * FALSE is returned if some failure occurred.
  */
 static int
-nfs_rewrite_pmap_mount_options(struct mount_options *options, int checkv4)
+nfs_rewrite_pmap_mount_options(struct mount_options *options, int checkv4,
+			       int *cached)
 {
 	union nfs_sockaddr nfs_address;
 	struct sockaddr *nfs_saddr = &nfs_address.sa;
@@ -561,6 +843,9 @@ nfs_rewrite_pmap_mount_options(struct mount_options *options, int checkv4)
 	socklen_t mnt_salen = sizeof(mnt_address);
 	unsigned long protocol;
 	struct pmap mnt_pmap;
+	int use_cache = *cached;
+
+	*cached = 0;
 
 	/* initialize structs */
 	memset(&nfs_pmap, 0, sizeof(struct pmap));
@@ -599,6 +884,13 @@ nfs_rewrite_pmap_mount_options(struct mount_options *options, int checkv4)
 	nfs_pmap.pm_prog = NFS_PROGRAM;
 	mnt_pmap.pm_prog = MOUNTPROG;
 
+	if (use_cache && !checkv4 &&
+	    nfs_compare_sockaddr(nfs_saddr, mnt_saddr) &&
+	    nfs_cached_pmap(nfs_saddr, &nfs_pmap, &mnt_pmap)) {
+		*cached = 1;
+		goto construct;
+	}
+
 	/*
 	 * If the server's rpcbind service isn't available, we can't
 	 * negotiate.  Bail now if we can't contact it.
@@ -618,7 +910,10 @@ nfs_rewrite_pmap_mount_options(struct mount_options *options, int checkv4)
 			errno = rpc_createerr.cf_error.re_errno;
 		return 0;
 	}
+	if (use_cache && nfs_compare_sockaddr(nfs_saddr, mnt_saddr))
+		nfs_srvcache_put_ports(nfs_saddr, &nfs_pmap, &mnt_pmap);
 
+construct:
 	if (!nfs_construct_new_options(options, nfs_saddr, &nfs_pmap,
 					mnt_saddr, &mnt_pmap)) {
 		if (rpc_createerr.cf_stat == RPC_UNKNOWNPROTO)
@@ -642,6 +937,7 @@ out:
 static int nfs_sys_mount(struct nfsmount_info *mi, struct mount_options *opts)
 {
 	char *options = NULL;
+	long long start;
 	int result;
 
 	if (mi->fake)
@@ -652,10 +948,29 @@ static int nfs_sys_mount(struct nfsmount_info *mi, struct mount_options *opts)
 		return 0;
 	}
 
+	start = nfs_timing_now();
 	result = mount(mi->spec, mi->node, mi->type,
 			mi->flags & ~(MS_USER|MS_USERS), options);
+	if (nfs_timing_mode) {
+		int save = errno;
+
+		nfs_timing("mount", nfs_timing_now() - start,
+			   result ? strerror(save) : NULL,
+			   "%s errno=%d options=%s", mi->type,
+			   result ? save : 0, options);
+		errno = save;
+	}
 	free(options);
 
+	if (result && errno == EINVAL && mi->tuned) {
+		/* Perhaps the kernel predates nconnect */
+		if (verbose)
+			printf(_("%s: trying again without tuned options\n"),
+				progname);
+		nfs_autotune_undo(mi, opts);
+		return nfs_sys_mount(mi, opts);
+	}
+
 	if (verbose && result) {
 		int save = errno;
 		nfs_error(_("%s: mount(2): %s"), progname, strerror(save));
@@ -669,7 +984,8 @@ static int nfs_do_mount_v3v2(struct nfsmount_info *mi,
 			     int checkv4)
 {
 	struct mount_options *options = po_dup(mi->options);
-	int result = 0;
+	struct mount_options *rewritten = NULL;
+	int result = 0, cached = !mi->fake;
 
 	if (!options) {
 		errno = ENOMEM;
@@ -708,12 +1024,32 @@ static int nfs_do_mount_v3v2(struct nfsmount_info *mi,
 		printf(_("%s: trying text-based options '%s'\n"),
 			progname, *mi->extra_opts);
 
-	if (!nfs_rewrite_pmap_mount_options(options, checkv4))
+	rewritten = po_dup(options);
+	if (!rewritten) {
+		errno = ENOMEM;
+		goto out_fail;
+	}
+	if (!nfs_rewrite_pmap_mount_options(rewritten, checkv4, &cached))
 		goto out_fail;
 
+	result = nfs_sys_mount(mi, rewritten);
+	if (result || !cached)
+		goto out_fail;
+
+	/*
+	 * The remembered ports may be stale, for instance if mountd
+	 * was restarted.  Forget them and probe the server instead.
+	 */
+	nfs_srvcache_forget(sap, "ports");
+	po_destroy(rewritten);
+	rewritten = NULL;
+	cached = 1;
+	if (!nfs_rewrite_pmap_mount_options(options, checkv4, &cached))
+		goto out_fail;
 	result = nfs_sys_mount(mi, options);
 
 out_fail:
+	po_destroy(rewritten);
 	po_destroy(options);
 	return result;
 }
@@ -903,12 +1239,36 @@ out:
  */
 static int nfs_autonegotiate(struct nfsmount_info *mi)
 {
+	struct sockaddr *sap = mi->address->ai_addr;
+	unsigned long major, minor;
 	int result, olderrno;
 
+	/*
+	 * Start with the version this server mounted with last time,
+	 * if it is remembered.
+	 */
+	if (!mi->fake && nfs_srvcache_get_version(sap, &major, &minor)) {
+		if (major == 3 && mi->version.v_mode != V_GENERAL) {
+			if (verbose)
+				printf(_("%s: trying NFSv3 first for %s\n"),
+					progname, mi->hostname);
+			if (nfs_try_mount_v3v2(mi, FALSE))
+				return 1;
+			nfs_timing("fallback", -1, strerror(errno),
+				   "remembered vers=3 to vers=4");
+			nfs_srvcache_forget(sap, "vers");
+		} else if (major == 4 && mi->version.v_mode != V_SPECIFIC &&
+			   minor < mi->version.minor)
+			mi->version.minor = minor;
+	}
+
 	result = nfs_try_mount_v4(mi);
 check_result:
-	if (result)
+	if (result) {
+		if (!mi->fake)
+			nfs_srvcache_put_version(sap, 4, mi->version.minor);
 		return result;
+	}
 
 	switch (errno) {
 	case EPROTONOSUPPORT:
@@ -922,6 +1282,10 @@ check_result:
 		 * may not support NFSv4 minor version. */
 		if (mi->version.v_mode != V_SPECIFIC) {
 			if (mi->version.minor > 0) {
+				nfs_timing("fallback", -1, strerror(errno),
+					   "vers=4.%lu to vers=4.%lu",
+					   mi->version.minor,
+					   mi->version.minor - 1);
 				mi->version.minor--;
 				result = nfs_try_mount_v4(mi);
 				goto check_result;
@@ -944,7 +1308,11 @@ check_result:
 		if (mi->version.v_mode == V_GENERAL)
 			/* Mustn't try v2,v3 */
 			return result;
+		nfs_timing("fallback", -1, strerror(errno),
+			   "vers=4 to vers=3");
 		result = nfs_try_mount_v3v2(mi, TRUE);
+		if (result && !mi->fake)
+			nfs_srvcache_put_version(sap, 3, 0);
 		if (result == 0 && errno == EAGAIN) {
 			/* v4 server seems to be registered now. */
 			result = nfs_try_mount_v4(mi);
@@ -970,8 +1338,12 @@ fall_back:
 	 * Report the first failure not the v3 mount failure
 	 */
 	olderrno = errno;
-	if ((result = nfs_try_mount_v3v2(mi, FALSE)))
+	nfs_timing("fallback", -1, strerror(errno), "vers=4 to vers=3");
+	if ((result = nfs_try_mount_v3v2(mi, FALSE))) {
+		if (!mi->fake)
+			nfs_srvcache_put_version(sap, 3, 0);
 		return result;
+	}
 
 	if (errno != EBUSY && errno != EACCES)
 		errno = olderrno;
@@ -979,13 +1351,77 @@ fall_back:
 	return result;
 }
 
+/*
+ * If the server has several addresses, move the one that answers
+ * first, or that answered first recently, to the head of the list
+ * so that it is the one tried first.  List entries are swapped in
+ * place, since freeaddrinfo() may expect the original head.
+ */
+static void nfs_prefer_address(struct nfsmount_info *mi)
+{
+	struct addrinfo *head = mi->address, *ai, save;
+	const struct addrinfo *winner = NULL;
+	union nfs_sockaddr address;
+	socklen_t salen = sizeof(address);
+	unsigned long protocol = 0;
+	long long start;
+	long port;
+
+	if (head == NULL || head->ai_next == NULL)
+		return;
+	if (nfs_nfs_protocol(mi->options, &protocol) && protocol != 0 &&
+	    protocol != IPPROTO_TCP)
+		return;
+
+	if (nfs_srvcache_get_address(mi->hostname, &address.sa, &salen)) {
+		for (ai = head; ai != NULL; ai = ai->ai_next)
+			if (nfs_compare_sockaddr(ai->ai_addr, &address.sa))
+				winner = ai;
+	}
+	if (winner == NULL) {
+		/* Race to NFSv4's port, or to rpcbind's for v2 and v3 */
+		if (mi->version.major == 3)
+			port = PMAPPORT;
+		else if (po_get_numeric(mi->options, "port", &port) !=
+				PO_FOUND || port <= 0 || port > 65535)
+			port = NFS_PORT;
+		start = nfs_timing_now();
+		winner = nfs_race_addresses(head, (unsigned short)port,
+					    NFS_RACE_TIMEOUT);
+		nfs_timing("race", nfs_timing_now() - start,
+			   winner ? NULL : _("no address answered"),
+			   "%s port %ld", mi->hostname, port);
+		if (winner == NULL)
+			return;
+		if (!mi->fake)
+			nfs_srvcache_put_address(mi->hostname,
+						 winner->ai_addr);
+	}
+	if (winner == head)
+		return;
+
+	if (verbose) {
+		char buf[NI_MAXHOST];
+
+		if (nfs_present_sockaddr(winner->ai_addr, winner->ai_addrlen,
+					 buf, sizeof(buf)))
+			printf(_("%s: trying %s first\n"), progname, buf);
+	}
+	ai = (struct addrinfo *)winner;
+	save = *head;
+	*head = *ai;
+	head->ai_next = save.ai_next;
+	save.ai_next = ai->ai_next;
+	*ai = save;
+}
+
 /*
  * This is a single pass through the fg/bg loop.
  *
  * Returns TRUE if successful, otherwise FALSE.
  * "errno" is set to reflect the individual error.
  */
-static int nfs_try_mount(struct nfsmount_info *mi)
+static int nfs_try_mount_once(struct nfsmount_info *mi)
 {
 	int result = 0;
 
@@ -995,9 +1431,14 @@ static int nfs_try_mount(struct nfsmount_info *mi)
 		};
 		int error;
 		struct addrinfo *address;
+		long long start;
 
 		hint.ai_family = (int)mi->family;
+		start = nfs_timing_now();
 		error = getaddrinfo(mi->hostname, NULL, &hint, &address);
+		nfs_timing("dns", nfs_timing_now() - start,
+			   error ? gai_strerror(error) : NULL,
+			   "%s", mi->hostname);
 		if (error != 0) {
 			if (error == EAI_AGAIN)
 				errno = EAGAIN;
@@ -1009,13 +1450,20 @@ static int nfs_try_mount(struct nfsmount_info *mi)
 			return 0;
 		}
 
+		mi->address = address;
+		nfs_prefer_address(mi);
 		if (!nfs_append_addr_option(address->ai_addr,
 					    address->ai_addrlen, mi->options)) {
 			nfs_freeaddrinfo(address);
+			mi->address = NULL;
 			errno = ENOMEM;
 			return 0;
 		}
-		mi->address = address;
+	}
+
+	if (mi->autotune) {
+		mi->autotune = 0;
+		nfs_autotune(mi);
 	}
 
 	switch (mi->version.major) {
@@ -1035,6 +1483,22 @@ static int nfs_try_mount(struct nfsmount_info *mi)
 	return result;
 }
 
+static int nfs_try_mount(struct nfsmount_info *mi)
+{
+	long long start = nfs_timing_now();
+	int result, save;
+
+	result = nfs_try_mount_once(mi);
+	if (nfs_timing_mode) {
+		save = errno;
+		nfs_timing("attempt", nfs_timing_now() - start,
+			   result ? NULL : strerror(save), "%u of %s",
+			   ++mi->attempts, mi->spec);
+		errno = save;
+	}
+	return result;
+}
+
 /*
  * Distinguish between permanent and temporary errors.
  *
@@ -1127,6 +1591,8 @@ static int nfsmount_fg(struct nfsmount_info *mi)
 			break;
 
 		if (errno != ETIMEDOUT) {
+			nfs_timing("retry", -1, strerror(errno),
+				   "in %u seconds", secs);
 			if (sleep(secs))
 				break;
 			secs <<= 1;
@@ -1177,6 +1643,8 @@ static int nfsmount_child(struct nfsmount_info *mi)
 					 NFS_DEF_BG_TIMEOUT_MINUTES);
 
 	for (;;) {
+		nfs_timing("retry", -1, strerror(errno),
+			   "in background in %u seconds", secs);
 		if (sleep(secs))
 			break;
 		secs <<= 1;
@@ -1300,6 +1768,9 @@ int nfsmount_string(const char *spec, const char *node, char *type,
 	mi.options = po_split(*extra_opts);
 	if (mi.options) {
 		retval = nfsmount_start(&mi);
+		nfs_timing("done", -1, retval == EX_SUCCESS ? NULL :
+			   (retval == EX_BG ? _("continuing in background") :
+			   _("failed")), "%s on %s", spec, node);
 		po_destroy(mi.options);
 	} else
 		nfs_error(_("%s: internal option parsing error"), progname);
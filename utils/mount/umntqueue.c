@@ -0,0 +1,354 @@
+/*
+ * umntqueue.c -- send UMNT advisories in the background
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 0211-1301 USA
+ *
+ */
+
+/*
+ * A UMNT call only asks the server to drop a share from its rmtab,
+ * but making one can cost an rpcbind query and a timeout or two, and
+ * at shutdown, with many mounts of unreachable servers, those add up.
+ *
+ * With "background-umnt" set in the [umount] section of nfs.conf,
+ * umount.nfs leaves the call in a file under NFS_UMNTQ_DIR and starts
+ * a detached helper to make it, and the local unmount goes ahead at
+ * once.  The helper takes every queued call, makes those to one
+ * server together, and drops whatever is left once "umnt-timeout"
+ * seconds have passed.  Only one helper runs at a time; one that
+ * finds another running leaves the queue to it.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <rpc/rpc.h>
+
+#include "mount.h"
+#include "sockaddr.h"
+#include "nls.h"
+#include "conffile.h"
+#include "mount_constants.h"
+#include "network.h"
+#include "umntqueue.h"
+
+#ifndef NFS_UMNTQ_TOPDIR
+#define NFS_UMNTQ_TOPDIR	"/run/nfs"
+#endif
+#define NFS_UMNTQ_DIR		NFS_UMNTQ_TOPDIR "/umount.nfs"
+#define NFS_UMNTQ_LOCK		NFS_UMNTQ_DIR "/.lock"
+#define NFS_UMNTQ_PREFIX	"umnt."
+#define NFS_UMNTQ_BUDGET	(30)	/* seconds */
+#define NFS_UMNTQ_CALL_TIMEOUT	(3000)	/* ms for one server's calls */
+#define NFS_UMNTQ_MAX		(1024)	/* calls taken from the queue at once */
+
+extern char *progname;
+extern int verbose;
+
+struct nfs_umntq_entry {
+	char		*hostname;
+	sa_family_t	family;
+	struct pmap	pmap;
+	char		*dirname;
+	int		done;
+};
+
+/*
+ * Read the queued call in @name.  Returns 1 and fills in @entry
+ * if it is well-formed, otherwise zero.
+ */
+static int nfs_umntq_read(DIR *dir, const char *name,
+			  struct nfs_umntq_entry *entry)
+{
+	char line[NI_MAXHOST + PATH_MAX + 64], hostname[NI_MAXHOST];
+	unsigned long prog, vers, prot, port;
+	unsigned int family;
+	struct stat st;
+	ssize_t len;
+	char *p;
+	int fd, pos;
+
+	fd = openat(dirfd(dir), name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd == -1)
+		return 0;
+	len = -1;
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_uid == 0 &&
+	    !(st.st_mode & (S_IWGRP | S_IWOTH)))
+		len = read(fd, line, sizeof(line) - 1);
+	close(fd);
+	if (len <= 0)
+		return 0;
+	line[len] = '\0';
+	p = strchr(line, '\n');
+	if (p == NULL)
+		return 0;
+	*p = '\0';
+
+	if (sscanf(line, "%1024s %u %lu %lu %lu %lu %n", hostname, &family,
+			&prog, &vers, &prot, &port, &pos) != 6 ||
+	    line[pos] != '/')
+		return 0;
+
+	entry->hostname = strdup(hostname);
+	entry->dirname = strdup(line + pos);
+	if (entry->hostname == NULL || entry->dirname == NULL) {
+		free(entry->hostname);
+		free(entry->dirname);
+		return 0;
+	}
+	entry->family = (sa_family_t)family;
+	entry->pmap.pm_prog = prog;
+	entry->pmap.pm_vers = vers;
+	entry->pmap.pm_prot = prot;
+	entry->pmap.pm_port = port;
+	entry->done = 0;
+	return 1;
+}
+
+static int nfs_umntq_same_server(const struct nfs_umntq_entry *a,
+				 const struct nfs_umntq_entry *b)
+{
+	return strcmp(a->hostname, b->hostname) == 0 &&
+		a->family == b->family &&
+		a->pmap.pm_prog == b->pmap.pm_prog &&
+		a->pmap.pm_vers == b->pmap.pm_vers &&
+		a->pmap.pm_prot == b->pmap.pm_prot &&
+		a->pmap.pm_port == b->pmap.pm_port;
+}
+
+/*
+ * Make the calls of @entries[first] and of every later entry for
+ * the same server, unless @deadline has passed.
+ */
+static void nfs_umntq_send(struct nfs_umntq_entry *entries,
+			   const unsigned int n, const unsigned int first,
+			   const time_t deadline)
+{
+	struct nfs_umntq_entry *entry = &entries[first];
+	union nfs_sockaddr address;
+	struct sockaddr *sap = &address.sa;
+	socklen_t salen = sizeof(address);
+	unsigned int i, count = 0;
+	dirpath *dirs;
+
+	dirs = calloc(n - first, sizeof(*dirs));
+	if (dirs == NULL)
+		return;
+	for (i = first; i < n; i++)
+		if (!entries[i].done &&
+		    nfs_umntq_same_server(entry, &entries[i])) {
+			entries[i].done = 1;
+			dirs[count++] = entries[i].dirname;
+		}
+
+	if (time(NULL) < deadline &&
+	    nfs_lookup(entry->hostname, entry->family, sap, &salen))
+		nfs_advise_umount_many(sap, salen, &entry->pmap, dirs, count,
+					NFS_UMNTQ_CALL_TIMEOUT);
+	free(dirs);
+}
+
+/*
+ * Take the calls now queued, and make them.  Returns the number
+ * of calls taken.
+ */
+static unsigned int nfs_umntq_drain(const time_t deadline)
+{
+	struct nfs_umntq_entry *entries;
+	struct dirent *d;
+	unsigned int i, n = 0;
+	DIR *dir;
+
+	entries = calloc(NFS_UMNTQ_MAX, sizeof(*entries));
+	if (entries == NULL)
+		return 0;
+	dir = opendir(NFS_UMNTQ_DIR);
+	if (dir == NULL) {
+		free(entries);
+		return 0;
+	}
+	while (n < NFS_UMNTQ_MAX && (d = readdir(dir)) != NULL) {
+		if (strncmp(d->d_name, NFS_UMNTQ_PREFIX,
+				strlen(NFS_UMNTQ_PREFIX)) != 0)
+			continue;
+		if (nfs_umntq_read(dir, d->d_name, &entries[n]))
+			n++;
+		unlinkat(dirfd(dir), d->d_name, 0);
+	}
+	closedir(dir);
+
+	for (i = 0; i < n; i++)
+		if (!entries[i].done)
+			nfs_umntq_send(entries, n, i, deadline);
+
+	for (i = 0; i < n; i++) {
+		free(entries[i].hostname);
+		free(entries[i].dirname);
+	}
+	free(entries);
+	return n;
+}
+
+static int nfs_umntq_pending(void)
+{
+	struct dirent *d;
+	int pending = 0;
+	DIR *dir;
+
+	dir = opendir(NFS_UMNTQ_DIR);
+	if (dir == NULL)
+		return 0;
+	while (!pending && (d = readdir(dir)) != NULL)
+		pending = strncmp(d->d_name, NFS_UMNTQ_PREFIX,
+				strlen(NFS_UMNTQ_PREFIX)) == 0;
+	closedir(dir);
+	return pending;
+}
+
+/*
+ * Drain the queue while holding its lock.  A call queued just as the
+ * lock is dropped would find it still held, and be left for us, so
+ * look once more afterwards.
+ */
+static void nfs_umntq_run(const int budget)
+{
+	time_t deadline = time(NULL) + budget;
+	int fd;
+
+	for (;;) {
+		fd = open(NFS_UMNTQ_LOCK, O_RDWR | O_CREAT | O_NOFOLLOW |
+				O_CLOEXEC, 0600);
+		if (fd == -1)
+			return;
+		if (flock(fd, LOCK_EX | LOCK_NB) == -1) {
+			close(fd);
+			return;
+		}
+		while (nfs_umntq_drain(deadline) > 0)
+			;
+		close(fd);
+		if (!nfs_umntq_pending())
+			return;
+	}
+}
+
+/*
+ * Start a helper that is no child of ours, and has no terminal, to
+ * make the queued calls.  If that fails, the calls stay queued until
+ * the next umount.nfs starts one.
+ */
+static void nfs_umntq_start(const int budget)
+{
+	int status, fd;
+	pid_t pid;
+
+	pid = fork();
+	if (pid == -1)
+		return;
+	if (pid > 0) {
+		waitpid(pid, &status, 0);
+		return;
+	}
+
+	if (setsid() == -1 || fork() != 0)
+		_exit(0);
+	fd = open("/dev/null", O_RDWR);
+	if (fd != -1) {
+		dup2(fd, STDIN_FILENO);
+		dup2(fd, STDOUT_FILENO);
+		dup2(fd, STDERR_FILENO);
+		if (fd > STDERR_FILENO)
+			close(fd);
+	}
+	if (chdir("/") == -1)
+		_exit(0);
+	verbose = 0;
+	nfs_umntq_run(budget);
+	_exit(0);
+}
+
+/**
+ * nfs_umnt_queue - leave a UMNT call to a background helper
+ * @hostname: server to call
+ * @family: address family to look @hostname up in
+ * @pmap: partially filled-in mountd RPC service tuple
+ * @dirname: directory path of share to "unmount"
+ *
+ * Returns 1 if the call was queued, and a helper started to make
+ * it; zero if background UMNT calls are not configured or the call
+ * could not be queued, and the caller should make it.
+ */
+int nfs_umnt_queue(const char *hostname, const sa_family_t family,
+		   const struct pmap *pmap, const char *dirname)
+{
+	char tmp[] = NFS_UMNTQ_DIR "/.XXXXXX";
+	char path[sizeof(tmp) + sizeof(NFS_UMNTQ_PREFIX)];
+	char line[NI_MAXHOST + PATH_MAX + 64];
+	int budget, len, fd;
+
+	conf_init_file(NFS_CONFFILE);
+	if (!conf_get_bool("umount", "background-umnt", false))
+		return 0;
+	budget = conf_get_num("umount", "umnt-timeout", NFS_UMNTQ_BUDGET);
+
+	if (geteuid() != 0 || *dirname != '/' || strchr(dirname, '\n') ||
+	    strpbrk(hostname, " \t\n"))
+		return 0;
+	len = snprintf(line, sizeof(line), "%s %u %lu %lu %lu %lu %s\n",
+			hostname, (unsigned int)family,
+			(unsigned long)pmap->pm_prog,
+			(unsigned long)pmap->pm_vers,
+			(unsigned long)pmap->pm_prot,
+			(unsigned long)pmap->pm_port, dirname);
+	if (len <= 0 || (size_t)len >= sizeof(line))
+		return 0;
+
+	if ((mkdir(NFS_UMNTQ_TOPDIR, 0755) == -1 && errno != EEXIST) ||
+	    (mkdir(NFS_UMNTQ_DIR, 0700) == -1 && errno != EEXIST))
+		return 0;
+	fd = mkstemp(tmp);
+	if (fd == -1)
+		return 0;
+	snprintf(path, sizeof(path), "%s/%s%s", NFS_UMNTQ_DIR,
+		 NFS_UMNTQ_PREFIX, strrchr(tmp, '.') + 1);
+	if (write(fd, line, len) != len || close(fd) == -1 ||
+	    rename(tmp, path) == -1) {
+		unlink(tmp);
+		return 0;
+	}
+
+	if (verbose)
+		printf(_("%s: UMNT call to %s queued\n"), progname, hostname);
+	nfs_umntq_start(budget);
+	return 1;
+}
@@ -0,0 +1,30 @@
+/*
+ * umntqueue.h -- send UMNT advisories in the background
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 0211-1301 USA
+ *
+ */
+
+#ifndef _NFS_UTILS_MOUNT_UMNTQUEUE_H
+#define _NFS_UTILS_MOUNT_UMNTQUEUE_H
+
+#include <rpc/rpc.h>
+#include <rpc/pmap_prot.h>
+
+int nfs_umnt_queue(const char *, const sa_family_t, const struct pmap *,
+		   const char *);
+
+#endif	/* _NFS_UTILS_MOUNT_UMNTQUEUE_H */
@@ -95,6 +95,8 @@ void mount_usage(void)
 {
 	printf(_("usage: %s remotetarget dir [-rvVwfnsh] [-o nfsoptions]\n"),
 		progname);
+	printf(_("       %s -a [-t types] [-O options] [-j jobs] "
+		 "[-rvwfns] [-o nfsoptions]\n"), progname);
 	printf(_("options:\n"));
 	printf(_("\t-r\t\tMount file system readonly\n"));
 	printf(_("\t-v\t\tVerbose\n"));
@@ -104,6 +106,10 @@ void mount_usage(void)
 	printf(_("\t-n\t\tDo not update /etc/mtab\n"));
 	printf(_("\t-s\t\tTolerate sloppy mount options rather than fail\n"));
 	printf(_("\t-h\t\tPrint this help\n"));
+	printf(_("\t-a\t\tMount the NFS file systems in /etc/fstab\n"));
+	printf(_("\t-t types\tWith -a, mount only these types\n"));
+	printf(_("\t-O options\tWith -a, mount only entries with these options\n"));
+	printf(_("\t-j jobs\t\tWith -a, mount this many at once\n"));
 	printf(_("\tnfsoptions\tRefer to mount.nfs(8) or nfs(5)\n\n"));
 }
 
@@ -0,0 +1,235 @@
+/*
+ * utils/mountd/callout.c
+ *
+ * Run the HA callout for MNT and UMNT requests in batches.
+ *
+ * Normally the callout program is run for each event, synchronously,
+ * while the request holds the rmtab lock.  With ha-callout-batch set,
+ * events are queued instead and a thread runs the program with
+ * "batch" as its only argument and up to that many events on its
+ * standard input, one per line.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef HAVE_LIBPTHREAD
+#include <pthread.h>
+#endif
+
+#include "misc.h"
+#include "xlog.h"
+#include "mountd.h"
+#include "ha-callout.h"
+
+/* Events per run of the callout program; zero runs it for each event */
+int ha_callout_batch;
+
+#ifdef HAVE_LIBPTHREAD
+
+/*
+ * Events are queued in the order they happen.  When the queue is
+ * full, the request that would add an event waits for the callout
+ * thread to make room, so events are never dropped; MNT and UMNT
+ * requests are slowed to the pace of the callout program instead.
+ */
+#define CALLOUT_QUEUE_MAX	4096
+
+static char *		callout_queue[CALLOUT_QUEUE_MAX];
+static unsigned int	callout_head, callout_count;
+static int		callout_started, callout_failed;
+static pthread_mutex_t	callout_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	callout_more = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t	callout_room = PTHREAD_COND_INITIALIZER;
+
+/* Write @lines to @fd, which is the callout's standard input */
+static void callout_write(int fd, char **lines, unsigned int n)
+{
+	unsigned int i;
+	size_t len, off;
+	ssize_t ret;
+
+	for (i = 0; i < n; i++) {
+		len = strlen(lines[i]);
+		for (off = 0; off < len; off += ret) {
+			ret = write(fd, lines[i] + off, len - off);
+			if (ret < 0) {
+				if (errno == EINTR) {
+					ret = 0;
+					continue;
+				}
+				xlog(L_ERROR, "ha callout: write: %m");
+				return;
+			}
+		}
+	}
+}
+
+static void callout_run(char **lines, unsigned int n)
+{
+	struct sigaction oldact, newact;
+	int pipefd[2], ret = -1;
+	pid_t pid;
+
+	if (pipe(pipefd) < 0) {
+		xlog(L_ERROR, "ha callout: pipe: %m");
+		return;
+	}
+
+	/* see ha_callout() */
+	newact.sa_handler = SIG_DFL;
+	newact.sa_flags = 0;
+	sigemptyset(&newact.sa_mask);
+	sigaction(SIGCHLD, &newact, &oldact);
+	pid = fork();
+	switch (pid) {
+	case 0:
+		close(pipefd[1]);
+		if (dup2(pipefd[0], STDIN_FILENO) < 0)
+			_exit(2);
+		close(pipefd[0]);
+		execl(ha_callout_prog, ha_callout_prog, "batch", NULL);
+		perror("execl");
+		_exit(2);
+	case -1:
+		xlog(L_ERROR, "ha callout: fork: %m");
+		close(pipefd[0]);
+		close(pipefd[1]);
+		break;
+	default:
+		close(pipefd[0]);
+		callout_write(pipefd[1], lines, n);
+		close(pipefd[1]);
+		waitpid(pid, &ret, 0);
+		xlog(D_GENERAL, "ha callout returned %d for %u events",
+		     WEXITSTATUS(ret), n);
+	}
+	sigaction(SIGCHLD, &oldact, &newact);
+}
+
+static void *callout_thread(void *UNUSED(arg))
+{
+	char **lines;
+	unsigned int i, n;
+
+	lines = calloc(ha_callout_batch, sizeof(*lines));
+	if (lines == NULL) {
+		xlog(L_ERROR, "ha callout: no memory for batch");
+		return NULL;
+	}
+	for (;;) {
+		pthread_mutex_lock(&callout_mutex);
+		while (callout_count == 0)
+			pthread_cond_wait(&callout_more, &callout_mutex);
+		for (n = 0; n < (unsigned int)ha_callout_batch &&
+			    callout_count; n++) {
+			lines[n] = callout_queue[callout_head];
+			callout_head = (callout_head + 1) % CALLOUT_QUEUE_MAX;
+			callout_count--;
+		}
+		pthread_cond_broadcast(&callout_room);
+		pthread_mutex_unlock(&callout_mutex);
+
+		callout_run(lines, n);
+		for (i = 0; i < n; i++)
+			free(lines[i]);
+	}
+	return NULL;
+}
+
+/* Called with callout_mutex held */
+static int callout_start(void)
+{
+	pthread_attr_t attr;
+	pthread_t thread;
+	int ret;
+
+	if (callout_started)
+		return 0;
+	if (callout_failed)
+		return -1;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	ret = pthread_create(&thread, &attr, callout_thread, NULL);
+	pthread_attr_destroy(&attr);
+	if (ret != 0) {
+		xlog(L_WARNING, "Unable to start ha callout thread, "
+		     "running callouts inline: %s", strerror(ret));
+		callout_failed = 1;
+		return -1;
+	}
+	callout_started = 1;
+	return 0;
+}
+
+static int callout_queue_event(char *event, char *client, char *path,
+			       int count)
+{
+	char buf[RPC_CHAN_BUF_SIZE], *bp = buf, *line;
+	int blen = sizeof(buf);
+
+	qword_add(&bp, &blen, event);
+	qword_add(&bp, &blen, client);
+	qword_add(&bp, &blen, path);
+	qword_addint(&bp, &blen, count);
+	qword_addeol(&bp, &blen);
+	if (blen <= 0)
+		return -1;
+	*bp = '\0';
+	line = strdup(buf);
+	if (line == NULL)
+		return -1;
+
+	pthread_mutex_lock(&callout_mutex);
+	if (callout_start() < 0) {
+		pthread_mutex_unlock(&callout_mutex);
+		free(line);
+		return -1;
+	}
+	while (callout_count == CALLOUT_QUEUE_MAX)
+		pthread_cond_wait(&callout_room, &callout_mutex);
+	callout_queue[(callout_head + callout_count) % CALLOUT_QUEUE_MAX] =
+		line;
+	callout_count++;
+	pthread_cond_signal(&callout_more);
+	pthread_mutex_unlock(&callout_mutex);
+	return 0;
+}
+
+#else	/* !HAVE_LIBPTHREAD */
+
+static int callout_queue_event(char *UNUSED(event), char *UNUSED(client),
+			       char *UNUSED(path), int UNUSED(count))
+{
+	return -1;
+}
+
+#endif	/* HAVE_LIBPTHREAD */
+
+/**
+ * mountd_callout - report a mount or unmount to the HA callout
+ * @event: "mount" or "unmount"
+ * @client: name of the client
+ * @path: path the client mounted
+ * @count: number of mounts of @path by @client now recorded
+ *
+ * Queues the event when ha-callout-batch is set, otherwise, or if
+ * the event can't be queued, runs the callout program for it now.
+ */
+void mountd_callout(char *event, char *client, char *path, int count)
+{
+	if (!ha_callout_prog)
+		return;
+	if (ha_callout_batch > 0 &&
+	    callout_queue_event(event, client, path, count) == 0)
+		return;
+	ha_callout(event, client, path, count);
+}
@@ -0,0 +1,374 @@
+/*
+ * utils/mountd/exportlist.c
+ *
+ * The export list returned by MOUNTPROC_EXPORT.
+ *
+ * The list has one entry per exported path, with the clients that path
+ * is exported to.  It is kept from one reload of the export table to
+ * the next: an entry is rebuilt only when the clients its path is
+ * exported to have changed, and each entry keeps its XDR encoding, so
+ * that the reply can be put together by copying and sent as it is.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "xmalloc.h"
+#include "xlog.h"
+#include "mountd.h"
+
+struct elist_ent {
+	struct elist_ent *	ee_hnext;	/* hash chain */
+	unsigned int		ee_hash;
+	unsigned int		ee_seen;	/* reload that last saw it */
+	exportnode		ee_node;	/* ex_dir is the path */
+	char *			ee_sig;		/* clients it was built from */
+	size_t			ee_siglen;
+	char *			ee_xdr;		/* its encoding, see below */
+	u_int			ee_xdrlen;
+};
+
+#define ELIST_HASH_INIT	256		/* initial buckets, a power of 2 */
+
+static struct elist_ent **elist_table;
+static unsigned int	elist_size, elist_count;
+static exports		elist;
+static char *		elist_xdr;	/* encoded reply, NULL if none */
+static u_int		elist_xdrlen;
+#ifdef HAVE_LIBPTHREAD
+/* Only one worker rebuilds the list; others wait and then share it */
+static pthread_mutex_t	elist_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/* FNV-1a */
+static unsigned int elist_hash(const char *s)
+{
+	uint32_t h = 2166136261u;
+
+	for (; *s; s++)
+		h = (h ^ (unsigned char)*s) * 16777619u;
+	return h;
+}
+
+static void elist_grow(void)
+{
+	unsigned int size = elist_size ? elist_size * 2 : ELIST_HASH_INIT;
+	struct elist_ent **table, *ee, *next;
+	unsigned int i;
+
+	table = xmalloc(size * sizeof(*table));
+	memset(table, 0, size * sizeof(*table));
+	for (i = 0; i < elist_size; i++)
+		for (ee = elist_table[i]; ee; ee = next) {
+			next = ee->ee_hnext;
+			ee->ee_hnext = table[ee->ee_hash & (size - 1)];
+			table[ee->ee_hash & (size - 1)] = ee;
+		}
+	free(elist_table);
+	elist_table = table;
+	elist_size = size;
+}
+
+static struct elist_ent *elist_lookup(const char *path)
+{
+	unsigned int hash = elist_hash(path);
+	struct elist_ent *ee;
+
+	if (elist_count >= elist_size)
+		elist_grow();
+	for (ee = elist_table[hash & (elist_size - 1)]; ee; ee = ee->ee_hnext)
+		if (ee->ee_hash == hash && !strcmp(ee->ee_node.ex_dir, path))
+			return ee;
+
+	ee = xmalloc(sizeof(*ee));
+	memset(ee, 0, sizeof(*ee));
+	ee->ee_hash = hash;
+	ee->ee_node.ex_dir = xstrdup(path);
+	ee->ee_hnext = elist_table[hash & (elist_size - 1)];
+	elist_table[hash & (elist_size - 1)] = ee;
+	elist_count++;
+	return ee;
+}
+
+static void remove_all_clients(exportnode *e)
+{
+	struct groupnode *g, *ng;
+
+	for (g = e->ex_groups; g; g = ng) {
+		ng = g->gr_next;
+		xfree(g->gr_name);
+		xfree(g);
+	}
+	e->ex_groups = NULL;
+}
+
+static void elist_free(struct elist_ent *ee)
+{
+	remove_all_clients(&ee->ee_node);
+	xfree(ee->ee_node.ex_dir);
+	free(ee->ee_sig);
+	free(ee->ee_xdr);
+	xfree(ee);
+}
+
+static void prune_clients(nfs_export *exp, struct exportnode *e)
+{
+	struct addrinfo *ai = NULL;
+	struct groupnode *c, **cp;
+
+	cp = &e->ex_groups;
+	while ((c = *cp) != NULL) {
+		if (client_gettype(c->gr_name) == MCL_FQDN
+		    && (ai = host_addrinfo(c->gr_name))) {
+			if (client_check(exp->m_client, ai)) {
+				*cp = c->gr_next;
+				xfree(c->gr_name);
+				xfree(c);
+				nfs_freeaddrinfo(ai);
+				continue;
+			}
+			nfs_freeaddrinfo(ai);
+		}
+		cp = &(c->gr_next);
+	}
+}
+
+static void insert_group(struct exportnode *e, char *newname)
+{
+	struct groupnode *g;
+
+	for (g = e->ex_groups; g; g = g->gr_next)
+		if (!strcmp(g->gr_name, newname))
+			return;
+
+	g = xmalloc(sizeof(*g));
+	g->gr_name = xstrdup(newname);
+	g->gr_next = e->ex_groups;
+	e->ex_groups = g;
+}
+
+/*
+ * The clients @path is exported to, in the order the groups are built
+ * from them: each export's client type and name.  An entry whose
+ * signature hasn't changed since it was built needs no rebuilding.
+ */
+static char *elist_signature(const char *path, size_t *lenp)
+{
+	size_t len = 0, size = 0, n;
+	char *sig = NULL;
+	nfs_export *exp;
+	int i;
+
+	for (i = 0; i < MCL_MAXTYPES; i++) {
+		for (exp = export_find_path(i, path, NULL); exp;
+		     exp = export_find_path(i, path, exp)) {
+			if (exp->m_export.e_flags & NFSEXP_V4ROOT)
+				continue;
+			n = strlen(exp->m_export.e_hostname) + 2;
+			if (len + n > size) {
+				size = (len + n) * 2;
+				sig = xrealloc(sig, size);
+			}
+			sig[len] = (char)i;
+			memcpy(sig + len + 1, exp->m_export.e_hostname, n - 1);
+			len += n;
+		}
+	}
+	*lenp = len;
+	return sig;
+}
+
+static void elist_build(struct elist_ent *ee)
+{
+	struct exportnode *e = &ee->ee_node;
+	nfs_export *exp;
+	int i;
+
+	remove_all_clients(e);
+	for (i = 0; i < MCL_MAXTYPES; i++) {
+		for (exp = export_find_path(i, e->ex_dir, NULL); exp;
+		     exp = export_find_path(i, e->ex_dir, exp)) {
+			 /* Don't show pseudo exports */
+			if (exp->m_export.e_flags & NFSEXP_V4ROOT)
+				continue;
+
+			/* exports to "*" absorb any others */
+			if (i == MCL_ANONYMOUS && e->ex_groups) {
+				remove_all_clients(e);
+				continue;
+			}
+			/* non-FQDN's absorb FQDN's they contain: */
+			if (i != MCL_FQDN && e->ex_groups)
+				prune_clients(exp, e);
+
+			if (exp->m_export.e_hostname[0] != '\0')
+				insert_group(e, exp->m_export.e_hostname);
+		}
+	}
+}
+
+/*
+ * An entry's encoding is that of a list holding just the entry, less
+ * the FALSE that ends the list, so the encodings of the entries can
+ * be put one after another to make the encoding of the whole list.
+ */
+static void elist_encode(struct elist_ent *ee)
+{
+	exportnode *e = &ee->ee_node;
+	exports next = e->ex_next, one = e;
+	XDR xdrs;
+	u_int len;
+
+	free(ee->ee_xdr);
+	ee->ee_xdr = NULL;
+	e->ex_next = NULL;
+	len = xdr_sizeof((xdrproc_t)xdr_exports, &one);
+	ee->ee_xdr = xmalloc(len);
+	xdrmem_create(&xdrs, ee->ee_xdr, len, XDR_ENCODE);
+	if (!xdr_exports(&xdrs, &one)) {
+		xlog(L_ERROR, "Failed to encode export list entry for %s",
+		     e->ex_dir);
+		free(ee->ee_xdr);
+		ee->ee_xdr = NULL;
+	} else
+		ee->ee_xdrlen = len - BYTES_PER_XDR_UNIT;
+	xdr_destroy(&xdrs);
+	e->ex_next = next;
+}
+
+/* Put the entries' encodings together, or leave none if one is missing */
+static void elist_encode_all(void)
+{
+	struct exportnode *e;
+	struct elist_ent *ee;
+	bool_t more = FALSE;
+	u_int len = BYTES_PER_XDR_UNIT;
+	XDR xdrs;
+	char *p;
+
+	free(elist_xdr);
+	elist_xdr = NULL;
+	for (e = elist; e; e = e->ex_next) {
+		ee = (struct elist_ent *)((char *)e -
+					  offsetof(struct elist_ent, ee_node));
+		if (ee->ee_xdr == NULL)
+			return;
+		len += ee->ee_xdrlen;
+	}
+
+	p = elist_xdr = xmalloc(len);
+	for (e = elist; e; e = e->ex_next) {
+		ee = (struct elist_ent *)((char *)e -
+					  offsetof(struct elist_ent, ee_node));
+		memcpy(p, ee->ee_xdr, ee->ee_xdrlen);
+		p += ee->ee_xdrlen;
+	}
+	xdrmem_create(&xdrs, p, BYTES_PER_XDR_UNIT, XDR_ENCODE);
+	xdr_bool(&xdrs, &more);
+	xdr_destroy(&xdrs);
+	elist_xdrlen = len;
+}
+
+static exports
+elist_update(void)
+{
+	static unsigned int	ecounter;
+	static int		evalid;
+	struct elist_ent	*ee, **eep;
+	unsigned int		acounter, i, built = 0;
+	nfs_export		*exp;
+	exports			list = NULL;
+	char			*sig;
+	size_t			siglen;
+	int			type;
+
+	acounter = mountd_reload();
+	if (evalid && acounter == ecounter)
+		return elist;
+
+	for (type = 0; type < MCL_MAXTYPES; type++) {
+		for (exp = exportlist[type].p_head; exp; exp = exp->m_next) {
+			if (exp->m_export.e_flags & NFSEXP_V4ROOT)
+				continue;
+			ee = elist_lookup(exp->m_export.e_path);
+			if (ee->ee_seen == acounter)
+				continue;
+			ee->ee_seen = acounter;
+			ee->ee_node.ex_next = list;
+			list = &ee->ee_node;
+
+			sig = elist_signature(ee->ee_node.ex_dir, &siglen);
+			if (ee->ee_xdr && siglen == ee->ee_siglen &&
+			    memcmp(sig, ee->ee_sig, siglen) == 0) {
+				free(sig);
+				continue;
+			}
+			free(ee->ee_sig);
+			ee->ee_sig = sig;
+			ee->ee_siglen = siglen;
+			elist_build(ee);
+			elist_encode(ee);
+			built++;
+		}
+	}
+
+	/* drop the paths that are no longer exported */
+	for (i = 0; i < elist_size; i++) {
+		eep = &elist_table[i];
+		while ((ee = *eep) != NULL) {
+			if (ee->ee_seen != acounter) {
+				*eep = ee->ee_hnext;
+				elist_free(ee);
+				elist_count--;
+				continue;
+			}
+			eep = &ee->ee_hnext;
+		}
+	}
+
+	elist = list;
+	elist_encode_all();
+	ecounter = acounter;
+	evalid = 1;
+	xlog(D_GENERAL, "Export list has %u paths, %u rebuilt",
+	     elist_count, built);
+	return elist;
+}
+
+/**
+ * get_exportlist - return the export list, updated if exports changed
+ *
+ * The order of the list, and the clients shown for each path, are
+ * those of the list rebuilt from scratch.  The export table must not
+ * be reloaded until the reply has been sent.
+ */
+exports
+get_exportlist(void)
+{
+	exports list;
+
+	mountd_lock(&elist_lock);
+	list = elist_update();
+	mountd_unlock(&elist_lock);
+	return list;
+}
+
+/**
+ * xdr_exportsres - encode the reply to MOUNTPROC_EXPORT
+ * @xdrs: XDR stream
+ * @objp: export list returned by get_exportlist()
+ *
+ * Sends the encoding kept with the list when there is one.
+ */
+bool_t
+xdr_exportsres(XDR *xdrs, exportsres *objp)
+{
+	if (xdrs->x_op == XDR_ENCODE && *objp == elist && elist_xdr)
+		return XDR_PUTBYTES(xdrs, elist_xdr, elist_xdrlen);
+	return xdr_exports(xdrs, objp);
+}
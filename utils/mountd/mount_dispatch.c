@@ -15,17 +15,28 @@
 #include "mountd.h"
 #include "rpcmisc.h"
 
+/*
+ * The internal rpcgen can decode a dirpath into a static buffer
+ * rather than allocating it (rpcgen -Z), one per thread with -M.
+ * mountd is done with its arguments when the call returns, so use
+ * that when it is there.
+ */
+#ifndef xdr_dirpath_view
+#define xdr_dirpath_view	xdr_dirpath
+#endif
+typedef dirpath			dirpath_view;
+
 /*
  * Procedures for MNTv1
  */
 static struct rpc_dentry mnt_1_dtable[] = {
 	dtable_ent(mount_null,1,void,void),		/* NULL */
-	dtable_ent(mount_mnt,1,dirpath,fhstatus),	/* MNT */
+	dtable_ent(mount_mnt,1,dirpath_view,fhstatus),	/* MNT */
 	dtable_ent(mount_dump,1,void,mountlist),	/* DUMP */
-	dtable_ent(mount_umnt,1,dirpath,void),		/* UMNT */
+	dtable_ent(mount_umnt,1,dirpath_view,void),		/* UMNT */
 	dtable_ent(mount_umntall,1,void,void),		/* UMNTALL */
-	dtable_ent(mount_export,1,void,exports),	/* EXPORT */
-	dtable_ent(mount_exportall,1,void,exports),	/* EXPORTALL */
+	dtable_ent(mount_export,1,void,exportsres),	/* EXPORT */
+	dtable_ent(mount_exportall,1,void,exportsres),	/* EXPORTALL */
 };
 
 /*
@@ -33,13 +44,13 @@ static struct rpc_dentry mnt_1_dtable[] = {
  */
 static struct rpc_dentry mnt_2_dtable[] = {
 	dtable_ent(mount_null,1,void,void),		/* NULL */
-	dtable_ent(mount_mnt,1,dirpath,fhstatus),	/* MNT */
+	dtable_ent(mount_mnt,1,dirpath_view,fhstatus),	/* MNT */
 	dtable_ent(mount_dump,1,void,mountlist),	/* DUMP */
-	dtable_ent(mount_umnt,1,dirpath,void),		/* UMNT */
+	dtable_ent(mount_umnt,1,dirpath_view,void),		/* UMNT */
 	dtable_ent(mount_umntall,1,void,void),		/* UMNTALL */
-	dtable_ent(mount_export,1,void,exports),	/* EXPORT */
-	dtable_ent(mount_exportall,1,void,exports),	/* EXPORTALL */
-	dtable_ent(mount_pathconf,2,dirpath,ppathcnf),	/* PATHCONF */
+	dtable_ent(mount_export,1,void,exportsres),	/* EXPORT */
+	dtable_ent(mount_exportall,1,void,exportsres),	/* EXPORTALL */
+	dtable_ent(mount_pathconf,2,dirpath_view,ppathcnf),	/* PATHCONF */
 };
 
 /*
@@ -47,21 +58,35 @@ static struct rpc_dentry mnt_2_dtable[] = {
  */
 static struct rpc_dentry mnt_3_dtable[] = {
 	dtable_ent(mount_null,1,void,void),		/* NULL */
-	dtable_ent(mount_mnt,3,dirpath,mountres3),	/* MNT */
+	dtable_ent(mount_mnt,3,dirpath_view,mountres3),	/* MNT */
 	dtable_ent(mount_dump,1,void,mountlist),	/* DUMP */
-	dtable_ent(mount_umnt,1,dirpath,void),		/* UMNT */
+	dtable_ent(mount_umnt,1,dirpath_view,void),		/* UMNT */
 	dtable_ent(mount_umntall,1,void,void),		/* UMNTALL */
-	dtable_ent(mount_export,1,void,exports),	/* EXPORT */
+	dtable_ent(mount_export,1,void,exportsres),	/* EXPORT */
 };
 
 #define number_of(x)	(sizeof(x)/sizeof(x[0]))
 
+#if defined(HAVE_TCP_WRAPPER) && defined(HAVE_LIBPTHREAD)
+/* libwrap and the cache of its answers aren't thread safe */
+static pthread_mutex_t	wrap_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
 static struct rpc_dtable	dtable[] = {
 	{ mnt_1_dtable,		number_of(mnt_1_dtable) },
 	{ mnt_2_dtable,		number_of(mnt_2_dtable) },
 	{ mnt_3_dtable,		number_of(mnt_3_dtable) },
 };
 
+/**
+ * mount_dispatch_metrics - keep a latency histogram per MOUNT procedure
+ */
+void
+mount_dispatch_metrics(void)
+{
+	rpc_dispatch_metrics(dtable, number_of(dtable));
+}
+
 /*
  * The main dispatch routine.
  */
@@ -70,15 +95,29 @@ mount_dispatch(struct svc_req *rqstp, SVCXPRT *transp)
 {
 	union mountd_arguments 	argument;
 	union mountd_results	result;
-
+	unsigned long long	start;
 #ifdef HAVE_TCP_WRAPPER
+	int			allowed;
+
 	/* remote host authorization check */
-	if (!check_default("mountd", nfs_getrpccaller(transp), MOUNTPROG)) {
+	mountd_lock(&wrap_lock);
+	allowed = check_default("mountd", nfs_getrpccaller(transp), MOUNTPROG);
+	mountd_unlock(&wrap_lock);
+	if (!allowed) {
 		svcerr_auth (transp, AUTH_FAILED);
 		return;
 	}
 #endif
 
+	/* drop requests from clients over their rate before any work */
+	if (rqstp->rq_proc != MOUNTPROC_NULL &&
+	    !throttle_request(nfs_getrpccaller(transp))) {
+		cache_stats_miss(CSTAT_MOUNT);
+		return;
+	}
+
+	start = cache_stats_clock();
 	rpc_dispatch(rqstp, transp, dtable, number_of(dtable),
 			&argument, &result);
+	cache_stats_add(CSTAT_MOUNT, start);
 }
@@ -32,11 +32,14 @@
 #include "nfsd_path.h"
 #include "nfslib.h"
 #include "export.h"
+#include "fsloc.h"
+#include "nfsmetrics.h"
+#include "nfstrace.h"
+#include "nfsworker.h"
 
 extern void my_svc_run(void);
 
 static void		usage(const char *, int exitcode);
-static exports		get_exportlist(void);
 static struct nfs_fh_len *get_rootfh(struct svc_req *, dirpath *, nfs_export **, mountstat3 *, int v3);
 
 int reverse_resolve = 0;
@@ -54,6 +57,9 @@ char *ha_callout_prog = NULL;
 static int num_threads = 1;
 /* Arbitrary limit on number of threads */
 #define MAX_THREADS 64
+/* Serve requests from a pool of threads sharing one export table,
+ * instead of forking num_threads worker processes */
+static int threaded = 0;
 
 static struct option longopts[] =
 {
@@ -69,6 +75,7 @@ static struct option longopts[] =
 	{ "ha-callout", 1, 0, 'H' },
 	{ "state-directory-path", 1, 0, 's' },
 	{ "num-threads", 1, 0, 't' },
+	{ "threaded", 0, 0, 'm' },
 	{ "reverse-lookup", 0, 0, 'r' },
 	{ "manage-gids", 0, 0, 'g' },
 	{ "no-udp", 0, 0, 'u' },
@@ -77,7 +84,7 @@ static struct option longopts[] =
 	{ "ttl", 1, 0, 'T'},
 	{ NULL, 0, 0, 0 }
 };
-static char shortopts[] = "o:nFd:p:P:hH:N:V:vurs:t:gliT:";
+static char shortopts[] = "o:nFd:p:P:hH:N:V:vurs:t:mgliT:";
 
 #define NFSVERSBIT(vers)	(0x1 << (vers - 1))
 #define NFSVERSBIT_ALL		(NFSVERSBIT(2) | NFSVERSBIT(3) | NFSVERSBIT(4))
@@ -156,6 +163,9 @@ fork_workers(void)
 
 	xlog(L_NOTICE, "mountd: starting %d threads\n", num_threads);
 
+	/* so that workers don't each ask the name service the same */
+	hostcache_share();
+
 	for (i = 0 ; i < num_threads ; i++) {
 		pid = fork();
 		if (pid < 0) {
@@ -177,6 +187,10 @@ fork_workers(void)
 			sigaction(SIGINT, &sa, NULL);
 			sigaction(SIGTERM, &sa, NULL);
 
+			cache_stats_worker(i);
+			nfsmetrics_worker(i);
+			nfstrace_worker(i);
+			nfsworker_start(i);
 			/* fall into my_svc_run in caller */
 			return;
 		}
@@ -199,7 +213,7 @@ static void
 killer (int sig)
 {
 	unregister_services();
-	if (num_threads > 1) {
+	if (num_threads > 1 && !threaded) {
 		/* play Kronos and eat our children */
 		kill(0, SIGTERM);
 		wait_for_workers();
@@ -301,7 +315,7 @@ mount_umntall_1_svc(struct svc_req *rqstp, void *UNUSED(argp),
 		host_ntop(sap, buf, sizeof(buf)));
 
 	/* Reload /etc/exports if necessary */
-	auth_reload();
+	mountd_reload();
 
 	mountlist_del_all(nfs_getrpccaller(rqstp->rq_xprt));
 	return 1;
@@ -362,7 +376,7 @@ mount_pathconf_2_svc(struct svc_req *rqstp, dirpath *path, ppathcnf *res)
 		p = "/";
 
 	/* Reload /etc/exports if necessary */
-	auth_reload();
+	mountd_reload();
 
 	/* Resolve symlinks */
 	if (nfsd_realpath(p, rpath) != NULL) {
@@ -413,7 +427,7 @@ mount_pathconf_2_svc(struct svc_req *rqstp, dirpath *path, ppathcnf *res)
 static void set_authflavors(struct mountres3_ok *ok, nfs_export *exp)
 {
 	struct sec_entry *s;
-	static int flavors[SECFLAVOR_COUNT];
+	static __thread int flavors[SECFLAVOR_COUNT];
 	int i = 0;
 
 	for (s = exp->m_export.e_secinfo; s->flav; s++) {
@@ -456,6 +470,133 @@ mount_mnt_3_svc(struct svc_req *rqstp, dirpath *path, mountres3 *res)
 	return 1;
 }
 
+/*
+ * Root filehandles handed out by get_rootfh(), so that clients that
+ * mount the same path over and over (autofs hosts, say) don't cost
+ * a push into the kernel's export cache and a filehandle request
+ * every time.  A filehandle is kept until the exports or the mount
+ * table change, and is only used while the path still names the
+ * file it was made for.  The client is still authenticated on every
+ * request.
+ */
+#define ROOTFH_HASH		256
+#define ROOTFH_MAX		4096
+
+struct rootfh_ent {
+	struct rootfh_ent *	rf_next;
+	dev_t			rf_dev;
+	ino_t			rf_ino;
+	int			rf_len;
+	struct nfs_fh_len	rf_fh;
+	size_t			rf_clen;
+	char			rf_key[];	/* client\0path */
+};
+
+static struct rootfh_ent *	rootfh_table[ROOTFH_HASH];
+static unsigned int		rootfh_count;
+static unsigned int		rootfh_exp_gen;
+static unsigned long		rootfh_mnt_gen;
+#ifdef HAVE_LIBPTHREAD
+static pthread_mutex_t		rootfh_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static void
+rootfh_flush(void)
+{
+	struct rootfh_ent *rf;
+	int i;
+
+	for (i = 0; i < ROOTFH_HASH; i++)
+		while ((rf = rootfh_table[i]) != NULL) {
+			rootfh_table[i] = rf->rf_next;
+			free(rf);
+		}
+	rootfh_count = 0;
+}
+
+static struct rootfh_ent **
+rootfh_find(const char *client, const char *path, int len)
+{
+	struct rootfh_ent *rf, **rfp;
+	size_t clen = strlen(client);
+	unsigned int h = len;
+	const char *s;
+
+	for (s = client; *s; s++)
+		h = h * 31 + (unsigned char)*s;
+	for (s = path; *s; s++)
+		h = h * 31 + (unsigned char)*s;
+
+	for (rfp = &rootfh_table[h % ROOTFH_HASH]; (rf = *rfp) != NULL;
+	     rfp = &rf->rf_next)
+		if (rf->rf_len == len && rf->rf_clen == clen &&
+		    memcmp(rf->rf_key, client, clen) == 0 &&
+		    strcmp(rf->rf_key + clen + 1, path) == 0)
+			break;
+	return rfp;
+}
+
+/* Copy out the filehandle of @path for @exp's client, if still good for @stb */
+static int
+rootfh_lookup(nfs_export *exp, const char *path, int len, struct stat *stb,
+	      struct nfs_fh_len *fh)
+{
+	struct rootfh_ent *rf;
+	int found = 0;
+
+	/* Notice any mount table change before checking generations */
+	mnttab_put(mnttab_get());
+	mountd_lock(&rootfh_lock);
+	if (rootfh_exp_gen != auth_generation() ||
+	    rootfh_mnt_gen != mnttab_generation()) {
+		rootfh_flush();
+		rootfh_exp_gen = auth_generation();
+		rootfh_mnt_gen = mnttab_generation();
+		goto out;
+	}
+	rf = *rootfh_find(exp->m_client->m_hostname, path, len);
+	if (rf && rf->rf_dev == stb->st_dev && rf->rf_ino == stb->st_ino) {
+		*fh = rf->rf_fh;
+		found = 1;
+	}
+out:
+	mountd_unlock(&rootfh_lock);
+	return found;
+}
+
+static void
+rootfh_add(nfs_export *exp, const char *path, int len, struct stat *stb,
+	   struct nfs_fh_len *fh)
+{
+	const char *client = exp->m_client->m_hostname;
+	struct rootfh_ent *rf, **rfp;
+	size_t clen = strlen(client);
+
+	mountd_lock(&rootfh_lock);
+	rfp = rootfh_find(client, path, len);
+	if ((rf = *rfp) == NULL) {
+		if (rootfh_count >= ROOTFH_MAX) {
+			rootfh_flush();
+			rfp = rootfh_find(client, path, len);
+		}
+		rf = malloc(sizeof(*rf) + clen + strlen(path) + 2);
+		if (rf == NULL)
+			goto out;
+		rf->rf_len = len;
+		rf->rf_clen = clen;
+		memcpy(rf->rf_key, client, clen + 1);
+		strcpy(rf->rf_key + clen + 1, path);
+		rf->rf_next = NULL;
+		*rfp = rf;
+		rootfh_count++;
+	}
+	rf->rf_dev = stb->st_dev;
+	rf->rf_ino = stb->st_ino;
+	rf->rf_fh = *fh;
+out:
+	mountd_unlock(&rootfh_lock);
+}
+
 static struct nfs_fh_len *
 get_rootfh(struct svc_req *rqstp, dirpath *path, nfs_export **expret,
 		mountstat3 *error, int v3)
@@ -467,12 +608,14 @@ get_rootfh(struct svc_req *rqstp, dirpath *path, nfs_export **expret,
 	char		rpath[MAXPATHLEN+1];
 	char		*p = *path;
 	char		buf[INET6_ADDRSTRLEN];
+	/* Returned to the caller, which encodes it into the reply */
+	static __thread struct nfs_fh_len rootfh;
 
 	if (*p == '\0')
 		p = "/";
 
 	/* Reload /var/lib/nfs/etab if necessary */
-	auth_reload();
+	mountd_reload();
 
 	/* Resolve symlinks */
 	if (nfsd_realpath(p, rpath) != NULL) {
@@ -500,6 +643,10 @@ get_rootfh(struct svc_req *rqstp, dirpath *path, nfs_export **expret,
 		*error = MNT3ERR_NOTDIR;
 		return NULL;
 	}
+	if (rootfh_lookup(exp, p, v3?64:32, &stb, &rootfh)) {
+		fh = &rootfh;
+		goto out_ok;
+	}
 	if (nfsd_path_stat(exp->m_export.e_path, &estb) < 0) {
 		xlog(L_WARNING, "can't stat export point %s: %s",
 		     p, strerror(errno));
@@ -537,6 +684,8 @@ get_rootfh(struct svc_req *rqstp, dirpath *path, nfs_export **expret,
 		*error = MNT3ERR_ACCES;
 		return NULL;
 	}
+	rootfh_add(exp, p, v3?64:32, &stb, fh);
+out_ok:
 	*error = MNT_OK;
 	mountlist_add(host_ntop(sap, buf, sizeof(buf)), p);
 	if (expret)
@@ -544,123 +693,17 @@ get_rootfh(struct svc_req *rqstp, dirpath *path, nfs_export **expret,
 	return fh;
 }
 
-static void remove_all_clients(exportnode *e)
-{
-	struct groupnode *g, *ng;
-
-	for (g = e->ex_groups; g; g = ng) {
-		ng = g->gr_next;
-		xfree(g->gr_name);
-		xfree(g);
-	}
-	e->ex_groups = NULL;
-}
-
-static void free_exportlist(exports *elist)
-{
-	struct exportnode *e, *ne;
-
-	for (e = *elist; e != NULL; e = ne) {
-		ne = e->ex_next;
-		remove_all_clients(e);
-		xfree(e->ex_dir);
-		xfree(e);
-	}
-	*elist = NULL;
-}
-
-static void prune_clients(nfs_export *exp, struct exportnode *e)
-{
-	struct addrinfo *ai = NULL;
-	struct groupnode *c, **cp;
-
-	cp = &e->ex_groups;
-	while ((c = *cp) != NULL) {
-		if (client_gettype(c->gr_name) == MCL_FQDN
-		    && (ai = host_addrinfo(c->gr_name))) {
-			if (client_check(exp->m_client, ai)) {
-				*cp = c->gr_next;
-				xfree(c->gr_name);
-				xfree(c);
-				nfs_freeaddrinfo(ai);
-				continue;
-			}
-			nfs_freeaddrinfo(ai);
-		}
-		cp = &(c->gr_next);
-	}
-}
-
-static exportnode *lookup_or_create_elist_entry(exports *elist, nfs_export *exp)
-{
-	exportnode *e;
-
-	for (e = *elist; e != NULL; e = e->ex_next) {
-		if (!strcmp(exp->m_export.e_path, e->ex_dir))
-			return e;
-	}
-	e = xmalloc(sizeof(*e));
-	e->ex_next = *elist;
-	e->ex_groups = NULL;
-	e->ex_dir = xstrdup(exp->m_export.e_path);
-	*elist = e;
-	return e;
-}
-
-static void insert_group(struct exportnode *e, char *newname)
+/**
+ * mountd_reload - bring the export table up to date before a request
+ *
+ * With worker threads, the event loop reloads the table before
+ * handing a request to a worker, which holds it read-locked; only
+ * its generation is looked at here.
+ */
+unsigned int
+mountd_reload(void)
 {
-	struct groupnode *g;
-
-	for (g = e->ex_groups; g; g = g->gr_next)
-		if (!strcmp(g->gr_name, newname))
-			return;
-
-	g = xmalloc(sizeof(*g));
-	g->gr_name = xstrdup(newname);
-	g->gr_next = e->ex_groups;
-	e->ex_groups = g;
-}
-
-static exports
-get_exportlist(void)
-{
-	static exports		elist = NULL;
-	struct exportnode	*e;
-	nfs_export		*exp;
-	int			i;
-	static unsigned int	ecounter;
-	unsigned int		acounter;
-
-	acounter = auth_reload();
-	if (elist && acounter == ecounter)
-		return elist;
-
-	ecounter = acounter;
-
-	free_exportlist(&elist);
-
-	for (i = 0; i < MCL_MAXTYPES; i++) {
-		for (exp = exportlist[i].p_head; exp; exp = exp->m_next) {
-			 /* Don't show pseudo exports */
-			if (exp->m_export.e_flags & NFSEXP_V4ROOT)
-				continue;
-			e = lookup_or_create_elist_entry(&elist, exp);
-
-			/* exports to "*" absorb any others */
-			if (i == MCL_ANONYMOUS && e->ex_groups) {
-				remove_all_clients(e);
-				continue;
-			}
-			/* non-FQDN's absorb FQDN's they contain: */
-			if (i != MCL_FQDN && e->ex_groups)
-				prune_clients(exp, e);
-
-			if (exp->m_export.e_hostname[0] != '\0')
-				insert_group(e, exp->m_export.e_hostname);
-		}
-	}
-
-	return elist;
+	return threaded ? auth_generation() : auth_reload();
 }
 
 int	vers;
@@ -678,10 +721,16 @@ read_mountd_conf(char **argv)
 	xlog_set_debug("mountd");
 	manage_gids = conf_get_bool("mountd", "manage-gids", manage_gids);
 	descriptors = conf_get_num("mountd", "descriptors", descriptors);
+	max_connections = conf_get_num("mountd", "max-connections",
+				       max_connections);
+	idle_timeout = conf_get_num("mountd", "idle-timeout", idle_timeout);
 	port = conf_get_num("mountd", "port", port);
 	num_threads = conf_get_num("mountd", "threads", num_threads);
+	threaded = conf_get_bool("mountd", "threaded", threaded);
 	reverse_resolve = conf_get_bool("mountd", "reverse-lookup", reverse_resolve);
 	ha_callout_prog = conf_get_str("mountd", "ha-callout");
+	ha_callout_batch = conf_get_num("mountd", "ha-callout-batch",
+					ha_callout_batch);
 	if (conf_get_bool("mountd", "cache-use-ipaddr", 0))
 		use_ipaddr = 2;
 
@@ -710,6 +759,31 @@ read_mountd_conf(char **argv)
 	ttl = conf_get_num("mountd", "ttl", default_ttl);
 	if (ttl > 0)
 		default_ttl = ttl;
+	hostcache_ttl = conf_get_num("mountd", "name-cache-ttl", hostcache_ttl);
+	hostcache_neg_ttl = conf_get_num("mountd", "name-cache-negative-ttl",
+					 hostcache_neg_ttl);
+	netgroup_expand = conf_get_bool("mountd", "netgroup-expand",
+					netgroup_expand);
+	netgroup_refresh = conf_get_num("mountd", "netgroup-refresh",
+					netgroup_refresh);
+	gidcache_ttl = conf_get_num("mountd", "gid-cache-ttl", gidcache_ttl);
+	gidcache_neg_ttl = conf_get_num("mountd", "gid-cache-negative-ttl",
+					gidcache_neg_ttl);
+	cache_uuid_persist = conf_get_bool("mountd", "uuid-cache",
+					   cache_uuid_persist);
+	cache_stats_file = conf_get_str("mountd", "stats-file");
+	cache_stats_interval = conf_get_num("mountd", "stats-interval",
+					    cache_stats_interval);
+	cache_trace_file = conf_get_str("mountd", "trace-file");
+	cache_refresh_ahead = conf_get_num("mountd", "refresh-ahead",
+					   cache_refresh_ahead);
+	client_rate = conf_get_num("mountd", "client-rate", client_rate);
+	client_burst = conf_get_num("mountd", "client-burst", client_burst);
+	v4clients_log = conf_get_bool("mountd", "log-v4clients", v4clients_log);
+	fsloc_weights = conf_get_str("mountd", "fsloc-weights");
+	s = conf_get_str("mountd", "fsloc-order");
+	if (s && fsloc_order_set(s) < 0)
+		xlog(L_ERROR, "unknown fsloc-order \"%s\"", s);
 }
 
 int
@@ -793,6 +867,9 @@ main(int argc, char **argv)
 		case 't':
 			num_threads = atoi (optarg);
 			break;
+		case 'm':
+			threaded = 1;
+			break;
 		case 'V':
 			vers = atoi(optarg);
 			if (vers < 2 || vers > 4) {
@@ -844,10 +921,12 @@ main(int argc, char **argv)
 		fprintf(stderr, "%s: getrlimit (RLIMIT_NOFILE) failed: %s\n",
 				progname, strerror(errno));
 	else {
+#ifndef HAVE_LIBTIRPC
 		/* glibc sunrpc code dies if getdtablesize > FD_SETSIZE */
 		if ((descriptors == 0 && rlim.rlim_cur > FD_SETSIZE) ||
 		    descriptors > FD_SETSIZE)
 			descriptors = FD_SETSIZE;
+#endif
 		if (descriptors) {
 			rlim.rlim_cur = descriptors;
 			if (setrlimit (RLIMIT_NOFILE, &rlim) != 0) {
@@ -907,16 +986,20 @@ main(int argc, char **argv)
 		}
 		setsid();
 	}
+	nfsmetrics_start("mountd");
+	nfstrace_start("mountd");
+	nfsworker_init("mountd");
+	mount_dispatch_metrics();
 
 	/* silently bounds check num_threads */
-	if (foreground)
+	if (foreground && !threaded)
 		num_threads = 1;
 	else if (num_threads < 1)
 		num_threads = 1;
 	else if (num_threads > MAX_THREADS)
 		num_threads = MAX_THREADS;
 
-	if (num_threads > 1)
+	if (num_threads > 1 && !threaded)
 		fork_workers();
 
 	nfsd_path_init();
@@ -924,6 +1007,13 @@ main(int argc, char **argv)
 	cache_open();
 	v4clients_init();
 
+	if (num_threads > 1 && threaded) {
+		xlog(L_NOTICE, "mountd: starting %d worker threads\n",
+				num_threads);
+		cache_start_workers(num_threads);
+		svc_start_workers(num_threads);
+	}
+
 	xlog(L_NOTICE, "Version " VERSION " starting");
 	my_svc_run();
 
@@ -945,6 +1035,6 @@ usage(const char *prog, int n)
 "	[-N version|--no-nfs-version version] [-n|--no-tcp]\n"
 "	[-H prog |--ha-callout prog] [-r |--reverse-lookup]\n"
 "	[-s|--state-directory-path path] [-g|--manage-gids]\n"
-"	[-t num|--num-threads=num] [-u|--no-udp]\n", prog);
+"	[-t num|--num-threads=num] [-m|--threaded] [-u|--no-udp]\n", prog);
 	exit(n);
 }
@@ -11,10 +11,28 @@
 
 #include <rpc/rpc.h>
 #include <rpc/svc.h>
+#ifdef HAVE_LIBPTHREAD
+#include <pthread.h>
+#endif
 #include "nfslib.h"
 #include "exportfs.h"
 #include "mount.h"
 
+/*
+ * With worker threads (--threaded), requests are served at once by
+ * several threads, and what they share is guarded by these.
+ */
+#ifdef HAVE_LIBPTHREAD
+#define mountd_lock(l)		pthread_mutex_lock(l)
+#define mountd_unlock(l)	pthread_mutex_unlock(l)
+#else
+#define mountd_lock(l)		do { } while (0)
+#define mountd_unlock(l)	do { } while (0)
+#endif
+
+/* exports, sent as encoded by get_exportlist() */
+typedef exports		exportsres;
+
 union mountd_arguments {
 	dirpath			dirpath;
 };
@@ -39,17 +57,35 @@ bool_t		mount_pathconf_2_svc(struct svc_req *, dirpath *, ppathcnf *);
 bool_t		mount_mnt_3_svc(struct svc_req *, dirpath *, mountres3 *);
 
 void		mount_dispatch(struct svc_req *, SVCXPRT *);
+void		mount_dispatch_metrics(void);
 void		auth_init(void);
 unsigned int	auth_reload(void);
+unsigned int	mountd_reload(void);
+int		svc_start_workers(int nthreads);
 nfs_export *	auth_authenticate(const char *what,
 					const struct sockaddr *caller,
 					const char *path);
 void		auth_export(nfs_export *exp);
 
+exports		get_exportlist(void);
+bool_t		xdr_exportsres(XDR *, exportsres *);
+
 void		mountlist_add(char *host, const char *path);
 void		mountlist_del(char *host, const char *path);
 void		mountlist_del_all(const struct sockaddr *sap);
 mountlist	mountlist_list(void);
+int		mountlist_register_events(void);
+
+extern int	max_connections;
+extern int	idle_timeout;
+
+extern int	client_rate;
+extern int	client_burst;
+int		throttle_request(const struct sockaddr *sap);
+
+extern int	ha_callout_batch;
+void		mountd_callout(char *event, char *client, char *path,
+				int count);
 
 void		cache_open(void);
 struct nfs_fh_len *
@@ -13,6 +13,8 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <stdint.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <netdb.h>
@@ -21,7 +23,7 @@
 #include "exportfs.h"
 #include "xio.h"
 #include "mountd.h"
-#include "ha-callout.h"
+#include "xepoll.h"
 
 #include <limits.h> /* PATH_MAX */
 #include <errno.h>
@@ -51,94 +53,418 @@ slink_safe_rename(const char * oldpath, const char * newpath)
 	return rename(oldpath, real_newpath);
 }
 
-void
-mountlist_add(char *host, const char *path)
+/*
+ * The mount list is kept in memory as a hash of (client, path) to
+ * mount count.  A MNT or UMNT appends the new count for its entry to
+ * a journal, "rmtab.journal" next to rmtab, rather than rewriting
+ * rmtab; an entry whose count drops to zero is gone.  Every so often
+ * rmtab is rewritten from memory and the journal emptied.
+ *
+ * rmtab plus the journal is always the complete list, so nothing is
+ * lost in a crash.  Forked workers share the files: each holds the
+ * rmtab lock across an update and first applies whatever the others
+ * appended to the journal since it last looked.  A new rmtab, from a
+ * compaction or from outside mountd, makes them load the list again.
+ */
+struct rmtab_ent {
+	struct rmtab_ent *	re_next;
+	unsigned int		re_hash;
+	int			re_count;
+	char *			re_client;
+	char			re_path[];
+};
+
+#define RMTAB_HASH_INIT		256	/* initial buckets, a power of 2 */
+#define RMTAB_COMPACT_INTERVAL	30	/* seconds between compactions */
+#define RMTAB_JOURNAL_MAX	4096	/* records before compacting anyway */
+
+static struct rmtab_ent	**rmtab_table;
+static unsigned int	rmtab_size, rmtab_count;
+static unsigned int	rmtab_version;		/* bumped on every change */
+static int		rmtab_loaded;
+static struct stat	rmtab_stb;		/* of the rmtab last loaded */
+static long		journal_pos;		/* journal read up to here */
+static unsigned int	journal_records;
+static char *		journal_fn;
+
+static unsigned int
+rmtab_hash(const char *client, const char *path)
 {
-	struct rmtabent	xe;
-	struct rmtabent	*rep;
-	int		lockid;
-	long		pos;
+	unsigned int h = 2166136261u;
+	const unsigned char *p;
 
-	if ((lockid = xflock(rmtab.lockfn, "a")) < 0)
+	for (p = (const unsigned char *)client; *p; p++)
+		h = (h ^ *p) * 16777619u;
+	h = (h ^ ':') * 16777619u;
+	for (p = (const unsigned char *)path; *p; p++)
+		h = (h ^ *p) * 16777619u;
+	return h;
+}
+
+static void
+rmtab_clear(void)
+{
+	struct rmtab_ent *re, *next;
+	unsigned int i;
+
+	for (i = 0; i < rmtab_size; i++)
+		for (re = rmtab_table[i]; re; re = next) {
+			next = re->re_next;
+			free(re->re_client);
+			free(re);
+		}
+	free(rmtab_table);
+	rmtab_table = NULL;
+	rmtab_size = rmtab_count = 0;
+	rmtab_version++;
+}
+
+static int
+rmtab_grow(void)
+{
+	unsigned int size = rmtab_size ? rmtab_size * 2 : RMTAB_HASH_INIT;
+	struct rmtab_ent **table, *re, *next;
+	unsigned int i;
+
+	table = calloc(size, sizeof(*table));
+	if (table == NULL)
+		return rmtab_size ? 0 : -1;
+	for (i = 0; i < rmtab_size; i++)
+		for (re = rmtab_table[i]; re; re = next) {
+			next = re->re_next;
+			re->re_next = table[re->re_hash & (size - 1)];
+			table[re->re_hash & (size - 1)] = re;
+		}
+	free(rmtab_table);
+	rmtab_table = table;
+	rmtab_size = size;
+	return 0;
+}
+
+/* Find the entry for @client and @path, creating it if @create is set */
+static struct rmtab_ent *
+rmtab_lookup(const char *client, const char *path, int create)
+{
+	unsigned int hash = rmtab_hash(client, path);
+	struct rmtab_ent *re;
+
+	if (rmtab_size) {
+		for (re = rmtab_table[hash & (rmtab_size - 1)]; re;
+		     re = re->re_next)
+			if (re->re_hash == hash &&
+			    strcmp(re->re_client, client) == 0 &&
+			    strcmp(re->re_path, path) == 0)
+				return re;
+	}
+	if (!create)
+		return NULL;
+
+	if (rmtab_count >= rmtab_size && rmtab_grow() < 0)
+		goto out_nomem;
+	re = malloc(sizeof(*re) + strlen(path) + 1);
+	if (re == NULL)
+		goto out_nomem;
+	re->re_client = strdup(client);
+	if (re->re_client == NULL) {
+		free(re);
+		goto out_nomem;
+	}
+	strcpy(re->re_path, path);
+	re->re_hash = hash;
+	re->re_count = 0;
+	re->re_next = rmtab_table[hash & (rmtab_size - 1)];
+	rmtab_table[hash & (rmtab_size - 1)] = re;
+	rmtab_count++;
+	return re;
+
+out_nomem:
+	xlog(L_ERROR, "%s: memory allocation failed", __func__);
+	return NULL;
+}
+
+static void
+rmtab_remove(struct rmtab_ent *re)
+{
+	struct rmtab_ent **rep;
+
+	for (rep = &rmtab_table[re->re_hash & (rmtab_size - 1)]; *rep != re;
+	     rep = &(*rep)->re_next)
+		;
+	*rep = re->re_next;
+	rmtab_count--;
+	free(re->re_client);
+	free(re);
+}
+
+/* Set the count of an entry read from rmtab or the journal */
+static void
+rmtab_apply(const struct rmtabent *rep, int add)
+{
+	struct rmtab_ent *re;
+
+	re = rmtab_lookup(rep->r_client, rep->r_path, rep->r_count > 0);
+	if (re == NULL)
 		return;
-	setrmtabent("r+");
-	while ((rep = getrmtabent(1, &pos)) != NULL) {
-		if (strcmp (rep->r_client,
-			    host) == 0
-		    && strcmp(rep->r_path, path) == 0) {
-			rep->r_count++;
-			/* PRC: do the HA callout: */
-			ha_callout("mount", rep->r_client, rep->r_path, rep->r_count);
-			putrmtabent(rep, &pos);
-			endrmtabent();
-			xfunlock(lockid);
-			return;
+	re->re_count = add ? re->re_count + rep->r_count : rep->r_count;
+	if (re->re_count <= 0)
+		rmtab_remove(re);
+	rmtab_version++;
+}
+
+static int
+rmtab_load(void)
+{
+	struct rmtabent	*rep;
+	FILE		*fp;
+
+	rmtab_clear();
+	journal_pos = 0;
+	journal_records = 0;
+	rmtab_loaded = 0;
+	if (stat(rmtab.statefn, &rmtab_stb) < 0) {
+		if (errno != ENOENT) {
+			xlog(L_ERROR, "can't stat %s: %m", rmtab.statefn);
+			return -1;
 		}
+		memset(&rmtab_stb, 0, sizeof(rmtab_stb));
+	} else {
+		/* Duplicate entries, which older mountds could leave
+		 * behind, are merged */
+		if ((fp = fsetrmtabent(rmtab.statefn, "r")) == NULL)
+			return -1;
+		while ((rep = fgetrmtabent(fp, 1, NULL)) != NULL)
+			rmtab_apply(rep, 1);
+		fendrmtabent(fp);
 	}
-	endrmtabent();
-	strncpy(xe.r_client, host,
-		sizeof (xe.r_client) - 1);
-	xe.r_client [sizeof (xe.r_client) - 1] = '\0';
-	strncpy(xe.r_path, path, sizeof (xe.r_path) - 1);
-	xe.r_path [sizeof (xe.r_path) - 1] = '\0';
-	xe.r_count = 1;
-	if (setrmtabent("a")) {
-		/* PRC: do the HA callout: */
-		ha_callout("mount", xe.r_client, xe.r_path, xe.r_count);
-		putrmtabent(&xe, NULL);
-		endrmtabent();
+	rmtab_loaded = 1;
+	return 0;
+}
+
+static int
+rmtab_changed(void)
+{
+	struct stat stb;
+
+	if (stat(rmtab.statefn, &stb) < 0) {
+		if (errno != ENOENT)
+			return 1;
+		memset(&stb, 0, sizeof(stb));
 	}
-	xfunlock(lockid);
+	return stb.st_dev != rmtab_stb.st_dev ||
+	       stb.st_ino != rmtab_stb.st_ino ||
+	       stb.st_size != rmtab_stb.st_size ||
+	       stb.st_mtime != rmtab_stb.st_mtime;
 }
 
-void
-mountlist_del(char *hname, const char *path)
+/*
+ * Bring the in-memory list up to date with rmtab and the journal.
+ * Called with the rmtab lock held.  Returns zero on success.
+ */
+static int
+mountlist_sync(void)
 {
 	struct rmtabent	*rep;
+	struct stat	stb;
 	FILE		*fp;
-	int		lockid;
-	int		match;
 
-	if ((lockid = xflock(rmtab.lockfn, "w")) < 0)
-		return;
-	if (!setrmtabent("r")) {
-		xfunlock(lockid);
-		return;
+	if (journal_fn == NULL &&
+	    asprintf(&journal_fn, "%s.journal", rmtab.statefn) < 0) {
+		journal_fn = NULL;
+		return -1;
 	}
-	if (!(fp = fsetrmtabent(rmtab.tmpfn, "w"))) {
-		endrmtabent();
-		xfunlock(lockid);
-		return;
+	if ((!rmtab_loaded || rmtab_changed()) && rmtab_load() < 0)
+		return -1;
+
+	fp = fopen(journal_fn, "r");
+	if (fp == NULL)
+		return errno == ENOENT ? 0 : -1;
+	if (fstat(fileno(fp), &stb) == 0 && stb.st_size < journal_pos) {
+		/* emptied behind our back */
+		fclose(fp);
+		if (rmtab_load() < 0)
+			return -1;
+		return mountlist_sync();
 	}
-	while ((rep = getrmtabent(1, NULL)) != NULL) {
-		match = !strcmp (rep->r_client, hname)
-			&& !strcmp(rep->r_path, path);
-		if (match) {
-			rep->r_count--;
-			/* PRC: do the HA callout: */
-			ha_callout("unmount", rep->r_client, rep->r_path, rep->r_count);
+	if (fseek(fp, journal_pos, SEEK_SET) == 0) {
+		while ((rep = fgetrmtabent(fp, 1, NULL)) != NULL) {
+			rmtab_apply(rep, 0);
+			journal_records++;
 		}
-		if (!match || rep->r_count)
-			fputrmtabent(fp, rep, NULL);
+		journal_pos = ftell(fp);
+	}
+	fclose(fp);
+	return 0;
+}
+
+/*
+ * Rewrite rmtab from the in-memory list and empty the journal.
+ * Called with the rmtab lock held for writing.
+ */
+static int
+mountlist_compact(void)
+{
+	struct rmtab_ent *re;
+	struct rmtabent	xe;
+	unsigned int	i;
+	FILE		*fp;
+	int		fd, err = 0;
+
+	if (!(fp = fsetrmtabent(rmtab.tmpfn, "w")))
+		return -1;
+	for (i = 0; i < rmtab_size; i++)
+		for (re = rmtab_table[i]; re; re = re->re_next) {
+			strncpy(xe.r_client, re->re_client,
+				sizeof (xe.r_client) - 1);
+			xe.r_client[sizeof (xe.r_client) - 1] = '\0';
+			strncpy(xe.r_path, re->re_path,
+				sizeof (xe.r_path) - 1);
+			xe.r_path[sizeof (xe.r_path) - 1] = '\0';
+			xe.r_count = re->re_count;
+			fputrmtabent(fp, &xe, NULL);
+		}
+	if (ferror(fp))
+		err = -1;
+	if (fclose(fp) != 0 || err < 0) {
+		xlog(L_ERROR, "couldn't write %s", rmtab.tmpfn);
+		unlink(rmtab.tmpfn);
+		return -1;
 	}
 	if (slink_safe_rename(rmtab.tmpfn, rmtab.statefn) < 0) {
 		xlog(L_ERROR, "couldn't rename %s to %s",
 				rmtab.tmpfn, rmtab.statefn);
+		unlink(rmtab.tmpfn);
+		return -1;
+	}
+	stat(rmtab.statefn, &rmtab_stb);
+
+	fd = open(journal_fn, O_WRONLY);
+	if (fd >= 0) {
+		if (ftruncate(fd, 0) < 0)
+			xlog(L_ERROR, "couldn't truncate %s: %m", journal_fn);
+		close(fd);
 	}
-	endrmtabent();	/* close & unlink */
-	fendrmtabent(fp);
+	journal_pos = 0;
+	journal_records = 0;
+	return 0;
+}
+
+/*
+ * Record the new count of @client's mount of @path, which may be zero.  If the journal
+ * can't be written, rmtab is rewritten instead.  Called with the
+ * rmtab lock held for writing.
+ */
+static void
+mountlist_journal(const char *client, const char *path, int count)
+{
+	struct rmtabent	xe;
+	FILE		*fp;
+	int		err = -1;
+
+	strncpy(xe.r_client, client, sizeof (xe.r_client) - 1);
+	xe.r_client[sizeof (xe.r_client) - 1] = '\0';
+	strncpy(xe.r_path, path, sizeof (xe.r_path) - 1);
+	xe.r_path[sizeof (xe.r_path) - 1] = '\0';
+	xe.r_count = count;
+
+	fp = fsetrmtabent(journal_fn, "a");
+	if (fp) {
+		fputrmtabent(fp, &xe, NULL);
+		if (fflush(fp) == 0 && !ferror(fp)) {
+			/* everything before our record was applied */
+			journal_pos = ftell(fp);
+			journal_records++;
+			err = 0;
+		}
+		if (fclose(fp) != 0)
+			err = -1;
+	}
+	if (err < 0 || journal_records > RMTAB_JOURNAL_MAX + rmtab_count)
+		mountlist_compact();
+}
+
+/*
+ * A lock taken with xflock() doesn't keep out the other threads of
+ * this process, so worker threads also take a mutex.
+ */
+#ifdef HAVE_LIBPTHREAD
+static pthread_mutex_t	rmtab_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static int
+rmtab_lock(char *type)
+{
+	int lockid;
+
+	mountd_lock(&rmtab_mutex);
+	lockid = xflock(rmtab.lockfn, type);
+	if (lockid < 0)
+		mountd_unlock(&rmtab_mutex);
+	return lockid;
+}
+
+static void
+rmtab_unlock(int lockid)
+{
 	xfunlock(lockid);
+	mountd_unlock(&rmtab_mutex);
+}
+
+void
+mountlist_add(char *host, const char *path)
+{
+	struct rmtab_ent *re;
+	int		lockid;
+
+	if ((lockid = rmtab_lock("a")) < 0)
+		return;
+	if (mountlist_sync() < 0)
+		goto out_unlock;
+	re = rmtab_lookup(host, path, 1);
+	if (re == NULL)
+		goto out_unlock;
+	re->re_count++;
+	rmtab_version++;
+	/* PRC: do the HA callout: */
+	mountd_callout("mount", re->re_client, re->re_path, re->re_count);
+	mountlist_journal(host, path, re->re_count);
+out_unlock:
+	rmtab_unlock(lockid);
+}
+
+void
+mountlist_del(char *hname, const char *path)
+{
+	struct rmtab_ent *re;
+	int		lockid;
+
+	if ((lockid = rmtab_lock("w")) < 0)
+		return;
+	if (mountlist_sync() < 0)
+		goto out_unlock;
+	re = rmtab_lookup(hname, path, 0);
+	if (re == NULL)
+		goto out_unlock;
+	re->re_count--;
+	rmtab_version++;
+	/* PRC: do the HA callout: */
+	mountd_callout("unmount", re->re_client, re->re_path,
+		       re->re_count);
+	mountlist_journal(hname, path, re->re_count);
+	if (re->re_count <= 0)
+		rmtab_remove(re);
+out_unlock:
+	rmtab_unlock(lockid);
 }
 
 void
 mountlist_del_all(const struct sockaddr *sap)
 {
+	struct rmtab_ent *re, *next;
 	char		*hostname;
-	struct rmtabent	*rep;
-	FILE		*fp;
+	unsigned int	i;
 	int		lockid;
 
-	if ((lockid = xflock(rmtab.lockfn, "w")) < 0)
+	if ((lockid = rmtab_lock("w")) < 0)
 		return;
 	hostname = host_canonname(sap);
 	if (hostname == NULL) {
@@ -148,29 +474,53 @@ mountlist_del_all(const struct sockaddr *sap)
 		goto out_unlock;
 	}
 
-	if (!setrmtabent("r"))
+	if (mountlist_sync() < 0)
 		goto out_free;
 
-	if (!(fp = fsetrmtabent(rmtab.tmpfn, "w")))
-		goto out_close;
-
-	while ((rep = getrmtabent(1, NULL)) != NULL) {
-		if (strcmp(rep->r_client, hostname) == 0 &&
-		    auth_authenticate("umountall", sap, rep->r_path) != NULL)
-			continue;
-		fputrmtabent(fp, rep, NULL);
-	}
-	if (slink_safe_rename(rmtab.tmpfn, rmtab.statefn) < 0) {
-		xlog(L_ERROR, "couldn't rename %s to %s",
-				rmtab.tmpfn, rmtab.statefn);
-	}
-	fendrmtabent(fp);
-out_close:
-	endrmtabent();	/* close & unlink */
+	for (i = 0; i < rmtab_size; i++)
+		for (re = rmtab_table[i]; re; re = next) {
+			next = re->re_next;
+			if (strcmp(re->re_client, hostname) != 0 ||
+			    auth_authenticate("umountall", sap,
+					      re->re_path) == NULL)
+				continue;
+			mountlist_journal(re->re_client, re->re_path, 0);
+			rmtab_remove(re);
+			rmtab_version++;
+		}
 out_free:
 	free(hostname);
 out_unlock:
-	xfunlock(lockid);
+	rmtab_unlock(lockid);
+}
+
+static void
+mountlist_compact_event(int UNUSED(fd), void *UNUSED(data))
+{
+	int		lockid;
+
+	if ((lockid = rmtab_lock("w")) < 0)
+		return;
+	if (mountlist_sync() == 0 && journal_records)
+		mountlist_compact();
+	rmtab_unlock(lockid);
+}
+
+/**
+ * mountlist_register_events - compact the mount list from the event loop
+ *
+ * Empties the rmtab journal into rmtab every RMTAB_COMPACT_INTERVAL
+ * seconds, if it has grown.  Returns zero on success.
+ */
+int
+mountlist_register_events(void)
+{
+	if (xepoll_add_timer(RMTAB_COMPACT_INTERVAL * 1000,
+			     mountlist_compact_event, NULL) < 0) {
+		xlog(L_WARNING, "Unable to start rmtab timer: %m");
+		return -1;
+	}
+	return 0;
 }
 
 static void
@@ -185,70 +535,78 @@ mountlist_freeall(mountlist list)
 	}
 }
 
+/* Make a mount list entry for @re, or return NULL */
+static mountlist
+mountlist_new(const struct rmtab_ent *re)
+{
+	mountlist m;
+
+	m = calloc(1, sizeof(*m));
+	if (m == NULL)
+		return NULL;
+
+	if (reverse_resolve) {
+		struct addrinfo *ai;
+		ai = host_pton(re->re_client);
+		if (ai != NULL) {
+			m->ml_hostname = host_canonname(ai->ai_addr);
+			nfs_freeaddrinfo(ai);
+		}
+	}
+	if (m->ml_hostname == NULL)
+		m->ml_hostname = strdup(re->re_client);
+
+	m->ml_directory = strdup(re->re_path);
+
+	if (m->ml_hostname == NULL || m->ml_directory == NULL) {
+		free(m->ml_hostname);
+		free(m->ml_directory);
+		free(m);
+		return NULL;
+	}
+	return m;
+}
+
 mountlist
 mountlist_list(void)
 {
-	static mountlist	mlist = NULL;
-	static time_t		last_mtime = 0;
+	/* Each thread's own, since its reply is sent after unlocking */
+	static __thread mountlist	mlist = NULL;
+	static __thread unsigned int	mlist_version;
+	static __thread int		mlist_valid;
 	mountlist		m;
-	struct rmtabent		*rep;
-	struct stat		stb;
+	struct rmtab_ent	*re;
+	unsigned int		i;
 	int			lockid;
 
-	if ((lockid = xflock(rmtab.lockfn, "r")) < 0)
+	if ((lockid = rmtab_lock("r")) < 0)
 		return NULL;
-	if (stat(rmtab.statefn, &stb) < 0) {
-		xlog(L_ERROR, "can't stat %s: %s",
-				rmtab.statefn, strerror(errno));
-		xfunlock(lockid);
+	if (mountlist_sync() < 0) {
+		rmtab_unlock(lockid);
 		return NULL;
 	}
-	if (stb.st_mtime != last_mtime) {
+	if (!mlist_valid || mlist_version != rmtab_version) {
 		mountlist_freeall(mlist);
 		mlist = NULL;
-		last_mtime = stb.st_mtime;
-
-		setrmtabent("r");
-		while ((rep = getrmtabent(1, NULL)) != NULL) {
-			m = calloc(1, sizeof(*m));
-			if (m == NULL) {
-				mountlist_freeall(mlist);
-				mlist = NULL;
-				xlog(L_ERROR, "%s: memory allocation failed",
-						__func__);
-				break;
-			}
+		mlist_version = rmtab_version;
+		mlist_valid = 1;
 
-			if (reverse_resolve) {
-				struct addrinfo *ai;
-				ai = host_pton(rep->r_client);
-				if (ai != NULL) {
-					m->ml_hostname = host_canonname(ai->ai_addr);
-					nfs_freeaddrinfo(ai);
+		for (i = 0; i < rmtab_size && mlist_valid; i++)
+			for (re = rmtab_table[i]; re; re = re->re_next) {
+				m = mountlist_new(re);
+				if (m == NULL) {
+					mountlist_freeall(mlist);
+					mlist = NULL;
+					mlist_valid = 0;
+					xlog(L_ERROR, "%s: memory allocation "
+					     "failed", __func__);
+					break;
 				}
+				m->ml_next = mlist;
+				mlist = m;
 			}
-			if (m->ml_hostname == NULL)
-				m->ml_hostname = strdup(rep->r_client);
-
-			m->ml_directory = strdup(rep->r_path);
-
-			if (m->ml_hostname == NULL || m->ml_directory == NULL) {
-				free(m->ml_hostname);
-				free(m->ml_directory);
-				free(m);
-				mountlist_freeall(mlist);
-				mlist = NULL;
-				xlog(L_ERROR, "%s: memory allocation failed",
-						__func__);
-				break;
-			}
-
-			m->ml_next = mlist;
-			mlist = m;
-		}
-		endrmtabent();
 	}
-	xfunlock(lockid);
+	rmtab_unlock(lockid);
 
 	return mlist;
 }
@@ -51,74 +51,115 @@
 #include <rpc/rpc.h>
 #include "xlog.h"
 #include <errno.h>
+#include <stdlib.h>
+#include <string.h>
 #include <time.h>
 
 #ifdef HAVE_LIBTIRPC
 #include <rpc/rpc_com.h>
 #endif
 #include "export.h"
+#include "mountd.h"
+#include "xepoll.h"
+#include "rpcmisc.h"
+#include "workqueue.h"
 
 void my_svc_run(void);
 
-#if defined(__GLIBC__) && LONG_MAX != INT_MAX
-/* bug in glibc 2.3.6 and earlier, we need
- * our own svc_getreqset
+int	max_connections = 0;
+int	idle_timeout = NFS_SVC_IDLE_TIMEOUT;
+
+/*
+ * With worker threads, a request is read and answered by a worker
+ * while the event loop goes on to the next transport.  As for cache
+ * upcalls, the event loop reloads the export table before queueing a
+ * request, and the worker holds it read-locked.
  */
+static struct xthread_workqueue *svc_wq;
+
+struct svc_work {
+	void		(*fn)(void *);
+	void *		data;
+};
+
 static void
-my_svc_getreqset (fd_set *readfds)
+svc_work_run(void *data)
+{
+	struct svc_work *w = data;
+
+	export_read_lock();
+	w->fn(w->data);
+	export_read_unlock();
+	free(w);
+}
+
+static int
+svc_work_queue(void (*fn)(void *), void *data)
 {
-	fd_mask mask;
-	fd_mask *maskp;
-	int setsize;
-	int sock;
-	int bit;
-
-	setsize = _rpc_dtablesize ();
-	if (setsize > FD_SETSIZE)
-		setsize = FD_SETSIZE;
-	maskp = readfds->fds_bits;
-	for (sock = 0; sock < setsize; sock += NFDBITS)
-		for (mask = *maskp++;
-		     (bit = ffsl (mask));
-		     mask ^= (1L << (bit - 1)))
-			svc_getreq_common (sock + bit - 1);
+	struct svc_work *w;
+
+	w = malloc(sizeof(*w));
+	if (w == NULL)
+		return -1;
+	w->fn = fn;
+	w->data = data;
+	auth_reload();
+	if (xthread_work_queue(svc_wq, svc_work_run, w) < 0) {
+		free(w);
+		return -1;
+	}
+	return 0;
 }
-#define svc_getreqset my_svc_getreqset
 
+/**
+ * svc_start_workers - serve RPC requests from a pool of threads
+ * @nthreads: number of worker threads
+ *
+ * Call before my_svc_run().  Returns zero on success, or -1 if the
+ * pool could not be started, in which case requests are served by
+ * the event loop.
+ */
+int
+svc_start_workers(int nthreads)
+{
+#ifdef HAVE_LIBPTHREAD
+	svc_wq = xthread_workqueue_alloc_pool(nthreads);
+	if (svc_wq)
+		return 0;
+	xlog(L_ERROR, "Unable to start %d RPC worker threads", nthreads);
+#else
+	xlog(L_ERROR, "Threaded RPC processing is not supported");
 #endif
+	return -1;
+}
 
 /*
- * The heart of the server.  A crib from libc for the most part...
+ * The heart of the server.  Cache channels, the v4clients watcher,
+ * the rmtab compaction timer and the RPC transports are registered
+ * with the event loop once; each wakeup dispatches only the
+ * descriptors that are ready.
  */
 void
 my_svc_run(void)
 {
-	fd_set	readfds;
-	int	selret;
-
-	for (;;) {
+	if (xepoll_init() < 0)
+		return;
 
-		readfds = svc_fdset;
-		cache_set_fds(&readfds);
-		v4clients_set_fds(&readfds);
+	cache_register_events();
+	v4clients_register_events();
+	mountlist_register_events();
+	if (nfs_svc_epoll_init(max_connections, idle_timeout) < 0)
+		return;
+	if (svc_wq && nfs_svc_epoll_offload(svc_work_queue) < 0)
+		xlog(L_WARNING, "RPC requests will be served by one thread");
 
-		selret = select(FD_SETSIZE, &readfds,
-				(void *) 0, (void *) 0, (struct timeval *) 0);
-
-
-		switch (selret) {
-		case -1:
-			if (errno == EINTR || errno == ECONNREFUSED
-			 || errno == ENETUNREACH || errno == EHOSTUNREACH)
+	for (;;) {
+		if (xepoll_wait(-1) < 0) {
+			if (errno == ECONNREFUSED || errno == ENETUNREACH ||
+			    errno == EHOSTUNREACH)
 				continue;
-			xlog(L_ERROR, "my_svc_run() - select: %m");
+			xlog(L_ERROR, "my_svc_run() - epoll_wait: %m");
 			return;
-
-		default:
-			selret -= cache_process_req(&readfds);
-			selret -= v4clients_process(&readfds);
-			if (selret)
-				svc_getreqset(&readfds);
 		}
 	}
 }
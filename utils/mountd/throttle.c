@@ -0,0 +1,179 @@
+/*
+ * utils/mountd/throttle.c
+ *
+ * Per-client rate limiting of MOUNT requests.
+ *
+ * Requests are served in the order they arrive, so a client that
+ * sends MNT requests in a loop can keep everyone else waiting.  With
+ * client-rate set, each client address may send that many requests a
+ * second, and up to client-burst at once; requests beyond that are
+ * dropped before their arguments are decoded or any lookup is done
+ * for them.  A dropped request gets no reply, so the client backs off
+ * and retransmits as it would if the server were busy.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "xlog.h"
+#include "exportfs.h"
+#include "mountd.h"
+
+/* Requests a second allowed from each client; zero means no limit */
+int client_rate;
+/* Requests a client may send at once */
+int client_burst = 20;
+
+/*
+ * Each client is rate limited with the generic cell rate algorithm: a
+ * request is let through when it comes no earlier than the time the
+ * client's previous requests are "paid off" by, less the burst
+ * allowance.  A client whose time is past is in the same state as one
+ * never seen, so entries can be forgotten when the table fills up.
+ */
+struct throttle_ent {
+	struct throttle_ent *	t_next;
+	struct in6_addr		t_addr;		/* IPv4 as v4-mapped */
+	unsigned long long	t_due;		/* us, see above */
+	unsigned long long	t_logged;	/* when last logged */
+	unsigned long		t_dropped;	/* since then */
+};
+
+#define THROTTLE_HASH		1024		/* buckets, a power of 2 */
+#define THROTTLE_MAX		65536		/* clients tracked */
+#define THROTTLE_LOG_USECS	60000000ULL	/* log a client once a minute */
+
+static struct throttle_ent *throttle_table[THROTTLE_HASH];
+static unsigned int	throttle_count;
+#ifdef HAVE_LIBPTHREAD
+static pthread_mutex_t	throttle_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static int throttle_key(const struct sockaddr *sap, struct in6_addr *addr)
+{
+	const struct sockaddr_in *sin = (const struct sockaddr_in *)sap;
+	const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *)sap;
+
+	switch (sap->sa_family) {
+	case AF_INET:
+		memset(addr, 0, sizeof(*addr));
+		addr->s6_addr[10] = 0xff;
+		addr->s6_addr[11] = 0xff;
+		memcpy(&addr->s6_addr[12], &sin->sin_addr, 4);
+		return 0;
+	case AF_INET6:
+		*addr = sin6->sin6_addr;
+		return 0;
+	}
+	return -1;
+}
+
+static unsigned int throttle_hash(const struct in6_addr *addr)
+{
+	const unsigned char *p = addr->s6_addr;
+	uint32_t h = 2166136261u;
+	unsigned int i;
+
+	for (i = 0; i < sizeof(addr->s6_addr); i++)
+		h = (h ^ p[i]) * 16777619u;
+	return h & (THROTTLE_HASH - 1);
+}
+
+/* Forget the clients that are no longer being held back */
+static void throttle_expire(unsigned long long now)
+{
+	struct throttle_ent *t, **tp;
+	unsigned int i;
+
+	for (i = 0; i < THROTTLE_HASH; i++) {
+		tp = &throttle_table[i];
+		while ((t = *tp) != NULL) {
+			if (t->t_due <= now && t->t_dropped == 0) {
+				*tp = t->t_next;
+				free(t);
+				throttle_count--;
+				continue;
+			}
+			tp = &t->t_next;
+		}
+	}
+}
+
+static struct throttle_ent *throttle_lookup(const struct in6_addr *addr,
+					    unsigned long long now)
+{
+	struct throttle_ent *t, **head = &throttle_table[throttle_hash(addr)];
+
+	for (t = *head; t; t = t->t_next)
+		if (memcmp(&t->t_addr, addr, sizeof(*addr)) == 0)
+			return t;
+
+	if (throttle_count >= THROTTLE_MAX) {
+		throttle_expire(now);
+		if (throttle_count >= THROTTLE_MAX)
+			return NULL;
+	}
+	t = malloc(sizeof(*t));
+	if (t == NULL)
+		return NULL;
+	memset(t, 0, sizeof(*t));
+	t->t_addr = *addr;
+	t->t_next = *head;
+	*head = t;
+	throttle_count++;
+	return t;
+}
+
+/**
+ * throttle_request - decide whether to serve a request
+ * @sap: address of the client that sent it
+ *
+ * Returns 1 if the request may be served, or 0 if the client has sent
+ * more requests than its rate allows and this one should be dropped.
+ */
+int throttle_request(const struct sockaddr *sap)
+{
+	unsigned long long now, interval, tolerance;
+	struct throttle_ent *t;
+	struct in6_addr addr;
+	char buf[INET6_ADDRSTRLEN];
+	int ok = 1;
+
+	if (client_rate <= 0 || throttle_key(sap, &addr) < 0)
+		return 1;
+
+	now = cache_stats_clock();
+	mountd_lock(&throttle_lock);
+	t = throttle_lookup(&addr, now);
+	if (t == NULL)
+		goto out;
+
+	interval = 1000000ULL / client_rate;
+	tolerance = interval * (client_burst > 1 ? client_burst - 1 : 0);
+	if (t->t_due < now)
+		t->t_due = now;
+	if (t->t_due - now <= tolerance) {
+		t->t_due += interval;
+		goto out;
+	}
+
+	t->t_dropped++;
+	if (now - t->t_logged >= THROTTLE_LOG_USECS || t->t_logged == 0) {
+		xlog(L_WARNING, "Dropped %lu requests from %s, which sends more "
+		     "than %d a second", t->t_dropped,
+		     host_ntop(sap, buf, sizeof(buf)), client_rate);
+		t->t_logged = now;
+		t->t_dropped = 0;
+	}
+	ok = 0;
+out:
+	mountd_unlock(&throttle_lock);
+	return ok;
+}
@@ -0,0 +1,368 @@
+/*
+ * utils/nfsd/autoscale.c
+ *
+ * Grow and shrink the number of nfsd threads in each pool with the
+ * load, between a configured minimum and maximum.
+ *
+ * Every interval, /proc/fs/nfsd/pool_stats tells how many requests
+ * arrived at each pool, and how many of those woke an idle thread; the
+ * others found every thread busy and had to wait.  A pool where more than 1% of requests waited
+ * gets a quarter more threads; a pool where none waited for the idle
+ * time loses an eighth of its threads.  Between the two, nothing
+ * changes, so the count does not swing with every burst.
+ *
+ * Each change is logged, and the state of each pool is written to
+ * AUTOSCALE_STATUS_FILE after every interval.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <sys/types.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+
+#include "xlog.h"
+#include "nfssvc.h"
+#include "autoscale.h"
+
+#ifndef NFSD_FS_DIR
+#define NFSD_FS_DIR	  "/proc/fs/nfsd"
+#endif
+#define NFSD_POOL_STATS_FILE	NFSD_FS_DIR "/pool_stats"
+
+#ifndef NFSD_RPC_STATS_FILE
+#define NFSD_RPC_STATS_FILE	"/proc/net/rpc/nfsd"
+#endif
+
+#ifndef AUTOSCALE_RUNDIR
+#define AUTOSCALE_RUNDIR	"/run"
+#endif
+#define AUTOSCALE_PID_FILE	AUTOSCALE_RUNDIR "/rpc.nfsd.autoscale.pid"
+#define AUTOSCALE_STATUS_FILE	AUTOSCALE_RUNDIR "/rpc.nfsd.autoscale"
+
+#define AUTOSCALE_MAXPOOLS	1024
+
+struct pool {
+	int			threads;
+	unsigned long long	arrived, woken;
+	unsigned long long	darrived, dwaited;
+	int			idle;		/* seconds without waits */
+	const char *		last;		/* last decision */
+};
+
+static struct pool pools[AUTOSCALE_MAXPOOLS];
+static volatile sig_atomic_t autoscale_done;
+
+static void
+autoscale_sigterm(__attribute__((unused)) int sig)
+{
+	autoscale_done = 1;
+}
+
+/*
+ * "# pool packets-arrived sockets-enqueued threads-woken threads-timedout"
+ * and then a line for each pool.  Returns the number of pools read.
+ */
+static int
+autoscale_read_pool_stats(struct pool *new, int maxpools)
+{
+	char line[256];
+	int npools = 0;
+	FILE *f;
+
+	f = fopen(NFSD_POOL_STATS_FILE, "r");
+	if (f == NULL)
+		return -1;
+	while (npools < maxpools && fgets(line, sizeof(line), f)) {
+		struct pool *p = &new[npools];
+		int id;
+
+		if (line[0] == '#')
+			continue;
+		if (sscanf(line, "%d %llu %*u %llu", &id, &p->arrived,
+				&p->woken) != 3)
+			continue;
+		npools++;
+	}
+	fclose(f);
+	return npools;
+}
+
+/*
+ * Older kernels count how often all threads were busy in the second
+ * field of the "th" line; newer ones leave it at zero.
+ */
+static unsigned long long
+autoscale_read_allbusy(void)
+{
+	unsigned long long busy = 0;
+	char line[256];
+	FILE *f;
+
+	f = fopen(NFSD_RPC_STATS_FILE, "r");
+	if (f == NULL)
+		return 0;
+	while (fgets(line, sizeof(line), f))
+		if (sscanf(line, "th %*d %llu", &busy) == 1)
+			break;
+	fclose(f);
+	return busy;
+}
+
+static void
+autoscale_write_status(int npools, const struct autoscale_config *conf)
+{
+	char tmp[] = AUTOSCALE_STATUS_FILE ".XXXXXX";
+	double secs = conf->interval;
+	FILE *f;
+	int fd, i;
+
+	fd = mkstemp(tmp);
+	if (fd < 0)
+		return;
+	f = fdopen(fd, "w");
+	if (f == NULL) {
+		close(fd);
+		unlink(tmp);
+		return;
+	}
+	fprintf(f, "# min %d max %d interval %d idle-time %d\n",
+			conf->min, conf->max, conf->interval, conf->idle_time);
+	fprintf(f, "# pool threads arrived/s waited/s idle-secs decision\n");
+	for (i = 0; i < npools; i++)
+		fprintf(f, "%d %d %.1f %.1f %d %s\n", i, pools[i].threads,
+				pools[i].darrived / secs,
+				pools[i].dwaited / secs, pools[i].idle,
+				pools[i].last ? pools[i].last : "none");
+	if (fchmod(fd, 0644) < 0 || fclose(f) != 0 ||
+	    rename(tmp, AUTOSCALE_STATUS_FILE) < 0)
+		unlink(tmp);
+}
+
+/* Someone else may have set the threads, so check before scaling */
+static int
+autoscale_clamp(struct pool *p, const struct autoscale_config *conf)
+{
+	if (p->threads < conf->min) {
+		p->last = "raise-to-min";
+		return conf->min;
+	}
+	if (p->threads > conf->max) {
+		p->last = "lower-to-max";
+		return conf->max;
+	}
+	return p->threads;
+}
+
+/* Decide how many threads pool 'p' should have; returns that */
+static int
+autoscale_decide(struct pool *p, unsigned long long allbusy,
+		const struct autoscale_config *conf)
+{
+	int want = autoscale_clamp(p, conf);
+
+	if (want != p->threads)
+		return want;
+	if (p->dwaited * 100 > p->darrived || allbusy) {
+		p->idle = 0;
+		if (want < conf->max) {
+			want += want / 4 ? want / 4 : 1;
+			if (want > conf->max)
+				want = conf->max;
+			p->last = "grow";
+		}
+		return want;
+	}
+	if (p->dwaited)
+		return want;
+
+	p->idle += conf->interval;
+	if (p->idle >= conf->idle_time && want > conf->min) {
+		want -= want / 8 ? want / 8 : 1;
+		if (want < conf->min)
+			want = conf->min;
+		p->idle = 0;
+		p->last = "shrink";
+	}
+	return want;
+}
+
+static void
+autoscale_run(const struct autoscale_config *conf)
+{
+	static struct pool new[AUTOSCALE_MAXPOOLS];
+	int threads[AUTOSCALE_MAXPOOLS], want[AUTOSCALE_MAXPOOLS];
+	unsigned long long allbusy, oallbusy = 0;
+	int i, npools, nstats, first = 1, changed;
+
+	xlog(L_NOTICE, "autoscaling nfsd threads between %d and %d per pool",
+			conf->min, conf->max);
+	while (!autoscale_done) {
+		struct timespec ts = { .tv_sec = first ? 0 : conf->interval };
+
+		if (nanosleep(&ts, NULL) < 0 && autoscale_done)
+			break;
+
+		/* rpc.nfsd 0 or a crash: nothing left to scale */
+		npools = nfssvc_get_pool_threads(threads, AUTOSCALE_MAXPOOLS);
+		for (i = 0; i < npools && threads[i] == 0; i++)
+			;
+		if (npools <= 0 || i == npools) {
+			xlog(L_NOTICE, "nfsd is not running; "
+					"stopping autoscaling");
+			break;
+		}
+		nstats = autoscale_read_pool_stats(new, AUTOSCALE_MAXPOOLS);
+		if (nstats < npools) {
+			xlog(L_ERROR, "unable to read %s: %m",
+					NFSD_POOL_STATS_FILE);
+			break;
+		}
+		allbusy = autoscale_read_allbusy();
+
+		changed = 0;
+		for (i = 0; i < npools; i++) {
+			struct pool *p = &pools[i];
+
+			p->threads = threads[i];
+			if (first || new[i].arrived < p->arrived) {
+				p->darrived = p->dwaited = 0;
+			} else {
+				unsigned long long dw;
+
+				dw = new[i].woken - p->woken;
+				p->darrived = new[i].arrived - p->arrived;
+				p->dwaited = p->darrived > dw ?
+						p->darrived - dw : 0;
+			}
+			p->arrived = new[i].arrived;
+			p->woken = new[i].woken;
+
+			if (first)
+				want[i] = autoscale_clamp(p, conf);
+			else
+				want[i] = autoscale_decide(p,
+						allbusy - oallbusy, conf);
+			if (want[i] != p->threads) {
+				xlog(L_NOTICE, "pool %d: %d -> %d threads, "
+					"%llu of %llu requests waited", i,
+					p->threads, want[i], p->dwaited,
+					p->darrived);
+				changed = 1;
+			}
+		}
+		oallbusy = allbusy;
+		first = 0;
+
+		if (changed) {
+			if (nfssvc_set_pool_threads(want, npools) < 0)
+				xlog(L_ERROR, "unable to set pool threads: "
+						"errno %d (%m)", errno);
+			else
+				for (i = 0; i < npools; i++)
+					pools[i].threads = want[i];
+		}
+		autoscale_write_status(npools, conf);
+	}
+	unlink(AUTOSCALE_STATUS_FILE);
+}
+
+/**
+ * nfsd_autoscale_start - start a thread controller in the background
+ * @conf: the range and pace to scale threads at
+ *
+ * Does nothing if a controller is already running.
+ */
+void
+nfsd_autoscale_start(const struct autoscale_config *conf)
+{
+	struct sigaction act = { .sa_handler = autoscale_sigterm };
+	char pid[32];
+	int fd;
+
+	fd = open(AUTOSCALE_PID_FILE, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		xlog(L_ERROR, "unable to open %s: %m", AUTOSCALE_PID_FILE);
+		return;
+	}
+	if (flock(fd, LOCK_EX | LOCK_NB) < 0) {
+		xlog(D_GENERAL, "nfsd thread autoscaling is already running");
+		close(fd);
+		return;
+	}
+
+	switch (fork()) {
+	case -1:
+		xlog(L_ERROR, "unable to start autoscaling: %m");
+		/* FALLTHRU */
+	default:
+		close(fd);
+		return;
+	case 0:
+		break;
+	}
+
+	setsid();
+	sigaction(SIGTERM, &act, NULL);
+	sigaction(SIGINT, &act, NULL);
+	if (ftruncate(fd, 0) == 0) {
+		snprintf(pid, sizeof(pid), "%d\n", getpid());
+		if (write(fd, pid, strlen(pid)) < 0)
+			xlog(L_WARNING, "unable to write %s: %m",
+					AUTOSCALE_PID_FILE);
+	}
+	autoscale_run(conf);
+	exit(0);
+}
+
+/**
+ * nfsd_autoscale_stop - stop the thread controller, if there is one
+ *
+ * Waits for it to exit, so that it cannot start threads again after
+ * the caller has stopped them.
+ */
+void
+nfsd_autoscale_stop(void)
+{
+	char buf[32];
+	ssize_t n;
+	int fd, tries;
+
+	fd = open(AUTOSCALE_PID_FILE, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return;
+	if (flock(fd, LOCK_EX | LOCK_NB) == 0)
+		goto out;
+
+	n = read(fd, buf, sizeof(buf) - 1);
+	if (n > 0) {
+		buf[n] = '\0';
+		if (atoi(buf) > 0)
+			kill(atoi(buf), SIGTERM);
+	}
+	for (tries = 0; tries < 100; tries++) {
+		struct timespec ts = { .tv_nsec = 50 * 1000 * 1000 };
+
+		if (flock(fd, LOCK_EX | LOCK_NB) == 0)
+			goto out;
+		nanosleep(&ts, NULL);
+	}
+	xlog(L_WARNING, "nfsd thread autoscaling did not stop");
+out:
+	close(fd);
+}
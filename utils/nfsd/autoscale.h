@@ -0,0 +1,23 @@
+/*
+ *   utils/nfsd/autoscale.h -- nfsd thread autoscaling for rpc.nfsd
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ */
+
+#ifndef _NFSD_AUTOSCALE_H
+#define _NFSD_AUTOSCALE_H
+
+struct autoscale_config {
+	int	min;		/* threads per pool */
+	int	max;
+	int	interval;	/* seconds between samples */
+	int	idle_time;	/* seconds without waits before shrinking */
+};
+
+void	nfsd_autoscale_start(const struct autoscale_config *conf);
+void	nfsd_autoscale_stop(void);
+
+#endif /* _NFSD_AUTOSCALE_H */
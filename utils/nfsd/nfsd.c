@@ -27,6 +27,8 @@
 #include "conffile.h"
 #include "nfslib.h"
 #include "nfssvc.h"
+#include "autoscale.h"
+#include "nfsnl.h"
 #include "xlog.h"
 #include "xcommon.h"
 
@@ -34,6 +36,8 @@
 #define NFSD_NPROC 8
 #endif
 
+#define NFSD_MAXPOOLS	1024
+
 static void	usage(const char *);
 
 static struct option longopts[] =
@@ -56,6 +60,41 @@ static struct option longopts[] =
 	{ NULL, 0, 0, 0 }
 };
 
+/*
+ * Spread the threads as pool-threads says: one count for every pool,
+ * or a count for each pool in turn.
+ */
+static void
+set_pool_threads(struct conf_list *list)
+{
+	int threads[NFSD_MAXPOOLS], npools, i;
+	struct conf_list_node *n;
+
+	npools = nfssvc_get_pool_threads(threads, NFSD_MAXPOOLS);
+	if (npools <= 0) {
+		xlog(L_ERROR, "unable to read the nfsd pools: errno %d (%m)",
+				errno);
+		return;
+	}
+	if (list->cnt != 1 && list->cnt != (size_t)npools) {
+		xlog(L_ERROR, "pool-threads gives %zu pools but nfsd has %d; "
+				"leaving the threads spread evenly",
+				list->cnt, npools);
+		return;
+	}
+
+	i = 0;
+	TAILQ_FOREACH(n, &list->fields, link)
+		threads[i++] = atoi(n->field);
+	for (; i < npools; i++)
+		threads[i] = threads[0];
+	for (i = 0; i < npools; i++)
+		xlog(D_GENERAL, "pool %d: %d threads", i, threads[i]);
+	if (nfssvc_set_pool_threads(threads, npools) < 0)
+		xlog(L_ERROR, "unable to set pool threads: errno %d (%m)",
+				errno);
+}
+
 inline static void 
 read_nfsd_conf(void)
 {
@@ -70,7 +109,8 @@ main(int argc, char **argv)
 	char *p, *progname, *port, *rdma_port = NULL;
 	char **haddr = NULL;
 	int hcounter = 0;
-	struct conf_list *hosts;
+	struct conf_list *hosts, *pool_threads;
+	char *pool_mode;
 	int	socket_up = 0;
 	unsigned int minorvers = NFSCTL_MINDEFAULT;
 	unsigned int minorversset = NFSCTL_MINDEFAULT;
@@ -78,8 +118,11 @@ main(int argc, char **argv)
 	unsigned int versbits = NFSCTL_VERDEFAULT;
 	unsigned int protobits = NFSCTL_PROTODEFAULT;
 	int grace = -1;
+	int listeners = 1;
 	int lease = -1;
 	int force4dot0 = 0;
+	int use_netlink;
+	struct autoscale_config autoscale;
 
 	progname = basename(argv[0]);
 	haddr = xmalloc(sizeof(char *));
@@ -94,9 +137,44 @@ main(int argc, char **argv)
 	nfssvc_get_minormask(&minormask);
 
 	count = conf_get_num("nfsd", "threads", count);
+	pool_mode = conf_get_str("nfsd", "pool-mode");
+	pool_threads = conf_get_list("nfsd", "pool-threads");
+	if (pool_threads && pool_threads->cnt) {
+		struct conf_list_node *n;
+
+		if (pool_threads->cnt > NFSD_MAXPOOLS) {
+			fprintf(stderr, "%s: too many pools in pool-threads\n",
+					progname);
+			exit(1);
+		}
+		/* with one count for every pool, this is fixed up below */
+		count = 0;
+		TAILQ_FOREACH(n, &pool_threads->fields, link) {
+			int val = strtol(n->field, &p, 10);
+
+			if (*p || val <= 0) {
+				fprintf(stderr, "%s: bad pool-threads count "
+						"\"%s\"\n", progname,
+						n->field);
+				exit(1);
+			}
+			count += val;
+		}
+	} else
+		pool_threads = NULL;
+	autoscale.min = conf_get_num("nfsd", "min-threads", 1);
+	autoscale.max = conf_get_num("nfsd", "max-threads", 0);
+	autoscale.interval = conf_get_num("nfsd", "autoscale-interval", 2);
+	autoscale.idle_time = conf_get_num("nfsd", "autoscale-idle-time", 60);
 	grace = conf_get_num("nfsd", "grace-time", grace);
 	lease = conf_get_num("nfsd", "lease-time", lease);
 	port = conf_get_str("nfsd", "port");
+	listeners = conf_get_num("nfsd", "listeners", listeners);
+	if (listeners < 1 || listeners > 64) {
+		fprintf(stderr, "%s: listeners must be between 1 and 64\n",
+				progname);
+		exit(1);
+	}
 	if (!port)
 		port = "nfs";
 	if (conf_get_bool("nfsd", "rdma", false)) {
@@ -159,6 +237,8 @@ main(int argc, char **argv)
 		}
 	}
 
+	use_netlink = conf_get_bool("nfsd", "netlink", true);
+
 	hosts = conf_get_list("nfsd", "host");
 	if (hosts && hosts->cnt) {
 		struct conf_list_node *n;
@@ -295,7 +375,21 @@ main(int argc, char **argv)
 		}
 	}
 
+	/*
+	 * The kernel opens netlink listeners itself, so it cannot bind
+	 * them to an interface or share an address between several.
+	 */
+	if (use_netlink && listeners > 1)
+		use_netlink = 0;
+	for (i = 0; use_netlink && i < hcounter; i++)
+		if (strchr(haddr[i], '@'))
+			use_netlink = 0;
+	if (use_netlink)
+		use_netlink = nfsnl_available();
+
 	if (optind < argc) {
+		/* a count on the command line wins over pool-threads */
+		pool_threads = NULL;
 		if ((count = atoi(argv[optind])) < 0) {
 			/* insane # of servers */
 			fprintf(stderr,
@@ -308,6 +402,7 @@ main(int argc, char **argv)
 			 * are coming down anyway.
 			 */
 			socket_up = 1;
+			grace = lease = -1;
 			goto set_threads;
 		}
 	}
@@ -351,6 +446,31 @@ main(int argc, char **argv)
 	/* can only change number of threads if nfsd is already up */
 	if (nfssvc_inuse()) {
 		socket_up = 1;
+		grace = lease = -1;
+		goto set_threads;
+	}
+
+	if (pool_mode)
+		nfssvc_set_pool_mode(pool_mode);
+
+	if (use_netlink) {
+		struct nfsnl_setup setup = {
+			.versbits	= versbits,
+			.minorvers	= minorvers,
+			.minorversset	= minorversset,
+			.minormask	= minormask,
+			.protobits	= protobits,
+			.hosts		= haddr,
+			.nhosts		= hcounter,
+			.port		= port,
+			.rdma_port	= rdma_port,
+		};
+
+		/* a failed listener leaves the others in place */
+		if (nfsnl_setup(&setup) == 0 || nfssvc_inuse())
+			socket_up = 1;
+		if (grace > 0)
+			nfssvc_set_nlm_grace(grace);
 		goto set_threads;
 	}
 
@@ -369,7 +489,8 @@ main(int argc, char **argv)
 
 	i = 0;
 	do {
-		error = nfssvc_set_sockets(protobits, haddr[i], port);
+		error = nfssvc_set_sockets(protobits, haddr[i], port,
+					   listeners);
 		if (!error)
 			socket_up = 1;
 	} while (++i < hcounter);
@@ -406,8 +527,30 @@ set_threads:
 	}
 	closeall(3);
 
-	if ((error = nfssvc_threads(count)) < 0)
+	/* a controller left running would start the threads again */
+	if (count == 0)
+		nfsd_autoscale_stop();
+
+	/*
+	 * The pools only exist once there are threads, so start the total
+	 * first, and then spread it.
+	 */
+	if (use_netlink)
+		error = nfsnl_threads(count, grace, lease);
+	else
+		error = nfssvc_threads(count);
+	if (error < 0)
 		xlog(L_ERROR, "error starting threads: errno %d (%m)", errno);
+	else if (pool_threads)
+		set_pool_threads(pool_threads);
+	if (error >= 0 && count > 0 && autoscale.max > 0) {
+		if (autoscale.min < 1 || autoscale.max < autoscale.min ||
+		    autoscale.interval < 1 || autoscale.idle_time < 1)
+			xlog(L_ERROR, "bad nfsd thread autoscaling settings; "
+					"not autoscaling");
+		else
+			nfsd_autoscale_start(&autoscale);
+	}
 out:
 	free(haddr);
 	return (error != 0);
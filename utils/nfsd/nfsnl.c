@@ -0,0 +1,582 @@
+/*
+ * utils/nfsd/nfsnl.c
+ *
+ * Configure nfsd through the "nfsd" generic netlink family, on kernels
+ * that have it, instead of one /proc/fs/nfsd file at a time.
+ *
+ * The versions and every listener go to the kernel as one batch of
+ * messages in a single sendmsg(), and the acknowledgements come back
+ * together.  Each message carries the whole set, which the kernel
+ * takes in place of what it had, so a write that fails half way
+ * through a list cannot leave part of it behind.  The threads are then
+ * started in one message that also carries the grace and lease times.
+ *
+ * The kernel creates the listening sockets itself, so listeners bound
+ * to an interface, or several sharing an address, are left to the
+ * /proc path.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <linux/netlink.h>
+#include <linux/genetlink.h>
+
+#include "nfslib.h"
+#include "xlog.h"
+#include "nfssvc.h"
+#include "nfsnl.h"
+
+#ifdef HAVE_LINUX_NFSD_NETLINK_H
+#include <linux/nfsd_netlink.h>
+#else
+/* from <linux/nfsd_netlink.h>, which older kernel headers lack */
+#define NFSD_FAMILY_NAME	"nfsd"
+
+enum {
+	NFSD_A_SERVER_THREADS = 1,
+	NFSD_A_SERVER_GRACETIME,
+	NFSD_A_SERVER_LEASETIME,
+};
+
+enum {
+	NFSD_A_VERSION_MAJOR = 1,
+	NFSD_A_VERSION_MINOR,
+	NFSD_A_VERSION_ENABLED,
+};
+
+enum {
+	NFSD_A_SERVER_PROTO_VERSION = 1,
+};
+
+enum {
+	NFSD_A_SOCK_ADDR = 1,
+	NFSD_A_SOCK_TRANSPORT_NAME,
+};
+
+enum {
+	NFSD_A_SERVER_SOCK_ADDR = 1,
+};
+
+enum {
+	NFSD_CMD_RPC_STATUS_GET = 1,
+	NFSD_CMD_THREADS_SET,
+	NFSD_CMD_THREADS_GET,
+	NFSD_CMD_VERSION_SET,
+	NFSD_CMD_VERSION_GET,
+	NFSD_CMD_LISTENER_SET,
+};
+#endif /* HAVE_LINUX_NFSD_NETLINK_H */
+
+#define NFSNL_BUFSIZE	16384
+#define NFSNL_MAXMSGS	4
+
+struct nfsnl_batch {
+	char		buf[NFSNL_BUFSIZE];
+	size_t		len;
+	size_t		msg;		/* offset of the message being built */
+	int		nmsgs;
+	const char	*names[NFSNL_MAXMSGS];
+	int		overflow;
+};
+
+static void *
+nfsnl_reserve(struct nfsnl_batch *b, const size_t size)
+{
+	void *p;
+
+	if (b->overflow || b->len + NLA_ALIGN(size) > sizeof(b->buf)) {
+		b->overflow = 1;
+		return NULL;
+	}
+	p = b->buf + b->len;
+	memset(p, 0, NLA_ALIGN(size));
+	b->len += NLA_ALIGN(size);
+	return p;
+}
+
+/*
+ * Start a message.  Its sequence number is its place in the batch, so
+ * that the acknowledgement can be matched to the command.
+ */
+static void
+nfsnl_begin(struct nfsnl_batch *b, const int family, const int cmd,
+	    const int flags, const char *name)
+{
+	struct nlmsghdr *nlh;
+	struct genlmsghdr *genl;
+
+	if (b->nmsgs == NFSNL_MAXMSGS) {
+		b->overflow = 1;
+		return;
+	}
+	b->msg = b->len;
+	nlh = nfsnl_reserve(b, NLMSG_HDRLEN);
+	genl = nfsnl_reserve(b, GENL_HDRLEN);
+	if (!nlh || !genl)
+		return;
+	nlh->nlmsg_type = family;
+	nlh->nlmsg_flags = flags;
+	nlh->nlmsg_seq = ++b->nmsgs;
+	genl->cmd = cmd;
+	genl->version = 1;
+	b->names[b->nmsgs - 1] = name;
+}
+
+static void
+nfsnl_end(struct nfsnl_batch *b)
+{
+	struct nlmsghdr *nlh = (struct nlmsghdr *)(b->buf + b->msg);
+
+	if (!b->overflow)
+		nlh->nlmsg_len = b->len - b->msg;
+}
+
+static void
+nfsnl_put(struct nfsnl_batch *b, const int type, const void *data,
+	  const size_t len)
+{
+	struct nlattr *nla = nfsnl_reserve(b, NLA_HDRLEN + len);
+
+	if (!nla)
+		return;
+	nla->nla_type = type;
+	nla->nla_len = NLA_HDRLEN + len;
+	if (len)
+		memcpy((char *)nla + NLA_HDRLEN, data, len);
+}
+
+static void
+nfsnl_put_u32(struct nfsnl_batch *b, const int type, const __u32 val)
+{
+	nfsnl_put(b, type, &val, sizeof(val));
+}
+
+static size_t
+nfsnl_nest_start(struct nfsnl_batch *b, const int type)
+{
+	size_t off = b->len;
+	struct nlattr *nla = nfsnl_reserve(b, NLA_HDRLEN);
+
+	if (nla)
+		nla->nla_type = type | NLA_F_NESTED;
+	return off;
+}
+
+static void
+nfsnl_nest_end(struct nfsnl_batch *b, const size_t off)
+{
+	if (!b->overflow)
+		((struct nlattr *)(b->buf + off))->nla_len = b->len - off;
+}
+
+/*
+ * Find attribute 'type' among the 'len' bytes of attributes at 'nla'.
+ */
+static const struct nlattr *
+nfsnl_find(const struct nlattr *nla, int len, const int type)
+{
+	while (len >= NLA_HDRLEN && nla->nla_len >= NLA_HDRLEN &&
+	       nla->nla_len <= len) {
+		if ((nla->nla_type & NLA_TYPE_MASK) == type)
+			return nla;
+		len -= NLA_ALIGN(nla->nla_len);
+		nla = (const struct nlattr *)((const char *)nla +
+					      NLA_ALIGN(nla->nla_len));
+	}
+	return NULL;
+}
+
+/*
+ * The kernel's reason for an error, if it gave one.
+ */
+static const char *
+nfsnl_extack(const struct nlmsghdr *nlh)
+{
+	const struct nlmsgerr *err = NLMSG_DATA(nlh);
+	const struct nlattr *nla;
+	size_t off = sizeof(*err);
+
+	if (!(nlh->nlmsg_flags & NLM_F_ACK_TLVS))
+		return NULL;
+	if (!(nlh->nlmsg_flags & NLM_F_CAPPED))
+		off += err->msg.nlmsg_len - NLMSG_HDRLEN;
+	off = NLMSG_ALIGN(off);
+	if (nlh->nlmsg_len < NLMSG_HDRLEN + off)
+		return NULL;
+	nla = nfsnl_find((const struct nlattr *)((const char *)err + off),
+			 nlh->nlmsg_len - NLMSG_HDRLEN - off,
+			 NLMSGERR_ATTR_MSG);
+	return nla ? (const char *)nla + NLA_HDRLEN : NULL;
+}
+
+static ssize_t
+nfsnl_recv(const int fd, char *buf, const size_t size)
+{
+	ssize_t n;
+
+	do {
+		n = recv(fd, buf, size, 0);
+	} while (n < 0 && errno == EINTR);
+	return n;
+}
+
+/*
+ * Send every message in the batch and wait for all of their
+ * acknowledgements.  Returns 0, or the first error the kernel gave.
+ */
+static int
+nfsnl_send(const int fd, const struct nfsnl_batch *b)
+{
+	char reply[8192];
+	struct nlmsghdr *nlh;
+	int pending = b->nmsgs, ret = 0, len;
+	ssize_t n;
+
+	if (b->overflow) {
+		xlog(L_ERROR, "nfsd netlink request is too large");
+		return E2BIG;
+	}
+	if (send(fd, b->buf, b->len, 0) != (ssize_t)b->len) {
+		xlog(L_ERROR, "unable to send to nfsd netlink: errno %d (%m)",
+				errno);
+		return errno;
+	}
+
+	while (pending > 0) {
+		n = nfsnl_recv(fd, reply, sizeof(reply));
+		if (n <= 0) {
+			ret = n < 0 ? errno : EPIPE;
+			xlog(L_ERROR, "unable to read nfsd netlink replies: "
+					"errno %d (%m)", ret);
+			break;
+		}
+		len = n;
+		for (nlh = (struct nlmsghdr *)reply; NLMSG_OK(nlh, len);
+		     nlh = NLMSG_NEXT(nlh, len)) {
+			const struct nlmsgerr *err = NLMSG_DATA(nlh);
+			const char *msg;
+
+			if (nlh->nlmsg_type != NLMSG_ERROR ||
+			    nlh->nlmsg_seq < 1 ||
+			    nlh->nlmsg_seq > (__u32)b->nmsgs)
+				continue;
+			pending--;
+			if (!err->error)
+				continue;
+			msg = nfsnl_extack(nlh);
+			xlog(L_ERROR, "nfsd netlink %s failed: %s%s%s",
+					b->names[nlh->nlmsg_seq - 1],
+					strerror(-err->error),
+					msg ? ": " : "", msg ? msg : "");
+			if (!ret)
+				ret = -err->error;
+		}
+	}
+	return ret;
+}
+
+/*
+ * Open a generic netlink socket and look up the nfsd family on it.
+ * Returns the socket, or -1 with errno set; ENOENT means the kernel
+ * has no nfsd family.
+ */
+static int
+nfsnl_connect(int *family)
+{
+	struct sockaddr_nl sa = { .nl_family = AF_NETLINK };
+	struct nfsnl_batch b = { .len = 0 };
+	char reply[8192];
+	const struct nlattr *nla;
+	struct nlmsghdr *nlh;
+	int fd, one = 1, len, err;
+	ssize_t n;
+
+	fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_GENERIC);
+	if (fd < 0)
+		return -1;
+	(void)setsockopt(fd, SOL_NETLINK, NETLINK_CAP_ACK, &one, sizeof(one));
+	(void)setsockopt(fd, SOL_NETLINK, NETLINK_EXT_ACK, &one, sizeof(one));
+	if (connect(fd, (struct sockaddr *)&sa, sizeof(sa)))
+		goto out_close;
+
+	nfsnl_begin(&b, GENL_ID_CTRL, CTRL_CMD_GETFAMILY, NLM_F_REQUEST,
+		    "getfamily");
+	nfsnl_put(&b, CTRL_ATTR_FAMILY_NAME, NFSD_FAMILY_NAME,
+		  sizeof(NFSD_FAMILY_NAME));
+	nfsnl_end(&b);
+	if (send(fd, b.buf, b.len, 0) != (ssize_t)b.len)
+		goto out_close;
+
+	n = nfsnl_recv(fd, reply, sizeof(reply));
+	if (n < 0)
+		goto out_close;
+	len = n;
+	for (nlh = (struct nlmsghdr *)reply; NLMSG_OK(nlh, len);
+	     nlh = NLMSG_NEXT(nlh, len)) {
+		if (nlh->nlmsg_type == NLMSG_ERROR) {
+			errno = -((struct nlmsgerr *)NLMSG_DATA(nlh))->error;
+			goto out_close;
+		}
+		if (nlh->nlmsg_type != GENL_ID_CTRL)
+			continue;
+		nla = nfsnl_find((const struct nlattr *)
+				 ((char *)NLMSG_DATA(nlh) + GENL_HDRLEN),
+				 nlh->nlmsg_len - NLMSG_LENGTH(GENL_HDRLEN),
+				 CTRL_ATTR_FAMILY_ID);
+		if (nla) {
+			*family = *(const __u16 *)((const char *)nla +
+						   NLA_HDRLEN);
+			return fd;
+		}
+	}
+	errno = ENOENT;
+
+out_close:
+	err = errno;
+	close(fd);
+	errno = err;
+	return -1;
+}
+
+/*
+ * Does the kernel have nfsd's netlink family?
+ */
+int
+nfsnl_available(void)
+{
+	int fd, family;
+
+	fd = nfsnl_connect(&family);
+	if (fd < 0) {
+		xlog(D_GENERAL, "nfsd netlink is not available: errno %d (%m)",
+				errno);
+		return 0;
+	}
+	close(fd);
+	return 1;
+}
+
+static void
+nfsnl_put_version(struct nfsnl_batch *b, const int major, const int minor,
+		  const int enabled)
+{
+	size_t nest = nfsnl_nest_start(b, NFSD_A_SERVER_PROTO_VERSION);
+
+	nfsnl_put_u32(b, NFSD_A_VERSION_MAJOR, major);
+	if (major == 4)
+		nfsnl_put_u32(b, NFSD_A_VERSION_MINOR, minor);
+	if (enabled)
+		nfsnl_put(b, NFSD_A_VERSION_ENABLED, NULL, 0);
+	nfsnl_nest_end(b, nest);
+}
+
+static void
+nfsnl_put_listener(struct nfsnl_batch *b, const struct sockaddr *sap,
+		   const socklen_t salen, const char *transport)
+{
+	size_t nest = nfsnl_nest_start(b, NFSD_A_SERVER_SOCK_ADDR);
+
+	nfsnl_put(b, NFSD_A_SOCK_ADDR, sap, salen);
+	nfsnl_put(b, NFSD_A_SOCK_TRANSPORT_NAME, transport,
+		  strlen(transport) + 1);
+	nfsnl_nest_end(b, nest);
+}
+
+/*
+ * Add a TCP and/or UDP listener for each address of 'host'.  Returns
+ * the number added, or -1.
+ */
+static int
+nfsnl_put_host(struct nfsnl_batch *b, const struct nfsnl_setup *setup,
+	       const char *host)
+{
+	struct addrinfo hints = { .ai_flags = AI_PASSIVE };
+	struct addrinfo *addrhead = NULL, *addr;
+	char portbuf[8];
+	int rc, count = 0;
+
+#ifdef IPV6_SUPPORTED
+	hints.ai_family = AF_UNSPEC;
+#else  /* IPV6_SUPPORTED */
+	hints.ai_family = AF_INET;
+#endif /* IPV6_SUPPORTED */
+	if (!NFSCTL_UDPISSET(setup->protobits))
+		hints.ai_protocol = IPPROTO_TCP;
+	else if (!NFSCTL_TCPISSET(setup->protobits))
+		hints.ai_protocol = IPPROTO_UDP;
+
+	rc = getaddrinfo(host, setup->port, &hints, &addrhead);
+	if (rc == EAI_NONAME && !strcmp(setup->port, "nfs")) {
+		snprintf(portbuf, sizeof(portbuf), "%d", NFS_PORT);
+		rc = getaddrinfo(host, portbuf, &hints, &addrhead);
+	}
+	if (rc != 0) {
+		xlog(L_ERROR, "unable to resolve %s:%s: %s",
+			host ? host : "ANYADDR", setup->port,
+			rc == EAI_SYSTEM ? strerror(errno) :
+				gai_strerror(rc));
+		return -1;
+	}
+
+	for (addr = addrhead; addr; addr = addr->ai_next) {
+		const char *transport;
+
+		switch (addr->ai_protocol) {
+		case IPPROTO_UDP:
+			transport = "udp";
+			break;
+		case IPPROTO_TCP:
+			transport = "tcp";
+			break;
+		default:
+			continue;
+		}
+		switch (addr->ai_addr->sa_family) {
+		case AF_INET:
+#ifdef IPV6_SUPPORTED
+		case AF_INET6:
+#endif /* IPV6_SUPPORTED */
+			break;
+		default:
+			continue;
+		}
+		nfsnl_put_listener(b, addr->ai_addr, addr->ai_addrlen,
+				   transport);
+		count++;
+	}
+	nfs_freeaddrinfo(addrhead);
+	return count;
+}
+
+/*
+ * RDMA listens on every address, as "rdma <port>" does in portlist.
+ */
+static int
+nfsnl_put_rdma(struct nfsnl_batch *b, const char *port)
+{
+	struct sockaddr_in sin = { .sin_family = AF_INET };
+#ifdef IPV6_SUPPORTED
+	struct sockaddr_in6 sin6 = { .sin6_family = AF_INET6 };
+#endif /* IPV6_SUPPORTED */
+	int nport = nfssvc_rdma_port(port);
+
+	if (nport < 0)
+		return -1;
+	sin.sin_port = htons(nport);
+	nfsnl_put_listener(b, (struct sockaddr *)&sin, sizeof(sin), "rdma");
+#ifdef IPV6_SUPPORTED
+	sin6.sin6_port = htons(nport);
+	sin6.sin6_addr = in6addr_any;
+	nfsnl_put_listener(b, (struct sockaddr *)&sin6, sizeof(sin6), "rdma");
+	return 2;
+#else  /* IPV6_SUPPORTED */
+	return 1;
+#endif /* IPV6_SUPPORTED */
+}
+
+/*
+ * Set the versions and the listeners in one batch, before any threads
+ * are started.  Returns 0, or an errno value; on an error some of the
+ * listeners may still have been created.
+ */
+int
+nfsnl_setup(const struct nfsnl_setup *setup)
+{
+	struct nfsnl_batch b = { .len = 0 };
+	unsigned int minors = setup->minormask | setup->minorversset;
+	int fd, family, listeners = 0, i, n, ret;
+
+	fd = nfsnl_connect(&family);
+	if (fd < 0)
+		return errno;
+
+	nfsnl_begin(&b, family, NFSD_CMD_VERSION_SET,
+		    NLM_F_REQUEST | NLM_F_ACK, "version-set");
+	for (n = NFSD_MINVERS; n <= ((NFSD_MAXVERS < 3) ? NFSD_MAXVERS : 3); n++)
+		nfsnl_put_version(&b, n, 0, NFSCTL_VERISSET(setup->versbits, n));
+	/* minor versions left alone from the command line stay on */
+	for (n = 0; n <= NFS4_MAXMINOR; n++) {
+		if (!NFSCTL_MINORISSET(minors, n))
+			continue;
+		nfsnl_put_version(&b, 4, n,
+			NFSCTL_VERISSET(setup->versbits, 4) &&
+			(!NFSCTL_MINORISSET(setup->minorversset, n) ||
+			 NFSCTL_MINORISSET(setup->minorvers, n)));
+	}
+	nfsnl_end(&b);
+
+	nfsnl_begin(&b, family, NFSD_CMD_LISTENER_SET,
+		    NLM_F_REQUEST | NLM_F_ACK, "listener-set");
+	if (NFSCTL_ANYPROTO(setup->protobits)) {
+		i = 0;
+		do {
+			n = nfsnl_put_host(&b, setup, setup->hosts[i]);
+			if (n > 0)
+				listeners += n;
+		} while (++i < setup->nhosts);
+	}
+	if (setup->rdma_port) {
+		n = nfsnl_put_rdma(&b, setup->rdma_port);
+		if (n > 0)
+			listeners += n;
+	}
+	nfsnl_end(&b);
+
+	if (!listeners) {
+		close(fd);
+		return EPROTOTYPE;
+	}
+	xlog(D_GENERAL, "Configuring nfsd through netlink: %d listeners",
+			listeners);
+	ret = nfsnl_send(fd, &b);
+	close(fd);
+	return ret;
+}
+
+/*
+ * Set the number of threads, with the grace and lease times (when
+ * positive) in the same message, since the kernel only takes those
+ * before the first threads start.  Returns 0, or -1 with errno set.
+ */
+int
+nfsnl_threads(const int nrservs, const int grace, const int lease)
+{
+	struct nfsnl_batch b = { .len = 0 };
+	int fd, family, ret;
+
+	fd = nfsnl_connect(&family);
+	if (fd < 0)
+		return -1;
+
+	nfsnl_begin(&b, family, NFSD_CMD_THREADS_SET,
+		    NLM_F_REQUEST | NLM_F_ACK, "threads-set");
+	nfsnl_put_u32(&b, NFSD_A_SERVER_THREADS, nrservs);
+	if (grace > 0)
+		nfsnl_put_u32(&b, NFSD_A_SERVER_GRACETIME, grace);
+	if (lease > 0)
+		nfsnl_put_u32(&b, NFSD_A_SERVER_LEASETIME, lease);
+	nfsnl_end(&b);
+
+	ret = nfsnl_send(fd, &b);
+	close(fd);
+	if (ret) {
+		errno = ret;
+		return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,29 @@
+/*
+ *   utils/nfsd/nfsnl.h -- nfsd generic netlink configuration for rpc.nfsd
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ */
+
+#ifndef _NFSD_NFSNL_H
+#define _NFSD_NFSNL_H
+
+struct nfsnl_setup {
+	unsigned int	versbits;
+	unsigned int	minorvers;
+	unsigned int	minorversset;
+	unsigned int	minormask;	/* minor versions the kernel knows */
+	unsigned int	protobits;
+	char		**hosts;	/* NULL entry for any address */
+	int		nhosts;
+	const char	*port;
+	const char	*rdma_port;	/* NULL for no RDMA listener */
+};
+
+int	nfsnl_available(void);
+int	nfsnl_setup(const struct nfsnl_setup *setup);
+int	nfsnl_threads(int nrservs, int grace, int lease);
+
+#endif /* _NFSD_NFSNL_H */
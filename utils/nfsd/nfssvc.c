@@ -34,6 +34,14 @@
 #define NFSD_PORTS_FILE   NFSD_FS_DIR "/portlist"
 #define NFSD_VERS_FILE    NFSD_FS_DIR "/versions"
 #define NFSD_THREAD_FILE  NFSD_FS_DIR "/threads"
+#define NFSD_POOL_THREADS_FILE  NFSD_FS_DIR "/pool_threads"
+
+#ifndef SYSFS_DIR
+#define SYSFS_DIR	  "/sys"
+#endif
+#define SUNRPC_POOL_MODE_FILE	SYSFS_DIR "/module/sunrpc/parameters/pool_mode"
+#define SYSFS_NODES_ONLINE	SYSFS_DIR "/devices/system/node/online"
+#define SYSFS_CPUS_ONLINE	SYSFS_DIR "/devices/system/cpu/online"
 
 /*
  * declaring a common static scratch buffer here keeps us from having to
@@ -109,11 +117,79 @@ nfssvc_inuse(void)
 	return (n > 0);
 }
 
+/*
+ * Open a socket for 'addr', ready to hand off to the kernel.  Returns
+ * the socket, or -1 with errno set.
+ */
 static int
-nfssvc_setfds(const struct addrinfo *hints, const char *node, const char *port)
+nfssvc_listen(const struct addrinfo *addr, const char *family,
+	      const char *proto, const char *iface, int reuseport)
 {
-	int fd, on = 1, fac = L_ERROR;
-	int sockfd = -1, rc = 0, bounded = 0;
+	int sockfd, on = 1, err;
+
+	sockfd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+	if (sockfd < 0) {
+		if (errno != EAFNOSUPPORT)
+			xlog(L_ERROR, "unable to create %s %s socket: "
+			     "errno %d (%m)", family, proto, errno);
+		return -1;
+	}
+
+	xlog(D_GENERAL, "Created %s %s socket.", family, proto);
+
+#ifdef IPV6_SUPPORTED
+	if (addr->ai_family == AF_INET6 &&
+	    setsockopt(sockfd, IPPROTO_IPV6, IPV6_V6ONLY, &on, sizeof(on))) {
+		xlog(L_ERROR, "unable to set IPV6_V6ONLY: "
+			"errno %d (%m)\n", errno);
+		goto error;
+	}
+#endif /* IPV6_SUPPORTED */
+	if (addr->ai_protocol == IPPROTO_TCP &&
+	    setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on))) {
+		xlog(L_ERROR, "unable to set SO_REUSEADDR on %s "
+			"socket: errno %d (%m)", family, errno);
+		goto error;
+	}
+#ifdef SO_REUSEPORT
+	if (reuseport &&
+	    setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on))) {
+		xlog(L_ERROR, "unable to set SO_REUSEPORT on %s "
+			"socket: errno %d (%m)", family, errno);
+		goto error;
+	}
+#endif /* SO_REUSEPORT */
+	if (iface && setsockopt(sockfd, SOL_SOCKET, SO_BINDTODEVICE,
+				iface, strlen(iface) + 1)) {
+		xlog(L_ERROR, "unable to bind %s %s socket to %s: "
+			"errno %d (%m)", family, proto, iface, errno);
+		goto error;
+	}
+	if (bind(sockfd, addr->ai_addr, addr->ai_addrlen)) {
+		xlog(L_ERROR, "unable to bind %s %s socket: "
+			"errno %d (%m)", family, proto, errno);
+		goto error;
+	}
+	if (addr->ai_protocol == IPPROTO_TCP && listen(sockfd, 64)) {
+		xlog(L_ERROR, "unable to create listening socket: "
+			"errno %d (%m)", errno);
+		goto error;
+	}
+	return sockfd;
+
+error:
+	err = errno;
+	close(sockfd);
+	errno = err;
+	return -1;
+}
+
+static int
+nfssvc_setfds(const struct addrinfo *hints, const char *node, const char *port,
+	      const char *iface, int listeners)
+{
+	int fd, fac = L_ERROR;
+	int sockfd = -1, rc = 0, bounded = 0, i;
 	struct addrinfo *addrhead = NULL, *addr;
 	char *proto, *family;
 
@@ -124,6 +200,14 @@ nfssvc_setfds(const struct addrinfo *hints, const char *node, const char *port)
 	if (fd < 0)
 		return 0;
 
+#ifndef SO_REUSEPORT
+	if (listeners > 1) {
+		xlog(L_WARNING, "SO_REUSEPORT is not supported; "
+				"using one socket for each address");
+		listeners = 1;
+	}
+#endif /* SO_REUSEPORT */
+
 	rc = getaddrinfo(node, port, hints, &addrhead);
 	if (rc == EAI_NONAME && !strcmp(port, "nfs")) {
 		snprintf(buf, sizeof(buf), "%d", NFS_PORT);
@@ -167,78 +251,50 @@ nfssvc_setfds(const struct addrinfo *hints, const char *node, const char *port)
 			continue;
 		}
 
-		/* open socket and prepare to hand it off to kernel */
-		sockfd = socket(addr->ai_family, addr->ai_socktype,
-				addr->ai_protocol);
-		if (sockfd < 0) {
-			if (errno != EAFNOSUPPORT) {
-				xlog(L_ERROR, "unable to create %s %s socket: "
-				     "errno %d (%m)", family, proto, errno);
+		/*
+		 * With several listeners, SO_REUSEPORT lets them share the
+		 * address, and the network stack spreads new connections and
+		 * datagrams across them, and so across the CPUs that take them.
+		 */
+		for (i = 0; i < listeners; i++) {
+			/* open socket and prepare to hand it off to kernel */
+			sockfd = nfssvc_listen(addr, family, proto, iface,
+					       listeners > 1);
+			if (sockfd < 0) {
+				if (errno == EAFNOSUPPORT)
+					break;
 				rc = errno;
 				goto error;
 			}
-			addr = addr->ai_next;
-			continue;
-		}
 
-		xlog(D_GENERAL, "Created %s %s socket.", family, proto);
+			if (fd < 0)
+				fd = open(NFSD_PORTS_FILE, O_WRONLY);
 
-#ifdef IPV6_SUPPORTED
-		if (addr->ai_family == AF_INET6 &&
-		    setsockopt(sockfd, IPPROTO_IPV6, IPV6_V6ONLY, &on, sizeof(on))) {
-			xlog(L_ERROR, "unable to set IPV6_V6ONLY: "
-				"errno %d (%m)\n", errno);
-			rc = errno;
-			goto error;
-		}
-#endif /* IPV6_SUPPORTED */
-		if (addr->ai_protocol == IPPROTO_TCP &&
-		    setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on))) {
-			xlog(L_ERROR, "unable to set SO_REUSEADDR on %s "
-				"socket: errno %d (%m)", family, errno);
-			rc = errno;
-			goto error;
-		}
-		if (bind(sockfd, addr->ai_addr, addr->ai_addrlen)) {
-			xlog(L_ERROR, "unable to bind %s %s socket: "
-				"errno %d (%m)", family, proto, errno);
-			rc = errno;
-			goto error;
-		}
-		if (addr->ai_protocol == IPPROTO_TCP && listen(sockfd, 64)) {
-			xlog(L_ERROR, "unable to create listening socket: "
-				"errno %d (%m)", errno);
-			rc = errno;
-			goto error;
-		}
-
-		if (fd < 0)
-			fd = open(NFSD_PORTS_FILE, O_WRONLY);
+			if (fd < 0) {
+				xlog(L_ERROR, "couldn't open ports file: errno "
+					      "%d (%m)", errno);
+				goto error;
+			}
 
-		if (fd < 0) {
-			xlog(L_ERROR, "couldn't open ports file: errno "
-				      "%d (%m)", errno);
-			goto error;
-		}
+			snprintf(buf, sizeof(buf), "%d\n", sockfd); 
+			if (write(fd, buf, strlen(buf)) != (ssize_t)strlen(buf)) {
+				/*
+				 * this error may be common on older kernels that don't
+				 * support IPv6, so turn into a debug message.
+				 */
+				if (errno == EAFNOSUPPORT)
+					fac = D_ALL;
+				xlog(fac, "writing fd to kernel failed: errno %d (%m)",
+					  errno);
+				rc = errno;
+				goto error;
+			}
+			bounded++;
 
-		snprintf(buf, sizeof(buf), "%d\n", sockfd); 
-		if (write(fd, buf, strlen(buf)) != (ssize_t)strlen(buf)) {
-			/*
-			 * this error may be common on older kernels that don't
-			 * support IPv6, so turn into a debug message.
-			 */
-			if (errno == EAFNOSUPPORT)
-				fac = D_ALL;
-			xlog(fac, "writing fd to kernel failed: errno %d (%m)",
-				  errno);
-			rc = errno;
-			goto error;
+			close(fd);
+			close(sockfd);
+			sockfd = fd = -1;
 		}
-		bounded++;
-
-		close(fd);
-		close(sockfd);
-		sockfd = fd = -1;
 		addr = addr->ai_next;
 	}
 error:
@@ -250,11 +306,17 @@ error:
 	return (bounded ? 0 : rc);
 }
 
+/*
+ * 'host' may be "NAME@INTERFACE" or "@INTERFACE" to take only the
+ * traffic that arrives on that interface.  Each address gets
+ * 'listeners' sockets.
+ */
 int
 nfssvc_set_sockets(const unsigned int protobits,
-		   const char *host, const char *port)
+		   const char *host, const char *port, const int listeners)
 {
 	struct addrinfo hints = { .ai_flags = AI_PASSIVE };
+	char node[NI_MAXHOST], *iface = NULL;
 
 #ifdef IPV6_SUPPORTED
 	hints.ai_family = AF_UNSPEC;
@@ -269,29 +331,51 @@ nfssvc_set_sockets(const unsigned int protobits,
 	else if (!NFSCTL_TCPISSET(protobits))
 		hints.ai_protocol = IPPROTO_UDP;
 
-	return nfssvc_setfds(&hints, host, port);
+	if (host && strchr(host, '@')) {
+		snprintf(node, sizeof(node), "%s", host);
+		iface = strchr(node, '@');
+		*iface++ = '\0';
+		if (!*iface) {
+			xlog(L_ERROR, "no interface given in \"%s\"", host);
+			return EINVAL;
+		}
+		host = node[0] ? node : NULL;
+	}
+
+	return nfssvc_setfds(&hints, host, port, iface, listeners);
 }
 
+/*
+ * Look up an RDMA port by service name or number.  Returns the port,
+ * or -1 if 'port' is neither.
+ */
 int
-nfssvc_set_rdmaport(const char *port)
+nfssvc_rdma_port(const char *port)
 {
 	struct servent *sv = getservbyname(port, "tcp");
+	char *ep;
 	int nport;
+
+	if (sv)
+		return ntohs(sv->s_port);
+	nport = strtol(port, &ep, 10);
+	if (!*port || *ep) {
+		xlog(L_ERROR, "unable to interpret port name %s", port);
+		return -1;
+	}
+	return nport;
+}
+
+int
+nfssvc_set_rdmaport(const char *port)
+{
+	int nport = nfssvc_rdma_port(port);
 	char buf[20];
 	int ret;
 	int fd;
 
-	if (sv)
-		nport = ntohs(sv->s_port);
-	else {
-		char *ep;
-		nport = strtol(port, &ep, 10);
-		if (!*port || *ep) {
-			xlog(L_ERROR, "unable to interpret port name %s",
-			     port);
-			return 1;
-		}
-	}
+	if (nport < 0)
+		return 1;
 
 	fd = open(NFSD_PORTS_FILE, O_WRONLY);
 	if (fd < 0)
@@ -306,6 +390,25 @@ nfssvc_set_rdmaport(const char *port)
 	return ret;
 }
 
+/*
+ * lockd keeps its own grace period, which nfsd's netlink interface
+ * does not reach; it is set to match nfsd's on either path.
+ */
+void
+nfssvc_set_nlm_grace(const int seconds)
+{
+	char nbuf[10];
+	int fd;
+
+	snprintf(nbuf, sizeof(nbuf), "%d", seconds);
+	fd = open("/proc/sys/fs/nfs/nlm_grace_period", O_WRONLY);
+	if (fd >= 0) {
+		if (write(fd, nbuf, strlen(nbuf)) != (ssize_t)strlen(nbuf))
+			xlog(L_ERROR, "Unable to write nlm_grace_period : %m");
+		close(fd);
+	}
+}
+
 void
 nfssvc_set_time(const char *type, const int seconds)
 {
@@ -321,15 +424,8 @@ nfssvc_set_time(const char *type, const int seconds)
 			xlog(L_ERROR, "Unable to set nfsv4%stime: %m", type);
 		close(fd);
 	}
-	if (strcmp(type, "grace") == 0) {
-		/* set same value for lockd */
-		fd = open("/proc/sys/fs/nfs/nlm_grace_period", O_WRONLY);
-		if (fd >= 0) {
-			if (write(fd, nbuf, strlen(nbuf)) != (ssize_t)strlen(nbuf))
-				xlog(L_ERROR, "Unable to write nlm_grace_period : %m");
-			close(fd);
-		}
-	}
+	if (strcmp(type, "grace") == 0)
+		nfssvc_set_nlm_grace(seconds);
 }
 
 void
@@ -436,3 +532,152 @@ nfssvc_threads(const int nrservs)
 	}
 	return -1;
 }
+
+/*
+ * Read the number of threads in each pool into 'threads'.  Returns
+ * the number of pools, or -1 if it cannot be read.
+ */
+int
+nfssvc_get_pool_threads(int *threads, const int maxpools)
+{
+	char pools[4096], *p, *end;
+	int fd, npools = 0;
+	ssize_t n;
+
+	fd = open(NFSD_POOL_THREADS_FILE, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	n = read(fd, pools, sizeof(pools) - 1);
+	close(fd);
+	if (n < 0)
+		return -1;
+	pools[n] = '\0';
+
+	p = pools;
+	while (npools < maxpools) {
+		long val = strtol(p, &end, 10);
+
+		if (end == p)
+			break;
+		threads[npools++] = val;
+		p = end;
+		if (*p == '\n')
+			break;
+	}
+	return npools;
+}
+
+int
+nfssvc_set_pool_threads(const int *threads, const int npools)
+{
+	char pools[4096];
+	size_t off = 0;
+	ssize_t n;
+	int fd, i;
+
+	for (i = 0; i < npools && off < sizeof(pools); i++)
+		off += snprintf(pools + off, sizeof(pools) - off, "%s%d",
+				i ? " " : "", threads[i]);
+	if (off >= sizeof(pools) - 1)
+		return -1;
+	pools[off++] = '\n';
+
+	fd = open(NFSD_POOL_THREADS_FILE, O_WRONLY);
+	if (fd < 0)
+		return -1;
+	n = write(fd, pools, off);
+	close(fd);
+	return n == (ssize_t)off ? 0 : -1;
+}
+
+/*
+ * Count the entries of a sysfs list such as "0-3,8-11".  Returns 0 if
+ * it cannot be read.
+ */
+static int
+nfssvc_count_online(const char *path)
+{
+	char list[1024], *p, *end;
+	int fd, count = 0;
+	ssize_t n;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return 0;
+	n = read(fd, list, sizeof(list) - 1);
+	close(fd);
+	if (n <= 0)
+		return 0;
+	list[n] = '\0';
+
+	for (p = list; *p >= '0' && *p <= '9'; p = end + 1) {
+		long first = strtol(p, &end, 10), last = first;
+
+		if (*end == '-')
+			last = strtol(end + 1, &end, 10);
+		if (last >= first)
+			count += last - first + 1;
+		if (*end != ',')
+			break;
+	}
+	return count;
+}
+
+/*
+ * Set how the kernel splits nfsd threads into pools: "global",
+ * "percpu", "pernode", or "auto" to let it choose.  This can only be
+ * changed while nfsd has no threads.  Returns 0 on success.
+ */
+int
+nfssvc_set_pool_mode(const char *mode)
+{
+	int fd, nodes, cpus;
+	char cur[32];
+	ssize_t n;
+
+	if (strcmp(mode, "auto") && strcmp(mode, "global") &&
+	    strcmp(mode, "percpu") && strcmp(mode, "pernode")) {
+		xlog(L_ERROR, "unknown pool-mode \"%s\"", mode);
+		return -1;
+	}
+
+	nodes = nfssvc_count_online(SYSFS_NODES_ONLINE);
+	cpus = nfssvc_count_online(SYSFS_CPUS_ONLINE);
+	xlog(D_GENERAL, "%d NUMA nodes and %d CPUs online", nodes, cpus);
+	if (!strcmp(mode, "pernode") && nodes == 1)
+		xlog(L_WARNING, "pool-mode=pernode on a host with one NUMA "
+				"node gives a single pool");
+	if (!strcmp(mode, "percpu") && nodes > 1)
+		xlog(L_WARNING, "pool-mode=percpu on a host with %d NUMA "
+				"nodes; pernode keeps fewer, larger pools "
+				"that are still node-local", nodes);
+
+	fd = open(SUNRPC_POOL_MODE_FILE, O_RDWR);
+	if (fd < 0) {
+		xlog(L_ERROR, "unable to open %s: errno %d (%m)",
+				SUNRPC_POOL_MODE_FILE, errno);
+		return -1;
+	}
+	n = read(fd, cur, sizeof(cur) - 1);
+	if (n > 0) {
+		cur[n] = '\0';
+		cur[strcspn(cur, "\n")] = '\0';
+		if (!strcmp(cur, mode)) {
+			close(fd);
+			return 0;
+		}
+	}
+	n = pwrite(fd, mode, strlen(mode), 0);
+	close(fd);
+	if (n != (ssize_t)strlen(mode)) {
+		if (errno == EBUSY)
+			xlog(L_ERROR, "unable to set pool-mode=%s while nfsd "
+					"is running", mode);
+		else
+			xlog(L_ERROR, "unable to set pool-mode=%s: "
+					"errno %d (%m)", mode, errno);
+		return -1;
+	}
+	xlog(D_GENERAL, "set pool mode to %s", mode);
+	return 0;
+}
@@ -23,10 +23,16 @@
 void	nfssvc_mount_nfsdfs(char *progname);
 int	nfssvc_inuse(void);
 int	nfssvc_set_sockets(const unsigned int protobits,
-			   const char *host, const char *port);
+			   const char *host, const char *port,
+			   int listeners);
 void	nfssvc_set_time(const char *type, const int seconds);
 int	nfssvc_set_rdmaport(const char *port);
+int	nfssvc_rdma_port(const char *port);
+void	nfssvc_set_nlm_grace(int seconds);
 void	nfssvc_setvers(unsigned int ctlbits, unsigned int minorvers4,
 		       unsigned int minorvers4set, int force4dot0);
 int	nfssvc_threads(int nrservs);
+int	nfssvc_get_pool_threads(int *threads, int maxpools);
+int	nfssvc_set_pool_threads(const int *threads, int npools);
+int	nfssvc_set_pool_mode(const char *mode);
 void	nfssvc_get_minormask(unsigned int *mask);
@@ -0,0 +1,71 @@
+/*
+ * backend.h -- where nfsdcld keeps its client records
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef _BACKEND_H_
+#define _BACKEND_H_
+
+#include <stddef.h>
+
+struct cld_client;
+
+/*
+ * The operations nfsdcld needs from the store of client records.  Each
+ * returns 0 on success, as the sqlite_* functions do.  Client records
+ * are changed in the store's current epoch, and a check looks in its
+ * recovery epoch; both are kept in current_epoch and recovery_epoch.
+ *
+ * cb_tick, if set, is called once the store is prepared, and then again
+ * when the number of seconds it returned have passed.
+ */
+struct cld_backend {
+	const char	*cb_name;
+	int		(*cb_prepare)(const char *topdir);
+	int		(*cb_insert_client)(const unsigned char *clname,
+					    const size_t namelen);
+	int		(*cb_insert_client_and_princhash)(
+					const unsigned char *clname,
+					const size_t namelen,
+					const unsigned char *clprinchash,
+					const size_t princhashlen);
+	int		(*cb_remove_client)(const unsigned char *clname,
+					    const size_t namelen);
+	int		(*cb_check_client)(const unsigned char *clname,
+					   const size_t namelen);
+	int		(*cb_grace_start)(void);
+	int		(*cb_grace_done)(void);
+	int		(*cb_iterate_recovery)(int (*cb)(struct cld_client *clnt),
+					       struct cld_client *clnt);
+	void		(*cb_set_group_commit)(const int enable);
+	int		(*cb_commit_pending)(void);
+	int		(*cb_commit)(void);
+	int		(*cb_checkpoint)(void);
+	int		(*cb_maintain)(void);
+	int		(*cb_threadsafe)(void);
+	int		(*cb_reclaim_lookup)(const unsigned char *clname,
+					     const size_t namelen);
+	int		(*cb_tick)(void);
+	void		(*cb_shutdown)(void);
+};
+
+extern const struct cld_backend sqlite_backend;
+extern const struct cld_backend shared_backend;
+
+void shared_set_node(const char *name, const int lease);
+
+#endif /* _BACKEND_H_ */
@@ -18,7 +18,9 @@
 #ifndef _CLD_INTERNAL_H_
 #define _CLD_INTERNAL_H_
 
-#if CLD_UPCALL_VERSION >= 2
+#if CLD_UPCALL_VERSION >= 3
+#define UPCALL_VERSION		3
+#elif CLD_UPCALL_VERSION >= 2
 #define UPCALL_VERSION		2
 #else
 #define UPCALL_VERSION		1
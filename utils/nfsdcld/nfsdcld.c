@@ -29,12 +29,21 @@
 #include <getopt.h>
 #include <signal.h>
 #include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <libgen.h>
+#include <poll.h>
+#ifdef HAVE_LIBPTHREAD
+#include <pthread.h>
+#endif
 #include <sys/inotify.h>
+#include <sys/time.h>
+#include <time.h>
+#include <stddef.h>
 #ifdef HAVE_SYS_CAPABILITY_H
 #include <sys/prctl.h>
 #include <sys/capability.h>
@@ -45,9 +54,13 @@
 #include "cld.h"
 #include "cld-internal.h"
 #include "sqlite.h"
+#include "backend.h"
 #include "version.h"
 #include "conffile.h"
 #include "legacy.h"
+#include "stats.h"
+#include "nfsmetrics.h"
+#include "nfsgrace.h"
 
 #ifndef DEFAULT_PIPEFS_DIR
 #define DEFAULT_PIPEFS_DIR NFS_STATEDIR "/rpc_pipefs"
@@ -72,6 +85,89 @@ static struct event_base *evbase;
 static bool old_kernel = false;
 static bool signal_received = false;
 
+#define CLD_COMMIT_MAX	256	/* downcalls held for one commit */
+
+union cld_upcall_msg {
+	struct cld_msg		cu_msg;
+#if UPCALL_VERSION >= 2
+	struct cld_msg_v2	cu_msg_v2;
+#endif
+};
+
+/*
+ * A successful downcall for a create, remove or check upcall tells the
+ * kernel that the client record is on stable storage.  With group
+ * commit, these downcalls are held until the record changes of the
+ * upcalls that arrived together have been committed.
+ *
+ * Where the backend allows, the commit is made by a worker thread, so that
+ * upcalls can still be read while it is in flight.  Those that need no
+ * database are answered at once.  The others are queued, and handled
+ * once the commit is done, when their changes form the next group.
+ */
+struct cld_held {
+	int			ch_error;	/* to send if the commit fails */
+	unsigned long long	ch_start;	/* when the upcall was read */
+	union cld_upcall_msg	ch_u;
+};
+
+static struct cld_held	cld_held_bufs[2][CLD_COMMIT_MAX];
+static struct cld_held	*cld_held = cld_held_bufs[0];
+static unsigned int	cld_nheld;
+static struct cld_held	*cld_inflight = cld_held_bufs[1];
+static unsigned int	cld_ninflight;
+static bool		commit_inflight;
+static union cld_upcall_msg cld_queue[CLD_COMMIT_MAX];
+static unsigned long long cld_queue_start[CLD_COMMIT_MAX];
+static unsigned int	cld_nqueued;
+#ifdef HAVE_LIBPTHREAD
+static int		commit_fds[2] = { -1, -1 };	/* ours, the worker's */
+static struct event	*commit_done_event;
+#endif
+static struct timeval	commit_start;	/* of the first held downcall */
+static struct event	*commit_event;
+static bool		group_commit = true;
+static int		commit_window;	/* ms */
+
+/* seconds between checkpoints of the write-ahead log */
+#define CLD_DEFAULT_CHECKPOINT_INTERVAL	60
+
+static struct event	*checkpoint_event;
+
+/* ms before housekeeping starts, and between its steps */
+#define CLD_MAINTAIN_DELAY	1000
+#define CLD_MAINTAIN_STEP	10
+
+static struct event	*maintain_event;
+
+/* where client records are kept */
+static const struct cld_backend *backend = &sqlite_backend;
+static struct event	*tick_event;
+
+/* seconds between writes of the statistics file */
+#define CLD_DEFAULT_STATS_INTERVAL	60
+
+static char		*stats_file;
+static struct event	*stats_event;
+
+/* when the upcall being handled was read */
+static unsigned long long upcall_start;
+
+/* records and downcalls sent for the last Cld_GraceStart */
+static unsigned int	recovery_records, recovery_downcalls;
+
+/* seconds from the last expected reclaim to ending grace, if lift_grace */
+#define CLD_DEFAULT_LIFT_DELAY	10
+
+static bool		lift_grace;
+static int		lift_grace_delay = CLD_DEFAULT_LIFT_DELAY;
+static struct event	*lift_event;
+
+#if UPCALL_VERSION >= 3
+/* records gathered for the next version 3 Cld_GraceStart downcall */
+static struct cld_msg_reclist	cld_reclist;
+#endif
+
 uint64_t current_epoch;
 uint64_t recovery_epoch;
 int first_time;
@@ -182,6 +278,17 @@ cld_pipe_open(struct cld_client *clnt)
 
 	clnt->cl_fd = fd;
 	clnt->cl_event = ev;
+
+	/* held and queued upcalls were made on the old pipe */
+	if (cld_nheld || cld_ninflight || cld_nqueued) {
+		if (cld_nheld)
+			backend->cb_commit();
+		xlog(L_WARNING, "%s: dropping %u held downcalls and %u "
+				"queued upcalls", __func__,
+				cld_nheld + cld_ninflight, cld_nqueued);
+		cld_nheld = cld_ninflight = cld_nqueued = 0;
+	}
+
 	/* event_add is done by the caller */
 	return 0;
 }
@@ -369,7 +476,7 @@ cld_check_grace_period(void)
 	if (c == 'N') {
 		xlog(L_WARNING, "nfsd is in grace but didn't send a gracestart upcall, "
 			"please update the kernel");
-		ret = sqlite_grace_start();
+		ret = backend->cb_grace_start();
 	}
 	return ret;
 }
@@ -383,6 +490,7 @@ static ssize_t cld_message_size(void *msg)
 	case 1:
 		return sizeof(struct cld_msg);
 	case 2:
+	case 3:
 		return sizeof(struct cld_msg_v2);
 	default:
 		xlog(L_FATAL, "%s invalid upcall version %d", __func__,
@@ -397,6 +505,380 @@ static ssize_t cld_message_size(void *UNUSED(msg))
 }
 #endif
 
+/*
+ * Send the @count downcalls in @held, once their client record changes
+ * are committed.  @ret is the result of the commit.
+ */
+static void
+cld_commit_send(struct cld_client *clnt, struct cld_held *held,
+		unsigned int *count, int ret)
+{
+	unsigned int i, n = *count;
+	ssize_t bsize, wsize;
+
+	if (ret)
+		xlog(L_ERROR, "%s: unable to commit client records: %d",
+				__func__, ret);
+
+	/* cld_pipe_open() drops the rest if a write fails */
+	for (i = 0; i < *count; i++) {
+#if UPCALL_VERSION >= 2
+		struct cld_msg_v2 *cmsg = &held[i].ch_u.cu_msg_v2;
+#else
+		struct cld_msg *cmsg = &held[i].ch_u.cu_msg;
+#endif
+
+		if (ret)
+			cmsg->cm_status = held[i].ch_error;
+		cld_stats_add(cmsg->cm_cmd, held[i].ch_start,
+			      cmsg->cm_status != 0);
+
+		bsize = cld_message_size(cmsg);
+		xlog(D_GENERAL, "%s: downcall with status %d", __func__,
+				cmsg->cm_status);
+		wsize = atomicio((void *)write, clnt->cl_fd, cmsg, bsize);
+		if (wsize != bsize) {
+			xlog(L_ERROR, "%s: problem writing to cld pipe (%zd): %m",
+				 __func__, wsize);
+			ret = cld_pipe_open(clnt);
+			if (ret) {
+				xlog(L_FATAL, "%s: unable to reopen pipe: %d",
+						__func__, ret);
+				exit(ret);
+			}
+			/* readd the event for the new pipe */
+			event_add(clnt->cl_event, NULL);
+		}
+	}
+	if (n > 1)
+		xlog(D_GENERAL, "Committed %u client record changes", n);
+	if (n)
+		cld_stats_group(n);
+	*count = 0;
+}
+
+/* Commit the pending client record changes, and time the commit */
+static int
+cld_commit(void)
+{
+	unsigned long long start = cld_stats_clock();
+	int ret;
+
+	ret = backend->cb_commit();
+	cld_stats_add(CSTAT_COMMIT, start, ret != 0);
+	return ret;
+}
+
+/* Commit the held downcalls' changes here, and send them */
+static void
+cld_commit_flush(struct cld_client *clnt)
+{
+	if (commit_event)
+		evtimer_del(commit_event);
+	cld_commit_send(clnt, cld_held, &cld_nheld, cld_commit());
+}
+
+static void cld_dispatch(struct cld_client *clnt);
+static void cld_commit_schedule(struct cld_client *clnt);
+
+#ifdef HAVE_LIBPTHREAD
+static void *
+cld_commit_worker(void *UNUSED(arg))
+{
+	char c;
+	int ret;
+
+	while (read(commit_fds[1], &c, 1) == 1) {
+		ret = cld_commit();
+		if (write(commit_fds[1], &ret, sizeof(ret)) != sizeof(ret))
+			break;
+	}
+	return NULL;
+}
+
+/*
+ * Send the downcalls of the commit that is done, then handle the
+ * upcalls queued meanwhile
+ */
+static void
+cld_commit_done(int UNUSED(fd), short UNUSED(which), void *data)
+{
+	struct cld_client *clnt = data;
+	unsigned int i, count;
+	int ret;
+
+	if (read(commit_fds[0], &ret, sizeof(ret)) != sizeof(ret)) {
+		xlog(L_FATAL, "%s: lost the commit worker: %m", __func__);
+		exit(1);
+	}
+	commit_inflight = false;
+	cld_commit_send(clnt, cld_inflight, &cld_ninflight, ret);
+
+	count = cld_nqueued;
+	for (i = 0; i < cld_nqueued; i++) {
+		memcpy(&clnt->cl_u, &cld_queue[i], sizeof(cld_queue[i]));
+		upcall_start = cld_queue_start[i];
+		cld_dispatch(clnt);
+	}
+	cld_nqueued = 0;
+	if (count == CLD_COMMIT_MAX)
+		event_add(clnt->cl_event, NULL);	/* reading again */
+	cld_commit_schedule(clnt);
+}
+
+/* Wait for the commit in flight */
+static void
+cld_commit_wait(struct cld_client *clnt)
+{
+	cld_commit_done(commit_fds[0], EV_READ, clnt);
+}
+
+/* Hand the held downcalls' changes to the worker thread to commit */
+static void
+cld_commit_start(struct cld_client *clnt)
+{
+	struct cld_held *held = cld_held;
+	char c = 0;
+
+	if (commit_fds[0] == -1) {
+		cld_commit_flush(clnt);
+		return;
+	}
+	if (commit_event)
+		evtimer_del(commit_event);
+
+	cld_held = cld_inflight;
+	cld_inflight = held;
+	cld_ninflight = cld_nheld;
+	cld_nheld = 0;
+	commit_inflight = true;
+	if (write(commit_fds[0], &c, 1) != 1) {
+		xlog(L_FATAL, "%s: lost the commit worker: %m", __func__);
+		exit(1);
+	}
+}
+
+/* Start the commit worker, if the backend allows commits from another thread */
+static void
+cld_commit_start_worker(struct cld_client *clnt)
+{
+	pthread_attr_t attr;
+	pthread_t thread;
+	int ret;
+
+	if (!group_commit || !backend->cb_threadsafe())
+		return;
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, commit_fds) == -1) {
+		xlog(L_WARNING, "Unable to create commit worker socket: %m");
+		return;
+	}
+	commit_done_event = event_new(evbase, commit_fds[0],
+				      EV_READ | EV_PERSIST, cld_commit_done,
+				      clnt);
+	if (commit_done_event == NULL)
+		goto out_close;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	ret = pthread_create(&thread, &attr, cld_commit_worker, NULL);
+	pthread_attr_destroy(&attr);
+	if (ret) {
+		event_free(commit_done_event);
+		commit_done_event = NULL;
+		goto out_close;
+	}
+	event_add(commit_done_event, NULL);
+	return;
+
+out_close:
+	xlog(L_WARNING, "Unable to start the commit worker");
+	close(commit_fds[0]);
+	close(commit_fds[1]);
+	commit_fds[0] = commit_fds[1] = -1;
+}
+#else
+static void
+cld_commit_start(struct cld_client *clnt)
+{
+	cld_commit_flush(clnt);
+}
+
+static void
+cld_commit_wait(struct cld_client *UNUSED(clnt))
+{
+}
+
+static void
+cld_commit_start_worker(struct cld_client *UNUSED(clnt))
+{
+}
+#endif
+
+static void
+cld_commit_timer(int UNUSED(fd), short UNUSED(which), void *data)
+{
+	cld_commit_start(data);
+}
+
+static void
+cld_checkpoint_timer(int UNUSED(fd), short UNUSED(which), void *UNUSED(data))
+{
+	if (!commit_inflight)
+		backend->cb_checkpoint();
+}
+
+static void
+cld_stats_timer(int UNUSED(fd), short UNUSED(which), void *UNUSED(data))
+{
+	cld_stats_write(stats_file);
+}
+
+/* Let the backend do its periodic work, and come back when it asks */
+static void
+cld_tick_timer(int UNUSED(fd), short UNUSED(which), void *UNUSED(data))
+{
+	struct timeval tv;
+
+	tv.tv_sec = backend->cb_tick();
+	tv.tv_usec = 0;
+	if (tv.tv_sec > 0)
+		evtimer_add(tick_event, &tv);
+}
+
+/* End the grace period, if every expected client is still back */
+static void
+cld_lift_timer(int UNUSED(fd), short UNUSED(which), void *UNUSED(data))
+{
+	if (!nfsgrace_complete())
+		return;
+	xlog(L_NOTICE, "Every client has reclaimed; ending the grace period "
+		"after %lu ms", nfsgrace_elapsed());
+	nfsgrace_lift();
+}
+
+/*
+ * A client in the recovery epoch has reclaimed.  Once all of them have,
+ * the grace period can end early, after lift_grace_delay seconds for
+ * the stragglers' remaining reclaims.
+ */
+static void
+cld_grace_reclaim(const unsigned char *id, size_t len)
+{
+	struct timeval tv;
+
+	if (!nfsgrace_reclaim(id, len) || !nfsgrace_complete())
+		return;
+	xlog(D_GENERAL, "%s: all clients reclaimed after %lu ms", __func__,
+		nfsgrace_elapsed());
+	if (lift_event == NULL)
+		return;
+	tv.tv_sec = lift_grace_delay;
+	tv.tv_usec = 0;
+	evtimer_add(lift_event, &tv);
+}
+
+static void
+cld_maintain_schedule(int ms)
+{
+	struct timeval tv;
+
+	if (maintain_event == NULL)
+		return;
+	tv.tv_sec = ms / 1000;
+	tv.tv_usec = (ms % 1000) * 1000;
+	evtimer_add(maintain_event, &tv);
+}
+
+/*
+ * Take one step of database housekeeping while no commit is waiting,
+ * and come back for the next step after the upcalls that arrived.
+ */
+static void
+cld_maintain_timer(int UNUSED(fd), short UNUSED(which), void *UNUSED(data))
+{
+	if (commit_inflight || cld_nheld) {
+		cld_maintain_schedule(CLD_MAINTAIN_DELAY);
+		return;
+	}
+	if (backend->cb_maintain())
+		cld_maintain_schedule(CLD_MAINTAIN_STEP);
+}
+
+/*
+ * Hold the downcall in @clnt's message until the client record change it
+ * reports has been committed.  @error is the status to send instead if
+ * the commit fails.
+ *
+ * Returns true if the downcall is held, or false if it is to be sent now.
+ */
+static bool
+cld_commit_hold(struct cld_client *clnt, int error)
+{
+#if UPCALL_VERSION >= 2
+	struct cld_msg_v2 *cmsg = &clnt->cl_u.cl_msg_v2;
+#else
+	struct cld_msg *cmsg = &clnt->cl_u.cl_msg;
+#endif
+
+	if (cmsg->cm_status != 0 || !backend->cb_commit_pending())
+		return false;
+
+	if (cld_nheld == CLD_COMMIT_MAX) {
+		/* this commits the change too, so send the downcall now */
+		cld_commit_flush(clnt);
+		return false;
+	}
+
+	if (cld_nheld == 0)
+		gettimeofday(&commit_start, NULL);
+	memcpy(&cld_held[cld_nheld].ch_u, cmsg, cld_message_size(cmsg));
+	cld_held[cld_nheld].ch_error = error;
+	cld_held[cld_nheld].ch_start = upcall_start;
+	cld_nheld++;
+	return true;
+}
+
+/*
+ * Commit once no more upcalls are waiting on the pipe and commit_window
+ * milliseconds have passed since the first held downcall, or when there
+ * is no room to hold more
+ */
+static void
+cld_commit_schedule(struct cld_client *clnt)
+{
+	struct pollfd pfd;
+	struct timeval now, tv;
+	long age;
+
+	if (commit_inflight)
+		return;
+
+	if (cld_nheld == 0) {
+		/* e.g. a change whose own downcall reported a failure */
+		if (backend->cb_commit_pending())
+			cld_commit();
+		return;
+	}
+
+	if (cld_nheld < CLD_COMMIT_MAX) {
+		pfd.fd = clnt->cl_fd;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLIN))
+			return;		/* the next upcall joins this commit */
+
+		gettimeofday(&now, NULL);
+		age = (now.tv_sec - commit_start.tv_sec) * 1000 +
+			(now.tv_usec - commit_start.tv_usec) / 1000;
+		if (age < commit_window) {
+			tv.tv_sec = (commit_window - age) / 1000;
+			tv.tv_usec = ((commit_window - age) % 1000) * 1000;
+			evtimer_add(commit_event, &tv);
+			return;
+		}
+	}
+	cld_commit_start(clnt);
+}
+
 static void
 cld_not_implemented(struct cld_client *clnt)
 {
@@ -440,6 +922,7 @@ cld_get_version(struct cld_client *clnt)
 
 	xlog(D_GENERAL, "%s: version = %u.", __func__, UPCALL_VERSION);
 
+	/* the kernel uses the lower of this and the latest it supports */
 	cmsg->cm_u.cm_version = UPCALL_VERSION;
 	cmsg->cm_status = 0;
 
@@ -477,21 +960,26 @@ cld_create(struct cld_client *clnt)
 
 #if UPCALL_VERSION >= 2
 	if (cmsg->cm_vers >= 2)
-		ret = sqlite_insert_client_and_princhash(
+		ret = backend->cb_insert_client_and_princhash(
 					cmsg->cm_u.cm_clntinfo.cc_name.cn_id,
 					cmsg->cm_u.cm_clntinfo.cc_name.cn_len,
 					cmsg->cm_u.cm_clntinfo.cc_princhash.cp_data,
 					cmsg->cm_u.cm_clntinfo.cc_princhash.cp_len);
 	else
-		ret = sqlite_insert_client(cmsg->cm_u.cm_name.cn_id,
+		ret = backend->cb_insert_client(cmsg->cm_u.cm_name.cn_id,
 					   cmsg->cm_u.cm_name.cn_len);
 #else
-	ret = sqlite_insert_client(cmsg->cm_u.cm_name.cn_id,
+	ret = backend->cb_insert_client(cmsg->cm_u.cm_name.cn_id,
 				   cmsg->cm_u.cm_name.cn_len);
 #endif
+	if (!ret && recovery_epoch != 0)
+		cld_grace_reclaim(cmsg->cm_u.cm_name.cn_id,
+				  cmsg->cm_u.cm_name.cn_len);
 
 reply:
 	cmsg->cm_status = ret ? -EREMOTEIO : ret;
+	if (group_commit && cld_commit_hold(clnt, -EREMOTEIO))
+		return;
 
 	bsize = cld_message_size(cmsg);
 	xlog(D_GENERAL, "Doing downcall with status %d", cmsg->cm_status);
@@ -525,11 +1013,13 @@ cld_remove(struct cld_client *clnt)
 
 	xlog(D_GENERAL, "%s: remove client record.", __func__);
 
-	ret = sqlite_remove_client(cmsg->cm_u.cm_name.cn_id,
+	ret = backend->cb_remove_client(cmsg->cm_u.cm_name.cn_id,
 				   cmsg->cm_u.cm_name.cn_len);
 
 reply:
 	cmsg->cm_status = ret ? -EREMOTEIO : ret;
+	if (group_commit && cld_commit_hold(clnt, -EREMOTEIO))
+		return;
 
 	bsize = cld_message_size(cmsg);
 	xlog(D_GENERAL, "%s: downcall with status %d", __func__,
@@ -561,25 +1051,27 @@ cld_check(struct cld_client *clnt)
 	/*
 	 * If we get a check upcall at all, it means we're talking to an old
 	 * kernel.  Furthermore, if we're not in grace it means this is the
-	 * first client to do a reclaim.  Log a message and use
-	 * sqlite_grace_start() to advance the epoch numbers.
+	 * first client to do a reclaim.  Log a message and start a grace
+	 * period to advance the epoch numbers.
 	 */
 	if (recovery_epoch == 0) {
 		xlog(D_GENERAL, "%s: received a check upcall, please update the kernel",
 			__func__);
-		ret = sqlite_grace_start();
+		ret = backend->cb_grace_start();
 		if (ret)
 			goto reply;
 	}
 
 	xlog(D_GENERAL, "%s: check client record", __func__);
 
-	ret = sqlite_check_client(cmsg->cm_u.cm_name.cn_id,
+	ret = backend->cb_check_client(cmsg->cm_u.cm_name.cn_id,
 				  cmsg->cm_u.cm_name.cn_len);
 
 reply:
 	/* set up reply */
 	cmsg->cm_status = ret ? -EACCES : ret;
+	if (group_commit && cld_commit_hold(clnt, -EACCES))
+		return;
 
 	bsize = cld_message_size(cmsg);
 	xlog(D_GENERAL, "%s: downcall with status %d", __func__,
@@ -612,21 +1104,26 @@ cld_gracedone(struct cld_client *clnt)
 	 * If we got a "gracedone" upcall while we're not in grace, then
 	 * 1) we must be talking to an old kernel
 	 * 2) no clients attempted to reclaim
-	 * In that case, log a message and use sqlite_grace_start() to
-	 * advance the epoch numbers, and then proceed as normal.
+	 * In that case, log a message and start a grace period to advance
+	 * the epoch numbers, and then proceed as normal.
 	 */
 	if (recovery_epoch == 0) {
 		xlog(D_GENERAL, "%s: received gracedone upcall "
 			"while not in grace, please update the kernel",
 			__func__);
-		ret = sqlite_grace_start();
+		ret = backend->cb_grace_start();
 		if (ret)
 			goto reply;
 	}
 
 	xlog(D_GENERAL, "%s: grace done.", __func__);
 
-	ret = sqlite_grace_done();
+	ret = backend->cb_grace_done();
+	if (!ret)
+		cld_maintain_schedule(CLD_MAINTAIN_DELAY);
+	if (lift_event)
+		evtimer_del(lift_event);
+	nfsgrace_end();
 
 	if (first_time) {
 		if (num_cltrack_records > 0)
@@ -673,14 +1170,85 @@ gracestart_callback(struct cld_client *clnt) {
 	wsize = atomicio((void *)write, clnt->cl_fd, cmsg, bsize);
 	if (wsize != bsize)
 		return -EIO;
+	nfsgrace_expect(cmsg->cm_u.cm_name.cn_id, cmsg->cm_u.cm_name.cn_len);
+	recovery_records++;
+	recovery_downcalls++;
+	return 0;
+}
+
+#if UPCALL_VERSION >= 3
+/* Send the records gathered by gracestart_batch_callback() */
+static int
+cld_reclist_flush(struct cld_client *clnt)
+{
+	struct cld_reclist *rl = &cld_reclist.cm_reclist;
+	ssize_t bsize, wsize;
+	unsigned int count = rl->cr_count;
+
+	if (count == 0)
+		return 0;
+
+	bsize = offsetof(struct cld_msg_reclist, cm_reclist.cr_data) +
+		rl->cr_len;
+	xlog(D_GENERAL, "Sending %u clients", count);
+	wsize = atomicio((void *)write, clnt->cl_fd, &cld_reclist, bsize);
+	rl->cr_count = 0;
+	rl->cr_len = 0;
+	if (wsize != bsize)
+		return -EIO;
+	recovery_records += count;
+	recovery_downcalls++;
 	return 0;
 }
 
+/* Add the record in @clnt's message to the next downcall */
+static int
+gracestart_batch_callback(struct cld_client *clnt)
+{
+	struct cld_msg_v2 *cmsg = &clnt->cl_u.cl_msg_v2;
+	struct cld_name *name = &cmsg->cm_u.cm_clntinfo.cc_name;
+	struct cld_princhash *princ = &cmsg->cm_u.cm_clntinfo.cc_princhash;
+	struct cld_reclist *rl = &cld_reclist.cm_reclist;
+	unsigned char *p;
+	size_t len;
+	int ret;
+
+	len = sizeof(name->cn_len) + name->cn_len +
+		sizeof(princ->cp_len) + princ->cp_len;
+	if (rl->cr_len + len > sizeof(rl->cr_data)) {
+		ret = cld_reclist_flush(clnt);
+		if (ret)
+			return ret;
+	}
+
+	if (rl->cr_count == 0) {
+		cld_reclist.cm_vers = cmsg->cm_vers;
+		cld_reclist.cm_cmd = cmsg->cm_cmd;
+		cld_reclist.cm_status = -EINPROGRESS;
+		cld_reclist.cm_xid = cmsg->cm_xid;
+	}
+
+	p = rl->cr_data + rl->cr_len;
+	memcpy(p, &name->cn_len, sizeof(name->cn_len));
+	p += sizeof(name->cn_len);
+	memcpy(p, name->cn_id, name->cn_len);
+	p += name->cn_len;
+	*p++ = princ->cp_len;
+	memcpy(p, princ->cp_data, princ->cp_len);
+
+	rl->cr_len += len;
+	rl->cr_count++;
+	nfsgrace_expect(name->cn_id, name->cn_len);
+	return 0;
+}
+#endif
+
 static void
 cld_gracestart(struct cld_client *clnt)
 {
 	int ret;
 	ssize_t bsize, wsize;
+	struct timespec start, end;
 #if UPCALL_VERSION >= 2
 	struct cld_msg_v2 *cmsg = &clnt->cl_u.cl_msg_v2;
 #else
@@ -689,13 +1257,32 @@ cld_gracestart(struct cld_client *clnt)
 
 	xlog(D_GENERAL, "%s: updating grace epochs", __func__);
 
-	ret = sqlite_grace_start();
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	recovery_records = recovery_downcalls = 0;
+	nfsgrace_start();
+
+	ret = backend->cb_grace_start();
 	if (ret)
 		goto reply;
 
 	xlog(D_GENERAL, "%s: sending client records to the kernel", __func__);
 
-	ret = sqlite_iterate_recovery(&gracestart_callback, clnt);
+	/*
+	 * A kernel that cannot take lists of records makes its upcalls
+	 * with the version it supports, even though cld_get_version()
+	 * offers a later one.
+	 */
+#if UPCALL_VERSION >= 3
+	if (cmsg->cm_vers >= 3) {
+		cld_reclist.cm_reclist.cr_count = 0;
+		cld_reclist.cm_reclist.cr_len = 0;
+		ret = backend->cb_iterate_recovery(&gracestart_batch_callback,
+						   clnt);
+		if (!ret)
+			ret = cld_reclist_flush(clnt);
+	} else
+#endif
+		ret = backend->cb_iterate_recovery(&gracestart_callback, clnt);
 
 reply:
 	/* set up reply: downcall with 0 status */
@@ -714,35 +1301,54 @@ reply:
 			exit(ret);
 		}
 	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	xlog(L_NOTICE, "Grace start took %ld ms: %u client records sent in "
+			"%u downcalls",
+			(long)(end.tv_sec - start.tv_sec) * 1000 +
+			(end.tv_nsec - start.tv_nsec) / 1000000,
+			recovery_records, recovery_downcalls);
+	nfsgrace_publish();
 }
 
-static void
-cldcb(int UNUSED(fd), short which, void *data)
+/*
+ * Can the upcall in @clnt be answered while a commit is in flight?  Only
+ * those that need no database can: version queries, and checks of clients
+ * that are not in the recovery epoch.
+ */
+static bool
+cld_answer_now(struct cld_client *clnt)
 {
-	ssize_t len;
-	struct cld_client *clnt = data;
 #if UPCALL_VERSION >= 2
 	struct cld_msg_v2 *cmsg = &clnt->cl_u.cl_msg_v2;
 #else
 	struct cld_msg *cmsg = &clnt->cl_u.cl_msg;
 #endif
 
-	if (which != EV_READ)
-		goto out;
-
-	len = atomicio(read, clnt->cl_fd, cmsg, sizeof(*cmsg));
-	if (len <= 0) {
-		xlog(L_ERROR, "%s: pipe read failed: %m", __func__);
-		cld_pipe_open(clnt);
-		goto out;
+	switch (cmsg->cm_cmd) {
+	case Cld_Create:
+	case Cld_Remove:
+	case Cld_GraceDone:
+	case Cld_GraceStart:
+		return false;
+	case Cld_Check:
+		return backend->cb_reclaim_lookup(cmsg->cm_u.cm_name.cn_id,
+						  cmsg->cm_u.cm_name.cn_len) == 0;
+	default:
+		return true;
 	}
+}
 
-	if (cmsg->cm_vers > UPCALL_VERSION) {
-		xlog(L_ERROR, "%s: unsupported upcall version: %hu",
-				__func__, cmsg->cm_vers);
-		cld_pipe_open(clnt);
-		goto out;
-	}
+static void
+cld_dispatch(struct cld_client *clnt)
+{
+#if UPCALL_VERSION >= 2
+	struct cld_msg_v2 *cmsg = &clnt->cl_u.cl_msg_v2;
+#else
+	struct cld_msg *cmsg = &clnt->cl_u.cl_msg;
+#endif
+	unsigned int held = cld_nheld;
+	unsigned char cmd = cmsg->cm_cmd;
 
 	switch(cmsg->cm_cmd) {
 	case Cld_Create:
@@ -768,8 +1374,55 @@ cldcb(int UNUSED(fd), short which, void *data)
 				__func__, cmsg->cm_cmd);
 		cld_not_implemented(clnt);
 	}
+
+	/* a held downcall is counted when it is sent */
+	if (cld_nheld <= held && cmd <= CSTAT_GETVERSION)
+		cld_stats_add(cmd, upcall_start, cmsg->cm_status != 0);
+	cld_stats_grace(recovery_epoch != 0);
+}
+
+static void
+cldcb(int UNUSED(fd), short which, void *data)
+{
+	ssize_t len;
+	struct cld_client *clnt = data;
+#if UPCALL_VERSION >= 2
+	struct cld_msg_v2 *cmsg = &clnt->cl_u.cl_msg_v2;
+#else
+	struct cld_msg *cmsg = &clnt->cl_u.cl_msg;
+#endif
+
+	if (which != EV_READ)
+		goto out;
+
+	len = atomicio(read, clnt->cl_fd, cmsg, sizeof(*cmsg));
+	upcall_start = cld_stats_clock();
+	if (len <= 0) {
+		xlog(L_ERROR, "%s: pipe read failed: %m", __func__);
+		cld_pipe_open(clnt);
+		goto out;
+	}
+
+	if (cmsg->cm_vers > UPCALL_VERSION) {
+		xlog(L_ERROR, "%s: unsupported upcall version: %hu",
+				__func__, cmsg->cm_vers);
+		cld_pipe_open(clnt);
+		goto out;
+	}
+
+	if (commit_inflight && !cld_answer_now(clnt)) {
+		cld_queue_start[cld_nqueued] = upcall_start;
+		memcpy(&cld_queue[cld_nqueued++], cmsg, sizeof(*cmsg));
+		cld_stats_queued(cld_nqueued);
+		/* once the queue is full, read again when the commit is done */
+		if (cld_nqueued == CLD_COMMIT_MAX)
+			return;
+		goto out;
+	}
+	cld_dispatch(clnt);
 out:
 	event_add(clnt->cl_event, NULL);
+	cld_commit_schedule(clnt);
 }
 
 int
@@ -782,6 +1435,9 @@ main(int argc, char **argv)
 	char *storagedir = CLD_DEFAULT_STORAGEDIR;
 	struct cld_client clnt;
 	char *s;
+	bool journal_wal = false, sync_normal = false;
+	int checkpoint_interval, stats_interval;
+	struct timeval tv;
 	first_time = 0;
 	num_cltrack_records = 0;
 	num_legacy_records = 0;
@@ -812,6 +1468,45 @@ main(int argc, char **argv)
 	rc = conf_get_num("nfsdcld", "debug", 0);
 	if (rc > 0)
 		xlog_config(D_ALL, 1);
+	group_commit = conf_get_bool("nfsdcld", "group-commit", true);
+	commit_window = conf_get_num("nfsdcld", "commit-window", 0);
+	if (commit_window < 0)
+		commit_window = 0;
+	s = conf_get_str("nfsdcld", "journal-mode");
+	if (s && strcasecmp(s, "wal") == 0)
+		journal_wal = true;
+	else if (s && strcasecmp(s, "delete") != 0)
+		xlog(L_WARNING, "Unknown journal-mode \"%s\", using delete", s);
+	s = conf_get_str("nfsdcld", "synchronous");
+	if (s && strcasecmp(s, "normal") == 0)
+		sync_normal = true;
+	else if (s && strcasecmp(s, "full") != 0)
+		xlog(L_WARNING, "Unknown synchronous level \"%s\", using full",
+				s);
+	checkpoint_interval = conf_get_num("nfsdcld", "checkpoint-interval",
+					   CLD_DEFAULT_CHECKPOINT_INTERVAL);
+	stats_file = conf_get_str("nfsdcld", "stats-file");
+	stats_interval = conf_get_num("nfsdcld", "stats-interval",
+				      CLD_DEFAULT_STATS_INTERVAL);
+	if (stats_interval < 1)
+		stats_interval = 1;
+	s = conf_get_str("nfsdcld", "backend");
+	if (s && strcasecmp(s, "shared") == 0)
+		backend = &shared_backend;
+	else if (s && strcasecmp(s, "sqlite") != 0)
+		xlog(L_WARNING, "Unknown backend \"%s\", using sqlite", s);
+	shared_set_node(conf_get_str("nfsdcld", "node-name"),
+			conf_get_num("nfsdcld", "node-lease", 0));
+	lift_grace = conf_get_bool("nfsdcld", "lift-grace", false);
+	lift_grace_delay = conf_get_num("nfsdcld", "lift-grace-delay",
+					CLD_DEFAULT_LIFT_DELAY);
+	if (lift_grace_delay < 0)
+		lift_grace_delay = 0;
+	/* The other nodes' clients may not have reclaimed yet */
+	if (lift_grace && backend == &shared_backend) {
+		xlog(L_WARNING, "lift-grace is ignored with the shared backend");
+		lift_grace = false;
+	}
 
 	/* process command-line options */
 	while ((arg = getopt_long(argc, argv, "hdFp:s:", longopts,
@@ -849,6 +1544,8 @@ main(int argc, char **argv)
 			goto out;
 		}
 	}
+	nfsmetrics_start("nfsdcld");
+	nfsgrace_open("nfsd", NFSD_END_GRACE_FILE);
 
 	/* drop all capabilities */
 	rc = cld_set_caps();
@@ -885,17 +1582,88 @@ main(int argc, char **argv)
 		old_kernel = true;
 
 	/* set up storage db */
-	rc = sqlite_prepare_dbh(storagedir);
+	sqlite_set_journal(journal_wal, sync_normal);
+	rc = backend->cb_prepare(storagedir);
 	if (rc) {
-		xlog(L_ERROR, "Failed to open main database: %d", rc);
+		xlog(L_ERROR, "Failed to open %s client records: %d",
+				backend->cb_name, rc);
 		goto out;
 	}
+	backend->cb_set_group_commit(group_commit);
 
 	/* set up event handler */
 	rc = cld_pipe_init(&clnt);
 	if (rc)
 		goto out;
 
+	commit_event = evtimer_new(evbase, cld_commit_timer, &clnt);
+	if (commit_event == NULL) {
+		xlog(L_ERROR, "%s: failed to create commit timer", __func__);
+		rc = -ENOMEM;
+		goto out;
+	}
+	cld_commit_start_worker(&clnt);
+
+	if (journal_wal && checkpoint_interval > 0) {
+		checkpoint_event = event_new(evbase, -1, EV_PERSIST,
+					     cld_checkpoint_timer, NULL);
+		if (checkpoint_event == NULL) {
+			xlog(L_ERROR, "%s: failed to create checkpoint timer",
+					__func__);
+			rc = -ENOMEM;
+			goto out;
+		}
+		tv.tv_sec = checkpoint_interval;
+		tv.tv_usec = 0;
+		evtimer_add(checkpoint_event, &tv);
+	}
+
+	maintain_event = evtimer_new(evbase, cld_maintain_timer, NULL);
+	if (maintain_event == NULL) {
+		xlog(L_ERROR, "%s: failed to create housekeeping timer",
+				__func__);
+		rc = -ENOMEM;
+		goto out;
+	}
+	cld_maintain_schedule(CLD_MAINTAIN_DELAY);
+
+	if (lift_grace) {
+		lift_event = evtimer_new(evbase, cld_lift_timer, NULL);
+		if (lift_event == NULL) {
+			xlog(L_ERROR, "%s: failed to create grace timer",
+					__func__);
+			rc = -ENOMEM;
+			goto out;
+		}
+	}
+
+	if (backend->cb_tick) {
+		tick_event = evtimer_new(evbase, cld_tick_timer, NULL);
+		if (tick_event == NULL) {
+			xlog(L_ERROR, "%s: failed to create backend timer",
+					__func__);
+			rc = -ENOMEM;
+			goto out;
+		}
+		cld_tick_timer(-1, 0, NULL);
+	}
+
+	if (stats_file && *stats_file) {
+		stats_event = event_new(evbase, -1, EV_PERSIST,
+					cld_stats_timer, NULL);
+		if (stats_event == NULL) {
+			xlog(L_ERROR, "%s: failed to create statistics timer",
+					__func__);
+			rc = -ENOMEM;
+			goto out;
+		}
+		cld_stats_grace(recovery_epoch != 0);
+		cld_stats_write(stats_file);
+		tv.tv_sec = stats_interval;
+		tv.tv_usec = 0;
+		evtimer_add(stats_event, &tv);
+	}
+
 	signal(SIGINT, sig_die);
 	signal(SIGTERM, sig_die);
 
@@ -903,8 +1671,26 @@ main(int argc, char **argv)
 	rc = event_base_dispatch(evbase);
 	if (rc < 0)
 		xlog(L_ERROR, "%s: event_dispatch failed: %m", __func__);
+	while (commit_inflight)
+		cld_commit_wait(&clnt);
+	if (cld_nheld)
+		cld_commit_flush(&clnt);
 
 out:
+	if (commit_event)
+		event_free(commit_event);
+	if (checkpoint_event)
+		event_free(checkpoint_event);
+	if (maintain_event)
+		event_free(maintain_event);
+	if (tick_event)
+		event_free(tick_event);
+	if (lift_event)
+		event_free(lift_event);
+	if (stats_event) {
+		cld_stats_write(stats_file);
+		event_free(stats_event);
+	}
 	if (clnt.cl_event)
 		event_free(clnt.cl_event);
 	if (clnt.cl_fd != -1)
@@ -915,7 +1701,7 @@ out:
 		close(inotify_fd);
 
 	event_base_free(evbase);
-	sqlite_shutdown();
+	backend->cb_shutdown();
 
 	free(progname);
 	return rc;
@@ -0,0 +1,1273 @@
+/*
+ * shared.c -- client records kept on storage shared by a cluster
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+/*
+ * When several servers export one namespace, each runs an nfsdcld that
+ * keeps its client records in the same directory, on storage they all
+ * mount.  A client can then reclaim its state on whichever of them it
+ * reaches after a failover.  The directory holds:
+ *
+ * cluster/grace	the cluster's epochs: "<current> <recovery>"
+ * cluster/grace.lock	locked while the epochs are changed
+ * cluster/nodes/<node>	"<epoch> grace|done <time>", renewed by <node>
+ *			every third of its lease
+ * cluster/log/<node>	the records <node> has written, one per line:
+ *			"+ <epoch> <stamp> <owner> <id> <princhash>|-" or
+ *			"- <epoch> <stamp> <owner> <id>"
+ *
+ * Only <node> writes its log, by appending to it, so it needs no lock.
+ * Each node reads the logs of the others into a hash table, and looks
+ * up reclaims there.  Where two nodes wrote a record for the same client
+ * and epoch, the one with the later stamp, a time in microseconds, wins.
+ *
+ * A node whose server starts a grace period starts one for the cluster,
+ * or joins the one in progress.  The other nodes then copy the records
+ * of their clients into the new current epoch.  The recovery epoch is
+ * cleared once every live node has done so and has ended its own grace
+ * period; the records of nodes whose lease has run out are copied then,
+ * by the node that clears it, so they can still be reclaimed when those
+ * nodes come back, or by clients that fail over.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#include <dirent.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <limits.h>
+#include <inttypes.h>
+#include <time.h>
+
+#include "xlog.h"
+#include "nfslib.h"
+#include "cld.h"
+#include "cld-internal.h"
+#include "backend.h"
+
+#define SHARED_NAME_MAX		64
+#define SHARED_DEFAULT_LEASE	90	/* seconds */
+#define SHARED_HASH_INIT	256	/* initial buckets, a power of 2 */
+#define SHARED_LINE_MAX		(32 + 2 * NFS4_OPAQUE_LIMIT + \
+				 2 * SHA256_DIGEST_SIZE + SHARED_NAME_MAX)
+
+struct shared_node {
+	struct shared_node	*sn_next;
+	char			sn_name[SHARED_NAME_MAX + 1];
+	ino_t			sn_ino;		/* of its log */
+	off_t			sn_offset;	/* of the log read so far */
+	uint64_t		sn_epoch;	/* from its node file */
+	int			sn_grace;
+	time_t			sn_renewed;
+};
+
+struct shared_rec {
+	struct shared_rec	*sr_next;
+	struct shared_node	*sr_owner;
+	uint64_t		sr_epoch;
+	uint64_t		sr_stamp;
+	uint32_t		sr_hash;
+	uint16_t		sr_idlen;
+	uint16_t		sr_princlen;
+	bool			sr_present;
+	bool			sr_ours;	/* last written to our log */
+	unsigned char		sr_data[];	/* id, then princhash */
+};
+
+static char shared_dir[PATH_MAX];
+static char node_name[SHARED_NAME_MAX + 1];
+static int node_lease = SHARED_DEFAULT_LEASE;
+static struct shared_node *nodes, *self;
+static bool node_grace;		/* our server is in grace */
+
+/* the epochs in cluster/grace, when last read */
+static uint64_t cluster_current, cluster_recovery;
+
+static struct shared_rec **rec_table;
+static unsigned int rec_size, rec_count;
+
+/* our log, the records not yet written to it, and how many it holds */
+static int log_fd = -1;
+static char *pending;
+static size_t pending_len, pending_size;
+static unsigned int log_records;
+static int group_commit;
+
+static uint64_t last_stamp;
+static time_t last_refresh;
+
+static int shared_commit(void);
+
+void
+shared_set_node(const char *name, const int lease)
+{
+	if (name)
+		strlcpy(node_name, name, sizeof(node_name));
+	if (lease > 0)
+		node_lease = lease;
+}
+
+static int __attribute__((format(printf, 2, 3)))
+shared_path(char *path, const char *fmt, ...)
+{
+	va_list args;
+	int ret;
+
+	ret = snprintf(path, PATH_MAX, "%s/", shared_dir);
+	if (ret > 0 && ret < PATH_MAX) {
+		va_start(args, fmt);
+		ret += vsnprintf(path + ret, PATH_MAX - ret, fmt, args);
+		va_end(args);
+	}
+	if (ret < 0 || ret >= PATH_MAX) {
+		xlog(L_ERROR, "%s: path too long", __func__);
+		return -ENAMETOOLONG;
+	}
+	return 0;
+}
+
+static int
+shared_mkdir(const char *dirname)
+{
+	struct stat statbuf;
+
+	if (mkdir(dirname, S_IRWXU) && errno != EEXIST)
+		return -errno;
+	if (stat(dirname, &statbuf))
+		return -errno;
+	return S_ISDIR(statbuf.st_mode) ? 0 : -ENOTDIR;
+}
+
+/* Replace the file at @path with @text, on stable storage */
+static int
+shared_write_file(const char *path, const char *text)
+{
+	char tmp[PATH_MAX];
+	size_t len = strlen(text);
+	int fd, ret = 0;
+
+	if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp))
+		return -ENAMETOOLONG;
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0)
+		return -errno;
+	if (write(fd, text, len) != (ssize_t)len || fsync(fd))
+		ret = errno ? -errno : -EIO;
+	if (close(fd) && !ret)
+		ret = -errno;
+	if (!ret && rename(tmp, path))
+		ret = -errno;
+	if (ret) {
+		xlog(L_ERROR, "%s: unable to write %s: %s", __func__, path,
+				strerror(-ret));
+		unlink(tmp);
+	}
+	return ret;
+}
+
+static int
+shared_read_file(const char *path, char *text, size_t size)
+{
+	ssize_t len;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -errno;
+	len = read(fd, text, size - 1);
+	close(fd);
+	if (len < 0)
+		return -errno;
+	text[len] = '\0';
+	return 0;
+}
+
+/* Take the lock that is held while the cluster's epochs change */
+static int
+shared_lock(void)
+{
+	struct flock fl = { .l_type = F_WRLCK, .l_whence = SEEK_SET };
+	char path[PATH_MAX];
+	int fd;
+
+	if (shared_path(path, "%s", "grace.lock"))
+		return -1;
+	fd = open(path, O_RDWR | O_CREAT, 0600);
+	if (fd < 0) {
+		xlog(L_ERROR, "%s: unable to open %s: %m", __func__, path);
+		return -1;
+	}
+	while (fcntl(fd, F_SETLKW, &fl) == -1) {
+		if (errno == EINTR)
+			continue;
+		xlog(L_ERROR, "%s: unable to lock %s: %m", __func__, path);
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static void
+shared_unlock(int fd)
+{
+	close(fd);
+}
+
+static int
+shared_read_grace(void)
+{
+	char path[PATH_MAX], text[64];
+	uint64_t cur, rec;
+	int ret;
+
+	ret = shared_path(path, "%s", "grace");
+	if (ret)
+		return ret;
+	ret = shared_read_file(path, text, sizeof(text));
+	if (ret)
+		return ret;
+	if (sscanf(text, "%" SCNu64 " %" SCNu64, &cur, &rec) != 2 ||
+	    cur == 0 || rec >= cur) {
+		xlog(L_ERROR, "%s: %s is corrupt", __func__, path);
+		return -EINVAL;
+	}
+	cluster_current = cur;
+	cluster_recovery = rec;
+	return 0;
+}
+
+/* Set the cluster's epochs.  The caller holds the lock. */
+static int
+shared_write_grace(uint64_t cur, uint64_t rec)
+{
+	char path[PATH_MAX], text[64];
+	int ret;
+
+	ret = shared_path(path, "%s", "grace");
+	if (ret)
+		return ret;
+	snprintf(text, sizeof(text), "%" PRIu64 " %" PRIu64 "\n", cur, rec);
+	ret = shared_write_file(path, text);
+	if (ret)
+		return ret;
+	cluster_current = cur;
+	cluster_recovery = rec;
+	return 0;
+}
+
+/* Renew our lease, and say which epoch we are at */
+static int
+shared_write_node(void)
+{
+	char path[PATH_MAX], text[96];
+	int ret;
+
+	ret = shared_path(path, "nodes/%s", node_name);
+	if (ret)
+		return ret;
+	self->sn_epoch = current_epoch;
+	self->sn_grace = node_grace;
+	self->sn_renewed = time(NULL);
+	snprintf(text, sizeof(text), "%" PRIu64 " %s %lld\n", current_epoch,
+		 node_grace ? "grace" : "done", (long long)self->sn_renewed);
+	return shared_write_file(path, text);
+}
+
+static struct shared_node *
+shared_node_find(const char *name)
+{
+	struct shared_node *sn;
+
+	for (sn = nodes; sn; sn = sn->sn_next)
+		if (strcmp(sn->sn_name, name) == 0)
+			return sn;
+
+	if (strlen(name) > SHARED_NAME_MAX || strchr(name, '.'))
+		return NULL;
+	sn = calloc(1, sizeof(*sn));
+	if (!sn)
+		return NULL;
+	strcpy(sn->sn_name, name);
+	sn->sn_next = nodes;
+	nodes = sn;
+	return sn;
+}
+
+static bool
+shared_node_live(const struct shared_node *sn)
+{
+	return sn == self || sn->sn_renewed + node_lease > time(NULL);
+}
+
+static void
+shared_read_node(struct shared_node *sn)
+{
+	char path[PATH_MAX], text[96], state[8];
+	long long renewed;
+
+	if (sn == self || shared_path(path, "nodes/%s", sn->sn_name) ||
+	    shared_read_file(path, text, sizeof(text)))
+		return;
+	if (sscanf(text, "%" SCNu64 " %7s %lld", &sn->sn_epoch, state,
+		   &renewed) != 3)
+		return;
+	sn->sn_grace = strcmp(state, "grace") == 0;
+	sn->sn_renewed = renewed;
+}
+
+/* FNV-1a of the client id, and then of the epoch */
+static uint32_t
+shared_hash(uint64_t epoch, const unsigned char *id, const size_t len)
+{
+	uint32_t hash = 2166136261u;
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		hash = (hash ^ id[i]) * 16777619u;
+	for (i = 0; i < sizeof(epoch); i++, epoch >>= 8)
+		hash = (hash ^ (epoch & 0xff)) * 16777619u;
+	return hash;
+}
+
+static struct shared_rec *
+rec_find(uint64_t epoch, const unsigned char *id, const size_t len)
+{
+	uint32_t hash;
+	struct shared_rec *sr;
+
+	if (!rec_table)
+		return NULL;
+	hash = shared_hash(epoch, id, len);
+	for (sr = rec_table[hash & (rec_size - 1)]; sr; sr = sr->sr_next)
+		if (sr->sr_hash == hash && sr->sr_epoch == epoch &&
+		    sr->sr_idlen == len && memcmp(sr->sr_data, id, len) == 0)
+			return sr;
+	return NULL;
+}
+
+static int
+rec_grow(void)
+{
+	unsigned int size = rec_size ? rec_size * 2 : SHARED_HASH_INIT;
+	struct shared_rec **table, *sr, *next;
+	unsigned int i;
+
+	table = calloc(size, sizeof(*table));
+	if (!table)
+		return -ENOMEM;
+	for (i = 0; i < rec_size; i++)
+		for (sr = rec_table[i]; sr; sr = next) {
+			next = sr->sr_next;
+			sr->sr_next = table[sr->sr_hash & (size - 1)];
+			table[sr->sr_hash & (size - 1)] = sr;
+		}
+	free(rec_table);
+	rec_table = table;
+	rec_size = size;
+	return 0;
+}
+
+/*
+ * Add a record to the table, unless it holds a later one for the same
+ * client and epoch.  A removal is kept as well, in case a record it
+ * replaced is read later, from another node's log.
+ */
+static int
+rec_apply(bool present, uint64_t epoch, uint64_t stamp,
+	  struct shared_node *owner, const unsigned char *id, size_t idlen,
+	  const unsigned char *princ, size_t princlen, bool ours)
+{
+	struct shared_rec *sr, **head;
+
+	if (idlen > NFS4_OPAQUE_LIMIT)
+		idlen = NFS4_OPAQUE_LIMIT;
+	if (princlen > SHA256_DIGEST_SIZE)
+		princlen = SHA256_DIGEST_SIZE;
+
+	sr = rec_find(epoch, id, idlen);
+	if (sr) {
+		if (stamp < sr->sr_stamp ||
+		    (stamp == sr->sr_stamp && !sr->sr_present))
+			return 0;
+	} else {
+		if (rec_count >= rec_size && rec_grow())
+			return -ENOMEM;
+		sr = malloc(sizeof(*sr) + idlen + SHA256_DIGEST_SIZE);
+		if (!sr)
+			return -ENOMEM;
+		sr->sr_epoch = epoch;
+		sr->sr_hash = shared_hash(epoch, id, idlen);
+		sr->sr_idlen = idlen;
+		memcpy(sr->sr_data, id, idlen);
+		head = &rec_table[sr->sr_hash & (rec_size - 1)];
+		sr->sr_next = *head;
+		*head = sr;
+		rec_count++;
+	}
+	sr->sr_owner = owner;
+	sr->sr_stamp = stamp;
+	sr->sr_present = present;
+	sr->sr_ours = ours;
+	sr->sr_princlen = princlen;
+	if (princlen)
+		memcpy(sr->sr_data + idlen, princ, princlen);
+	return 0;
+}
+
+/* The oldest epoch whose records are still needed */
+static uint64_t
+shared_keep_epoch(void)
+{
+	uint64_t keep = cluster_recovery ? cluster_recovery : cluster_current;
+
+	if (current_epoch && current_epoch < keep)
+		keep = current_epoch;
+	if (recovery_epoch && recovery_epoch < keep)
+		keep = recovery_epoch;
+	return keep;
+}
+
+/* Forget the records of epochs before @keep, or all of them if 0 */
+static void
+rec_prune(uint64_t keep)
+{
+	struct shared_rec *sr, **prev;
+	unsigned int i;
+
+	for (i = 0; i < rec_size; i++)
+		for (prev = &rec_table[i]; (sr = *prev) != NULL; ) {
+			if (keep && sr->sr_epoch >= keep) {
+				prev = &sr->sr_next;
+				continue;
+			}
+			*prev = sr->sr_next;
+			free(sr);
+			rec_count--;
+		}
+	if (!keep) {
+		free(rec_table);
+		rec_table = NULL;
+		rec_size = 0;
+	}
+}
+
+static int
+shared_hex_decode(const char *hex, unsigned char *data, size_t size)
+{
+	size_t len = strlen(hex), i;
+	unsigned int byte;
+
+	if (strcmp(hex, "-") == 0)
+		return 0;
+	if (len % 2 || len / 2 > size)
+		return -1;
+	for (i = 0; i < len / 2; i++) {
+		if (sscanf(hex + 2 * i, "%2x", &byte) != 1)
+			return -1;
+		data[i] = byte;
+	}
+	return len / 2;
+}
+
+static char *
+shared_hex_encode(char *p, const unsigned char *data, size_t len)
+{
+	static const char digits[] = "0123456789abcdef";
+	size_t i;
+
+	if (len == 0) {
+		*p++ = '-';
+		return p;
+	}
+	for (i = 0; i < len; i++) {
+		*p++ = digits[data[i] >> 4];
+		*p++ = digits[data[i] & 0xf];
+	}
+	return p;
+}
+
+/* Apply one line of a log written by @sn */
+static void
+shared_parse_line(char *line, struct shared_node *sn)
+{
+	unsigned char id[NFS4_OPAQUE_LIMIT], princ[SHA256_DIGEST_SIZE];
+	char *op, *epoch, *stamp, *owner, *hexid, *hexprinc, *save;
+	struct shared_node *on;
+	int idlen, princlen = 0;
+
+	op = strtok_r(line, " ", &save);
+	if (!op)
+		return;		/* what is left of a failed write */
+	epoch = strtok_r(NULL, " ", &save);
+	stamp = strtok_r(NULL, " ", &save);
+	owner = strtok_r(NULL, " ", &save);
+	hexid = strtok_r(NULL, " ", &save);
+	hexprinc = strtok_r(NULL, " ", &save);
+	if (!hexid || (*op != '+' && *op != '-'))
+		goto bad;
+	idlen = shared_hex_decode(hexid, id, sizeof(id));
+	if (hexprinc)
+		princlen = shared_hex_decode(hexprinc, princ, sizeof(princ));
+	on = shared_node_find(owner);
+	if (idlen <= 0 || princlen < 0 || !on)
+		goto bad;
+	if (strtoull(epoch, NULL, 10) < shared_keep_epoch())
+		return;
+	if (rec_apply(*op == '+', strtoull(epoch, NULL, 10),
+		      strtoull(stamp, NULL, 10), on, id, idlen, princ, princlen,
+		      sn == self))
+		xlog(L_WARNING, "%s: out of memory", __func__);
+	if (sn == self)
+		log_records++;
+	return;
+bad:
+	xlog(L_WARNING, "%s: bad record in the log of %s", __func__,
+			sn->sn_name);
+}
+
+/*
+ * Read what @sn has added to its log since we last looked.  A log that
+ * has been replaced is read again from the start: the records it holds
+ * are the ones we already have, or later ones.
+ */
+static void
+shared_read_log(struct shared_node *sn)
+{
+	char path[PATH_MAX], *buf, *line, *nl;
+	size_t have = 0, size = 4 * SHARED_LINE_MAX;
+	struct stat stb;
+	ssize_t len;
+	int fd;
+
+	if (shared_path(path, "log/%s", sn->sn_name))
+		return;
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return;
+	if (fstat(fd, &stb) || (stb.st_ino == sn->sn_ino &&
+				stb.st_size == sn->sn_offset)) {
+		close(fd);
+		return;
+	}
+	if (stb.st_ino != sn->sn_ino || stb.st_size < sn->sn_offset) {
+		sn->sn_ino = stb.st_ino;
+		sn->sn_offset = 0;
+	}
+
+	buf = malloc(size);
+	if (!buf) {
+		close(fd);
+		return;
+	}
+	while ((len = pread(fd, buf + have, size - have - 1,
+			    sn->sn_offset + have)) > 0) {
+		have += len;
+		buf[have] = '\0';
+		for (line = buf; (nl = strchr(line, '\n')) != NULL;
+		     line = nl + 1) {
+			*nl = '\0';
+			shared_parse_line(line, sn);
+		}
+		/* a line being written is read next time */
+		sn->sn_offset += line - buf;
+		have -= line - buf;
+		if (have == size - 1) {
+			/* too long to be a record */
+			sn->sn_offset += have;
+			have = 0;
+		}
+		memmove(buf, line, have);
+	}
+	free(buf);
+	close(fd);
+}
+
+/* Read what the other nodes have written since we last looked */
+static void
+shared_refresh(bool all)
+{
+	char path[PATH_MAX];
+	struct shared_node *sn;
+	struct dirent *de;
+	DIR *dir;
+
+	last_refresh = time(NULL);
+	if (shared_read_grace())
+		return;
+
+	if (shared_path(path, "%s", "nodes"))
+		return;
+	dir = opendir(path);
+	if (dir) {
+		while ((de = readdir(dir)) != NULL)
+			if (de->d_name[0] != '.' &&
+			    !strstr(de->d_name, ".tmp"))
+				shared_node_find(de->d_name);
+		closedir(dir);
+	}
+	if (shared_path(path, "%s", "log"))
+		return;
+	dir = opendir(path);
+	if (dir) {
+		while ((de = readdir(dir)) != NULL)
+			if (de->d_name[0] != '.' &&
+			    !strstr(de->d_name, ".tmp"))
+				shared_node_find(de->d_name);
+		closedir(dir);
+	}
+
+	for (sn = nodes; sn; sn = sn->sn_next) {
+		shared_read_node(sn);
+		if (all || sn != self)
+			shared_read_log(sn);
+	}
+	rec_prune(shared_keep_epoch());
+}
+
+static uint64_t
+shared_stamp(void)
+{
+	struct timespec ts;
+	uint64_t stamp;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	stamp = (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+	if (stamp <= last_stamp)
+		stamp = last_stamp + 1;
+	last_stamp = stamp;
+	return stamp;
+}
+
+/* Format a record, for our log */
+static size_t
+shared_format(char *line, const struct shared_rec *sr)
+{
+	char *p = line;
+
+	p += sprintf(p, "%c %" PRIu64 " %" PRIu64 " %s ",
+		     sr->sr_present ? '+' : '-', sr->sr_epoch, sr->sr_stamp,
+		     sr->sr_owner->sn_name);
+	p = shared_hex_encode(p, sr->sr_data, sr->sr_idlen);
+	if (sr->sr_present) {
+		*p++ = ' ';
+		p = shared_hex_encode(p, sr->sr_data + sr->sr_idlen,
+				      sr->sr_princlen);
+	}
+	*p++ = '\n';
+	return p - line;
+}
+
+/*
+ * Record a client in, or remove it from, @epoch on behalf of @owner.
+ * The change is seen here at once, and reaches our log by the next
+ * commit.  It is stamped later than the record it replaces, even if
+ * that came from a node whose clock is ahead.
+ */
+static int
+shared_append(bool present, uint64_t epoch, struct shared_node *owner,
+	      const unsigned char *id, size_t idlen,
+	      const unsigned char *princ, size_t princlen)
+{
+	struct shared_rec *sr;
+	uint64_t stamp;
+	size_t size;
+	char *p;
+	int ret;
+
+	if (idlen > NFS4_OPAQUE_LIMIT)
+		idlen = NFS4_OPAQUE_LIMIT;
+	if (!rec_table && rec_grow())
+		return -ENOMEM;
+	stamp = shared_stamp();
+	sr = rec_find(epoch, id, idlen);
+	if (sr && sr->sr_stamp >= stamp)
+		stamp = last_stamp = sr->sr_stamp + 1;
+	ret = rec_apply(present, epoch, stamp, owner, id, idlen,
+			princ, princlen, true);
+	if (ret)
+		return ret;
+
+	if (pending_len + SHARED_LINE_MAX > pending_size) {
+		size = pending_size ? pending_size * 2 : 4 * SHARED_LINE_MAX;
+		p = realloc(pending, size);
+		if (!p)
+			return -ENOMEM;
+		pending = p;
+		pending_size = size;
+	}
+	sr = rec_find(epoch, id, idlen);
+	pending_len += shared_format(pending + pending_len, sr);
+	log_records++;
+
+	if (!group_commit)
+		return shared_commit();
+	return 0;
+}
+
+/* Write the records added since the last commit, and sync them */
+static int
+shared_commit(void)
+{
+	ssize_t len;
+
+	if (pending_len == 0)
+		return 0;
+	len = write(log_fd, pending, pending_len);
+	if (len == (ssize_t)pending_len && fdatasync(log_fd) == 0) {
+		pending_len = 0;
+		return 0;
+	}
+	xlog(L_ERROR, "%s: unable to write client records: %m", __func__);
+	/* a partial line is finished by the next commit, and then skipped */
+	if (len > 0 && len < (ssize_t)pending_len) {
+		pending[0] = '\n';
+		pending_len = 1;
+	} else
+		pending_len = 0;
+	return -EIO;
+}
+
+/*
+ * Copy the present records of @from into @to, for the owners that
+ * @copy() picks.  A record already made in @to is left alone.
+ */
+static int
+shared_copy_epoch(uint64_t from, uint64_t to,
+		  bool (*copy)(const struct shared_node *owner))
+{
+	struct shared_rec *sr, *dst;
+	unsigned int i, count = 0;
+	int ret;
+
+	/* so that the table does not grow while it is walked */
+	while (rec_size < 2 * rec_count)
+		if (rec_grow())
+			return -ENOMEM;
+
+	for (i = 0; i < rec_size; i++)
+		for (sr = rec_table[i]; sr; sr = sr->sr_next) {
+			if (sr->sr_epoch != from || !sr->sr_present ||
+			    !copy(sr->sr_owner))
+				continue;
+			dst = rec_find(to, sr->sr_data, sr->sr_idlen);
+			if (dst)
+				continue;
+			ret = shared_append(true, to, sr->sr_owner,
+					    sr->sr_data, sr->sr_idlen,
+					    sr->sr_data + sr->sr_idlen,
+					    sr->sr_princlen);
+			if (ret)
+				return ret;
+			count++;
+		}
+	if (count)
+		xlog(D_GENERAL, "%s: copied %u records of epoch %" PRIu64
+			" to %" PRIu64, __func__, count, from, to);
+	return shared_commit();
+}
+
+static bool
+shared_is_self(const struct shared_node *owner)
+{
+	return owner == self;
+}
+
+static bool
+shared_is_dead(const struct shared_node *owner)
+{
+	return !shared_node_live(owner);
+}
+
+/*
+ * Clear the recovery epoch if every live node has reached the current
+ * one and ended its grace period
+ */
+static void
+shared_try_lift(void)
+{
+	struct shared_node *sn;
+	int fd;
+
+	if (cluster_recovery == 0 || node_grace)
+		return;
+	fd = shared_lock();
+	if (fd < 0)
+		return;
+	shared_refresh(false);
+	if (cluster_recovery == 0)
+		goto out;
+	for (sn = nodes; sn; sn = sn->sn_next)
+		if (shared_node_live(sn) &&
+		    (sn->sn_epoch != cluster_current || sn->sn_grace)) {
+			xlog(D_GENERAL, "%s: waiting for %s", __func__,
+					sn->sn_name);
+			goto out;
+		}
+	if (shared_copy_epoch(cluster_recovery, cluster_current,
+			      shared_is_dead))
+		goto out;
+	if (shared_write_grace(cluster_current, 0) == 0) {
+		xlog(L_NOTICE, "Cluster grace period ended: epoch %" PRIu64,
+				cluster_current);
+		rec_prune(shared_keep_epoch());
+	}
+out:
+	shared_unlock(fd);
+}
+
+/*
+ * Rewrite our log with only the records it still needs to hold, once
+ * at least half of those in it are no longer needed
+ */
+static void
+shared_compact(void)
+{
+	char path[PATH_MAX], tmp[PATH_MAX], line[SHARED_LINE_MAX];
+	struct shared_rec *sr;
+	unsigned int i, count = 0;
+	FILE *fp;
+	int fd;
+
+	for (i = 0; i < rec_size; i++)
+		for (sr = rec_table[i]; sr; sr = sr->sr_next)
+			if (sr->sr_ours)
+				count++;
+	if (log_records < 2 * count + 64 || shared_commit())
+		return;
+
+	if (shared_path(path, "log/%s", node_name) ||
+	    snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp))
+		return;
+	fp = fopen(tmp, "w");
+	if (!fp) {
+		xlog(L_WARNING, "%s: unable to create %s: %m", __func__, tmp);
+		return;
+	}
+	for (i = 0; i < rec_size; i++)
+		for (sr = rec_table[i]; sr; sr = sr->sr_next)
+			if (sr->sr_ours)
+				fwrite(line, shared_format(line, sr), 1, fp);
+	if (fflush(fp) || fsync(fileno(fp)) || ferror(fp)) {
+		xlog(L_WARNING, "%s: unable to write %s: %m", __func__, tmp);
+		fclose(fp);
+		unlink(tmp);
+		return;
+	}
+	fclose(fp);
+
+	fd = open(tmp, O_WRONLY | O_APPEND);
+	if (fd < 0 || rename(tmp, path)) {
+		xlog(L_WARNING, "%s: unable to replace %s: %m", __func__, path);
+		if (fd >= 0)
+			close(fd);
+		unlink(tmp);
+		return;
+	}
+	close(log_fd);
+	log_fd = fd;
+	xlog(D_GENERAL, "%s: %u records in place of %u", __func__, count,
+			log_records);
+	log_records = count;
+}
+
+static int
+shared_prepare(const char *topdir)
+{
+	char path[PATH_MAX], text[96], state[8], *p;
+	uint64_t epoch;
+	int ret, fd;
+
+	if (!node_name[0]) {
+		if (gethostname(node_name, sizeof(node_name) - 1)) {
+			ret = -errno;
+			xlog(L_ERROR, "%s: unable to get the host name: %m",
+					__func__);
+			return ret;
+		}
+		p = strchr(node_name, '.');
+		if (p)
+			*p = '\0';
+	}
+	if (strchr(node_name, '/') || strchr(node_name, ' ') ||
+	    strchr(node_name, '.')) {
+		xlog(L_ERROR, "%s: bad node name \"%s\"", __func__, node_name);
+		return -EINVAL;
+	}
+
+	ret = shared_mkdir(topdir);
+	if (ret) {
+		xlog(L_ERROR, "%s: unable to create %s: %s", __func__, topdir,
+				strerror(-ret));
+		return ret;
+	}
+	if (snprintf(shared_dir, sizeof(shared_dir), "%s/cluster", topdir) >=
+	    (int)sizeof(shared_dir))
+		return -ENAMETOOLONG;
+	ret = shared_mkdir(shared_dir);
+	if (!ret && !(ret = shared_path(path, "%s", "nodes")))
+		ret = shared_mkdir(path);
+	if (!ret && !(ret = shared_path(path, "%s", "log")))
+		ret = shared_mkdir(path);
+	if (ret) {
+		xlog(L_ERROR, "%s: unable to create %s: %s", __func__,
+				shared_dir, strerror(-ret));
+		return ret;
+	}
+
+	self = shared_node_find(node_name);
+	if (!self)
+		return -ENOMEM;
+
+	fd = shared_lock();
+	if (fd < 0)
+		return -EIO;
+	ret = shared_read_grace();
+	if (ret == -ENOENT)
+		ret = shared_write_grace(1, 0);
+	shared_unlock(fd);
+	if (ret)
+		return ret;
+
+	ret = shared_path(path, "log/%s", node_name);
+	if (ret)
+		return ret;
+	log_fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0600);
+	if (log_fd < 0) {
+		xlog(L_ERROR, "%s: unable to open %s: %m", __func__, path);
+		return -errno;
+	}
+
+	/*
+	 * Carry on from the epoch we were at when we stopped, so that our
+	 * records are copied if the cluster has moved on since.  Were we
+	 * in this grace period?
+	 */
+	current_epoch = cluster_current;
+	node_grace = false;
+	if (!shared_path(path, "nodes/%s", node_name) &&
+	    !shared_read_file(path, text, sizeof(text)) &&
+	    sscanf(text, "%" SCNu64 " %7s", &epoch, state) == 2 &&
+	    epoch <= cluster_current && epoch >= shared_keep_epoch()) {
+		current_epoch = epoch;
+		node_grace = epoch == cluster_current && cluster_recovery &&
+			     strcmp(state, "grace") == 0;
+	}
+	recovery_epoch = node_grace ? cluster_recovery : 0;
+
+	if (rec_grow())
+		return -ENOMEM;
+	shared_refresh(true);
+	ret = shared_write_node();
+	if (ret)
+		return ret;
+
+	xlog(D_GENERAL, "%s: node %s, current_epoch=%" PRIu64
+		" recovery_epoch=%" PRIu64 ", cluster recovery epoch %" PRIu64,
+		__func__, node_name, current_epoch, recovery_epoch,
+		cluster_recovery);
+	return 0;
+}
+
+static int
+shared_insert_client_and_princhash(const unsigned char *clname,
+		const size_t namelen, const unsigned char *clprinchash,
+		const size_t princhashlen)
+{
+	return shared_append(true, current_epoch, self, clname, namelen,
+			     clprinchash, princhashlen);
+}
+
+static int
+shared_insert_client(const unsigned char *clname, const size_t namelen)
+{
+	return shared_append(true, current_epoch, self, clname, namelen,
+			     NULL, 0);
+}
+
+static int
+shared_remove_client(const unsigned char *clname, const size_t namelen)
+{
+	return shared_append(false, current_epoch, self, clname, namelen,
+			     NULL, 0);
+}
+
+/*
+ * Is @clname in the recovery epoch?  Answered from the records of all
+ * the nodes that have been read.
+ */
+static int
+shared_reclaim_lookup(const unsigned char *clname, const size_t namelen)
+{
+	struct shared_rec *sr;
+
+	if (recovery_epoch == 0)
+		return -1;
+	sr = rec_find(recovery_epoch, clname, namelen);
+	return sr && sr->sr_present;
+}
+
+static int
+shared_check_client(const unsigned char *clname, const size_t namelen)
+{
+	struct shared_rec *sr;
+
+	sr = rec_find(recovery_epoch, clname, namelen);
+	if ((!sr || !sr->sr_present) && last_refresh != time(NULL)) {
+		/* another node may have just recorded it */
+		shared_refresh(false);
+		sr = rec_find(recovery_epoch, clname, namelen);
+	}
+	xlog(D_GENERAL, "%s: %s in recovery epoch", __func__,
+			sr && sr->sr_present ? "found" : "not found");
+	if (!sr || !sr->sr_present)
+		return -EACCES;
+
+	/* keep the principal hash the record had */
+	return shared_append(true, current_epoch, self, clname, namelen,
+			     sr->sr_data + sr->sr_idlen, sr->sr_princlen);
+}
+
+/*
+ * Start a grace period for the cluster, or join the one that another
+ * node has started
+ */
+static int
+shared_grace_start(void)
+{
+	struct shared_rec *sr;
+	uint64_t cur, rec;
+	unsigned int i;
+	int ret, fd;
+
+	ret = shared_commit();
+	if (ret)
+		return ret;
+	fd = shared_lock();
+	if (fd < 0)
+		return -EIO;
+	ret = shared_read_grace();
+	if (ret)
+		goto out;
+	cur = cluster_current;
+	rec = cluster_recovery;
+	if (rec == 0) {
+		rec = cur++;
+		ret = shared_write_grace(cur, rec);
+		if (ret)
+			goto out;
+		xlog(L_NOTICE, "Cluster grace period started: epoch %" PRIu64,
+				cur);
+	} else if (current_epoch == cur) {
+		/*
+		 * Restarted during this grace period: drop the records we
+		 * made in it, as sqlite_grace_start() clears the table of
+		 * the current epoch.
+		 */
+		for (i = 0; i < rec_size; i++)
+			for (sr = rec_table[i]; sr; sr = sr->sr_next)
+				if (sr->sr_epoch == cur && sr->sr_present &&
+				    sr->sr_owner == self) {
+					ret = shared_append(false, cur, self,
+							sr->sr_data,
+							sr->sr_idlen, NULL, 0);
+					if (ret)
+						goto out;
+				}
+		ret = shared_commit();
+		if (ret)
+			goto out;
+	}
+
+	current_epoch = cur;
+	recovery_epoch = rec;
+	node_grace = true;
+	ret = shared_write_node();
+	if (ret)
+		goto out;
+	shared_refresh(false);
+	xlog(D_GENERAL, "%s: current_epoch=%" PRIu64 " recovery_epoch=%" PRIu64,
+		__func__, current_epoch, recovery_epoch);
+out:
+	shared_unlock(fd);
+	return ret;
+}
+
+static int
+shared_grace_done(void)
+{
+	int ret;
+
+	ret = shared_commit();
+	if (ret)
+		return ret;
+	node_grace = false;
+	recovery_epoch = 0;
+	ret = shared_write_node();
+	if (ret)
+		return ret;
+	xlog(D_GENERAL, "%s: current_epoch=%" PRIu64 " recovery_epoch=%" PRIu64,
+		__func__, current_epoch, recovery_epoch);
+	shared_try_lift();
+	return 0;
+}
+
+static int
+shared_iterate_recovery(int (*cb)(struct cld_client *clnt),
+			struct cld_client *clnt)
+{
+	struct shared_rec *sr;
+	unsigned int i;
+#if UPCALL_VERSION >= 2
+	struct cld_msg_v2 *cmsg = &clnt->cl_u.cl_msg_v2;
+#else
+	struct cld_msg *cmsg = &clnt->cl_u.cl_msg;
+#endif
+
+	if (recovery_epoch == 0) {
+		xlog(D_GENERAL, "%s: not in grace!", __func__);
+		return -EINVAL;
+	}
+
+	for (i = 0; i < rec_size; i++)
+		for (sr = rec_table[i]; sr; sr = sr->sr_next) {
+			if (sr->sr_epoch != recovery_epoch || !sr->sr_present)
+				continue;
+			memset(&cmsg->cm_u, 0, sizeof(cmsg->cm_u));
+#if UPCALL_VERSION >= 2
+			memcpy(&cmsg->cm_u.cm_clntinfo.cc_name.cn_id,
+			       sr->sr_data, sr->sr_idlen);
+			cmsg->cm_u.cm_clntinfo.cc_name.cn_len = sr->sr_idlen;
+			memcpy(&cmsg->cm_u.cm_clntinfo.cc_princhash.cp_data,
+			       sr->sr_data + sr->sr_idlen, sr->sr_princlen);
+			cmsg->cm_u.cm_clntinfo.cc_princhash.cp_len =
+							sr->sr_princlen;
+#else
+			memcpy(&cmsg->cm_u.cm_name.cn_id, sr->sr_data,
+			       sr->sr_idlen);
+			cmsg->cm_u.cm_name.cn_len = sr->sr_idlen;
+#endif
+			cb(clnt);
+		}
+	return 0;
+}
+
+static void
+shared_set_group_commit(const int enable)
+{
+	group_commit = enable;
+}
+
+static int
+shared_commit_pending(void)
+{
+	return pending_len != 0;
+}
+
+static int
+shared_checkpoint(void)
+{
+	return 0;
+}
+
+static int
+shared_maintain(void)
+{
+	shared_compact();
+	return 0;
+}
+
+/* commits write to our log, which nothing else does meanwhile */
+static int
+shared_threadsafe(void)
+{
+	return 0;
+}
+
+/*
+ * Renew our lease, read what the other nodes have written, and follow
+ * the cluster into a new epoch that another node has started
+ */
+static int
+shared_tick(void)
+{
+	shared_refresh(false);
+	if (cluster_current > current_epoch &&
+	    shared_copy_epoch(current_epoch, cluster_current,
+			      shared_is_self) == 0) {
+		xlog(D_GENERAL, "%s: following the cluster to epoch %" PRIu64,
+				__func__, cluster_current);
+		current_epoch = cluster_current;
+	}
+	shared_write_node();
+	shared_try_lift();
+	shared_compact();
+	return node_lease / 3 ? node_lease / 3 : 1;
+}
+
+static void
+shared_shutdown(void)
+{
+	struct shared_node *sn;
+
+	if (log_fd >= 0) {
+		shared_commit();
+		close(log_fd);
+		log_fd = -1;
+	}
+	free(pending);
+	pending = NULL;
+	pending_len = pending_size = 0;
+	rec_prune(0);
+	while ((sn = nodes) != NULL) {
+		nodes = sn->sn_next;
+		free(sn);
+	}
+	self = NULL;
+}
+
+const struct cld_backend shared_backend = {
+	.cb_name			= "shared",
+	.cb_prepare			= shared_prepare,
+	.cb_insert_client		= shared_insert_client,
+	.cb_insert_client_and_princhash	= shared_insert_client_and_princhash,
+	.cb_remove_client		= shared_remove_client,
+	.cb_check_client		= shared_check_client,
+	.cb_grace_start			= shared_grace_start,
+	.cb_grace_done			= shared_grace_done,
+	.cb_iterate_recovery		= shared_iterate_recovery,
+	.cb_set_group_commit		= shared_set_group_commit,
+	.cb_commit_pending		= shared_commit_pending,
+	.cb_commit			= shared_commit,
+	.cb_checkpoint			= shared_checkpoint,
+	.cb_maintain			= shared_maintain,
+	.cb_threadsafe			= shared_threadsafe,
+	.cb_reclaim_lookup		= shared_reclaim_lookup,
+	.cb_tick			= shared_tick,
+	.cb_shutdown			= shared_shutdown,
+};
@@ -63,6 +63,7 @@
 
 #include "xlog.h"
 #include "sqlite.h"
+#include "backend.h"
 #include "cld.h"
 #include "cld-internal.h"
 #include "conffile.h"
@@ -75,6 +76,12 @@
 /* in milliseconds */
 #define CLD_SQLITE_BUSY_TIMEOUT 10000
 
+/* WAL pages written before sqlite checkpoints without being asked */
+#define CLD_SQLITE_WAL_AUTOCHECKPOINT 4096
+
+/* free pages that one step of sqlite_maintain() gives back */
+#define CLD_SQLITE_VACUUM_PAGES 256
+
 /* private data structures */
 
 /* global variables */
@@ -86,6 +93,68 @@ static char buf[PATH_MAX];
 /* global database handle */
 static sqlite3 *dbh;
 
+/*
+ * With group commit, client records are created and removed in one
+ * transaction that stays open until sqlite_commit() is called.  A
+ * function that needs a transaction of its own commits the group
+ * first, and keeps the result for sqlite_commit() to return.
+ */
+static int group_commit;
+static int group_open;
+static int group_status = SQLITE_OK;
+
+/*
+ * The statements run for each upcall are prepared once for the epoch
+ * table they use, and kept until that epoch changes.
+ */
+enum {
+	CLD_STMT_INSERT,
+	CLD_STMT_INSERT_PRINCHASH,
+	CLD_STMT_REMOVE,
+	CLD_STMT_CHECK,
+	CLD_STMT_MAX
+};
+
+/* the SQL on either side of the table name */
+static const struct {
+	const char	*ss_head;
+	const char	*ss_tail;
+} stmt_sql[CLD_STMT_MAX] = {
+	[CLD_STMT_INSERT] = { "INSERT OR REPLACE INTO", "(id) VALUES (?);" },
+	[CLD_STMT_INSERT_PRINCHASH] = { "INSERT OR REPLACE INTO",
+					"VALUES (?, ?);" },
+	[CLD_STMT_REMOVE] = { "DELETE FROM", "WHERE id==?;" },
+	[CLD_STMT_CHECK] = { "SELECT count(*) FROM", "WHERE id==?;" },
+};
+
+static struct {
+	sqlite3_stmt	*cs_stmt;
+	uint64_t	cs_epoch;
+} stmt_cache[CLD_STMT_MAX];
+
+/*
+ * During grace, the client records of the recovery epoch are also kept
+ * in a hash table, so that check upcalls need not query the database.
+ */
+#define CLD_RECLAIM_HASH_INIT	256	/* initial buckets, a power of 2 */
+
+struct reclaim_ent {
+	struct reclaim_ent	*re_next;
+	uint32_t		re_hash;
+	uint16_t		re_idlen;
+	uint16_t		re_princlen;
+	unsigned char		re_data[];	/* id, then princhash */
+};
+
+static struct reclaim_ent **reclaim_table;
+static unsigned int reclaim_size, reclaim_count;
+static uint64_t reclaim_epoch;		/* of the records loaded, or 0 */
+
+/* journal settings, and the change count at the last checkpoint */
+static int journal_wal;
+static int journal_sync_normal;
+static int checkpoint_changes;
+
 /* forward declarations */
 
 /* make a directory, ignoring EEXIST errors unless it's not a directory */
@@ -788,11 +857,275 @@ rollback:
 	goto cleanup;
 }
 
+/*
+ * Find the statement @which for the table of @epoch, preparing it if need
+ * be.  It is to be handed back with sqlite_put_stmt() after use.
+ */
+static int
+sqlite_get_stmt(const int which, const uint64_t epoch, sqlite3_stmt **stmt)
+{
+	int ret;
+
+	if (stmt_cache[which].cs_stmt && stmt_cache[which].cs_epoch == epoch) {
+		*stmt = stmt_cache[which].cs_stmt;
+		return SQLITE_OK;
+	}
+
+	sqlite3_finalize(stmt_cache[which].cs_stmt);
+	stmt_cache[which].cs_stmt = NULL;
+
+	ret = snprintf(buf, sizeof(buf), "%s \"rec-%016" PRIx64 "\" %s",
+			stmt_sql[which].ss_head, epoch, stmt_sql[which].ss_tail);
+	if (ret < 0) {
+		xlog(L_ERROR, "sprintf failed!");
+		return ret;
+	} else if ((size_t)ret >= sizeof(buf)) {
+		xlog(L_ERROR, "sprintf output too long! (%d chars)", ret);
+		return -EINVAL;
+	}
+
+	ret = sqlite3_prepare_v2(dbh, buf, -1, &stmt_cache[which].cs_stmt,
+				 NULL);
+	if (ret != SQLITE_OK) {
+		xlog(L_ERROR, "%s: statement prepare failed: %s",
+			__func__, sqlite3_errmsg(dbh));
+		stmt_cache[which].cs_stmt = NULL;
+		return ret;
+	}
+	stmt_cache[which].cs_epoch = epoch;
+	*stmt = stmt_cache[which].cs_stmt;
+	return SQLITE_OK;
+}
+
+/* Make a cached statement ready for its next use */
+static void
+sqlite_put_stmt(sqlite3_stmt *stmt)
+{
+	sqlite3_reset(stmt);
+	sqlite3_clear_bindings(stmt);
+}
+
+/* Finalize the cached statements, e.g. before the epoch tables change */
+static void
+sqlite_flush_stmts(void)
+{
+	int i;
+
+	for (i = 0; i < CLD_STMT_MAX; i++) {
+		sqlite3_finalize(stmt_cache[i].cs_stmt);
+		stmt_cache[i].cs_stmt = NULL;
+	}
+}
+
+/* FNV-1a */
+static uint32_t
+reclaim_hash(const unsigned char *id, const size_t len)
+{
+	uint32_t hash = 2166136261u;
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		hash = (hash ^ id[i]) * 16777619u;
+	return hash;
+}
+
+static struct reclaim_ent *
+reclaim_find(const unsigned char *id, const size_t len)
+{
+	uint32_t hash = reclaim_hash(id, len);
+	struct reclaim_ent *re;
+
+	re = reclaim_table[hash & (reclaim_size - 1)];
+	for (; re; re = re->re_next)
+		if (re->re_hash == hash && re->re_idlen == len &&
+		    memcmp(re->re_data, id, len) == 0)
+			return re;
+	return NULL;
+}
+
+static int
+reclaim_grow(void)
+{
+	unsigned int size = reclaim_size ? reclaim_size * 2 :
+					   CLD_RECLAIM_HASH_INIT;
+	struct reclaim_ent **table, *re, *next;
+	unsigned int i;
+
+	table = calloc(size, sizeof(*table));
+	if (!table)
+		return -ENOMEM;
+	for (i = 0; i < reclaim_size; i++)
+		for (re = reclaim_table[i]; re; re = next) {
+			next = re->re_next;
+			re->re_next = table[re->re_hash & (size - 1)];
+			table[re->re_hash & (size - 1)] = re;
+		}
+	free(reclaim_table);
+	reclaim_table = table;
+	reclaim_size = size;
+	return 0;
+}
+
+static int
+reclaim_add(const unsigned char *id, size_t idlen,
+		const unsigned char *princ, size_t princlen)
+{
+	struct reclaim_ent *re, **head;
+
+	if (idlen > NFS4_OPAQUE_LIMIT)
+		idlen = NFS4_OPAQUE_LIMIT;
+	if (princlen > SHA256_DIGEST_SIZE)
+		princlen = SHA256_DIGEST_SIZE;
+
+	if (reclaim_count >= reclaim_size && reclaim_grow())
+		return -ENOMEM;
+
+	re = malloc(sizeof(*re) + idlen + princlen);
+	if (!re)
+		return -ENOMEM;
+	re->re_hash = reclaim_hash(id, idlen);
+	re->re_idlen = idlen;
+	re->re_princlen = princlen;
+	memcpy(re->re_data, id, idlen);
+	if (princlen)
+		memcpy(re->re_data + idlen, princ, princlen);
+
+	head = &reclaim_table[re->re_hash & (reclaim_size - 1)];
+	re->re_next = *head;
+	*head = re;
+	reclaim_count++;
+	return 0;
+}
+
+/* Forget the records of the recovery epoch */
+static void
+sqlite_reclaim_drop(void)
+{
+	struct reclaim_ent *re, *next;
+	unsigned int i;
+
+	for (i = 0; i < reclaim_size; i++)
+		for (re = reclaim_table[i]; re; re = next) {
+			next = re->re_next;
+			free(re);
+		}
+	free(reclaim_table);
+	reclaim_table = NULL;
+	reclaim_size = reclaim_count = 0;
+	reclaim_epoch = 0;
+}
+
+/*
+ * Load the records of the recovery epoch into the hash table.  If that
+ * fails, check upcalls query the database instead.
+ */
+static void
+sqlite_reclaim_load(void)
+{
+	int ret;
+	sqlite3_stmt *stmt = NULL;
+
+	if (recovery_epoch == 0 || reclaim_epoch == recovery_epoch)
+		return;
+	sqlite_reclaim_drop();
+
+	ret = snprintf(buf, sizeof(buf), "SELECT * FROM \"rec-%016" PRIx64 "\";",
+		recovery_epoch);
+	if (ret < 0) {
+		xlog(L_ERROR, "sprintf failed!");
+		return;
+	} else if ((size_t)ret >= sizeof(buf)) {
+		xlog(L_ERROR, "sprintf output too long! (%d chars)", ret);
+		return;
+	}
+
+	ret = sqlite3_prepare_v2(dbh, buf, -1, &stmt, NULL);
+	if (ret != SQLITE_OK) {
+		xlog(L_ERROR, "%s: select statement prepare failed: %s",
+			__func__, sqlite3_errmsg(dbh));
+		return;
+	}
+
+	while ((ret = sqlite3_step(stmt)) == SQLITE_ROW) {
+		if (reclaim_add(sqlite3_column_blob(stmt, 0),
+				sqlite3_column_bytes(stmt, 0),
+				sqlite3_column_blob(stmt, 1),
+				sqlite3_column_bytes(stmt, 1))) {
+			ret = -ENOMEM;
+			break;
+		}
+	}
+	sqlite3_finalize(stmt);
+
+	if (ret != SQLITE_DONE) {
+		xlog(L_WARNING, "%s: unable to load the records of the "
+				"recovery epoch: %d", __func__, ret);
+		sqlite_reclaim_drop();
+		return;
+	}
+	if (!reclaim_table && reclaim_grow()) {
+		sqlite_reclaim_drop();
+		return;
+	}
+	reclaim_epoch = recovery_epoch;
+	xlog(D_GENERAL, "%s: loaded %u records of epoch %016" PRIx64,
+		__func__, reclaim_count, reclaim_epoch);
+}
+
+static int
+sqlite_journal_mode_cb(void *arg, int ncols, char **cols,
+			char **UNUSED(colnames))
+{
+	int *wal = arg;
+
+	if (ncols == 1 && cols[0])
+		*wal = !strcmp(cols[0], "wal");
+	return 0;
+}
+
+/* Apply the journal settings chosen with sqlite_set_journal() */
+static int
+sqlite_setup_journal(void)
+{
+	int ret, wal = 0;
+	char *err = NULL;
+
+	ret = sqlite3_exec(dbh, journal_wal ? "PRAGMA journal_mode = WAL;" :
+				"PRAGMA journal_mode = DELETE;",
+				sqlite_journal_mode_cb, &wal, &err);
+	if (ret != SQLITE_OK) {
+		xlog(L_ERROR, "Unable to set journal mode: %s", err);
+		sqlite3_free(err);
+		return ret;
+	}
+	if (journal_wal && !wal) {
+		xlog(L_WARNING, "Unable to use a write-ahead log, using the "
+				"rollback journal");
+		journal_wal = 0;
+	}
+
+	ret = sqlite3_exec(dbh, journal_wal && journal_sync_normal ?
+				"PRAGMA synchronous = NORMAL;" :
+				"PRAGMA synchronous = FULL;", NULL, NULL, &err);
+	if (ret != SQLITE_OK) {
+		xlog(L_ERROR, "Unable to set synchronous level: %s", err);
+		sqlite3_free(err);
+		return ret;
+	}
+
+	if (journal_wal) {
+		sqlite3_wal_autocheckpoint(dbh, CLD_SQLITE_WAL_AUTOCHECKPOINT);
+		checkpoint_changes = sqlite3_total_changes(dbh);
+		xlog(D_GENERAL, "%s: using a write-ahead log", __func__);
+	}
+	return SQLITE_OK;
+}
+
 /* Open the database and set up the database handle for it */
 int
 sqlite_prepare_dbh(const char *topdir)
 {
-	int ret;
+	int ret, enable;
 
 	/* Do nothing if the database handle is already set up */
 	if (dbh)
@@ -826,6 +1159,19 @@ sqlite_prepare_dbh(const char *topdir)
 		goto out_close;
 	}
 
+	ret = sqlite_setup_journal();
+	if (ret)
+		goto out_close;
+
+	/* only takes effect in a new database, or after a VACUUM */
+	ret = sqlite3_exec(dbh, "PRAGMA auto_vacuum = INCREMENTAL;", NULL, NULL,
+				NULL);
+	if (ret != SQLITE_OK) {
+		xlog(L_ERROR, "Unable to set auto_vacuum: %s",
+			sqlite3_errmsg(dbh));
+		goto out_close;
+	}
+
 	ret = sqlite_query_schema_version();
 	switch (ret) {
 	case CLD_SQLITE_LATEST_SCHEMA_VERSION:
@@ -868,6 +1214,7 @@ sqlite_prepare_dbh(const char *topdir)
 	ret = sqlite_startup_query_grace();
 	if (ret)
 		goto out_close;
+	sqlite_reclaim_load();
 
 	ret = sqlite_query_first_time(&first_time);
 	if (ret)
@@ -885,7 +1232,16 @@ sqlite_prepare_dbh(const char *topdir)
 		sqlite_copy_cltrack_records(&num_cltrack_records);
 		xlog(D_GENERAL, "%s: num_cltrack_records = %d\n",
 			__func__, num_cltrack_records);
+		/* import the legacy records in one transaction */
+		enable = group_commit;
+		group_commit = 1;
 		legacy_load_clients_from_recdir(&num_legacy_records);
+		if (sqlite_commit() != SQLITE_OK) {
+			xlog(L_WARNING, "%s: unable to commit legacy records",
+				__func__);
+			num_legacy_records = 0;
+		}
+		group_commit = enable;
 		xlog(D_GENERAL, "%s: num_legacy_records = %d\n",
 			__func__, num_legacy_records);
 		if (num_cltrack_records > 0 && num_legacy_records > 0)
@@ -900,6 +1256,306 @@ out_close:
 	return ret;
 }
 
+/*
+ * Open the transaction that the next client record changes join
+ */
+static int
+sqlite_group_begin(void)
+{
+	int ret;
+	char *err = NULL;
+
+	if (!group_commit || group_open)
+		return SQLITE_OK;
+
+	ret = sqlite3_exec(dbh, "BEGIN IMMEDIATE TRANSACTION;", NULL, NULL,
+				&err);
+	if (ret != SQLITE_OK) {
+		xlog(L_ERROR, "Unable to begin transaction: %s", err);
+		sqlite3_free(err);
+		return ret;
+	}
+	group_open = 1;
+	return SQLITE_OK;
+}
+
+/*
+ * Commit the record changes made since sqlite_group_begin(), and note
+ * the result
+ */
+static void
+sqlite_group_end(void)
+{
+	int ret;
+	char *err = NULL;
+
+	if (!group_open)
+		return;
+	group_open = 0;
+
+	if (sqlite3_get_autocommit(dbh)) {
+		/* sqlite rolled the transaction back after an error */
+		xlog(L_ERROR, "%s: client record changes were rolled back",
+				__func__);
+		group_status = SQLITE_ABORT;
+		return;
+	}
+
+	ret = sqlite3_exec(dbh, "COMMIT TRANSACTION;", NULL, NULL, &err);
+	if (ret != SQLITE_OK) {
+		xlog(L_ERROR, "Unable to commit transaction: %s", err);
+		sqlite3_free(err);
+		err = NULL;
+		if (sqlite3_exec(dbh, "ROLLBACK TRANSACTION;", NULL, NULL,
+				 &err) != SQLITE_OK) {
+			xlog(L_ERROR, "Unable to rollback transaction: %s",
+					err);
+			sqlite3_free(err);
+		}
+		group_status = ret;
+	}
+}
+
+/*
+ * Group the client record changes of upcalls that arrive together into
+ * one transaction, if @enable
+ */
+void
+sqlite_set_group_commit(const int enable)
+{
+	if (!enable)
+		sqlite_group_end();
+	group_commit = enable;
+}
+
+/*
+ * Are there client record changes that sqlite_commit() has yet to make
+ * durable, or report on?
+ */
+int
+sqlite_commit_pending(void)
+{
+	return group_open || group_status != SQLITE_OK;
+}
+
+/*
+ * Make the grouped client record changes durable
+ *
+ * Returns SQLITE_OK if every change made since the last call is on
+ * stable storage, or else a non-zero sqlite error code, in which case
+ * none of them are.
+ */
+int
+sqlite_commit(void)
+{
+	int ret;
+
+	sqlite_group_end();
+	ret = group_status;
+	group_status = SQLITE_OK;
+	return ret;
+}
+
+/*
+ * Choose the journal that sqlite_prepare_dbh() sets up: a write-ahead log
+ * if @wal, else the rollback journal.  If @sync_normal, commits to the
+ * write-ahead log are not synced, and only checkpoints are.
+ */
+void
+sqlite_set_journal(const int wal, const int sync_normal)
+{
+	journal_wal = wal;
+	journal_sync_normal = sync_normal;
+}
+
+/*
+ * Copy the changes in the write-ahead log back into the database, if
+ * there are any and no transaction is open
+ *
+ * Returns a non-zero sqlite error code, or SQLITE_OK (aka 0)
+ */
+int
+sqlite_checkpoint(void)
+{
+	int ret, changes;
+
+	if (!journal_wal || group_open)
+		return SQLITE_OK;
+	changes = sqlite3_total_changes(dbh);
+	if (changes == checkpoint_changes)
+		return SQLITE_OK;
+
+	ret = sqlite3_wal_checkpoint_v2(dbh, NULL, SQLITE_CHECKPOINT_TRUNCATE,
+					NULL, NULL);
+	if (ret != SQLITE_OK) {
+		xlog(L_ERROR, "%s: checkpoint failed: %s", __func__,
+				sqlite3_errmsg(dbh));
+		return ret;
+	}
+	xlog(D_GENERAL, "%s: checkpointed the write-ahead log", __func__);
+	checkpoint_changes = changes;
+	return SQLITE_OK;
+}
+
+/* Callback to fetch a single integer, such as the value of a pragma */
+static int
+sqlite_int_cb(void *arg, int ncols, char **cols, char **UNUSED(colnames))
+{
+	if (ncols == 1 && cols[0])
+		*(long *)arg = strtol(cols[0], NULL, 10);
+	return 0;
+}
+
+static long
+sqlite_pragma_int(const char *pragma)
+{
+	long val = -1;
+	char *err = NULL;
+	int ret;
+
+	ret = sqlite3_exec(dbh, pragma, sqlite_int_cb, &val, &err);
+	if (ret != SQLITE_OK) {
+		xlog(L_ERROR, "%s: %s failed: %s", __func__, pragma, err);
+		val = -1;
+	}
+	sqlite3_free(err);
+	return val;
+}
+
+/*
+ * Drop one recovery table for an epoch that is neither the current nor
+ * the recovery epoch.  Returns 1 if one was dropped, 0 if there were
+ * none, or a negative sqlite error code.
+ */
+static int
+sqlite_prune_epoch(void)
+{
+	char cur[24], rec[24];
+	char *name = NULL;
+	sqlite3_stmt *stmt;
+	char *err = NULL;
+	int ret;
+
+	snprintf(cur, sizeof(cur), "rec-%016" PRIx64, current_epoch);
+	snprintf(rec, sizeof(rec), "rec-%016" PRIx64, recovery_epoch);
+
+	ret = sqlite3_prepare_v2(dbh, "SELECT name FROM sqlite_master "
+				 "WHERE type = 'table' "
+				 "AND name GLOB 'rec-[0-9a-f]*' "
+				 "AND name != ? AND name != ? LIMIT 1;",
+				 -1, &stmt, NULL);
+	if (ret != SQLITE_OK) {
+		xlog(L_ERROR, "%s: unable to prepare select: %s", __func__,
+			sqlite3_errmsg(dbh));
+		return -ret;
+	}
+	sqlite3_bind_text(stmt, 1, cur, -1, SQLITE_STATIC);
+	sqlite3_bind_text(stmt, 2, rec, -1, SQLITE_STATIC);
+	if (sqlite3_step(stmt) == SQLITE_ROW)
+		name = sqlite3_mprintf("%s", sqlite3_column_text(stmt, 0));
+	sqlite3_finalize(stmt);
+	if (!name)
+		return 0;
+
+	ret = snprintf(buf, sizeof(buf), "DROP TABLE \"%s\";", name);
+	if (ret < 0 || (size_t)ret >= sizeof(buf)) {
+		sqlite3_free(name);
+		return -SQLITE_ERROR;
+	}
+	ret = sqlite3_exec(dbh, (const char *)buf, NULL, NULL, &err);
+	if (ret != SQLITE_OK)
+		xlog(L_ERROR, "Unable to drop table %s: %s", name, err);
+	else
+		xlog(D_GENERAL, "%s: dropped table %s", __func__, name);
+	sqlite3_free(err);
+	sqlite3_free(name);
+	return ret == SQLITE_OK ? 1 : -ret;
+}
+
+/*
+ * Do one short step of housekeeping: drop a recovery table that is no
+ * longer needed, or give some free pages back to the filesystem.  This
+ * is work that sqlite_grace_done() leaves for when nfsdcld is idle, so
+ * that it can answer the kernel at once.
+ *
+ * A database created with an incremental auto_vacuum is shrunk a few
+ * pages at a time.  An older one is vacuumed once, to convert it, when
+ * a quarter or more of its pages are free.
+ *
+ * Returns 1 if there is more to do, or 0 if there is not.
+ */
+int
+sqlite_maintain(void)
+{
+	long pages, freepages, mode;
+	char *err = NULL;
+	int ret;
+
+	if (group_open)
+		return 1;
+
+	ret = sqlite_prune_epoch();
+	if (ret)
+		return ret > 0;
+
+	pages = sqlite_pragma_int("PRAGMA page_count;");
+	freepages = sqlite_pragma_int("PRAGMA freelist_count;");
+	mode = sqlite_pragma_int("PRAGMA auto_vacuum;");
+	if (pages <= 0 || freepages <= 0 || mode < 0)
+		return 0;
+	xlog(D_GENERAL, "%s: %ld of %ld pages are free", __func__,
+		freepages, pages);
+
+	if (mode == 2) {
+		snprintf(buf, sizeof(buf), "PRAGMA incremental_vacuum(%d);",
+			CLD_SQLITE_VACUUM_PAGES);
+		ret = sqlite3_exec(dbh, (const char *)buf, NULL, NULL, &err);
+		if (ret != SQLITE_OK) {
+			xlog(L_ERROR, "Incremental vacuum failed: %s", err);
+			sqlite3_free(err);
+			return 0;
+		}
+		return freepages > CLD_SQLITE_VACUUM_PAGES;
+	}
+
+	if (freepages * 4 < pages)
+		return 0;
+	ret = sqlite3_exec(dbh, "PRAGMA auto_vacuum = INCREMENTAL; VACUUM;",
+				NULL, NULL, &err);
+	if (ret != SQLITE_OK)
+		xlog(L_ERROR, "Vacuum failed: %s", err);
+	else
+		xlog(L_NOTICE, "Vacuumed the database, freeing %ld of %ld "
+			       "pages", freepages, pages);
+	sqlite3_free(err);
+	return 0;
+}
+
+/*
+ * Can sqlite_commit() be called from another thread, while this one does
+ * no other database work?
+ */
+int
+sqlite_threadsafe(void)
+{
+	return sqlite3_threadsafe();
+}
+
+/*
+ * Is @clname in the recovery epoch?  Answered from memory, so it needs
+ * no database.
+ *
+ * Returns 1 if it is, 0 if it is not, or -1 if the records of the
+ * recovery epoch are not in memory.
+ */
+int
+sqlite_reclaim_lookup(const unsigned char *clname, const size_t namelen)
+{
+	if (recovery_epoch == 0 || reclaim_epoch != recovery_epoch)
+		return -1;
+	return reclaim_find(clname, namelen) != NULL;
+}
+
 /*
  * Create a client record
  *
@@ -911,22 +1567,13 @@ sqlite_insert_client(const unsigned char *clname, const size_t namelen)
 	int ret;
 	sqlite3_stmt *stmt = NULL;
 
-	ret = snprintf(buf, sizeof(buf), "INSERT OR REPLACE INTO \"rec-%016" PRIx64 "\" (id) "
-				"VALUES (?);", current_epoch);
-	if (ret < 0) {
-		xlog(L_ERROR, "sprintf failed!");
+	ret = sqlite_group_begin();
+	if (ret != SQLITE_OK)
 		return ret;
-	} else if ((size_t)ret >= sizeof(buf)) {
-		xlog(L_ERROR, "sprintf output too long! (%d chars)", ret);
-		return -EINVAL;
-	}
 
-	ret = sqlite3_prepare_v2(dbh, buf, -1, &stmt, NULL);
-	if (ret != SQLITE_OK) {
-		xlog(L_ERROR, "%s: insert statement prepare failed: %s",
-			__func__, sqlite3_errmsg(dbh));
+	ret = sqlite_get_stmt(CLD_STMT_INSERT, current_epoch, &stmt);
+	if (ret != SQLITE_OK)
 		return ret;
-	}
 
 	ret = sqlite3_bind_blob(stmt, 1, (const void *)clname, namelen,
 				SQLITE_STATIC);
@@ -945,7 +1592,7 @@ sqlite_insert_client(const unsigned char *clname, const size_t namelen)
 
 out_err:
 	xlog(D_GENERAL, "%s: returning %d", __func__, ret);
-	sqlite3_finalize(stmt);
+	sqlite_put_stmt(stmt);
 	return ret;
 }
 
@@ -962,26 +1609,14 @@ sqlite_insert_client_and_princhash(const unsigned char *clname, const size_t nam
 	int ret;
 	sqlite3_stmt *stmt = NULL;
 
-	if (princhashlen > 0)
-		ret = snprintf(buf, sizeof(buf), "INSERT OR REPLACE INTO \"rec-%016" PRIx64 "\" "
-				"VALUES (?, ?);", current_epoch);
-	else
-		ret = snprintf(buf, sizeof(buf), "INSERT OR REPLACE INTO \"rec-%016" PRIx64 "\" (id) "
-				"VALUES (?);", current_epoch);
-	if (ret < 0) {
-		xlog(L_ERROR, "sprintf failed!");
+	ret = sqlite_group_begin();
+	if (ret != SQLITE_OK)
 		return ret;
-	} else if ((size_t)ret >= sizeof(buf)) {
-		xlog(L_ERROR, "sprintf output too long! (%d chars)", ret);
-		return -EINVAL;
-	}
 
-	ret = sqlite3_prepare_v2(dbh, buf, -1, &stmt, NULL);
-	if (ret != SQLITE_OK) {
-		xlog(L_ERROR, "%s: insert statement prepare failed: %s",
-			__func__, sqlite3_errmsg(dbh));
+	ret = sqlite_get_stmt(princhashlen > 0 ? CLD_STMT_INSERT_PRINCHASH :
+			      CLD_STMT_INSERT, current_epoch, &stmt);
+	if (ret != SQLITE_OK)
 		return ret;
-	}
 
 	ret = sqlite3_bind_blob(stmt, 1, (const void *)clname, namelen,
 				SQLITE_STATIC);
@@ -1010,7 +1645,7 @@ sqlite_insert_client_and_princhash(const unsigned char *clname, const size_t nam
 
 out_err:
 	xlog(D_GENERAL, "%s: returning %d", __func__, ret);
-	sqlite3_finalize(stmt);
+	sqlite_put_stmt(stmt);
 	return ret;
 }
 #else
@@ -1029,23 +1664,13 @@ sqlite_remove_client(const unsigned char *clname, const size_t namelen)
 	int ret;
 	sqlite3_stmt *stmt = NULL;
 
-	ret = snprintf(buf, sizeof(buf), "DELETE FROM \"rec-%016" PRIx64 "\" "
-				"WHERE id==?;", current_epoch);
-	if (ret < 0) {
-		xlog(L_ERROR, "sprintf failed!");
+	ret = sqlite_group_begin();
+	if (ret != SQLITE_OK)
 		return ret;
-	} else if ((size_t)ret >= sizeof(buf)) {
-		xlog(L_ERROR, "sprintf output too long! (%d chars)", ret);
-		return -EINVAL;
-	}
-
-	ret = sqlite3_prepare_v2(dbh, buf, -1, &stmt, NULL);
 
-	if (ret != SQLITE_OK) {
-		xlog(L_ERROR, "%s: statement prepare failed: %s",
-				__func__, sqlite3_errmsg(dbh));
-		goto out_err;
-	}
+	ret = sqlite_get_stmt(CLD_STMT_REMOVE, current_epoch, &stmt);
+	if (ret != SQLITE_OK)
+		return ret;
 
 	ret = sqlite3_bind_blob(stmt, 1, (const void *)clname, namelen,
 				SQLITE_STATIC);
@@ -1064,7 +1689,7 @@ sqlite_remove_client(const unsigned char *clname, const size_t namelen)
 
 out_err:
 	xlog(D_GENERAL, "%s: returning %d", __func__, ret);
-	sqlite3_finalize(stmt);
+	sqlite_put_stmt(stmt);
 	return ret;
 }
 
@@ -1078,23 +1703,28 @@ sqlite_check_client(const unsigned char *clname, const size_t namelen)
 {
 	int ret;
 	sqlite3_stmt *stmt = NULL;
+	struct reclaim_ent *re;
 
-	ret = snprintf(buf, sizeof(buf), "SELECT count(*) FROM  \"rec-%016" PRIx64 "\" "
-				"WHERE id==?;", recovery_epoch);
-	if (ret < 0) {
-		xlog(L_ERROR, "sprintf failed!");
-		return ret;
-	} else if ((size_t)ret >= sizeof(buf)) {
-		xlog(L_ERROR, "sprintf output too long! (%d chars)", ret);
-		return -EINVAL;
+	if (recovery_epoch && reclaim_epoch == recovery_epoch) {
+		re = reclaim_find(clname, namelen);
+		xlog(D_GENERAL, "%s: %s in recovery epoch", __func__,
+				re ? "found" : "not found");
+		if (!re)
+			return -EACCES;
+
+		/* keep the principal hash the record had */
+#if UPCALL_VERSION >= 2
+		if (re->re_princlen)
+			return sqlite_insert_client_and_princhash(clname,
+					namelen, re->re_data + re->re_idlen,
+					re->re_princlen);
+#endif
+		return sqlite_insert_client(clname, namelen);
 	}
 
-	ret = sqlite3_prepare_v2(dbh, buf, -1, &stmt, NULL);
-	if (ret != SQLITE_OK) {
-		xlog(L_ERROR, "%s: select statement prepare failed: %s",
-			__func__, sqlite3_errmsg(dbh));
+	ret = sqlite_get_stmt(CLD_STMT_CHECK, recovery_epoch, &stmt);
+	if (ret != SQLITE_OK)
 		return ret;
-	}
 
 	ret = sqlite3_bind_blob(stmt, 1, (const void *)clname, namelen,
 				SQLITE_STATIC);
@@ -1118,14 +1748,14 @@ sqlite_check_client(const unsigned char *clname, const size_t namelen)
 		goto out_err;
 	}
 
-	sqlite3_finalize(stmt);
+	sqlite_put_stmt(stmt);
 
 	/* Now insert the client into the table for the current epoch */
 	return sqlite_insert_client(clname, namelen);
 
 out_err:
 	xlog(D_GENERAL, "%s: returning %d", __func__, ret);
-	sqlite3_finalize(stmt);
+	sqlite_put_stmt(stmt);
 	return ret;
 }
 
@@ -1137,6 +1767,9 @@ sqlite_grace_start(void)
 	uint64_t tcur = current_epoch;
 	uint64_t trec = recovery_epoch;
 
+	sqlite_group_end();
+	sqlite_flush_stmts();
+
 	/* begin transaction */
 	ret = sqlite3_exec(dbh, "BEGIN EXCLUSIVE TRANSACTION;", NULL, NULL,
 				&err);
@@ -1225,6 +1858,7 @@ sqlite_grace_start(void)
 	recovery_epoch = trec;
 	xlog(D_GENERAL, "%s: current_epoch=%"PRIu64" recovery_epoch=%"PRIu64,
 		__func__, current_epoch, recovery_epoch);
+	sqlite_reclaim_load();
 
 out:
 	sqlite3_free(err);
@@ -1242,6 +1876,9 @@ sqlite_grace_done(void)
 	int ret, ret2;
 	char *err;
 
+	sqlite_group_end();
+	sqlite_flush_stmts();
+
 	/* begin transaction */
 	ret = sqlite3_exec(dbh, "BEGIN EXCLUSIVE TRANSACTION;", NULL, NULL,
 				&err);
@@ -1257,24 +1894,7 @@ sqlite_grace_done(void)
 		goto rollback;
 	}
 
-	ret = snprintf(buf, sizeof(buf), "DROP TABLE \"rec-%016" PRIx64 "\";",
-		recovery_epoch);
-	if (ret < 0) {
-		xlog(L_ERROR, "sprintf failed!");
-		goto rollback;
-	} else if ((size_t)ret >= sizeof(buf)) {
-		xlog(L_ERROR, "sprintf output too long! (%d chars)", ret);
-		ret = -EINVAL;
-		goto rollback;
-	}
-
-	ret = sqlite3_exec(dbh, (const char *)buf, NULL, NULL, &err);
-	if (ret != SQLITE_OK) {
-		xlog(L_ERROR, "Unable to drop table for recovery epoch: %s",
-			err);
-		goto rollback;
-	}
-
+	/* the recovery epoch's table is dropped later, by sqlite_maintain() */
 	ret = sqlite3_exec(dbh, "COMMIT TRANSACTION;", NULL, NULL, &err);
 	if (ret != SQLITE_OK) {
 		xlog(L_ERROR, "Unable to commit transaction: %s", err);
@@ -1282,6 +1902,7 @@ sqlite_grace_done(void)
 	}
 
 	recovery_epoch = 0;
+	sqlite_reclaim_drop();
 	xlog(D_GENERAL, "%s: current_epoch=%"PRIu64" recovery_epoch=%"PRIu64,
 		__func__, current_epoch, recovery_epoch);
 
@@ -1419,9 +2040,32 @@ void
 sqlite_shutdown(void)
 {
 	if (dbh != NULL) {
+		sqlite_group_end();
+		sqlite_flush_stmts();
 		sqlite3_close(dbh);
+		sqlite_reclaim_drop();
 		dbh = NULL;
 	}
 
 	sqlite3_shutdown();
 }
+
+const struct cld_backend sqlite_backend = {
+	.cb_name			= "sqlite",
+	.cb_prepare			= sqlite_prepare_dbh,
+	.cb_insert_client		= sqlite_insert_client,
+	.cb_insert_client_and_princhash	= sqlite_insert_client_and_princhash,
+	.cb_remove_client		= sqlite_remove_client,
+	.cb_check_client		= sqlite_check_client,
+	.cb_grace_start			= sqlite_grace_start,
+	.cb_grace_done			= sqlite_grace_done,
+	.cb_iterate_recovery		= sqlite_iterate_recovery,
+	.cb_set_group_commit		= sqlite_set_group_commit,
+	.cb_commit_pending		= sqlite_commit_pending,
+	.cb_commit			= sqlite_commit,
+	.cb_checkpoint			= sqlite_checkpoint,
+	.cb_maintain			= sqlite_maintain,
+	.cb_threadsafe			= sqlite_threadsafe,
+	.cb_reclaim_lookup		= sqlite_reclaim_lookup,
+	.cb_shutdown			= sqlite_shutdown,
+};
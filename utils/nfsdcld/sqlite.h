@@ -33,6 +33,14 @@ int sqlite_grace_done(void);
 int sqlite_iterate_recovery(int (*cb)(struct cld_client *clnt), struct cld_client *clnt);
 int sqlite_delete_cltrack_records(void);
 int sqlite_first_time_done(void);
+void sqlite_set_group_commit(const int enable);
+int sqlite_commit_pending(void);
+int sqlite_commit(void);
+void sqlite_set_journal(const int wal, const int sync_normal);
+int sqlite_checkpoint(void);
+int sqlite_maintain(void);
+int sqlite_threadsafe(void);
+int sqlite_reclaim_lookup(const unsigned char *clname, const size_t namelen);
 
 void sqlite_shutdown(void);
 #endif /* _SQLITE_H */
@@ -0,0 +1,190 @@
+/*
+ * stats.c -- statistics about the upcalls nfsdcld handles
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+/*
+ * Each upcall type, and the commits of client record changes, counts
+ * calls, failures and latency in a histogram of power-of-two buckets.
+ * An upcall is timed from when it is read to its downcall, so the time
+ * a held downcall waits for its commit is included.  The commit worker
+ * updates its entry from another thread, so counters are updated with
+ * relaxed atomic operations; a reader of the statistics file sees each
+ * counter exact, but not all of them from the same instant.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#include <limits.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "xlog.h"
+#include "stats.h"
+
+#define CLD_STAT_BUCKETS	24	/* < 1us ... < 2^22us, and the rest */
+
+struct cld_stat {
+	const char *		cs_name;
+	unsigned long		cs_calls;
+	unsigned long		cs_failed;
+	unsigned long		cs_usecs;
+	unsigned long		cs_max;
+	unsigned long		cs_hist[CLD_STAT_BUCKETS];
+};
+
+static struct cld_stat cld_stats[CSTAT_MAX] = {
+	[CSTAT_CREATE]		= { .cs_name = "create" },
+	[CSTAT_REMOVE]		= { .cs_name = "remove" },
+	[CSTAT_CHECK]		= { .cs_name = "check" },
+	[CSTAT_GRACEDONE]	= { .cs_name = "gracedone" },
+	[CSTAT_GRACESTART]	= { .cs_name = "gracestart" },
+	[CSTAT_GETVERSION]	= { .cs_name = "getversion" },
+	[CSTAT_COMMIT]		= { .cs_name = "commit" },
+};
+
+/* record changes per commit, and upcalls queued behind one */
+static unsigned long	group_commits, group_changes, group_max;
+static unsigned long	queued_max;
+
+/* grace periods, and the time spent in them */
+static unsigned long		grace_periods, grace_usecs;
+static unsigned long long	grace_start;
+
+#define cld_stat_inc(p, n)	__atomic_fetch_add((p), (n), __ATOMIC_RELAXED)
+#define cld_stat_get(p)		__atomic_load_n((p), __ATOMIC_RELAXED)
+
+/* Returns a monotonic time stamp, in microseconds, for cld_stats_add() */
+unsigned long long
+cld_stats_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/* Count one call of @id that started at @start, and failed if @failed */
+void
+cld_stats_add(unsigned int id, unsigned long long start, bool failed)
+{
+	struct cld_stat *cs;
+	unsigned long usecs = cld_stats_clock() - start;
+	unsigned long max;
+	int bucket;
+
+	if (id >= CSTAT_MAX)
+		return;
+	cs = &cld_stats[id];
+
+	bucket = usecs ? 64 - __builtin_clzll(usecs) : 0;
+	if (bucket >= CLD_STAT_BUCKETS)
+		bucket = CLD_STAT_BUCKETS - 1;
+
+	cld_stat_inc(&cs->cs_calls, 1);
+	if (failed)
+		cld_stat_inc(&cs->cs_failed, 1);
+	cld_stat_inc(&cs->cs_usecs, usecs);
+	cld_stat_inc(&cs->cs_hist[bucket], 1);
+	max = cld_stat_get(&cs->cs_max);
+	while (usecs > max &&
+	       !__atomic_compare_exchange_n(&cs->cs_max, &max, usecs, 1,
+					    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+/* Count a commit that sends @held downcalls */
+void
+cld_stats_group(unsigned int held)
+{
+	group_commits++;
+	group_changes += held;
+	if (held > group_max)
+		group_max = held;
+}
+
+/* Note that @queued upcalls wait for the commit in flight */
+void
+cld_stats_queued(unsigned int queued)
+{
+	if (queued > queued_max)
+		queued_max = queued;
+}
+
+/* Note the start of a grace period, or its end if !@in_grace */
+void
+cld_stats_grace(bool in_grace)
+{
+	unsigned long long now = cld_stats_clock();
+
+	if (in_grace) {
+		if (!grace_start)
+			grace_start = now;
+		return;
+	}
+	if (grace_start) {
+		grace_periods++;
+		grace_usecs += now - grace_start;
+		grace_start = 0;
+	}
+}
+
+/* Write the statistics to @path, by way of a temporary file */
+void
+cld_stats_write(const char *path)
+{
+	char tmp[PATH_MAX];
+	struct cld_stat *cs;
+	FILE *fp;
+	int i, j;
+
+	if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp))
+		return;
+	fp = fopen(tmp, "w");
+	if (fp == NULL) {
+		xlog(L_WARNING, "Unable to write %s: %m", tmp);
+		return;
+	}
+	fprintf(fp, "# name calls failed total_us max_us, then the number\n"
+		    "# of calls that took less than 1, 2, 4 ... %u us, and longer\n",
+		1U << (CLD_STAT_BUCKETS - 2));
+	for (i = 0; i < CSTAT_MAX; i++) {
+		cs = &cld_stats[i];
+		fprintf(fp, "%s %lu %lu %lu %lu", cs->cs_name,
+			cld_stat_get(&cs->cs_calls),
+			cld_stat_get(&cs->cs_failed),
+			cld_stat_get(&cs->cs_usecs),
+			cld_stat_get(&cs->cs_max));
+		for (j = 0; j < CLD_STAT_BUCKETS; j++)
+			fprintf(fp, " %lu", cld_stat_get(&cs->cs_hist[j]));
+		fputc('\n', fp);
+	}
+	fprintf(fp, "# groups commits changes largest, then the most upcalls "
+		    "queued behind a commit\n");
+	fprintf(fp, "groups %lu %lu %lu %lu\n", group_commits, group_changes,
+		group_max, queued_max);
+	fprintf(fp, "# grace periods total_us, then us in the current one\n");
+	fprintf(fp, "grace %lu %lu %llu\n", grace_periods, grace_usecs,
+		grace_start ? cld_stats_clock() - grace_start : 0ULL);
+	if (fclose(fp) != 0 || rename(tmp, path) != 0) {
+		xlog(L_WARNING, "Unable to write %s: %m", path);
+		unlink(tmp);
+	}
+}
@@ -0,0 +1,42 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef _CLD_STATS_H_
+#define _CLD_STATS_H_
+
+#include <stdbool.h>
+
+/* one per upcall type, in cld_command order, then the work they wait for */
+enum cld_stat_id {
+	CSTAT_CREATE,
+	CSTAT_REMOVE,
+	CSTAT_CHECK,
+	CSTAT_GRACEDONE,
+	CSTAT_GRACESTART,
+	CSTAT_GETVERSION,
+	CSTAT_COMMIT,
+	CSTAT_MAX
+};
+
+unsigned long long cld_stats_clock(void);
+void cld_stats_add(unsigned int id, unsigned long long start, bool failed);
+void cld_stats_group(unsigned int held);
+void cld_stats_queued(unsigned int queued);
+void cld_stats_grace(bool in_grace);
+void cld_stats_write(const char *path);
+
+#endif /* _CLD_STATS_H_ */
@@ -30,6 +30,7 @@
 #include <stdbool.h>
 #include <getopt.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <fcntl.h>
@@ -39,6 +40,11 @@
 #include <sys/inotify.h>
 #include <dirent.h>
 #include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
 #ifdef HAVE_SYS_CAPABILITY_H
 #include <sys/prctl.h>
 #include <sys/capability.h>
@@ -57,6 +63,15 @@
 /* defined by RFC 3530 */
 #define NFS4_OPAQUE_LIMIT	1024
 
+/* the persistent helper listens here, under the storagedir */
+#define CLTRACK_HELPER_SOCK	"helper.sock"
+
+/* largest request a helper accepts: command, arg and environment */
+#define CLTRACK_HELPER_MSGMAX	(4 * NFS4_OPAQUE_LIMIT + 2 * PATH_MAX)
+
+/* seconds to wait for a request, or for the helper's answer to one */
+#define CLTRACK_HELPER_TIMEOUT	10
+
 /* private data structures */
 struct cltrack_cmd {
 	char *name;
@@ -78,6 +93,7 @@ static struct option longopts[] =
 	{ "debug", 0, NULL, 'd' },
 	{ "foreground", 0, NULL, 'f' },
 	{ "storagedir", 1, NULL, 's' },
+	{ "persistent", 0, NULL, 'p' },
 	{ NULL, 0, 0, 0 },
 };
 
@@ -96,10 +112,22 @@ static char *storagedir = CLD_DEFAULT_STORAGEDIR;
 /* common buffer for holding id4 blobs */
 static unsigned char blob[NFS4_OPAQUE_LIMIT];
 
+/* the environment that the kernel passes along with a command */
+static const char *helper_env[] = {
+	"NFSDCLTRACK_GRACE_START",
+	"NFSDCLTRACK_CLIENT_HAS_SESSION",
+	"NFSDCLTRACK_LEGACY_RECDIR",
+	"NFSDCLTRACK_LEGACY_TOPDIR",
+	NULL,
+};
+
+static volatile sig_atomic_t helper_exit;
+
 static void
 usage(char *progname)
 {
 	printf("Usage: %s [ -hfd ] [ -s dir ] < cmd > < arg >\n", progname);
+	printf("       %s [ -fd ] [ -s dir ] -p\n", progname);
 	printf("Where < cmd > is one of the following and takes the following < arg >:\n");
 	printf("    init\n");
 	printf("    create <nfs_client_id4>\n");
@@ -215,29 +243,6 @@ cltrack_set_caps(void)
 	return ret;
 }
 
-/* Inform the kernel that it's OK to lift nfsd's grace period */
-static void
-cltrack_lift_grace_period(void)
-{
-	int fd;
-
-	fd = open(NFSD_END_GRACE_FILE, O_WRONLY);
-	if (fd < 0) {
-		/* Don't warn if file isn't present */
-		if (errno != ENOENT)
-			xlog(L_WARNING, "Unable to open %s: %m",
-				NFSD_END_GRACE_FILE);
-		return;
-	}
-
-	if (write(fd, "Y", 1) < 0)
-		xlog(L_WARNING, "Unable to write to %s: %m",
-				NFSD_END_GRACE_FILE);
-
-	close(fd);
-	return;
-}
-
 /*
  * Fetch the contents of the NFSDCLTRACK_GRACE_START env var. If it's not set
  * or there's an error converting it to time_t, then return LONG_MAX.
@@ -261,6 +266,56 @@ cltrack_get_grace_start(void)
 	return grace_start;
 }
 
+/* Has nfsd's grace period already ended? */
+static bool
+cltrack_grace_ended(void)
+{
+	char c = 'N';
+	int fd;
+
+	fd = open(NFSD_END_GRACE_FILE, O_RDONLY);
+	if (fd < 0)
+		return false;
+	if (read(fd, &c, 1) != 1)
+		c = 'N';
+	close(fd);
+	return c == 'Y';
+}
+
+/*
+ * Inform the kernel that it's OK to lift nfsd's grace period, and log
+ * how long it lasted, unless it is over already.
+ */
+static void
+cltrack_lift_grace_period(void)
+{
+	time_t grace_start = cltrack_get_grace_start();
+	int fd;
+
+	if (cltrack_grace_ended())
+		return;
+
+	fd = open(NFSD_END_GRACE_FILE, O_WRONLY);
+	if (fd < 0) {
+		/* Don't warn if file isn't present */
+		if (errno != ENOENT)
+			xlog(L_WARNING, "Unable to open %s: %m",
+				NFSD_END_GRACE_FILE);
+		return;
+	}
+
+	if (write(fd, "Y", 1) < 0)
+		xlog(L_WARNING, "Unable to write to %s: %m",
+				NFSD_END_GRACE_FILE);
+	else if (grace_start != LONG_MAX)
+		xlog(L_NOTICE, "All clients have reclaimed; ending the grace "
+			"period %ld seconds after it started",
+			(long)(time(NULL) - grace_start));
+
+	close(fd);
+	return;
+}
+
 static bool
 cltrack_reclaims_complete(void)
 {
@@ -529,6 +584,8 @@ cltrack_gracedone(const char *timestr)
 	xlog(D_GENERAL, "%s: grace done. gracetime=%"PRIu64, __func__, gracetime);
 
 	ret = sqlite_remove_unreclaimed(gracetime);
+	if (!ret)
+		sqlite_checkpoint();
 
 	cltrack_legacy_gracedone();
 
@@ -550,16 +607,274 @@ find_cmd(char *cmdname)
 			__func__, cmdname);
 	return NULL;
 }
+/*
+ * Short-lived invocations hand their command to a persistent helper
+ * ("nfsdcltrack -p") over a unix socket in the storagedir, if one is
+ * running there, so that the database is opened once rather than for
+ * every upcall.  A request is the command, its argument and then the
+ * name and value of each variable in helper_env[] that is set, all as
+ * NUL-terminated strings.  The helper answers with the command's
+ * result as an int32_t.
+ */
+static int
+cltrack_helper_addr(struct sockaddr_un *addr)
+{
+	int ret;
+
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	ret = snprintf(addr->sun_path, sizeof(addr->sun_path), "%s/%s",
+			storagedir, CLTRACK_HELPER_SOCK);
+	if (ret < 0 || (size_t)ret >= sizeof(addr->sun_path))
+		return -ENAMETOOLONG;
+	return 0;
+}
+
+static bool
+cltrack_helper_put(char *msg, size_t *len, const char *str)
+{
+	size_t n = strlen(str) + 1;
+
+	if (*len + n > CLTRACK_HELPER_MSGMAX)
+		return false;
+	memcpy(msg + *len, str, n);
+	*len += n;
+	return true;
+}
+
+/*
+ * Returns true and sets @status if the helper ran the command, or false
+ * if it should be run here.  All of the commands can be repeated
+ * safely, so one that a helper stopped answering partway through is
+ * simply run again.
+ */
+static bool
+cltrack_forward(const char *name, const char *arg, int *status)
+{
+	char msg[CLTRACK_HELPER_MSGMAX];
+	struct timeval tv = { CLTRACK_HELPER_TIMEOUT, 0 };
+	struct sockaddr_un addr;
+	const char **env;
+	size_t len = 0, sent;
+	int32_t res;
+	ssize_t n;
+	char *val;
+	int fd;
+
+	if (cltrack_helper_addr(&addr))
+		return false;
+
+	if (!cltrack_helper_put(msg, &len, name) ||
+	    !cltrack_helper_put(msg, &len, arg ? arg : ""))
+		return false;
+	for (env = helper_env; *env; env++) {
+		val = getenv(*env);
+		if (!val)
+			continue;
+		if (!cltrack_helper_put(msg, &len, *env) ||
+		    !cltrack_helper_put(msg, &len, val))
+			return false;
+	}
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return false;
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+	    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) ||
+	    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)))
+		goto out_close;
+
+	for (sent = 0; sent < len; sent += (size_t)n) {
+		n = send(fd, msg + sent, len - sent, MSG_NOSIGNAL);
+		if (n < 0)
+			goto out_fail;
+	}
+	shutdown(fd, SHUT_WR);
+
+	n = recv(fd, &res, sizeof(res), MSG_WAITALL);
+	if (n != sizeof(res))
+		goto out_fail;
+	close(fd);
+
+	xlog(D_GENERAL, "%s: helper ran %s: %d", __func__, name, res);
+	*status = res;
+	return true;
+
+out_fail:
+	xlog(L_WARNING, "%s: helper did not answer %s, running it here",
+		__func__, name);
+out_close:
+	close(fd);
+	return false;
+}
+
+/* Run one request from a short-lived invocation on @fd */
+static void
+cltrack_helper_serve(int fd)
+{
+	char msg[CLTRACK_HELPER_MSGMAX + 1];
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	socklen_t credlen = sizeof(struct ucred);
+	struct cltrack_cmd *cmd;
+	struct ucred cred;
+	char *p, *end, *name, *arg, *val;
+	const char **env;
+	size_t len = 0;
+	int32_t res;
+	ssize_t n;
+
+	cred.uid = (uid_t)-1;
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &credlen) ||
+	    cred.uid != geteuid()) {
+		xlog(L_WARNING, "%s: refusing request from uid %u", __func__,
+			(unsigned int)cred.uid);
+		return;
+	}
+
+	for (;;) {
+		if (poll(&pfd, 1, CLTRACK_HELPER_TIMEOUT * 1000) <= 0)
+			return;
+		n = read(fd, msg + len, sizeof(msg) - len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return;
+		}
+		if (n == 0)
+			break;
+		len += (size_t)n;
+		if (len > CLTRACK_HELPER_MSGMAX)
+			return;
+	}
+	if (len == 0 || msg[len - 1] != '\0')
+		return;
+
+	end = msg + len;
+	name = msg;
+	arg = name + strlen(name) + 1;
+	if (arg >= end)
+		return;
+
+	for (env = helper_env; *env; env++)
+		unsetenv(*env);
+	for (p = arg + strlen(arg) + 1; p < end; p = val + strlen(val) + 1) {
+		val = p + strlen(p) + 1;
+		if (val >= end)
+			return;
+		for (env = helper_env; *env; env++)
+			if (!strcmp(p, *env))
+				setenv(*env, val, 1);
+	}
+
+	cmd = find_cmd(name);
+	if (!cmd)
+		res = -ENOSYS;
+	else if (cmd->needs_arg && !*arg)
+		res = -EINVAL;
+	else
+		res = cmd->func(cmd->needs_arg ? arg : NULL);
+
+	if (send(fd, &res, sizeof(res), MSG_NOSIGNAL) != sizeof(res))
+		xlog(L_WARNING, "%s: unable to answer %s: %m", __func__, name);
+}
+
+static void
+cltrack_helper_sig(int __attribute__((unused)) sig)
+{
+	helper_exit = 1;
+}
+
+/* Serve upcalls from short-lived invocations until signalled */
+static int
+cltrack_helper(void)
+{
+	struct sockaddr_un addr;
+	struct sigaction sa;
+	mode_t mask;
+	int fd, conn, ret;
+
+	ret = cltrack_helper_addr(&addr);
+	if (ret) {
+		xlog(L_ERROR, "Storage directory %s is too long for the "
+			      "helper's socket path", storagedir);
+		return ret;
+	}
+
+	/* this also creates the storagedir if need be */
+	ret = sqlite_prepare_dbh(storagedir);
+	if (ret) {
+		xlog(L_ERROR, "Failed to init database: %d", ret);
+		return -EACCES;
+	}
+
+	/* refuse to take over from a helper that is still answering */
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -errno;
+	if (!connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+		xlog(L_ERROR, "A helper is already listening on %s",
+			addr.sun_path);
+		close(fd);
+		return -EADDRINUSE;
+	}
+	close(fd);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -errno;
+	unlink(addr.sun_path);
+	mask = umask(077);
+	ret = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+	umask(mask);
+	if (ret || listen(fd, SOMAXCONN)) {
+		ret = -errno;
+		xlog(L_ERROR, "Unable to listen on %s: %m", addr.sun_path);
+		close(fd);
+		return ret;
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = cltrack_helper_sig;
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
+	sa.sa_handler = SIG_IGN;
+	sigaction(SIGPIPE, &sa, NULL);
+
+	xlog(L_NOTICE, "Listening for upcalls on %s", addr.sun_path);
+	while (!helper_exit) {
+		conn = accept4(fd, NULL, NULL, SOCK_CLOEXEC);
+		if (conn < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			ret = -errno;
+			xlog(L_ERROR, "Unable to accept on %s: %m",
+				addr.sun_path);
+			break;
+		}
+		cltrack_helper_serve(conn);
+		close(conn);
+	}
+
+	unlink(addr.sun_path);
+	close(fd);
+	return ret;
+}
+
 inline static void 
 read_nfsdcltrack_conf(void)
 {
 	char *val;
+	bool wal;
 
 	conf_init_file(NFS_CONFFILE); 
 	xlog_set_debug("nfsdcltrack");
 	val = conf_get_str("nfsdcltrack", "storagedir");
 	if (val)
 		storagedir = val;
+	val = conf_get_str("nfsdcltrack", "journal-mode");
+	wal = val && strcasecmp(val, "wal") == 0;
+	val = conf_get_str("nfsdcltrack", "synchronous");
+	sqlite_set_journal(wal, val && strcasecmp(val, "normal") == 0);
 }
 int
 main(int argc, char **argv)
@@ -568,6 +883,7 @@ main(int argc, char **argv)
 	int rc = 0;
 	char *progname, *cmdarg = NULL;
 	struct cltrack_cmd *cmd;
+	bool persistent = false;
 
 	progname = basename(argv[0]);
 
@@ -578,7 +894,7 @@ main(int argc, char **argv)
 	read_nfsdcltrack_conf();
 
 	/* process command-line options */
-	while ((arg = getopt_long(argc, argv, "hdfs:", longopts,
+	while ((arg = getopt_long(argc, argv, "hdfs:p", longopts,
 				  NULL)) != EOF) {
 		switch (arg) {
 		case 'd':
@@ -591,6 +907,9 @@ main(int argc, char **argv)
 		case 's':
 			storagedir = optarg;
 			break;
+		case 'p':
+			persistent = true;
+			break;
 		default:
 			usage(progname);
 			return 1;
@@ -599,6 +918,13 @@ main(int argc, char **argv)
 
 	xlog_open(progname);
 
+	if (persistent) {
+		rc = cltrack_set_caps();
+		if (!rc)
+			rc = cltrack_helper();
+		goto out;
+	}
+
 	/* we expect a command, at least */
 	if (optind >= argc) {
 		xlog(L_ERROR, "Missing command name\n");
@@ -633,7 +959,8 @@ main(int argc, char **argv)
 		}
 		cmdarg = argv[optind + 1];
 	}
-	rc = cmd->func(cmdarg);
+	if (!cltrack_forward(cmd->name, cmdarg, &rc))
+		rc = cmd->func(cmdarg);
 out:
 	return rc;
 }
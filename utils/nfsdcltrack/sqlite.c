@@ -69,6 +69,10 @@ static char buf[PATH_MAX];
 /* global database handle */
 static sqlite3 *dbh;
 
+/* journal settings */
+static int journal_wal;
+static int journal_sync_normal;
+
 /* forward declarations */
 
 /* make a directory, ignoring EEXIST errors unless it's not a directory */
@@ -294,6 +298,92 @@ rollback:
 	goto out;
 }
 
+static int
+sqlite_journal_mode_cb(void *arg, int ncols, char **cols,
+			char **colnames __attribute__ ((unused)))
+{
+	int *wal = arg;
+
+	if (ncols == 1 && cols[0])
+		*wal = !strcmp(cols[0], "wal");
+	return 0;
+}
+
+/*
+ * Apply the journal settings chosen with sqlite_set_journal().  Each
+ * upcall runs in a process of its own, so the write-ahead log is not
+ * checkpointed on close, but when it grows large or grace ends.
+ */
+static int
+sqlite_setup_journal(void)
+{
+	int ret, wal = 0;
+	char *err = NULL;
+
+	ret = sqlite3_exec(dbh, journal_wal ? "PRAGMA journal_mode = WAL;" :
+				"PRAGMA journal_mode = DELETE;",
+				sqlite_journal_mode_cb, &wal, &err);
+	if (ret != SQLITE_OK) {
+		xlog(L_ERROR, "Unable to set journal mode: %s", err);
+		sqlite3_free(err);
+		return ret;
+	}
+	if (journal_wal && !wal) {
+		xlog(L_WARNING, "Unable to use a write-ahead log, using the "
+				"rollback journal");
+		journal_wal = 0;
+	}
+
+	ret = sqlite3_exec(dbh, journal_wal && journal_sync_normal ?
+				"PRAGMA synchronous = NORMAL;" :
+				"PRAGMA synchronous = FULL;", NULL, NULL, &err);
+	if (ret != SQLITE_OK) {
+		xlog(L_ERROR, "Unable to set synchronous level: %s", err);
+		sqlite3_free(err);
+		return ret;
+	}
+
+#ifdef SQLITE_DBCONFIG_NO_CKPT_ON_CLOSE
+	if (journal_wal)
+		sqlite3_db_config(dbh, SQLITE_DBCONFIG_NO_CKPT_ON_CLOSE, 1,
+				  NULL);
+#endif
+	return SQLITE_OK;
+}
+
+/*
+ * Choose the journal that sqlite_prepare_dbh() sets up: a write-ahead log
+ * if @wal, else the rollback journal.  If @sync_normal, commits to the
+ * write-ahead log are not synced, and only checkpoints are.
+ */
+void
+sqlite_set_journal(const int wal, const int sync_normal)
+{
+	journal_wal = wal;
+	journal_sync_normal = sync_normal;
+}
+
+/*
+ * Copy the changes in the write-ahead log back into the database
+ *
+ * Returns a non-zero sqlite error code, or SQLITE_OK (aka 0)
+ */
+int
+sqlite_checkpoint(void)
+{
+	int ret;
+
+	if (!journal_wal)
+		return SQLITE_OK;
+
+	ret = sqlite3_wal_checkpoint_v2(dbh, NULL, SQLITE_CHECKPOINT_TRUNCATE,
+					NULL, NULL);
+	if (ret != SQLITE_OK)
+		xlog(L_ERROR, "%s: checkpoint failed: %s", __func__,
+				sqlite3_errmsg(dbh));
+	return ret;
+}
+
 /* Open the database and set up the database handle for it */
 int
 sqlite_prepare_dbh(const char *topdir)
@@ -332,6 +422,10 @@ sqlite_prepare_dbh(const char *topdir)
 		goto out_close;
 	}
 
+	ret = sqlite_setup_journal();
+	if (ret)
+		goto out_close;
+
 	ret = sqlite_query_schema_version();
 	switch (ret) {
 	case CLTRACK_SQLITE_LATEST_SCHEMA_VERSION:
@@ -28,5 +28,7 @@ int sqlite_check_client(const unsigned char *clname, const size_t namelen,
 				const bool has_session);
 int sqlite_remove_unreclaimed(const uint64_t grace_start);
 int sqlite_query_reclaiming(const time_t grace_start);
+void sqlite_set_journal(const int wal, const int sync_normal);
+int sqlite_checkpoint(void);
 
 #endif /* _SQLITE_H */
@@ -0,0 +1,400 @@
+/*
+ * utils/nfsidmap/mapcache.c
+ *
+ * nfsidmap runs once for each key the kernel can't find, and most of
+ * its time goes to loading the configuration and the translation
+ * plugins.  The results it hands the kernel are therefore also kept in
+ * a file under the state directory, which the next nfsidmap processes
+ * map and search before doing any of that.
+ *
+ * The file is a table of fixed size slots, four to a bucket.  Readers
+ * take no lock: each slot has a sequence count that its writer makes
+ * odd while it changes the slot, and a reader that sees the count
+ * change while it copies the slot treats it as a miss.  Writers
+ * serialize on a lock on the file.  The file records the configuration
+ * it was made under; once that changes, or its size or lifetime do,
+ * readers ignore it and the next writer replaces it with an empty one.
+ * Replacing it by renaming means readers that have the old one mapped
+ * never see it shrink.
+ *
+ * The cache is configured in the [nfsidmap] section of idmapd.conf,
+ * and is off unless Cache-TTL is set.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <stdint.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+
+#include "xlog.h"
+#include "conffile.h"
+#include "mapcache.h"
+
+#define MAPCACHE_FILE	NFS_STATEDIR "/nfsidmap.cache"
+#define MAPCACHE_MAGIC	0x6e69646d	/* "nidm" */
+#define MAPCACHE_VERS	1
+#define MAPCACHE_WAYS	4		/* slots to a bucket */
+#define MAPCACHE_SIZE	4096		/* default slots */
+
+struct mapcache_stamp {
+	uint64_t	ino;
+	uint64_t	size;
+	int64_t		mtime;		/* of the file, in ns */
+	int64_t		dmtime;		/* of its .d directory, in ns */
+};
+
+struct mapcache_hdr {
+	uint32_t		magic;
+	uint32_t		vers;
+	uint32_t		nslots;
+	uint32_t		ttl;
+	struct mapcache_stamp	stamp;
+};
+
+struct mapcache_slot {
+	uint32_t	seq;		/* odd while being written */
+	uint32_t	hash;
+	int64_t		expires;
+	char		key[MAPCACHE_KEYSZ];
+	char		val[MAPCACHE_VALSZ];
+};
+
+static size_t mapcache_len(uint32_t nslots)
+{
+	return sizeof(struct mapcache_hdr) +
+		(size_t)nslots * sizeof(struct mapcache_slot);
+}
+
+static uint32_t mapcache_hash(const char *s)
+{
+	uint32_t h = 2166136261u;
+
+	for (; *s; s++)
+		h = (h ^ (unsigned char)*s) * 16777619u;
+	return h;
+}
+
+static int64_t mapcache_mtime(const struct stat *st)
+{
+	return st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec;
+}
+
+/* Identify the configuration in @conffile, and in its .d directory */
+static void mapcache_get_stamp(const char *conffile,
+			       struct mapcache_stamp *stamp)
+{
+	char dname[PATH_MAX];
+	struct stat st;
+
+	memset(stamp, 0, sizeof(*stamp));
+	if (stat(conffile, &st) == 0) {
+		stamp->ino = st.st_ino;
+		stamp->size = st.st_size;
+		stamp->mtime = mapcache_mtime(&st);
+	}
+	snprintf(dname, sizeof(dname), "%s.d", conffile);
+	if (stat(dname, &st) == 0)
+		stamp->dmtime = mapcache_mtime(&st);
+}
+
+static struct mapcache_slot *mapcache_bucket(struct mapcache_hdr *hdr,
+					     uint32_t hash)
+{
+	struct mapcache_slot *slots = (struct mapcache_slot *)(hdr + 1);
+	uint32_t nbuckets = hdr->nslots / MAPCACHE_WAYS;
+
+	return &slots[(hash & (nbuckets - 1)) * MAPCACHE_WAYS];
+}
+
+/*
+ * Map the cache file, if there is one made under the configuration
+ * @stamp describes.  A @stamp of NULL maps any valid file.
+ */
+static struct mapcache_hdr *mapcache_map(int fd, int prot,
+					 const struct mapcache_stamp *stamp,
+					 size_t *lenp)
+{
+	struct mapcache_hdr *hdr;
+	struct stat st;
+	size_t len;
+
+	if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) ||
+	    (size_t)st.st_size < sizeof(*hdr))
+		return NULL;
+	len = st.st_size;
+	hdr = mmap(NULL, len, prot, MAP_SHARED, fd, 0);
+	if (hdr == MAP_FAILED)
+		return NULL;
+	if (hdr->magic != MAPCACHE_MAGIC || hdr->vers != MAPCACHE_VERS ||
+	    hdr->nslots < MAPCACHE_WAYS ||
+	    (hdr->nslots & (hdr->nslots - 1)) != 0 ||
+	    mapcache_len(hdr->nslots) != len ||
+	    (stamp && memcmp(&hdr->stamp, stamp, sizeof(*stamp)) != 0)) {
+		munmap(hdr, len);
+		return NULL;
+	}
+	*lenp = len;
+	return hdr;
+}
+
+/**
+ * mapcache_lookup - find the result of an earlier upcall
+ * @conffile: the configuration file the result must have been found under
+ * @desc: the description of the key being instantiated, "type:value"
+ * @val: filled in with the result
+ * @len: size of @val
+ *
+ * Returns 1 if a result was found, otherwise zero.
+ */
+int mapcache_lookup(const char *conffile, const char *desc,
+		    char *val, size_t len)
+{
+	struct mapcache_stamp stamp;
+	struct mapcache_slot *slot, copy;
+	struct mapcache_hdr *hdr;
+	uint32_t hash, seq;
+	size_t maplen;
+	time_t now;
+	int fd, i, found = 0;
+
+	if (strlen(desc) >= MAPCACHE_KEYSZ)
+		return 0;
+	fd = open(MAPCACHE_FILE, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd < 0)
+		return 0;
+	mapcache_get_stamp(conffile, &stamp);
+	hdr = mapcache_map(fd, PROT_READ, &stamp, &maplen);
+	close(fd);
+	if (!hdr)
+		return 0;
+
+	hash = mapcache_hash(desc);
+	now = time(NULL);
+	slot = mapcache_bucket(hdr, hash);
+	for (i = 0; i < MAPCACHE_WAYS; i++, slot++) {
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		if ((seq & 1) || slot->hash != hash)
+			continue;
+		memcpy(&copy, slot, sizeof(copy));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq)
+			continue;
+		copy.key[MAPCACHE_KEYSZ - 1] = '\0';
+		copy.val[MAPCACHE_VALSZ - 1] = '\0';
+		if (strcmp(copy.key, desc) != 0 || copy.expires <= now ||
+		    copy.expires > now + hdr->ttl)
+			continue;
+		if (strlen(copy.val) < len) {
+			strcpy(val, copy.val);
+			found = 1;
+		}
+		break;
+	}
+	munmap(hdr, maplen);
+	return found;
+}
+
+/*
+ * Write an empty cache file for @stamp, and rename it into place.
+ * Returns the new file, locked, or -1.
+ */
+static int mapcache_create(const struct mapcache_stamp *stamp,
+			   uint32_t nslots, uint32_t ttl)
+{
+	char tmpname[] = MAPCACHE_FILE ".XXXXXX";
+	struct mapcache_hdr hdr;
+	int fd;
+
+	fd = mkostemp(tmpname, O_CLOEXEC);
+	if (fd < 0) {
+		xlog_err("mapcache: can't create %s: %m", tmpname);
+		return -1;
+	}
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = MAPCACHE_MAGIC;
+	hdr.vers = MAPCACHE_VERS;
+	hdr.nslots = nslots;
+	hdr.ttl = ttl;
+	hdr.stamp = *stamp;
+	if (flock(fd, LOCK_EX) < 0 ||
+	    ftruncate(fd, mapcache_len(nslots)) < 0 ||
+	    pwrite(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+	    rename(tmpname, MAPCACHE_FILE) < 0) {
+		xlog_err("mapcache: can't write %s: %m", MAPCACHE_FILE);
+		close(fd);
+		unlink(tmpname);
+		return -1;
+	}
+	return fd;
+}
+
+/* Open and lock the cache file in place now, creating it if @create */
+static int mapcache_open_locked(int create)
+{
+	struct stat st, pst;
+	int fd, flags = O_RDWR | O_NOFOLLOW | O_CLOEXEC;
+
+	for (;;) {
+		fd = open(MAPCACHE_FILE, flags | (create ? O_CREAT : 0), 0600);
+		if (fd < 0)
+			return -1;
+		if (flock(fd, LOCK_EX) < 0) {
+			close(fd);
+			return -1;
+		}
+		/* it may have been replaced while we waited */
+		if (fstat(fd, &st) == 0 && stat(MAPCACHE_FILE, &pst) == 0 &&
+		    st.st_ino == pst.st_ino && st.st_dev == pst.st_dev)
+			return fd;
+		close(fd);
+	}
+}
+
+static int mapcache_size(void)
+{
+	int size = conf_get_num("nfsidmap", "Cache-Size", MAPCACHE_SIZE);
+	int nslots = MAPCACHE_WAYS * 16;
+
+	while (nslots < size && nslots < (1 << 20))
+		nslots <<= 1;
+	return nslots;
+}
+
+/**
+ * mapcache_store - keep the result of an upcall for later ones
+ * @conffile: the configuration file the result was found under
+ * @desc: the description of the key instantiated, "type:value"
+ * @val: the result
+ *
+ * The configuration must have been loaded from @conffile.
+ */
+void mapcache_store(const char *conffile, const char *desc, const char *val)
+{
+	int ttl = conf_get_num("nfsidmap", "Cache-TTL", 0);
+	struct mapcache_slot *slot, *victim;
+	struct mapcache_stamp stamp;
+	struct mapcache_hdr *hdr;
+	uint32_t hash, nslots;
+	size_t maplen;
+	time_t now;
+	int fd, i;
+
+	if (ttl <= 0) {
+		/* don't leave results around for when it's turned on again */
+		if (unlink(MAPCACHE_FILE) == 0)
+			xlog(D_GENERAL, "mapcache: removed %s", MAPCACHE_FILE);
+		return;
+	}
+	if (strlen(desc) >= MAPCACHE_KEYSZ || strlen(val) >= MAPCACHE_VALSZ)
+		return;
+
+	fd = mapcache_open_locked(1);
+	if (fd < 0) {
+		xlog_err("mapcache: can't open %s: %m", MAPCACHE_FILE);
+		return;
+	}
+	mapcache_get_stamp(conffile, &stamp);
+	nslots = mapcache_size();
+	hdr = mapcache_map(fd, PROT_READ | PROT_WRITE, &stamp, &maplen);
+	if (hdr && (hdr->nslots != nslots || hdr->ttl != (uint32_t)ttl)) {
+		munmap(hdr, maplen);
+		hdr = NULL;
+	}
+	if (!hdr) {
+		/* writers waiting for the old file will find the new one */
+		int nfd = mapcache_create(&stamp, nslots, ttl);
+
+		if (nfd < 0)
+			goto out;
+		close(fd);
+		fd = nfd;
+		hdr = mapcache_map(fd, PROT_READ | PROT_WRITE, &stamp, &maplen);
+		if (!hdr)
+			goto out;
+	}
+
+	hash = mapcache_hash(desc);
+	now = time(NULL);
+	slot = victim = mapcache_bucket(hdr, hash);
+	for (i = 0; i < MAPCACHE_WAYS; i++, slot++) {
+		if (slot->hash == hash &&
+		    strncmp(slot->key, desc, MAPCACHE_KEYSZ) == 0) {
+			victim = slot;
+			break;
+		}
+		if (slot->expires < victim->expires)
+			victim = slot;
+	}
+
+	__atomic_store_n(&victim->seq, victim->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	victim->hash = hash;
+	victim->expires = now + ttl;
+	strcpy(victim->key, desc);
+	strcpy(victim->val, val);
+	__atomic_store_n(&victim->seq, victim->seq + 1, __ATOMIC_RELEASE);
+	munmap(hdr, maplen);
+out:
+	close(fd);
+}
+
+/**
+ * mapcache_invalidate - forget results for the given name
+ * @conffile: the configuration file in use
+ * @prefix: the type of key, "uid:" or "gid:"
+ * @name: the start of the value to forget results for
+ */
+void mapcache_invalidate(const char *conffile, const char *prefix,
+			 const char *name)
+{
+	struct mapcache_stamp stamp;
+	struct mapcache_slot *slot;
+	struct mapcache_hdr *hdr;
+	size_t maplen, plen = strlen(prefix);
+	uint32_t i;
+	int fd;
+
+	fd = mapcache_open_locked(0);
+	if (fd < 0)
+		return;
+	mapcache_get_stamp(conffile, &stamp);
+	hdr = mapcache_map(fd, PROT_READ | PROT_WRITE, &stamp, &maplen);
+	if (!hdr)
+		goto out;
+	slot = (struct mapcache_slot *)(hdr + 1);
+	for (i = 0; i < hdr->nslots; i++, slot++) {
+		if (slot->expires == 0 ||
+		    strncmp(slot->key, prefix, plen) != 0 ||
+		    strncmp(slot->key + plen, name, strlen(name)) != 0)
+			continue;
+		__atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_RELEASE);
+		slot->expires = 0;
+		__atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELEASE);
+	}
+	munmap(hdr, maplen);
+out:
+	close(fd);
+}
+
+/**
+ * mapcache_clear - forget all results
+ */
+void mapcache_clear(void)
+{
+	if (unlink(MAPCACHE_FILE) < 0 && errno != ENOENT)
+		xlog_err("mapcache: can't remove %s: %m", MAPCACHE_FILE);
+}
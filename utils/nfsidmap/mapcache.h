@@ -0,0 +1,22 @@
+/*
+ * utils/nfsidmap/mapcache.h
+ *
+ * Results of earlier upcalls, shared by nfsidmap processes.
+ */
+
+#ifndef NFSIDMAP_MAPCACHE_H
+#define NFSIDMAP_MAPCACHE_H
+
+#include <stddef.h>
+
+#define MAPCACHE_KEYSZ	192
+#define MAPCACHE_VALSZ	128
+
+int mapcache_lookup(const char *conffile, const char *desc,
+		    char *val, size_t len);
+void mapcache_store(const char *conffile, const char *desc, const char *val);
+void mapcache_invalidate(const char *conffile, const char *prefix,
+			 const char *name);
+void mapcache_clear(void);
+
+#endif	/* NFSIDMAP_MAPCACHE_H */
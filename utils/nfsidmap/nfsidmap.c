@@ -12,13 +12,19 @@
 #include <keyutils.h>
 #include <nfsidmap.h>
 
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <time.h>
 #include <unistd.h>
 #include "xlog.h"
 #include "conffile.h"
 #include "xcommon.h"
+#include "mapcache.h"
 
 int verbose = 0;
-#define USAGE "Usage: %s [-vh] [-c || [-u|-g|-r key] || -d || -l || [-t timeout] key desc]"
+#define USAGE "Usage: %s [-vh] [-c || [-u|-g|-r key] || -d || -l || [-t timeout] -p [list] || [-t timeout] key desc]"
 
 #define MAX_ID_LEN   11
 #define IDMAP_NAMESZ 128
@@ -37,6 +43,8 @@ int verbose = 0;
 #define UIDKEYS 0x1
 #define GIDKEYS 0x2
 
+#define PREFETCH_STAMP NFS_STATEDIR "/nfsidmap.prefetch"
+
 #ifndef HAVE_FIND_KEY_BY_TYPE_AND_DESC
 static key_serial_t find_key_by_type_and_desc(const char *type,
 		const char *desc, key_serial_t destringid)
@@ -188,30 +196,12 @@ static int list_keyring(const char *keyring)
 }
 
 /*
- * Find either a user or group id based on the name@domain string
+ * Instantiate the key with the given uid or gid
  */
-static int id_lookup(char *name_at_domain, key_serial_t key, int type)
+static int id_instantiate(key_serial_t key, const char *id)
 {
-	char id[MAX_ID_LEN];
-	uid_t uid = 0;
-	gid_t gid = 0;
-	int rc;
+	int rc = EXIT_SUCCESS;
 
-	if (type == USER) {
-		rc = nfs4_owner_to_uid(name_at_domain, &uid);
-		sprintf(id, "%u", uid);
-	} else {
-		rc = nfs4_group_owner_to_gid(name_at_domain, &gid);
-		sprintf(id, "%u", gid);
-	}
-	if (rc < 0) {
-		xlog_errno(rc, "id_lookup: %s: for %s failed: %m",
-			(type == USER ? "nfs4_owner_to_uid" : "nfs4_group_owner_to_gid"),
-			name_at_domain);
-		return EXIT_FAILURE;
-	}
-
-	rc = EXIT_SUCCESS;
 	if (keyctl_instantiate(key, id, strlen(id) + 1, 0)) {
 		switch (errno) {
 		case EDQUOT:
@@ -237,10 +227,53 @@ static int id_lookup(char *name_at_domain, key_serial_t key, int type)
 	return rc;
 }
 
+/*
+ * Instantiate the key with the given name@domain
+ */
+static int name_instantiate(key_serial_t key, const char *name)
+{
+	if (keyctl_instantiate(key, name, strlen(name), 0)) {
+		xlog_err("name_lookup: keyctl_instantiate failed: %m");
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
+
+/*
+ * Find either a user or group id based on the name@domain string
+ */
+static int id_lookup(char *name_at_domain, key_serial_t key, int type,
+		     const char *desc)
+{
+	char id[MAX_ID_LEN];
+	uid_t uid = 0;
+	gid_t gid = 0;
+	int rc;
+
+	if (type == USER) {
+		rc = nfs4_owner_to_uid(name_at_domain, &uid);
+		sprintf(id, "%u", uid);
+	} else {
+		rc = nfs4_group_owner_to_gid(name_at_domain, &gid);
+		sprintf(id, "%u", gid);
+	}
+	if (rc < 0) {
+		xlog_errno(rc, "id_lookup: %s: for %s failed: %m",
+			(type == USER ? "nfs4_owner_to_uid" : "nfs4_group_owner_to_gid"),
+			name_at_domain);
+		return EXIT_FAILURE;
+	}
+
+	rc = id_instantiate(key, id);
+	if (rc == EXIT_SUCCESS)
+		mapcache_store(PATH_IDMAPDCONF, desc, id);
+	return rc;
+}
+
 /*
  * Find the name@domain string from either a user or group id
  */
-static int name_lookup(char *id, key_serial_t key, int type)
+static int name_lookup(char *id, key_serial_t key, int type, const char *desc)
 {
 	char name[IDMAP_NAMESZ];
 	char domain[NFS4_MAX_DOMAIN_LEN];
@@ -269,12 +302,35 @@ static int name_lookup(char *id, key_serial_t key, int type)
 		return EXIT_FAILURE;
 	}
 
-	rc = EXIT_SUCCESS;
-	if (keyctl_instantiate(key, &name, strlen(name), 0)) {
-		rc = EXIT_FAILURE;
-		xlog_err("name_lookup: keyctl_instantiate failed: %m");
-	}
+	rc = name_instantiate(key, name);
+	if (rc == EXIT_SUCCESS)
+		mapcache_store(PATH_IDMAPDCONF, desc, name);
+	return rc;
+}
 
+/*
+ * Instantiate the key from the result of an earlier upcall, if one is
+ * cached, without loading the configuration and translation plugins.
+ * Returns -1 if none is.
+ */
+static int cached_lookup(key_serial_t key, const char *desc, int timeout)
+{
+	char val[MAPCACHE_VALSZ];
+	int rc;
+
+	if (!mapcache_lookup(PATH_IDMAPDCONF, desc, val, sizeof(val)))
+		return -1;
+	if (verbose)
+		xlog_warn("key: 0x%x desc: %s cached: %s timeout %d",
+			key, desc, val, timeout);
+
+	request_key("keyring", DEFAULT_KEYRING, NULL, KEY_SPEC_THREAD_KEYRING);
+	if (strncmp(desc, "uid:", 4) == 0 || strncmp(desc, "gid:", 4) == 0)
+		rc = id_instantiate(key, val);
+	else
+		rc = name_instantiate(key, val);
+	if (rc == EXIT_SUCCESS)
+		keyctl_set_timeout(key, timeout);
 	return rc;
 }
 
@@ -353,6 +409,269 @@ static int key_invalidate(char *keystr, int keymask)
 	return EXIT_FAILURE;
 }
 
+/*
+ * Prefetching resolves many accounts in one process and adds the keys
+ * the kernel would ask for, in both directions, to the keyring, so that
+ * their lookups need no upcall at all.
+ */
+struct prefetch {
+	key_serial_t ring;	/* 0 once keys cannot be added */
+	int timeout;
+	char domain[NFS4_MAX_DOMAIN_LEN];
+	unsigned int added;
+};
+
+static void prefetch_key(struct prefetch *pf, const char *desc,
+			 const char *val, size_t len)
+{
+	key_serial_t key;
+
+	mapcache_store(PATH_IDMAPDCONF, desc, val);
+	if (pf->ring <= 0)
+		return;
+
+	key = add_key("id_resolver", desc, val, len, pf->ring);
+	if (key < 0) {
+		xlog_warn("prefetch: add_key(%s) failed: %m", desc);
+		pf->ring = 0;
+		return;
+	}
+	keyctl_set_timeout(key, pf->timeout);
+	pf->added++;
+}
+
+static void prefetch_id(struct prefetch *pf, int type, unsigned int id)
+{
+	char name[IDMAP_NAMESZ], desc[MAPCACHE_KEYSZ], idstr[MAX_ID_LEN];
+	uid_t uid;
+	gid_t gid;
+	int rc;
+
+	if (type == USER)
+		rc = nfs4_uid_to_name(id, pf->domain, name, IDMAP_NAMESZ);
+	else
+		rc = nfs4_gid_to_name(id, pf->domain, name, IDMAP_NAMESZ);
+	if (rc)
+		return;
+	snprintf(desc, sizeof(desc), "%s:%u", type == USER ? "user" : "group",
+		 id);
+	prefetch_key(pf, desc, name, strlen(name));
+
+	/* the mapping back need not be the same id */
+	if (type == USER) {
+		rc = nfs4_name_to_uid(name, &uid);
+		id = uid;
+	} else {
+		rc = nfs4_name_to_gid(name, &gid);
+		id = gid;
+	}
+	if (rc || snprintf(desc, sizeof(desc), "%s:%s",
+			   type == USER ? "uid" : "gid", name) >= (int)sizeof(desc))
+		return;
+	sprintf(idstr, "%u", id);
+	prefetch_key(pf, desc, idstr, strlen(idstr) + 1);
+}
+
+static void prefetch_all(struct prefetch *pf, int type)
+{
+	unsigned int *ids = NULL, *new, n = 0, size = 0, i;
+	struct passwd *pw;
+	struct group *gr;
+
+	/* collect first: the lookups may use the same NSS modules */
+	for (;;) {
+		if (type == USER) {
+			if ((pw = getpwent()) == NULL)
+				break;
+		} else {
+			if ((gr = getgrent()) == NULL)
+				break;
+		}
+		if (n == size) {
+			size = size ? size * 2 : 256;
+			new = realloc(ids, size * sizeof(*ids));
+			if (new == NULL)
+				break;
+			ids = new;
+		}
+		ids[n++] = type == USER ? pw->pw_uid : gr->gr_gid;
+	}
+	if (type == USER)
+		endpwent();
+	else
+		endgrent();
+
+	for (i = 0; i < n; i++)
+		prefetch_id(pf, type, ids[i]);
+	free(ids);
+}
+
+/*
+ * Each line of @path is "user NAME" or "group NAME", where NAME is a
+ * local name, a name@domain or a numeric id.
+ */
+static int prefetch_list(struct prefetch *pf, const char *path)
+{
+	char line[IDMAP_NAMESZ + 16], *kind, *name, *end;
+	unsigned long id;
+	struct passwd *pw;
+	struct group *gr;
+	uid_t uid;
+	gid_t gid;
+	int type, rc;
+	FILE *fp;
+
+	if ((fp = fopen(path, "r")) == NULL) {
+		xlog_err("prefetch: fopen(%s) failed: %m", path);
+		return EXIT_FAILURE;
+	}
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		kind = strtok(line, " \t\n");
+		if (kind == NULL || *kind == '#')
+			continue;
+		name = strtok(NULL, " \t\n");
+		if (strcmp(kind, "user") == 0)
+			type = USER;
+		else if (strcmp(kind, "group") == 0)
+			type = GROUP;
+		else
+			name = NULL;
+		if (name == NULL) {
+			xlog_warn("prefetch: %s: unparsable line", path);
+			continue;
+		}
+
+		id = strtoul(name, &end, 10);
+		if (*end == '\0') {
+			prefetch_id(pf, type, id);
+			continue;
+		}
+		if (strchr(name, '@')) {
+			if (type == USER) {
+				rc = nfs4_name_to_uid(name, &uid);
+				id = uid;
+			} else {
+				rc = nfs4_name_to_gid(name, &gid);
+				id = gid;
+			}
+		} else if (type == USER) {
+			pw = getpwnam(name);
+			rc = pw == NULL;
+			id = pw ? pw->pw_uid : 0;
+		} else {
+			gr = getgrnam(name);
+			rc = gr == NULL;
+			id = gr ? gr->gr_gid : 0;
+		}
+		if (rc) {
+			xlog_warn("prefetch: %s: %s '%s' not found", path,
+				  kind, name);
+			continue;
+		}
+		prefetch_id(pf, type, id);
+	}
+	fclose(fp);
+	return EXIT_SUCCESS;
+}
+
+/*
+ * Only a process that possesses the id_resolver keyring can add keys to
+ * it, which outside an upcall nothing does; then only the results cached
+ * in the shared file are filled in.
+ */
+static int prefetch_keys(const char *list, int timeout, key_serial_t ring)
+{
+	struct prefetch pf = { .ring = ring, .timeout = timeout };
+	int rc;
+
+	rc = nfs4_get_default_domain(NULL, pf.domain, NFS4_MAX_DOMAIN_LEN);
+	if (rc) {
+		xlog_errno(rc, "prefetch: nfs4_get_default_domain failed: %m");
+		return EXIT_FAILURE;
+	}
+	if (pf.ring <= 0)
+		pf.ring = request_key("keyring", DEFAULT_KEYRING, NULL,
+				      KEY_SPEC_THREAD_KEYRING);
+	if (pf.ring <= 0) {
+		if (conf_get_num("nfsidmap", "Cache-TTL", 0) <= 0) {
+			xlog_err("prefetch: the %s keyring is not reachable "
+				 "outside an upcall, and Cache-TTL is not set",
+				 DEFAULT_KEYRING);
+			return EXIT_FAILURE;
+		}
+		xlog_warn("prefetch: the %s keyring is not reachable outside "
+			  "an upcall; filling %s only", DEFAULT_KEYRING,
+			  NFS_STATEDIR "/nfsidmap.cache");
+		pf.ring = 0;
+	}
+
+	if (list)
+		rc = prefetch_list(&pf, list);
+	else {
+		prefetch_all(&pf, USER);
+		prefetch_all(&pf, GROUP);
+		rc = EXIT_SUCCESS;
+	}
+	if (verbose)
+		xlog_warn("prefetch: %u keys added", pf.added);
+	return rc;
+}
+
+/*
+ * With Prefetch-Interval set, an upcall that had to load the translation
+ * methods leaves a child behind to prefetch all the other accounts too,
+ * at most once in that many seconds.  The child keeps possession of the
+ * keyring through the session keyring it inherits.
+ */
+static void prefetch_in_background(key_serial_t ring, int timeout)
+{
+	int interval = conf_get_num("nfsidmap", "Prefetch-Interval", 0);
+	struct stat st;
+	int fd, null;
+
+	if (interval <= 0 || ring <= 0)
+		return;
+
+	fd = open(PREFETCH_STAMP, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (fd < 0)
+		return;
+	if (flock(fd, LOCK_EX | LOCK_NB) < 0 || fstat(fd, &st) < 0 ||
+	    (st.st_size > 0 && time(NULL) - st.st_mtime < interval))
+		goto out;
+	if (keyctl_link(ring, KEY_SPEC_SESSION_KEYRING) < 0) {
+		xlog_warn("prefetch: keyctl_link(0x%x) failed: %m", ring);
+		goto out;
+	}
+	if (write(fd, "\n", 1) != 1)
+		goto out;
+
+	switch (fork()) {
+	case 0:
+		break;
+	case -1:
+		xlog_warn("prefetch: fork failed: %m");
+		/* fall through */
+	default:
+		goto out;
+	}
+
+	setsid();
+	null = open("/dev/null", O_RDWR);
+	if (null >= 0) {
+		dup2(null, 0);
+		dup2(null, 1);
+		dup2(null, 2);
+		if (null > 2)
+			close(null);
+	}
+	xlog_stderr(0);
+	xlog_syslog(1);
+	exit(prefetch_keys(conf_get_str("nfsidmap", "Prefetch-List"),
+			   timeout, ring));
+out:
+	close(fd);
+}
+
 int main(int argc, char **argv)
 {
 	char *arg;
@@ -360,9 +679,9 @@ int main(int argc, char **argv)
 	char *type;
 	int rc = 1, opt;
 	int timeout = 600;
-	key_serial_t key;
+	key_serial_t key, ring;
 	char *progname, *keystr = NULL;
-	int clearing = 0, keymask = 0, display = 0, list = 0;
+	int clearing = 0, keymask = 0, display = 0, list = 0, prefetch = 0;
 
 	/* Set the basename */
 	if ((progname = strrchr(argv[0], '/')) != NULL)
@@ -372,7 +691,7 @@ int main(int argc, char **argv)
 
 	xlog_open(progname);
 
-	while ((opt = getopt(argc, argv, "hdu:g:r:ct:vl")) != -1) {
+	while ((opt = getopt(argc, argv, "hdu:g:r:ct:vlp")) != -1) {
 		switch (opt) {
 		case 'd':
 			display++;
@@ -395,6 +714,9 @@ int main(int argc, char **argv)
 		case 'c':
 			clearing++;
 			break;
+		case 'p':
+			prefetch++;
+			break;
 		case 'v':
 			verbose++;
 			break;
@@ -413,6 +735,15 @@ int main(int argc, char **argv)
 		return EXIT_FAILURE;
 	}
 
+	if (!display && !list && !keystr && !clearing && !prefetch &&
+	    (argc - optind) == 2) {
+		xlog_stderr(verbose);
+		key = strtol(argv[optind], NULL, 10);
+		rc = cached_lookup(key, argv[optind + 1], timeout);
+		if (rc >= 0)
+			return rc;
+	}
+
 	if ((rc = nfs4_init_name_mapping(PATH_IDMAPDCONF)))  {
 		xlog_errno(rc, "Unable to create name to user id mappings.");
 		return EXIT_FAILURE;
@@ -425,12 +756,24 @@ int main(int argc, char **argv)
 	if (list)
 		return list_keyring(DEFAULT_KEYRING);
 	if (keystr) {
+		if (keymask & UIDKEYS)
+			mapcache_invalidate(PATH_IDMAPDCONF, "uid:", keystr);
+		if (keymask & GIDKEYS)
+			mapcache_invalidate(PATH_IDMAPDCONF, "gid:", keystr);
 		return key_invalidate(keystr, keymask);
 	}
 	if (clearing) {
 		xlog_syslog(0);
+		mapcache_clear();
 		return keyring_clear(DEFAULT_KEYRING);
 	}
+	if (prefetch) {
+		xlog_stderr(1);
+		if (verbose)
+			nfs4_set_debug(verbose, NULL);
+		return prefetch_keys(optind < argc ? argv[optind] : NULL,
+				     timeout, 0);
+	}
 
 	xlog_stderr(verbose);
 	if ((argc - optind) != 2) {
@@ -458,20 +801,23 @@ int main(int argc, char **argv)
 	}
 
 	/* Become a possesor of the to-be-instantiated key to set the key's timeout */
-	request_key("keyring", DEFAULT_KEYRING, NULL, KEY_SPEC_THREAD_KEYRING);
+	ring = request_key("keyring", DEFAULT_KEYRING, NULL,
+			   KEY_SPEC_THREAD_KEYRING);
 
 	if (strcmp(type, "uid") == 0)
-		rc = id_lookup(value, key, USER);
+		rc = id_lookup(value, key, USER, argv[optind]);
 	else if (strcmp(type, "gid") == 0)
-		rc = id_lookup(value, key, GROUP);
+		rc = id_lookup(value, key, GROUP, argv[optind]);
 	else if (strcmp(type, "user") == 0)
-		rc = name_lookup(value, key, USER);
+		rc = name_lookup(value, key, USER, argv[optind]);
 	else if (strcmp(type, "group") == 0)
-		rc = name_lookup(value, key, GROUP);
+		rc = name_lookup(value, key, GROUP, argv[optind]);
 
 	/* Set timeout to 10 (600 seconds) minutes */
-	if (rc == EXIT_SUCCESS)
+	if (rc == EXIT_SUCCESS) {
 		keyctl_set_timeout(key, timeout);
+		prefetch_in_background(ring, timeout);
+	}
 
 	free(arg);
 	return rc;
@@ -75,6 +75,7 @@ nfsref_usage(const char *progname)
 	fprintf(stderr, "\tadd        Add a new junction\n");
 	fprintf(stderr, "\tremove     Remove an existing junction\n");
 	fprintf(stderr, "\tlookup     Enumerate a junction\n");
+	fprintf(stderr, "\tscan       Check every junction below a directory\n");
 
 	fprintf(stderr, "\nUse \"%s SUBCOMMAND -?\" for details.\n", progname);
 }
@@ -164,7 +165,8 @@ main(int argc, char **argv)
 		}
 		exit_status = nfsref_add(type, junct_path, argv, optind);
 		if (exit_status == EXIT_SUCCESS)
-			(void)junction_flush_exports_cache();
+			(void)junction_flush_exports_cache_paths(
+				(const char * const *)&junct_path, 1);
 	} else if (strcasecmp(subcommand, "remove") == 0) {
 		if (help) {
 			exit_status = nfsref_remove_help(progname);
@@ -172,13 +174,25 @@ main(int argc, char **argv)
 		}
 		exit_status = nfsref_remove(type, junct_path);
 		if (exit_status == EXIT_SUCCESS)
-			(void)junction_flush_exports_cache();
+			(void)junction_flush_exports_cache_paths(
+				(const char * const *)&junct_path, 1);
 	} else if (strcasecmp(subcommand, "lookup") == 0) {
 		if (help) {
 			exit_status = nfsref_lookup_help(progname);
 			goto out;
 		}
 		exit_status = nfsref_lookup(type, junct_path);
+	} else if (strcasecmp(subcommand, "scan") == 0) {
+		if (help) {
+			exit_status = nfsref_scan_help(progname);
+			goto out;
+		}
+		if (argc < optind + 2) {
+			xlog(L_ERROR, "Not enough positional parameters");
+			nfsref_usage(progname);
+			goto out;
+		}
+		exit_status = nfsref_scan(type, junct_path, argv, optind);
 	} else {
 		xlog(L_ERROR, "Unrecognized subcommand: %s", subcommand);
 		nfsref_usage(progname);
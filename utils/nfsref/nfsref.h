@@ -39,9 +39,12 @@ int	 nfsref_add(enum nfsref_type type, const char *junct_path, char **argv,
 				int optind);
 int	 nfsref_remove(enum nfsref_type type, const char *junct_path);
 int	 nfsref_lookup(enum nfsref_type type, const char *junct_path);
+int	 nfsref_scan(enum nfsref_type type, const char *path, char **argv,
+				int optind);
 
 int	 nfsref_add_help(const char *progname);
 int	 nfsref_remove_help(const char *progname);
 int	 nfsref_lookup_help(const char *progname);
+int	 nfsref_scan_help(const char *progname);
 
 #endif	/* !UTILS_NFSREF_H */
@@ -0,0 +1,250 @@
+/**
+ * @file utils/nfsref/scan.c
+ * @brief Check every junction below a local directory
+ */
+
+/*
+ * This file is part of nfs-utils.
+ *
+ * nfs-utils is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2.0 as
+ * published by the Free Software Foundation.
+ *
+ * nfs-utils is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License version 2.0 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2.0 along with nfs-utils.  If not, see:
+ *
+ *	http://www.gnu.org/licenses/old-licenses/gpl-2.0.txt
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#ifdef HAVE_LIBPTHREAD
+#include <pthread.h>
+#endif
+
+#include "junction.h"
+#include "xlog.h"
+#include "nfsref.h"
+
+/**
+ * Number of threads walking the directory tree
+ */
+#define NFSREF_SCAN_THREADS	8
+
+/**
+ * Junctions found so far
+ */
+struct nfsref_scan_list {
+	char		**sl_paths;
+	unsigned int	  sl_count, sl_size;
+	_Bool		  sl_nomem;
+#ifdef HAVE_LIBPTHREAD
+	pthread_mutex_t	  sl_lock;
+#endif
+};
+
+/**
+ * Display help message for "scan" subcommand
+ *
+ * @param progname NUL-terminated C string containing name of program
+ * @return program exit status
+ */
+int
+nfsref_scan_help(const char *progname)
+{
+	fprintf(stderr, " \n");
+
+	fprintf(stderr, "Usage: %s [ -t type ] scan <directory> [ update ]\n\n",
+		progname);
+
+	fprintf(stderr, "Find every junction below <directory> and check "
+			"that its locations can\n");
+	fprintf(stderr, "be read.  With \"update\", also give each junction "
+			"an up to date binary\n");
+	fprintf(stderr, "copy of its locations.  Only nfs-basic junctions "
+			"are supported.\n");
+
+	return EXIT_SUCCESS;
+}
+
+/**
+ * Remember one junction found by junction_scan()
+ *
+ * @param pathname NUL-terminated C string containing pathname of a junction
+ * @param arg list of junctions
+ */
+static void
+nfsref_scan_add(const char *pathname, void *arg)
+{
+	struct nfsref_scan_list *list = arg;
+	char **new, *path;
+
+	path = strdup(pathname);
+
+#ifdef HAVE_LIBPTHREAD
+	pthread_mutex_lock(&list->sl_lock);
+#endif
+	if (path != NULL && list->sl_count == list->sl_size) {
+		list->sl_size = list->sl_size ? list->sl_size * 2 : 256;
+		new = realloc(list->sl_paths,
+				list->sl_size * sizeof(*list->sl_paths));
+		if (new == NULL) {
+			free(path);
+			path = NULL;
+		} else
+			list->sl_paths = new;
+	}
+	if (path != NULL)
+		list->sl_paths[list->sl_count++] = path;
+	else
+		list->sl_nomem = true;
+#ifdef HAVE_LIBPTHREAD
+	pthread_mutex_unlock(&list->sl_lock);
+#endif
+}
+
+static int
+nfsref_scan_cmp(const void *a, const void *b)
+{
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/**
+ * Check, and perhaps update, one junction
+ *
+ * @param junct_path NUL-terminated C string containing pathname of junction
+ * @param update true if the binary copy of the locations should be updated
+ * @param updated OUT: set to true if it was updated
+ * @return true if the junction's locations could be read
+ */
+static _Bool
+nfsref_scan_check(const char *junct_path, _Bool update, _Bool *updated)
+{
+	struct nfs_fsloc *fslocs = NULL, *fsloc;
+	FedFsStatus retval;
+	unsigned int count;
+
+	retval = nfs_get_locations(junct_path, &fslocs);
+	if (retval != FEDFS_OK) {
+		printf("%s: %s\n", junct_path, nsdb_display_fedfsstatus(retval));
+		return false;
+	}
+	for (count = 0, fsloc = fslocs; fsloc != NULL; fsloc = fsloc->nfl_next)
+		count++;
+	nfs_free_locations(fslocs);
+
+	*updated = false;
+	if (update) {
+		retval = nfs_update_junction(junct_path);
+		switch (retval) {
+		case FEDFS_OK:
+			*updated = true;
+			break;
+		case FEDFS_ERR_EXIST:
+			break;
+		default:
+			printf("%s: %u location(s), update failed: %s\n",
+				junct_path, count,
+				nsdb_display_fedfsstatus(retval));
+			return false;
+		}
+	}
+
+	printf("%s: %u location(s)%s\n", junct_path, count,
+		*updated ? ", updated" : "");
+	return true;
+}
+
+/**
+ * Check every junction below a directory
+ *
+ * @param type type of junctions to check
+ * @param path NUL-terminated C string containing pathname of a directory
+ * @param argv array of pointers to NUL-terminated C strings containing arguments
+ * @param optind index of "argv" where "scan" subcommand arguments start
+ * @return program exit status
+ */
+int
+nfsref_scan(enum nfsref_type type, const char *path, char **argv, int optind)
+{
+	struct nfsref_scan_list list;
+	unsigned int i, bad, updated;
+	FedFsStatus retval;
+	_Bool update, this;
+	char *swap;
+
+	switch (type) {
+	case NFSREF_TYPE_UNSPECIFIED:
+	case NFSREF_TYPE_NFS_BASIC:
+		break;
+	default:
+		xlog(L_ERROR, "Only nfs-basic junctions can be scanned");
+		return EXIT_FAILURE;
+	}
+
+	update = false;
+	if (argv[optind + 2] != NULL) {
+		if (strcmp(argv[optind + 2], "update") != 0 ||
+		    argv[optind + 3] != NULL) {
+			xlog(L_ERROR, "Unrecognized scan argument: %s",
+				argv[optind + 2]);
+			return EXIT_FAILURE;
+		}
+		update = true;
+	}
+
+	memset(&list, 0, sizeof(list));
+#ifdef HAVE_LIBPTHREAD
+	pthread_mutex_init(&list.sl_lock, NULL);
+#endif
+	retval = junction_scan(path, NFSREF_SCAN_THREADS, nfsref_scan_add, &list);
+#ifdef HAVE_LIBPTHREAD
+	pthread_mutex_destroy(&list.sl_lock);
+#endif
+	if (retval != FEDFS_OK) {
+		xlog(L_ERROR, "Failed to scan %s: %s",
+			path, nsdb_display_fedfsstatus(retval));
+		return EXIT_FAILURE;
+	}
+	if (list.sl_nomem)
+		xlog(L_ERROR, "Not enough memory to list every junction");
+
+	qsort(list.sl_paths, list.sl_count, sizeof(*list.sl_paths),
+		nfsref_scan_cmp);
+	/* the updated paths are moved to the front of the list */
+	bad = updated = 0;
+	for (i = 0; i < list.sl_count; i++) {
+		if (!nfsref_scan_check(list.sl_paths[i], update, &this))
+			bad++;
+		else if (this) {
+			swap = list.sl_paths[updated];
+			list.sl_paths[updated++] = list.sl_paths[i];
+			list.sl_paths[i] = swap;
+		}
+	}
+
+	if (update)
+		printf("%u junction(s), %u bad, %u updated\n",
+			list.sl_count, bad, updated);
+	else
+		printf("%u junction(s), %u bad\n", list.sl_count, bad);
+	if (updated)
+		(void)junction_flush_exports_cache_paths(
+			(const char * const *)list.sl_paths, updated);
+	for (i = 0; i < list.sl_count; i++)
+		free(list.sl_paths[i]);
+	free(list.sl_paths);
+	return (bad || list.sl_nomem) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,494 @@
+/*
+ * mountstats.c		Per-mount, per-op statistics for nfsstat
+ *
+ * Reads the "per-op statistics" of each NFS mount in
+ * /proc/self/mountstats, and prints round trip, execute and queue
+ * times, retransmissions, errors and bytes for each op, either since
+ * the mount or as rates over an interval; or, with --top, ranks the
+ * busiest or slowest mounts, servers or transports over a sliding
+ * window of intervals; or, with --snapshot, writes all of it in
+ * binary for mountstats and nfsiostat.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+
+#include "nfs_mountstats.h"
+#include "mountstats.h"
+
+static void
+ms_print_header(const struct ms_mount *m, long msecs)
+{
+	printf("%s mounted on %s:\n", m->dev, m->dir);
+	if (msecs)
+		printf("  %-20s %10s %9s %9s %9s %9s %9s %10s %10s\n",
+			"op", "ops/s", "rtt ms", "exe ms", "queue ms",
+			"retrans/s", "errors/s", "sent kB/s", "recv kB/s");
+	else
+		printf("  %-20s %10s %9s %9s %9s %9s %9s %10s %10s\n",
+			"op", "ops", "rtt ms", "exe ms", "queue ms",
+			"retrans", "errors", "sent kB", "recv kB");
+}
+
+/*
+ * Print the ops of each mount in 'new' that were used since 'old',
+ * as rates over 'msecs'; or, if 'old' is NULL, since the mount.
+ */
+static void
+ms_print(const struct ms_sample *new, const struct ms_sample *old, long msecs)
+{
+	unsigned long long d[MS_NFIELDS], retrans;
+	unsigned int i, j, k, printed;
+	double secs = msecs / 1000.0;
+
+	for (i = 0; i < new->nmounts; i++) {
+		const struct ms_mount *m = &new->mounts[i];
+		const struct ms_mount *om = old ? ms_find_mount(old, m) : NULL;
+
+		printed = 0;
+		for (j = 0; j < m->nops; j++) {
+			const struct ms_op *op = &new->ops[m->firstop + j];
+			const struct ms_op *oo = om ?
+				ms_find_op(old, om, op->name) : NULL;
+
+			for (k = 0; k < MS_NFIELDS; k++) {
+				d[k] = op->v[k];
+				/* a counter that went back means a remount */
+				if (oo && oo->v[k] <= op->v[k])
+					d[k] -= oo->v[k];
+			}
+			if (d[MS_OPS] == 0)
+				continue;
+			retrans = d[MS_TRANS] > d[MS_OPS] ?
+					d[MS_TRANS] - d[MS_OPS] : 0;
+
+			if (!printed++)
+				ms_print_header(m, old ? msecs : 0);
+			if (old)
+				printf("  %-20s %10.1f %9.3f %9.3f %9.3f "
+					"%9.1f %9.1f %10.1f %10.1f\n",
+					op->name, d[MS_OPS] / secs,
+					(double)d[MS_RTT] / d[MS_OPS],
+					(double)d[MS_EXEC] / d[MS_OPS],
+					(double)d[MS_QUEUE] / d[MS_OPS],
+					retrans / secs, d[MS_ERRORS] / secs,
+					d[MS_SENT] / 1024.0 / secs,
+					d[MS_RECV] / 1024.0 / secs);
+			else
+				printf("  %-20s %10llu %9.3f %9.3f %9.3f "
+					"%9llu %9llu %10llu %10llu\n",
+					op->name, d[MS_OPS],
+					(double)d[MS_RTT] / d[MS_OPS],
+					(double)d[MS_EXEC] / d[MS_OPS],
+					(double)d[MS_QUEUE] / d[MS_OPS],
+					retrans, d[MS_ERRORS],
+					d[MS_SENT] / 1024, d[MS_RECV] / 1024);
+		}
+		if (printed)
+			printf("\n");
+	}
+}
+
+static long long
+ms_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * mountstats - print per-op statistics for each NFS mount
+ * @file: usually MOUNTSTATSFILE
+ * @interval: milliseconds between reports, or zero to print the
+ *	statistics since each mount once
+ *
+ * Returns an exit code for nfsstat; with an interval, returns only
+ * if @file cannot be read.
+ */
+int
+mountstats(const char *file, long interval)
+{
+	struct ms_sample samples[2], *new, *old;
+	long long then, now;
+	int fd, cur = 0;
+
+	memset(samples, 0, sizeof(samples));
+	fd = open(file, O_RDONLY | O_CLOEXEC);
+	if (fd < 0 || ms_read(fd, &samples[0]) || ms_parse(&samples[0], 0)) {
+		fprintf(stderr, "Error: %s: %s\n", file, strerror(errno));
+		return 2;
+	}
+	if (!interval) {
+		ms_print(&samples[0], NULL, 0);
+		close(fd);
+		return 0;
+	}
+
+	then = ms_now();
+	for (;;) {
+		struct timespec ts = {
+			.tv_sec = interval / 1000,
+			.tv_nsec = (interval % 1000) * 1000000,
+		};
+
+		while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+			;
+		old = &samples[cur];
+		cur ^= 1;
+		new = &samples[cur];
+		if (ms_read(fd, new) || ms_parse(new, 0)) {
+			fprintf(stderr, "Error: %s: %s\n", file,
+					strerror(errno));
+			return 2;
+		}
+		now = ms_now();
+		ms_print(new, old, (long)(now - then > 0 ? now - then : 1));
+		fflush(stdout);
+		then = now;
+	}
+}
+
+/* One line of --top: a mount, or all the mounts of a server or transport */
+struct ms_row {
+	char			name[320];
+	char			xprt[320];
+	unsigned int		nmounts;
+	unsigned long long	d[MS_NFIELDS];
+	unsigned long long	x[MS_XNFIELDS];
+	double			score;
+};
+
+static const char *ms_sortname[] = {
+	"rtt", "exe", "queue", "ops", "kB", "retrans", "errors",
+};
+
+static const char *ms_byname[] = {
+	"mount", "server", "xprt",
+};
+
+/* The server part of "server:/export", or of "[2001:db8::1]:/export" */
+static void
+ms_host(const char *dev, char *buf, size_t len)
+{
+	size_t n;
+
+	if (dev[0] == '[' && strchr(dev, ']'))
+		n = strchr(dev, ']') - dev + 1;
+	else
+		n = strcspn(dev, ":");
+	if (n >= len)
+		n = len - 1;
+	memcpy(buf, dev, n);
+	buf[n] = '\0';
+}
+
+static unsigned long long
+ms_delta(unsigned long long new, const unsigned long long *old)
+{
+	/* a counter that went back means a remount */
+	if (old && *old <= new)
+		return new - *old;
+	return new;
+}
+
+/*
+ * Fill in 'r' with what mount 'm' of 'new' did since 'old'.  Returns
+ * 0 if it did nothing, or is filtered out.
+ */
+static int
+ms_top_row(const struct ms_sample *new, const struct ms_sample *old,
+		const struct ms_mount *m, const struct ms_top_options *opts,
+		struct ms_row *r)
+{
+	const struct ms_mount *om = ms_find_mount(old, m);
+	unsigned int j, k;
+	char host[256];
+
+	ms_host(m->dev, host, sizeof(host));
+	if (opts->host && strcmp(opts->host, host) &&
+	    strcmp(opts->host, m->addr))
+		return 0;
+
+	memset(r, 0, sizeof(*r));
+	for (j = 0; j < m->nops; j++) {
+		const struct ms_op *op = &new->ops[m->firstop + j];
+		const struct ms_op *oo;
+
+		if (opts->op && strcasecmp(opts->op, op->name))
+			continue;
+		oo = om ? ms_find_op(old, om, op->name) : NULL;
+		for (k = 0; k < MS_NFIELDS; k++)
+			r->d[k] += ms_delta(op->v[k], oo ? &oo->v[k] : NULL);
+	}
+	for (k = 0; k < MS_XNFIELDS; k++)
+		r->x[k] = ms_delta(m->x[k], om ? &om->x[k] : NULL);
+	if (r->d[MS_OPS] == 0 && (opts->op || r->x[MS_XSENDS] == 0))
+		return 0;
+
+	snprintf(r->xprt, sizeof(r->xprt), "%s %s/%llu",
+			m->addr[0] ? m->addr : host, m->proto, m->port);
+	switch (opts->by) {
+	case MS_BY_SERVER:
+		snprintf(r->name, sizeof(r->name), "%s", host);
+		break;
+	case MS_BY_XPRT:
+		snprintf(r->name, sizeof(r->name), "%s", r->xprt);
+		break;
+	default:
+		snprintf(r->name, sizeof(r->name), "%s", m->dir);
+	}
+	r->nmounts = 1;
+	return 1;
+}
+
+static int
+ms_row_bykey(const void *a, const void *b)
+{
+	const struct ms_row *ra = a, *rb = b;
+	int c = strcmp(ra->name, rb->name);
+
+	return c ? c : strcmp(ra->xprt, rb->xprt);
+}
+
+/*
+ * Add up the rows with the same name.  Mounts that share a transport
+ * all show its counters, so they are counted once for each transport.
+ */
+static unsigned int
+ms_merge_rows(struct ms_row *rows, unsigned int n)
+{
+	unsigned int i, k, out = 0;
+
+	if (n == 0)
+		return 0;
+	qsort(rows, n, sizeof(*rows), ms_row_bykey);
+	for (i = 1; i < n; i++) {
+		struct ms_row *r = &rows[out];
+
+		if (strcmp(r->name, rows[i].name)) {
+			rows[++out] = rows[i];
+			continue;
+		}
+		r->nmounts++;
+		for (k = 0; k < MS_NFIELDS; k++)
+			r->d[k] += rows[i].d[k];
+		if (strcmp(rows[i - 1].xprt, rows[i].xprt))
+			for (k = 0; k < MS_XNFIELDS; k++)
+				r->x[k] += rows[i].x[k];
+	}
+	return out + 1;
+}
+
+static double
+ms_score(const struct ms_row *r, int sort)
+{
+	const unsigned long long *d = r->d;
+
+	switch (sort) {
+	case MS_SORT_OPS:
+		return d[MS_OPS];
+	case MS_SORT_KB:
+		return d[MS_SENT] + d[MS_RECV];
+	case MS_SORT_RETRANS:
+		return d[MS_TRANS] > d[MS_OPS] ? d[MS_TRANS] - d[MS_OPS] : 0;
+	case MS_SORT_ERRORS:
+		return d[MS_ERRORS];
+	}
+	if (d[MS_OPS] == 0)
+		return 0;
+	switch (sort) {
+	case MS_SORT_EXE:
+		return (double)d[MS_EXEC] / d[MS_OPS];
+	case MS_SORT_QUEUE:
+		return (double)d[MS_QUEUE] / d[MS_OPS];
+	}
+	return (double)d[MS_RTT] / d[MS_OPS];
+}
+
+static int
+ms_row_byscore(const void *a, const void *b)
+{
+	const struct ms_row *ra = a, *rb = b;
+
+	if (ra->score != rb->score)
+		return ra->score < rb->score ? 1 : -1;
+	return strcmp(ra->name, rb->name);
+}
+
+static void
+ms_print_top(struct ms_row *rows, unsigned int n, unsigned int nmounts,
+		long msecs, const struct ms_top_options *opts)
+{
+	double secs = msecs / 1000.0;
+	char stamp[32];
+	time_t t = time(NULL);
+	unsigned int i;
+
+	qsort(rows, n, sizeof(*rows), ms_row_byscore);
+
+	/* Redraw in place on a terminal; otherwise one report after another */
+	if (isatty(STDOUT_FILENO))
+		printf("\033[H\033[J");
+	strftime(stamp, sizeof(stamp), "%H:%M:%S", localtime(&t));
+	printf("%s  %u NFS mounts, %u busy %s%s, last %.1fs, "
+		"sorted by %s%s%s\n\n",
+		stamp, nmounts, n, ms_byname[opts->by],
+		n == 1 ? "" : "s",
+		secs, ms_sortname[opts->sort],
+		opts->op ? ", op " : "", opts->op ? opts->op : "");
+	printf("%-32s %6s %9s %8s %8s %8s %9s %8s %10s %10s %9s %7s\n",
+		ms_byname[opts->by], "mounts", "ops/s", "rtt ms", "exe ms",
+		"queue ms", "retrans/s", "errors/s", "sent kB/s", "recv kB/s",
+		"sends/s", "backlog");
+
+	if (opts->rows && n > opts->rows)
+		n = opts->rows;
+	for (i = 0; i < n; i++) {
+		const struct ms_row *r = &rows[i];
+		const unsigned long long *d = r->d, *x = r->x;
+		double ops = d[MS_OPS] ? (double)d[MS_OPS] : 1;
+
+		printf("%-32s %6u %9.1f %8.3f %8.3f %8.3f %9.1f %8.1f "
+			"%10.1f %10.1f %9.1f %7.2f\n",
+			r->name, r->nmounts, d[MS_OPS] / secs,
+			d[MS_RTT] / ops, d[MS_EXEC] / ops, d[MS_QUEUE] / ops,
+			(d[MS_TRANS] > d[MS_OPS] ?
+				d[MS_TRANS] - d[MS_OPS] : 0) / secs,
+			d[MS_ERRORS] / secs,
+			d[MS_SENT] / 1024.0 / secs, d[MS_RECV] / 1024.0 / secs,
+			x[MS_XSENDS] / secs,
+			x[MS_XSENDS] ?
+				(double)x[MS_XBACKLOG] / x[MS_XSENDS] : 0.0);
+	}
+	printf("\n");
+	fflush(stdout);
+}
+
+/**
+ * mountstats_top - rank NFS mounts, servers or transports
+ * @file: usually MOUNTSTATSFILE
+ * @interval: milliseconds between reports
+ * @opts: what to rank, how, and which mounts
+ *
+ * Each report covers the last @opts->window intervals, or as many
+ * as there have been so far.  Returns only if @file cannot be read.
+ */
+int
+mountstats_top(const char *file, long interval,
+		const struct ms_top_options *opts)
+{
+	unsigned int nslots = opts->window + 1, filled = 1, cur = 0;
+	struct ms_sample *samples;
+	struct ms_row *rows = NULL;
+	unsigned int maxrows = 0;
+	long long *taken;
+	int fd;
+
+	samples = calloc(nslots, sizeof(*samples));
+	taken = calloc(nslots, sizeof(*taken));
+	if (samples == NULL || taken == NULL) {
+		fprintf(stderr, "Error: %s\n", strerror(ENOMEM));
+		return 2;
+	}
+	fd = open(file, O_RDONLY | O_CLOEXEC);
+	if (fd < 0 || ms_read(fd, &samples[0]) || ms_parse(&samples[0], 0))
+		goto out_err;
+	taken[0] = ms_now();
+
+	for (;;) {
+		struct timespec ts = {
+			.tv_sec = interval / 1000,
+			.tv_nsec = (interval % 1000) * 1000000,
+		};
+		const struct ms_sample *new, *old;
+		unsigned int i, n = 0, oldest;
+		long long msecs;
+
+		while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+			;
+		cur = (cur + 1) % nslots;
+		if (filled < nslots)
+			filled++;
+		if (ms_read(fd, &samples[cur]) || ms_parse(&samples[cur], 0))
+			goto out_err;
+		taken[cur] = ms_now();
+		oldest = (cur + nslots - (filled - 1)) % nslots;
+		new = &samples[cur];
+		old = &samples[oldest];
+
+		if (new->nmounts > maxrows) {
+			struct ms_row *newrows;
+
+			newrows = realloc(rows, new->nmounts * sizeof(*rows));
+			if (newrows == NULL) {
+				fprintf(stderr, "Error: %s\n",
+						strerror(ENOMEM));
+				return 2;
+			}
+			rows = newrows;
+			maxrows = new->nmounts;
+		}
+		for (i = 0; i < new->nmounts; i++)
+			n += ms_top_row(new, old, &new->mounts[i], opts,
+					&rows[n]);
+		if (opts->by != MS_BY_MOUNT)
+			n = ms_merge_rows(rows, n);
+		for (i = 0; i < n; i++)
+			rows[i].score = ms_score(&rows[i], opts->sort);
+
+		msecs = taken[cur] - taken[oldest];
+		ms_print_top(rows, n, new->nmounts, msecs > 0 ? msecs : 1,
+				opts);
+	}
+
+out_err:
+	fprintf(stderr, "Error: %s: %s\n", file, strerror(errno));
+	return 2;
+}
+
+/**
+ * mountstats_snapshot - write all the statistics of each NFS mount
+ * @file: usually MOUNTSTATSFILE
+ *
+ * Writes the binary snapshot described at ms_write_snapshot() to
+ * stdout, for mountstats and nfsiostat to load rather than parse.
+ * Returns an exit code for nfsstat.
+ */
+int
+mountstats_snapshot(const char *file)
+{
+	struct ms_sample s;
+	int fd, ret = 0;
+
+	if (isatty(STDOUT_FILENO)) {
+		fprintf(stderr, "Error: not writing a binary snapshot "
+				"to a terminal\n");
+		return 2;
+	}
+	memset(&s, 0, sizeof(s));
+	fd = open(file, O_RDONLY | O_CLOEXEC);
+	if (fd < 0 || ms_read(fd, &s) || ms_parse(&s, MS_PARSE_ALL)) {
+		fprintf(stderr, "Error: %s: %s\n", file, strerror(errno));
+		ret = 2;
+	} else if (ms_write_snapshot(stdout, &s) < 0) {
+		fprintf(stderr, "Error: writing snapshot: %s\n",
+				strerror(errno));
+		ret = 2;
+	}
+	if (fd >= 0)
+		close(fd);
+	ms_free(&s);
+	return ret;
+}
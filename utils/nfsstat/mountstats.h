@@ -0,0 +1,36 @@
+/*
+ * mountstats.h		Per-mount, per-op statistics for nfsstat
+ */
+
+#ifndef NFSSTAT_MOUNTSTATS_H
+#define NFSSTAT_MOUNTSTATS_H
+
+/* What --top ranks */
+#define MS_BY_MOUNT	0
+#define MS_BY_SERVER	1
+#define MS_BY_XPRT	2
+
+/* What --top sorts by, slowest or busiest first */
+#define MS_SORT_RTT	0
+#define MS_SORT_EXE	1
+#define MS_SORT_QUEUE	2
+#define MS_SORT_OPS	3
+#define MS_SORT_KB	4
+#define MS_SORT_RETRANS	5
+#define MS_SORT_ERRORS	6
+
+struct ms_top_options {
+	unsigned int	rows;		/* 0 for all */
+	unsigned int	window;		/* intervals */
+	int		by;		/* MS_BY_* */
+	int		sort;		/* MS_SORT_* */
+	const char *	host;		/* only this server, or NULL */
+	const char *	op;		/* only this op, or NULL */
+};
+
+int	mountstats(const char *file, long interval);
+int	mountstats_top(const char *file, long interval,
+			const struct ms_top_options *opts);
+int	mountstats_snapshot(const char *file);
+
+#endif /* NFSSTAT_MOUNTSTATS_H */
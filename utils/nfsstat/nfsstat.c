@@ -14,15 +14,20 @@
 #define MOUNTSFILE	"/proc/mounts"
 
 #include <stdlib.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <getopt.h>
 #include <string.h>
+#include <strings.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <signal.h>
 #include <time.h>
 
+#include "nfs_mountstats.h"
+#include "mountstats.h"
+
 #define MAXNRVALS	32
 
 enum {
@@ -35,43 +40,43 @@ enum {
 	SRVPROC4OPS_SZ = 71,
 };
 
-static unsigned int	srvproc2info[SRVPROC2_SZ+2],
+static unsigned long long	srvproc2info[SRVPROC2_SZ+2],
 			srvproc2info_old[SRVPROC2_SZ+2];	/* NFSv2 call counts ([0] == 18) */
-static unsigned int	cltproc2info[CLTPROC2_SZ+2],
+static unsigned long long	cltproc2info[CLTPROC2_SZ+2],
 			cltproc2info_old[CLTPROC2_SZ+2];	/* NFSv2 call counts ([0] == 18) */
-static unsigned int	srvproc3info[SRVPROC3_SZ+2],
+static unsigned long long	srvproc3info[SRVPROC3_SZ+2],
 			srvproc3info_old[SRVPROC3_SZ+2];	/* NFSv3 call counts ([0] == 22) */
-static unsigned int	cltproc3info[CLTPROC3_SZ+2],
+static unsigned long long	cltproc3info[CLTPROC3_SZ+2],
 			cltproc3info_old[CLTPROC3_SZ+2];	/* NFSv3 call counts ([0] == 22) */
-static unsigned int	srvproc4info[SRVPROC4_SZ+2],
+static unsigned long long	srvproc4info[SRVPROC4_SZ+2],
 			srvproc4info_old[SRVPROC4_SZ+2];	/* NFSv4 call counts ([0] == 2) */
-static unsigned int	cltproc4info[CLTPROC4_SZ+2],
+static unsigned long long	cltproc4info[CLTPROC4_SZ+2],
 			cltproc4info_old[CLTPROC4_SZ+2];	/* NFSv4 call counts ([0] == 49) */
-static unsigned int	srvproc4opsinfo[SRVPROC4OPS_SZ+2],
+static unsigned long long	srvproc4opsinfo[SRVPROC4OPS_SZ+2],
 			srvproc4opsinfo_old[SRVPROC4OPS_SZ+2];	/* NFSv4 call counts ([0] == 59) */
-static unsigned int	srvnetinfo[5], srvnetinfo_old[5];	/* 0  # of received packets
+static unsigned long long	srvnetinfo[5], srvnetinfo_old[5];	/* 0  # of received packets
 								 * 1  UDP packets
 								 * 2  TCP packets
 								 * 3  TCP connections
 								 */
-static unsigned int	cltnetinfo[5], cltnetinfo_old[5];	/* 0  # of received packets
+static unsigned long long	cltnetinfo[5], cltnetinfo_old[5];	/* 0  # of received packets
 								 * 1  UDP packets
 								 * 2  TCP packets
 								 * 3  TCP connections
 								 */
 
-static unsigned int	srvrpcinfo[6], srvrpcinfo_old[6];	/* 0  total # of RPC calls
+static unsigned long long	srvrpcinfo[6], srvrpcinfo_old[6];	/* 0  total # of RPC calls
 								 * 1  total # of bad calls
 								 * 2  bad format
 								 * 3  authentication failed
 								 * 4  unknown client
 								 */
-static unsigned int	cltrpcinfo[4], cltrpcinfo_old[4];	/* 0  total # of RPC calls
+static unsigned long long	cltrpcinfo[4], cltrpcinfo_old[4];	/* 0  total # of RPC calls
 								 * 1  retransmitted calls
 								 * 2  cred refreshs
 								 */
 
-static unsigned int	srvrcinfo[9], srvrcinfo_old[9];		/* 0  repcache hits
+static unsigned long long	srvrcinfo[9], srvrcinfo_old[9];		/* 0  repcache hits
 								 * 1  repcache hits
 								 * 2  uncached reqs
 								 * (for pre-2.4 kernels:)
@@ -82,7 +87,7 @@ static unsigned int	srvrcinfo[9], srvrcinfo_old[9];		/* 0  repcache hits
 								 * 7  stale
 								 */
 
-static unsigned int	srvfhinfo[7], srvfhinfo_old[7];		/* (for kernels >= 2.4.0)
+static unsigned long long	srvfhinfo[7], srvfhinfo_old[7];		/* (for kernels >= 2.4.0)
 								 * 0  stale
 								 * 1  FH lookups
 								 * 2  'anon' FHs
@@ -92,11 +97,11 @@ static unsigned int	srvfhinfo[7], srvfhinfo_old[7];		/* (for kernels >= 2.4.0)
 								 *    compatability.
 								 */
 
-static unsigned int	srvioinfo[3], srvioinfo_old[3];		/* 0  bytes read
+static unsigned long long	srvioinfo[3], srvioinfo_old[3];		/* 0  bytes read
 								 * 1  bytes written
 								 */
 
-static unsigned int	srvrainfo[13], srvrainfo_old[13];	/* 0  ra cache size
+static unsigned long long	srvrainfo[13], srvrainfo_old[13];	/* 0  ra cache size
 								 * 1..11 depth of ra cache hit
 								 * 12 ra cache misses
 								 */
@@ -216,7 +221,7 @@ typedef struct statinfo {
 	char		*tag;
 	char		*label;
 	int		nrvals;
-	unsigned int *	valptr;
+	unsigned long long *	valptr;
 } statinfo;
 
 /*
@@ -258,12 +263,13 @@ static void		print_all_stats(int, int, int);
 static void		print_server_stats(int);
 static void		print_client_stats(int);
 static void		print_stats_list(int, int, int);
-static void		print_numbers(const char *, unsigned int *,
+static void		print_numbers(const char *, unsigned long long *,
 					unsigned int);
 static void		print_callstats(const char *, const char **,
-					unsigned int *, unsigned int);
+					unsigned long long *, unsigned int);
 static void		print_callstats_list(const char *, const char **,
-					unsigned int *, unsigned int);
+					unsigned long long *, unsigned int);
+static void		parse_raw_statline(char *, struct statinfo *);
 static int		parse_raw_statfile(const char *, struct statinfo *);
 static int 		parse_pretty_statfile(const char *, struct statinfo *);
 
@@ -273,14 +279,41 @@ static int		mounts(const char *);
 
 static void		get_stats(const char *, struct statinfo *, int *, int,
 					int);
-static int		has_stats(const unsigned int *, int);
-static int		has_rpcstats(const unsigned int *, int);
-static void 		diff_stats(struct statinfo *, struct statinfo *, int);
+static int		has_stats(const unsigned long long *, int);
+static int		has_rpcstats(const unsigned long long *, int);
+static void 		diff_stats(struct statinfo *, struct statinfo *);
+static void 		rate_stats(struct statinfo *, long long);
 static void 		unpause(int);
-static void 		update_old_counters(struct statinfo *, struct statinfo *);
+static int		stream_stats(int, int, long, int);
 
 static time_t		starttime;
 
+#define FMT_TABLE	0
+#define FMT_JSON	1
+#define FMT_CSV		2
+#define FMT_OPENMETRICS	3
+
+static long long
+monotonic_msecs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void
+sleep_msecs(long msecs)
+{
+	struct timespec ts = {
+		.tv_sec = msecs / 1000,
+		.tv_nsec = (msecs % 1000) * 1000000,
+	};
+
+	while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+		;
+}
+
 #define PRNT_CALLS	0x0001
 #define PRNT_RPC	0x0002
 #define PRNT_NET	0x0004
@@ -305,6 +338,18 @@ static void usage(char *name)
 	printf("Usage: %s [OPTION]...\n\
 \n\
   -m, --mounts		Show statistics on mounted NFS filesystems\n\
+  -M, --mountstats	Show per-op times, retransmissions, errors and\n\
+			    bytes for each NFS mount; with -Z#, as\n\
+			    rates over each interval\n\
+  --top[=N]		Show the N (default 20, 0 for all) NFS mounts with\n\
+			    the slowest ops, every -Z# seconds (default 1)\n\
+    --by=what		Rank each mount, server or xprt\n\
+    --sort=key		Sort by rtt, exe, queue, ops, kB, retrans or errors\n\
+    --host=server	Only count the mounts of this server\n\
+    --op=name		Only count this op, such as READ\n\
+    --window=N		Cover the last N intervals (default 5)\n\
+  --snapshot[=file]	Write the statistics of each NFS mount in binary,\n\
+			    for the mountstats and nfsiostat scripts\n\
   -c, --client		Show NFS client statistics\n\
   -s, --server		Show NFS server statistics\n\
   -2			Show NFS version 2 statistics\n\
@@ -326,6 +371,11 @@ static void usage(char *name)
 			    Cumulative stats are then printed\n\
           		    If # is provided, stats will be output every\n\
 			    # seconds.\n\
+  -R, --rate		With -Z#, show per-second rates over each\n\
+			    interval instead of counts\n\
+  --format=fmt		Stream the changes every -Z# seconds (default 1;\n\
+			    fractions allowed) as fmt: json, csv or\n\
+			    openmetrics\n\
   -S, --since file	Shows difference between current stats and those in 'file'\n\
   -l, --list		Prints stats in list format\n\
   --version		Show program version\n\
@@ -341,6 +391,7 @@ static struct option longopts[] =
 	{ "auto", 0, 0, '\3' },
 	{ "client", 0, 0, 'c' },
 	{ "mounts", 0, 0, 'm' },
+	{ "mountstats", 0, 0, 'M' },
 	{ "nfs", 0, 0, 'n' },
 	{ "rpc", 0, 0, 'r' },
 	{ "server", 0, 0, 's' },
@@ -351,6 +402,15 @@ static struct option longopts[] =
 	{ "sleep", 2, 0, 'Z' },
 	{ "since", 1, 0, 'S' },
 	{ "list", 0, 0, 'l' },
+	{ "rate", 0, 0, 'R' },
+	{ "format", 1, 0, '\4' },
+	{ "top", 2, 0, '\5' },
+	{ "by", 1, 0, '\6' },
+	{ "sort", 1, 0, '\7' },
+	{ "host", 1, 0, '\10' },
+	{ "op", 1, 0, '\11' },
+	{ "window", 1, 0, '\12' },
+	{ "snapshot", 2, 0, '\13' },
 	{ NULL, 0, 0, 0 }
 };
 int opt_sleep;
@@ -362,11 +422,23 @@ main(int argc, char **argv)
 			opt_srv = 0,
 			opt_clt = 0,
 			opt_prt = 0,
-			sleep_time = 0,
+			opt_format = FMT_TABLE,
 			opt_list =0,
+			opt_rate = 0,
+			opt_mountstats = 0,
+			opt_top = 0,
 			opt_since = 0;
+	long long	then = 0, now, msecs;
+	long		sleep_time = 0;	/* milliseconds */
+	struct ms_top_options top = {
+		.rows = 20,
+		.window = 5,
+		.by = MS_BY_MOUNT,
+		.sort = MS_SORT_RTT,
+	};
 	int		c;
 	char           *progname,
+		       *end,
 		       *serverfile = NFSSRVSTAT,
 		       *clientfile = NFSCLTSTAT;
 
@@ -385,7 +457,7 @@ main(int argc, char **argv)
 	else
 		progname = argv[0];
 
-	while ((c = getopt_long(argc, argv, "234acmno:Z::S:vrslz\1\2", longopts, NULL)) != EOF) {
+	while ((c = getopt_long(argc, argv, "234acmMno:Z::S:vrRslz\1\2\4", longopts, NULL)) != EOF) {
 		switch (c) {
 		case 'a':
 			fprintf(stderr, "nfsstat: nfs acls are not yet supported.\n");
@@ -422,7 +494,16 @@ main(int argc, char **argv)
 		case 'Z':
 			opt_sleep = 1;
 			if (optarg) {
-				sleep_time = atoi(optarg);
+				double secs = strtod(optarg, &end);
+
+				if (*end != '\0' || secs < 0 || secs > 86400) {
+					fprintf(stderr, "nfsstat: bad interval "
+							"'%s'\n", optarg);
+					return 2;
+				}
+				sleep_time = (long)(secs * 1000 + 0.5);
+				if (secs > 0 && sleep_time == 0)
+					sleep_time = 1;
 			}
 			break;
 		case 'S':
@@ -450,12 +531,95 @@ main(int argc, char **argv)
 		case 'l':
 			opt_list = 1;
 			break;
+		case 'R':
+			opt_rate = 1;
+			break;
+		case '\4':
+			if (!strcmp(optarg, "json"))
+				opt_format = FMT_JSON;
+			else if (!strcmp(optarg, "csv"))
+				opt_format = FMT_CSV;
+			else if (!strcmp(optarg, "openmetrics"))
+				opt_format = FMT_OPENMETRICS;
+			else {
+				fprintf(stderr, "nfsstat: unknown format: "
+						"%s\n", optarg);
+				return 2;
+			}
+			break;
+		case '\5':
+			opt_top = 1;
+			if (optarg) {
+				top.rows = strtoul(optarg, &end, 10);
+				if (*optarg == '\0' || *end != '\0') {
+					fprintf(stderr, "nfsstat: bad number "
+							"of mounts '%s'\n",
+							optarg);
+					return 2;
+				}
+			}
+			break;
+		case '\6':
+			if (!strcmp(optarg, "mount"))
+				top.by = MS_BY_MOUNT;
+			else if (!strcmp(optarg, "server"))
+				top.by = MS_BY_SERVER;
+			else if (!strcmp(optarg, "xprt"))
+				top.by = MS_BY_XPRT;
+			else {
+				fprintf(stderr, "nfsstat: cannot rank by "
+						"%s\n", optarg);
+				return 2;
+			}
+			break;
+		case '\7':
+			if (!strcasecmp(optarg, "rtt"))
+				top.sort = MS_SORT_RTT;
+			else if (!strcasecmp(optarg, "exe"))
+				top.sort = MS_SORT_EXE;
+			else if (!strcasecmp(optarg, "queue"))
+				top.sort = MS_SORT_QUEUE;
+			else if (!strcasecmp(optarg, "ops"))
+				top.sort = MS_SORT_OPS;
+			else if (!strcasecmp(optarg, "kB"))
+				top.sort = MS_SORT_KB;
+			else if (!strcasecmp(optarg, "retrans"))
+				top.sort = MS_SORT_RETRANS;
+			else if (!strcasecmp(optarg, "errors"))
+				top.sort = MS_SORT_ERRORS;
+			else {
+				fprintf(stderr, "nfsstat: unknown sort key: "
+						"%s\n", optarg);
+				return 2;
+			}
+			break;
+		case '\10':
+			top.host = optarg;
+			break;
+		case '\11':
+			top.op = optarg;
+			break;
+		case '\12':
+			top.window = strtoul(optarg, &end, 10);
+			if (*optarg == '\0' || *end != '\0' ||
+			    top.window == 0 || top.window > 3600) {
+				fprintf(stderr, "nfsstat: bad window '%s'\n",
+						optarg);
+				return 2;
+			}
+			break;
 		case 'z':
 			fprintf(stderr, "nfsstat: zeroing of nfs statistics "
 					"not yet supported\n");
 			return 2;
 		case 'm':
 			return ! mounts(MOUNTSFILE);
+		case 'M':
+			opt_mountstats = 1;
+			break;
+		case '\13':
+			return mountstats_snapshot(optarg ? optarg :
+							MOUNTSTATSFILE);
 		case '\1':
 			usage(progname);
 			return 0;
@@ -468,6 +632,30 @@ main(int argc, char **argv)
 		}
 	}
 
+	if (opt_rate && !sleep_time) {
+		fprintf(stderr, "nfsstat: --rate needs an interval, "
+				"as in '-Z5 --rate'\n");
+		return 2;
+	}
+
+	if (opt_top)
+		return mountstats_top(MOUNTSTATSFILE,
+				sleep_time ? sleep_time : 1000, &top);
+	if (opt_mountstats)
+		return mountstats(MOUNTSTATSFILE, sleep_time);
+
+	if (opt_format != FMT_TABLE) {
+		if (opt_since || opt_rate || opt_list) {
+			fprintf(stderr, "nfsstat: --format cannot be used with "
+					"--since, --rate or --list\n");
+			return 2;
+		}
+		if (!opt_srv && !opt_clt)
+			opt_srv = opt_clt = 1;
+		return stream_stats(opt_srv, opt_clt,
+				    sleep_time ? sleep_time : 1000, opt_format);
+	}
+
 	if (opt_all) {
 		opt_srv = opt_clt = 1;
 		opt_prt |= PRNT_ALL;
@@ -499,6 +687,7 @@ main(int argc, char **argv)
 		get_stats(serverfile, serverinfo, &opt_srv, opt_clt, 1);
 	if (opt_clt)
 		get_stats(clientfile, clientinfo, &opt_clt, opt_srv, 0);
+	then = monotonic_msecs();
 
 	if (opt_sleep && !sleep_time) {
 		starttime = time(NULL);
@@ -513,23 +702,30 @@ main(int argc, char **argv)
 	if (opt_since || (opt_sleep && !sleep_time)) {
 		if (opt_srv) {
 			get_stats(NFSSRVSTAT, serverinfo_tmp, &opt_srv, opt_clt, 1);
-			diff_stats(serverinfo_tmp, serverinfo, 1);
+			diff_stats(serverinfo_tmp, serverinfo);
 		}
 		if (opt_clt) {
 			get_stats(NFSCLTSTAT, clientinfo_tmp, &opt_clt, opt_srv, 0);
-			diff_stats(clientinfo_tmp, clientinfo, 0);
+			diff_stats(clientinfo_tmp, clientinfo);
 		}
 	}
 	if(sleep_time) {
 		while(1) {
 			if (opt_srv) {
 				get_stats(NFSSRVSTAT, serverinfo_tmp , &opt_srv, opt_clt, 1);
-				diff_stats(serverinfo_tmp, serverinfo, 1);
+				diff_stats(serverinfo_tmp, serverinfo);
 			}
 			if (opt_clt) {
 				get_stats(NFSCLTSTAT, clientinfo_tmp, &opt_clt, opt_srv, 0);
-				diff_stats(clientinfo_tmp, clientinfo, 0);
+				diff_stats(clientinfo_tmp, clientinfo);
 			}
+			now = monotonic_msecs();
+			msecs = now - then;
+			then = now;
+			if (opt_rate && opt_srv)
+				rate_stats(serverinfo_tmp, msecs);
+			if (opt_rate && opt_clt)
+				rate_stats(clientinfo_tmp, msecs);
 			if (opt_list) {
 				print_stats_list(opt_srv, opt_clt, opt_prt);
 			} else {
@@ -537,12 +733,7 @@ main(int argc, char **argv)
 			}
 			fflush(stdout);
 
-			if (opt_srv)
-				update_old_counters(serverinfo_tmp, serverinfo);
-			if (opt_clt)
-				update_old_counters(clientinfo_tmp, clientinfo);
-
-			sleep(sleep_time);
+			sleep_msecs(sleep_time);
 		}	
 	} else {
 		if (opt_list) {
@@ -626,7 +817,7 @@ print_server_stats(int opt_prt)
 	 */
 	if (opt_prt & PRNT_FH) {
 		if (get_stat_info("fh", srvinfo)) {	/* >= 2.4 */
-			int t = srvfhinfo[3];
+			unsigned long long t = srvfhinfo[3];
 			srvfhinfo[3]=srvfhinfo[4];
 			srvfhinfo[4]=t;
 			
@@ -824,19 +1015,19 @@ get_stat_info(const char *sp, struct statinfo *statp)
 }
 
 static void
-print_numbers(const char *hdr, unsigned int *info, unsigned int nr)
+print_numbers(const char *hdr, unsigned long long *info, unsigned int nr)
 {
 	unsigned int	i;
 
 	fputs(hdr, stdout);
 	for (i = 0; i < nr; i++)
-		printf("%s%-8u", i? "   " : "", info[i]);
+		printf("%s%-8llu", i? "   " : "", info[i]);
 	printf("\n");
 }
 
 static void
 print_callstats(const char *hdr, const char **names,
-				 unsigned int *info, unsigned int nr)
+				 unsigned long long *info, unsigned int nr)
 {
 	unsigned long long	total;
 	unsigned long long	pct;
@@ -852,8 +1043,8 @@ print_callstats(const char *hdr, const char **names,
 			printf("%-17s", names[i+j]);
 		printf("\n");
 		for (j = 0; j < 5 && i + j < nr; j++) {
-			pct = ((unsigned long long) info[i+j]*100)/total;
-			printf("%-8u%3llu%%     ", info[i+j], pct);
+			pct = (info[i+j] * 100) / total;
+			printf("%-8llu%3llu%%     ", info[i+j], pct);
 		}
 		printf("\n");
 	}
@@ -862,7 +1053,7 @@ print_callstats(const char *hdr, const char **names,
 
 static void
 print_callstats_list(const char *hdr, const char **names,
-		 	unsigned int *callinfo, unsigned int nr)
+		 	unsigned long long *callinfo, unsigned int nr)
 {
 	unsigned long long	calltotal;
 	unsigned int			i;
@@ -876,13 +1067,39 @@ print_callstats_list(const char *hdr, const char **names,
 	printf("------------- ------------- --------\n");
 	for (i = 0; i < nr; i++) {
 			if (callinfo[i])
-				printf("%13s %12s: %8u \n", hdr, names[i], callinfo[i]);
+				printf("%13s %12s: %8llu \n", hdr, names[i], callinfo[i]);
 	}
 	printf("\n");
 		
 }
 
 
+static void
+parse_raw_statline(char *line, struct statinfo *statp)
+{
+	struct statinfo	*ip;
+	char		*sp, *save;
+	unsigned int    i, cnt;
+	unsigned long long total = 0;
+
+	if (!(sp = strtok_r(line, " \t", &save)))
+		return;
+
+	ip = get_stat_info(sp, statp);
+	if (!ip)
+		return;
+
+	cnt = ip->nrvals;
+
+	for (i = 0; i < cnt; i++) {
+		if (!(sp = strtok_r(NULL, " \t", &save)))
+			break;
+		ip->valptr[i] = strtoull(sp, NULL, 0);
+		total += ip->valptr[i];
+	}
+	ip->valptr[cnt - 1] = total;
+}
+
 /* returns 0 on success, 1 otherwise */
 static int
 parse_raw_statfile(const char *name, struct statinfo *statp)
@@ -899,29 +1116,9 @@ parse_raw_statfile(const char *name, struct statinfo *statp)
 	}
 
 	while (fgets(buffer, sizeof(buffer), fp) != NULL) {
-		struct statinfo	*ip;
-		char		*sp, *line = buffer;
-		unsigned int    i, cnt;
-		unsigned int	total = 0;
-
-		if ((next = strchr(line, '\n')) != NULL)
-			*next++ = '\0';
-		if (!(sp = strtok(line, " \t")))
-			continue;
-
-		ip = get_stat_info(sp, statp);
-		if (!ip)
-			continue;
-
-		cnt = ip->nrvals;
-
-		for (i = 0; i < cnt; i++) {
-			if (!(sp = strtok(NULL, " \t")))
-				break;
-			ip->valptr[i] = (unsigned int) strtoul(sp, NULL, 0);
-			total += ip->valptr[i];
-		}
-		ip->valptr[cnt - 1] = total;
+		if ((next = strchr(buffer, '\n')) != NULL)
+			*next = '\0';
+		parse_raw_statline(buffer, statp);
 	}
 
 	fclose(fp);
@@ -933,7 +1130,7 @@ static int
 parse_pretty_statfile(const char *filename, struct statinfo *info)
 {
 	int numvals, curindex, numconsumed, n, err = 1;
-	unsigned int sum;
+	unsigned long long sum;
 	char buf[4096], *bufp, *fmt, is_proc;
 	FILE *fp = NULL;
 	struct statinfo *ip;
@@ -951,11 +1148,11 @@ parse_pretty_statfile(const char *filename, struct statinfo *info)
 			numvals = ip->nrvals - 1;
 			is_proc = strncmp("proc", ip->tag, 4) ? 0 : 1;
 			if (is_proc) {
-				fmt = " %u %*u%% %n";
+				fmt = " %llu %*u%% %n";
 				curindex = 1;
 				ip->valptr[0] = 0;
 			} else {
-				fmt = " %u %n";
+				fmt = " %llu %n";
 				curindex = 0;
 			}
 more_stats:
@@ -1104,28 +1301,46 @@ out:
  * there are stats if the sum's greater than the entry-count.
  */
 static int
-has_stats(const unsigned int *info, int nr)
+has_stats(const unsigned long long *info, int nr)
 {
 	return (info[0] && info[nr-1] > info[0]);
 }
 static int
-has_rpcstats(const unsigned int *info, int size)
+has_rpcstats(const unsigned long long *info, int size)
 {
-	int i, cnt;
+	int i;
+	unsigned long long cnt;
 
 	for (i=0, cnt=0; i < size; i++)
 		cnt += info[i];
-	return cnt;
+	return cnt != 0;
+}
+
+/*
+ * The kernel keeps many of these counters in 32 bits.  A counter that
+ * went backwards and fits in 32 bits has most likely wrapped; one
+ * that does not fit was reset, e.g. by reloading the module.
+ */
+static unsigned long long
+diff_counter(unsigned long long new, unsigned long long old)
+{
+	if (new >= old)
+		return new - old;
+	if (old <= UINT32_MAX)
+		return new + (UINT32_MAX - old) + 1;
+	return new;
 }
 
 /*
  * take the difference of each individual stat value in 'new' and 'old'
- * and store the results back into 'new'
+ * and store the results back into 'new'.  The values 'new' had are
+ * kept in 'old', ready for the next interval.
  */
 static void
-diff_stats(struct statinfo *new, struct statinfo *old, int is_srv)
+diff_stats(struct statinfo *new, struct statinfo *old)
 {
-	int i, j, nodiff_first_index, should_diff;
+	int i, j, is_proc, should_diff, total;
+	unsigned long long raw, sum;
 
 	/*
 	 * Different stat types have different formats in the /proc
@@ -1133,28 +1348,54 @@ diff_stats(struct statinfo *new, struct statinfo *old, int is_srv)
 	 * the total number of subsequent entries; one does not want
 	 * to diff that first entry.  The other stat types aren't like
 	 * this.  So, we diff a given entry if it's not of one of the
-	 * procX types ("i" < 2 for clt, < 4 for srv), or if it's not
-	 * the first entry ("j" > 0).
+	 * procX types, or if it's not the first entry ("j" > 0).
+	 *
+	 * The "totals" entry (last value in each stat array) is not
+	 * diffed but summed again, so that it still includes the
+	 * procX-type "numentries" entry.
 	 */
-	nodiff_first_index = 2 + (2 * is_srv);
-
 	for (i = 0; old[i].tag; i++) {
-		for (j = 0; j < new[i].nrvals; j++) {
-			should_diff = (i < nodiff_first_index || j > 0);
+		is_proc = !strncmp("proc", new[i].tag, 4);
+		total = new[i].nrvals - 1;
+		sum = 0;
+		for (j = 0; j < total; j++) {
+			should_diff = (!is_proc || j > 0);
+			raw = new[i].valptr[j];
 			if (should_diff)
-				new[i].valptr[j] -= old[i].valptr[j];
+				new[i].valptr[j] = diff_counter(raw,
+							old[i].valptr[j]);
+			old[i].valptr[j] = raw;
+			sum += new[i].valptr[j];
 		}
+		old[i].valptr[total] = new[i].valptr[total];
+		new[i].valptr[total] = sum;
+	}
+}
 
-		/*
-		 * Make sure that the "totals" entry (last value in
-		 * each stat array) for the procX-type stats has the
-		 * "numentries" entry's (first value in procX-type
-		 * stat arrays) constant value added-back after the
-		 * diff -- i.e., it should always be included in the
-		 * total.
-		 */
-		if (!strncmp("proc", new[i].tag, 4) && old[i].valptr[0])
-			new[i].valptr[new[i].nrvals - 1] += new[i].valptr[0];
+/*
+ * turn the differences diff_stats() left in 'info' into per-second
+ * rates over 'msecs' milliseconds, rounding to the nearest
+ */
+static void
+rate_stats(struct statinfo *info, long long msecs)
+{
+	int i, j, is_proc, total;
+	unsigned long long sum;
+
+	if (msecs <= 0)
+		return;
+
+	for (i = 0; info[i].tag; i++) {
+		is_proc = !strncmp("proc", info[i].tag, 4);
+		total = info[i].nrvals - 1;
+		sum = 0;
+		for (j = 0; j < total; j++) {
+			if (!is_proc || j > 0)
+				info[i].valptr[j] = (info[i].valptr[j] * 1000 +
+						     msecs / 2) / msecs;
+			sum += info[i].valptr[j];
+		}
+		info[i].valptr[total] = sum;
 	}
 }
 
@@ -1172,12 +1413,231 @@ unpause(int sig)
 	printf("Signal %d received; displaying (only) statistics gathered over the last %d minutes, %d seconds:\n\n", sig, minutes, seconds);
 }
 
+/*
+ * Streaming export: --format=json|csv|openmetrics.  The stat files are
+ * opened once and read again with pread() each tick, and the changes
+ * since the last tick are printed as (side, table, name, delta).
+ */
+static const char *	srvnetname[] = { "packets", "udp", "tcp", "tcpconn" };
+static const char *	srvrpcname[] = { "calls", "badcalls", "badfmt",
+					 "badauth", "badclnt" };
+static const char *	srvrcname[] = { "hits", "misses", "nocache" };
+static const char *	srvioname[] = { "read", "write" };
+static const char *	cltrpcname[] = { "calls", "retrans", "authrefrsh" };
+
+struct stream_table {
+	const char *	tag;		/* statinfo tag */
+	const char *	table;		/* name printed */
+	const char **	names;
+	unsigned int	nr;
+	int		first;		/* index of names[0] in valptr */
+};
+
+#define TABLE(t, n, k, f)	{ t, n, k, ARRAYSIZE(k), f }
+static const struct stream_table srvtables[] = {
+	TABLE("net", "net", srvnetname, 0),
+	TABLE("rpc", "rpc", srvrpcname, 0),
+	TABLE("rc", "rc", srvrcname, 0),
+	TABLE("io", "io", srvioname, 0),
+	TABLE("proc2", "nfs2", nfsv2name, 1),
+	TABLE("proc3", "nfs3", nfsv3name, 1),
+	TABLE("proc4", "nfs4", nfssrvproc4name, 1),
+	TABLE("proc4ops", "nfs4ops", nfssrvproc4opname, 1),
+	{ NULL, NULL, NULL, 0, 0 }
+};
+static const struct stream_table clttables[] = {
+	TABLE("net", "net", srvnetname, 0),
+	TABLE("rpc", "rpc", cltrpcname, 0),
+	TABLE("proc2", "nfs2", nfsv2name, 1),
+	TABLE("proc3", "nfs3", nfsv3name, 1),
+	TABLE("proc4", "nfs4", nfscltproc4name, 1),
+	{ NULL, NULL, NULL, 0, 0 }
+};
+
+struct stream_side {
+	const char *			side;
+	const char *			file;
+	int				fd;
+	struct statinfo *		info;
+	struct statinfo *		old;
+	const struct stream_table *	tables;
+};
+
+static char *	streambuf;
+static size_t	streambuflen;
+
+/* returns 0 on success, 1 otherwise */
+static int
+stream_read(struct stream_side *sp, struct statinfo *info)
+{
+	char *line, *next;
+	size_t got = 0;
+	ssize_t len;
+
+	for (;;) {
+		if (got + 1 >= streambuflen) {
+			size_t newlen = streambuflen ? streambuflen * 2 : 8192;
+			char *newbuf = realloc(streambuf, newlen);
+
+			if (newbuf == NULL)
+				return 1;
+			streambuf = newbuf;
+			streambuflen = newlen;
+		}
+		len = pread(sp->fd, streambuf + got, streambuflen - got - 1,
+				got);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			return 1;
+		}
+		if (len == 0)
+			break;
+		got += len;
+	}
+	streambuf[got] = '\0';
+
+	for (line = streambuf; line && *line; line = next) {
+		if ((next = strchr(line, '\n')) != NULL)
+			*next++ = '\0';
+		parse_raw_statline(line, info);
+	}
+	return 0;
+}
+
 static void
-update_old_counters(struct statinfo *new, struct statinfo *old)
+stream_print(struct stream_side *sp, const char *stamp, long msecs,
+		int format)
 {
-	int z, i;
-	for (z = 0; old[z].tag; z++) 
-		for (i = 0; i <= old[z].nrvals; i++) 
-			old[z].valptr[i] += new[z].valptr[i];
+	const struct stream_table *tp;
+	struct statinfo *ip;
+	unsigned long long delta;
+	unsigned int i, nvals;
 
+	if (format == FMT_JSON)
+		printf("{\"time\":%s,\"interval_ms\":%ld,\"side\":\"%s\"",
+			stamp, msecs, sp->side);
+
+	for (tp = sp->tables; tp->tag; tp++) {
+		ip = get_stat_info(tp->tag, sp->info);
+		if (!ip)
+			continue;
+		nvals = 0;
+		for (i = 0; i < tp->nr &&
+			    tp->first + i < (unsigned int)ip->nrvals - 1; i++) {
+			delta = ip->valptr[tp->first + i];
+			if (!delta)
+				continue;
+			switch (format) {
+			case FMT_JSON:
+				if (nvals)
+					printf(",");
+				else
+					printf(",\"%s\":{", tp->table);
+				printf("\"%s\":%llu", tp->names[i], delta);
+				break;
+			case FMT_CSV:
+				printf("%s,%ld,%s,%s,%s,%llu\n", stamp, msecs,
+					sp->side, tp->table, tp->names[i],
+					delta);
+				break;
+			case FMT_OPENMETRICS:
+				printf("nfsstat_delta{side=\"%s\",table=\"%s\","
+					"name=\"%s\"} %llu %s\n", sp->side,
+					tp->table, tp->names[i], delta, stamp);
+				break;
+			}
+			nvals++;
+		}
+		if (format == FMT_JSON && nvals)
+			printf("}");
+	}
+
+	if (format == FMT_JSON)
+		printf("}\n");
+}
+
+/*
+ * Never returns unless the stat files cannot be read; returns 2 then,
+ * as get_stats() would exit.
+ */
+static int
+stream_stats(int opt_srv, int opt_clt, long msecs, int format)
+{
+	struct stream_side sides[2] = {
+		{ "server", NFSSRVSTAT, -1, srvinfo, srvinfo_old, srvtables },
+		{ "client", NFSCLTSTAT, -1, cltinfo, cltinfo_old, clttables },
+	};
+	struct timespec next, now;
+	char stamp[32];
+	long long then, mono;
+	long interval;
+	int i, open_sides = 0;
+
+	if (!opt_srv)
+		sides[0].file = NULL;
+	if (!opt_clt)
+		sides[1].file = NULL;
+	for (i = 0; i < 2; i++) {
+		if (!sides[i].file)
+			continue;
+		sides[i].fd = open(sides[i].file, O_RDONLY | O_CLOEXEC);
+		if (sides[i].fd < 0 || stream_read(&sides[i], sides[i].old)) {
+			fprintf(stderr, "Warning: %s: %s\n", sides[i].file,
+					strerror(errno));
+			if (sides[i].fd >= 0)
+				close(sides[i].fd);
+			sides[i].fd = -1;
+			continue;
+		}
+		open_sides++;
+	}
+	if (!open_sides) {
+		fprintf(stderr, "Error: No Stats to stream.\n");
+		return 2;
+	}
+
+	if (format == FMT_CSV)
+		printf("time,interval_ms,side,table,name,delta\n");
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	then = monotonic_msecs();
+	for (;;) {
+		next.tv_sec += msecs / 1000;
+		next.tv_nsec += (msecs % 1000) * 1000000;
+		if (next.tv_nsec >= 1000000000) {
+			next.tv_sec++;
+			next.tv_nsec -= 1000000000;
+		}
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+					&next, NULL) == EINTR)
+			;
+
+		clock_gettime(CLOCK_REALTIME, &now);
+		snprintf(stamp, sizeof(stamp), "%lld.%03ld",
+			 (long long)now.tv_sec, now.tv_nsec / 1000000);
+		mono = monotonic_msecs();
+		interval = (long)(mono - then);
+		then = mono;
+
+		if (format == FMT_OPENMETRICS)
+			printf("# TYPE nfsstat_delta gauge\n"
+				"# HELP nfsstat_delta Change in an NFS "
+				"statistic since the last sample\n");
+
+		for (i = 0; i < 2; i++) {
+			if (sides[i].fd < 0)
+				continue;
+			if (stream_read(&sides[i], sides[i].info)) {
+				fprintf(stderr, "Error: %s: %s\n",
+						sides[i].file, strerror(errno));
+				return 2;
+			}
+			diff_stats(sides[i].info, sides[i].old);
+			stream_print(&sides[i], stamp, interval, format);
+		}
+		if (format == FMT_OPENMETRICS)
+			printf("# EOF\n");
+		fflush(stdout);
+	}
 }
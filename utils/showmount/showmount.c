@@ -23,6 +23,7 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <sys/time.h>
+#include <time.h>
 #include <string.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -33,15 +34,25 @@
 #include <netdb.h>
 #include <arpa/inet.h>
 #include <errno.h>
+#include <ctype.h>
+#ifdef HAVE_LIBPTHREAD
+#include <pthread.h>
+#endif
 #include <getopt.h>
 #include <mount.h>
 #include <unistd.h>
 
 #include "nfsrpc.h"
+#include "sockaddr.h"
+#include "nfslib.h"
 
 #define TIMEOUT_UDP	3
 #define TOTAL_TIMEOUT	20
 
+/* Servers queried at once in multi-host mode, by default and at most */
+#define SHOWMOUNT_JOBS		32
+#define SHOWMOUNT_MAXJOBS	256
+
 static char *	version = "showmount for " VERSION;
 static char *	program_name;
 static int	headers = 1;
@@ -49,12 +60,20 @@ static int	hflag = 0;
 static int	aflag = 0;
 static int	dflag = 0;
 static int	eflag = 0;
+static int	parseable = 0;
+static int	jobs = SHOWMOUNT_JOBS;
+static int	timeout = TOTAL_TIMEOUT;
+static rpcprog_t mount_program;
 
 static struct option longopts[] =
 {
 	{ "all", 0, 0, 'a' },
 	{ "directories", 0, 0, 'd' },
 	{ "exports", 0, 0, 'e' },
+	{ "hosts-from", 1, 0, 'f' },
+	{ "jobs", 1, 0, 'j' },
+	{ "parseable", 0, 0, 'p' },
+	{ "timeout", 1, 0, 't' },
 	{ "no-headers", 0, &headers, 0 },
 	{ "version", 0, 0, 'v' },
 	{ "help", 0, 0, 'h' },
@@ -72,9 +91,12 @@ static int dump_cmp(const void *pv, const void *qv)
 
 static void usage(FILE *fp, int n)
 {
-	fprintf(fp, "Usage: %s [-adehv]\n", program_name);
+	fprintf(fp, "Usage: %s [-adehpv] [-f file] [-j jobs] [-t secs]\n",
+		program_name);
 	fprintf(fp, "       [--all] [--directories] [--exports]\n");
-	fprintf(fp, "       [--no-headers] [--help] [--version] [host]\n");
+	fprintf(fp, "       [--hosts-from file] [--jobs jobs] [--parseable]\n");
+	fprintf(fp, "       [--timeout secs] [--no-headers] [--help] [--version]\n");
+	fprintf(fp, "       [host ...]\n");
 	exit(n);
 }
 
@@ -93,48 +115,466 @@ static const rpcvers_t mount_vers_tbl[] = {
 static const unsigned int max_vers_tblsz = 
 	(sizeof(mount_vers_tbl)/sizeof(mount_vers_tbl[0]));
 
+/*
+ * What one query of a server brought back
+ */
+struct showmount_reply {
+	exports		sr_exports;
+	mountlist	sr_dump;
+	char *		sr_error;	/* NULL if the query succeeded */
+};
+
+/*
+ * Servers still to be queried in multi-host mode
+ */
+static char **		host_list;
+static unsigned int	host_count, host_size, host_next;
+static unsigned int	host_failed;
+
+#ifdef HAVE_LIBPTHREAD
+/* Protects the host list, stdout, and the RPC error string buffer */
+static pthread_mutex_t	showmount_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define showmount_lock()	pthread_mutex_lock(&showmount_mutex)
+#define showmount_unlock()	pthread_mutex_unlock(&showmount_mutex)
+#else
+#define showmount_lock()	do { } while (0)
+#define showmount_unlock()	do { } while (0)
+#endif
+
+static void *xmalloc(size_t size)
+{
+	void *p = malloc(size);
+
+	if (p == NULL) {
+		fprintf(stderr, "%s: out of memory\n", program_name);
+		exit(1);
+	}
+	return p;
+}
+
+static char *showmount_message(const char *what, const char *msg)
+{
+	char *s;
+
+	if (asprintf(&s, "%s: %s", what, msg) < 0) {
+		fprintf(stderr, "%s: out of memory\n", program_name);
+		exit(1);
+	}
+	return s;
+}
+
+/*
+ * Copy an RPC error message, which the library builds in a buffer
+ * shared by all threads.
+ */
+static char *showmount_error(CLIENT *client, const char *what)
+{
+	char *msg, *nl;
+
+	showmount_lock();
+	msg = strdup(client ? clnt_sperror(client, what) :
+			clnt_spcreateerror(what));
+	showmount_unlock();
+	if (msg == NULL) {
+		fprintf(stderr, "%s: out of memory\n", program_name);
+		exit(1);
+	}
+	if ((nl = strchr(msg, '\n')) != NULL)
+		*nl = '\0';
+	return msg;
+}
+
+/*
+ * Time left until @deadline, in @tv.  Returns zero once it has passed,
+ * with rpc_createerr set to say so.
+ */
+static int showmount_time_left(const struct timespec *deadline,
+			       struct timeval *tv)
+{
+	struct timespec now;
+	long long usecs;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	usecs = (deadline->tv_sec - now.tv_sec) * 1000000LL +
+		(deadline->tv_nsec - now.tv_nsec) / 1000;
+	if (usecs <= 0) {
+		rpc_createerr.cf_stat = RPC_TIMEDOUT;
+		return 0;
+	}
+	tv->tv_sec = usecs / 1000000;
+	tv->tv_usec = usecs % 1000000;
+	return 1;
+}
+
 /*
  * Generate an RPC client handle connected to the mountd service
- * at @hostname, or die trying.
+ * at @hostname, trying TCP and then UDP, or give up by @deadline.
+ * Returns NULL with rpc_createerr set if no client could be created.
  *
  * Supports both AF_INET and AF_INET6 server addresses.
  */
-static CLIENT *nfs_get_mount_client(const char *hostname, rpcvers_t vers)
+static CLIENT *nfs_get_mount_client(const char *hostname, rpcvers_t vers,
+				    const struct timespec *deadline)
 {
-	rpcprog_t program = nfs_getrpcbyname(MOUNTPROG, mount_pgm_tbl);
-	CLIENT *client;
-
-	client = clnt_create(hostname, program, vers, "tcp");
-	if (client)
-		return client;
-	client = clnt_create(hostname, program, vers, "udp");
-	if (client)
-		return client;
-
-	clnt_pcreateerror("clnt_create");
-	exit(1);
+	static const unsigned short protocols[] = { IPPROTO_TCP, IPPROTO_UDP };
+	struct addrinfo hint, *res, *ai;
+	union nfs_sockaddr address;
+	CLIENT *client = NULL;
+	unsigned short port;
+	struct timeval tv;
+	unsigned int i;
+
+	memset(&hint, 0, sizeof(hint));
+	hint.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(hostname, NULL, &hint, &res) != 0) {
+		nfs_clear_rpc_createerr();
+		rpc_createerr.cf_stat = RPC_UNKNOWNHOST;
+		return NULL;
+	}
+
+	for (i = 0; i < 2 && client == NULL; i++) {
+		for (ai = res; ai != NULL && client == NULL; ai = ai->ai_next) {
+			if (ai->ai_addrlen > sizeof(address))
+				continue;
+			if (!showmount_time_left(deadline, &tv))
+				goto out;
+			port = nfs_getport_timed(ai->ai_addr, ai->ai_addrlen,
+					mount_program, vers, protocols[i], &tv);
+			if (port == 0 || !showmount_time_left(deadline, &tv))
+				continue;
+			memcpy(&address, ai->ai_addr, ai->ai_addrlen);
+			nfs_set_port(&address.sa, port);
+			client = nfs_get_rpcclient(&address.sa, ai->ai_addrlen,
+					protocols[i], mount_program, vers, &tv);
+		}
+	}
+out:
+	freeaddrinfo(res);
+	return client;
 }
 
-int main(int argc, char **argv)
+/*
+ * Ask the mountd service at @hostname for its export list, with -e,
+ * or for its list of mounts.
+ */
+static void showmount_query(const char *hostname,
+			    struct showmount_reply *reply)
 {
-	char hostname_buf[MAXHOSTLEN];
-	char *hostname;
-	enum clnt_stat clnt_stat;
+	const char *what = eflag ? "rpc mount export" : "rpc mount dump";
 	struct timeval total_timeout;
-	int c;
+	struct timespec deadline;
+	enum clnt_stat clnt_stat;
+	unsigned int vers = 0;
 	CLIENT *mclient;
+
+	memset(reply, 0, sizeof(*reply));
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += timeout;
+
+	mclient = nfs_get_mount_client(hostname, mount_vers_tbl[vers],
+				       &deadline);
+	if (mclient == NULL) {
+		reply->sr_error = showmount_error(NULL, "clnt_create");
+		return;
+	}
+	mclient->cl_auth = nfs_authsys_create();
+	if (mclient->cl_auth == NULL) {
+		reply->sr_error = showmount_message(program_name,
+					"unable to create RPC auth handle.");
+		clnt_destroy(mclient);
+		return;
+	}
+
+	for (;;) {
+		if (!showmount_time_left(&deadline, &total_timeout)) {
+			reply->sr_error = showmount_message(what,
+					clnt_sperrno(RPC_TIMEDOUT));
+			clnt_stat = RPC_SUCCESS;
+			break;
+		}
+		if (eflag)
+			clnt_stat = clnt_call(mclient, MOUNTPROC_EXPORT,
+				(xdrproc_t) xdr_void, NULL,
+				(xdrproc_t) xdr_exports,
+				(caddr_t) &reply->sr_exports,
+				total_timeout);
+		else
+			clnt_stat = clnt_call(mclient, MOUNTPROC_DUMP,
+				(xdrproc_t) xdr_void, NULL,
+				(xdrproc_t) xdr_mountlist,
+				(caddr_t) &reply->sr_dump,
+				total_timeout);
+		if (clnt_stat != RPC_PROGVERSMISMATCH ||
+		    ++vers >= max_vers_tblsz)
+			break;
+		(void)CLNT_CONTROL(mclient, CLSET_VERS,
+			(void *)&mount_vers_tbl[vers]);
+	}
+	if (clnt_stat != RPC_SUCCESS)
+		reply->sr_error = showmount_error(mclient, what);
+
+	auth_destroy(mclient->cl_auth);
+	clnt_destroy(mclient);
+}
+
+static void showmount_free(struct showmount_reply *reply)
+{
+	xdr_free((xdrproc_t) xdr_exports, (char *) &reply->sr_exports);
+	xdr_free((xdrproc_t) xdr_mountlist, (char *) &reply->sr_dump);
+	free(reply->sr_error);
+}
+
+static void showmount_print_exports(FILE *fp, const char *hostname,
+				    exports exportlist)
+{
 	groups grouplist;
-	exports exportlist, exl;
-	mountlist dumplist;
+	exports exl;
+	int n, maxlen;
+
+	if (parseable) {
+		for (exl = exportlist; exl; exl = exl->ex_next) {
+			fprintf(fp, "%s\texport\t%s\t", hostname, exl->ex_dir);
+			for (grouplist = exl->ex_groups; grouplist;
+			     grouplist = grouplist->gr_next)
+				fprintf(fp, "%s%s", grouplist->gr_name,
+					grouplist->gr_next ? "," : "");
+			fputc('\n', fp);
+		}
+		return;
+	}
+
+	if (headers)
+		fprintf(fp, "Export list for %s:\n", hostname);
+	maxlen = 0;
+	for (exl = exportlist; exl; exl = exl->ex_next) {
+		if ((n = strlen(exl->ex_dir)) > maxlen)
+			maxlen = n;
+	}
+	for (exl = exportlist; exl; exl = exl->ex_next) {
+		fprintf(fp, "%-*s ", maxlen, exl->ex_dir);
+		grouplist = exl->ex_groups;
+		if (grouplist)
+			while (grouplist) {
+				fprintf(fp, "%s%s", grouplist->gr_name,
+					grouplist->gr_next ? "," : "");
+				grouplist = grouplist->gr_next;
+			}
+		else
+			fprintf(fp, "(everyone)");
+		fputc('\n', fp);
+	}
+}
+
+static void showmount_print_dump(FILE *fp, const char *hostname,
+				 mountlist dumplist)
+{
+	const char *kind;
 	mountlist list;
-	int i;
-	int n;
-	int maxlen;
-	int unsigned vers=0;
 	char **dumpv;
+	int i, n;
+
+	n = 0;
+	for (list = dumplist; list; list = list->ml_next)
+		n++;
+	dumpv = (char **) xmalloc((n ? n : 1) * sizeof (char *));
+	i = 0;
+
+	if (hflag) {
+		kind = "client";
+		if (headers && !parseable)
+			fprintf(fp, "Hosts on %s:\n", hostname);
+		for (list = dumplist; list; list = list->ml_next)
+			dumpv[i++] = strdup(list->ml_hostname);
+	}
+	else if (aflag) {
+		kind = "mount";
+		if (headers && !parseable)
+			fprintf(fp, "All mount points on %s:\n", hostname);
+		for (list = dumplist; list; list = list->ml_next) {
+			char *t;
+
+			t = xmalloc(strlen(list->ml_hostname) +
+				    strlen(list->ml_directory) + 2);
+			sprintf(t, "%s%c%s", list->ml_hostname,
+				parseable ? '\t' : ':', list->ml_directory);
+			dumpv[i++] = t;
+		}
+	}
+	else {
+		kind = "directory";
+		if (headers && !parseable)
+			fprintf(fp, "Directories on %s:\n", hostname);
+		for (list = dumplist; list; list = list->ml_next)
+			dumpv[i++] = strdup(list->ml_directory);
+	}
+	for (i = 0; i < n; i++)
+		if (dumpv[i] == NULL) {
+			fprintf(stderr, "%s: out of memory\n", program_name);
+			exit(1);
+		}
+
+	qsort(dumpv, n, sizeof (char *), dump_cmp);
+
+	for (i = 0; i < n; i++) {
+		if (i == 0 || strcmp(dumpv[i], dumpv[i - 1]) != 0) {
+			if (parseable)
+				fprintf(fp, "%s\t%s\t", hostname, kind);
+			fprintf(fp, "%s\n", dumpv[i]);
+		}
+	}
+	for (i = 0; i < n; i++)
+		free(dumpv[i]);
+	free(dumpv);
+}
+
+static void showmount_print(FILE *fp, const char *hostname,
+			    struct showmount_reply *reply)
+{
+	if (eflag)
+		showmount_print_exports(fp, hostname, reply->sr_exports);
+	else
+		showmount_print_dump(fp, hostname, reply->sr_dump);
+}
+
+/*
+ * Query servers from the host list until it is empty.  Each server's
+ * results are written out in one piece as soon as they are in.
+ */
+static void *showmount_worker(void *UNUSED(arg))
+{
+	struct showmount_reply reply;
+	const char *hostname;
+	char *buf;
+	size_t len;
+	FILE *fp;
+
+	for (;;) {
+		showmount_lock();
+		hostname = host_next < host_count ?
+				host_list[host_next++] : NULL;
+		showmount_unlock();
+		if (hostname == NULL)
+			break;
+
+		showmount_query(hostname, &reply);
+
+		buf = NULL;
+		fp = open_memstream(&buf, &len);
+		if (fp == NULL) {
+			fprintf(stderr, "%s: out of memory\n", program_name);
+			exit(1);
+		}
+		if (reply.sr_error == NULL)
+			showmount_print(fp, hostname, &reply);
+		else if (parseable)
+			fprintf(fp, "%s\terror\t%s\n", hostname, reply.sr_error);
+		fclose(fp);
+
+		showmount_lock();
+		if (reply.sr_error != NULL) {
+			host_failed++;
+			if (!parseable)
+				fprintf(stderr, "%s: %s\n", hostname,
+					reply.sr_error);
+		}
+		fwrite(buf, 1, len, stdout);
+		fflush(stdout);
+		showmount_unlock();
+
+		free(buf);
+		showmount_free(&reply);
+	}
+	return NULL;
+}
+
+static void showmount_add_host(const char *hostname)
+{
+	if (host_count == host_size) {
+		host_size = host_size ? host_size * 2 : 64;
+		host_list = realloc(host_list, host_size * sizeof(char *));
+		if (host_list == NULL) {
+			fprintf(stderr, "%s: out of memory\n", program_name);
+			exit(1);
+		}
+	}
+	host_list[host_count] = strdup(hostname);
+	if (host_list[host_count] == NULL) {
+		fprintf(stderr, "%s: out of memory\n", program_name);
+		exit(1);
+	}
+	host_count++;
+}
+
+/*
+ * Add the servers named in @filename, one to a line, to the host
+ * list.  Blank lines and lines starting with '#' are skipped.
+ */
+static void showmount_read_hosts(const char *filename)
+{
+	char *line = NULL, *p, *end;
+	size_t size = 0;
+	FILE *fp;
+
+	if (strcmp(filename, "-") == 0)
+		fp = stdin;
+	else if ((fp = fopen(filename, "r")) == NULL) {
+		fprintf(stderr, "%s: %s: %s\n", program_name, filename,
+			strerror(errno));
+		exit(1);
+	}
+	while (getline(&line, &size, fp) != -1) {
+		for (p = line; isspace((unsigned char)*p); p++)
+			;
+		for (end = p + strlen(p);
+		     end > p && isspace((unsigned char)end[-1]); end--)
+			;
+		*end = '\0';
+		if (*p != '\0' && *p != '#')
+			showmount_add_host(p);
+	}
+	free(line);
+	if (fp != stdin)
+		fclose(fp);
+}
+
+/*
+ * Query every server in the host list, @jobs at a time.
+ */
+static int showmount_many(void)
+{
+#ifdef HAVE_LIBPTHREAD
+	pthread_t *threads;
+	unsigned int i, started = 0;
+
+	if ((unsigned int)jobs > host_count)
+		jobs = host_count;
+	threads = xmalloc(jobs * sizeof(*threads));
+	for (i = 1; i < (unsigned int)jobs; i++) {
+		if (pthread_create(&threads[started], NULL,
+				showmount_worker, NULL) != 0)
+			break;
+		started++;
+	}
+	showmount_worker(NULL);
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+#else
+	showmount_worker(NULL);
+#endif
+	return host_failed ? 1 : 0;
+}
+
+int main(int argc, char **argv)
+{
+	char hostname_buf[MAXHOSTLEN];
+	struct showmount_reply reply;
+	char *hosts_from = NULL;
+	char *hostname;
+	int c;
 
 	program_name = argv[0];
-	while ((c = getopt_long(argc, argv, "adehv", longopts, NULL)) != EOF) {
+	while ((c = getopt_long(argc, argv, "adehvf:j:pt:", longopts, NULL)) != EOF) {
 		switch (c) {
 		case 'a':
 			aflag = 1;
@@ -145,6 +585,28 @@ int main(int argc, char **argv)
 		case 'e':
 			eflag = 1;
 			break;
+		case 'f':
+			hosts_from = optarg;
+			break;
+		case 'j':
+			jobs = atoi(optarg);
+			if (jobs < 1 || jobs > SHOWMOUNT_MAXJOBS) {
+				fprintf(stderr, "%s: jobs must be 1 to %d\n",
+					program_name, SHOWMOUNT_MAXJOBS);
+				exit(1);
+			}
+			break;
+		case 'p':
+			parseable = 1;
+			break;
+		case 't':
+			timeout = atoi(optarg);
+			if (timeout < 1) {
+				fprintf(stderr, "%s: bad timeout: %s\n",
+					program_name, optarg);
+				exit(1);
+			}
+			break;
 		case 'h':
 			usage(stdout, 0);
 			break;
@@ -175,149 +637,30 @@ int main(int argc, char **argv)
 		break;
 	}
 
-	switch (argc) {
-	case 0:
+	mount_program = nfs_getrpcbyname(MOUNTPROG, mount_pgm_tbl);
+
+	if (hosts_from != NULL || argc > 1) {
+		for (c = 0; c < argc; c++)
+			showmount_add_host(argv[c]);
+		if (hosts_from != NULL)
+			showmount_read_hosts(hosts_from);
+		exit(showmount_many());
+	}
+
+	if (argc == 0) {
 		if (gethostname(hostname_buf, MAXHOSTLEN) < 0) {
 			perror("getting hostname");
 			exit(1);
 		}
 		hostname = hostname_buf;
-		break;
-	case 1:
+	} else
 		hostname = argv[0];
-		break;
-	default:
-		fprintf(stderr, "%s: only one hostname is allowed\n",
-			program_name);
-		exit(1);
-		break;
-	}
-
-	mclient = nfs_get_mount_client(hostname, mount_vers_tbl[vers]);
-	mclient->cl_auth = nfs_authsys_create();
-	if (mclient->cl_auth == NULL) {
-		fprintf(stderr, "%s: unable to create RPC auth handle.\n",
-				program_name);
-		clnt_destroy(mclient);
-		exit(1);
-	}
-	total_timeout.tv_sec = TOTAL_TIMEOUT;
-	total_timeout.tv_usec = 0;
-
-again:
-	if (eflag) {
-		memset(&exportlist, '\0', sizeof(exportlist));
-
-		clnt_stat = clnt_call(mclient, MOUNTPROC_EXPORT,
-			(xdrproc_t) xdr_void, NULL,
-			(xdrproc_t) xdr_exports, (caddr_t) &exportlist,
-			total_timeout);
-		if (clnt_stat == RPC_PROGVERSMISMATCH) {
-			if (++vers <  max_vers_tblsz) {
-				(void)CLNT_CONTROL(mclient, CLSET_VERS, 
-					(void *)&mount_vers_tbl[vers]);
-				goto again;
-				}
-		}
-		if (clnt_stat != RPC_SUCCESS) {
-			clnt_perror(mclient, "rpc mount export");
-			clnt_destroy(mclient);
-			exit(1);
-		}
-		if (headers)
-			printf("Export list for %s:\n", hostname);
-		maxlen = 0;
-		for (exl = exportlist; exl; exl = exl->ex_next) {
-			if ((n = strlen(exl->ex_dir)) > maxlen)
-				maxlen = n;
-		}
-		while (exportlist) {
-			printf("%-*s ", maxlen, exportlist->ex_dir);
-			grouplist = exportlist->ex_groups;
-			if (grouplist)
-				while (grouplist) {
-					printf("%s%s", grouplist->gr_name,
-						grouplist->gr_next ? "," : "");
-					grouplist = grouplist->gr_next;
-				}
-			else
-				printf("(everyone)");
-			printf("\n");
-			exportlist = exportlist->ex_next;
-		}
-		clnt_destroy(mclient);
-		exit(0);
-	}
-
-	memset(&dumplist, '\0', sizeof(dumplist));
-	clnt_stat = clnt_call(mclient, MOUNTPROC_DUMP,
-		(xdrproc_t) xdr_void, NULL,
-		(xdrproc_t) xdr_mountlist, (caddr_t) &dumplist,
-		total_timeout);
-	if (clnt_stat == RPC_PROGVERSMISMATCH) {
-		if (++vers <  max_vers_tblsz) {
-			(void)CLNT_CONTROL(mclient, CLSET_VERS, 
-				(void *)&mount_vers_tbl[vers]);
-			goto again;
-		}
-	}
-	if (clnt_stat != RPC_SUCCESS) {
-		clnt_perror(mclient, "rpc mount dump");
-		clnt_destroy(mclient);
-		exit(1);
-	}
-	clnt_destroy(mclient);
 
-	n = 0;
-	for (list = dumplist; list; list = list->ml_next)
-		n++;
-	dumpv = (char **) calloc(n, sizeof (char *));
-	if (n && !dumpv) {
-		fprintf(stderr, "%s: out of memory\n", program_name);
+	showmount_query(hostname, &reply);
+	if (reply.sr_error != NULL) {
+		fprintf(stderr, "%s\n", reply.sr_error);
 		exit(1);
 	}
-	i = 0;
-
-	if (hflag) {
-		if (headers)
-			printf("Hosts on %s:\n", hostname);
-		while (dumplist) {
-			dumpv[i++] = dumplist->ml_hostname;
-			dumplist = dumplist->ml_next;
-		}
-	}
-	else if (aflag) {
-		if (headers)
-			printf("All mount points on %s:\n", hostname);
-		while (dumplist) {
-			char *t;
-
-			t=malloc(strlen(dumplist->ml_hostname)+strlen(dumplist->ml_directory)+2);
-			if (!t)
-			{
-				fprintf(stderr, "%s: out of memory\n", program_name);
-				exit(1);
-			}
-			sprintf(t, "%s:%s", dumplist->ml_hostname, dumplist->ml_directory);
-			dumpv[i++] = t;
-			dumplist = dumplist->ml_next;
-		}
-	}
-	else if (dflag) {
-		if (headers)
-			printf("Directories on %s:\n", hostname);
-		while (dumplist) {
-			dumpv[i++] = dumplist->ml_directory;
-			dumplist = dumplist->ml_next;
-		}
-	}
-
-	qsort(dumpv, n, sizeof (char *), dump_cmp);
-	
-	for (i = 0; i < n; i++) {
-		if (i == 0 || strcmp(dumpv[i], dumpv[i - 1]) != 0)
-			printf("%s\n", dumpv[i]);
-	}
+	showmount_print(stdout, hostname, &reply);
 	exit(0);
 }
-
@@ -114,7 +114,7 @@ sm_notify_1_svc(struct stat_chge *argp, struct svc_req *rqstp)
 		     statd_matchhostname(ip_addr, lp->dns_name))) {
 			NL_STATE(lp) = argp->state;
 			call = nlist_clone(lp);
-			nlist_insert(&notify, call);
+			callback_queue(call);
 		}
 
 
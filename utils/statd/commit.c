@@ -0,0 +1,350 @@
+/*
+ * utils/statd/commit.c
+ *
+ * Group commit of monitor records.
+ *
+ * Each SM_MON used to create its record with O_SYNC, so a burst of
+ * new monitors cost one trip to the disk apiece.  Now the records
+ * changed by requests that arrive together are made durable by one
+ * nsm_commit(), once no more requests are waiting, or commit_window
+ * milliseconds after the first change at the latest.  A reply to
+ * SM_MON tells lockd that its record is on stable storage, so these
+ * replies are held back until the commit, and sent then.
+ *
+ * The svc library sends a reply from the transport's own state, which
+ * the next request on that transport overwrites.  So the transports
+ * statd answers on get a receive method that notes the XID of each
+ * call, and a held reply is encoded and sent here, like the calls
+ * libnsm makes.  A transport's first call is answered the old way,
+ * after committing at once.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <netinet/in.h>
+#include <rpc/rpc.h>
+
+#include "nsm.h"
+#include "statd.h"
+
+#define COMMIT_MAX	256	/* replies held for one commit */
+#define COMMIT_SLOTS	4	/* kinds of transport */
+#define COMMIT_LINGER	10	/* ms that waiting requests may add */
+#define COMMIT_SENDWAIT	2000	/* ms to wait for room on a stream */
+
+int group_commit = 1;
+int commit_window;
+
+#ifdef HAVE_LIBTIRPC
+
+struct commit_reply {
+	int			cr_fd;		/* dup of the transport's */
+	_Bool			cr_stream;	/* record marking */
+	uint32_t		cr_xid;
+	struct sockaddr_storage	cr_addr;
+	socklen_t		cr_addrlen;
+	sm_stat_res		cr_res;
+};
+
+struct commit_slot {
+	const struct xp_ops *	cs_orig;
+	struct xp_ops		cs_ops;
+	_Bool			cs_stream;
+};
+
+static struct commit_reply	commit_replies[COMMIT_MAX];
+static unsigned int		commit_count;
+static struct timeval		commit_start;	/* of the first change */
+static _Bool			commit_open;
+
+static struct commit_slot	commit_slots[COMMIT_SLOTS];
+static unsigned int		commit_nslots;
+
+/* The transport and XID of the call being dispatched */
+static SVCXPRT *		commit_xprt;
+static uint32_t			commit_xid;
+
+static struct commit_slot *
+commit_slot(const SVCXPRT *xprt)
+{
+	unsigned int i;
+
+	for (i = 0; i < commit_nslots; i++)
+		if (xprt->xp_ops == &commit_slots[i].cs_ops)
+			return &commit_slots[i];
+	return NULL;
+}
+
+static bool_t
+commit_recv(SVCXPRT *xprt, struct rpc_msg *msg)
+{
+	struct commit_slot *cs = commit_slot(xprt);
+	bool_t result;
+
+	commit_xprt = NULL;
+	result = cs->cs_orig->xp_recv(xprt, msg);
+	if (result) {
+		commit_xprt = xprt;
+		commit_xid = msg->rm_xid;
+	}
+	return result;
+}
+
+static void
+commit_destroy(SVCXPRT *xprt)
+{
+	struct commit_slot *cs = commit_slot(xprt);
+
+	if (commit_xprt == xprt)
+		commit_xprt = NULL;
+	cs->cs_orig->xp_destroy(xprt);
+}
+
+/*
+ * Route @xprt's calls through commit_recv(), so that later calls
+ * on it can be answered after a commit.
+ */
+static void
+commit_watch(SVCXPRT *xprt)
+{
+	struct commit_slot *cs;
+	unsigned int i;
+	socklen_t len;
+	int type;
+
+	if (commit_slot(xprt) != NULL)
+		return;
+
+	for (i = 0; i < commit_nslots; i++)
+		if (commit_slots[i].cs_orig == xprt->xp_ops)
+			break;
+	if (i == commit_nslots) {
+		if (commit_nslots == COMMIT_SLOTS)
+			return;
+		len = sizeof(type);
+		if (getsockopt(xprt->xp_fd, SOL_SOCKET, SO_TYPE,
+				&type, &len) == -1)
+			return;
+		cs = &commit_slots[commit_nslots++];
+		cs->cs_orig = xprt->xp_ops;
+		cs->cs_ops = *xprt->xp_ops;
+		cs->cs_ops.xp_recv = commit_recv;
+		cs->cs_ops.xp_destroy = commit_destroy;
+		cs->cs_stream = type == SOCK_STREAM;
+	}
+	xprt->xp_ops = &commit_slots[i].cs_ops;
+}
+
+static void
+commit_send(struct commit_reply *cr)
+{
+	char buf[NSM_MAXMSGSIZE];
+	struct rpc_msg msg;
+	struct pollfd pfd;
+	uint32_t mark;
+	size_t len, sent;
+	ssize_t n;
+	XDR xdr;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.rm_xid = cr->cr_xid;
+	msg.rm_direction = REPLY;
+	msg.rm_reply.rp_stat = MSG_ACCEPTED;
+	msg.acpted_rply.ar_verf = _null_auth;
+	msg.acpted_rply.ar_stat = SUCCESS;
+	msg.acpted_rply.ar_results.where = (caddr_t)&cr->cr_res;
+	msg.acpted_rply.ar_results.proc = (xdrproc_t)xdr_sm_stat_res;
+
+	xdrmem_create(&xdr, buf + sizeof(mark), sizeof(buf) - sizeof(mark),
+			XDR_ENCODE);
+	if (!xdr_replymsg(&xdr, &msg)) {
+		xlog_warn("%s: failed to encode reply", __func__);
+		xdr_destroy(&xdr);
+		return;
+	}
+	len = (size_t)xdr_getpos(&xdr);
+	xdr_destroy(&xdr);
+
+	if (!cr->cr_stream) {
+		if (sendto(cr->cr_fd, buf + sizeof(mark), len, 0,
+				(struct sockaddr *)&cr->cr_addr,
+				cr->cr_addrlen) == -1)
+			xlog_warn("%s: failed to send reply: %m", __func__);
+		return;
+	}
+
+	mark = htonl(0x80000000u | (uint32_t)len);
+	memcpy(buf, &mark, sizeof(mark));
+	len += sizeof(mark);
+	for (sent = 0; sent < len; sent += (size_t)n) {
+		n = send(cr->cr_fd, buf + sent, len - sent, MSG_NOSIGNAL);
+		if (n >= 0)
+			continue;
+		n = 0;
+		if (errno == EINTR)
+			continue;
+		pfd.fd = cr->cr_fd;
+		pfd.events = POLLOUT;
+		if (errno != EAGAIN ||
+		    poll(&pfd, 1, COMMIT_SENDWAIT) <= 0) {
+			xlog_warn("%s: failed to send reply: %m", __func__);
+			return;
+		}
+	}
+}
+
+/**
+ * commit_flush - commit record changes and send the held replies
+ *
+ * Returns true if the changes are on stable storage.  If they may not
+ * be, the held replies report STAT_FAIL.
+ */
+_Bool
+commit_flush(void)
+{
+	_Bool result = nsm_commit();
+	unsigned int i;
+
+	for (i = 0; i < commit_count; i++) {
+		struct commit_reply *cr = &commit_replies[i];
+
+		if (!result) {
+			cr->cr_res.res_stat = STAT_FAIL;
+			cr->cr_res.state = -1;
+		}
+		commit_send(cr);
+		(void)close(cr->cr_fd);
+	}
+	if (commit_count > 1)
+		xlog(D_GENERAL, "Committed %u monitor requests", commit_count);
+	commit_count = 0;
+	commit_open = false;
+	return result;
+}
+
+/**
+ * commit_reply - answer a request once its record changes are durable
+ * @rqstp: the request
+ * @res: its result
+ *
+ * Returns @res if it can be sent now, or NULL if the reply is held
+ * and will be sent by commit_flush().
+ */
+sm_stat_res *
+commit_reply(struct svc_req *rqstp, sm_stat_res *res)
+{
+	SVCXPRT *xprt = rqstp->rq_xprt;
+	struct commit_reply *cr;
+	struct netbuf *nbuf;
+
+	if (!nsm_commit_pending())
+		return res;
+
+	if (commit_xprt != xprt || commit_slot(xprt) == NULL ||
+	    commit_count == COMMIT_MAX)
+		goto now;
+	commit_xprt = NULL;
+
+	nbuf = svc_getrpccaller(xprt);
+	cr = &commit_replies[commit_count];
+	cr->cr_stream = commit_slot(xprt)->cs_stream;
+	cr->cr_addrlen = 0;
+	if (!cr->cr_stream) {
+		if (nbuf == NULL || nbuf->len > sizeof(cr->cr_addr))
+			goto now;
+		memcpy(&cr->cr_addr, nbuf->buf, nbuf->len);
+		cr->cr_addrlen = nbuf->len;
+	}
+	cr->cr_fd = dup(xprt->xp_fd);
+	if (cr->cr_fd == -1)
+		goto now;
+	cr->cr_xid = commit_xid;
+	cr->cr_res = *res;
+
+	commit_count++;
+	if (!commit_open) {
+		gettimeofday(&commit_start, NULL);
+		commit_open = true;
+	}
+	return NULL;
+
+now:
+	commit_watch(xprt);
+	if (!commit_flush()) {
+		res->res_stat = STAT_FAIL;
+		res->state = -1;
+	}
+	return res;
+}
+
+/**
+ * commit_timeout - time left to gather requests for the next commit
+ * @busy: more requests are waiting already
+ *
+ * Returns the number of milliseconds left, zero if the commit is due,
+ * or -1 if there is nothing to commit.  More requests may join after
+ * commit_window has passed if they are already waiting, for up to
+ * COMMIT_LINGER milliseconds more, or until there is no more room.
+ */
+int
+commit_timeout(_Bool busy)
+{
+	struct timeval now;
+	long age;
+
+	if (!nsm_commit_pending())
+		return -1;
+
+	gettimeofday(&now, NULL);
+	if (!commit_open) {
+		commit_start = now;
+		commit_open = true;
+	}
+	age = (now.tv_sec - commit_start.tv_sec) * 1000 +
+		(now.tv_usec - commit_start.tv_usec) / 1000;
+
+	if (age < commit_window)
+		return (int)(commit_window - age);
+	if (busy && commit_count < COMMIT_MAX &&
+	    age < commit_window + COMMIT_LINGER)
+		return (int)(commit_window + COMMIT_LINGER - age);
+	return 0;
+}
+
+#else	/* !HAVE_LIBTIRPC */
+
+_Bool
+commit_flush(void)
+{
+	return nsm_commit();
+}
+
+sm_stat_res *
+commit_reply(__attribute__ ((unused)) struct svc_req *rqstp,
+		sm_stat_res *res)
+{
+	if (!commit_flush()) {
+		res->res_stat = STAT_FAIL;
+		res->state = -1;
+	}
+	return res;
+}
+
+int
+commit_timeout(__attribute__ ((unused)) _Bool busy)
+{
+	return nsm_commit_pending() ? 0 : -1;
+}
+
+#endif	/* !HAVE_LIBTIRPC */
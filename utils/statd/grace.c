@@ -0,0 +1,133 @@
+/*
+ * utils/statd/grace.c
+ *
+ * Progress of lockd's grace period.
+ *
+ * After a reboot, sm-notify publishes the hosts it tells of it in
+ * NFSMETRICS_DIR/nlm.grace.  As each of them reclaims its locks, lockd
+ * asks statd to monitor it again, so the SM_MON requests of those hosts
+ * are their reclaims.  statd takes the list over from sm-notify with
+ * the first SM_MON after it was published, and follows the grace
+ * period until lockd says it is over.
+ *
+ * lockd has no word for a host being done with its reclaims, so with
+ * "lift-grace" set, the grace period is ended lift_grace_delay seconds
+ * after the last of the hosts has come back.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+
+#include "nfsgrace.h"
+#include "statd.h"
+#include "xlog.h"
+
+#define NLM_END_GRACE_FILE	"/proc/fs/lockd/nlm_end_grace"
+
+/* ms between asking lockd whether its grace period is over */
+#define GRACE_POLL		1000
+
+int		lift_grace;
+int		lift_grace_delay = LIFT_GRACE_DELAY;
+int		grace_time = GRACE_TIME;
+
+static unsigned long long	grace_lift_at, grace_check_at;
+
+/**
+ * statd_grace_open - get ready to follow lockd's grace periods
+ *
+ * Call it while statd can still open lockd's file for ending them.
+ */
+void
+statd_grace_open(void)
+{
+	nfsgrace_open("nlm", NLM_END_GRACE_FILE);
+	statd_grace_adopt();
+}
+
+/**
+ * statd_grace_adopt - look for hosts sm-notify has told of a reboot
+ */
+void
+statd_grace_adopt(void)
+{
+	if (nfsgrace_adopt()) {
+		grace_lift_at = 0;
+		grace_check_at = 0;
+	}
+}
+
+/**
+ * statd_grace_monitored - a host has been monitored again
+ * @mon_name: the name lockd knows it by
+ */
+void
+statd_grace_monitored(const char *mon_name)
+{
+	statd_grace_adopt();
+	if (!nfsgrace_reclaim(mon_name, strlen(mon_name)) ||
+	    !nfsgrace_complete())
+		return;
+	xlog(D_GENERAL, "All hosts are monitored again after %lu ms",
+		nfsgrace_elapsed());
+	if (lift_grace)
+		grace_lift_at = nfsmetric_clock() + lift_grace_delay * 1000000ULL;
+}
+
+/**
+ * statd_grace_timeout - when statd_grace_check() is next due
+ *
+ * Returns milliseconds, or -1 if no grace period is being followed.
+ */
+int
+statd_grace_timeout(void)
+{
+	unsigned long long now, due;
+
+	if (!nfsgrace_active())
+		return -1;
+	now = nfsmetric_clock();
+	due = grace_check_at;
+	if (grace_lift_at && grace_lift_at < due)
+		due = grace_lift_at;
+	return due > now ? (int)((due - now + 999) / 1000) : 0;
+}
+
+/**
+ * statd_grace_check - end the grace period if it is time to
+ *
+ * Ends it early once every host is back and lift_grace_delay has
+ * passed, and stops following it once lockd says it is over, or, if
+ * lockd cannot say, after grace_time seconds.
+ */
+void
+statd_grace_check(void)
+{
+	unsigned long long now;
+	int over;
+
+	if (!nfsgrace_active())
+		return;
+	now = nfsmetric_clock();
+	if (grace_lift_at && now >= grace_lift_at) {
+		grace_lift_at = 0;
+		if (nfsgrace_complete()) {
+			xlog(L_NOTICE, "Every host has reclaimed; ending the "
+				"grace period after %lu ms", nfsgrace_elapsed());
+			nfsgrace_lift();
+		}
+	}
+	if (now < grace_check_at)
+		return;
+	grace_check_at = now + GRACE_POLL * 1000ULL;
+
+	over = nfsgrace_over();
+	if (over > 0 ||
+	    (over < 0 && nfsgrace_elapsed() >= grace_time * 1000UL)) {
+		grace_lift_at = 0;
+		nfsgrace_end();
+	}
+}
@@ -30,8 +30,11 @@
 
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <string.h>
 #include <strings.h>
+#include <ctype.h>
+#include <time.h>
 #include <netdb.h>
 #include <arpa/inet.h>
 
@@ -170,21 +173,13 @@ get_nameinfo(const struct sockaddr *sap,
 }
 #endif	/* !HAVE_GETNAMEINFO */
 
-/**
- * statd_canonical_name - choose file name for monitor record files
- * @hostname: C string containing hostname or presentation address
- *
- * Returns a '\0'-terminated ASCII string containing a fully qualified
- * canonical hostname, or NULL if @hostname does not have a reverse
- * mapping.  Caller must free the result with free(3).
- *
- * Incoming hostnames are looked up to determine the canonical hostname,
- * and incoming presentation addresses are converted to canonical
- * hostnames.
+/*
+ * Look up the canonical name of @hostname, and the first address
+ * found for it if @addr is not NULL.  See statd_canonical_host().
  */
 __attribute__((__malloc__))
-char *
-statd_canonical_name(const char *hostname)
+static char *
+canonical_host(const char *hostname, char *addr, const size_t addrlen)
 {
 	struct addrinfo hint = {
 #ifdef IPV6_SUPPORTED
@@ -198,12 +193,18 @@ statd_canonical_name(const char *hostname)
 	char buf[NI_MAXHOST];
 	struct addrinfo *ai;
 
+	if (addr != NULL)
+		addr[0] = '\0';
+
 	ai = get_addrinfo(hostname, &hint);
 	if (ai != NULL) {
 		/* @hostname was a presentation address */
 		_Bool result;
 		result = get_nameinfo(ai->ai_addr, ai->ai_addrlen,
 					buf, (socklen_t)sizeof(buf));
+		if (addr != NULL &&
+		    !statd_present_address(ai->ai_addr, addr, addrlen))
+			addr[0] = '\0';
 		nfs_freeaddrinfo(ai);
 		if (!result || buf[0] == '\0')
 			/* OK to use presentation address,
@@ -218,6 +219,9 @@ statd_canonical_name(const char *hostname)
 	if (ai == NULL)
 		return NULL;
 	strcpy(buf, ai->ai_canonname);
+	if (addr != NULL &&
+	    !statd_present_address(ai->ai_addr, addr, addrlen))
+		addr[0] = '\0';
 	nfs_freeaddrinfo(ai);
 
 	return strdup(buf);
@@ -234,7 +238,7 @@ statd_canonical_name(const char *hostname)
  */
 __attribute__((__malloc__))
 static struct addrinfo *
-statd_canonical_list(const char *hostname)
+canonical_list(const char *hostname)
 {
 	struct addrinfo hint = {
 #ifdef IPV6_SUPPORTED
@@ -266,6 +270,354 @@ out:
 	return get_addrinfo(buf, &hint);
 }
 
+/*
+ * The canonical name and the addresses of a host, kept sorted so that
+ * two hosts are matched by walking their sets side by side.
+ */
+struct statd_addr {
+	uint32_t		sa_family;
+	uint32_t		sa_scope;	/* IPv6 link-local only */
+	unsigned char		sa_addr[16];
+};
+
+struct statd_addrs {
+	char *			sa_canon;
+	size_t			sa_count;
+	struct statd_addr	sa_addrs[];
+};
+
+static int
+statd_addr_cmp(const void *a, const void *b)
+{
+	return memcmp(a, b, sizeof(struct statd_addr));
+}
+
+static void
+statd_addrs_free(struct statd_addrs *set)
+{
+	if (set != NULL)
+		free(set->sa_canon);
+	free(set);
+}
+
+/*
+ * Returns the address set of @hostname, from canonical_list(), or
+ * NULL if its lookup fails.  Caller frees it with statd_addrs_free().
+ */
+static struct statd_addrs *
+statd_addrs_build(const char *hostname)
+{
+	struct addrinfo *list, *ai;
+	struct statd_addrs *set;
+	struct statd_addr *sa;
+	size_t count = 0, i, n;
+
+	list = canonical_list(hostname);
+	if (list == NULL)
+		return NULL;
+	for (ai = list; ai != NULL; ai = ai->ai_next)
+		count++;
+
+	set = calloc(1, sizeof(*set) + count * sizeof(set->sa_addrs[0]));
+	if (set == NULL)
+		goto out;
+	set->sa_canon = strdup(list->ai_canonname ? list->ai_canonname : "");
+	if (set->sa_canon == NULL) {
+		free(set);
+		set = NULL;
+		goto out;
+	}
+
+	for (ai = list; ai != NULL; ai = ai->ai_next) {
+		sa = &set->sa_addrs[set->sa_count];
+		switch (ai->ai_addr->sa_family) {
+		case AF_INET: {
+			const struct sockaddr_in *sin =
+				(const struct sockaddr_in *)ai->ai_addr;
+
+			sa->sa_family = AF_INET;
+			memcpy(sa->sa_addr, &sin->sin_addr, sizeof(sin->sin_addr));
+			break;
+		}
+#ifdef IPV6_SUPPORTED
+		case AF_INET6: {
+			const struct sockaddr_in6 *sin6 =
+				(const struct sockaddr_in6 *)ai->ai_addr;
+
+			sa->sa_family = AF_INET6;
+			memcpy(sa->sa_addr, &sin6->sin6_addr,
+					sizeof(sin6->sin6_addr));
+			if (IN6_IS_ADDR_LINKLOCAL(&sin6->sin6_addr))
+				sa->sa_scope = sin6->sin6_scope_id;
+			break;
+		}
+#endif	/* IPV6_SUPPORTED */
+		default:
+			continue;
+		}
+		set->sa_count++;
+	}
+
+	qsort(set->sa_addrs, set->sa_count, sizeof(set->sa_addrs[0]),
+			statd_addr_cmp);
+	for (i = n = 0; i < set->sa_count; i++)
+		if (n == 0 || statd_addr_cmp(&set->sa_addrs[n - 1],
+					     &set->sa_addrs[i]) != 0)
+			set->sa_addrs[n++] = set->sa_addrs[i];
+	set->sa_count = n;
+out:
+	nfs_freeaddrinfo(list);
+	return set;
+}
+
+/* Returns true if @set1 and @set2 have an address in common */
+static _Bool
+statd_addrs_meet(const struct statd_addrs *set1,
+		const struct statd_addrs *set2)
+{
+	size_t i = 0, j = 0;
+	int cmp;
+
+	while (i < set1->sa_count && j < set2->sa_count) {
+		cmp = statd_addr_cmp(&set1->sa_addrs[i], &set2->sa_addrs[j]);
+		if (cmp == 0)
+			return true;
+		if (cmp < 0)
+			i++;
+		else
+			j++;
+	}
+	return false;
+}
+
+/*
+ * Results of earlier lookups, by name.  rpc.statd matches each SM_MON,
+ * SM_UNMON and SM_NOTIFY against the names it monitors, and looking
+ * the same names up in DNS again for every request makes the cost of
+ * a request grow with the number of monitored hosts.  Results are kept
+ * for statd_name_ttl seconds, and lookups that fail for a few seconds,
+ * so that a name that does not resolve is not tried for every entry.
+ */
+struct statd_name {
+	struct statd_name *	sn_next;
+	time_t			sn_host_expires;
+	char *			sn_canon;	/* canonical_host() */
+	char *			sn_addr;
+	time_t			sn_set_expires;
+	struct statd_addrs *	sn_set;		/* statd_addrs_build() */
+	char			sn_name[];
+};
+
+#define STATD_NAMES_MIN		64
+#define STATD_NAME_NEG_TTL	5	/* seconds, for failed lookups */
+
+int statd_name_ttl = STATD_NAME_TTL;
+
+static struct statd_name **statd_names;
+static size_t statd_names_size, statd_names_count;
+
+/**
+ * statd_hash_name - hash a hostname
+ * @hostname: C string containing hostname or presentation address
+ *
+ * Returns a hash of @hostname that ignores case, as host names
+ * are compared here.
+ */
+uint32_t
+statd_hash_name(const char *hostname)
+{
+	uint32_t hash = 2166136261u;
+
+	while (*hostname != '\0') {
+		hash ^= (unsigned char)tolower((unsigned char)*hostname++);
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+/* How long to keep the result of a lookup that SUCCEEDED or not */
+static time_t
+statd_name_expiry(time_t now, _Bool succeeded)
+{
+	if (succeeded || statd_name_ttl < STATD_NAME_NEG_TTL)
+		return now + statd_name_ttl;
+	return now + STATD_NAME_NEG_TTL;
+}
+
+static void
+statd_name_free(struct statd_name *sn)
+{
+	free(sn->sn_canon);
+	free(sn->sn_addr);
+	statd_addrs_free(sn->sn_set);
+	free(sn);
+}
+
+/*
+ * Drop the entries that have expired, then make room for more if
+ * the table is still full.
+ */
+static void
+statd_names_grow(time_t now)
+{
+	struct statd_name **table, **pp, *sn;
+	size_t size, i;
+
+	for (i = 0; i < statd_names_size; i++)
+		for (pp = &statd_names[i]; (sn = *pp) != NULL; ) {
+			if (sn->sn_host_expires > now ||
+			    sn->sn_set_expires > now) {
+				pp = &sn->sn_next;
+				continue;
+			}
+			*pp = sn->sn_next;
+			statd_name_free(sn);
+			statd_names_count--;
+		}
+	if (statd_names_count < statd_names_size / 2)
+		return;
+
+	size = statd_names_size ? statd_names_size * 2 : STATD_NAMES_MIN;
+	table = calloc(size, sizeof(*table));
+	if (table == NULL)
+		return;
+	for (i = 0; i < statd_names_size; i++)
+		while ((sn = statd_names[i]) != NULL) {
+			statd_names[i] = sn->sn_next;
+			pp = &table[statd_hash_name(sn->sn_name) & (size - 1)];
+			sn->sn_next = *pp;
+			*pp = sn;
+		}
+	free(statd_names);
+	statd_names = table;
+	statd_names_size = size;
+}
+
+/*
+ * Find the cache entry for @hostname, adding an empty one if there
+ * is none.  Returns NULL if the cache is off or memory is short.
+ */
+static struct statd_name *
+statd_name_lookup(const char *hostname, time_t now)
+{
+	uint32_t hash = statd_hash_name(hostname);
+	struct statd_name *sn;
+	size_t len;
+
+	if (statd_name_ttl <= 0)
+		return NULL;
+
+	if (statd_names_size != 0)
+		for (sn = statd_names[hash & (statd_names_size - 1)];
+		     sn != NULL; sn = sn->sn_next)
+			if (strcasecmp(sn->sn_name, hostname) == 0)
+				return sn;
+
+	if (statd_names_count >= statd_names_size)
+		statd_names_grow(now);
+	if (statd_names_count >= statd_names_size)
+		return NULL;
+
+	len = strlen(hostname) + 1;
+	sn = calloc(1, sizeof(*sn) + len);
+	if (sn == NULL)
+		return NULL;
+	memcpy(sn->sn_name, hostname, len);
+	sn->sn_next = statd_names[hash & (statd_names_size - 1)];
+	statd_names[hash & (statd_names_size - 1)] = sn;
+	statd_names_count++;
+	return sn;
+}
+
+/**
+ * statd_canonical_host - choose file name for monitor record files
+ * @hostname: C string containing hostname or presentation address
+ * @addr: OUT: buffer for the presentation address of @hostname, or NULL
+ * @addrlen: size of @addr
+ *
+ * Returns a '\0'-terminated ASCII string containing a fully qualified
+ * canonical hostname, or NULL if @hostname does not have a reverse
+ * mapping.  Caller must free the result with free(3).  If @addr is
+ * not NULL, it is filled in with the first address found for
+ * @hostname, or an empty string.
+ *
+ * Incoming hostnames are looked up to determine the canonical hostname,
+ * and incoming presentation addresses are converted to canonical
+ * hostnames.
+ */
+__attribute__((__malloc__))
+char *
+statd_canonical_host(const char *hostname, char *addr, const size_t addrlen)
+{
+	time_t now = time(NULL);
+	char buf[NI_MAXHOST];
+	struct statd_name *sn;
+
+	sn = statd_name_lookup(hostname, now);
+	if (sn == NULL)
+		return canonical_host(hostname, addr, addrlen);
+
+	if (sn->sn_host_expires <= now) {
+		free(sn->sn_canon);
+		free(sn->sn_addr);
+		sn->sn_addr = NULL;
+		sn->sn_canon = canonical_host(hostname, buf, sizeof(buf));
+		if (sn->sn_canon != NULL) {
+			sn->sn_addr = strdup(buf);
+			if (sn->sn_addr == NULL) {
+				free(sn->sn_canon);
+				sn->sn_canon = NULL;
+				return canonical_host(hostname, addr, addrlen);
+			}
+		}
+		sn->sn_host_expires = statd_name_expiry(now,
+						sn->sn_canon != NULL);
+	}
+
+	if (addr != NULL) {
+		addr[0] = '\0';
+		if (sn->sn_addr != NULL && strlen(sn->sn_addr) < addrlen)
+			strcpy(addr, sn->sn_addr);
+	}
+	return sn->sn_canon ? strdup(sn->sn_canon) : NULL;
+}
+
+/**
+ * statd_canonical_name - choose file name for monitor record files
+ * @hostname: C string containing hostname or presentation address
+ *
+ * Like statd_canonical_host(), without the address.
+ */
+__attribute__((__malloc__))
+char *
+statd_canonical_name(const char *hostname)
+{
+	return statd_canonical_host(hostname, NULL, 0);
+}
+
+/*
+ * Like statd_addrs_build(), from the cache if it is on.  *@cached is
+ * set if the set belongs to the cache; otherwise the caller frees it.
+ */
+static struct statd_addrs *
+statd_canonical_addrs(const char *hostname, _Bool *cached)
+{
+	time_t now = time(NULL);
+	struct statd_name *sn;
+
+	sn = statd_name_lookup(hostname, now);
+	*cached = sn != NULL;
+	if (sn == NULL)
+		return statd_addrs_build(hostname);
+
+	if (sn->sn_set_expires <= now) {
+		statd_addrs_free(sn->sn_set);
+		sn->sn_set = statd_addrs_build(hostname);
+		sn->sn_set_expires = statd_name_expiry(now, sn->sn_set != NULL);
+	}
+	return sn->sn_set;
+}
+
 /**
  * statd_matchhostname - check if two hostnames are equivalent
  * @hostname1: C string containing hostname
@@ -281,7 +633,8 @@ out:
 _Bool
 statd_matchhostname(const char *hostname1, const char *hostname2)
 {
-	struct addrinfo *ai1, *ai2, *results1 = NULL, *results2 = NULL;
+	struct statd_addrs *set1 = NULL, *set2 = NULL;
+	_Bool cached1 = true, cached2 = true;
 	_Bool result = false;
 
 	if (strcasecmp(hostname1, hostname2) == 0) {
@@ -289,28 +642,24 @@ statd_matchhostname(const char *hostname1, const char *hostname2)
 		goto out;
 	}
 
-	results1 = statd_canonical_list(hostname1);
-	if (results1 == NULL)
+	set1 = statd_canonical_addrs(hostname1, &cached1);
+	if (set1 == NULL)
 		goto out;
-	results2 = statd_canonical_list(hostname2);
-	if (results2 == NULL)
+	set2 = statd_canonical_addrs(hostname2, &cached2);
+	if (set2 == NULL)
 		goto out;
 
-	if (strcasecmp(results1->ai_canonname, results2->ai_canonname) == 0) {
+	if (set1->sa_canon[0] != '\0' &&
+	    strcasecmp(set1->sa_canon, set2->sa_canon) == 0)
 		result = true;
-		goto out;
-	}
-
-	for (ai1 = results1; ai1 != NULL; ai1 = ai1->ai_next)
-		for (ai2 = results2; ai2 != NULL; ai2 = ai2->ai_next)
-			if (nfs_compare_sockaddr(ai1->ai_addr, ai2->ai_addr)) {
-				result = true;
-				break;
-			}
+	else
+		result = statd_addrs_meet(set1, set2);
 
 out:
-	nfs_freeaddrinfo(results2);
-	nfs_freeaddrinfo(results1);
+	if (!cached2)
+		statd_addrs_free(set2);
+	if (!cached1)
+		statd_addrs_free(set1);
 
 	xlog(D_CALL, "%s: hostnames %s and %s %s", __func__,
 			hostname1, hostname2,
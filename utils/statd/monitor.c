@@ -67,11 +67,14 @@ sm_mon_1_svc(struct mon *argp, struct svc_req *rqstp)
 	struct my_id	*id = &argp->mon_id.my_id;
 	char		*cp;
 	notify_list	*clnt = NULL;
+	struct nlist_iter it;
 	struct sockaddr_in my_addr = {
 		.sin_family		= AF_INET,
 		.sin_addr.s_addr	= htonl(INADDR_LOOPBACK),
 	};
 	char *dnsname = NULL;
+	char addr[NSM_ADDRSTRLEN];
+	uint16_t port;
 	int existing = 0;
 
 	xlog(D_CALL, "Received SM_MON for %s from %s", mon_name, my_name);
@@ -128,7 +131,7 @@ sm_mon_1_svc(struct mon *argp, struct svc_req *rqstp)
 	 * sure that multi-homed hosts work nicely, we get an
 	 * FQDN now, and use that for matching.
 	 */
-	dnsname = statd_canonical_name(mon_name);
+	dnsname = statd_canonical_host(mon_name, addr, sizeof(addr));
 	if (dnsname == NULL) {
 		xlog(L_WARNING, "No canonical hostname found for %s", mon_name);
 		goto failure;
@@ -143,9 +146,8 @@ sm_mon_1_svc(struct mon *argp, struct svc_req *rqstp)
 	 * I'll just do a quickie success return and things should
 	 * be happy.
 	 */
-	clnt = rtnl;
-
-	while ((clnt = nlist_gethost(clnt, mon_name, 0))) {
+	for (clnt = nlist_gethost(&it, mon_name, 0); clnt;
+	     clnt = nlist_nexthost(&it)) {
 		if (statd_matchhostname(NL_MY_NAME(clnt), my_name) &&
 		    NL_MY_PROC(clnt) == id->my_proc &&
 		    NL_MY_PROG(clnt) == id->my_prog &&
@@ -156,6 +158,8 @@ sm_mon_1_svc(struct mon *argp, struct svc_req *rqstp)
 					"cookie for %s from procedure on %s",
 					mon_name, my_name);
 
+				/* Rehashed below, if dns_name changes */
+				nlist_remove(&rtnl, clnt);
 				existing = 1; 
 				break;
 			} else {
@@ -170,7 +174,6 @@ sm_mon_1_svc(struct mon *argp, struct svc_req *rqstp)
 				goto success;
 			}
 		}
-		clnt = NL_NEXT(clnt);
 	}
 
 	/*
@@ -187,25 +190,33 @@ sm_mon_1_svc(struct mon *argp, struct svc_req *rqstp)
 	NL_MY_VERS(clnt) = id->my_vers;
 	NL_MY_PROC(clnt) = id->my_proc;
 	memcpy(NL_PRIV(clnt), argp->priv, SM_PRIV_SIZE);
+	free(clnt->dns_name);
 	clnt->dns_name = dnsname;
 
 	/*
 	 * Now, Create file on stable storage for host, first deleting any
-	 * existing records on file.
+	 * existing records on file.  Keep the port its statd was
+	 * last found on.
 	 */
+	port = nsm_recall_port(dnsname);
 	nsm_delete_monitored_host(dnsname, mon_name, my_name, 0);
 
 	if (!nsm_insert_monitored_host(dnsname,
 				(struct sockaddr *)(char *)&my_addr, argp)) {
-		nlist_free(existing ? &rtnl : NULL, clnt);
+		nlist_free(NULL, clnt);
 		goto failure;
 	}
+	/* Saves sm-notify a DNS lookup after we reboot */
+	if (addr[0] != '\0')
+		(void)nsm_set_monitored_addr(dnsname, addr);
+	if (port != 0)
+		(void)nsm_set_monitored_port(dnsname, port);
 
 	/* PRC: do the HA callout: */
 	ha_callout("add-client", mon_name, my_name, -1);
-	if (!existing)
-		nlist_insert(&rtnl, clnt);
+	nlist_insert(&rtnl, clnt);
 	xlog(D_GENERAL, "MONITORING %s for %s", mon_name, my_name);
+	statd_grace_monitored(mon_name);
  success:
 	result.res_stat = STAT_SUCC;
 	/* SUN's sm_inter.x says this should be "state number of local site".
@@ -219,7 +230,8 @@ sm_mon_1_svc(struct mon *argp, struct svc_req *rqstp)
 	 * use SM_STAT (and prayer).
 	 */
 	result.state = MY_STATE;
-	return (&result);
+	/* Not until the record is on stable storage */
+	return commit_reply(rqstp, &result);
 
 failure:
 	xlog_warn("STAT_FAIL to %s for SM_MON of %s", my_name, mon_name);
@@ -281,6 +293,7 @@ sm_unmon_1_svc(struct mon_id *argp, struct svc_req *rqstp)
 {
 	static sm_stat  result;
 	notify_list	*clnt;
+	struct nlist_iter it;
 	char		*mon_name = argp->mon_name,
 			*my_name  = argp->my_id.my_name;
 	struct my_id	*id = &argp->my_id;
@@ -305,7 +318,6 @@ sm_unmon_1_svc(struct mon_id *argp, struct svc_req *rqstp)
 			"monitoring any hosts", my_name, argp->mon_name);
 		return (&result);
 	}
-	clnt = rtnl;
 
 	/*
 	 * OK, we are.  Now look for appropriate entry in run-time list.
@@ -313,7 +325,8 @@ sm_unmon_1_svc(struct mon_id *argp, struct svc_req *rqstp)
 	 * SM_MON calls.  (Actually, duplicate calls are allowed, but only one
 	 * entry winds up in the list the way I'm currently handling them.)
 	 */
-	while ((clnt = nlist_gethost(clnt, mon_name, 0))) {
+	for (clnt = nlist_gethost(&it, mon_name, 0); clnt;
+	     clnt = nlist_nexthost(&it)) {
 		if (statd_matchhostname(NL_MY_NAME(clnt), my_name) &&
 			NL_MY_PROC(clnt) == id->my_proc &&
 			NL_MY_PROG(clnt) == id->my_prog &&
@@ -328,10 +341,10 @@ sm_unmon_1_svc(struct mon_id *argp, struct svc_req *rqstp)
 			nsm_delete_monitored_host(clnt->dns_name,
 							mon_name, my_name, 1);
 			nlist_free(&rtnl, clnt);
+			free(clnt);
 
 			return (&result);
-		} else
-			clnt = NL_NEXT(clnt);
+		}
 	}
 
  failure:
@@ -347,6 +360,7 @@ sm_unmon_all_1_svc(struct my_id *argp, struct svc_req *rqstp)
 	short int       count = 0;
 	static sm_stat  result;
 	notify_list	*clnt;
+	struct nlist_iter it;
 	char		*my_name = argp->my_name;
 
 	xlog(D_CALL, "Received SM_UNMON_ALL for %s", my_name);
@@ -361,15 +375,13 @@ sm_unmon_all_1_svc(struct my_id *argp, struct svc_req *rqstp)
 			"while not monitoring any hosts", my_name);
 		return (&result);
 	}
-	clnt = rtnl;
-
-	while ((clnt = nlist_gethost(clnt, my_name, 1))) {
+	for (clnt = nlist_gethost(&it, my_name, 1); clnt;
+	     clnt = nlist_nexthost(&it)) {
 		if (NL_MY_PROC(clnt) == argp->my_proc &&
 			NL_MY_PROG(clnt) == argp->my_prog &&
 			NL_MY_VERS(clnt) == argp->my_vers) {
 			/* Watch stack! */
 			char            mon_name[SM_MAXSTRLEN + 1];
-			notify_list	*temp;
 
 			xlog(D_GENERAL,
 				"UNMONITORING (SM_UNMON_ALL) %s for %s",
@@ -377,16 +389,14 @@ sm_unmon_all_1_svc(struct my_id *argp, struct svc_req *rqstp)
 			strncpy(mon_name, NL_MON_NAME(clnt),
 				sizeof (mon_name) - 1);
 			mon_name[sizeof (mon_name) - 1] = '\0';
-			temp = NL_NEXT(clnt);
 			/* PRC: do the HA callout: */
 			ha_callout("del-client", mon_name, my_name, -1);
 			nsm_delete_monitored_host(clnt->dns_name,
 							mon_name, my_name, 1);
 			nlist_free(&rtnl, clnt);
+			free(clnt);
 			++count;
-			clnt = temp;
-		} else
-			clnt = NL_NEXT(clnt);
+		}
 	}
 
 	if (!count) {
@@ -16,10 +16,110 @@
 #include <config.h>
 #endif
 
+#include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include "statd.h"
 #include "notlist.h"
 
+/*
+ * rtnl is also hashed by dns_name, mon_name and my_name, so that
+ * SM_MON and SM_UNMON find the entries of one host without walking
+ * the whole list and looking up every name in it.
+ */
+#define NL_INDEX_MIN	64
+
+static notify_list	**nl_index[NL_NINDEX];
+static size_t		nl_size, nl_count;
+
+static const char *
+nl_key(notify_list *entry, int idx)
+{
+	const char *key;
+
+	switch (idx) {
+	case NL_BY_DNS:
+		key = entry->dns_name;
+		break;
+	case NL_BY_MON:
+		key = NL_MON_NAME(entry);
+		break;
+	default:
+		key = NL_MY_NAME(entry);
+	}
+	return key ? key : "";
+}
+
+static notify_list **
+nl_bucket(int idx, const char *key)
+{
+	return &nl_index[idx][statd_hash_name(key) & (nl_size - 1)];
+}
+
+static void
+nl_link(notify_list *entry, int idx)
+{
+	notify_list **pp = nl_bucket(idx, nl_key(entry, idx));
+
+	entry->hnext[idx] = *pp;
+	if (*pp)
+		(*pp)->hpprev[idx] = &entry->hnext[idx];
+	entry->hpprev[idx] = pp;
+	*pp = entry;
+}
+
+/*
+ * Double the size of the indexes, and rehash what is on rtnl.
+ */
+static void
+nl_index_grow(void)
+{
+	size_t size = nl_size ? nl_size * 2 : NL_INDEX_MIN;
+	notify_list *lp;
+	int i;
+
+	for (i = 0; i < NL_NINDEX; i++) {
+		free(nl_index[i]);
+		nl_index[i] = xmalloc(size * sizeof(notify_list *));
+		memset(nl_index[i], 0, size * sizeof(notify_list *));
+	}
+	nl_size = size;
+
+	for (lp = rtnl; lp; lp = lp->next)
+		for (i = 0; i < NL_NINDEX; i++)
+			nl_link(lp, i);
+}
+
+/* Add *entry, which is not yet on rtnl, to the indexes */
+static void
+nl_index_add(notify_list *entry)
+{
+	int i;
+
+	if (nl_count >= nl_size)
+		nl_index_grow();
+	for (i = 0; i < NL_NINDEX; i++)
+		nl_link(entry, i);
+	nl_count++;
+}
+
+static void
+nl_index_del(notify_list *entry)
+{
+	int i;
+
+	if (entry->hpprev[0] == NULL)
+		return;
+	for (i = 0; i < NL_NINDEX; i++) {
+		*entry->hpprev[i] = entry->hnext[i];
+		if (entry->hnext[i])
+			entry->hnext[i]->hpprev[i] = entry->hpprev[i];
+		entry->hnext[i] = NULL;
+		entry->hpprev[i] = NULL;
+	}
+	nl_count--;
+}
+
 
 #ifdef DEBUG
 /* 
@@ -67,18 +167,19 @@ nlist_new(char *my_name, char *mon_name, int state)
 /*
  * Insert *entry into a notify list at the point specified by
  * **head.  This can be in the middle.  However, we do not handle
- * list _append_ in this function; rather, the only place we should
- * have to worry about this case is in nlist_insert_timer below.
+ * list _append_ in this function.
  * - entry must not be NULL.
  */
 void 
 nlist_insert(notify_list **head, notify_list *entry)
 {
+	if (head == &rtnl)
+		nl_index_add(entry);
+
 	if (*head) {
 		/* 
 		 * Cases where we're prepending a non-empty list
-		 * or inserting possibly in the middle somewhere (eg,
-		 * nlist_insert_timer...)
+		 * or inserting possibly in the middle somewhere
 		 */
 		entry->next = (*head);		/* Forward pointer */
 		entry->prev = (*head)->prev;	/* Back pointer */
@@ -93,59 +194,6 @@ nlist_insert(notify_list **head, notify_list *entry)
 #endif
 }
 
-/* 
- * (re)insert *entry into notify_list **head.  This requires that
- * NL_WHEN(entry) has been set (usually, this is time() + 5 seconds).
- * - entry must not be NULL
- *
- * LH - This used to cause (a) a memory leak and (b) dropped notify-list
- * entries.  The pointer ran off the end of the list, and changed the 
- * head-end to point to the new, one-entry list.  All other entries became garbage.
- *
- * FIXME: Optimize this function. (I'll work on it - LH)
- */
-void 
-nlist_insert_timer(notify_list **head, notify_list *entry)
-{
-	notify_list 	*spot = *head,	 	/* Insertion location */
-						/* ...Start at head */
-			*back = NULL;		/* Back pointer */
-
-
-	/* Find first entry with higher timeout value or end of list */
-	while (spot && NL_WHEN(spot) <= NL_WHEN(entry)) {
-		/* 
-		 * Keep the back pointer in case we 
-		 * run off the end...  (see below)
-		 */
-		back = spot;
-		spot = spot->next;
-	}
-
-	if (spot == (*head)) {
-		/* 
-		 * case where we're prepending an empty or non-empty
-		 * list or inserting in the middle somewhere.  Pass 
-		 * the real head of the list, since we'll be changing 
-		 * during the insert... 
-		 */
-		nlist_insert(head, entry);
-	} else {
-		/* all other cases - don't move the real head pointer */
-		nlist_insert(&spot, entry);
-
-		/* 
-		 * If spot == entry, then spot was NULL when we called
-		 * nlist_insert.  This happened because we had run off 
-		 * the end of the list.  Append entry to original list.
-		 */
-		if (spot == entry) {
-			back->next = entry;
-			entry->prev = back;
-		}
-	}
-}
-
 /* 
  * Remove *entry from the list pointed to by **head.
  * Do not destroy *entry.  This is normally done before
@@ -158,6 +206,9 @@ nlist_remove(notify_list **head, notify_list *entry)
 	notify_list	*prev = entry->prev,
 			*next = entry->next;
 
+	if (head == &rtnl)
+		nl_index_del(entry);
+
 	if (next) {
 		next->prev = prev;
 	}
@@ -218,29 +269,89 @@ nlist_free(notify_list **head, notify_list *entry)
 void 
 nlist_kill(notify_list **head)
 {
-	notify_list *next;
+	notify_list *entry;
 
-	while (*head) {
-		next = (*head)->next;
-		nlist_free(head, *head);
-		free(*head);
-		*head = next;
+	while ((entry = *head) != NULL) {
+		nlist_free(head, entry);
+		free(entry);
 	}
 }
 
 /*
- * Walk a list looking for a matching name in the NL_MON_NAME field.
+ * Find the entries on rtnl for @host: with NL_MON_NAME(entry) @host, or
+ * NL_MY_NAME(entry) if @myname.  The search uses *@it and continues
+ * with nlist_nexthost(), which returns the next entry, or NULL when
+ * there are no more.  The caller may free each entry as it is found.
+ *
+ * Entries whose mon_name is @host, ignoring case, come first, then
+ * those whose dns_name is the canonical name of @host.  my_names are
+ * matched with statd_matchhostname() down the whole list, but only if
+ * there is no entry with just that my_name.
  */
 notify_list *
-nlist_gethost(notify_list *list, char *host, int myname)
+nlist_gethost(struct nlist_iter *it, const char *host, int myname)
 {
-	notify_list	*lp;
+	it->host = host;
+	it->myname = myname;
+	it->pass = 0;
+	it->found = 0;
+	it->canon[0] = '\0';
+	it->next = NULL;
+	if (nl_count != 0)
+		it->next = *nl_bucket(myname ? NL_BY_MY : NL_BY_MON, host);
+	return nlist_nexthost(it);
+}
 
-	for (lp = list; lp; lp = lp->next) {
-		if (statd_matchhostname(host,
-				myname? NL_MY_NAME(lp) : NL_MON_NAME(lp)))
-			return lp;
-	}
+notify_list *
+nlist_nexthost(struct nlist_iter *it)
+{
+	int idx = it->myname ? NL_BY_MY : NL_BY_MON;
+	notify_list *lp;
+	char *canon;
+
+	if (nl_count == 0)
+		return NULL;
+
+	for (;;) {
+		while ((lp = it->next) != NULL) {
+			switch (it->pass) {
+			case 0:
+				it->next = lp->hnext[idx];
+				if (strcasecmp(it->host, nl_key(lp, idx)) == 0) {
+					it->found = 1;
+					return lp;
+				}
+				break;
+			case 1:
+				it->next = lp->hnext[NL_BY_DNS];
+				if (strcasecmp(it->canon, nl_key(lp, NL_BY_DNS)) == 0 &&
+				    strcasecmp(it->host, NL_MON_NAME(lp)) != 0)
+					return lp;
+				break;
+			default:
+				it->next = lp->next;
+				if (strcasecmp(it->host, NL_MY_NAME(lp)) != 0 &&
+				    statd_matchhostname(it->host, NL_MY_NAME(lp)))
+					return lp;
+			}
+		}
 
-	return (notify_list *) NULL;
+		if (it->pass == 0 && !it->myname) {
+			canon = statd_canonical_name(it->host);
+			if (canon == NULL)
+				return NULL;
+			if (strlen(canon) >= sizeof(it->canon)) {
+				free(canon);
+				return NULL;
+			}
+			strcpy(it->canon, canon);
+			free(canon);
+			it->next = *nl_bucket(NL_BY_DNS, it->canon);
+			it->pass = 1;
+		} else if (it->pass == 0 && !it->found) {
+			it->next = rtnl;
+			it->pass = 2;
+		} else
+			return NULL;
+	}
 }
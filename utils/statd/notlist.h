@@ -6,6 +6,17 @@
  */
 
 #include <netinet/in.h>
+#include <netdb.h>
+
+/*
+ * Indexes of the run-time notify list
+ */
+enum {
+	NL_BY_DNS,		/* canonical name, dns_name */
+	NL_BY_MON,		/* NL_MON_NAME */
+	NL_BY_MY,		/* NL_MY_NAME */
+	NL_NINDEX
+};
 
 /*
  * Primary information structure.
@@ -21,15 +32,30 @@ struct notify_list {
   struct notify_list	*prev;	/* Linked list backward pointer. */
   uint32_t		xid;	/* XID of MS_NOTIFY RPC call */
   time_t		when;	/* notify: timeout for re-xmit */
+  struct notify_list	*hnext[NL_NINDEX];	/* rtnl hash chains */
+  struct notify_list	**hpprev[NL_NINDEX];
+  unsigned int		qindex;	/* in the callback queue */
+  struct notify_list	*xid_next; /* callbacks found by XID */
 };
 
 typedef struct notify_list notify_list;
 
+/*
+ * Position in a search of rtnl by nlist_gethost()
+ */
+struct nlist_iter {
+  const char		*host;
+  int			myname;
+  int			pass;
+  int			found;
+  char			canon[NI_MAXHOST];
+  notify_list		*next;
+};
+
 /*
  * Global Variables
  */
 extern notify_list *	rtnl;	/* Run-time notify list */
-extern notify_list *	notify;	/* Pending RPC calls */
 
 /*
  * List-handling functions
@@ -37,11 +63,17 @@ extern notify_list *	notify;	/* Pending RPC calls */
 extern notify_list *	nlist_new(char *, char *, int);
 extern void		nlist_insert(notify_list **, notify_list *);
 extern void		nlist_remove(notify_list **, notify_list *);
-extern void		nlist_insert_timer(notify_list **, notify_list *);
 extern notify_list *	nlist_clone(notify_list *);
 extern void		nlist_free(notify_list **, notify_list *);
 extern void		nlist_kill(notify_list **);
-extern notify_list *	nlist_gethost(notify_list *, char *, int);
+extern notify_list *	nlist_gethost(struct nlist_iter *, const char *, int);
+extern notify_list *	nlist_nexthost(struct nlist_iter *);
+
+/*
+ * Callbacks to lockd
+ */
+extern void		callback_queue(notify_list *);
+extern int		callback_timeout(void);
 
 /* 
  * List-handling macros.
@@ -35,6 +35,8 @@
 #include <rpc/pmap_rmt.h>
 #include <time.h>
 #include <netdb.h>
+#include <errno.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
@@ -116,32 +118,232 @@ statd_get_socket(void)
 	return sockfd;
 }
 
-static notify_list *
-recv_rply(u_long *portp)
+/*
+ * Callbacks to lockd waiting to be sent, or for the reply to one, in
+ * a binary heap ordered by NL_WHEN: the callback due next is always
+ * cb_queue[0].  Callbacks with a call outstanding are also found by
+ * the XID of the call, in cb_xids.  When many peers reboot at once,
+ * due callbacks go out CB_SEND_BATCH at a time, and statd answers
+ * its own requests in between.
+ */
+#define CB_SEND_BATCH	64	/* calls sent in one go */
+#define CB_RECV_BATCH	64	/* replies read with one call */
+#define CB_XID_HASH	1024	/* a power of two */
+#define CB_PORTS	4	/* lockd ports remembered */
+
+static notify_list **	cb_queue = NULL;
+static unsigned int	cb_queued = 0;
+static unsigned int	cb_queue_size = 0;
+
+static notify_list *	cb_xids[CB_XID_HASH];
+
+/*
+ * Where lockd was last found, by program and version, so that each
+ * callback need not ask rpcbind first.  A port is forgotten when a
+ * call to it goes unanswered.
+ */
+static struct {
+	rpcprog_t		prog;
+	rpcvers_t		vers;
+	in_port_t		port;
+} cb_ports[CB_PORTS];
+static unsigned int	cb_nports = 0;
+
+static in_port_t
+cb_port_find(const notify_list *lp)
 {
-	char			msgbuf[NSM_MAXMSGSIZE];
-	ssize_t			msglen;
-	notify_list		*lp = NULL;
-	XDR			xdr;
-	struct sockaddr_in	sin;
-	socklen_t		alen = (socklen_t)sizeof(sin);
-	uint32_t		xid;
+	unsigned int i;
 
-	memset(msgbuf, 0, sizeof(msgbuf));
-	msglen = recvfrom(sockfd, msgbuf, sizeof(msgbuf), 0,
-				(struct sockaddr *)(char *)&sin, &alen);
-	if (msglen == (ssize_t)-1) {
-		xlog_warn("%s: recvfrom failed: %m", __func__);
-		return NULL;
+	for (i = 0; i < cb_nports; i++)
+		if (cb_ports[i].prog == (rpcprog_t)NL_MY_PROG(lp) &&
+		    cb_ports[i].vers == (rpcvers_t)NL_MY_VERS(lp))
+			return cb_ports[i].port;
+	return 0;
+}
+
+static void
+cb_port_set(const notify_list *lp, const in_port_t port)
+{
+	unsigned int i;
+
+	for (i = 0; i < cb_nports; i++)
+		if (cb_ports[i].prog == (rpcprog_t)NL_MY_PROG(lp) &&
+		    cb_ports[i].vers == (rpcvers_t)NL_MY_VERS(lp))
+			break;
+	if (i == cb_nports) {
+		if (port == 0 || cb_nports == CB_PORTS)
+			return;
+		cb_nports++;
+	}
+	cb_ports[i].prog = (rpcprog_t)NL_MY_PROG(lp);
+	cb_ports[i].vers = (rpcvers_t)NL_MY_VERS(lp);
+	cb_ports[i].port = port;
+}
+
+static void
+cb_xid_unhash(notify_list *lp)
+{
+	notify_list **where = &cb_xids[lp->xid & (CB_XID_HASH - 1)];
+
+	for (; *where != NULL; where = &(*where)->xid_next)
+		if (*where == lp) {
+			*where = lp->xid_next;
+			break;
+		}
+	lp->xid_next = NULL;
+}
+
+/* Record that the reply to @lp's call will come with @xid */
+static void
+cb_set_xid(notify_list *lp, const uint32_t xid)
+{
+	notify_list **bucket;
+
+	if (lp->xid != 0)
+		cb_xid_unhash(lp);
+	lp->xid = xid;
+	if (xid == 0)
+		return;
+	bucket = &cb_xids[xid & (CB_XID_HASH - 1)];
+	lp->xid_next = *bucket;
+	*bucket = lp;
+}
+
+static void
+cb_queue_set(const unsigned int i, notify_list *lp)
+{
+	cb_queue[i] = lp;
+	lp->qindex = i;
+}
+
+static void
+cb_queue_up(unsigned int i)
+{
+	notify_list *lp = cb_queue[i];
+	unsigned int parent;
+
+	while (i > 0) {
+		parent = (i - 1) / 2;
+		if (NL_WHEN(cb_queue[parent]) <= NL_WHEN(lp))
+			break;
+		cb_queue_set(i, cb_queue[parent]);
+		i = parent;
+	}
+	cb_queue_set(i, lp);
+}
+
+static void
+cb_queue_down(unsigned int i)
+{
+	notify_list *lp = cb_queue[i];
+	unsigned int child;
+
+	while ((child = 2 * i + 1) < cb_queued) {
+		if (child + 1 < cb_queued &&
+		    NL_WHEN(cb_queue[child + 1]) < NL_WHEN(cb_queue[child]))
+			child++;
+		if (NL_WHEN(lp) <= NL_WHEN(cb_queue[child]))
+			break;
+		cb_queue_set(i, cb_queue[child]);
+		i = child;
+	}
+	cb_queue_set(i, lp);
+}
+
+/* Move @lp after its NL_WHEN has changed */
+static void
+cb_requeue(notify_list *lp)
+{
+	const unsigned int i = lp->qindex;
+
+	if (i > 0 && NL_WHEN(lp) < NL_WHEN(cb_queue[(i - 1) / 2]))
+		cb_queue_up(i);
+	else
+		cb_queue_down(i);
+}
+
+/* Take @lp off the queue for good */
+static void
+cb_forget(notify_list *lp)
+{
+	const unsigned int i = lp->qindex;
+	notify_list *last = cb_queue[--cb_queued];
+
+	cb_set_xid(lp, 0);
+	if (last != lp) {
+		cb_queue_set(i, last);
+		cb_requeue(last);
+	}
+	nlist_free(NULL, lp);
+	free(lp);
+}
+
+/**
+ * callback_queue - call lockd back about a peer's reboot
+ * @lp: a callback made by nlist_clone(), to be freed once done
+ *
+ */
+void
+callback_queue(notify_list *lp)
+{
+	if (cb_queued == cb_queue_size) {
+		unsigned int size = cb_queue_size ? cb_queue_size * 2 : 64;
+		notify_list **queue;
+
+		queue = realloc(cb_queue, size * sizeof(*queue));
+		if (queue == NULL) {
+			xlog_warn("%s: no memory to call back %s, giving up",
+					__func__, NL_MY_NAME(lp));
+			nlist_free(NULL, lp);
+			free(lp);
+			return;
+		}
+		cb_queue = queue;
+		cb_queue_size = size;
 	}
 
+	NL_WHEN(lp) = 0;
+	lp->xid = 0;
+	lp->xid_next = NULL;
+	cb_queue[cb_queued] = lp;
+	cb_queue_up(cb_queued++);
+}
+
+/**
+ * callback_timeout - time until the next callback is due
+ *
+ * Returns the number of milliseconds left, zero if a callback is due
+ * now, or -1 if there are none waiting.
+ */
+int
+callback_timeout(void)
+{
+	time_t now;
+
+	if (cb_queued == 0)
+		return -1;
+	time(&now);
+	if (NL_WHEN(cb_queue[0]) <= now)
+		return 0;
+	return (int)(NL_WHEN(cb_queue[0]) - now) * 1000;
+}
+
+static void
+recv_rply(const char *msgbuf, const size_t msglen,
+		const struct sockaddr_in *sin)
+{
+	notify_list		*lp;
+	XDR			xdr;
+	uint32_t		xid;
+	u_long			port;
+
 	memset(&xdr, 0, sizeof(xdr));
-	xdrmem_create(&xdr, msgbuf, (unsigned int)msglen, XDR_DECODE);
+	xdrmem_create(&xdr, (char *)msgbuf, (unsigned int)msglen, XDR_DECODE);
 	xid = nsm_parse_reply(&xdr);
 	if (xid == 0)
 		goto done;
-	if (sin.sin_addr.s_addr != htonl(INADDR_LOOPBACK)) {
-		struct in_addr addr = sin.sin_addr;
+	if (sin->sin_addr.s_addr != htonl(INADDR_LOOPBACK)) {
+		struct in_addr addr = sin->sin_addr;
 		char buf[INET_ADDRSTRLEN];
 
 		xlog_warn("%s: Unrecognized reply from %s", __func__,
@@ -150,20 +352,37 @@ recv_rply(u_long *portp)
 		goto done;
 	}
 
-	for (lp = notify; lp != NULL; lp = lp->next) {
-		/* LH - this was a bug... it should have been checking
-		 * the xid from the response message from the client,
-		 * not the static, internal xid */
-		if (lp->xid != xid)
-			continue;
-		if (lp->port == 0)
-			*portp = nsm_recv_getport(&xdr);
-		break;
+	for (lp = cb_xids[xid & (CB_XID_HASH - 1)]; lp != NULL;
+	     lp = lp->xid_next)
+		if (lp->xid == xid)
+			break;
+	if (lp == NULL)
+		goto done;
+
+	if (lp->port != 0) {
+		xlog(D_GENERAL, "%s: Callback to %s (for %s) succeeded",
+			__func__, NL_MY_NAME(lp), NL_MON_NAME(lp));
+		cb_forget(lp);
+		goto done;
 	}
 
+	port = nsm_recv_getport(&xdr);
+	if (port == 0) {
+		xlog_warn("%s: service %d not registered on localhost",
+			__func__, NL_MY_PROG(lp));
+		cb_forget(lp);
+		goto done;
+	}
+
+	/* the call itself goes out with the next batch */
+	lp->port = htons((unsigned short)port);
+	cb_port_set(lp, lp->port);
+	cb_set_xid(lp, 0);
+	NL_WHEN(lp) = 0;
+	cb_requeue(lp);
+
 done:
 	xdr_destroy(&xdr);
-	return lp;
 }
 
 /*
@@ -180,6 +399,15 @@ process_entry(notify_list *lp)
 		return 0;
 	}
 
+	/*
+	 * An unanswered call suggests lockd may have moved, so later
+	 * callbacks ask rpcbind again.
+	 */
+	if (lp->xid != 0 && lp->port != 0 && cb_port_find(lp) == lp->port)
+		cb_port_set(lp, 0);
+	if (lp->port == 0 && lp->xid == 0)
+		lp->port = cb_port_find(lp);
+
 	memset(&sin, 0, sizeof(sin));
 	sin.sin_family = AF_INET;
 	sin.sin_port   = lp->port;
@@ -190,9 +418,9 @@ process_entry(notify_list *lp)
 	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
 
 	if (sin.sin_port == 0)
-		lp->xid = nsm_xmit_getport(sockfd, &sin,
+		cb_set_xid(lp, nsm_xmit_getport(sockfd, &sin,
 					(rpcprog_t)NL_MY_PROG(lp),
-					(rpcvers_t)NL_MY_VERS(lp));
+					(rpcvers_t)NL_MY_VERS(lp)));
 	else {
 		struct mon m;
 
@@ -204,9 +432,9 @@ process_entry(notify_list *lp)
 		m.mon_id.my_id.my_vers = NL_MY_VERS(lp);
 		m.mon_id.my_id.my_proc = NL_MY_PROC(lp);
 
-		lp->xid = nsm_xmit_nlmcall(sockfd,
+		cb_set_xid(lp, nsm_xmit_nlmcall(sockfd,
 				(struct sockaddr *)(char *)&sin,
-				(socklen_t)sizeof(sin), &m, NL_STATE(lp));
+				(socklen_t)sizeof(sin), &m, NL_STATE(lp)));
 	}
 	if (lp->xid == 0) {
 		xlog_warn("%s: failed to notify port %d",
@@ -218,58 +446,87 @@ process_entry(notify_list *lp)
 }
 
 /*
- * Process a datagram received on the notify socket
+ * Process the datagrams received on the notify socket
  */
-int
-process_reply(FD_SET_TYPE *rfds)
+#ifdef HAVE_RECVMMSG
+static void
+recv_replies(void)
 {
-	notify_list		*lp;
-	u_long			port;
-
-	if (sockfd == -1 || !FD_ISSET(sockfd, rfds))
-		return 0;
-
-	/* Should not be processed again. */
-	FD_CLR (sockfd, rfds);
-
-	if (!(lp = recv_rply(&port)))
-		return 1;
-
-	if (lp->port == 0) {
-		if (port != 0) {
-			lp->port = htons((unsigned short) port);
-			process_entry(lp);
-			NL_WHEN(lp) = time(NULL) + NOTIFY_TIMEOUT;
-			nlist_remove(&notify, lp);
-			nlist_insert_timer(&notify, lp);
-			return 1;
+	static char msgbuf[CB_RECV_BATCH][NSM_MAXMSGSIZE];
+	struct sockaddr_in sin[CB_RECV_BATCH];
+	struct mmsghdr msgs[CB_RECV_BATCH];
+	struct iovec iov[CB_RECV_BATCH];
+	int i, n;
+
+	memset(msgs, 0, sizeof(msgs));
+	for (i = 0; i < CB_RECV_BATCH; i++) {
+		iov[i].iov_base = msgbuf[i];
+		iov[i].iov_len = sizeof(msgbuf[i]);
+		msgs[i].msg_hdr.msg_name = &sin[i];
+		msgs[i].msg_hdr.msg_namelen = sizeof(sin[i]);
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+	n = recvmmsg(sockfd, msgs, CB_RECV_BATCH, MSG_DONTWAIT, NULL);
+	if (n < 0 && errno != EAGAIN)
+		xlog_warn("%s: recvmmsg failed: %m", __func__);
+	for (i = 0; i < n; i++)
+		recv_rply(msgbuf[i], msgs[i].msg_len, &sin[i]);
+}
+#else	/* !HAVE_RECVMMSG */
+static void
+recv_replies(void)
+{
+	char msgbuf[NSM_MAXMSGSIZE];
+	struct sockaddr_in sin;
+	socklen_t alen;
+	ssize_t msglen;
+	int i;
+
+	for (i = 0; i < CB_RECV_BATCH; i++) {
+		alen = (socklen_t)sizeof(sin);
+		msglen = recvfrom(sockfd, msgbuf, sizeof(msgbuf), MSG_DONTWAIT,
+				(struct sockaddr *)(char *)&sin, &alen);
+		if (msglen == (ssize_t)-1) {
+			if (errno != EAGAIN)
+				xlog_warn("%s: recvfrom failed: %m", __func__);
+			return;
 		}
-		xlog_warn("%s: service %d not registered on localhost",
-			__func__, NL_MY_PROG(lp));
-	} else {
-		xlog(D_GENERAL, "%s: Callback to %s (for %s) succeeded",
-			__func__, NL_MY_NAME(lp), NL_MON_NAME(lp));
+		recv_rply(msgbuf, (size_t)msglen, &sin);
 	}
-	nlist_free(&notify, lp);
-	return 1;
 }
+#endif	/* !HAVE_RECVMMSG */
 
 /*
- * Process a notify list, either for notifying remote hosts after reboot
- * or for calling back (local) statd clients when the remote has notified
- * us of a crash. 
+ * Process the datagrams received on the notify socket
+ */
+void
+process_reply(void)
+{
+	if (sockfd != -1)
+		recv_replies();
+}
+
+/*
+ * Send the callbacks to (local) statd clients that are due, after a
+ * remote has notified us of a crash, up to CB_SEND_BATCH of them.
  */
 int
 process_notify_list(void)
 {
 	notify_list	*entry;
+	unsigned int	sent;
 	time_t		now;
 
-	while ((entry = notify) != NULL && NL_WHEN(entry) < time(&now)) {
+	time(&now);
+	nsm_xmit_hold(sockfd);
+	for (sent = 0; sent < CB_SEND_BATCH && cb_queued != 0; sent++) {
+		entry = cb_queue[0];
+		if (NL_WHEN(entry) > now)
+			break;
 		if (process_entry(entry)) {
-			NL_WHEN(entry) = time(NULL) + NOTIFY_TIMEOUT;
-			nlist_remove(&notify, entry);
-			nlist_insert_timer(&notify, entry);
+			NL_WHEN(entry) = now + NOTIFY_TIMEOUT;
+			cb_queue_down(0);
 		} else {
 			xlog(L_ERROR,
 				"%s: Can't callback %s (%d,%d), giving up",
@@ -277,9 +534,10 @@ process_notify_list(void)
 					NL_MY_NAME(entry),
 					NL_MY_PROG(entry),
 					NL_MY_VERS(entry));
-			nlist_free(&notify, entry);
+			cb_forget(entry);
 		}
 	}
+	(void)nsm_xmit_flush();
 
 	return 1;
 }
@@ -0,0 +1,90 @@
+/*
+ * Convert the NSM monitor database between a file per host and
+ * the database log, or compact the log.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "conffile.h"
+#include "xlog.h"
+#include "nsm.h"
+#include "nfslib.h"
+
+static void
+usage(const char *progname)
+{
+	fprintf(stderr,
+		"Usage: %s [-d] [-P /path/to/state/directory] "
+		"convert|revert|compact\n", progname);
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	_Bool result = false;
+	char *progname, *s;
+	int c, debug = 0;
+
+	progname = strrchr(argv[0], '/');
+	if (progname != NULL)
+		progname++;
+	else
+		progname = argv[0];
+
+	conf_init_file(NFS_CONFFILE);
+	s = conf_get_str("statd", "state-directory-path");
+	if (s && !nsm_setup_pathnames(argv[0], s))
+		exit(1);
+
+	while ((c = getopt(argc, argv, "dP:")) != -1) {
+		switch (c) {
+		case 'd':
+			debug++;
+			break;
+		case 'P':
+			if (!nsm_setup_pathnames(argv[0], optarg))
+				exit(1);
+			break;
+		default:
+			usage(progname);
+		}
+	}
+	if (optind != argc - 1)
+		usage(progname);
+
+	xlog_syslog(0);
+	xlog_stderr(1);
+	if (debug)
+		xlog_config(D_ALL, 1);
+	xlog_open(progname);
+
+	if (!nsm_drop_privileges(-1))
+		exit(1);
+
+	if (strcmp(argv[optind], "convert") == 0) {
+		if (nsm_log_enabled()) {
+			xlog(L_ERROR, "The database log is in use already");
+			exit(1);
+		}
+		result = nsm_log_convert();
+	} else if (strcmp(argv[optind], "revert") == 0) {
+		if (!nsm_log_enabled()) {
+			xlog(L_ERROR, "The database log is not in use");
+			exit(1);
+		}
+		result = nsm_log_revert();
+	} else if (strcmp(argv[optind], "compact") == 0)
+		result = nsm_log_compact();
+	else
+		usage(progname);
+
+	return result ? 0 : 1;
+}
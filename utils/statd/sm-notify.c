@@ -31,6 +31,7 @@
 #include <netinet/in.h>
 #include <arpa/nameser.h>
 #include <resolv.h>
+#include <pthread.h>
 
 #include "conffile.h"
 #include "sockaddr.h"
@@ -38,6 +39,7 @@
 #include "nsm.h"
 #include "nfslib.h"
 #include "nfsrpc.h"
+#include "nfsgrace.h"
 
 /* glibc before 2.3.4 */
 #ifndef AI_NUMERICSERV
@@ -49,21 +51,32 @@
 
 #define NLM_END_GRACE_FILE	"/proc/fs/lockd/nlm_end_grace"
 
+#define SMN_SEND_RATE	100	/* packets per second */
+#define SMN_RECV_BATCH	64	/* replies read with one call */
+#define SMN_RESOLVERS	8	/* threads looking up host names */
+#define SMN_FAMILIES	2	/* IPv4 and IPv6 */
+#define SMN_MAX_SOCKETS	8	/* sockets for each address family */
+#define SMN_PARALLEL	4	/* addresses asked for a port at once */
+
 int lift_grace = 1;
 int force = 0;
 
 struct nsm_host {
-	struct nsm_host *	next;
+	struct nsm_host *	xid_next;
+	unsigned int		queue_index;
 	char *			name;
 	const char *		mon_name;
 	const char *		my_name;
 	char *			notify_arg;
 	struct addrinfo		*ai;
+	struct addrinfo		*fresh_ai;
+	struct smn_query	*query;
 	time_t			last_used;
 	time_t			send_next;
 	unsigned int		timeout;
 	unsigned int		retries;
 	uint32_t		xid;
+	_Bool			port_hint;
 };
 
 static char		nsm_hostname[SM_MAXSTRLEN + 1];
@@ -74,15 +87,55 @@ static _Bool		opt_update_state = true;
 static unsigned int	opt_max_retry = 15 * 60;
 static char *		opt_srcaddr = NULL;
 static char *		opt_srcport = NULL;
-
-static void		notify(const int sock);
-static int		notify_host(int, struct nsm_host *);
-static void		recv_reply(int);
-static void		insert_host(struct nsm_host *);
+static unsigned int	opt_send_rate = SMN_SEND_RATE;
+static unsigned int	opt_resolvers = SMN_RESOLVERS;
+static unsigned int	opt_sockets = 1;
+
+static void		notify(void);
+static int		notify_host(struct nsm_host *);
+static void		recv_replies(int);
+static int		insert_host(struct nsm_host *);
+static void		smn_unqueue(struct nsm_host *);
+static void		smn_schedule(struct nsm_host *);
 static struct nsm_host *find_host(uint32_t);
 static int		record_pid(void);
 
-static struct nsm_host *	hosts = NULL;
+/*
+ * Hosts waiting to be sent a call, or for the reply to one, in a
+ * binary heap ordered by the time the next call is due: the host to
+ * call next is always smn_queue[0].  Hosts with a call outstanding are
+ * also found by the XID of the call, in smn_xids.
+ */
+static struct nsm_host **	smn_queue = NULL;
+static unsigned int		smn_queued = 0;
+static unsigned int		smn_queue_size = 0;
+
+static struct nsm_host **	smn_xids = NULL;
+static uint32_t			smn_xid_mask = 0;
+
+/* Calls that may be sent before waiting for the send rate to allow more */
+static unsigned int		smn_credit = 0;
+static unsigned long long	smn_credit_at = 0;
+
+/*
+ * The sockets of each address family.  With more than one, they share
+ * a port, so that the kernel spreads the replies over them.
+ */
+struct smn_sockets {
+	int			family;
+	unsigned int		count;
+	unsigned int		next;		/* to send on */
+	int			fd[SMN_MAX_SOCKETS];
+};
+
+static struct smn_sockets	smn_socks[SMN_FAMILIES] = {
+	{ .family = AF_INET },
+#ifdef IPV6_SUPPORTED
+	{ .family = AF_INET6 },
+#else	/* !IPV6_SUPPORTED */
+	{ .family = AF_UNSPEC },
+#endif	/* !IPV6_SUPPORTED */
+};
 
 __attribute__((__malloc__))
 static struct addrinfo *
@@ -90,7 +143,7 @@ smn_lookup(const char *name)
 {
 	struct addrinfo	*ai = NULL;
 	struct addrinfo hint = {
-		.ai_family	= (nsm_family == AF_INET ? AF_INET: AF_UNSPEC),
+		.ai_family	= nsm_family,
 		.ai_protocol	= (int)IPPROTO_UDP,
 	};
 	int error;
@@ -105,6 +158,114 @@ smn_lookup(const char *name)
 	return ai;
 }
 
+/*
+ * Names are looked up by a pool of opt_resolvers threads, so that one
+ * slow name does not hold up the notifications behind it.  The send
+ * loop queues a query for each host it has no fresh address for;
+ * resolver threads answer them in any order and write to smn_wakeup
+ * so the loop picks the answers up.  Only the send loop touches hosts:
+ * a query carries its own copy of the name, and when the host is
+ * forgotten first, the answer is dropped.
+ */
+struct smn_query {
+	struct smn_query *	next;
+	struct nsm_host *	host;
+	char *			name;
+	struct addrinfo *	ai;
+};
+
+static pthread_mutex_t		smn_query_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t		smn_query_cond = PTHREAD_COND_INITIALIZER;
+static struct smn_query *	smn_queries = NULL;
+static struct smn_query **	smn_queries_tail = &smn_queries;
+static struct smn_query *	smn_answers = NULL;
+static int			smn_wakeup[2] = { -1, -1 };
+
+static void *
+smn_resolver(__attribute__ ((unused)) void *arg)
+{
+	struct smn_query *q;
+
+	for (;;) {
+		pthread_mutex_lock(&smn_query_lock);
+		while (smn_queries == NULL)
+			pthread_cond_wait(&smn_query_cond, &smn_query_lock);
+		q = smn_queries;
+		smn_queries = q->next;
+		if (smn_queries == NULL)
+			smn_queries_tail = &smn_queries;
+		pthread_mutex_unlock(&smn_query_lock);
+
+		q->ai = smn_lookup(q->name);
+
+		pthread_mutex_lock(&smn_query_lock);
+		q->next = smn_answers;
+		smn_answers = q;
+		pthread_mutex_unlock(&smn_query_lock);
+		if (write(smn_wakeup[1], "", 1) < 0 && errno != EAGAIN)
+			xlog(L_WARNING, "Unable to wake up sender: %m");
+	}
+	return NULL;
+}
+
+/*
+ * Start the resolver threads.  If none can be started, names are
+ * looked up by the send loop itself.
+ */
+static void
+smn_start_resolvers(void)
+{
+	pthread_attr_t attr;
+	pthread_t thread;
+	unsigned int i;
+
+	if (opt_resolvers == 0)
+		return;
+	if (pipe(smn_wakeup) == -1 ||
+	    fcntl(smn_wakeup[0], F_SETFL, O_NONBLOCK) == -1 ||
+	    fcntl(smn_wakeup[1], F_SETFL, O_NONBLOCK) == -1) {
+		xlog(L_WARNING, "Unable to create resolver pipe: %m");
+		opt_resolvers = 0;
+		return;
+	}
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	for (i = 0; i < opt_resolvers; i++)
+		if (pthread_create(&thread, &attr, smn_resolver, NULL) != 0)
+			break;
+	pthread_attr_destroy(&attr);
+	if (i == 0)
+		xlog(L_WARNING, "Unable to start resolver threads");
+	opt_resolvers = i;
+}
+
+/* Queue a lookup of @host's name, unless one is outstanding already */
+static void
+smn_query_host(struct nsm_host *host)
+{
+	struct smn_query *q;
+
+	if (host->query != NULL)
+		return;
+	q = calloc(1, sizeof(*q));
+	if (q == NULL)
+		return;
+	q->name = strdup(host->name);
+	if (q->name == NULL) {
+		free(q);
+		return;
+	}
+	q->host = host;
+	host->query = q;
+
+	pthread_mutex_lock(&smn_query_lock);
+	*smn_queries_tail = q;
+	smn_queries_tail = &q->next;
+	pthread_cond_signal(&smn_query_cond);
+	pthread_mutex_unlock(&smn_query_lock);
+}
+
 #ifdef HAVE_GETNAMEINFO
 static char *
 smn_get_hostname(const struct sockaddr *sap, const socklen_t salen,
@@ -256,6 +417,9 @@ static void smn_forget_host(struct nsm_host *host)
 	free((void *)host->mon_name);
 	free(host->name);
 	nfs_freeaddrinfo(host->ai);
+	nfs_freeaddrinfo(host->fresh_ai);
+	if (host->query != NULL)
+		host->query->host = NULL;
 
 	free(host);
 }
@@ -272,55 +436,56 @@ smn_get_host(const char *hostname,
 	if (host == NULL)
 		return 0;
 
-	insert_host(host);
+	if (insert_host(host) == 0) {
+		xlog_warn("Unable to allocate memory");
+		free(host->notify_arg);
+		free((void *)host->my_name);
+		free((void *)host->mon_name);
+		free(host->name);
+		free(host);
+		return 0;
+	}
 	return 1;
 }
 
-#ifdef IPV6_SUPPORTED
-static int smn_socket(void)
+/*
+ * Create a datagram socket for @family.  An AF_INET6 socket carries
+ * only IPv6: IPv4 peers are reached on a socket of their own.
+ *
+ * Returns the socket, or -1 if it could not be created.  No error is
+ * logged if the local system does not support @family.
+ */
+static int smn_socket(const int family)
 {
+	const int one = 1;
 	int sock;
 
-	/*
-	 * Use an AF_INET socket if IPv6 is disabled on the
-	 * local system.
-	 */
-	sock = socket(AF_INET6, SOCK_DGRAM, 0);
+	sock = socket(family, SOCK_DGRAM, 0);
 	if (sock == -1) {
-		if (errno != EAFNOSUPPORT) {
-			xlog(L_ERROR, "Failed to create RPC socket: %m");
-			return -1;
-		}
-		sock = socket(AF_INET, SOCK_DGRAM, 0);
-		if (sock < 0) {
+		if (errno != EAFNOSUPPORT)
 			xlog(L_ERROR, "Failed to create RPC socket: %m");
-			return -1;
-		}
-	} else
-		nsm_family = AF_INET6;
+		return -1;
+	}
 
 	if (fcntl(sock, F_SETFL, O_NONBLOCK) == -1) {
 		xlog(L_ERROR, "fcntl(3) on RPC socket failed: %m");
 		goto out_close;
 	}
 
-	/*
-	 * TI-RPC over IPv6 (udp6/tcp6) does not handle IPv4.  However,
-	 * since sm-notify open-codes all of its RPC support, it can
-	 * use a single socket and let the local network stack provide
-	 * the correct mapping between address families automatically.
-	 * This is the same thing that is done in the kernel.
-	 */
-	if (nsm_family == AF_INET6) {
-		const int zero = 0;
-		socklen_t zerolen = (socklen_t)sizeof(zero);
-
-		if (setsockopt(sock, SOL_IPV6, IPV6_V6ONLY,
-					(char *)&zero, zerolen) == -1) {
-			xlog(L_ERROR, "setsockopt(3) on RPC socket failed: %m");
-			goto out_close;
-		}
+#ifdef IPV6_SUPPORTED
+	if (family == AF_INET6 &&
+	    setsockopt(sock, SOL_IPV6, IPV6_V6ONLY, &one, sizeof(one)) == -1) {
+		xlog(L_ERROR, "setsockopt(3) on RPC socket failed: %m");
+		goto out_close;
 	}
+#endif	/* IPV6_SUPPORTED */
+
+#ifdef SO_REUSEPORT
+	/* Several sockets of a family share a port, and the replies */
+	if (opt_sockets > 1 &&
+	    setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) == -1)
+		xlog(D_GENERAL, "setsockopt(SO_REUSEPORT) failed: %m");
+#endif	/* SO_REUSEPORT */
 
 	return sock;
 
@@ -328,39 +493,20 @@ out_close:
 	(void)close(sock);
 	return -1;
 }
-#else	/* !IPV6_SUPPORTED */
-static int smn_socket(void)
-{
-	int sock;
-
-	sock = socket(AF_INET, SOCK_DGRAM, 0);
-	if (sock == -1) {
-		xlog(L_ERROR, "Failed to create RPC socket: %m");
-		return -1;
-	}
-
-	if (fcntl(sock, F_SETFL, O_NONBLOCK) == -1) {
-		xlog(L_ERROR, "fcntl(3) on RPC socket failed: %m");
-		(void)close(sock);
-		return -1;
-	}
-
-	return sock;
-}
-#endif	/* !IPV6_SUPPORTED */
 
 /*
  * If admin specified a source address or srcport, then convert those
- * to a sockaddr and return it.   Otherwise, return an ANYADDR address.
+ * to a sockaddr of @family and return it.   Otherwise, return an
+ * ANYADDR address.
  */
 __attribute__((__malloc__))
 static struct addrinfo *
-smn_bind_address(const char *srcaddr, const char *srcport)
+smn_bind_address(const char *srcaddr, const char *srcport, const int family)
 {
 	struct addrinfo *ai = NULL;
 	struct addrinfo hint = {
-		.ai_flags	= AI_NUMERICSERV | AI_V4MAPPED,
-		.ai_family	= nsm_family,
+		.ai_flags	= AI_NUMERICSERV,
+		.ai_family	= family,
 		.ai_protocol	= (int)IPPROTO_UDP,
 	};
 	int error;
@@ -374,8 +520,9 @@ smn_bind_address(const char *srcaddr, const char *srcport)
 	else
 		error = getaddrinfo(srcaddr, srcport, &hint, &ai);
 	if (error != 0) {
-		xlog(L_ERROR,
-			"Invalid bind address or port for RPC socket: %s",
+		xlog(D_GENERAL,
+			"No %s bind address or port for RPC socket: %s",
+				family == AF_INET ? "IPv4" : "IPv6",
 				gai_strerror(error));
 		return NULL;
 	}
@@ -404,31 +551,36 @@ smn_bindresvport(int sock, struct sockaddr *sap)
 #endif	/* !HAVE_LIBTIRPC */
 
 /*
- * Prepare a socket for sending RPC requests
+ * Prepare a socket of @family for sending RPC requests, bound to
+ * @port if that is not zero
  *
  * Returns a bound datagram socket file descriptor, or -1 if
  * an error occurs.
  */
 static int
-smn_create_socket(const char *srcaddr, const char *srcport)
+smn_create_socket(const char *srcaddr, const char *srcport,
+		const int family, const uint16_t port)
 {
 	int sock, retry_cnt = 0;
 	struct addrinfo *ai;
 
 retry:
-	sock = smn_socket();
+	sock = smn_socket(family);
 	if (sock == -1)
 		return -1;
 
-	ai = smn_bind_address(srcaddr, srcport);
+	ai = smn_bind_address(srcaddr, srcport, family);
 	if (ai == NULL) {
 		(void)close(sock);
 		return -1;
 	}
 
-	/* Use source port if provided on the command line,
-	 * otherwise use bindresvport */
-	if (srcport) {
+	/* Join the port of the family's other sockets, or use the
+	 * source port if provided on the command line, otherwise
+	 * use bindresvport */
+	if (port || srcport) {
+		if (port)
+			nfs_set_port(ai->ai_addr, port);
 		if (bind(sock, ai->ai_addr, ai->ai_addrlen) == -1) {
 			xlog(L_ERROR, "Failed to bind RPC socket: %m");
 			nfs_freeaddrinfo(ai);
@@ -460,27 +612,97 @@ retry:
 	return sock;
 }
 
-/* Inform the kernel that it's OK to lift lockd's grace period */
-static void
-nsm_lift_grace_period(void)
+/*
+ * Open opt_sockets sockets for each address family the local system
+ * (and the source address, if one was given) supports.
+ *
+ * Returns true if there is a socket for at least one family.
+ */
+static _Bool
+smn_create_sockets(const char *srcaddr, const char *srcport)
 {
-	int fd;
+	unsigned int i, j;
 
-	fd = open(NLM_END_GRACE_FILE, O_WRONLY);
-	if (fd < 0) {
-		/* Don't warn if file isn't present */
-		if (errno != ENOENT)
-			xlog(L_WARNING, "Unable to open %s: %m",
-				NLM_END_GRACE_FILE);
-		return;
+	for (i = 0; i < SMN_FAMILIES; i++) {
+		struct smn_sockets *ss = &smn_socks[i];
+		struct sockaddr_storage addr;
+		socklen_t len = sizeof(addr);
+		uint16_t port = 0;
+		int sock;
+
+		if (ss->family == AF_UNSPEC)
+			continue;
+		for (j = 0; j < opt_sockets; j++) {
+			sock = smn_create_socket(srcaddr, srcport,
+						 ss->family, port);
+			if (sock == -1)
+				break;
+			ss->fd[ss->count++] = sock;
+			if (port == 0 && getsockname(sock,
+					(struct sockaddr *)&addr, &len) == 0)
+				port = nfs_get_port((struct sockaddr *)&addr);
+		}
+	}
+
+	if (smn_socks[0].count && smn_socks[1].count)
+		nsm_family = AF_UNSPEC;
+	else if (smn_socks[1].count)
+		nsm_family = AF_INET6;
+	else if (smn_socks[0].count == 0) {
+		xlog(L_ERROR, "No usable RPC socket");
+		return false;
 	}
+	return true;
+}
+
+/*
+ * Returns a socket for sending to an address of @family, taking the
+ * family's sockets in turn, or -1 if there are none.
+ */
+static int
+smn_sock(const int family)
+{
+	struct smn_sockets *ss;
 
-	if (write(fd, "Y", 1) < 0)
-		xlog(L_WARNING, "Unable to write to %s: %m", NLM_END_GRACE_FILE);
+	switch (family) {
+	case AF_INET:
+		ss = &smn_socks[0];
+		break;
+	case AF_INET6:
+		ss = &smn_socks[1];
+		break;
+	default:
+		return -1;
+	}
+	if (ss->count == 0)
+		return -1;
+	if (++ss->next >= ss->count)
+		ss->next = 0;
+	return ss->fd[ss->next];
+}
 
-	close(fd);
-	return;
+/*
+ * Publish the hosts about to be told of our reboot, for rpc.statd to
+ * follow as they reclaim their locks through lockd's grace period.
+ * With none to tell, the grace period can end at once.
+ */
+static void
+smn_grace_start(void)
+{
+	unsigned int i;
+
+	nfsgrace_open("nlm", NLM_END_GRACE_FILE);
+	nfsgrace_start();
+	for (i = 0; i < smn_queued; i++)
+		nfsgrace_expect(smn_queue[i]->mon_name,
+				strlen(smn_queue[i]->mon_name));
+	if (smn_queued == 0 && lift_grace && nfsgrace_lift() == 0)
+		nfsgrace_end();
+	else
+		nfsgrace_publish();
+	nfsgrace_close();
 }
+
 inline static void 
 read_smnotify_conf(char **argv)
 {
@@ -492,6 +714,14 @@ read_smnotify_conf(char **argv)
 	opt_srcport = conf_get_str("sm-notify", "outgoing-port");
 	opt_srcaddr = conf_get_str("sm-notify", "outgoing-addr");
 	lift_grace = conf_get_bool("sm-notify", "lift-grace", lift_grace);
+	opt_send_rate = conf_get_num("sm-notify", "send-rate", opt_send_rate);
+	opt_resolvers = conf_get_num("sm-notify", "resolver-threads",
+				     opt_resolvers);
+	opt_sockets = conf_get_num("sm-notify", "sockets", opt_sockets);
+	if (opt_sockets < 1)
+		opt_sockets = 1;
+	if (opt_sockets > SMN_MAX_SOCKETS)
+		opt_sockets = SMN_MAX_SOCKETS;
 
 	s = conf_get_str("statd", "state-directory-path");
 	if (s && !nsm_setup_pathnames(argv[0], s))
@@ -503,7 +733,7 @@ read_smnotify_conf(char **argv)
 int
 main(int argc, char **argv)
 {
-	int	c, sock;
+	int	c;
 	char *	progname;
 
 	progname = strrchr(argv[0], '/');
@@ -515,7 +745,7 @@ main(int argc, char **argv)
 	/* Read in config setting */
 	read_smnotify_conf(argv);
 
-	while ((c = getopt(argc, argv, "dm:np:v:P:f")) != -1) {
+	while ((c = getopt(argc, argv, "dm:np:r:v:P:f")) != -1) {
 		switch (c) {
 		case 'f':
 			force = 1;
@@ -532,6 +762,9 @@ main(int argc, char **argv)
 		case 'p':
 			opt_srcport = optarg;
 			break;
+		case 'r':
+			opt_send_rate = atoi(optarg);
+			break;
 		case 'v':
 			opt_srcaddr = optarg;
 			break;
@@ -548,6 +781,7 @@ main(int argc, char **argv)
 	if (optind < argc) {
 usage:		fprintf(stderr,
 			"Usage: %s -notify [-dfq] [-m max-retry-minutes] [-p srcport]\n"
+			"            [-r packets-per-second]\n"
 			"            [-P /path/to/state/directory] [-v my_host_name]\n",
 			progname);
 		exit(1);
@@ -585,10 +819,10 @@ usage:		fprintf(stderr,
 	}
 
 	(void)nsm_retire_monitored_hosts();
-	if (nsm_load_notify_list(smn_get_host) == 0) {
+	nsm_load_notify_list(smn_get_host);
+	smn_grace_start();
+	if (smn_queued == 0) {
 		xlog(D_GENERAL, "No hosts to notify; exiting");
-		if (lift_grace)
-			nsm_lift_grace_period();
 		return 0;
 	}
 
@@ -610,60 +844,326 @@ usage:		fprintf(stderr,
 		close(2);
 	}
 
-	sock = smn_create_socket(opt_srcaddr, opt_srcport);
-	if (sock == -1)
+	if (!smn_create_sockets(opt_srcaddr, opt_srcport))
 		exit(1);
 
 	if (!nsm_drop_privileges(-1))
 		exit(1);
 
-	notify(sock);
+	notify();
 
-	if (hosts) {
-		struct nsm_host	*hp;
+	if (smn_queued) {
+		unsigned int i;
 
-		while ((hp = hosts) != 0) {
-			hosts = hp->next;
+		for (i = 0; i < smn_queued; i++)
 			xlog(L_NOTICE, "Unable to notify %s, giving up",
-				hp->name);
-		}
+				smn_queue[i]->name);
 		exit(1);
 	}
 
 	exit(0);
 }
 
+static unsigned long long
+smn_clock_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Calls are paced by a token bucket: credit for one more call accrues
+ * every 1/opt_send_rate seconds, up to a tenth of a second's worth.
+ * A send rate of zero sends every call as soon as it is due.
+ */
+static unsigned int
+smn_credit_max(void)
+{
+	return opt_send_rate >= 10 ? opt_send_rate / 10 : 1;
+}
+
+static void
+smn_credit_refill(void)
+{
+	unsigned long long now = smn_clock_ms(), n;
+
+	if (opt_send_rate == 0)
+		return;
+	n = (now - smn_credit_at) * opt_send_rate / 1000;
+	if (n == 0)
+		return;
+	if (smn_credit + n >= smn_credit_max()) {
+		smn_credit = smn_credit_max();
+		smn_credit_at = now;
+		return;
+	}
+	smn_credit += n;
+	smn_credit_at += n * 1000 / opt_send_rate;
+}
+
+static _Bool
+smn_credit_take(void)
+{
+	if (opt_send_rate == 0)
+		return true;
+	if (smn_credit == 0)
+		return false;
+	smn_credit--;
+	return true;
+}
+
+/* Milliseconds until there is credit for another call */
+static long
+smn_credit_wait(void)
+{
+	long wait;
+
+	wait = (long)(smn_credit_at + (1000 + opt_send_rate - 1) / opt_send_rate
+			- smn_clock_ms());
+	return wait > 0 ? wait : 1;
+}
+
+/*
+ * The XIDs of calls in flight are mostly consecutive, so their low
+ * bits alone spread them evenly over a table of a power-of-two size.
+ */
+static _Bool
+smn_xid_init(unsigned int count)
+{
+	uint32_t size = 64;
+
+	while (size < count && size < (1U << 24))
+		size <<= 1;
+	smn_xids = calloc(size, sizeof(*smn_xids));
+	if (smn_xids == NULL) {
+		xlog(L_ERROR, "Unable to allocate memory");
+		return false;
+	}
+	smn_xid_mask = size - 1;
+	return true;
+}
+
+static void
+smn_xid_unhash(struct nsm_host *host)
+{
+	struct nsm_host **where = &smn_xids[host->xid & smn_xid_mask];
+
+	for (; *where != NULL; where = &(*where)->xid_next)
+		if (*where == host) {
+			*where = host->xid_next;
+			break;
+		}
+	host->xid_next = NULL;
+}
+
+/* Record that the reply to @host's call will come with @xid */
+static void
+smn_set_xid(struct nsm_host *host, uint32_t xid)
+{
+	struct nsm_host **bucket;
+
+	if (host->xid != 0)
+		smn_xid_unhash(host);
+	host->xid = xid;
+	if (xid == 0)
+		return;
+	bucket = &smn_xids[xid & smn_xid_mask];
+	host->xid_next = *bucket;
+	*bucket = host;
+}
+
+/*
+ * The address @host had when it was last monitored or looked up, or
+ * its mon_name if that is a presentation address, so the first
+ * notification need not wait for DNS.
+ */
+__attribute__((__malloc__))
+static struct addrinfo *
+smn_cached_addr(const struct nsm_host *host)
+{
+	struct addrinfo	*ai = NULL;
+	struct addrinfo hint = {
+		.ai_family	= nsm_family,
+		.ai_flags	= AI_NUMERICHOST,
+		.ai_protocol	= (int)IPPROTO_UDP,
+	};
+	char buf[NSM_ADDRSTRLEN];
+	const char *addr = host->mon_name;
+
+	if (nsm_get_notified_addr(host->name, buf, sizeof(buf)))
+		addr = buf;
+	if (getaddrinfo(addr, NULL, &hint, &ai) != 0)
+		return NULL;
+	xlog(D_GENERAL, "Using last known address %s for %s",
+			addr, host->name);
+	return ai;
+}
+
+/*
+ * Start @host at its last known address and, if its statd port was
+ * recorded too, with an SM_NOTIFY straight to that port.
+ */
+static void
+smn_cached_port(struct nsm_host *host)
+{
+	uint16_t port;
+
+	host->ai = smn_cached_addr(host);
+	if (host->ai == NULL)
+		return;
+	port = nsm_get_notified_port(host->name);
+	if (port == 0)
+		return;
+	xlog(D_GENERAL, "Using last known statd port %u for %s",
+			port, host->name);
+	nfs_set_port(host->ai->ai_addr, port);
+	host->port_hint = true;
+	host->retries = 0;
+}
+
+static void
+smn_save_addr(const struct nsm_host *host, const struct addrinfo *ai)
+{
+#ifdef HAVE_GETNAMEINFO
+	char buf[NSM_ADDRSTRLEN];
+
+	if (getnameinfo(ai->ai_addr, ai->ai_addrlen, buf, sizeof(buf),
+			NULL, 0, NI_NUMERICHOST) == 0)
+		(void)nsm_set_notified_addr(host->name, buf);
+#else	/* !HAVE_GETNAMEINFO */
+	(void)host;
+	(void)ai;
+#endif	/* !HAVE_GETNAMEINFO */
+}
+
+/*
+ * Take the answer to a lookup of @host's name.  A host that had no
+ * address is sent its notification at once.  A host notified at its
+ * last known address is switched to the new addresses, unless they
+ * include that address.
+ */
+static void
+smn_answer(struct nsm_host *host, struct addrinfo *ai)
+{
+	struct addrinfo *p;
+
+	host->query = NULL;
+	if (ai == NULL) {
+		if (host->ai == NULL)
+			xlog_warn("DNS resolution of %s failed; "
+				"retrying later", host->name);
+		return;
+	}
+	smn_save_addr(host, ai);
+
+	if (host->ai != NULL) {
+		for (p = ai; p != NULL; p = p->ai_next)
+			if (nfs_compare_sockaddr(p->ai_addr,
+						 host->ai->ai_addr)) {
+				nfs_freeaddrinfo(ai);
+				return;
+			}
+		xlog(D_GENERAL, "Address of %s has changed", host->name);
+		nfs_freeaddrinfo(host->fresh_ai);
+		host->fresh_ai = ai;
+		host->port_hint = false;
+		smn_unqueue(host);
+		smn_schedule(host);
+		host->retries = 4;	/* switch on the next call */
+		return;
+	}
+
+	host->ai = ai;
+	smn_unqueue(host);
+	smn_schedule(host);
+}
+
+static void
+smn_take_answers(void)
+{
+	struct smn_query *q, *next;
+	char buf[64];
+
+	while (read(smn_wakeup[0], buf, sizeof(buf)) > 0)
+		;
+
+	pthread_mutex_lock(&smn_query_lock);
+	q = smn_answers;
+	smn_answers = NULL;
+	pthread_mutex_unlock(&smn_query_lock);
+
+	for (; q != NULL; q = next) {
+		next = q->next;
+		if (q->host != NULL)
+			smn_answer(q->host, q->ai);
+		else
+			nfs_freeaddrinfo(q->ai);
+		free(q->name);
+		free(q);
+	}
+}
+
 /*
  * Notify hosts
  */
 static void
-notify(const int sock)
+notify(void)
 {
-	time_t	failtime = 0;
+	struct pollfd	pfd[SMN_FAMILIES * SMN_MAX_SOCKETS + 1];
+	unsigned int	i, j, nfds = 0;
+	time_t		failtime = 0;
 
 	if (opt_max_retry)
 		failtime = time(NULL) + opt_max_retry;
 
-	while (hosts) {
-		struct pollfd	pfd;
+	if (!smn_xid_init(smn_queued))
+		return;
+	smn_credit = smn_credit_max();
+	smn_credit_at = smn_clock_ms();
+
+	/*
+	 * Start with the last known addresses, and look every name up
+	 * again in the background.
+	 */
+	smn_start_resolvers();
+	if (opt_resolvers) {
+		for (i = 0; i < smn_queued; i++) {
+			smn_cached_port(smn_queue[i]);
+			smn_query_host(smn_queue[i]);
+		}
+	}
+
+	for (i = 0; i < SMN_FAMILIES; i++)
+		for (j = 0; j < smn_socks[i].count; j++)
+			pfd[nfds++].fd = smn_socks[i].fd[j];
+	pfd[nfds].fd = smn_wakeup[0];
+
+	while (smn_queued) {
 		time_t		now = time(NULL);
-		unsigned int	sent = 0;
 		struct nsm_host	*hp;
-		long		wait;
+		long		wait = 0;
 
 		if (failtime && now >= failtime)
 			break;
 
-		while (hosts && ((wait = hosts->send_next - now) <= 0)) {
-			/* Never send more than 10 packets at once */
-			if (sent++ >= 10)
+		smn_credit_refill();
+		for (i = 0; i < nfds; i++)
+			nsm_xmit_hold(pfd[i].fd);
+		while (smn_queued &&
+		       ((wait = smn_queue[0]->send_next - now) <= 0)) {
+			/* Keep to the send rate, but a host still waiting
+			   for its address sends nothing */
+			hp = smn_queue[0];
+			if ((hp->ai != NULL || opt_resolvers == 0) &&
+			    !smn_credit_take())
 				break;
 
 			/* Remove queue head */
-			hp = hosts;
-			hosts = hp->next;
+			smn_unqueue(hp);
 
-			if (notify_host(sock, hp))
+			if (notify_host(hp))
 				continue;
 
 			/* Set the timeout for this call, using an
@@ -676,22 +1176,87 @@ notify(const int sock)
 
 			insert_host(hp);
 		}
-		if (hosts == NULL)
+		(void)nsm_xmit_flush();
+		if (smn_queued == 0)
 			return;
 
-		xlog(D_GENERAL, "Host %s due in %ld seconds",
-				hosts->name, wait);
+		if (wait <= 0)
+			wait = smn_credit_wait();
+		else {
+			xlog(D_GENERAL, "Host %s due in %ld seconds",
+					smn_queue[0]->name, wait);
+			wait *= 1000;
+			if (wait < 100)
+				wait = 100;
+		}
 
-		pfd.fd = sock;
-		pfd.events = POLLIN;
+		for (i = 0; i <= nfds; i++) {
+			pfd[i].events = POLLIN;
+			pfd[i].revents = 0;
+		}
+
+		if (poll(pfd, opt_resolvers ? nfds + 1 : nfds, wait) <= 0)
+			continue;
+
+		if (pfd[nfds].revents & POLLIN)
+			smn_take_answers();
+		for (i = 0; i < nfds; i++)
+			if (pfd[i].revents & POLLIN)
+				recv_replies(pfd[i].fd);
+	}
+}
+
+/*
+ * Ask rpcbind for the statd port at up to SMN_PARALLEL of @host's
+ * addresses at once, rather than at one address after another, so a
+ * host that can be reached at any of them is reached in one round
+ * trip.  The calls share one XID; the address that answers first is
+ * the one notified.  They count as one call against the send rate.
+ *
+ * Returns the XID of the calls, or zero if none could be sent.
+ */
+static uint32_t
+smn_xmit_rpcbind(const struct nsm_host *host)
+{
+	const struct addrinfo *ai;
+	unsigned int count = 0;
+	uint32_t xid = 0, sent;
+	int sock;
 
-		wait *= 1000;
-		if (wait < 100)
-			wait = 100;
-		if (poll(&pfd, 1, wait) != 1)
+	for (ai = host->ai; ai != NULL && count < SMN_PARALLEL;
+	     ai = ai->ai_next) {
+		sock = smn_sock(ai->ai_family);
+		if (sock == -1)
 			continue;
+		nsm_xmit_reuse_xid(xid);
+		sent = nsm_xmit_rpcbind(sock, ai->ai_addr, SM_PROG, SM_VERS);
+		if (xid == 0)
+			xid = sent;
+		count++;
+	}
+	nsm_xmit_reuse_xid(0);
+	return xid;
+}
+
+/*
+ * Move the address of @host that a reply came from, @sap, to the
+ * front of its list.
+ */
+static void
+smn_answered_at(struct nsm_host *host, const struct sockaddr *sap)
+{
+	struct addrinfo **where, *ai;
 
-		recv_reply(sock);
+	for (where = &host->ai; (ai = *where) != NULL; where = &ai->ai_next) {
+		if (ai->ai_family != sap->sa_family ||
+		    !nfs_compare_sockaddr(ai->ai_addr, sap))
+			continue;
+		if (ai != host->ai) {
+			*where = ai->ai_next;
+			ai->ai_next = host->ai;
+			host->ai = ai;
+		}
+		return;
 	}
 }
 
@@ -699,12 +1264,17 @@ notify(const int sock)
  * Send notification to a single host
  */
 static int
-notify_host(int sock, struct nsm_host *host)
+notify_host(struct nsm_host *host)
 {
 	struct sockaddr *sap;
 	socklen_t salen;
+	int sock;
 
 	if (host->ai == NULL) {
+		if (opt_resolvers) {
+			smn_query_host(host);
+			return 0;
+		}
 		host->ai = smn_lookup(host->name);
 		if (host->ai == NULL) {
 			xlog_warn("DNS resolution of %s failed; "
@@ -713,14 +1283,26 @@ notify_host(int sock, struct nsm_host *host)
 		}
 	}
 
+	/* A remembered port gets one try; if that went unanswered,
+	 * ask rpcbind. */
+	if (host->port_hint && host->retries > 0) {
+		host->port_hint = false;
+		nfs_set_port(host->ai->ai_addr, 0);
+	}
+
 	/* If we retransmitted 4 times, reset the port to force
 	 * a new portmap lookup (in case statd was restarted).
 	 * We also rotate through multiple IP addresses at this
 	 * point.
 	 */
 	if (host->retries >= 4) {
-		/* don't rotate if there is only one addrinfo */
-		if (host->ai->ai_next != NULL) {
+		if (host->fresh_ai != NULL) {
+			/* switch to the addresses looked up last */
+			nfs_freeaddrinfo(host->ai);
+			host->ai = host->fresh_ai;
+			host->fresh_ai = NULL;
+		} else if (host->ai->ai_next != NULL) {
+			/* don't rotate if there is only one addrinfo */
 			struct addrinfo *first = host->ai;
 			struct addrinfo **next = &host->ai;
 
@@ -743,10 +1325,12 @@ notify_host(int sock, struct nsm_host *host)
 	salen = host->ai->ai_addrlen;
 
 	if (nfs_get_port(sap) == 0)
-		host->xid = nsm_xmit_rpcbind(sock, sap, SM_PROG, SM_VERS);
+		smn_set_xid(host, smn_xmit_rpcbind(host));
+	else if ((sock = smn_sock(sap->sa_family)) != -1)
+		smn_set_xid(host, nsm_xmit_notify(sock, sap, salen,
+					SM_PROG, host->notify_arg, nsm_state));
 	else
-		host->xid = nsm_xmit_notify(sock, sap, salen,
-					SM_PROG, host->notify_arg, nsm_state);
+		smn_set_xid(host, 0);
 
 	return 0;
 }
@@ -754,7 +1338,7 @@ notify_host(int sock, struct nsm_host *host)
 static void
 smn_defer(struct nsm_host *host)
 {
-	host->xid = 0;
+	smn_set_xid(host, 0);
 	host->send_next = time(NULL) + NSM_MAX_TIMEOUT;
 	host->timeout = NSM_MAX_TIMEOUT;
 	insert_host(host);
@@ -764,7 +1348,7 @@ static void
 smn_schedule(struct nsm_host *host)
 {
 	host->retries = 0;
-	host->xid = 0;
+	smn_set_xid(host, 0);
 	host->send_next = time(NULL);
 	host->timeout = NSM_TIMEOUT;
 	insert_host(host);
@@ -802,33 +1386,30 @@ recv_notify_reply(struct nsm_host *host)
 {
 	char *dot = strchr(host->notify_arg, '.');
 
+	host->port_hint = false;
 	if (dot != NULL) {
 		*dot = '\0';
 		smn_schedule(host);
 	} else {
 		xlog(D_GENERAL, "Host %s notified successfully", host->name);
+		/* Next time, SM_NOTIFY can go straight to this port */
+		(void)nsm_remember_port(host->name,
+					nfs_get_port(host->ai->ai_addr));
 		smn_forget_host(host);
 	}
 }
 
 /*
- * Receive reply from remote host
+ * Process a reply from a remote host
  */
 static void
-recv_reply(int sock)
+recv_reply(char *msgbuf, const size_t msglen, const struct sockaddr *from)
 {
 	struct nsm_host	*hp;
 	struct sockaddr *sap;
-	char msgbuf[NSM_MAXMSGSIZE];
 	uint32_t	xid;
-	ssize_t		msglen;
 	XDR		xdr;
 
-	memset(msgbuf, 0 , sizeof(msgbuf));
-	msglen = recv(sock, msgbuf, sizeof(msgbuf), 0);
-	if (msglen < 0)
-		return;
-
 	xlog(D_GENERAL, "Received packet...");
 
 	memset(&xdr, 0, sizeof(xdr));
@@ -842,6 +1423,8 @@ recv_reply(int sock)
 	if ((hp = find_host(xid)) == NULL)
 		goto out;
 
+	if (nfs_get_port(hp->ai->ai_addr) == 0)
+		smn_answered_at(hp, from);
 	sap = hp->ai->ai_addr;
 	if (nfs_get_port(sap) == 0)
 		recv_rpcbind_reply(sap, hp, &xdr);
@@ -853,49 +1436,171 @@ out:
 }
 
 /*
- * Insert host into notification list, sorted by next send time
+ * Receive the replies waiting on the socket
  */
+#ifdef HAVE_RECVMMSG
 static void
-insert_host(struct nsm_host *host)
+recv_replies(int sock)
 {
-	struct nsm_host	**where, *p;
+	static char msgbuf[SMN_RECV_BATCH][NSM_MAXMSGSIZE];
+	struct sockaddr_storage from[SMN_RECV_BATCH];
+	struct mmsghdr msgs[SMN_RECV_BATCH];
+	struct iovec iov[SMN_RECV_BATCH];
+	int i, n;
+
+	do {
+		memset(msgs, 0, sizeof(msgs));
+		for (i = 0; i < SMN_RECV_BATCH; i++) {
+			iov[i].iov_base = msgbuf[i];
+			iov[i].iov_len = sizeof(msgbuf[i]);
+			msgs[i].msg_hdr.msg_iov = &iov[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+			msgs[i].msg_hdr.msg_name = &from[i];
+			msgs[i].msg_hdr.msg_namelen = sizeof(from[i]);
+		}
+		n = recvmmsg(sock, msgs, SMN_RECV_BATCH, MSG_DONTWAIT, NULL);
+		for (i = 0; i < n; i++)
+			recv_reply(msgbuf[i], msgs[i].msg_len,
+				   (struct sockaddr *)&from[i]);
+	} while (n == SMN_RECV_BATCH);
+}
+#else	/* !HAVE_RECVMMSG */
+static void
+recv_replies(int sock)
+{
+	char msgbuf[NSM_MAXMSGSIZE];
+	struct sockaddr_storage from;
+	socklen_t fromlen;
+	ssize_t msglen;
+	int i;
+
+	for (i = 0; i < SMN_RECV_BATCH; i++) {
+		fromlen = sizeof(from);
+		msglen = recvfrom(sock, msgbuf, sizeof(msgbuf), MSG_DONTWAIT,
+				  (struct sockaddr *)&from, &fromlen);
+		if (msglen < 0)
+			return;
+		recv_reply(msgbuf, (size_t)msglen, (struct sockaddr *)&from);
+	}
+}
+#endif	/* !HAVE_RECVMMSG */
+
+/*
+ * A host due before another goes first.  If both are due at the
+ * same time, the most recently used host goes first.  This makes
+ * sure that "recent" hosts get notified first.
+ */
+static _Bool
+smn_before(const struct nsm_host *a, const struct nsm_host *b)
+{
+	if (a->send_next != b->send_next)
+		return a->send_next < b->send_next;
+	return a->last_used > b->last_used;
+}
+
+static void
+smn_queue_set(unsigned int i, struct nsm_host *host)
+{
+	smn_queue[i] = host;
+	host->queue_index = i;
+}
 
-	where = &hosts;
-	while ((p = *where) != 0) {
-		/* Sort in ascending order of timeout */
-		if (host->send_next < p->send_next)
+static void
+smn_queue_up(unsigned int i)
+{
+	struct nsm_host *host = smn_queue[i];
+	unsigned int parent;
+
+	while (i > 0) {
+		parent = (i - 1) / 2;
+		if (!smn_before(host, smn_queue[parent]))
 			break;
-		/* If we have the same timeout, put the
-		 * most recently used host first.
-		 * This makes sure that "recent" hosts
-		 * get notified first.
-		 */
-		if (host->send_next == p->send_next
-		 && host->last_used > p->last_used)
+		smn_queue_set(i, smn_queue[parent]);
+		i = parent;
+	}
+	smn_queue_set(i, host);
+}
+
+static void
+smn_queue_down(unsigned int i)
+{
+	struct nsm_host *host = smn_queue[i];
+	unsigned int child;
+
+	while ((child = 2 * i + 1) < smn_queued) {
+		if (child + 1 < smn_queued &&
+		    smn_before(smn_queue[child + 1], smn_queue[child]))
+			child++;
+		if (!smn_before(smn_queue[child], host))
 			break;
-		where = &p->next;
+		smn_queue_set(i, smn_queue[child]);
+		i = child;
 	}
+	smn_queue_set(i, host);
+}
 
-	host->next = *where;
-	*where = host;
+/*
+ * Remove host from the notification queue
+ */
+static void
+smn_unqueue(struct nsm_host *host)
+{
+	unsigned int i = host->queue_index;
+	struct nsm_host *last = smn_queue[--smn_queued];
+
+	if (last == host)
+		return;
+	smn_queue_set(i, last);
+	if (i > 0 && smn_before(last, smn_queue[(i - 1) / 2]))
+		smn_queue_up(i);
+	else
+		smn_queue_down(i);
+}
+
+/*
+ * Insert host into notification queue, by next send time
+ *
+ * Returns 1 if the host was queued, or 0 if the queue could not
+ * grow.  A host that was taken off the queue always fits back on.
+ */
+static int
+insert_host(struct nsm_host *host)
+{
+	if (smn_queued == smn_queue_size) {
+		unsigned int size = smn_queue_size ? smn_queue_size * 2 : 64;
+		struct nsm_host **queue;
+
+		queue = realloc(smn_queue, size * sizeof(*queue));
+		if (queue == NULL)
+			return 0;
+		smn_queue = queue;
+		smn_queue_size = size;
+	}
+
+	smn_queue[smn_queued] = host;
+	smn_queue_up(smn_queued++);
 	xlog(D_GENERAL, "Added host %s to notify list", host->name);
+	return 1;
 }
 
 /*
- * Find host given the XID
+ * Find host given the XID, and take it off the queue
  */
 static struct nsm_host *
 find_host(uint32_t xid)
 {
 	struct nsm_host	**where, *p;
 
-	where = &hosts;
-	while ((p = *where) != 0) {
+	where = &smn_xids[xid & smn_xid_mask];
+	while ((p = *where) != NULL) {
 		if (p->xid == xid) {
-			*where = p->next;
+			*where = p->xid_next;
+			p->xid_next = NULL;
+			p->xid = 0;
+			smn_unqueue(p);
 			return p;
 		}
-		where = &p->next;
+		where = &p->xid_next;
 	}
 	return NULL;
 }
@@ -17,6 +17,7 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <stdlib.h>
 #include <string.h>
 #include <getopt.h>
 #include <rpc/rpc.h>
@@ -31,6 +32,7 @@
 #include "nfslib.h"
 #include "nfsrpc.h"
 #include "nsm.h"
+#include "nfsmetrics.h"
 
 /* Socket operations */
 #include <sys/types.h>
@@ -92,6 +94,56 @@ sm_prog_1_wrapper (struct svc_req *rqstp, register SVCXPRT *transp)
 #define sm_prog_1 sm_prog_1_wrapper
 #endif
 
+#ifdef sm_prog_1_procs
+/*
+ * The internal rpcgen (-P) dispatches SM procedures through a table,
+ * and calls hooks around each, which time it.
+ */
+static struct nfsmetric **statd_proc_metrics;
+
+static void
+statd_proc_begin(struct svc_req *UNUSED(rqstp),
+		 const struct rpcgen_svc_proc *UNUSED(proc),
+		 unsigned long long *start)
+{
+	*start = nfsmetric_clock();
+}
+
+static void
+statd_proc_end(struct svc_req *UNUSED(rqstp),
+	       const struct rpcgen_svc_proc *proc, unsigned long long start)
+{
+	nfsmetric_since(statd_proc_metrics[proc - sm_prog_1_procs], start);
+}
+
+static const struct rpcgen_svc_hooks statd_proc_hooks = {
+	.begin	= statd_proc_begin,
+	.end	= statd_proc_end,
+};
+
+static void
+statd_proc_metrics_init(void)
+{
+	unsigned int i;
+
+	statd_proc_metrics = calloc(sm_prog_1_nprocs,
+				    sizeof(*statd_proc_metrics));
+	if (statd_proc_metrics == NULL)
+		return;
+	for (i = 0; i < sm_prog_1_nprocs; i++)
+		if (sm_prog_1_procs[i].handler)
+			statd_proc_metrics[i] =
+				rpc_proc_metric(sm_prog_1_procs[i].name,
+						SM_VERS);
+	sm_prog_1_hooks = &statd_proc_hooks;
+}
+#else
+static void
+statd_proc_metrics_init(void)
+{
+}
+#endif
+
 static void
 statd_unregister(void) {
 	nfs_svc_unregister(SM_PROG, SM_VERS);
@@ -271,6 +323,22 @@ read_statd_conf(char **argv)
 
 	if (conf_get_bool("statd", "no-notify", false))
 		run_mode |= MODE_NO_NOTIFY;
+
+	statd_name_ttl = conf_get_num("statd", "name-cache-time",
+				      statd_name_ttl);
+	group_commit = conf_get_bool("statd", "group-commit", group_commit);
+	commit_window = conf_get_num("statd", "commit-window", commit_window);
+	lift_grace = conf_get_bool("statd", "lift-grace", lift_grace);
+	lift_grace_delay = conf_get_num("statd", "lift-grace-delay",
+					lift_grace_delay);
+	if (lift_grace_delay < 0)
+		lift_grace_delay = 0;
+	grace_time = conf_get_num("nfsd", "grace-time", grace_time);
+	max_connections = conf_get_num("statd", "max-connections",
+				       max_connections);
+	idle_timeout = conf_get_num("statd", "idle-timeout", idle_timeout);
+	if (commit_window > COMMIT_WINDOW_MAX)
+		commit_window = COMMIT_WINDOW_MAX;
 }
 
 /*
@@ -281,7 +349,9 @@ int main (int argc, char **argv)
 	extern char *optarg;
 	int pid;
 	int arg;
+#ifndef HAVE_LIBTIRPC
 	struct rlimit rlim;
+#endif
 	int notify_sockfd;
 	char *env;
 
@@ -410,6 +480,7 @@ int main (int argc, char **argv)
 						   daemon mode. */
 	}
 
+#ifndef HAVE_LIBTIRPC
 	if (getrlimit (RLIMIT_NOFILE, &rlim) != 0)
 		fprintf(stderr, "%s: getrlimit (RLIMIT_NOFILE) failed: %s\n",
 				argv [0], strerror(errno));
@@ -424,6 +495,7 @@ int main (int argc, char **argv)
 			}
 		}
 	}
+#endif
 
 	set_nlm_port("tcp", nlm_tcp);
 	set_nlm_port("udp", nlm_udp);
@@ -435,6 +507,8 @@ int main (int argc, char **argv)
 #endif
 
 	daemon_init((run_mode & MODE_NODAEMON));
+	nfsmetrics_start("statd");
+	statd_proc_metrics_init();
 
 	if (run_mode & MODE_LOG_STDERR) {
 		xlog_syslog(0);
@@ -486,6 +560,8 @@ int main (int argc, char **argv)
 	 * pass on any SM_NOTIFY that arrives
 	 */
 	load_state();
+	if (group_commit)
+		nsm_commit_hold();
 
 	MY_STATE = nsm_get_state(0);
 	if (MY_STATE == 0)
@@ -493,6 +569,10 @@ int main (int argc, char **argv)
 	xlog(D_GENERAL, "Local NSM state number: %d", MY_STATE);
 	nsm_update_kernel_state(MY_STATE);
 
+	/* Needs root to open lockd's grace file, and the hosts sm-notify
+	 * is telling of our reboot, if it has run */
+	statd_grace_open();
+
 	/*
 	 * ORDER
 	 * Clear old listeners while still root, to override any
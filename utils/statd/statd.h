@@ -10,7 +10,6 @@
 #endif
 
 #include "sm_inter.h"
-#include "system.h"
 #include "xlog.h"
 
 /*
@@ -23,21 +22,49 @@
  * Function prototypes.
  */
 extern _Bool	statd_matchhostname(const char *hostname1, const char *hostname2);
+extern uint32_t	statd_hash_name(const char *hostname);
 extern _Bool	statd_present_address(const struct sockaddr *sap, char *buf,
 					const size_t buflen);
 __attribute__((__malloc__))
 extern char *	statd_canonical_name(const char *hostname);
+__attribute__((__malloc__))
+extern char *	statd_canonical_host(const char *hostname, char *addr,
+					const size_t addrlen);
 
 extern void	my_svc_run(int);
+extern int	max_connections;
+extern int	idle_timeout;
 extern void	notify_hosts(void);
 extern void	shuffle_dirs(void);
 extern int	statd_get_socket(void);
 extern int	process_notify_list(void);
-extern int	process_reply(FD_SET_TYPE *);
+extern void	process_reply(void);
 extern char *	xstrdup(const char *);
 extern void *	xmalloc(size_t);
 extern void	load_state(void);
 
+/* commit.c */
+#define COMMIT_WINDOW_MAX	100	/* ms */
+
+extern int	group_commit;
+extern int	commit_window;
+extern _Bool	commit_flush(void);
+extern sm_stat_res *commit_reply(struct svc_req *rqstp, sm_stat_res *res);
+extern int	commit_timeout(_Bool busy);
+
+/* grace.c */
+#define LIFT_GRACE_DELAY	10	/* seconds */
+#define GRACE_TIME		90	/* seconds, as nfsd's grace-time */
+
+extern int	lift_grace;
+extern int	lift_grace_delay;
+extern int	grace_time;
+extern void	statd_grace_open(void);
+extern void	statd_grace_adopt(void);
+extern void	statd_grace_monitored(const char *mon_name);
+extern int	statd_grace_timeout(void);
+extern void	statd_grace_check(void);
+
 /*
  * Host status structure and macros.
  */
@@ -52,6 +79,10 @@ extern stat_chge	SM_stat_chge;
 #define NOTIFY_TIMEOUT		 5 /* For status-change notifications. */
 #define SELECT_TIMEOUT		10 /* Max select() timeout when work to do. */
 #define MAX_TRIES		 5 /* Max number of tries for any host. */
+#define STATD_NAME_TTL		60 /* Default for statd_name_ttl. */
+
+/* Seconds that host name lookups are remembered; zero disables */
+extern int statd_name_ttl;
 
 /*
  * Modes of operation - Lon
@@ -52,19 +52,19 @@
 #endif
 
 #include <errno.h>
+#include <stdbool.h>
 #include <time.h>
-#include <inttypes.h>
 #include "statd.h"
 #include "notlist.h"
+#include "nfslib.h"
+#include "xepoll.h"
+#include "rpcmisc.h"
 
 void my_svc_exit(void);
 static int	svc_stop = 0;
 
-/*
- * This is the global notify list onto which all SM_NOTIFY and CALLBACK
- * requests are put.
- */
-notify_list *	notify = NULL;
+int	max_connections = 0;
+int	idle_timeout = NFS_SVC_IDLE_TIMEOUT;
 
 /*
  * Jump-off function.
@@ -76,63 +76,83 @@ my_svc_exit(void)
 }
 
 
+static void
+svc_notify_event(int UNUSED(fd), void *UNUSED(data))
+{
+	process_reply();
+}
+
 /*
- * The heart of the server.  A crib from libc for the most part...
+ * The heart of the server.  The RPC transports and the notify socket
+ * are watched by the shared event loop; callbacks, and commits of the
+ * records changed by requests, are driven by its timeout.
  */
 void
 my_svc_run(int sockfd)
 {
-	FD_SET_TYPE	readfds;
-	int             selret;
-	time_t		now;
+	int		wait, cbwait, gwait;
 
 	svc_stop = 0;
 
+	if (nfs_svc_epoll_init(max_connections, idle_timeout) < 0) {
+		xlog(L_ERROR, "my_svc_run() - unable to watch RPC transports");
+		return;
+	}
+	/* Set notify sockfd for waiting for reply */
+	if (!xepoll_registered(sockfd) &&
+	    xepoll_add(sockfd, svc_notify_event, NULL) < 0) {
+		xlog(L_ERROR, "my_svc_run() - unable to watch notify socket");
+		return;
+	}
+
 	for (;;) {
+		/*
+		 * Make the last requests' records durable, and answer
+		 * them, unless more requests can join in first.
+		 */
+		wait = commit_timeout(false);
+		if (wait == 0 && xepoll_ready())
+			wait = commit_timeout(true);
+		if (wait == 0) {
+			commit_flush();
+			wait = -1;
+		}
+
 		if (svc_stop)
 			return;
 
-		/* Ah, there are some notifications to be processed */
-		while (notify && NL_WHEN(notify) <= time(&now)) {
-			process_notify_list();
-		}
-
-		readfds = SVC_FDSET;
-		/* Set notify sockfd for waiting for reply */
-		FD_SET(sockfd, &readfds);
-		if (notify) {
-			struct timeval	tv;
-
-			tv.tv_sec  = NL_WHEN(notify) - now;
-			tv.tv_usec = 0;
-			xlog(D_GENERAL, "Waiting for reply... (timeo %jd)",
-							(intmax_t)tv.tv_sec);
-			selret = select(FD_SETSIZE, &readfds,
-				(void *) 0, (void *) 0, &tv);
-		} else {
+		/*
+		 * Ah, there are some notifications to be processed.  Only
+		 * a batch goes out each time around, so that requests
+		 * are served in between.
+		 */
+		process_notify_list();
+
+		cbwait = callback_timeout();
+		if (cbwait >= 0)
+			xlog(D_GENERAL, "Waiting for reply... (timeo %d ms)",
+							cbwait);
+		else
 			xlog(D_GENERAL, "Waiting for client connections");
-			selret = select(FD_SETSIZE, &readfds,
-				(void *) 0, (void *) 0, (struct timeval *) 0);
-		}
 
-		switch (selret) {
-		case -1:
-			if (errno == EINTR || errno == ECONNREFUSED
-			 || errno == ENETUNREACH || errno == EHOSTUNREACH)
-				continue;
-			xlog(L_ERROR, "my_svc_run() - select: %m");
-			return;
+		/* Wake for the commit or the next callback, if sooner */
+		if (cbwait >= 0 && (wait < 0 || cbwait < wait))
+			wait = cbwait;
 
-		case 0:
-			/* A notify/callback timed out. */
-			continue;
+		/* ... or to see how the grace period is going */
+		statd_grace_check();
+		gwait = statd_grace_timeout();
+		if (gwait >= 0 && (wait < 0 || gwait < wait))
+			wait = gwait;
 
-		default:
-			selret -= process_reply(&readfds);
-			if (selret) {
-				FD_CLR(sockfd, &readfds);
-				svc_getreqset(&readfds);
-			}
+		/* A timeout means a notify/callback is due. */
+		if (xepoll_wait(wait) < 0) {
+			if (errno == ECONNREFUSED || errno == ENETUNREACH ||
+			    errno == EHOSTUNREACH)
+				continue;
+			xlog(L_ERROR, "my_svc_run() - epoll_wait: %m");
+			commit_flush();
+			return;
 		}
 	}
 }